@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+
+/*
+ * Lossless float image files, for caching intermediates between processes.
+ *
+ *   .pfm  Portable float map: "PF" (RGB) or "Pf" (gray) header, rows stored bottom to top.
+ *   .f32  Raw float image: a 64-byte header (RawFloatHeader) followed by the rows top to bottom,
+ *         channels interleaved, little-endian. The pixels start at a 64-byte aligned offset, so
+ *         a mapped file can be used in place.
+ *   .exr  OpenEXR, scanline, uncompressed, 32-bit float channels ("R", "G", "B" or "Y").
+ *
+ * Images have 1 (gray) or 3 (RGB) channels.
+ */
+
+/// <summary>
+/// Header of the .f32 format.
+/// </summary>
+struct RawFloatHeader {
+    static constexpr uint32_t MAGIC = 0x49323346; // "F32I"
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t channels = 0;
+    uint32_t reserved[11] = {};
+};
+static_assert(sizeof(RawFloatHeader) == 64);
+
+/// <summary>
+/// True for the extensions handled by FloatImageReader / writeFloatImage().
+/// </summary>
+bool isFloatImageFile(const std::filesystem::path& filePath);
+
+/// <summary>
+/// Row reader for .pfm, .f32 and .exr files written by writeFloatImage() (uncompressed EXR
+/// scanline files with float or half channels in general).
+/// </summary>
+class FloatImageReader {
+public:
+    // Throws std::exception (after printing the reason) when the file cannot be opened or parsed.
+    explicit FloatImageReader(const std::filesystem::path& filePath);
+    ~FloatImageReader();
+
+    FloatImageReader(const FloatImageReader&) = delete;
+    FloatImageReader& operator=(const FloatImageReader&) = delete;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int channels() const { return m_channels; }
+
+    /// <summary>
+    /// Reads image row y (0 = top) as width() * channels() interleaved floats.
+    /// </summary>
+    /// <returns>false on a read error</returns>
+    bool readRow(const int y, float* pixels);
+
+private:
+    enum class Format { Pfm, Raw, Exr };
+
+    void parsePfm(const std::filesystem::path& filePath);
+    void parseRaw(const std::filesystem::path& filePath);
+    void parseExr(const std::filesystem::path& filePath);
+
+    std::FILE* m_file = nullptr;
+    Format m_format = Format::Raw;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    // Offset of the first stored row (PFM, raw) or of the scanline offset table (EXR).
+    long m_data_offset = 0;
+    // PFM data in the opposite byte order of the host.
+    bool m_swap_bytes = false;
+    // EXR: channel order in the file (alphabetical) to interleaved RGB, and half-float channels.
+    int m_exr_channel_target[3] = { 0, 1, 2 };
+    bool m_exr_half = false;
+};
+
+/// <summary>
+/// Writes width x height pixels of 1 or 3 interleaved float channels, the format is selected by
+/// the extension (.pfm, .f32 or .exr). Creates missing parent directories.
+/// </summary>
+/// <returns>false if the extension is unknown or the file could not be written</returns>
+bool writeFloatImage(const std::filesystem::path& filePath, const int width, const int height, const int channels, const float* pixels);
@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory_resource>
+
+/// <summary>
+/// Memory resource that backs large image buffers with 2 MB pages.
+///
+/// Full-resolution intermediates span tens of thousands of 4 KB pages, and stencils that read
+/// many rows per output row (bilateral windows, Jacobi sweeps) miss the TLB on most of them.
+/// Requests of at least min_bytes are mapped directly, rounded up to whole large pages:
+/// - Linux: explicit huge pages (MAP_HUGETLB) when the system has some reserved, otherwise a
+///   regular mapping with madvise(MADV_HUGEPAGE) so transparent huge pages back it.
+/// - Windows: large pages (MEM_LARGE_PAGES, needs the "Lock pages in memory" privilege),
+///   otherwise regular pages.
+/// Smaller requests go to the upstream resource. Throws std::bad_alloc when no mapping succeeds.
+///
+/// Use it as the upstream of an ImageBufferPool, which then recycles the large buffers, so the
+/// cost of mapping is paid once per buffer. Thread-safe.
+/// </summary>
+class HugePageResource : public std::pmr::memory_resource {
+public:
+    // Size of one large page, the granularity of direct mappings.
+    static constexpr size_t LARGE_PAGE_BYTES = size_t(2) << 20;
+
+    struct Stats {
+        // Mappings backed by explicit huge / large pages.
+        size_t huge_pages = 0;
+        // Mappings with transparent huge pages requested (Linux) or regular pages.
+        size_t regular_pages = 0;
+        // Requests served by the upstream resource.
+        size_t upstream = 0;
+    };
+
+    explicit HugePageResource(const size_t new_min_bytes = LARGE_PAGE_BYTES, std::pmr::memory_resource* new_upstream = std::pmr::new_delete_resource())
+        : min_bytes(new_min_bytes)
+        , upstream(new_upstream)
+    {
+    }
+
+    HugePageResource(const HugePageResource&) = delete;
+    HugePageResource& operator=(const HugePageResource&) = delete;
+
+    Stats getStats() const { return { huge_pages.load(), regular_pages.load(), upstream_count.load() }; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    // Whether a request is mapped directly; deallocation decides by the same rule.
+    bool isMapped(const size_t bytes, const size_t alignment) const { return bytes >= min_bytes && alignment <= LARGE_PAGE_BYTES; }
+
+    size_t min_bytes;
+    std::pmr::memory_resource* upstream;
+    std::atomic<size_t> huge_pages { 0 }, regular_pages { 0 }, upstream_count { 0 };
+};
@@ -2,14 +2,33 @@
 // Suppress warnings in third-party code.
 #include <framework/disable_all_warnings.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <filesystem>
+#include <functional>
 #include <vector>
 #include <cassert>
 #include <exception>
 #include <iostream>
+#include <optional>
+#include <limits>
+#include <span>
 #include <string>
-#include <random>
-#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include <framework/image_allocator.h>
+#include <framework/image_pool.h>
+#include <framework/float_image_io.h>
+#include <framework/image_view.h>
+#include <framework/png_writer.h>
+#include <framework/radiance_hdr.h>
+#include <framework/shared_image.h>
+#include <framework/tiff_writer.h>
 
 DISABLE_WARNINGS_PUSH()
 #include <glm/vec2.hpp>
@@ -18,20 +37,320 @@ DISABLE_WARNINGS_PUSH()
 #include <stb/stb_image_write.h>
 DISABLE_WARNINGS_POP()
 
+// Buffers of at least this many bytes are first written by all threads, see imageRowsFirstTouch().
+constexpr size_t IMAGE_PARALLEL_TOUCH_BYTES = size_t(1) << 20;
+
+/// <summary>
+/// Runs row_fn(y) for all rows that initialize a new image buffer. Large buffers are written
+/// with the static row partition of the kernels' "#pragma omp parallel for" loops, so on NUMA
+/// systems every page is first touched, and placed, on the node of the thread that later
+/// processes its rows; images left uninitialized get the same placement from their first kernel.
+/// </summary>
+template <typename RowFn>
+inline void imageRowsFirstTouch(const int height, const size_t bytes, const RowFn& row_fn)
+{
+#pragma omp parallel for schedule(static) if (bytes >= IMAGE_PARALLEL_TOUCH_BYTES)
+    for (int y = 0; y < height; y++) {
+        row_fn(y);
+    }
+}
+
+// Whether single-channel images are written as 1-channel PNGs (a third of the bytes to compress)
+// instead of gray replicated to RGB. Process-wide, off by default.
+inline std::atomic<bool>& grayPngOutputFlag()
+{
+    static std::atomic<bool> gray_png { false };
+    return gray_png;
+}
+inline void setGrayPngOutput(const bool gray_png) { grayPngOutputFlag().store(gray_png, std::memory_order_relaxed); }
+inline bool grayPngOutput() { return grayPngOutputFlag().load(std::memory_order_relaxed); }
+
+// Whether .png outputs are written with 16 bits per sample instead of 8. Process-wide, off by
+// default; .tif / .tiff outputs always have 16 bits.
+inline std::atomic<bool>& png16OutputFlag()
+{
+    static std::atomic<bool> png16 { false };
+    return png16;
+}
+inline void setPng16Output(const bool png16) { png16OutputFlag().store(png16, std::memory_order_relaxed); }
+inline bool png16Output() { return png16OutputFlag().load(std::memory_order_relaxed); }
+
+/// <summary>
+/// Size and format of an image file, see probeImage().
+/// </summary>
+struct ImageInfo {
+    int width = 0;
+    int height = 0;
+    // Channels stored in the file (1 gray, 2 gray + alpha, 3 RGB, 4 RGBA).
+    int channels = 0;
+    // Float data (Radiance, PFM, raw float, EXR) rather than 8-bit.
+    bool hdr = false;
+
+    size_t pixelCount() const { return size_t(width) * size_t(height); }
+    // Bytes of the pixels of an Image<T> loaded from the file.
+    template <typename T>
+    size_t imageBytes() const { return pixelCount() * sizeof(T); }
+};
+
+/// <summary>
+/// Reads the size and format of an image file from its header, without decoding any pixels,
+/// for every format the Image(filePath) constructor accepts. Throws std::exception (after
+/// printing the reason) when the file is missing or not a readable image.
+/// </summary>
+ImageInfo probeImage(const std::filesystem::path& filePath);
+
+/// <summary>
+/// Quantizes count floats to 8 bits: scaled, clamped to [0, 1] (NaN to 0) and rounded to the
+/// nearest of the 256 levels. Branch-free, so the loop vectorizes.
+/// </summary>
+inline void floatsToUint8(const float* src, stbi_uc* dst, const size_t count, const float scale = 1.0f)
+{
+#pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+        float value = src[i] * scale;
+        value = value > 0.0f ? value : 0.0f;
+        value = value < 1.0f ? value : 1.0f;
+        dst[i] = stbi_uc(value * 255.0f + 0.5f);
+    }
+}
+
+/// <summary>
+/// Quantizes count floats to 16 bits, as floatsToUint8() with 65536 levels.
+/// </summary>
+inline void floatsToUint16(const float* src, uint16_t* dst, const size_t count, const float scale = 1.0f)
+{
+#pragma omp simd
+    for (size_t i = 0; i < count; i++) {
+        float value = src[i] * scale;
+        value = value > 0.0f ? value : 0.0f;
+        value = value < 1.0f ? value : 1.0f;
+        dst[i] = uint16_t(value * 65535.0f + 0.5f);
+    }
+}
+
+/// <summary>
+/// Display transform of 8-bit and 16-bit outputs, applied while the floats are quantized:
+/// code = round(255 * clamp(curve(exposure * value + offset), 0, 1)) (65535 for 16 bits).
+/// Lossless float outputs keep the linear values.
+/// </summary>
+struct OutputTransform {
+    enum class Curve {
+        Linear,
+        Gamma, // value^gamma, e.g. gamma = 1 / 2.2
+        Srgb, // sRGB OETF (IEC 61966-2-1)
+    };
+    Curve curve = Curve::Linear;
+    float gamma = 1.0f;
+    // Scale (positive) and offset of the value before the curve, e.g. a normalization to [0, 1].
+    float exposure = 1.0f;
+    float offset = 0.0f;
+
+    static OutputTransform scale(const float exposure) { return { Curve::Linear, 1.0f, exposure, 0.0f }; }
+    static OutputTransform gammaCurve(const float gamma, const float exposure = 1.0f, const float offset = 0.0f) { return { Curve::Gamma, gamma, exposure, offset }; }
+    static OutputTransform srgb(const float exposure = 1.0f, const float offset = 0.0f) { return { Curve::Srgb, 1.0f, exposure, offset }; }
+
+    bool isScaleOnly() const { return curve == Curve::Linear && offset == 0.0f; }
+
+    // Display value of the curve input x in [0, 1].
+    float curveValue(const float x) const
+    {
+        switch (curve) {
+        case Curve::Gamma:
+            return std::pow(x, gamma);
+        case Curve::Srgb:
+            return x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+        case Curve::Linear:
+        default:
+            return x;
+        }
+    }
+
+    /// <summary>
+    /// Quantizes count values multiplied by scale to 16 bits. The curve is evaluated per value:
+    /// a threshold table as in OutputQuantizer would need 65536 entries.
+    /// </summary>
+    void quantize16(const float* src, uint16_t* dst, const size_t count, const float scale = 1.0f) const
+    {
+        for (size_t i = 0; i < count; i++) {
+            // Clamped before the curve (which maps [0, 1] onto itself), so NaN gives 0.
+            float value = (src[i] * scale) * exposure + offset;
+            value = value > 0.0f ? value : 0.0f;
+            value = value < 1.0f ? value : 1.0f;
+            dst[i] = uint16_t(curveValue(value) * 65535.0f + 0.5f);
+        }
+    }
+
+    // Input of the curve that gives the display value y in [0, 1].
+    float inverseCurve(const float y) const
+    {
+        switch (curve) {
+        case Curve::Gamma:
+            return std::pow(y, 1.0f / gamma);
+        case Curve::Srgb:
+            return y <= 0.04045f ? y / 12.92f : std::pow((y + 0.055f) / 1.055f, 2.4f);
+        case Curve::Linear:
+        default:
+            return y;
+        }
+    }
+};
+
+/// <summary>
+/// 8-bit quantization through an OutputTransform without evaluating the curve per value: a table
+/// holds the input value at which each of the 256 codes starts (the inverse curve at the code
+/// boundaries), and a value is quantized by an 8-step branch-free binary search in it.
+/// </summary>
+class OutputQuantizer {
+public:
+    explicit OutputQuantizer(const OutputTransform& transform)
+    {
+        m_thresholds[0] = -std::numeric_limits<float>::infinity();
+        for (int code = 1; code < 256; code++) {
+            m_thresholds[code] = (transform.inverseCurve((float(code) - 0.5f) / 255.0f) - transform.offset) / transform.exposure;
+        }
+    }
+
+    // Quantizes count values multiplied by scale; NaN gives 0.
+    void quantize(const float* src, stbi_uc* dst, const size_t count, const float scale = 1.0f) const
+    {
+        const float* thresholds = m_thresholds.data();
+#pragma omp simd
+        for (size_t i = 0; i < count; i++) {
+            const float value = src[i] * scale;
+            int code = 0;
+            for (int step = 128; step > 0; step >>= 1) {
+                code += value >= thresholds[code + step] ? step : 0;
+            }
+            dst[i] = stbi_uc(code);
+        }
+    }
+
+private:
+    std::array<float, 256> m_thresholds;
+};
+
+/// <summary>
+/// Formats of Image::encodeToBuffer().
+/// </summary>
+enum class ImageEncoding {
+    Png, // 8-bit, multi-threaded encoder (png_writer.h)
+    Png16, // 16-bit, same encoder
+    Tiff16, // 16-bit, Deflate strips (tiff_writer.h)
+    Jpg, // 8-bit, quality 95
+    Hdr, // Radiance RGBE
+};
+
+/// <summary>
+/// Integer encoding of an output file by extension, see Image::writeToFile(): .tif / .tiff is
+/// a 16-bit TIFF, .png a PNG of 8 or 16 bits (see png16Output()), anything else a JPG.
+/// </summary>
+inline ImageEncoding outputEncoding(const std::filesystem::path& filePath)
+{
+    const auto extension = filePath.extension();
+    if (extension == ".tif" || extension == ".tiff") {
+        return ImageEncoding::Tiff16;
+    }
+    if (extension == ".png") {
+        return png16Output() ? ImageEncoding::Png16 : ImageEncoding::Png;
+    }
+    return ImageEncoding::Jpg;
+}
+
+/// <summary>
+/// Consumer of the rows of an image while it is decoded, see the Image(filePath, on_row) constructor.
+/// </summary>
+template <typename T>
+using ImageRowHook = std::function<void(int y, const T* row)>;
+
+// Rows the sequential decoders (float files, single-channel Radiance) decode before the row hook
+// runs on them on all threads: a band small enough to still be in cache.
+constexpr int IMAGE_ROW_HOOK_BAND = 32;
 
 template <typename T>
 class Image {
 public:
-    Image(const std::filesystem::path& filePath);
+    // on_row(y, row), when given, runs on every row right after it is decoded, concurrently for
+    // different rows, so consumers of the pixels (statistics, derived planes) fuse into the decode
+    // instead of reading the whole image again. The stb_image formats are decoded at once and run
+    // it on the converted image.
+    Image(const std::filesystem::path& filePath, const ImageRowHook<T>& on_row = {});
     Image(const int new_width, const int new_height);
-    Image(const Image&) = default;
+    // Copies draw from the current image memory resource, see ImageAllocator.
+    Image(const Image& other);
     Image() : Image(1, 1) {};
 
-    void writeToFile(const std::filesystem::path& filePath, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f);
+    // Moves take the buffer and leave an empty 0 x 0 image behind.
+    Image(Image&& other) noexcept
+        : width(std::exchange(other.width, 0))
+        , height(std::exchange(other.height, 0))
+        , data(std::move(other.data))
+    {
+    }
+    Image& operator=(const Image&) = default;
+    Image& operator=(Image&& other) noexcept
+    {
+        width = std::exchange(other.width, 0);
+        height = std::exchange(other.height, 0);
+        data = std::move(other.data);
+        return *this;
+    }
+
+    // Explicit deep copy, drawing from the current image memory resource.
+    Image clone() const { return Image(*this); }
+
+    // Deep copy of the pixels of a view (e.g. to materialize a crop).
+    explicit Image(const ImageView<const T>& view);
+
+    // Image whose pixels are left uninitialized, for outputs that overwrite every pixel.
+    static Image uninitialized(const int new_width, const int new_height);
+    // Image file decoded at 1 / factor of its size, see loadDownsampled() below.
+    static Image loadDownsampled(const std::filesystem::path& filePath, const int factor);
+
+    // Non-owning views of the whole image or of a region of it.
+    ImageView<T> view() { return ImageView<T>(*this); }
+    ImageView<const T> view() const { return ImageView<const T>(*this); }
+    ImageView<T> view(const int x, const int y, const int w, const int h) { return view().subview(x, y, w, h); }
+    ImageView<const T> view(const int x, const int y, const int w, const int h) const { return view().subview(x, y, w, h); }
+
+    // 8-bit PNG / JPG, 16-bit PNG / TIFF (see outputEncoding()), or lossless float for .pfm, .f32 and .exr (see float_image_io.h).
+    // noise_sigma > 0 dithers integer output with uniform noise; noise_seed selects the (deterministic) noise pattern.
+    // transform maps integer output to display values during quantization (gamma, sRGB), see OutputTransform.
+    void writeToFile(const std::filesystem::path& filePath, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f, const uint64_t noise_seed = 0,
+        const OutputTransform& transform = {}) const;
+
+    // Image decoded from an encoded file in memory (any format of stb_image, Radiance HDR included).
+    // Throws std::exception (after printing the reason) when the data cannot be decoded.
+    static Image fromMemory(const std::span<const std::byte> bytes);
+    // The encoded file in memory, with the same conversions as writeToFile(); Hdr keeps the scaled linear floats.
+    std::vector<uint8_t> encodeToBuffer(const ImageEncoding encoding, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f, const uint64_t noise_seed = 0,
+        const OutputTransform& transform = {}) const;
+
+private:
+    struct UninitializedTag { };
+    Image(UninitializedTag, const int new_width, const int new_height);
+
+    // Runs a row hook on the decoded rows [y_begin, y_end) on all threads.
+    void runRowHook(const ImageRowHook<T>& on_row, const int y_begin, const int y_end) const
+    {
+        if (!on_row) {
+            return;
+        }
+#pragma omp parallel for schedule(static)
+        for (int y = y_begin; y < y_end; y++) {
+            on_row(y, data.data() + size_t(y) * size_t(width));
+        }
+    }
+
+    // Pixels as interleaved 8-bit (stbi_uc) or 16-bit (uint16_t) values with 1 (float images only) or 3 channels, see writeToFile().
+    template <typename Out>
+    std::vector<Out> quantizePixels(const int channels, const float scaling_factor, const float noise_sigma, const uint64_t noise_seed, const OutputTransform& transform) const;
+    // Channels of an integer output, 1 for single-channel PNGs and TIFFs with grayPngOutput().
+    static int outputChannels(const ImageEncoding encoding) { return std::is_same_v<T, float> && encoding != ImageEncoding::Jpg && grayPngOutput() ? 1 : 3; }
 
 public:
     int width, height;
-    std::vector<T> data;
+    // 64-byte aligned pixel storage, see ImageAllocator.
+    std::vector<T, ImageAllocator<T>> data;
 };
 
 template<typename T> 
@@ -48,23 +367,130 @@ float stbfToType<float>(const float* src);
 template <>
 glm::vec3 stbfToType<glm::vec3>(const float* src);
 
+// Pixel from a float file with 1 or 3 channels (gray is replicated, RGB to gray keeps the first channel like stbfToType).
 template <typename T>
-inline void typeToRgbUint8(stbi_uc* dst, const T& value) { throw std::exception("Not implemented."); };
+inline T floatChannelsToType(const float* src, const int channels) { throw std::exception("Not implemented."); };
 template <>
-void typeToRgbUint8(stbi_uc* dst, const float& value);
+inline float floatChannelsToType<float>(const float* src, const int) { return src[0]; }
 template <>
-void typeToRgbUint8(stbi_uc* dst, const glm::vec3& value);
+inline glm::vec3 floatChannelsToType<glm::vec3>(const float* src, const int channels) { return channels == 1 ? glm::vec3(src[0]) : glm::vec3(src[0], src[1], src[2]); }
 
+/// <summary>
+/// Converts rows of pixels with Channels interleaved 8-bit or float values (1 gray, 2 gray +
+/// alpha, 3 RGB, 4 RGBA) to T: gray is replicated, alpha dropped, and single-channel images keep
+/// the first channel. 8-bit values become k / 255 like stbToType(), floats are copied like
+/// stbfToType(). The stride is a compile-time constant, so the loop over a row vectorizes, and
+/// large images are converted on all threads (which also places their pages, see
+/// imageRowsFirstTouch()).
+/// </summary>
+template <typename T, int Channels, typename Src>
+inline void convertPixelRows(const Src* src, T* dst, const int width, const int height)
+{
+    constexpr int type_channels = int(sizeof(T) / sizeof(float));
+    constexpr bool bytes = std::is_same_v<Src, stbi_uc>;
+    // k / 255 of every 8-bit value, for the strided conversions.
+    static const auto byte_values = [] {
+        std::array<float, 256> values;
+        for (int k = 0; k < 256; k++) {
+            values[size_t(k)] = float(k) / 255.0f;
+        }
+        return values;
+    }();
+    float* out = reinterpret_cast<float*>(dst);
+#pragma omp parallel for schedule(static) if (size_t(width) * size_t(height) * sizeof(T) >= IMAGE_PARALLEL_TOUCH_BYTES)
+    for (int y = 0; y < height; y++) {
+        const Src* in = src + size_t(y) * size_t(width) * Channels;
+        float* row = out + size_t(y) * size_t(width) * type_channels;
+        if constexpr (Channels == type_channels) {
+            // Same layout: one flat loop over the values.
+            const int count = width * Channels;
+#pragma omp simd
+            for (int i = 0; i < count; i++) {
+                if constexpr (bytes) {
+                    row[i] = float(in[i]) / 255.0f;
+                } else {
+                    row[i] = in[i];
+                }
+            }
+        } else {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < type_channels; c++) {
+                    const Src value = in[x * Channels + (Channels >= 3 ? c : 0)];
+                    if constexpr (bytes) {
+                        row[x * type_channels + c] = byte_values[value];
+                    } else {
+                        row[x * type_channels + c] = value;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// convertPixelRows() for a channel count known at runtime (1 to 4). Throws std::exception (after
+/// printing the reason) for other counts.
+/// </summary>
+template <typename T, typename Src>
+inline void convertPixels(const Src* src, const int channels, T* dst, const int width, const int height)
+{
+    switch (channels) {
+    case 1:
+        convertPixelRows<T, 1>(src, dst, width, height);
+        break;
+    case 2:
+        convertPixelRows<T, 2>(src, dst, width, height);
+        break;
+    case 3:
+        convertPixelRows<T, 3>(src, dst, width, height);
+        break;
+    case 4:
+        convertPixelRows<T, 4>(src, dst, width, height);
+        break;
+    default:
+        std::cerr << "Images with " << channels << " channels are not supported" << std::endl;
+        throw std::exception();
+    }
+}
+
+// Counter-based uniform noise in [-1, 1): the splitmix64 finalizer applied to (seed, counter).
+// Every sample is a pure function of its counter, so pixels can be dithered in any order or in
+// parallel with a deterministic result.
+inline float counterNoise(const uint64_t seed, const uint64_t counter)
+{
+    uint64_t z = seed ^ (counter * 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return float(z >> 40) * (2.0f / 16777216.0f) - 1.0f;
+}
+
+// Noise of pixel i, one independent sample per channel.
 template <typename T>
-inline T sampleNoise(std::function<float(void)>& pdf) { throw std::exception("Not implemented."); };
+inline T sampleNoise(const uint64_t seed, const uint64_t i) { throw std::exception("Not implemented."); };
 template <>
-inline float sampleNoise(std::function<float(void)>& pdf) { return pdf(); }
+inline float sampleNoise(const uint64_t seed, const uint64_t i) { return counterNoise(seed, 3 * i); }
 template <>
-inline glm::vec3 sampleNoise(std::function<float(void)>& pdf) { return glm::vec3(pdf(), pdf(), pdf()); }
+inline glm::vec3 sampleNoise(const uint64_t seed, const uint64_t i) { return glm::vec3(counterNoise(seed, 3 * i), counterNoise(seed, 3 * i + 1), counterNoise(seed, 3 * i + 2)); }
 
 template <typename T>
-Image<T>::Image(const std::filesystem::path& filePath)
+Image<T>::Image(const std::filesystem::path& filePath, const ImageRowHook<T>& on_row)
 {
+    if (isSharedImagePath(filePath)) {
+        // Pixels of another process, see shared_image.h: one copy, no decoding.
+        const auto shared = SharedImage<T>::open(sharedImageName(filePath));
+        width = shared.width();
+        height = shared.height();
+        data.resize(size_t(width) * size_t(height)); // Default-initialized, every pixel is overwritten.
+        const float* pixels = shared.floats();
+        if (uint32_t(shared.channels()) == SharedImage<T>::type_channels) {
+            std::memcpy(data.data(), pixels, data.size() * sizeof(T));
+        } else {
+            convertPixels(pixels, int(shared.channels()), data.data(), width, height);
+        }
+        runRowHook(on_row, 0, height);
+        return;
+    }
     if (!std::filesystem::exists(filePath)) {
         std::cerr << "Image file " << filePath << " does not exists!" << std::endl;
         throw std::exception();
@@ -73,31 +499,108 @@ Image<T>::Image(const std::filesystem::path& filePath)
     const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
     int channels;
 
-    if (stbi_is_hdr(filePathStr.c_str())) {
+    if (isFloatImageFile(filePath)) {
+        // Lossless float formats, see float_image_io.h.
+        FloatImageReader reader(filePath);
+        width = reader.width();
+        height = reader.height();
+        data.resize(size_t(width) * size_t(height)); // Default-initialized, every pixel is overwritten.
+
+        constexpr int type_channels = int(sizeof(T) / sizeof(float));
+        const int file_channels = reader.channels();
+        std::vector<float> row_buffer(file_channels == type_channels ? 0 : size_t(width) * size_t(file_channels));
+        int band_begin = 0;
+        for (int y = 0; y < height; y++) {
+            T* row = data.data() + size_t(y) * size_t(width);
+            bool ok;
+            if (file_channels == type_channels) {
+                ok = reader.readRow(y, reinterpret_cast<float*>(row));
+            } else {
+                ok = reader.readRow(y, row_buffer.data());
+                convertPixels(row_buffer.data(), file_channels, row, width, 1);
+            }
+            if (!ok) {
+                std::cerr << "Failed to read row " << y << " of float image " << filePath << std::endl;
+                throw std::exception();
+            }
+            if (y + 1 - band_begin == IMAGE_ROW_HOOK_BAND || y + 1 == height) {
+                runRowHook(on_row, band_begin, y + 1);
+                band_begin = y + 1;
+            }
+        }
+    }
+    else if (RadianceHdrReader::isRadianceFile(filePath)) {
+        // Decode straight into the pixel storage: peak memory is the image itself plus the
+        // compressed RGBE data, instead of an extra full float copy from stbi_loadf().
+        RadianceHdrReader reader(filePath);
+        width = reader.width();
+        height = reader.height();
+        data.resize(size_t(width) * size_t(height)); // Default-initialized, every pixel is overwritten.
+
+        if constexpr (std::is_same_v<T, glm::vec3>) {
+            // RGB images are decoded in parallel bands, see RadianceHdrReader::readImage().
+            static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+            std::function<void(int)> decoded_row;
+            if (on_row) {
+                decoded_row = [&](const int y) { on_row(y, data.data() + size_t(y) * size_t(width)); };
+            }
+            if (!reader.readImage(reinterpret_cast<float*>(data.data()), decoded_row)) {
+                std::cerr << "Failed to decode HDR image " << filePath << std::endl;
+                throw std::exception();
+            }
+        } else {
+            std::vector<float> row_buffer(size_t(width) * 3);
+            int band_begin = 0;
+            for (int y = 0; y < height; y++) {
+                T* row = data.data() + size_t(y) * size_t(width);
+                const bool ok = reader.readScanline(row_buffer.data());
+                convertPixelRows<T, 3>(row_buffer.data(), row, width, 1);
+                if (!ok) {
+                    std::cerr << "Failed to decode scanline " << y << " of HDR image " << filePath << std::endl;
+                    throw std::exception();
+                }
+                if (y + 1 - band_begin == IMAGE_ROW_HOOK_BAND || y + 1 == height) {
+                    runRowHook(on_row, band_begin, y + 1);
+                    band_begin = y + 1;
+                }
+            }
+        }
+    }
+    else if (stbi_is_hdr(filePathStr.c_str())) {
         stbi_hdr_to_ldr_gamma(1.0f);
         stbi_hdr_to_ldr_scale(1.0f);
         float* stb_data_float = stbi_loadf(filePathStr.c_str(), &width, &height, &channels, 0);
 
-        data.resize(width * height);
-        for (size_t i = 0; i < data.size(); i++) {
-            data[i] = stbfToType<T>(stb_data_float + i * channels);
-        }
+        data.resize(size_t(width) * size_t(height)); // Default-initialized, every pixel is overwritten.
+        convertPixels(stb_data_float, channels, data.data(), width, height);
 
         stbi_image_free(stb_data_float);
+        runRowHook(on_row, 0, height);
     }
     else {
-        stbi_uc* stb_data = stbi_load(filePathStr.c_str(), &width, &height, &channels, 0);
+        // A single-channel image of a gray (+ alpha) file only needs the gray channel decoded. Color
+        // files keep all channels, the first one is used like for RGB images.
+        int requested_channels = 0;
+        if constexpr (std::is_same_v<T, float>) {
+            int info_width, info_height, file_channels;
+            if (stbi_info(filePathStr.c_str(), &info_width, &info_height, &file_channels) && file_channels <= 2) {
+                requested_channels = 1;
+            }
+        }
+        stbi_uc* stb_data = stbi_load(filePathStr.c_str(), &width, &height, &channels, requested_channels);
         if (!stb_data) {
             std::cerr << "Failed to read image " << filePath << " using stb_image.h" << std::endl;
             throw std::exception();
         }
-
-        data.resize(width * height);
-        for (size_t i = 0; i < data.size(); i++) {
-            data[i] = stbToType<T>(stb_data + i * channels);
+        if (requested_channels != 0) {
+            channels = requested_channels;
         }
 
+        data.resize(size_t(width) * size_t(height)); // Default-initialized, every pixel is overwritten.
+        convertPixels(stb_data, channels, data.data(), width, height);
+
         stbi_image_free(stb_data);
+        runRowHook(on_row, 0, height);
     }
 
 
@@ -108,33 +611,341 @@ Image<T>::Image(const int new_width, const int new_height)
 {
     width = new_width;
     height = new_height;
-    data.resize(width * height); // Should be full of zeros.
+    data.resize(size_t(width) * size_t(height)); // Default-initialized, zeroed below.
+    imageRowsFirstTouch(height, data.size() * sizeof(T), [&](const int y) {
+        std::fill_n(data.data() + size_t(y) * size_t(width), width, T {});
+    });
+}
+
+template <typename T>
+Image<T>::Image(const Image& other)
+    : width(other.width)
+    , height(other.height)
+    , data(other.data.get_allocator().select_on_container_copy_construction())
+{
+    data.resize(other.data.size());
+    imageRowsFirstTouch(height, data.size() * sizeof(T), [&](const int y) {
+        const size_t offset = size_t(y) * size_t(width);
+        std::copy_n(other.data.data() + offset, width, data.data() + offset);
+    });
+}
+
+template <typename T>
+Image<T>::Image(UninitializedTag, const int new_width, const int new_height)
+{
+    width = new_width;
+    height = new_height;
+    data.resize(width * height); // Default-initialized, see ImageAllocator.
+}
+
+template <typename T>
+Image<T>::Image(const ImageView<const T>& view)
+    : Image(UninitializedTag {}, view.width, view.height)
+{
+    imageRowsFirstTouch(height, data.size() * sizeof(T), [&](const int y) {
+        std::copy_n(view.row(y), width, data.data() + size_t(y) * size_t(width));
+    });
+}
+
+template <typename T>
+Image<T> Image<T>::fromMemory(const std::span<const std::byte> bytes)
+{
+    if (bytes.size() > size_t(std::numeric_limits<int>::max())) {
+        std::cerr << "Encoded image of " << bytes.size() << " bytes is too large for stb_image.h" << std::endl;
+        throw std::exception();
+    }
+    const auto* buffer = reinterpret_cast<const stbi_uc*>(bytes.data());
+    const int length = int(bytes.size());
+    int width, height, channels;
+
+    if (stbi_is_hdr_from_memory(buffer, length)) {
+        float* stb_data_float = stbi_loadf_from_memory(buffer, length, &width, &height, &channels, 0);
+        if (!stb_data_float) {
+            std::cerr << "Failed to decode HDR image from memory using stb_image.h: " << stbi_failure_reason() << std::endl;
+            throw std::exception();
+        }
+        auto result = uninitialized(width, height);
+        convertPixels(stb_data_float, channels, result.data.data(), width, height);
+        stbi_image_free(stb_data_float);
+        return result;
+    }
+
+    // Gray files decode only the gray channel into single-channel images, as in Image(filePath).
+    int requested_channels = 0;
+    if constexpr (std::is_same_v<T, float>) {
+        int info_width, info_height, file_channels;
+        if (stbi_info_from_memory(buffer, length, &info_width, &info_height, &file_channels) && file_channels <= 2) {
+            requested_channels = 1;
+        }
+    }
+    stbi_uc* stb_data = stbi_load_from_memory(buffer, length, &width, &height, &channels, requested_channels);
+    if (!stb_data) {
+        std::cerr << "Failed to decode image from memory using stb_image.h: " << stbi_failure_reason() << std::endl;
+        throw std::exception();
+    }
+    if (requested_channels != 0) {
+        channels = requested_channels;
+    }
+    auto result = uninitialized(width, height);
+    convertPixels(stb_data, channels, result.data.data(), width, height);
+    stbi_image_free(stb_data);
+    return result;
+}
+
+template <typename T>
+std::vector<uint8_t> Image<T>::encodeToBuffer(const ImageEncoding encoding, const float scaling_factor, const float noise_sigma, const uint64_t noise_seed,
+    const OutputTransform& transform) const
+{
+    std::vector<uint8_t> encoded;
+    const auto append = [](void* context, void* chunk, const int size) {
+        auto& out = *static_cast<std::vector<uint8_t>*>(context);
+        out.insert(out.end(), static_cast<const uint8_t*>(chunk), static_cast<const uint8_t*>(chunk) + size);
+    };
+
+    if (encoding == ImageEncoding::Hdr) {
+        constexpr int float_channels = int(sizeof(T) / sizeof(float));
+        std::vector<float> scaled(data.size() * float_channels);
+        const float* pixels = reinterpret_cast<const float*>(data.data());
+        for (size_t i = 0; i < scaled.size(); i++) {
+            scaled[i] = pixels[i] * scaling_factor;
+        }
+        if (!stbi_write_hdr_to_func(append, &encoded, width, height, float_channels, scaled.data())) {
+            std::cerr << "Failed to encode HDR image" << std::endl;
+            throw std::exception();
+        }
+        return encoded;
+    }
+
+    const auto channels = outputChannels(encoding);
+    if (encoding == ImageEncoding::Png16 || encoding == ImageEncoding::Tiff16) {
+        const auto std_data = quantizePixels<uint16_t>(channels, scaling_factor, noise_sigma, noise_seed, transform);
+        return encoding == ImageEncoding::Png16 ? encodePng(width, height, channels, std_data.data()) : encodeTiff(width, height, channels, std_data.data());
+    }
+    const auto std_data = quantizePixels<stbi_uc>(channels, scaling_factor, noise_sigma, noise_seed, transform);
+    if (encoding == ImageEncoding::Png) {
+        return encodePng(width, height, channels, std_data.data());
+    }
+    if (!stbi_write_jpg_to_func(append, &encoded, width, height, channels, std_data.data(), 95)) {
+        std::cerr << "Failed to encode JPG image" << std::endl;
+        throw std::exception();
+    }
+    return encoded;
 }
 
 template <typename T>
-inline void Image<T>::writeToFile(const std::filesystem::path& filePath, const float scaling_factor, const float noise_sigma) {
+Image<T> Image<T>::uninitialized(const int new_width, const int new_height)
+{
+    return Image(UninitializedTag {}, new_width, new_height);
+}
+
+/// <summary>
+/// Box-filtered reduction of decoded rows to 1 / factor of their size (at least 1 x 1): output
+/// pixel (x, y) is the mean of the factor x factor block at (x, y) * factor. Input rows are
+/// requested in order, row_fn(y) returns the channels interleaved values of row y (any arithmetic
+/// type, up to 4 channels), which are only added up in double precision; the conversion to T and
+/// the scale are applied once per output pixel. Only one output row of sums is kept.
+/// </summary>
+template <typename T, typename RowFn>
+Image<T> downsampleDecodedRows(const int in_width, const int in_height, const int channels, const int factor, const float scale, const RowFn& row_fn)
+{
+    const int width = std::max(in_width / factor, 1);
+    const int height = std::max(in_height / factor, 1);
+    auto result = Image<T>::uninitialized(width, height);
+    // Gray + alpha keeps the gray channel.
+    const int pixel_channels = channels >= 3 ? 3 : 1;
+    std::vector<double> sums(size_t(width) * size_t(channels));
+    for (int y = 0; y < height; y++) {
+        std::fill(sums.begin(), sums.end(), 0.0);
+        const int y0 = y * factor;
+        const int y1 = std::min(y0 + factor, in_height);
+        for (int sy = y0; sy < y1; sy++) {
+            const auto* row = row_fn(sy);
+            for (int x = 0; x < width; x++) {
+                double* sum = sums.data() + size_t(x) * size_t(channels);
+                const int x1 = std::min((x + 1) * factor, in_width);
+                for (int sx = x * factor; sx < x1; sx++) {
+                    for (int c = 0; c < channels; c++) {
+                        sum[c] += double(row[size_t(sx) * size_t(channels) + size_t(c)]);
+                    }
+                }
+            }
+        }
+        T* out = result.data.data() + size_t(y) * size_t(width);
+        for (int x = 0; x < width; x++) {
+            double* sum = sums.data() + size_t(x) * size_t(channels);
+            const int x1 = std::min((x + 1) * factor, in_width);
+            const double weight = double(scale) / double((x1 - x * factor) * (y1 - y0));
+            float mean[4];
+            for (int c = 0; c < std::min(channels, 4); c++) {
+                mean[c] = float(sum[c] * weight);
+            }
+            out[x] = floatChannelsToType<T>(mean, pixel_channels);
+        }
+    }
+    return result;
+}
 
-    // RGB => 3
-    const auto channels = 3;
+/// <summary>
+/// Decodes an image file straight to 1 / factor of its size, box filtered (see above).
+/// The reduction is fused into the decode: HDR and float files are read row by row, so memory
+/// is the output plus one input row; 8-bit files are decoded whole by stb_image (one byte per
+/// channel) and reduced from the bytes. Previews and proxies of large inputs never hold the
+/// full-resolution float image.
+/// </summary>
+/// <param name="filePath">any file the Image(filePath) constructor reads</param>
+/// <param name="factor">downsampling factor, values <= 1 decode the full image</param>
+template <typename T>
+Image<T> Image<T>::loadDownsampled(const std::filesystem::path& filePath, const int factor)
+{
+    if (factor <= 1) {
+        return Image(filePath);
+    }
+    if (!std::filesystem::exists(filePath)) {
+        std::cerr << "Image file " << filePath << " does not exists!" << std::endl;
+        throw std::exception();
+    }
 
-    /*auto pdf = std::bind(std::normal_distribution<float>{0.0f, std::max(noise_sigma, 1e-5f)},
-        std::mt19937(std::random_device{}()));*/
-    auto pdf = std::bind(std::uniform_real_distribution<float>{-noise_sigma, noise_sigma},
-        std::mt19937(std::random_device{}()));
-    std::function<float(void)> pdf_sampler = pdf;
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    if (isFloatImageFile(filePath)) {
+        FloatImageReader reader(filePath);
+        std::vector<float> row(size_t(reader.width()) * size_t(reader.channels()));
+        return downsampleDecodedRows<T>(reader.width(), reader.height(), reader.channels(), factor, 1.0f, [&](const int y) {
+            if (!reader.readRow(y, row.data())) {
+                std::cerr << "Failed to read row " << y << " of float image " << filePath << std::endl;
+                throw std::exception();
+            }
+            return row.data();
+        });
+    }
+    if (RadianceHdrReader::isRadianceFile(filePath)) {
+        RadianceHdrReader reader(filePath);
+        std::vector<float> row(size_t(reader.width()) * 3);
+        return downsampleDecodedRows<T>(reader.width(), reader.height(), 3, factor, 1.0f, [&](const int y) {
+            if (!reader.readScanline(row.data())) {
+                std::cerr << "Failed to decode scanline " << y << " of HDR image " << filePath << std::endl;
+                throw std::exception();
+            }
+            return row.data();
+        });
+    }
 
-    // Converts floats to uint8 array. 
-    // Assumes normalized format, so it is multiplied by 255 (on top of the scaling_factor).
-    // If input is single channel, it triples it to get RGB.
-    std::vector<stbi_uc> std_data;
-    std_data.resize(width * height * channels);
-    for (size_t i = 0; i < data.size(); i++) {
-        auto val = data[i] * scaling_factor;
-        if (noise_sigma != 0.0f) {
-            val += sampleNoise<T>(pdf_sampler);
+    int width, height, channels;
+    if (stbi_is_hdr(filePathStr.c_str())) {
+        stbi_hdr_to_ldr_gamma(1.0f);
+        stbi_hdr_to_ldr_scale(1.0f);
+        float* stb_data_float = stbi_loadf(filePathStr.c_str(), &width, &height, &channels, 0);
+        if (!stb_data_float) {
+            std::cerr << "Failed to read image " << filePath << " using stb_image.h" << std::endl;
+            throw std::exception();
         }
-        // Conversion handles [0,1] clamping.
-        typeToRgbUint8<T>(&std_data[i * channels], val);
+        auto result = downsampleDecodedRows<T>(width, height, channels, factor, 1.0f,
+            [&](const int y) { return stb_data_float + size_t(y) * size_t(width) * size_t(channels); });
+        stbi_image_free(stb_data_float);
+        return result;
+    }
+    stbi_uc* stb_data = stbi_load(filePathStr.c_str(), &width, &height, &channels, 0);
+    if (!stb_data) {
+        std::cerr << "Failed to read image " << filePath << " using stb_image.h" << std::endl;
+        throw std::exception();
+    }
+    // Same scale as stbToType().
+    auto result = downsampleDecodedRows<T>(width, height, channels, factor, 1.0f / 255.0f,
+        [&](const int y) { return stb_data + size_t(y) * size_t(width) * size_t(channels); });
+    stbi_image_free(stb_data);
+    return result;
+}
+
+template <typename T>
+template <typename Out>
+std::vector<Out> Image<T>::quantizePixels(const int channels, const float scaling_factor, const float noise_sigma, const uint64_t noise_seed, const OutputTransform& transform) const
+{
+    // Converts floats to a uint8 or uint16 array.
+    // Assumes normalized format (after the transform), so it is multiplied by 255 or 65535 (on top of the scaling_factor).
+    // A single-channel image is tripled for 3 channels.
+    // Optional dithering adds uniform noise in [-noise_sigma, noise_sigma] before quantization.
+    constexpr int float_channels = int(sizeof(T) / sizeof(float));
+    std::vector<Out> std_data(size_t(width) * size_t(height) * size_t(channels));
+    const float* pixels = reinterpret_cast<const float*>(data.data());
+    // 8-bit curves go through the threshold table, plain scales through the direct conversion.
+    constexpr bool is_uint8 = std::is_same_v<Out, stbi_uc>;
+    std::optional<OutputQuantizer> quantizer;
+    if (is_uint8 && !transform.isScaleOnly()) {
+        quantizer.emplace(transform);
+    }
+#pragma omp parallel
+    {
+        std::vector<float> noisy(noise_sigma != 0.0f ? size_t(width) * float_channels : 0);
+        std::vector<Out> gray(float_channels < channels ? size_t(width) : 0);
+#pragma omp for
+        for (int y = 0; y < height; y++) {
+            const size_t first = size_t(y) * size_t(width);
+            const float* row = pixels + first * float_channels;
+            float scale = scaling_factor;
+            if (noise_sigma != 0.0f) {
+                for (int x = 0; x < width; x++) {
+                    const T value = data[first + x] * scaling_factor + noise_sigma * sampleNoise<T>(noise_seed, uint64_t(first + x));
+                    std::memcpy(noisy.data() + size_t(x) * float_channels, &value, sizeof(T));
+                }
+                row = noisy.data();
+                scale = 1.0f;
+            }
+            Out* out = std_data.data() + first * size_t(channels);
+            const auto convert = [&](Out* dst, const size_t count) {
+                if constexpr (is_uint8) {
+                    if (quantizer) {
+                        quantizer->quantize(row, dst, count, scale);
+                    } else {
+                        floatsToUint8(row, dst, count, scale * transform.exposure);
+                    }
+                } else if (transform.isScaleOnly()) {
+                    floatsToUint16(row, dst, count, scale * transform.exposure);
+                } else {
+                    transform.quantize16(row, dst, count, scale);
+                }
+            };
+            if (float_channels == channels) {
+                convert(out, size_t(width) * size_t(channels));
+            } else {
+                convert(gray.data(), size_t(width));
+                for (int x = 0; x < width; x++) {
+                    out[3 * x] = out[3 * x + 1] = out[3 * x + 2] = gray[x];
+                }
+            }
+        }
+    }
+    return std_data;
+}
+
+template <typename T>
+inline void Image<T>::writeToFile(const std::filesystem::path& filePath, const float scaling_factor, const float noise_sigma, const uint64_t noise_seed,
+    const OutputTransform& transform) const {
+
+    // Shared-memory images (see shared_image.h) and the lossless float formats (.pfm, .f32, .exr,
+    // see float_image_io.h) keep the scaled values as they are.
+    if (isSharedImagePath(filePath)) {
+        auto shared = SharedImage<T>::create(sharedImageName(filePath), width, height);
+        auto pixels = shared.view();
+        for (int y = 0; y < height; y++) {
+            const T* row = data.data() + size_t(y) * size_t(width);
+            std::transform(row, row + width, pixels.row(y), [&](const T& value) { return value * scaling_factor; });
+        }
+        return;
+    }
+    if (isFloatImageFile(filePath)) {
+        constexpr int float_channels = int(sizeof(T) / sizeof(float));
+        const float* pixels = reinterpret_cast<const float*>(data.data());
+        std::vector<float> scaled;
+        if (scaling_factor != 1.0f) {
+            scaled.resize(data.size() * float_channels);
+            for (size_t i = 0; i < scaled.size(); i++) {
+                scaled[i] = pixels[i] * scaling_factor;
+            }
+            pixels = scaled.data();
+        }
+        if (!writeFloatImage(filePath, width, height, float_channels, pixels)) {
+            std::cerr << "Failed to write float image " << filePath << std::endl;
+        }
+        return;
     }
 
     // Create a folder.
@@ -142,10 +953,24 @@ inline void Image<T>::writeToFile(const std::filesystem::path& filePath, const f
         std::filesystem::create_directories(filePath.parent_path());
     }
 
-    // Decide JPG (default) or PNG based on extension.
+    // Decide JPG (default), PNG or TIFF based on extension, see outputEncoding().
+    // RGB => 3, or gray => 1 for PNGs and TIFFs, see grayPngOutput().
+    const auto encoding = outputEncoding(filePath);
+    const auto channels = outputChannels(encoding);
+    if (encoding == ImageEncoding::Png16 || encoding == ImageEncoding::Tiff16) {
+        // Multi-threaded encoders, see png_writer.h and tiff_writer.h.
+        const auto std_data = quantizePixels<uint16_t>(channels, scaling_factor, noise_sigma, noise_seed, transform);
+        const bool written = encoding == ImageEncoding::Png16 ? writePng(filePath, width, height, channels, std_data.data()) : writeTiff(filePath, width, height, channels, std_data.data());
+        if (!written) {
+            std::cerr << "Failed to write image " << filePath << std::endl;
+        }
+        return;
+    }
+    const auto std_data = quantizePixels<stbi_uc>(channels, scaling_factor, noise_sigma, noise_seed, transform);
     const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
-    if (filePath.extension() == ".png") {
-        stbi_write_png(filePathStr.c_str(), width, height, channels, std_data.data(), width * channels);
+    if (encoding == ImageEncoding::Png) {
+        // Multi-threaded encoder, see png_writer.h.
+        writePng(filePath, width, height, channels, std_data.data());
     } else {
         stbi_write_jpg(filePathStr.c_str(), width, height, channels, std_data.data(), 95);
     }
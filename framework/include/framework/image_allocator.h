@@ -0,0 +1,113 @@
+#pragma once
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Alignment of image buffers in bytes (one cache line, also the widest SIMD register).
+constexpr size_t IMAGE_ALIGNMENT = 64;
+
+/// <summary>
+/// Memory resource used by image buffers created on the calling thread.
+/// Defaults to aligned operator new/delete, see ImageMemoryScope to redirect it.
+/// </summary>
+inline std::pmr::memory_resource*& currentImageMemoryResource()
+{
+    thread_local std::pmr::memory_resource* resource = std::pmr::new_delete_resource();
+    return resource;
+}
+
+/// <summary>
+/// RAII scope that makes images created on this thread draw from the given resource.
+/// Every buffer remembers its resource, so the resource must outlive all images allocated from it.
+/// </summary>
+class ImageMemoryScope {
+public:
+    explicit ImageMemoryScope(std::pmr::memory_resource* resource)
+        : previous(currentImageMemoryResource())
+    {
+        currentImageMemoryResource() = resource;
+    }
+    ~ImageMemoryScope() { currentImageMemoryResource() = previous; }
+
+    ImageMemoryScope(const ImageMemoryScope&) = delete;
+    ImageMemoryScope& operator=(const ImageMemoryScope&) = delete;
+
+private:
+    std::pmr::memory_resource* previous;
+};
+
+/// <summary>
+/// Allocator for image pixel storage.
+/// - Buffers are aligned to IMAGE_ALIGNMENT bytes.
+/// - Memory comes from the current image memory resource of the thread creating the container.
+/// - Construction without arguments default-initializes, so resize(n) leaves trivial pixels
+///   uninitialized instead of zero-filling them. Use resize(n, T {}) to get zeros.
+/// </summary>
+template <typename T>
+class ImageAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    ImageAllocator() noexcept
+        : resource(currentImageMemoryResource())
+    {
+    }
+    template <typename U>
+    ImageAllocator(const ImageAllocator<U>& other) noexcept
+        : resource(other.resource)
+    {
+    }
+
+    // Copies of an image draw from the resource that is current at the time of the copy.
+    ImageAllocator select_on_container_copy_construction() const { return ImageAllocator(); }
+
+    T* allocate(const size_t n)
+    {
+        return static_cast<T*>(resource->allocate(n * sizeof(T), IMAGE_ALIGNMENT));
+    }
+
+    void deallocate(T* p, const size_t n) noexcept
+    {
+        resource->deallocate(p, n * sizeof(T), IMAGE_ALIGNMENT);
+    }
+
+    template <typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const ImageAllocator<U>& other) const noexcept { return resource == other.resource; }
+    template <typename U>
+    bool operator!=(const ImageAllocator<U>& other) const noexcept { return resource != other.resource; }
+
+    std::pmr::memory_resource* resource;
+};
+
+/// <summary>
+/// Smallest row length (in elements) >= width whose byte size is a multiple of IMAGE_ALIGNMENT,
+/// so every row of a padded buffer starts aligned. Falls back to width for pixel sizes that
+/// cannot tile the alignment.
+/// </summary>
+template <typename T>
+constexpr int imageRowStride(const int width)
+{
+    if constexpr (IMAGE_ALIGNMENT % sizeof(T) == 0) {
+        constexpr int per_line = int(IMAGE_ALIGNMENT / sizeof(T));
+        return (width + per_line - 1) / per_line * per_line;
+    } else {
+        return width;
+    }
+}
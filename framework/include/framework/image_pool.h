@@ -0,0 +1,104 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <framework/image_allocator.h>
+
+/// <summary>
+/// Recycling memory resource for image buffers.
+///
+/// Freed buffers are kept in per-size free lists and handed out again for the next request of
+/// the same byte size, so a pipeline that runs over frames of one resolution stops hitting
+/// malloc and page faults after the first frame. Cached memory is bounded by max_cached_bytes;
+/// release() returns all cached buffers to the upstream resource in bulk.
+///
+/// Thread-safe: buffers may be allocated and freed from any thread.
+/// The pool must outlive every image allocated from it.
+/// </summary>
+class ImageBufferPool : public std::pmr::memory_resource {
+public:
+    struct Stats {
+        // Requests served from a free list / from upstream.
+        size_t hits = 0;
+        size_t misses = 0;
+        // Bytes currently held in free lists.
+        size_t cached_bytes = 0;
+    };
+
+    explicit ImageBufferPool(const size_t new_max_cached_bytes = size_t(1) << 30, std::pmr::memory_resource* new_upstream = std::pmr::new_delete_resource())
+        : max_cached_bytes(new_max_cached_bytes)
+        , upstream(new_upstream)
+    {
+    }
+    ~ImageBufferPool() override { release(); }
+
+    ImageBufferPool(const ImageBufferPool&) = delete;
+    ImageBufferPool& operator=(const ImageBufferPool&) = delete;
+
+    /// <summary>
+    /// Frees all cached (unused) buffers. Buffers still owned by images are not affected.
+    /// </summary>
+    void release()
+    {
+        std::lock_guard lock(mutex);
+        for (auto& [bytes, buffers] : free_lists) {
+            for (void* p : buffers) {
+                upstream->deallocate(p, bytes, IMAGE_ALIGNMENT);
+            }
+        }
+        free_lists.clear();
+        stats.cached_bytes = 0;
+    }
+
+    Stats getStats() const
+    {
+        std::lock_guard lock(mutex);
+        return stats;
+    }
+
+private:
+    void* do_allocate(const size_t bytes, const size_t alignment) override
+    {
+        if (alignment <= IMAGE_ALIGNMENT) {
+            std::lock_guard lock(mutex);
+            auto it = free_lists.find(bytes);
+            if (it != free_lists.end() && !it->second.empty()) {
+                void* p = it->second.back();
+                it->second.pop_back();
+                stats.cached_bytes -= bytes;
+                stats.hits++;
+                return p;
+            }
+            stats.misses++;
+        }
+        return upstream->allocate(bytes, std::max(alignment, IMAGE_ALIGNMENT));
+    }
+
+    void do_deallocate(void* p, const size_t bytes, const size_t alignment) override
+    {
+        if (alignment <= IMAGE_ALIGNMENT) {
+            std::lock_guard lock(mutex);
+            if (stats.cached_bytes + bytes <= max_cached_bytes) {
+                free_lists[bytes].push_back(p);
+                stats.cached_bytes += bytes;
+                return;
+            }
+        }
+        upstream->deallocate(p, bytes, std::max(alignment, IMAGE_ALIGNMENT));
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    size_t max_cached_bytes;
+    std::pmr::memory_resource* upstream;
+    mutable std::mutex mutex;
+    std::unordered_map<size_t, std::vector<void*>> free_lists;
+    Stats stats;
+};
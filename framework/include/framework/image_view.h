@@ -0,0 +1,67 @@
+#pragma once
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+template <typename T>
+class Image;
+
+/// <summary>
+/// Non-owning view of a 2D pixel region: pointer, size and row stride (in elements).
+/// Use ImageView<const T> for read-only access. Image<T> converts to a view implicitly,
+/// so kernels taking a view also accept whole images. Crops and tiles are views into the
+/// same buffer and cost nothing.
+/// </summary>
+template <typename T>
+class ImageView {
+public:
+    using value_type = std::remove_const_t<T>;
+
+    ImageView() = default;
+    ImageView(T* pixels, const int width, const int height, const int stride)
+        : pixels(pixels)
+        , width(width)
+        , height(height)
+        , stride(stride)
+    {
+        assert(stride >= width);
+    }
+
+    ImageView(Image<value_type>& image)
+        : ImageView(image.data.data(), image.width, image.height, image.width)
+    {
+    }
+
+    template <typename U = T, typename = std::enable_if_t<std::is_const_v<U>>>
+    ImageView(const Image<value_type>& image)
+        : ImageView(image.data.data(), image.width, image.height, image.width)
+    {
+    }
+
+    // Mutable views convert to read-only views.
+    template <typename U = T, typename = std::enable_if_t<std::is_const_v<U>>>
+    ImageView(const ImageView<value_type>& other)
+        : ImageView(other.pixels, other.width, other.height, other.stride)
+    {
+    }
+
+    T* row(const int y) const { return pixels + size_t(y) * size_t(stride); }
+    T& operator()(const int x, const int y) const { return row(y)[x]; }
+
+    // True when the rows follow each other without padding.
+    bool isContiguous() const { return stride == width; }
+
+    /// <summary>
+    /// View of the region [x, x + w) x [y, y + h), which must lie inside this view.
+    /// </summary>
+    ImageView subview(const int x, const int y, const int w, const int h) const
+    {
+        assert(x >= 0 && y >= 0 && x + w <= width && y + h <= height);
+        return ImageView(row(y) + x, w, h, stride);
+    }
+
+public:
+    T* pixels = nullptr;
+    int width = 0, height = 0;
+    int stride = 0;
+};
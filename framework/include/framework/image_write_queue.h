@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <framework/image.h>
+
+/// <summary>
+/// Write-behind sink for image outputs.
+///
+/// write() hands an image to a bounded queue and returns; background workers convert, encode
+/// and store it with Image::writeToFile() while the caller computes the next stage. When
+/// max_pending writes are queued, write() blocks until a worker frees a slot (backpressure), so
+/// the memory held by pending images stays bounded. flush() waits for all queued writes; the
+/// destructor flushes and joins the workers.
+///
+/// Images allocated from an ImageBufferPool are released from the worker threads, so the pool
+/// must outlive the queue (declare the queue after the pool).
+/// </summary>
+class ImageWriteQueue {
+public:
+    explicit ImageWriteQueue(const int num_workers = 2, const size_t new_max_pending = 8)
+        : max_pending(std::max<size_t>(new_max_pending, 1))
+    {
+        for (int i = 0; i < std::max(num_workers, 1); i++) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~ImageWriteQueue()
+    {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        not_empty.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ImageWriteQueue(const ImageWriteQueue&) = delete;
+    ImageWriteQueue& operator=(const ImageWriteQueue&) = delete;
+
+    /// <summary>
+    /// Queues the image for writing and takes ownership of its pixels; the image is left empty.
+    /// Arguments are those of Image::writeToFile().
+    /// </summary>
+    template <typename T>
+    void write(Image<T>&& image, const std::filesystem::path& filePath, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f, const uint64_t noise_seed = 0,
+        const OutputTransform& transform = {})
+    {
+        // Steal the pixel buffer instead of copying it.
+        auto owned = std::make_shared<Image<T>>(0, 0);
+        owned->width = std::exchange(image.width, 0);
+        owned->height = std::exchange(image.height, 0);
+        owned->data.swap(image.data);
+        push([owned, filePath, scaling_factor, noise_sigma, noise_seed, transform] { owned->writeToFile(filePath, scaling_factor, noise_sigma, noise_seed, transform); });
+    }
+
+    /// <summary>
+    /// Queues an image shared with other writes (e.g. one snapshot written with several output
+    /// transforms); the image is released after the last of them.
+    /// </summary>
+    template <typename T>
+    void write(std::shared_ptr<const Image<T>> image, const std::filesystem::path& filePath, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f,
+        const uint64_t noise_seed = 0, const OutputTransform& transform = {})
+    {
+        push([image, filePath, scaling_factor, noise_sigma, noise_seed, transform] { image->writeToFile(filePath, scaling_factor, noise_sigma, noise_seed, transform); });
+    }
+
+    /// <summary>
+    /// Queues a snapshot (deep copy) of an image that the caller keeps using.
+    /// </summary>
+    template <typename T>
+    void write(const Image<T>& image, const std::filesystem::path& filePath, const float scaling_factor = 1.0f, const float noise_sigma = 0.0f, const uint64_t noise_seed = 0,
+        const OutputTransform& transform = {})
+    {
+        write(Image<T>(image.view()), filePath, scaling_factor, noise_sigma, noise_seed, transform);
+    }
+
+    /// <summary>
+    /// Queues a job that derives and writes images itself (e.g. reduced-size renditions of an
+    /// output), under the same backpressure as the writes.
+    /// </summary>
+    void submit(std::function<void()> job)
+    {
+        push(std::move(job));
+    }
+
+    /// <summary>
+    /// Blocks until every queued write is on disk.
+    /// </summary>
+    void flush()
+    {
+        std::unique_lock lock(mutex);
+        idle.wait(lock, [this] { return jobs.empty() && num_active == 0; });
+    }
+
+    // Writes queued or in progress.
+    size_t pending() const
+    {
+        std::lock_guard lock(mutex);
+        return jobs.size() + num_active;
+    }
+
+private:
+    void push(std::function<void()> job)
+    {
+        {
+            std::unique_lock lock(mutex);
+            not_full.wait(lock, [this] { return jobs.size() < max_pending; });
+            jobs.push_back(std::move(job));
+        }
+        not_empty.notify_one();
+    }
+
+    void workerLoop()
+    {
+        std::unique_lock lock(mutex);
+        while (true) {
+            not_empty.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return; // Stopping and drained.
+            }
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            num_active++;
+            lock.unlock();
+            not_full.notify_one();
+
+            try {
+                job();
+            } catch (const std::exception&) {
+                std::cerr << "ImageWriteQueue: failed to write an image" << std::endl;
+            }
+            // Release the image before reporting idle, so flush() implies the buffers are freed.
+            job = nullptr;
+
+            lock.lock();
+            num_active--;
+            if (jobs.empty() && num_active == 0) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    const size_t max_pending;
+    mutable std::mutex mutex;
+    std::condition_variable not_empty, not_full, idle;
+    std::deque<std::function<void()>> jobs;
+    size_t num_active = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <framework/float_image_io.h>
+#include <framework/image.h>
+#include <framework/image_view.h>
+
+/// <summary>
+/// Read-only memory mapping of a whole file. Pages are loaded on first access and shared by all
+/// processes that map the same file.
+/// </summary>
+class MappedFile {
+public:
+    // Throws std::exception (after printing the reason) when the file cannot be mapped.
+    explicit MappedFile(const std::filesystem::path& filePath);
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return static_cast<const uint8_t*>(m_address); }
+    size_t size() const { return m_size; }
+
+private:
+    void unmap();
+
+    void* m_address = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void* m_mapping = nullptr;
+#endif
+};
+
+/// <summary>
+/// Image backed by a read-only mapping of a .f32 file (see float_image_io.h), the file is used in
+/// place without decoding or copying. Pixels are accessed through view(), which every view-based
+/// operator accepts; Image(mapped.view()) makes a private, writable copy.
+/// </summary>
+template <typename T>
+class MappedImage {
+public:
+    explicit MappedImage(const std::filesystem::path& filePath)
+        : file(filePath)
+    {
+        constexpr uint32_t type_channels = uint32_t(sizeof(T) / sizeof(float));
+        RawFloatHeader header;
+        if (file.size() < sizeof(header) || (std::memcpy(&header, file.data(), sizeof(header)), header.magic != RawFloatHeader::MAGIC)
+            || header.version != RawFloatHeader::VERSION) {
+            std::cerr << "Image " << filePath << " is not a raw float image (or not in host byte order)" << std::endl;
+            throw std::exception();
+        }
+        if (header.channels != type_channels
+            || file.size() < sizeof(header) + size_t(header.width) * size_t(header.height) * sizeof(T)) {
+            std::cerr << "Raw float image " << filePath << " does not match the pixel type or is truncated" << std::endl;
+            throw std::exception();
+        }
+        width = int(header.width);
+        height = int(header.height);
+    }
+
+    ImageView<const T> view() const
+    {
+        // The header keeps the pixels 64-byte aligned relative to the page-aligned mapping.
+        return ImageView<const T>(reinterpret_cast<const T*>(file.data() + sizeof(RawFloatHeader)), width, height, width);
+    }
+    ImageView<const T> view(const int x, const int y, const int w, const int h) const { return view().subview(x, y, w, h); }
+
+    int width = 0, height = 0;
+
+private:
+    MappedFile file;
+};
+
+/// <summary>
+/// Maps the decoded pixels of an image file from a .f32 cache, so processes sharing the cache
+/// share one physical copy and skip decoding. The cache file is (re)created from the source when
+/// it is missing or older than the source; it is written to a temporary name and renamed, so
+/// concurrent workers never map a partial file.
+/// </summary>
+/// <param name="source_path">image in any format supported by Image(path)</param>
+/// <param name="cache_path">.f32 file holding the decoded pixels</param>
+template <typename T>
+MappedImage<T> mapDecodedImage(const std::filesystem::path& source_path, const std::filesystem::path& cache_path)
+{
+    std::error_code error;
+    const bool up_to_date = std::filesystem::exists(cache_path, error)
+        && std::filesystem::last_write_time(cache_path, error) >= std::filesystem::last_write_time(source_path, error)
+        && !error;
+    if (!up_to_date) {
+        Image<T> decoded(source_path);
+        // Unique per writer, so concurrent writers do not interleave.
+        const auto writer_id = std::hash<std::thread::id> {}(std::this_thread::get_id()) ^ size_t(std::chrono::steady_clock::now().time_since_epoch().count());
+        const auto temporary_path = cache_path.parent_path() / (cache_path.stem().string() + ".tmp" + std::to_string(writer_id) + ".f32");
+        if (!writeFloatImage(temporary_path, decoded.width, decoded.height, int(sizeof(T) / sizeof(float)), reinterpret_cast<const float*>(decoded.data.data()))) {
+            std::cerr << "Failed to write image cache " << temporary_path << std::endl;
+            throw std::exception();
+        }
+        std::filesystem::rename(temporary_path, cache_path);
+    }
+    return MappedImage<T>(cache_path);
+}
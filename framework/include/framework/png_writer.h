@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+/// <summary>
+/// Multi-threaded PNG encoder for 8-bit images (16-bit overload below).
+///
+/// Scanlines are filtered in parallel (same per-row filter heuristic as stb_image_write) and the
+/// filtered data is split into row chunks that are deflated independently, one IDAT chunk each.
+/// Every chunk may still reference the 32 KiB preceding it, so compression stays close to a
+/// single stream. Non-final chunks end with an empty stored block (a zlib "sync flush"), which
+/// byte-aligns them for concatenation; the result is one standard zlib stream.
+/// The chunking depends only on the image size, so the output does not depend on the thread count.
+/// </summary>
+/// <param name="width">image width</param>
+/// <param name="height">image height</param>
+/// <param name="channels">bytes per pixel, 1 to 4 (gray, gray + alpha, RGB, RGBA)</param>
+/// <param name="pixels">rows of width * channels bytes, top to bottom, without padding</param>
+/// <returns>the encoded file</returns>
+std::vector<uint8_t> encodePng(const int width, const int height, const int channels, const uint8_t* pixels);
+
+/// <summary>
+/// Encodes the pixels with encodePng() and writes them to the file.
+/// </summary>
+/// <returns>false if the file could not be written</returns>
+bool writePng(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint8_t* pixels);
+
+/// <summary>
+/// encodePng() of 16-bit samples (PNG bit depth 16), filtered on 2-byte samples and compressed
+/// in the same parallel chunks.
+/// </summary>
+/// <param name="channels">samples per pixel, 1 to 4</param>
+/// <param name="pixels">rows of width * channels samples in native byte order, top to bottom, without padding</param>
+std::vector<uint8_t> encodePng(const int width, const int height, const int channels, const uint16_t* pixels);
+bool writePng(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint16_t* pixels);
+
+/// <summary>
+/// One zlib stream of the data, deflated as in encodePng(): in independent chunks compressed in
+/// parallel when called outside a parallel region. Used by the TIFF writer (tiff_writer.h).
+/// </summary>
+std::vector<uint8_t> zlibCompress(const uint8_t* data, const size_t size);
@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <vector>
+
+/// <summary>
+/// Scanline decoder for Radiance RGBE (.hdr) files.
+///
+/// Decodes one scanline at a time into caller-provided RGB floats, so a full image can be
+/// decoded straight into its final buffer and very large files can be processed in bands.
+/// Supports the "-Y height +X width" orientation with flat or new-style run-length encoded
+/// scanlines, like stb_image. The RGBE to float conversion matches stbi_loadf() bit for bit.
+/// </summary>
+class RadianceHdrReader {
+public:
+    // Throws std::exception (after printing the reason) when the file cannot be opened or parsed.
+    explicit RadianceHdrReader(const std::filesystem::path& filePath);
+    ~RadianceHdrReader();
+
+    RadianceHdrReader(const RadianceHdrReader&) = delete;
+    RadianceHdrReader& operator=(const RadianceHdrReader&) = delete;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    // Index of the scanline returned by the next readScanline() call.
+    int nextRow() const { return m_next_row; }
+
+    /// <summary>
+    /// Decodes the next scanline into 3 * width() floats (RGB, interleaved).
+    /// </summary>
+    /// <returns>false at the end of the image or on a decoding error</returns>
+    bool readScanline(float* rgb);
+
+    /// <summary>
+    /// Decodes all remaining scanlines into 3 * width() floats per row, rows back to back.
+    /// The compressed rest of the file is read at once, a scan pass locates the scanline starts,
+    /// then bands of scanlines are decoded and converted on all threads. on_row(y) runs on the
+    /// decoding thread after scanline y is converted, while it is still in cache; it is called
+    /// concurrently for different rows.
+    /// </summary>
+    /// <returns>false on a decoding error, rgb is then partially written</returns>
+    bool readImage(float* rgb, const std::function<void(int)>& on_row = {});
+
+    /// <summary>
+    /// True when the file starts with a Radiance signature.
+    /// </summary>
+    static bool isRadianceFile(const std::filesystem::path& filePath);
+
+private:
+    bool readRgbeScanline();
+    // Offsets of the scanlines of the remaining rows in bytes, false when they are malformed.
+    bool locateScanlines(const std::vector<uint8_t>& bytes, std::vector<size_t>& offsets);
+
+    std::FILE* m_file = nullptr;
+    int m_width = 0;
+    int m_height = 0;
+    int m_next_row = 0;
+    // Scanlines are stored flat instead of run-length encoded.
+    bool m_flat = false;
+    // RGBE bytes of the current scanline.
+    std::vector<uint8_t> m_rgbe;
+};
+
+/// <summary>
+/// Scanline encoder for Radiance RGBE (.hdr) files, the counterpart of RadianceHdrReader.
+///
+/// Scanlines are written top to bottom as they are produced, run-length encoded when the width
+/// allows it, so an image never has to be held in memory as a whole.
+/// </summary>
+class RadianceHdrWriter {
+public:
+    // Creates missing parent directories. Throws std::exception when the file cannot be created.
+    RadianceHdrWriter(const std::filesystem::path& filePath, const int width, const int height);
+    ~RadianceHdrWriter();
+
+    RadianceHdrWriter(const RadianceHdrWriter&) = delete;
+    RadianceHdrWriter& operator=(const RadianceHdrWriter&) = delete;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    // Index of the scanline written by the next writeScanline() call.
+    int nextRow() const { return m_next_row; }
+
+    /// <summary>
+    /// Encodes the next scanline from 3 * width() floats (RGB, interleaved).
+    /// </summary>
+    /// <returns>false when all rows were already written or on a write error</returns>
+    bool writeScanline(const float* rgb);
+
+private:
+    std::FILE* m_file = nullptr;
+    int m_width = 0;
+    int m_height = 0;
+    int m_next_row = 0;
+    std::vector<uint8_t> m_rgbe;
+    std::vector<uint8_t> m_encoded;
+};
+
+/// <summary>
+/// Converts RGBE bytes to linear RGB floats the same way stb_image does.
+/// </summary>
+void rgbeToFloat(const uint8_t* rgbe, float* rgb, const int num_pixels);
+
+/// <summary>
+/// Converts linear RGB floats to RGBE bytes the same way stb_image_write does.
+/// </summary>
+void floatToRgbe(const float* rgb, uint8_t* rgbe, const int num_pixels);
@@ -0,0 +1,182 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include <framework/float_image_io.h>
+#include <framework/image_view.h>
+
+/*
+ * Images exchanged between processes in shared memory.
+ *
+ * A named POSIX shared-memory segment holds a .f32 image (see float_image_io.h): the 64-byte
+ * RawFloatHeader followed by the pixels, rows top to bottom, channels interleaved. One process
+ * creates the segment and writes the pixels once, another maps the same physical pages by name:
+ * nothing is encoded, decoded or rounded, and the pages are not copied between the processes.
+ * A segment lives until it is unlinked (or the machine restarts), so the producer may exit
+ * before the consumer starts; creating a segment of an existing name replaces it.
+ *
+ * Processes refer to a segment with a path "shm:<name>" wherever an image file is accepted:
+ * Image(path) and probeImage() read it, Image::writeToFile() creates it. The name is a single
+ * word without '/'. The descriptor line "a1_hdr-shm <name> <width> <height> <channels>" carries
+ * it between processes together with the size, see SharedImageDescriptor.
+ */
+
+/// <summary>
+/// True for "shm:<name>" paths of shared-memory images.
+/// </summary>
+inline bool isSharedImagePath(const std::filesystem::path& filePath)
+{
+    return filePath.native().starts_with("shm:");
+}
+
+/// <summary>
+/// Segment name of a "shm:<name>" path.
+/// </summary>
+inline std::string sharedImageName(const std::filesystem::path& filePath)
+{
+    return filePath.string().substr(4);
+}
+
+/// <summary>
+/// Read-write or read-only mapping of a named shared-memory segment.
+/// </summary>
+class SharedMemory {
+public:
+    SharedMemory() = default;
+    ~SharedMemory();
+
+    SharedMemory(SharedMemory&& other) noexcept;
+    SharedMemory& operator=(SharedMemory&& other) noexcept;
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    // Creates a zeroed segment of size bytes, replacing one of the same name. Throws
+    // std::exception (after printing the reason) on failure, like the calls below.
+    static SharedMemory create(const std::string& name, size_t size);
+    // Maps an existing segment read-only.
+    static SharedMemory open(const std::string& name);
+    // Removes the name; mappings stay valid until they are unmapped.
+    static bool unlink(const std::string& name);
+
+    uint8_t* data() { return static_cast<uint8_t*>(m_address); }
+    const uint8_t* data() const { return static_cast<const uint8_t*>(m_address); }
+    size_t size() const { return m_size; }
+
+private:
+    void unmap();
+
+    void* m_address = nullptr;
+    size_t m_size = 0;
+};
+
+/// <summary>
+/// Name and size of a shared-memory image, as passed between processes.
+/// </summary>
+struct SharedImageDescriptor {
+    std::string name;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+
+    std::string toString() const { return "a1_hdr-shm " + name + " " + std::to_string(width) + " " + std::to_string(height) + " " + std::to_string(channels); }
+
+    /// <summary>
+    /// Parses a descriptor line, nothing when it is not one.
+    /// </summary>
+    static std::optional<SharedImageDescriptor> parse(const std::string& line);
+};
+
+/// <summary>
+/// Image of T pixels in a shared-memory segment, see above. A created image is writable
+/// through view(), an opened one is read-only.
+/// </summary>
+template <typename T>
+class SharedImage {
+public:
+    static constexpr uint32_t type_channels = uint32_t(sizeof(T) / sizeof(float));
+
+    /// <summary>
+    /// Creates the segment "name" for a width x height image; its pixels are zero.
+    /// </summary>
+    static SharedImage create(const std::string& name, const int width, const int height)
+    {
+        SharedImage image;
+        image.m_memory = SharedMemory::create(name, sizeof(RawFloatHeader) + size_t(width) * size_t(height) * sizeof(T));
+        RawFloatHeader header;
+        header.width = uint32_t(width);
+        header.height = uint32_t(height);
+        header.channels = type_channels;
+        std::memcpy(image.m_memory.data(), &header, sizeof(header));
+        image.m_descriptor = { name, width, height, int(type_channels) };
+        return image;
+    }
+
+    /// <summary>
+    /// Maps the segment "name" read-only. Its channels may differ from T, see channels().
+    /// </summary>
+    static SharedImage open(const std::string& name)
+    {
+        SharedImage image;
+        image.m_memory = SharedMemory::open(name);
+        RawFloatHeader header;
+        if (image.m_memory.size() < sizeof(header) || (std::memcpy(&header, image.m_memory.data(), sizeof(header)), header.magic != RawFloatHeader::MAGIC)
+            || header.version != RawFloatHeader::VERSION || (header.channels != 1 && header.channels != 3)
+            || image.m_memory.size() < sizeof(header) + size_t(header.width) * size_t(header.height) * header.channels * sizeof(float)) {
+            std::cerr << "Shared memory segment " << name << " does not hold an image" << std::endl;
+            throw std::exception();
+        }
+        image.m_descriptor = { name, int(header.width), int(header.height), int(header.channels) };
+        return image;
+    }
+
+    int width() const { return m_descriptor.width; }
+    int height() const { return m_descriptor.height; }
+    int channels() const { return m_descriptor.channels; }
+    const SharedImageDescriptor& descriptor() const { return m_descriptor; }
+
+    /// <summary>
+    /// Interleaved floats of the pixels (channels() per pixel), 64-byte aligned.
+    /// </summary>
+    const float* floats() const { return reinterpret_cast<const float*>(m_memory.data() + sizeof(RawFloatHeader)); }
+
+    /// <summary>
+    /// The pixels in place, when the segment has the channels of T.
+    /// </summary>
+    ImageView<const T> view() const
+    {
+        checkChannels();
+        return ImageView<const T>(reinterpret_cast<const T*>(floats()), width(), height(), width());
+    }
+    ImageView<T> view()
+    {
+        checkChannels();
+        return ImageView<T>(reinterpret_cast<T*>(m_memory.data() + sizeof(RawFloatHeader)), width(), height(), width());
+    }
+
+private:
+    void checkChannels() const
+    {
+        if (uint32_t(channels()) != type_channels) {
+            std::cerr << "Shared image " << m_descriptor.name << " has " << channels() << " channels" << std::endl;
+            throw std::exception();
+        }
+    }
+
+    SharedMemory m_memory;
+    SharedImageDescriptor m_descriptor;
+};
+
+/// <summary>
+/// Header of the shared image "name" without mapping its pixels for writing.
+/// </summary>
+inline SharedImageDescriptor probeSharedImage(const std::string& name)
+{
+    return SharedImage<float>::open(name).descriptor();
+}
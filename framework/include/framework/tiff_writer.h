@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+/// <summary>
+/// Multi-threaded encoder of 16-bit TIFF images (baseline TIFF, little-endian, chunky).
+///
+/// The rows are stored in strips of about 256 KiB, each with horizontal differencing (TIFF
+/// predictor 2) and Deflate compression (compression 8, one zlib stream per strip); the strips
+/// are predicted and compressed in parallel. Like encodePng() the strips depend only on the
+/// image size, so the output does not depend on the thread count.
+/// </summary>
+/// <param name="width">image width</param>
+/// <param name="height">image height</param>
+/// <param name="channels">samples per pixel, 1 to 4 (gray, gray + alpha, RGB, RGBA)</param>
+/// <param name="pixels">rows of width * channels samples, top to bottom, without padding</param>
+/// <returns>the encoded file</returns>
+std::vector<uint8_t> encodeTiff(const int width, const int height, const int channels, const uint16_t* pixels);
+
+/// <summary>
+/// Encodes the pixels with encodeTiff() and writes them to the file.
+/// </summary>
+/// <returns>false if the file could not be written</returns>
+bool writeTiff(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint16_t* pixels);
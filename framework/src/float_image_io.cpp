@@ -0,0 +1,417 @@
+#include "float_image_io.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool isHostLittleEndian()
+{
+    const uint16_t probe = 1;
+    uint8_t first;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+void swapBytes(float* values, const size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint8_t bytes[4];
+        std::memcpy(bytes, values + i, 4);
+        std::swap(bytes[0], bytes[3]);
+        std::swap(bytes[1], bytes[2]);
+        std::memcpy(values + i, bytes, 4);
+    }
+}
+
+float halfToFloat(const uint16_t half)
+{
+    const uint32_t sign = uint32_t(half & 0x8000) << 16;
+    const int exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13); // Inf / NaN
+    } else if (exponent != 0) {
+        bits = sign | (uint32_t(exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign; // +-0
+    } else {
+        // Subnormal half: normalize.
+        int e = -1;
+        do {
+            e++;
+            mantissa <<= 1;
+        } while (!(mantissa & 0x400));
+        bits = sign | (uint32_t(127 - 15 - e) << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+// Little-endian scalar of the EXR header / raw header.
+template <typename T>
+T readLittleEndian(const uint8_t* bytes)
+{
+    T value {};
+    uint8_t ordered[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++) {
+        ordered[i] = bytes[isHostLittleEndian() ? i : sizeof(T) - 1 - i];
+    }
+    std::memcpy(&value, ordered, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void appendLittleEndian(std::vector<uint8_t>& out, const T value)
+{
+    uint8_t bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); i++) {
+        out.push_back(bytes[isHostLittleEndian() ? i : sizeof(T) - 1 - i]);
+    }
+}
+
+void appendExrAttribute(std::vector<uint8_t>& out, const char* name, const char* type, const std::vector<uint8_t>& value)
+{
+    out.insert(out.end(), name, name + std::strlen(name) + 1);
+    out.insert(out.end(), type, type + std::strlen(type) + 1);
+    appendLittleEndian(out, int32_t(value.size()));
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+[[noreturn]] void failToParse(const std::filesystem::path& filePath, const char* reason)
+{
+    std::cerr << "Failed to read float image " << filePath << ": " << reason << std::endl;
+    throw std::exception();
+}
+
+} // namespace
+
+bool isFloatImageFile(const std::filesystem::path& filePath)
+{
+    const auto extension = filePath.extension();
+    return extension == ".pfm" || extension == ".f32" || extension == ".exr";
+}
+
+FloatImageReader::FloatImageReader(const std::filesystem::path& filePath)
+{
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    m_file = std::fopen(filePathStr.c_str(), "rb");
+    if (!m_file) {
+        failToParse(filePath, "cannot open file");
+    }
+    try {
+        const auto extension = filePath.extension();
+        if (extension == ".pfm") {
+            parsePfm(filePath);
+        } else if (extension == ".exr") {
+            parseExr(filePath);
+        } else {
+            parseRaw(filePath);
+        }
+    } catch (...) {
+        std::fclose(m_file);
+        throw;
+    }
+}
+
+FloatImageReader::~FloatImageReader()
+{
+    if (m_file) {
+        std::fclose(m_file);
+    }
+}
+
+void FloatImageReader::parsePfm(const std::filesystem::path& filePath)
+{
+    m_format = Format::Pfm;
+    char type[3] = {};
+    float scale = 0.0f;
+    if (std::fscanf(m_file, "%2s %d %d %f", type, &m_width, &m_height, &scale) != 4 || m_width <= 0 || m_height <= 0 || scale == 0.0f) {
+        failToParse(filePath, "invalid PFM header");
+    }
+    if (std::strcmp(type, "PF") == 0) {
+        m_channels = 3;
+    } else if (std::strcmp(type, "Pf") == 0) {
+        m_channels = 1;
+    } else {
+        failToParse(filePath, "not a PFM file");
+    }
+    // A single whitespace character separates the header from the data.
+    std::fgetc(m_file);
+    m_data_offset = std::ftell(m_file);
+    // The sign of the scale encodes the byte order: negative is little-endian.
+    m_swap_bytes = (scale < 0.0f) != isHostLittleEndian();
+}
+
+void FloatImageReader::parseRaw(const std::filesystem::path& filePath)
+{
+    m_format = Format::Raw;
+    uint8_t bytes[sizeof(RawFloatHeader)];
+    if (std::fread(bytes, 1, sizeof(bytes), m_file) != sizeof(bytes) || readLittleEndian<uint32_t>(bytes) != RawFloatHeader::MAGIC) {
+        failToParse(filePath, "not a raw float image");
+    }
+    if (readLittleEndian<uint32_t>(bytes + 4) != RawFloatHeader::VERSION) {
+        failToParse(filePath, "unsupported raw float image version");
+    }
+    m_width = int(readLittleEndian<uint32_t>(bytes + 8));
+    m_height = int(readLittleEndian<uint32_t>(bytes + 12));
+    m_channels = int(readLittleEndian<uint32_t>(bytes + 16));
+    if (m_width <= 0 || m_height <= 0 || (m_channels != 1 && m_channels != 3)) {
+        failToParse(filePath, "invalid raw float image size");
+    }
+    m_data_offset = long(sizeof(RawFloatHeader));
+    m_swap_bytes = !isHostLittleEndian();
+}
+
+void FloatImageReader::parseExr(const std::filesystem::path& filePath)
+{
+    m_format = Format::Exr;
+    uint8_t start[8];
+    if (std::fread(start, 1, 8, m_file) != 8 || readLittleEndian<uint32_t>(start) != 20000630) {
+        failToParse(filePath, "not an OpenEXR file");
+    }
+    if ((readLittleEndian<uint32_t>(start + 4) & 0xFFFFFF00) != 0 || start[4] != 2) {
+        failToParse(filePath, "only single-part scanline OpenEXR files are supported");
+    }
+
+    const auto readString = [&]() {
+        std::string result;
+        int c;
+        while ((c = std::fgetc(m_file)) != EOF && c != 0) {
+            result.push_back(char(c));
+        }
+        return result;
+    };
+
+    std::vector<std::string> channel_names;
+    std::vector<int32_t> channel_types;
+    bool has_window = false;
+    while (true) {
+        const auto name = readString();
+        if (name.empty()) {
+            break;
+        }
+        const auto type = readString();
+        uint8_t size_bytes[4];
+        if (std::fread(size_bytes, 1, 4, m_file) != 4) {
+            failToParse(filePath, "truncated header");
+        }
+        std::vector<uint8_t> value(readLittleEndian<uint32_t>(size_bytes));
+        if (std::fread(value.data(), 1, value.size(), m_file) != value.size()) {
+            failToParse(filePath, "truncated header");
+        }
+
+        if (name == "channels") {
+            // Sequence of (name, pixel type, pLinear + 3 reserved bytes, x/y sampling), null-terminated.
+            size_t pos = 0;
+            while (pos < value.size() && value[pos] != 0) {
+                const std::string channel(reinterpret_cast<const char*>(value.data() + pos));
+                pos += channel.size() + 1;
+                if (pos + 16 > value.size()) {
+                    failToParse(filePath, "invalid channel list");
+                }
+                channel_names.push_back(channel);
+                channel_types.push_back(readLittleEndian<int32_t>(value.data() + pos));
+                if (readLittleEndian<int32_t>(value.data() + pos + 8) != 1 || readLittleEndian<int32_t>(value.data() + pos + 12) != 1) {
+                    failToParse(filePath, "subsampled channels are not supported");
+                }
+                pos += 16;
+            }
+        } else if (name == "compression") {
+            if (value.empty() || value[0] != 0) {
+                failToParse(filePath, "only uncompressed OpenEXR files are supported");
+            }
+        } else if (name == "dataWindow" && value.size() == 16) {
+            const int x_min = readLittleEndian<int32_t>(value.data());
+            const int y_min = readLittleEndian<int32_t>(value.data() + 4);
+            const int x_max = readLittleEndian<int32_t>(value.data() + 8);
+            const int y_max = readLittleEndian<int32_t>(value.data() + 12);
+            m_width = x_max - x_min + 1;
+            m_height = y_max - y_min + 1;
+            has_window = true;
+        }
+    }
+
+    if (!has_window || m_width <= 0 || m_height <= 0) {
+        failToParse(filePath, "missing data window");
+    }
+    // Channels are stored in alphabetical order.
+    if (channel_names.size() == 1) {
+        m_channels = 1;
+    } else if (channel_names == std::vector<std::string> { "B", "G", "R" }) {
+        m_channels = 3;
+        m_exr_channel_target[0] = 2;
+        m_exr_channel_target[1] = 1;
+        m_exr_channel_target[2] = 0;
+    } else {
+        failToParse(filePath, "only Y or RGB channels are supported");
+    }
+    // Pixel types: 1 = half, 2 = float.
+    if (std::any_of(channel_types.begin(), channel_types.end(), [&](const int32_t t) { return t != channel_types[0]; })
+        || (channel_types[0] != 1 && channel_types[0] != 2)) {
+        failToParse(filePath, "only float or half channels of one type are supported");
+    }
+    m_exr_half = channel_types[0] == 1;
+    m_data_offset = std::ftell(m_file);
+}
+
+bool FloatImageReader::readRow(const int y, float* pixels)
+{
+    if (y < 0 || y >= m_height) {
+        return false;
+    }
+    const size_t row_values = size_t(m_width) * size_t(m_channels);
+
+    if (m_format != Format::Exr) {
+        // PFM stores the bottom row first.
+        const int stored_row = m_format == Format::Pfm ? m_height - 1 - y : y;
+        if (std::fseek(m_file, m_data_offset + long(stored_row) * long(row_values * sizeof(float)), SEEK_SET) != 0
+            || std::fread(pixels, sizeof(float), row_values, m_file) != row_values) {
+            return false;
+        }
+        if (m_swap_bytes) {
+            swapBytes(pixels, row_values);
+        }
+        return true;
+    }
+
+    // EXR: the offset table holds one 64-bit file offset per scanline block (one line each).
+    uint8_t bytes[8];
+    if (std::fseek(m_file, m_data_offset + long(y) * 8, SEEK_SET) != 0 || std::fread(bytes, 1, 8, m_file) != 8) {
+        return false;
+    }
+    const auto block_offset = long(readLittleEndian<uint64_t>(bytes));
+    const size_t value_bytes = m_exr_half ? 2 : 4;
+    std::vector<uint8_t> block(8 + row_values * value_bytes);
+    if (std::fseek(m_file, block_offset, SEEK_SET) != 0 || std::fread(block.data(), 1, block.size(), m_file) != block.size()
+        || size_t(readLittleEndian<uint32_t>(block.data() + 4)) != row_values * value_bytes) {
+        return false;
+    }
+    // Channels are stored one after the other (planar) within the line.
+    for (int c = 0; c < m_channels; c++) {
+        const uint8_t* src = block.data() + 8 + size_t(c) * size_t(m_width) * value_bytes;
+        const int target = m_exr_channel_target[c];
+        for (int x = 0; x < m_width; x++) {
+            pixels[size_t(x) * m_channels + target] = m_exr_half
+                ? halfToFloat(readLittleEndian<uint16_t>(src + size_t(x) * 2))
+                : readLittleEndian<float>(src + size_t(x) * 4);
+        }
+    }
+    return true;
+}
+
+bool writeFloatImage(const std::filesystem::path& filePath, const int width, const int height, const int channels, const float* pixels)
+{
+    if (!isFloatImageFile(filePath) || (channels != 1 && channels != 3)) {
+        return false;
+    }
+    // Create a folder.
+    if (filePath.has_parent_path() && !std::filesystem::is_directory(filePath.parent_path())) {
+        std::filesystem::create_directories(filePath.parent_path());
+    }
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    std::FILE* file = std::fopen(filePathStr.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    const size_t row_values = size_t(width) * size_t(channels);
+    const auto extension = filePath.extension();
+    bool ok = true;
+    if (extension == ".pfm") {
+        // Negative scale: little-endian data. Rows go bottom to top.
+        std::fprintf(file, "%s\n%d %d\n%s\n", channels == 3 ? "PF" : "Pf", width, height, isHostLittleEndian() ? "-1.0" : "1.0");
+        for (int y = height - 1; y >= 0 && ok; y--) {
+            ok = std::fwrite(pixels + size_t(y) * row_values, sizeof(float), row_values, file) == row_values;
+        }
+    } else if (extension == ".f32") {
+        std::vector<uint8_t> header;
+        appendLittleEndian(header, RawFloatHeader::MAGIC);
+        appendLittleEndian(header, RawFloatHeader::VERSION);
+        appendLittleEndian(header, uint32_t(width));
+        appendLittleEndian(header, uint32_t(height));
+        appendLittleEndian(header, uint32_t(channels));
+        header.resize(sizeof(RawFloatHeader), 0);
+        ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+        std::vector<float> swapped;
+        for (int y = 0; y < height && ok; y++) {
+            const float* row = pixels + size_t(y) * row_values;
+            if (!isHostLittleEndian()) {
+                swapped.assign(row, row + row_values);
+                swapBytes(swapped.data(), row_values);
+                row = swapped.data();
+            }
+            ok = std::fwrite(row, sizeof(float), row_values, file) == row_values;
+        }
+    } else {
+        // OpenEXR header: magic, version 2 (single-part scanline), attributes.
+        std::vector<uint8_t> header;
+        appendLittleEndian(header, uint32_t(20000630));
+        appendLittleEndian(header, uint32_t(2));
+
+        // Channels in alphabetical order, pixel type 2 = float.
+        const std::vector<std::string> names = channels == 3 ? std::vector<std::string> { "B", "G", "R" } : std::vector<std::string> { "Y" };
+        const int source_channel[3] = { 2, 1, 0 };
+        std::vector<uint8_t> channel_list;
+        for (const auto& name : names) {
+            channel_list.insert(channel_list.end(), name.begin(), name.end());
+            channel_list.push_back(0);
+            appendLittleEndian(channel_list, int32_t(2)); // pixel type
+            channel_list.insert(channel_list.end(), { 0, 0, 0, 0 }); // pLinear, reserved
+            appendLittleEndian(channel_list, int32_t(1)); // x sampling
+            appendLittleEndian(channel_list, int32_t(1)); // y sampling
+        }
+        channel_list.push_back(0);
+        std::vector<uint8_t> window;
+        for (const int32_t v : { 0, 0, width - 1, height - 1 }) {
+            appendLittleEndian(window, v);
+        }
+        std::vector<uint8_t> one;
+        appendLittleEndian(one, 1.0f);
+        std::vector<uint8_t> center;
+        appendLittleEndian(center, 0.0f);
+        appendLittleEndian(center, 0.0f);
+
+        appendExrAttribute(header, "channels", "chlist", channel_list);
+        appendExrAttribute(header, "compression", "compression", { 0 });
+        appendExrAttribute(header, "dataWindow", "box2i", window);
+        appendExrAttribute(header, "displayWindow", "box2i", window);
+        appendExrAttribute(header, "lineOrder", "lineOrder", { 0 });
+        appendExrAttribute(header, "pixelAspectRatio", "float", one);
+        appendExrAttribute(header, "screenWindowCenter", "v2f", center);
+        appendExrAttribute(header, "screenWindowWidth", "float", one);
+        header.push_back(0);
+
+        // Offset table: one uncompressed line per block of 8 + row_values * 4 bytes.
+        const uint64_t first_block = header.size() + size_t(height) * 8;
+        const uint64_t block_bytes = 8 + row_values * 4;
+        for (int y = 0; y < height; y++) {
+            appendLittleEndian(header, first_block + uint64_t(y) * block_bytes);
+        }
+        ok = std::fwrite(header.data(), 1, header.size(), file) == header.size();
+
+        std::vector<uint8_t> block;
+        block.reserve(block_bytes);
+        for (int y = 0; y < height && ok; y++) {
+            block.clear();
+            appendLittleEndian(block, int32_t(y));
+            appendLittleEndian(block, int32_t(row_values * 4));
+            const float* row = pixels + size_t(y) * row_values;
+            for (int c = 0; c < channels; c++) {
+                const int source = channels == 3 ? source_channel[c] : 0;
+                for (int x = 0; x < width; x++) {
+                    appendLittleEndian(block, row[size_t(x) * channels + source]);
+                }
+            }
+            ok = std::fwrite(block.data(), 1, block.size(), file) == block.size();
+        }
+    }
+    return std::fclose(file) == 0 && ok;
+}
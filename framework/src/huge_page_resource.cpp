@@ -0,0 +1,106 @@
+#include "huge_page_resource.h"
+
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+size_t roundToLargePages(const size_t bytes)
+{
+    return (bytes + HugePageResource::LARGE_PAGE_BYTES - 1) / HugePageResource::LARGE_PAGE_BYTES * HugePageResource::LARGE_PAGE_BYTES;
+}
+
+#ifdef _WIN32
+// Large pages need SeLockMemoryPrivilege enabled on the process token, tried once.
+bool enableLargePages()
+{
+    static const bool enabled = [] {
+        HANDLE token;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+            return false;
+        }
+        TOKEN_PRIVILEGES privileges {};
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        const bool ok = LookupPrivilegeValueW(nullptr, L"SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+            && AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(token);
+        return ok && GetLargePageMinimum() != 0 && HugePageResource::LARGE_PAGE_BYTES % GetLargePageMinimum() == 0;
+    }();
+    return enabled;
+}
+#endif
+
+}
+
+void* HugePageResource::do_allocate(const size_t bytes, const size_t alignment)
+{
+    if (!isMapped(bytes, alignment)) {
+        upstream_count++;
+        return upstream->allocate(bytes, alignment);
+    }
+    const size_t mapped_bytes = roundToLargePages(bytes);
+
+#ifdef _WIN32
+    if (enableLargePages()) {
+        if (void* p = VirtualAlloc(nullptr, mapped_bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) {
+            huge_pages++;
+            return p;
+        }
+    }
+    if (void* p = VirtualAlloc(nullptr, mapped_bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) {
+        regular_pages++;
+        return p;
+    }
+#else
+#ifdef MAP_HUGETLB
+    // Fails without reserved huge pages (vm.nr_hugepages), which is the common case.
+    void* p = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        huge_pages++;
+        return p;
+    }
+#endif
+    // Over-allocate by one large page so the buffer can start on a large-page boundary, which
+    // transparent huge pages need; the unused head and tail are unmapped again.
+    void* region = mmap(nullptr, mapped_bytes + LARGE_PAGE_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region != MAP_FAILED) {
+        const auto start = reinterpret_cast<uintptr_t>(region);
+        const uintptr_t aligned = (start + LARGE_PAGE_BYTES - 1) / LARGE_PAGE_BYTES * LARGE_PAGE_BYTES;
+        if (aligned > start) {
+            munmap(region, aligned - start);
+        }
+        const uintptr_t end = aligned + mapped_bytes;
+        if (start + mapped_bytes + LARGE_PAGE_BYTES > end) {
+            munmap(reinterpret_cast<void*>(end), start + mapped_bytes + LARGE_PAGE_BYTES - end);
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(reinterpret_cast<void*>(aligned), mapped_bytes, MADV_HUGEPAGE);
+#endif
+        regular_pages++;
+        return reinterpret_cast<void*>(aligned);
+    }
+#endif
+    throw std::bad_alloc();
+}
+
+void HugePageResource::do_deallocate(void* p, const size_t bytes, const size_t alignment)
+{
+    if (!isMapped(bytes, alignment)) {
+        upstream->deallocate(p, bytes, alignment);
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, roundToLargePages(bytes));
+#endif
+}
@@ -26,26 +26,32 @@ glm::vec3 stbfToType<glm::vec3>(const float* src)
     return glm::vec3(src[0], src[1], src[2]);
 }
 
-
-
-
-inline auto floatToStb(const float value)
+ImageInfo probeImage(const std::filesystem::path& filePath)
 {
-    return stbi_uc(std::min<float>(std::max<float>(value, 0.0f), 1.0f) * 255);
-}
-
-template<>
-void typeToRgbUint8(stbi_uc* dst, const float& value)
-{
-    auto f_val = floatToStb(value);
-    dst[0] = f_val;
-    dst[1] = f_val;
-    dst[2] = f_val;
-}
-
-template <>
-void typeToRgbUint8(stbi_uc* dst, const glm::vec3& value) {
-    dst[0] = floatToStb(value.r);
-    dst[1] = floatToStb(value.g);
-    dst[2] = floatToStb(value.b);
+    if (isSharedImagePath(filePath)) {
+        const auto shared = probeSharedImage(sharedImageName(filePath));
+        return { shared.width, shared.height, shared.channels, true };
+    }
+    if (!std::filesystem::exists(filePath)) {
+        std::cerr << "Image file " << filePath << " does not exists!" << std::endl;
+        throw std::exception();
+    }
+    // Same format order as the Image(filePath) constructor; the readers parse only the header.
+    if (isFloatImageFile(filePath)) {
+        const FloatImageReader reader(filePath);
+        return { reader.width(), reader.height(), reader.channels(), true };
+    }
+    if (RadianceHdrReader::isRadianceFile(filePath)) {
+        const RadianceHdrReader reader(filePath);
+        return { reader.width(), reader.height(), 3, true };
+    }
+
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    ImageInfo info;
+    if (!stbi_info(filePathStr.c_str(), &info.width, &info.height, &info.channels)) {
+        std::cerr << "Failed to read the header of image " << filePath << " using stb_image.h" << std::endl;
+        throw std::exception();
+    }
+    info.hdr = stbi_is_hdr(filePathStr.c_str()) != 0;
+    return info;
 }
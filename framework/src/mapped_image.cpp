@@ -0,0 +1,104 @@
+#include "mapped_image.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::filesystem::path& filePath)
+{
+    const auto fail = [&](const char* reason) {
+        std::cerr << "Failed to map " << filePath << ": " << reason << std::endl;
+        throw std::exception();
+    };
+
+#ifdef _WIN32
+    const HANDLE file = CreateFileW(filePath.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        fail("cannot open file");
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        fail("empty file");
+    }
+    m_size = size_t(file_size.QuadPart);
+    m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file); // The mapping keeps the file open.
+    if (!m_mapping) {
+        fail("CreateFileMapping failed");
+    }
+    m_address = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_address) {
+        CloseHandle(m_mapping);
+        fail("MapViewOfFile failed");
+    }
+#else
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    const int fd = open(filePathStr.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fail("cannot open file");
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        fail("empty file");
+    }
+    m_size = size_t(file_stat.st_size);
+    void* address = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file open.
+    if (address == MAP_FAILED) {
+        fail("mmap failed");
+    }
+    m_address = address;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : m_address(std::exchange(other.m_address, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+#ifdef _WIN32
+    , m_mapping(std::exchange(other.m_mapping, nullptr))
+#endif
+{
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other) {
+        unmap();
+        m_address = std::exchange(other.m_address, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+#ifdef _WIN32
+        m_mapping = std::exchange(other.m_mapping, nullptr);
+#endif
+    }
+    return *this;
+}
+
+void MappedFile::unmap()
+{
+    if (!m_address) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_address);
+    CloseHandle(m_mapping);
+    m_mapping = nullptr;
+#else
+    munmap(m_address, m_size);
+#endif
+    m_address = nullptr;
+    m_size = 0;
+}
@@ -0,0 +1,488 @@
+#include "png_writer.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+// Filtered bytes per independently compressed chunk (rounded to whole rows).
+constexpr size_t PNG_CHUNK_BYTES = 256 * 1024;
+// Deflate window.
+constexpr int DEFLATE_WINDOW = 32768;
+constexpr int DEFLATE_HASH_SIZE = 16384;
+// Candidates kept per hash bucket, as stb_image_write at its default compression level.
+constexpr int DEFLATE_QUALITY = 8;
+
+// Bit-level output buffer; deflate fields are packed starting at the least significant bit.
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out)
+        : m_out(out)
+    {
+    }
+
+    void add(const uint32_t code, const int num_bits)
+    {
+        m_buffer |= code << m_count;
+        m_count += num_bits;
+        while (m_count >= 8) {
+            m_out.push_back(uint8_t(m_buffer));
+            m_buffer >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    // Huffman codes are stored most significant bit first.
+    void addReversed(const uint32_t code, const int num_bits)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < num_bits; i++) {
+            reversed |= ((code >> i) & 1) << (num_bits - 1 - i);
+        }
+        add(reversed, num_bits);
+    }
+
+    // Pads with zero bits to the next byte boundary.
+    void alignToByte()
+    {
+        if (m_count > 0) {
+            add(0, 8 - m_count);
+        }
+    }
+
+private:
+    std::vector<uint8_t>& m_out;
+    uint32_t m_buffer = 0;
+    int m_count = 0;
+};
+
+// Bit-reversed fixed Huffman codes of the literal/length symbols (RFC 1951, 3.2.6).
+struct FixedHuffmanTable {
+    std::array<uint16_t, 288> code;
+    std::array<uint8_t, 288> length;
+
+    FixedHuffmanTable()
+    {
+        for (int symbol = 0; symbol < 288; symbol++) {
+            uint32_t value;
+            int num_bits;
+            if (symbol <= 143) {
+                value = 0x30 + symbol, num_bits = 8;
+            } else if (symbol <= 255) {
+                value = 0x190 + symbol - 144, num_bits = 9;
+            } else if (symbol <= 279) {
+                value = symbol - 256, num_bits = 7;
+            } else {
+                value = 0xC0 + symbol - 280, num_bits = 8;
+            }
+            uint32_t reversed = 0;
+            for (int i = 0; i < num_bits; i++) {
+                reversed |= ((value >> i) & 1) << (num_bits - 1 - i);
+            }
+            code[symbol] = uint16_t(reversed);
+            length[symbol] = uint8_t(num_bits);
+        }
+    }
+};
+
+void addFixedSymbol(BitWriter& bits, const int symbol)
+{
+    static const FixedHuffmanTable table;
+    bits.add(table.code[symbol], table.length[symbol]);
+}
+
+uint32_t hash3(const uint8_t* data)
+{
+    // Same mixing as stb_image_write.
+    uint32_t hash = data[0] + (data[1] << 8) + (data[2] << 16);
+    hash ^= hash << 3;
+    hash += hash >> 5;
+    hash ^= hash << 4;
+    hash += hash >> 17;
+    hash ^= hash << 25;
+    hash += hash >> 6;
+    return hash & (DEFLATE_HASH_SIZE - 1);
+}
+
+int matchLength(const uint8_t* a, const uint8_t* b, const int limit)
+{
+    int i = 0;
+    while (i < limit && i < 258 && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+// Appends data[begin, end) as stored blocks.
+void storeChunk(const uint8_t* data, const size_t begin, const size_t end, const bool final, std::vector<uint8_t>& out)
+{
+    size_t pos = begin;
+    do {
+        const size_t length = std::min<size_t>(end - pos, 65535);
+        const bool last = pos + length == end;
+        out.push_back(uint8_t(final && last)); // BFINAL, BTYPE = 0 (stored), padded
+        out.push_back(uint8_t(length));
+        out.push_back(uint8_t(length >> 8));
+        out.push_back(uint8_t(~length));
+        out.push_back(uint8_t(~length >> 8));
+        out.insert(out.end(), data + pos, data + pos + length);
+        pos += length;
+    } while (pos < end);
+}
+
+/// Deflates data[begin, end) as one fixed-Huffman block with greedy + lazy LZ77 matching (the
+/// algorithm of stb_image_write). Matches may start in the window before begin but never extend
+/// past end. The output ends on a byte boundary: with an empty stored block unless final.
+std::vector<uint8_t> deflateChunk(const uint8_t* data, const size_t begin, const size_t end, const bool final)
+{
+    static const std::array<int, 30> length_base = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259 };
+    static const std::array<int, 29> length_extra = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const std::array<int, 31> dist_base = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32768 };
+    static const std::array<int, 30> dist_extra = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    // Positions per hash bucket; a full bucket drops its older half.
+    constexpr int bucket_capacity = 2 * DEFLATE_QUALITY;
+    // Slots beyond the bucket counts are never read, so the positions stay uninitialized.
+    const std::unique_ptr<int64_t[]> hash_positions(new int64_t[size_t(DEFLATE_HASH_SIZE) * bucket_capacity]);
+    std::vector<uint8_t> hash_counts(DEFLATE_HASH_SIZE, 0);
+    const auto insert = [&](const size_t pos) {
+        const uint32_t h = hash3(data + pos);
+        int64_t* bucket = hash_positions.get() + size_t(h) * bucket_capacity;
+        if (hash_counts[h] == bucket_capacity) {
+            std::copy(bucket + DEFLATE_QUALITY, bucket + bucket_capacity, bucket);
+            hash_counts[h] = DEFLATE_QUALITY;
+        }
+        bucket[hash_counts[h]++] = int64_t(pos);
+    };
+    // Preload the window preceding the chunk so references can cross the chunk boundary.
+    for (size_t pos = begin > size_t(DEFLATE_WINDOW) ? begin - DEFLATE_WINDOW : 0; pos < begin; pos++) {
+        insert(pos);
+    }
+
+    std::vector<uint8_t> out;
+    out.reserve((end - begin) / 2);
+    BitWriter bits(out);
+    bits.add(final ? 1 : 0, 1); // BFINAL
+    bits.add(1, 2); // BTYPE = 1, fixed Huffman
+
+    const auto best_match = [&](const size_t pos, const int64_t window, int best, const uint8_t** location) {
+        const uint32_t h = hash3(data + pos);
+        const int64_t* bucket = hash_positions.get() + size_t(h) * bucket_capacity;
+        for (int j = 0; j < hash_counts[h]; j++) {
+            const int64_t candidate = bucket[j];
+            if (candidate > int64_t(pos) - window) {
+                const int length = matchLength(data + candidate, data + pos, int(end - pos));
+                if (length >= best) {
+                    best = length;
+                    *location = data + candidate;
+                }
+            }
+        }
+        return best;
+    };
+
+    size_t i = begin;
+    while (i + 3 < end) {
+        const uint8_t* location = nullptr;
+        const int best = best_match(i, DEFLATE_WINDOW, 3, &location);
+        insert(i);
+
+        if (location) {
+            // Lazy matching: emit a literal if the match at the next byte is longer.
+            const uint8_t* next_location = nullptr;
+            best_match(i + 1, DEFLATE_WINDOW - 1, best + 1, &next_location);
+            if (next_location) {
+                location = nullptr;
+            }
+        }
+
+        if (location) {
+            const int distance = int(data + i - location);
+            int code = 0;
+            while (best > length_base[code + 1] - 1) {
+                code++;
+            }
+            addFixedSymbol(bits, code + 257);
+            if (length_extra[code]) {
+                bits.add(uint32_t(best - length_base[code]), length_extra[code]);
+            }
+            code = 0;
+            while (distance > dist_base[code + 1] - 1) {
+                code++;
+            }
+            bits.addReversed(uint32_t(code), 5);
+            if (dist_extra[code]) {
+                bits.add(uint32_t(distance - dist_base[code]), dist_extra[code]);
+            }
+            i += size_t(best);
+        } else {
+            addFixedSymbol(bits, data[i]);
+            i++;
+        }
+    }
+    for (; i < end; i++) {
+        addFixedSymbol(bits, data[i]);
+    }
+    addFixedSymbol(bits, 256); // end of block
+
+    if (!final) {
+        // Empty stored block: byte-aligns the output so chunks can be concatenated.
+        bits.add(0, 3);
+        bits.alignToByte();
+        out.insert(out.end(), { 0x00, 0x00, 0xFF, 0xFF });
+    }
+    bits.alignToByte();
+
+    // Fall back to stored blocks if fixed Huffman expanded the data.
+    if (out.size() > (end - begin) + 5 * ((end - begin) / 65535 + 1)) {
+        out.clear();
+        storeChunk(data, begin, end, final, out);
+    }
+    return out;
+}
+
+uint32_t crc32(const uint8_t* data, const size_t length, uint32_t crc = 0)
+{
+    static const auto table = [] {
+        std::array<uint32_t, 256> result {};
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            result[n] = c;
+        }
+        return result;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint32_t adler32(const uint8_t* data, const size_t length)
+{
+    uint32_t s1 = 1, s2 = 0;
+    for (size_t pos = 0; pos < length;) {
+        // Largest block without overflow of s2 before the modulo.
+        const size_t block_end = std::min(length, pos + 5552);
+        for (; pos < block_end; pos++) {
+            s1 += data[pos];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+void appendBigEndian(std::vector<uint8_t>& out, const uint32_t value)
+{
+    out.insert(out.end(), { uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value) });
+}
+
+// Appends a PNG chunk: length, tag, payload and the CRC of tag + payload.
+void appendPngChunk(std::vector<uint8_t>& out, const char* tag, const uint8_t* payload, const size_t length)
+{
+    appendBigEndian(out, uint32_t(length));
+    const size_t tag_pos = out.size();
+    out.insert(out.end(), tag, tag + 4);
+    out.insert(out.end(), payload, payload + length);
+    appendBigEndian(out, crc32(out.data() + tag_pos, length + 4));
+}
+
+uint8_t paeth(const int a, const int b, const int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return uint8_t(a);
+    }
+    return uint8_t(pb <= pc ? b : c);
+}
+
+// Applies PNG filter type (0 none, 1 sub, 2 up, 3 average, 4 Paeth) to one row.
+// Returns the sum of the residuals as signed bytes, the filter selection heuristic.
+template <int Filter>
+long filterPngRow(const uint8_t* row, const uint8_t* prior, const int row_bytes, const int bpp, uint8_t* dst)
+{
+    long cost = 0;
+    for (int i = 0; i < row_bytes; i++) {
+        // The first pixel has no left neighbor (treated as 0).
+        const int left = i >= bpp ? row[i - bpp] : 0;
+        const int up_left = i >= bpp ? prior[i - bpp] : 0;
+        int predictor = 0;
+        if constexpr (Filter == 1) {
+            predictor = left;
+        } else if constexpr (Filter == 2) {
+            predictor = prior[i];
+        } else if constexpr (Filter == 3) {
+            predictor = (left + prior[i]) >> 1;
+        } else if constexpr (Filter == 4) {
+            predictor = paeth(left, prior[i], up_left);
+        }
+        dst[i] = uint8_t(row[i] - predictor);
+        cost += std::abs(int(int8_t(dst[i])));
+    }
+    return cost;
+}
+
+long filterPngRow(const uint8_t* row, const uint8_t* prior, const int row_bytes, const int bpp, const int filter, uint8_t* dst)
+{
+    switch (filter) {
+    case 1:
+        return filterPngRow<1>(row, prior, row_bytes, bpp, dst);
+    case 2:
+        return filterPngRow<2>(row, prior, row_bytes, bpp, dst);
+    case 3:
+        return filterPngRow<3>(row, prior, row_bytes, bpp, dst);
+    case 4:
+        return filterPngRow<4>(row, prior, row_bytes, bpp, dst);
+    default:
+        return filterPngRow<0>(row, prior, row_bytes, bpp, dst);
+    }
+}
+
+// zlib stream of data[0, size) as independently deflated pieces of chunk_bytes (the last one
+// shorter), compressed in parallel: the zlib header is in the first piece, the Adler-32 in the last.
+std::vector<std::vector<uint8_t>> deflateZlibChunks(const uint8_t* data, const size_t size, const size_t chunk_bytes)
+{
+    const int num_chunks = int(std::max<size_t>(1, (size + chunk_bytes - 1) / chunk_bytes));
+    std::vector<std::vector<uint8_t>> compressed(num_chunks);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < num_chunks; c++) {
+        const size_t begin = size_t(c) * chunk_bytes;
+        const size_t end = std::min(size, begin + chunk_bytes);
+        compressed[c] = deflateChunk(data, begin, end, c == num_chunks - 1);
+    }
+
+    // zlib header (32K window, default level) before the first chunk, Adler-32 after the last.
+    compressed.front().insert(compressed.front().begin(), { 0x78, 0x5E });
+    appendBigEndian(compressed.back(), adler32(data, size));
+    return compressed;
+}
+
+// PNG of rows of width * channels samples of bit_depth (8 or 16, big-endian) bits.
+std::vector<uint8_t> encodePngBytes(const int width, const int height, const int channels, const int bit_depth, const uint8_t* pixels)
+{
+    const int bpp = channels * bit_depth / 8;
+    const int row_bytes = width * bpp;
+    const size_t filtered_row_bytes = size_t(row_bytes) + 1;
+
+    // Filter rows in parallel. The filter of each row minimizes the sum of |signed residuals|,
+    // the heuristic of stb_image_write; the first row sees a zero prior row.
+    std::vector<uint8_t> filtered(filtered_row_bytes * size_t(height));
+    const std::vector<uint8_t> zero_row(size_t(row_bytes), 0);
+#pragma omp parallel
+    {
+        // Candidates are filtered into the scratch row, the best one is swapped into the output.
+        std::vector<uint8_t> scratch(static_cast<size_t>(row_bytes));
+#pragma omp for
+        for (int y = 0; y < height; y++) {
+            const uint8_t* row = pixels + size_t(y) * size_t(row_bytes);
+            const uint8_t* prior = y > 0 ? row - row_bytes : zero_row.data();
+            uint8_t* dst = filtered.data() + size_t(y) * filtered_row_bytes;
+            dst[0] = 0;
+            long best_cost = filterPngRow(row, prior, row_bytes, bpp, 0, dst + 1);
+            for (int filter = 1; filter < 5; filter++) {
+                const long cost = filterPngRow(row, prior, row_bytes, bpp, filter, scratch.data());
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    dst[0] = uint8_t(filter);
+                    std::swap_ranges(scratch.begin(), scratch.end(), dst + 1);
+                }
+            }
+        }
+    }
+
+    // Deflate independent row chunks in parallel.
+    const int rows_per_chunk = std::max(1, int(PNG_CHUNK_BYTES / filtered_row_bytes));
+    const auto compressed = deflateZlibChunks(filtered.data(), filtered.size(), size_t(rows_per_chunk) * filtered_row_bytes);
+
+    static const int color_types[5] = { -1, 0, 4, 2, 6 };
+    const uint8_t ihdr[13] = {
+        uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+        uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+        uint8_t(bit_depth), uint8_t(color_types[channels]), 0, 0, 0
+    };
+
+    size_t total_size = 8 + 12 + 13 + 12;
+    for (const auto& chunk : compressed) {
+        total_size += 12 + chunk.size();
+    }
+    static constexpr std::array<uint8_t, 8> signature { 137, 80, 78, 71, 13, 10, 26, 10 };
+    std::vector<uint8_t> png;
+    png.reserve(total_size);
+    png.resize(signature.size());
+    std::memcpy(png.data(), signature.data(), signature.size());
+    appendPngChunk(png, "IHDR", ihdr, sizeof(ihdr));
+    // One IDAT chunk per compressed chunk; decoders concatenate their payloads.
+    for (const auto& chunk : compressed) {
+        appendPngChunk(png, "IDAT", chunk.data(), chunk.size());
+    }
+    appendPngChunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+bool writeBytes(const std::filesystem::path& filePath, const std::vector<uint8_t>& bytes)
+{
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    std::FILE* file = std::fopen(filePathStr.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    const bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    return std::fclose(file) == 0 && ok;
+}
+
+} // namespace
+
+std::vector<uint8_t> zlibCompress(const uint8_t* data, const size_t size)
+{
+    std::vector<uint8_t> stream;
+    for (const auto& chunk : deflateZlibChunks(data, size, PNG_CHUNK_BYTES)) {
+        stream.insert(stream.end(), chunk.begin(), chunk.end());
+    }
+    return stream;
+}
+
+std::vector<uint8_t> encodePng(const int width, const int height, const int channels, const uint8_t* pixels)
+{
+    return encodePngBytes(width, height, channels, 8, pixels);
+}
+
+std::vector<uint8_t> encodePng(const int width, const int height, const int channels, const uint16_t* pixels)
+{
+    // PNG stores 16-bit samples big-endian.
+    const size_t row_samples = size_t(width) * size_t(channels);
+    std::vector<uint8_t> bytes(row_samples * size_t(height) * 2);
+#pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+        const uint16_t* row = pixels + size_t(y) * row_samples;
+        uint8_t* dst = bytes.data() + size_t(y) * row_samples * 2;
+        for (size_t i = 0; i < row_samples; i++) {
+            dst[2 * i] = uint8_t(row[i] >> 8);
+            dst[2 * i + 1] = uint8_t(row[i]);
+        }
+    }
+    return encodePngBytes(width, height, channels, 16, bytes.data());
+}
+
+bool writePng(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint8_t* pixels)
+{
+    return writeBytes(filePath, encodePng(width, height, channels, pixels));
+}
+
+bool writePng(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint16_t* pixels)
+{
+    return writeBytes(filePath, encodePng(width, height, channels, pixels));
+}
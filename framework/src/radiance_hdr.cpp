@@ -0,0 +1,411 @@
+#include "radiance_hdr.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// Reads one header line (without the newline). Returns false at EOF.
+bool readHeaderLine(std::FILE* file, std::string& line)
+{
+    line.clear();
+    int c;
+    while ((c = std::fgetc(file)) != EOF) {
+        if (c == '\n') {
+            return true;
+        }
+        line.push_back(char(c));
+    }
+    return !line.empty();
+}
+
+// Scale of every exponent byte, 0 for the exponent 0 (black).
+const std::array<float, 256>& exponentScales()
+{
+    static const auto scales = [] {
+        std::array<float, 256> table {};
+        for (int exponent = 1; exponent < 256; exponent++) {
+            // Same expression as stbi__hdr_convert().
+            table[exponent] = float(ldexp(1.0f, exponent - int(128 + 8)));
+        }
+        return table;
+    }();
+    return scales;
+}
+
+// Skips one new-style run-length encoded scanline. Returns the end of the scanline, or nullptr
+// when it is not run-length encoded or malformed.
+const uint8_t* skipRleScanline(const uint8_t* p, const uint8_t* end, const int width)
+{
+    if (end - p < 4 || p[0] != 2 || p[1] != 2 || (p[2] & 0x80) || ((int(p[2]) << 8) | int(p[3])) != width) {
+        return nullptr;
+    }
+    p += 4;
+    for (int channel = 0; channel < 4; channel++) {
+        int x = 0;
+        while (x < width) {
+            if (p == end) {
+                return nullptr;
+            }
+            int count = *p++;
+            // A run is followed by one value, literals by count values.
+            const int values = count > 128 ? 1 : count;
+            count = count > 128 ? count - 128 : count;
+            if (count == 0 || x + count > width || end - p < values) {
+                return nullptr;
+            }
+            p += values;
+            x += count;
+        }
+    }
+    return p;
+}
+
+// Decodes a scanline validated by skipRleScanline() into width RGBE pixels.
+void decodeRleScanline(const uint8_t* p, uint8_t* rgbe, const int width)
+{
+    p += 4;
+    for (int channel = 0; channel < 4; channel++) {
+        int x = 0;
+        while (x < width) {
+            const int count = *p++;
+            if (count > 128) {
+                const uint8_t value = *p++;
+                for (int i = 0; i < count - 128; i++) {
+                    rgbe[4 * (x++) + channel] = value;
+                }
+            } else {
+                for (int i = 0; i < count; i++) {
+                    rgbe[4 * (x++) + channel] = *p++;
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+void rgbeToFloat(const uint8_t* rgbe, float* rgb, const int num_pixels)
+{
+    // The table replaces the branch on black pixels and the ldexp() per pixel, so the loop vectorizes.
+    const float* scales = exponentScales().data();
+#pragma omp simd
+    for (int i = 0; i < num_pixels; i++) {
+        const uint8_t* src = rgbe + 4 * i;
+        float* dst = rgb + 3 * i;
+        const float scale = scales[src[3]];
+        dst[0] = float(src[0]) * scale;
+        dst[1] = float(src[1]) * scale;
+        dst[2] = float(src[2]) * scale;
+    }
+}
+
+void floatToRgbe(const float* rgb, uint8_t* rgbe, const int num_pixels)
+{
+    for (int i = 0; i < num_pixels; i++) {
+        const float* src = rgb + 3 * i;
+        uint8_t* dst = rgbe + 4 * i;
+        const float max_component = std::max(src[0], std::max(src[1], src[2]));
+        if (max_component < 1e-32f) {
+            dst[0] = dst[1] = dst[2] = dst[3] = 0;
+        } else {
+            // Same expression as stbiw__linear_to_rgbe().
+            int exponent;
+            const float normalize = float(frexp(max_component, &exponent)) * 256.0f / max_component;
+            dst[0] = uint8_t(src[0] * normalize);
+            dst[1] = uint8_t(src[1] * normalize);
+            dst[2] = uint8_t(src[2] * normalize);
+            dst[3] = uint8_t(exponent + 128);
+        }
+    }
+}
+
+bool RadianceHdrReader::isRadianceFile(const std::filesystem::path& filePath)
+{
+    std::FILE* file = std::fopen(filePath.string().c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    const bool ok = readHeaderLine(file, line) && (line == "#?RADIANCE" || line == "#?RGBE");
+    std::fclose(file);
+    return ok;
+}
+
+RadianceHdrReader::RadianceHdrReader(const std::filesystem::path& filePath)
+{
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    m_file = std::fopen(filePathStr.c_str(), "rb");
+    if (!m_file) {
+        std::cerr << "Failed to open HDR image " << filePath << std::endl;
+        throw std::exception();
+    }
+
+    std::string line;
+    if (!readHeaderLine(m_file, line) || (line != "#?RADIANCE" && line != "#?RGBE")) {
+        std::fclose(m_file);
+        std::cerr << "Image " << filePath << " is not a Radiance HDR file" << std::endl;
+        throw std::exception();
+    }
+
+    // Header variables up to the first empty line.
+    bool valid_format = false;
+    while (readHeaderLine(m_file, line) && !line.empty()) {
+        if (line == "FORMAT=32-bit_rle_rgbe") {
+            valid_format = true;
+        }
+    }
+
+    // Resolution string.
+    char y_axis[3] = {}, x_axis[3] = {};
+    if (!valid_format || !readHeaderLine(m_file, line)
+        || std::sscanf(line.c_str(), "%2s %d %2s %d", y_axis, &m_height, x_axis, &m_width) != 4
+        || std::strcmp(y_axis, "-Y") != 0 || std::strcmp(x_axis, "+X") != 0 || m_width <= 0 || m_height <= 0) {
+        std::fclose(m_file);
+        std::cerr << "Unsupported Radiance HDR header in " << filePath << std::endl;
+        throw std::exception();
+    }
+
+    // As in stb_image, widths outside [8, 32767] cannot be run-length encoded.
+    m_flat = m_width < 8 || m_width >= 32768;
+    m_rgbe.resize(size_t(m_width) * 4);
+}
+
+RadianceHdrReader::~RadianceHdrReader()
+{
+    if (m_file) {
+        std::fclose(m_file);
+    }
+}
+
+bool RadianceHdrReader::readRgbeScanline()
+{
+    uint8_t* rgbe = m_rgbe.data();
+    if (m_flat) {
+        return std::fread(rgbe, 4, size_t(m_width), m_file) == size_t(m_width);
+    }
+
+    uint8_t start[4];
+    if (std::fread(start, 1, 4, m_file) != 4) {
+        return false;
+    }
+    if (start[0] != 2 || start[1] != 2 || (start[2] & 0x80)) {
+        // Not run-length encoded: the whole rest of the image is flat (only valid on the first scanline).
+        if (m_next_row != 0) {
+            return false;
+        }
+        m_flat = true;
+        std::memcpy(rgbe, start, 4);
+        return std::fread(rgbe + 4, 4, size_t(m_width) - 1, m_file) == size_t(m_width) - 1;
+    }
+    if (((int(start[2]) << 8) | int(start[3])) != m_width) {
+        return false;
+    }
+
+    // Each of the four channels is run-length encoded separately.
+    for (int channel = 0; channel < 4; channel++) {
+        int x = 0;
+        while (x < m_width) {
+            int count = std::fgetc(m_file);
+            if (count == EOF) {
+                return false;
+            }
+            if (count > 128) {
+                // Run of one value.
+                count -= 128;
+                const int value = std::fgetc(m_file);
+                if (value == EOF || x + count > m_width) {
+                    return false;
+                }
+                for (int i = 0; i < count; i++) {
+                    rgbe[4 * (x++) + channel] = uint8_t(value);
+                }
+            } else {
+                // Literal values.
+                if (count == 0 || x + count > m_width) {
+                    return false;
+                }
+                for (int i = 0; i < count; i++) {
+                    const int value = std::fgetc(m_file);
+                    if (value == EOF) {
+                        return false;
+                    }
+                    rgbe[4 * (x++) + channel] = uint8_t(value);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool RadianceHdrReader::readScanline(float* rgb)
+{
+    if (m_next_row >= m_height || !readRgbeScanline()) {
+        return false;
+    }
+    rgbeToFloat(m_rgbe.data(), rgb, m_width);
+    m_next_row++;
+    return true;
+}
+
+bool RadianceHdrReader::locateScanlines(const std::vector<uint8_t>& bytes, std::vector<size_t>& offsets)
+{
+    const size_t rows = size_t(m_height - m_next_row);
+    const size_t flat_bytes = size_t(m_width) * 4;
+    offsets.resize(rows);
+    const uint8_t* begin = bytes.data();
+    const uint8_t* end = begin + bytes.size();
+    const uint8_t* p = begin;
+    for (size_t row = 0; row < rows; row++) {
+        offsets[row] = size_t(p - begin);
+        if (!m_flat) {
+            if (const uint8_t* next = skipRleScanline(p, end, m_width)) {
+                p = next;
+                continue;
+            }
+            // Not run-length encoded: the whole rest of the image is flat (only valid on the first scanline).
+            if (m_next_row + int(row) != 0) {
+                return false;
+            }
+            m_flat = true;
+        }
+        if (size_t(end - p) < flat_bytes) {
+            return false;
+        }
+        p += flat_bytes;
+    }
+    return true;
+}
+
+bool RadianceHdrReader::readImage(float* rgb, const std::function<void(int)>& on_row)
+{
+    // The compressed rest of the file.
+    constexpr size_t CHUNK_BYTES = size_t(4) << 20;
+    std::vector<uint8_t> bytes;
+    size_t size = 0;
+    while (true) {
+        bytes.resize(size + CHUNK_BYTES);
+        const size_t read = std::fread(bytes.data() + size, 1, CHUNK_BYTES, m_file);
+        size += read;
+        if (read < CHUNK_BYTES) {
+            break;
+        }
+    }
+    bytes.resize(size);
+
+    // Serial scan: run-length encoded scanlines have no length field, but skipping the runs only
+    // touches the count bytes and is much cheaper than decoding them.
+    std::vector<size_t> offsets;
+    if (!locateScanlines(bytes, offsets)) {
+        return false;
+    }
+
+    // Every thread decodes a band of consecutive scanlines, which also places the pages of its
+    // band of the output on its own node (first touch).
+    const int rows = int(offsets.size());
+    const int first_row = m_next_row;
+    const size_t row_floats = size_t(m_width) * 3;
+    const bool flat = m_flat;
+#pragma omp parallel if (size_t(rows) * row_floats * sizeof(float) >= (size_t(1) << 20))
+    {
+        std::vector<uint8_t> scanline(flat ? 0 : size_t(m_width) * 4);
+#pragma omp for schedule(static)
+        for (int row = 0; row < rows; row++) {
+            const uint8_t* line = bytes.data() + offsets[size_t(row)];
+            float* out = rgb + size_t(row) * row_floats;
+            if (flat) {
+                rgbeToFloat(line, out, m_width);
+            } else {
+                decodeRleScanline(line, scanline.data(), m_width);
+                rgbeToFloat(scanline.data(), out, m_width);
+            }
+            if (on_row) {
+                on_row(first_row + row);
+            }
+        }
+    }
+    m_next_row = m_height;
+    return true;
+}
+
+RadianceHdrWriter::RadianceHdrWriter(const std::filesystem::path& filePath, const int width, const int height)
+    : m_width(width)
+    , m_height(height)
+    , m_rgbe(size_t(width) * 4)
+{
+    // Create a folder.
+    if (filePath.has_parent_path() && !std::filesystem::is_directory(filePath.parent_path())) {
+        std::filesystem::create_directories(filePath.parent_path());
+    }
+
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    m_file = std::fopen(filePathStr.c_str(), "wb");
+    if (!m_file) {
+        std::cerr << "Failed to create HDR image " << filePath << std::endl;
+        throw std::exception();
+    }
+    std::fprintf(m_file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", height, width);
+}
+
+RadianceHdrWriter::~RadianceHdrWriter()
+{
+    if (m_file) {
+        std::fclose(m_file);
+    }
+}
+
+bool RadianceHdrWriter::writeScanline(const float* rgb)
+{
+    if (m_next_row >= m_height) {
+        return false;
+    }
+    floatToRgbe(rgb, m_rgbe.data(), m_width);
+    m_next_row++;
+
+    // As in stb_image, widths outside [8, 32767] cannot be run-length encoded.
+    if (m_width < 8 || m_width >= 32768) {
+        return std::fwrite(m_rgbe.data(), 4, size_t(m_width), m_file) == size_t(m_width);
+    }
+
+    const uint8_t start[4] = { 2, 2, uint8_t(m_width >> 8), uint8_t(m_width & 0xFF) };
+    m_encoded.assign(start, start + 4);
+    // Each of the four channels is run-length encoded separately: runs of at least 3 equal
+    // bytes become (128 + count, value), everything in between is stored as literal chunks.
+    for (int channel = 0; channel < 4; channel++) {
+        const auto value = [&](const int x) { return m_rgbe[4 * size_t(x) + channel]; };
+        const auto run_length = [&](const int x) {
+            int count = 1;
+            while (count < 127 && x + count < m_width && value(x + count) == value(x)) {
+                count++;
+            }
+            return count;
+        };
+
+        int x = 0;
+        while (x < m_width) {
+            const int run = run_length(x);
+            if (run >= 3) {
+                m_encoded.push_back(uint8_t(128 + run));
+                m_encoded.push_back(value(x));
+                x += run;
+                continue;
+            }
+            // Literals up to the start of the next run.
+            int end = x + run;
+            while (end < m_width && end - x < 128 && run_length(end) < 3) {
+                end++;
+            }
+            end = std::min(end, x + 128);
+            m_encoded.push_back(uint8_t(end - x));
+            for (; x < end; x++) {
+                m_encoded.push_back(value(x));
+            }
+        }
+    }
+    return std::fwrite(m_encoded.data(), 1, m_encoded.size(), m_file) == m_encoded.size();
+}
@@ -0,0 +1,149 @@
+#include "shared_image.h"
+
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+[[noreturn]] void failShared(const std::string& name, const char* reason)
+{
+    std::cerr << "Shared memory segment " << name << ": " << reason << std::endl;
+    throw std::exception();
+}
+
+#ifndef _WIN32
+// POSIX names start with one slash; the prefix keeps the segments of this program together.
+std::string posixName(const std::string& name)
+{
+    if (name.empty() || name.find('/') != std::string::npos) {
+        failShared(name, "invalid name");
+    }
+    return "/a1_hdr." + name;
+}
+#endif
+
+} // namespace
+
+#ifdef _WIN32
+// Named file mappings on Windows disappear with the last handle, so a producer could not exit
+// before its consumer starts; shared-memory images are POSIX only.
+SharedMemory SharedMemory::create(const std::string& name, size_t)
+{
+    failShared(name, "not supported on this platform");
+}
+
+SharedMemory SharedMemory::open(const std::string& name)
+{
+    failShared(name, "not supported on this platform");
+}
+
+bool SharedMemory::unlink(const std::string&)
+{
+    return false;
+}
+#else
+SharedMemory SharedMemory::create(const std::string& name, const size_t size)
+{
+    const auto posix_name = posixName(name);
+    // A new object, so mappings of a replaced image in other processes keep their pixels.
+    shm_unlink(posix_name.c_str());
+    const int fd = shm_open(posix_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        failShared(name, "shm_open failed");
+    }
+    if (ftruncate(fd, off_t(size)) != 0) {
+        close(fd);
+        shm_unlink(posix_name.c_str());
+        failShared(name, "cannot allocate");
+    }
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the object open.
+    if (address == MAP_FAILED) {
+        shm_unlink(posix_name.c_str());
+        failShared(name, "mmap failed");
+    }
+    SharedMemory memory;
+    memory.m_address = address;
+    memory.m_size = size;
+    return memory;
+}
+
+SharedMemory SharedMemory::open(const std::string& name)
+{
+    const auto posix_name = posixName(name);
+    const int fd = shm_open(posix_name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        failShared(name, "does not exist");
+    }
+    struct stat segment_stat;
+    if (fstat(fd, &segment_stat) != 0 || segment_stat.st_size == 0) {
+        close(fd);
+        failShared(name, "empty");
+    }
+    const auto size = size_t(segment_stat.st_size);
+    void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        failShared(name, "mmap failed");
+    }
+    SharedMemory memory;
+    memory.m_address = address;
+    memory.m_size = size;
+    return memory;
+}
+
+bool SharedMemory::unlink(const std::string& name)
+{
+    return shm_unlink(posixName(name).c_str()) == 0;
+}
+#endif
+
+SharedMemory::~SharedMemory()
+{
+    unmap();
+}
+
+SharedMemory::SharedMemory(SharedMemory&& other) noexcept
+    : m_address(std::exchange(other.m_address, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+{
+}
+
+SharedMemory& SharedMemory::operator=(SharedMemory&& other) noexcept
+{
+    if (this != &other) {
+        unmap();
+        m_address = std::exchange(other.m_address, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+    }
+    return *this;
+}
+
+void SharedMemory::unmap()
+{
+    if (!m_address) {
+        return;
+    }
+#ifndef _WIN32
+    munmap(m_address, m_size);
+#endif
+    m_address = nullptr;
+    m_size = 0;
+}
+
+std::optional<SharedImageDescriptor> SharedImageDescriptor::parse(const std::string& line)
+{
+    std::istringstream words(line);
+    std::string tag;
+    SharedImageDescriptor descriptor;
+    if (!(words >> tag >> descriptor.name >> descriptor.width >> descriptor.height >> descriptor.channels) || tag != "a1_hdr-shm") {
+        return std::nullopt;
+    }
+    return descriptor;
+}
@@ -0,0 +1,145 @@
+#include "tiff_writer.h"
+#include "png_writer.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// Uncompressed bytes per strip (rounded to whole rows).
+constexpr size_t TIFF_STRIP_BYTES = 256 * 1024;
+
+// TIFF field types.
+constexpr uint16_t TIFF_SHORT = 3;
+constexpr uint16_t TIFF_LONG = 4;
+
+void appendLittleEndian16(std::vector<uint8_t>& out, const uint32_t value)
+{
+    out.insert(out.end(), { uint8_t(value), uint8_t(value >> 8) });
+}
+
+void appendLittleEndian32(std::vector<uint8_t>& out, const uint32_t value)
+{
+    out.insert(out.end(), { uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16), uint8_t(value >> 24) });
+}
+
+// IFD entry; value is the value itself when it fits in 4 bytes (left-justified), else the offset of the values.
+void appendEntry(std::vector<uint8_t>& out, const uint16_t tag, const uint16_t type, const uint32_t count, const uint32_t value)
+{
+    appendLittleEndian16(out, tag);
+    appendLittleEndian16(out, type);
+    appendLittleEndian32(out, count);
+    if (type == TIFF_SHORT && count == 1) {
+        appendLittleEndian16(out, value);
+        appendLittleEndian16(out, 0);
+    } else {
+        appendLittleEndian32(out, value);
+    }
+}
+
+} // namespace
+
+std::vector<uint8_t> encodeTiff(const int width, const int height, const int channels, const uint16_t* pixels)
+{
+    const size_t row_samples = size_t(width) * size_t(channels);
+    const int rows_per_strip = std::max(1, int(TIFF_STRIP_BYTES / (row_samples * 2)));
+    const int num_strips = std::max(1, (height + rows_per_strip - 1) / rows_per_strip);
+
+    // Predict and deflate the strips in parallel; samples are stored little-endian.
+    std::vector<std::vector<uint8_t>> strips(num_strips);
+#pragma omp parallel
+    {
+        std::vector<uint8_t> bytes;
+#pragma omp for schedule(dynamic)
+        for (int s = 0; s < num_strips; s++) {
+            const int y0 = s * rows_per_strip;
+            const int y1 = std::min(y0 + rows_per_strip, height);
+            bytes.resize(size_t(y1 - y0) * row_samples * 2);
+            for (int y = y0; y < y1; y++) {
+                const uint16_t* row = pixels + size_t(y) * row_samples;
+                uint8_t* dst = bytes.data() + size_t(y - y0) * row_samples * 2;
+                // Horizontal differencing: every sample minus the same channel of the pixel to its left.
+                for (size_t i = 0; i < row_samples; i++) {
+                    const uint16_t value = i < size_t(channels) ? row[i] : uint16_t(row[i] - row[i - channels]);
+                    dst[2 * i] = uint8_t(value);
+                    dst[2 * i + 1] = uint8_t(value >> 8);
+                }
+            }
+            strips[s] = zlibCompress(bytes.data(), bytes.size());
+        }
+    }
+
+    // Header, the strips, then the arrays referenced by the IFD and the IFD itself (word-aligned).
+    std::vector<uint8_t> tiff = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+    std::vector<uint32_t> strip_offsets(num_strips), strip_byte_counts(num_strips);
+    for (int s = 0; s < num_strips; s++) {
+        strip_offsets[s] = uint32_t(tiff.size());
+        strip_byte_counts[s] = uint32_t(strips[s].size());
+        tiff.insert(tiff.end(), strips[s].begin(), strips[s].end());
+    }
+    if (tiff.size() % 2) {
+        tiff.push_back(0);
+    }
+
+    // Arrays of more than 4 bytes are stored outside the IFD.
+    uint32_t bits_per_sample = 16;
+    if (channels > 2) {
+        bits_per_sample = uint32_t(tiff.size());
+        for (int c = 0; c < channels; c++) {
+            appendLittleEndian16(tiff, 16);
+        }
+    }
+    uint32_t offsets_value = strip_offsets[0], byte_counts_value = strip_byte_counts[0];
+    if (num_strips > 1) {
+        offsets_value = uint32_t(tiff.size());
+        for (const uint32_t offset : strip_offsets) {
+            appendLittleEndian32(tiff, offset);
+        }
+        byte_counts_value = uint32_t(tiff.size());
+        for (const uint32_t count : strip_byte_counts) {
+            appendLittleEndian32(tiff, count);
+        }
+    }
+    if (channels == 2) {
+        // Two 16-bit values fit in the entry.
+        bits_per_sample = 16 | (16 << 16);
+    }
+
+    const uint32_t ifd_offset = uint32_t(tiff.size());
+    tiff[4] = uint8_t(ifd_offset);
+    tiff[5] = uint8_t(ifd_offset >> 8);
+    tiff[6] = uint8_t(ifd_offset >> 16);
+    tiff[7] = uint8_t(ifd_offset >> 24);
+    // Gray + alpha and RGBA declare the alpha channel as extra sample.
+    const bool alpha = channels == 2 || channels == 4;
+    appendLittleEndian16(tiff, alpha ? 12 : 11);
+    // Entries in ascending tag order.
+    appendEntry(tiff, 256, TIFF_LONG, 1, uint32_t(width)); // ImageWidth
+    appendEntry(tiff, 257, TIFF_LONG, 1, uint32_t(height)); // ImageLength
+    appendEntry(tiff, 258, TIFF_SHORT, uint32_t(channels), bits_per_sample); // BitsPerSample
+    appendEntry(tiff, 259, TIFF_SHORT, 1, 8); // Compression: Deflate
+    appendEntry(tiff, 262, TIFF_SHORT, 1, channels >= 3 ? 2 : 1); // PhotometricInterpretation: RGB or BlackIsZero
+    appendEntry(tiff, 273, TIFF_LONG, uint32_t(num_strips), offsets_value); // StripOffsets
+    appendEntry(tiff, 277, TIFF_SHORT, 1, uint32_t(channels)); // SamplesPerPixel
+    appendEntry(tiff, 278, TIFF_LONG, 1, uint32_t(rows_per_strip)); // RowsPerStrip
+    appendEntry(tiff, 279, TIFF_LONG, uint32_t(num_strips), byte_counts_value); // StripByteCounts
+    appendEntry(tiff, 284, TIFF_SHORT, 1, 1); // PlanarConfiguration: chunky
+    appendEntry(tiff, 317, TIFF_SHORT, 1, 2); // Predictor: horizontal differencing
+    if (alpha) {
+        appendEntry(tiff, 338, TIFF_SHORT, 1, 2); // ExtraSamples: unassociated alpha
+    }
+    appendLittleEndian32(tiff, 0); // no next IFD
+    return tiff;
+}
+
+bool writeTiff(const std::filesystem::path& filePath, const int width, const int height, const int channels, const uint16_t* pixels)
+{
+    const auto tiff = encodeTiff(width, height, channels, pixels);
+    const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+    std::FILE* file = std::fopen(filePathStr.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    const bool ok = std::fwrite(tiff.data(), 1, tiff.size(), file) == tiff.size();
+    return std::fclose(file) == 0 && ok;
+}
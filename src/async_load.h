@@ -0,0 +1,73 @@
+#pragma once
+#include <filesystem>
+#include <future>
+#include <memory_resource>
+#include <utility>
+
+#include <framework/image.h>
+#include <framework/image_allocator.h>
+
+#include "binary_mask.h"
+#include "execution.h"
+#include "stage_profiler.h"
+
+/*
+ * Asynchronous loading of input files.
+ *
+ * Decoding an input does not depend on anything computed before it, so all inputs of a run can
+ * be decoded at once, next to each other and next to the stages that do not need them yet
+ * (e.g. the tone mapping of the HDR input while the compositing inputs of Part II decode).
+ * loadAsync() starts the decode on its own thread and returns a std::future; get() waits for
+ * the result and rethrows the exception of a failed load. The decode allocates from the image
+ * memory resource of the caller and runs its kernels with the caller's thread count, and it is
+ * profiled as a stage of the given name on its own thread.
+ */
+
+#pragma region Asynchronous loading
+
+/// <summary>
+/// Starts decoding a file into a Result (ImageRGB, ImageFloat, BinaryMask, ...), constructed
+/// from the path, on a new thread.
+/// </summary>
+/// <param name="stage_name">stage of the decode in the StageProfiler</param>
+/// <param name="path">input file</param>
+/// <returns>future of the decoded input</returns>
+template <typename Result>
+std::future<Result> loadAsync(const char* stage_name, std::filesystem::path path)
+{
+    std::pmr::memory_resource* const resource = currentImageMemoryResource();
+    const int threads = getThreadCount();
+    return std::async(std::launch::async, [stage_name, path = std::move(path), resource, threads] {
+        ImageMemoryScope memory_scope(resource);
+        setThreadCount(threads);
+        return profileStage(stage_name, 0, [&] { return Result(path); });
+    });
+}
+
+/// <summary>
+/// Inputs of a Poisson editing job, decoded concurrently, see startLoading().
+/// </summary>
+struct PoissonEditLoads {
+    // Invalid when the target or the source is not read from a file.
+    std::future<ImageRGB> target;
+    std::future<ImageRGB> source;
+    std::future<BinaryMask> mask;
+
+    /// <summary>
+    /// Starts decoding the mask, and the target and the source when their paths are not empty.
+    /// </summary>
+    static PoissonEditLoads startLoading(const std::filesystem::path& target_path, const std::filesystem::path& source_path, const std::filesystem::path& mask_path)
+    {
+        PoissonEditLoads loads;
+        if (!target_path.empty()) {
+            loads.target = loadAsync<ImageRGB>("load target", target_path);
+        }
+        if (!source_path.empty()) {
+            loads.source = loadAsync<ImageRGB>("load source", source_path);
+        }
+        loads.mask = loadAsync<BinaryMask>("load mask", mask_path);
+        return loads;
+    }
+};
+
+#pragma endregion Asynchronous loading
@@ -0,0 +1,272 @@
+#pragma once
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+#include "kernel_benchmark.h"
+#include "your_code_here.h"
+
+/*
+ * Per-machine autotuning.
+ *
+ * The fastest bilateral tile size, blocking depth of the temporally blocked Jacobi solver,
+ * vectorized filter engine and thread count differ between CPUs. autotuneKernels() times short
+ * runs of the kernels concerned on a synthetic HDR image (see makeSyntheticHdrImage()) and
+ * keeps the fastest of each candidate set, one after the other: the tile size with the SIMD
+ * filter, the engine (which tiles alike) with the tuned tile, the Jacobi depth, then the thread count on the whole
+ * Durand chain with the tuned engine.
+ *
+ * The results are kept in a profile file with one line per CPU model, so all hosts of a fleet
+ * can share one file:
+ *
+ *     # cpu model<TAB>settings
+ *     Intel(R) Xeon(R) Platinum 8375C CPU @ 2.90GHz (64 threads)<TAB>threads=32,bilateral_tile=128,jacobi_block=16,engine=simd
+ *
+ * The tile and depth only change the blocking (see KernelTuning), never a result. The engine
+ * is chosen among the ones computing the brute-force filter up to float rounding (tiled and
+ * simd) and replaces only an engine of that set, see applyTuningProfile() in run_config.h.
+ */
+
+#pragma region Autotuning
+
+/// <summary>
+/// Best configuration of one CPU model, see above.
+/// </summary>
+struct TuningProfile {
+    std::string cpu_model;
+    // Kernel threads, 0 is the default count.
+    int threads = 0;
+    KernelTuning kernels;
+    BilateralEngine engine = BilateralEngine::Simd;
+};
+
+/// <summary>
+/// Engines computing the brute-force filter up to float rounding, the candidates of the tuner.
+/// </summary>
+inline bool isTunableBilateralEngine(const BilateralEngine engine)
+{
+    return engine == BilateralEngine::Tiled || engine == BilateralEngine::Simd;
+}
+
+/// <summary>
+/// Name of the CPU with its logical CPU count, e.g. "AMD EPYC 7R13 Processor (96 threads)".
+/// </summary>
+std::string cpuModelName()
+{
+    std::string model;
+#ifdef __APPLE__
+    char brand[256] = {};
+    size_t length = sizeof(brand);
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &length, nullptr, 0) == 0) {
+        model = brand;
+    }
+#else
+    // x86 names the model, ARM only the implementer and part numbers.
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string implementer, part;
+    for (std::string line; model.empty() && std::getline(cpuinfo, line);) {
+        const auto colon = line.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        auto key = line.substr(0, colon);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        const auto value = colon + 2 <= line.size() ? line.substr(colon + 2) : std::string();
+        if (key == "model name") {
+            model = value;
+        } else if (key == "CPU implementer" && implementer.empty()) {
+            implementer = value;
+        } else if (key == "CPU part" && part.empty()) {
+            part = value;
+        }
+    }
+    if (model.empty() && !implementer.empty()) {
+        model = "ARM implementer " + implementer + " part " + part;
+    }
+#endif
+    if (model.empty()) {
+        model = "unknown CPU";
+    }
+    return model + " (" + std::to_string(defaultThreadCount()) + " threads)";
+}
+
+/// <summary>
+/// Settings of a profile line: "threads=...,bilateral_tile=...,jacobi_block=...,engine=...".
+/// </summary>
+std::string formatTuningSettings(const TuningProfile& profile)
+{
+    return "threads=" + std::to_string(profile.threads) + ",bilateral_tile=" + std::to_string(profile.kernels.bilateral_tile)
+        + ",jacobi_block=" + std::to_string(profile.kernels.jacobi_block_iters) + ",engine=" + (profile.engine == BilateralEngine::Tiled ? "tiled" : "simd");
+}
+
+/// <summary>
+/// Profile of a CPU model from a profile file, none when the file or the line does not exist.
+/// </summary>
+std::optional<TuningProfile> readTuningProfile(const std::filesystem::path& filePath, const std::string& cpu_model)
+{
+    std::ifstream file(filePath);
+    for (std::string line; std::getline(file, line);) {
+        const auto tab = line.find('\t');
+        if (line.empty() || line[0] == '#' || tab == std::string::npos || line.substr(0, tab) != cpu_model) {
+            continue;
+        }
+        TuningProfile profile { cpu_model };
+        std::istringstream settings(line.substr(tab + 1));
+        for (std::string item; std::getline(settings, item, ',');) {
+            const auto equals = item.find('=');
+            const auto key = item.substr(0, equals);
+            const auto value = equals == std::string::npos ? std::string() : item.substr(equals + 1);
+            try {
+                if (key == "threads") {
+                    profile.threads = std::max(std::stoi(value), 0);
+                } else if (key == "bilateral_tile") {
+                    profile.kernels.bilateral_tile = std::max(std::stoi(value), 8);
+                } else if (key == "jacobi_block") {
+                    profile.kernels.jacobi_block_iters = std::max(std::stoi(value), 1);
+                } else if (key == "engine" && (value == "tiled" || value == "simd")) {
+                    profile.engine = value == "tiled" ? BilateralEngine::Tiled : BilateralEngine::Simd;
+                } else {
+                    throw std::invalid_argument(key);
+                }
+            } catch (const std::logic_error&) {
+                std::cerr << "Invalid tuning setting " << item << " in " << filePath << "." << std::endl;
+                throw std::exception();
+            }
+        }
+        return profile;
+    }
+    return std::nullopt;
+}
+
+/// <summary>
+/// Stores a profile in a profile file, replacing the line of its CPU model and keeping the others.
+/// </summary>
+bool writeTuningProfile(const std::filesystem::path& filePath, const TuningProfile& profile)
+{
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(filePath);
+        for (std::string line; std::getline(file, line);) {
+            const auto tab = line.find('\t');
+            if (!line.empty() && line[0] != '#' && (tab == std::string::npos || line.substr(0, tab) != profile.cpu_model)) {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(profile.cpu_model + "\t" + formatTuningSettings(profile));
+    std::ofstream file(filePath);
+    file << "# cpu model\tsettings (a1_hdr --autotune)\n";
+    for (const auto& line : lines) {
+        file << line << "\n";
+    }
+    return bool(file);
+}
+
+/// <summary>
+/// Measures the best configuration of this machine, see above.
+/// </summary>
+/// <param name="params">Durand parameters of the timed filters and tone mapping</param>
+/// <param name="size">side length of the synthetic image</param>
+/// <param name="out">progress, one line per decision</param>
+TuningProfile autotuneKernels(const DurandParams& params, const int size, std::ostream& out)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    const int initial_threads = getThreadCount();
+    const KernelTuning initial_tuning = currentKernelTuning();
+    KernelBenchmarkOptions timing;
+    timing.min_seconds = 0.1;
+    timing.max_repeats = 5;
+    const KernelBenchmarkInputs inputs(size, params);
+    PoissonControl quiet;
+    quiet.report_every = 0;
+    quiet.on_progress = {};
+
+    // Fastest candidate of run(candidate), keeping the setting of the winner applied.
+    const auto fastest = [&]<typename T>(const char* what, const std::vector<T>& candidates, const auto& name, const auto& apply, const auto& run) {
+        T best = candidates.front();
+        double best_ms = 0.0;
+        // Printed when done, the solvers report progress while they are timed.
+        std::ostringstream line;
+        line << std::left << std::setw(16) << what << std::right << std::fixed << std::setprecision(1);
+        for (const T& candidate : candidates) {
+            apply(candidate);
+            const double ms = timeKernel({ what, 0, 1, [&](const KernelBenchmarkInputs&) { run(); } }, inputs, timing);
+            line << "  " << name(candidate) << " " << ms << " ms";
+            if (best_ms == 0.0 || ms < best_ms) {
+                best = candidate;
+                best_ms = ms;
+            }
+        }
+        apply(best);
+        out << line.str() << "  -> " << name(best) << std::endl;
+        return best;
+    };
+    const auto number = [](const int value) { return std::to_string(value); };
+
+    TuningProfile profile { cpuModelName() };
+    out << "Autotuning for " << profile.cpu_model << " on a " << size << "x" << size << " image:" << std::endl;
+    setThreadCount(0);
+    profile.kernels.bilateral_tile = fastest(
+        "bilateral tile", std::vector<int> { 32, 64, 128, 256 }, number, [](const int tile) { currentKernelTuning().bilateral_tile = tile; },
+        [&] { keepBenchmarkResult(bilateralFilter(inputs.log_lum, params.filter_size, params.space_sigma, params.range_sigma, BilateralEngine::Simd)); });
+    profile.engine = fastest(
+        "bilateral engine", std::vector<BilateralEngine> { BilateralEngine::Tiled, BilateralEngine::Simd },
+        [](const BilateralEngine engine) { return engine == BilateralEngine::Tiled ? "tiled" : "simd"; }, [&](const BilateralEngine engine) { profile.engine = engine; },
+        [&] { keepBenchmarkResult(bilateralFilter(inputs.log_lum, params.filter_size, params.space_sigma, params.range_sigma, profile.engine)); });
+    profile.kernels.jacobi_block_iters = fastest(
+        "jacobi block", std::vector<int> { 2, 4, 8, 16, 32 }, number, [](const int depth) { currentKernelTuning().jacobi_block_iters = depth; },
+        [&] { keepBenchmarkResult(solvePoisson(inputs.log_lum, inputs.divergence, 64, PoissonMethod::BlockedJacobi, 0.0f, quiet)); });
+
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < defaultThreadCount(); threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(defaultThreadCount());
+    auto tone_map_params = params;
+    tone_map_params.engine = profile.engine;
+    const int threads = fastest(
+        "threads", thread_counts, number, [](const int count) { setThreadCount(count); }, [&] { keepBenchmarkResult(toneMapDurand(inputs.hdr, tone_map_params)); });
+    profile.threads = threads == defaultThreadCount() ? 0 : threads;
+
+    setThreadCount(initial_threads);
+    currentKernelTuning() = initial_tuning;
+    out << "Autotuning took " << std::fixed << std::setprecision(1) << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() << " s: "
+        << formatTuningSettings(profile) << std::defaultfloat << std::endl;
+    return profile;
+}
+
+/// <summary>
+/// Profile of this machine from a profile file, measured and added to the file when it has none.
+/// </summary>
+/// <param name="filePath">profile file</param>
+/// <param name="params">Durand parameters of the timed kernels</param>
+/// <param name="size">side length of the synthetic image of a measurement</param>
+/// <param name="retune">measure even when the file has a profile</param>
+/// <param name="out">progress of a measurement</param>
+TuningProfile loadOrAutotune(const std::filesystem::path& filePath, const DurandParams& params, const int size, const bool retune, std::ostream& out)
+{
+    const auto cpu_model = cpuModelName();
+    if (!retune) {
+        if (auto profile = readTuningProfile(filePath, cpu_model)) {
+            return *profile;
+        }
+    }
+    const auto profile = autotuneKernels(params, size, out);
+    if (!writeTuningProfile(filePath, profile)) {
+        std::cerr << "Failed to write " << filePath << std::endl;
+    }
+    return profile;
+}
+
+#pragma endregion Autotuning
@@ -0,0 +1,379 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "mpi_distributed.h"
+#include "tone_map_batch.h"
+
+/*
+ * Tone mapping batch spread over the MPI ranks of a fleet (build with A1_HDR_MPI, launch with mpirun).
+ *
+ * Rank 0 is the coordinator: it holds the queue of jobs and answers the job requests of the
+ * other ranks, the workers. Every worker keeps the decoded inputs of its last jobs up to
+ * input_cache_bytes (least recently used are dropped), and the coordinator mirrors that cache
+ * with the same policy, so it knows which plates are resident where without asking. A free worker
+ * gets, in order of preference:
+ *   1. a job whose input it already holds,
+ *   2. a job whose input no other worker holds, so the plates spread over the fleet,
+ *   3. any job it has not failed before, then any job at all.
+ * A failed job goes back to the queue until it failed max_attempts times, preferring other
+ * workers (the failed worker also drops the input). Every finished attempt is reported back with
+ * its rank, attempt, cache hit and timings and appended by the coordinator to a JSON-lines log
+ * as it arrives. All ranks collect the same job list from the shared file system (the --batch
+ * arguments); only job indices and reports travel. With a single rank the coordinator runs the
+ * jobs itself in the same order.
+ */
+
+#pragma region Distributed batch
+
+/// <summary>
+/// Retry and cache limits of runToneMapBatchDistributed().
+/// </summary>
+struct DistributedBatchOptions {
+    // Attempts of a job before it counts as failed.
+    int max_attempts = 3;
+    // Bytes of decoded inputs a worker keeps for later jobs of the same input.
+    size_t input_cache_bytes = size_t(1) << 30;
+    // JSON-lines log of every finished attempt, none when empty.
+    std::filesystem::path log;
+};
+
+/// <summary>
+/// Outcome of one attempt of a job, sent from the worker to the coordinator.
+/// </summary>
+struct BatchJobReport {
+    int job = -1;
+    int succeeded = 0;
+    int cache_hit = 0;
+    double load_seconds = 0.0;
+    double seconds = 0.0;
+};
+
+/// <summary>
+/// Keys (input indices) of a least recently used set bounded by bytes. An entry larger than
+/// the capacity is never kept.
+/// </summary>
+class InputResidency {
+public:
+    explicit InputResidency(const size_t capacity_bytes = 0)
+        : m_capacity(capacity_bytes)
+    {
+    }
+
+    bool contains(const int input) const { return m_entries.contains(input); }
+
+    /// <summary>
+    /// Marks the input as used, inserting it if needed.
+    /// </summary>
+    /// <returns>inputs dropped to make room</returns>
+    std::vector<int> touch(const int input, const size_t bytes)
+    {
+        std::vector<int> evicted;
+        if (const auto it = m_entries.find(input); it != m_entries.end()) {
+            m_order.splice(m_order.begin(), m_order, it->second.first);
+            return evicted;
+        }
+        if (bytes > m_capacity) {
+            return evicted;
+        }
+        while (m_used + bytes > m_capacity) {
+            evicted.push_back(m_order.back());
+            erase(m_order.back());
+        }
+        m_order.push_front(input);
+        m_entries[input] = { m_order.begin(), bytes };
+        m_used += bytes;
+        return evicted;
+    }
+
+    void erase(const int input)
+    {
+        if (const auto it = m_entries.find(input); it != m_entries.end()) {
+            m_used -= it->second.second;
+            m_order.erase(it->second.first);
+            m_entries.erase(it);
+        }
+    }
+
+private:
+    size_t m_capacity;
+    size_t m_used = 0;
+    // Most recently used first.
+    std::list<int> m_order;
+    std::map<int, std::pair<std::list<int>::iterator, size_t>> m_entries;
+};
+
+/// <summary>
+/// Job queue of the coordinator with the locality preference and retries described above.
+/// </summary>
+class DistributedJobQueue {
+public:
+    /// <param name="job_inputs">input index of every job</param>
+    /// <param name="input_bytes">decoded size of every input</param>
+    /// <param name="workers">number of workers</param>
+    /// <param name="options">cache size of the workers and attempts per job</param>
+    DistributedJobQueue(std::vector<int> job_inputs, std::vector<size_t> input_bytes, const int workers, const DistributedBatchOptions& options)
+        : m_job_inputs(std::move(job_inputs))
+        , m_input_bytes(std::move(input_bytes))
+        , m_max_attempts(std::max(options.max_attempts, 1))
+        , m_attempts(m_job_inputs.size(), 0)
+        , m_failed_on(m_job_inputs.size())
+        , m_residency(static_cast<size_t>(workers), InputResidency(options.input_cache_bytes))
+    {
+        for (int job = 0; job < int(m_job_inputs.size()); job++) {
+            m_pending.push_back(job);
+        }
+    }
+
+    /// <summary>
+    /// Takes the preferred pending job of the worker, -1 when none is pending.
+    /// </summary>
+    int next(const int worker)
+    {
+        if (m_pending.empty()) {
+            return -1;
+        }
+        const auto held_elsewhere = [&](const int input) {
+            for (int other = 0; other < int(m_residency.size()); other++) {
+                if (other != worker && m_residency[other].contains(input)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        const auto failed_here = [&](const int job) { return std::find(m_failed_on[job].begin(), m_failed_on[job].end(), worker) != m_failed_on[job].end(); };
+        // Rank of a job for this worker, lower is better (see above).
+        const auto preference = [&](const int job) {
+            const int input = m_job_inputs[job];
+            if (failed_here(job)) {
+                return 3;
+            }
+            if (m_residency[worker].contains(input)) {
+                return 0;
+            }
+            return held_elsewhere(input) ? 2 : 1;
+        };
+        auto best = m_pending.begin();
+        int best_preference = preference(*best);
+        for (auto it = std::next(m_pending.begin()); it != m_pending.end() && best_preference > 0; ++it) {
+            if (const int p = preference(*it); p < best_preference) {
+                best = it;
+                best_preference = p;
+            }
+        }
+        const int job = *best;
+        m_pending.erase(best);
+        m_attempts[job]++;
+        m_in_flight++;
+        // The worker loads the input for the job, mirror its cache.
+        m_residency[worker].touch(m_job_inputs[job], m_input_bytes[m_job_inputs[job]]);
+        return job;
+    }
+
+    /// <summary>
+    /// Records the outcome of an attempt; a failed job is queued again until it used its attempts.
+    /// </summary>
+    void complete(const int worker, const int job, const bool succeeded)
+    {
+        m_in_flight--;
+        if (succeeded) {
+            m_succeeded++;
+            return;
+        }
+        m_residency[worker].erase(m_job_inputs[job]);
+        m_failed_on[job].push_back(worker);
+        if (m_attempts[job] < m_max_attempts) {
+            m_pending.push_back(job);
+        } else {
+            m_failed++;
+        }
+    }
+
+    int attempts(const int job) const { return m_attempts[job]; }
+    bool hasPending() const { return !m_pending.empty(); }
+    // True when every job succeeded or used up its attempts.
+    bool finished() const { return m_pending.empty() && m_in_flight == 0; }
+    int succeeded() const { return m_succeeded; }
+    int failed() const { return m_failed; }
+
+private:
+    std::vector<int> m_job_inputs;
+    std::vector<size_t> m_input_bytes;
+    int m_max_attempts;
+    std::vector<int> m_attempts;
+    std::vector<std::vector<int>> m_failed_on;
+    std::vector<InputResidency> m_residency;
+    std::list<int> m_pending;
+    int m_in_flight = 0;
+    int m_succeeded = 0;
+    int m_failed = 0;
+};
+
+/// <summary>
+/// Job runner of a worker with its cache of decoded inputs, the counterpart of the residency
+/// the coordinator mirrors.
+/// </summary>
+class BatchWorker {
+public:
+    BatchWorker(const std::vector<ToneMapJob>& jobs, const std::vector<int>& job_inputs, const std::vector<size_t>& input_bytes, const size_t cache_bytes)
+        : m_jobs(jobs)
+        , m_job_inputs(job_inputs)
+        , m_input_bytes(input_bytes)
+        , m_residency(cache_bytes)
+    {
+    }
+
+    BatchJobReport run(const int job_index)
+    {
+        const auto& job = m_jobs[job_index];
+        const int input = m_job_inputs[job_index];
+        BatchJobReport report;
+        report.job = job_index;
+        const auto start_time = std::chrono::steady_clock::now();
+        try {
+            report.cache_hit = m_images.contains(input) ? 1 : 0;
+            for (const int evicted : m_residency.touch(input, m_input_bytes[input])) {
+                m_images.erase(evicted);
+            }
+            if (!report.cache_hit) {
+                ImageRGB image(job.input);
+                if (m_residency.contains(input)) {
+                    m_images.emplace(input, std::move(image));
+                } else {
+                    // Larger than the cache, used once.
+                    m_uncached = std::move(image);
+                }
+            }
+            const ImageRGB& hdr_image = m_residency.contains(input) ? m_images.at(input) : m_uncached;
+            report.load_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            toneMap(hdr_image, job.params).writeToFile(job.output);
+            report.succeeded = 1;
+        } catch (const std::exception&) {
+            std::cerr << "Tone mapping " << job.input << " failed." << std::endl;
+            m_residency.erase(input);
+            m_images.erase(input);
+        }
+        m_uncached = ImageRGB();
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        return report;
+    }
+
+private:
+    const std::vector<ToneMapJob>& m_jobs;
+    const std::vector<int>& m_job_inputs;
+    const std::vector<size_t>& m_input_bytes;
+    InputResidency m_residency;
+    std::map<int, ImageRGB> m_images;
+    ImageRGB m_uncached;
+};
+
+/// <summary>
+/// Tone maps all jobs on the ranks of the session, see above. Every rank calls it with the same jobs.
+/// </summary>
+/// <param name="jobs">jobs to run, identical on all ranks</param>
+/// <param name="options">retries, worker cache and log</param>
+/// <param name="session">rank 0 coordinates, the others run jobs</param>
+/// <returns>counts and wall time on rank 0, the jobs run by this worker on the others</returns>
+ToneMapBatchStats runToneMapBatchDistributed(const std::vector<ToneMapJob>& jobs, const DistributedBatchOptions& options, const MpiSession& session)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    // Inputs shared by several jobs (parameter sets of one plate) are one cache entry.
+    std::map<std::filesystem::path, int> input_index;
+    std::vector<int> job_inputs;
+    std::vector<size_t> input_bytes;
+    for (const auto& job : jobs) {
+        const auto [it, inserted] = input_index.try_emplace(job.input, int(input_bytes.size()));
+        if (inserted) {
+            input_bytes.push_back(readImagePixelCount(job.input) * sizeof(glm::vec3));
+        }
+        job_inputs.push_back(it->second);
+    }
+    const auto elapsed = [&] { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count(); };
+
+    BatchWorker local_worker(jobs, job_inputs, input_bytes, options.input_cache_bytes);
+#ifdef HDR_MPI
+    if (!session.isRoot()) {
+        ToneMapBatchStats stats;
+        // The first report has no job and only asks for one.
+        BatchJobReport report;
+        while (true) {
+            MPI_Send(&report, int(sizeof(report)), MPI_BYTE, 0, 3, MPI_COMM_WORLD);
+            int job = -1;
+            MPI_Recv(&job, 1, MPI_INT, 0, 4, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (job < 0) {
+                break;
+            }
+            report = local_worker.run(job);
+            (report.succeeded ? stats.succeeded : stats.failed)++;
+        }
+        stats.seconds = elapsed();
+        return stats;
+    }
+#endif
+
+    const int workers = std::max(session.ranks() - 1, 1);
+    DistributedJobQueue queue(job_inputs, input_bytes, workers, options);
+    std::ofstream log;
+    if (!options.log.empty()) {
+        log.open(options.log);
+    }
+    const auto record = [&](const int rank, const BatchJobReport& report) {
+        if (log) {
+            const auto& job = jobs[report.job];
+            log << "{\"job\": " << report.job << ", \"input\": " << std::quoted(job.input.string()) << ", \"output\": " << std::quoted(job.output.string())
+                << ", \"rank\": " << rank << ", \"attempt\": " << queue.attempts(report.job) << ", \"succeeded\": " << (report.succeeded ? "true" : "false")
+                << ", \"cache_hit\": " << (report.cache_hit ? "true" : "false") << ", \"load_seconds\": " << report.load_seconds << ", \"seconds\": " << report.seconds
+                << ", \"elapsed_seconds\": " << elapsed() << "}" << std::endl;
+        }
+    };
+
+    if (session.ranks() == 1) {
+        for (int job = queue.next(0); job >= 0; job = queue.next(0)) {
+            const auto report = local_worker.run(job);
+            queue.complete(0, job, report.succeeded != 0);
+            record(0, report);
+        }
+    }
+#ifdef HDR_MPI
+    else {
+        // Workers asking while only retries could still come wait here until the queue is finished.
+        std::vector<int> waiting;
+        int stopped = 0;
+        const auto answer = [&](const int rank) {
+            int job = queue.next(rank - 1);
+            if (job < 0 && !queue.finished()) {
+                waiting.push_back(rank);
+                return;
+            }
+            MPI_Send(&job, 1, MPI_INT, rank, 4, MPI_COMM_WORLD);
+            stopped += job < 0 ? 1 : 0;
+        };
+        while (stopped < workers) {
+            BatchJobReport report;
+            MPI_Status status;
+            MPI_Recv(&report, int(sizeof(report)), MPI_BYTE, MPI_ANY_SOURCE, 3, MPI_COMM_WORLD, &status);
+            if (report.job >= 0) {
+                queue.complete(status.MPI_SOURCE - 1, report.job, report.succeeded != 0);
+                record(status.MPI_SOURCE, report);
+            }
+            answer(status.MPI_SOURCE);
+            if (queue.hasPending() || queue.finished()) {
+                for (const int rank : std::exchange(waiting, {})) {
+                    answer(rank);
+                }
+            }
+        }
+    }
+#endif
+    return { queue.succeeded(), queue.failed(), elapsed() };
+}
+
+#pragma endregion Distributed batch
@@ -0,0 +1,509 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Reading the input files of a batch ahead of their decodes.
+ *
+ * Image(path) opens and reads its file synchronously inside stb_image.h, so on a network
+ * filesystem a decode worker spends most of a small input waiting for the round trips of open,
+ * stat and read. BatchFileReader reads the files of a batch into memory buffers, in the order they
+ * will be taken and up to read_ahead files ahead of the consumer, many at once, and the workers
+ * decode the buffers with Image::fromMemory():
+ *
+ *  - on Linux through one io_uring (raw syscalls, no liburing): every file runs
+ *    openat -> statx -> read (repeated for short reads) -> close as a chain of submissions, all
+ *    files of the window interleaved by a single thread that only waits on the ring,
+ *  - elsewhere, or when the kernel has no io_uring (before 5.6, or blocked by a seccomp profile),
+ *    on a few threads that read whole files with std::ifstream.
+ *
+ * Every index must be taken exactly once (a failed read throws from take()), the window moves
+ * with the files taken, so it holds at most read_ahead encoded files.
+ */
+
+#pragma region Batch file reader
+
+/// <summary>
+/// Reads a list of files into memory ahead of their consumers, see above.
+/// </summary>
+class BatchFileReader {
+public:
+    /// <param name="paths">files in the order they are taken</param>
+    /// <param name="read_ahead">files read or being read that are not taken yet, at least 1</param>
+    /// <param name="fallback_threads">reading threads without io_uring</param>
+    BatchFileReader(std::vector<std::filesystem::path> paths, const int read_ahead, const int fallback_threads = 4)
+        : m_files(paths.size())
+        , m_read_ahead(std::max(read_ahead, 1))
+    {
+        for (size_t i = 0; i < paths.size(); i++) {
+            m_files[i].path = std::move(paths[i]);
+        }
+#ifdef __linux__
+        if (m_ring.open()) {
+            m_threads.emplace_back([this] { runRing(); });
+            return;
+        }
+#endif
+        for (int i = 0; i < std::max(fallback_threads, 1); i++) {
+            m_threads.emplace_back([this] { runThread(); });
+        }
+    }
+
+    BatchFileReader(const BatchFileReader&) = delete;
+    BatchFileReader& operator=(const BatchFileReader&) = delete;
+
+    /// <summary>
+    /// Waits for the reads in flight; the files not taken are dropped.
+    /// </summary>
+    ~BatchFileReader()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_changed.notify_all();
+#ifdef __linux__
+        m_ring.wake();
+#endif
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    /// <summary>
+    /// Whether the files are read through io_uring rather than the fallback threads.
+    /// </summary>
+    bool usesIoUring() const
+    {
+#ifdef __linux__
+        return m_ring.isOpen();
+#else
+        return false;
+#endif
+    }
+
+    size_t size() const { return m_files.size(); }
+
+    /// <summary>
+    /// Contents of the file at index, waiting until they are read.
+    /// </summary>
+    std::vector<std::byte> take(const size_t index)
+    {
+        std::unique_lock lock(m_mutex);
+        File& file = m_files.at(index);
+        if (file.state == State::Taken) {
+            std::cerr << "File " << file.path << " taken twice from the batch reader" << std::endl;
+            throw std::exception();
+        }
+        m_changed.wait(lock, [&] { return file.state == State::Ready || file.state == State::Failed; });
+        const bool failed = file.state == State::Failed;
+        file.state = State::Taken;
+        m_outstanding--;
+        auto bytes = std::move(file.bytes);
+        lock.unlock();
+        m_changed.notify_all();
+#ifdef __linux__
+        m_ring.wake();
+#endif
+        if (failed) {
+            std::cerr << "Failed to read " << m_files[index].path << std::endl;
+            throw std::exception();
+        }
+        return bytes;
+    }
+
+private:
+    enum class State {
+        Queued,
+        Reading,
+        Ready,
+        Failed,
+        Taken,
+    };
+
+    struct File {
+        std::filesystem::path path;
+        State state = State::Queued;
+        std::vector<std::byte> bytes;
+#ifdef __linux__
+        // Progress of the io_uring chain, owned by the ring thread while Reading.
+        int fd = -1;
+        size_t offset = 0;
+        bool failed = false;
+        struct statx status {};
+#endif
+    };
+
+    // Next index to read while the window has room, files.size() when there is none.
+    size_t nextFileLocked()
+    {
+        if (m_stop || m_next >= m_files.size() || m_outstanding >= m_read_ahead) {
+            return m_files.size();
+        }
+        m_outstanding++;
+        m_files[m_next].state = State::Reading;
+        return m_next++;
+    }
+
+    void finishFile(File& file, const bool failed)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            file.state = failed ? State::Failed : State::Ready;
+            if (failed) {
+                file.bytes = {};
+            }
+        }
+        m_changed.notify_all();
+    }
+
+    void runThread()
+    {
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock lock(m_mutex);
+                m_changed.wait(lock, [&] { return m_stop || m_next >= m_files.size() || m_outstanding < m_read_ahead; });
+                index = nextFileLocked();
+                if (index == m_files.size()) {
+                    return;
+                }
+            }
+            File& file = m_files[index];
+            bool failed = true;
+            std::ifstream stream(file.path, std::ios::binary);
+            std::error_code error;
+            const auto size = std::filesystem::file_size(file.path, error);
+            if (stream && !error) {
+                file.bytes.resize(size_t(size));
+                failed = !stream.read(reinterpret_cast<char*>(file.bytes.data()), std::streamsize(size));
+            }
+            finishFile(file, failed);
+        }
+    }
+
+#ifdef __linux__
+    // Kinds of submissions, in the upper bits of their user_data next to the file index.
+    enum Step : uint64_t {
+        Open = 0,
+        Stat = 1,
+        Read = 2,
+        Close = 3,
+    };
+    static constexpr int STEP_SHIFT = 62;
+
+    /// <summary>
+    /// A submission and a completion queue mapped from the kernel.
+    /// </summary>
+    class Ring {
+    public:
+        static constexpr unsigned RING_ENTRIES = 64;
+
+        ~Ring() { release(); }
+
+        /// <summary>
+        /// Sets up the ring, false when the kernel refuses it or lacks the operations used.
+        /// </summary>
+        bool open()
+        {
+            // take() writes to this pipe so the ring thread notices room in the window while it waits.
+            int pipe_fds[2];
+            if (pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+                return false;
+            }
+            m_wake_read_fd = pipe_fds[0];
+            m_wake_fd = pipe_fds[1];
+
+            io_uring_params params {};
+            m_fd = int(syscall(__NR_io_uring_setup, RING_ENTRIES, &params));
+            // IORING_FEAT_CUR_PERSONALITY came with openat, statx, read and close (Linux 5.6).
+            if (m_fd < 0 || !(params.features & IORING_FEAT_CUR_PERSONALITY)) {
+                release();
+                return false;
+            }
+            m_sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            m_single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (m_single_mmap) {
+                m_sq_bytes = m_cq_bytes = std::max(m_sq_bytes, m_cq_bytes);
+            }
+            m_sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+            m_sq_ring = mmap(nullptr, m_sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            m_cq_ring = m_single_mmap ? m_sq_ring : mmap(nullptr, m_cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            m_sqes = mmap(nullptr, m_sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+            if (m_sq_ring == MAP_FAILED || m_cq_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+                std::cerr << "Failed to map the io_uring queues, reading files on threads" << std::endl;
+                release();
+                return false;
+            }
+            auto* sq = static_cast<char*>(m_sq_ring);
+            auto* cq = static_cast<char*>(m_cq_ring);
+            m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+            m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+            m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+            m_sq_entries = params.sq_entries;
+            m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+            m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+            m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        bool isOpen() const { return m_fd >= 0; }
+
+        unsigned capacity() const { return m_sq_entries; }
+
+        /// <summary>
+        /// Next free submission entry, cleared; the queue never holds more than capacity() entries
+        /// because every file has at most one submission in flight.
+        /// </summary>
+        io_uring_sqe& next()
+        {
+            const unsigned tail = *m_sq_tail + m_queued;
+            const unsigned index = tail & m_sq_mask;
+            io_uring_sqe& sqe = static_cast<io_uring_sqe*>(m_sqes)[index];
+            sqe = {};
+            m_sq_array[index] = index;
+            m_queued++;
+            return sqe;
+        }
+
+        /// <summary>
+        /// Submits the queued entries and waits for at least one completion when wait is set.
+        /// </summary>
+        void submit(const bool wait)
+        {
+            std::atomic_ref(*m_sq_tail).store(*m_sq_tail + m_queued, std::memory_order_release);
+            const unsigned count = m_queued;
+            m_queued = 0;
+            while (syscall(__NR_io_uring_enter, m_fd, count, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0 && errno == EINTR) {
+            }
+        }
+
+        /// <summary>
+        /// Calls fn(user_data, result) for every completion.
+        /// </summary>
+        template <typename Fn>
+        void reap(Fn&& fn)
+        {
+            unsigned head = *m_cq_head;
+            const unsigned tail = std::atomic_ref(*m_cq_tail).load(std::memory_order_acquire);
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+                fn(cqe.user_data, cqe.res);
+            }
+            std::atomic_ref(*m_cq_head).store(head, std::memory_order_release);
+        }
+
+        /// <summary>
+        /// Queues a poll of the wake pipe (user_data ~0), completed by wake().
+        /// </summary>
+        void pollWake()
+        {
+            io_uring_sqe& sqe = next();
+            sqe.opcode = IORING_OP_POLL_ADD;
+            sqe.fd = m_wake_read_fd;
+            sqe.poll_events = POLLIN;
+            sqe.user_data = ~uint64_t(0);
+        }
+
+        void drainWake()
+        {
+            char buffer[64];
+            while (read(m_wake_read_fd, buffer, sizeof(buffer)) > 0) {
+            }
+        }
+
+        void wake() const
+        {
+            if (m_wake_fd >= 0) {
+                const char byte = 0;
+                [[maybe_unused]] const auto written = write(m_wake_fd, &byte, 1);
+            }
+        }
+
+    private:
+        void release()
+        {
+            if (m_sqes != nullptr && m_sqes != MAP_FAILED) {
+                munmap(m_sqes, m_sqes_bytes);
+            }
+            if (!m_single_mmap && m_cq_ring != nullptr && m_cq_ring != MAP_FAILED) {
+                munmap(m_cq_ring, m_cq_bytes);
+            }
+            if (m_sq_ring != nullptr && m_sq_ring != MAP_FAILED) {
+                munmap(m_sq_ring, m_sq_bytes);
+            }
+            for (int* fd : { &m_fd, &m_wake_fd, &m_wake_read_fd }) {
+                if (*fd >= 0) {
+                    close(*fd);
+                }
+                *fd = -1;
+            }
+            m_sq_ring = m_cq_ring = m_sqes = nullptr;
+        }
+
+        int m_fd = -1;
+        int m_wake_fd = -1, m_wake_read_fd = -1;
+        void* m_sq_ring = nullptr;
+        void* m_cq_ring = nullptr;
+        void* m_sqes = nullptr;
+        bool m_single_mmap = false;
+        size_t m_sq_bytes = 0, m_cq_bytes = 0, m_sqes_bytes = 0;
+        unsigned *m_sq_tail = nullptr, *m_sq_array = nullptr;
+        unsigned *m_cq_head = nullptr, *m_cq_tail = nullptr;
+        unsigned m_sq_mask = 0, m_cq_mask = 0, m_sq_entries = 0;
+        io_uring_cqe* m_cqes = nullptr;
+        unsigned m_queued = 0;
+    };
+
+    void queueStep(const size_t index, const Step step)
+    {
+        File& file = m_files[index];
+        io_uring_sqe& sqe = m_ring.next();
+        sqe.user_data = (uint64_t(step) << STEP_SHIFT) | index;
+        switch (step) {
+        case Open:
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uint64_t>(file.path.c_str());
+            sqe.open_flags = O_RDONLY | O_CLOEXEC;
+            break;
+        case Stat:
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = file.fd;
+            sqe.addr = reinterpret_cast<uint64_t>("");
+            sqe.len = STATX_SIZE;
+            sqe.off = reinterpret_cast<uint64_t>(&file.status);
+            sqe.statx_flags = AT_EMPTY_PATH;
+            break;
+        case Read:
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = file.fd;
+            sqe.addr = reinterpret_cast<uint64_t>(file.bytes.data() + file.offset);
+            sqe.len = unsigned(std::min(file.bytes.size() - file.offset, size_t(INT_MAX)));
+            sqe.off = file.offset;
+            break;
+        case Close:
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = file.fd;
+            break;
+        }
+    }
+
+    // Advances the chain of a file by the completion of one of its steps.
+    void completeStep(const size_t index, const Step step, const int result)
+    {
+        File& file = m_files[index];
+        if (step == Close) {
+            file.fd = -1;
+            finishFile(file, file.failed);
+            m_in_flight--;
+            return;
+        }
+        if (result < 0) {
+            file.failed = true;
+            if (file.fd >= 0) {
+                queueStep(index, Close);
+            } else {
+                finishFile(file, true);
+                m_in_flight--;
+            }
+            return;
+        }
+        if (step == Open) {
+            file.fd = result;
+            queueStep(index, Stat);
+        } else if (step == Stat) {
+            file.bytes.resize(size_t(file.status.stx_size));
+            queueStep(index, file.bytes.empty() ? Close : Read);
+        } else if (result == 0) {
+            // The file shrank since statx.
+            file.bytes.resize(file.offset);
+            queueStep(index, Close);
+        } else {
+            file.offset += size_t(result);
+            queueStep(index, file.offset < file.bytes.size() ? Read : Close);
+        }
+    }
+
+    void runRing()
+    {
+        bool polling = false;
+        for (;;) {
+            // Start the files the window has room for, one ring entry per file in flight and
+            // one for the wake pipe.
+            while (m_in_flight + 1 < int(m_ring.capacity())) {
+                size_t index;
+                {
+                    std::lock_guard lock(m_mutex);
+                    index = nextFileLocked();
+                }
+                if (index == m_files.size()) {
+                    break;
+                }
+                m_in_flight++;
+                queueStep(index, Open);
+            }
+            bool idle;
+            {
+                std::lock_guard lock(m_mutex);
+                idle = m_stop || m_next >= m_files.size();
+            }
+            if (m_in_flight == 0 && idle) {
+                break;
+            }
+            if (!polling) {
+                m_ring.pollWake();
+                polling = true;
+            }
+            m_ring.submit(true);
+            m_ring.reap([&](const uint64_t user_data, const int result) {
+                if (user_data == ~uint64_t(0)) {
+                    m_ring.drainWake();
+                    polling = false;
+                    return;
+                }
+                completeStep(size_t(user_data & ((uint64_t(1) << STEP_SHIFT) - 1)), Step(user_data >> STEP_SHIFT), result);
+            });
+        }
+    }
+
+    Ring m_ring;
+    // Files in their io_uring chain, only used by the ring thread.
+    int m_in_flight = 0;
+#endif
+
+    std::vector<File> m_files;
+    const size_t m_read_ahead;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    // Next file to start, files started and not taken, set by the destructor.
+    size_t m_next = 0;
+    size_t m_outstanding = 0;
+    bool m_stop = false;
+    std::vector<std::thread> m_threads;
+};
+
+#pragma endregion Batch file reader
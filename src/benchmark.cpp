@@ -0,0 +1,136 @@
+// Catch2 benchmarks of the kernels (a1_hdr_benchmark), see kernel_benchmark.h.
+#include "run_config.h"
+#include "your_code_here.h"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_session.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/reporters/catch_reporter_event_listener.hpp>
+#include <catch2/reporters/catch_reporter_registrars.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * Every kernel of makeKernelBenchmarks() (and makeIoBenchmarks() with bench_io) is a Catch2
+ * BENCHMARK of the test case "kernels", run for every size and thread count of the settings.
+ * Catch2 warms it up, takes the samples (10 unless --benchmark-samples says otherwise) and
+ * reports them with its bootstrapped mean and standard deviation; the listener below hands the
+ * samples to runKernelBenchmarks(), whose table (after the Catch2 output) and CSV report the
+ * median, the standard deviation and the rates as for "a1_hdr --benchmark".
+ *
+ * With bench_baseline, every kernel is compared with the CSV or JSON of an earlier run (of either
+ * executable) as in compareKernelResult(): the noise threshold combines the standard deviation
+ * Catch2 estimated from the samples with the one of the baseline. Every comparison is a check of
+ * the test case, so a regression fails the run (non-zero exit code) and shows in the Catch2
+ * reporters (JUnit, XML, ...) with its ratio and threshold.
+ *
+ * The run settings of a1_hdr are options of their own name ("--bench_sizes 512,2k"), and
+ * "--setting name=value" sets any other (filter_size, workload_stops, ...). Kernels with an
+ * untimed setup before every run (the cold io benchmarks) keep the timing of
+ * timeKernelSamples(), as a BENCHMARK times everything between its samples.
+ */
+
+namespace {
+
+// Settings of a1_hdr that are options of a1_hdr_benchmark.
+const char* const BENCHMARK_SETTINGS[] { "bench_sizes", "bench_threads", "bench_kernels", "bench_iters", "bench_io", "bench_io_dir", "bench_csv",
+    "bench_json", "bench_baseline", "bench_tolerance", "bench_noise_sigmas", "bench_counters", "bench_roofline", "bench_scaling" };
+
+// Configuration of the run, from the command line.
+RunConfig benchmark_config;
+
+// Statistics of the last BENCHMARK, empty when it did not run (--skip-benchmarks).
+std::optional<Catch::BenchmarkStats<>> last_benchmark_stats;
+
+class KernelBenchmarkListener : public Catch::EventListenerBase {
+public:
+    using Catch::EventListenerBase::EventListenerBase;
+
+    void benchmarkEnded(const Catch::BenchmarkStats<>& stats) override
+    {
+        last_benchmark_stats = stats;
+    }
+};
+
+// Times one kernel as a BENCHMARK: the median of the samples and their standard deviation.
+KernelTiming timeCatchBenchmark(const KernelBenchmark& benchmark, const KernelBenchmarkInputs& inputs)
+{
+    if (benchmark.prepare) {
+        return timeKernelSamples(benchmark, inputs, benchmark_config.benchmark);
+    }
+    last_benchmark_stats.reset();
+    BENCHMARK(benchmark.name + " " + std::to_string(inputs.hdr.width) + " " + std::to_string(getThreadCount()))
+    {
+        return benchmark.run(inputs);
+    };
+    if (!last_benchmark_stats || last_benchmark_stats->samples.empty()) {
+        return timeKernelSamples(benchmark, inputs, benchmark_config.benchmark);
+    }
+    std::vector<double> samples;
+    for (const auto& sample : last_benchmark_stats->samples) {
+        samples.push_back(std::chrono::duration<double, std::milli>(sample).count());
+    }
+    KernelTiming timing;
+    timing.samples = int(samples.size());
+    timing.stddev_ms = std::chrono::duration<double, std::milli>(last_benchmark_stats->standardDeviation.point).count();
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    timing.median_ms = samples[samples.size() / 2];
+    return timing;
+}
+
+}
+
+CATCH_REGISTER_LISTENER(KernelBenchmarkListener)
+
+TEST_CASE("kernels", "[benchmark]")
+{
+    std::ostringstream table;
+    std::vector<KernelComparison> comparisons;
+    runKernelBenchmarks(benchmark_config.durand, benchmark_config.benchmark, table, nullptr, &comparisons, timeCatchBenchmark);
+    std::cout << "\n" << table.str() << std::flush;
+    for (const auto& comparison : comparisons) {
+        INFO(comparison.kernel << " " << comparison.size << " with " << comparison.threads << " threads: " << comparison.ratio << "x baseline, threshold "
+                               << 100.0 * comparison.threshold << "%");
+        CHECK(comparison.verdict != "regression");
+    }
+}
+
+/// <summary>
+/// Runs the Catch2 session with the run settings of a1_hdr as extra options.
+/// </summary>
+/// <returns>the exit code of the session, 1 for invalid settings</returns>
+int main(int argc, char** argv)
+{
+    Catch::Session session;
+    session.configData().benchmarkSamples = 10;
+    std::vector<std::string> arguments { argv[0] };
+    auto cli = session.cli();
+    for (const std::string name : BENCHMARK_SETTINGS) {
+        cli |= Catch::Clara::Opt([&arguments, name](const std::string& value) { arguments.push_back("--" + name + "=" + value); }, "value")["--" + name](
+            "run setting " + name + " of a1_hdr");
+    }
+    cli |= Catch::Clara::Opt(Catch::Clara::accept_many, [&arguments](const std::string& setting) { arguments.push_back("--" + setting); }, "name=value")["--setting"]("any other run setting of a1_hdr");
+    session.cli(cli);
+    if (const int result = session.applyCommandLine(argc, argv); result != 0) {
+        return result;
+    }
+
+    std::vector<char*> setting_argv;
+    for (auto& argument : arguments) {
+        setting_argv.push_back(argument.data());
+    }
+    try {
+        parseRunArguments(benchmark_config, int(setting_argv.size()), setting_argv.data());
+    } catch (const std::exception&) {
+        printRunUsage(std::cerr);
+        return 1;
+    }
+    return session.run();
+}
@@ -0,0 +1,261 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "binary_mask.h"
+#include "bilateral_tiled.h"
+#include "scratch_arena.h"
+#include "tile_scheduler.h"
+
+/*
+ * Bilateral filter that evaluates the range kernel only where it matters.
+ *
+ * Large parts of an HDR frame (sky, walls) have a nearly constant log-luminance within the
+ * filter radius. There all range weights are close to 1 and the bilateral filter is a Gaussian
+ * blur, which is separable: 2 size taps per pixel instead of size^2. bilateralFilterAdaptive()
+ * works on the tiles of bilateralFilterTiled() and classifies every tile by the range (max - min)
+ * of its input footprint (tile plus radius), read from a MinMaxPyramid:
+ *
+ *  - if every value of the footprint is within R of every other, all range weights lie in
+ *    [m, 1] with m = exp(-R^2 / (2 range_sigma^2)), and a normalized average whose weights are
+ *    scaled by factors in [m, 1] moves by at most R (1 - sqrt(m)) / (1 + sqrt(m)) (two values
+ *    R apart, weighted for the largest shift). Tiles where this bound is at most
+ *    tolerance * range_sigma are flat and filtered with the separable Gaussian, cropped at the
+ *    borders like bilateralFilterBruteForce();
+ *  - the other tiles run the exact kernel of bilateralFilterTiled() (same taps and order).
+ *
+ * So no pixel deviates from the brute-force result by more than tolerance * range_sigma (plus
+ * float rounding). Flat tiles are much cheaper than edge tiles, the TileScheduler balances them.
+ */
+
+#pragma region Adaptive bilateral filter
+
+/// <summary>
+/// Default bound of the flat-tile error relative to range_sigma, see above.
+/// </summary>
+constexpr float BILATERAL_FLAT_TOLERANCE = 0.01f;
+
+/// <summary>
+/// Minimum and maximum of an image over square cells, from MINMAX_BLOCK pixels up to one cell,
+/// for bounds of the value range of rectangles.
+/// </summary>
+class MinMaxPyramid {
+public:
+    static constexpr int MINMAX_BLOCK = 8;
+
+    explicit MinMaxPyramid(const ImageView<const float> image)
+    {
+        Level base;
+        base.width = (image.width + MINMAX_BLOCK - 1) / MINMAX_BLOCK;
+        base.height = (image.height + MINMAX_BLOCK - 1) / MINMAX_BLOCK;
+        base.min.resize(size_t(base.width) * size_t(base.height));
+        base.max.resize(base.min.size());
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+        for (int by = 0; by < base.height; by++) {
+            const int y1 = std::min((by + 1) * MINMAX_BLOCK, image.height);
+            for (int bx = 0; bx < base.width; bx++) {
+                const int x0 = bx * MINMAX_BLOCK, x1 = std::min(x0 + MINMAX_BLOCK, image.width);
+                float low = image(x0, by * MINMAX_BLOCK), high = low;
+                for (int y = by * MINMAX_BLOCK; y < y1; y++) {
+                    const auto [min_it, max_it] = std::minmax_element(image.row(y) + x0, image.row(y) + x1);
+                    low = std::min(low, *min_it);
+                    high = std::max(high, *max_it);
+                }
+                base.min[size_t(by) * size_t(base.width) + bx] = low;
+                base.max[size_t(by) * size_t(base.width) + bx] = high;
+            }
+        }
+        m_levels.push_back(std::move(base));
+        while (m_levels.back().width > 1 || m_levels.back().height > 1) {
+            const Level& fine = m_levels.back();
+            Level coarse;
+            coarse.width = (fine.width + 1) / 2;
+            coarse.height = (fine.height + 1) / 2;
+            coarse.min.resize(size_t(coarse.width) * size_t(coarse.height));
+            coarse.max.resize(coarse.min.size());
+            for (int y = 0; y < coarse.height; y++) {
+                for (int x = 0; x < coarse.width; x++) {
+                    const auto [low, high] = fine.range(2 * x, 2 * y, std::min(2 * x + 2, fine.width), std::min(2 * y + 2, fine.height));
+                    coarse.min[size_t(y) * size_t(coarse.width) + x] = low;
+                    coarse.max[size_t(y) * size_t(coarse.width) + x] = high;
+                }
+            }
+            m_levels.push_back(std::move(coarse));
+        }
+    }
+
+    /// <summary>
+    /// Bounds of the values in a non-empty rectangle: the min and max over the cells of the
+    /// coarsest level that are at most a quarter of its longer side, so it spans few cells.
+    /// </summary>
+    std::pair<float, float> range(const PixelRect& rect) const
+    {
+        const int extent = std::max(rect.x1 - rect.x0, rect.y1 - rect.y0);
+        int level = 0;
+        while (level + 1 < int(m_levels.size()) && (MINMAX_BLOCK << (level + 1)) * 4 <= extent) {
+            level++;
+        }
+        const int cell = MINMAX_BLOCK << level;
+        return m_levels[level].range(rect.x0 / cell, rect.y0 / cell, (rect.x1 - 1) / cell + 1, (rect.y1 - 1) / cell + 1);
+    }
+
+private:
+    struct Level {
+        int width = 0, height = 0;
+        std::vector<float> min, max;
+
+        // Min and max over the cells [x0, x1) x [y0, y1).
+        std::pair<float, float> range(const int x0, const int y0, const int x1, const int y1) const
+        {
+            float low = min[size_t(y0) * size_t(width) + x0], high = max[size_t(y0) * size_t(width) + x0];
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    low = std::min(low, min[size_t(y) * size_t(width) + x]);
+                    high = std::max(high, max[size_t(y) * size_t(width) + x]);
+                }
+            }
+            return { low, high };
+        }
+    };
+
+    // MINMAX_BLOCK pixels per cell first, each further level halves the one before it.
+    std::vector<Level> m_levels;
+};
+
+/// <summary>
+/// Tiles of one bilateralFilterAdaptive() call.
+/// </summary>
+struct BilateralAdaptiveStats {
+    int tiles = 0;
+    int flat_tiles = 0;
+};
+
+/// <summary>
+/// Largest difference between the bilateral and the Gaussian average of values within range of
+/// each other, see above.
+/// </summary>
+inline float bilateralFlatError(const float range, const float range_sigma)
+{
+    const float sqrt_m = std::exp(-range * range / (4.0f * range_sigma * range_sigma));
+    return range * (1.0f - sqrt_m) / (1.0f + sqrt_m);
+}
+
+/// <summary>
+/// Gaussian filter of the output pixels [x0, x1) x [y0, y1) with the windows cropped to the
+/// image, a horizontal pass over the footprint rows into scratch and a vertical pass.
+/// </summary>
+inline void gaussianFilterTile(const ImageView<const float> H, const int x0, const int y0, const int x1, const int y1, const int radius,
+    const std::vector<float>& weights, const std::span<float> scratch, ImageFloat& result)
+{
+    const int hy0 = std::max(y0 - radius, 0);
+    const int hy1 = std::min(y1 + radius, H.height);
+    const int tile_width = x1 - x0;
+
+    for (int y = hy0; y < hy1; y++) {
+        const float* row = H.row(y);
+        float* out = &scratch[size_t(y - hy0) * size_t(tile_width)];
+        for (int x = x0; x < x1; x++) {
+            const int dx_min = std::max(-radius, -x);
+            const int dx_max = std::min(radius, H.width - 1 - x);
+            float K = 0.0f;
+            float filteredValue = 0.0f;
+            for (int dx = dx_min; dx <= dx_max; dx++) {
+                filteredValue += weights[dx + radius] * row[x + dx];
+                K += weights[dx + radius];
+            }
+            out[x - x0] = filteredValue / K;
+        }
+    }
+
+    for (int y = y0; y < y1; y++) {
+        const int dy_min = std::max(-radius, -y);
+        const int dy_max = std::min(radius, H.height - 1 - y);
+        float K = 0.0f;
+        for (int dy = dy_min; dy <= dy_max; dy++) {
+            K += weights[dy + radius];
+        }
+        float* out = result.data.data() + size_t(y) * size_t(H.width) + x0;
+        std::fill_n(out, tile_width, 0.0f);
+        for (int dy = dy_min; dy <= dy_max; dy++) {
+            const float weight = weights[dy + radius] / K;
+            const float* row = &scratch[size_t(y + dy - hy0) * size_t(tile_width)];
+#pragma omp simd
+            for (int x = 0; x < tile_width; x++) {
+                out[x] += weight * row[x];
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Bilateral filter with the separable Gaussian on flat tiles, see above.
+/// </summary>
+/// <param name="H">The intensity image (or a region of one) to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="tolerance">largest deviation from the exact filter on flat tiles, in units of range_sigma</param>
+/// <param name="tile_size">edge length of the output tiles</param>
+/// <param name="stats">receives the number of tiles and of flat tiles when given</param>
+/// <param name="output_stats">receives the statistics of the result tile by tile when given, see ImageStatsAccumulator::addBlock()</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterAdaptive(const ImageView<const float> H, const int size, const float space_sigma, const float range_sigma,
+    const float tolerance = BILATERAL_FLAT_TOLERANCE, const int tile_size = currentKernelTuning().bilateral_tile, BilateralAdaptiveStats* stats = nullptr,
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+    const int radius = size / 2;
+
+    const auto spatialWeights = bilateralSpatialWeights(size, space_sigma);
+    auto axisWeights = std::vector<float>(size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        axisWeights[i + radius] = exp(-(i * i) / (2.0f * space_sigma * space_sigma));
+    }
+    const auto range_weight = [range_sigma](const float diff) {
+        return exp(-diff * diff / (2.0f * range_sigma * range_sigma));
+    };
+
+    const MinMaxPyramid ranges(H);
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+
+    const int tiles_x = (H.width + tile_size - 1) / tile_size;
+    const int tiles_y = (H.height + tile_size - 1) / tile_size;
+    std::atomic<int> flat_tiles { 0 };
+    TileScheduler scheduler("bilateralFilterAdaptive", tiles_x * tiles_y);
+
+#pragma omp parallel
+    scheduler.run([&](const int tile) {
+        const int x0 = (tile % tiles_x) * tile_size;
+        const int y0 = (tile / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, H.width);
+        const int y1 = std::min(y0 + tile_size, H.height);
+        // Halo buffer of the tile, large enough for both kinds of tiles.
+        ScratchScope scratch;
+        const auto halo = scratch.take<float>(size_t(x1 - x0 + 2 * radius) * size_t(y1 - y0 + 2 * radius));
+        const auto [low, high] = ranges.range(PixelRect { x0, y0, x1, y1 }.grown(radius, radius, radius, radius).clamped(H.width, H.height));
+        if (bilateralFlatError(high - low, range_sigma) <= tolerance * range_sigma) {
+            gaussianFilterTile(H, x0, y0, x1, y1, radius, axisWeights, halo, result);
+            flat_tiles.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            bilateralFilterTile(H, x0, y0, x1, y1, size, spatialWeights, range_weight, halo, result);
+        }
+        if (output_stats) {
+            output_stats->addBlock(std::as_const(result).view(x0, y0, x1 - x0, y1 - y0));
+        }
+    });
+    scheduler.throwIfCancelled();
+
+    if (stats) {
+        stats->tiles = tiles_x * tiles_y;
+        stats->flat_tiles = flat_tiles.load();
+    }
+    return result;
+}
+
+#pragma endregion Adaptive bilateral filter
@@ -0,0 +1,241 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "helpers.h"
+#include "scratch_arena.h"
+
+/*
+ * Bilateral grid (Chen, Paris and Durand 2007).
+ *
+ * The intensity image is splatted into a coarse 3D grid (x, y, intensity) sampled
+ * at the spatial and range sigmas, the grid is blurred by a small separable Gaussian
+ * and the result is sliced back out with trilinear interpolation.
+ * The cost is dominated by the splat and the slice, so it does not depend on the filter size.
+ */
+
+#pragma region Bilateral grid
+
+/// <summary>
+/// Homogeneous 3D grid of (weighted value, weight) pairs.
+/// Cells are stored with the intensity axis innermost so that slicing one pixel touches few cache lines.
+/// </summary>
+struct BilateralGrid {
+    int width, height, depth;
+    std::vector<glm::vec2> cells;
+
+    BilateralGrid(const int new_width, const int new_height, const int new_depth)
+        : width(new_width)
+        , height(new_height)
+        , depth(new_depth)
+        , cells(size_t(new_width) * size_t(new_height) * size_t(new_depth), glm::vec2(0.0f))
+    {
+    }
+
+    size_t offset(const int gx, const int gy, const int gz) const
+    {
+        return (size_t(gy) * size_t(width) + size_t(gx)) * size_t(depth) + size_t(gz);
+    }
+};
+
+/// <summary>
+/// Number of empty cells kept around the grid so that the blur never reads outside of it.
+/// </summary>
+constexpr int BILATERAL_GRID_PADDING = 2;
+
+/// <summary>
+/// Largest number of intensity cells of a grid, padding included. A range_sigma far below the
+/// intensity span would otherwise ask for millions of cells per column (or overflow int).
+/// </summary>
+constexpr int BILATERAL_GRID_MAX_DEPTH = 256;
+
+/// <summary>
+/// Intensity units per grid cell: range_sigma, or coarser when the span needs more than
+/// BILATERAL_GRID_MAX_DEPTH cells (the range Gaussian then widens to the cell size).
+/// </summary>
+inline float bilateralGridRangeStep(const float range_span, const float range_sigma)
+{
+    return std::max({ range_sigma, range_span / float(BILATERAL_GRID_MAX_DEPTH - 2 - 2 * BILATERAL_GRID_PADDING), 1e-6f });
+}
+
+/// <summary>
+/// Whether the grid samples the range axis of H at range_sigma, see bilateralGridRangeStep().
+/// </summary>
+inline bool bilateralGridResolvesRange(const ImageFloat& H, const float range_sigma)
+{
+    const auto [min_it, max_it] = std::minmax_element(H.data.begin(), H.data.end());
+    return min_it == H.data.end() || bilateralGridRangeStep(*max_it - *min_it, range_sigma) <= range_sigma;
+}
+
+/// <summary>
+/// Blurs the grid along one axis with a 5-tap Gaussian of sigma = 1 cell.
+/// </summary>
+/// <param name="grid">grid to blur in place</param>
+/// <param name="axis">0 = x, 1 = y, 2 = intensity</param>
+void blurBilateralGridAxis(BilateralGrid& grid, const int axis)
+{
+    // exp(-k^2 / 2) for k = 0, 1, 2, normalized to sum 1.
+    const float w0 = 1.0f;
+    const float w1 = std::exp(-0.5f);
+    const float w2 = std::exp(-2.0f);
+    const float norm = w0 + 2.0f * w1 + 2.0f * w2;
+    const std::array<float, 5> taps = { w2 / norm, w1 / norm, w0 / norm, w1 / norm, w2 / norm };
+
+    const int extent = axis == 0 ? grid.width : (axis == 1 ? grid.height : grid.depth);
+    const size_t stride = axis == 0 ? size_t(grid.depth) : (axis == 1 ? size_t(grid.width) * size_t(grid.depth) : 1);
+    // Number of independent 1D lines along the chosen axis.
+    const int num_lines = grid.width * grid.height * grid.depth / extent;
+
+#pragma omp parallel num_threads(kernelThreads(int64_t(grid.width) * grid.height * grid.depth, KernelCost::Medium))
+    {
+        ScratchScope scratch;
+        const auto line = scratch.take<glm::vec2>(size_t(extent));
+#pragma omp for
+        for (int l = 0; l < num_lines; l++) {
+            // Decompose the line index into the coordinates of the two remaining axes.
+            size_t start;
+            if (axis == 0) {
+                start = grid.offset(0, l / grid.depth, l % grid.depth);
+            } else if (axis == 1) {
+                start = grid.offset(l / grid.depth, 0, l % grid.depth);
+            } else {
+                start = grid.offset(l % grid.width, l / grid.width, 0);
+            }
+
+            for (int i = 0; i < extent; i++) {
+                line[i] = grid.cells[start + size_t(i) * stride];
+            }
+            // Padding guarantees the outermost two cells are empty, so they are skipped.
+            for (int i = 2; i < extent - 2; i++) {
+                glm::vec2 sum(0.0f);
+                for (int k = -2; k <= 2; k++) {
+                    sum += taps[k + 2] * line[i + k];
+                }
+                grid.cells[start + size_t(i) * stride] = sum;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Splats an intensity image into a grid sampled every s_s pixels and s_r intensity units from
+/// range_min, the cells of the image starting at BILATERAL_GRID_PADDING.
+/// </summary>
+void splatBilateralGrid(const ImageFloat& H, BilateralGrid& grid, const float s_s, const float s_r, const float range_min)
+{
+    const int pad = BILATERAL_GRID_PADDING;
+    // Every grid row gathers the image rows inside its support,
+    // so each OpenMP thread owns the cells it writes and no atomics are needed.
+#pragma omp parallel for num_threads(kernelThreads(H, KernelCost::Light))
+    for (int gy = pad; gy < grid.height - pad; gy++) {
+        const int y_first = std::max(int(std::ceil(float(gy - pad - 1) * s_s)), 0);
+        const int y_last = std::min(int(std::floor(float(gy - pad + 1) * s_s)), H.height - 1);
+        for (int y = y_first; y <= y_last; y++) {
+            const float fy = float(y) / s_s + float(pad);
+            const float wy = 1.0f - std::abs(fy - float(gy));
+            if (wy <= 0.0f) {
+                continue;
+            }
+            for (int x = 0; x < H.width; x++) {
+                const float val = H.data[y * H.width + x];
+                const float fx = float(x) / s_s + float(pad);
+                const float fz = (val - range_min) / s_r + float(pad);
+                const int gx = int(fx);
+                const int gz = int(fz);
+                const float tx = fx - float(gx);
+                const float tz = fz - float(gz);
+
+                for (int i = 0; i < 2; i++) {
+                    const float wx = i == 0 ? 1.0f - tx : tx;
+                    for (int k = 0; k < 2; k++) {
+                        const float w = wy * wx * (k == 0 ? 1.0f - tz : tz);
+                        grid.cells[grid.offset(gx + i, gy, gz + k)] += w * glm::vec2(val, 1.0f);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Slices a blurred grid of splatBilateralGrid() with trilinear interpolation at each pixel's own
+/// (x, y, intensity) position.
+/// </summary>
+ImageFloat sliceBilateralGrid(const ImageFloat& H, const BilateralGrid& grid, const float s_s, const float s_r, const float range_min)
+{
+    const int pad = BILATERAL_GRID_PADDING;
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+#pragma omp parallel for num_threads(kernelThreads(H, KernelCost::Medium))
+    for (int y = 0; y < H.height; y++) {
+        const float fy = float(y) / s_s + float(pad);
+        const int gy = int(fy);
+        const float ty = fy - float(gy);
+        for (int x = 0; x < H.width; x++) {
+            const float val = H.data[y * H.width + x];
+            const float fx = float(x) / s_s + float(pad);
+            const float fz = (val - range_min) / s_r + float(pad);
+            const int gx = int(fx);
+            const int gz = int(fz);
+            const float tx = fx - float(gx);
+            const float tz = fz - float(gz);
+
+            glm::vec2 acc(0.0f);
+            for (int j = 0; j < 2; j++) {
+                const float wy = j == 0 ? 1.0f - ty : ty;
+                for (int i = 0; i < 2; i++) {
+                    const float wx = i == 0 ? 1.0f - tx : tx;
+                    const size_t base = grid.offset(gx + i, gy + j, gz);
+                    acc += wy * wx * ((1.0f - tz) * grid.cells[base] + tz * grid.cells[base + 1]);
+                }
+            }
+
+            // The pixel always splats into its own neighborhood, so the weight is positive.
+            result.data[y * H.width + x] = acc.y > 0.0f ? acc.x / acc.y : val;
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Approximates bilateralFilter() using a bilateral grid.
+/// The spatial axes are sampled every space_sigma pixels and the range axis every range_sigma,
+/// so memory and runtime only depend on the image size and its dynamic range; the range axis has
+/// at most BILATERAL_GRID_MAX_DEPTH cells.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="size">The kernel size. Unused except for validation, the grid implicitly uses the full Gaussian.</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterGrid(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+
+    const auto [min_it, max_it] = std::minmax_element(H.data.begin(), H.data.end());
+    const float range_min = *min_it;
+    const float range_span = *max_it - *min_it;
+
+    // Sampling rates (pixels and intensity units per grid cell).
+    const float s_s = std::max(space_sigma, 1.0f);
+    const float s_r = bilateralGridRangeStep(range_span, range_sigma);
+
+    const int pad = BILATERAL_GRID_PADDING;
+    auto grid = BilateralGrid(
+        int(float(H.width - 1) / s_s) + 2 + 2 * pad,
+        int(float(H.height - 1) / s_s) + 2 + 2 * pad,
+        int(range_span / s_r) + 2 + 2 * pad);
+
+    splatBilateralGrid(H, grid, s_s, s_r, range_min);
+
+    // Blur with a separable Gaussian of one cell in every axis.
+    for (int axis = 0; axis < 3; axis++) {
+        blurBilateralGridAxis(grid, axis);
+    }
+
+    return sliceBilateralGrid(H, grid, s_s, s_r, range_min);
+}
+
+#pragma endregion Bilateral grid
@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "helpers.h"
+#include "fast_math.h"
+
+/*
+ * Recursive bilateral filter (Yang 2012), O(1) per pixel in the filter radius.
+ *
+ * The spatial Gaussian is replaced by a first-order recursive (exponential) filter, run causally
+ * and anti-causally along the rows and then along the columns, with
+ * alpha = exp(-sqrt(2) / space_sigma) so that the spread matches the Gaussian. Between two
+ * neighbours the recursion is attenuated by the range Gaussian of their intensity difference in
+ * the input, so the weight of a pixel is the product of the range weights along the path to it:
+ * the filter does not leak across an edge, even where the two sides have similar intensities.
+ * A second recursion on a constant image gives the normalization.
+ *
+ * The cost is four passes over the image, independent of filter_size, so the spatial sigma can
+ * scale with the image (radii of 100 and more at 8K). The result differs from the brute-force
+ * filter: the spatial kernel is an exponential with a path-dependent range weight, not a Gaussian
+ * window weighted by the intensity difference to the center.
+ */
+
+#pragma region Recursive bilateral filter
+
+/// <summary>
+/// Range weights exp(-d^2 / (2 range_sigma^2)) between every pixel and its left (axis 0) or
+/// upper (axis 1) neighbour, 0 for pixels in the first column or row.
+/// </summary>
+std::vector<float> recursiveBilateralWeights(const ImageFloat& H, const int axis, const float range_sigma)
+{
+    const float range_scale = -0.5f / std::max(range_sigma * range_sigma, 1e-12f);
+    std::vector<float> weights(H.data.size(), 0.0f);
+#pragma omp parallel for num_threads(kernelThreads(H, KernelCost::Light))
+    for (int y = 0; y < H.height; y++) {
+        for (int x = 0; x < H.width; x++) {
+            if ((axis == 0 && x == 0) || (axis == 1 && y == 0)) {
+                continue;
+            }
+            const size_t i = size_t(y) * size_t(H.width) + size_t(x);
+            const size_t j = axis == 0 ? i - 1 : i - size_t(H.width);
+            const float d = H.data[i] - H.data[j];
+            weights[i] = tmoExp<MathPrecision::Fast>(d * d * range_scale);
+        }
+    }
+    return weights;
+}
+
+/// <summary>
+/// Approximates bilateralFilter() with recursive filters, see above. The filter size is not used.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterRecursive(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+
+    const int width = H.width;
+    const int height = H.height;
+    const float alpha = std::exp(-std::sqrt(2.0f) / std::max(space_sigma, 1e-3f));
+    const float gain = 1.0f - alpha;
+
+    // Rows: causal and anti-causal recursions of the value and of the normalization.
+    const auto weights_x = recursiveBilateralWeights(H, 0, range_sigma);
+    auto rows = ImageFloat::uninitialized(width, height);
+    auto rows_norm = ImageFloat::uninitialized(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+    for (int y = 0; y < height; y++) {
+        const size_t row = size_t(y) * size_t(width);
+        float value = 0.0f, norm = 0.0f;
+        for (int x = 0; x < width; x++) {
+            const float a = alpha * weights_x[row + size_t(x)];
+            value = gain * H.data[row + size_t(x)] + a * value;
+            norm = gain + a * norm;
+            rows.data[row + size_t(x)] = value;
+            rows_norm.data[row + size_t(x)] = norm;
+        }
+        value = 0.0f, norm = 0.0f;
+        for (int x = width - 1; x >= 0; x--) {
+            // value holds the anti-causal recursion of the right neighbour, carried over to x, so
+            // the pixel itself is counted once.
+            rows.data[row + size_t(x)] += value;
+            rows_norm.data[row + size_t(x)] += norm;
+            const float a = x > 0 ? alpha * weights_x[row + size_t(x)] : 0.0f;
+            value = a * (gain * H.data[row + size_t(x)] + value);
+            norm = a * (gain + norm);
+        }
+    }
+
+    // Columns, on the row result and its normalization, with the range weights of the input.
+    // Strips of columns keep the passes running along rows in memory.
+    const auto weights_y = recursiveBilateralWeights(H, 1, range_sigma);
+    constexpr int strip = 64;
+    auto result = ImageFloat::uninitialized(width, height);
+    auto result_norm = ImageFloat::uninitialized(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+    for (int x0 = 0; x0 < width; x0 += strip) {
+        const int x1 = std::min(x0 + strip, width);
+        float value[strip], norm[strip];
+        std::fill(value, value + strip, 0.0f);
+        std::fill(norm, norm + strip, 0.0f);
+        for (int y = 0; y < height; y++) {
+            const size_t row = size_t(y) * size_t(width);
+            for (int x = x0; x < x1; x++) {
+                const float a = alpha * weights_y[row + size_t(x)];
+                value[x - x0] = gain * rows.data[row + size_t(x)] + a * value[x - x0];
+                norm[x - x0] = gain * rows_norm.data[row + size_t(x)] + a * norm[x - x0];
+                result.data[row + size_t(x)] = value[x - x0];
+                result_norm.data[row + size_t(x)] = norm[x - x0];
+            }
+        }
+        std::fill(value, value + strip, 0.0f);
+        std::fill(norm, norm + strip, 0.0f);
+        for (int y = height - 1; y >= 0; y--) {
+            const size_t row = size_t(y) * size_t(width);
+            for (int x = x0; x < x1; x++) {
+                const float num = result.data[row + size_t(x)] + value[x - x0];
+                const float den = result_norm.data[row + size_t(x)] + norm[x - x0];
+                const float a = y > 0 ? alpha * weights_y[row + size_t(x)] : 0.0f;
+                value[x - x0] = a * (gain * rows.data[row + size_t(x)] + value[x - x0]);
+                norm[x - x0] = a * (gain * rows_norm.data[row + size_t(x)] + norm[x - x0]);
+                result.data[row + size_t(x)] = den > 0.0f ? num / den : H.data[row + size_t(x)];
+            }
+        }
+    }
+    return result;
+}
+
+#pragma endregion Recursive bilateral filter
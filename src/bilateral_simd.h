@@ -0,0 +1,155 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "bilateral_tiled.h"
+#include "scratch_arena.h"
+#include "simd.h"
+
+/*
+ * SIMD bilateral filter with runtime instruction-set dispatch.
+ *
+ * The tile kernel (bilateral_simd_kernel.inl) is written once against the SIMD layer (simd.h)
+ * and compiled for every instruction set by simd_instantiate.inl.
+ *
+ * The image is processed in tiles like bilateralFilterTiled(). Each tile is copied into a scratch
+ * buffer padded by the kernel radius, together with a validity mask that is 0 outside of the image,
+ * so the vector kernel evaluates every tap without bounds checks. The range Gaussian uses a
+ * polynomial exp() approximation with a relative error below 2e-7.
+ *
+ * The common filter sizes (5, 9, 15, 27 and 31) have kernels compiled for their size, with
+ * constant trip counts for the window loops; other sizes use the generic kernel. Tiles whose
+ * windows are all inside the image skip the validity weights. Every variant evaluates the same
+ * taps in the same order, so the result does not depend on which one runs.
+ */
+
+#pragma region SIMD bilateral filter
+
+/// <summary>
+/// One padded tile handed to the vector kernel.
+/// values/valid are (rows + 2 radius) x stride, with the tile origin at (radius, radius).
+/// </summary>
+struct BilateralSimdTile {
+    const float* values;
+    const float* valid;
+    // Every window of the tile is inside the image, valid is 1 for all its taps.
+    bool interior;
+    int stride;
+    int rows, cols;
+    // size x size spatial weights.
+    const float* spatial;
+    int size;
+    float neg_inv_two_range_sigma2;
+    float* out;
+    int out_stride;
+};
+
+#define HDR_SIMD_KERNEL "bilateral_simd_kernel.inl"
+#define HDR_SIMD_KERNEL_NAMESPACE bilateral
+#include "simd_instantiate.inl"
+
+/// <summary>
+/// Applies the bilateral filter with the kernel of the detected instruction set, the one-lane
+/// kernel of the SIMD layer on CPUs without a vector instruction set.
+/// </summary>
+/// <param name="H">The intensity image (or a region of one) to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="isa">instruction set to use (defaults to the detected one)</param>
+/// <param name="output_stats">receives the statistics of the result tile by tile when given, see ImageStatsAccumulator::addBlock()</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterSimd(const ImageView<const float> H, const int size, const float space_sigma, const float range_sigma, const SimdIsa isa = detectSimdIsa(),
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+
+    void (*kernel)(const BilateralSimdTile&) = bilateral_scalar::tileKernel(size);
+    switch (isa) {
+#if defined(HDR_SIMD_X86)
+    case SimdIsa::Avx2:
+        kernel = bilateral_avx2::tileKernel(size);
+        break;
+    case SimdIsa::Avx512:
+        kernel = bilateral_avx512::tileKernel(size);
+        break;
+#endif
+#if defined(HDR_SIMD_NEON)
+    case SimdIsa::Neon:
+        kernel = bilateral_neon::tileKernel(size);
+        break;
+#endif
+    default:
+        break;
+    }
+    const int radius = size / 2;
+    const int tile_size = currentKernelTuning().bilateral_tile;
+
+    // Precompute spatial Gaussian weights into a flat size x size table.
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
+        }
+    }
+
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+
+    // Widest vector is 16 lanes, so padding the tile width to 16 keeps every load inside the scratch.
+    // Rows are further padded to whole cache lines so every scratch row starts aligned.
+    const int stride = imageRowStride<float>((tile_size + 15) / 16 * 16 + 2 * radius);
+    const int scratch_rows = tile_size + 2 * radius;
+    const int tiles_x = (H.width + tile_size - 1) / tile_size;
+    const int tiles_y = (H.height + tile_size - 1) / tile_size;
+    TileScheduler scheduler("bilateralFilterSimd", tiles_x * tiles_y);
+
+#pragma omp parallel
+    {
+        // Padded footprint and validity of the tiles, from the thread's arena.
+        ScratchScope scratch;
+        const auto values = scratch.take<float>(size_t(stride) * size_t(scratch_rows));
+        const auto valid = scratch.take<float>(size_t(stride) * size_t(scratch_rows));
+
+        scheduler.run([&](const int tile_index) {
+            const int x0 = (tile_index % tiles_x) * tile_size;
+            const int y0 = (tile_index / tiles_x) * tile_size;
+
+            // Padded input footprint, zero weight outside of the image.
+            for (int i = 0; i < scratch_rows; i++) {
+                const int y = y0 - radius + i;
+                for (int j = 0; j < stride; j++) {
+                    const int x = x0 - radius + j;
+                    const bool inside = x >= 0 && y >= 0 && x < H.width && y < H.height;
+                    values[size_t(i) * size_t(stride) + size_t(j)] = inside ? H(x, y) : 0.0f;
+                    valid[size_t(i) * size_t(stride) + size_t(j)] = inside ? 1.0f : 0.0f;
+                }
+            }
+
+            BilateralSimdTile tile;
+            tile.values = values.data();
+            tile.valid = valid.data();
+            tile.stride = stride;
+            tile.rows = std::min(tile_size, H.height - y0);
+            tile.cols = std::min(tile_size, H.width - x0);
+            tile.interior = x0 >= radius && y0 >= radius && x0 + tile.cols + radius <= H.width && y0 + tile.rows + radius <= H.height;
+            tile.spatial = spatialWeights.data();
+            tile.size = size;
+            tile.neg_inv_two_range_sigma2 = -1.0f / (2.0f * range_sigma * range_sigma);
+            tile.out = &result.data[y0 * H.width + x0];
+            tile.out_stride = H.width;
+            kernel(tile);
+            if (output_stats) {
+                output_stats->addBlock(std::as_const(result).view(x0, y0, tile.cols, tile.rows));
+            }
+        });
+    }
+    scheduler.throwIfCancelled();
+
+    return result;
+}
+
+#pragma endregion SIMD bilateral filter
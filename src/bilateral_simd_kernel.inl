@@ -0,0 +1,89 @@
+// Bilateral tile kernel shared by all SIMD instruction sets.
+//
+// This file is compiled once per ISA by simd_instantiate.inl (see bilateral_simd.h), against the
+// wrappers of the SIMD layer (simd.h).
+// Lanes process neighboring output pixels of the same row, so every lane accumulates its taps in
+// the same order as the scalar filter. Taps outside of the image have a zero validity weight,
+// which makes the loops branch-free.
+//
+// FixedSize > 0 compiles the kernel for that filter size: the window loops get constant trip
+// counts the compiler can unroll, the taps and their order stay the same. 0 reads the size from
+// the tile.
+// Tiles whose windows are all inside the image skip the validity weights (all 1).
+
+template <int FixedSize, bool Masked>
+void filterTileWith(const BilateralSimdTile& tile)
+{
+    const int size = FixedSize > 0 ? FixedSize : tile.size;
+    const int radius = size / 2;
+    const VecF neg_inv_two_sigma2 = set1(tile.neg_inv_two_range_sigma2);
+
+    for (int y = 0; y < tile.rows; y++) {
+        float* out_row = tile.out + size_t(y) * size_t(tile.out_stride);
+        for (int x = 0; x < tile.cols; x += LANES) {
+            const VecF val = loadu(tile.values + size_t(y + radius) * size_t(tile.stride) + size_t(x + radius));
+            VecF K = zero();
+            VecF filtered = zero();
+
+            for (int dy = 0; dy < size; dy++) {
+                const size_t row_offset = size_t(y + dy) * size_t(tile.stride) + size_t(x);
+                const float* row = tile.values + row_offset;
+                const float* valid = tile.valid + row_offset;
+                const float* spatial = tile.spatial + size_t(dy) * size_t(size);
+                for (int dx = 0; dx < size; dx++) {
+                    const VecF n_val = loadu(row + dx);
+                    const VecF diff = sub(val, n_val);
+                    const VecF range_weight = expNonPositive(mul(mul(diff, diff), neg_inv_two_sigma2));
+                    VecF weight = mul(set1(spatial[dx]), range_weight);
+                    if constexpr (Masked) {
+                        weight = mul(weight, loadu(valid + dx));
+                    }
+                    filtered = fmadd(weight, n_val, filtered);
+                    K = add(K, weight);
+                }
+            }
+
+            const VecF result = div(filtered, K);
+            if (x + LANES <= tile.cols) {
+                storeu(out_row + x, result);
+            } else {
+                // Partial vector at the right image border.
+                storePartial(out_row + x, result, tile.cols - x);
+            }
+        }
+    }
+}
+
+template <int FixedSize>
+void filterTileSized(const BilateralSimdTile& tile)
+{
+    if (tile.interior) {
+        filterTileWith<FixedSize, false>(tile);
+    } else {
+        filterTileWith<FixedSize, true>(tile);
+    }
+}
+
+void filterTile(const BilateralSimdTile& tile)
+{
+    filterTileSized<0>(tile);
+}
+
+// Kernel of a filter size, the specialized one for the common sizes.
+inline void (*tileKernel(const int size))(const BilateralSimdTile&)
+{
+    switch (size) {
+    case 5:
+        return filterTileSized<5>;
+    case 9:
+        return filterTileSized<9>;
+    case 15:
+        return filterTileSized<15>;
+    case 27:
+        return filterTileSized<27>;
+    case 31:
+        return filterTileSized<31>;
+    default:
+        return filterTile;
+    }
+}
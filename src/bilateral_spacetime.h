@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <utility>
+
+#include "bilateral_grid.h"
+
+/*
+ * Space-time bilateral grid for video.
+ *
+ * Filtering the log-luminance of every frame of a video on its own repeats most of the work of
+ * the previous frame, and the base layers of two frames differ wherever noise or a small motion
+ * moved an intensity across a grid cell, which shows as flicker after the detail is boosted. The
+ * space-time grid adds time as a fourth axis (x, y, t, intensity): the base layer of a frame is
+ * the bilateral filter over the frame and the frames before it, with a Gaussian of time_sigma
+ * frames along t.
+ *
+ * The grid of a window of frames is the stack of the 3D grids of its frames, and the separable
+ * blur along x, y and intensity does not mix frames, so every frame is splatted and blurred once,
+ * when it arrives, and its slice is kept for the next frames of the window. A frame then costs its
+ * own splat and blur, the weighted sum of the window's slices along t (a few grid cells per
+ * pixel) and the slice of its base layer at its own intensities. The window is causal, so a frame
+ * needs no later frame and the output has no latency.
+ *
+ * Every slice covers the intensity range of its frame only. Its range axis starts at a multiple of
+ * the range sigma, so the slices of frames with different ranges line up cell by cell in the sum.
+ * A frame of another resolution restarts the window.
+ */
+
+#pragma region Space-time bilateral grid
+
+/// <summary>
+/// Causal bilateral grid over (x, y, t, intensity) of consecutive frames, see above.
+/// </summary>
+class SpaceTimeBilateralGrid {
+public:
+    /// <param name="space_sigma">spatial sigma in pixels, the spacing of the x and y cells</param>
+    /// <param name="range_sigma">intensity sigma, the spacing of the intensity cells</param>
+    /// <param name="frames">frames of the window, the current one included (1 filters every frame on its own)</param>
+    /// <param name="time_sigma">sigma of the Gaussian along t in frames</param>
+    SpaceTimeBilateralGrid(const float space_sigma, const float range_sigma, const int frames, const float time_sigma)
+        : m_s_s(std::max(space_sigma, 1.0f))
+        , m_s_r(std::max(range_sigma, 1e-6f))
+        , m_frames(std::max(frames, 1))
+        , m_time_sigma(std::max(time_sigma, 1e-3f))
+    {
+    }
+
+    /// <summary>
+    /// Adds the next frame to the window and returns its base layer.
+    /// </summary>
+    /// <param name="H">log-luminance of the frame</param>
+    /// <returns>the filtered intensity of the frame</returns>
+    ImageFloat filter(const ImageFloat& H)
+    {
+        if (H.width != m_width || H.height != m_height) {
+            reset();
+            m_width = H.width;
+            m_height = H.height;
+        }
+        if (int(m_slices.size()) == m_frames) {
+            m_slices.pop_back();
+        }
+        m_slices.push_front(splatFrame(H));
+
+        // Range cells of the window, from the lowest slice to the highest.
+        int z_origin = m_slices.front().z_origin;
+        int z_end = z_origin + m_slices.front().grid.depth;
+        for (const auto& slice : m_slices) {
+            z_origin = std::min(z_origin, slice.z_origin);
+            z_end = std::max(z_end, slice.z_origin + slice.grid.depth);
+        }
+        const auto& front = m_slices.front().grid;
+        BilateralGrid window(front.width, front.height, z_end - z_origin);
+
+        // Sum of the slices along t, weighted by their age. The grid is homogeneous, so the
+        // weights need no normalization.
+        for (size_t age = 0; age < m_slices.size(); age++) {
+            const float weight = std::exp(-float(age * age) / (2.0f * m_time_sigma * m_time_sigma));
+            const auto& slice = m_slices[age];
+            const int shift = slice.z_origin - z_origin;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(window.width) * window.height * slice.grid.depth, KernelCost::Light))
+            for (int gy = 0; gy < window.height; gy++) {
+                for (int gx = 0; gx < window.width; gx++) {
+                    const glm::vec2* src = slice.grid.cells.data() + slice.grid.offset(gx, gy, 0);
+                    glm::vec2* dst = window.cells.data() + window.offset(gx, gy, shift);
+                    for (int gz = 0; gz < slice.grid.depth; gz++) {
+                        dst[gz] += weight * src[gz];
+                    }
+                }
+            }
+        }
+
+        return sliceBilateralGrid(H, window, m_s_s, m_s_r, float(z_origin) * m_s_r);
+    }
+
+    /// <summary>
+    /// Drops the frames of the window.
+    /// </summary>
+    void reset()
+    {
+        m_slices.clear();
+        m_width = 0;
+        m_height = 0;
+    }
+
+    /// <summary>
+    /// Frames in the window.
+    /// </summary>
+    int frames() const { return int(m_slices.size()); }
+
+private:
+    // Splatted and blurred 3D grid of one frame, its range axis starting at z_origin * s_r.
+    struct Slice {
+        BilateralGrid grid;
+        int z_origin;
+    };
+
+    Slice splatFrame(const ImageFloat& H) const
+    {
+        const auto [min_it, max_it] = std::minmax_element(H.data.begin(), H.data.end());
+        const int z_origin = int(std::floor(*min_it / m_s_r));
+        const int z_top = int(std::floor(*max_it / m_s_r));
+
+        const int pad = BILATERAL_GRID_PADDING;
+        // One cell more than bilateralFilterGrid() for the rounding of the shifted origin.
+        Slice slice {
+            BilateralGrid(int(float(H.width - 1) / m_s_s) + 2 + 2 * pad, int(float(H.height - 1) / m_s_s) + 2 + 2 * pad, z_top - z_origin + 3 + 2 * pad),
+            z_origin,
+        };
+        splatBilateralGrid(H, slice.grid, m_s_s, m_s_r, float(z_origin) * m_s_r);
+        for (int axis = 0; axis < 3; axis++) {
+            blurBilateralGridAxis(slice.grid, axis);
+        }
+        return slice;
+    }
+
+    float m_s_s;
+    float m_s_r;
+    int m_frames;
+    float m_time_sigma;
+    int m_width = 0;
+    int m_height = 0;
+    // Slices of the window, the current frame first.
+    std::deque<Slice> m_slices;
+};
+
+#pragma endregion Space-time bilateral grid
@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "image_stats.h"
+#include "scratch_arena.h"
+#include "tile_scheduler.h"
+
+/*
+ * Tiled (cache-blocked) brute-force bilateral filter.
+ *
+ * The output is processed in square tiles. Each tile's input footprint (tile + radius halo,
+ * clipped to the image) is copied into a contiguous buffer of the thread's ScratchArena first, so the
+ * size x size window of every output pixel stays in L1/L2 regardless of the image width.
+ * Out-of-image pixels are skipped exactly like in bilateralFilterBruteForce() by clipping the
+ * window bounds, and the taps are accumulated in the same order, so the results are identical.
+ *
+ * The range weight is a template parameter, so the same loop also serves the lookup-table
+ * variant that removes exp() from the inner loop.
+ */
+
+#pragma region Tiled bilateral filter
+
+/// <summary>
+/// Default number of intervals of the range-kernel lookup table.
+/// </summary>
+constexpr int BILATERAL_RANGE_LUT_SIZE = 1024;
+
+/// <summary>
+/// Range Gaussian exp(-d^2 / (2 range_sigma^2)) tabulated over |d| in [0, max_difference]
+/// and evaluated with linear interpolation.
+/// </summary>
+struct RangeKernelLut {
+    float inv_step;
+    std::vector<float> table;
+
+    RangeKernelLut(const float max_difference, const float range_sigma, const int resolution = BILATERAL_RANGE_LUT_SIZE)
+        : table(size_t(resolution) + 2)
+    {
+        const float step = std::max(max_difference, 1e-6f) / float(resolution);
+        inv_step = 1.0f / step;
+        for (size_t i = 0; i < table.size(); i++) {
+            const float d = float(i) * step;
+            table[i] = exp(-d * d / (2.0f * range_sigma * range_sigma));
+        }
+    }
+
+    float operator()(const float difference) const
+    {
+        const float t = std::min(std::abs(difference) * inv_step, float(table.size() - 2));
+        const auto i = size_t(t);
+        const float frac = t - float(i);
+        return table[i] + frac * (table[i + 1] - table[i]);
+    }
+};
+
+/// <summary>
+/// Spatial Gaussian weights of the size x size window as a flat table, row by row.
+/// </summary>
+inline std::vector<float> bilateralSpatialWeights(const int size, const float space_sigma)
+{
+    const int radius = size / 2;
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
+        }
+    }
+    return spatialWeights;
+}
+
+/// <summary>
+/// Filters the output pixels [x0, x1) x [y0, y1) into result, see bilateralFilterTiled().
+/// scratch holds at least the clipped footprint, (x1 - x0 + 2 radius) * (y1 - y0 + 2 radius) values.
+/// </summary>
+template <typename RangeWeight>
+void bilateralFilterTile(const ImageView<const float> H, const int x0, const int y0, const int x1, const int y1, const int size,
+    const std::vector<float>& spatialWeights, const RangeWeight& range_weight, const std::span<float> scratch, ImageFloat& result)
+{
+    const int radius = size / 2;
+
+    // Input footprint of the tile clipped to the image.
+    const int hx0 = std::max(x0 - radius, 0);
+    const int hy0 = std::max(y0 - radius, 0);
+    const int hx1 = std::min(x1 + radius, H.width);
+    const int hy1 = std::min(y1 + radius, H.height);
+    const int halo_width = hx1 - hx0;
+
+    for (int y = hy0; y < hy1; y++) {
+        std::copy_n(H.row(y) + hx0, halo_width, &scratch[(y - hy0) * halo_width]);
+    }
+
+    for (int y = y0; y < y1; y++) {
+        // Window rows inside the image.
+        const int dy_min = std::max(-radius, hy0 - y);
+        const int dy_max = std::min(radius, hy1 - 1 - y);
+        for (int x = x0; x < x1; x++) {
+            const int dx_min = std::max(-radius, hx0 - x);
+            const int dx_max = std::min(radius, hx1 - 1 - x);
+
+            const float val = scratch[(y - hy0) * halo_width + (x - hx0)];
+            float K = 0.0f;
+            float filteredValue = 0.0f;
+
+            for (int dy = dy_min; dy <= dy_max; dy++) {
+                const float* row = &scratch[(y + dy - hy0) * halo_width + (x - hx0)];
+                const float* weights = &spatialWeights[(dy + radius) * size + radius];
+                for (int dx = dx_min; dx <= dx_max; dx++) {
+                    const float n_val = row[dx];
+                    // Compute range weight (intensity difference).
+                    float rangeWeight = range_weight(val - n_val);
+                    float weight = weights[dx] * rangeWeight;
+                    filteredValue += weight * n_val;
+                    K += weight;
+                }
+            }
+
+            // Normalize the result.
+            result.data[y * H.width + x] = filteredValue / K;
+        }
+    }
+}
+
+/// <summary>
+/// Tiled bilateral filter loop, see bilateralFilterTiled().
+/// RangeWeight maps the intensity difference (val - n_val) to the range weight.
+/// </summary>
+template <typename RangeWeight>
+ImageFloat bilateralFilterTiledWith(const ImageView<const float> H, const int size, const float space_sigma, const RangeWeight& range_weight, const int tile_size,
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+
+    // Kernel radius.
+    const int radius = size / 2;
+
+    // Precompute spatial Gaussian weights into a flat size x size table.
+    const auto spatialWeights = bilateralSpatialWeights(size, space_sigma);
+
+    // Empty output image.
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+
+    const int tiles_x = (H.width + tile_size - 1) / tile_size;
+    const int tiles_y = (H.height + tile_size - 1) / tile_size;
+    // Clipped border tiles are cheaper, stealing balances them, see TileScheduler.
+    TileScheduler scheduler("bilateralFilterTiled", tiles_x * tiles_y);
+
+#pragma omp parallel
+    scheduler.run([&](const int tile) {
+        const int x0 = (tile % tiles_x) * tile_size;
+        const int y0 = (tile / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, H.width);
+        const int y1 = std::min(y0 + tile_size, H.height);
+        // Halo buffer of the tile from the thread's arena.
+        ScratchScope scratch;
+        const auto halo = scratch.take<float>(size_t(x1 - x0 + 2 * radius) * size_t(y1 - y0 + 2 * radius));
+        bilateralFilterTile(H, x0, y0, x1, y1, size, spatialWeights, range_weight, halo, result);
+        if (output_stats) {
+            output_stats->addBlock(std::as_const(result).view(x0, y0, x1 - x0, y1 - y0));
+        }
+    });
+    scheduler.throwIfCancelled();
+
+    // Return filtered intensity.
+    return result;
+}
+
+/// <summary>
+/// Applies the brute-force bilateral filter tile by tile with halo regions.
+/// </summary>
+/// <param name="H">The intensity image (or a region of one) to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="tile_size">edge length of the output tiles</param>
+/// <param name="output_stats">receives the statistics of the result tile by tile when given, see ImageStatsAccumulator::addBlock()</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterTiled(const ImageView<const float> H, const int size, const float space_sigma, const float range_sigma, const int tile_size = currentKernelTuning().bilateral_tile,
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    const auto range_weight = [range_sigma](const float diff) {
+        return exp(-diff * diff / (2.0f * range_sigma * range_sigma));
+    };
+    return bilateralFilterTiledWith(H, size, space_sigma, range_weight, tile_size, output_stats);
+}
+
+/// <summary>
+/// bilateralFilterRangeLut() with a table over the given span of values instead of the range of
+/// H, so a region of an image is filtered with the table of the whole image.
+/// </summary>
+/// <param name="H">The intensity image (or a region of one) to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="value_span">maximum minus minimum value, at least that of H</param>
+/// <param name="lut_resolution">number of table intervals</param>
+/// <param name="output_stats">receives the statistics of the result tile by tile when given, see ImageStatsAccumulator::addBlock()</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterRangeLutSpan(const ImageView<const float> H, const int size, const float space_sigma, const float range_sigma, const float value_span,
+    const int lut_resolution = BILATERAL_RANGE_LUT_SIZE, ImageStatsAccumulator* output_stats = nullptr)
+{
+    const auto lut = RangeKernelLut(value_span, range_sigma, lut_resolution);
+    return bilateralFilterTiledWith(H, size, space_sigma, lut, currentKernelTuning().bilateral_tile, output_stats);
+}
+
+/// <summary>
+/// Tiled bilateral filter with the range Gaussian replaced by a lookup table.
+/// The table covers the full dynamic range of H, so no difference falls outside of it.
+/// Linear interpolation bounds the weight error by step^2 / (8 range_sigma^2), with step = (max - min) / lut_resolution.
+/// </summary>
+/// <param name="H">The intensity image (or a region of one) to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="lut_resolution">number of table intervals</param>
+/// <param name="output_stats">receives the statistics of the result tile by tile when given, see ImageStatsAccumulator::addBlock()</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterRangeLut(const ImageView<const float> H, const int size, const float space_sigma, const float range_sigma, const int lut_resolution = BILATERAL_RANGE_LUT_SIZE,
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    float min_val = H(0, 0);
+    float max_val = H(0, 0);
+    for (int y = 0; y < H.height; y++) {
+        const auto [min_it, max_it] = std::minmax_element(H.row(y), H.row(y) + H.width);
+        min_val = std::min(min_val, *min_it);
+        max_val = std::max(max_val, *max_it);
+    }
+    return bilateralFilterRangeLutSpan(H, size, space_sigma, range_sigma, max_val - min_val, lut_resolution, output_stats);
+}
+
+#pragma endregion Tiled bilateral filter
@@ -0,0 +1,259 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Binary masks.
+ *
+ * Mask files are 8-bit images, but every consumer only asks "value > 0.5". A
+ * BinaryMask stores that answer as one bit per pixel, 64 pixels per word, each row starting on
+ * a new word, so a mask takes 1/32 of the float image and a whole row is tested with a few word
+ * reads. Bits past the width of a row are always zero, which lets word operations (shifts for
+ * the left/right neighbours, or-ing the rows above and below) run over full words without
+ * masking the tail. Mask files are thresholded while loading, see BinaryMask(filePath).
+ */
+
+#pragma region Binary mask
+
+/// <summary>
+/// Axis-aligned pixel rectangle [x0, x1) x [y0, y1), empty when x0 >= x1 or y0 >= y1.
+/// </summary>
+struct PixelRect {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+    PixelRect united(const PixelRect& other) const
+    {
+        if (empty()) {
+            return other;
+        }
+        if (other.empty()) {
+            return *this;
+        }
+        return { std::min(x0, other.x0), std::min(y0, other.y0), std::max(x1, other.x1), std::max(y1, other.y1) };
+    }
+    PixelRect grown(const int left, const int top, const int right, const int bottom) const
+    {
+        return empty() ? *this : PixelRect { x0 - left, y0 - top, x1 + right, y1 + bottom };
+    }
+    PixelRect clamped(const int width, const int height) const
+    {
+        return { std::max(x0, 0), std::max(y0, 0), std::min(x1, width), std::min(y1, height) };
+    }
+};
+
+/// <summary>
+/// One bit per pixel mask.
+/// </summary>
+class BinaryMask {
+public:
+    BinaryMask() = default;
+
+    /// <summary>
+    /// Empty (all clear) mask.
+    /// </summary>
+    BinaryMask(const int width, const int height)
+        : m_width(width)
+        , m_height(height)
+        , m_words_per_row((width + 63) / 64)
+        , m_bits(static_cast<size_t>(m_words_per_row) * static_cast<size_t>(height), 0)
+    {
+    }
+
+    /// <summary>
+    /// Thresholds a float mask, pixels with value > threshold are set. Implicit so that functions
+    /// taking a mask also accept the float mask.
+    /// </summary>
+    BinaryMask(const ImageFloat& mask, const float threshold = 0.5f)
+        : BinaryMask(mask.width, mask.height)
+    {
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_width) * m_height, KernelCost::Light))
+        for (int y = 0; y < m_height; y++) {
+            const float* values = mask.data.data() + static_cast<size_t>(y) * static_cast<size_t>(m_width);
+            uint64_t* words = row(y);
+            for (int x = 0; x < m_width; x++) {
+                words[x >> 6] |= uint64_t(values[x] > threshold) << (x & 63);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Loads and thresholds a mask file without an intermediate float or RGB image: 8-bit files
+    /// are thresholded straight from the stb_image pixels (gray files decoded to one channel,
+    /// color files by their first channel like imageRgbToFloat()), other formats go through
+    /// ImageFloat.
+    /// </summary>
+    /// <param name="filePath">mask image</param>
+    /// <param name="threshold">pixels with value > threshold are set</param>
+    explicit BinaryMask(const std::filesystem::path& filePath, const float threshold = 0.5f)
+    {
+        if (!std::filesystem::exists(filePath)) {
+            std::cerr << "Mask file " << filePath << " does not exists!" << std::endl;
+            throw std::exception();
+        }
+        const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+        int width, height, channels;
+        if (!stbi_info(filePathStr.c_str(), &width, &height, &channels) || stbi_is_hdr(filePathStr.c_str())) {
+            *this = BinaryMask(ImageFloat(filePath), threshold);
+            return;
+        }
+
+        const int requested_channels = channels <= 2 ? 1 : 0;
+        stbi_uc* pixels = stbi_load(filePathStr.c_str(), &width, &height, &channels, requested_channels);
+        if (!pixels) {
+            std::cerr << "Failed to read mask " << filePath << " using stb_image.h" << std::endl;
+            throw std::exception();
+        }
+        const int stride = requested_channels != 0 ? requested_channels : channels;
+
+        *this = BinaryMask(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_width) * m_height, KernelCost::Light))
+        for (int y = 0; y < m_height; y++) {
+            const stbi_uc* values = pixels + static_cast<size_t>(y) * static_cast<size_t>(m_width) * static_cast<size_t>(stride);
+            uint64_t* words = row(y);
+            for (int x = 0; x < m_width; x++) {
+                // Same value as stbToType<float>().
+                words[x >> 6] |= uint64_t(float(values[x * stride]) / 255.0f > threshold) << (x & 63);
+            }
+        }
+        stbi_image_free(pixels);
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int wordsPerRow() const { return m_words_per_row; }
+
+    /// <summary>
+    /// Pixel (x, y), which must be inside the mask.
+    /// </summary>
+    bool operator()(const int x, const int y) const
+    {
+        return (row(y)[x >> 6] >> (x & 63)) & 1u;
+    }
+
+    void set(const int x, const int y, const bool value)
+    {
+        uint64_t& word = row(y)[x >> 6];
+        const uint64_t bit = uint64_t(1) << (x & 63);
+        word = value ? (word | bit) : (word & ~bit);
+    }
+
+    const uint64_t* row(const int y) const { return m_bits.data() + static_cast<size_t>(y) * static_cast<size_t>(m_words_per_row); }
+    uint64_t* row(const int y) { return m_bits.data() + static_cast<size_t>(y) * static_cast<size_t>(m_words_per_row); }
+
+    /// <summary>
+    /// True when no pixel of row y is set (also for rows outside of the mask).
+    /// </summary>
+    bool rowEmpty(const int y) const
+    {
+        if (y < 0 || y >= m_height) {
+            return true;
+        }
+        const uint64_t* words = row(y);
+        return std::all_of(words, words + m_words_per_row, [](const uint64_t word) { return word == 0; });
+    }
+
+    /// <summary>
+    /// 64 pixels of row y starting at column x (may be negative), pixels outside of the mask are clear.
+    /// </summary>
+    uint64_t bitsAt(const int x, const int y) const
+    {
+        if (y < 0 || y >= m_height) {
+            return 0;
+        }
+        const int word = x >= 0 ? x / 64 : -((63 - x) / 64);
+        const int shift = x - word * 64;
+        const uint64_t* words = row(y);
+        const uint64_t low = word >= 0 && word < m_words_per_row ? words[word] : 0;
+        if (shift == 0) {
+            return low;
+        }
+        const uint64_t high = word + 1 >= 0 && word + 1 < m_words_per_row ? words[word + 1] : 0;
+        return (low >> shift) | (high << (64 - shift));
+    }
+
+    /// <summary>
+    /// Bounding box of the set pixels (empty rectangle for an empty mask).
+    /// </summary>
+    PixelRect bounds() const
+    {
+        PixelRect box { m_width, m_height, 0, 0 };
+        for (int y = 0; y < m_height; y++) {
+            const uint64_t* words = row(y);
+            for (int i = 0; i < m_words_per_row; i++) {
+                if (words[i] != 0) {
+                    box.x0 = std::min(box.x0, i * 64 + std::countr_zero(words[i]));
+                    box.x1 = std::max(box.x1, i * 64 + 64 - std::countl_zero(words[i]));
+                    box.y0 = std::min(box.y0, y);
+                    box.y1 = y + 1;
+                }
+            }
+        }
+        return box;
+    }
+
+    /// <summary>
+    /// Number of set pixels.
+    /// </summary>
+    size_t count() const
+    {
+        size_t total = 0;
+        for (const uint64_t word : m_bits) {
+            total += size_t(std::popcount(word));
+        }
+        return total;
+    }
+
+    /// <summary>
+    /// The mask translated into a width x height frame, with its pixel (0, 0) at (offset_x, offset_y).
+    /// </summary>
+    BinaryMask placed(const int width, const int height, const int offset_x, const int offset_y) const
+    {
+        auto result = BinaryMask(width, height);
+        const int tail = width % 64;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            const int sy = y - offset_y;
+            if (sy < 0 || sy >= m_height) {
+                continue;
+            }
+            uint64_t* words = result.row(y);
+            for (int i = 0; i < result.m_words_per_row; i++) {
+                words[i] = bitsAt(i * 64 - offset_x, sy);
+            }
+            if (tail != 0) {
+                words[result.m_words_per_row - 1] &= (uint64_t(1) << tail) - 1;
+            }
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Float mask with 1 for set and 0 for clear pixels.
+    /// </summary>
+    ImageFloat toImage() const
+    {
+        auto image = ImageFloat(m_width, m_height);
+        for (int y = 0; y < m_height; y++) {
+            for (int x = 0; x < m_width; x++) {
+                image.data[static_cast<size_t>(y) * static_cast<size_t>(m_width) + static_cast<size_t>(x)] = (*this)(x, y) ? 1.0f : 0.0f;
+            }
+        }
+        return image;
+    }
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_words_per_row = 0;
+    std::vector<uint64_t> m_bits;
+};
+
+#pragma endregion Binary mask
@@ -0,0 +1,306 @@
+// C interface of the tone-mapping and Poisson kernels (library a1_hdr), built with -DA1_HDR_CAPI=ON.
+#include "c_api.h"
+
+#include "run_config.h"
+#include "your_code_here.h"
+
+#include <framework/image_pool.h>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <new>
+#include <optional>
+#include <string>
+
+/*
+ * Implementation of c_api.h.
+ *
+ * Every call runs under ImageMemoryScope(&context->pool), so the images of the kernels come from
+ * the ImageBufferPool of the context and are recycled by the next call, and with the thread count
+ * of the context (restored for the host thread afterwards). Caller images are adapted at the
+ * boundary only: RGB buffers of vec3 rows are read through ImageView where the kernel takes views
+ * (the Poisson divergence), other inputs are copied once into pooled images, and results are
+ * copied row by row into the output with its stride and channels.
+ *
+ * Settings are run settings applied to a RunConfig (applyRunSetting()); the quality preset and
+ * the derived space_sigma are resolved per call as in parseRunArguments(). Kernels report errors
+ * by printing to std::cerr and throwing std::exception, which become A1HDR_FAILED; so does any
+ * other exception, none unwinds into the C caller.
+ */
+
+struct A1HdrContext {
+    // Declared first so that it outlives every image of a call.
+    ImageBufferPool pool;
+    RunConfig config;
+    std::string last_error;
+};
+
+namespace {
+
+#pragma region Caller images
+
+// Checks an image argument, describing the problem in the context.
+bool validImage(A1HdrContext* context, const A1HdrImage* image, const char* name, const bool mask)
+{
+    const auto fail = [&](const std::string& reason) {
+        context->last_error = std::string(name) + ": " + reason;
+        return false;
+    };
+    if (!image || !image->pixels) {
+        return fail("null image");
+    }
+    if (image->width < 1 || image->height < 1) {
+        return fail("size must be positive");
+    }
+    if (mask ? image->channels != 1 : image->channels != 3 && image->channels != 4) {
+        return fail(mask ? "masks have 1 channel" : "images have 3 or 4 channels");
+    }
+    if (image->row_stride < int64_t(image->width) * image->channels) {
+        return fail("row_stride is smaller than width * channels");
+    }
+    return true;
+}
+
+bool sameSize(A1HdrContext* context, const A1HdrImage& a, const A1HdrImage& b, const char* names)
+{
+    if (a.width != b.width || a.height != b.height) {
+        context->last_error = std::string(names) + " differ in size";
+        return false;
+    }
+    return true;
+}
+
+float* imageRow(const A1HdrImage& image, const int y) { return image.pixels + size_t(y) * size_t(image.row_stride); }
+
+// The RGB pixels of a caller image in place, when its rows are vec3 rows.
+std::optional<ImageView<const glm::vec3>> rgbView(const A1HdrImage& image)
+{
+    if (image.channels != 3 || image.row_stride % 3 != 0 || image.row_stride / 3 > std::numeric_limits<int>::max()) {
+        return std::nullopt;
+    }
+    return ImageView<const glm::vec3>(reinterpret_cast<const glm::vec3*>(image.pixels), image.width, image.height, int(image.row_stride / 3));
+}
+
+// Copy of the RGB pixels of a caller image into a pooled image.
+ImageRGB readRgb(const A1HdrImage& image)
+{
+    if (const auto view = rgbView(image)) {
+        return ImageRGB(*view);
+    }
+    auto result = ImageRGB::uninitialized(image.width, image.height);
+    const int channels = image.channels;
+#pragma omp parallel for num_threads(kernelThreads(result, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        const float* row = imageRow(image, y);
+        glm::vec3* out = result.data.data() + size_t(y) * size_t(image.width);
+        for (int x = 0; x < image.width; x++) {
+            out[x] = glm::vec3(row[x * channels], row[x * channels + 1], row[x * channels + 2]);
+        }
+    }
+    return result;
+}
+
+// Thresholds a 1-channel caller mask as BinaryMask(ImageFloat) does.
+BinaryMask readMask(const A1HdrImage& image)
+{
+    BinaryMask mask(image.width, image.height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(image.width) * image.height, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        const float* values = imageRow(image, y);
+        uint64_t* words = mask.row(y);
+        for (int x = 0; x < image.width; x++) {
+            words[x >> 6] |= uint64_t(values[x] > 0.5f) << (x & 63);
+        }
+    }
+    return mask;
+}
+
+// Writes RGB into a caller image of the same size, alpha 1 for 4 channels.
+void writeRgb(const ImageView<const glm::vec3> result, const A1HdrImage& image)
+{
+    const int channels = image.channels;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(image.width) * image.height, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        const glm::vec3* row = result.row(y);
+        float* out = imageRow(image, y);
+        if (channels == 3) {
+            std::copy_n(&row[0].x, size_t(image.width) * 3, out);
+            continue;
+        }
+        for (int x = 0; x < image.width; x++) {
+            out[x * 4] = row[x].x;
+            out[x * 4 + 1] = row[x].y;
+            out[x * 4 + 2] = row[x].z;
+            out[x * 4 + 3] = 1.0f;
+        }
+    }
+}
+
+#pragma endregion Caller images
+
+#pragma region Calls
+
+// The settings of a call: the preset and the derived space_sigma resolved as in parseRunArguments().
+RunConfig callConfig(const A1HdrContext& context)
+{
+    RunConfig config = context.config;
+    applyQualityPreset(config);
+    if (config.durand.filter_size < 1 || config.durand.filter_size % 2 == 0) {
+        std::cerr << "filter_size must be a positive odd integer." << std::endl;
+        throw std::exception();
+    }
+    if (!config.explicit_space_sigma) {
+        config.durand.space_sigma = config.durand.filter_size / 6.4f;
+    }
+    return config;
+}
+
+// Runs a call on the pool and the threads of the context; exceptions become the status.
+template <typename Fn>
+A1HdrStatus runCall(A1HdrContext* context, const char* name, const Fn& fn)
+{
+    if (!context) {
+        return A1HDR_INVALID_ARGUMENT;
+    }
+    context->last_error.clear();
+    const int host_threads = getThreadCount();
+    A1HdrStatus status = A1HDR_OK;
+    try {
+        ImageMemoryScope memory_scope(&context->pool);
+        setThreadCount(context->config.threads);
+        status = fn();
+    } catch (const std::bad_alloc&) {
+        context->last_error = std::string(name) + ": out of memory";
+        status = A1HDR_OUT_OF_MEMORY;
+    } catch (const std::exception&) {
+        // The failing stage printed the reason to std::cerr.
+        context->last_error = std::string(name) + " failed, see stderr";
+        status = A1HDR_FAILED;
+    } catch (...) {
+        // Nothing may unwind through the C interface.
+        context->last_error = std::string(name) + " failed with an unknown exception";
+        status = A1HDR_FAILED;
+    }
+    setThreadCount(host_threads);
+    return status;
+}
+
+#pragma endregion Calls
+
+} // namespace
+
+extern "C" {
+
+int32_t a1hdr_api_version(void)
+{
+    return A1HDR_API_VERSION;
+}
+
+A1HdrContext* a1hdr_context_create(const int32_t threads)
+{
+    try {
+        auto* context = new A1HdrContext();
+        context->config.threads = threads;
+        return context;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void a1hdr_context_destroy(A1HdrContext* context)
+{
+    delete context;
+}
+
+A1HdrStatus a1hdr_set_setting(A1HdrContext* context, const char* name, const char* value)
+{
+    if (!context || !name || !value) {
+        if (context) {
+            context->last_error = "a1hdr_set_setting: null name or value";
+        }
+        return A1HDR_INVALID_ARGUMENT;
+    }
+    context->last_error.clear();
+    // Applied to a copy, so that an invalid value leaves the settings unchanged.
+    RunConfig config = context->config;
+    try {
+        applyRunSetting(config, name, value);
+    } catch (const std::exception&) {
+        context->last_error = std::string("invalid setting ") + name + "=" + value + ", see stderr";
+        return A1HDR_INVALID_ARGUMENT;
+    } catch (...) {
+        context->last_error = std::string("setting ") + name + "=" + value + " failed with an unknown exception";
+        return A1HDR_FAILED;
+    }
+    context->config = std::move(config);
+    return A1HDR_OK;
+}
+
+void a1hdr_release_scratch(A1HdrContext* context)
+{
+    if (context) {
+        context->pool.release();
+    }
+}
+
+A1HdrStatus a1hdr_tone_map(A1HdrContext* context, const A1HdrImage* input, const A1HdrImage* output)
+{
+    return runCall(context, "a1hdr_tone_map", [&] {
+        if (!validImage(context, input, "input", false) || !validImage(context, output, "output", false) || !sameSize(context, *input, *output, "input and output")) {
+            return A1HDR_INVALID_ARGUMENT;
+        }
+        const auto config = callConfig(*context);
+        const auto result = toneMap(readRgb(*input), config.durand);
+        writeRgb(result, *output);
+        return A1HDR_OK;
+    });
+}
+
+A1HdrStatus a1hdr_poisson_composite(A1HdrContext* context, const A1HdrImage* target, const A1HdrImage* source, const A1HdrImage* mask, const int32_t offset_x,
+    const int32_t offset_y, const A1HdrImage* output)
+{
+    return runCall(context, "a1hdr_poisson_composite", [&] {
+        if (!validImage(context, target, "target", false) || !validImage(context, source, "source", false) || !validImage(context, mask, "mask", true)
+            || !validImage(context, output, "output", false) || !sameSize(context, *source, *mask, "source and mask")
+            || !sameSize(context, *target, *output, "target and output")) {
+            return A1HDR_INVALID_ARGUMENT;
+        }
+        const auto config = callConfig(*context);
+        const auto source_mask = readMask(*mask);
+        if (config.composite != CompositeMode::Poisson || config.membrane_clone) {
+            // Blends and the membrane clone take whole images.
+            const auto target_image = readRgb(*target);
+            const auto source_image = readRgb(*source);
+            writeRgb(config.composite != CompositeMode::Poisson
+                    ? compositeBlend(config.composite, source_image, target_image, source_mask, offset_x, offset_y, config.feather_radius, config.blend_levels)
+                    : MembraneClone(source_mask).apply(source_image, target_image, offset_x, offset_y),
+                *output);
+            return A1HDR_OK;
+        }
+        // The divergence reads RGB rows in place, see getMergedDivergenceRgb().
+        std::optional<ImageRGB> target_copy, source_copy;
+        auto target_view = rgbView(*target);
+        if (!target_view) {
+            target_view = target_copy.emplace(readRgb(*target));
+        }
+        auto source_view = rgbView(*source);
+        if (!source_view) {
+            source_view = source_copy.emplace(readRgb(*source));
+        }
+        ImageXYZ target_XYZ;
+        auto divergence_XYZ = getMergedDivergenceRgb(*source_view, *target_view, source_mask, target_XYZ, offset_x, offset_y);
+        target_copy.reset();
+        source_copy.reset();
+        const auto result_XYZ = solvePoissonXYZ(target_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method);
+        writeRgb(xyzToRGBSimd(result_XYZ), *output);
+        return A1HDR_OK;
+    });
+}
+
+const char* a1hdr_last_error(const A1HdrContext* context)
+{
+    return context ? context->last_error.c_str() : "null context";
+}
+
+} // extern "C"
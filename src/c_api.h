@@ -0,0 +1,109 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * C interface of the a1_hdr library (liba1_hdr / a1_hdr.dll), built with -DA1_HDR_CAPI=ON.
+ *
+ * Hosts in other languages (C#, Rust, ...) call the tone mapping and the Poisson compositing in
+ * process instead of starting the a1_hdr executable for every image. Images are caller-owned
+ * float buffers described by an A1HdrImage (pointer, size, channels and row stride); inputs are
+ * only read and results are written straight into the output buffer, which may be an input.
+ *
+ * An A1HdrContext holds the settings, the thread count and a pool of scratch buffers that is
+ * recycled from call to call, so the calls after the first on a size stop allocating. The OpenMP
+ * threads stay alive between calls of one host thread. A context serves one call at a time; use
+ * one context per host thread to run calls in parallel.
+ *
+ * Every call returns an A1HdrStatus. After a failure a1hdr_last_error() describes it; kernels
+ * that fail also print the reason to stderr, like the application.
+ *
+ * The ABI is plain C: no C++ types cross it, and structures only grow in new major versions
+ * (see A1HDR_API_VERSION).
+ */
+
+#if defined(_WIN32)
+#if defined(A1HDR_BUILD)
+#define A1HDR_API __declspec(dllexport)
+#else
+#define A1HDR_API __declspec(dllimport)
+#endif
+#else
+#define A1HDR_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Version of this interface, major * 10000 + minor. The major version changes on incompatible changes. */
+#define A1HDR_API_VERSION 10000
+
+typedef enum A1HdrStatus {
+    A1HDR_OK = 0,
+    /* A null pointer, an image of the wrong size or channels, or an invalid setting. */
+    A1HDR_INVALID_ARGUMENT = 1,
+    /* The kernel failed, see a1hdr_last_error() and stderr. */
+    A1HDR_FAILED = 2,
+    A1HDR_OUT_OF_MEMORY = 3,
+} A1HdrStatus;
+
+/*
+ * Caller-owned image of float pixels. Pixel (x, y) starts at pixels[y * row_stride + x * channels].
+ *  - channels: 1 (masks), 3 (RGB) or 4 (RGBA; alpha is ignored on input and set to 1 on output),
+ *  - row_stride: floats from the start of one row to the next, at least width * channels.
+ * RGB inputs with a row_stride that is a multiple of 3 are read in place where the kernel takes views.
+ */
+typedef struct A1HdrImage {
+    float* pixels;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int64_t row_stride;
+} A1HdrImage;
+
+typedef struct A1HdrContext A1HdrContext;
+
+/* A1HDR_API_VERSION of the library, to check against the header the host was built with. */
+A1HDR_API int32_t a1hdr_api_version(void);
+
+/*
+ * New context with the default settings. threads <= 0 uses all cores. Returns null when out of
+ * memory.
+ */
+A1HDR_API A1HdrContext* a1hdr_context_create(int32_t threads);
+
+/* Frees the context and its scratch buffers. Null is ignored. */
+A1HDR_API void a1hdr_context_destroy(A1HdrContext* context);
+
+/*
+ * Applies one run setting of the a1_hdr command line by name (see a1_hdr --help), e.g.
+ * ("filter_size", "33"), ("operator", "reinhard"), ("preset", "balanced"), ("poisson_iters", "500"),
+ * ("composite", "feather") or ("threads", "8"). Settings of inputs and outputs have no effect.
+ */
+A1HDR_API A1HdrStatus a1hdr_set_setting(A1HdrContext* context, const char* name, const char* value);
+
+/* Returns the scratch buffers the context keeps for later calls to the system. */
+A1HDR_API void a1hdr_release_scratch(A1HdrContext* context);
+
+/*
+ * Tone maps linear HDR RGB into output, display RGB in [0, 1] as in the tone-mapped file of
+ * a1_hdr, with the operator and the parameters of the settings. input and output have the same size.
+ */
+A1HDR_API A1HdrStatus a1hdr_tone_map(A1HdrContext* context, const A1HdrImage* input, const A1HdrImage* output);
+
+/*
+ * Composites source into target with the source pixel (0, 0) at target pixel (offset_x, offset_y):
+ * the set pixels of the mask (value > 0.5) take the gradients of the source and the result is the
+ * Poisson solve of the setting poisson_iters / poisson_method, or the membrane clone or the blend
+ * of the settings membrane_clone and composite. mask has 1 channel and the size of source; output
+ * has the size of target.
+ */
+A1HDR_API A1HdrStatus a1hdr_poisson_composite(A1HdrContext* context, const A1HdrImage* target, const A1HdrImage* source, const A1HdrImage* mask,
+    int32_t offset_x, int32_t offset_y, const A1HdrImage* output);
+
+/* Description of the last failure of a call on the context, "" after a success. Valid until the next call. */
+A1HDR_API const char* a1hdr_last_error(const A1HdrContext* context);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,362 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <framework/image_pool.h>
+#include <framework/image_write_queue.h>
+
+#include "color_simd.h"
+#include "poisson_fused.h"
+#include "ring_buffer.h"
+#include "your_code_here.h"
+
+/*
+ * Seamless cloning of an object into the frames of a video.
+ *
+ * Solving every frame cold (poisson_iters sweeps from the target frame) ignores that the frames
+ * of a clip are mostly the same. The solution of a frame is its cut-and-paste composite (source
+ * pixels inside the mask, target pixels elsewhere) plus a smooth correction that removes the
+ * seam, and the correction changes little from frame to frame. CloneSequence keeps the
+ * correction of the previous frame and starts every solve from
+ *
+ *     u0 = composite(t) + (u(t - 1) - composite(t - 1)),
+ *
+ * i.e. from the previous solution corrected by the change of target and source. The image
+ * border is part of the target in both composites, so u0 keeps the Dirichlet border of frame t.
+ * Each plane is then swept with red-black SOR until its residual drops to tolerance times the
+ * residual of a cold start from the target frame (measured every check_every sweeps), which
+ * warm starts reach in a fraction of the sweeps. The first frame and frames of another size
+ * start from the composite.
+ *
+ * cloneSequenceFiles() pipelines the clip: a decoder thread reads target, source and mask
+ * frames (a single source or mask is read once and reused), a second thread builds the merged
+ * divergence and the composite (getMergedDivergenceRgb()), the solver runs with all kernel
+ * threads, and the XYZ to RGB conversion and encoding run on an ImageWriteQueue, so decoding,
+ * divergence and encoding of neighbouring frames overlap the solve.
+ */
+
+#pragma region Clone sequences
+
+/// <summary>
+/// Convergence and pipelining options of CloneSequence.
+/// </summary>
+struct CloneSequenceOptions {
+    // Stop when the residual of a plane is at most tolerance times that of a cold start.
+    float tolerance = 1e-3f;
+    // SOR sweeps between residual measurements.
+    int check_every = 20;
+    // Upper bound of the sweeps per frame and plane.
+    int max_iters = 2000;
+    // Start from the previous frame; false starts every frame from its composite.
+    bool warm_start = true;
+    // Frames cloneSequenceFiles() decodes and prepares ahead of the solve.
+    int prepare_ahead = 2;
+};
+
+/// <summary>
+/// Solve of one frame.
+/// </summary>
+struct CloneFrameStats {
+    // Sweeps of the slowest plane.
+    int iterations = 0;
+    // Largest residual of a plane relative to its cold start.
+    float relative_residual = 0.0f;
+    bool warm_started = false;
+};
+
+/// <summary>
+/// Poisson problem of one frame, see prepareCloneFrame().
+/// </summary>
+struct CloneFrameProblem {
+    // Source XYZ inside the mask, target XYZ elsewhere and on the image border.
+    ImageXYZ composite;
+    // Merged divergence per plane, as getMergedDivergenceRgb().
+    ImageXYZ divergence;
+    // Squared residual norm of the target frame per plane, the start of a cold solve.
+    std::array<double, 3> cold_norm2 {};
+};
+
+/// <summary>
+/// Builds the problem of a frame: merged divergence, composite and cold residuals.
+/// </summary>
+/// <param name="target">target frame in RGB</param>
+/// <param name="source">source in RGB, at the size of the mask and placed at (0, 0)</param>
+/// <param name="source_mask">pixels taking the source gradients</param>
+inline CloneFrameProblem prepareCloneFrame(const ImageRGB& target, const ImageRGB& source, const BinaryMask& source_mask)
+{
+    CloneFrameProblem problem;
+    problem.divergence = getMergedDivergenceRgb(source, target, source_mask, problem.composite);
+    problem.cold_norm2 = { poissonResidualNorm2(problem.composite.X, problem.divergence.X), poissonResidualNorm2(problem.composite.Y, problem.divergence.Y),
+        poissonResidualNorm2(problem.composite.Z, problem.divergence.Z) };
+
+    // The source pixels of the mask, except on the image border.
+    const auto source_XYZ = rgbToXYZSimd(source);
+    const int w = target.width;
+    const int rows = std::min(source_mask.height(), target.height - 1);
+    const int columns = std::min(source_mask.width(), w - 1);
+#pragma omp parallel for num_threads(kernelThreads(target, KernelCost::Light))
+    for (int y = 1; y < rows; y++) {
+        for (int x = 1; x < columns; x++) {
+            if (source_mask(x, y)) {
+                forEachPlane([&](ImageFloat& composite, const ImageFloat& source_plane) {
+                    composite.data[size_t(y) * size_t(w) + x] = source_plane.data[size_t(y) * size_t(source_XYZ.X.width) + x];
+                }, problem.composite, source_XYZ);
+            }
+        }
+    }
+    return problem;
+}
+
+/// <summary>
+/// Poisson composites of consecutive frames with warm starts, see above.
+/// </summary>
+class CloneSequence {
+public:
+    explicit CloneSequence(const CloneSequenceOptions& options = {})
+        : m_options(options)
+    {
+    }
+
+    /// <summary>
+    /// Solves the next frame.
+    /// </summary>
+    /// <returns>composite in XYZ</returns>
+    ImageXYZ process(CloneFrameProblem problem, CloneFrameStats* stats = nullptr)
+    {
+        const ScopedStage stage("CloneSequence::process", problem.composite.X.data.size());
+        const int w = problem.composite.X.width, h = problem.composite.X.height;
+        const bool warm = m_options.warm_start && m_correction.X.width == w && m_correction.X.height == h;
+        auto u = problem.composite;
+        if (warm) {
+            forEachPlane([&](ImageFloat& plane, const ImageFloat& correction) {
+                const int64_t count = int64_t(plane.data.size());
+#pragma omp parallel for simd num_threads(kernelThreads(count, KernelCost::Light))
+                for (int64_t i = 0; i < count; i++) {
+                    plane.data[i] += correction.data[i];
+                }
+            }, u, m_correction);
+        }
+
+        const float omega = computeOptimalSorOmega(w, h);
+        const double tolerance2 = double(m_options.tolerance) * double(m_options.tolerance);
+        CloneFrameStats frame { 0, 0.0f, warm };
+        ImageFloat* planes[3] = { &u.X, &u.Y, &u.Z };
+        const ImageFloat* divergences[3] = { &problem.divergence.X, &problem.divergence.Y, &problem.divergence.Z };
+        for (int p = 0; p < 3; p++) {
+            const double threshold2 = problem.cold_norm2[p] * tolerance2;
+            double norm2 = poissonResidualNorm2(*planes[p], *divergences[p]);
+            int iterations = 0;
+            while (iterations < m_options.max_iters && norm2 > threshold2) {
+                const int sweeps = std::min(std::max(m_options.check_every, 1), m_options.max_iters - iterations);
+                smoothPoissonRedBlack(*planes[p], *divergences[p], sweeps, omega);
+                iterations += sweeps;
+                norm2 = poissonResidualNorm2(*planes[p], *divergences[p]);
+            }
+            frame.iterations = std::max(frame.iterations, iterations);
+            const float relative = problem.cold_norm2[p] > 0.0 ? float(std::sqrt(norm2 / problem.cold_norm2[p])) : 0.0f;
+            frame.relative_residual = std::max(frame.relative_residual, relative);
+        }
+
+        // The correction of this frame, the warm start of the next one.
+        m_correction = std::move(problem.composite);
+        forEachPlane([&](ImageFloat& correction, const ImageFloat& solution) {
+            const int64_t count = int64_t(correction.data.size());
+#pragma omp parallel for simd num_threads(kernelThreads(count, KernelCost::Light))
+            for (int64_t i = 0; i < count; i++) {
+                correction.data[i] = solution.data[i] - correction.data[i];
+            }
+        }, m_correction, u);
+
+        m_frames++;
+        if (stats) {
+            *stats = frame;
+        }
+        return u;
+    }
+
+    int frames() const { return m_frames; }
+
+private:
+    CloneSequenceOptions m_options;
+    // Solution minus composite of the last frame.
+    ImageXYZ m_correction;
+    int m_frames = 0;
+};
+
+/// <summary>
+/// Files of one frame of a clone sequence.
+/// </summary>
+struct CloneFrameFiles {
+    std::filesystem::path target;
+    std::filesystem::path source;
+    std::filesystem::path mask;
+    std::filesystem::path output;
+};
+
+/// <summary>
+/// Image files of a directory (sorted), the lines of a list file, or a single image file.
+/// </summary>
+inline std::vector<std::filesystem::path> listFrameFiles(const std::filesystem::path& frames)
+{
+    std::vector<std::filesystem::path> files;
+    const auto is_image = [](const std::filesystem::path& path) {
+        const auto extension = path.extension();
+        return extension == ".png" || extension == ".jpg" || extension == ".jpeg" || extension == ".hdr" || extension == ".pfm" || extension == ".exr";
+    };
+    if (std::filesystem::is_directory(frames)) {
+        for (const auto& entry : std::filesystem::directory_iterator(frames)) {
+            if (entry.is_regular_file() && is_image(entry.path())) {
+                files.push_back(entry.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+    } else if (is_image(frames)) {
+        files.push_back(frames);
+    } else {
+        std::ifstream list(frames);
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                files.emplace_back(line);
+            }
+        }
+    }
+    return files;
+}
+
+/// <summary>
+/// Frames of a clone sequence: one per target frame, with a source and a mask that are single
+/// files for the whole clip or frames of the same count. Outputs are "<target stem>.png".
+/// </summary>
+inline std::vector<CloneFrameFiles> collectCloneFrames(const std::filesystem::path& targets, const std::filesystem::path& sources, const std::filesystem::path& masks,
+    const std::filesystem::path& output_dir)
+{
+    const auto target_files = listFrameFiles(targets);
+    const auto source_files = listFrameFiles(sources);
+    const auto mask_files = listFrameFiles(masks);
+    const auto matches = [&](const std::vector<std::filesystem::path>& files) { return files.size() == 1 || files.size() == target_files.size(); };
+    if (target_files.empty() || source_files.empty() || mask_files.empty() || !matches(source_files) || !matches(mask_files)) {
+        std::cerr << "Clone sequence needs one source and mask, or one per target frame (" << target_files.size() << " targets, " << source_files.size()
+                  << " sources, " << mask_files.size() << " masks)" << std::endl;
+        throw std::exception();
+    }
+    std::vector<CloneFrameFiles> frames;
+    for (size_t i = 0; i < target_files.size(); i++) {
+        frames.push_back({ target_files[i], source_files[source_files.size() == 1 ? 0 : i], mask_files[mask_files.size() == 1 ? 0 : i],
+            output_dir / (target_files[i].stem().string() + ".png") });
+    }
+    return frames;
+}
+
+/// <summary>
+/// Composites a clip frame by frame with CloneSequence, decoding and preparing the next frames
+/// and encoding the previous ones while a frame is solved.
+/// </summary>
+/// <param name="frames">files of the frames, in order</param>
+/// <param name="options">convergence and pipelining options</param>
+/// <param name="stats">receives the stats of every frame when given</param>
+/// <returns>frames per second</returns>
+inline double cloneSequenceFiles(const std::vector<CloneFrameFiles>& frames, const CloneSequenceOptions& options = {}, std::vector<CloneFrameStats>* stats = nullptr)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    ImageBufferPool frame_pool;
+    ImageMemoryScope memory_scope(&frame_pool);
+    // Declared after the pool, which must outlive the queued frames.
+    ImageWriteQueue output_queue;
+    CloneSequence sequence(options);
+
+    struct DecodedFrame {
+        ImageRGB target;
+        std::shared_ptr<const ImageRGB> source;
+        std::shared_ptr<const BinaryMask> mask;
+    };
+    const size_t ahead = size_t(std::max(options.prepare_ahead, 1));
+    SpscRing<DecodedFrame> decoded("clone decode", ahead);
+    SpscRing<CloneFrameProblem> prepared("clone prepare", ahead);
+
+    // The decoder stops at the end of the frames, on an error, or when its ring is closed.
+    std::exception_ptr decode_error, prepare_error;
+    std::thread decoder([&] {
+        ImageMemoryScope decode_scope(&frame_pool);
+        try {
+            std::shared_ptr<const ImageRGB> source;
+            std::shared_ptr<const BinaryMask> mask;
+            for (size_t i = 0; i < frames.size(); i++) {
+                if (!source || frames[i].source != frames[i - 1].source) {
+                    source = std::make_shared<const ImageRGB>(frames[i].source);
+                }
+                if (!mask || frames[i].mask != frames[i - 1].mask) {
+                    mask = std::make_shared<const BinaryMask>(frames[i].mask);
+                }
+                if (!decoded.push({ ImageRGB(frames[i].target), source, mask })) {
+                    break;
+                }
+            }
+        } catch (...) {
+            decode_error = std::current_exception();
+        }
+        decoded.close();
+    });
+    // The divergence of the next frame runs beside the solve with a share of the threads.
+    const int prepare_threads = std::max(getThreadCount() / 4, 1);
+    std::thread preparer([&] {
+        ImageMemoryScope prepare_scope(&frame_pool);
+        setThreadCount(prepare_threads);
+        try {
+            while (auto frame = decoded.pop()) {
+                if (!prepared.push(prepareCloneFrame(frame->target, *frame->source, *frame->mask))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            prepare_error = std::current_exception();
+        }
+        decoded.close();
+        prepared.close();
+    });
+    const auto join = [&] {
+        decoded.close();
+        prepared.close();
+        decoder.join();
+        preparer.join();
+    };
+
+    try {
+        for (size_t i = 0; i < frames.size(); i++) {
+            auto problem = prepared.pop();
+            if (!problem) {
+                break;
+            }
+            CloneFrameStats frame_stats;
+            auto result = std::make_shared<const ImageXYZ>(sequence.process(std::move(*problem), &frame_stats));
+            if (stats) {
+                stats->push_back(frame_stats);
+            }
+            output_queue.submit([result, path = frames[i].output] { xyzToRGBSimd(*result).writeToFile(path); });
+        }
+    } catch (...) {
+        join();
+        throw;
+    }
+    join();
+    for (const auto& error : { decode_error, prepare_error }) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    output_queue.flush();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    return seconds > 0.0 ? double(sequence.frames()) / seconds : 0.0;
+}
+
+#pragma endregion Clone sequences
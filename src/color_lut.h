@@ -0,0 +1,196 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "helpers.h"
+#include "execution.h"
+
+/*
+ * 3D color lookup tables: the look of a colorist applied to the tone-mapped display RGB.
+ *
+ * ColorLut3D::loadCube() reads the Adobe/Resolve .cube format (LUT_3D_SIZE, optional DOMAIN_MIN
+ * and DOMAIN_MAX, then size^3 RGB lines with red changing fastest); 33^3 and 65^3 grids are the
+ * usual sizes, any size from 2 to 256 is accepted. Inputs outside the domain are clamped to it.
+ *
+ * Colors are interpolated tetrahedrally: the grid cell of a color is split into the six
+ * tetrahedra along its gray diagonal, and the color is the weighted sum of the four corners of
+ * its tetrahedron (Kasson, Nin, Plouffe and Hafner 1995). The tetrahedron is chosen by comparing
+ * the three cell fractions without branches, so applyRow() is one omp simd loop with gathered
+ * corner loads. Neutral colors stay on the diagonal of the table, unlike trilinear interpolation.
+ *
+ * The table is set with the "look_lut" setting and applied to the result of every tone-mapping
+ * path: in the row loop of the fused encode (durandComposeQuantized()), so grading costs no pass
+ * over the image there, and in place on the float result elsewhere (applyLook()).
+ */
+
+#pragma region 3D color LUT
+
+class ColorLut3D {
+public:
+    static constexpr int MAX_SIZE = 256;
+
+    /// <summary>
+    /// Reads a .cube file, see above.
+    /// </summary>
+    static ColorLut3D loadCube(const std::filesystem::path& path)
+    {
+        std::ifstream file(path);
+        if (!file) {
+            std::cerr << "Cannot open LUT file " << path << std::endl;
+            throw std::exception();
+        }
+        ColorLut3D lut;
+        const auto fail = [&](const std::string& reason) {
+            std::cerr << "Invalid LUT file " << path << ": " << reason << std::endl;
+            throw std::exception();
+        };
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string keyword;
+            if (!(fields >> keyword) || keyword[0] == '#' || keyword == "TITLE") {
+                continue;
+            }
+            if (keyword == "LUT_3D_SIZE") {
+                if (!(fields >> lut.m_size) || lut.m_size < 2 || lut.m_size > MAX_SIZE) {
+                    fail("LUT_3D_SIZE must be 2 to " + std::to_string(MAX_SIZE));
+                }
+                lut.m_table.reserve(size_t(lut.m_size) * size_t(lut.m_size) * size_t(lut.m_size) * 3);
+            } else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX") {
+                glm::vec3& bound = keyword == "DOMAIN_MIN" ? lut.m_domain_min : lut.m_domain_max;
+                if (!(fields >> bound.r >> bound.g >> bound.b)) {
+                    fail(keyword + " needs three values");
+                }
+            } else if (keyword == "LUT_1D_SIZE" || keyword == "LUT_1D_INPUT_RANGE") {
+                fail("1D LUTs are not supported");
+            } else if (keyword == "LUT_3D_INPUT_RANGE") {
+                float low, high;
+                if (!(fields >> low >> high)) {
+                    fail(keyword + " needs two values");
+                }
+                lut.m_domain_min = glm::vec3(low);
+                lut.m_domain_max = glm::vec3(high);
+            } else {
+                std::istringstream values(line);
+                float r, g, b;
+                if (lut.m_size == 0 || !(values >> r >> g >> b)) {
+                    fail("unexpected line \"" + line + "\"");
+                }
+                lut.m_table.insert(lut.m_table.end(), { r, g, b });
+            }
+        }
+        const size_t entries = size_t(lut.m_size) * size_t(lut.m_size) * size_t(lut.m_size);
+        if (lut.m_size == 0 || lut.m_table.size() != entries * 3) {
+            fail("expected " + std::to_string(entries) + " entries, found " + std::to_string(lut.m_table.size() / 3));
+        }
+        if (glm::any(glm::lessThanEqual(lut.m_domain_max, lut.m_domain_min))) {
+            fail("DOMAIN_MAX must be above DOMAIN_MIN");
+        }
+        return lut;
+    }
+
+    /// <summary>
+    /// Table of fn(color) on a size^3 grid over [0, 1]^3, e.g. for identity or analytic looks.
+    /// </summary>
+    template <typename Fn>
+    static ColorLut3D fromFunction(const int size, const Fn& fn)
+    {
+        ColorLut3D lut;
+        lut.m_size = size;
+        lut.m_table.reserve(size_t(size) * size_t(size) * size_t(size) * 3);
+        for (int b = 0; b < size; b++) {
+            for (int g = 0; g < size; g++) {
+                for (int r = 0; r < size; r++) {
+                    const glm::vec3 value = fn(glm::vec3(r, g, b) / float(size - 1));
+                    lut.m_table.insert(lut.m_table.end(), { value.r, value.g, value.b });
+                }
+            }
+        }
+        return lut;
+    }
+
+    int size() const { return m_size; }
+
+    /// <summary>
+    /// Looks up count pixels; in and out may be the same row.
+    /// </summary>
+    void applyRow(const glm::vec3* in, glm::vec3* out, const int count) const
+    {
+        const float* src = reinterpret_cast<const float*>(in);
+        float* dst = reinterpret_cast<float*>(out);
+        const float* table = m_table.data();
+        const int last_cell = m_size - 2;
+        const float cells = float(m_size - 1);
+        const glm::vec3 scale = cells / (m_domain_max - m_domain_min);
+        const float scale_r = scale.r, scale_g = scale.g, scale_b = scale.b;
+        const float min_r = m_domain_min.r, min_g = m_domain_min.g, min_b = m_domain_min.b;
+        // Float offsets of the neighbors along r, g and b.
+        const int stride_r = 3, stride_g = 3 * m_size, stride_b = 3 * m_size * m_size;
+#pragma omp simd
+        for (int i = 0; i < count; i++) {
+            // Grid coordinates clamped to [0, size - 1] (NaN to 0).
+            const auto grid = [cells](const float v) {
+                const float clamped = v > 0.0f ? v : 0.0f;
+                return clamped < cells ? clamped : cells;
+            };
+            const float gr = grid((src[3 * i] - min_r) * scale_r);
+            const float gg = grid((src[3 * i + 1] - min_g) * scale_g);
+            const float gb = grid((src[3 * i + 2] - min_b) * scale_b);
+            // Lower corner of the cell, the last cell for the upper bound.
+            const int ir = std::min(int(gr), last_cell), ig = std::min(int(gg), last_cell), ib = std::min(int(gb), last_cell);
+            const float fr = gr - float(ir), fg = gg - float(ig), fb = gb - float(ib);
+
+            // The tetrahedron: corners along the axes of the largest, middle and smallest fraction.
+            const bool r_ge_g = fr >= fg, g_ge_b = fg >= fb, r_ge_b = fr >= fb;
+            const float f_hi = std::max(fr, std::max(fg, fb));
+            const float f_lo = std::min(fr, std::min(fg, fb));
+            const float f_mid = fr + fg + fb - f_hi - f_lo;
+            const int s_hi = r_ge_g ? (r_ge_b ? stride_r : stride_b) : (g_ge_b ? stride_g : stride_b);
+            const int s_lo = r_ge_g ? (g_ge_b ? stride_b : stride_g) : (r_ge_b ? stride_b : stride_r);
+            const int s_hi_mid = stride_r + stride_g + stride_b - s_lo;
+
+            const float* c000 = table + ir * stride_r + ig * stride_g + ib * stride_b;
+            const float w000 = 1.0f - f_hi, w_hi = f_hi - f_mid, w_mid = f_mid - f_lo, w111 = f_lo;
+            for (int c = 0; c < 3; c++) {
+                dst[3 * i + c] = w000 * c000[c] + w_hi * c000[s_hi + c] + w_mid * c000[s_hi_mid + c] + w111 * c000[stride_r + stride_g + stride_b + c];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Looks up every pixel of image into result (same size, may be the image).
+    /// </summary>
+    void apply(const ImageView<const glm::vec3> image, const ImageView<glm::vec3> result) const
+    {
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Medium))
+        for (int y = 0; y < image.height; y++) {
+            applyRow(image.row(y), result.row(y), image.width);
+        }
+    }
+
+private:
+    int m_size = 0;
+    glm::vec3 m_domain_min { 0.0f };
+    glm::vec3 m_domain_max { 1.0f };
+    // size^3 RGB entries, red fastest.
+    std::vector<float> m_table;
+};
+
+/// <summary>
+/// Grades a display image in place with the look of the tone-mapping settings, if any.
+/// </summary>
+inline void applyLook(ImageRGB& image, const std::shared_ptr<const ColorLut3D>& look)
+{
+    if (look) {
+        look->apply(image, image);
+    }
+}
+
+#pragma endregion 3D color LUT
@@ -0,0 +1,350 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "helpers.h"
+#include "color_lut.h"
+#include "execution.h"
+
+/*
+ * Chains of color transforms run in one pass over an image.
+ *
+ * A ColorPipeline is built from steps: affine steps (color matrices, exposure, offsets such as a
+ * normalization), per-channel curves (gamma, the sRGB encoding or any function) and 3D LUT looks.
+ * Adjacent affine steps are folded into one matrix and offset when they are added, so
+ * xyzToRgb().exposure(2).normalize(min, max) is one matrix multiply per pixel. ColorAffine is a
+ * literal type, so chains of constants fold at compile time (XYZ_TO_RGB_AFFINE is the inverse of
+ * RGB_TO_XYZ_AFFINE computed by the compiler, not glm::inverse() per call).
+ *
+ * Curves are tabulated once by ColorCurve: the table is indexed by the exponent and the top 7
+ * mantissa bits of the input, 128 linearly interpolated entries per octave from 2^-24 to 2^8, so
+ * power curves are within a few 1e-6 relative of the function over the whole range (an evenly
+ * spaced table is poor near 0 where gamma curves are steep). Inputs below 2^-24 are interpolated
+ * from curve(0), above 2^8 clamped, NaN and negative inputs map to curve(0).
+ *
+ * apply() runs all steps on blocks of PIPELINE_BLOCK pixels of a row, each step an omp simd loop
+ * over the block while it is in L1, so the image is read and written once however long the chain.
+ * The planar variant reads XYZ (or any) planes, which replaces the separate plane-to-RGB pass.
+ */
+
+#pragma region Color pipeline
+
+/// <summary>
+/// Pixels of a row processed by all steps before the next ones (12 bytes each, in L1).
+/// </summary>
+constexpr int PIPELINE_BLOCK = 512;
+
+/// <summary>
+/// out = m * in + offset with a row-major m, a literal type.
+/// </summary>
+struct ColorAffine {
+    std::array<std::array<float, 3>, 3> m { { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } } };
+    std::array<float, 3> offset { 0.0f, 0.0f, 0.0f };
+
+    static constexpr ColorAffine identity() { return {}; }
+
+    static constexpr ColorAffine rows(const std::array<float, 3> r0, const std::array<float, 3> r1, const std::array<float, 3> r2)
+    {
+        ColorAffine affine;
+        affine.m = { r0, r1, r2 };
+        return affine;
+    }
+
+    static constexpr ColorAffine scale(const float r, const float g, const float b)
+    {
+        return rows({ r, 0.0f, 0.0f }, { 0.0f, g, 0.0f }, { 0.0f, 0.0f, b });
+    }
+
+    static constexpr ColorAffine translate(const float r, const float g, const float b)
+    {
+        ColorAffine affine;
+        affine.offset = { r, g, b };
+        return affine;
+    }
+
+    /// <summary>
+    /// This transform followed by next, rounded once per coefficient.
+    /// </summary>
+    constexpr ColorAffine then(const ColorAffine& next) const
+    {
+        ColorAffine result;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                double sum = 0.0;
+                for (int k = 0; k < 3; k++) {
+                    sum += double(next.m[i][k]) * double(m[k][j]);
+                }
+                result.m[i][j] = float(sum);
+            }
+            double shifted = next.offset[i];
+            for (int k = 0; k < 3; k++) {
+                shifted += double(next.m[i][k]) * double(offset[k]);
+            }
+            result.offset[i] = float(shifted);
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Inverse transform (the matrix is assumed invertible), computed in double precision.
+    /// </summary>
+    constexpr ColorAffine inverse() const
+    {
+        const auto a = [this](const int i, const int j) { return double(m[i][j]); };
+        const double cofactor[3][3] = {
+            { a(1, 1) * a(2, 2) - a(1, 2) * a(2, 1), a(0, 2) * a(2, 1) - a(0, 1) * a(2, 2), a(0, 1) * a(1, 2) - a(0, 2) * a(1, 1) },
+            { a(1, 2) * a(2, 0) - a(1, 0) * a(2, 2), a(0, 0) * a(2, 2) - a(0, 2) * a(2, 0), a(0, 2) * a(1, 0) - a(0, 0) * a(1, 2) },
+            { a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0), a(0, 1) * a(2, 0) - a(0, 0) * a(2, 1), a(0, 0) * a(1, 1) - a(0, 1) * a(1, 0) },
+        };
+        const double determinant = a(0, 0) * cofactor[0][0] + a(0, 1) * cofactor[1][0] + a(0, 2) * cofactor[2][0];
+        ColorAffine result;
+        for (int i = 0; i < 3; i++) {
+            double shifted = 0.0;
+            for (int j = 0; j < 3; j++) {
+                result.m[i][j] = float(cofactor[i][j] / determinant);
+                shifted -= cofactor[i][j] / determinant * double(offset[j]);
+            }
+            result.offset[i] = float(shifted);
+        }
+        return result;
+    }
+
+    constexpr bool isIdentity() const
+    {
+        return m == identity().m && offset == identity().offset;
+    }
+};
+
+/// <summary>
+/// The matrix of rgbToXYZ() in helpers.h and its inverse.
+/// </summary>
+constexpr ColorAffine RGB_TO_XYZ_AFFINE = ColorAffine::rows({ 0.49f, 0.31f, 0.2f }, { 0.17697f, 0.8124f, 0.01063f }, { 0.0f, 0.01f, 0.99f });
+constexpr ColorAffine XYZ_TO_RGB_AFFINE = RGB_TO_XYZ_AFFINE.inverse();
+static_assert(RGB_TO_XYZ_AFFINE.then(XYZ_TO_RGB_AFFINE).m[1][1] > 0.99999f && RGB_TO_XYZ_AFFINE.then(XYZ_TO_RGB_AFFINE).m[1][1] < 1.00001f);
+
+/// <summary>
+/// Tabulated per-channel curve, see above.
+/// </summary>
+class ColorCurve {
+public:
+    static constexpr int MIN_EXPONENT = -24;
+    static constexpr int MAX_EXPONENT = 8;
+    static constexpr int STEPS_PER_OCTAVE = 128;
+    static constexpr int ENTRIES = (MAX_EXPONENT - MIN_EXPONENT) * STEPS_PER_OCTAVE;
+
+    template <typename Fn>
+    explicit ColorCurve(const Fn& fn)
+        : m_table(ENTRIES + 1)
+    {
+        for (uint32_t k = 0; k <= uint32_t(ENTRIES); k++) {
+            m_table[k] = float(fn(std::bit_cast<float>((k + FIRST_INDEX) << 16)));
+        }
+        m_at_zero = float(fn(0.0f));
+    }
+
+    /// <summary>
+    /// Maps count floats; src and dst may be the same.
+    /// </summary>
+    void applyValues(const float* src, float* dst, const int count) const
+    {
+        const float* table = m_table.data();
+        const float at_zero = m_at_zero;
+        const float first = m_table[0];
+        const float last = m_table[ENTRIES];
+        constexpr float min_input = 0x1p-24f;
+        constexpr float max_input = 0x1p8f;
+#pragma omp simd
+        for (int i = 0; i < count; i++) {
+            const float x = src[i] > 0.0f ? src[i] : 0.0f;
+            // The table index of x clamped into [2^-24, 2^8).
+            const float in_table = x < min_input ? min_input : (x < max_input ? x : max_input);
+            const uint32_t bits = std::bit_cast<uint32_t>(in_table);
+            const uint32_t index = std::min((bits >> 16) - FIRST_INDEX, uint32_t(ENTRIES - 1));
+            const float fraction = x < max_input ? float(bits & 0xFFFFu) * (1.0f / 65536.0f) : 1.0f;
+            const float tabulated = table[index] + fraction * (table[index + 1] - table[index]);
+            const float below = at_zero + (first - at_zero) * (x * (1.0f / min_input));
+            dst[i] = x < min_input ? below : (x < max_input ? tabulated : last);
+        }
+    }
+
+private:
+    // Float bits >> 16 of 2^MIN_EXPONENT.
+    static constexpr uint32_t FIRST_INDEX = uint32_t(127 + MIN_EXPONENT) << 7;
+
+    std::vector<float> m_table;
+    float m_at_zero;
+};
+
+/// <summary>
+/// Chain of color transforms applied in one pass, see above.
+/// </summary>
+class ColorPipeline {
+public:
+    ColorPipeline& affine(const ColorAffine& transform)
+    {
+        if (!m_steps.empty() && m_steps.back().kind == Step::Kind::Affine) {
+            m_steps.back().affine = m_steps.back().affine.then(transform);
+            if (m_steps.back().affine.isIdentity()) {
+                m_steps.pop_back();
+            }
+        } else if (!transform.isIdentity()) {
+            m_steps.push_back({ Step::Kind::Affine, transform, nullptr, nullptr });
+        }
+        return *this;
+    }
+    ColorPipeline& rgbToXyz() { return affine(RGB_TO_XYZ_AFFINE); }
+    ColorPipeline& xyzToRgb() { return affine(XYZ_TO_RGB_AFFINE); }
+    ColorPipeline& exposure(const float scale) { return affine(ColorAffine::scale(scale, scale, scale)); }
+    // (value - min) / (max - min) on every channel, as normalizeRGBImage().
+    ColorPipeline& normalize(const glm::vec2 min_max)
+    {
+        const float scale = 1.0f / (min_max.y - min_max.x);
+        return affine(ColorAffine::translate(-min_max.x, -min_max.x, -min_max.x).then(ColorAffine::scale(scale, scale, scale)));
+    }
+
+    template <typename Fn>
+    ColorPipeline& curve(const Fn& fn)
+    {
+        m_steps.push_back({ Step::Kind::Curve, {}, std::make_shared<const ColorCurve>(fn), nullptr });
+        return *this;
+    }
+    ColorPipeline& gamma(const float exponent)
+    {
+        return curve([exponent](const float x) { return std::pow(double(x), double(exponent)); });
+    }
+    // sRGB OETF (IEC 61966-2-1) of linear values.
+    ColorPipeline& srgbEncode()
+    {
+        return curve([](const float x) { return x <= 0.0031308f ? 12.92 * x : 1.055 * std::pow(double(x), 1.0 / 2.4) - 0.055; });
+    }
+    ColorPipeline& look(std::shared_ptr<const ColorLut3D> lut)
+    {
+        if (lut) {
+            m_steps.push_back({ Step::Kind::Lut, {}, nullptr, std::move(lut) });
+        }
+        return *this;
+    }
+
+    // Steps left after folding, for tests and profiles.
+    size_t stepCount() const { return m_steps.size(); }
+
+    /// <summary>
+    /// Transforms count pixels; in and out may be the same row.
+    /// </summary>
+    void applyRow(const glm::vec3* in, glm::vec3* out, const int count) const
+    {
+        for (int begin = 0; begin < count; begin += PIPELINE_BLOCK) {
+            const int n = std::min(PIPELINE_BLOCK, count - begin);
+            if (in != out) {
+                std::copy_n(in + begin, n, out + begin);
+            }
+            runSteps(out + begin, n);
+        }
+    }
+
+    /// <summary>
+    /// Transforms count pixels given as three planes into RGB (or whatever the chain produces).
+    /// </summary>
+    void applyPlanesRow(const float* p0, const float* p1, const float* p2, glm::vec3* out, const int count) const
+    {
+        for (int begin = 0; begin < count; begin += PIPELINE_BLOCK) {
+            const int n = std::min(PIPELINE_BLOCK, count - begin);
+            float* block = reinterpret_cast<float*>(out + begin);
+#pragma omp simd
+            for (int i = 0; i < n; i++) {
+                block[3 * i] = p0[begin + i];
+                block[3 * i + 1] = p1[begin + i];
+                block[3 * i + 2] = p2[begin + i];
+            }
+            runSteps(out + begin, n);
+        }
+    }
+
+    /// <summary>
+    /// Transforms image into result (same size, may be the image).
+    /// </summary>
+    void apply(const ImageView<const glm::vec3> image, const ImageView<glm::vec3> result) const
+    {
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Medium))
+        for (int y = 0; y < image.height; y++) {
+            applyRow(image.row(y), result.row(y), image.width);
+        }
+    }
+
+    ImageRGB apply(const ImageRGB& image) const
+    {
+        auto result = ImageRGB::uninitialized(image.width, image.height);
+        apply(image, result);
+        return result;
+    }
+
+    /// <summary>
+    /// Transforms three planes of one size (e.g. XYZ) into an interleaved image.
+    /// </summary>
+    ImageRGB apply(const ImageFloatPlane3& planes) const
+    {
+        const ImageFloat& p0 = planes.X;
+        const ImageFloat& p1 = planes.Y;
+        const ImageFloat& p2 = planes.Z;
+        auto result = ImageRGB::uninitialized(p0.width, p0.height);
+#pragma omp parallel for num_threads(kernelThreads(p0, KernelCost::Medium))
+        for (int y = 0; y < p0.height; y++) {
+            const size_t offset = size_t(y) * size_t(p0.width);
+            applyPlanesRow(p0.data.data() + offset, p1.data.data() + offset, p2.data.data() + offset, result.data.data() + offset, p0.width);
+        }
+        return result;
+    }
+
+private:
+    struct Step {
+        enum class Kind {
+            Affine,
+            Curve,
+            Lut,
+        };
+        Kind kind;
+        ColorAffine affine;
+        std::shared_ptr<const ColorCurve> curve;
+        std::shared_ptr<const ColorLut3D> lut;
+    };
+
+    static void applyAffine(const ColorAffine& a, float* values, const int n)
+    {
+        const float m00 = a.m[0][0], m01 = a.m[0][1], m02 = a.m[0][2], o0 = a.offset[0];
+        const float m10 = a.m[1][0], m11 = a.m[1][1], m12 = a.m[1][2], o1 = a.offset[1];
+        const float m20 = a.m[2][0], m21 = a.m[2][1], m22 = a.m[2][2], o2 = a.offset[2];
+#pragma omp simd
+        for (int i = 0; i < n; i++) {
+            const float r = values[3 * i], g = values[3 * i + 1], b = values[3 * i + 2];
+            values[3 * i] = m00 * r + m01 * g + m02 * b + o0;
+            values[3 * i + 1] = m10 * r + m11 * g + m12 * b + o1;
+            values[3 * i + 2] = m20 * r + m21 * g + m22 * b + o2;
+        }
+    }
+
+    void runSteps(glm::vec3* block, const int n) const
+    {
+        float* values = reinterpret_cast<float*>(block);
+        for (const auto& step : m_steps) {
+            switch (step.kind) {
+            case Step::Kind::Affine:
+                applyAffine(step.affine, values, n);
+                break;
+            case Step::Kind::Curve:
+                step.curve->applyValues(values, values, 3 * n);
+                break;
+            case Step::Kind::Lut:
+                step.lut->applyRow(block, block, n);
+                break;
+            }
+        }
+    }
+
+    std::vector<Step> m_steps;
+};
+
+#pragma endregion Color pipeline
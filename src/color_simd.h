@@ -0,0 +1,327 @@
+#pragma once
+#include <algorithm>
+
+#include "helpers.h"
+#include "simd.h"
+
+DISABLE_WARNINGS_PUSH()
+#include <glm/mat3x3.hpp>
+#include <glm/matrix.hpp>
+DISABLE_WARNINGS_POP()
+
+/*
+ * Interleaved (vec3) <-> planar conversions with an optional fused 3x3 color matrix.
+ *
+ * The kernels load 8 interleaved pixels (24 floats) as three vectors, transpose them into one
+ * vector per channel with in-lane shuffles, apply the matrix with separate multiplies and adds in
+ * the order of glm's mat3 * vec3, and store the planes (and the reverse). No FMA is used, so the
+ * results are bit-identical to rgbToXYZ(), xyzToRGB(), imageVec3ToPlane3() and imagePlane3ToVec3()
+ * in helpers.h for every instruction set.
+ */
+
+#pragma region SIMD color conversions
+
+namespace color_simd {
+
+/// <summary>
+/// Row-major 3x3 matrix (out_i = m[i][0] * in_0 + m[i][1] * in_1 + m[i][2] * in_2).
+/// </summary>
+struct ColorMatrix {
+    float m[3][3];
+};
+
+inline ColorMatrix toColorMatrix(const glm::mat3& matrix)
+{
+    ColorMatrix result;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            result.m[i][j] = matrix[j][i]; // glm is column-major.
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// The matrix of rgbToXYZ() in helpers.h.
+/// </summary>
+inline glm::mat3 rgbToXyzMatrix()
+{
+    return glm::transpose(glm::mat3(0.49f, 0.31f, 0.2f, 0.17697f, 0.8124f, 0.01063f, 0.0f, 0.01f, 0.99000f));
+}
+
+template <bool Transform>
+void deinterleaveScalar(const float* src, float* x_out, float* y_out, float* z_out, const int begin, const int end, const ColorMatrix& m)
+{
+    for (int i = begin; i < end; i++) {
+        const float r = src[3 * i], g = src[3 * i + 1], b = src[3 * i + 2];
+        if constexpr (Transform) {
+            x_out[i] = m.m[0][0] * r + m.m[0][1] * g + m.m[0][2] * b;
+            y_out[i] = m.m[1][0] * r + m.m[1][1] * g + m.m[1][2] * b;
+            z_out[i] = m.m[2][0] * r + m.m[2][1] * g + m.m[2][2] * b;
+        } else {
+            x_out[i] = r;
+            y_out[i] = g;
+            z_out[i] = b;
+        }
+    }
+}
+
+template <bool Transform>
+void interleaveScalar(const float* x_in, const float* y_in, const float* z_in, float* dst, const int begin, const int end, const ColorMatrix& m)
+{
+    for (int i = begin; i < end; i++) {
+        const float x = x_in[i], y = y_in[i], z = z_in[i];
+        if constexpr (Transform) {
+            dst[3 * i] = m.m[0][0] * x + m.m[0][1] * y + m.m[0][2] * z;
+            dst[3 * i + 1] = m.m[1][0] * x + m.m[1][1] * y + m.m[1][2] * z;
+            dst[3 * i + 2] = m.m[2][0] * x + m.m[2][1] * y + m.m[2][2] * z;
+        } else {
+            dst[3 * i] = x;
+            dst[3 * i + 1] = y;
+            dst[3 * i + 2] = z;
+        }
+    }
+}
+
+} // namespace color_simd
+
+#if defined(HDR_SIMD_X86)
+// AVX only (no FMA): a fused multiply-add would change the rounding of the matrix product.
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx")
+#endif
+namespace color_avx {
+using color_simd::ColorMatrix;
+
+inline void transform(__m256& a, __m256& b, __m256& c, const ColorMatrix& m)
+{
+    const auto row = [&](const int i) {
+        return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m.m[i][0]), a), _mm256_mul_ps(_mm256_set1_ps(m.m[i][1]), b)), _mm256_mul_ps(_mm256_set1_ps(m.m[i][2]), c));
+    };
+    const __m256 x = row(0), y = row(1), z = row(2);
+    a = x;
+    b = y;
+    c = z;
+}
+
+template <bool Transform>
+void deinterleave(const float* src, float* x_out, float* y_out, float* z_out, const int count, const ColorMatrix& m)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const float* p = src + 3 * i;
+        // Pixels 0-3 in the low lanes, 4-7 in the high lanes.
+        const __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p + 12), 1);
+        const __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+        const __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+        const __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+        const __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+        __m256 x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+        __m256 y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+        __m256 z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+        if constexpr (Transform) {
+            transform(x, y, z, m);
+        }
+        _mm256_storeu_ps(x_out + i, x);
+        _mm256_storeu_ps(y_out + i, y);
+        _mm256_storeu_ps(z_out + i, z);
+    }
+    color_simd::deinterleaveScalar<Transform>(src, x_out, y_out, z_out, i, count, m);
+}
+
+template <bool Transform>
+void interleave(const float* x_in, const float* y_in, const float* z_in, float* dst, const int count, const ColorMatrix& m)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(x_in + i);
+        __m256 y = _mm256_loadu_ps(y_in + i);
+        __m256 z = _mm256_loadu_ps(z_in + i);
+        if constexpr (Transform) {
+            transform(x, y, z, m);
+        }
+        const __m256 rxy = _mm256_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 ryz = _mm256_shuffle_ps(y, z, _MM_SHUFFLE(3, 1, 3, 1));
+        const __m256 rzx = _mm256_shuffle_ps(z, x, _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256 r03 = _mm256_shuffle_ps(rxy, rzx, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 r14 = _mm256_shuffle_ps(ryz, rxy, _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256 r25 = _mm256_shuffle_ps(rzx, ryz, _MM_SHUFFLE(3, 1, 3, 1));
+        float* p = dst + 3 * i;
+        _mm_storeu_ps(p, _mm256_castps256_ps128(r03));
+        _mm_storeu_ps(p + 4, _mm256_castps256_ps128(r14));
+        _mm_storeu_ps(p + 8, _mm256_castps256_ps128(r25));
+        _mm_storeu_ps(p + 12, _mm256_extractf128_ps(r03, 1));
+        _mm_storeu_ps(p + 16, _mm256_extractf128_ps(r14, 1));
+        _mm_storeu_ps(p + 20, _mm256_extractf128_ps(r25, 1));
+    }
+    color_simd::interleaveScalar<Transform>(x_in, y_in, z_in, dst, i, count, m);
+}
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+#endif // HDR_SIMD_X86
+
+#if defined(HDR_SIMD_NEON)
+namespace color_neon {
+using color_simd::ColorMatrix;
+
+inline float32x4x3_t transform(const float32x4x3_t v, const ColorMatrix& m)
+{
+    float32x4x3_t result;
+    for (int i = 0; i < 3; i++) {
+        // vmulq + vaddq, not vmlaq/vfmaq, to keep the rounding of the scalar product.
+        result.val[i] = vaddq_f32(vaddq_f32(vmulq_n_f32(v.val[0], m.m[i][0]), vmulq_n_f32(v.val[1], m.m[i][1])), vmulq_n_f32(v.val[2], m.m[i][2]));
+    }
+    return result;
+}
+
+template <bool Transform>
+void deinterleave(const float* src, float* x_out, float* y_out, float* z_out, const int count, const ColorMatrix& m)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4x3_t v = vld3q_f32(src + 3 * i);
+        if constexpr (Transform) {
+            v = transform(v, m);
+        }
+        vst1q_f32(x_out + i, v.val[0]);
+        vst1q_f32(y_out + i, v.val[1]);
+        vst1q_f32(z_out + i, v.val[2]);
+    }
+    color_simd::deinterleaveScalar<Transform>(src, x_out, y_out, z_out, i, count, m);
+}
+
+template <bool Transform>
+void interleave(const float* x_in, const float* y_in, const float* z_in, float* dst, const int count, const ColorMatrix& m)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4x3_t v = { { vld1q_f32(x_in + i), vld1q_f32(y_in + i), vld1q_f32(z_in + i) } };
+        if constexpr (Transform) {
+            v = transform(v, m);
+        }
+        vst3q_f32(dst + 3 * i, v);
+    }
+    color_simd::interleaveScalar<Transform>(x_in, y_in, z_in, dst, i, count, m);
+}
+}
+#endif // HDR_SIMD_NEON
+
+namespace color_simd {
+
+template <bool Transform>
+void deinterleaveRow(const float* src, float* x_out, float* y_out, float* z_out, const int count, const ColorMatrix& m, const SimdIsa isa)
+{
+#if defined(HDR_SIMD_X86)
+    if (isa == SimdIsa::Avx2 || isa == SimdIsa::Avx512) {
+        color_avx::deinterleave<Transform>(src, x_out, y_out, z_out, count, m);
+        return;
+    }
+#elif defined(HDR_SIMD_NEON)
+    if (isa == SimdIsa::Neon) {
+        color_neon::deinterleave<Transform>(src, x_out, y_out, z_out, count, m);
+        return;
+    }
+#endif
+    deinterleaveScalar<Transform>(src, x_out, y_out, z_out, 0, count, m);
+}
+
+template <bool Transform>
+void interleaveRow(const float* x_in, const float* y_in, const float* z_in, float* dst, const int count, const ColorMatrix& m, const SimdIsa isa)
+{
+#if defined(HDR_SIMD_X86)
+    if (isa == SimdIsa::Avx2 || isa == SimdIsa::Avx512) {
+        color_avx::interleave<Transform>(x_in, y_in, z_in, dst, count, m);
+        return;
+    }
+#elif defined(HDR_SIMD_NEON)
+    if (isa == SimdIsa::Neon) {
+        color_neon::interleave<Transform>(x_in, y_in, z_in, dst, count, m);
+        return;
+    }
+#endif
+    interleaveScalar<Transform>(x_in, y_in, z_in, dst, 0, count, m);
+}
+
+template <bool Transform>
+ImageFloatPlane3 toPlanes(const ImageView<const glm::vec3> image, const ColorMatrix& m, const SimdIsa isa)
+{
+    auto result = ImageFloatPlane3 { ImageFloat::uninitialized(image.width, image.height), ImageFloat::uninitialized(image.width, image.height), ImageFloat::uninitialized(image.width, image.height) };
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        const size_t offset = size_t(y) * size_t(image.width);
+        deinterleaveRow<Transform>(reinterpret_cast<const float*>(image.row(y)), result.X.data.data() + offset, result.Y.data.data() + offset, result.Z.data.data() + offset, image.width, m, isa);
+    }
+    return result;
+}
+
+template <bool Transform>
+ImageVec3 toInterleaved(const ImageFloatPlane3& image, const ColorMatrix& m, const SimdIsa isa)
+{
+    assert(image.Y.width == image.X.width && image.Z.width == image.X.width);
+    assert(image.Y.height == image.X.height && image.Z.height == image.X.height);
+    auto result = ImageVec3::uninitialized(image.X.width, image.X.height);
+#pragma omp parallel for num_threads(kernelThreads(image.X, KernelCost::Light))
+    for (int y = 0; y < image.X.height; y++) {
+        const size_t offset = size_t(y) * size_t(image.X.width);
+        interleaveRow<Transform>(image.X.data.data() + offset, image.Y.data.data() + offset, image.Z.data.data() + offset, reinterpret_cast<float*>(result.data.data() + offset), image.X.width, m, isa);
+    }
+    return result;
+}
+
+} // namespace color_simd
+
+static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "the kernels treat vec3 rows as interleaved floats");
+
+/// <summary>
+/// rgbToXYZ() with the color matrix fused into a SIMD deinterleave (bit-identical results).
+/// </summary>
+/// <param name="rgb">image in RGB</param>
+/// <param name="isa">instruction set, detected by default</param>
+/// <returns>image in XYZ planes</returns>
+ImageXYZ rgbToXYZSimd(const ImageView<const glm::vec3> rgb, const SimdIsa isa = detectSimdIsa())
+{
+    return color_simd::toPlanes<true>(rgb, color_simd::toColorMatrix(color_simd::rgbToXyzMatrix()), isa);
+}
+
+/// <summary>
+/// xyzToRGB() with the inverse color matrix fused into a SIMD interleave (bit-identical results).
+/// </summary>
+/// <param name="xyz">image in XYZ planes</param>
+/// <param name="isa">instruction set, detected by default</param>
+/// <returns>image in RGB</returns>
+ImageRGB xyzToRGBSimd(const ImageXYZ& xyz, const SimdIsa isa = detectSimdIsa())
+{
+    static const auto matrix = color_simd::toColorMatrix(glm::inverse(color_simd::rgbToXyzMatrix()));
+    return color_simd::toInterleaved<true>(xyz, matrix, isa);
+}
+
+/// <summary>
+/// imageVec3ToPlane3() with a SIMD transpose.
+/// </summary>
+/// <param name="image">image in attribute order</param>
+/// <param name="isa">instruction set, detected by default</param>
+/// <returns>image in plane order</returns>
+ImageFloatPlane3 imageVec3ToPlane3Simd(const ImageView<const glm::vec3> image, const SimdIsa isa = detectSimdIsa())
+{
+    return color_simd::toPlanes<false>(image, {}, isa);
+}
+
+/// <summary>
+/// imagePlane3ToVec3() with a SIMD transpose.
+/// </summary>
+/// <param name="image">image in plane order</param>
+/// <param name="isa">instruction set, detected by default</param>
+/// <returns>image in attribute order</returns>
+ImageVec3 imagePlane3ToVec3Simd(const ImageFloatPlane3& image, const SimdIsa isa = detectSimdIsa())
+{
+    return color_simd::toInterleaved<false>(image, {}, isa);
+}
+
+#pragma endregion SIMD color conversions
@@ -0,0 +1,208 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "binary_mask.h"
+#include "execution.h"
+#include "helpers.h"
+#include "image_pyramid.h"
+#include "mask_geometry.h"
+
+/*
+ * Fast compositing without a Poisson solve: instant previews of an edit and cheap results
+ * where seamless gradients are not needed.
+ *
+ * featherBlend() pastes the source with an alpha that rises from 0 at the mask boundary to 1
+ * at feather_radius pixels inside it (smoothstep of the Euclidean distance to the nearest
+ * pixel outside the mask, the pixels beyond the mask's edges counting as outside). The distance
+ * transform is part of the mask's MaskGeometry (mask_geometry.h), computed once for all planes
+ * and blends with the same mask; the blend is one pass.
+ *
+ * laplacianPyramidBlend() is multiband blending (Burt and Adelson): the Laplacian pyramids of
+ * the target and of the composite (source pasted into the target) are mixed level by level
+ * with the Gaussian pyramid of the mask, so low frequencies blend over a wide transition and
+ * fine detail over a narrow one, then the pyramid collapses. It runs on image_pyramid.h. The
+ * result only differs from the target within about 3 * 2^(levels - 1) pixels of the mask, so
+ * the pyramids are built over the mask's bounding box plus that margin, not the whole target.
+ */
+
+#pragma region Composite blend
+
+/// <summary>
+/// Compositing of the edit: the Poisson solve or one of the fast blends above.
+/// </summary>
+enum class CompositeMode {
+    Poisson,
+    Feather,
+    Pyramid,
+};
+
+/// <summary>
+/// Composite mode by name: poisson, feather or pyramid.
+/// </summary>
+inline CompositeMode parseCompositeMode(const std::string& name)
+{
+    if (name == "poisson") {
+        return CompositeMode::Poisson;
+    } else if (name == "feather") {
+        return CompositeMode::Feather;
+    } else if (name == "pyramid") {
+        return CompositeMode::Pyramid;
+    }
+    std::cerr << "Unknown composite mode: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Default and maximum number of levels of laplacianPyramidBlend().
+/// </summary>
+constexpr int PYRAMID_BLEND_LEVELS = 6;
+
+/// <summary>
+/// Pastes the source over the target with a feathered mask, see above.
+/// </summary>
+/// <param name="source">pasted image</param>
+/// <param name="target">background</param>
+/// <param name="mask">mask of the pasted pixels, at the source size</param>
+/// <param name="offset_x">position of the source in the target</param>
+/// <param name="offset_y">position of the source in the target</param>
+/// <param name="feather_radius">width of the transition inside the mask in pixels, 0 for a hard edge</param>
+/// <returns>the target with the blended source</returns>
+template <typename T>
+Image<T> featherBlend(const Image<T>& source, const Image<T>& target, const BinaryMask& mask, const int offset_x = 0, const int offset_y = 0,
+    const float feather_radius = 16.0f)
+{
+    if (mask.width() != source.width || mask.height() != source.height) {
+        std::cerr << "featherBlend: the mask does not match the size of the source." << std::endl;
+        throw std::exception();
+    }
+    auto result = target.clone();
+    // Only the mask's bounding box inside the target changes.
+    const auto geometry = maskGeometry(mask);
+    const auto& bounds = geometry->bounds();
+    const int x0 = std::max(bounds.x0, -offset_x), x1 = std::min(bounds.x1, target.width - offset_x);
+    const int y0 = std::max(bounds.y0, -offset_y), y1 = std::min(bounds.y1, target.height - offset_y);
+    if (bounds.empty() || x0 >= x1 || y0 >= y1) {
+        return result;
+    }
+    const ImageFloat* distance = feather_radius > 0.0f ? &geometry->distanceSquared() : nullptr;
+    const float inv_radius = feather_radius > 0.0f ? 1.0f / feather_radius : 0.0f;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(x1 - x0) * (y1 - y0), KernelCost::Light))
+    for (int y = y0; y < y1; y++) {
+        if (mask.rowEmpty(y)) {
+            continue;
+        }
+        T* out = result.data.data() + size_t(y + offset_y) * size_t(target.width);
+        const T* in = source.data.data() + size_t(y) * size_t(source.width);
+        for (int x = x0; x < x1; x++) {
+            if (!mask(x, y)) {
+                continue;
+            }
+            float alpha = 1.0f;
+            if (feather_radius > 0.0f) {
+                // Distances start at 1 on the boundary pixels.
+                const float t = std::clamp((std::sqrt(distance->data[size_t(y - bounds.y0) * size_t(distance->width) + size_t(x - bounds.x0)]) - 0.5f) * inv_radius, 0.0f, 1.0f);
+                alpha = t * t * (3.0f - 2.0f * t);
+            }
+            T& pixel = out[x + offset_x];
+            pixel = pixel + alpha * (in[x] - pixel);
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Multiband blend of the source into the target, see above.
+/// </summary>
+/// <param name="source">pasted image</param>
+/// <param name="target">background</param>
+/// <param name="mask">mask of the pasted pixels, at the source size</param>
+/// <param name="offset_x">position of the source in the target</param>
+/// <param name="offset_y">position of the source in the target</param>
+/// <param name="levels">pyramid levels, values <= 0 for PYRAMID_BLEND_LEVELS</param>
+/// <returns>the target with the blended source</returns>
+template <typename T>
+Image<T> laplacianPyramidBlend(const Image<T>& source, const Image<T>& target, const BinaryMask& mask, const int offset_x = 0, const int offset_y = 0, int levels = 0)
+{
+    if (mask.width() != source.width || mask.height() != source.height) {
+        std::cerr << "laplacianPyramidBlend: the mask does not match the size of the source." << std::endl;
+        throw std::exception();
+    }
+    levels = levels > 0 ? levels : PYRAMID_BLEND_LEVELS;
+    auto result = target.clone();
+    // Bounding box of the mask in the target, grown by the reach of the pyramid. Its corner lies on
+    // the grid of the coarsest level, so the result equals blending the whole target.
+    const auto bounds = maskGeometry(mask)->bounds();
+    const int spacing = 1 << (levels - 1), margin = 4 * spacing;
+    const int x0 = std::max(bounds.x0 + offset_x - margin, 0) / spacing * spacing, x1 = std::min(bounds.x1 + offset_x + margin, target.width);
+    const int y0 = std::max(bounds.y0 + offset_y - margin, 0) / spacing * spacing, y1 = std::min(bounds.y1 + offset_y + margin, target.height);
+    if (bounds.empty() || x0 >= x1 || y0 >= y1) {
+        return result;
+    }
+    const int width = x1 - x0, height = y1 - y0;
+    levels = pyramidDepth(width, height, 8, levels);
+
+    // The composite and the mask over the box.
+    auto composite = Image<T>::uninitialized(width, height);
+    ImageFloat alpha(width, height);
+#pragma omp parallel for num_threads(kernelThreads(composite, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        const int sy = y + y0 - offset_y;
+        const T* background = target.data.data() + size_t(y + y0) * size_t(target.width) + x0;
+        T* out = composite.data.data() + size_t(y) * size_t(width);
+        float* weights = alpha.data.data() + size_t(y) * size_t(width);
+        std::copy(background, background + width, out);
+        if (sy < 0 || sy >= source.height || mask.rowEmpty(sy)) {
+            continue;
+        }
+        for (int x = std::max(0, offset_x - x0); x < std::min(width, source.width + offset_x - x0); x++) {
+            const int sx = x + x0 - offset_x;
+            if (mask(sx, sy)) {
+                out[x] = source.data[size_t(sy) * size_t(source.width) + sx];
+                weights[x] = 1.0f;
+            }
+        }
+    }
+
+    std::vector<Image<T>> target_pyramid, composite_pyramid;
+    std::vector<ImageFloat> alpha_pyramid;
+    buildLaplacianPyramid<T>(ImageView<const T>(target.data.data() + size_t(y0) * size_t(target.width) + x0, width, height, target.width), levels, target_pyramid);
+    buildLaplacianPyramid<T>(composite, levels, composite_pyramid);
+    buildGaussianPyramid<float>(alpha, levels, alpha_pyramid);
+    for (int l = 0; l < levels; l++) {
+        auto& blended = target_pyramid[l];
+        const auto& pasted = composite_pyramid[l];
+        const auto& weights = alpha_pyramid[l];
+        const int64_t size = int64_t(blended.data.size());
+#pragma omp parallel for num_threads(kernelThreads(size, KernelCost::Light))
+        for (int64_t i = 0; i < size; i++) {
+            blended.data[i] = blended.data[i] + weights.data[i] * (pasted.data[i] - blended.data[i]);
+        }
+    }
+    collapseLaplacianPyramid(target_pyramid);
+
+    const auto& blended = target_pyramid[0];
+#pragma omp parallel for num_threads(kernelThreads(blended, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        const T* in = blended.data.data() + size_t(y) * size_t(width);
+        std::copy(in, in + width, result.data.data() + size_t(y + y0) * size_t(target.width) + x0);
+    }
+    return result;
+}
+
+/// <summary>
+/// Fast composite of the given mode (Feather or Pyramid).
+/// </summary>
+template <typename T>
+Image<T> compositeBlend(const CompositeMode mode, const Image<T>& source, const Image<T>& target, const BinaryMask& mask, const int offset_x = 0,
+    const int offset_y = 0, const float feather_radius = 16.0f, const int levels = 0)
+{
+    return mode == CompositeMode::Pyramid ? laplacianPyramidBlend(source, target, mask, offset_x, offset_y, levels)
+                                          : featherBlend(source, target, mask, offset_x, offset_y, feather_radius);
+}
+
+#pragma endregion Composite blend
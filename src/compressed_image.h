@@ -0,0 +1,382 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+#include <framework/image.h>
+#include <framework/image_view.h>
+
+#include "execution.h"
+#include "your_code_here.h"
+
+/*
+ * Lossless compressed residency of idle images.
+ *
+ * Intermediates that wait for a later stage (the HDR input and its luminance during the bilateral
+ * filter) are compressed while they wait and decompressed bit-exactly when they are needed again.
+ * The codec is float-specific and works on bands of COMPRESSED_BAND_ROWS rows, which are coded
+ * independently and in parallel:
+ *   1. every float is XORed with the same channel of the previous pixel of the band: neighbours
+ *      share sign, exponent and the high mantissa bits, which become zero bytes,
+ *   2. the words are shuffled into four byte planes (lowest byte of every word first), so the
+ *      zero high bytes form long runs,
+ *   3. the planes are coded with a byte-oriented LZ77 codec in the LZ4 block format (a token of
+ *      literal and match lengths, the literals, a 16-bit offset), which needs no entropy coder
+ *      and decodes at memory speed.
+ * Inputs decoded from Radiance files (8-bit mantissas) compress to about a third; computed floats
+ * such as the luminance only lose their exponent bytes, to about 90 %. Incompressible bands cost
+ * at most 0.4 % more than raw.
+ *
+ * IdleImage parks an image for the stages that do not read it: the pixels are compressed and the
+ * buffer returned to the pool (the next stage usually takes it over), restore() brings them back.
+ * A pixelwise consumer can also read the bands directly (durandComposeCompressed()), so the
+ * image is never whole again; toneMapCompressedIdle() is toneMapDurand() that way.
+ */
+
+#pragma region Compressed images
+
+constexpr int COMPRESSED_BAND_ROWS = 32;
+
+namespace compressed_image {
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_BITS = 14;
+
+inline uint32_t load32(const uint8_t* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, 4);
+    return value;
+}
+
+inline void appendLength(std::vector<uint8_t>& dst, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        dst.push_back(255);
+    }
+    dst.push_back(uint8_t(length));
+}
+
+inline void appendSequence(std::vector<uint8_t>& dst, const uint8_t* literals, const size_t literal_count, const size_t offset, const size_t match_length)
+{
+    const size_t match_code = match_length ? match_length - MIN_MATCH : 0;
+    dst.push_back(uint8_t((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(match_code, 15)));
+    if (literal_count >= 15) {
+        appendLength(dst, literal_count - 15);
+    }
+    dst.insert(dst.end(), literals, literals + literal_count);
+    if (match_length) {
+        dst.push_back(uint8_t(offset));
+        dst.push_back(uint8_t(offset >> 8));
+        if (match_code >= 15) {
+            appendLength(dst, match_code - 15);
+        }
+    }
+}
+
+/// <summary>
+/// Greedy LZ77 with a hash table of the last position of every 4-byte prefix. The last sequence
+/// has literals only. Runs of misses are skipped faster, so incompressible data costs little time.
+/// </summary>
+inline void lzCompress(const uint8_t* src, const size_t size, std::vector<uint8_t>& dst)
+{
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0); // Position + 1, 0 is empty.
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + MIN_MATCH <= size) {
+        const uint32_t sequence = load32(src + i);
+        const uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        const size_t candidate = table[hash];
+        table[hash] = uint32_t(i + 1);
+        if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || load32(src + candidate - 1) != sequence) {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        const size_t reference = candidate - 1;
+        size_t length = MIN_MATCH;
+        while (i + length < size && src[reference + length] == src[i + length]) {
+            length++;
+        }
+        appendSequence(dst, src + anchor, i - anchor, i - reference, length);
+        i += length;
+        anchor = i;
+    }
+    appendSequence(dst, src + anchor, size - anchor, 0, 0);
+}
+
+inline size_t readLength(const uint8_t*& p, const uint8_t* end, size_t length)
+{
+    if (length == 15) {
+        uint8_t byte;
+        do {
+            if (p == end) {
+                return SIZE_MAX;
+            }
+            byte = *p++;
+            length += byte;
+        } while (byte == 255);
+    }
+    return length;
+}
+
+/// <summary>
+/// Decodes lzCompress() output of exactly size bytes, false when the data is corrupt.
+/// </summary>
+inline bool lzDecompress(const uint8_t* src, const size_t src_size, uint8_t* dst, const size_t size)
+{
+    const uint8_t* p = src;
+    const uint8_t* const end = src + src_size;
+    size_t out = 0;
+    while (p < end) {
+        const uint8_t token = *p++;
+        const size_t literals = readLength(p, end, token >> 4);
+        if (literals > size_t(end - p) || literals > size - out) {
+            return false;
+        }
+        std::memcpy(dst + out, p, literals);
+        p += literals;
+        out += literals;
+        if (p == end) {
+            break;
+        }
+        if (end - p < 2) {
+            return false;
+        }
+        const size_t offset = size_t(p[0]) | (size_t(p[1]) << 8);
+        p += 2;
+        const size_t match = readLength(p, end, token & 15);
+        if (match == SIZE_MAX || offset == 0 || offset > out || match + MIN_MATCH > size - out) {
+            return false;
+        }
+        // Byte by byte, the match may overlap its own output.
+        const uint8_t* from = dst + out - offset;
+        for (size_t k = 0; k < match + MIN_MATCH; k++) {
+            dst[out + k] = from[k];
+        }
+        out += match + MIN_MATCH;
+    }
+    return out == size;
+}
+
+} // namespace compressed_image
+
+/// <summary>
+/// Losslessly compressed copy of an image of T pixels (float or glm::vec3), see above.
+/// </summary>
+template <typename T>
+class CompressedImage {
+public:
+    static constexpr size_t channels = sizeof(T) / sizeof(float);
+
+    CompressedImage() = default;
+
+    /// <summary>
+    /// Compresses the pixels of an image, its bands in parallel.
+    /// </summary>
+    explicit CompressedImage(const ImageView<const T> image)
+        : m_width(image.width)
+        , m_height(image.height)
+    {
+        m_bands.resize(size_t((image.height + COMPRESSED_BAND_ROWS - 1) / COMPRESSED_BAND_ROWS));
+        parallelFor(0, int(m_bands.size()), int64_t(image.width) * COMPRESSED_BAND_ROWS, KernelCost::Medium, [&](const int band) {
+            const int y0 = band * COMPRESSED_BAND_ROWS;
+            const int rows = std::min(COMPRESSED_BAND_ROWS, image.height - y0);
+            const size_t words = size_t(rows) * size_t(image.width) * channels;
+            std::vector<uint32_t> residuals(words);
+            for (int y = 0; y < rows; y++) {
+                std::memcpy(residuals.data() + size_t(y) * size_t(image.width) * channels, image.row(y0 + y), size_t(image.width) * sizeof(T));
+            }
+            for (size_t i = words; i-- > channels;) {
+                residuals[i] ^= residuals[i - channels];
+            }
+            std::vector<uint8_t> planes(words * 4);
+            for (size_t i = 0; i < words; i++) {
+                for (size_t b = 0; b < 4; b++) {
+                    planes[b * words + i] = uint8_t(residuals[i] >> (8 * b));
+                }
+            }
+            compressed_image::lzCompress(planes.data(), planes.size(), m_bands[size_t(band)]);
+            m_bands[size_t(band)].shrink_to_fit();
+        });
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    /// <summary>
+    /// Bytes of the compressed bands.
+    /// </summary>
+    size_t compressedBytes() const
+    {
+        size_t bytes = 0;
+        for (const auto& band : m_bands) {
+            bytes += band.size();
+        }
+        return bytes;
+    }
+
+    int bands() const { return int(m_bands.size()); }
+    int bandRows(const int band) const { return std::min(COMPRESSED_BAND_ROWS, m_height - band * COMPRESSED_BAND_ROWS); }
+
+    /// <summary>
+    /// Decompresses the rows of one band, bit for bit, into bandRows(band) * width() pixels.
+    /// False when the band is corrupt.
+    /// </summary>
+    bool decompressBand(const int band, T* pixels) const
+    {
+        const size_t words = size_t(bandRows(band)) * size_t(m_width) * channels;
+        std::vector<uint8_t> planes(words * 4);
+        const auto& data = m_bands[size_t(band)];
+        if (!compressed_image::lzDecompress(data.data(), data.size(), planes.data(), planes.size())) {
+            return false;
+        }
+        uint32_t* residuals = reinterpret_cast<uint32_t*>(pixels);
+        for (size_t i = 0; i < words; i++) {
+            residuals[i] = uint32_t(planes[i]) | (uint32_t(planes[words + i]) << 8) | (uint32_t(planes[2 * words + i]) << 16) | (uint32_t(planes[3 * words + i]) << 24);
+        }
+        for (size_t i = channels; i < words; i++) {
+            residuals[i] ^= residuals[i - channels];
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// The original image, bit for bit.
+    /// </summary>
+    Image<T> decompress() const
+    {
+        auto image = Image<T>::uninitialized(m_width, m_height);
+        std::atomic<bool> corrupt = false;
+        parallelFor(0, bands(), int64_t(m_width) * COMPRESSED_BAND_ROWS, KernelCost::Medium, [&](const int band) {
+            if (!decompressBand(band, image.data.data() + size_t(band) * COMPRESSED_BAND_ROWS * size_t(m_width))) {
+                corrupt = true;
+            }
+        });
+        if (corrupt) {
+            std::cerr << "Compressed image is corrupt." << std::endl;
+            throw std::exception();
+        }
+        return image;
+    }
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<std::vector<uint8_t>> m_bands;
+};
+
+/// <summary>
+/// Keeps an image compressed while the stages in between do not read it, see above; the image is
+/// empty until restore(). When disabled, the image stays as it is and restore() does nothing.
+/// </summary>
+template <typename T>
+class IdleImage {
+public:
+    IdleImage(Image<T>& image, const bool enabled)
+        : m_image(image)
+    {
+        if (enabled) {
+            m_compressed.emplace(image);
+            image = Image<T>();
+        }
+    }
+    IdleImage(const IdleImage&) = delete;
+    IdleImage& operator=(const IdleImage&) = delete;
+
+    /// <summary>
+    /// Decompresses the image back into place on first use.
+    /// </summary>
+    Image<T>& restore()
+    {
+        if (m_compressed) {
+            m_image = m_compressed->decompress();
+            m_compressed.reset();
+        }
+        return m_image;
+    }
+
+    /// <summary>
+    /// Bytes held while the image is idle, its raw size when it is not compressed.
+    /// </summary>
+    size_t residentBytes() const { return m_compressed ? m_compressed->compressedBytes() : m_image.data.size() * sizeof(T); }
+
+private:
+    Image<T>& m_image;
+    std::optional<CompressedImage<T>> m_compressed;
+};
+
+/// <summary>
+/// durandCompose() of an input kept compressed while the base layer was filtered: the bands of
+/// the input are decompressed one at a time per thread, the full input is never resident again.
+/// Same result as durandCompose() of the decompressed image.
+/// </summary>
+/// <param name="hdr_image">compressed linear HDR RGB image</param>
+/// <param name="log_lum_H">durandLogLuminance() of the image</param>
+/// <param name="base_image">base layer, the bilateral filter of log_lum_H</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB durandComposeCompressed(const CompressedImage<glm::vec3>& hdr_image, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params = {})
+{
+    const int width = hdr_image.width();
+    auto result = ImageRGB::uninitialized(width, hdr_image.height());
+    std::atomic<bool> corrupt = false;
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * int64_t(hdr_image.height()), KernelCost::Medium))
+        {
+            std::vector<glm::vec3> band_pixels(size_t(COMPRESSED_BAND_ROWS) * size_t(width));
+#pragma omp for schedule(static)
+            for (int band = 0; band < hdr_image.bands(); band++) {
+                if (!hdr_image.decompressBand(band, band_pixels.data())) {
+                    corrupt = true;
+                    continue;
+                }
+                const size_t first = size_t(band) * COMPRESSED_BAND_ROWS * size_t(width);
+                const size_t count = size_t(hdr_image.bandRows(band)) * size_t(width);
+                for (size_t j = 0; j < count; j++) {
+                    const auto val = band_pixels[j];
+                    const float b_val = base_image.data[first + j];
+                    const float d_val = log_lum_H.data[first + j] - b_val;
+                    const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, d_val, params.base_scale, params.output_gain);
+                    result.data[first + j] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+                }
+            }
+        }
+    });
+    if (corrupt) {
+        std::cerr << "Compressed image is corrupt." << std::endl;
+        throw std::exception();
+    }
+    return result;
+}
+
+/// <summary>
+/// toneMap() with the input compressed while its base layer is filtered and decompressed band by
+/// band by the final pass (see durandComposeCompressed()), same result. The input is consumed.
+/// Operators without a base layer and the color guide, which filters with the input, run as usual.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image, empty afterwards</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapCompressedIdle(ImageRGB&& hdr_image, const DurandParams& params = {})
+{
+    if (params.tone_operator != ToneMapOperator::Durand || params.color_guide) {
+        const auto input = std::move(hdr_image);
+        return toneMap(input, params);
+    }
+    const auto log_lum_H = durandLogLuminance(hdr_image, params);
+    const CompressedImage<glm::vec3> idle_hdr(hdr_image);
+    hdr_image = ImageRGB();
+    AutoContrast auto_contrast(params, log_lum_H.width, log_lum_H.height);
+    const auto base_image = bilateralFilter(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+    auto result = durandComposeCompressed(idle_hdr, log_lum_H, base_image, auto_contrast.resolve());
+    applyLook(result, params.look);
+    return result;
+}
+
+#pragma endregion Compressed images
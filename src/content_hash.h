@@ -0,0 +1,205 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Non-cryptographic 64-bit content hashes, the keys of cached results (result_cache.h) and of
+ * data derived from a mask (mask_geometry.h).
+ *
+ * ContentHash hashes a sequence of small values. Images are hashed by hashImage() instead, fast
+ * enough to key a cache on what an image contains: every row is a leaf hashed on its own with
+ * eight independent multiply-accumulate lanes over 64-byte stripes (hashBytes(), the structure
+ * of xxh3, which the compiler vectorizes), and the row hashes are combined in row order. Rows
+ * are hashed in parallel, and as the leaves do not depend on how rows are distributed, the hash
+ * is the same for every thread count. A kernel that writes an image row by row can hash each
+ * row while it is still in cache, see ImageHashAccumulator; ContentHash::add() of an image mixes
+ * in the same value.
+ */
+
+#pragma region Content hash
+
+/// <summary>
+/// Lane keys of hashBytes(), odd 64-bit constants.
+/// </summary>
+constexpr uint64_t HASH_LANE_KEYS[8] = { 0x9e3779b185ebca87ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0x85ebca77c2b2ae63ull,
+    0x27d4eb2f165667c5ull, 0x94d049bb133111ebull, 0xbf58476d1ce4e5b9ull, 0xd6e8feb86659fd93ull };
+
+/// <summary>
+/// Stripes between two scrambles of the lanes of hashBytes().
+/// </summary>
+constexpr size_t HASH_STRIPES_PER_BLOCK = 16;
+
+/// <summary>
+/// splitmix64 finalizer.
+/// </summary>
+inline uint64_t hashMix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/// <summary>
+/// 64-bit hash of a byte range, see above: per 64-byte stripe, every lane adds the product of
+/// the halves of its keyed word and its neighbour lane the word itself; the lanes are scrambled
+/// after every block of stripes and mixed with the tail at the end.
+/// </summary>
+inline uint64_t hashBytes(const void* data, const size_t size, const uint64_t seed = 0)
+{
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    uint64_t lanes[8];
+    for (int lane = 0; lane < 8; lane++) {
+        lanes[lane] = HASH_LANE_KEYS[lane] ^ seed;
+    }
+    const size_t num_stripes = size / 64;
+    for (size_t stripe = 0; stripe < num_stripes; stripe++) {
+        uint64_t words[8];
+        std::memcpy(words, bytes + stripe * 64, 64);
+        for (int lane = 0; lane < 8; lane++) {
+            const uint64_t keyed = words[lane] ^ HASH_LANE_KEYS[lane];
+            lanes[lane ^ 1] += words[lane];
+            lanes[lane] += (keyed & 0xffffffffull) * (keyed >> 32);
+        }
+        if ((stripe + 1) % HASH_STRIPES_PER_BLOCK == 0) {
+            for (int lane = 0; lane < 8; lane++) {
+                lanes[lane] = (lanes[lane] ^ (lanes[lane] >> 47) ^ HASH_LANE_KEYS[7 - lane]) * 0x9e3779b1ull;
+            }
+        }
+    }
+    uint64_t result = hashMix(uint64_t(size) ^ seed);
+    for (const uint64_t lane : lanes) {
+        result = hashMix(result ^ lane);
+    }
+    // The last partial stripe, 8 bytes at a time.
+    for (size_t offset = num_stripes * 64; offset < size; offset += 8) {
+        uint64_t word = 0;
+        std::memcpy(&word, bytes + offset, std::min<size_t>(8, size - offset));
+        result = hashMix(result ^ word);
+    }
+    return result;
+}
+
+/// <summary>
+/// Hash of an image from its rows, added in any order and from any thread, see above.
+/// </summary>
+class ImageHashAccumulator {
+public:
+    /// <param name="pixel_bytes">size of a pixel, e.g. sizeof(float)</param>
+    ImageHashAccumulator(const int width, const int height, const size_t pixel_bytes)
+        : m_width(width)
+        , m_height(height)
+        , m_pixel_bytes(pixel_bytes)
+        , m_row_hashes(size_t(height), 0)
+    {
+    }
+
+    /// <summary>
+    /// Adds row y, width pixels. Safe to call concurrently for different rows.
+    /// </summary>
+    void addRow(const int y, const void* row) { m_row_hashes[size_t(y)] = hashBytes(row, size_t(m_width) * m_pixel_bytes); }
+
+    /// <summary>
+    /// Adds the rows of a band of the image (full rows) starting at row y0.
+    /// </summary>
+    template <typename T>
+    void addRows(const ImageView<const T> rows, const int y0)
+    {
+        assert(rows.width == m_width && sizeof(T) == m_pixel_bytes);
+        for (int y = 0; y < rows.height; y++) {
+            addRow(y0 + y, rows.row(y));
+        }
+    }
+
+    /// <summary>
+    /// Hash of the image, once every row was added.
+    /// </summary>
+    uint64_t finish() const
+    {
+        const uint64_t header[3] = { uint64_t(m_width), uint64_t(m_height), uint64_t(m_pixel_bytes) };
+        return hashBytes(m_row_hashes.data(), m_row_hashes.size() * sizeof(uint64_t), hashBytes(header, sizeof(header)));
+    }
+
+private:
+    int m_width;
+    int m_height;
+    size_t m_pixel_bytes;
+    std::vector<uint64_t> m_row_hashes;
+};
+
+/// <summary>
+/// Hash of the size and pixels of an image, rows hashed in parallel, see above.
+/// </summary>
+template <typename T>
+uint64_t hashImage(const ImageView<const T> image)
+{
+    ImageHashAccumulator accumulator(image.width, image.height, sizeof(T));
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        accumulator.addRow(y, image.row(y));
+    }
+    return accumulator.finish();
+}
+
+/// <summary>
+/// 64-bit hash of a sequence of values, four interleaved multiply-xor lanes over 8-byte words.
+/// </summary>
+class ContentHash {
+public:
+    ContentHash& addBytes(const void* data, const size_t size)
+    {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        const size_t num_words = size / 8;
+        size_t i = 0;
+        for (; i + 4 <= num_words; i += 4) {
+            for (int lane = 0; lane < 4; lane++) {
+                uint64_t word;
+                std::memcpy(&word, bytes + (i + size_t(lane)) * 8, 8);
+                m_lanes[lane] = mix(m_lanes[lane] ^ word);
+            }
+        }
+        for (; i < num_words; i++) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i * 8, 8);
+            m_lanes[0] = mix(m_lanes[0] ^ word);
+        }
+        uint64_t tail = 0;
+        if (size % 8 != 0) {
+            std::memcpy(&tail, bytes + num_words * 8, size % 8);
+        }
+        m_lanes[1] = mix(m_lanes[1] ^ tail ^ (uint64_t(size) << 56));
+        return *this;
+    }
+
+    template <typename T>
+    ContentHash& add(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+        return addBytes(&value, sizeof(T));
+    }
+    ContentHash& add(const std::string_view text) { return add(text.size()).addBytes(text.data(), text.size()); }
+    ContentHash& add(const ImageFloat& image) { return add(hashImage<float>(image)); }
+    ContentHash& add(const ImageXYZ& image) { return add(image.X).add(image.Y).add(image.Z); }
+
+    uint64_t value() const
+    {
+        uint64_t result = 0;
+        for (const uint64_t lane : m_lanes) {
+            result = mix(result ^ lane);
+        }
+        return result;
+    }
+
+private:
+    static uint64_t mix(const uint64_t x) { return hashMix(x); }
+
+    uint64_t m_lanes[4] = { 0x9e3779b97f4a7c15ull, 0x6a09e667f3bcc909ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull };
+};
+
+#pragma endregion Content hash
@@ -0,0 +1,433 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <filesystem>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <semaphore>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <framework/image.h>
+#include <framework/image_allocator.h>
+
+#include "execution.h"
+#include "ring_buffer.h"
+#include "stage_profiler.h"
+#include "your_code_here.h"
+
+/*
+ * Coroutine versions of the expensive stages.
+ *
+ * A job written with blocking calls holds its thread while it waits for a decode, a kernel of
+ * another job or a write, so the number of jobs in flight is the number of threads. The stages
+ * here are C++20 coroutines returning a Task: loadImageAsync(), bilateralFilterAsync(),
+ * toneMapAsync(), solvePoissonXYZAsync() and writeAsync() first move to the StageExecutor they
+ * are given and run the synchronous stage there, and a job awaiting one is suspended without a
+ * thread until the stage completes, then continues on the thread that ran it. Jobs are written
+ * as straight-line coroutines
+ *
+ *     Task<void> job(StageExecutor& io, StageExecutor& compute, ...)
+ *     {
+ *         auto hdr = co_await loadImageAsync<ImageRGB>(io, input);
+ *         co_await writeAsync(io, co_await toneMapAsync(compute, std::move(hdr), params), output);
+ *     }
+ *
+ * and many of them interleave on a few threads: a small I/O pool for decodes and writes and a
+ * compute pool whose workers split the kernel threads. Tasks are lazy (they start when awaited)
+ * and resume their awaiter by symmetric transfer, so deep chains do not grow the stack.
+ * syncWait() runs a task to completion from a thread that is not a pool worker, and a TaskGroup
+ * starts detached jobs with a bound on the jobs in flight.
+ *
+ * ThreadPoolExecutor queues resumptions in an MpmcRing (see ring_buffer.h). Its workers run
+ * with the image memory resource of the thread that created the pool and getThreadCount()
+ * split between them, like the workers of runToneMapBatch(). A resumption posted to a full
+ * queue runs inline on the posting thread instead of blocking it.
+ */
+
+#pragma region Coroutine stages
+
+/// <summary>
+/// Where coroutines of the stages resume.
+/// </summary>
+class StageExecutor {
+public:
+    virtual ~StageExecutor() = default;
+
+    /// <summary>
+    /// Resumes the coroutine on a thread of the executor, later or now.
+    /// </summary>
+    virtual void post(std::coroutine_handle<> handle) = 0;
+};
+
+/// <summary>
+/// Resumes on the posting thread (stages run synchronously).
+/// </summary>
+class InlineExecutor : public StageExecutor {
+public:
+    void post(const std::coroutine_handle<> handle) override { handle.resume(); }
+};
+
+/// <summary>
+/// Fixed pool of worker threads, see above.
+/// </summary>
+class ThreadPoolExecutor : public StageExecutor {
+public:
+    /// <param name="name">name of the queue in the RingOccupancyReport</param>
+    /// <param name="num_workers">worker threads</param>
+    /// <param name="kernel_threads">kernel threads of each worker, values <= 0 split getThreadCount() between the workers</param>
+    /// <param name="queue_capacity">queued resumptions before posts run inline</param>
+    ThreadPoolExecutor(std::string name, const int num_workers, const int kernel_threads = 0, const size_t queue_capacity = 1024)
+        : m_queue(std::move(name), queue_capacity, WaitStrategy::Block)
+    {
+        const int workers = std::max(num_workers, 1);
+        const int threads = kernel_threads > 0 ? kernel_threads : std::max(getThreadCount() / workers, 1);
+        std::pmr::memory_resource* const resource = currentImageMemoryResource();
+        for (int i = 0; i < workers; i++) {
+            m_workers.emplace_back([this, threads, resource] {
+                ImageMemoryScope memory_scope(resource);
+                setThreadCount(threads);
+                while (const auto handle = m_queue.pop()) {
+                    handle->resume();
+                }
+            });
+        }
+    }
+
+    /// <summary>
+    /// Runs the queued resumptions and joins the workers.
+    /// </summary>
+    ~ThreadPoolExecutor()
+    {
+        m_queue.close();
+        for (auto& worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    void post(const std::coroutine_handle<> handle) override
+    {
+        auto queued = handle;
+        if (!m_queue.tryPush(queued)) {
+            handle.resume();
+        }
+    }
+
+private:
+    MpmcRing<std::coroutine_handle<>> m_queue;
+    std::vector<std::thread> m_workers;
+};
+
+/// <summary>
+/// Awaitable that continues the coroutine on an executor.
+/// </summary>
+struct ScheduleOn {
+    StageExecutor& executor;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(const std::coroutine_handle<> handle) const { executor.post(handle); }
+    void await_resume() const noexcept { }
+};
+
+/// <summary>
+/// co_await schedule(executor) moves the rest of the coroutine to the executor.
+/// </summary>
+inline ScheduleOn schedule(StageExecutor& executor)
+{
+    return { executor };
+}
+
+template <typename T>
+class Task;
+
+/// <summary>
+/// State of a Task shared by all result types: the awaiting coroutine and a pending exception.
+/// </summary>
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(const std::coroutine_handle<Promise> handle) const noexcept
+        {
+            return handle.promise().continuation;
+        }
+        void await_resume() const noexcept { }
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value.emplace(std::move(result)); }
+    T result()
+    {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() const noexcept { }
+    void result() const
+    {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+/// <summary>
+/// Lazy coroutine producing a T: starts when awaited, and the awaiter continues with the result
+/// (or the exception) on the thread that completed it.
+/// </summary>
+template <typename T = void>
+class [[nodiscard]] Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(const std::coroutine_handle<promise_type> handle)
+        : m_handle(handle)
+    {
+    }
+    Task(Task&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, {}))
+    {
+    }
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other) {
+            if (m_handle) {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if (m_handle) {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(const std::coroutine_handle<> awaiting) const noexcept
+    {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+    T await_resume() const { return m_handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/// <summary>
+/// Eagerly started coroutine that frees itself at the end, the root of syncWait() and TaskGroup jobs.
+/// </summary>
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept { }
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+// Result slot of syncWait(), std::monostate for Task<void>.
+template <typename T>
+using TaskResultSlot = std::optional<std::conditional_t<std::is_void_v<T>, std::monostate, T>>;
+
+template <typename T>
+DetachedTask runSignaling(Task<T> task, TaskResultSlot<T>& result, std::exception_ptr& error, std::binary_semaphore& done)
+{
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+            result.emplace();
+        } else {
+            result.emplace(co_await task);
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    done.release();
+}
+
+/// <summary>
+/// Runs a task and blocks the calling thread until it completes. Must not be called from a
+/// worker of an executor the task needs.
+/// </summary>
+/// <returns>result of the task, its exception is rethrown</returns>
+template <typename T>
+T syncWait(Task<T> task)
+{
+    TaskResultSlot<T> result;
+    std::exception_ptr error;
+    std::binary_semaphore done(0);
+    runSignaling(std::move(task), result, error, done);
+    done.acquire();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void_v<T>) {
+        return std::move(*result);
+    }
+}
+
+/// <summary>
+/// Detached jobs with a bound on the jobs in flight. spawn() blocks the calling thread while
+/// the bound is reached, wait() until every job completed.
+/// </summary>
+class TaskGroup {
+public:
+    /// <param name="max_in_flight">jobs started and not completed, values <= 0 for no bound</param>
+    explicit TaskGroup(const int max_in_flight = 0)
+        : m_max_in_flight(max_in_flight > 0 ? max_in_flight : std::numeric_limits<int>::max())
+    {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup()
+    {
+        std::unique_lock lock(m_mutex);
+        m_completed.wait(lock, [this] { return m_in_flight == 0; });
+    }
+
+    /// <summary>
+    /// Starts a job on the calling thread (up to its first suspension).
+    /// </summary>
+    void spawn(Task<void> job)
+    {
+        {
+            std::unique_lock lock(m_mutex);
+            m_completed.wait(lock, [this] { return m_in_flight < m_max_in_flight; });
+            m_in_flight++;
+        }
+        run(std::move(job), *this);
+    }
+
+    /// <summary>
+    /// Blocks until the spawned jobs completed; rethrows the first exception of a job.
+    /// </summary>
+    void wait()
+    {
+        std::unique_lock lock(m_mutex);
+        m_completed.wait(lock, [this] { return m_in_flight == 0; });
+        if (auto error = std::exchange(m_error, nullptr)) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    static DetachedTask run(Task<void> job, TaskGroup& group)
+    {
+        std::exception_ptr error;
+        try {
+            co_await job;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        // Notified under the lock: the group may be destroyed as soon as it is released.
+        std::lock_guard lock(group.m_mutex);
+        if (error && !group.m_error) {
+            group.m_error = error;
+        }
+        group.m_in_flight--;
+        group.m_completed.notify_all();
+    }
+
+    const int m_max_in_flight;
+    int m_in_flight = 0;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::condition_variable m_completed;
+};
+
+/// <summary>
+/// Decodes a file into a Result (ImageRGB, ImageFloat, BinaryMask, ...) on the executor.
+/// </summary>
+/// <param name="executor">executor of the decode, usually an I/O pool</param>
+/// <param name="path">input file</param>
+template <typename Result = ImageRGB>
+Task<Result> loadImageAsync(StageExecutor& executor, std::filesystem::path path)
+{
+    co_await schedule(executor);
+    co_return profileStage("load", 0, [&] { return Result(path); });
+}
+
+/// <summary>
+/// bilateralFilter() on the executor.
+/// </summary>
+Task<ImageFloat> bilateralFilterAsync(StageExecutor& executor, ImageFloat H, const int size, const float space_sigma, const float range_sigma,
+    const BilateralEngine engine = BilateralEngine::BruteForce)
+{
+    co_await schedule(executor);
+    co_return bilateralFilter(H, size, space_sigma, range_sigma, engine);
+}
+
+/// <summary>
+/// toneMap() on the executor.
+/// </summary>
+Task<ImageRGB> toneMapAsync(StageExecutor& executor, ImageRGB hdr_image, const DurandParams params = {})
+{
+    co_await schedule(executor);
+    co_return toneMap(hdr_image, params);
+}
+
+/// <summary>
+/// solvePoissonXYZ() on the executor.
+/// </summary>
+Task<ImageXYZ> solvePoissonXYZAsync(StageExecutor& executor, ImageXYZ targetXYZ, ImageXYZ divergenceXYZ_G, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const ExecutionContext context = {})
+{
+    co_await schedule(executor);
+    co_return solvePoissonXYZ(targetXYZ, divergenceXYZ_G, num_iters, method, context);
+}
+
+/// <summary>
+/// Image::writeToFile() on the executor; the image is released there.
+/// </summary>
+template <typename T>
+Task<void> writeAsync(StageExecutor& executor, Image<T> image, std::filesystem::path path)
+{
+    co_await schedule(executor);
+    profileStage("write", 0, [&] { image.writeToFile(path); });
+}
+
+#pragma endregion Coroutine stages
@@ -0,0 +1,79 @@
+#pragma once
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Table-driven tone curves for quantized inputs.
+ *
+ * LDR files are loaded by stbToType() as k / 255 floats, so a per-channel curve only ever sees
+ * 256 distinct inputs. The curve is tabulated once per call and every pixel becomes a lookup.
+ * Table entries are computed with the same per-pixel function as the direct path, so the
+ * result is bitwise identical.
+ */
+
+#pragma region Quantized curve tables
+
+/// <summary>
+/// What is known about the quantization of the pixel values passed to a curve operator.
+/// </summary>
+enum class PixelQuantization {
+    // Scan the image and use a table if every channel is k / 255.
+    Auto,
+    // Values are arbitrary floats, always evaluate the curve.
+    Continuous,
+    // Values are k / 255 as produced by the 8-bit loader.
+    Uint8,
+};
+
+/// <summary>
+/// Number of steps of 8-bit inputs (values are k / 255, k in [0, 255]).
+/// </summary>
+constexpr int UINT8_LEVELS = 255;
+
+/// <summary>
+/// True when every channel of every pixel equals float(k) / levels for an integer k in [0, levels],
+/// i.e. exactly what the loader produces for integer samples. Stops at the first mismatch,
+/// so HDR inputs are rejected after a few pixels.
+/// </summary>
+bool isQuantizedImage(const ImageView<const glm::vec3> image, const int levels = UINT8_LEVELS)
+{
+    const auto on_grid = [levels](const float v) {
+        const int k = int(v * float(levels) + 0.5f);
+        return v >= 0.0f && k <= levels && float(k) / float(levels) == v;
+    };
+    for (int y = 0; y < image.height; y++) {
+        const auto* row = image.row(y);
+        for (int x = 0; x < image.width; x++) {
+            if (!on_grid(row[x].r) || !on_grid(row[x].g) || !on_grid(row[x].b)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// <summary>
+/// Scalar curve tabulated at the inputs float(k) / levels.
+/// </summary>
+struct QuantizedCurveLut {
+    float levels;
+    std::vector<float> table;
+
+    template <typename Curve>
+    QuantizedCurveLut(const int num_levels, const Curve& curve)
+        : levels(float(num_levels))
+        , table(size_t(num_levels) + 1)
+    {
+        for (int k = 0; k <= num_levels; k++) {
+            table[k] = curve(float(k) / float(num_levels));
+        }
+    }
+
+    // Input must be one of the tabulated values.
+    float operator()(const float v) const { return table[int(v * levels + 0.5f)]; }
+
+    glm::vec3 operator()(const glm::vec3& v) const { return { (*this)(v.r), (*this)(v.g), (*this)(v.b) }; }
+};
+
+#pragma endregion Quantized curve tables
@@ -0,0 +1,186 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <typeindex>
+#include <utility>
+
+#include <framework/image.h>
+#include <framework/image_allocator.h>
+
+#include "binary_mask.h"
+
+/*
+ * Process-wide cache of decoded input files.
+ *
+ * Batch and service runs reuse the same targets, sources and masks across many jobs, and each
+ * job used to decode them again. DecodedImageCache::load<T>(path) returns the decoded file as a
+ * shared immutable T (ImageRGB, ImageFloat, BinaryMask or any type constructed from a path),
+ * decoding it only when it is not cached. An entry is keyed by the absolute path, the
+ * modification time and size of the file and the requested type, so a rewritten file is decoded
+ * again and the same file loaded as RGB and as a mask is two entries. Entries are evicted least
+ * recently used first once their decoded bytes exceed the bound; a holder of an evicted image
+ * keeps it alive until it drops it.
+ *
+ * Cached images are allocated with operator new rather than from the image memory resource of the
+ * caller (a pool or an arena of one job), since they outlive it. Thread-safe; a file missed by two
+ * threads at once is decoded by both and cached once. Callers that modify the image copy it.
+ */
+
+#pragma region Decoded image cache
+
+/// <summary>
+/// Bytes of a decoded image, for the bound of the cache.
+/// </summary>
+template <typename T>
+size_t decodedImageBytes(const Image<T>& image)
+{
+    return image.data.size() * sizeof(T);
+}
+inline size_t decodedImageBytes(const BinaryMask& mask)
+{
+    return size_t(mask.wordsPerRow()) * size_t(mask.height()) * sizeof(uint64_t);
+}
+
+/// <summary>
+/// LRU cache of decoded files by path, modification time and type, see above.
+/// </summary>
+class DecodedImageCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t entries = 0;
+        // Decoded bytes held.
+        size_t bytes = 0;
+    };
+
+    /// <param name="max_bytes">bound of the decoded bytes held, 0 disables the cache</param>
+    explicit DecodedImageCache(const size_t max_bytes = size_t(512) << 20)
+        : m_max_bytes(max_bytes)
+    {
+    }
+
+    DecodedImageCache(const DecodedImageCache&) = delete;
+    DecodedImageCache& operator=(const DecodedImageCache&) = delete;
+
+    /// <summary>
+    /// The decoded file, from the cache while the file is unchanged. Throws std::exception (after
+    /// printing the reason) when the file is missing or cannot be decoded.
+    /// </summary>
+    /// <param name="path">input file</param>
+    template <typename T>
+    std::shared_ptr<const T> load(const std::filesystem::path& path)
+    {
+        std::error_code error;
+        const auto absolute = std::filesystem::absolute(path, error).lexically_normal();
+        const auto write_time = std::filesystem::last_write_time(absolute, error);
+        const auto file_size = error ? std::uintmax_t(0) : std::filesystem::file_size(absolute, error);
+        if (error) {
+            std::cerr << "Input " << path << " does not exist." << std::endl;
+            throw std::exception();
+        }
+        const Key key { absolute.string(), write_time, file_size, std::type_index(typeid(T)) };
+        {
+            std::lock_guard lock(m_mutex);
+            const auto it = m_entries.find(key);
+            if (it != m_entries.end()) {
+                m_order.splice(m_order.begin(), m_order, it->second.order);
+                m_stats.hits++;
+                return std::static_pointer_cast<const T>(it->second.value);
+            }
+            m_stats.misses++;
+        }
+
+        std::shared_ptr<const T> value;
+        {
+            ImageMemoryScope memory_scope(std::pmr::new_delete_resource());
+            value = std::make_shared<const T>(absolute);
+        }
+        insert(key, value, decodedImageBytes(*value));
+        return value;
+    }
+
+    /// <summary>
+    /// Changes the bound, evicting entries beyond it.
+    /// </summary>
+    void setMaxBytes(const size_t max_bytes)
+    {
+        std::lock_guard lock(m_mutex);
+        m_max_bytes = max_bytes;
+        evict();
+    }
+
+    Stats getStats() const
+    {
+        std::lock_guard lock(m_mutex);
+        Stats stats = m_stats;
+        stats.entries = m_entries.size();
+        return stats;
+    }
+
+    void clear()
+    {
+        std::lock_guard lock(m_mutex);
+        m_entries.clear();
+        m_order.clear();
+        m_stats.bytes = 0;
+    }
+
+private:
+    using Key = std::tuple<std::string, std::filesystem::file_time_type, std::uintmax_t, std::type_index>;
+
+    struct Entry {
+        std::shared_ptr<const void> value;
+        size_t bytes = 0;
+        std::list<Key>::iterator order;
+    };
+
+    void insert(const Key& key, std::shared_ptr<const void> value, const size_t bytes)
+    {
+        std::lock_guard lock(m_mutex);
+        if (bytes > m_max_bytes || m_entries.count(key) != 0) {
+            return;
+        }
+        m_order.push_front(key);
+        m_entries[key] = Entry { std::move(value), bytes, m_order.begin() };
+        m_stats.bytes += bytes;
+        evict();
+    }
+
+    // Drops the least recently used entries beyond the bound, with the mutex held.
+    void evict()
+    {
+        while (m_stats.bytes > m_max_bytes && !m_order.empty()) {
+            const auto oldest = m_entries.find(m_order.back());
+            m_stats.bytes -= oldest->second.bytes;
+            m_entries.erase(oldest);
+            m_order.pop_back();
+        }
+    }
+
+    mutable std::mutex m_mutex;
+    size_t m_max_bytes;
+    std::map<Key, Entry> m_entries;
+    // Keys, most recently used first.
+    std::list<Key> m_order;
+    Stats m_stats;
+};
+
+/// <summary>
+/// The cache of the process, bounded by the decoded_cache_mb setting.
+/// </summary>
+inline DecodedImageCache& decodedImageCache()
+{
+    static DecodedImageCache cache;
+    return cache;
+}
+
+#pragma endregion Decoded image cache
@@ -0,0 +1,298 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+#include "binary_mask.h"
+#include "stage_profiler.h"
+
+/*
+ * Dirty regions of the buffers of a pipeline.
+ *
+ * A local edit (exposure of a rectangle, a painted mask) changes a few tiles of the input, but
+ * every stage after it reads the whole frame. A DirtyRegionGraph keeps the stages of a pipeline
+ * with the footprint of each of their inputs, marks the tiles of a source buffer that an edit
+ * changed, and update() carries the marks through the stages in order:
+ *
+ *  - a per-pixel stage (log-luminance, compose, a LUT) keeps the tiles: StageFootprint::pointwise();
+ *  - a stage that reads a window (the bilateral filter) grows them by its radius:
+ *    StageFootprint::window(radius);
+ *  - a stage whose result depends on a whole region (the Poisson solution inside a mask, which
+ *    every pixel of the mask and its boundary influences) marks all of the region as soon as one
+ *    of its tiles changes: StageFootprint::region(bounds);
+ *  - a stage that depends on the whole frame (a normalization, statistics of a layer) marks
+ *    everything: StageFootprint::global().
+ *
+ * Every stage whose output has marked tiles is called with them and recomputes only those, from
+ * the intermediates kept from the last update, so an edit costs time in proportion to its size
+ * (plus the footprints) instead of the frame. The tiles of a stage are the union over its inputs;
+ * the stages of a graph are added after their inputs, so the order they were added in is an order
+ * to update them in.
+ */
+
+#pragma region Dirty regions
+
+/// <summary>
+/// Default edge length of the tiles of a DirtyRegionGraph.
+/// </summary>
+constexpr int DIRTY_TILE_SIZE = 32;
+
+/// <summary>
+/// Pixels of its input that one output pixel of a stage reads, see above.
+/// </summary>
+struct StageFootprint {
+    enum class Kind {
+        Pointwise,
+        Window,
+        Region,
+        Global,
+    };
+
+    Kind kind = Kind::Pointwise;
+    // Reach of a Window stage in pixels.
+    int radius = 0;
+    // Pixels a Region stage recomputes together.
+    PixelRect area;
+
+    static StageFootprint pointwise() { return {}; }
+    static StageFootprint window(const int radius) { return { Kind::Window, radius, {} }; }
+    static StageFootprint region(const PixelRect& area) { return { Kind::Region, 0, area }; }
+    static StageFootprint global() { return { Kind::Global, 0, {} }; }
+};
+
+/// <summary>
+/// Set of the tiles of an image that changed.
+/// </summary>
+class DirtyTiles {
+public:
+    DirtyTiles() = default;
+    DirtyTiles(const int width, const int height, const int tile_size = DIRTY_TILE_SIZE)
+        : m_width(width)
+        , m_height(height)
+        , m_tile_size(std::max(tile_size, 1))
+        , m_tiles_x((width + m_tile_size - 1) / m_tile_size)
+        , m_tiles_y((height + m_tile_size - 1) / m_tile_size)
+        , m_flags(size_t(m_tiles_x) * size_t(m_tiles_y), 0)
+    {
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int tileSize() const { return m_tile_size; }
+    int numTiles() const { return m_tiles_x * m_tiles_y; }
+    int count() const { return int(std::count(m_flags.begin(), m_flags.end(), 1)); }
+    bool any() const { return std::find(m_flags.begin(), m_flags.end(), 1) != m_flags.end(); }
+    bool all() const { return std::find(m_flags.begin(), m_flags.end(), 0) == m_flags.end(); }
+    bool contains(const int tx, const int ty) const { return m_flags[size_t(ty) * size_t(m_tiles_x) + size_t(tx)] != 0; }
+
+    /// <summary>
+    /// Marks the tiles that overlap a rectangle (clipped to the image).
+    /// </summary>
+    void mark(const PixelRect& rect)
+    {
+        const PixelRect clipped = rect.clamped(m_width, m_height);
+        if (clipped.empty()) {
+            return;
+        }
+        for (int ty = clipped.y0 / m_tile_size; ty <= (clipped.y1 - 1) / m_tile_size; ty++) {
+            std::fill_n(m_flags.begin() + (size_t(ty) * size_t(m_tiles_x) + size_t(clipped.x0 / m_tile_size)),
+                (clipped.x1 - 1) / m_tile_size - clipped.x0 / m_tile_size + 1, char(1));
+        }
+    }
+    void markAll() { std::fill(m_flags.begin(), m_flags.end(), char(1)); }
+    void clear() { std::fill(m_flags.begin(), m_flags.end(), char(0)); }
+
+    void unite(const DirtyTiles& other)
+    {
+        for (size_t i = 0; i < m_flags.size(); i++) {
+            m_flags[i] |= other.m_flags[i];
+        }
+    }
+
+    /// <summary>
+    /// Tiles of the output of a stage with the given footprint that these input tiles change.
+    /// </summary>
+    DirtyTiles propagated(const StageFootprint& footprint) const
+    {
+        DirtyTiles result(m_width, m_height, m_tile_size);
+        switch (footprint.kind) {
+        case StageFootprint::Kind::Pointwise:
+            result.m_flags = m_flags;
+            break;
+        case StageFootprint::Kind::Window:
+            for (const auto& run : runs()) {
+                result.mark(run.grown(footprint.radius, footprint.radius, footprint.radius, footprint.radius));
+            }
+            break;
+        case StageFootprint::Kind::Region:
+            result.m_flags = m_flags;
+            if (intersects(footprint.area)) {
+                result.mark(footprint.area);
+            }
+            break;
+        case StageFootprint::Kind::Global:
+            if (any()) {
+                result.markAll();
+            }
+            break;
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// The marked tiles as rectangles, one per run of adjacent tiles of a tile row, clipped to
+    /// the image, row by row.
+    /// </summary>
+    std::vector<PixelRect> runs() const
+    {
+        std::vector<PixelRect> result;
+        for (int ty = 0; ty < m_tiles_y; ty++) {
+            for (int tx = 0; tx < m_tiles_x; tx++) {
+                if (!contains(tx, ty)) {
+                    continue;
+                }
+                const int run_start = tx;
+                while (tx + 1 < m_tiles_x && contains(tx + 1, ty)) {
+                    tx++;
+                }
+                result.push_back(PixelRect { run_start * m_tile_size, ty * m_tile_size, (tx + 1) * m_tile_size, (ty + 1) * m_tile_size }.clamped(m_width, m_height));
+            }
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Bounding box of the marked tiles, empty when none is.
+    /// </summary>
+    PixelRect bounds() const
+    {
+        PixelRect result;
+        for (const auto& run : runs()) {
+            result = result.united(run);
+        }
+        return result;
+    }
+
+private:
+    bool intersects(const PixelRect& rect) const
+    {
+        const PixelRect clipped = rect.clamped(m_width, m_height);
+        if (clipped.empty()) {
+            return false;
+        }
+        for (int ty = clipped.y0 / m_tile_size; ty <= (clipped.y1 - 1) / m_tile_size; ty++) {
+            for (int tx = clipped.x0 / m_tile_size; tx <= (clipped.x1 - 1) / m_tile_size; tx++) {
+                if (contains(tx, ty)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    int m_width = 0;
+    int m_height = 0;
+    int m_tile_size = DIRTY_TILE_SIZE;
+    int m_tiles_x = 0;
+    int m_tiles_y = 0;
+    // 1 for a marked tile, row-major.
+    std::vector<char> m_flags;
+};
+
+/// <summary>
+/// Stages of a pipeline over images of one size, updated by the tiles their inputs changed, see above.
+/// </summary>
+class DirtyRegionGraph {
+public:
+    using Buffer = int;
+
+    /// <summary>
+    /// Input of a stage and how the stage reads it.
+    /// </summary>
+    struct Input {
+        Buffer buffer;
+        StageFootprint footprint;
+    };
+
+    DirtyRegionGraph(const int width, const int height, const int tile_size = DIRTY_TILE_SIZE)
+        : m_width(width)
+        , m_height(height)
+        , m_tile_size(tile_size)
+    {
+    }
+
+    /// <summary>
+    /// Adds a buffer that edits change (e.g. the input image).
+    /// </summary>
+    Buffer addSource(const char* name) { return addNode(name, {}, {}); }
+
+    /// <summary>
+    /// Adds a stage that runs after its (already added) inputs.
+    /// </summary>
+    /// <param name="name">stage name, for the profiler</param>
+    /// <param name="inputs">buffers the stage reads and their footprints</param>
+    /// <param name="recompute">recomputes the given tiles of the output of the stage</param>
+    /// <returns>the output buffer of the stage</returns>
+    Buffer addStage(const char* name, std::initializer_list<Input> inputs, std::function<void(const DirtyTiles&)> recompute)
+    {
+        return addNode(name, std::vector<Input>(inputs), std::move(recompute));
+    }
+
+    /// <summary>
+    /// Marks the pixels of a source that an edit changed.
+    /// </summary>
+    void invalidate(const Buffer source, const PixelRect& rect) { m_nodes[source].dirty.mark(rect); }
+    void invalidateAll(const Buffer source) { m_nodes[source].dirty.markAll(); }
+
+    /// <summary>
+    /// Propagates the marked tiles through the stages and recomputes them, see above.
+    /// </summary>
+    void update()
+    {
+        for (auto& node : m_nodes) {
+            for (const auto& input : node.inputs) {
+                node.dirty.unite(m_nodes[input.buffer].dirty.propagated(input.footprint));
+            }
+            if (node.recompute && node.dirty.any()) {
+                const int count = node.dirty.count();
+                const ScopedStage stage(node.name, uint64_t(count) * uint64_t(m_tile_size) * uint64_t(m_tile_size));
+                node.recompute(node.dirty);
+            }
+        }
+        for (auto& node : m_nodes) {
+            node.last_dirty_tiles = node.dirty.count();
+            node.dirty.clear();
+        }
+    }
+
+    /// <summary>
+    /// Tiles of a buffer that the last update() recomputed (or the edits marked, for a source).
+    /// </summary>
+    int lastDirtyTiles(const Buffer buffer) const { return m_nodes[buffer].last_dirty_tiles; }
+    int numTiles() const { return m_nodes.empty() ? 0 : m_nodes.front().dirty.numTiles(); }
+
+private:
+    struct Node {
+        const char* name;
+        std::vector<Input> inputs;
+        std::function<void(const DirtyTiles&)> recompute;
+        DirtyTiles dirty;
+        int last_dirty_tiles = 0;
+    };
+
+    Buffer addNode(const char* name, std::vector<Input> inputs, std::function<void(const DirtyTiles&)> recompute)
+    {
+        m_nodes.push_back({ name, std::move(inputs), std::move(recompute), DirtyTiles(m_width, m_height, m_tile_size) });
+        return Buffer(m_nodes.size() - 1);
+    }
+
+    int m_width;
+    int m_height;
+    int m_tile_size;
+    std::vector<Node> m_nodes;
+};
+
+#pragma endregion Dirty regions
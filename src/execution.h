@@ -0,0 +1,478 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <utility>
+#include <vector>
+
+#include <framework/image_allocator.h>
+
+#include "job_control.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(_OPENMP) && defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+/*
+ * Execution policy of the image kernels.
+ *
+ * Every per-pixel pass and stencil in this project is parallelized with OpenMP over image rows
+ * ("#pragma omp parallel for"); each output pixel is written by exactly one iteration, so results
+ * do not depend on the thread count. The thread count and the thread placement are shared by
+ * all kernels.
+ *
+ * The loops use the static schedule, so thread t always processes the same band of rows, and
+ * image buffers are first touched by the same partition (see imageRowsFirstTouch()): on a NUMA
+ * host each band then lives on the node of its thread. That only holds while threads stay on
+ * their node, which the thread placement ensures: Close packs the threads onto neighbouring
+ * CPUs, Spread distributes them evenly over all CPUs the process may use (and so over the
+ * sockets). Threads are pinned once per thread count; OMP_PROC_BIND, when set, takes precedence.
+ *
+ * Waking the team and joining it costs several microseconds, more than a light per-pixel pass
+ * over a small image takes. Every kernel therefore asks kernelThreads() for its team size, from
+ * its pixel count and a cost class: each thread gets at least the pixels that outweigh its fork
+ * and join, small images run on fewer threads and the smallest on the calling thread alone (an
+ * OpenMP team of one runs inline). With the static schedule the chunk of each thread is then its
+ * share of the rows. parallelFor() wraps the same choice for loops written as a lambda.
+ *
+ * A chain of light kernels still pays a fork, a join and a cold barrier per kernel, and the
+ * rows a thread writes in one kernel are read by another thread in the next. runKernelTeam()
+ * opens one parallel region for a sequence of stages instead: inside it parallelFor() gives
+ * every thread its share of the static schedule (KernelTeam::share(), the same rows in every
+ * stage of the same height) and ends with a team barrier rather than a join, so each thread
+ * reads back the rows it has just written while they are in its cache. The helpers of helpers.h
+ * and the per-pixel Durand kernels loop through parallelFor(), so their overloads that write into
+ * caller-provided buffers can be called as the stages of a team; their results are the same.
+ * Kernels with a parallel region of their own must not be called in a team (the nested region
+ * runs on one thread per team member, each doing all the work), nor anything that throws.
+ *
+ * Sums are the exception: floating-point addition is not associative, and an OpenMP
+ * "reduction(+)" adds one partial per thread in whatever order the threads finish, so norms,
+ * dot products and means (and the iterations they steer) would change with the thread count.
+ * reproducibleSum() splits the range into chunks of a fixed size instead, sums each chunk in
+ * order and adds the chunk sums by a fixed pairwise tree: the result depends on the data and the
+ * chunk size only, and the whole pipeline is bitwise identical for any thread count and
+ * placement. Min / max and integer reductions are exact and stay OpenMP reductions.
+ *
+ * Work made of independent items (the planes of an XYZ image, the stages of a TaskGraph wave)
+ * can run its items at once, each with a share of the threads for its kernels. An
+ * ExecutionContext states that split explicitly, items x kernel threads, and runConcurrently()
+ * applies it in one nested OpenMP region: the outer team runs the items, and every item sets
+ * its kernel thread count before its kernels open their (inner) regions. Without the split an
+ * item either oversubscribes the machine (every item takes all threads) or runs its kernels on
+ * one thread (nesting disabled). The default context runs the items one after the other, each
+ * with all threads.
+ */
+
+#pragma region Execution policy
+
+/// <summary>
+/// Number of threads the kernels use when no count was set.
+/// </summary>
+inline int defaultThreadCount()
+{
+#ifdef _OPENMP
+    static const int default_count = omp_get_max_threads();
+    return default_count;
+#else
+    return 1;
+#endif
+}
+
+/// <summary>
+/// Pinning of the kernel threads to CPUs, see above.
+/// </summary>
+enum class ThreadPlacement {
+    // Left to the OS (or to OMP_PROC_BIND).
+    Default,
+    Close,
+    Spread,
+};
+
+inline ThreadPlacement& currentThreadPlacement()
+{
+    static ThreadPlacement placement = ThreadPlacement::Default;
+    return placement;
+}
+
+/// <summary>
+/// Pins the threads of the next parallel regions according to the current placement.
+/// </summary>
+inline void applyThreadPlacement()
+{
+#if defined(_OPENMP) && defined(__linux__)
+    const ThreadPlacement placement = currentThreadPlacement();
+    // Inner teams of nested regions keep the placement of their outer thread.
+    if (placement == ThreadPlacement::Default || std::getenv("OMP_PROC_BIND") != nullptr || omp_get_level() > 0) {
+        return;
+    }
+    // CPUs the process was started on, before any thread was pinned.
+    static const std::vector<int> cpus = [] {
+        std::vector<int> allowed;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) {
+                    allowed.push_back(cpu);
+                }
+            }
+        }
+        return allowed;
+    }();
+    if (cpus.empty()) {
+        return;
+    }
+    const int num_cpus = int(cpus.size());
+#pragma omp parallel
+    {
+        const int t = omp_get_thread_num();
+        const int team = omp_get_num_threads();
+        const int slot = placement == ThreadPlacement::Spread && team < num_cpus ? int(int64_t(t) * num_cpus / team) : t % num_cpus;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[size_t(slot)], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+}
+
+/// <summary>
+/// Sets the thread placement of all following parallel regions and pins the threads.
+/// </summary>
+inline void setThreadPlacement(const ThreadPlacement placement)
+{
+    currentThreadPlacement() = placement;
+    applyThreadPlacement();
+}
+
+/// <summary>
+/// Sets the number of threads used by all following parallel regions of the calling thread.
+/// </summary>
+/// <param name="num_threads">thread count, values <= 0 restore the default</param>
+inline void setThreadCount(const int num_threads)
+{
+#ifdef _OPENMP
+    const int default_count = defaultThreadCount();
+    omp_set_num_threads(num_threads > 0 ? num_threads : default_count);
+    // New threads of a larger team are not pinned yet.
+    applyThreadPlacement();
+#else
+    (void)num_threads;
+#endif
+}
+
+/// <summary>
+/// Number of threads the next parallel region will use.
+/// </summary>
+inline int getThreadCount()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+/// <summary>
+/// Output size from which kernels stream their rows by default (see streaming_store.h): half the
+/// last-level cache, at least 4 MiB.
+/// </summary>
+inline int64_t defaultStreamingStoreBytes()
+{
+    int64_t cache_bytes = int64_t(32) << 20;
+#if defined(__linux__) && defined(_SC_LEVEL3_CACHE_SIZE)
+    if (const long level3 = sysconf(_SC_LEVEL3_CACHE_SIZE); level3 > 0) {
+        cache_bytes = int64_t(level3);
+    }
+#endif
+    return std::max(cache_bytes / 2, int64_t(4) << 20);
+}
+
+/// <summary>
+/// Machine-dependent blocking factors of the kernels, measured by the autotuner (see autotune.h).
+/// None changes a result, only how the loops are blocked and how their outputs are stored.
+/// </summary>
+struct KernelTuning {
+    // Edge length of the output tiles of the tiled, range LUT and SIMD bilateral filters.
+    int bilateral_tile = 64;
+    // Iterations fused into one pass over the image by solvePoissonJacobiBlocked().
+    int jacobi_block_iters = 8;
+    // Outputs of at least this many bytes are written with non-temporal stores, 0 for never.
+    int64_t streaming_store_bytes = defaultStreamingStoreBytes();
+};
+
+inline KernelTuning& currentKernelTuning()
+{
+    static KernelTuning tuning;
+    return tuning;
+}
+
+/// <summary>
+/// Cost class of the per-pixel work of a kernel, see kernelThreads().
+/// </summary>
+enum class KernelCost {
+    // A few arithmetic operations, bandwidth bound (copies, sums, color matrices).
+    Light,
+    // Transcendental functions (exp, log, pow) or a handful of neighbours.
+    Medium,
+    // Windows and stencils with tens of taps per pixel.
+    Heavy,
+};
+
+/// <summary>
+/// Smallest number of pixels worth a thread of its own, about 20 microseconds of work.
+/// </summary>
+constexpr int64_t minPixelsPerThread(const KernelCost cost)
+{
+    switch (cost) {
+    case KernelCost::Light:
+        return 32768;
+    case KernelCost::Medium:
+        return 8192;
+    default:
+        return 1024;
+    }
+}
+
+/// <summary>
+/// Team size of a kernel over the given number of pixels, between 1 and getThreadCount().
+/// </summary>
+inline int kernelThreads(const int64_t pixels, const KernelCost cost = KernelCost::Light)
+{
+    const int64_t useful = pixels / minPixelsPerThread(cost);
+    return int(std::clamp<int64_t>(useful, 1, getThreadCount()));
+}
+
+/// <summary>
+/// Team size of a kernel over every pixel of an image or view.
+/// </summary>
+template <typename ImageLike>
+    requires requires(const ImageLike& image) { image.width; image.height; }
+inline int kernelThreads(const ImageLike& image, const KernelCost cost = KernelCost::Light)
+{
+    return kernelThreads(int64_t(image.width) * int64_t(image.height), cost);
+}
+
+/// <summary>
+/// The thread of a parallel region spanning several kernels, see runKernelTeam().
+/// </summary>
+class KernelTeam {
+public:
+    KernelTeam(const int rank, const int size)
+        : m_rank(rank)
+        , m_size(size)
+    {
+    }
+
+    int rank() const { return m_rank; }
+    int size() const { return m_size; }
+
+    /// <summary>
+    /// Share of this thread of [begin, end) under the static schedule: contiguous, the first
+    /// (end - begin) % size threads one index more, so every stage over the same range gives a
+    /// thread the same indices.
+    /// </summary>
+    std::pair<int, int> share(const int begin, const int end) const
+    {
+        const int count = std::max(end - begin, 0);
+        const int base = count / m_size, extra = count % m_size;
+        const int first = begin + m_rank * base + std::min(m_rank, extra);
+        return { first, first + base + (m_rank < extra ? 1 : 0) };
+    }
+
+    /// <summary>
+    /// Waits for all threads of the team (spinning briefly before sleeping, as OpenMP barriers do).
+    /// </summary>
+    void barrier() const
+    {
+#pragma omp barrier
+    }
+
+    /// <summary>
+    /// Team of the calling thread, nullptr outside runKernelTeam().
+    /// </summary>
+    static const KernelTeam*& current()
+    {
+        thread_local const KernelTeam* team = nullptr;
+        return team;
+    }
+
+private:
+    int m_rank;
+    int m_size;
+};
+
+/// <summary>
+/// Runs body(team) on every thread of one parallel region of the given size; the parallelFor()
+/// loops of the stages it calls share their indices between the threads of the team, see above.
+/// Within a team the body runs as it is.
+/// </summary>
+/// <param name="threads">team size, e.g. kernelThreads() of the largest stage</param>
+/// <param name="body">called as body(const KernelTeam&) by every thread</param>
+template <typename Body>
+void runKernelTeam(const int threads, const Body& body)
+{
+    if (const KernelTeam* team = KernelTeam::current()) {
+        body(*team);
+        return;
+    }
+#pragma omp parallel num_threads(std::max(threads, 1))
+    {
+#ifdef _OPENMP
+        const KernelTeam team(omp_get_thread_num(), omp_get_num_threads());
+#else
+        const KernelTeam team(0, 1);
+#endif
+        KernelTeam::current() = &team;
+        body(team);
+        KernelTeam::current() = nullptr;
+    }
+}
+
+/// <summary>
+/// Runs fn(i) for i in [begin, end) with the static schedule on kernelThreads() threads, or on
+/// the threads of the calling team followed by its barrier (see runKernelTeam()).
+/// </summary>
+/// <param name="begin">first index</param>
+/// <param name="end">end of the indices</param>
+/// <param name="pixels_per_index">pixels processed by one index (e.g. the width for rows)</param>
+/// <param name="cost">cost class of one pixel</param>
+/// <param name="fn">called as fn(i)</param>
+template <typename Fn>
+void parallelFor(const int begin, const int end, const int64_t pixels_per_index, const KernelCost cost, const Fn& fn)
+{
+    if (const KernelTeam* team = KernelTeam::current()) {
+        const auto [first, last] = team->share(begin, end);
+        for (int i = first; i < last; i++) {
+            fn(i);
+        }
+        team->barrier();
+        return;
+    }
+#pragma omp parallel for schedule(static) num_threads(kernelThreads(int64_t(std::max(end - begin, 0)) * pixels_per_index, cost))
+    for (int i = begin; i < end; i++) {
+        fn(i);
+    }
+}
+
+/// <summary>
+/// Elements per partial sum of flat reductions over whole images (64 KB of floats).
+/// </summary>
+constexpr int64_t REDUCTION_CHUNK = 16384;
+
+/// <summary>
+/// Adds values[0..n) in place by a fixed pairwise tree (stride 1, 2, 4, ...) and returns the total.
+/// The order of the additions only depends on n.
+/// </summary>
+template <typename T>
+T pairwiseSum(std::vector<T>& values)
+{
+    const size_t n = values.size();
+    if (n == 0) {
+        return T {};
+    }
+    for (size_t stride = 1; stride < n; stride *= 2) {
+        for (size_t i = 0; i + stride < n; i += 2 * stride) {
+            values[i] += values[i + stride];
+        }
+    }
+    return values[0];
+}
+
+/// <summary>
+/// Sum of partial(begin, end) over the chunks [0, chunk), [chunk, 2 chunk), ... of [0, count),
+/// computed in parallel and added by pairwiseSum(), see above. Bitwise identical for any thread
+/// count. T is a scalar or a vector type with += (e.g. glm::dvec2 for two sums in one pass).
+/// </summary>
+/// <param name="count">number of indices</param>
+/// <param name="chunk">indices per partial sum, part of the result's definition</param>
+/// <param name="threads">team size, e.g. from kernelThreads()</param>
+/// <param name="partial">called as partial(begin, end), returns the sum of the chunk</param>
+template <typename T, typename Partial>
+T reproducibleSum(const int64_t count, const int64_t chunk, const int threads, const Partial& partial)
+{
+    const int64_t num_chunks = count > 0 ? (count + chunk - 1) / chunk : 0;
+    std::vector<T> sums(static_cast<size_t>(num_chunks));
+#pragma omp parallel for schedule(static) num_threads(threads)
+    for (int64_t c = 0; c < num_chunks; c++) {
+        sums[size_t(c)] = partial(c * chunk, std::min(count, (c + 1) * chunk));
+    }
+    return pairwiseSum(sums);
+}
+
+/// <summary>
+/// Split of the threads between independent items and their kernels, see above.
+/// </summary>
+struct ExecutionContext {
+    // Items processed at once, values <= 1 process them one after the other.
+    int concurrent_items = 1;
+    // Kernel threads of each item, values <= 0 split getThreadCount() evenly between the items.
+    int kernel_threads = 0;
+
+    // Items one after the other, each with all threads.
+    static ExecutionContext sequential() { return {}; }
+    // Up to num_items items at once, sharing the threads.
+    static ExecutionContext concurrent(const int num_items) { return { num_items, 0 }; }
+};
+
+/// <summary>
+/// Runs fn(i) for i in [0, count) with the split of the context, see above. Images created by
+/// the items draw from the caller's image memory resource, and their kernels check and report to
+/// the caller's job (see job_control.h). The first exception thrown by an item is rethrown after
+/// all items have finished.
+/// </summary>
+/// <param name="count">number of items</param>
+/// <param name="context">split of the threads</param>
+/// <param name="fn">called as fn(i)</param>
+template <typename Fn>
+void runConcurrently(const int count, const ExecutionContext& context, const Fn& fn)
+{
+    const int total_threads = getThreadCount();
+    const int workers = std::min({ count, context.concurrent_items, total_threads });
+    if (workers <= 1) {
+        for (int i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    const int threads_per_item = context.kernel_threads > 0 ? context.kernel_threads : std::max(total_threads / workers, 1);
+    std::pmr::memory_resource* const resource = currentImageMemoryResource();
+    JobControl* const job = currentJobControl();
+    std::exception_ptr failure;
+#ifdef _OPENMP
+    const int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(std::max(max_levels, omp_get_level() + 2));
+#endif
+#pragma omp parallel for num_threads(workers) schedule(dynamic, 1)
+    for (int i = 0; i < count; i++) {
+        ImageMemoryScope memory_scope(resource);
+        JobControlScope job_scope(job);
+        setThreadCount(threads_per_item);
+        try {
+            fn(i);
+        } catch (...) {
+#pragma omp critical(run_concurrently_failure)
+            if (!failure) {
+                failure = std::current_exception();
+            }
+        }
+    }
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_levels);
+#endif
+    if (failure) {
+        std::rethrow_exception(failure);
+    }
+}
+
+#pragma endregion Execution policy
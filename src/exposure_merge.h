@@ -0,0 +1,313 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef HDR_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "your_code_here.h"
+
+/*
+ * HDR radiance map from bracketed LDR exposures (Debevec and Malik 1997).
+ *
+ * Every 8-bit value z of a bracket with exposure time t votes for the radiance g(z) / t, where g
+ * is the inverse camera response (the sRGB curve, or a power curve), weighted by the triangle
+ * w(z) = min(z + 1, 256 - z), which never vanishes, so a value clipped in every bracket still
+ * gets a radiance. The merge is the weighted average per channel,
+ *
+ *     E = sum_i w(z_i) g(z_i) / t_i / sum_i w(z_i),
+ *
+ * with w(z) g(z) / t_i tabulated per bracket.
+ *
+ * mergeExposureBrackets() never holds the N decoded brackets at once. With libjpeg
+ * (-DA1_HDR_LIBJPEG=ON) and JPEG brackets it keeps one decoder per bracket and merges the
+ * brackets band by band: the N decoders produce their next band_rows scanlines in parallel and
+ * the band is merged into the radiance map in parallel, so the brackets take
+ * N * band_rows * width * 3 bytes. Otherwise the brackets are decoded one after the other
+ * (stb_image) and accumulated into the radiance map and a map of the weight sums, which takes one
+ * decoded bracket and 12 bytes per pixel at the peak. Both sum the brackets in the same order;
+ * they differ only where libjpeg and stb_image decode a JPEG differently.
+ */
+
+#pragma region Exposure merge
+
+/// <summary>
+/// One LDR exposure of a bracket set.
+/// </summary>
+struct ExposureBracket {
+    std::filesystem::path path;
+    // Exposure time in seconds (any unit shared by all brackets).
+    float exposure_seconds = 1.0f;
+};
+
+/// <summary>
+/// Camera response and streaming of mergeExposureBrackets().
+/// </summary>
+struct ExposureMergeOptions {
+    // Inverse camera response: z^response_gamma, the sRGB curve when 0.
+    float response_gamma = 0.0f;
+    // Scanlines per bracket decoded at once when streaming.
+    int band_rows = 64;
+};
+
+/// <summary>
+/// Bracket of a "path,seconds" setting, seconds also as a fraction like "1/30".
+/// Throws std::exception (after printing the reason) on a malformed setting.
+/// </summary>
+ExposureBracket parseExposureBracket(const std::string& text)
+{
+    const auto comma = text.rfind(',');
+    ExposureBracket bracket;
+    try {
+        if (comma == std::string::npos) {
+            throw std::invalid_argument(text);
+        }
+        bracket.path = text.substr(0, comma);
+        const auto seconds = text.substr(comma + 1);
+        const auto slash = seconds.find('/');
+        bracket.exposure_seconds = slash == std::string::npos ? std::stof(seconds) : std::stof(seconds.substr(0, slash)) / std::stof(seconds.substr(slash + 1));
+    } catch (const std::logic_error&) {
+        bracket.exposure_seconds = 0.0f;
+    }
+    if (!(bracket.exposure_seconds > 0.0f) || !std::isfinite(bracket.exposure_seconds)) {
+        std::cerr << "Invalid bracket " << text << " (expected path,seconds)" << std::endl;
+        throw std::exception();
+    }
+    return bracket;
+}
+
+/// <summary>
+/// Weight w(z) and weighted radiance w(z) g(z) / t of every 8-bit value, per bracket.
+/// </summary>
+struct ExposureMergeTables {
+    std::array<float, 256> weight;
+    std::vector<std::array<float, 256>> radiance;
+
+    ExposureMergeTables(const std::vector<ExposureBracket>& brackets, const ExposureMergeOptions& options)
+        : radiance(brackets.size())
+    {
+        std::array<float, 256> response;
+        for (int z = 0; z < 256; z++) {
+            const float value = float(z) / 255.0f;
+            if (options.response_gamma > 0.0f) {
+                response[z] = std::pow(value, options.response_gamma);
+            } else {
+                response[z] = value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+            }
+            weight[z] = float(std::min(z + 1, 256 - z));
+        }
+        for (size_t i = 0; i < brackets.size(); i++) {
+            for (int z = 0; z < 256; z++) {
+                radiance[i][z] = weight[z] * response[z] / brackets[i].exposure_seconds;
+            }
+        }
+    }
+};
+
+#ifdef HDR_LIBJPEG
+/// <summary>
+/// Sequential scanline decoder of a JPEG file (libjpeg), RGB or grayscale expanded to RGB.
+/// </summary>
+class JpegRowReader {
+public:
+    explicit JpegRowReader(const std::filesystem::path& filePath)
+        : m_file(std::fopen(filePath.string().c_str(), "rb"))
+    {
+        m_info.err = jpeg_std_error(&m_error.manager);
+        m_error.manager.error_exit = [](j_common_ptr info) { std::longjmp(reinterpret_cast<ErrorManager*>(info->err)->jump, 1); };
+        jpeg_create_decompress(&m_info);
+        if (!m_file || !start()) {
+            std::cerr << "Failed to open JPEG " << filePath << std::endl;
+            jpeg_destroy_decompress(&m_info);
+            if (m_file) {
+                std::fclose(m_file);
+            }
+            throw std::exception();
+        }
+    }
+    JpegRowReader(const JpegRowReader&) = delete;
+    JpegRowReader& operator=(const JpegRowReader&) = delete;
+    ~JpegRowReader()
+    {
+        jpeg_destroy_decompress(&m_info);
+        std::fclose(m_file);
+    }
+
+    int width() const { return int(m_info.output_width); }
+    int height() const { return int(m_info.output_height); }
+
+    /// <summary>
+    /// Decodes the next scanline into width * 3 bytes.
+    /// </summary>
+    /// <returns>false on a decoding error</returns>
+    bool readScanline(uint8_t* rgb)
+    {
+        if (setjmp(m_error.jump)) {
+            return false;
+        }
+        JSAMPROW row = m_info.output_components == 3 ? rgb : rgb + 2 * size_t(width());
+        if (jpeg_read_scanlines(&m_info, &row, 1) != 1) {
+            return false;
+        }
+        if (m_info.output_components == 1) {
+            // Expanded in place front to back: the gray row in the last third is read before it is overwritten.
+            for (int x = 0; x < width(); x++) {
+                rgb[3 * x] = rgb[3 * x + 1] = rgb[3 * x + 2] = row[x];
+            }
+        }
+        return true;
+    }
+
+private:
+    struct ErrorManager {
+        jpeg_error_mgr manager;
+        std::jmp_buf jump;
+    };
+
+    bool start()
+    {
+        if (setjmp(m_error.jump)) {
+            return false;
+        }
+        jpeg_stdio_src(&m_info, m_file);
+        jpeg_read_header(&m_info, TRUE);
+        if (m_info.jpeg_color_space != JCS_GRAYSCALE && m_info.jpeg_color_space != JCS_RGB && m_info.jpeg_color_space != JCS_YCbCr) {
+            return false;
+        }
+        m_info.out_color_space = m_info.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_start_decompress(&m_info);
+        return true;
+    }
+
+    std::FILE* m_file;
+    jpeg_decompress_struct m_info {};
+    ErrorManager m_error {};
+};
+#endif
+
+/// <summary>
+/// Whether mergeExposureBrackets() streams these brackets band by band, see above.
+/// </summary>
+inline bool canStreamExposureBrackets(const std::vector<ExposureBracket>& brackets)
+{
+#ifdef HDR_LIBJPEG
+    return std::all_of(brackets.begin(), brackets.end(), [](const ExposureBracket& bracket) {
+        auto extension = bracket.path.extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](const unsigned char c) { return char(std::tolower(c)); });
+        return extension == ".jpg" || extension == ".jpeg";
+    });
+#else
+    (void)brackets;
+    return false;
+#endif
+}
+
+/// <summary>
+/// Radiance map of a set of LDR exposures of the same size, see above.
+/// Throws std::exception (after printing the reason) when a bracket cannot be read or the sizes differ.
+/// </summary>
+/// <param name="brackets">exposures, in any order</param>
+/// <param name="options">camera response and band height</param>
+/// <returns>linear HDR RGB radiance map</returns>
+ImageRGB mergeExposureBrackets(const std::vector<ExposureBracket>& brackets, const ExposureMergeOptions& options = {})
+{
+    if (brackets.empty()) {
+        std::cerr << "An exposure merge needs at least one bracket." << std::endl;
+        throw std::exception();
+    }
+    const ExposureMergeTables tables(brackets, options);
+    const auto check_size = [&](const size_t i, const int width, const int height, const int first_width, const int first_height) {
+        if (width != first_width || height != first_height) {
+            std::cerr << "Bracket " << brackets[i].path << " is " << width << "x" << height << ", not " << first_width << "x" << first_height << "." << std::endl;
+            throw std::exception();
+        }
+    };
+
+#ifdef HDR_LIBJPEG
+    if (canStreamExposureBrackets(brackets)) {
+        std::vector<std::unique_ptr<JpegRowReader>> readers;
+        for (size_t i = 0; i < brackets.size(); i++) {
+            readers.push_back(std::make_unique<JpegRowReader>(brackets[i].path));
+            check_size(i, readers[i]->width(), readers[i]->height(), readers[0]->width(), readers[0]->height());
+        }
+        const int width = readers[0]->width();
+        const int height = readers[0]->height();
+        const int band_rows = std::clamp(options.band_rows, 1, height);
+        const size_t row_values = size_t(width) * 3;
+        const int num_brackets = int(brackets.size());
+        std::vector<std::vector<uint8_t>> bands(brackets.size(), std::vector<uint8_t>(size_t(band_rows) * row_values));
+        auto result = ImageRGB::uninitialized(width, height);
+        for (int band_begin = 0; band_begin < height; band_begin += band_rows) {
+            const int num_rows = std::min(band_rows, height - band_begin);
+            // Every decoder is sequential, the brackets decode side by side.
+            int failed = 0;
+#pragma omp parallel for num_threads(std::min(num_brackets, getThreadCount())) reduction(+ : failed)
+            for (int i = 0; i < num_brackets; i++) {
+                for (int y = 0; y < num_rows; y++) {
+                    failed += readers[i]->readScanline(bands[i].data() + size_t(y) * row_values) ? 0 : 1;
+                }
+            }
+            if (failed > 0) {
+                std::cerr << "Failed to decode a bracket in rows " << band_begin << " to " << band_begin + num_rows << "." << std::endl;
+                throw std::exception();
+            }
+#pragma omp parallel for num_threads(kernelThreads(int64_t(num_rows) * width * num_brackets, KernelCost::Light))
+            for (int y = 0; y < num_rows; y++) {
+                float* out = reinterpret_cast<float*>(result.data.data() + size_t(band_begin + y) * size_t(width));
+                for (size_t k = 0; k < row_values; k++) {
+                    float radiance = 0.0f;
+                    float weight = 0.0f;
+                    for (int i = 0; i < num_brackets; i++) {
+                        const uint8_t z = bands[i][size_t(y) * row_values + k];
+                        radiance += tables.radiance[i][z];
+                        weight += tables.weight[z];
+                    }
+                    out[k] = radiance / weight;
+                }
+            }
+        }
+        return result;
+    }
+#endif
+
+    // One decoded bracket at a time, accumulated in the same order.
+    const ImageInfo info = probeImage(brackets[0].path);
+    auto result = ImageRGB(info.width, info.height);
+    std::vector<float> weights(result.data.size() * 3, 0.0f);
+    float* const sums = reinterpret_cast<float*>(result.data.data());
+    const int64_t num_values = int64_t(weights.size());
+    for (size_t i = 0; i < brackets.size(); i++) {
+        int width = 0, height = 0, channels = 0;
+        const auto filePathStr = brackets[i].path.string();
+        const std::unique_ptr<stbi_uc, void (*)(void*)> pixels(stbi_load(filePathStr.c_str(), &width, &height, &channels, 3), stbi_image_free);
+        if (!pixels) {
+            std::cerr << "Failed to read bracket " << brackets[i].path << std::endl;
+            throw std::exception();
+        }
+        check_size(i, width, height, info.width, info.height);
+        const auto& radiance = tables.radiance[i];
+#pragma omp parallel for num_threads(kernelThreads(num_values, KernelCost::Light))
+        for (int64_t k = 0; k < num_values; k++) {
+            const uint8_t z = pixels.get()[k];
+            sums[k] += radiance[z];
+            weights[k] += tables.weight[z];
+        }
+    }
+#pragma omp parallel for num_threads(kernelThreads(num_values, KernelCost::Light))
+    for (int64_t k = 0; k < num_values; k++) {
+        sums[k] /= weights[k];
+    }
+    return result;
+}
+
+#pragma endregion Exposure merge
@@ -0,0 +1,33 @@
+// Row kernels of the fast_math.h tiers shared by all instruction sets.
+//
+// This file is compiled once per ISA by simd_instantiate.inl (see fast_math_simd.h), against the
+// wrappers of the SIMD layer (simd.h). The last partial vector of a row is loaded and stored with
+// masks, so rows of any length need no scalar tail.
+
+template <MathPrecision P>
+void logRow(const float* src, float* dst, const int count)
+{
+    const VecF smallest = set1(1e-8f);
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        storeu(dst + i, fastLog<P>(max(loadu(src + i), smallest)));
+    }
+    if (i < count) {
+        storePartial(dst + i, fastLog<P>(max(loadPartial(src + i, count - i), smallest)), count - i);
+    }
+}
+
+template <MathPrecision P>
+void clampedExpRow(const float* src, const float* offset, const float scale, float* dst, const int count)
+{
+    const VecF s = set1(scale);
+    const VecF one = set1(1.0f);
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        storeu(dst + i, min(max(fastExp<P>(fmadd(s, loadu(src + i), loadu(offset + i))), zero()), one));
+    }
+    if (i < count) {
+        const int rest = count - i;
+        storePartial(dst + i, min(max(fastExp<P>(fmadd(s, loadPartial(src + i, rest), loadPartial(offset + i, rest))), zero()), one), rest);
+    }
+}
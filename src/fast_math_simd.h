@@ -0,0 +1,65 @@
+#pragma once
+#include "fast_math.h"
+#include "simd.h"
+
+/*
+ * Row kernels of the approximations of fast_math.h for the vector width of the running CPU.
+ *
+ * The per-pixel loops calling tmoLog() and friends are vectorized by the compiler for the baseline
+ * instruction set only. The kernels of fast_math_kernel.inl are written once against the SIMD layer
+ * and compiled for every instruction set; the vector functions repeat the scalar operations, so the
+ * results equal those of the scalar loops up to the rounding of fused multiply-adds (an ulp).
+ */
+
+#pragma region Fast math rows
+
+#define HDR_SIMD_KERNEL "fast_math_kernel.inl"
+#define HDR_SIMD_KERNEL_NAMESPACE fast_math_rows
+#include "simd_instantiate.inl"
+
+/// <summary>
+/// Row kernel dst[i] = tmoLog<P>(max(src[i], 1e-8)) for an instruction set (Fast and Faster tiers).
+/// </summary>
+template <MathPrecision P>
+inline void (*logRowKernel(const SimdIsa isa))(const float*, float*, int)
+{
+    switch (isa) {
+#if defined(HDR_SIMD_X86)
+    case SimdIsa::Avx2:
+        return fast_math_rows_avx2::logRow<P>;
+    case SimdIsa::Avx512:
+        return fast_math_rows_avx512::logRow<P>;
+#endif
+#if defined(HDR_SIMD_NEON)
+    case SimdIsa::Neon:
+        return fast_math_rows_neon::logRow<P>;
+#endif
+    default:
+        return fast_math_rows_scalar::logRow<P>;
+    }
+}
+
+/// <summary>
+/// Row kernel dst[i] = clamp(tmoExp<P>(scale * src[i] + offset[i]), 0, 1) for an instruction set
+/// (Fast and Faster tiers).
+/// </summary>
+template <MathPrecision P>
+inline void (*clampedExpRowKernel(const SimdIsa isa))(const float*, const float*, float, float*, int)
+{
+    switch (isa) {
+#if defined(HDR_SIMD_X86)
+    case SimdIsa::Avx2:
+        return fast_math_rows_avx2::clampedExpRow<P>;
+    case SimdIsa::Avx512:
+        return fast_math_rows_avx512::clampedExpRow<P>;
+#endif
+#if defined(HDR_SIMD_NEON)
+    case SimdIsa::Neon:
+        return fast_math_rows_neon::clampedExpRow<P>;
+#endif
+    default:
+        return fast_math_rows_scalar::clampedExpRow<P>;
+    }
+}
+
+#pragma endregion Fast math rows
@@ -0,0 +1,107 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+
+#include "fast_math.h"
+#include "image_stats.h"
+#include "your_code_here.h"
+
+/*
+ * Consumers of the HDR input fused into its decode.
+ *
+ * Part I starts with full passes over the freshly loaded input: the statistics of the
+ * normalized snapshots, then the luminance and the log-luminance. On a frame of hundreds of
+ * megabytes every pass reads it back from memory. loadHdrFused() hands them to the row hook of
+ * the Image(filePath, on_row) loader instead, which runs them on every scanline right after it is
+ * decoded and still in cache (Radiance files on the decoding threads, float files band by band),
+ * so the three passes cost no extra read of the image.
+ *
+ * The planes equal rgbToLuminance(), logImage() and durandLogLuminance() of the loaded image bit
+ * for bit, and the statistics computeImageStats() (see ImageStatsAccumulator).
+ */
+
+#pragma region Fused decode
+
+/// <summary>
+/// What loadHdrFused() computes while decoding.
+/// </summary>
+struct DecodeConsumers {
+    // ImageStat flags, 0 for none.
+    uint32_t stats = 0;
+    int histogram_bins = 256;
+    // Luminance plane, as rgbToLuminance().
+    bool luminance = false;
+    // Log-luminance plane, as durandLogLuminance() at this precision.
+    bool log_luminance = false;
+    MathPrecision precision = MathPrecision::Exact;
+
+    bool any() const { return stats != 0 || luminance || log_luminance; }
+};
+
+/// <summary>
+/// Result of loadHdrFused(); the planes are set when requested, stats.computed are the requested
+/// statistics.
+/// </summary>
+struct DecodedHdr {
+    ImageRGB image;
+    ImageStats stats;
+    std::optional<ImageFloat> luminance;
+    std::optional<ImageFloat> log_luminance;
+};
+
+/// <summary>
+/// Loads an RGB image and runs the requested consumers on its rows while it is decoded, see above.
+/// </summary>
+/// <param name="path">image file, any format of the Image loader</param>
+/// <param name="consumers">statistics and planes to compute</param>
+/// <returns>the image with the statistics and planes</returns>
+inline DecodedHdr loadHdrFused(const std::filesystem::path& path, const DecodeConsumers& consumers)
+{
+    if (!consumers.any()) {
+        return { ImageRGB(path), {}, std::nullopt, std::nullopt };
+    }
+    // The size is known from the header, the outputs exist before the first row arrives.
+    const ImageInfo info = probeImage(path);
+    DecodedHdr result { ImageRGB(), {}, std::nullopt, std::nullopt };
+    if (consumers.luminance) {
+        result.luminance = ImageFloat::uninitialized(info.width, info.height);
+    }
+    if (consumers.log_luminance) {
+        result.log_luminance = ImageFloat::uninitialized(info.width, info.height);
+    }
+    ImageStatsRequest request;
+    request.stats = consumers.stats;
+    request.histogram_bins = consumers.histogram_bins;
+    ImageStatsAccumulator accumulator(info.width, info.height, request);
+
+    float* const luminance = consumers.luminance ? result.luminance->data.data() : nullptr;
+    float* const log_luminance = consumers.log_luminance ? result.log_luminance->data.data() : nullptr;
+    const int width = info.width;
+    dispatchMathPrecision(consumers.precision, [&](auto tier) {
+        result.image = ImageRGB(path, [&](const int y, const glm::vec3* row) {
+            if (consumers.stats != 0) {
+                accumulator.addRows<glm::vec3>(ImageView<const glm::vec3>(row, width, 1, width), y);
+            }
+            if (luminance || log_luminance) {
+                const size_t offset = size_t(y) * size_t(width);
+                for (int x = 0; x < width; x++) {
+                    const float lum = rgbToLuminancePixel(row[x]);
+                    if (luminance) {
+                        luminance[offset + size_t(x)] = lum;
+                    }
+                    if (log_luminance) {
+                        log_luminance[offset + size_t(x)] = tmoLog<decltype(tier)::value>(std::max(lum, 1e-8f));
+                    }
+                }
+            }
+        });
+    });
+    if (consumers.stats != 0) {
+        result.stats = accumulator.finish();
+    }
+    return result;
+}
+
+#pragma endregion Fused decode
@@ -0,0 +1,49 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+/*
+ * Global tone curves.
+ *
+ * A global operator maps every pixel through one curve of its luminance, so it needs no
+ * neighbourhood and runs as a streaming pass, for thumbnails and proxies where the local
+ * contrast of Durand's operator is not worth the filter. The curves take the luminance after
+ * the exposure key / log-average luminance (Reinhard et al. 2002), which comes from one parallel
+ * reduction over the image:
+ * - Reinhard: Lm (1 + Lm / white^2) / (1 + Lm), white is the smallest exposed luminance that
+ *   maps to 1 (the exposed maximum of the image when not set).
+ * - Filmic: Narkowicz's fit of the ACES reference rendering transform, with a toe and a
+ *   shoulder, saturating to 1.
+ */
+
+#pragma region Global tone curves
+
+/// <summary>
+/// Reduction of the luminance of an image.
+/// </summary>
+struct LuminanceStats {
+    // exp(mean(ln(delta + L))).
+    float log_average = 1.0f;
+    float max = 1.0f;
+};
+
+/// <summary>
+/// Extended Reinhard curve of an exposed luminance.
+/// </summary>
+/// <param name="exposed">luminance times key / log-average</param>
+/// <param name="white">exposed luminance mapped to 1</param>
+inline float reinhardCurve(const float exposed, const float white)
+{
+    return exposed * (1.0f + exposed / (white * white)) / (1.0f + exposed);
+}
+
+/// <summary>
+/// ACES filmic curve (Narkowicz 2015) of an exposed luminance, in [0,1].
+/// </summary>
+inline float acesFilmicCurve(const float exposed)
+{
+    const float x = std::max(exposed, 0.0f);
+    return std::clamp(x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f, 1.0f);
+}
+
+#pragma endregion Global tone curves
@@ -0,0 +1,637 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "bilateral_spacetime.h"
+#include "coro_stages.h"
+#include "gpu_compute.h"
+#include "image_quality.h"
+#include "kernel_benchmark.h"
+#include "ldr_native.h"
+#include "line_buffer.h"
+#include "padded_image.h"
+#include "padded_tone_map.h"
+#include "pixel_layout.h"
+#include "ring_buffer.h"
+#include "tiled_image_store.h"
+#include "tone_map_edit.h"
+#include "tone_map_sweep.h"
+#include "your_code_here.h"
+
+/*
+ * Correctness checks of the fast paths.
+ *
+ * "a1_hdr --validate" runs every fast path next to the reference implementation it replaces
+ * (the brute-force bilateral filter, exact math, the scalar color conversions, fp32 gradients,
+ * Jacobi, and the CPU for the GPU backend when it is built) on the validation inputs and on synthetic HDR images, and reports the maximum and mean
+ * absolute error, the PSNR and the SSIM (image_quality.h; the worst plane of XYZ images) of each
+ * stage. PSNR and SSIM use the value range of the reference as the peak, so they are comparable
+ * between stages of different units (log luminance, RGB, XYZ).
+ *
+ * The Poisson solvers are checked against the exact answer: the right-hand side is the
+ * divergence of the log luminance itself and the initial solution is that image plus noise, so
+ * a solver converges to the image and its error is the error of the solve.
+ *
+ * Every check has a minimum PSNR and a maximum absolute error; the run fails when a check falls
+ * outside. The tolerances are overridden by "prefix=min_psnr[:max_abs]" entries, the longest
+ * matching prefix applies (e.g. "bilateralFilter/grid=25,solvePoisson=40:0.05").
+ */
+
+#pragma region Golden-output checks
+
+/// <summary>
+/// Allowed deviation of a check.
+/// </summary>
+struct GoldenTolerance {
+    // Minimum PSNR in dB.
+    double min_psnr = 40.0;
+    // Maximum absolute error, infinity when unchecked.
+    double max_abs = std::numeric_limits<double>::infinity();
+};
+
+/// <summary>
+/// Settings of a validation run, see above.
+/// </summary>
+struct GoldenCheckOptions {
+    // HDR input files.
+    std::vector<std::filesystem::path> inputs;
+    // Side lengths of the synthetic inputs.
+    std::vector<int> synthetic_sizes { 256 };
+    // Iterations of the iterative Poisson solvers.
+    int poisson_iters = 2000;
+    // Overrides of the default tolerances by check name prefix.
+    std::vector<std::pair<std::string, GoldenTolerance>> tolerances;
+};
+
+/// <summary>
+/// Deviation of a result from its reference.
+/// </summary>
+struct ImageDeviation {
+    double max_abs = 0.0;
+    double mean_abs = 0.0;
+    // Infinity when the images are identical.
+    double psnr = std::numeric_limits<double>::infinity();
+    // The smallest over the planes of multi-plane results, NaN when not measured.
+    double ssim = std::numeric_limits<double>::quiet_NaN();
+};
+
+/// <summary>
+/// Max / mean absolute error and PSNR of test against reference, over all channels.
+/// </summary>
+ImageDeviation measureDeviation(const std::span<const float> reference, const std::span<const float> test)
+{
+    if (reference.size() != test.size()) {
+        std::cerr << "Validation result has " << test.size() << " values, the reference " << reference.size() << "." << std::endl;
+        throw std::exception();
+    }
+    const auto count = int64_t(reference.size());
+    double max_abs = 0.0, sum_abs = 0.0, sum_squares = 0.0;
+    float min_value = std::numeric_limits<float>::max(), max_value = std::numeric_limits<float>::lowest();
+#pragma omp parallel for reduction(max : max_abs, max_value) reduction(min : min_value) reduction(+ : sum_abs, sum_squares)
+    for (int64_t i = 0; i < count; i++) {
+        const double error = std::abs(double(test[i]) - double(reference[i]));
+        max_abs = std::max(max_abs, error);
+        sum_abs += error;
+        sum_squares += error * error;
+        min_value = std::min(min_value, reference[i]);
+        max_value = std::max(max_value, reference[i]);
+    }
+
+    ImageDeviation deviation;
+    deviation.max_abs = max_abs;
+    deviation.mean_abs = count ? sum_abs / double(count) : 0.0;
+    const double mse = count ? sum_squares / double(count) : 0.0;
+    const double peak = std::max(double(max_value) - double(min_value), 1e-12);
+    if (mse > 0.0) {
+        deviation.psnr = 10.0 * std::log10(peak * peak / mse);
+    }
+    return deviation;
+}
+
+/// <summary> Values of a float image. </summary>
+inline std::span<const float> imageValues(const ImageFloat& image)
+{
+    return { image.data.data(), image.data.size() };
+}
+
+/// <summary> Channel values of an RGB image. </summary>
+inline std::span<const float> imageValues(const ImageRGB& image)
+{
+    return { &image.data.data()->x, image.data.size() * 3 };
+}
+
+template <typename T>
+ImageDeviation measureDeviation(const T& reference, const T& test)
+{
+    auto deviation = measureDeviation(imageValues(reference), imageValues(test));
+    const auto values = imageValues(reference);
+    const auto [min_value, max_value] = std::minmax_element(values.begin(), values.end());
+    if (min_value != values.end()) {
+        deviation.ssim = ssim(reference.view(), test.view(), std::max(double(*max_value) - double(*min_value), 1e-12));
+    }
+    return deviation;
+}
+
+ImageDeviation measureDeviation(const ImageXYZ& reference, const ImageXYZ& test)
+{
+    // One flat buffer per image, so the PSNR peak is the range over all planes.
+    const auto flatten = [](const ImageXYZ& image) {
+        std::vector<float> values;
+        forEachPlane([&](const ImageFloat& plane) { values.insert(values.end(), plane.data.begin(), plane.data.end()); }, image);
+        return values;
+    };
+    const auto reference_values = flatten(reference);
+    const auto test_values = flatten(test);
+    auto deviation = measureDeviation(std::span<const float>(reference_values), std::span<const float>(test_values));
+    // The SSIM of the worst plane, with the same peak.
+    const auto [min_value, max_value] = std::minmax_element(reference_values.begin(), reference_values.end());
+    if (min_value != reference_values.end()) {
+        const double peak = std::max(double(*max_value) - double(*min_value), 1e-12);
+        deviation.ssim = std::numeric_limits<double>::infinity();
+        forEachPlane([&](const ImageFloat& reference_plane, const ImageFloat& test_plane) { deviation.ssim = std::min(deviation.ssim, ssim(reference_plane.view(), test_plane.view(), peak)); },
+            reference, test);
+    }
+    return deviation;
+}
+
+/// <summary>
+/// One check: a fast path, its reference and the default tolerance.
+/// </summary>
+struct GoldenCheck {
+    std::string name;
+    std::string reference;
+    GoldenTolerance tolerance;
+    std::function<ImageDeviation()> measure;
+};
+
+/// <summary>
+/// Poisson edit of the checks: the mirrored image pasted as a disk into the middle of the image.
+/// </summary>
+struct GoldenEdit {
+    ImageRGB source;
+    BinaryMask mask;
+    int offset_x, offset_y;
+};
+
+GoldenEdit makeGoldenEdit(const ImageRGB& hdr)
+{
+    const int sw = std::max(hdr.width / 2, 1), sh = std::max(hdr.height / 2, 1);
+    GoldenEdit edit { ImageRGB(sw, sh), BinaryMask(sw, sh), hdr.width / 4, hdr.height / 4 };
+    for (int y = 0; y < sh; y++) {
+        for (int x = 0; x < sw; x++) {
+            edit.source.data[size_t(y) * sw + x] = hdr.data[size_t(y + edit.offset_y) * hdr.width + (hdr.width - 1 - x - edit.offset_x)];
+            const float dx = float(x) - 0.5f * float(sw), dy = float(y) - 0.5f * float(sh);
+            edit.mask.set(x, y, 4.0f * (dx * dx + dy * dy) < 0.8f * float(sw * sw));
+        }
+    }
+    return edit;
+}
+
+/// <summary>
+/// Checks of all fast paths on one HDR image.
+/// </summary>
+/// <param name="hdr">linear HDR input</param>
+/// <param name="params">Durand parameters of the filter and tone mapping checks</param>
+/// <param name="poisson_iters">iterations of the iterative Poisson solvers</param>
+std::vector<GoldenCheck> makeGoldenChecks(const ImageRGB& hdr, const DurandParams& params, const int poisson_iters)
+{
+    // Reference intermediates by value, shared by the checks.
+    const auto luminance = std::make_shared<const ImageFloat>(rgbToLuminance(hdr));
+    const auto log_lum = std::make_shared<const ImageFloat>(logImage(*luminance));
+    const auto base = std::make_shared<const ImageFloat>(bilateralFilter(*log_lum, params.filter_size, params.space_sigma, params.range_sigma));
+    const auto detail = std::make_shared<const ImageFloat>(getDetailImage(*log_lum, *base));
+    const auto lum_out = std::make_shared<const ImageFloat>(applyDurandToneMappingOperator(*base, *detail, params.base_scale, params.output_gain));
+    const auto xyz = std::make_shared<const ImageXYZ>(rgbToXYZ(hdr));
+
+    std::vector<GoldenCheck> checks;
+    for (const auto [name, precision] : { std::pair { "fast", MathPrecision::Fast }, std::pair { "faster", MathPrecision::Faster } }) {
+        const auto suffix = std::string("/") + name;
+        checks.push_back({ "logImage" + suffix, "helpers", { 80.0, 1e-4 }, [=] { return measureDeviation(*log_lum, logImage(*luminance, precision)); } });
+        checks.push_back({ "logImage" + suffix + "_scalar", "simd", { 140.0, 2e-6 }, [=] {
+            // The vector functions of the SIMD layer repeat the scalar ones operation by operation,
+            // up to the multiply-adds the compiler fuses for FMA targets.
+            auto scalar = ImageFloat::uninitialized(luminance->width, luminance->height);
+            dispatchMathPrecision(precision, [&](auto tier) {
+                for (size_t i = 0; i < scalar.data.size(); i++) {
+                    scalar.data[i] = tmoLog<decltype(tier)::value>(std::max(luminance->data[i], 1e-8f));
+                }
+            });
+            return measureDeviation(logImage(*luminance, precision), scalar);
+        } });
+        checks.push_back({ "applyDurandToneMappingOperator" + suffix, "exact", { 70.0, 1e-3 },
+            [=] { return measureDeviation(*lum_out, applyDurandToneMappingOperator(*base, *detail, params.base_scale, params.output_gain, precision)); } });
+        checks.push_back({ "rescaleRgbByLuminance" + suffix, "exact", { 70.0 },
+            [=, &hdr] { return measureDeviation(rescaleRgbByLuminance(hdr, *luminance, *lum_out, params.saturation),
+                            rescaleRgbByLuminance(hdr, *luminance, *lum_out, params.saturation, precision)); } });
+        checks.push_back({ "applyGamma" + suffix, "exact", { 70.0, 1e-3 },
+            [=, &hdr] { return measureDeviation(applyGamma(hdr, 1.0f / 2.2f, true), applyGamma(hdr, 1.0f / 2.2f, true, std::nullopt, precision)); } });
+    }
+
+    const std::vector<std::tuple<const char*, BilateralEngine, GoldenTolerance>> engines {
+        { "grid", BilateralEngine::Grid, { 25.0 } },
+        { "tiled", BilateralEngine::Tiled, { 100.0, 1e-4 } },
+        { "rangelut", BilateralEngine::RangeLut, { 60.0, 1e-2 } },
+        { "simd", BilateralEngine::Simd, { 60.0, 1e-2 } },
+        { "upsampled", BilateralEngine::Upsampled, { 50.0 } },
+        { "recursive", BilateralEngine::Recursive, { 30.0 } },
+        { "permutohedral", BilateralEngine::Permutohedral, { 40.0 } },
+        { "adaptive", BilateralEngine::Adaptive, { 60.0, double(BILATERAL_FLAT_TOLERANCE * params.range_sigma) + 1e-4 } },
+    };
+    for (const auto& [name, engine, tolerance] : engines) {
+        checks.push_back({ std::string("bilateralFilter/") + name, "bruteforce", tolerance,
+            [=, engine = engine] { return measureDeviation(*base, bilateralFilter(*log_lum, params.filter_size, params.space_sigma, params.range_sigma, engine)); } });
+    }
+    checks.push_back({ "bilateralFilter/simd_scalar", "bruteforce", { 60.0, 1e-2 },
+        [=] { return measureDeviation(*base, bilateralFilterSimd(*log_lum, params.filter_size, params.space_sigma, params.range_sigma, SimdIsa::Scalar)); } });
+    checks.push_back({ "bilateralFilter/spacetime", "grid", { 40.0 }, [=] {
+        // A still video: the slices of the window are the same, so the base layer is that of one frame.
+        SpaceTimeBilateralGrid grid(params.space_sigma, params.range_sigma, 5, 1.0f);
+        ImageFloat filtered;
+        for (int frame = 0; frame < 4; frame++) {
+            filtered = grid.filter(*log_lum);
+        }
+        return measureDeviation(bilateralFilter(*log_lum, params.filter_size, params.space_sigma, params.range_sigma, BilateralEngine::Grid), filtered);
+    } });
+    checks.push_back({ "bilateralFilter/out_of_core", "bruteforce", { 200.0, 0.0 }, [=] {
+        // Small tiles and a budget of a few of them, so the tiles are evicted and loaded again.
+        const auto directory = std::filesystem::temp_directory_path() / "a1_hdr_validate";
+        TiledImageParams tiling;
+        tiling.tile_size = 16;
+        tiling.memory_budget = 6 * 16 * 16 * sizeof(float);
+        ImageFloat filtered;
+        {
+            TiledImage<float> input(directory / "out_of_core_input.f32", log_lum->width, log_lum->height, tiling);
+            TiledImage<float> output(directory / "out_of_core_output.f32", log_lum->width, log_lum->height, tiling);
+            input.write(0, 0, log_lum->view());
+            bilateralFilterOutOfCore(input, output, params.filter_size, params.space_sigma, params.range_sigma);
+            filtered = output.read(output.bounds());
+        }
+        std::filesystem::remove_all(directory);
+        return measureDeviation(*base, filtered);
+    } });
+    checks.push_back({ "toneMapDurand/line_buffer", "bruteforce_exact", { 200.0, 0.0 }, [=, &hdr] {
+                          // Blocks of 5 rows, so the rings wrap several times.
+                          ImageRGB result = ImageRGB::uninitialized(hdr.width, hdr.height);
+                          toneMapDurandLineBuffered(hdr.width, hdr.height, params,
+                              [&](const int y, glm::vec3* rgb) { std::copy_n(hdr.data.data() + size_t(y) * size_t(hdr.width), hdr.width, rgb); },
+                              [&](const int y, const glm::vec3* rgb) { std::copy_n(rgb, hdr.width, result.data.data() + size_t(y) * size_t(hdr.width)); }, 5);
+                          return measureDeviation(toneMapDurand(hdr, params), result);
+                      } });
+    checks.push_back({ "toneMapDurand/padded", "bruteforce_exact", { 140.0, 2e-6 }, [=, &hdr] {
+                          // The luminance in w is computed at the decode, the same way up to fused multiply-adds.
+                          return measureDeviation(toneMapDurand(hdr, params), unpadRgb(toneMapDurandPadded(padRgb(hdr), params)));
+                      } });
+    for (const auto [name, precision, tolerance] : { std::tuple { "", MathPrecision::Exact, GoldenTolerance { 100.0, 1e-5 } },
+             std::tuple { "/fast", MathPrecision::Fast, GoldenTolerance { 70.0, 1e-3 } } }) {
+        checks.push_back({ std::string("composeDurandSweep") + name, "exact", tolerance, [=, &hdr] {
+                              // The last of three variants composed in one pass, against its own durandCompose().
+                              const std::vector<ToneMapVariant> variants { { 0.1f, 0.4f, 0.3f }, { params.base_scale, params.output_gain, params.saturation },
+                                  { 0.25f, 0.7f, 0.8f } };
+                              auto variant_params = params;
+                              variant_params.base_scale = variants[2].base_scale;
+                              variant_params.output_gain = variants[2].output_gain;
+                              variant_params.saturation = variants[2].saturation;
+                              variant_params.math_precision = MathPrecision::Exact;
+                              return measureDeviation(durandCompose(hdr, *log_lum, *base, variant_params), composeDurandSweep(hdr, *base, *detail, variants, precision)[2]);
+                          } });
+    }
+    checks.push_back({ "rgbToXYZ/padded", "helpers", { 140.0, 2e-6 }, [=, &hdr] { return measureDeviation(*xyz, rgbToXYZPadded(padRgb(hdr))); } });
+    checks.push_back({ "bilateralFilter/tiled16_layout", "bruteforce", { 200.0, 0.0 }, [=] {
+                          const LayoutImage<float, PixelLayout::Tiled16> H(*log_lum);
+                          return measureDeviation(*base, bilateralFilterLayout(H, params.filter_size, params.space_sigma, params.range_sigma).toImage());
+                      } });
+    checks.push_back({ "bilateralFilter/morton_layout", "bruteforce", { 200.0, 0.0 }, [=] {
+                          const LayoutImage<float, PixelLayout::Morton> H(*log_lum);
+                          return measureDeviation(*base, bilateralFilterLayout(H, params.filter_size, params.space_sigma, params.range_sigma).toImage());
+                      } });
+    for (const char* target : { "default", "xeon", "graviton", "laptop" }) {
+        checks.push_back({ std::string("toneMapDurand/scheduled_") + target, "bruteforce_exact", { 200.0, 0.0 }, [=, &hdr] {
+                              // Small tiles, so the halos of the producer computed per tile overlap.
+                              auto schedule = presetSchedule(parseScheduleTarget(target), KernelKind::Stencil);
+                              schedule.tile_width = std::min(schedule.tile_width, 24);
+                              schedule.tile_height = std::min(schedule.tile_height, 20);
+                              return measureDeviation(toneMapDurand(hdr, params), toneMapDurandScheduled(hdr, params, schedule));
+                          } });
+    }
+    checks.push_back({ "toneMapDurand/simd_fast", "bruteforce_exact", { 40.0 }, [=, &hdr] {
+                          auto fast_params = params;
+                          fast_params.engine = BilateralEngine::Simd;
+                          fast_params.math_precision = MathPrecision::Fast;
+                          return measureDeviation(toneMapDurand(hdr, params), toneMapDurand(hdr, fast_params));
+                      } });
+    checks.push_back({ "toneMapDurand/local_edit", "bruteforce_exact", { 200.0, 0.0 }, [=, &hdr] {
+                          // A rectangle across tile borders, brightened after the first full update.
+                          ToneMapEditSession session(hdr, params, 16);
+                          const auto& result = session.adjustExposure({ hdr.width / 3, hdr.height / 3, hdr.width / 3 + 37, hdr.height / 3 + 29 }, 1.0f);
+                          return measureDeviation(toneMapDurand(session.image(), params), result);
+                      } });
+
+    checks.push_back({ "collapseLaplacianPyramid", "input", { 100.0, 1e-4 }, [=] {
+                          std::vector<ImageFloat> pyramid;
+                          buildLaplacianPyramid<float>(*log_lum, pyramidDepth(log_lum->width, log_lum->height, 8), pyramid);
+                          collapseLaplacianPyramid(pyramid);
+                          return measureDeviation(*log_lum, pyramid[0]);
+                      } });
+
+    checks.push_back({ "rgbToXYZ/simd", "helpers", { 100.0, 1e-3 }, [=, &hdr] { return measureDeviation(*xyz, rgbToXYZSimd(hdr)); } });
+    checks.push_back({ "xyzToRGB/simd", "helpers", { 100.0, 1e-3 }, [=] { return measureDeviation(xyzToRGB(*xyz), xyzToRGBSimd(*xyz)); } });
+
+    // Divergence of fp32 gradients against 16-bit gradient storage.
+    const auto divergence = std::make_shared<const ImageFloat>([&] {
+        auto gradients = getGradients(*log_lum);
+        return getDivergence(gradients);
+    }());
+    checks.push_back({ "getDivergence/interleaved", "float", { 200.0, 0.0 },
+        [=] { return measureDeviation(*divergence, getDivergence(getGradients<GradientLayout::Interleaved>(*log_lum))); } });
+    checks.push_back({ "getDivergence/padded", "float", { 200.0, 0.0 }, [=] {
+                          auto image = PaddedImage<float>::copyOf(*log_lum, 1, GhostFill::Zero);
+                          const auto padded = getDivergencePadded(getGradientsPadded(image));
+                          return measureDeviation(*divergence, ImageFloat(padded.view(0, 0, padded.width() + 1, padded.height() + 1)));
+                      } });
+    checks.push_back({ "getDivergence/half", "float", { 50.0 }, [=] { return measureDeviation(*divergence, getDivergence(getGradientsAs<half>(*log_lum))); } });
+    checks.push_back({ "getDivergence/bfloat16", "float", { 30.0 }, [=] { return measureDeviation(*divergence, getDivergence(getGradientsAs<bfloat16>(*log_lum))); } });
+
+    // Poisson: the exact solution is log_lum, the solve starts from it plus noise in the interior.
+    const auto initial = std::make_shared<const ImageFloat>([&] {
+        auto image = *log_lum;
+        for (int y = 1; y < image.height - 1; y++) {
+            for (int x = 1; x < image.width - 1; x++) {
+                const uint32_t hash = (uint32_t(x) * 0x9E3779B1u ^ uint32_t(y) * 0x85EBCA77u) * 0x2C1B3C6Du;
+                image.data[size_t(y) * image.width + x] += float(hash >> 8) / float(1 << 24) - 0.5f;
+            }
+        }
+        return image;
+    }());
+    PoissonControl quiet;
+    quiet.report_every = 0;
+    quiet.on_progress = {};
+    const auto jacobi = std::make_shared<const ImageFloat>(solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::Jacobi, 0.0f, quiet));
+    checks.push_back({ "solvePoisson/jacobi", "exact", { 30.0 }, [=] { return measureDeviation(*log_lum, *jacobi); } });
+    checks.push_back({ "solvePoisson/blocked_jacobi", "jacobi", { 200.0, 0.0 },
+        [=] { return measureDeviation(*jacobi, solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::BlockedJacobi, 0.0f, quiet)); } });
+    checks.push_back({ "solvePoisson/tiled8_layout", "jacobi", { 200.0, 0.0 }, [=] {
+                          using Tiled = LayoutImage<float, PixelLayout::Tiled8>;
+                          return measureDeviation(*jacobi, solvePoissonJacobiLayout(Tiled(*initial), Tiled(*divergence), poisson_iters).toImage());
+                      } });
+    checks.push_back({ "solvePoisson/morton_layout", "jacobi", { 200.0, 0.0 }, [=] {
+                          using Morton = LayoutImage<float, PixelLayout::Morton>;
+                          return measureDeviation(*jacobi, solvePoissonJacobiLayout(Morton(*initial), Morton(*divergence), poisson_iters).toImage());
+                      } });
+    checks.push_back({ "solvePoisson/sor", "exact", { 30.0 },
+        [=] { return measureDeviation(*log_lum, solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::RedBlackSor, 0.0f, quiet)); } });
+    checks.push_back({ "solvePoisson/jacobi_half", "jacobi", { 60.0 },
+        [=] { return measureDeviation(*jacobi, solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::MixedJacobi, 0.0f, quiet)); } });
+    checks.push_back({ "solvePoisson/sor_half", "exact", { 30.0 },
+        [=] { return measureDeviation(*log_lum, solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::MixedSor, 0.0f, quiet)); } });
+    checks.push_back({ "solvePoisson/sor_half_threads", "sor_half", { 200.0, 0.0 }, [=] {
+                          // The rows of a 16-bit red-black pass are split into bands by thread; the row window of
+                          // a band must not carry over from the previous pass, so any split gives the same result.
+                          const int threads = getThreadCount();
+                          setThreadCount(1);
+                          const auto serial = solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::MixedSor, 0.0f, quiet);
+                          setThreadCount(std::max(threads, 3));
+                          const auto banded = solvePoisson(*initial, *divergence, poisson_iters, PoissonMethod::MixedSor, 0.0f, quiet);
+                          setThreadCount(threads);
+                          return measureDeviation(serial, banded);
+                      } });
+    checks.push_back({ "solvePoisson/multigrid","exact", { 30.0 }, [=] { return measureDeviation(*log_lum, solvePoissonMultigrid(*initial, *divergence)); } });
+    // Even sides that are not 2^k + 1, where the last coarse node of a level lies on the last fine one.
+    for (const auto& [w, h] : { std::pair { 802, 602 }, std::pair { 66, 66 } }) {
+        checks.push_back({ "solvePoisson/multigrid_" + std::to_string(w) + "x" + std::to_string(h), "exact", { 60.0 }, [=, w = w, h = h] {
+                              const auto exact = resampleNodesBilinear(*log_lum, w, h);
+                              auto gradients = getGradients(exact);
+                              auto start = exact;
+                              for (int y = 1; y < h - 1; y++) {
+                                  for (int x = 1; x < w - 1; x++) {
+                                      const uint32_t hash = (uint32_t(x) * 0x9E3779B1u ^ uint32_t(y) * 0x85EBCA77u) * 0x2C1B3C6Du;
+                                      start.data[size_t(y) * w + x] += float(hash >> 8) / float(1 << 24) - 0.5f;
+                                  }
+                              }
+                              return measureDeviation(exact, solvePoissonMultigrid(start, getDivergence(gradients), 1e-5f));
+                          } });
+    }
+    checks.push_back({ "solvePoisson/cg", "exact", { 30.0 }, [=] { return measureDeviation(*log_lum, solvePoissonCG(*initial, *divergence)); } });
+    checks.push_back({ "solvePoisson/spectral", "exact", { 30.0 }, [=] { return measureDeviation(*log_lum, solvePoissonSpectral(*initial, *divergence)); } });
+    checks.push_back({ "solvePoisson/schwarz", "exact", { 30.0 }, [=] {
+        // Tiles small enough that even the small synthetic inputs are split.
+        SchwarzPoissonParams schwarz;
+        schwarz.tile_size = 48;
+        schwarz.overlap = 8;
+        schwarz.coarse_spacing = 8;
+        return measureDeviation(*log_lum, solvePoissonSchwarz(*initial, *divergence, schwarz));
+    } });
+
+    // Luminance-only solves of the whole edit, against the full solve of all channels.
+    const auto edit = std::make_shared<const GoldenEdit>(makeGoldenEdit(hdr));
+    const auto edit_target = std::make_shared<const ImageXYZ>(rgbToXYZ(hdr));
+    const auto edit_divergence = std::make_shared<const ImageXYZ>(getMergedDivergenceXYZ(rgbToXYZ(edit->source), *edit_target, edit->mask, edit->offset_x, edit->offset_y));
+    const auto edit_full = std::make_shared<const ImageXYZ>(solvePoissonXYZ(*edit_target, *edit_divergence, poisson_iters));
+    checks.push_back({ "solvePoissonLuminanceXYZ/coarse", "full", { 35.0 },
+        [=] { return measureDeviation(*edit_full, solvePoissonLuminanceXYZ(*edit_target, *edit_divergence, poisson_iters, PoissonMethod::Jacobi, PoissonChroma::Coarse)); } });
+    checks.push_back({ "solvePoissonLuminanceXYZ/transfer", "full", { 30.0 }, [=] {
+        const auto composite = pasteMaskedXYZ(rgbToXYZ(edit->source), *edit_target, edit->mask, edit->offset_x, edit->offset_y);
+        return measureDeviation(*edit_full, solvePoissonLuminanceXYZ(*edit_target, *edit_divergence, poisson_iters, PoissonMethod::Jacobi, PoissonChroma::Transfer, &composite));
+    } });
+
+    // The factorized masked solve: the target back from its own Laplacian with the masked pixels
+    // cleared, and the edit against the sweeps of the masked Jacobi solve.
+    checks.push_back({ "solvePoissonPreparedXYZ/manufactured", "target", { 100.0 }, [=] {
+        const auto laplacian = mapPlanes([](const ImageFloat& plane) { return getDivergence(getGradients(plane)); }, *edit_target);
+        ImageXYZ cleared(edit_target->X.clone(), edit_target->Y.clone(), edit_target->Z.clone());
+        for (const int offset : findPoissonActiveRegion(edit->mask, cleared.X.width, cleared.X.height, edit->offset_x, edit->offset_y).offsets) {
+            forEachPlane([offset](ImageFloat& plane) { plane.data[offset] = 0.0f; }, cleared);
+        }
+        return measureDeviation(*edit_target, solvePoissonPreparedXYZ(cleared, laplacian, edit->mask, edit->offset_x, edit->offset_y));
+    } });
+    checks.push_back({ "solvePoissonPreparedXYZ", "masked", { 30.0 }, [=] {
+        return measureDeviation(solvePoissonMaskedXYZ(*edit_target, *edit_divergence, edit->mask, poisson_iters, edit->offset_x, edit->offset_y),
+            solvePoissonPreparedXYZ(*edit_target, *edit_divergence, edit->mask, edit->offset_x, edit->offset_y));
+    } });
+
+    checks.push_back({ "copySourceGradients/interleaved", "planar", { 200.0, 0.0 }, [=] {
+                          // Both layouts of the luminance gradients of the edit, merged the same way.
+                          const auto source = rgbToLuminance(edit->source), target = rgbToLuminance(hdr);
+                          const auto planar = copySourceGradientsToTarget(getGradients(source), getGradients(target), edit->mask, edit->offset_x, edit->offset_y);
+                          const auto interleaved = copySourceGradientsToTarget(getGradients<GradientLayout::Interleaved>(source),
+                              getGradients<GradientLayout::Interleaved>(target), edit->mask, edit->offset_x, edit->offset_y);
+                          return measureDeviation(gradientsToRgb(planar), gradientsToRgb(interleaved));
+                      } });
+
+    // Native 8-bit edit: the same edit of the image scaled to [0, 1] and quantized, against the float path.
+    const auto ldr_target = std::make_shared<const LdrPlanes<uint8_t>>([&] {
+        float max_value = 1e-8f;
+        for (const auto& pixel : hdr.data) {
+            max_value = std::max({ max_value, pixel.x, pixel.y, pixel.z });
+        }
+        auto scaled = hdr.clone();
+        for (auto& pixel : scaled.data) {
+            pixel /= max_value;
+        }
+        return LdrPlanes<uint8_t>::quantize(scaled);
+    }());
+    checks.push_back({ "getDivergence/int16", "float", { 200.0, 0.0 }, [=] {
+                          auto gradients = getGradients(convertImage<float>(ldr_target->planes.Y.view()));
+                          return measureDeviation(getDivergence(gradients), getDivergence(getGradientsAs<int16_t>(ldr_target->planes.Y)));
+                      } });
+    checks.push_back({ "poissonEditLdr/uint8", "float", { 60.0 }, [=] {
+                          const auto target = ldr_target->toRgb();
+                          const auto ldr_edit = makeGoldenEdit(target);
+                          const auto target_xyz = rgbToXYZ(target);
+                          const auto divergence_xyz = getMergedDivergenceXYZ(rgbToXYZ(ldr_edit.source), target_xyz, ldr_edit.mask, ldr_edit.offset_x, ldr_edit.offset_y);
+                          return measureDeviation(xyzToRGB(solvePoissonXYZ(target_xyz, divergence_xyz, poisson_iters)),
+                              poissonEditLdr(*ldr_target, LdrPlanes<uint8_t>::quantize(ldr_edit.source), ldr_edit.mask, poisson_iters, PoissonMethod::Jacobi,
+                                  ldr_edit.offset_x, ldr_edit.offset_y));
+                      } });
+
+    // Bands of rows handed through the rings by move and reassembled: every band arrives exactly once.
+    const auto ring_round_trip = [=](auto& ring, const int producers, const int consumers) {
+        constexpr int band_rows = 4;
+        const int num_bands = (luminance->height + band_rows - 1) / band_rows;
+        auto result = ImageFloat(luminance->width, luminance->height);
+        std::atomic<int> next_band = 0, producing = producers;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++) {
+            threads.emplace_back([&] {
+                for (int band; (band = next_band++) < num_bands;) {
+                    const int y0 = band * band_rows;
+                    ring.push({ y0, ImageFloat(luminance->view(0, y0, luminance->width, std::min(band_rows, luminance->height - y0))) });
+                }
+                if (--producing == 0) {
+                    ring.close();
+                }
+            });
+        }
+        for (int c = 0; c < consumers; c++) {
+            threads.emplace_back([&] {
+                while (auto band = ring.pop()) {
+                    for (int y = 0; y < band->second.height; y++) {
+                        std::copy_n(band->second.view().row(y), band->second.width, result.data.data() + size_t(band->first + y) * size_t(result.width));
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        return measureDeviation(*luminance, result);
+    };
+    checks.push_back({ "spscRing/bands", "helpers", { 200.0, 0.0 }, [=] {
+                          SpscRing<std::pair<int, ImageFloat>> ring("validate spsc", 4, WaitStrategy::Spin);
+                          return ring_round_trip(ring, 1, 1);
+                      } });
+    checks.push_back({ "mpmcRing/bands", "helpers", { 200.0, 0.0 }, [=] {
+                          MpmcRing<std::pair<int, ImageFloat>> ring("validate mpmc", 4, WaitStrategy::Block);
+                          return ring_round_trip(ring, 3, 2);
+                      } });
+
+    // The coroutine stages resumed on a pool of two workers, against the direct calls.
+    checks.push_back({ "bilateralFilterAsync/pool", "sync", { 200.0, 0.0 }, [=] {
+                          ThreadPoolExecutor compute("validate compute", 2);
+                          return measureDeviation(*base, syncWait(bilateralFilterAsync(compute, log_lum->clone(), params.filter_size, params.space_sigma, params.range_sigma)));
+                      } });
+    checks.push_back({ "solvePoissonXYZAsync/pool", "sync", { 200.0, 0.0 }, [=, &hdr] {
+                          const auto edit = makeGoldenEdit(hdr);
+                          const auto divergence = getMergedDivergenceXYZ(rgbToXYZ(edit.source), *xyz, edit.mask, edit.offset_x, edit.offset_y);
+                          const auto clone = [](const ImageFloat& plane) { return plane.clone(); };
+                          ThreadPoolExecutor compute("validate compute", 2);
+                          return measureDeviation(solvePoissonXYZ(*xyz, divergence, poisson_iters),
+                              syncWait(solvePoissonXYZAsync(compute, mapPlanes(clone, *xyz), mapPlanes(clone, divergence), poisson_iters)));
+                      } });
+
+    if (gpuComputeAvailable()) {
+        checks.push_back({ "gpu/toneMapDurand", "cpu", { 60.0, 1e-3 }, [=, &hdr] {
+                              auto reference_params = params;
+                              reference_params.engine = BilateralEngine::BruteForce;
+                              reference_params.math_precision = MathPrecision::Exact;
+                              return measureDeviation(toneMapDurand(hdr, reference_params), toneMapDurandGpu(hdr, params));
+                          } });
+        for (const auto [name, method] : { std::pair { "jacobi", PoissonMethod::Jacobi }, std::pair { "sor", PoissonMethod::RedBlackSor } }) {
+            checks.push_back({ std::string("gpu/solvePoisson/") + name, "cpu", { 60.0 }, [=] {
+                                  const ImageXYZ initial_xyz { *initial, *initial, *initial };
+                                  const ImageXYZ divergence_xyz { *divergence, *divergence, *divergence };
+                                  return measureDeviation(solvePoissonXYZ(initial_xyz, divergence_xyz, poisson_iters, method),
+                                      solvePoissonXYZGpu(initial_xyz, divergence_xyz, poisson_iters, method));
+                              } });
+        }
+        checks.push_back({ "gpu/poissonEdit", "cpu", { 60.0 }, [=, &hdr] {
+                              const auto edit = makeGoldenEdit(hdr);
+                              const auto target_xyz = rgbToXYZ(hdr);
+                              const auto divergence_xyz = getMergedDivergenceXYZ(rgbToXYZ(edit.source), target_xyz, edit.mask, edit.offset_x, edit.offset_y);
+                              return measureDeviation(xyzToRGB(solvePoissonXYZ(target_xyz, divergence_xyz, poisson_iters)),
+                                  poissonEditGpu(hdr, edit.source, edit.mask, poisson_iters, PoissonMethod::Jacobi, edit.offset_x, edit.offset_y));
+                          } });
+    }
+    return checks;
+}
+
+/// <summary>
+/// Tolerance of a check: the override with the longest matching prefix, else the default.
+/// </summary>
+GoldenTolerance goldenTolerance(const GoldenCheck& check, const GoldenCheckOptions& options)
+{
+    auto tolerance = check.tolerance;
+    size_t matched = 0;
+    for (const auto& [prefix, override_tolerance] : options.tolerances) {
+        if (check.name.compare(0, prefix.size(), prefix) == 0 && prefix.size() >= matched) {
+            tolerance = override_tolerance;
+            matched = prefix.size();
+        }
+    }
+    return tolerance;
+}
+
+/// <summary>
+/// Runs and prints the checks on all inputs, see above.
+/// </summary>
+/// <param name="params">Durand parameters of the filter and tone mapping checks</param>
+/// <param name="options">inputs, solver iterations and tolerances</param>
+/// <param name="out">result table</param>
+/// <returns>true when every check is within its tolerance</returns>
+bool runGoldenChecks(const DurandParams& params, const GoldenCheckOptions& options, std::ostream& out)
+{
+    std::vector<std::pair<std::string, ImageRGB>> inputs;
+    for (const auto& input : options.inputs) {
+        inputs.emplace_back(input.filename().string(), ImageRGB(input));
+    }
+    for (const int size : options.synthetic_sizes) {
+        inputs.emplace_back("synthetic_" + std::to_string(size), makeSyntheticHdrImage(size));
+    }
+
+    bool passed = true;
+    out << std::left << std::setw(38) << "check" << std::setw(18) << "reference" << std::setw(22) << "input" << std::right << std::setw(12) << "max abs"
+        << std::setw(12) << "mean abs" << std::setw(10) << "PSNR dB" << std::setw(10) << "SSIM" << std::setw(10) << "min dB" << "  result" << std::endl;
+    for (const auto& [input_name, hdr] : inputs) {
+        for (const auto& check : makeGoldenChecks(hdr, params, options.poisson_iters)) {
+            const auto deviation = check.measure();
+            const auto tolerance = goldenTolerance(check, options);
+            const bool ok = deviation.psnr >= tolerance.min_psnr && deviation.max_abs <= tolerance.max_abs;
+            passed &= ok;
+            out << std::left << std::setw(38) << check.name << std::setw(18) << check.reference << std::setw(22) << input_name << std::right << std::scientific
+                << std::setprecision(2) << std::setw(12) << deviation.max_abs << std::setw(12) << deviation.mean_abs << std::fixed << std::setprecision(1)
+                << std::setw(10) << deviation.psnr << std::setprecision(4) << std::setw(10);
+            if (std::isnan(deviation.ssim)) {
+                out << "-";
+            } else {
+                out << deviation.ssim;
+            }
+            out << std::setprecision(1) << std::setw(10) << tolerance.min_psnr << std::defaultfloat << (ok ? "  ok" : "  FAILED") << std::endl;
+        }
+    }
+    return passed;
+}
+
+#pragma endregion Golden-output checks
@@ -0,0 +1,813 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef HDR_GPU
+// glad before glfw, which would otherwise include the system GL header.
+#include <glad/glad.h>
+#ifdef HDR_GPU_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
+#include <GLFW/glfw3.h>
+#endif
+#endif
+
+#include "your_code_here.h"
+
+/*
+ * OpenGL compute backend (CMake option A1_HDR_GPU).
+ *
+ * toneMapDurandGpu(), solvePoissonXYZGpu() and poissonEditGpu() run the whole stage as compute
+ * shaders: the inputs are uploaded once into shader storage buffers, every pass reads and writes
+ * device buffers, and only the final image is downloaded. The kernels follow the CPU references:
+ *   - the bilateral filter evaluates the exact window with the border crop of
+ *     bilateralFilterBruteForce() and the same spatial weight table,
+ *   - the log-luminance and compose passes are durandLogLuminance() and durandCompose(),
+ *   - Jacobi and red-black SOR are the update rules of solvePoisson() with a fixed border; the
+ *     three XYZ planes are solved by one dispatch (z = plane). BlockedJacobi is plain Jacobi
+ *     on the GPU, it is bit-identical to it on the CPU,
+ *   - the color conversions are the matrices of rgbToXYZ() / xyzToRGB(), the merged divergence
+ *     is getMergedDivergence() with the mask placed on the target.
+ * exp/log/pow of the driver are not the C library ones, results differ from the CPU slightly
+ * (see --validate).
+ *
+ * The OpenGL 4.3 core context is created on first use and current on the thread that created it;
+ * the GPU functions must be called from that thread. It belongs to a hidden GLFW window, or with
+ * A1_HDR_GPU_HEADLESS to an EGL display without any window system (the GPU device through
+ * EGL_EXT_device_enumeration, else Mesa's surfaceless platform), so render nodes without X or
+ * Wayland run the backend too.
+ * Without A1_HDR_GPU the functions exist but report that the backend is not built.
+ */
+
+#pragma region GPU compute
+
+#ifdef HDR_GPU
+
+namespace gpu {
+
+#ifdef HDR_GPU_EGL
+
+/// <summary>
+/// EGL display and context without a window system, see above.
+/// </summary>
+class Context {
+public:
+    static Context& instance()
+    {
+        static Context context;
+        return context;
+    }
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    ~Context()
+    {
+        eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(m_display, m_context);
+        eglTerminate(m_display);
+    }
+
+private:
+    Context()
+    {
+        m_display = headlessDisplay();
+        if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+            std::cerr << "GPU backend: no EGL display with OpenGL available." << std::endl;
+            throw std::exception();
+        }
+        const EGLint context_attributes[] = { EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 3, EGL_CONTEXT_OPENGL_PROFILE_MASK,
+            EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+        // Compute needs no surface, so no config either where EGL_KHR_no_config_context is supported.
+        m_context = eglCreateContext(m_display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes);
+        if (m_context == EGL_NO_CONTEXT) {
+            const EGLint config_attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+            EGLConfig config;
+            EGLint num_configs = 0;
+            if (eglChooseConfig(m_display, config_attributes, &config, 1, &num_configs) && num_configs > 0) {
+                m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, context_attributes);
+            }
+        }
+        if (m_context == EGL_NO_CONTEXT || !eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context)) {
+            eglTerminate(m_display);
+            std::cerr << "GPU backend: no surfaceless OpenGL 4.3 context available (EGL error " << eglGetError() << ")." << std::endl;
+            throw std::exception();
+        }
+        if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(eglGetProcAddress))) {
+            std::cerr << "GPU backend: failed to load the OpenGL functions." << std::endl;
+            throw std::exception();
+        }
+    }
+
+    /// <summary>
+    /// First EGL device, else the surfaceless platform, else the default display.
+    /// </summary>
+    static EGLDisplay headlessDisplay()
+    {
+        const auto get_platform_display = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        const auto query_devices = reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC>(eglGetProcAddress("eglQueryDevicesEXT"));
+        if (get_platform_display && query_devices) {
+            EGLDeviceEXT device;
+            EGLint num_devices = 0;
+            if (query_devices(1, &device, &num_devices) && num_devices > 0) {
+                const EGLDisplay display = get_platform_display(EGL_PLATFORM_DEVICE_EXT, device, nullptr);
+                if (display != EGL_NO_DISPLAY) {
+                    return display;
+                }
+            }
+        }
+        if (get_platform_display) {
+            const EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+            if (display != EGL_NO_DISPLAY) {
+                return display;
+            }
+        }
+        return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLDisplay m_display = EGL_NO_DISPLAY;
+    EGLContext m_context = EGL_NO_CONTEXT;
+};
+
+#else
+
+/// <summary>
+/// Hidden window that owns the OpenGL context, see above.
+/// </summary>
+class Context {
+public:
+    static Context& instance()
+    {
+        static Context context;
+        return context;
+    }
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    ~Context()
+    {
+        if (m_window) {
+            glfwDestroyWindow(m_window);
+        }
+        glfwTerminate();
+    }
+
+private:
+    Context()
+    {
+        if (!glfwInit()) {
+            std::cerr << "GPU backend: glfwInit() failed." << std::endl;
+            throw std::exception();
+        }
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+        m_window = glfwCreateWindow(1, 1, "a1_hdr compute", nullptr, nullptr);
+        if (!m_window) {
+            glfwTerminate();
+            std::cerr << "GPU backend: no OpenGL 4.3 context available." << std::endl;
+            throw std::exception();
+        }
+        glfwMakeContextCurrent(m_window);
+        if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress))) {
+            std::cerr << "GPU backend: failed to load the OpenGL functions." << std::endl;
+            throw std::exception();
+        }
+    }
+
+    GLFWwindow* m_window = nullptr;
+};
+
+#endif
+
+/// <summary>
+/// Shader storage buffer of floats.
+/// </summary>
+class Buffer {
+public:
+    /// <param name="count">number of floats</param>
+    /// <param name="data">initial contents, uninitialized when null</param>
+    explicit Buffer(const size_t count, const float* data = nullptr)
+        : m_count(count)
+    {
+        glGenBuffers(1, &m_id);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_id);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, GLsizeiptr(count * sizeof(float)), data, GL_DYNAMIC_COPY);
+    }
+    ~Buffer()
+    {
+        if (m_id) {
+            glDeleteBuffers(1, &m_id);
+        }
+    }
+    Buffer(Buffer&& other) noexcept
+        : m_id(std::exchange(other.m_id, 0))
+        , m_count(other.m_count)
+    {
+    }
+    Buffer& operator=(Buffer&& other) noexcept
+    {
+        std::swap(m_id, other.m_id);
+        std::swap(m_count, other.m_count);
+        return *this;
+    }
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    /// <summary> Writes count floats at a float offset. </summary>
+    void upload(const float* data, const size_t offset, const size_t count)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_id);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, GLintptr(offset * sizeof(float)), GLsizeiptr(count * sizeof(float)), data);
+    }
+    /// <summary> Reads count floats at a float offset, waits for the writing shaders. </summary>
+    void download(float* data, const size_t offset, const size_t count) const
+    {
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_id);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, GLintptr(offset * sizeof(float)), GLsizeiptr(count * sizeof(float)), data);
+    }
+    /// <summary> Copies the whole buffer into a buffer at least as large. </summary>
+    void copyTo(Buffer& destination) const
+    {
+        glBindBuffer(GL_COPY_READ_BUFFER, m_id);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, destination.m_id);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, GLsizeiptr(m_count * sizeof(float)));
+    }
+    void bind(const GLuint binding) const { glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, m_id); }
+    size_t size() const { return m_count; }
+
+private:
+    GLuint m_id = 0;
+    size_t m_count = 0;
+};
+
+/// <summary>
+/// Compute shader program with 16 x 16 work groups.
+/// </summary>
+class Program {
+public:
+    static constexpr int GROUP_SIZE = 16;
+
+    explicit Program(const char* source)
+    {
+        const GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+        glShaderSource(shader, 1, &source, nullptr);
+        glCompileShader(shader);
+        GLint status = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if (!status) {
+            std::cerr << "GPU backend: compute shader does not compile:\n" << infoLog(shader, glGetShaderInfoLog) << std::endl;
+            glDeleteShader(shader);
+            throw std::exception();
+        }
+        m_id = glCreateProgram();
+        glAttachShader(m_id, shader);
+        glLinkProgram(m_id);
+        glDeleteShader(shader);
+        glGetProgramiv(m_id, GL_LINK_STATUS, &status);
+        if (!status) {
+            std::cerr << "GPU backend: compute program does not link:\n" << infoLog(m_id, glGetProgramInfoLog) << std::endl;
+            throw std::exception();
+        }
+    }
+    ~Program() { glDeleteProgram(m_id); }
+    Program(const Program&) = delete;
+    Program& operator=(const Program&) = delete;
+
+    void set(const char* name, const int value) const { glProgramUniform1i(m_id, glGetUniformLocation(m_id, name), value); }
+    void set(const char* name, const float value) const { glProgramUniform1f(m_id, glGetUniformLocation(m_id, name), value); }
+    void set(const char* name, const glm::mat3& value) const { glProgramUniformMatrix3fv(m_id, glGetUniformLocation(m_id, name), 1, GL_FALSE, &value[0][0]); }
+
+    /// <summary>
+    /// Runs one invocation per pixel of a width x height x depth grid, followed by a barrier for
+    /// the next pass.
+    /// </summary>
+    void dispatch(const int width, const int height, const int depth = 1) const
+    {
+        glUseProgram(m_id);
+        glDispatchCompute(GLuint((width + GROUP_SIZE - 1) / GROUP_SIZE), GLuint((height + GROUP_SIZE - 1) / GROUP_SIZE), GLuint(depth));
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+private:
+    template <typename GetLog>
+    static std::string infoLog(const GLuint id, GetLog get_log)
+    {
+        std::vector<char> log(4096);
+        get_log(id, GLsizei(log.size()), nullptr, log.data());
+        return log.data();
+    }
+
+    GLuint m_id = 0;
+};
+
+#define HDR_GPU_SHADER_HEADER            \
+    "#version 430\n"                     \
+    "layout(local_size_x = 16, local_size_y = 16) in;\n"
+
+// log(max(luminance, 1e-8)) of interleaved RGB, see durandLogLuminance().
+inline const char* const LOG_LUMINANCE_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Rgb { float rgb[]; };
+layout(std430, binding = 1) writeonly buffer LogLum { float log_lum[]; };
+uniform int width;
+uniform int height;
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= width || p.y >= height) return;
+    int i = p.y * width + p.x;
+    float luminance = 0.299 * rgb[3 * i] + 0.587 * rgb[3 * i + 1] + 0.114 * rgb[3 * i + 2];
+    log_lum[i] = log(max(luminance, 1e-8));
+}
+)";
+
+// Exact bilateral window cropped at the border, see bilateralFilterBruteForce().
+inline const char* const BILATERAL_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Src { float src[]; };
+layout(std430, binding = 1) writeonly buffer Dst { float dst[]; };
+layout(std430, binding = 2) readonly buffer Spatial { float spatial[]; };
+uniform int width;
+uniform int height;
+uniform int radius;
+uniform float range_denominator;
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= width || p.y >= height) return;
+    int size = 2 * radius + 1;
+    int dy0 = max(-radius, -p.y), dy1 = min(radius, height - 1 - p.y);
+    int dx0 = max(-radius, -p.x), dx1 = min(radius, width - 1 - p.x);
+    float val = src[p.y * width + p.x];
+    float K = 0.0;
+    float filtered = 0.0;
+    for (int dy = dy0; dy <= dy1; dy++) {
+        for (int dx = dx0; dx <= dx1; dx++) {
+            float n_val = src[(p.y + dy) * width + p.x + dx];
+            float weight = spatial[(dy + radius) * size + dx + radius] * exp(-(val - n_val) * (val - n_val) / range_denominator);
+            filtered += weight * n_val;
+            K += weight;
+        }
+    }
+    dst[p.y * width + p.x] = filtered / K;
+}
+)";
+
+// Detail, contrast reduction and RGB rescale, see durandCompose().
+inline const char* const COMPOSE_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Rgb { float rgb[]; };
+layout(std430, binding = 1) readonly buffer LogLum { float log_lum[]; };
+layout(std430, binding = 2) readonly buffer Base { float base[]; };
+layout(std430, binding = 3) writeonly buffer Result { float result[]; };
+uniform int width;
+uniform int height;
+uniform float base_scale;
+uniform float output_gain;
+uniform float saturation;
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= width || p.y >= height) return;
+    int i = p.y * width + p.x;
+    vec3 val = vec3(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+    float b_val = base[i];
+    float d_val = log_lum[i] - b_val;
+    float new_luminance = exp(b_val * base_scale + d_val) * output_gain;
+    float luminance = max(dot(vec3(0.299, 0.587, 0.114), val), 1e-7);
+    vec3 adjusted = clamp(pow(max(val / luminance, vec3(0.0)), vec3(saturation)) * new_luminance, 0.0, 1.0);
+    result[3 * i] = adjusted.r;
+    result[3 * i + 1] = adjusted.g;
+    result[3 * i + 2] = adjusted.b;
+}
+)";
+
+// One Jacobi sweep of the interior of every plane (z), see solvePoisson().
+inline const char* const JACOBI_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Src { float src[]; };
+layout(std430, binding = 1) writeonly buffer Dst { float dst[]; };
+layout(std430, binding = 2) readonly buffer Div { float div_G[]; };
+uniform int width;
+uniform int height;
+uniform int div_width;
+uniform int div_height;
+void main() {
+    ivec3 p = ivec3(gl_GlobalInvocationID);
+    if (p.x < 1 || p.y < 1 || p.x >= width - 1 || p.y >= height - 1) return;
+    int i = (p.z * height + p.y) * width + p.x;
+    float f = div_G[(p.z * div_height + p.y) * div_width + p.x];
+    dst[i] = 0.25 * (src[i + 1] + src[i - 1] + src[i + width] + src[i - width] - f);
+}
+)";
+
+// One color of a red-black SOR sweep in place, see smoothPoissonRedBlack().
+inline const char* const RED_BLACK_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) buffer U { float u[]; };
+layout(std430, binding = 2) readonly buffer Div { float div_G[]; };
+uniform int width;
+uniform int height;
+uniform int div_width;
+uniform int div_height;
+uniform int color;
+uniform float omega;
+void main() {
+    ivec3 p = ivec3(gl_GlobalInvocationID);
+    if (p.x < 1 || p.y < 1 || p.x >= width - 1 || p.y >= height - 1 || ((p.x + p.y) & 1) != color) return;
+    int i = (p.z * height + p.y) * width + p.x;
+    float f = div_G[(p.z * div_height + p.y) * div_width + p.x];
+    float gs = 0.25 * (u[i - 1] + u[i + 1] + u[i - width] + u[i + width] - f);
+    u[i] += omega * (gs - u[i]);
+}
+)";
+
+// Interleaved RGB to XYZ planes, see rgbToXYZ().
+inline const char* const RGB_TO_XYZ_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Rgb { float rgb[]; };
+layout(std430, binding = 1) writeonly buffer Xyz { float xyz[]; };
+uniform int width;
+uniform int height;
+uniform mat3 rgb_to_xyz;
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= width || p.y >= height) return;
+    int i = p.y * width + p.x;
+    int plane = width * height;
+    vec3 v = rgb_to_xyz * vec3(rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2]);
+    xyz[i] = v.x;
+    xyz[plane + i] = v.y;
+    xyz[2 * plane + i] = v.z;
+}
+)";
+
+// XYZ planes to interleaved RGB, see xyzToRGB().
+inline const char* const XYZ_TO_RGB_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Xyz { float xyz[]; };
+layout(std430, binding = 1) writeonly buffer Rgb { float rgb[]; };
+uniform int width;
+uniform int height;
+uniform mat3 xyz_to_rgb;
+void main() {
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (p.x >= width || p.y >= height) return;
+    int i = p.y * width + p.x;
+    int plane = width * height;
+    vec3 v = xyz_to_rgb * vec3(xyz[i], xyz[plane + i], xyz[2 * plane + i]);
+    rgb[3 * i] = v.r;
+    rgb[3 * i + 1] = v.g;
+    rgb[3 * i + 2] = v.b;
+}
+)";
+
+// Divergence of the gradients merged by the placed mask, see getMergedDivergence(). The
+// divergence planes are (width + 2) x (height + 2) and zero outside of the dispatched pixels.
+inline const char* const MERGED_DIVERGENCE_SHADER = HDR_GPU_SHADER_HEADER R"(
+layout(std430, binding = 0) readonly buffer Source { float source[]; };
+layout(std430, binding = 1) readonly buffer Target { float target[]; };
+layout(std430, binding = 2) readonly buffer Mask { float mask[]; };
+layout(std430, binding = 3) writeonly buffer Div { float div_G[]; };
+uniform int width;
+uniform int height;
+uniform int source_width;
+uniform int source_height;
+uniform int offset_x;
+uniform int offset_y;
+bool placed(int x, int y) { return mask[y * width + x] != 0.0; }
+vec2 merged(int x, int y, int z) {
+    if (x >= width || y >= height) return vec2(0.0);
+    bool mask_val = placed(x, y);
+    vec2 g = vec2(0.0);
+    if (mask_val) {
+        int sx = x - offset_x;
+        int sy = y - offset_y;
+        int s = (z * source_height + sy) * source_width + sx;
+        if (sx + 1 < source_width) g.x = source[s + 1] - source[s];
+        if (sy + 1 < source_height) g.y = source[s + source_width] - source[s];
+    } else {
+        int t = (z * height + y) * width + x;
+        if (x + 1 < width) g.x = target[t + 1] - target[t];
+        if (y + 1 < height) g.y = target[t + width] - target[t];
+    }
+    if ((x > 0 && placed(x - 1, y) != mask_val) || (x < width - 1 && placed(x + 1, y) != mask_val)) g.x = 0.0;
+    if ((y > 0 && placed(x, y - 1) != mask_val) || (y < height - 1 && placed(x, y + 1) != mask_val)) g.y = 0.0;
+    return g;
+}
+void main() {
+    ivec3 p = ivec3(gl_GlobalInvocationID);
+    if (p.x > width || p.y > height) return;
+    vec2 g = merged(p.x, p.y, p.z);
+    float div_x = g.x;
+    if (p.x > 0) div_x -= merged(p.x - 1, p.y, p.z).x;
+    float div_y = g.y;
+    if (p.y > 0) div_y -= merged(p.x, p.y - 1, p.z).y;
+    div_G[(p.z * (height + 2) + p.y) * (width + 2) + p.x] = div_x + div_y;
+}
+)";
+
+#undef HDR_GPU_SHADER_HEADER
+
+/// <summary>
+/// Compiled programs of the context, built on first use.
+/// </summary>
+struct Kernels {
+    Program log_luminance { LOG_LUMINANCE_SHADER };
+    Program bilateral { BILATERAL_SHADER };
+    Program compose { COMPOSE_SHADER };
+    Program jacobi { JACOBI_SHADER };
+    Program red_black { RED_BLACK_SHADER };
+    Program rgb_to_xyz { RGB_TO_XYZ_SHADER };
+    Program xyz_to_rgb { XYZ_TO_RGB_SHADER };
+    Program merged_divergence { MERGED_DIVERGENCE_SHADER };
+
+    static Kernels& instance()
+    {
+        Context::instance();
+        static Kernels kernels;
+        return kernels;
+    }
+};
+
+/// <summary>
+/// Buffer with the three planes of an XYZ image one after the other.
+/// </summary>
+inline Buffer uploadPlanes(const ImageXYZ& image)
+{
+    const size_t plane_size = image.X.data.size();
+    Buffer buffer(3 * plane_size);
+    size_t offset = 0;
+    forEachPlane([&](const ImageFloat& plane) {
+        buffer.upload(plane.data.data(), offset, plane_size);
+        offset += plane_size;
+    }, image);
+    return buffer;
+}
+
+/// <summary>
+/// Copy of a buffer on the device.
+/// </summary>
+inline Buffer copyBuffer(const Buffer& source)
+{
+    Buffer copy(source.size());
+    source.copyTo(copy);
+    return copy;
+}
+
+/// <summary>
+/// Solves the three planes of current in place, see solvePoissonXYZGpu().
+/// </summary>
+/// <param name="current">width x height planes, initial solution and border; holds the result</param>
+/// <param name="divergence">div G planes of div_width x div_height</param>
+/// <param name="control">progress output and cancellation, a checkpoint before every iteration is dispatched</param>
+inline void solvePlanes(Buffer& current, const Buffer& divergence, const int width, const int height, const int div_width, const int div_height, const int num_iters,
+    const PoissonMethod method, const PoissonControl& control = {})
+{
+    auto& kernels = Kernels::instance();
+    divergence.bind(2);
+    // The mixed-precision methods run their scheme in fp32 here.
+    const bool sor = method == PoissonMethod::RedBlackSor || method == PoissonMethod::MixedSor;
+    const auto& program = sor ? kernels.red_black : kernels.jacobi;
+    program.set("width", width);
+    program.set("height", height);
+    program.set("div_width", div_width);
+    program.set("div_height", div_height);
+    if (sor) {
+        program.set("omega", computeOptimalSorOmega(width, height));
+        current.bind(0);
+    }
+    // Jacobi alternates between two buffers that both hold the border.
+    auto next = sor ? Buffer(0) : copyBuffer(current);
+
+    for (int iter = 0; iter < num_iters && !control.checkpoint(); iter++) {
+        if (control.reports(iter)) {
+            control.report({ iter, num_iters, std::numeric_limits<float>::quiet_NaN(), "XYZ, GPU" });
+        }
+        if (sor) {
+            for (int color = 0; color < 2; color++) {
+                program.set("color", color);
+                program.dispatch(width, height, 3);
+            }
+        } else {
+            current.bind(0);
+            next.bind(1);
+            program.dispatch(width, height, 3);
+            std::swap(current, next);
+        }
+    }
+    control.throwIfCancelled();
+}
+
+/// <summary>
+/// The rgbToXYZ() matrix.
+/// </summary>
+inline glm::mat3 rgbToXyzColorMatrix()
+{
+    return glm::transpose(glm::mat3(0.49f, 0.31f, 0.2f, 0.17697f, 0.8124f, 0.01063f, 0.0f, 0.01f, 0.99000f));
+}
+
+} // namespace gpu
+
+/// <summary>
+/// True when the GPU backend is built in.
+/// </summary>
+inline bool gpuComputeAvailable()
+{
+    return true;
+}
+
+/// <summary>
+/// toneMapDurand() on the GPU, see above. The bilateral filter is the exact window regardless
+/// of params.engine; exp/log/pow are the driver's regardless of params.math_precision.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapDurandGpu(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    const ScopedStage stage("toneMapDurandGpu", hdr_image.data.size());
+    auto& kernels = gpu::Kernels::instance();
+    const int w = hdr_image.width, h = hdr_image.height;
+    const size_t pixels = hdr_image.data.size();
+
+    // Same spatial table as the CPU filter.
+    const int radius = params.filter_size / 2;
+    std::vector<float> spatial_weights(size_t(params.filter_size) * size_t(params.filter_size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatial_weights[(i + radius) * params.filter_size + (j + radius)] = std::exp(-(i * i + j * j) / (2.0f * params.space_sigma * params.space_sigma));
+        }
+    }
+
+    gpu::Buffer rgb(3 * pixels, &hdr_image.data.data()->x);
+    gpu::Buffer log_lum(pixels), base(pixels), result(3 * pixels);
+    gpu::Buffer spatial(spatial_weights.size(), spatial_weights.data());
+
+    rgb.bind(0);
+    log_lum.bind(1);
+    kernels.log_luminance.set("width", w);
+    kernels.log_luminance.set("height", h);
+    kernels.log_luminance.dispatch(w, h);
+
+    log_lum.bind(0);
+    base.bind(1);
+    spatial.bind(2);
+    kernels.bilateral.set("width", w);
+    kernels.bilateral.set("height", h);
+    kernels.bilateral.set("radius", radius);
+    kernels.bilateral.set("range_denominator", 2.0f * params.range_sigma * params.range_sigma);
+    kernels.bilateral.dispatch(w, h);
+
+    rgb.bind(0);
+    log_lum.bind(1);
+    base.bind(2);
+    result.bind(3);
+    kernels.compose.set("width", w);
+    kernels.compose.set("height", h);
+    kernels.compose.set("base_scale", params.base_scale);
+    kernels.compose.set("output_gain", params.output_gain);
+    kernels.compose.set("saturation", params.saturation);
+    kernels.compose.dispatch(w, h);
+
+    auto output = ImageRGB::uninitialized(w, h);
+    result.download(&output.data.data()->x, 0, 3 * pixels);
+    return output;
+}
+
+/// <summary>
+/// solvePoissonXYZ() on the GPU, see above.
+/// </summary>
+/// <param name="targetXYZ">initial solution and border values</param>
+/// <param name="divergenceXYZ_G">div G, at least the size of the target</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">Jacobi, RedBlackSor (optimal omega) or BlockedJacobi (as Jacobi)</param>
+/// <returns>solution of every plane</returns>
+ImageXYZ solvePoissonXYZGpu(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 2000, const PoissonMethod method = PoissonMethod::Jacobi)
+{
+    const int w = targetXYZ.X.width, h = targetXYZ.X.height;
+    const ScopedStage stage("solvePoissonXYZGpu", 3 * uint64_t(w) * uint64_t(h) * uint64_t(std::max(num_iters, 0)));
+    auto solution = gpu::uploadPlanes(targetXYZ);
+    gpu::solvePlanes(solution, gpu::uploadPlanes(divergenceXYZ_G), w, h, divergenceXYZ_G.X.width, divergenceXYZ_G.X.height, num_iters, method);
+
+    ImageXYZ result { ImageFloat::uninitialized(w, h), ImageFloat::uninitialized(w, h), ImageFloat::uninitialized(w, h) };
+    size_t offset = 0;
+    forEachPlane([&](ImageFloat& plane) {
+        solution.download(plane.data.data(), offset, plane.data.size());
+        offset += plane.data.size();
+    }, result);
+    return result;
+}
+
+/// <summary>
+/// Poisson edit on the GPU: RGB to XYZ, merged divergence, solve and XYZ to RGB, i.e.
+/// xyzToRGB(solvePoissonXYZ(rgbToXYZ(target), getMergedDivergenceXYZ(rgbToXYZ(source),
+/// rgbToXYZ(target), mask), ...)) with one upload of the inputs and one download.
+/// </summary>
+/// <param name="target">target RGB image</param>
+/// <param name="source">source RGB image, at the size of the mask</param>
+/// <param name="source_mask">source mask, set pixels take the source gradients</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme, see solvePoissonXYZGpu()</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>edited RGB image</returns>
+ImageRGB poissonEditGpu(const ImageRGB& target, const ImageRGB& source, const BinaryMask& source_mask, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const int offset_x = 0, const int offset_y = 0)
+{
+    const int w = target.width, h = target.height;
+    const ScopedStage stage("poissonEditGpu", 3 * uint64_t(w) * uint64_t(h) * uint64_t(std::max(num_iters, 0)));
+    auto& kernels = gpu::Kernels::instance();
+    const size_t pixels = target.data.size();
+
+    // The mask placed on the target as one float per pixel.
+    const auto placed = source_mask.placed(w, h, offset_x, offset_y);
+    std::vector<float> mask_values(pixels);
+#pragma omp parallel for
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            mask_values[size_t(y) * size_t(w) + size_t(x)] = placed(x, y) ? 1.0f : 0.0f;
+        }
+    }
+
+    const gpu::Buffer target_rgb(3 * pixels, &target.data.data()->x);
+    const gpu::Buffer source_rgb(3 * source.data.size(), &source.data.data()->x);
+    const gpu::Buffer mask(pixels, mask_values.data());
+    gpu::Buffer target_xyz(3 * pixels), source_xyz(3 * source.data.size());
+    const std::vector<float> zeros(3 * size_t(w + 2) * size_t(h + 2));
+    const gpu::Buffer divergence(zeros.size(), zeros.data());
+    gpu::Buffer result_rgb(3 * pixels);
+
+    const auto to_xyz = [&](const gpu::Buffer& rgb, gpu::Buffer& xyz, const int width, const int height) {
+        rgb.bind(0);
+        xyz.bind(1);
+        kernels.rgb_to_xyz.set("width", width);
+        kernels.rgb_to_xyz.set("height", height);
+        kernels.rgb_to_xyz.set("rgb_to_xyz", gpu::rgbToXyzColorMatrix());
+        kernels.rgb_to_xyz.dispatch(width, height);
+    };
+    to_xyz(target_rgb, target_xyz, w, h);
+    to_xyz(source_rgb, source_xyz, source.width, source.height);
+
+    source_xyz.bind(0);
+    target_xyz.bind(1);
+    mask.bind(2);
+    divergence.bind(3);
+    kernels.merged_divergence.set("width", w);
+    kernels.merged_divergence.set("height", h);
+    kernels.merged_divergence.set("source_width", source.width);
+    kernels.merged_divergence.set("source_height", source.height);
+    kernels.merged_divergence.set("offset_x", offset_x);
+    kernels.merged_divergence.set("offset_y", offset_y);
+    kernels.merged_divergence.dispatch(w + 1, h + 1, 3);
+
+    gpu::solvePlanes(target_xyz, divergence, w, h, w + 2, h + 2, num_iters, method);
+
+    target_xyz.bind(0);
+    result_rgb.bind(1);
+    kernels.xyz_to_rgb.set("width", w);
+    kernels.xyz_to_rgb.set("height", h);
+    kernels.xyz_to_rgb.set("xyz_to_rgb", glm::inverse(gpu::rgbToXyzColorMatrix()));
+    kernels.xyz_to_rgb.dispatch(w, h);
+
+    auto output = ImageRGB::uninitialized(w, h);
+    result_rgb.download(&output.data.data()->x, 0, 3 * pixels);
+    return output;
+}
+
+#else
+
+inline bool gpuComputeAvailable()
+{
+    return false;
+}
+
+inline void reportGpuComputeMissing()
+{
+    std::cerr << "a1_hdr was built without the GPU backend, configure with -DA1_HDR_GPU=ON." << std::endl;
+    throw std::exception();
+}
+
+ImageRGB toneMapDurandGpu(const ImageRGB&, const DurandParams& = {})
+{
+    reportGpuComputeMissing();
+    return {};
+}
+
+ImageXYZ solvePoissonXYZGpu(const ImageXYZ&, const ImageXYZ&, const int = 2000, const PoissonMethod = PoissonMethod::Jacobi)
+{
+    reportGpuComputeMissing();
+    return {};
+}
+
+ImageRGB poissonEditGpu(const ImageRGB&, const ImageRGB&, const BinaryMask&, const int = 2000, const PoissonMethod = PoissonMethod::Jacobi, const int = 0, const int = 0)
+{
+    reportGpuComputeMissing();
+    return {};
+}
+
+#endif
+
+#pragma endregion GPU compute
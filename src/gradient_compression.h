@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "execution.h"
+#include "helpers.h"
+#include "image_pyramid.h"
+
+/*
+ * Gradient-domain HDR compression (Fattal, Lischinski and Werman 2002).
+ *
+ * Large log-luminance gradients are attenuated and small ones kept, then the luminance is
+ * reconstructed from the attenuated field by a Poisson solve. The attenuation of a pixel is the
+ * product over a Gaussian pyramid of the log-luminance of
+ *
+ *   phi_k = (|grad H_k| / alpha_k)^(beta - 1),
+ *
+ * with central differences at the spacing of level k and alpha_k = alpha times the average
+ * gradient magnitude of the level, so an edge is compressed at every scale it is large at. The
+ * product is built in the log domain, where it is the sum of the interpolated levels, i.e. the
+ * collapse of a Laplacian pyramid whose levels are log phi_k.
+ *
+ * gradientAttenuation() computes the factor and attenuateGradients() applies it to the forward
+ * differences of getGradients(); toneMapFattal() solves on them with the Neumann border of the
+ * stencil solver core (no gradient crosses the image edge) and recovers the color like the other
+ * local operators.
+ */
+
+#pragma region Gradient compression
+
+/// <summary>
+/// Smallest side of the coarsest level of the attenuation pyramid.
+/// </summary>
+constexpr int GRADIENT_ATTENUATION_MIN_SIZE = 32;
+
+/// <summary>
+/// Gradient magnitudes below this are treated as this value, phi stays finite in flat areas.
+/// </summary>
+constexpr float GRADIENT_ATTENUATION_MIN_MAGNITUDE = 1e-4f;
+
+/// <summary>
+/// Attenuation factor Phi of the gradients of an intensity image, see above.
+/// </summary>
+/// <param name="H">intensity image (log-luminance)</param>
+/// <param name="alpha">magnitude kept unchanged, relative to the average magnitude of each level</param>
+/// <param name="beta">exponent of the magnitude, below 1 compresses the large gradients</param>
+/// <param name="min_size">minimum side of the coarsest level</param>
+/// <returns>Phi at the image size</returns>
+inline ImageFloat gradientAttenuation(const ImageFloat& H, const float alpha = 0.1f, const float beta = 0.85f, const int min_size = GRADIENT_ATTENUATION_MIN_SIZE)
+{
+    const int levels = pyramidDepth(H.width, H.height, min_size);
+    std::vector<ImageFloat> gaussian, log_phi;
+    buildGaussianPyramid<float>(H, levels, gaussian);
+    resizePyramid(log_phi, H.width, H.height, levels);
+
+    for (int k = 0; k < levels; k++) {
+        const auto& level = gaussian[size_t(k)];
+        auto& out = log_phi[size_t(k)];
+        const int w = level.width, h = level.height;
+        // Central differences over two pixels of this level, in units of the full resolution.
+        const float scale = 1.0f / float(2 << k);
+        const int threads = kernelThreads(level, KernelCost::Light);
+        // Magnitudes first, they give the average.
+#pragma omp parallel for num_threads(threads)
+        for (int y = 0; y < h; y++) {
+            const float* row = level.data.data() + size_t(y) * size_t(w);
+            const float* above = level.data.data() + size_t(std::max(y - 1, 0)) * size_t(w);
+            const float* below = level.data.data() + size_t(std::min(y + 1, h - 1)) * size_t(w);
+            float* mag = out.data.data() + size_t(y) * size_t(w);
+            for (int x = 0; x < w; x++) {
+                const float dx = (row[std::min(x + 1, w - 1)] - row[std::max(x - 1, 0)]) * scale;
+                const float dy = (below[x] - above[x]) * scale;
+                mag[x] = std::max(std::sqrt(dx * dx + dy * dy), GRADIENT_ATTENUATION_MIN_MAGNITUDE);
+            }
+        }
+        const auto size = int64_t(out.data.size());
+        const double sum = reproducibleSum<double>(size, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            double partial = 0.0;
+            for (int64_t i = begin; i < end; i++) {
+                partial += out.data[i];
+            }
+            return partial;
+        });
+        const float inv_alpha = 1.0f / (alpha * float(sum / double(size)));
+#pragma omp parallel for num_threads(threads)
+        for (int64_t i = 0; i < size; i++) {
+            out.data[i] = (beta - 1.0f) * std::log(out.data[i] * inv_alpha);
+        }
+    }
+
+    // Sum of the interpolated levels, then back from the log domain.
+    collapseLaplacianPyramid(log_phi);
+    auto& phi = log_phi[0];
+#pragma omp parallel for num_threads(kernelThreads(phi, KernelCost::Medium))
+    for (int64_t i = 0; i < int64_t(phi.data.size()); i++) {
+        phi.data[i] = std::exp(phi.data[i]);
+    }
+    return std::move(phi);
+}
+
+/// <summary>
+/// Scales the forward differences of getGradients() by an attenuation factor, each by the mean
+/// of the factor at its two pixels.
+/// </summary>
+/// <param name="gradients">gradients of an image, 1px larger than it</param>
+/// <param name="phi">factor at the image size</param>
+inline void attenuateGradients(ImageGradient& gradients, const ImageFloat& phi)
+{
+    const int w = phi.width, h = phi.height;
+    const int gw = gradients.dx.width;
+#pragma omp parallel for num_threads(kernelThreads(phi, KernelCost::Light))
+    for (int y = 0; y < h; y++) {
+        const float* row = phi.data.data() + size_t(y) * size_t(w);
+        const float* below = row + (y + 1 < h ? w : 0);
+        float* dx = gradients.dx.data.data() + size_t(y) * size_t(gw);
+        float* dy = gradients.dy.data.data() + size_t(y) * size_t(gw);
+        // The differences leaving the image are 0 and stay 0.
+        for (int x = 0; x + 1 < w; x++) {
+            dx[x] *= 0.5f * (row[x] + row[x + 1]);
+        }
+        for (int x = 0; x < w; x++) {
+            dy[x] *= 0.5f * (row[x] + below[x]);
+        }
+    }
+}
+
+#pragma endregion Gradient compression
@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <vector>
+
+#include "helpers.h"
+#include "integral_image.h"
+
+/*
+ * Guided filter (He, Sun and Tang 2010) as an edge-preserving base-layer operator.
+ *
+ * The filter is guided by the image itself: in every radius x radius window the output is the
+ * linear model a * H + b that fits H best with a penalty eps on a, so a = var / (var + eps) and
+ * b = (1 - a) * mean. Windows with a variance well below eps are smoothed to their mean, windows
+ * across an edge keep it. The base layer averages the models of all windows that cover a pixel.
+ *
+ * All window means are box filters evaluated with summed-area tables, so the cost per pixel does
+ * not depend on the radius. Unlike the bilateral filter the result has no gradient reversal at
+ * strong edges. The filter maps onto the bilateral parameters as radius = size / 2 and
+ * eps = range_sigma^2; the spatial sigma is not used. Windows are clipped at the image border.
+ */
+
+#pragma region Guided filter
+
+/// <summary>
+/// Means of the clipped (2 * radius + 1)^2 windows around every pixel, in double precision.
+/// </summary>
+/// <param name="values">width * height values, row by row</param>
+/// <param name="width">image width</param>
+/// <param name="height">image height</param>
+/// <param name="radius">window radius</param>
+/// <returns>width * height window means</returns>
+std::vector<double> boxMean(const std::vector<double>& values, const int width, const int height, const int radius)
+{
+    std::vector<double> means(size_t(width) * size_t(height));
+    SummedAreaTable<double>(values.data(), width, height, width).windowMeans(radius, means.data());
+    return means;
+}
+
+/// <summary>
+/// Applies the self-guided filter to an intensity image, see above.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="size">The window size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="range_sigma">square root of the regularization eps, in units of H.</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat guidedFilter(const ImageFloat& H, const int size, const float range_sigma)
+{
+    const int radius = std::max(size / 2, 0);
+    const double eps = double(range_sigma) * double(range_sigma);
+    const size_t count = H.data.size();
+
+    std::vector<double> values(count), squares(count);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(count), KernelCost::Light))
+    for (int i = 0; i < int(count); i++) {
+        values[size_t(i)] = double(H.data[size_t(i)]);
+        squares[size_t(i)] = values[size_t(i)] * values[size_t(i)];
+    }
+    const auto mean = boxMean(values, H.width, H.height, radius);
+    const auto mean_square = boxMean(squares, H.width, H.height, radius);
+
+    // Linear model of every window, reusing the buffers: values = a, squares = b.
+#pragma omp parallel for num_threads(kernelThreads(int64_t(count), KernelCost::Light))
+    for (int i = 0; i < int(count); i++) {
+        const double variance = std::max(mean_square[size_t(i)] - mean[size_t(i)] * mean[size_t(i)], 0.0);
+        const double a = variance / (variance + eps);
+        values[size_t(i)] = a;
+        squares[size_t(i)] = (1.0 - a) * mean[size_t(i)];
+    }
+    const auto mean_a = boxMean(values, H.width, H.height, radius);
+    const auto mean_b = boxMean(squares, H.width, H.height, radius);
+
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(count), KernelCost::Light))
+    for (int i = 0; i < int(count); i++) {
+        result.data[size_t(i)] = float(mean_a[size_t(i)] * double(H.data[size_t(i)]) + mean_b[size_t(i)]);
+    }
+    return result;
+}
+
+#pragma endregion Guided filter
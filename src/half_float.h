@@ -0,0 +1,327 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "helpers.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HDR_F16C_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+/*
+ * 16-bit pixel storage with fp32 compute.
+ *
+ * half (IEEE binary16: 10-bit mantissa, range 6e-5 .. 65504) and bfloat16 (8-bit mantissa, the
+ * fp32 range) halve the memory traffic of intermediate images. Kernels never compute in 16 bit:
+ * rows are widened to fp32 with loadRow(), processed, and narrowed with storeRow(), which round to
+ * nearest even. On x86 CPUs with F16C the half conversions run 8 pixels per instruction; the
+ * scalar fallback produces the same bits.
+ */
+
+#pragma region Half-precision storage
+
+namespace half_float {
+
+inline uint32_t floatBits(const float f)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &f, 4);
+    return bits;
+}
+
+inline float bitsFloat(const uint32_t bits)
+{
+    float f;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+/// <summary>
+/// fp32 -> binary16 with round to nearest even; overflow gives infinity, NaNs stay quiet NaNs.
+/// </summary>
+inline uint16_t floatToHalfBits(const float value)
+{
+    uint32_t x = floatBits(value);
+    const uint32_t sign = (x >> 16) & 0x8000;
+    x &= 0x7FFFFFFF;
+    uint32_t result;
+    if (x >= 0x7F800000) {
+        // Inf, or NaN with the quiet bit set and the payload truncated (as F16C does).
+        result = x == 0x7F800000 ? 0x7C00 : 0x7E00 | ((x >> 13) & 0x3FF);
+    } else if (x >= 0x477FF000) {
+        result = 0x7C00; // Rounds above the largest half.
+    } else if (x < 0x38800000) {
+        // Subnormal half or zero: the float addition performs the rounding.
+        const uint32_t denorm_magic = ((127 - 15) + (23 - 10) + 1) << 23;
+        result = floatBits(bitsFloat(x) + bitsFloat(denorm_magic)) - denorm_magic;
+    } else {
+        const uint32_t mantissa_odd = (x >> 13) & 1;
+        x += (uint32_t(15 - 127) << 23) + 0xFFF + mantissa_odd;
+        result = x >> 13;
+    }
+    return uint16_t(result | sign);
+}
+
+/// <summary>
+/// binary16 -> fp32, exact (NaNs are returned quiet).
+/// </summary>
+inline float halfBitsToFloat(const uint16_t half)
+{
+    const uint32_t shifted_exponent = 0x7C00 << 13;
+    uint32_t bits = (half & 0x7FFFu) << 13;
+    const uint32_t exponent = bits & shifted_exponent;
+    bits += (127 - 15) << 23;
+    if (exponent == shifted_exponent) {
+        bits += (128 - 16) << 23; // Inf / NaN
+        if (half & 0x3FF) {
+            bits |= 0x400000; // Quiet signaling NaNs, as F16C does.
+        }
+    } else if (exponent == 0) {
+        // Subnormal: renormalize with a float subtraction.
+        bits += 1 << 23;
+        bits = floatBits(bitsFloat(bits) - bitsFloat(113 << 23));
+    }
+    return bitsFloat(bits | (uint32_t(half & 0x8000) << 16));
+}
+
+/// <summary>
+/// fp32 -> bfloat16 with round to nearest even, NaNs stay quiet NaNs.
+/// </summary>
+inline uint16_t floatToBfloat16Bits(const float value)
+{
+    const uint32_t x = floatBits(value);
+    if ((x & 0x7FFFFFFF) > 0x7F800000) {
+        return uint16_t((x >> 16) | 0x40);
+    }
+    return uint16_t((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+inline float bfloat16BitsToFloat(const uint16_t value) { return bitsFloat(uint32_t(value) << 16); }
+
+} // namespace half_float
+
+/// <summary>
+/// IEEE half-precision storage type. Converts to and from float, arithmetic happens in float.
+/// </summary>
+struct half {
+    // Left uninitialized by default construction (like float), half {} is +0.
+    uint16_t bits;
+
+    half() = default;
+    explicit half(const float value)
+        : bits(half_float::floatToHalfBits(value))
+    {
+    }
+    operator float() const { return half_float::halfBitsToFloat(bits); }
+};
+
+/// <summary>
+/// bfloat16 storage type: the upper half of an fp32, same range, 8-bit mantissa.
+/// </summary>
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+    explicit bfloat16(const float value)
+        : bits(half_float::floatToBfloat16Bits(value))
+    {
+    }
+    operator float() const { return half_float::bfloat16BitsToFloat(bits); }
+};
+
+static_assert(sizeof(half) == 2 && sizeof(bfloat16) == 2);
+
+#if defined(HDR_F16C_X86)
+
+/// <summary>
+/// True when the running CPU converts half precision in hardware (cached after the first call).
+/// </summary>
+inline bool hasF16c()
+{
+    static const bool supported = []() {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#elif defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+        const bool f16c = (info[2] & (1 << 29)) != 0;
+        return osxsave && avx && f16c && (_xgetbv(0) & 0x6) == 0x6;
+#else
+        return false;
+#endif
+    }();
+    return supported;
+}
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx,f16c")
+#endif
+namespace half_float_f16c {
+inline void load(const half* src, float* dst, const int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    }
+    for (; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void store(const float* src, half* dst, const int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < count; i++) {
+        dst[i] = half(src[i]);
+    }
+}
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif // HDR_F16C_X86
+
+/// <summary>
+/// Widens count stored values to fp32.
+/// </summary>
+inline void loadRow(const float* src, float* dst, const int count) { std::copy_n(src, count, dst); }
+
+inline void loadRow(const half* src, float* dst, const int count)
+{
+#if defined(HDR_F16C_X86)
+    if (hasF16c()) {
+        half_float_f16c::load(src, dst, count);
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void loadRow(const bfloat16* src, float* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+/// <summary>
+/// Narrows count fp32 values to the storage type (round to nearest even).
+/// </summary>
+inline void storeRow(const float* src, float* dst, const int count) { std::copy_n(src, count, dst); }
+
+inline void storeRow(const float* src, half* dst, const int count)
+{
+#if defined(HDR_F16C_X86)
+    if (hasF16c()) {
+        half_float_f16c::store(src, dst, count);
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        dst[i] = half(src[i]);
+    }
+}
+
+inline void storeRow(const float* src, bfloat16* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = bfloat16(src[i]);
+    }
+}
+
+/// <summary>
+/// Integer pixels and the exact differences of integer pixels (see getGradientsAs()), widened
+/// to fp32 in their levels. Values are exact in fp32 while they stay below 2^24.
+/// </summary>
+inline void loadRow(const uint8_t* src, float* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void loadRow(const uint16_t* src, float* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void loadRow(const int16_t* src, float* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void loadRow(const int32_t* src, float* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = float(src[i]);
+    }
+}
+
+inline void storeRow(const int32_t* src, int16_t* dst, const int count)
+{
+    for (int i = 0; i < count; i++) {
+        dst[i] = int16_t(src[i]);
+    }
+}
+
+inline void storeRow(const int32_t* src, int32_t* dst, const int count) { std::copy_n(src, count, dst); }
+
+/// <summary>
+/// Converts an image between storage types (e.g. ImageFloat <-> Image<half>).
+/// </summary>
+template <typename Dst, typename Src>
+Image<Dst> convertImage(const ImageView<const Src> image)
+{
+    auto result = Image<Dst>::uninitialized(image.width, image.height);
+#pragma omp parallel num_threads(kernelThreads(image, KernelCost::Light))
+    {
+        std::vector<float> row(static_cast<size_t>(image.width));
+#pragma omp for
+        for (int y = 0; y < image.height; y++) {
+            loadRow(image.row(y), row.data(), image.width);
+            storeRow(row.data(), result.data.data() + size_t(y) * size_t(image.width), image.width);
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Gradient of a scalar image with dx/dy in a 16-bit (or float) storage type.
+/// </summary>
+template <typename S>
+struct ImageGradientStorage {
+    Image<S> dx;
+    Image<S> dy;
+};
+
+/// <summary> Half-precision gradient (half the traffic of ImageGradient). </summary>
+using ImageGradientHalf = ImageGradientStorage<half>;
+/// <summary> Half-precision gradient of a XYZ image. </summary>
+using ImageXYZGradientHalf = ImagePlane3<ImageGradientHalf>;
+/// <summary> Exact gradient of an 8-bit image in its levels (9 bits in 16-bit storage). </summary>
+using ImageGradientInt16 = ImageGradientStorage<int16_t>;
+
+#pragma endregion Half-precision storage
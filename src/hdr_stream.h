@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <filesystem>
+
+#include <framework/radiance_hdr.h>
+
+#include "helpers.h"
+
+/*
+ * Band-wise processing of Radiance HDR files that do not fit in memory.
+ *
+ * HdrBandReader yields consecutive bands of scanlines, each optionally extended by a halo of
+ * rows above and below, so neighborhood operators with a vertical radius (bilateral filter) can
+ * run on one band at a time; HdrBandWriter appends the finished rows to the output file.
+ * Only band_rows + 2 * halo_rows scanlines are ever resident: the halo rows shared by two
+ * consecutive bands are moved to the front of the window instead of being decoded again.
+ */
+
+#pragma region HDR streaming
+
+/// <summary>
+/// Reads a Radiance HDR file as consecutive bands of scanlines with a rolling halo window.
+/// </summary>
+class HdrBandReader {
+public:
+    /// <param name="filePath">Radiance .hdr file</param>
+    /// <param name="band_rows">number of rows produced per band (the last band may be shorter)</param>
+    /// <param name="halo_rows">rows of context above and below each band (clamped at the image border)</param>
+    HdrBandReader(const std::filesystem::path& filePath, const int band_rows, const int halo_rows = 0)
+        : m_reader(filePath)
+        , m_band_rows(band_rows)
+        , m_halo_rows(halo_rows)
+        , m_window(ImageRGB::uninitialized(m_reader.width(), std::min(band_rows + 2 * halo_rows, m_reader.height())))
+    {
+        assert(band_rows > 0 && halo_rows >= 0);
+        m_window.height = 0;
+    }
+
+    int width() const { return m_reader.width(); }
+    int height() const { return m_reader.height(); }
+
+    /// <summary>
+    /// Advances to the next band.
+    /// </summary>
+    /// <returns>false when all rows were produced</returns>
+    bool next()
+    {
+        const int band_begin = m_band_end;
+        if (band_begin >= height()) {
+            return false;
+        }
+        m_band_end = std::min(band_begin + m_band_rows, height());
+        const int window_begin = std::max(band_begin - m_halo_rows, 0);
+        const int window_end = std::min(m_band_end + m_halo_rows, height());
+
+        // Keep the rows of the previous window that overlap the new one.
+        const int old_end = m_window_begin + m_window.height;
+        const int kept_rows = std::max(old_end - window_begin, 0);
+        const size_t row_pixels = size_t(width());
+        std::copy(m_window.data.begin() + (old_end - kept_rows - m_window_begin) * row_pixels,
+            m_window.data.begin() + (old_end - m_window_begin) * row_pixels, m_window.data.begin());
+
+        m_window_begin = window_begin;
+        m_window.height = window_end - window_begin;
+        m_window.data.resize(size_t(m_window.height) * row_pixels); // Stays within the reserved capacity.
+        for (int y = window_begin + kept_rows; y < window_end; y++) {
+            static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+            if (!m_reader.readScanline(reinterpret_cast<float*>(m_window.data.data() + size_t(y - window_begin) * row_pixels))) {
+                std::cerr << "Failed to decode scanline " << y << " of a streamed HDR image" << std::endl;
+                throw std::exception();
+            }
+        }
+        m_band_begin = band_begin;
+        return true;
+    }
+
+    // Current band including its halo rows.
+    const ImageRGB& window() const { return m_window; }
+    // Image row of the first window row.
+    int windowBegin() const { return m_window_begin; }
+    // Image rows [bandBegin(), bandEnd()) produced by this band.
+    int bandBegin() const { return m_band_begin; }
+    int bandEnd() const { return m_band_end; }
+    // Window row of the first band row (halo rows above the band).
+    int haloTop() const { return m_band_begin - m_window_begin; }
+
+    // Rows of the current band without halo.
+    ImageView<const glm::vec3> band() const { return m_window.view(0, haloTop(), width(), m_band_end - m_band_begin); }
+
+private:
+    RadianceHdrReader m_reader;
+    int m_band_rows;
+    int m_halo_rows;
+    ImageRGB m_window;
+    int m_window_begin = 0;
+    int m_band_begin = 0;
+    int m_band_end = 0;
+};
+
+/// <summary>
+/// Writes a Radiance HDR file band by band, top to bottom.
+/// </summary>
+class HdrBandWriter {
+public:
+    HdrBandWriter(const std::filesystem::path& filePath, const int width, const int height)
+        : m_writer(filePath, width, height)
+    {
+    }
+
+    /// <summary>
+    /// Appends the rows of the band to the file.
+    /// </summary>
+    void write(const ImageView<const glm::vec3> band)
+    {
+        assert(band.width == m_writer.width());
+        for (int y = 0; y < band.height; y++) {
+            static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+            if (!m_writer.writeScanline(reinterpret_cast<const float*>(band.row(y)))) {
+                std::cerr << "Failed to write scanline " << m_writer.nextRow() << " of a streamed HDR image" << std::endl;
+                throw std::exception();
+            }
+        }
+    }
+
+    // True once all rows of the image were written.
+    bool isComplete() const { return m_writer.nextRow() == m_writer.height(); }
+
+private:
+    RadianceHdrWriter m_writer;
+};
+
+/// <summary>
+/// Streams a Radiance HDR file through an operator band by band and writes the result as Radiance HDR.
+/// func(window, halo_top, band_rows) receives a band with its halo rows and returns the band_rows
+/// output rows that start at window row halo_top (an ImageRGB of window.width x band_rows).
+/// With halo_rows >= the vertical radius of a local operator, the output equals the operator
+/// applied to the whole image, since the halo is clamped exactly like the image border.
+/// </summary>
+/// <param name="input_path">Radiance .hdr input</param>
+/// <param name="output_path">Radiance .hdr output</param>
+/// <param name="band_rows">rows per band, bounds the memory footprint</param>
+/// <param name="halo_rows">rows of context above and below each band</param>
+/// <param name="func">band operator</param>
+template <typename BandFunc>
+void processHdrInBands(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const int band_rows, const int halo_rows, BandFunc&& func)
+{
+    HdrBandReader reader(input_path, band_rows, halo_rows);
+    HdrBandWriter writer(output_path, reader.width(), reader.height());
+    while (reader.next()) {
+        const ImageRGB band_result = func(reader.window(), reader.haloTop(), reader.bandEnd() - reader.bandBegin());
+        writer.write(band_result.view());
+    }
+    assert(writer.isComplete());
+}
+
+#pragma endregion HDR streaming
@@ -29,6 +29,9 @@ DISABLE_WARNINGS_POP()
 
 #include <framework/image.h>
 
+#include "execution.h"
+#include "streaming_store.h"
+
 /// <summary>
 /// Structure of an image with 3 planes.
 /// </summary>
@@ -90,6 +93,25 @@ struct ImageGradient {
 /// <summary> Gradient of a XYZ image (contains one dxy-gradient image per channel) </summary>
 using ImageXYZGradient = ImagePlane3<ImageGradient>;
 
+/// <summary> Gradient of a scalar image with dx and dy of a pixel next to each other (x = dx, y = dy) </summary>
+struct ImageGradientInterleaved {
+    Image<glm::vec2> dxy;
+};
+
+/// <summary>
+/// Memory layout of a gradient: dx and dy in two planes (ImageGradient) or interleaved per pixel
+/// (ImageGradientInterleaved), which keeps both in one cache line for kernels reading both.
+/// The pipeline stores planar gradients; "--benchmark" times the kernels in both layouts.
+/// </summary>
+enum class GradientLayout {
+    Planar,
+    Interleaved,
+};
+
+/// <summary> Gradient image of a layout </summary>
+template <GradientLayout Layout>
+using ImageGradientOf = std::conditional_t<Layout == GradientLayout::Planar, ImageGradient, ImageGradientInterleaved>;
+
 
 
 
@@ -107,6 +129,18 @@ void printOpenMPStatus()
 #endif
 }
 
+/// <summary>
+/// gradientsToRgb() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void gradientsToRgb(const ImageGradient& gradient, ImageRGB& grad_rgb) {
+    const int width = grad_rgb.width;
+    parallelFor(0, grad_rgb.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            grad_rgb.data[i] = glm::abs(glm::vec3(gradient.dx.data[i], gradient.dy.data[i], 0.0f));
+        }
+    });
+}
+
 /// <summary>
 /// Converts gradients to RGB for visualization.
 /// Red channel = dX, Green  = dY, Blue = 0.
@@ -115,14 +149,41 @@ void printOpenMPStatus()
 /// <returns></returns>
 ImageRGB gradientsToRgb(const ImageGradient& gradient) {
     auto grad_rgb = ImageRGB(gradient.dx.width, gradient.dx.height);
-    #pragma omp parallel for
-    for (auto i = 0; i < grad_rgb.data.size(); i++) {
-        grad_rgb.data[i] = glm::abs(glm::vec3(gradient.dx.data[i], gradient.dy.data[i], 0.0f));
-    }
+    gradientsToRgb(gradient, grad_rgb);
+    return grad_rgb;
+}
+
+/// <summary>
+/// gradientsToRgb() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void gradientsToRgb(const ImageGradientInterleaved& gradient, ImageRGB& grad_rgb) {
+    const int width = grad_rgb.width;
+    parallelFor(0, grad_rgb.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            grad_rgb.data[i] = glm::abs(glm::vec3(gradient.dxy.data[i], 0.0f));
+        }
+    });
+}
+
+ImageRGB gradientsToRgb(const ImageGradientInterleaved& gradient) {
+    auto grad_rgb = ImageRGB(gradient.dxy.width, gradient.dxy.height);
+    gradientsToRgb(gradient, grad_rgb);
     return grad_rgb;
 }
 
 
+/// <summary>
+/// imageFloatToRgb() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void imageFloatToRgb(const ImageFloat& img, ImageRGB& result) {
+    const int width = img.width;
+    parallelFor(0, img.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            result.data[i] = glm::vec3(img.data[i], img.data[i], img.data[i]);
+        }
+    });
+}
+
 /// <summary>
 /// Converts float image to RGB by repeating the channel 3x.
 /// </summary>
@@ -130,13 +191,23 @@ ImageRGB gradientsToRgb(const ImageGradient& gradient) {
 /// <returns></returns>
 ImageRGB imageFloatToRgb(const ImageFloat& img) {
     auto result = ImageRGB(img.width, img.height);
-    #pragma omp parallel for
-    for (int i = 0; i < result.data.size(); i++) {
-        result.data[i] = glm::vec3(img.data[i], img.data[i], img.data[i]);
-    }
+    imageFloatToRgb(img, result);
     return result;
 }
 
+/// <summary>
+/// imageRgbToFloat() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void imageRgbToFloat(const ImageRGB& img, ImageFloat& result)
+{
+    const int width = img.width;
+    parallelFor(0, img.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            result.data[i] = img.data[i].x;
+        }
+    });
+}
+
 /// <summary>
 /// Converts RGB image to float by selecting the Red channel.
 /// </summary>
@@ -145,10 +216,7 @@ ImageRGB imageFloatToRgb(const ImageFloat& img) {
 ImageFloat imageRgbToFloat(const ImageRGB& img)
 {
     auto result = ImageFloat(img.width, img.height);
-#pragma omp parallel for
-    for (int i = 0; i < result.data.size(); i++) {
-        result.data[i] = img.data[i].x;
-    }
+    imageRgbToFloat(img, result);
     return result;
 }
 
@@ -162,10 +230,12 @@ ImageFloat imageRgbToFloat(const ImageRGB& img)
 ImageFloat logImage(const ImageFloat& image)
 {
     auto result = ImageFloat(image.width, image.height);
-#pragma omp parallel for
-    for (int i = 0; i < image.data.size(); i++) {
-        result.data[i] = logf(std::max(image.data[i], 1e-8f));
-    }
+    const int width = image.width;
+    parallelFor(0, image.height, width, KernelCost::Medium, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            result.data[i] = logf(std::max(image.data[i], 1e-8f));
+        }
+    });
     return result;
 }
 
@@ -179,12 +249,22 @@ ImageFloat logImage(const ImageFloat& image)
 /// <returns></returns>
 ImageFloat getDetailImage(const ImageFloat& H, const ImageFloat& base)
 {
-    // Empty output image.
-    auto result = ImageFloat(H.width, H.height);
-#pragma omp parallel for
-    for (int i = 0; i < result.data.size(); i++) {
-        result.data[i] = H.data[i] - base.data[i];
-    }
+    // Every pixel is written below; a large output is streamed, see streaming_store.h.
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+    const int width = H.width;
+    const bool streaming = useStreamingStores(int64_t(result.data.size() * sizeof(float)));
+    parallelFor(0, H.height, width, KernelCost::Light, [&](const int y) {
+        const size_t row = size_t(y) * size_t(width);
+        if (streaming && y + 1 < H.height) {
+            prefetchRow(H.data.data() + row + size_t(width), size_t(width) * sizeof(float));
+            prefetchRow(base.data.data() + row + size_t(width), size_t(width) * sizeof(float));
+        }
+        const StreamingRow<float> out(result.data.data() + row, width, streaming);
+        for (int x = 0; x < width; x++) {
+            out.data()[x] = H.data[row + size_t(x)] - base.data[row + size_t(x)];
+        }
+        out.commit();
+    });
     return result;
 }
 
@@ -195,6 +275,36 @@ Unused code.
 */
 
 
+/// <summary>
+/// rgbToXYZ() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void rgbToXYZ(const ImageRGB& rgb, ImageXYZ& xyz)
+{
+    const auto MAT_RGB_TO_XYZ = glm::transpose(glm::mat3(0.49f, 0.31f, 0.2f, 0.17697f, 0.8124f, 0.01063f, 0.0f, 0.01f, 0.99000f));
+
+    const int width = rgb.width;
+    // Three large planes are streamed, see streaming_store.h.
+    const bool streaming = useStreamingStores(int64_t(rgb.data.size() * 3 * sizeof(float)));
+    parallelFor(0, rgb.height, width, KernelCost::Light, [&](const int y) {
+        const size_t row = size_t(y) * size_t(width);
+        if (streaming && y + 1 < rgb.height) {
+            prefetchRow(rgb.data.data() + row + size_t(width), size_t(width) * sizeof(glm::vec3));
+        }
+        const StreamingRow<float> x_out(xyz.X.data.data() + row, width, streaming);
+        const StreamingRow<float> y_out(xyz.Y.data.data() + row, width, streaming);
+        const StreamingRow<float> z_out(xyz.Z.data.data() + row, width, streaming);
+        for (int x = 0; x < width; x++) {
+            auto v = MAT_RGB_TO_XYZ * rgb.data[row + size_t(x)];
+            x_out.data()[x] = v.x;
+            y_out.data()[x] = v.y;
+            z_out.data()[x] = v.z;
+        }
+        x_out.commit();
+        y_out.commit();
+        z_out.commit();
+    });
+}
+
 /// <summary>
 /// https://en.wikipedia.org/wiki/CIE_1931_color_space
 /// </summary>
@@ -202,19 +312,28 @@ Unused code.
 /// <returns></returns>
 ImageXYZ rgbToXYZ(const ImageRGB& rgb)
 {
-    auto xyz = ImageXYZ(ImageFloat(rgb.width, rgb.height), ImageFloat(rgb.width, rgb.height), ImageFloat(rgb.width, rgb.height));
+    // Every pixel is written by rgbToXYZ().
+    auto xyz = ImageXYZ(ImageFloat::uninitialized(rgb.width, rgb.height), ImageFloat::uninitialized(rgb.width, rgb.height), ImageFloat::uninitialized(rgb.width, rgb.height));
+    rgbToXYZ(rgb, xyz);
+    return xyz;
+}
 
+/// <summary>
+/// xyzToRGB() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void xyzToRGB(const ImageXYZ& xyz, ImageRGB& rgb)
+{
     const auto MAT_RGB_TO_XYZ = glm::transpose(glm::mat3(0.49f, 0.31f, 0.2f, 0.17697f, 0.8124f, 0.01063f, 0.0f, 0.01f, 0.99000f));
-
-#pragma omp parallel for
-    for (int i = 0; i < rgb.data.size(); i++) {
-        auto v = MAT_RGB_TO_XYZ * rgb.data[i];
-        xyz.X.data[i] = v.x;
-        xyz.Y.data[i] = v.y;
-        xyz.Z.data[i] = v.z;
-    }
-
-    return xyz;
+    // Inverted once, not on every call.
+    static const auto MAT_XYZ_TO_RGB = glm::inverse(MAT_RGB_TO_XYZ);
+
+    const int width = xyz.X.width;
+    parallelFor(0, xyz.X.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            auto v = glm::vec3(xyz.X.data[i], xyz.Y.data[i], xyz.Z.data[i]);
+            rgb.data[i] = MAT_XYZ_TO_RGB * v;
+        }
+    });
 }
 
 /// <summary>
@@ -225,21 +344,26 @@ ImageXYZ rgbToXYZ(const ImageRGB& rgb)
 ImageRGB xyzToRGB(const ImageXYZ& xyz)
 {
     auto rgb = ImageRGB(xyz.X.width, xyz.X.height);
-
-    const auto MAT_RGB_TO_XYZ = glm::transpose(glm::mat3(0.49f, 0.31f, 0.2f, 0.17697f, 0.8124f, 0.01063f, 0.0f, 0.01f, 0.99000f));
-    const auto MAT_XYZ_TO_RGB = glm::inverse(MAT_RGB_TO_XYZ);
-
-#pragma omp parallel for
-    for (int i = 0; i < xyz.X.data.size(); i++) {
-        auto v = glm::vec3(xyz.X.data[i], xyz.Y.data[i], xyz.Z.data[i]);
-        auto xyz = MAT_XYZ_TO_RGB * v;
-        rgb.data[i] = xyz;
-    }
-
+    xyzToRGB(xyz, rgb);
     return rgb;
 }
 
 
+/// <summary>
+/// imageVec3ToPlane3() into a caller-provided image of the same size, also as a stage of runKernelTeam().
+/// </summary>
+void imageVec3ToPlane3(const ImageVec3& image, ImageFloatPlane3& result)
+{
+    const int width = image.width;
+    parallelFor(0, image.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            for (auto j = 0; j < 3; j++) {
+                result[j].data[i] = image.data[i][j];
+            }
+        }
+    });
+}
+
 /// <summary>
 /// Switches from Attribute layout to Plane layout.
 /// </summary>
@@ -248,29 +372,34 @@ ImageRGB xyzToRGB(const ImageXYZ& xyz)
 ImageFloatPlane3 imageVec3ToPlane3(const ImageVec3& image)
 {
     auto result = ImageFloatPlane3({ image.width, image.height }, { image.width, image.height }, { image.width, image.height });
-#pragma omp parallel for
-    for (int i = 0; i < image.data.size(); i++) {
-        for (auto j = 0; j < 3; j++) {
-            result[j].data[i] = image.data[i][j];
-        }
-    }
+    imageVec3ToPlane3(image, result);
     return result;
 }
 
 /// <summary>
-/// Switches from Attribute layout to Plane layout.
+/// imagePlane3ToVec3() into a caller-provided image of the same size, also as a stage of runKernelTeam().
 /// </summary>
-/// <param name="image">image in attribute order</param>
-/// <returns>image in plane order</returns>
+void imagePlane3ToVec3(const ImageFloatPlane3& image, ImageVec3& result)
+{
+    const int width = image.X.width;
+    parallelFor(0, image.X.height, width, KernelCost::Light, [&](const int y) {
+        for (int i = y * width; i < (y + 1) * width; i++) {
+            for (auto j = 0; j < 3; j++) {
+                result.data[i][j] = image[j].data[i];
+            }
+        }
+    });
+}
+
+/// <summary>
+/// Switches from Plane layout to Attribute layout.
+/// </summary>
+/// <param name="image">image in plane order</param>
+/// <returns>image in attribute order</returns>
 ImageVec3 imagePlane3ToVec3(const ImageFloatPlane3& image)
 {
     auto result = ImageVec3(image.X.width, image.X.height);
-#pragma omp parallel for
-    for (int i = 0; i < image.X.data.size(); i++) {
-        for (auto j = 0; j < 3; j++) {
-            result.data[i][j] = image[j].data[i];
-        }
-    }
+    imagePlane3ToVec3(image, result);
     return result;
 }
 
@@ -0,0 +1,307 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <concepts>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include "helpers.h"
+
+/*
+ * Expression templates for per-pixel image algebra.
+ *
+ * Arithmetic on images and scalars builds an expression type instead of an image:
+ *
+ *     const auto detail = evaluate(H - base);
+ *     const auto tmo = evaluate(exp(base * base_scale + (H - base)) * output_gain);
+ *
+ * Nothing is computed until evaluate() (or evaluateInto() for a caller-provided buffer), which
+ * runs the whole expression in one parallel loop over rows with a vectorizable inner loop, so
+ * a chain of operations reads its inputs once and writes one image, without temporaries.
+ *
+ * Operands are Image<T>, ImageView<T>, scalars and other expressions; images of one expression
+ * must have the same size. Expressions keep views of their images, so they are meant to be
+ * evaluated in the statement that builds them: an expression stored in a variable must not
+ * outlive its images. exp, log, pow, min, max, clamp and abs also apply to expressions; for RGB
+ * images they act per channel.
+ */
+
+#pragma region Image expressions
+
+namespace image_expr {
+
+/// <summary>
+/// Marker base of all expression nodes.
+/// </summary>
+struct ExprBase {
+};
+
+template <typename E>
+concept Expr = std::derived_from<E, ExprBase>;
+
+/// <summary>
+/// Leaf: pixels of an image or view.
+/// </summary>
+template <typename T>
+struct ImageLeaf : ExprBase {
+    using value_type = T;
+    ImageView<const T> view;
+
+    int width() const { return view.width; }
+    int height() const { return view.height; }
+    T at(const int x, const int y) const { return view.row(y)[x]; }
+};
+
+/// <summary>
+/// Leaf: one value for every pixel.
+/// </summary>
+struct ScalarLeaf : ExprBase {
+    using value_type = float;
+    float value;
+
+    int width() const { return 0; }
+    int height() const { return 0; }
+    float at(const int, const int) const { return value; }
+};
+
+template <typename Op, Expr A>
+struct UnaryNode : ExprBase {
+    using value_type = std::decay_t<decltype(std::declval<Op>()(std::declval<typename A::value_type>()))>;
+    Op op;
+    A a;
+
+    int width() const { return a.width(); }
+    int height() const { return a.height(); }
+    value_type at(const int x, const int y) const { return op(a.at(x, y)); }
+};
+
+template <typename Op, Expr A, Expr B>
+struct BinaryNode : ExprBase {
+    using value_type = std::decay_t<decltype(std::declval<Op>()(std::declval<typename A::value_type>(), std::declval<typename B::value_type>()))>;
+    Op op;
+    A a;
+    B b;
+
+    // Scalars have size 0, the size comes from the image side.
+    int width() const { return std::max(a.width(), b.width()); }
+    int height() const { return std::max(a.height(), b.height()); }
+    value_type at(const int x, const int y) const { return op(a.at(x, y), b.at(x, y)); }
+};
+
+// Operands of the operators: expressions, images, views and arithmetic scalars.
+template <typename T>
+struct IsImageOperand : std::false_type {
+};
+template <typename T>
+struct IsImageOperand<Image<T>> : std::true_type {
+};
+template <typename T>
+struct IsImageOperand<ImageView<T>> : std::true_type {
+};
+
+template <typename X>
+concept ImageOperand = Expr<X> || IsImageOperand<std::decay_t<X>>::value;
+
+template <typename X>
+concept Operand = ImageOperand<X> || std::is_arithmetic_v<std::decay_t<X>>;
+
+/// <summary>
+/// Expression node of an operand.
+/// </summary>
+template <Expr E>
+const E& leaf(const E& expr)
+{
+    return expr;
+}
+template <typename T>
+ImageLeaf<T> leaf(const Image<T>& image)
+{
+    return { {}, ImageView<const T>(image) };
+}
+template <typename T>
+ImageLeaf<std::remove_const_t<T>> leaf(const ImageView<T>& view)
+{
+    return { {}, ImageView<const std::remove_const_t<T>>(view) };
+}
+template <typename S>
+    requires std::is_arithmetic_v<S>
+ScalarLeaf leaf(const S value)
+{
+    return { {}, float(value) };
+}
+
+template <typename Op, Operand A>
+auto makeUnary(const Op& op, const A& a)
+{
+    auto leaf_a = leaf(a);
+    return UnaryNode<Op, std::decay_t<decltype(leaf_a)>> { {}, op, leaf_a };
+}
+
+template <typename Op, Operand A, Operand B>
+auto makeBinary(const Op& op, const A& a, const B& b)
+{
+    auto leaf_a = leaf(a);
+    auto leaf_b = leaf(b);
+    return BinaryNode<Op, std::decay_t<decltype(leaf_a)>, std::decay_t<decltype(leaf_b)>> { {}, op, leaf_a, leaf_b };
+}
+
+// Per-channel functions of float and glm::vec3 values.
+struct Exp {
+    template <typename V>
+    V operator()(const V& v) const
+    {
+        if constexpr (std::is_same_v<V, float>) {
+            return std::exp(v);
+        } else {
+            return glm::exp(v);
+        }
+    }
+};
+struct Log {
+    template <typename V>
+    V operator()(const V& v) const
+    {
+        if constexpr (std::is_same_v<V, float>) {
+            return std::log(v);
+        } else {
+            return glm::log(v);
+        }
+    }
+};
+struct Abs {
+    template <typename V>
+    V operator()(const V& v) const
+    {
+        if constexpr (std::is_same_v<V, float>) {
+            return std::abs(v);
+        } else {
+            return glm::abs(v);
+        }
+    }
+};
+struct Pow {
+    template <typename V, typename W>
+    auto operator()(const V& v, const W& w) const
+    {
+        if constexpr (std::is_same_v<V, float> && std::is_same_v<W, float>) {
+            return std::pow(v, w);
+        } else {
+            return glm::pow(v, V(w));
+        }
+    }
+};
+struct Min {
+    template <typename V, typename W>
+    auto operator()(const V& v, const W& w) const
+    {
+        if constexpr (std::is_same_v<V, float> && std::is_same_v<W, float>) {
+            return std::min(v, w);
+        } else {
+            return glm::min(v, w);
+        }
+    }
+};
+struct Max {
+    template <typename V, typename W>
+    auto operator()(const V& v, const W& w) const
+    {
+        if constexpr (std::is_same_v<V, float> && std::is_same_v<W, float>) {
+            return std::max(v, w);
+        } else {
+            return glm::max(v, w);
+        }
+    }
+};
+
+} // namespace image_expr
+
+// Operators, found for images through the concepts (at least one side is an image operand).
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto operator+(const A& a, const B& b) { return image_expr::makeBinary(std::plus<> {}, a, b); }
+
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto operator-(const A& a, const B& b) { return image_expr::makeBinary(std::minus<> {}, a, b); }
+
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto operator*(const A& a, const B& b) { return image_expr::makeBinary(std::multiplies<> {}, a, b); }
+
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto operator/(const A& a, const B& b) { return image_expr::makeBinary(std::divides<> {}, a, b); }
+
+template <image_expr::ImageOperand A>
+auto operator-(const A& a) { return image_expr::makeUnary(std::negate<> {}, a); }
+
+template <image_expr::ImageOperand A>
+auto exp(const A& a) { return image_expr::makeUnary(image_expr::Exp {}, a); }
+
+template <image_expr::ImageOperand A>
+auto log(const A& a) { return image_expr::makeUnary(image_expr::Log {}, a); }
+
+template <image_expr::ImageOperand A>
+auto abs(const A& a) { return image_expr::makeUnary(image_expr::Abs {}, a); }
+
+template <image_expr::ImageOperand A, image_expr::Operand B>
+auto pow(const A& a, const B& b) { return image_expr::makeBinary(image_expr::Pow {}, a, b); }
+
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto min(const A& a, const B& b) { return image_expr::makeBinary(image_expr::Min {}, a, b); }
+
+template <image_expr::Operand A, image_expr::Operand B>
+    requires(image_expr::ImageOperand<A> || image_expr::ImageOperand<B>)
+auto max(const A& a, const B& b) { return image_expr::makeBinary(image_expr::Max {}, a, b); }
+
+template <image_expr::ImageOperand A>
+auto clamp(const A& a, const float lo, const float hi) { return min(max(a, lo), hi); }
+
+/// <summary>
+/// Evaluates an expression into a caller-provided buffer of its size, in one parallel pass.
+/// result may be one of the images of the expression when every pixel only reads its own
+/// position (all expressions do).
+/// </summary>
+/// <param name="operand">expression or image</param>
+/// <param name="result">output buffer</param>
+template <image_expr::ImageOperand X, typename T>
+void evaluateInto(const X& operand, const ImageView<T> result)
+{
+    const auto& expr = image_expr::leaf(operand);
+    assert(expr.width() == result.width && expr.height() == result.height);
+    parallelFor(0, result.height, result.width, KernelCost::Medium, [&](const int y) {
+        T* out = result.row(y);
+#pragma omp simd
+        for (int x = 0; x < result.width; x++) {
+            out[x] = T(expr.at(x, y));
+        }
+    });
+}
+
+/// <summary>
+/// evaluateInto() a whole image.
+/// </summary>
+template <image_expr::ImageOperand X, typename T>
+void evaluateInto(const X& operand, Image<T>& result)
+{
+    evaluateInto(operand, result.view());
+}
+
+/// <summary>
+/// Evaluates an expression into a new image, in one parallel pass.
+/// </summary>
+/// <param name="operand">expression or image</param>
+/// <returns>image of the value type of the expression</returns>
+template <image_expr::ImageOperand X>
+auto evaluate(const X& operand)
+{
+    const auto& expr = image_expr::leaf(operand);
+    using T = typename std::decay_t<decltype(expr)>::value_type;
+    auto result = Image<T>::uninitialized(expr.width(), expr.height());
+    evaluateInto(expr, result.view());
+    return result;
+}
+
+#pragma endregion Image expressions
@@ -0,0 +1,203 @@
+#pragma once
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Gaussian and Laplacian image pyramids (Burt and Adelson).
+ *
+ * Each level has (w + 1) / 2 x (h + 1) / 2 pixels, and coarse pixel (i, j) lies on fine pixel
+ * (2i, 2j). pyramidDown() blurs with the separable binomial kernel [1 4 6 4 1] / 16 and keeps
+ * every second pixel; pyramidUpAdd() interpolates with the same kernel (times 2 per axis, so
+ * even fine pixels take [1 6 1] / 8 and odd ones [1 1] / 2 of their coarse neighbours). Borders
+ * are clamped. Both are parallel over output rows, with one row of the separable pass per thread.
+ *
+ * The pyramids live in a std::vector<Image<T>> of the caller: levels of the right size are
+ * reused, so an operator that builds many pyramids of one image size (local Laplacian filter,
+ * progressive previews) allocates its levels once. New levels draw from the image memory pool
+ * like every other image. A Laplacian pyramid is built in place over the Gaussian one and
+ * collapses in place into level 0. T is float or glm::vec3.
+ */
+
+#pragma region Image pyramid
+
+/// <summary>
+/// Size of the next coarser pyramid level.
+/// </summary>
+inline std::pair<int, int> pyramidCoarseSize(const int width, const int height)
+{
+    return { (width + 1) / 2, (height + 1) / 2 };
+}
+
+/// <summary>
+/// Number of levels (including the full resolution) until a side would drop below min_size.
+/// </summary>
+/// <param name="width">image width</param>
+/// <param name="height">image height</param>
+/// <param name="min_size">minimum side of the coarsest level</param>
+/// <param name="max_levels">upper bound of the result, values <= 0 for none</param>
+/// <returns>at least 1</returns>
+inline int pyramidDepth(int width, int height, const int min_size, const int max_levels = 0)
+{
+    int levels = 1;
+    while (max_levels <= 0 || levels < max_levels) {
+        const auto [coarse_w, coarse_h] = pyramidCoarseSize(width, height);
+        if (std::min(coarse_w, coarse_h) < min_size || (coarse_w == width && coarse_h == height)) {
+            break;
+        }
+        width = coarse_w;
+        height = coarse_h;
+        levels++;
+    }
+    return levels;
+}
+
+/// <summary>
+/// Blurs and decimates fine into coarse, which has the pyramidCoarseSize() of fine.
+/// </summary>
+/// <param name="fine">input level</param>
+/// <param name="coarse">output level</param>
+template <typename T>
+void pyramidDown(const ImageView<const T> fine, const ImageView<T> coarse)
+{
+    assert(coarse.width == (fine.width + 1) / 2 && coarse.height == (fine.height + 1) / 2);
+    constexpr float weights[5] = { 1.0f / 16.0f, 4.0f / 16.0f, 6.0f / 16.0f, 4.0f / 16.0f, 1.0f / 16.0f };
+#pragma omp parallel num_threads(kernelThreads(fine, KernelCost::Medium))
+    {
+        // Vertical pass of the five fine rows around the coarse row.
+        std::vector<T> column_sums(static_cast<size_t>(fine.width));
+#pragma omp for
+        for (int j = 0; j < coarse.height; j++) {
+            const T* rows[5];
+            for (int k = 0; k < 5; k++) {
+                rows[k] = fine.row(std::clamp(2 * j + k - 2, 0, fine.height - 1));
+            }
+            for (int x = 0; x < fine.width; x++) {
+                column_sums[x] = weights[0] * rows[0][x] + weights[1] * rows[1][x] + weights[2] * rows[2][x] + weights[3] * rows[3][x] + weights[4] * rows[4][x];
+            }
+            T* out = coarse.row(j);
+            for (int i = 0; i < coarse.width; i++) {
+                T sum = weights[2] * column_sums[2 * i];
+                for (int k = 1; k <= 2; k++) {
+                    sum += weights[2 - k] * column_sums[std::max(2 * i - k, 0)] + weights[2 + k] * column_sums[std::min(2 * i + k, fine.width - 1)];
+                }
+                out[i] = sum;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Adds scale times the interpolated coarse level to fine, whose pyramidCoarseSize() is the
+/// coarse size. Scale -1 turns a Gaussian level into a Laplacian one, 1 reverses it.
+/// </summary>
+/// <param name="coarse">coarser level</param>
+/// <param name="fine">level to update</param>
+/// <param name="scale">factor of the interpolated values</param>
+template <typename T>
+void pyramidUpAdd(const ImageView<const T> coarse, const ImageView<T> fine, const float scale = 1.0f)
+{
+    assert(coarse.width == (fine.width + 1) / 2 && coarse.height == (fine.height + 1) / 2);
+#pragma omp parallel num_threads(kernelThreads(fine, KernelCost::Medium))
+    {
+        // Vertical interpolation of the coarse rows around the fine row.
+        std::vector<T> row(static_cast<size_t>(coarse.width));
+#pragma omp for
+        for (int y = 0; y < fine.height; y++) {
+            const int j = y / 2;
+            const T* center = coarse.row(j);
+            const T* below = coarse.row(std::min(j + 1, coarse.height - 1));
+            if (y % 2 == 0) {
+                const T* above = coarse.row(std::max(j - 1, 0));
+                for (int i = 0; i < coarse.width; i++) {
+                    row[i] = scale * (0.125f * above[i] + 0.75f * center[i] + 0.125f * below[i]);
+                }
+            } else {
+                for (int i = 0; i < coarse.width; i++) {
+                    row[i] = scale * (0.5f * center[i] + 0.5f * below[i]);
+                }
+            }
+            T* out = fine.row(y);
+            for (int x = 0; x < fine.width; x++) {
+                const int i = x / 2;
+                const T& right = row[std::min(i + 1, coarse.width - 1)];
+                if (x % 2 == 0) {
+                    out[x] += 0.125f * row[std::max(i - 1, 0)] + 0.75f * row[i] + 0.125f * right;
+                } else {
+                    out[x] += 0.5f * row[i] + 0.5f * right;
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Resizes pyramid to the levels of a width x height image, keeping levels that already have
+/// their size.
+/// </summary>
+template <typename T>
+void resizePyramid(std::vector<Image<T>>& pyramid, int width, int height, const int levels)
+{
+    pyramid.resize(size_t(std::max(levels, 1)));
+    for (auto& level : pyramid) {
+        if (level.width != width || level.height != height) {
+            level = Image<T>::uninitialized(width, height);
+        }
+        std::tie(width, height) = pyramidCoarseSize(width, height);
+    }
+}
+
+/// <summary>
+/// Gaussian pyramid of an image: level 0 is a copy, level l + 1 is pyramidDown() of level l.
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="levels">number of levels, see pyramidDepth()</param>
+/// <param name="pyramid">levels, reused where their size matches</param>
+template <typename T>
+void buildGaussianPyramid(const ImageView<const T> image, const int levels, std::vector<Image<T>>& pyramid)
+{
+    resizePyramid(pyramid, image.width, image.height, levels);
+    auto& base = pyramid[0];
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        std::copy(image.row(y), image.row(y) + image.width, base.data.data() + size_t(y) * size_t(image.width));
+    }
+    for (size_t l = 1; l < pyramid.size(); l++) {
+        pyramidDown<T>(pyramid[l - 1], pyramid[l]);
+    }
+}
+
+/// <summary>
+/// Laplacian pyramid of an image: level l is Gaussian level l minus the interpolated level
+/// l + 1, the last level is the coarsest Gaussian level (the residual).
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="levels">number of levels, see pyramidDepth()</param>
+/// <param name="pyramid">levels, reused where their size matches</param>
+template <typename T>
+void buildLaplacianPyramid(const ImageView<const T> image, const int levels, std::vector<Image<T>>& pyramid)
+{
+    buildGaussianPyramid(image, levels, pyramid);
+    // Fine to coarse, level l + 1 still holds the Gaussian level.
+    for (size_t l = 0; l + 1 < pyramid.size(); l++) {
+        pyramidUpAdd<T>(pyramid[l + 1], pyramid[l], -1.0f);
+    }
+}
+
+/// <summary>
+/// Collapses a Laplacian pyramid in place, coarse to fine. Level 0 becomes the image; the other
+/// levels hold the Gaussian levels of the result.
+/// </summary>
+/// <param name="pyramid">Laplacian pyramid</param>
+template <typename T>
+void collapseLaplacianPyramid(std::vector<Image<T>>& pyramid)
+{
+    for (size_t l = pyramid.size(); l-- > 1;) {
+        pyramidUpAdd<T>(pyramid[l], pyramid[l - 1]);
+    }
+}
+
+#pragma endregion Image pyramid
@@ -0,0 +1,444 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "execution.h"
+#include "helpers.h"
+
+/*
+ * Image quality metrics of a result against a reference render: PSNR, SSIM and CIE delta E.
+ *
+ * The kernels read Image<T> views (float or RGB) in place, run on kernelThreads() threads with
+ * vectorized inner loops (omp simd over the values of a row), and sum in double precision
+ * through reproducibleSum(), so a metric is the same for any thread count.
+ *
+ *  - meanSquaredError() / psnr(): over all channels, peak 1 for display images.
+ *  - ssim(): mean SSIM (Wang, Bovik, Sheikh and Simoncelli 2004) with the usual 11x11 Gaussian
+ *    window of sigma 1.5, K1 = 0.01 and K2 = 0.03, averaged over the channels. The five local
+ *    moments are filtered separably: every band of SSIM_BAND rows keeps the horizontally
+ *    filtered rows in a ring of 11 rows and filters down the columns, so no moment image is
+ *    stored. Rows and columns are clamped at the borders.
+ *  - deltaE(): per-pixel CIE76 or CIEDE2000 difference of display RGB (sRGB-encoded values in
+ *    [0, 1], as written to 8- and 16-bit files), through linear sRGB, XYZ (D65) and L*a*b*.
+ *    Mean, maximum and share of pixels above a threshold.
+ *
+ * compareImages() computes all of them for one pair, runImageComparison() is the --compare mode
+ * (files or directories of files against their references).
+ */
+
+#pragma region Image quality
+
+/// <summary>
+/// Rows per band of the SSIM filter, a fixed partition of the sums.
+/// </summary>
+constexpr int SSIM_BAND = 64;
+constexpr int SSIM_RADIUS = 5;
+constexpr float SSIM_SIGMA = 1.5f;
+
+enum class DeltaEFormula {
+    Cie76,
+    Ciede2000,
+};
+
+/// <summary>
+/// Delta E formula by name: cie76 or ciede2000.
+/// </summary>
+DeltaEFormula parseDeltaEFormula(const std::string& name)
+{
+    if (name == "cie76") {
+        return DeltaEFormula::Cie76;
+    } else if (name == "ciede2000") {
+        return DeltaEFormula::Ciede2000;
+    }
+    std::cerr << "Unknown delta E formula: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Statistics of the per-pixel color difference.
+/// </summary>
+struct ColorDifference {
+    double mean = 0.0;
+    double max = 0.0;
+    // Share of the pixels with a difference above the threshold of deltaE().
+    double above_threshold = 0.0;
+};
+
+/// <summary>
+/// All metrics of a pair, see compareImages().
+/// </summary>
+struct ImageQuality {
+    // Infinity for identical images.
+    double psnr = std::numeric_limits<double>::infinity();
+    double ssim = 1.0;
+    ColorDifference delta_e;
+};
+
+/// <summary>
+/// Limits of --compare; a pair fails when a metric is outside.
+/// </summary>
+struct QualityThresholds {
+    double min_psnr = 0.0;
+    double min_ssim = -1.0;
+    // Limit of the mean delta E.
+    double max_delta_e = std::numeric_limits<double>::infinity();
+    DeltaEFormula formula = DeltaEFormula::Ciede2000;
+    // Delta E counted in ColorDifference::above_threshold (about one just noticeable difference).
+    double delta_e_threshold = 1.0;
+};
+
+namespace image_quality {
+
+template <typename T>
+constexpr int channelsOf() { return int(sizeof(T) / sizeof(float)); }
+
+template <typename T>
+const float* rowValues(const ImageView<const T> image, const int y) { return reinterpret_cast<const float*>(image.row(y)); }
+
+template <typename T>
+void checkSameSize(const ImageView<const T> reference, const ImageView<const T> test)
+{
+    if (reference.width != test.width || reference.height != test.height) {
+        std::cerr << "Compared images differ in size: " << reference.width << "x" << reference.height << " and " << test.width << "x" << test.height << "."
+                  << std::endl;
+        throw std::exception();
+    }
+}
+
+// Linear sRGB (D65) to CIE L*a*b*.
+inline glm::vec3 linearSrgbToLab(const glm::vec3 rgb)
+{
+    const float x = (0.4124564f * rgb.r + 0.3575761f * rgb.g + 0.1804375f * rgb.b) / 0.95047f;
+    const float y = 0.2126729f * rgb.r + 0.7151522f * rgb.g + 0.0721750f * rgb.b;
+    const float z = (0.0193339f * rgb.r + 0.1191920f * rgb.g + 0.9503041f * rgb.b) / 1.08883f;
+    const auto f = [](const float t) { return t > 0.008856452f ? std::cbrt(t) : t * 7.787037f + 4.0f / 29.0f; };
+    const float fx = f(x), fy = f(y), fz = f(z);
+    return { 116.0f * fy - 16.0f, 500.0f * (fx - fy), 200.0f * (fy - fz) };
+}
+
+inline float srgbDecode(const float value)
+{
+    const float v = std::clamp(value, 0.0f, 1.0f);
+    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+// CIEDE2000 of two L*a*b* colors (Sharma, Wu and Dalal 2005).
+inline double ciede2000(const glm::vec3 lab1, const glm::vec3 lab2)
+{
+    constexpr double pi = 3.14159265358979323846;
+    constexpr double deg = pi / 180.0;
+    constexpr double pow25_7 = 6103515625.0;
+    const double c1 = std::hypot(double(lab1.y), double(lab1.z));
+    const double c2 = std::hypot(double(lab2.y), double(lab2.z));
+    const double c_mean7 = std::pow((c1 + c2) / 2.0, 7.0);
+    const double g = 0.5 * (1.0 - std::sqrt(c_mean7 / (c_mean7 + pow25_7)));
+    const double a1 = (1.0 + g) * lab1.y, a2 = (1.0 + g) * lab2.y;
+    const double c1p = std::hypot(a1, double(lab1.z)), c2p = std::hypot(a2, double(lab2.z));
+    const auto hue = [&](const double b, const double a) {
+        if (a == 0.0 && b == 0.0) {
+            return 0.0;
+        }
+        const double h = std::atan2(b, a) / deg;
+        return h < 0.0 ? h + 360.0 : h;
+    };
+    const double h1 = hue(lab1.z, a1), h2 = hue(lab2.z, a2);
+
+    const double dl = double(lab2.x) - double(lab1.x);
+    const double dc = c2p - c1p;
+    double dh = 0.0;
+    if (c1p * c2p != 0.0) {
+        dh = h2 - h1;
+        dh += dh > 180.0 ? -360.0 : dh < -180.0 ? 360.0 : 0.0;
+    }
+    const double dh_big = 2.0 * std::sqrt(c1p * c2p) * std::sin(dh * deg / 2.0);
+
+    const double l_mean = (double(lab1.x) + double(lab2.x)) / 2.0;
+    const double cp_mean = (c1p + c2p) / 2.0;
+    double h_mean = h1 + h2;
+    if (c1p * c2p != 0.0) {
+        h_mean = std::abs(h1 - h2) <= 180.0 ? (h1 + h2) / 2.0 : h1 + h2 < 360.0 ? (h1 + h2 + 360.0) / 2.0 : (h1 + h2 - 360.0) / 2.0;
+    }
+    const double t = 1.0 - 0.17 * std::cos((h_mean - 30.0) * deg) + 0.24 * std::cos(2.0 * h_mean * deg) + 0.32 * std::cos((3.0 * h_mean + 6.0) * deg)
+        - 0.20 * std::cos((4.0 * h_mean - 63.0) * deg);
+    const double d_theta = 30.0 * std::exp(-std::pow((h_mean - 275.0) / 25.0, 2.0));
+    const double cp_mean7 = std::pow(cp_mean, 7.0);
+    const double rc = 2.0 * std::sqrt(cp_mean7 / (cp_mean7 + pow25_7));
+    const double l50 = (l_mean - 50.0) * (l_mean - 50.0);
+    const double sl = 1.0 + 0.015 * l50 / std::sqrt(20.0 + l50);
+    const double sc = 1.0 + 0.045 * cp_mean;
+    const double sh = 1.0 + 0.015 * cp_mean * t;
+    const double rt = -std::sin(2.0 * d_theta * deg) * rc;
+    const double tl = dl / sl, tc = dc / sc, th = dh_big / sh;
+    return std::sqrt(std::max(tl * tl + tc * tc + th * th + rt * tc * th, 0.0));
+}
+
+// Normalized taps of the SSIM window.
+inline std::array<float, 2 * SSIM_RADIUS + 1> ssimWindow()
+{
+    std::array<float, 2 * SSIM_RADIUS + 1> taps;
+    float total = 0.0f;
+    for (int k = -SSIM_RADIUS; k <= SSIM_RADIUS; k++) {
+        taps[size_t(k + SSIM_RADIUS)] = std::exp(-float(k * k) / (2.0f * SSIM_SIGMA * SSIM_SIGMA));
+        total += taps[size_t(k + SSIM_RADIUS)];
+    }
+    for (auto& tap : taps) {
+        tap /= total;
+    }
+    return taps;
+}
+
+// Horizontal window of one row, columns clamped.
+inline void filterRow(const float* in, float* out, const int width, const std::array<float, 2 * SSIM_RADIUS + 1>& taps)
+{
+    const int interior_begin = std::min(SSIM_RADIUS, width);
+    const int interior_end = std::max(width - SSIM_RADIUS, interior_begin);
+    const auto clamped = [&](const int x) {
+        float sum = 0.0f;
+        for (int k = -SSIM_RADIUS; k <= SSIM_RADIUS; k++) {
+            sum += taps[size_t(k + SSIM_RADIUS)] * in[std::clamp(x + k, 0, width - 1)];
+        }
+        return sum;
+    };
+    for (int x = 0; x < interior_begin; x++) {
+        out[x] = clamped(x);
+    }
+#pragma omp simd
+    for (int x = interior_begin; x < interior_end; x++) {
+        float sum = 0.0f;
+        for (int k = -SSIM_RADIUS; k <= SSIM_RADIUS; k++) {
+            sum += taps[size_t(k + SSIM_RADIUS)] * in[x + k];
+        }
+        out[x] = sum;
+    }
+    for (int x = interior_end; x < width; x++) {
+        out[x] = clamped(x);
+    }
+}
+
+} // namespace image_quality
+
+/// <summary>
+/// Mean squared difference over all channels.
+/// </summary>
+template <typename T>
+double meanSquaredError(const ImageView<const T> reference, const ImageView<const T> test)
+{
+    using namespace image_quality;
+    checkSameSize(reference, test);
+    const int values = reference.width * channelsOf<T>();
+    const int64_t rows_per_chunk = std::max<int64_t>(1, REDUCTION_CHUNK / std::max(values, 1));
+    const double sum = reproducibleSum<double>(reference.height, rows_per_chunk, kernelThreads(reference, KernelCost::Light), [&](const int64_t begin, const int64_t end) {
+        double chunk_sum = 0.0;
+        for (int64_t y = begin; y < end; y++) {
+            const float* a = rowValues(reference, int(y));
+            const float* b = rowValues(test, int(y));
+            double row_sum = 0.0;
+#pragma omp simd reduction(+ : row_sum)
+            for (int i = 0; i < values; i++) {
+                const double d = double(a[i]) - double(b[i]);
+                row_sum += d * d;
+            }
+            chunk_sum += row_sum;
+        }
+        return chunk_sum;
+    });
+    return sum / (double(values) * double(reference.height));
+}
+
+/// <summary>
+/// Peak signal-to-noise ratio in dB, infinity for identical images.
+/// </summary>
+/// <param name="peak">largest value, 1 for display images</param>
+template <typename T>
+double psnr(const ImageView<const T> reference, const ImageView<const T> test, const double peak = 1.0)
+{
+    const double mse = meanSquaredError(reference, test);
+    return mse > 0.0 ? 10.0 * std::log10(peak * peak / mse) : std::numeric_limits<double>::infinity();
+}
+
+/// <summary>
+/// Mean structural similarity, averaged over the channels, see above.
+/// </summary>
+/// <param name="peak">dynamic range L of the constants (K L)^2, 1 for display images</param>
+template <typename T>
+double ssim(const ImageView<const T> reference, const ImageView<const T> test, const double peak = 1.0)
+{
+    using namespace image_quality;
+    checkSameSize(reference, test);
+    constexpr int channels = channelsOf<T>();
+    constexpr int ring_rows = 2 * SSIM_RADIUS + 1;
+    const int w = reference.width, h = reference.height;
+    const auto taps = ssimWindow();
+    const float c1 = float((0.01 * peak) * (0.01 * peak));
+    const float c2 = float((0.03 * peak) * (0.03 * peak));
+    const int bands = (h + SSIM_BAND - 1) / SSIM_BAND;
+
+    const double sum = reproducibleSum<double>(int64_t(bands) * channels, 1, kernelThreads(int64_t(w) * h * channels, KernelCost::Heavy), [&](const int64_t index, int64_t) {
+        const int c = int(index % channels);
+        const int y0 = int(index / channels) * SSIM_BAND;
+        const int y1 = std::min(y0 + SSIM_BAND, h);
+        // Moments a, b, a^2, b^2, ab: a row of products, the ring of filtered rows, the column sums.
+        std::vector<float> products(size_t(5) * size_t(w));
+        std::vector<float> ring(size_t(5) * ring_rows * size_t(w));
+        std::vector<float> moments(size_t(5) * size_t(w));
+        const auto ringRow = [&](const int moment, const int y) { return ring.data() + (size_t(moment) * ring_rows + size_t((y + ring_rows) % ring_rows)) * size_t(w); };
+        const auto filterInto = [&](const int y) {
+            const int source_y = std::clamp(y, 0, h - 1);
+            const float* a = rowValues(reference, source_y);
+            const float* b = rowValues(test, source_y);
+            float* p = products.data();
+#pragma omp simd
+            for (int x = 0; x < w; x++) {
+                const float va = a[x * channels + c], vb = b[x * channels + c];
+                p[x] = va;
+                p[w + x] = vb;
+                p[2 * w + x] = va * va;
+                p[3 * w + x] = vb * vb;
+                p[4 * w + x] = va * vb;
+            }
+            for (int moment = 0; moment < 5; moment++) {
+                filterRow(p + size_t(moment) * size_t(w), ringRow(moment, y), w, taps);
+            }
+        };
+        for (int y = y0 - SSIM_RADIUS; y < y0 + SSIM_RADIUS; y++) {
+            filterInto(y);
+        }
+        double band_sum = 0.0;
+        for (int y = y0; y < y1; y++) {
+            filterInto(y + SSIM_RADIUS);
+            for (int moment = 0; moment < 5; moment++) {
+                float* out = moments.data() + size_t(moment) * size_t(w);
+                std::fill_n(out, w, 0.0f);
+                for (int k = -SSIM_RADIUS; k <= SSIM_RADIUS; k++) {
+                    const float tap = taps[size_t(k + SSIM_RADIUS)];
+                    const float* row = ringRow(moment, y + k);
+#pragma omp simd
+                    for (int x = 0; x < w; x++) {
+                        out[x] += tap * row[x];
+                    }
+                }
+            }
+            const float* m = moments.data();
+            double row_sum = 0.0;
+#pragma omp simd reduction(+ : row_sum)
+            for (int x = 0; x < w; x++) {
+                const float mu_a = m[x], mu_b = m[w + x];
+                const float var_a = m[2 * w + x] - mu_a * mu_a;
+                const float var_b = m[3 * w + x] - mu_b * mu_b;
+                const float cov = m[4 * w + x] - mu_a * mu_b;
+                row_sum += double(((2.0f * mu_a * mu_b + c1) * (2.0f * cov + c2)) / ((mu_a * mu_a + mu_b * mu_b + c1) * (var_a + var_b + c2)));
+            }
+            band_sum += row_sum;
+        }
+        return band_sum;
+    });
+    return sum / (double(w) * double(h) * channels);
+}
+
+/// <summary>
+/// Per-pixel CIE color difference of display RGB, see above.
+/// </summary>
+/// <param name="threshold">difference counted in above_threshold</param>
+inline ColorDifference deltaE(const ImageView<const glm::vec3> reference, const ImageView<const glm::vec3> test, const DeltaEFormula formula = DeltaEFormula::Ciede2000,
+    const double threshold = 1.0)
+{
+    using namespace image_quality;
+    checkSameSize(reference, test);
+    struct Partial {
+        double sum = 0.0;
+        double max = 0.0;
+        double above = 0.0;
+        Partial& operator+=(const Partial& other)
+        {
+            sum += other.sum;
+            max = std::max(max, other.max);
+            above += other.above;
+            return *this;
+        }
+    };
+    const int w = reference.width;
+    const int64_t rows_per_chunk = std::max<int64_t>(1, REDUCTION_CHUNK / std::max(w, 1));
+    const auto total = reproducibleSum<Partial>(reference.height, rows_per_chunk, kernelThreads(reference, KernelCost::Medium), [&](const int64_t begin, const int64_t end) {
+        Partial partial;
+        for (int64_t y = begin; y < end; y++) {
+            const glm::vec3* a = reference.row(int(y));
+            const glm::vec3* b = test.row(int(y));
+            for (int x = 0; x < w; x++) {
+                const auto decode = [](const glm::vec3 v) { return glm::vec3(srgbDecode(v.r), srgbDecode(v.g), srgbDecode(v.b)); };
+                const glm::vec3 lab_a = linearSrgbToLab(decode(a[x]));
+                const glm::vec3 lab_b = linearSrgbToLab(decode(b[x]));
+                const double difference = formula == DeltaEFormula::Ciede2000 ? ciede2000(lab_a, lab_b) : double(glm::length(lab_a - lab_b));
+                partial.sum += difference;
+                partial.max = std::max(partial.max, difference);
+                partial.above += difference > threshold ? 1.0 : 0.0;
+            }
+        }
+        return partial;
+    });
+    const double pixels = double(w) * double(reference.height);
+    return { total.sum / pixels, total.max, total.above / pixels };
+}
+
+/// <summary>
+/// PSNR (peak 1), SSIM and delta E of a display image against its reference.
+/// </summary>
+inline ImageQuality compareImages(const ImageRGB& reference, const ImageRGB& test, const QualityThresholds& thresholds = {})
+{
+    ImageQuality quality;
+    quality.psnr = psnr(reference.view(), test.view());
+    quality.ssim = ssim(reference.view(), test.view());
+    quality.delta_e = deltaE(reference.view(), test.view(), thresholds.formula, thresholds.delta_e_threshold);
+    return quality;
+}
+
+/// <summary>
+/// The --compare mode: the test file against the reference file, or every file of the reference
+/// directory against the file of the same name in the test directory. Prints one line per pair.
+/// </summary>
+/// <returns>true when every pair exists, decodes and is within the thresholds</returns>
+bool runImageComparison(const std::filesystem::path& reference, const std::filesystem::path& test, const QualityThresholds& thresholds, std::ostream& out)
+{
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> pairs;
+    if (std::filesystem::is_directory(reference)) {
+        for (const auto& entry : std::filesystem::directory_iterator(reference)) {
+            if (entry.is_regular_file()) {
+                pairs.emplace_back(entry.path(), test / entry.path().filename());
+            }
+        }
+        std::sort(pairs.begin(), pairs.end());
+    } else {
+        pairs.emplace_back(reference, test);
+    }
+
+    const char* formula = thresholds.formula == DeltaEFormula::Ciede2000 ? "dE00" : "dE76";
+    bool all_ok = true;
+    for (const auto& [reference_path, test_path] : pairs) {
+        out << reference_path.filename().string() << ": ";
+        try {
+            const ImageRGB reference_image(reference_path);
+            const ImageRGB test_image(test_path);
+            const auto quality = compareImages(reference_image, test_image, thresholds);
+            const bool ok = quality.psnr >= thresholds.min_psnr && quality.ssim >= thresholds.min_ssim && quality.delta_e.mean <= thresholds.max_delta_e;
+            all_ok = all_ok && ok;
+            out << std::fixed << std::setprecision(2) << "PSNR " << quality.psnr << " dB, SSIM " << std::setprecision(5) << quality.ssim << ", " << formula
+                << " mean " << std::setprecision(3) << quality.delta_e.mean << " max " << quality.delta_e.max << ", " << std::setprecision(2)
+                << 100.0 * quality.delta_e.above_threshold << "% above " << thresholds.delta_e_threshold << std::defaultfloat << (ok ? "  ok" : "  FAILED")
+                << std::endl;
+        } catch (const std::exception&) {
+            // The loader printed the reason.
+            all_ok = false;
+            out << "FAILED" << std::endl;
+        }
+    }
+    return all_ok;
+}
+
+#pragma endregion Image quality
@@ -0,0 +1,644 @@
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <framework/image_pool.h>
+
+#include "decoded_image_cache.h"
+#include "job_scheduler.h"
+#include "result_cache.h"
+#include "run_config.h"
+#include "stage_metrics.h"
+#include "stage_profiler.h"
+#include "tone_map_edit.h"
+#include "tone_map_encode.h"
+#include "tone_map_preview.h"
+#include "your_code_here.h"
+
+/*
+ * Long-running tone mapping / Poisson editing service.
+ *
+ * One a1_hdr process answers jobs read line by line from an input stream (stdin by default),
+ * so OpenMP spins its threads up once and later jobs skip the cold start of a fresh process:
+ *   - every image is allocated from one ImageBufferPool, so intermediates of a resolution that
+ *     was processed before reuse already touched buffers instead of faulting in new pages,
+ *   - decoded inputs and masks come from the process-wide DecodedImageCache, keyed by path and
+ *     modification time, so a target, source or mask sent again (the usual case while a user
+ *     tweaks parameters, or composites many sources onto one plate) is not decoded again,
+ *   - base layers are kept in a ResultCache, so a job that only changes base_scale, output_gain
+ *     or saturation skips the bilateral filter,
+ *   - the tiles of the last roi job are kept, so panning a zoomed view computes only the tiles
+ *     that came into view,
+ *   - the image of the last edit job is kept with its intermediates as a ToneMapEditSession, so a
+ *     local exposure change recomputes only the tiles it reaches,
+ *   - the last Poisson composite is kept as a PoissonEditSession: a job with the same target,
+ *     source and mask only moves the source and updates the solution locally.
+ *
+ * Jobs run by priority class on the lanes of a JobScheduler (see job_scheduler.h): roi, edit,
+ * thumbnail, stats, metrics and cancel are interactive, tonemap and poisson batch, unless the option
+ * priority=interactive|batch says otherwise. An interactive job starts before the waiting batch
+ * jobs and preempts the running one, which continues once the interactive jobs are done. The
+ * lanes and memory quota of each class are settings (serve_interactive_jobs, serve_batch_jobs,
+ * serve_interactive_memory_mb, serve_batch_memory_mb). The kept state above is locked per item,
+ * so jobs of both classes may use it.
+ *
+ * Protocol: one job per line, words separated by spaces (paths cannot contain spaces), options as
+ * key=value after the positional arguments. Every job answers one line, "ok <milliseconds>" or
+ * "error <reason>". Replies come in the order the jobs finish; a job with the option id=<token>
+ * ends each of its lines with " id=<token>". A progressive tonemap first writes the result at 1/8, 1/4 and 1/2 of the
+ * resolution next to the output (<stem>_1of<factor>.<ext>, see ProgressiveToneMap) and answers
+ * a line "level <factor> <milliseconds> <path>" for each before its final reply. Any job with the
+ * option progress=1 also answers lines "progress <stage> <done> <total>" while it runs, from the
+ * kernels that report (tiles of the bilateral engines, rows of the brute-force filter, iterations
+ * of the Poisson solvers).
+ *   tonemap <input> <output> [filter_size= space_sigma= range_sigma= base_scale= output_gain=
+ *                             auto_contrast=0|1 target_contrast= saturation= engine=bruteforce|grid|tiled|rangelut|simd|upsampled|
+ *                             recursive|permutohedral|adaptive|guided|wls
+ *                             color_guide=0|1 operator=durand|local_laplacian|reinhard|filmic|
+ *                             fattal key= white_point= gradient_alpha= gradient_beta=
+ *                             gradient_solver=jacobi|sor|cg|multigrid|mgcg look=<file.cube>
+ *                             progressive=0|1]
+ *                                          look grades the result with a 3D LUT (color_lut.h),
+ *                                          kept loaded until the file changes
+ *   roi <input> <output> x= y= width= height= [tonemap options except progressive]
+ *                                          tone maps the rectangle only, from the tiles kept for
+ *                                          the last roi input (see RoiToneMap), for zoomed views
+ *   edit <input> <output> x= y= width= height= exposure= [tonemap options except progressive]
+ *                                          scales the exposure of the rectangle by 2^exposure and
+ *                                          writes the result; the edits add up on the kept image
+ *                                          until the input or the tonemap options change
+ *   poisson <target> <source> <mask> <output> [x= y= iters= local_iters= membrane=0|1
+ *                                              blend=poisson|feather|pyramid feather_radius= levels=]
+ *                                          membrane=1 clones with mean-value coordinates instead
+ *                                          of solving (instant previews, see MembraneClone),
+ *                                          blend=feather|pyramid blends without gradients in
+ *                                          milliseconds (see composite_blend.h)
+ *   thumbnail <input> <output> [factor=]   input decoded at 1/factor (default 8) of its size,
+ *                                          a .pfm or .exr output keeps HDR values
+ *   stats
+ *   cancel                                 abandons every job sent before it: the running job
+ *                                          stops at its next check (see job_control.h) and
+ *                                          answers "error <command> cancelled", the waiting
+ *                                          ones answer the same without running
+ *   metrics [<path>]                       live metrics in the OpenMetrics text format, see below;
+ *                                          with a path they are written to that file instead
+ *   quit                                   answers "ok" once every job before it is done
+ *
+ * Metrics: lines are read ahead on a thread of their own into a queue, so the jobs waiting
+ * behind the running one are known (and a cancel reaches them and the running job at once). The metrics job answers the OpenMetrics exposition (ended by
+ * "# EOF") before its reply line, or writes it to the path (through a temporary file and a
+ * rename, for the textfile collector of a node exporter). It has latency histograms (see
+ * stage_metrics.h) of every stage timed by a ScopedStage (load, bilateralFilter, solvePoisson...,
+ * write), of every job by command and of the wait of jobs in the queue; job counts by command and
+ * result; the queue depth; and the memory: resident set, live and peak image bytes, and the bytes
+ * of the buffer pool and the input and result caches.
+ */
+
+#pragma region Image service
+
+/// <summary>
+/// Serves tonemap and poisson jobs from a line protocol, see above.
+/// </summary>
+class ImageService {
+public:
+    explicit ImageService(const JobSchedulerQuotas& quotas = {})
+        : m_quotas(quotas)
+    {
+    }
+
+    /// <summary>
+    /// Answers jobs until "quit" or the end of the input.
+    /// </summary>
+    /// <param name="input">job lines</param>
+    /// <param name="output">one reply line per job</param>
+    void run(std::istream& input, std::ostream& output)
+    {
+        ImageMemoryScope memory_scope(&m_image_memory);
+        StageMetrics::instance().enable();
+        ReplyWriter replies { output };
+        m_scheduler.emplace(m_quotas, &m_image_memory, [&](ScheduledJob& job) { runJob(job, replies); });
+        for (std::string line; std::getline(input, line);) {
+            std::istringstream words(line);
+            std::string command;
+            if (!(words >> command)) {
+                continue;
+            }
+            if (command == "quit") {
+                m_scheduler->finish();
+                replies.line("ok");
+                break;
+            }
+            if (command == "cancel") {
+                // The jobs before it stop at once, not when the cancel job runs.
+                m_scheduler->cancelAll();
+            }
+            m_scheduler->submit(std::move(line), jobPriority(command, words));
+        }
+        m_scheduler.reset();
+    }
+
+private:
+    using Options = std::map<std::string, std::string>;
+
+    // Reply lines of the jobs of all lanes, each written whole.
+    struct ReplyWriter {
+        std::ostream& output;
+        std::mutex mutex;
+
+        void line(const std::string& text)
+        {
+            const std::lock_guard lock(mutex);
+            output << text << std::endl;
+        }
+    };
+
+    // Latency and results of the jobs, by command, guarded by m_metrics_mutex.
+    struct JobMetrics {
+        // By priority class.
+        std::map<std::string, LatencyHistogram> queue_wait;
+        std::map<std::string, LatencyHistogram> latency;
+        // Succeeded and failed jobs.
+        std::map<std::string, std::pair<uint64_t, uint64_t>> results;
+
+        void record(const std::string& command, const bool ok, const std::chrono::nanoseconds duration)
+        {
+            // Unknown commands share one label, the input cannot add label values.
+            static const std::set<std::string> commands { "tonemap", "roi", "edit", "poisson", "thumbnail", "stats", "cancel", "metrics" };
+            const std::string label = commands.contains(command) ? command : "other";
+            latency[label].observe(duration);
+            auto& counts = results[label];
+            (ok ? counts.first : counts.second)++;
+        }
+    };
+
+    // Inputs of the cached Poisson session.
+    struct PoissonInputs {
+        std::filesystem::path target, source, mask;
+        std::shared_ptr<const ImageRGB> target_image, source_image;
+        std::shared_ptr<const BinaryMask> mask_image;
+
+        bool operator==(const PoissonInputs& other) const = default;
+    };
+
+    // Default class of a command, or the one of the priority option (invalid values are reported by handle()).
+    static JobPriority jobPriority(const std::string& command, std::istringstream& words)
+    {
+        static const std::set<std::string> interactive { "roi", "edit", "thumbnail", "stats", "metrics", "cancel" };
+        auto priority = interactive.contains(command) ? JobPriority::Interactive : JobPriority::Batch;
+        for (std::string word; words >> word;) {
+            if (word == "priority=interactive") {
+                priority = JobPriority::Interactive;
+            } else if (word == "priority=batch") {
+                priority = JobPriority::Batch;
+            }
+        }
+        return priority;
+    }
+
+    void runJob(ScheduledJob& job, ReplyWriter& replies)
+    {
+        std::istringstream words(job.request);
+        std::string command;
+        words >> command;
+        const auto start_time = std::chrono::steady_clock::now();
+        const auto reply = handle(command, words, replies, *job.control);
+        const std::lock_guard lock(m_metrics_mutex);
+        m_job_metrics.queue_wait[job.priority == JobPriority::Interactive ? "interactive" : "batch"].observe(start_time - job.arrival);
+        m_job_metrics.record(command, reply.starts_with("ok"), std::chrono::steady_clock::now() - start_time);
+        replies.line(reply);
+    }
+
+    // Locks an item of the kept state. An interactive job that finds it held by a preempted batch
+    // job lets that job run until it releases the item (see JobScheduler::PreemptionPause).
+    std::unique_lock<std::mutex> lockState(std::mutex& mutex)
+    {
+        std::unique_lock lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            const JobScheduler::PreemptionPause pause(*m_scheduler);
+            lock.lock();
+        }
+        return lock;
+    }
+
+    std::string handle(const std::string& command, std::istringstream& words, ReplyWriter& replies, JobControl& control)
+    {
+        std::vector<std::string> arguments;
+        Options options;
+        for (std::string word; words >> word;) {
+            const auto equals = word.find('=');
+            if (equals == std::string::npos) {
+                arguments.push_back(word);
+            } else {
+                options[word.substr(0, equals)] = word.substr(equals + 1);
+            }
+        }
+
+        const auto id = options.contains("id") ? " id=" + options.at("id") : std::string();
+        // Lines of the job before its reply.
+        const auto emit = [&](const std::string& text) { replies.line(text + id); };
+        if (getOption(options, "progress", 0) != 0) {
+            control.on_progress = [&](const JobProgress& progress) {
+                std::ostringstream text;
+                text << "progress " << progress.stage << " " << progress.done << " " << progress.total;
+                emit(text.str());
+            };
+        }
+
+        const auto start_time = std::chrono::steady_clock::now();
+        try {
+            // A cancel only cancels the jobs before it, and later cancels have nothing left to stop.
+            if (command != "cancel") {
+                control.throwIfCancelled();
+            }
+            if (const auto priority = getOption(options, "priority", std::string("batch")); priority != "interactive" && priority != "batch") {
+                std::cerr << "Unknown priority " << priority << ", expected interactive or batch." << std::endl;
+                throw std::exception();
+            }
+            if (command == "tonemap" && arguments.size() == 2) {
+                toneMap(arguments[0], arguments[1], options, emit);
+            } else if (command == "roi" && arguments.size() == 2) {
+                toneMapRoi(arguments[0], arguments[1], options);
+            } else if (command == "edit" && arguments.size() == 2) {
+                toneMapEdit(arguments[0], arguments[1], options);
+            } else if (command == "poisson" && arguments.size() == 4) {
+                poisson(arguments[0], arguments[1], arguments[2], arguments[3], options);
+            } else if (command == "thumbnail" && arguments.size() == 2) {
+                writeOutput(ImageRGB::loadDownsampled(arguments[0], getOption(options, "factor", 8)), arguments[1]);
+            } else if (command == "stats" && arguments.empty()) {
+                const auto pool_stats = m_pool.getStats();
+                const auto input_stats = decodedImageCache().getStats();
+                std::ostringstream reply;
+                reply << "ok buffers_recycled=" << pool_stats.hits << " buffers_allocated=" << pool_stats.misses
+                      << " cached_bytes=" << pool_stats.cached_bytes << " cached_inputs=" << input_stats.entries << " cached_input_bytes=" << input_stats.bytes
+                      << " input_hits=" << input_stats.hits << " input_misses=" << input_stats.misses << " cached_results=" << m_results.getStats().memory_bytes;
+                const auto lock = lockState(m_roi_mutex);
+                if (m_roi) {
+                    reply << " roi_tiles_computed=" << m_roi->stats().tiles_computed << " roi_tiles_reused=" << m_roi->stats().tiles_reused;
+                }
+                const auto edit_lock = lockState(m_edit_mutex);
+                if (m_edit) {
+                    reply << " edits=" << m_edit->stats().edits << " edit_tiles=" << m_edit->stats().tiles << " edit_result_tiles=" << m_edit->stats().result_tiles;
+                }
+                return reply.str() + id;
+            } else if (command == "cancel" && arguments.empty()) {
+                // run() cancelled the jobs before this one.
+            } else if (command == "metrics" && arguments.empty()) {
+                // One block, the lines of other jobs do not come between.
+                std::ostringstream exposition;
+                writeMetrics(exposition);
+                auto text = exposition.str();
+                text.pop_back();
+                replies.line(text);
+            } else if (command == "metrics" && arguments.size() == 1) {
+                writeMetricsFile(arguments[0]);
+            } else {
+                return "error unknown command or wrong number of arguments: " + command + id;
+            }
+        } catch (const CancelledError&) {
+            return "error " + command + " cancelled" + id;
+        } catch (const std::exception&) {
+            // The failing stage printed the reason to std::cerr.
+            return "error " + command + " failed" + id;
+        }
+        std::ostringstream reply;
+        reply << "ok " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count() << id;
+        return reply.str();
+    }
+
+    /// <summary>
+    /// Writes the metrics in the OpenMetrics text format, see above.
+    /// </summary>
+    void writeMetrics(std::ostream& out) const
+    {
+        const std::lock_guard lock(m_metrics_mutex);
+        writeOpenMetricsFamily(out, "a1_hdr_stage_duration_seconds", "histogram", "seconds", "Wall time of the timed stages.");
+        StageMetrics::instance().forEach([&](const std::string& stage, const LatencyHistogram& histogram) {
+            writeOpenMetricsHistogram(out, "a1_hdr_stage_duration_seconds", "stage=\"" + openMetricsLabel(stage) + "\"", histogram);
+        });
+        writeOpenMetricsFamily(out, "a1_hdr_job_duration_seconds", "histogram", "seconds", "Time from the start of a job to its reply.");
+        for (const auto& [command, histogram] : m_job_metrics.latency) {
+            writeOpenMetricsHistogram(out, "a1_hdr_job_duration_seconds", "command=\"" + command + "\"", histogram);
+        }
+        writeOpenMetricsFamily(out, "a1_hdr_job_queue_wait_seconds", "histogram", "seconds", "Time a job waited in the queue, by priority class.");
+        for (const auto& [priority, histogram] : m_job_metrics.queue_wait) {
+            writeOpenMetricsHistogram(out, "a1_hdr_job_queue_wait_seconds", "priority=\"" + priority + "\"", histogram);
+        }
+        writeOpenMetricsFamily(out, "a1_hdr_jobs", "counter", "", "Jobs answered.");
+        for (const auto& [command, counts] : m_job_metrics.results) {
+            writeOpenMetricsSample(out, "a1_hdr_jobs_total", "command=\"" + command + "\",result=\"ok\"", double(counts.first));
+            writeOpenMetricsSample(out, "a1_hdr_jobs_total", "command=\"" + command + "\",result=\"error\"", double(counts.second));
+        }
+        writeOpenMetricsFamily(out, "a1_hdr_queue_depth", "gauge", "", "Jobs read and not started yet.");
+        writeOpenMetricsSample(out, "a1_hdr_queue_depth", "", double(m_scheduler->depth()));
+        writeOpenMetricsFamily(out, "a1_hdr_job_preemptions", "counter", "", "Batch jobs preempted by interactive jobs.");
+        writeOpenMetricsSample(out, "a1_hdr_job_preemptions_total", "", double(m_scheduler->preemptions()));
+        writeOpenMetricsFamily(out, "a1_hdr_image_class_live_bytes", "gauge", "bytes", "Live image bytes by priority class, see the memory quotas.");
+        writeOpenMetricsSample(out, "a1_hdr_image_class_live_bytes", "priority=\"interactive\"", double(m_scheduler->liveBytes(JobPriority::Interactive)));
+        writeOpenMetricsSample(out, "a1_hdr_image_class_live_bytes", "priority=\"batch\"", double(m_scheduler->liveBytes(JobPriority::Batch)));
+
+        const auto pool_stats = m_pool.getStats();
+        const auto input_stats = decodedImageCache().getStats();
+        const struct {
+            const char* name;
+            const char* help;
+            uint64_t bytes;
+        } memory[] {
+            { "a1_hdr_resident_memory_bytes", "Resident set size of the process.", currentResidentBytes() },
+            { "a1_hdr_resident_memory_peak_bytes", "Peak resident set size of the process.", peakResidentBytes() },
+            { "a1_hdr_image_live_bytes", "Image bytes allocated and not freed.", m_image_memory.liveBytes() },
+            { "a1_hdr_image_live_peak_bytes", "Peak of the live image bytes.", m_image_memory.peakLiveBytes() },
+            { "a1_hdr_image_pool_cached_bytes", "Free image buffers kept by the pool.", pool_stats.cached_bytes },
+            { "a1_hdr_input_cache_bytes", "Decoded inputs kept by the input cache.", input_stats.bytes },
+            { "a1_hdr_result_cache_bytes", "Results kept by the result cache.", m_results.getStats().memory_bytes },
+        };
+        for (const auto& gauge : memory) {
+            writeOpenMetricsFamily(out, gauge.name, "gauge", "bytes", gauge.help);
+            writeOpenMetricsSample(out, gauge.name, "", double(gauge.bytes));
+        }
+        writeOpenMetricsFamily(out, "a1_hdr_image_buffers", "counter", "", "Image buffers served by the pool.");
+        writeOpenMetricsSample(out, "a1_hdr_image_buffers_total", "source=\"recycled\"", double(pool_stats.hits));
+        writeOpenMetricsSample(out, "a1_hdr_image_buffers_total", "source=\"allocated\"", double(pool_stats.misses));
+        writeOpenMetricsFamily(out, "a1_hdr_input_cache_requests", "counter", "", "Input loads by the input cache.");
+        writeOpenMetricsSample(out, "a1_hdr_input_cache_requests_total", "result=\"hit\"", double(input_stats.hits));
+        writeOpenMetricsSample(out, "a1_hdr_input_cache_requests_total", "result=\"miss\"", double(input_stats.misses));
+        out << "# EOF" << std::endl;
+    }
+
+    void writeMetricsFile(const std::filesystem::path& file_path) const
+    {
+        // Renamed into place, a collector never reads a partial file.
+        auto temporary_path = file_path;
+        temporary_path += ".tmp";
+        {
+            std::ofstream file(temporary_path);
+            writeMetrics(file);
+            if (!file) {
+                std::cerr << "Failed to write " << temporary_path << std::endl;
+                throw std::exception();
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary_path, file_path, error);
+        if (error) {
+            std::cerr << "Failed to rename " << temporary_path << " to " << file_path << ": " << error.message() << std::endl;
+            throw std::exception();
+        }
+    }
+
+    DurandParams parseToneMapOptions(const Options& options)
+    {
+        DurandParams params;
+        params.filter_size = getOption(options, "filter_size", params.filter_size);
+        params.space_sigma = getOption(options, "space_sigma", params.filter_size / 6.4f);
+        params.range_sigma = getOption(options, "range_sigma", params.range_sigma);
+        params.base_scale = getOption(options, "base_scale", params.base_scale);
+        params.output_gain = getOption(options, "output_gain", params.output_gain);
+        params.auto_contrast = getOption(options, "auto_contrast", 0) != 0;
+        params.target_contrast = getOption(options, "target_contrast", params.target_contrast);
+        params.saturation = getOption(options, "saturation", params.saturation);
+        params.engine = parseBilateralEngine(getOption(options, "engine", std::string("bruteforce")));
+        params.color_guide = getOption(options, "color_guide", 0) != 0;
+        params.tone_operator = parseToneMapOperator(getOption(options, "operator", std::string("durand")));
+        params.key = getOption(options, "key", params.key);
+        params.white_point = getOption(options, "white_point", params.white_point);
+        params.gradient_alpha = getOption(options, "gradient_alpha", params.gradient_alpha);
+        params.gradient_beta = getOption(options, "gradient_beta", params.gradient_beta);
+        params.gradient_solver = parseStencilMethod(getOption(options, "gradient_solver", std::string("multigrid")));
+        if (const auto look_path = getOption(options, "look", std::string()); !look_path.empty()) {
+            params.look = loadLook(look_path);
+        }
+        if (params.filter_size < 1 || params.filter_size % 2 == 0) {
+            std::cerr << "filter_size must be a positive odd integer." << std::endl;
+            throw std::exception();
+        }
+        return params;
+    }
+
+    // The LUT of a look option, parsed again only when the file changed.
+    std::shared_ptr<const ColorLut3D> loadLook(const std::filesystem::path& path)
+    {
+        const auto lock = lockState(m_looks_mutex);
+        std::error_code error;
+        const auto modified = std::filesystem::last_write_time(path, error);
+        auto& [cached_time, lut] = m_looks[path];
+        if (!lut || error || cached_time != modified) {
+            lut = std::make_shared<const ColorLut3D>(ColorLut3D::loadCube(path));
+            cached_time = modified;
+        }
+        return lut;
+    }
+
+    void toneMap(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const Options& options,
+        const std::function<void(const std::string&)>& emit)
+    {
+        const auto start_time = std::chrono::steady_clock::now();
+        const auto params = parseToneMapOptions(options);
+
+        // Same passes as toneMapDurand(), with the base layer from the cache.
+        const auto base_layer = [&](const ImageRGB& image, const ImageFloat& log_lum_H, const DurandParams& image_params, ImageStatsAccumulator* base_stats) {
+            return image_params.color_guide
+                ? durandBaseLayer(image, log_lum_H, image_params, base_stats)
+                : bilateralFilterCached(m_results, log_lum_H, image_params.filter_size, image_params.space_sigma, image_params.range_sigma, image_params.engine, base_stats);
+        };
+        const auto render = [&](const ImageRGB& image, const DurandParams& image_params) {
+            if (image_params.tone_operator != ToneMapOperator::Durand) {
+                return ::toneMap(image, image_params);
+            }
+            const auto log_lum_H = durandLogLuminance(image, image_params);
+            AutoContrast auto_contrast(image_params, image.width, image.height);
+            const auto base_image = base_layer(image, log_lum_H, image_params, auto_contrast.stats());
+            auto result = durandCompose(image, log_lum_H, base_image, auto_contrast.resolve());
+            applyLook(result, image_params.look);
+            return result;
+        };
+        const auto hdr_image = loadInput(input_path);
+        if (getOption(options, "progressive", 0) != 0) {
+            const std::vector<int> factors { 8, 4, 2 };
+            const auto pyramid = buildHdrPyramid(*hdr_image, factors);
+            for (size_t i = 0; i < factors.size(); i++) {
+                const auto level_path = output_path.parent_path()
+                    / (output_path.stem().string() + "_1of" + std::to_string(factors[i]) + output_path.extension().string());
+                writeOutput(render(pyramid[i], scaleDurandParams(params, factors[i])), level_path);
+                std::ostringstream line;
+                line << "level " << factors[i] << " " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count() << " "
+                     << level_path.string();
+                emit(line.str());
+            }
+        }
+        // The full-size result is quantized while it is composed, see tone_map_encode.h.
+        if (params.tone_operator != ToneMapOperator::Durand) {
+            writeOutput(::toneMap(*hdr_image, params), output_path);
+            return;
+        }
+        const auto log_lum_H = durandLogLuminance(*hdr_image, params);
+        AutoContrast auto_contrast(params, hdr_image->width, hdr_image->height);
+        const auto base_image = base_layer(*hdr_image, log_lum_H, params, auto_contrast.stats());
+        const ScopedStage stage("durandComposeToFile", hdr_image->data.size());
+        durandComposeToFile(*hdr_image, log_lum_H, base_image, auto_contrast.resolve(), output_path);
+    }
+
+    void toneMapRoi(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const Options& options)
+    {
+        const auto params = parseToneMapOptions(options);
+        const RoiRect roi { getOption(options, "x", 0), getOption(options, "y", 0), getOption(options, "width", 0), getOption(options, "height", 0) };
+        auto hdr_image = loadInput(input_path);
+        const auto lock = lockState(m_roi_mutex);
+        if (!m_roi || &m_roi->image() != hdr_image.get()) {
+            m_roi.emplace(std::move(hdr_image));
+        }
+        writeOutput(m_roi->render(roi, params), output_path);
+    }
+
+    void toneMapEdit(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const Options& options)
+    {
+        // The rectangle and the exposure are the edit, the other options belong to the session.
+        Options session_options = options;
+        for (const char* key : { "x", "y", "width", "height", "exposure", "id", "progress", "priority" }) {
+            session_options.erase(key);
+        }
+        const auto params = parseToneMapOptions(session_options);
+        const int x = getOption(options, "x", 0), y = getOption(options, "y", 0);
+        const PixelRect rect { x, y, x + getOption(options, "width", 0), y + getOption(options, "height", 0) };
+        const float stops = getOption(options, "exposure", 0.0f);
+        auto hdr_image = loadInput(input_path);
+        const auto lock = lockState(m_edit_mutex);
+        if (!m_edit || m_edit_input != hdr_image || m_edit_options != session_options) {
+            m_edit.reset();
+            m_edit.emplace(ImageRGB(*hdr_image), params);
+            m_edit_input = std::move(hdr_image);
+            m_edit_options = std::move(session_options);
+        }
+        writeOutput(m_edit->adjustExposure(rect, stops), output_path);
+    }
+
+    void poisson(const std::filesystem::path& target_path, const std::filesystem::path& source_path, const std::filesystem::path& mask_path,
+        const std::filesystem::path& output_path, const Options& options)
+    {
+        PoissonInputs inputs { target_path, source_path, mask_path, loadInput(target_path), loadInput(source_path), loadMask(mask_path) };
+        const int offset_x = getOption(options, "x", 0);
+        const int offset_y = getOption(options, "y", 0);
+        const int local_iters = getOption(options, "local_iters", 100);
+
+        const auto blend = parseCompositeMode(getOption(options, "blend", std::string("poisson")));
+        if (blend != CompositeMode::Poisson) {
+            writeOutput(compositeBlend(blend, *inputs.source_image, *inputs.target_image, *inputs.mask_image, offset_x, offset_y,
+                            getOption(options, "feather_radius", 16.0f), getOption(options, "levels", 0)),
+                output_path);
+            return;
+        }
+
+        if (getOption(options, "membrane", 0) != 0) {
+            // Mean-value cloning without a solve; the coordinates are kept while the mask is unchanged.
+            const auto lock = lockState(m_membrane_mutex);
+            if (!m_membrane || m_membrane_mask != inputs.mask_image) {
+                m_membrane.emplace(BinaryMask(*inputs.mask_image));
+                m_membrane_mask = inputs.mask_image;
+            }
+            if (m_membrane->width() != inputs.source_image->width || m_membrane->height() != inputs.source_image->height) {
+                std::cerr << "Mask " << mask_path << " does not match the size of the source." << std::endl;
+                throw std::exception();
+            }
+            writeOutput(m_membrane->apply(*inputs.source_image, *inputs.target_image, offset_x, offset_y), output_path);
+            return;
+        }
+
+        const auto lock = lockState(m_session_mutex);
+        if (!m_session || !(m_session_inputs == inputs)) {
+            // New composite: full solve, then the requested placement.
+            m_session.reset();
+            auto source_mask = BinaryMask(*inputs.mask_image);
+            if (source_mask.width() != inputs.source_image->width || source_mask.height() != inputs.source_image->height) {
+                std::cerr << "Mask " << mask_path << " does not match the size of the source." << std::endl;
+                throw std::exception();
+            }
+            const auto target_XYZ = rgbToXYZSimd(*inputs.target_image);
+            m_session.emplace(target_XYZ, getGradientsXYZ(target_XYZ), getGradientsXYZ(rgbToXYZSimd(*inputs.source_image)), std::move(source_mask),
+                getOption(options, "iters", 500));
+            m_session_inputs = std::move(inputs);
+        }
+        if (offset_x != m_session->offsetX() || offset_y != m_session->offsetY()) {
+            m_session->moveSource(offset_x, offset_y, local_iters);
+        }
+
+        writeOutput(xyzToRGBSimd(m_session->solution()), output_path);
+    }
+
+    /// <summary>
+    /// Decoded input file, from the cache while the file is unchanged.
+    /// </summary>
+    static std::shared_ptr<const ImageRGB> loadInput(const std::filesystem::path& file_path)
+    {
+        const ScopedStage stage("load");
+        return decodedImageCache().load<ImageRGB>(file_path);
+    }
+
+    static std::shared_ptr<const BinaryMask> loadMask(const std::filesystem::path& file_path)
+    {
+        const ScopedStage stage("load");
+        return decodedImageCache().load<BinaryMask>(file_path);
+    }
+
+    static void writeOutput(const ImageRGB& image, const std::filesystem::path& file_path)
+    {
+        const ScopedStage stage("write", image.data.size());
+        image.writeToFile(file_path);
+    }
+
+    template <typename T>
+    static T getOption(const Options& options, const std::string& key, const T default_value)
+    {
+        const auto it = options.find(key);
+        if (it == options.end()) {
+            return default_value;
+        }
+        std::istringstream text(it->second);
+        T value;
+        if (!(text >> value) || !text.eof()) {
+            std::cerr << "Invalid value of option " << key << ": " << it->second << std::endl;
+            throw std::exception();
+        }
+        return value;
+    }
+
+    // Declared first so that it outlives every cached image.
+    ImageBufferPool m_pool;
+    // Live image bytes of the metrics, between the images and the pool.
+    ImageAllocationCounter m_image_memory { &m_pool };
+    JobSchedulerQuotas m_quotas;
+    mutable std::mutex m_metrics_mutex;
+    JobMetrics m_job_metrics;
+    ResultCache m_results;
+    // Every item of the kept state has its own mutex, see lockState().
+    std::mutex m_looks_mutex;
+    std::map<std::filesystem::path, std::pair<std::filesystem::file_time_type, std::shared_ptr<const ColorLut3D>>> m_looks;
+    // Tiles of the last roi input.
+    std::mutex m_roi_mutex;
+    std::optional<RoiToneMap> m_roi;
+    // Edited image of the last edit input, with the options it is tone mapped with.
+    std::mutex m_edit_mutex;
+    std::optional<ToneMapEditSession> m_edit;
+    std::shared_ptr<const ImageRGB> m_edit_input;
+    Options m_edit_options;
+    std::mutex m_session_mutex;
+    std::optional<PoissonEditSession> m_session;
+    PoissonInputs m_session_inputs;
+    // Mean-value coordinates of the last mask of a membrane job.
+    std::mutex m_membrane_mutex;
+    std::optional<MembraneClone> m_membrane;
+    std::shared_ptr<const BinaryMask> m_membrane_mask;
+    // Lanes of the jobs while run() runs, declared last so that they stop before the state goes.
+    std::optional<JobScheduler> m_scheduler;
+};
+
+#pragma endregion Image service
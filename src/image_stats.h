@@ -0,0 +1,394 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Global statistics of an image in one read.
+ *
+ * Normalization needs the min/max, the global tone curves the log-average luminance, auto
+ * exposure a luminance histogram; computed one at a time, every statistic is another full pass
+ * over a bandwidth-bound image. computeImageStats() evaluates any set of them in a single
+ * parallel pass: an ImageStatsAccumulator reduces every row into per-row partials (the
+ * min/max/sum loops are vectorized per row), which are merged once at the end. The sums are
+ * added by pairwiseSum(), so the means and the log-average do not change with the thread count
+ * or the order the rows arrive in; a decoder can feed the accumulator row by row instead.
+ *
+ * Luminance statistics use the BT.601 weights of rgbToLuminancePixel(). The histogram has
+ * uniform bins of log2 luminance over a fixed range, so it needs no earlier min/max pass;
+ * percentiles are read from it, interpolated within a bin. Scalar images count as gray. Images
+ * that are already in a log domain (a base layer) bin their values as they are
+ * (histogram_of_values).
+ *
+ * Kernels that produce an image tile by tile feed the accumulator with addBlock() (min/max and
+ * histogram only, which do not depend on the order), so the statistics of their output come
+ * with it instead of costing one more pass; see bilateralFilter().
+ *
+ * An ImageStatsCache keeps the statistics next to an image that is not modified any more, and
+ * computes missing statistics on request in one more pass.
+ */
+
+#pragma region Image statistics
+
+/// <summary>
+/// Statistics computed by computeImageStats(), as bit flags.
+/// </summary>
+enum ImageStat : uint32_t {
+    // Per-channel minimum and maximum.
+    StatMinMax = 1u << 0,
+    // Per-channel sum.
+    StatSum = 1u << 1,
+    // exp(mean(ln(1e-6 + L))) and the maximum luminance L.
+    StatLogMean = 1u << 2,
+    // Histogram of log2 luminance, see ImageStats::percentile().
+    StatHistogram = 1u << 3,
+};
+
+/// <summary>
+/// Results of computeImageStats(); only the requested fields are valid.
+/// </summary>
+struct ImageStats {
+    uint32_t computed = 0;
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+    glm::dvec3 sum = glm::dvec3(0.0);
+    double log_mean = 1.0;
+    float max_luminance = 0.0f;
+    // Bins of log2 luminance from histogram_min to histogram_max, clamped at both ends.
+    std::vector<uint64_t> histogram;
+    float histogram_min = -16.0f;
+    float histogram_max = 16.0f;
+    // Bins of the gray value instead of log2 luminance, see ImageStatsRequest.
+    bool histogram_of_values = false;
+    uint64_t count = 0;
+
+    bool has(const uint32_t stats) const { return (computed & stats) == stats; }
+
+    // Min and max over all channels, as getRGBImageMinMax().
+    glm::vec2 minMax() const { return { std::min({ min.r, min.g, min.b }), std::max({ max.r, max.g, max.b }) }; }
+
+    /// <summary>
+    /// Luminance (or value, see histogram_of_values) below which a fraction p of the pixels lies,
+    /// from the histogram.
+    /// </summary>
+    /// <param name="p">fraction in [0, 1]</param>
+    float percentile(const double p) const
+    {
+        if (histogram.empty() || count == 0) {
+            return 0.0f;
+        }
+        const double target = std::clamp(p, 0.0, 1.0) * double(count);
+        const double bin_width = double(histogram_max - histogram_min) / double(histogram.size());
+        double below = 0.0;
+        for (size_t i = 0; i < histogram.size(); i++) {
+            const double in_bin = double(histogram[i]);
+            if (below + in_bin >= target && in_bin > 0.0) {
+                const double t = (target - below) / in_bin;
+                return binValue(double(histogram_min) + (double(i) + t) * bin_width);
+            }
+            below += in_bin;
+        }
+        return binValue(double(histogram_max));
+    }
+
+private:
+    float binValue(const double position) const { return float(histogram_of_values ? position : std::exp2(position)); }
+};
+
+/// <summary>
+/// Options of computeImageStats().
+/// </summary>
+struct ImageStatsRequest {
+    uint32_t stats = StatMinMax;
+    int histogram_bins = 256;
+    // Range of the histogram in log2 luminance, or in values with histogram_of_values.
+    float histogram_min = -16.0f;
+    float histogram_max = 16.0f;
+    // Bin the gray value itself (e.g. a log-luminance or a base layer) instead of its log2 luminance.
+    bool histogram_of_values = false;
+};
+
+/// <summary>
+/// Pixel as RGB, gray for scalar images.
+/// </summary>
+inline glm::vec3 statsPixelRgb(const glm::vec3& val) { return val; }
+inline glm::vec3 statsPixelRgb(const float val) { return glm::vec3(val); }
+
+/// <summary>
+/// Partial statistics of the rows of an image, added in any order and from several threads at
+/// once; computeImageStats() adds the bands of its threads, a decoder (see fused_decode.h) every
+/// row as soon as it is decoded. Per-row results are kept per row and reduced in finish(), so the
+/// statistics do not depend on the order the rows arrive in.
+/// </summary>
+class ImageStatsAccumulator {
+public:
+    /// <param name="width">pixels per row</param>
+    /// <param name="height">rows of the image</param>
+    /// <param name="request">statistics and histogram layout</param>
+    ImageStatsAccumulator(const int width, const int height, const ImageStatsRequest& request = {})
+        : m_request(request)
+        , m_bins(std::max(request.histogram_bins, 1))
+        , m_row_min(request.stats & StatMinMax ? size_t(height) : 0, glm::vec3(std::numeric_limits<float>::max()))
+        , m_row_max(request.stats & StatMinMax ? size_t(height) : 0, glm::vec3(std::numeric_limits<float>::lowest()))
+        , m_row_sums(request.stats & StatSum ? size_t(height) : 0)
+        , m_row_log_sums(request.stats & StatLogMean ? size_t(height) : 0)
+        , m_row_max_luminance(request.stats & StatLogMean ? size_t(height) : 0, 0.0f)
+        , m_histogram(request.stats & StatHistogram ? size_t(m_bins) : 0, 0)
+    {
+        m_count = uint64_t(width) * uint64_t(height);
+    }
+
+    /// <summary>
+    /// Adds consecutive rows. Safe to call concurrently for disjoint rows.
+    /// </summary>
+    /// <param name="rows">the rows, width pixels each</param>
+    /// <param name="y_begin">index of the first row in the image</param>
+    template <typename T>
+    void addRows(const ImageView<const T> rows, const int y_begin)
+    {
+        const uint32_t stats = m_request.stats;
+        const bool want_min_max = (stats & StatMinMax) != 0;
+        const bool want_sum = (stats & StatSum) != 0;
+        const bool want_log = (stats & StatLogMean) != 0;
+        const bool want_histogram = (stats & StatHistogram) != 0;
+        const float bins_per_log2 = binsPerUnit();
+        const glm::vec3 luminance_weights(0.299f, 0.587f, 0.114f);
+        std::vector<uint64_t> histogram(want_histogram ? size_t(m_bins) : 0, 0);
+
+        for (int i = 0; i < rows.height; i++) {
+            const T* row = rows.row(i);
+            const size_t y = size_t(y_begin + i);
+            if (want_min_max || want_sum) {
+                float min_r = std::numeric_limits<float>::max(), min_g = min_r, min_b = min_r;
+                float max_r = std::numeric_limits<float>::lowest(), max_g = max_r, max_b = max_r;
+                float sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f;
+#pragma omp simd reduction(min : min_r, min_g, min_b) reduction(max : max_r, max_g, max_b) reduction(+ : sum_r, sum_g, sum_b)
+                for (int x = 0; x < rows.width; x++) {
+                    const glm::vec3 val = statsPixelRgb(row[x]);
+                    min_r = std::min(min_r, val.r);
+                    min_g = std::min(min_g, val.g);
+                    min_b = std::min(min_b, val.b);
+                    max_r = std::max(max_r, val.r);
+                    max_g = std::max(max_g, val.g);
+                    max_b = std::max(max_b, val.b);
+                    sum_r += val.r;
+                    sum_g += val.g;
+                    sum_b += val.b;
+                }
+                if (want_min_max) {
+                    m_row_min[y] = glm::vec3(min_r, min_g, min_b);
+                    m_row_max[y] = glm::vec3(max_r, max_g, max_b);
+                }
+                // Row sums in float, accumulated in double.
+                if (want_sum) {
+                    m_row_sums[y] = glm::dvec3(sum_r, sum_g, sum_b);
+                }
+            }
+            if (want_log || want_histogram) {
+                double row_log_sum = 0.0;
+                float max_lum = 0.0f;
+                for (int x = 0; x < rows.width; x++) {
+                    const float lum = glm::dot(luminance_weights, statsPixelRgb(row[x]));
+                    if (want_log) {
+                        row_log_sum += std::log(std::max(lum, 0.0f) + 1e-6f);
+                        max_lum = std::max(max_lum, lum);
+                    }
+                    if (want_histogram) {
+                        histogram[histogramBin(lum, bins_per_log2)]++;
+                    }
+                }
+                if (want_log) {
+                    m_row_log_sums[y] = row_log_sum;
+                    m_row_max_luminance[y] = max_lum;
+                }
+            }
+        }
+        if (want_histogram) {
+            // Counts are integers, the merge order does not matter.
+            const std::lock_guard lock(m_histogram_mutex);
+            for (size_t i = 0; i < histogram.size(); i++) {
+                m_histogram[i] += histogram[i];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Adds a block of any rows and columns (a tile of a kernel's output). Only min/max and the
+    /// histogram, which do not depend on the order, can be requested. Safe to call concurrently
+    /// for disjoint blocks.
+    /// </summary>
+    template <typename T>
+    void addBlock(const ImageView<const T> block)
+    {
+        assert((m_request.stats & ~uint32_t(StatMinMax | StatHistogram)) == 0);
+        const bool want_histogram = (m_request.stats & StatHistogram) != 0;
+        const float bins_per_unit = binsPerUnit();
+        const glm::vec3 luminance_weights(0.299f, 0.587f, 0.114f);
+        glm::vec3 low(std::numeric_limits<float>::max()), high(std::numeric_limits<float>::lowest());
+        std::vector<uint64_t> histogram(want_histogram ? size_t(m_bins) : 0, 0);
+        for (int y = 0; y < block.height; y++) {
+            const T* row = block.row(y);
+            for (int x = 0; x < block.width; x++) {
+                const glm::vec3 val = statsPixelRgb(row[x]);
+                low = glm::min(low, val);
+                high = glm::max(high, val);
+                if (want_histogram) {
+                    histogram[histogramBin(glm::dot(luminance_weights, val), bins_per_unit)]++;
+                }
+            }
+        }
+        const std::lock_guard lock(m_histogram_mutex);
+        m_block_min = glm::min(m_block_min, low);
+        m_block_max = glm::max(m_block_max, high);
+        for (size_t i = 0; i < histogram.size(); i++) {
+            m_histogram[i] += histogram[i];
+        }
+    }
+
+    /// <summary>
+    /// Statistics of all added rows, with computed == the requested statistics. Call once, after
+    /// every row was added.
+    /// </summary>
+    ImageStats finish()
+    {
+        ImageStats result;
+        result.computed = m_request.stats;
+        result.histogram_min = m_request.histogram_min;
+        result.histogram_max = m_request.histogram_max;
+        result.histogram_of_values = m_request.histogram_of_values;
+        result.count = m_count;
+        for (size_t y = 0; y < m_row_min.size(); y++) {
+            result.min = glm::min(result.min, m_row_min[y]);
+            result.max = glm::max(result.max, m_row_max[y]);
+        }
+        if (m_request.stats & StatMinMax) {
+            result.min = glm::min(result.min, m_block_min);
+            result.max = glm::max(result.max, m_block_max);
+        }
+        for (const float max_lum : m_row_max_luminance) {
+            result.max_luminance = std::max(result.max_luminance, max_lum);
+        }
+        result.histogram = std::move(m_histogram);
+        if (m_request.stats & StatSum) {
+            result.sum = pairwiseSum(m_row_sums);
+        }
+        if (m_request.stats & StatLogMean) {
+            result.log_mean = std::exp(pairwiseSum(m_row_log_sums) / double(std::max<uint64_t>(m_count, 1)));
+        }
+        return result;
+    }
+
+private:
+    float binsPerUnit() const { return float(m_bins) / std::max(m_request.histogram_max - m_request.histogram_min, 1e-6f); }
+
+    // Histogram bin of a luminance (or value), clamped at both ends; NaN counts in the first bin.
+    size_t histogramBin(const float lum, const float bins_per_unit) const
+    {
+        const float position = ((m_request.histogram_of_values ? lum : std::log2(std::max(lum, 1e-30f))) - m_request.histogram_min) * bins_per_unit;
+        if (!(position >= 0.0f)) {
+            return 0;
+        }
+        return size_t(std::min(position, float(m_bins - 1)));
+    }
+
+    ImageStatsRequest m_request;
+    int m_bins;
+    uint64_t m_count = 0;
+    std::vector<glm::vec3> m_row_min, m_row_max;
+    std::vector<glm::dvec3> m_row_sums;
+    std::vector<double> m_row_log_sums;
+    std::vector<float> m_row_max_luminance;
+    std::vector<uint64_t> m_histogram;
+    // Min and max of the blocks of addBlock(), guarded by the histogram mutex.
+    glm::vec3 m_block_min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 m_block_max = glm::vec3(std::numeric_limits<float>::lowest());
+    std::mutex m_histogram_mutex;
+};
+
+/// <summary>
+/// Adds all rows of an image to an accumulator in one parallel pass, one band of rows per thread.
+/// </summary>
+template <typename T>
+void addImageRows(ImageStatsAccumulator& accumulator, const ImageView<const T> image)
+{
+    const int threads = kernelThreads(image, KernelCost::Light);
+#pragma omp parallel for num_threads(threads)
+    for (int band = 0; band < threads; band++) {
+        const int y_begin = int(int64_t(image.height) * band / threads);
+        const int y_end = int(int64_t(image.height) * (band + 1) / threads);
+        accumulator.addRows<T>(image.subview(0, y_begin, image.width, y_end - y_begin), y_begin);
+    }
+}
+
+/// <summary>
+/// Computes the requested statistics of an image in one parallel pass, see above.
+/// </summary>
+/// <param name="image">float or RGB image (or a region of one)</param>
+/// <param name="request">statistics and histogram layout</param>
+/// <returns>statistics, with computed == request.stats</returns>
+template <typename T>
+ImageStats computeImageStats(const ImageView<const T> image, const ImageStatsRequest& request = {})
+{
+    ImageStatsAccumulator accumulator(image.width, image.height, request);
+    addImageRows(accumulator, image);
+    return accumulator.finish();
+}
+
+/// <summary>
+/// Statistics of one unmodified image, computed on first request, see above.
+/// </summary>
+template <typename T>
+class ImageStatsCache {
+public:
+    /// <param name="image">image that outlives the cache and is not modified while it is used</param>
+    /// <param name="histogram_bins">bins of a histogram request</param>
+    explicit ImageStatsCache(const ImageView<const T> image, const int histogram_bins = 256)
+        : m_image(image)
+        , m_histogram_bins(histogram_bins)
+    {
+    }
+
+    /// <param name="image">image that outlives the cache and is not modified while it is used</param>
+    /// <param name="known">statistics of the image computed elsewhere (e.g. while it was decoded)</param>
+    /// <param name="histogram_bins">bins of a histogram request</param>
+    ImageStatsCache(const ImageView<const T> image, ImageStats known, const int histogram_bins = 256)
+        : m_image(image)
+        , m_histogram_bins(histogram_bins)
+        , m_stats(std::move(known))
+    {
+    }
+
+    /// <summary>
+    /// Statistics including the requested ones. When some are missing, they are computed together
+    /// with the cached ones in one pass.
+    /// </summary>
+    const ImageStats& get(const uint32_t stats)
+    {
+        if (!m_stats.has(stats)) {
+            ImageStatsRequest request;
+            request.stats = m_stats.computed | stats;
+            request.histogram_bins = m_histogram_bins;
+            m_stats = computeImageStats<T>(m_image, request);
+        }
+        return m_stats;
+    }
+
+    // Min and max over all channels, as getRGBImageMinMax().
+    glm::vec2 minMax() { return get(StatMinMax).minMax(); }
+
+    // Forgets the statistics after the image changed.
+    void invalidate() { m_stats = {}; }
+
+private:
+    ImageView<const T> m_image;
+    int m_histogram_bins;
+    ImageStats m_stats;
+};
+
+#pragma endregion Image statistics
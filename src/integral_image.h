@@ -0,0 +1,139 @@
+#pragma once
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Summed-area tables (integral images).
+ *
+ * Entry (x, y) of the table is the sum of all pixels above and left of (x, y), with one extra
+ * row and column of zeros, so the sum over any rectangle is four lookups: box filters of any
+ * radius (guided filter, box approximations of Gaussians, local means for exposure) and area
+ * queries cost O(1) per pixel.
+ *
+ * The table is built with two parallel prefix scans: every row is scanned independently, then
+ * the columns are scanned in strips of STRIP columns that stay in cache while the scan walks
+ * down the rows. Sums are accumulated in double precision (dvec3 for RGB), so a 16k x 16k table
+ * of HDR values keeps the differences of neighbouring entries exact to float precision.
+ */
+
+#pragma region Summed-area table
+
+/// <summary>
+/// Accumulator of a pixel type: double for scalars, glm::dvec3 for RGB.
+/// </summary>
+template <typename T>
+using SummedAreaAccum = std::conditional_t<std::is_arithmetic_v<T>, double, glm::dvec3>;
+
+/// <summary>
+/// Summed-area table of a float, double or RGB image, see above.
+/// </summary>
+template <typename T>
+class SummedAreaTable {
+public:
+    using Accum = SummedAreaAccum<T>;
+    // Columns per strip of the column scan (two cache lines of doubles).
+    static constexpr int STRIP = 16;
+
+    /// <param name="image">input image (or a region of one)</param>
+    explicit SummedAreaTable(const ImageView<const T> image)
+        : SummedAreaTable(image.pixels, image.width, image.height, image.stride)
+    {
+    }
+
+    /// <param name="values">width * height values, rows stride values apart</param>
+    /// <param name="width">image width</param>
+    /// <param name="height">image height</param>
+    /// <param name="stride">distance of the rows in values</param>
+    SummedAreaTable(const T* values, const int width, const int height, const int stride)
+        : m_width(width)
+        , m_height(height)
+        , m_stride(size_t(width) + 1)
+        , m_table(m_stride * (size_t(height) + 1), Accum(0))
+    {
+        // Prefix sums of every row.
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            const T* row = values + size_t(y) * size_t(stride);
+            Accum* out = m_table.data() + (size_t(y) + 1) * m_stride + 1;
+            Accum sum(0);
+            for (int x = 0; x < width; x++) {
+                sum += Accum(row[x]);
+                out[x] = sum;
+            }
+        }
+        // Prefix sums of every column, strip by strip.
+        const int num_strips = (width + STRIP - 1) / STRIP;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int strip = 0; strip < num_strips; strip++) {
+            const int x0 = 1 + strip * STRIP;
+            const int x1 = std::min(x0 + STRIP, width + 1);
+            for (int y = 2; y <= height; y++) {
+                const Accum* above = m_table.data() + (size_t(y) - 1) * m_stride;
+                Accum* row = m_table.data() + size_t(y) * m_stride;
+                for (int x = x0; x < x1; x++) {
+                    row[x] += above[x];
+                }
+            }
+        }
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    /// <summary>
+    /// Sum over the pixels [x0, x1) x [y0, y1), which must lie inside the image.
+    /// </summary>
+    Accum sum(const int x0, const int y0, const int x1, const int y1) const
+    {
+        const Accum* top = m_table.data() + size_t(y0) * m_stride;
+        const Accum* bottom = m_table.data() + size_t(y1) * m_stride;
+        return bottom[x1] - bottom[x0] - top[x1] + top[x0];
+    }
+
+    /// <summary>
+    /// Mean of the (2 * radius + 1)^2 window around (x, y), clipped to the image.
+    /// </summary>
+    Accum windowMean(const int x, const int y, const int radius) const
+    {
+        const int x0 = std::max(x - radius, 0);
+        const int x1 = std::min(x + radius + 1, m_width);
+        const int y0 = std::max(y - radius, 0);
+        const int y1 = std::min(y + radius + 1, m_height);
+        return sum(x0, y0, x1, y1) / double((x1 - x0) * (y1 - y0));
+    }
+
+    /// <summary>
+    /// windowMean() of every pixel, row by row, in a caller-provided array of width * height.
+    /// </summary>
+    template <typename Out>
+    void windowMeans(const int radius, Out* result) const
+    {
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_width) * m_height, KernelCost::Light))
+        for (int y = 0; y < m_height; y++) {
+            Out* out = result + size_t(y) * size_t(m_width);
+            for (int x = 0; x < m_width; x++) {
+                out[x] = Out(windowMean(x, y, radius));
+            }
+        }
+    }
+
+    /// <summary>
+    /// Box filter of the image: windowMean() of every pixel.
+    /// </summary>
+    Image<T> boxFilter(const int radius) const
+    {
+        auto result = Image<T>::uninitialized(m_width, m_height);
+        windowMeans(radius, result.data.data());
+        return result;
+    }
+
+private:
+    int m_width, m_height;
+    size_t m_stride;
+    std::vector<Accum> m_table;
+};
+
+#pragma endregion Summed-area table
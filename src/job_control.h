@@ -0,0 +1,204 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string_view>
+
+/*
+ * Cooperative cancellation and progress of long-running kernels.
+ *
+ * A JobControl is the token of one job (e.g. a request of the image service): a cancelled flag
+ * that any thread may set, and an optional progress callback. The job runs under a
+ * JobControlScope, which makes it the current control of the calling thread, like the image
+ * memory resource. Kernels pick it up where they start, before their parallel region, since the
+ * threads of the region do not inherit it:
+ *
+ *  - the TileScheduler stops handing out tiles once the job is cancelled and reports the tiles
+ *    done, its users call scheduler.throwIfCancelled() after the region;
+ *  - forEachStencilPixel() skips the remaining rows and throws after the loop;
+ *  - the Poisson solvers check between iterations (see PoissonControl) and report their
+ *    iterations to the job instead of printing them.
+ *
+ * A cancelled kernel throws CancelledError once its threads have left the parallel region, so a
+ * job that is abandoned frees its threads within a tile, a row or a few iterations. Its partial
+ * results are discarded. Without a current control nothing is checked or reported.
+ *
+ * The same checks are the points where a job yields: while a job is preempted (see
+ * job_scheduler.h), every thread that reaches a checkpoint() sleeps until the job is resumed or
+ * cancelled, so a higher-priority job gets the cores within a tile, a row or an iteration.
+ */
+
+#pragma region Job control
+
+/// <summary>
+/// Number of progress reports of a JobProgressCounter over its total.
+/// </summary>
+constexpr int64_t JOB_PROGRESS_STEPS = 100;
+
+/// <summary>
+/// Progress of one stage of a job, passed to JobControl::on_progress.
+/// </summary>
+struct JobProgress {
+    // Kernel reporting, e.g. "solvePoisson".
+    std::string_view stage;
+    // Units (iterations, tiles, rows) done so far and in total.
+    int64_t done = 0;
+    int64_t total = 0;
+};
+
+/// <summary>
+/// Thrown by a kernel whose job was cancelled.
+/// </summary>
+class CancelledError : public std::exception {
+public:
+    const char* what() const noexcept override { return "cancelled"; }
+};
+
+/// <summary>
+/// Cancellation token, preemption and progress callback of one job, see above.
+/// </summary>
+class JobControl {
+public:
+    // Progress output, empty for none. Set before the job starts; called by one thread at a time.
+    std::function<void(const JobProgress&)> on_progress;
+
+    JobControl() = default;
+    JobControl(const JobControl&) = delete;
+    JobControl& operator=(const JobControl&) = delete;
+
+    /// <summary>
+    /// Requests the job to stop, from any thread.
+    /// </summary>
+    void cancel()
+    {
+        const std::lock_guard lock(m_pause_mutex);
+        m_cancelled.store(true, std::memory_order_relaxed);
+        m_resumed.notify_all();
+    }
+    bool cancelled() const { return m_cancelled.load(std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Makes the threads of the job sleep at their next checkpoint() until it is called with false.
+    /// </summary>
+    void setPreempted(const bool preempted)
+    {
+        const std::lock_guard lock(m_pause_mutex);
+        m_preempted.store(preempted, std::memory_order_relaxed);
+        if (!preempted) {
+            m_resumed.notify_all();
+        }
+    }
+    bool preempted() const { return m_preempted.load(std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Point where a kernel yields: waits while the job is preempted, true once it is cancelled.
+    /// </summary>
+    bool checkpoint() const
+    {
+        if (m_preempted.load(std::memory_order_relaxed)) {
+            std::unique_lock lock(m_pause_mutex);
+            m_resumed.wait(lock, [&] { return !m_preempted.load(std::memory_order_relaxed) || cancelled(); });
+        }
+        return cancelled();
+    }
+
+    void throwIfCancelled() const
+    {
+        if (checkpoint()) {
+            throw CancelledError();
+        }
+    }
+
+    bool reportsProgress() const { return bool(on_progress); }
+    void report(const JobProgress& progress) const
+    {
+        if (on_progress) {
+            const std::lock_guard lock(m_mutex);
+            on_progress(progress);
+        }
+    }
+
+private:
+    std::atomic<bool> m_cancelled { false };
+    std::atomic<bool> m_preempted { false };
+    mutable std::mutex m_mutex;
+    mutable std::mutex m_pause_mutex;
+    mutable std::condition_variable m_resumed;
+};
+
+/// <summary>
+/// Job of the calling thread, nullptr outside of a JobControlScope.
+/// </summary>
+inline JobControl*& currentJobControl()
+{
+    thread_local JobControl* control = nullptr;
+    return control;
+}
+
+/// <summary>
+/// RAII scope that makes the kernels started on this thread check and report to a job.
+/// </summary>
+class JobControlScope {
+public:
+    explicit JobControlScope(JobControl* control)
+        : previous(currentJobControl())
+    {
+        currentJobControl() = control;
+    }
+    ~JobControlScope() { currentJobControl() = previous; }
+
+    JobControlScope(const JobControlScope&) = delete;
+    JobControlScope& operator=(const JobControlScope&) = delete;
+
+private:
+    JobControl* previous;
+};
+
+/// <summary>
+/// Checkpoint of the job of the calling thread, throws CancelledError when it was cancelled.
+/// </summary>
+inline void throwIfCancelled(const JobControl* job = currentJobControl())
+{
+    if (job) {
+        job->throwIfCancelled();
+    }
+}
+
+/// <summary>
+/// Units of a stage done by any number of threads, reported to the job about JOB_PROGRESS_STEPS
+/// times over the total.
+/// </summary>
+class JobProgressCounter {
+public:
+    JobProgressCounter(const std::string_view stage, const int64_t total, const JobControl* job = currentJobControl())
+        : m_job(job && job->reportsProgress() ? job : nullptr)
+        , m_stage(stage)
+        , m_total(total)
+        , m_step(std::max<int64_t>(total / JOB_PROGRESS_STEPS, 1))
+    {
+    }
+
+    void add(const int64_t units = 1)
+    {
+        if (!m_job) {
+            return;
+        }
+        const int64_t done = m_done.fetch_add(units, std::memory_order_relaxed) + units;
+        if (done / m_step != (done - units) / m_step || done == m_total) {
+            m_job->report({ m_stage, done, m_total });
+        }
+    }
+
+private:
+    const JobControl* m_job;
+    std::string_view m_stage;
+    int64_t m_total;
+    int64_t m_step;
+    std::atomic<int64_t> m_done { 0 };
+};
+
+#pragma endregion Job control
@@ -0,0 +1,314 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "execution.h"
+#include "job_control.h"
+#include "stage_profiler.h"
+
+/*
+ * Priority classes of the jobs of a long-running process.
+ *
+ * An interactive request (a preview, a zoomed region) must not wait behind a long batch job.
+ * A JobScheduler runs the submitted jobs on lanes, threads of their own that each run one job at
+ * a time with all kernel threads, and orders them by class:
+ *
+ *  - an interactive job starts before any waiting batch job, and no batch job starts while an
+ *    interactive job runs or waits;
+ *  - a running interactive job preempts the running batch jobs: their threads sleep at the next
+ *    checkpoint of their kernels (a tile, a row, a Poisson iteration, see job_control.h) until the
+ *    last interactive job has finished, so the interactive job gets the cores within milliseconds
+ *    and the batch job continues where it stopped instead of starting over;
+ *  - every class has a quota: the jobs it runs at once (its lanes), and the live image bytes it may
+ *    hold when a new job of the class starts. The images a job creates are counted for its class;
+ *    a class over its memory quota starts its next job only once its running jobs are done.
+ *
+ * A preempted job may hold a resource an interactive job needs (e.g. a cached session). The
+ * interactive job then waits in a PreemptionPause, which lets the batch jobs run until the
+ * resource is free, so the two do not wait for each other.
+ */
+
+#pragma region Job scheduler
+
+/// <summary>
+/// Priority class of a job, see above.
+/// </summary>
+enum class JobPriority {
+    Interactive,
+    Batch,
+};
+
+constexpr int JOB_PRIORITY_COUNT = 2;
+
+/// <summary>
+/// Limits of one priority class.
+/// </summary>
+struct JobClassQuota {
+    // Jobs of the class running at once, at least 1.
+    int max_jobs = 1;
+    // Live image bytes of the class above which no further job of the class starts, 0 for no limit.
+    size_t max_memory_bytes = 0;
+};
+
+/// <summary>
+/// Quotas of the priority classes.
+/// </summary>
+struct JobSchedulerQuotas {
+    JobClassQuota interactive;
+    JobClassQuota batch;
+
+    const JobClassQuota& of(const JobPriority priority) const { return priority == JobPriority::Interactive ? interactive : batch; }
+};
+
+/// <summary>
+/// A submitted job.
+/// </summary>
+struct ScheduledJob {
+    // Request of the job, interpreted by the runner.
+    std::string request;
+    JobPriority priority = JobPriority::Batch;
+    std::chrono::steady_clock::time_point arrival;
+    // Cancellation, preemption and progress of the job.
+    std::shared_ptr<JobControl> control;
+};
+
+/// <summary>
+/// Runs jobs by priority class on lanes of their own, see above.
+/// </summary>
+class JobScheduler {
+public:
+    /// <param name="quotas">lanes and memory of every class</param>
+    /// <param name="memory">resource the images of the jobs draw from, counted per class</param>
+    /// <param name="run">called as run(job) on a lane, under the job's control and memory scopes</param>
+    JobScheduler(const JobSchedulerQuotas& quotas, std::pmr::memory_resource* memory, std::function<void(ScheduledJob&)> run)
+        : m_quotas(quotas)
+        , m_memory { ImageAllocationCounter(memory), ImageAllocationCounter(memory) }
+        , m_run(std::move(run))
+    {
+        m_quotas.interactive.max_jobs = std::max(m_quotas.interactive.max_jobs, 1);
+        m_quotas.batch.max_jobs = std::max(m_quotas.batch.max_jobs, 1);
+        // The lanes use the kernel threads of the creating thread.
+        const int threads = getThreadCount();
+        for (const auto priority : { JobPriority::Interactive, JobPriority::Batch }) {
+            for (int i = 0; i < m_quotas.of(priority).max_jobs; i++) {
+                m_lanes.emplace_back([this, threads, priority] {
+                    setThreadCount(threads);
+                    runLane(priority);
+                });
+            }
+        }
+    }
+
+    ~JobScheduler() { finish(); }
+
+    JobScheduler(const JobScheduler&) = delete;
+    JobScheduler& operator=(const JobScheduler&) = delete;
+
+    /// <summary>
+    /// Queues a job behind the waiting jobs of its class.
+    /// </summary>
+    void submit(std::string request, const JobPriority priority)
+    {
+        const std::lock_guard lock(m_mutex);
+        m_waiting[index(priority)].push_back({ std::move(request), priority, std::chrono::steady_clock::now(), std::make_shared<JobControl>() });
+        m_changed.notify_all();
+    }
+
+    /// <summary>
+    /// Cancels every running and waiting job.
+    /// </summary>
+    void cancelAll()
+    {
+        const std::lock_guard lock(m_mutex);
+        for (const auto& [control, priority] : m_running) {
+            control->cancel();
+        }
+        for (const auto& waiting : m_waiting) {
+            for (const auto& job : waiting) {
+                job.control->cancel();
+            }
+        }
+    }
+
+    /// <summary>
+    /// Runs the jobs submitted so far to their end and stops the lanes.
+    /// </summary>
+    void finish()
+    {
+        {
+            const std::lock_guard lock(m_mutex);
+            m_closed = true;
+            m_changed.notify_all();
+        }
+        for (auto& lane : m_lanes) {
+            if (lane.joinable()) {
+                lane.join();
+            }
+        }
+    }
+
+    /// <summary>
+    /// Jobs submitted and not started yet.
+    /// </summary>
+    size_t depth() const
+    {
+        const std::lock_guard lock(m_mutex);
+        return m_waiting[0].size() + m_waiting[1].size();
+    }
+
+    /// <summary>
+    /// Times a running batch job was preempted.
+    /// </summary>
+    uint64_t preemptions() const
+    {
+        const std::lock_guard lock(m_mutex);
+        return m_preemptions;
+    }
+
+    /// <summary>
+    /// Live image bytes of the jobs (and the results they left in caches) of a class.
+    /// </summary>
+    uint64_t liveBytes(const JobPriority priority) const { return m_memory[index(priority)].liveBytes(); }
+
+    /// <summary>
+    /// Lets the preempted batch jobs run while an interactive job waits for one of them, see above.
+    /// Has no effect on other threads than the lanes of interactive jobs.
+    /// </summary>
+    class PreemptionPause {
+    public:
+        explicit PreemptionPause(JobScheduler& scheduler)
+            : m_scheduler(currentLanePriority() == JobPriority::Interactive ? &scheduler : nullptr)
+        {
+            if (m_scheduler) {
+                m_scheduler->changePreemptors(-1);
+            }
+        }
+        ~PreemptionPause()
+        {
+            if (m_scheduler) {
+                m_scheduler->changePreemptors(1);
+            }
+        }
+
+        PreemptionPause(const PreemptionPause&) = delete;
+        PreemptionPause& operator=(const PreemptionPause&) = delete;
+
+    private:
+        JobScheduler* m_scheduler;
+    };
+
+private:
+    static int index(const JobPriority priority) { return priority == JobPriority::Interactive ? 0 : 1; }
+
+    // Class of the job run by the calling lane, Batch outside of the lanes.
+    static JobPriority& currentLanePriority()
+    {
+        thread_local JobPriority priority = JobPriority::Batch;
+        return priority;
+    }
+
+    // Whether the next waiting job of a class may start, with the mutex held.
+    bool admits(const JobPriority priority) const
+    {
+        const int i = index(priority);
+        if (m_waiting[i].empty()) {
+            return false;
+        }
+        if (priority == JobPriority::Batch && (m_running_jobs[0] > 0 || !m_waiting[0].empty())) {
+            return false;
+        }
+        const auto& quota = m_quotas.of(priority);
+        return m_running_jobs[i] == 0 || quota.max_memory_bytes == 0 || m_memory[i].liveBytes() < quota.max_memory_bytes;
+    }
+
+    // Adds to the interactive jobs that preempt the batch jobs, with the mutex not held.
+    void changePreemptors(const int delta)
+    {
+        const std::lock_guard lock(m_mutex);
+        m_preemptors += delta;
+        updatePreemption();
+    }
+
+    // Preempts or resumes the running batch jobs, with the mutex held.
+    void updatePreemption()
+    {
+        const bool preempt = m_preemptors > 0;
+        for (const auto& [control, priority] : m_running) {
+            if (priority == JobPriority::Batch && control->preempted() != preempt) {
+                control->setPreempted(preempt);
+                m_preemptions += preempt ? 1 : 0;
+            }
+        }
+    }
+
+    void runLane(const JobPriority priority)
+    {
+        const int i = index(priority);
+        currentLanePriority() = priority;
+        while (true) {
+            ScheduledJob job;
+            {
+                std::unique_lock lock(m_mutex);
+                // The admission of a class changes with the jobs of both classes, so lanes wait on one condition.
+                m_changed.wait(lock, [&] { return admits(priority) || (m_closed && m_waiting[i].empty()); });
+                if (!admits(priority)) {
+                    return;
+                }
+                job = std::move(m_waiting[i].front());
+                m_waiting[i].pop_front();
+                m_running_jobs[i]++;
+                m_running.emplace(job.control, priority);
+                if (priority == JobPriority::Interactive) {
+                    m_preemptors++;
+                    updatePreemption();
+                }
+            }
+
+            {
+                const ImageMemoryScope memory_scope(&m_memory[i]);
+                const JobControlScope job_scope(job.control.get());
+                m_run(job);
+            }
+
+            const std::lock_guard lock(m_mutex);
+            m_running_jobs[i]--;
+            m_running.erase(job.control);
+            if (priority == JobPriority::Interactive) {
+                m_preemptors--;
+                updatePreemption();
+            }
+            m_changed.notify_all();
+        }
+    }
+
+    JobSchedulerQuotas m_quotas;
+    std::array<ImageAllocationCounter, JOB_PRIORITY_COUNT> m_memory;
+    std::function<void(ScheduledJob&)> m_run;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::array<std::deque<ScheduledJob>, JOB_PRIORITY_COUNT> m_waiting;
+    std::array<int, JOB_PRIORITY_COUNT> m_running_jobs {};
+    std::map<std::shared_ptr<JobControl>, JobPriority> m_running;
+    // Running interactive jobs that are not in a PreemptionPause.
+    int m_preemptors = 0;
+    uint64_t m_preemptions = 0;
+    bool m_closed = false;
+    // Joined by finish().
+    std::vector<std::thread> m_lanes;
+};
+
+#pragma endregion Job scheduler
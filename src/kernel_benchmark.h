@@ -0,0 +1,1150 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <framework/image_pool.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "bilateral_spacetime.h"
+#include "gpu_compute.h"
+#include "padded_image.h"
+#include "padded_tone_map.h"
+#include "perf_counters.h"
+#include "pixel_layout.h"
+#include "planar_tone_map.h"
+#include "poisson_batch.h"
+#include "synthetic_workload.h"
+#include "tone_map_sweep.h"
+#include "your_code_here.h"
+
+/*
+ * Kernel benchmarks.
+ *
+ * "a1_hdr --benchmark" times every kernel of your_code_here.h and helpers.h on synthetic HDR
+ * images of the requested sizes (squares, "512,2k,4k,8k") and thread counts. Implementations of
+ * one kernel are variants "kernel/variant" (bilateralFilter/grid, solvePoisson/sor, ...); the
+ * first variant is the reference and the "x ref" column is its time divided by the variant's.
+ *
+ * Every kernel runs once to warm up, then until min_seconds have passed (at most max_repeats
+ * runs); the median is reported. MPix/s counts pixel updates (pixels x iterations for the
+ * iterative Poisson solvers, solved pixels for the ones running to a tolerance), GB/s the
+ * nominal bytes read and written per update, which is a lower bound of the real traffic.
+ *
+ * With counters, every kernel runs once more under the hardware performance counters (see
+ * perf_counters.h): IPC tells compute-bound kernels (high IPC, e.g. exp in the bilateral filter)
+ * from stalled ones, LLC misses per update and the DRAM bytes per update and GB/s they imply
+ * show the kernels bound by memory, next to the nominal bytes above.
+ *
+ * With roofline, the bandwidth (STREAM triad) and the peak FLOP rate (independent multiply-add
+ * chains) of the machine are measured at every thread count, and every kernel with a known
+ * FLOP count per update (see kernelFlopsPerUpdate()) is placed under its roof: its arithmetic
+ * intensity is the FLOPs over the nominal bytes, its roof the smaller of the peak and intensity
+ * times bandwidth, and "% roof" how much of it the kernel attains (over 100% for inputs that fit
+ * in the caches, which are faster than the STREAM arrays). Kernels far below a memory
+ * roof gain from fusion (fewer bytes), kernels far below the compute roof from SIMD.
+ *
+ * The inputs are the fixed scene of makeSyntheticHdrImage() with a centered disk mask, or a
+ * generated workload of chosen dynamic range, edge density and mask shape (see
+ * synthetic_workload.h). Every size runs with every thread count (strong scaling); with weak
+ * scaling, each size is the size at the first thread count and grows with the thread count so
+ * that the pixels per thread stay the same (rounded to multiples of 8).
+ *
+ * With io, the load, quantize and encode paths of the file formats are timed as well, warm
+ * (file in the page cache) and cold (evicted from it), see makeIoBenchmarks().
+ *
+ * Results can be written as CSV and JSON (with the standard deviation of the timed runs) and
+ * compared against a baseline CSV or JSON of an earlier build. The threshold of every kernel
+ * is noise-aware: the larger of the tolerance and noise_sigmas times the combined relative
+ * standard deviation of both runs, so noisy kernels do not raise false alarms and stable ones
+ * flag small changes. Kernels slower than their threshold are regressions, faster ones
+ * improvements; a summary per image size and a list per kernel follow the table, and the run
+ * fails on a regression, so it can gate changes.
+ * An 8K run needs about 4 GB for the inputs.
+ *
+ * The same kernels also run as Catch2 benchmarks in a1_hdr_benchmark (src/benchmark.cpp): every
+ * kernel is a BENCHMARK timed by Catch2 (warm-up, samples and their bootstrapped statistics),
+ * the table, CSV and JSON above report its median and standard deviation, and the comparison
+ * with a baseline uses that standard deviation for the noise threshold; every regression is a
+ * failed check of the Catch2 run.
+ */
+
+#pragma region Kernel benchmarks
+
+/// <summary>
+/// Settings of a benchmark run, see above.
+/// </summary>
+struct KernelBenchmarkOptions {
+    // Side lengths of the square inputs.
+    std::vector<int> sizes { 512, 2048 };
+    // Thread counts, 0 is the default count.
+    std::vector<int> threads { 0 };
+    // Kernel name prefixes, all kernels when empty.
+    std::vector<std::string> kernels;
+    // Load, quantize and encode benchmarks, with their files in io_dir, see makeIoBenchmarks().
+    bool io = false;
+    std::filesystem::path io_dir = std::filesystem::temp_directory_path() / "a1_hdr_io";
+    // Iterations of the iterative Poisson solvers.
+    int poisson_iters = 50;
+    double min_seconds = 0.3;
+    int max_repeats = 10;
+    // Result table as CSV, none when empty.
+    std::filesystem::path csv;
+    // Result list as JSON, none when empty.
+    std::filesystem::path json;
+    // Earlier results (CSV or JSON) to compare with, the smallest threshold (0.1 = 10%) and the
+    // standard deviations of noise a threshold allows, see above.
+    std::filesystem::path baseline;
+    double tolerance = 0.1;
+    double noise_sigmas = 3.0;
+    // Hardware counters of one extra run per kernel, see above.
+    bool counters = false;
+    // Roofline report of the kernels, see above.
+    bool roofline = false;
+    // Generated inputs, the fixed scene and disk mask when none.
+    std::optional<SyntheticWorkload> workload;
+    // Scale the size with the thread count, see above.
+    bool weak_scaling = false;
+};
+
+struct KernelBenchmarkResult {
+    std::string kernel;
+    int size = 0;
+    int threads = 0;
+    double median_ms = 0.0;
+    // Standard deviation of the timed runs and their number.
+    double stddev_ms = 0.0;
+    int samples = 1;
+    double mpix_per_s = 0.0;
+    double gb_per_s = 0.0;
+    double speedup = 1.0;
+    // Hardware counters, 0 when not measured.
+    double ipc = 0.0;
+    double llc_misses_per_update = 0.0;
+    double dram_bytes_per_update = 0.0;
+    double dram_gb_per_s = 0.0;
+    // Roofline, 0 when not measured or not modeled.
+    double gflop_per_s = 0.0;
+    double flop_per_byte = 0.0;
+    double roof_fraction = 0.0;
+};
+
+/// <summary>
+/// HDR test image of about six orders of magnitude: smooth light falloff, a bright spot and
+/// deterministic per-pixel noise for texture.
+/// </summary>
+/// <param name="size">width and height</param>
+ImageRGB makeSyntheticHdrImage(const int size)
+{
+    auto image = ImageRGB::uninitialized(size, size);
+#pragma omp parallel for
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            const float u = float(x) / float(size), v = float(y) / float(size);
+            uint32_t hash = uint32_t(x) * 0x9E3779B1u ^ uint32_t(y) * 0x85EBCA77u;
+            hash ^= hash >> 15;
+            hash *= 0x2C1B3C6Du;
+            hash ^= hash >> 12;
+            const float noise = float(hash & 0xFFFF) / 65535.0f;
+            const float log_value = 4.0f * std::sin(6.0f * u) * std::cos(4.0f * v) + 6.0f * std::exp(-40.0f * ((u - 0.7f) * (u - 0.7f) + (v - 0.3f) * (v - 0.3f))) + 0.5f * noise - 2.0f;
+            const float value = std::exp(log_value);
+            image.data[size_t(y) * size + x] = glm::vec3(value, value * (0.8f + 0.2f * u), value * (0.7f + 0.3f * v));
+        }
+    }
+    return image;
+}
+
+/// <summary>
+/// Synthetic inputs of one size, shared by all kernels.
+/// </summary>
+struct KernelBenchmarkInputs {
+    ImageRGB hdr;
+    // hdr in the other layouts of Part I, see planar_tone_map.h and padded_tone_map.h.
+    ImageRgbPlanes hdr_planes;
+    ImageRgbPadded hdr_padded;
+    ImageFloat luminance, log_lum, base, detail;
+    ImageGradient gradients;
+    ImageGradientInterleaved gradients_interleaved;
+    PaddedGradient gradients_padded;
+    ImageFloat divergence;
+    ImageXYZ xyz;
+    // hdr / (1 + hdr), an LDR image for the 8- and 16-bit formats.
+    ImageRGB ldr;
+    // Centered disk of half the image size, or the mask of the workload.
+    BinaryMask disk_mask;
+    // Centered disk of at most 512 pixels across and its factorization, for the masked solves.
+    BinaryMask solve_mask;
+    std::shared_ptr<const PreparedPoissonMask> prepared_mask;
+    // 64 x 64 tiles of log_lum and divergence, small problems for the batched Poisson solver.
+    std::vector<ImageFloat> patches, patch_divergences;
+
+    explicit KernelBenchmarkInputs(const int size, const DurandParams& params, const std::optional<SyntheticWorkload>& workload = std::nullopt)
+        : hdr(workload ? makeSyntheticHdr(size, size, *workload) : makeSyntheticHdrImage(size))
+    {
+        hdr_planes = imageVec3ToPlane3Simd(hdr);
+        hdr_padded = padRgb(hdr);
+        luminance = rgbToLuminance(hdr);
+        log_lum = logImage(luminance);
+        base = bilateralFilter(log_lum, params.filter_size, params.space_sigma, params.range_sigma, BilateralEngine::Grid);
+        detail = getDetailImage(log_lum, base);
+        gradients = getGradients(log_lum);
+        gradients_interleaved = getGradients<GradientLayout::Interleaved>(log_lum);
+        auto log_lum_padded = PaddedImage<float>::copyOf(log_lum, 1, GhostFill::Zero);
+        gradients_padded = getGradientsPadded(log_lum_padded);
+        auto gradients_copy = gradients;
+        divergence = getDivergence(gradients_copy);
+        xyz = rgbToXYZSimd(hdr);
+        ldr = ImageRGB::uninitialized(size, size);
+        std::transform(hdr.data.begin(), hdr.data.end(), ldr.data.begin(), [](const glm::vec3& value) { return value / (1.0f + value); });
+        if (workload) {
+            disk_mask = makeSyntheticMask(size, size, *workload);
+        } else {
+            disk_mask = BinaryMask(size, size);
+            for (int y = 0; y < size; y++) {
+                for (int x = 0; x < size; x++) {
+                    const float dx = float(x) - 0.5f * float(size), dy = float(y) - 0.5f * float(size);
+                    disk_mask.set(x, y, 16.0f * (dx * dx + dy * dy) < float(size) * float(size));
+                }
+            }
+        }
+        solve_mask = BinaryMask(size, size);
+        const float radius = 0.5f * float(std::min(size / 2, 512));
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                const float dx = float(x) - 0.5f * float(size), dy = float(y) - 0.5f * float(size);
+                solve_mask.set(x, y, dx * dx + dy * dy < radius * radius);
+            }
+        }
+        prepared_mask = std::make_shared<const PreparedPoissonMask>(solve_mask, size, size);
+        for (int y = 0; y + 64 <= size; y += 64) {
+            for (int x = 0; x + 64 <= size; x += 64) {
+                patches.emplace_back(log_lum.view(x, y, 64, 64));
+                patch_divergences.emplace_back(divergence.view(x, y, 64, 64));
+            }
+        }
+    }
+};
+
+/// <summary>
+/// One benchmarked kernel.
+/// </summary>
+struct KernelBenchmark {
+    // "kernel" or "kernel/variant".
+    std::string name;
+    // Nominal bytes read and written per update, 0 when unknown.
+    double bytes_per_update = 0.0;
+    // Updates per pixel of one run.
+    double updates_per_pixel = 1.0;
+    std::function<void(const KernelBenchmarkInputs&)> run;
+    // Untimed setup before every run (e.g. evicting a file from the page cache), none when empty.
+    std::function<void(const KernelBenchmarkInputs&)> prepare = {};
+};
+
+/// <summary>
+/// Keeps the result of a kernel alive, so the call cannot be optimized away.
+/// </summary>
+template <typename T>
+void keepBenchmarkResult(const T& result)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    // The empty asm may read anything behind the address, so the stores of result must happen.
+    asm volatile("" : : "g"(&result) : "memory");
+#else
+    static std::atomic<const void*> sink;
+    sink.store(&result, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+/// <summary>
+/// Runs a kernel with its outputs stored in one mode of streaming_store.h, into buffers recycled
+/// by a pool: streamed into fresh pages, which the OS zeroes through the cache, the stores would
+/// time the page faults.
+/// </summary>
+template <typename Fn>
+void runInStoreMode(const bool streaming, const Fn& run)
+{
+    static ImageBufferPool pool;
+    const ImageMemoryScope memory_scope(&pool);
+    const StreamingStoreScope store_mode(streaming ? 1 : 0);
+    run();
+}
+
+/// <summary>
+/// All kernels, variants of a kernel in a row with the reference first.
+/// </summary>
+/// <param name="params">Durand parameters of the filter and tone mapping kernels</param>
+/// <param name="poisson_iters">iterations of the iterative Poisson solvers</param>
+std::vector<KernelBenchmark> makeKernelBenchmarks(const DurandParams& params, const int poisson_iters)
+{
+    using In = KernelBenchmarkInputs;
+    // No progress output between the timings.
+    PoissonControl quiet;
+    quiet.report_every = 0;
+    quiet.on_progress = {};
+    std::vector<KernelBenchmark> benchmarks {
+        { "rgbToLuminance", 16, 1, [](const In& in) { keepBenchmarkResult(rgbToLuminance(in.hdr)); } },
+        { "logImage/helpers", 8, 1, [](const In& in) { keepBenchmarkResult(logImage(in.luminance)); } },
+        { "logImage/exact", 8, 1, [](const In& in) { keepBenchmarkResult(logImage(in.luminance, MathPrecision::Exact)); } },
+        { "logImage/fast", 8, 1, [](const In& in) { keepBenchmarkResult(logImage(in.luminance, MathPrecision::Fast)); } },
+        { "logImage/faster", 8, 1, [](const In& in) { keepBenchmarkResult(logImage(in.luminance, MathPrecision::Faster)); } },
+        { "getDetailImage", 12, 1, [](const In& in) { keepBenchmarkResult(getDetailImage(in.log_lum, in.base)); } },
+        // Both store modes of streaming_store.h, whatever the size, see runInStoreMode().
+        { "getDetailImage/cached", 12, 1, [](const In& in) { runInStoreMode(false, [&] { keepBenchmarkResult(getDetailImage(in.log_lum, in.base)); }); } },
+        { "getDetailImage/streaming", 12, 1, [](const In& in) { runInStoreMode(true, [&] { keepBenchmarkResult(getDetailImage(in.log_lum, in.base)); }); } },
+        { "applyDurandToneMappingOperator/exact", 12, 1,
+            [params](const In& in) { keepBenchmarkResult(applyDurandToneMappingOperator(in.base, in.detail, params.base_scale, params.output_gain)); } },
+        { "applyDurandToneMappingOperator/fast", 12, 1,
+            [params](const In& in) { keepBenchmarkResult(applyDurandToneMappingOperator(in.base, in.detail, params.base_scale, params.output_gain, MathPrecision::Fast)); } },
+        { "applyDurandToneMappingOperator/cached", 12, 1, [params](const In& in) {
+             runInStoreMode(false, [&] { keepBenchmarkResult(applyDurandToneMappingOperator(in.base, in.detail, params.base_scale, params.output_gain)); });
+         } },
+        { "applyDurandToneMappingOperator/streaming", 12, 1, [params](const In& in) {
+             runInStoreMode(true, [&] { keepBenchmarkResult(applyDurandToneMappingOperator(in.base, in.detail, params.base_scale, params.output_gain)); });
+         } },
+        { "rescaleRgbByLuminance/exact", 32, 1,
+            [params](const In& in) { keepBenchmarkResult(rescaleRgbByLuminance(in.hdr, in.luminance, in.luminance, params.saturation)); } },
+        { "rescaleRgbByLuminance/fast", 32, 1,
+            [params](const In& in) { keepBenchmarkResult(rescaleRgbByLuminance(in.hdr, in.luminance, in.luminance, params.saturation, MathPrecision::Fast)); } },
+        // The pixel layouts of Part I side by side, see padded_tone_map.h.
+        { "rescaleRgbByLuminance/planar", 32, 1,
+            [params](const In& in) { keepBenchmarkResult(rescaleRgbByLuminancePlanar(in.hdr_planes, in.luminance, in.luminance, params.saturation)); } },
+        { "rescaleRgbByLuminance/padded", 36, 1,
+            [params](const In& in) { keepBenchmarkResult(rescaleRgbByLuminancePadded(in.hdr_padded, in.luminance, params.saturation)); } },
+        { "durandLogLuminance/interleaved", 16, 1, [params](const In& in) { keepBenchmarkResult(durandLogLuminance(in.hdr, params)); } },
+        { "durandLogLuminance/planar", 16, 1, [params](const In& in) { keepBenchmarkResult(durandLogLuminancePlanar(in.hdr_planes, params)); } },
+        { "durandLogLuminance/padded", 20, 1, [params](const In& in) { keepBenchmarkResult(durandLogLuminancePadded(in.hdr_padded, params)); } },
+        { "durandCompose/interleaved", 32, 1, [params](const In& in) { keepBenchmarkResult(durandCompose(in.hdr, in.log_lum, in.base, params)); } },
+        { "durandCompose/planar", 32, 1, [params](const In& in) { keepBenchmarkResult(durandComposePlanar(in.hdr_planes, in.log_lum, in.base, params)); } },
+        { "durandCompose/padded", 40, 1, [params](const In& in) { keepBenchmarkResult(durandComposePadded(in.hdr_padded, in.log_lum, in.base, params)); } },
+        // Per variant: one variant, and 8 composed in one pass over the image (tone_map_sweep.h).
+        { "composeDurandSweep/1", 32, 1, [params](const In& in) {
+             const ToneMapVariant variant { params.base_scale, params.output_gain, params.saturation };
+             keepBenchmarkResult(composeDurandSweep(in.hdr, in.base, in.detail, std::span(&variant, 1), params.math_precision));
+         } },
+        { "composeDurandSweep/8", 14.5, 8, [params](const In& in) {
+             std::vector<ToneMapVariant> variants;
+             for (int i = 0; i < 8; i++) {
+                 variants.push_back({ params.base_scale * (0.5f + 0.125f * float(i)), params.output_gain, params.saturation });
+             }
+             keepBenchmarkResult(composeDurandSweep(in.hdr, in.base, in.detail, variants, params.math_precision));
+         } },
+        { "applyGamma/exact", 24, 1, [](const In& in) { keepBenchmarkResult(applyGamma(in.hdr, 1.0f / 2.2f)); } },
+        { "applyGamma/fast", 24, 1, [](const In& in) { keepBenchmarkResult(applyGamma(in.hdr, 1.0f / 2.2f, false, std::nullopt, MathPrecision::Fast)); } },
+        { "normalizeRGBImage", 24, 1, [](const In& in) { keepBenchmarkResult(normalizeRGBImage(in.hdr)); } },
+        { "normalizeRGBImage/cached", 24, 1, [](const In& in) { runInStoreMode(false, [&] { keepBenchmarkResult(normalizeRGBImage(in.hdr)); }); } },
+        { "normalizeRGBImage/streaming", 24, 1, [](const In& in) { runInStoreMode(true, [&] { keepBenchmarkResult(normalizeRGBImage(in.hdr)); }); } },
+        { "normalizeFloatImage", 8, 1, [](const In& in) { keepBenchmarkResult(normalizeFloatImage(in.log_lum)); } },
+        { "toneMapDurand", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapDurand(in.hdr, params)); } },
+        { "toneMapDurand/planar", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapDurandPlanar(in.hdr_planes, params)); } },
+        { "toneMapDurand/padded", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapDurandPadded(in.hdr_padded, params)); } },
+        { "toneMapGlobal/reinhard", 36, 1, [params](const In& in) {
+             auto global_params = params;
+             global_params.tone_operator = ToneMapOperator::Reinhard;
+             keepBenchmarkResult(toneMapGlobal(in.hdr, global_params));
+         } },
+        { "toneMapGlobal/filmic", 36, 1, [params](const In& in) {
+             auto global_params = params;
+             global_params.tone_operator = ToneMapOperator::Filmic;
+             keepBenchmarkResult(toneMapGlobal(in.hdr, global_params));
+         } },
+        { "toneMapLocalLaplacian", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapLocalLaplacian(in.hdr, params)); } },
+        { "toneMapFattal", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapFattal(in.hdr, params)); } },
+        { "buildLaplacianPyramid", 8, 1, [](const In& in) {
+             std::vector<ImageFloat> pyramid;
+             buildLaplacianPyramid<float>(in.log_lum, pyramidDepth(in.log_lum.width, in.log_lum.height, 8), pyramid);
+             keepBenchmarkResult(pyramid[0]);
+         } },
+        { "SummedAreaTable/boxFilter", 40, 1, [](const In& in) { keepBenchmarkResult(SummedAreaTable<float>(in.log_lum).boxFilter(8)); } },
+        { "rgbToXYZ/helpers", 24, 1, [](const In& in) { keepBenchmarkResult(rgbToXYZ(in.hdr)); } },
+        { "rgbToXYZ/simd", 24, 1, [](const In& in) { keepBenchmarkResult(rgbToXYZSimd(in.hdr)); } },
+        { "rgbToXYZ/padded", 28, 1, [](const In& in) { keepBenchmarkResult(rgbToXYZPadded(in.hdr_padded)); } },
+        { "rgbToXYZ/cached", 24, 1, [](const In& in) { runInStoreMode(false, [&] { keepBenchmarkResult(rgbToXYZ(in.hdr)); }); } },
+        { "rgbToXYZ/streaming", 24, 1, [](const In& in) { runInStoreMode(true, [&] { keepBenchmarkResult(rgbToXYZ(in.hdr)); }); } },
+        { "xyzToRGB/helpers", 24, 1, [](const In& in) { keepBenchmarkResult(xyzToRGB(in.xyz)); } },
+        { "xyzToRGB/simd", 24, 1, [](const In& in) { keepBenchmarkResult(xyzToRGBSimd(in.xyz)); } },
+        { "getGradients", 12, 1, [](const In& in) { keepBenchmarkResult(getGradients(in.log_lum)); } },
+        { "getGradients/interleaved", 12, 1, [](const In& in) { keepBenchmarkResult(getGradients<GradientLayout::Interleaved>(in.log_lum)); } },
+        { "getDivergence", 12, 1, [](const In& in) { keepBenchmarkResult(getDivergence(in.gradients)); } },
+        { "getDivergence/interleaved", 12, 1, [](const In& in) { keepBenchmarkResult(getDivergence(in.gradients_interleaved)); } },
+        { "getDivergence/padded", 12, 1, [](const In& in) { keepBenchmarkResult(getDivergencePadded(in.gradients_padded)); } },
+        // The gradients of the image pasted onto themselves through a disk covering the middle.
+        { "copySourceGradientsToTarget", 28, 1, [](const In& in) { keepBenchmarkResult(copySourceGradientsToTarget(in.gradients, in.gradients, in.disk_mask)); } },
+        { "copySourceGradientsToTarget/interleaved", 28, 1,
+            [](const In& in) { keepBenchmarkResult(copySourceGradientsToTarget(in.gradients_interleaved, in.gradients_interleaved, in.disk_mask)); } },
+        { "getMergedDivergence", 8, 1, [](const In& in) {
+             // A 64 x 64 source in the middle: the rest of the target takes the direct Laplacian.
+             BinaryMask mask(64, 64);
+             for (int y = 0; y < 64; y++) {
+                 for (int x = 0; x < 64; x++) {
+                     mask.set(x, y, true);
+                 }
+             }
+             const int offset = std::max(in.log_lum.width / 2 - 32, 0);
+             keepBenchmarkResult(getMergedDivergence(in.patches.front(), in.log_lum, mask, offset, offset));
+         } },
+        { "solvePoisson/jacobi", 12, double(poisson_iters),
+            [=](const In& in) { keepBenchmarkResult(solvePoisson(in.log_lum, in.divergence, poisson_iters, PoissonMethod::Jacobi, 0.0f, quiet)); } },
+        { "solvePoisson/sor", 12, double(poisson_iters),
+            [=](const In& in) { keepBenchmarkResult(solvePoisson(in.log_lum, in.divergence, poisson_iters, PoissonMethod::RedBlackSor, 0.0f, quiet)); } },
+        { "solvePoisson/blocked_jacobi", 12, double(poisson_iters),
+            [=](const In& in) { keepBenchmarkResult(solvePoisson(in.log_lum, in.divergence, poisson_iters, PoissonMethod::BlockedJacobi, 0.0f, quiet)); } },
+        { "solvePoisson/jacobi_half", 6, double(poisson_iters),
+            [=](const In& in) { keepBenchmarkResult(solvePoisson(in.log_lum, in.divergence, poisson_iters, PoissonMethod::MixedJacobi, 0.0f, quiet)); } },
+        { "solvePoisson/jacobi_bf16", 6, double(poisson_iters), [=](const In& in) {
+             keepBenchmarkResult(solvePoissonMixed(in.log_lum, in.divergence, poisson_iters, MixedPoissonSmoother::Jacobi, PoissonStorage::Bfloat16));
+         } },
+        { "solvePoisson/sor_half", 6, double(poisson_iters),
+            [=](const In& in) { keepBenchmarkResult(solvePoisson(in.log_lum, in.divergence, poisson_iters, PoissonMethod::MixedSor, 0.0f, quiet)); } },
+        { "solvePoisson/multigrid", 0, 1, [](const In& in) { keepBenchmarkResult(solvePoissonMultigrid(in.log_lum, in.divergence)); } },
+        { "solvePoisson/cg", 0, 1, [](const In& in) { keepBenchmarkResult(solvePoissonCG(in.log_lum, in.divergence)); } },
+        { "solvePoisson/spectral", 0, 1, [](const In& in) { keepBenchmarkResult(solvePoissonSpectral(in.log_lum, in.divergence)); } },
+        { "solvePoisson/schwarz", 0, 1, [](const In& in) { keepBenchmarkResult(solvePoissonSchwarz(in.log_lum, in.divergence)); } },
+        { "solveStencil/multigrid", 0, 1, [](const In& in) { keepBenchmarkResult(solvePoissonStencil(in.log_lum, in.divergence)); } },
+        { "solveStencil/cg", 0, 1, [](const In& in) {
+             keepBenchmarkResult(solvePoissonStencil(in.log_lum, in.divergence, { StencilMethod::ConjugateGradient, 1e-4f, 2000 }));
+         } },
+        { "solvePoissonBatch/calls", 12, double(poisson_iters), [=](const In& in) {
+             for (size_t i = 0; i < in.patches.size(); i++) {
+                 keepBenchmarkResult(solvePoisson(in.patches[i], in.patch_divergences[i], poisson_iters, PoissonMethod::Jacobi, 0.0f, quiet));
+             }
+         } },
+        { "solvePoissonBatch/batched", 12, double(poisson_iters), [=](const In& in) {
+             std::vector<PoissonProblem> problems;
+             for (size_t i = 0; i < in.patches.size(); i++) {
+                 problems.push_back({ &in.patches[i], &in.patch_divergences[i] });
+             }
+             keepBenchmarkResult(solvePoissonBatch(problems, poisson_iters));
+         } },
+    };
+
+    // The filter engines, brute force (the reference) first.
+    const std::vector<std::pair<const char*, BilateralEngine>> engines {
+        { "bruteforce", BilateralEngine::BruteForce },
+        { "grid", BilateralEngine::Grid },
+        { "tiled", BilateralEngine::Tiled },
+        { "rangelut", BilateralEngine::RangeLut },
+        { "simd", BilateralEngine::Simd },
+        { "upsampled", BilateralEngine::Upsampled },
+        { "recursive", BilateralEngine::Recursive },
+        { "permutohedral", BilateralEngine::Permutohedral },
+        { "adaptive", BilateralEngine::Adaptive },
+        { "guided", BilateralEngine::Guided },
+        { "wls", BilateralEngine::Wls },
+    };
+    const auto filter_position = std::find_if(benchmarks.begin(), benchmarks.end(), [](const KernelBenchmark& b) { return b.name == "getDetailImage"; });
+    std::vector<KernelBenchmark> filters;
+    for (const auto& [engine_name, engine] : engines) {
+        filters.push_back({ std::string("bilateralFilter/") + engine_name, 8, 1,
+            [params, engine = engine](const In& in) { keepBenchmarkResult(bilateralFilter(in.log_lum, params.filter_size, params.space_sigma, params.range_sigma, engine)); } });
+    }
+    // Steady state of a video: every call adds a frame to a window of 5.
+    filters.push_back({ "bilateralFilter/spacetime", 8, 1,
+        [grid = std::make_shared<SpaceTimeBilateralGrid>(params.space_sigma, params.range_sigma, 5, 1.0f)](const In& in) { keepBenchmarkResult(grid->filter(in.log_lum)); } });
+    benchmarks.insert(filter_position, filters.begin(), filters.end());
+
+    // The stencils spanning rows in every pixel layout, row-major (the reference) first. The
+    // conversions at the boundary are timed with the kernel.
+    const auto layout_benchmarks = [&]<PixelLayout L>(const char* layout_name) {
+        benchmarks.push_back({ std::string("bilateralFilterLayout/") + layout_name, 8, 1, [params](const In& in) {
+                                  const LayoutImage<float, L> H(in.log_lum);
+                                  keepBenchmarkResult(bilateralFilterLayout(H, params.filter_size, params.space_sigma, params.range_sigma).toImage());
+                              } });
+    };
+    const auto jacobi_benchmarks = [&]<PixelLayout L>(const char* layout_name) {
+        benchmarks.push_back({ std::string("solvePoissonJacobiLayout/") + layout_name, 12, double(poisson_iters), [=](const In& in) {
+                                  const LayoutImage<float, L> initial(in.log_lum), divergence(in.divergence);
+                                  keepBenchmarkResult(solvePoissonJacobiLayout(initial, divergence, poisson_iters).toImage());
+                              } });
+    };
+    layout_benchmarks.template operator()<PixelLayout::RowMajor>("rowmajor");
+    layout_benchmarks.template operator()<PixelLayout::Tiled8>("tiled8");
+    layout_benchmarks.template operator()<PixelLayout::Tiled16>("tiled16");
+    layout_benchmarks.template operator()<PixelLayout::Morton>("morton");
+    jacobi_benchmarks.template operator()<PixelLayout::RowMajor>("rowmajor");
+    jacobi_benchmarks.template operator()<PixelLayout::Tiled8>("tiled8");
+    jacobi_benchmarks.template operator()<PixelLayout::Tiled16>("tiled16");
+    jacobi_benchmarks.template operator()<PixelLayout::Morton>("morton");
+
+    // The three planes of a Poisson edit, the reference for the GPU solve.
+    benchmarks.push_back({ "solvePoissonXYZ/cpu", 12, 3.0 * poisson_iters, [=](const In& in) {
+                              const ImageXYZ initial { in.log_lum, in.log_lum, in.log_lum };
+                              const ImageXYZ divergence { in.divergence, in.divergence, in.divergence };
+                              keepBenchmarkResult(solvePoissonXYZ(initial, divergence, poisson_iters));
+                          } });
+    // The same planes inside a disk: the sweeps of the masked solve, and the factorization of the
+    // prepared solve against the substitutions every later solve with the mask costs.
+    benchmarks.push_back({ "solvePoissonMaskedXYZ", 0, 1, [=](const In& in) {
+                              const ImageXYZ initial { in.log_lum, in.log_lum, in.log_lum };
+                              const ImageXYZ divergence { in.divergence, in.divergence, in.divergence };
+                              keepBenchmarkResult(solvePoissonMaskedXYZ(initial, divergence, in.solve_mask, poisson_iters));
+                          } });
+    benchmarks.push_back({ "solvePoissonPreparedXYZ/factorize", 0, 1, [](const In& in) {
+                              const PreparedPoissonMask prepared(in.solve_mask, in.log_lum.width, in.log_lum.height);
+                              keepBenchmarkResult(prepared.factorNonzeros());
+                          } });
+    benchmarks.push_back({ "solvePoissonPreparedXYZ/solve", 0, 1, [](const In& in) {
+                              const ImageXYZ initial { in.log_lum, in.log_lum, in.log_lum };
+                              const ImageXYZ divergence { in.divergence, in.divergence, in.divergence };
+                              keepBenchmarkResult(in.prepared_mask->solveXYZ(initial, divergence));
+                          } });
+    if (gpuComputeAvailable()) {
+        // Upload, all passes and the download of the result.
+        const auto tone_map_position = std::find_if(benchmarks.begin(), benchmarks.end(), [](const KernelBenchmark& b) { return b.name == "toneMapDurand"; });
+        benchmarks.insert(tone_map_position + 1, { "toneMapDurand/gpu", 0, 1, [params](const In& in) { keepBenchmarkResult(toneMapDurandGpu(in.hdr, params)); } });
+        benchmarks.push_back({ "solvePoissonXYZ/gpu", 12, 3.0 * poisson_iters, [=](const In& in) {
+                                  const ImageXYZ initial { in.log_lum, in.log_lum, in.log_lum };
+                                  const ImageXYZ divergence { in.divergence, in.divergence, in.divergence };
+                                  keepBenchmarkResult(solvePoissonXYZGpu(initial, divergence, poisson_iters));
+                              } });
+    }
+    return benchmarks;
+}
+
+/// <summary>
+/// Writes a file's dirty pages to the storage device and drops all its pages from the page
+/// cache, so the next read comes from the device (Linux; elsewhere the file stays cached).
+/// </summary>
+inline void evictFromPageCache(const std::filesystem::path& filePath)
+{
+#ifdef __linux__
+    const int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        ::close(fd);
+    }
+#else
+    (void)filePath;
+#endif
+}
+
+/// <summary>
+/// I/O benchmarks of the file formats, in groups:
+///  - quantize/uint8, quantize/uint16: the float to integer conversion of the integer outputs
+///    (floatsToUint8() / floatsToUint16() per row, in parallel);
+///  - encode/FORMAT: Image::writeToFile() (the Radiance encoder for hdr) with the file in the
+///    page cache, encode_cold/FORMAT the same and fsync() until it is on the device;
+///  - decode/FORMAT: Image(path) of a file in the page cache, decode_cold/FORMAT of a file just
+///    evicted from it (see evictFromPageCache()).
+/// The 8- and 16-bit formats hold the LDR image, the float formats the HDR image. The nominal
+/// bytes are those of the float image (12 per pixel), the file sizes differ by format.
+/// </summary>
+/// <param name="directory">directory of the written and read files</param>
+std::vector<KernelBenchmark> makeIoBenchmarks(const std::filesystem::path& directory)
+{
+    using In = KernelBenchmarkInputs;
+    std::filesystem::create_directories(directory);
+    const auto file_path = [directory](const char* role, const In& in, const std::string& extension) {
+        return directory / (std::string(role) + "_" + std::to_string(in.hdr.width) + "." + extension);
+    };
+    const auto is_float = [](const std::string& extension) { return extension == "hdr" || extension == "pfm" || extension == "exr" || extension == "f32"; };
+    const auto write = [is_float](const In& in, const std::filesystem::path& filePath) {
+        const auto extension = filePath.extension().string().substr(1);
+        if (extension == "hdr") {
+            const auto encoded = in.hdr.encodeToBuffer(ImageEncoding::Hdr);
+            std::ofstream(filePath, std::ios::binary).write(reinterpret_cast<const char*>(encoded.data()), std::streamsize(encoded.size()));
+        } else {
+            (is_float(extension) ? in.hdr : in.ldr).writeToFile(filePath);
+        }
+    };
+
+    std::vector<KernelBenchmark> benchmarks {
+        { "quantize/uint8", 15, 1, [](const In& in) {
+             std::vector<stbi_uc> pixels(in.ldr.data.size() * 3);
+#pragma omp parallel for num_threads(kernelThreads(in.ldr, KernelCost::Light))
+             for (int y = 0; y < in.ldr.height; y++) {
+                 const size_t first = size_t(y) * size_t(in.ldr.width) * 3;
+                 floatsToUint8(reinterpret_cast<const float*>(in.ldr.data.data()) + first, pixels.data() + first, size_t(in.ldr.width) * 3);
+             }
+             keepBenchmarkResult(pixels);
+         } },
+        { "quantize/uint16", 18, 1, [](const In& in) {
+             std::vector<uint16_t> pixels(in.ldr.data.size() * 3);
+#pragma omp parallel for num_threads(kernelThreads(in.ldr, KernelCost::Light))
+             for (int y = 0; y < in.ldr.height; y++) {
+                 const size_t first = size_t(y) * size_t(in.ldr.width) * 3;
+                 floatsToUint16(reinterpret_cast<const float*>(in.ldr.data.data()) + first, pixels.data() + first, size_t(in.ldr.width) * 3);
+             }
+             keepBenchmarkResult(pixels);
+         } },
+    };
+    for (const std::string extension : { "png", "jpg", "tif", "hdr", "pfm", "exr", "f32" }) {
+        benchmarks.push_back({ "encode/" + extension, 12, 1, [=](const In& in) { write(in, file_path("encode", in, extension)); } });
+    }
+    for (const std::string extension : { "png", "jpg", "tif", "hdr", "pfm", "exr", "f32" }) {
+        benchmarks.push_back({ "encode_cold/" + extension, 12, 1, [=](const In& in) {
+                                  const auto filePath = file_path("encode", in, extension);
+                                  write(in, filePath);
+                                  evictFromPageCache(filePath);
+                              } });
+    }
+    // TIFF is an output format only.
+    for (const bool cold : { false, true }) {
+        for (const std::string extension : { "png", "jpg", "hdr", "pfm", "exr", "f32" }) {
+            benchmarks.push_back({ std::string(cold ? "decode_cold/" : "decode/") + extension, 12, 1,
+                [=](const In& in) { keepBenchmarkResult(ImageRGB(file_path("decode", in, extension))); },
+                [=](const In& in) {
+                    // The input file of this size is written once per run of the program.
+                    static std::set<std::filesystem::path> written;
+                    static std::mutex mutex;
+                    const auto filePath = file_path("decode", in, extension);
+                    {
+                        std::lock_guard lock(mutex);
+                        if (written.insert(filePath).second) {
+                            write(in, filePath);
+                        }
+                    }
+                    if (cold) {
+                        evictFromPageCache(filePath);
+                    }
+                } });
+        }
+    }
+    return benchmarks;
+}
+
+/// <summary>
+/// Median and spread of the timed runs of one kernel.
+/// </summary>
+struct KernelTiming {
+    double median_ms = 0.0;
+    double stddev_ms = 0.0;
+    int samples = 1;
+};
+
+/// <summary>
+/// Times one kernel, see above.
+/// </summary>
+KernelTiming timeKernelSamples(const KernelBenchmark& benchmark, const KernelBenchmarkInputs& inputs, const KernelBenchmarkOptions& options)
+{
+    const auto time_run = [&] {
+        if (benchmark.prepare) {
+            benchmark.prepare(inputs);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        benchmark.run(inputs);
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    const double warm_up_ms = time_run();
+    if (warm_up_ms > options.min_seconds * 1000.0) {
+        // Too slow to repeat, the first run is the sample.
+        return { warm_up_ms };
+    }
+    std::vector<double> samples;
+    double total_ms = 0.0;
+    while (samples.empty() || (total_ms < options.min_seconds * 1000.0 && int(samples.size()) < options.max_repeats)) {
+        samples.push_back(time_run());
+        total_ms += samples.back();
+    }
+    const double mean_ms = total_ms / double(samples.size());
+    double square_sum = 0.0;
+    for (const double sample : samples) {
+        square_sum += (sample - mean_ms) * (sample - mean_ms);
+    }
+    KernelTiming timing;
+    timing.samples = int(samples.size());
+    timing.stddev_ms = samples.size() > 1 ? std::sqrt(square_sum / double(samples.size() - 1)) : 0.0;
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    timing.median_ms = samples[samples.size() / 2];
+    return timing;
+}
+
+/// <summary>
+/// Times one kernel on its inputs, timeKernelSamples() with the options of the run when empty.
+/// </summary>
+using KernelTimer = std::function<KernelTiming(const KernelBenchmark&, const KernelBenchmarkInputs&)>;
+
+/// <summary>
+/// Median time of one kernel in milliseconds, see above.
+/// </summary>
+double timeKernel(const KernelBenchmark& benchmark, const KernelBenchmarkInputs& inputs, const KernelBenchmarkOptions& options)
+{
+    return timeKernelSamples(benchmark, inputs, options).median_ms;
+}
+
+/// <summary>
+/// Achievable memory bandwidth and FLOP rate of the machine at one thread count.
+/// </summary>
+struct MachineRoofs {
+    double gb_per_s = 0.0;
+    double gflop_per_s = 0.0;
+};
+
+/// <summary>
+/// Measures the roofs with the current thread count: the best of repeated STREAM triads
+/// (a = b + s * c, 12 bytes per element, arrays far beyond the caches) and of multiply-add chains
+/// (64 independent accumulators per thread, 2 FLOPs each, with the vector width of this build).
+/// </summary>
+/// <param name="min_seconds">minimum time of each measurement</param>
+MachineRoofs measureMachineRoofs(const double min_seconds)
+{
+    const int threads = getThreadCount();
+    const auto best_rate = [&](const double work, const auto& run) {
+        double best = 0.0;
+        double total = 0.0;
+        for (int repeat = 0; repeat < 3 || total < min_seconds; repeat++) {
+            const auto start = std::chrono::steady_clock::now();
+            run();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            best = std::max(best, work / seconds);
+            total += seconds;
+        }
+        return best;
+    };
+
+    MachineRoofs roofs;
+    const int64_t n = int64_t(1) << 24;
+    std::vector<float> a(n), b(n), c(n);
+#pragma omp parallel for num_threads(threads) schedule(static)
+    for (int64_t i = 0; i < n; i++) {
+        a[i] = 0.0f;
+        b[i] = 1.0f;
+        c[i] = 2.0f;
+    }
+    roofs.gb_per_s = best_rate(12.0 * double(n) / 1e9, [&] {
+        const float scalar = 3.0f;
+#pragma omp parallel for num_threads(threads) schedule(static)
+        for (int64_t i = 0; i < n; i++) {
+            a[i] = b[i] + scalar * c[i];
+        }
+        keepBenchmarkResult(a);
+    });
+
+    constexpr int chains = 64;
+    constexpr int64_t steps = 1 << 20;
+    roofs.gflop_per_s = best_rate(2.0 * chains * double(steps) * threads / 1e9, [&] {
+#pragma omp parallel num_threads(threads)
+        {
+            alignas(64) float acc[chains];
+            for (int k = 0; k < chains; k++) {
+                acc[k] = float(k);
+            }
+            const float scale = 0.999999f, shift = 1e-7f;
+            for (int64_t step = 0; step < steps; step++) {
+#pragma omp simd aligned(acc : 64)
+                for (int k = 0; k < chains; k++) {
+                    acc[k] = acc[k] * scale + shift;
+                }
+            }
+            // The value itself is kept, so the chains cannot be removed.
+            float sum = 0.0f;
+            for (int k = 0; k < chains; k++) {
+                sum += acc[k];
+            }
+            keepBenchmarkResult(sum);
+        }
+    });
+    return roofs;
+}
+
+/// <summary>
+/// FLOPs per update of a kernel (exp, log and pow count as one), 0 when not modeled: kernels
+/// whose work depends on the data (grid, permutohedral, the solvers to a tolerance) or that
+/// chain stages of different intensities (the whole tone mapping).
+/// </summary>
+/// <param name="name">benchmark name, "kernel" or "kernel/variant"</param>
+/// <param name="params">Durand parameters of the benchmark run</param>
+double kernelFlopsPerUpdate(const std::string& name, const DurandParams& params)
+{
+    // Per tap of the window: spatial weight, range difference, square, scale, exp, product,
+    // weighted sum and normalizer.
+    const double window_taps = double(params.filter_size) * double(params.filter_size);
+    const std::map<std::string, double> flops {
+        { "rgbToLuminance", 5 },
+        { "logImage", 1 },
+        { "getDetailImage", 1 },
+        { "applyDurandToneMappingOperator", 5 },
+        { "rescaleRgbByLuminance", 12 },
+        { "durandLogLuminance", 6 },
+        // Detail, contrast reduction and the rescale.
+        { "durandCompose", 22 },
+        { "applyGamma", 3 },
+        { "rgbToXYZ", 15 },
+        { "xyzToRGB", 15 },
+        // dx and dy.
+        { "getGradients", 2 },
+        // dx - dx_left + dy - dy_above.
+        { "getDivergence", 3 },
+        { "getMergedDivergence", 5 },
+        { "copySourceGradientsToTarget", 0 },
+        // Four neighbors, the divergence and the scale of a sweep.
+        { "solvePoisson/jacobi", 6 },
+        { "solvePoisson/blocked_jacobi", 6 },
+        { "solvePoisson/jacobi_half", 6 },
+        { "solvePoisson/jacobi_bf16", 6 },
+        { "solvePoissonBatch", 6 },
+        { "solvePoissonJacobiLayout", 6 },
+        { "solvePoissonXYZ", 6 },
+        // Over-relaxation adds a difference and a multiply-add.
+        { "solvePoisson/sor", 9 },
+        { "solvePoisson/sor_half", 9 },
+        { "bilateralFilter/bruteforce", 8 * window_taps },
+        { "bilateralFilter/tiled", 8 * window_taps },
+        { "bilateralFilter/simd", 8 * window_taps },
+        { "bilateralFilter/rangelut", 8 * window_taps },
+        { "bilateralFilterLayout", 8 * window_taps },
+    };
+    if (const auto it = flops.find(name); it != flops.end()) {
+        return it->second;
+    }
+    const auto group = flops.find(name.substr(0, name.find('/')));
+    return group != flops.end() ? group->second : 0.0;
+}
+
+/// <summary>
+/// Side length of a benchmark input at a thread count: the size itself (strong scaling), or the
+/// size grown with the thread count at constant pixels per thread from the first thread count
+/// (weak scaling), rounded to a multiple of 8. Thread counts of 0 are the default count.
+/// </summary>
+inline int scaledBenchmarkSize(const int size, const int threads, const int first_threads, const bool weak_scaling)
+{
+    if (!weak_scaling) {
+        return size;
+    }
+    const auto resolved = [](const int count) { return count > 0 ? count : defaultThreadCount(); };
+    const double growth = std::sqrt(double(resolved(threads)) / double(resolved(first_threads)));
+    return std::max(8, int(std::lround(double(size) * growth / 8.0)) * 8);
+}
+
+/// <summary>
+/// Numeric field "key": value of a line of the benchmark JSON, 0 when missing.
+/// </summary>
+inline double kernelBenchmarkJsonNumber(const std::string& line, const std::string& key)
+{
+    const auto pos = line.find("\"" + key + "\": ");
+    return pos == std::string::npos ? 0.0 : std::stod(line.substr(pos + key.size() + 4));
+}
+
+/// <summary>
+/// Timings of an earlier run by "kernel size threads", from its CSV or (.json) JSON. CSV files
+/// of builds before the standard deviation was recorded have no noise.
+/// </summary>
+std::map<std::string, KernelTiming> readKernelBenchmarkBaseline(const std::filesystem::path& filePath)
+{
+    std::ifstream file(filePath);
+    if (!file) {
+        std::cerr << "Benchmark baseline " << filePath << " does not exist!" << std::endl;
+        throw std::exception();
+    }
+    std::map<std::string, KernelTiming> timings;
+    std::string line;
+    if (filePath.extension() == ".json") {
+        // One result per line, see the writer in runKernelBenchmarks().
+        // The comparisons after the results are not read.
+        while (std::getline(file, line) && line.find("\"comparisons\"") == std::string::npos) {
+            const auto name = line.find("{\"kernel\": \"");
+            if (name == std::string::npos) {
+                continue;
+            }
+            const auto name_start = name + 12;
+            const auto kernel = line.substr(name_start, line.find('"', name_start) - name_start);
+            const auto key = kernel + " " + std::to_string(int(kernelBenchmarkJsonNumber(line, "size"))) + " " + std::to_string(int(kernelBenchmarkJsonNumber(line, "threads")));
+            timings[key] = { kernelBenchmarkJsonNumber(line, "median_ms"), kernelBenchmarkJsonNumber(line, "stddev_ms"), std::max(int(kernelBenchmarkJsonNumber(line, "samples")), 1) };
+        }
+        return timings;
+    }
+    std::getline(file, line);
+    std::vector<std::string> header;
+    std::istringstream header_fields(line);
+    for (std::string field; std::getline(header_fields, field, ',');) {
+        header.push_back(field);
+    }
+    const auto column = [&](const char* name) { return size_t(std::find(header.begin(), header.end(), name) - header.begin()); };
+    const size_t stddev_column = column("stddev_ms"), samples_column = column("samples");
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::istringstream line_fields(line);
+        for (std::string field; std::getline(line_fields, field, ',');) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 4) {
+            continue;
+        }
+        KernelTiming timing { std::stod(fields[3]) };
+        if (stddev_column < fields.size() && samples_column < fields.size()) {
+            timing.stddev_ms = std::stod(fields[stddev_column]);
+            timing.samples = std::max(std::stoi(fields[samples_column]), 1);
+        }
+        timings[fields[0] + " " + fields[1] + " " + fields[2]] = timing;
+    }
+    return timings;
+}
+
+/// <summary>
+/// Result of a kernel against its baseline.
+/// </summary>
+struct KernelComparison {
+    std::string kernel;
+    int size = 0;
+    int threads = 0;
+    // Time over the baseline time, and the relative change allowed before it is flagged.
+    double ratio = 1.0;
+    double threshold = 0.0;
+    // "regression", "improvement" or "unchanged".
+    std::string verdict = {};
+};
+
+/// <summary>
+/// Compares a result with its baseline, see above: the threshold is the larger of the tolerance
+/// and noise_sigmas times the combined relative standard deviation of both medians.
+/// </summary>
+KernelComparison compareKernelResult(const KernelBenchmarkResult& result, const KernelTiming& baseline, const KernelBenchmarkOptions& options)
+{
+    const double new_noise = result.median_ms > 0.0 ? result.stddev_ms / result.median_ms : 0.0;
+    const double old_noise = baseline.median_ms > 0.0 ? baseline.stddev_ms / baseline.median_ms : 0.0;
+    KernelComparison comparison { result.kernel, result.size, result.threads };
+    comparison.ratio = baseline.median_ms > 0.0 ? result.median_ms / baseline.median_ms : 1.0;
+    comparison.threshold = std::max(options.tolerance, options.noise_sigmas * std::sqrt(new_noise * new_noise + old_noise * old_noise));
+    comparison.verdict = comparison.ratio > 1.0 + comparison.threshold ? "regression"
+        : comparison.ratio < 1.0 / (1.0 + comparison.threshold)      ? "improvement"
+                                                                     : "unchanged";
+    return comparison;
+}
+
+/// <summary>
+/// Prints the comparisons per image size (compared, regressions, improvements, geometric mean
+/// of the ratios) and the flagged kernels.
+/// </summary>
+void printKernelComparisons(const std::vector<KernelComparison>& comparisons, std::ostream& out)
+{
+    if (comparisons.empty()) {
+        return;
+    }
+    struct SizeSummary {
+        int compared = 0, regressions = 0, improvements = 0;
+        double log_ratio_sum = 0.0;
+    };
+    std::map<int, SizeSummary> sizes;
+    for (const auto& comparison : comparisons) {
+        auto& summary = sizes[comparison.size];
+        summary.compared++;
+        summary.regressions += comparison.verdict == "regression";
+        summary.improvements += comparison.verdict == "improvement";
+        summary.log_ratio_sum += std::log(comparison.ratio);
+    }
+    out << "Against the baseline:" << std::endl;
+    for (const auto& [size, summary] : sizes) {
+        out << "  " << std::setw(6) << size << ": " << summary.compared << " kernels, " << summary.regressions << " regressions, " << summary.improvements
+            << " improvements, geometric mean " << std::fixed << std::setprecision(3) << std::exp(summary.log_ratio_sum / summary.compared) << "x" << std::defaultfloat
+            << std::endl;
+    }
+    for (const char* verdict : { "regression", "improvement" }) {
+        for (const auto& comparison : comparisons) {
+            if (comparison.verdict == verdict) {
+                out << "  " << std::left << std::setw(12) << verdict << std::setw(40) << comparison.kernel << std::right << std::setw(6) << comparison.size
+                    << std::setw(4) << comparison.threads << " threads " << std::fixed << std::setprecision(2) << comparison.ratio << "x (threshold "
+                    << std::setprecision(1) << 100.0 * comparison.threshold << "%)" << std::defaultfloat << std::endl;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Runs and prints the benchmarks, see above.
+/// </summary>
+/// <param name="params">Durand parameters of the filter and tone mapping kernels</param>
+/// <param name="options">sizes, thread counts, kernel selection and outputs</param>
+/// <param name="out">result table</param>
+/// <param name="results_out">receives the results when given</param>
+/// <param name="comparisons_out">receives the comparisons with the baseline when given</param>
+/// <param name="timer">times the kernels, timeKernelSamples() when empty</param>
+/// <returns>false when a kernel regressed against the baseline</returns>
+bool runKernelBenchmarks(const DurandParams& params, const KernelBenchmarkOptions& options, std::ostream& out, std::vector<KernelBenchmarkResult>* results_out = nullptr,
+    std::vector<KernelComparison>* comparisons_out = nullptr, const KernelTimer& timer = {})
+{
+    const auto selected = [&](const std::string& name) {
+        return options.kernels.empty() || std::any_of(options.kernels.begin(), options.kernels.end(), [&](const std::string& prefix) { return name.compare(0, prefix.size(), prefix) == 0; });
+    };
+    const auto baseline = options.baseline.empty() ? std::map<std::string, KernelTiming> {} : readKernelBenchmarkBaseline(options.baseline);
+    auto benchmarks = makeKernelBenchmarks(params, options.poisson_iters);
+    if (options.io) {
+        const auto io_benchmarks = makeIoBenchmarks(options.io_dir);
+        benchmarks.insert(benchmarks.end(), io_benchmarks.begin(), io_benchmarks.end());
+    }
+    const int initial_threads = getThreadCount();
+
+    const bool counters = options.counters && PerfCounters::available();
+    if (options.counters && !counters) {
+        std::cerr << "Hardware counters are not available (perf_event_open failed), the benchmarks run without them." << std::endl;
+    }
+
+    std::vector<KernelBenchmarkResult> results;
+    std::vector<KernelComparison> comparisons;
+    bool passed = true;
+    out << std::left << std::setw(40) << "kernel" << std::right << std::setw(6) << "size" << std::setw(8) << "threads" << std::setw(12) << "median ms"
+        << std::setw(10) << "MPix/s" << std::setw(8) << "GB/s" << std::setw(8) << "x ref";
+    if (counters) {
+        out << std::setw(7) << "IPC" << std::setw(10) << "LLC/upd" << std::setw(9) << "B/upd" << std::setw(11) << "DRAM GB/s";
+    }
+    if (options.roofline) {
+        out << std::setw(9) << "GFLOP/s" << std::setw(8) << "flop/B" << std::setw(8) << "% roof" << std::setw(8) << "bound";
+    }
+    out << std::endl;
+    // Thread counts of every size, the weak-scaling sizes grow with the thread count.
+    std::vector<std::pair<int, std::vector<int>>> runs;
+    for (const int size : options.sizes) {
+        for (const int threads : options.threads) {
+            const int run_size = scaledBenchmarkSize(size, threads, options.threads.front(), options.weak_scaling);
+            auto run = std::find_if(runs.begin(), runs.end(), [&](const auto& entry) { return entry.first == run_size; });
+            if (run == runs.end()) {
+                run = runs.insert(runs.end(), { run_size, {} });
+            }
+            run->second.push_back(threads);
+        }
+    }
+    std::map<int, MachineRoofs> roofs;
+    for (const auto& [size, thread_counts] : runs) {
+        const KernelBenchmarkInputs inputs(size, params, options.workload);
+        const double pixels = double(size) * double(size);
+        for (const int threads : thread_counts) {
+            setThreadCount(threads);
+            if (options.roofline && !roofs.contains(getThreadCount())) {
+                const auto& measured = roofs[getThreadCount()] = measureMachineRoofs(options.min_seconds);
+                out << "Roofs with " << getThreadCount() << " threads: " << std::fixed << std::setprecision(1) << measured.gb_per_s << " GB/s (STREAM triad), "
+                    << measured.gflop_per_s << " GFLOP/s (multiply-add), ridge at " << std::setprecision(2) << measured.gflop_per_s / measured.gb_per_s << " flop/B"
+                    << std::defaultfloat << std::endl;
+            }
+            std::map<std::string, double> reference_ms;
+            for (const auto& benchmark : benchmarks) {
+                if (!selected(benchmark.name)) {
+                    continue;
+                }
+                KernelBenchmarkResult result { benchmark.name, size, getThreadCount() };
+                const auto timing = timer ? timer(benchmark, inputs) : timeKernelSamples(benchmark, inputs, options);
+                result.median_ms = timing.median_ms;
+                result.stddev_ms = timing.stddev_ms;
+                result.samples = timing.samples;
+                const double updates_per_s = pixels * benchmark.updates_per_pixel / (result.median_ms / 1000.0);
+                result.mpix_per_s = updates_per_s / 1e6;
+                result.gb_per_s = updates_per_s * benchmark.bytes_per_update / 1e9;
+                if (counters) {
+                    if (benchmark.prepare) {
+                        benchmark.prepare(inputs);
+                    }
+                    PerfCounters counter;
+                    counter.start();
+                    const auto start = std::chrono::steady_clock::now();
+                    benchmark.run(inputs);
+                    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    const auto counts = counter.stop();
+                    const double updates = pixels * benchmark.updates_per_pixel;
+                    result.ipc = counts.ipc();
+                    result.llc_misses_per_update = counts.llc_misses / updates;
+                    result.dram_bytes_per_update = counts.dramBytes() / updates;
+                    result.dram_gb_per_s = counts.dramBytes() / seconds / 1e9;
+                }
+                const double flops_per_update = options.roofline ? kernelFlopsPerUpdate(benchmark.name, params) : 0.0;
+                if (flops_per_update > 0.0 && benchmark.bytes_per_update > 0.0) {
+                    const auto& roof = roofs[result.threads];
+                    result.gflop_per_s = updates_per_s * flops_per_update / 1e9;
+                    result.flop_per_byte = flops_per_update / benchmark.bytes_per_update;
+                    result.roof_fraction = result.gflop_per_s / std::min(roof.gflop_per_s, result.flop_per_byte * roof.gb_per_s);
+                }
+                const auto group = benchmark.name.substr(0, benchmark.name.find('/'));
+                const auto [reference, inserted] = reference_ms.try_emplace(group, result.median_ms);
+                result.speedup = reference->second / result.median_ms;
+
+                out << std::left << std::setw(40) << result.kernel << std::right << std::setw(6) << result.size << std::setw(8) << result.threads << std::fixed
+                    << std::setprecision(2) << std::setw(12) << result.median_ms << std::setw(10) << result.mpix_per_s << std::setw(8) << result.gb_per_s
+                    << std::setw(8) << result.speedup;
+                if (counters) {
+                    out << std::setw(7) << result.ipc << std::setw(10) << std::setprecision(3) << result.llc_misses_per_update << std::setprecision(2) << std::setw(9)
+                        << result.dram_bytes_per_update << std::setw(11) << result.dram_gb_per_s;
+                }
+                if (options.roofline && result.flop_per_byte > 0.0) {
+                    const auto& roof = roofs[result.threads];
+                    const bool memory_bound = result.flop_per_byte * roof.gb_per_s < roof.gflop_per_s;
+                    out << std::setw(9) << result.gflop_per_s << std::setw(8) << result.flop_per_byte << std::setprecision(1) << std::setw(8) << 100.0 * result.roof_fraction
+                        << std::setw(8) << (memory_bound ? "memory" : "compute") << std::setprecision(2);
+                } else if (options.roofline) {
+                    out << std::setw(33) << "-";
+                }
+                out << std::defaultfloat;
+                const auto earlier = baseline.find(result.kernel + " " + std::to_string(result.size) + " " + std::to_string(result.threads));
+                if (earlier != baseline.end()) {
+                    const auto& comparison = comparisons.emplace_back(compareKernelResult(result, earlier->second, options));
+                    out << "  " << std::fixed << std::setprecision(2) << comparison.ratio << "x baseline (+-" << std::setprecision(1) << 100.0 * comparison.threshold << "%)"
+                        << (comparison.verdict == "regression" ? " REGRESSION" : comparison.verdict == "improvement" ? " IMPROVEMENT" : "") << std::defaultfloat;
+                    passed &= comparison.verdict != "regression";
+                }
+                out << std::endl;
+                results.push_back(result);
+            }
+        }
+    }
+    setThreadCount(initial_threads);
+    printKernelComparisons(comparisons, out);
+
+    if (!options.csv.empty()) {
+        std::ofstream csv(options.csv);
+        csv << "kernel,size,threads,median_ms,mpix_per_s,gb_per_s,speedup,stddev_ms,samples" << (counters ? ",ipc,llc_misses_per_update,dram_bytes_per_update,dram_gb_per_s" : "")
+            << (options.roofline ? ",gflop_per_s,flop_per_byte,roof_fraction" : "") << "\n";
+        for (const auto& result : results) {
+            csv << result.kernel << "," << result.size << "," << result.threads << "," << result.median_ms << "," << result.mpix_per_s << "," << result.gb_per_s << ","
+                << result.speedup << "," << result.stddev_ms << "," << result.samples;
+            if (counters) {
+                csv << "," << result.ipc << "," << result.llc_misses_per_update << "," << result.dram_bytes_per_update << "," << result.dram_gb_per_s;
+            }
+            if (options.roofline) {
+                csv << "," << result.gflop_per_s << "," << result.flop_per_byte << "," << result.roof_fraction;
+            }
+            csv << "\n";
+        }
+        if (!csv) {
+            std::cerr << "Failed to write " << options.csv << std::endl;
+            passed = false;
+        }
+    }
+    if (!options.json.empty()) {
+        // One result per line, read back by readKernelBenchmarkBaseline().
+        std::ofstream json(options.json);
+        json << "{\n  \"results\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& result = results[i];
+            json << (i ? ",\n" : "\n") << "    {\"kernel\": \"" << result.kernel << "\", \"size\": " << result.size << ", \"threads\": " << result.threads
+                 << ", \"median_ms\": " << result.median_ms << ", \"stddev_ms\": " << result.stddev_ms << ", \"samples\": " << result.samples << ", \"mpix_per_s\": "
+                 << result.mpix_per_s << ", \"gb_per_s\": " << result.gb_per_s << ", \"speedup\": " << result.speedup << "}";
+        }
+        json << "\n  ],\n  \"comparisons\": [";
+        for (size_t i = 0; i < comparisons.size(); i++) {
+            const auto& comparison = comparisons[i];
+            json << (i ? ",\n" : "\n") << "    {\"kernel\": \"" << comparison.kernel << "\", \"size\": " << comparison.size << ", \"threads\": " << comparison.threads
+                 << ", \"ratio\": " << comparison.ratio << ", \"threshold\": " << comparison.threshold << ", \"verdict\": \"" << comparison.verdict << "\"}";
+        }
+        json << "\n  ]\n}\n";
+        if (!json) {
+            std::cerr << "Failed to write " << options.json << std::endl;
+            passed = false;
+        }
+    }
+    if (results_out) {
+        *results_out = std::move(results);
+    }
+    if (comparisons_out) {
+        *comparisons_out = std::move(comparisons);
+    }
+    return passed;
+}
+
+#pragma endregion Kernel benchmarks
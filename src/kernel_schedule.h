@@ -0,0 +1,472 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <framework/image.h>
+#include <framework/image_view.h>
+
+#include "execution.h"
+#include "tile_scheduler.h"
+
+/*
+ * Separation of the algorithm of a kernel from its schedule.
+ *
+ * A kernel is described once by what it computes per output pixel:
+ *
+ *     PointwiseKernel   value(x, y) from pixels at (x, y) only
+ *     StencilKernel     value(window, x, y) from a window of radius pixels around (x, y) of the
+ *                       image computed by a pointwise producer
+ *     ReductionKernel   map(x, y) folded with combine()
+ *
+ * and how the loops run is a KernelSchedule chosen separately: the output tile, whether tiles or
+ * row bands are parallelized, the vector width of the inner strips, where the producer of a
+ * stencil is computed (root: the whole image before the stencil; tile: per tile with its halo,
+ * recomputed in the overlaps, in a scratch buffer that stays in cache) and whether a pointwise
+ * consumer is fused into the stencil or run as a pass of its own.
+ *
+ * Every output pixel is computed by the same expression under any schedule, so the schedule of a
+ * pointwise or stencil kernel changes the speed and never the result. Reductions combine their
+ * tiles in tile order: the result depends on the tile size, not on the thread count.
+ *
+ * Schedules come from a ScheduleTable: presets per deployment target (the cache sizes and vector
+ * widths of a Xeon, a Graviton or a laptop part), overridden per kernel name from a setting,
+ * e.g. "durand:tile=128x32,parallel=tiles,vector=16,compute_at=tile". The kernels look up their
+ * schedule by name in currentSchedules().
+ */
+
+#pragma region Kernel schedules
+
+/// <summary>
+/// How the tiles of a schedule are distributed over the threads.
+/// </summary>
+enum class ScheduleParallel {
+    // All tiles on the calling thread.
+    Serial,
+    // Bands of tile_height full rows, static schedule.
+    Rows,
+    // Tiles of tile_width x tile_height, balanced by the TileScheduler.
+    Tiles,
+};
+
+/// <summary>
+/// Where the pointwise producer of a stencil is computed.
+/// </summary>
+enum class ComputeAt {
+    // The whole producer image before the stencil.
+    Root,
+    // Per output tile with its halo, in a per-thread scratch buffer.
+    Tile,
+};
+
+/// <summary>
+/// Loop structure of a kernel, see above.
+/// </summary>
+struct KernelSchedule {
+    int tile_width = 64;
+    int tile_height = 64;
+    ScheduleParallel parallel = ScheduleParallel::Rows;
+    // Pixels of an inner strip evaluated under "omp simd": 1, 4, 8 or 16.
+    int vector_width = 1;
+    ComputeAt compute_at = ComputeAt::Root;
+    // Pointwise consumer of a stencil evaluated in the stencil loop, without storing the stencil.
+    bool fuse_consumer = true;
+};
+
+/// <summary>
+/// Hardware the schedules are tuned for.
+/// </summary>
+enum class ScheduleTarget {
+    // Loops of the reference kernels: row bands, producer at root.
+    Default,
+    // Large private L2 and AVX-512.
+    Xeon,
+    // 1 MB L2 per core and 128-bit NEON.
+    Graviton,
+    // Few cores, small shared caches and AVX2.
+    Laptop,
+};
+
+/// <summary>
+/// Kind of kernel a preset schedule is chosen for.
+/// </summary>
+enum class KernelKind {
+    Pointwise,
+    Stencil,
+    Reduction,
+};
+
+/// <summary>
+/// Preset schedule of a kind of kernel on a target.
+/// </summary>
+inline KernelSchedule presetSchedule(const ScheduleTarget target, const KernelKind kind)
+{
+    KernelSchedule schedule;
+    switch (target) {
+    case ScheduleTarget::Xeon:
+        schedule = { 128, 64, ScheduleParallel::Tiles, 16, ComputeAt::Tile, true };
+        break;
+    case ScheduleTarget::Graviton:
+        schedule = { 64, 64, ScheduleParallel::Tiles, 4, ComputeAt::Tile, true };
+        break;
+    case ScheduleTarget::Laptop:
+        schedule = { 1 << 20, 32, ScheduleParallel::Rows, 8, ComputeAt::Tile, true };
+        break;
+    case ScheduleTarget::Default:
+    default:
+        schedule = { 1 << 20, 16, ScheduleParallel::Rows, 1, ComputeAt::Root, false };
+        break;
+    }
+    // Pointwise kernels and reductions have no halo: whole rows stream best.
+    if (kind != KernelKind::Stencil) {
+        schedule.tile_width = 1 << 20;
+        schedule.parallel = schedule.parallel == ScheduleParallel::Serial ? ScheduleParallel::Serial : ScheduleParallel::Rows;
+    }
+    return schedule;
+}
+
+/// <summary>
+/// Schedules of the kernels of a run: the presets of a target and overrides per kernel name.
+/// </summary>
+class ScheduleTable {
+public:
+    ScheduleTarget target = ScheduleTarget::Default;
+
+    /// <summary>
+    /// Schedule of the named kernel.
+    /// </summary>
+    KernelSchedule get(const std::string& kernel, const KernelKind kind) const
+    {
+        const auto it = m_overrides.find(kernel);
+        return it != m_overrides.end() ? it->second : presetSchedule(target, kind);
+    }
+
+    void set(const std::string& kernel, const KernelSchedule& schedule) { m_overrides[kernel] = schedule; }
+
+    /// <summary>
+    /// Adds the overrides of a "kernel:key=value,...;kernel:..." specification. Keys not given keep
+    /// the preset of the target for a stencil. Keys: tile (WxH), parallel (serial, rows, tiles),
+    /// vector (1, 4, 8, 16), compute_at (root, tile) and fuse (0, 1).
+    /// </summary>
+    void parse(const std::string& spec)
+    {
+        std::stringstream kernels(spec);
+        std::string entry;
+        while (std::getline(kernels, entry, ';')) {
+            if (entry.empty()) {
+                continue;
+            }
+            const auto colon = entry.find(':');
+            if (colon == std::string::npos) {
+                std::cerr << "Schedule entry " << entry << " is not kernel:key=value,..." << std::endl;
+                throw std::exception();
+            }
+            const std::string kernel = entry.substr(0, colon);
+            KernelSchedule schedule = get(kernel, KernelKind::Stencil);
+            std::stringstream keys(entry.substr(colon + 1));
+            std::string item;
+            while (std::getline(keys, item, ',')) {
+                const auto equals = item.find('=');
+                const std::string key = item.substr(0, equals);
+                const std::string value = equals == std::string::npos ? "" : item.substr(equals + 1);
+                bool valid = true;
+                if (key == "tile") {
+                    valid = std::sscanf(value.c_str(), "%dx%d", &schedule.tile_width, &schedule.tile_height) == 2 && schedule.tile_width > 0 && schedule.tile_height > 0;
+                } else if (key == "parallel" && (value == "serial" || value == "rows" || value == "tiles")) {
+                    schedule.parallel = value == "serial" ? ScheduleParallel::Serial : value == "rows" ? ScheduleParallel::Rows : ScheduleParallel::Tiles;
+                } else if (key == "vector" && (value == "1" || value == "4" || value == "8" || value == "16")) {
+                    schedule.vector_width = std::stoi(value);
+                } else if (key == "compute_at" && (value == "root" || value == "tile")) {
+                    schedule.compute_at = value == "root" ? ComputeAt::Root : ComputeAt::Tile;
+                } else if (key == "fuse" && (value == "0" || value == "1")) {
+                    schedule.fuse_consumer = value == "1";
+                } else {
+                    valid = false;
+                }
+                if (!valid) {
+                    std::cerr << "Invalid schedule setting " << item << " of kernel " << kernel << "." << std::endl;
+                    throw std::exception();
+                }
+            }
+            set(kernel, schedule);
+        }
+    }
+
+private:
+    std::map<std::string, KernelSchedule> m_overrides;
+};
+
+/// <summary>
+/// Parses a target name: default, xeon, graviton or laptop.
+/// </summary>
+inline ScheduleTarget parseScheduleTarget(const std::string& name)
+{
+    if (name == "default") {
+        return ScheduleTarget::Default;
+    } else if (name == "xeon") {
+        return ScheduleTarget::Xeon;
+    } else if (name == "graviton") {
+        return ScheduleTarget::Graviton;
+    } else if (name == "laptop") {
+        return ScheduleTarget::Laptop;
+    }
+    std::cerr << "Unknown schedule target " << name << " (default, xeon, graviton or laptop)." << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Schedules used by the kernels of the process.
+/// </summary>
+inline ScheduleTable& currentSchedules()
+{
+    static ScheduleTable table;
+    return table;
+}
+
+/// <summary>
+/// Per-pixel kernel: fn(x, y) is the output pixel.
+/// </summary>
+template <typename Fn>
+struct PointwiseKernel {
+    Fn fn;
+};
+
+/// <summary>
+/// Neighborhood kernel: fn(window, x, y) is the output pixel, reading window.row(y + dy)[x + dx]
+/// for |dx|, |dy| <= radius inside the image only.
+/// </summary>
+template <typename Fn>
+struct StencilKernel {
+    int radius;
+    Fn fn;
+};
+
+/// <summary>
+/// Fold of map(x, y) over all pixels with combine(accumulator, value), starting from init.
+/// </summary>
+template <typename V, typename MapFn, typename CombineFn>
+struct ReductionKernel {
+    V init;
+    MapFn map;
+    CombineFn combine;
+};
+
+/// <summary>
+/// Pixels of a producer visible to a stencil: the whole image, or a tile with its halo. Rows are
+/// addressed with image coordinates.
+/// </summary>
+template <typename T>
+struct StencilWindow {
+    const T* data = nullptr;
+    int x0 = 0;
+    int y0 = 0;
+    int stride = 0;
+    // Size of the image.
+    int width = 0;
+    int height = 0;
+
+    const T* row(const int y) const { return data + ptrdiff_t(y - y0) * stride - x0; }
+};
+
+/// <summary>
+/// Output rectangle of one tile of a schedule.
+/// </summary>
+struct ScheduleTile {
+    int x0, y0, x1, y1;
+};
+
+/// <summary>
+/// Runs tile_fn(tile) for every tile of a width x height domain with the parallelism of the
+/// schedule. Per-thread state is created by make_state() inside the parallel region.
+/// </summary>
+template <typename MakeState, typename TileFn>
+void forEachScheduleTile(const char* name, const int width, const int height, const KernelSchedule& schedule, const MakeState& make_state, const TileFn& tile_fn)
+{
+    const int tile_width = std::min(schedule.tile_width, std::max(width, 1));
+    const int tile_height = std::max(schedule.tile_height, 1);
+    const int tiles_x = (width + tile_width - 1) / tile_width;
+    const int tiles_y = (height + tile_height - 1) / tile_height;
+    const int num_tiles = tiles_x * tiles_y;
+    const auto tile_at = [&](const int tile) {
+        const int x0 = (tile % tiles_x) * tile_width;
+        const int y0 = (tile / tiles_x) * tile_height;
+        return ScheduleTile { x0, y0, std::min(x0 + tile_width, width), std::min(y0 + tile_height, height) };
+    };
+    const int threads = schedule.parallel == ScheduleParallel::Serial ? 1 : kernelThreads(int64_t(width) * height, KernelCost::Medium);
+
+    if (schedule.parallel == ScheduleParallel::Tiles && threads > 1) {
+        TileScheduler scheduler(name, num_tiles, 1, threads);
+#pragma omp parallel num_threads(threads)
+        {
+            auto state = make_state();
+            scheduler.run([&](const int tile) { tile_fn(tile_at(tile), state); });
+        }
+        scheduler.throwIfCancelled();
+    } else {
+#pragma omp parallel num_threads(threads)
+        {
+            auto state = make_state();
+#pragma omp for schedule(static)
+            for (int tile = 0; tile < num_tiles; tile++) {
+                tile_fn(tile_at(tile), state);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Calls pixel(x, y) for x in [x0, x1) in strips of Lanes pixels under "omp simd".
+/// </summary>
+template <int Lanes, typename PixelFn>
+inline void scheduleRowStrips(const int y, const int x0, const int x1, const PixelFn& pixel)
+{
+    int x = x0;
+    if constexpr (Lanes > 1) {
+        for (; x + Lanes <= x1; x += Lanes) {
+#pragma omp simd simdlen(Lanes)
+            for (int lane = 0; lane < Lanes; lane++) {
+                pixel(x + lane, y);
+            }
+        }
+    }
+    for (; x < x1; x++) {
+        pixel(x, y);
+    }
+}
+
+/// <summary>
+/// Row [x0, x1) of y with the vector width of the schedule.
+/// </summary>
+template <typename PixelFn>
+inline void scheduleRow(const KernelSchedule& schedule, const int y, const int x0, const int x1, const PixelFn& pixel)
+{
+    switch (schedule.vector_width) {
+    case 16:
+        scheduleRowStrips<16>(y, x0, x1, pixel);
+        break;
+    case 8:
+        scheduleRowStrips<8>(y, x0, x1, pixel);
+        break;
+    case 4:
+        scheduleRowStrips<4>(y, x0, x1, pixel);
+        break;
+    default:
+        scheduleRowStrips<1>(y, x0, x1, pixel);
+        break;
+    }
+}
+
+/// <summary>
+/// Evaluates a pointwise kernel into out with the given schedule.
+/// </summary>
+template <typename T, typename Fn>
+void realize(const char* name, const PointwiseKernel<Fn>& kernel, const ImageView<T> out, const KernelSchedule& schedule)
+{
+    struct NoState {
+    };
+    forEachScheduleTile(name, out.width, out.height, schedule, [] { return NoState {}; }, [&](const ScheduleTile& tile, NoState&) {
+        for (int y = tile.y0; y < tile.y1; y++) {
+            T* row = out.row(y);
+            scheduleRow(schedule, y, tile.x0, tile.x1, [&](const int x, const int y_) { row[x] = kernel.fn(x, y_); });
+        }
+    });
+}
+
+/// <summary>
+/// Evaluates a reduction with the given schedule. The partial results of the tiles are combined
+/// in tile order, so the result does not depend on the thread count.
+/// </summary>
+template <typename V, typename MapFn, typename CombineFn>
+V reduce(const char* name, const ReductionKernel<V, MapFn, CombineFn>& kernel, const int width, const int height, const KernelSchedule& schedule)
+{
+    const int tile_width = std::min(schedule.tile_width, std::max(width, 1));
+    const int tiles_x = (width + tile_width - 1) / tile_width;
+    const int tile_height = std::max(schedule.tile_height, 1);
+    std::vector<V> partials(size_t(tiles_x) * size_t((height + tile_height - 1) / tile_height), kernel.init);
+    struct NoState {
+    };
+    forEachScheduleTile(name, width, height, schedule, [] { return NoState {}; }, [&](const ScheduleTile& tile, NoState&) {
+        V accumulator = kernel.init;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                accumulator = kernel.combine(accumulator, kernel.map(x, y));
+            }
+        }
+        partials[size_t(tile.y0 / tile_height) * size_t(tiles_x) + size_t(tile.x0 / tile_width)] = accumulator;
+    });
+    V result = kernel.init;
+    for (const V& partial : partials) {
+        result = kernel.combine(result, partial);
+    }
+    return result;
+}
+
+/// <summary>
+/// Evaluates the chain producer -> stencil -> consumer into out with the given schedule:
+/// out(x, y) = consumer.fn(x, y, window, stencil.fn(window, x, y)), where window holds the
+/// producer. With compute_at Root the producer is realized as a whole image first, with Tile per
+/// tile and halo. Without fuse_consumer the stencil is stored and the consumer runs as a second
+/// pass (with the producer at root).
+/// </summary>
+/// <param name="name">kernel name, for the tile balance report</param>
+/// <param name="producer">pointwise kernel of P values</param>
+/// <param name="stencil">stencil over the producer, S values</param>
+/// <param name="consumer">consumer.fn(x, y, window, s) is the output pixel</param>
+/// <param name="out">output image</param>
+/// <param name="schedule">loop structure</param>
+template <typename P, typename S, typename T, typename ProducerFn, typename StencilFn, typename ConsumerFn>
+void realizeStencilChain(const char* name, const PointwiseKernel<ProducerFn>& producer, const StencilKernel<StencilFn>& stencil, const PointwiseKernel<ConsumerFn>& consumer,
+    const ImageView<T> out, const KernelSchedule& schedule)
+{
+    const int width = out.width;
+    const int height = out.height;
+    const int radius = stencil.radius;
+    struct NoState {
+    };
+
+    if (schedule.compute_at == ComputeAt::Root || !schedule.fuse_consumer) {
+        auto produced = Image<P>::uninitialized(width, height);
+        realize(name, producer, produced.view(), schedule);
+        const StencilWindow<P> window { produced.data.data(), 0, 0, width, width, height };
+        if (schedule.fuse_consumer) {
+            forEachScheduleTile(name, width, height, schedule, [] { return NoState {}; }, [&](const ScheduleTile& tile, NoState&) {
+                for (int y = tile.y0; y < tile.y1; y++) {
+                    T* row = out.row(y);
+                    scheduleRow(schedule, y, tile.x0, tile.x1, [&](const int x, const int y_) { row[x] = consumer.fn(x, y_, window, stencil.fn(window, x, y_)); });
+                }
+            });
+        } else {
+            auto stenciled = Image<S>::uninitialized(width, height);
+            realize(name, PointwiseKernel { [&](const int x, const int y) { return stencil.fn(window, x, y); } }, stenciled.view(), schedule);
+            realize(name, PointwiseKernel { [&](const int x, const int y) { return consumer.fn(x, y, window, stenciled.data[size_t(y) * size_t(width) + size_t(x)]); } }, out,
+                schedule);
+        }
+        return;
+    }
+
+    // Producer per tile: the halo is recomputed by the neighbouring tiles instead of stored.
+    const int tile_width = std::min(schedule.tile_width, std::max(width, 1));
+    const size_t scratch_pixels = size_t(tile_width + 2 * radius) * size_t(std::max(schedule.tile_height, 1) + 2 * radius);
+    forEachScheduleTile(name, width, height, schedule, [&] { return std::vector<P>(scratch_pixels); }, [&](const ScheduleTile& tile, std::vector<P>& scratch) {
+        const int hx0 = std::max(tile.x0 - radius, 0);
+        const int hy0 = std::max(tile.y0 - radius, 0);
+        const int hx1 = std::min(tile.x1 + radius, width);
+        const int hy1 = std::min(tile.y1 + radius, height);
+        const StencilWindow<P> window { scratch.data(), hx0, hy0, hx1 - hx0, width, height };
+        for (int y = hy0; y < hy1; y++) {
+            P* row = scratch.data() + size_t(y - hy0) * size_t(hx1 - hx0) - hx0;
+            scheduleRow(schedule, y, hx0, hx1, [&](const int x, const int y_) { row[x] = producer.fn(x, y_); });
+        }
+        for (int y = tile.y0; y < tile.y1; y++) {
+            T* row = out.row(y);
+            scheduleRow(schedule, y, tile.x0, tile.x1, [&](const int x, const int y_) { row[x] = consumer.fn(x, y_, window, stencil.fn(window, x, y_)); });
+        }
+    });
+}
+
+#pragma endregion Kernel schedules
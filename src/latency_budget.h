@@ -0,0 +1,270 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#include "your_code_here.h"
+
+/*
+ * Latency budgets.
+ *
+ * A run with a time budget instead of an iteration count picks its bilateral engine and its
+ * Poisson strategy from a cost model, so the same request takes about the same time however the
+ * defaults would have performed:
+ *   - the stages without alternatives (decoding and encoding, log-luminance and compose, the XYZ
+ *     conversions and the divergence) are predicted first and come off the budget,
+ *   - the filter gets at most half of the rest: the configured engine when it fits, otherwise the
+ *     most faithful engine that fits (the exact ones first, the coarse approximations last), the
+ *     fastest when none does,
+ *   - the solve gets what is left: the configured method with poisson_iters when it fits, then
+ *     SOR with the iterations that fit (at least a quarter of poisson_iters), then multigrid to
+ *     its tolerance, and finally SOR with whatever fits.
+ * The iterative solve also runs against a deadline (see PoissonControl): when the prediction was
+ * optimistic, it stops after the iteration that passes the end of the budget and returns its
+ * current estimate with the relative residual. The filter is never interrupted.
+ *
+ * The model holds seconds per pixel of one thread, divided by the thread count of the run. The
+ * defaults were measured on one core of a 3 GHz x86 server; calibrate() replaces them with the
+ * rates of a "--benchmark --bench_csv" run on the machine itself (the largest size of each
+ * kernel). Engines evaluating the whole window scale with the square of the filter size, the
+ * rates are those of the default filter_size 27.
+ */
+
+#pragma region Latency budget
+
+/// <summary>
+/// Names of the bilateral engines, as in the settings and the benchmarks.
+/// </summary>
+inline const std::array<std::pair<const char*, BilateralEngine>, 11>& bilateralEngineNames()
+{
+    static const std::array<std::pair<const char*, BilateralEngine>, 11> names { {
+        { "bruteforce", BilateralEngine::BruteForce },
+        { "grid", BilateralEngine::Grid },
+        { "tiled", BilateralEngine::Tiled },
+        { "rangelut", BilateralEngine::RangeLut },
+        { "simd", BilateralEngine::Simd },
+        { "upsampled", BilateralEngine::Upsampled },
+        { "recursive", BilateralEngine::Recursive },
+        { "permutohedral", BilateralEngine::Permutohedral },
+        { "adaptive", BilateralEngine::Adaptive },
+        { "guided", BilateralEngine::Guided },
+        { "wls", BilateralEngine::Wls },
+    } };
+    return names;
+}
+
+inline const char* bilateralEngineName(const BilateralEngine engine)
+{
+    for (const auto& [name, value] : bilateralEngineNames()) {
+        if (value == engine) {
+            return name;
+        }
+    }
+    return "unknown";
+}
+
+/// <summary>
+/// Seconds per pixel of one thread of the stages a budget chooses between, see above.
+/// </summary>
+struct LatencyCostModel {
+    // Bilateral filter of the log-luminance at filter_size 27, per engine.
+    std::map<BilateralEngine, double> filter {
+        { BilateralEngine::BruteForce, 6.3e-6 },
+        { BilateralEngine::Grid, 39e-9 },
+        { BilateralEngine::Tiled, 6.0e-6 },
+        { BilateralEngine::RangeLut, 2.3e-6 },
+        { BilateralEngine::Simd, 300e-9 },
+        { BilateralEngine::Upsampled, 260e-9 },
+        { BilateralEngine::Recursive, 26e-9 },
+        { BilateralEngine::Permutohedral, 240e-9 },
+        // Every tile an edge tile, flat tiles cost a tenth of it.
+        { BilateralEngine::Adaptive, 6.0e-6 },
+        { BilateralEngine::Guided, 40e-9 },
+        { BilateralEngine::Wls, 450e-9 },
+    };
+    // Log-luminance and the RGB rescale of the tone mapping.
+    double tone_map = 30e-9;
+    // XYZ conversions of target and source and the merged divergence of the three planes, before the solve.
+    double edit = 7e-9;
+    // XYZ to RGB after the solve.
+    double edit_finish = 2e-9;
+    // Decoding an input or encoding an output, mostly on one thread and not divided by the threads
+    // (not benchmarked, calibrate() keeps it).
+    double io = 40e-9;
+    // One pixel update of one plane.
+    double jacobi = 0.55e-9;
+    double sor = 1.2e-9;
+    // One plane solved to the multigrid tolerance.
+    double multigrid = 950e-9;
+
+    /// <summary>
+    /// Replaces the rates measured by a benchmark run (its CSV) on this machine; kernels missing
+    /// from the file keep their defaults.
+    /// </summary>
+    void calibrate(const std::filesystem::path& csv_path)
+    {
+        std::ifstream file(csv_path);
+        if (!file) {
+            std::cerr << "Benchmark results " << csv_path << " do not exist!" << std::endl;
+            throw std::exception();
+        }
+        // Seconds per pixel and thread of the largest size of every kernel.
+        std::map<std::string, std::pair<int, double>> rates;
+        std::string line;
+        std::getline(file, line);
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string kernel, size, threads, median_ms, mpix_per_s;
+            if (!std::getline(fields, kernel, ',') || !std::getline(fields, size, ',') || !std::getline(fields, threads, ',') || !std::getline(fields, median_ms, ',')
+                || !std::getline(fields, mpix_per_s, ',')) {
+                continue;
+            }
+            const int pixels_size = std::stoi(size);
+            const double rate = std::stod(mpix_per_s);
+            auto& entry = rates[kernel];
+            if (rate > 0.0 && pixels_size >= entry.first) {
+                entry = { pixels_size, double(std::max(std::stoi(threads), 1)) / (rate * 1e6) };
+            }
+        }
+        const auto rate = [&](const std::string& kernel, double& value) {
+            if (const auto it = rates.find(kernel); it != rates.end() && it->second.second > 0.0) {
+                value = it->second.second;
+                return true;
+            }
+            return false;
+        };
+        for (const auto& [name, engine] : bilateralEngineNames()) {
+            rate(std::string("bilateralFilter/") + name, filter[engine]);
+        }
+        double log = 0.0, rescale = 0.0;
+        if (rate("logImage/exact", log) && rate("rescaleRgbByLuminance/exact", rescale)) {
+            tone_map = log + rescale;
+        }
+        double to_xyz = 0.0, divergence = 0.0;
+        if (rate("rgbToXYZ/simd", to_xyz) && rate("getMergedDivergence", divergence)) {
+            edit = 2 * to_xyz + 3 * divergence;
+        }
+        rate("xyzToRGB/simd", edit_finish);
+        rate("solvePoisson/jacobi", jacobi);
+        rate("solvePoisson/sor", sor);
+        rate("solvePoisson/multigrid", multigrid);
+    }
+
+    /// <summary>
+    /// Predicted seconds of the bilateral filter of an image.
+    /// </summary>
+    double filterSeconds(const BilateralEngine engine, const size_t pixels, const int filter_size, const int threads) const
+    {
+        const bool window = engine == BilateralEngine::BruteForce || engine == BilateralEngine::Tiled || engine == BilateralEngine::RangeLut || engine == BilateralEngine::Simd
+            || engine == BilateralEngine::Adaptive;
+        const double window_scale = window ? double(filter_size) * double(filter_size) / (27.0 * 27.0) : 1.0;
+        return filter.at(engine) * window_scale * double(pixels) / double(threads);
+    }
+};
+
+/// <summary>
+/// Poisson solve chosen by a budget.
+/// </summary>
+enum class PoissonStrategy {
+    // solvePoissonPlanes() with poisson_method and poisson_iters, stopped at the deadline.
+    Iterative,
+    // solvePoissonMultigridXYZ() to its tolerance.
+    Multigrid,
+};
+
+/// <summary>
+/// Engine and solve of a run chosen by planLatencyBudget(), with the predicted seconds.
+/// </summary>
+struct LatencyPlan {
+    double budget_seconds = 0.0;
+    BilateralEngine engine = BilateralEngine::BruteForce;
+    PoissonStrategy poisson_strategy = PoissonStrategy::Iterative;
+    PoissonMethod poisson_method = PoissonMethod::Jacobi;
+    int poisson_iters = 0;
+    double fixed_seconds = 0.0;
+    double filter_seconds = 0.0;
+    double poisson_seconds = 0.0;
+    // Seconds after the solve, the deadline of the solve is that much before the end of the budget.
+    double finish_seconds = 0.0;
+
+    void print(std::ostream& out) const
+    {
+        out << std::fixed << std::setprecision(0) << "Latency budget " << budget_seconds * 1e3 << " ms: bilateral " << bilateralEngineName(engine) << " (" << filter_seconds * 1e3
+            << " ms), Poisson ";
+        if (poisson_strategy == PoissonStrategy::Multigrid) {
+            out << "multigrid";
+        } else {
+            out << (poisson_method == PoissonMethod::RedBlackSor ? "sor" : "jacobi") << " x " << poisson_iters;
+        }
+        out << " (" << poisson_seconds * 1e3 << " ms), other stages " << fixed_seconds * 1e3 << " ms predicted." << std::defaultfloat << std::endl;
+    }
+};
+
+/// <summary>
+/// Chooses the bilateral engine and the Poisson solve of a run within a time budget, see above.
+/// </summary>
+/// <param name="model">costs per pixel</param>
+/// <param name="budget_seconds">wall time of the run</param>
+/// <param name="hdr_pixels">pixels of the tone-mapped image</param>
+/// <param name="target_pixels">pixels of the edited target</param>
+/// <param name="params">tone-mapping parameters, the engine is the preferred one</param>
+/// <param name="poisson_iters">iterations of the configured solve</param>
+/// <param name="poisson_method">configured iteration scheme</param>
+/// <param name="threads">kernel threads of the run</param>
+LatencyPlan planLatencyBudget(const LatencyCostModel& model, const double budget_seconds, const size_t hdr_pixels, const size_t target_pixels, const DurandParams& params,
+    const int poisson_iters, const PoissonMethod poisson_method, const int threads)
+{
+    const double t = double(std::max(threads, 1));
+    LatencyPlan plan;
+    plan.budget_seconds = budget_seconds;
+    // The HDR input and the tone-mapped image, the target and the edit result are decoded or encoded once.
+    plan.finish_seconds = model.edit_finish * double(target_pixels) / t + model.io * double(target_pixels);
+    plan.fixed_seconds = (model.tone_map * double(hdr_pixels) + model.edit * double(target_pixels)) / t + model.io * double(2 * hdr_pixels + target_pixels)
+        + plan.finish_seconds;
+    const double available = std::max(budget_seconds - plan.fixed_seconds, 0.0);
+
+    // The configured engine, then the exact engines, the close approximations and the coarse ones.
+    const BilateralEngine candidates[] = { params.engine, BilateralEngine::Simd, BilateralEngine::Tiled, BilateralEngine::BruteForce, BilateralEngine::RangeLut,
+        BilateralEngine::Permutohedral, BilateralEngine::Upsampled, BilateralEngine::Grid, BilateralEngine::Recursive, BilateralEngine::Guided };
+    const auto filter_seconds = [&](const BilateralEngine engine) { return model.filterSeconds(engine, hdr_pixels, params.filter_size, threads); };
+    const auto fitting = std::find_if(std::begin(candidates), std::end(candidates), [&](const BilateralEngine engine) { return filter_seconds(engine) <= available / 2; });
+    plan.engine = fitting != std::end(candidates) ? *fitting
+                                                  : *std::min_element(std::begin(candidates), std::end(candidates),
+                                                      [&](const BilateralEngine a, const BilateralEngine b) { return filter_seconds(a) < filter_seconds(b); });
+    plan.filter_seconds = filter_seconds(plan.engine);
+
+    const double solve_available = std::max(available - plan.filter_seconds, 0.0);
+    const double plane_pixels = 3.0 * double(target_pixels) / t;
+    const double configured_seconds = plane_pixels * (poisson_method == PoissonMethod::RedBlackSor ? model.sor : model.jacobi) * poisson_iters;
+    const int sor_iters = int(std::min(solve_available / (plane_pixels * model.sor), double(poisson_iters)));
+    const double multigrid_seconds = plane_pixels * model.multigrid;
+    if ((poisson_method == PoissonMethod::Jacobi || poisson_method == PoissonMethod::RedBlackSor) && configured_seconds <= solve_available) {
+        plan.poisson_method = poisson_method;
+        plan.poisson_iters = poisson_iters;
+        plan.poisson_seconds = configured_seconds;
+    } else if (sor_iters >= poisson_iters / 4 && sor_iters > 0) {
+        plan.poisson_method = PoissonMethod::RedBlackSor;
+        plan.poisson_iters = sor_iters;
+        plan.poisson_seconds = plane_pixels * model.sor * sor_iters;
+    } else if (multigrid_seconds <= solve_available) {
+        plan.poisson_strategy = PoissonStrategy::Multigrid;
+        plan.poisson_seconds = multigrid_seconds;
+    } else {
+        plan.poisson_method = PoissonMethod::RedBlackSor;
+        plan.poisson_iters = std::max(sor_iters, 1);
+        plan.poisson_seconds = plane_pixels * model.sor * plan.poisson_iters;
+    }
+    return plan;
+}
+
+#pragma endregion Latency budget
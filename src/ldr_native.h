@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <iostream>
+
+#include "async_load.h"
+#include "half_float.h"
+#include "plane3.h"
+#include "your_code_here.h"
+
+/*
+ * Poisson editing of LDR inputs at their native bit depth.
+ *
+ * The float path decodes an 8-bit file to glm::vec3 (12 bytes per pixel), converts it to XYZ
+ * planes (12 more) and takes their fp32 gradients (24 bytes per pixel). Here the source and the
+ * target stay in the levels of the file: RGB planes of uint8_t (3 bytes per pixel) whose
+ * gradients are the exact integer differences in int16_t (12 bytes per pixel). 16-bit files keep
+ * uint16_t planes (6 bytes per pixel); their differences need 17 bits and are stored in int32_t.
+ * copySourceGradientsToTarget() and getDivergence() run on the integer gradients unchanged, and
+ * the divergence is the first fp32 buffer, exact since it is a sum of integers.
+ *
+ * The solve runs in RGB on the scale of the levels: rgbToXYZ() is linear and the Poisson solve
+ * is linear per plane with the same operator, so solving the RGB planes equals solving the XYZ
+ * planes and converting back, and scaling the target and the divergence by the number of levels
+ * scales the solution by it. The result differs from the float path by rounding only.
+ */
+
+#pragma region Native LDR editing
+
+/// <summary>
+/// Gradient storage and value range of the pixels of LDR planes.
+/// </summary>
+template <typename P>
+struct LdrPixelTraits;
+
+template <>
+struct LdrPixelTraits<uint8_t> {
+    using Gradient = int16_t;
+    static constexpr float max_level = 255.0f;
+};
+
+template <>
+struct LdrPixelTraits<uint16_t> {
+    using Gradient = int32_t;
+    static constexpr float max_level = 65535.0f;
+};
+
+/// <summary>
+/// R, G and B planes (in X, Y and Z) of an LDR image in the levels of its file.
+/// </summary>
+template <typename P>
+struct LdrPlanes {
+    ImagePlane3<Image<P>> planes;
+
+    LdrPlanes() = default;
+
+    /// <summary>
+    /// Decodes an 8-bit or 16-bit file with stb_image. Gray files are replicated to RGB and alpha
+    /// is dropped; the levels are converted by stb_image when the file has the other depth.
+    /// </summary>
+    /// <param name="filePath">LDR image</param>
+    explicit LdrPlanes(const std::filesystem::path& filePath)
+    {
+        if (!std::filesystem::exists(filePath)) {
+            std::cerr << "Image file " << filePath << " does not exists!" << std::endl;
+            throw std::exception();
+        }
+        const auto filePathStr = filePath.string(); // Create l-value so c_str() is safe.
+        int width, height, channels;
+        P* pixels;
+        if constexpr (std::is_same_v<P, uint8_t>) {
+            pixels = stbi_load(filePathStr.c_str(), &width, &height, &channels, 3);
+        } else {
+            pixels = stbi_load_16(filePathStr.c_str(), &width, &height, &channels, 3);
+        }
+        if (!pixels) {
+            std::cerr << "Failed to read image " << filePath << " using stb_image.h" << std::endl;
+            throw std::exception();
+        }
+
+        planes = { Image<P>::uninitialized(width, height), Image<P>::uninitialized(width, height), Image<P>::uninitialized(width, height) };
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            const P* rgb = pixels + size_t(y) * size_t(width) * 3;
+            P* r = planes.X.data.data() + size_t(y) * size_t(width);
+            P* g = planes.Y.data.data() + size_t(y) * size_t(width);
+            P* b = planes.Z.data.data() + size_t(y) * size_t(width);
+            for (int x = 0; x < width; x++) {
+                r[x] = rgb[3 * x];
+                g[x] = rgb[3 * x + 1];
+                b[x] = rgb[3 * x + 2];
+            }
+        }
+        stbi_image_free(pixels);
+    }
+
+    /// <summary>
+    /// Quantizes an RGB image in [0, 1] to the levels, like the 8-bit writer.
+    /// </summary>
+    static LdrPlanes quantize(const ImageRGB& image)
+    {
+        LdrPlanes result;
+        result.planes = { Image<P>::uninitialized(image.width, image.height), Image<P>::uninitialized(image.width, image.height),
+            Image<P>::uninitialized(image.width, image.height) };
+        for (size_t i = 0; i < image.data.size(); i++) {
+            for (int c = 0; c < 3; c++) {
+                const float value = std::clamp(image.data[i][c], 0.0f, 1.0f);
+                result.planes[c].data[i] = P(value * LdrPixelTraits<P>::max_level + 0.5f);
+            }
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// The RGB image in [0, 1] the float path decodes from the same file (see stbToType()).
+    /// </summary>
+    ImageRGB toRgb() const
+    {
+        auto result = ImageRGB::uninitialized(width(), height());
+        for (size_t i = 0; i < result.data.size(); i++) {
+            result.data[i] = glm::vec3(float(planes.X.data[i]), float(planes.Y.data[i]), float(planes.Z.data[i])) / LdrPixelTraits<P>::max_level;
+        }
+        return result;
+    }
+
+    int width() const { return planes.X.width; }
+    int height() const { return planes.X.height; }
+};
+
+/// <summary>
+/// True when an image file is decoded at 8 or 16 bits per channel (not a float format), so
+/// LdrPlanes hold it without loss.
+/// </summary>
+inline bool isLdrFile(const std::filesystem::path& filePath)
+{
+    return !probeImage(filePath).hdr;
+}
+
+/// <summary>
+/// True when an LDR file has 16 bits per channel.
+/// </summary>
+inline bool isLdr16File(const std::filesystem::path& filePath)
+{
+    return stbi_is_16_bit(filePath.string().c_str()) != 0;
+}
+
+/// <summary>
+/// Target and source planes of a native LDR edit, decoded concurrently. Both are held at 16 bits
+/// when either file has 16 bits per channel, else at 8 bits.
+/// </summary>
+struct LdrEditLoads {
+    bool deep = false;
+    std::future<LdrPlanes<uint8_t>> target8, source8;
+    std::future<LdrPlanes<uint16_t>> target16, source16;
+
+    static LdrEditLoads startLoading(const std::filesystem::path& target_path, const std::filesystem::path& source_path)
+    {
+        LdrEditLoads loads;
+        loads.deep = isLdr16File(target_path) || isLdr16File(source_path);
+        if (loads.deep) {
+            loads.target16 = loadAsync<LdrPlanes<uint16_t>>("load target", target_path);
+            loads.source16 = loadAsync<LdrPlanes<uint16_t>>("load source", source_path);
+        } else {
+            loads.target8 = loadAsync<LdrPlanes<uint8_t>>("load target", target_path);
+            loads.source8 = loadAsync<LdrPlanes<uint8_t>>("load source", source_path);
+        }
+        return loads;
+    }
+};
+
+/// <summary>
+/// Divergence of the merged gradients of the planes, in levels, see above. Per plane equal to
+/// getDivergence(copySourceGradientsToTarget(getGradients(source), getGradients(target), mask))
+/// of the levels, the integer gradients of a plane live only until its divergence is taken.
+/// </summary>
+/// <param name="target">target planes</param>
+/// <param name="source">source planes</param>
+/// <param name="source_mask">mask of the source</param>
+/// <param name="offset_x">placement of the source in the target</param>
+/// <param name="offset_y">placement of the source in the target</param>
+/// <param name="context">thread split between the planes and their kernels</param>
+/// <returns>div G of the R, G and B planes, 2px larger than the target</returns>
+template <typename P>
+ImageFloatPlane3 getMergedDivergenceLdr(const LdrPlanes<P>& target, const LdrPlanes<P>& source, const BinaryMask& source_mask, const int offset_x = 0,
+    const int offset_y = 0, const ExecutionContext& context = {})
+{
+    using Gradient = typename LdrPixelTraits<P>::Gradient;
+    return mapPlanes(context, [&](const Image<P>& target_plane, const Image<P>& source_plane) {
+        return getDivergence(copySourceGradientsToTarget(getGradientsAs<Gradient>(source_plane), getGradientsAs<Gradient>(target_plane), source_mask, offset_x, offset_y));
+    }, target.planes, source.planes);
+}
+
+/// <summary>
+/// Poisson edit of LDR planes: the merged divergence in levels, solvePoissonXYZ() of the RGB
+/// planes from the target in levels, and the solution scaled back to [0, 1].
+/// </summary>
+/// <param name="target">target planes</param>
+/// <param name="source">source planes</param>
+/// <param name="source_mask">mask of the source</param>
+/// <param name="num_iters">iterations of the solve</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="offset_x">placement of the source in the target</param>
+/// <param name="offset_y">placement of the source in the target</param>
+/// <param name="context">thread split between the planes and their kernels</param>
+/// <returns>edited RGB image</returns>
+template <typename P>
+ImageRGB poissonEditLdr(const LdrPlanes<P>& target, const LdrPlanes<P>& source, const BinaryMask& source_mask, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const int offset_x = 0, const int offset_y = 0, const ExecutionContext& context = {})
+{
+    auto divergence = getMergedDivergenceLdr(target, source, source_mask, offset_x, offset_y, context);
+    auto solution = [&] {
+        const auto target_levels = mapPlanes([](const Image<P>& plane) { return convertImage<float>(plane.view()); }, target.planes);
+        return solvePoissonXYZ(target_levels, divergence, num_iters, method, context);
+    }();
+    divergence = {};
+
+    auto result = ImageRGB::uninitialized(target.width(), target.height());
+    constexpr float scale = 1.0f / LdrPixelTraits<P>::max_level;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(result.data.size()), KernelCost::Light))
+    for (int64_t i = 0; i < int64_t(result.data.size()); i++) {
+        result.data[i] = glm::vec3(solution.X.data[i], solution.Y.data[i], solution.Z.data[i]) * scale;
+    }
+    return result;
+}
+
+#pragma endregion Native LDR editing
@@ -0,0 +1,202 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <span>
+#include <vector>
+
+#include <framework/radiance_hdr.h>
+
+#include "execution.h"
+#include "scratch_arena.h"
+#include "your_code_here.h"
+
+/*
+ * Line-buffered execution of the Durand chain (luminance -> log -> bilateral -> detail ->
+ * contrast reduction -> RGB rescale), scheduled like a Halide pipeline computed at output rows.
+ *
+ * Input rows are pulled one at a time and pushed through the per-pixel stages into a ring of
+ * log-luminance rows. The bilateral filter is the only stencil: as soon as the rows
+ * [y - radius, y + radius] of an output block are in the ring, the block is filtered, composed
+ * with its input rows and emitted, and the oldest rows are overwritten by the next ones. The base
+ * and detail layers never exist beyond one pixel. Every intermediate is O(width * radius) instead
+ * of O(width * height), small enough to stay in L2/L3, and only the output block is handed out.
+ * The rings come from the calling thread's ScratchArena, so the images of a stream reuse them.
+ *
+ * The window is evaluated exactly in the order of bilateralFilterBruteForce(), so the result
+ * equals toneMapDurand() with the brute-force engine; the engine setting is not used. Output
+ * blocks of block_rows rows are filtered on all threads, larger blocks spread the work better at
+ * the cost of block_rows more rows per ring.
+ */
+
+#pragma region Line buffer
+
+/// <summary>
+/// Ring of image rows: row y is stored in slot y % capacity, so only the last capacity rows
+/// written are resident. The rows are taken from a scratch scope of the calling thread.
+/// </summary>
+template <typename T>
+class LineBuffer {
+public:
+    LineBuffer(ScratchScope& scratch, const int width, const int capacity)
+        : m_width(width)
+        , m_capacity(capacity)
+        , m_data(scratch.take<T>(size_t(width) * size_t(capacity)))
+    {
+        assert(width > 0 && capacity > 0);
+    }
+
+    int width() const { return m_width; }
+    int capacity() const { return m_capacity; }
+
+    T* row(const int y) { return m_data.data() + size_t(y % m_capacity) * size_t(m_width); }
+    const T* row(const int y) const { return m_data.data() + size_t(y % m_capacity) * size_t(m_width); }
+
+private:
+    int m_width;
+    int m_capacity;
+    std::span<T> m_data;
+};
+
+/// <summary>
+/// Default rows per output block of the line-buffered executor.
+/// </summary>
+constexpr int LINE_BUFFER_BLOCK_ROWS = 16;
+
+/// <summary>
+/// Streams the Durand chain row by row, see above. load_row(y, rgb) fills input row y and is
+/// called for y = 0, 1, ... in order; emit_row(y, rgb) receives output row y in order.
+/// </summary>
+/// <param name="width">image width</param>
+/// <param name="height">image height</param>
+/// <param name="params">tone-mapping parameters (filter_size, sigmas, base_scale, output_gain, saturation, math_precision)</param>
+/// <param name="load_row">writes width input pixels of the requested row</param>
+/// <param name="emit_row">consumes width output pixels of a row</param>
+/// <param name="block_rows">output rows filtered at once</param>
+template <typename LoadRow, typename EmitRow>
+void toneMapDurandLineBuffered(const int width, const int height, const DurandParams& params, const LoadRow& load_row, const EmitRow& emit_row,
+    const int block_rows = LINE_BUFFER_BLOCK_ROWS)
+{
+    assert(params.filter_size % 2 == 1 && block_rows > 0);
+    const int size = params.filter_size;
+    const int radius = size / 2;
+
+    // Same spatial table as bilateralFilterBruteForce().
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * params.space_sigma * params.space_sigma));
+        }
+    }
+    const float range_sigma = params.range_sigma;
+
+    // The input rows of a block and the radius rows read ahead of it, the log-luminance rows of
+    // the windows of a block, and the output block.
+    ScratchScope scratch;
+    LineBuffer<glm::vec3> input(scratch, width, block_rows + radius);
+    LineBuffer<float> log_lum(scratch, width, block_rows + 2 * radius);
+    LineBuffer<glm::vec3> output(scratch, width, block_rows);
+
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+        constexpr auto precision = decltype(tier)::value;
+        int loaded = 0;
+        for (int y0 = 0; y0 < height; y0 += block_rows) {
+            const int y1 = std::min(y0 + block_rows, height);
+
+            // Pull the rows up to the lower edge of the last window of the block.
+            const int needed = std::min(y1 + radius, height);
+            for (; loaded < needed; loaded++) {
+                glm::vec3* rgb = input.row(loaded);
+                load_row(loaded, rgb);
+                float* log_row = log_lum.row(loaded);
+                for (int x = 0; x < width; x++) {
+                    log_row[x] = tmoLog<precision>(std::max(rgbToLuminancePixel(rgb[x]), 1e-8f));
+                }
+            }
+
+#pragma omp parallel for schedule(dynamic) num_threads(kernelThreads(int64_t(y1 - y0) * width, KernelCost::Heavy))
+            for (int y = y0; y < y1; y++) {
+                const int dy0 = std::max(-radius, -y);
+                const int dy1 = std::min(radius, height - 1 - y);
+                const float* center = log_lum.row(y);
+                const glm::vec3* rgb = input.row(y);
+                glm::vec3* out = output.row(y);
+                for (int x = 0; x < width; x++) {
+                    const int dx0 = std::max(-radius, -x);
+                    const int dx1 = std::min(radius, width - 1 - x);
+                    const float val = center[x];
+                    float K = 0.0f;
+                    float filteredValue = 0.0f;
+                    for (int dy = dy0; dy <= dy1; dy++) {
+                        const float* row = log_lum.row(y + dy) + x;
+                        const float* weights = &spatialWeights[(dy + radius) * size + radius];
+                        for (int dx = dx0; dx <= dx1; dx++) {
+                            const float n_val = row[dx];
+                            float rangeWeight = exp(-(val - n_val) * (val - n_val) / (2.0f * range_sigma * range_sigma));
+                            float weight = weights[dx] * rangeWeight;
+                            filteredValue += weight * n_val;
+                            K += weight;
+                        }
+                    }
+
+                    // Base, detail and the new luminance in registers, as in durandCompose().
+                    const float b_val = filteredValue / K;
+                    const float d_val = val - b_val;
+                    const float tmo_luminance = applyDurandToneMappingPixel<precision>(b_val, d_val, params.base_scale, params.output_gain);
+                    out[x] = rescaleRgbByLuminancePixel<precision>(rgb[x], rgbToLuminancePixel(rgb[x]), tmo_luminance, params.saturation);
+                }
+            }
+
+            for (int y = y0; y < y1; y++) {
+                emit_row(y, static_cast<const glm::vec3*>(output.row(y)));
+            }
+        }
+    });
+}
+
+/// <summary>
+/// toneMapDurandLineBuffered() of an image in memory. Only the result is allocated in full.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1], equal to toneMapDurand() with the brute-force engine</returns>
+ImageRGB toneMapDurandLineBuffered(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    const int width = hdr_image.width;
+    auto result = ImageRGB::uninitialized(width, hdr_image.height);
+    toneMapDurandLineBuffered(width, hdr_image.height, params,
+        [&](const int y, glm::vec3* rgb) { std::copy_n(hdr_image.data.data() + size_t(y) * size_t(width), width, rgb); },
+        [&](const int y, const glm::vec3* rgb) { std::copy_n(rgb, width, result.data.data() + size_t(y) * size_t(width)); });
+    return result;
+}
+
+/// <summary>
+/// toneMapDurandLineBuffered() from a Radiance HDR file to a Radiance HDR file: scanlines are
+/// decoded and encoded as the chain needs and produces them, nothing is held as a whole image.
+/// </summary>
+/// <param name="input_path">Radiance .hdr input</param>
+/// <param name="output_path">Radiance .hdr output with the tone-mapped RGB in [0,1]</param>
+/// <param name="params">tone-mapping parameters</param>
+void toneMapDurandLineBuffered(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const DurandParams& params = {})
+{
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+    RadianceHdrReader reader(input_path);
+    RadianceHdrWriter writer(output_path, reader.width(), reader.height());
+    toneMapDurandLineBuffered(reader.width(), reader.height(), params,
+        [&](const int y, glm::vec3* rgb) {
+            if (!reader.readScanline(reinterpret_cast<float*>(rgb))) {
+                std::cerr << "Failed to decode scanline " << y << " of " << input_path << std::endl;
+                throw std::exception();
+            }
+        },
+        [&](const int y, const glm::vec3* rgb) {
+            if (!writer.writeScanline(reinterpret_cast<const float*>(rgb))) {
+                std::cerr << "Failed to write scanline " << y << " of " << output_path << std::endl;
+                throw std::exception();
+            }
+        });
+}
+
+#pragma endregion Line buffer
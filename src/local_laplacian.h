@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "image_pyramid.h"
+
+/*
+ * Fast local Laplacian filter (Paris, Hasinoff and Kautz 2011; Aubry et al. 2014).
+ *
+ * Every Laplacian coefficient of the output is the coefficient of the input after a point-wise
+ * remapping around g, the Gaussian pyramid value at that coefficient: differences up to
+ * range_sigma from g are details and are scaled by detail_scale, larger ones are edges whose
+ * excess over range_sigma is scaled by edge_scale. The fast variant remaps the whole image for
+ * a few reference values g_k spread over the value range, builds one Laplacian pyramid per
+ * reference and interpolates the coefficients linearly between the two references around g.
+ * The residual of the output is residual_scale times the input residual.
+ *
+ * On the log-luminance this is a tone mapping operator: with an edge and residual scale below
+ * 1 the large-scale contrast is compressed like the base layer of Durand's operator, while the
+ * details around every edge keep their contrast and no halo forms. The cost is num_samples
+ * pyramids of the image; the reference spacing follows range_sigma, as coarser spacings blur
+ * the transition between details and edges.
+ */
+
+#pragma region Local Laplacian filter
+
+/// <summary>
+/// Remapping of a value around the reference g, see above.
+/// </summary>
+inline float localLaplacianRemap(const float value, const float g, const float range_sigma, const float detail_scale, const float edge_scale)
+{
+    const float d = value - g;
+    const float a = std::abs(d);
+    const float remapped = a <= range_sigma ? a * detail_scale : range_sigma * detail_scale + (a - range_sigma) * edge_scale;
+    return g + std::copysign(remapped, d);
+}
+
+/// <summary>
+/// Number of references for a value range: one per range_sigma, at least 2 and at most 64.
+/// </summary>
+inline int localLaplacianSamples(const float value_range, const float range_sigma)
+{
+    return std::clamp(int(std::ceil(value_range / std::max(range_sigma, 1e-3f))) + 1, 2, 64);
+}
+
+/// <summary>
+/// Applies the fast local Laplacian filter to an image, see above.
+/// </summary>
+/// <param name="H">The intensity image to be filtered (e.g. log-luminance).</param>
+/// <param name="range_sigma">largest difference treated as detail, in units of H</param>
+/// <param name="detail_scale">factor of the details (1 keeps them)</param>
+/// <param name="edge_scale">factor of the edge amplitudes above range_sigma</param>
+/// <param name="residual_scale">factor of the coarsest level</param>
+/// <param name="num_samples">number of references, values <= 0 use localLaplacianSamples()</param>
+/// <param name="min_size">minimum side of the coarsest level</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat localLaplacianFilter(const ImageFloat& H, const float range_sigma, const float detail_scale, const float edge_scale, const float residual_scale,
+    int num_samples = 0, const int min_size = 8)
+{
+    const int levels = pyramidDepth(H.width, H.height, min_size);
+    const auto [min_it, max_it] = std::minmax_element(H.data.begin(), H.data.end());
+    const float min_val = *min_it;
+    const float value_range = std::max(*max_it - min_val, 1e-6f);
+    if (num_samples <= 0) {
+        num_samples = localLaplacianSamples(value_range, range_sigma);
+    }
+    const float step = value_range / float(num_samples - 1);
+
+    std::vector<ImageFloat> gaussian, result, remapped_pyramid;
+    buildGaussianPyramid<float>(H, levels, gaussian);
+    resizePyramid(result, H.width, H.height, levels);
+    for (int l = 0; l + 1 < levels; l++) {
+        std::fill(result[l].data.begin(), result[l].data.end(), 0.0f);
+    }
+    const auto& residual = gaussian[levels - 1];
+    std::transform(residual.data.begin(), residual.data.end(), result[levels - 1].data.begin(), [&](const float v) { return residual_scale * v; });
+
+    auto remapped = ImageFloat::uninitialized(H.width, H.height);
+    const auto num_pixels = int(H.data.size());
+    for (int k = 0; k < num_samples; k++) {
+        const float g = min_val + float(k) * step;
+#pragma omp parallel for num_threads(kernelThreads(num_pixels, KernelCost::Light))
+        for (int i = 0; i < num_pixels; i++) {
+            remapped.data[i] = localLaplacianRemap(H.data[i], g, range_sigma, detail_scale, edge_scale);
+        }
+        buildLaplacianPyramid<float>(remapped, levels, remapped_pyramid);
+
+        // Coefficients whose Gaussian value lies within one step of g, with the tent weight.
+        for (int l = 0; l + 1 < levels; l++) {
+            const auto& level_g = gaussian[l];
+            const auto& coefficients = remapped_pyramid[l];
+            auto& out = result[l];
+            const auto level_pixels = int(out.data.size());
+#pragma omp parallel for num_threads(kernelThreads(level_pixels, KernelCost::Light))
+            for (int i = 0; i < level_pixels; i++) {
+                const float weight = 1.0f - std::abs(level_g.data[i] - g) / step;
+                if (weight > 0.0f) {
+                    out.data[i] += weight * coefficients.data[i];
+                }
+            }
+        }
+    }
+
+    collapseLaplacianPyramid(result);
+    return std::move(result[0]);
+}
+
+#pragma endregion Local Laplacian filter
@@ -1,4 +1,26 @@
 #include "your_code_here.h"
+#include "async_load.h"
+#include "color_pipeline.h"
+#include "compressed_image.h"
+#include "decoded_image_cache.h"
+#include "fused_decode.h"
+#include "image_service.h"
+#include "latency_budget.h"
+#include "ldr_native.h"
+#include "line_buffer.h"
+#include "memory_plan.h"
+#include "output_set.h"
+#include "padded_tone_map.h"
+#include "planar_tone_map.h"
+#include "poisson_checkpoint.h"
+#include "result_cache.h"
+#include "run_config.h"
+#include "tone_map_batch.h"
+#include "tone_map_sequence.h"
+#include "tone_map_sweep.h"
+
+#include <framework/huge_page_resource.h>
+#include <framework/image_write_queue.h>
 
 static const std::filesystem::path dataDirPath { DATA_DIR };
 static const std::filesystem::path outDirPath { OUTPUT_DIR };
@@ -7,13 +29,346 @@ static const std::filesystem::path outDirPath { OUTPUT_DIR };
 /// <summary>
 /// A Helper function that saves each of the XYZ channel gradients into an RGB image (R = dx, G = dy, B = 0).
 /// </summary>
+/// <param name="outputs"></param>
 /// <param name="gradients"></param>
 /// <param name="name"></param>
-void saveGradients(const ImageXYZGradient& gradients, const std::string& name)
+void saveGradients(OutputSet& outputs, const ImageXYZGradient& gradients, const std::string& name)
 {
     for (auto i = 0; i < 3; ++i) {
-        gradientsToRgb(gradients[i]).writeToFile(outDirPath / (name + "_" + "XYZ"[i] + ".png"));
+        outputs.write(name + "_" + "XYZ"[i], [&] { return gradientsToRgb(gradients[i]); });
+    }
+}
+
+
+/// <summary>
+/// True when Part I can tone map the HDR input in bands: the Durand operator on the CPU from a
+/// Radiance file, with none of the intermediates of steps 0 to 6 wanted. Not with auto_contrast,
+/// which needs the base layer of the whole image.
+/// </summary>
+bool canToneMapInBands(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.durand.tone_operator == ToneMapOperator::Durand && !config.durand.color_guide && !config.durand.auto_contrast && !config.gpu
+        && config.hdr_input.extension() == ".hdr"
+        && !outputs.wantsAny("0") && !outputs.wantsAny("1") && !outputs.wantsAny("2_") && !outputs.wantsAny("3") && !outputs.wantsAny("4")
+        && !outputs.wantsAny("5") && !outputs.wantsAny("6");
+}
+
+/// <summary>
+/// True when Part II edits the source and the target in the levels of their files (see
+/// ldr_native.h): asked for, both read from LDR files, and a full Jacobi-style solve of one
+/// source on the CPU with none of the XYZ intermediates of steps 7 to 11 wanted.
+/// </summary>
+bool canEditLdrNative(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.ldr_native && !config.target_input.empty() && config.layers.empty() && !config.membrane_clone && config.composite == CompositeMode::Poisson && !config.gpu && !config.poisson_quadtree
+        && !config.poisson_schwarz && !config.poisson_prepared && config.poisson_chroma == PoissonChroma::Full && !outputs.wantsAny("7b") && !outputs.wantsAny("7c") && !outputs.wantsAny("8")
+        && !outputs.wantsAny("9") && !outputs.wantsAny("10") && !outputs.wantsAny("11") && isLdrFile(config.target_input) && isLdrFile(config.source_input);
+}
+
+/// <summary>
+/// True when the XYZ front end of Part II converts the source and the target in the pass of the
+/// merged divergence (getMergedDivergenceRgb()): one source, no gradient images or source planes
+/// wanted, and a solver that does not paste the source again.
+/// </summary>
+bool canFuseEditFrontEnd(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.layers.empty() && !config.poisson_quadtree && config.poisson_chroma != PoissonChroma::Transfer && !outputs.wantsAny("7c") && !outputs.wantsAny("8")
+        && !outputs.wantsAny("9");
+}
+
+/// <summary>
+/// Whether the outputs include the normalized snapshots of the input (0 - 2).
+/// </summary>
+bool wantsHdrSnapshot(const OutputSet& outputs)
+{
+    return outputs.wanted("0_src") || outputs.wanted("1_normalized") || outputs.wanted("2_gamma") || outputs.wanted("2_gamma_orig");
+}
+
+/// <summary>
+/// Whether the outputs include the Durand luminance, base, detail or contrast-reduced layers (3 - 6).
+/// </summary>
+bool wantsDurandLayers(const OutputSet& outputs)
+{
+    return outputs.wantsAny("3") || outputs.wantsAny("4") || outputs.wantsAny("5") || outputs.wantsAny("6");
+}
+
+/// <summary>
+/// True when Part I can decode and tone map the HDR input in another pixel storage than ImageRGB:
+/// the Durand operator on the CPU without the color guide from one file, with none of the
+/// intermediates of steps 0 to 6 wanted.
+/// </summary>
+bool canToneMapInLayout(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.durand.tone_operator == ToneMapOperator::Durand && !config.durand.color_guide && !config.gpu && !config.scheduled && !config.line_buffer
+        && config.brackets.empty() && !wantsHdrSnapshot(outputs) && !wantsDurandLayers(outputs);
+}
+
+/// <summary>
+/// True when Part I decodes and tone maps the HDR input as RGB planes (see planar_tone_map.h):
+/// asked for and possible, see canToneMapInLayout().
+/// </summary>
+bool canToneMapPlanar(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.rgb_layout == RgbLayout::Planar && canToneMapInLayout(config, outputs);
+}
+
+/// <summary>
+/// True when Part I decodes and tone maps the HDR input as padded pixels (see padded_tone_map.h):
+/// asked for and possible, see canToneMapInLayout().
+/// </summary>
+bool canToneMapPadded(const RunConfig& config, const OutputSet& outputs)
+{
+    return config.rgb_layout == RgbLayout::Padded && canToneMapInLayout(config, outputs);
+}
+
+/// <summary>
+/// True when the planes of a planar Part I become the XYZ target of the edit without an RGB copy:
+/// the tone-mapped image is the target of a Poisson solve in XYZ and is not shared or blended.
+/// </summary>
+bool isPlanarEditTarget(const RunConfig& config, const OutputSet& outputs)
+{
+    return canToneMapPlanar(config, outputs) && config.target_input.empty() && config.composite == CompositeMode::Poisson && config.edit_preview == CompositeMode::Poisson
+        && !config.membrane_clone && config.share_tmo.empty();
+}
+
+/// <summary>
+/// What the tone mapping of Part I reads of a decoded HDR input, computed while it is decoded (see
+/// fused_decode.h): the min/max of the snapshots, the luminance and log-luminance of the Durand
+/// layers, the log-luminance of the default Durand path. Nothing for bracketed exposures.
+/// </summary>
+DecodeConsumers hdrDecodeConsumers(const RunConfig& config, const OutputSet& outputs)
+{
+    DecodeConsumers consumers;
+    if (!config.brackets.empty()) {
+        return consumers;
+    }
+    const DurandParams& params = config.durand;
+    consumers.stats = wantsHdrSnapshot(outputs) ? StatMinMax : 0;
+    if (params.tone_operator == ToneMapOperator::Durand && wantsDurandLayers(outputs)) {
+        consumers.luminance = true;
+        consumers.log_luminance = true;
+    } else if (params.tone_operator == ToneMapOperator::Durand && (params.color_guide || !(config.gpu || config.scheduled || config.line_buffer))) {
+        consumers.log_luminance = true;
+        consumers.precision = params.math_precision;
+    }
+    return consumers;
+}
+
+/// <summary>
+/// Memory plan of the run below for the image sizes in the file headers (see memory_plan.h): the
+/// stages main() selects for the configuration and the outputs, with the buffers released where
+/// main() releases them.
+/// </summary>
+/// <param name="config">settings of the run</param>
+/// <param name="outputs">selected outputs</param>
+/// <param name="tone_map_band_rows">rows per band when Part I is tone mapped in bands, 0 for the whole image</param>
+MemoryPlan planRunMemory(const RunConfig& config, const OutputSet& outputs, const int tone_map_band_rows)
+{
+    const ImageInfo hdr = probeImage(config.hdr_input);
+    const ImageInfo target = config.target_input.empty() ? hdr : probeImage(config.target_input);
+    const ImageInfo source = probeImage(config.source_input);
+    const size_t hp = hdr.pixelCount(), tp = target.pixelCount(), sp = source.pixelCount();
+    const size_t rgb = sizeof(glm::vec3), plane = sizeof(float);
+    const DurandParams& params = config.durand;
+    MemoryPlan plan;
+
+    // Part I.
+    if (tone_map_band_rows > 0) {
+        const size_t window_rows = std::min(size_t(tone_map_band_rows + 2 * (params.filter_size / 2)), size_t(hdr.height));
+        // Window, log-luminance, base layer and result of one band.
+        plan.stage("toneMapDurandInBands", {}, window_rows * size_t(hdr.width) * (2 * rgb + 2 * plane));
+        plan.produce("tmo_rgb", hp * rgb);
+    } else if (canToneMapPlanar(config, outputs)) {
+        // Planes from the decode on, the result is the XYZ target of the edit or interleaved once.
+        plan.stage("loadRgbPlanes");
+        plan.produce("hdr_planes", hp * rgb);
+        plan.stage("durandLogLuminancePlanar", { "hdr_planes" });
+        plan.produce("log_lum_H", hp * plane);
+        plan.stage("bilateralFilter", { "log_lum_H" });
+        plan.produce("base_image", hp * plane);
+        plan.stage("durandComposePlanar", { "hdr_planes", "log_lum_H", "base_image" });
+        if (isPlanarEditTarget(config, outputs)) {
+            plan.produce("target_image_XYZ", hp * rgb);
+        } else {
+            plan.produce("tmo_planes", hp * rgb);
+            plan.stage("interleave tmo_planes", { "tmo_planes" });
+            plan.produce("tmo_rgb", hp * rgb);
+        }
+    } else if (canToneMapPadded(config, outputs)) {
+        // Padded pixels from the decode on, unpadded once.
+        const size_t padded = sizeof(glm::vec4);
+        plan.stage("loadRgbPadded");
+        plan.produce("hdr_padded", hp * padded);
+        plan.stage("durandLogLuminancePadded", { "hdr_padded" });
+        plan.produce("log_lum_H", hp * plane);
+        plan.stage("bilateralFilter", { "log_lum_H" });
+        plan.produce("base_image", hp * plane);
+        plan.stage("durandComposePadded", { "hdr_padded", "log_lum_H", "base_image" });
+        plan.produce("tmo_padded", hp * padded);
+        plan.stage("unpad tmo_padded", { "tmo_padded" });
+        plan.produce("tmo_rgb", hp * rgb);
+    } else {
+        // The planes fused into the decode exist from the load on.
+        const DecodeConsumers decoded = hdrDecodeConsumers(config, outputs);
+        plan.stage("load hdr");
+        plan.produce("hdr_image", hp * rgb);
+        if (decoded.luminance) {
+            plan.produce("hdr_luminance", hp * plane);
+        }
+        if (decoded.log_luminance) {
+            plan.produce("log_lum_H", hp * plane);
+        }
+        if (wantsHdrSnapshot(outputs)) {
+            plan.stage("snapshot hdr", { "hdr_image" });
+            plan.produce("hdr_snapshot", hp * rgb);
+            plan.stage("encode snapshot", { "hdr_snapshot" });
+        }
+        if (params.tone_operator != ToneMapOperator::Durand) {
+            plan.stage("toneMap", { "hdr_image" }, hp * 2 * plane);
+        } else if (wantsDurandLayers(outputs)) {
+            if (!decoded.luminance) {
+                plan.stage("rgbToLuminance", { "hdr_image" });
+                plan.produce("hdr_luminance", hp * plane);
+                plan.stage("logImage", { "hdr_luminance" });
+                plan.produce("log_lum_H", hp * plane);
+            }
+            // The compressed input is assumed to take half its raw size, the luminance its full size.
+            std::string idle_hdr = "hdr_image", idle_luminance = "hdr_luminance";
+            if (config.compress_idle && !params.color_guide) {
+                plan.stage("compress idle", { "hdr_image", "hdr_luminance" });
+                plan.produce("idle_compressed", hp * (rgb / 2 + plane));
+                idle_hdr = "hdr_image_restored";
+                idle_luminance = "hdr_luminance_restored";
+            }
+            plan.stage("bilateralFilter", { "log_lum_H" });
+            plan.produce("base_image", hp * plane);
+            plan.stage("getDetailImage", { "log_lum_H", "base_image" });
+            plan.produce("detail_image", hp * plane);
+            plan.stage("applyDurandToneMappingOperator", { "base_image", "detail_image" });
+            plan.produce("tmo_luminance", hp * plane);
+            if (idle_hdr != "hdr_image") {
+                plan.stage("restore idle", { "idle_compressed" });
+                plan.produce(idle_hdr, hp * rgb);
+                plan.produce(idle_luminance, hp * plane);
+            }
+            plan.stage("rescaleRgbByLuminance", { idle_hdr, idle_luminance, "tmo_luminance" });
+        } else if (config.gpu && !params.color_guide && !params.auto_contrast) {
+            plan.stage("toneMapDurandGpu", { "hdr_image" });
+        } else if (config.scheduled && !params.color_guide && !params.auto_contrast) {
+            const auto schedule = config.schedules.get("durand", KernelKind::Stencil);
+            const size_t halo_tile = size_t(std::min(schedule.tile_width, hdr.width) + params.filter_size) * size_t(schedule.tile_height + params.filter_size);
+            if (schedule.compute_at == ComputeAt::Tile && schedule.fuse_consumer) {
+                plan.stage("toneMapDurandScheduled", { "hdr_image" }, halo_tile * plane * size_t(getThreadCount()));
+            } else {
+                plan.stage("toneMapDurandScheduled", { "hdr_image" }, hp * plane * (schedule.fuse_consumer ? 1 : 2));
+            }
+        } else if (config.line_buffer && !params.color_guide && !params.auto_contrast) {
+            // Rings of input, log-luminance and output rows.
+            const size_t ring_rows = size_t(2 * LINE_BUFFER_BLOCK_ROWS + 3 * (params.filter_size / 2));
+            plan.stage("toneMapDurandLineBuffered", { "hdr_image" }, ring_rows * size_t(hdr.width) * rgb);
+        } else {
+            if (!decoded.log_luminance) {
+                plan.stage("durandLogLuminance", { "hdr_image" });
+                plan.produce("log_lum_H", hp * plane);
+            }
+            std::string compose_input = "hdr_image";
+            if (config.compress_idle && !params.color_guide) {
+                plan.stage("compress hdr_image", { "hdr_image" });
+                plan.produce("hdr_compressed", hp * rgb / 2);
+                compose_input = "hdr_compressed";
+            }
+            plan.stage("bilateralFilter", { "log_lum_H" });
+            plan.produce("base_image", hp * plane);
+            plan.stage("durandCompose", { compose_input, "log_lum_H", "base_image" });
+        }
+        plan.produce("tmo_rgb", hp * rgb);
+    }
+
+    // Part II: the target is the tone-mapped image itself unless it is given.
+    plan.stage("load edit inputs");
+    const bool gpu_edit = config.gpu && config.layers.empty() && !outputs.wantsAny("7b") && !outputs.wantsAny("7c") && !outputs.wantsAny("8") && !outputs.wantsAny("9")
+        && !outputs.wantsAny("10") && !outputs.wantsAny("11");
+    if (canEditLdrNative(config, outputs)) {
+        // Planes and gradients in the levels, the gradients of the planes solved at once live together.
+        const size_t level = isLdr16File(config.target_input) || isLdr16File(config.source_input) ? sizeof(uint16_t) : sizeof(uint8_t);
+        const size_t gradient = 2 * level;
+        const size_t planes_at_once = size_t(std::clamp(config.plane_threads, 1, 3));
+        const size_t gp = size_t(target.width + 1) * size_t(target.height + 1), sgp = size_t(source.width + 1) * size_t(source.height + 1);
+        plan.produce("source_planes", sp * 3 * level);
+        plan.produce("source_mask", sp / 8);
+        plan.produce("target_planes", tp * 3 * level);
+        plan.stage("getMergedDivergenceLdr", { "source_planes", "source_mask", "target_planes" }, planes_at_once * 2 * gradient * (sgp + 2 * gp));
+        plan.produce("divergence", tp * rgb);
+        // The target in fp32 levels is the initial solution.
+        plan.stage("solvePoisson", { "target_planes", "divergence" }, tp * rgb + tp * plane * planes_at_once);
+        plan.produce("edit_result_levels", tp * rgb);
+        plan.stage("scale levels", { "edit_result_levels" });
+        plan.produce("edit_result_rgb", tp * rgb);
+        plan.stage("write outputs", { "edit_result_rgb" });
+        return plan;
+    }
+    plan.produce("source_image", sp * rgb);
+    plan.produce("source_mask", sp / 8);
+    const bool planar_target = isPlanarEditTarget(config, outputs);
+    const std::string target_image = config.target_input.empty() ? "tmo_rgb" : "target_image";
+    if (!config.target_input.empty()) {
+        plan.produce("target_image", tp * rgb);
     }
+    if (config.composite != CompositeMode::Poisson) {
+        plan.stage(config.composite == CompositeMode::Pyramid ? "laplacianPyramidBlend" : "featherBlend", { "source_image", "source_mask", target_image });
+    } else if (config.membrane_clone || gpu_edit) {
+        plan.stage(config.membrane_clone ? "membraneClone" : "poissonEditGpu", { "source_image", "source_mask", target_image });
+    } else if (canFuseEditFrontEnd(config, outputs) && !planar_target) {
+        plan.stage("getMergedDivergenceRgb", { "source_image", "source_mask", target_image });
+        plan.produce("target_image_XYZ", tp * rgb);
+        plan.produce("divergence_XYZ", tp * rgb);
+        plan.stage("solvePoisson", { "target_image_XYZ", "divergence_XYZ" }, tp * plane * size_t(std::clamp(config.plane_threads, 1, 3)));
+        plan.produce("edit_result_XYZ", tp * rgb);
+        plan.stage("xyzToRGB", { "edit_result_XYZ" });
+    } else {
+        if (!planar_target) {
+            plan.stage("rgbToXYZ target", { target_image });
+            plan.produce("target_image_XYZ", tp * rgb);
+        }
+        plan.stage("rgbToXYZ source", { "source_image" });
+        plan.produce("source_image_XYZ", sp * rgb);
+        if (!config.layers.empty()) {
+            plan.stage("load layers");
+            for (const auto& layer : config.layers) {
+                const size_t lp = probeImage(layer.source).pixelCount();
+                plan.produce(layer.source.stem().string() + "_XYZ", lp * rgb);
+            }
+            plan.stage("getLayeredDivergenceXYZ", { "target_image_XYZ", "source_image_XYZ", "source_mask" });
+            for (const auto& layer : config.layers) {
+                plan.stage("layer " + layer.source.stem().string(), { layer.source.stem().string() + "_XYZ" });
+            }
+        } else if (outputs.wantsAny("8") || outputs.wantsAny("9")) {
+            const auto gradient_bytes = [](const ImageInfo& info) { return 3 * 2 * size_t(info.width + 1) * size_t(info.height + 1) * sizeof(float); };
+            plan.stage("getGradientsXYZ source", { "source_image_XYZ" });
+            plan.produce("source_gradients_XYZ", gradient_bytes(source));
+            plan.stage("getGradientsXYZ target", { "target_image_XYZ" });
+            plan.produce("target_gradients_XYZ", gradient_bytes(target));
+            plan.stage("copySourceGradientsToTargetXYZ", { "source_gradients_XYZ", "target_gradients_XYZ", "source_mask" });
+            plan.produce("merged_gradients_XYZ", gradient_bytes(target));
+            plan.stage("getDivergenceXYZ", { "merged_gradients_XYZ" });
+        } else {
+            plan.stage("getMergedDivergenceXYZ", { "source_image_XYZ", "target_image_XYZ", "source_mask" });
+        }
+        plan.produce("divergence_XYZ", tp * rgb);
+        // Jacobi and the other solvers hold a second solution of each plane solved at once.
+        const size_t solve_scratch = tp * plane * size_t(std::clamp(config.plane_threads, 1, 3));
+        if (config.poisson_quadtree || config.poisson_chroma == PoissonChroma::Transfer) {
+            // The pasted composite is rebuilt from the source.
+            plan.stage("solvePoisson", { "target_image_XYZ", "divergence_XYZ", "source_image_XYZ", "source_mask" }, solve_scratch + tp * rgb);
+        } else {
+            plan.stage("solvePoisson", { "target_image_XYZ", "divergence_XYZ" }, solve_scratch);
+        }
+        plan.produce("edit_result_XYZ", tp * rgb);
+        plan.stage("xyzToRGB", { "edit_result_XYZ" });
+    }
+    plan.produce("edit_result_rgb", tp * rgb);
+    plan.stage("write outputs", { "edit_result_rgb" });
+    return plan;
 }
 
 
@@ -21,61 +376,431 @@ void saveGradients(const ImageXYZGradient& gradients, const std::string& name)
 /// Main method. Runs default tests. Feel free to modify it, add more tests and experiments,
 /// change the input images etc. The file is not part of the solution. All solutions have to 
 /// implemented in "your_code_here.h".
+///
+/// All parameters, inputs and modes are settings of a RunConfig, see run_config.h and "--help".
 /// </summary>
 /// <returns>0</returns>
-int main()
+int main(int argc, char** argv)
 {
-    std::chrono::steady_clock::time_point time_start, time_end;
+    // Start of a latency budget.
+    const auto run_start = std::chrono::steady_clock::now();
+    // Defaults of the run, overridden by the command line and job files.
+    RunConfig config;
+    config.hdr_input = dataDirPath / "memorial2_half.hdr"; // https://www.cs.huji.ac.il/~danix/hdr/pages/memorial.html
+    config.source_input = dataDirPath / "cat.png";
+    config.mask_input = dataDirPath / "cat_mask.png";
+    config.output_dir = outDirPath;
+    config.validate.inputs = { config.hdr_input };
+    try {
+        parseRunArguments(config, argc, argv);
+    } catch (const std::exception&) {
+        printRunUsage(std::cerr);
+        return 1;
+    }
+    if (config.mode == "help") {
+        printRunUsage(std::cout);
+        return 0;
+    }
+    if (!config.tuning_profile.empty() && config.mode != "serve") {
+        // Measured with the default blocking on all threads.
+        const auto profile = loadOrAutotune(config.tuning_profile, config.durand, config.autotune_size, config.mode == "autotune", std::cout);
+        if (config.mode == "autotune") {
+            return 0;
+        }
+        applyTuningProfile(config, profile);
+        std::cout << "Tuning profile: " << formatTuningSettings(profile) << std::endl;
+    }
+    setThreadCount(config.threads);
+    setThreadPlacement(config.thread_placement);
+    setGrayPngOutput(config.gray_png);
+    setPng16Output(config.png16);
+    decodedImageCache().setMaxBytes(config.decoded_cache_bytes);
+
+    if (config.mode == "serve") {
+        // Replies are the only output on stdout.
+        ImageService service(config.serve_quotas);
+        service.run(std::cin, std::cout);
+        return 0;
+    }
+
     printOpenMPStatus();
+    if (config.explicit_settings.contains("preset")) {
+        std::cout << "Quality preset: " << describeQualityPreset(config) << std::endl;
+    }
+    if (config.mode == "benchmark") {
+        return runKernelBenchmarks(config.durand, config.benchmark, std::cout) ? 0 : 1;
+    }
+    if (config.mode == "scaling") {
+        return runScalingHarness(currentExecutablePath(argv[0]), pipelineRunArguments(config), config.durand, config.benchmark, config.workload, config.scaling, std::cout)
+            ? 0
+            : 1;
+    }
+    if (config.mode == "generate") {
+        writeSyntheticWorkloads(config.workload_sizes, config.workload, config.mode_output, std::cout);
+        return 0;
+    }
+    if (config.mode == "validate") {
+        return runGoldenChecks(config.durand, config.validate, std::cout) ? 0 : 1;
+    }
+    if (config.mode == "compare") {
+        return runImageComparison(config.mode_input, config.mode_output, config.compare, std::cout) ? 0 : 1;
+    }
+
+    // Large buffers optionally come from huge pages, which the pool then recycles.
+    HugePageResource huge_page_resource;
+    // All images of this run draw from one pool, so freed temporaries are recycled for later stages.
+    ImageBufferPool image_pool(size_t(1) << 30, config.huge_pages ? static_cast<std::pmr::memory_resource*>(&huge_page_resource) : std::pmr::new_delete_resource());
+    // Counts the image bytes of each stage for the profiler, also must outlive the images.
+    ImageAllocationCounter allocation_counter(&image_pool);
+    ImageMemoryScope image_memory_scope(&allocation_counter);
+    const bool profiling = config.profile || config.profile_memory || !config.profile_json.empty() || !config.trace.empty();
+    if (profiling) {
+        StageProfiler::instance().enable(&allocation_counter);
+        StageProfiler::instance().setRunInfo("preset", describeQualityPreset(config));
+    }
+    // Outputs are encoded and written in the background while the next stage runs.
+    // Declared after the pool, which must outlive the queued images.
+    ImageWriteQueue output_queue;
+    // Base layer, gradients and the solution by content, kept between runs with a cache_dir.
+    ResultCache result_cache(size_t(512) << 20, config.cache_dir);
+
+    if (config.mode == "batch" && config.batch_distributed) {
+        const MpiSession session;
+        const auto jobs = collectToneMapJobs(config.mode_input, config.mode_output, { { "", config.durand } });
+        const auto stats = runToneMapBatchDistributed(jobs, config.distributed_batch, session);
+        if (session.isRoot()) {
+            std::cout << "Batch: " << stats.succeeded << " of " << jobs.size() << " images tone mapped by " << std::max(session.ranks() - 1, 1) << " workers in "
+                      << stats.seconds << " s." << std::endl;
+        }
+        // Attempts of a worker may fail and succeed elsewhere, the coordinator has the outcome.
+        return !session.isRoot() || stats.failed == 0 ? 0 : 1;
+    }
+    if (config.mode == "batch") {
+        const auto jobs = collectToneMapJobs(config.mode_input, config.mode_output, { { "", config.durand } });
+        ToneMapBatchOptions batch_options;
+        batch_options.compress_idle = config.compress_idle;
+        batch_options.read_ahead = config.batch_read_ahead;
+        const auto stats = config.batch_coroutines ? runToneMapBatchCoroutines(jobs, batch_options) : runToneMapBatch(jobs, batch_options);
+        std::cout << "Batch: " << stats.succeeded << " of " << jobs.size() << " images tone mapped in " << stats.seconds << " s." << std::endl;
+        if (config.profile) {
+            RingOccupancyReport::instance().print(std::cout);
+        }
+        return stats.failed == 0 ? 0 : 1;
+    }
+    if (config.mode == "sequence") {
+        std::vector<std::filesystem::path> inputs, outputs;
+        for (const auto& job : collectToneMapJobs(config.mode_input, config.mode_output)) {
+            inputs.push_back(job.input);
+            outputs.push_back(job.output);
+        }
+        const double fps = toneMapSequenceFiles(inputs, outputs, config.durand, config.sequence);
+        std::cout << "Sequence: " << inputs.size() << " frames at " << fps << " frames/s." << std::endl;
+        if (config.profile) {
+            RingOccupancyReport::instance().print(std::cout);
+        }
+        return 0;
+    }
+    if (config.mode == "sweep") {
+        // One base layer for all variants, see tone_map_sweep.h.
+        const auto start_time = std::chrono::steady_clock::now();
+        const size_t variants = toneMapSweepFile(config.mode_input, config.mode_output, config.durand, config.sweep, output_queue);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        std::cout << "Sweep: " << variants << " variants of " << config.mode_input << " in " << seconds << " s." << std::endl;
+        return 0;
+    }
+    if (config.mode == "clone_sequence") {
+        std::filesystem::create_directories(config.mode_output);
+        const auto frames = collectCloneFrames(config.mode_input, config.source_input, config.mask_input, config.mode_output);
+        auto options = config.clone_sequence;
+        options.max_iters = config.poisson_iters;
+        std::vector<CloneFrameStats> frame_stats;
+        const double fps = cloneSequenceFiles(frames, options, &frame_stats);
+        int sweeps = 0;
+        for (const auto& stats : frame_stats) {
+            sweeps += stats.iterations;
+        }
+        std::cout << "Clone sequence: " << frame_stats.size() << " frames at " << fps << " frames/s, " << (frame_stats.empty() ? 0 : sweeps / int(frame_stats.size()))
+                  << " sweeps per frame." << std::endl;
+        if (config.profile) {
+            RingOccupancyReport::instance().print(std::cout);
+        }
+        return 0;
+    }
+
+    if (config.mode == "distributed") {
+        // Launched by mpirun, every rank tone maps its band of rows.
+        const MpiSession session;
+        const double seconds = toneMapDurandDistributed(config.mode_input, config.mode_output, config.durand, session);
+        if (session.isRoot()) {
+            std::cout << "Distributed: " << config.mode_output << " tone mapped by " << session.ranks() << " ranks in " << seconds << " s." << std::endl;
+        }
+        return 0;
+    }
+
+    // Final images only with "--outputs final", see OutputSet for the selection syntax.
+    OutputSet outputs(output_queue, config.output_dir, config.outputs);
+    outputs.setRenditions(config.renditions);
+    outputs.setTilePyramid(config.tile_pyramid);
+
+    // With a latency budget the engine and the Poisson solve follow the cost model, see latency_budget.h.
+    std::optional<LatencyPlan> latency_plan;
+    if (config.latency_budget_ms > 0) {
+        LatencyCostModel cost_model;
+        if (!config.latency_profile.empty()) {
+            cost_model.calibrate(config.latency_profile);
+        }
+        const size_t hdr_pixels = probeImage(config.hdr_input).pixelCount();
+        const size_t target_pixels = config.target_input.empty() ? hdr_pixels : probeImage(config.target_input).pixelCount();
+        latency_plan = planLatencyBudget(cost_model, config.latency_budget_ms / 1e3, hdr_pixels, target_pixels, config.durand, config.poisson_iters, config.poisson_method,
+            getThreadCount());
+        latency_plan->print(std::cout);
+        config.durand.engine = latency_plan->engine;
+        if (latency_plan->poisson_strategy == PoissonStrategy::Iterative) {
+            config.poisson_method = latency_plan->poisson_method;
+            config.poisson_iters = latency_plan->poisson_iters;
+        }
+    }
+
+    // Predicted footprint from the image headers, checked against the budget before anything is loaded.
+    // Over the budget Part I is tone mapped in bands where possible, with the largest bands that fit.
+    int tone_map_band_rows = 0;
+    if (config.memory_plan || config.memory_budget > 0) {
+        auto plan = planRunMemory(config, outputs, 0);
+        auto summary = plan.analyze();
+        if (config.memory_budget > 0 && summary.peak_bytes > config.memory_budget && canToneMapInBands(config, outputs)) {
+            for (int band_rows = probeImage(config.hdr_input).height / 2; band_rows >= 16; band_rows /= 2) {
+                auto band_plan = planRunMemory(config, outputs, band_rows);
+                const auto band_summary = band_plan.analyze();
+                if (band_summary.peak_bytes < summary.peak_bytes) {
+                    plan = std::move(band_plan);
+                    summary = band_summary;
+                    tone_map_band_rows = band_rows;
+                }
+                if (summary.peak_bytes <= config.memory_budget) {
+                    break;
+                }
+            }
+        }
+        if (config.memory_plan) {
+            plan.print(std::cout);
+        }
+        if (config.memory_budget > 0 && summary.peak_bytes > config.memory_budget) {
+            std::cerr << "The run needs " << std::fixed << std::setprecision(1) << double(summary.peak_bytes) / double(1 << 20)
+                      << " MB at its peak, more than the memory budget of " << (config.memory_budget >> 20) << " MB." << std::endl;
+            return 1;
+        }
+    }
 
     #pragma region HDR TMO
     //////////////////////////////////////////////////////////////////////////////
     /// Part I: HDR Tone Mapping
     //////////////////////////////////////////////////////////////////////////////
 
-    // 0. Load inputs from files. https://www.cs.huji.ac.il/~danix/hdr/pages/memorial.html
-    auto hdr_image = ImageRGB(dataDirPath / "memorial2_half.hdr");
-    hdr_image.writeToFile(outDirPath / "0_src.png");
-
-    // 1. Normalize the image range to [0,1].
-    auto image_normed = normalizeRGBImage(hdr_image);
-    image_normed.writeToFile(outDirPath / "1_normalized.png");
-
-    // 2. Apply gamma curve.
-    auto image_gamma = applyGamma(image_normed, 1 / 2.2f);
-    image_gamma.writeToFile(outDirPath / "2_gamma.png");
-
-    // 2b. Apply gamma to the original image.
-    auto gamma_orig = applyGamma(hdr_image, 1 / 2.2f);
-    gamma_orig.writeToFile(outDirPath / "2_gamma_orig.png");
-
-    // 3. Get luminance.
-    auto hdr_luminance = rgbToLuminance(hdr_image);
-    hdr_luminance.writeToFile(outDirPath / "3a_luminance.png");
-    // [Provided] Compute Logarithm of the luminance
-    auto log_lum_H = logImage(hdr_luminance);
-    normalizeFloatImage(log_lum_H).writeToFile(outDirPath / "3b_log_luminance_H.png");
-
-    // 4. Apply bilateral filter.
-    const int filter_size = 27; // must be an odd integer
-    const float space_sigma = filter_size / 6.4f;
-    const float range_sigma = 1.0f;
-    auto base_image = bilateralFilter(log_lum_H, filter_size, space_sigma, range_sigma);
-    normalizeFloatImage(base_image).writeToFile(outDirPath / "4_base_layer.png");
-
-    // [Provided] Get Detail image.
-    auto detail_image = getDetailImage(log_lum_H, base_image);
-    normalizeFloatImage(detail_image).writeToFile(outDirPath / "5_detail_layer.png");
-
-    // 6. Get new intensity after contrast reduction.
-    const float base_scale = 0.15f;
-    const float output_gain = 0.5f;
-    auto tmo_luminance = applyDurandToneMappingOperator(base_image, detail_image, base_scale, output_gain);
-    tmo_luminance.writeToFile(outDirPath / "6_tmo_luminance.png");
-
-    // 7. Convert back to RGB.
-    auto tmo_rgb = rescaleRgbByLuminance(hdr_image, hdr_luminance, tmo_luminance);
-    tmo_rgb.writeToFile(outDirPath / "7_tmo_rgb.png");
+    StageProfiler::instance().setPhase("tone mapping");
+    // 0. Load inputs from files. The inputs of Part II decode in the background meanwhile.
+    // A native LDR edit decodes the source and the target in their levels instead.
+    const bool ldr_edit = canEditLdrNative(config, outputs);
+    auto edit_loads = ldr_edit ? PoissonEditLoads::startLoading({}, {}, config.mask_input)
+                               : PoissonEditLoads::startLoading(config.target_input, config.source_input, config.mask_input);
+    auto ldr_loads = ldr_edit ? LdrEditLoads::startLoading(config.target_input, config.source_input) : LdrEditLoads();
+    std::vector<std::pair<std::future<ImageRGB>, std::future<BinaryMask>>> layer_loads;
+    for (const auto& layer : config.layers) {
+        layer_loads.emplace_back(loadAsync<ImageRGB>("load layer source", layer.source), loadAsync<BinaryMask>("load layer mask", layer.mask));
+    }
+    // Not loaded as a whole when Part I runs in bands.
+    // Bracketed LDR exposures are merged into the radiance map while they are decoded, see exposure_merge.h.
+    // A decoded file feeds the statistics and the planes the branches below start from while it is
+    // decoded (see hdrDecodeConsumers()); the branches compute whatever is missing.
+    const auto load_hdr = [&] {
+        if (!config.brackets.empty()) {
+            return DecodedHdr { profileStage("mergeExposureBrackets", 0, [&] { return mergeExposureBrackets(config.brackets, config.bracket_merge); }) };
+        }
+        return profileStage("load hdr", 0, [&] { return loadHdrFused(config.hdr_input, hdrDecodeConsumers(config, outputs)); });
+    };
+    // Decoded into RGB planes instead when Part I runs on them, see planar_tone_map.h.
+    const bool planar_tmo = tone_map_band_rows == 0 && canToneMapPlanar(config, outputs);
+    const bool planar_target = planar_tmo && isPlanarEditTarget(config, outputs);
+    // Or into padded pixels, see padded_tone_map.h.
+    const bool padded_tmo = tone_map_band_rows == 0 && canToneMapPadded(config, outputs);
+    auto decoded_hdr = tone_map_band_rows > 0 || planar_tmo || padded_tmo ? DecodedHdr {} : load_hdr();
+    auto hdr_planes = planar_tmo ? profileStage("loadRgbPlanes", 0, [&] { return loadRgbPlanes(config.hdr_input); }) : ImageRgbPlanes {};
+    auto hdr_padded = padded_tmo ? profileStage("loadRgbPadded", 0, [&] { return loadRgbPadded(config.hdr_input); }) : ImageRgbPadded {};
+    auto hdr_image = std::move(decoded_hdr.image);
+    const uint64_t hdr_pixels = planar_tmo ? hdr_planes.X.data.size() : padded_tmo ? hdr_padded.data.size() : hdr_image.data.size();
+    // Statistics of the input, reduced once for all stages that normalize it.
+    ImageStatsCache<glm::vec3> hdr_stats(hdr_image, std::move(decoded_hdr.stats));
+
+    // 0 - 2. The input, normalized and gamma mapped: one snapshot, the normalization and the gamma
+    // curve are applied while the writer quantizes it (see OutputTransform).
+    if (wantsHdrSnapshot(outputs)) {
+        const auto hdr_snapshot = std::make_shared<const ImageRGB>(hdr_image.clone());
+        const glm::vec2 min_max = hdr_stats.minMax();
+        const float normalize_scale = 1.0f / (min_max.y - min_max.x);
+        const float normalize_offset = -min_max.x * normalize_scale;
+        outputs.write("0_src", hdr_snapshot);
+
+        // 1. Normalize the image range to [0,1].
+        outputs.write("1_normalized", hdr_snapshot, OutputKind::Diagnostic, { OutputTransform::Curve::Linear, 1.0f, normalize_scale, normalize_offset });
+
+        // 2. Apply gamma curve (normalization fused in).
+        outputs.write("2_gamma", hdr_snapshot, OutputKind::Diagnostic, OutputTransform::gammaCurve(1 / 2.2f, normalize_scale, normalize_offset));
+
+        // 2b. Apply gamma to the original image.
+        outputs.write("2_gamma_orig", hdr_snapshot, OutputKind::Diagnostic, OutputTransform::gammaCurve(1 / 2.2f));
+    }
+
+    // Tone mapping parameters of the run, by default filter_size 27, space_sigma 27 / 6.4, range_sigma 1, base_scale 0.15, output_gain 0.5.
+    const DurandParams& params = config.durand;
+    // With auto_contrast base_scale and output_gain come from the statistics of the base layer,
+    // collected by the filter (the fused paths of the GPU, schedules and line buffers have none).
+    AutoContrast auto_contrast(params, planar_tmo ? hdr_planes.X.width : padded_tmo ? hdr_padded.width : hdr_image.width,
+        planar_tmo ? hdr_planes.X.height : padded_tmo ? hdr_padded.height : hdr_image.height);
+    const auto report_contrast = [&](const DurandParams& resolved) {
+        if (params.auto_contrast) {
+            std::cout << "auto_contrast: base_scale " << resolved.base_scale << ", output_gain " << resolved.output_gain << std::endl;
+        }
+        return resolved;
+    };
+    ImageRGB tmo_rgb;
+    // The result as the XYZ target of the edit when the planar path hands it on (planar_target).
+    ImageXYZ tmo_XYZ;
+    if (tone_map_band_rows > 0) {
+        // Steps 3 to 7 band by band, same result with the exact engines (see toneMapDurandInBands()).
+        tmo_rgb = profileStage("toneMapDurandInBands", 0, [&] { return toneMapDurandInBands(config.hdr_input, tone_map_band_rows, params); });
+    } else if (planar_tmo) {
+        // Steps 3 to 7 on RGB planes, same result (see toneMapDurand()). As the target of the edit the
+        // result stays planar: composed straight into XYZ, or converted in place after 7_tmo_rgb.
+        const auto log_lum_H = profileStage("durandLogLuminancePlanar", hdr_pixels, [&] { return durandLogLuminancePlanar(hdr_planes, params); });
+        const auto base_image
+            = bilateralFilterCached(result_cache, log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+        const auto compose_params = report_contrast(auto_contrast.resolve());
+        const bool compose_xyz = planar_target && !outputs.wanted("7_tmo_rgb", OutputKind::Final);
+        auto tmo_planes = profileStage("durandComposePlanar", hdr_pixels, [&] {
+            return durandComposePlanar(hdr_planes, log_lum_H, base_image, compose_params, compose_xyz ? RGB_TO_XYZ_AFFINE : ColorAffine::identity());
+        });
+        hdr_planes = {};
+        if (!planar_target) {
+            tmo_rgb = profileStage("interleave tmo_planes", hdr_pixels, [&] { return imagePlane3ToVec3Simd(tmo_planes); });
+        } else {
+            if (!compose_xyz) {
+                outputs.write("7_tmo_rgb", [&] { return imagePlane3ToVec3Simd(tmo_planes); }, OutputKind::Final);
+                profileStage("rgbToXYZ", hdr_pixels, [&] { transformPlanes(tmo_planes, RGB_TO_XYZ_AFFINE); });
+            }
+            tmo_XYZ = std::move(tmo_planes);
+        }
+    } else if (padded_tmo) {
+        // Steps 3 to 7 on padded pixels, the luminance of the input computed at decode (see toneMapDurand()).
+        const auto log_lum_H = profileStage("durandLogLuminancePadded", hdr_pixels, [&] { return durandLogLuminancePadded(hdr_padded, params); });
+        const auto base_image
+            = bilateralFilterCached(result_cache, log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+        const auto compose_params = report_contrast(auto_contrast.resolve());
+        const auto tmo_padded = profileStage("durandComposePadded", hdr_pixels, [&] { return durandComposePadded(hdr_padded, log_lum_H, base_image, compose_params); });
+        hdr_padded = {};
+        tmo_rgb = profileStage("unpad tmo_padded", hdr_pixels, [&] { return unpadRgb(tmo_padded); });
+    } else if (params.tone_operator != ToneMapOperator::Durand) {
+        // Steps 3 to 7 with an operator that has no base and detail layers.
+        tmo_rgb = profileStage("toneMap", hdr_pixels, [&] { return toneMap(hdr_image, params); });
+    } else if (wantsDurandLayers(outputs)) {
+        // 3. Get luminance.
+        auto hdr_luminance = decoded_hdr.luminance ? std::move(*decoded_hdr.luminance)
+                                                   : profileStage("rgbToLuminance", hdr_pixels, [&] { return rgbToLuminance(hdr_image); });
+        outputs.write("3a_luminance", hdr_luminance);
+        // [Provided] Compute Logarithm of the luminance
+        auto log_lum_H = decoded_hdr.log_luminance ? std::move(*decoded_hdr.log_luminance)
+                                                   : profileStage("logImage", hdr_pixels, [&] { return logImage(hdr_luminance); });
+        outputs.write("3b_log_luminance_H", [&] { return normalizeFloatImage(log_lum_H); });
+        // The input and its luminance wait for step 7, compressed with compress_idle (the color guide reads the input).
+        IdleImage idle_hdr(hdr_image, config.compress_idle && !params.color_guide);
+        IdleImage idle_luminance(hdr_luminance, config.compress_idle && !params.color_guide);
+
+        // 4. Apply bilateral filter (joint with the color guide if selected).
+        auto base_image = params.color_guide
+            ? durandBaseLayer(hdr_image, log_lum_H, params, auto_contrast.stats())
+            : bilateralFilterCached(result_cache, log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+        outputs.write("4_base_layer", [&] { return normalizeFloatImage(base_image); });
+        const auto compose_params = report_contrast(auto_contrast.resolve());
+
+        if (config.kernel_team) {
+            // Steps 5 to 7 in one parallel region: every thread computes the same rows of the
+            // three layers, between barriers instead of joins (see runKernelTeam()).
+            idle_hdr.restore();
+            idle_luminance.restore();
+            auto detail_image = ImageFloat::uninitialized(base_image.width, base_image.height);
+            auto tmo_luminance = ImageFloat::uninitialized(base_image.width, base_image.height);
+            tmo_rgb = ImageRGB::uninitialized(hdr_image.width, hdr_image.height);
+            profileStage("durandLayersInTeam", hdr_pixels, [&] {
+                runKernelTeam(kernelThreads(hdr_image, KernelCost::Medium), [&](const KernelTeam&) {
+                    getDetailImage(log_lum_H, base_image, detail_image);
+                    applyDurandToneMappingOperator(base_image, detail_image, compose_params.base_scale, compose_params.output_gain, tmo_luminance);
+                    rescaleRgbByLuminance(hdr_image, hdr_luminance, tmo_luminance, params.saturation, tmo_rgb);
+                });
+            });
+            outputs.write("5_detail_layer", [&] { return normalizeFloatImage(detail_image); });
+            outputs.write("6_tmo_luminance", tmo_luminance);
+        } else {
+            // [Provided] Get Detail image.
+            auto detail_image = profileStage("getDetailImage", hdr_pixels, [&] { return getDetailImage(log_lum_H, base_image); });
+            outputs.write("5_detail_layer", [&] { return normalizeFloatImage(detail_image); });
+
+            // 6. Get new intensity after contrast reduction.
+            auto tmo_luminance = profileStage("applyDurandToneMappingOperator", hdr_pixels,
+                [&] { return applyDurandToneMappingOperator(base_image, detail_image, compose_params.base_scale, compose_params.output_gain); });
+            outputs.write("6_tmo_luminance", tmo_luminance);
+
+            // 7. Convert back to RGB.
+            idle_hdr.restore();
+            idle_luminance.restore();
+            tmo_rgb = profileStage("rescaleRgbByLuminance", hdr_pixels, [&] { return rescaleRgbByLuminance(hdr_image, hdr_luminance, tmo_luminance, params.saturation); });
+        }
+    } else if (config.gpu && !params.color_guide) {
+        // Steps 3 to 7 on the GPU, only the result is downloaded (brute-force filter).
+        tmo_rgb = toneMapDurandGpu(hdr_image, params);
+    } else if (config.scheduled && !params.color_guide) {
+        // Steps 3 to 7 as kernels with the schedules of the target (brute-force filter).
+        currentSchedules() = config.schedules;
+        tmo_rgb = profileStage("toneMapDurandScheduled", hdr_pixels, [&] { return toneMapDurandScheduled(hdr_image, params); });
+    } else if (config.line_buffer && !params.color_guide) {
+        // Steps 3 to 7 streamed row by row, only a few rows of each intermediate exist (brute-force filter).
+        tmo_rgb = profileStage("toneMapDurandLineBuffered", hdr_pixels, [&] { return toneMapDurandLineBuffered(hdr_image, params); });
+    } else {
+        // Steps 3 to 7 without the intermediate images, same result (see toneMapDurand()). The
+        // log-luminance is hashed for the cache key while it is written.
+        const bool decoded_log_luminance = decoded_hdr.log_luminance.has_value();
+        ImageHashAccumulator log_lum_hash(hdr_image.width, hdr_image.height, sizeof(float));
+        const auto log_lum_H = decoded_log_luminance
+            ? std::move(*decoded_hdr.log_luminance)
+            : profileStage("durandLogLuminance", hdr_pixels, [&] { return durandLogLuminance(hdr_image, params, &log_lum_hash); });
+        // With compress_idle the input waits for the base layer compressed, the last pass decompresses it band by band.
+        std::optional<CompressedImage<glm::vec3>> idle_hdr;
+        if (config.compress_idle && !params.color_guide) {
+            idle_hdr = profileStage("compress hdr_image", hdr_pixels, [&] { return CompressedImage<glm::vec3>(hdr_image); });
+            hdr_image = ImageRGB();
+        }
+        const auto base_image = params.color_guide
+            ? durandBaseLayer(hdr_image, log_lum_H, params, auto_contrast.stats())
+            : bilateralFilterCached(result_cache, log_lum_H, decoded_log_luminance ? hashImage<float>(log_lum_H) : log_lum_hash.finish(), params.filter_size,
+                params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+        const auto compose_params = report_contrast(auto_contrast.resolve());
+        tmo_rgb = profileStage("durandCompose", hdr_pixels, [&] {
+            return idle_hdr ? durandComposeCompressed(*idle_hdr, log_lum_H, base_image, compose_params)
+                            : durandCompose(hdr_image, log_lum_H, base_image, compose_params);
+        });
+    }
+    if (params.look && params.tone_operator == ToneMapOperator::Durand && !planar_tmo && !padded_tmo) {
+        // The other operators ran through toneMap(), the planar and padded paths through durandComposePlanar() and
+        // durandComposePadded(), which grade.
+        profileStage("applyLook", hdr_pixels, [&] { applyLook(tmo_rgb, params.look); });
+    }
+    if (!planar_target) {
+        outputs.write("7_tmo_rgb", tmo_rgb, OutputKind::Final);
+    }
+    if (!config.share_tmo.empty()) {
+        // Handed to a Poisson process as it is, without encoding, see shared_image.h.
+        profileStage("share tmo_rgb", hdr_pixels, [&] { tmo_rgb.writeToFile("shm:" + config.share_tmo); });
+        std::cout << SharedImageDescriptor { config.share_tmo, tmo_rgb.width, tmo_rgb.height, 3 }.toString() << std::endl;
+    }
+    // The input is not needed by Part II.
+    hdr_image = ImageRGB();
 
     #pragma endregion HDR TMO
 
@@ -84,52 +809,243 @@ int main()
     /// Part II: Poisson Image Editing
     //////////////////////////////////////////////////////////////////////////////
 
+    StageProfiler::instance().setPhase("poisson edit");
     // [Provided]  Read Mask and source images
-    auto target_image = tmo_rgb;
-    auto source_image = ImageRGB(dataDirPath / "cat.png");
-    auto source_mask = imageRgbToFloat(ImageRGB(dataDirPath / "cat_mask.png"));
-
-    // [Optional] Alternative test inputs (make your own!)
-    /*auto target_image = ImageRGB(dataDirPath / "plane_target.jpg");
-    auto source_image = ImageRGB(dataDirPath / "plane_src.jpg");
-    auto source_mask = imageRgbToFloat(ImageRGB(dataDirPath / "plane_mask.png"));*/
-
-    // [Provided]  Convert colorspace RGB->XYZ
-    auto target_image_XYZ = rgbToXYZ(target_image);
-    auto source_image_XYZ = rgbToXYZ(source_image);
-    //auto target_image_XYZ = imageVec3ToPlane3(target_image); // use this to by-pass the RGB->XYZ conversion and calculate in RGB space. The final results might often be similar.
-    //auto source_image_XYZ = imageVec3ToPlane3(source_image);
-    imagePlane3ToVec3(target_image_XYZ).writeToFile(outDirPath / "7b_target_xyz.png");
-    imagePlane3ToVec3(source_image_XYZ).writeToFile(outDirPath / "7c_source_xyz.png");
-
-    // 8.  Compute gradients of source.
-    auto source_gradients_XYZ = getGradientsXYZ(source_image_XYZ);
-    saveGradients(source_gradients_XYZ, "8a_source_gradients");
-
-    // 8.  Compute gradients of target.
-    auto target_gradients_XYZ = getGradientsXYZ(target_image_XYZ);
-    saveGradients(target_gradients_XYZ, "8b_target_gradients");
-
-    // 9.  Merge the two gradient images following the mask.
-    auto merged_gradients_XYZ = copySourceGradientsToTargetXYZ(source_gradients_XYZ, target_gradients_XYZ, source_mask);
-    saveGradients(merged_gradients_XYZ, "9_merged_gradients");
-    //merged_gradients_XYZ = target_gradients_XYZ;
-
-    // 9.  Compute the divergence.
-    auto divergence_XYZ = getDivergenceXYZ(merged_gradients_XYZ);
-    normalizeRGBImage(imagePlane3ToVec3(divergence_XYZ)).writeToFile(outDirPath / "10_divergence.png");
-    
-    // 11. Solve Poisson equations per channel (XYZ)
-    auto edit_result_XYZ = solvePoissonXYZ(target_image_XYZ, divergence_XYZ, 2000);
-    imagePlane3ToVec3(edit_result_XYZ).writeToFile(outDirPath / "11_edit_result_XYZ.png");
-
-    // [Provided] 12. XYZ to RGB
-    auto edit_result_rgb = xyzToRGB(edit_result_XYZ);
-    edit_result_rgb.writeToFile(outDirPath / "12_edit_result_rgb.png");
+    // The tone-mapped image is only used as the target, if at all.
+    auto target_image = ldr_edit ? ImageRGB() : config.target_input.empty() ? std::move(tmo_rgb) : edit_loads.target.get();
+    tmo_rgb = ImageRGB();
+    auto source_image = ldr_edit ? ImageRGB() : edit_loads.source.get();
+    auto source_mask = edit_loads.mask.get();
+    const uint64_t target_pixels = planar_target ? tmo_XYZ.X.data.size() : target_image.data.size();
+    const uint64_t source_pixels = source_image.data.size();
+
+    // [Optional] Alternative test inputs (make your own!):
+    // --target data/plane_target.jpg --source data/plane_src.jpg --mask data/plane_mask.png
+
+    // With the GPU backend and none of the XYZ diagnostics wanted, the whole edit stays on the device.
+    const bool gpu_edit = config.gpu && config.layers.empty() && !outputs.wantsAny("7b") && !outputs.wantsAny("7c") && !outputs.wantsAny("8") && !outputs.wantsAny("9")
+        && !outputs.wantsAny("10") && !outputs.wantsAny("11");
+    ImageRGB edit_result_rgb;
+    if (config.composite == CompositeMode::Poisson && config.edit_preview != CompositeMode::Poisson && !ldr_edit) {
+        // A blend in milliseconds to look at while the solve runs.
+        outputs.write("12_edit_preview", [&] {
+            return profileStage("editPreview", target_pixels,
+                [&] { return compositeBlend(config.edit_preview, source_image, target_image, source_mask, 0, 0, config.feather_radius, config.blend_levels); });
+        });
+    }
+    if (config.composite != CompositeMode::Poisson) {
+        // Feathered or multiband blending of the source, no gradients and no solve.
+        edit_result_rgb = profileStage(config.composite == CompositeMode::Pyramid ? "laplacianPyramidBlend" : "featherBlend", target_pixels,
+            [&] { return compositeBlend(config.composite, source_image, target_image, source_mask, 0, 0, config.feather_radius, config.blend_levels); });
+    } else if (config.membrane_clone) {
+        // Seamless cloning without a linear system: the boundary differences are interpolated inward.
+        edit_result_rgb = profileStage("membraneClone", target_pixels, [&] { return MembraneClone(source_mask).apply(source_image, target_image); });
+    } else if (ldr_edit) {
+        // Integer planes and gradients up to the divergence, see ldr_native.h.
+        const auto plane_context = ExecutionContext::concurrent(std::clamp(config.plane_threads, 1, 3));
+        const auto edit_ldr = [&](auto& target_load, auto& source_load) {
+            const auto target_planes = target_load.get();
+            const auto source_planes = source_load.get();
+            return profileStage("poissonEditLdr", uint64_t(target_planes.width()) * uint64_t(target_planes.height()), [&] {
+                return poissonEditLdr(target_planes, source_planes, source_mask, config.poisson_iters, config.poisson_method, 0, 0, plane_context);
+            });
+        };
+        edit_result_rgb = ldr_loads.deep ? edit_ldr(ldr_loads.target16, ldr_loads.source16) : edit_ldr(ldr_loads.target8, ldr_loads.source8);
+    } else if (gpu_edit) {
+        edit_result_rgb = poissonEditGpu(target_image, source_image, source_mask, config.poisson_iters, config.poisson_method);
+    } else {
+        // The XYZ channels of the steps below run plane_threads at a time, see ExecutionContext.
+        const auto plane_context = ExecutionContext::concurrent(std::clamp(config.plane_threads, 1, 3));
+        // The source and the target branch are independent, they run side by side as a task graph.
+        TaskGraph edit_graph;
+        ImageXYZ target_image_XYZ, source_image_XYZ;
+        ImageXYZGradient source_gradients_XYZ, target_gradients_XYZ;
+        // The gradient images are only stored for their diagnostics, otherwise the divergence is fused.
+        const bool gradient_outputs = outputs.wantsAny("8") || outputs.wantsAny("9");
+        // Steps 7 to 9 in one pass when the source planes are not needed afterwards.
+        // The planar target is in XYZ already, only the source is converted.
+        const bool fused_front_end = canFuseEditFrontEnd(config, outputs) && !planar_target;
+
+        if (!fused_front_end) {
+            // [Provided]  Convert colorspace RGB->XYZ (SIMD versions of the helpers.h conversions, same results)
+            const auto target_XYZ_node = edit_graph.add([&] {
+                target_image_XYZ = planar_target ? std::move(tmo_XYZ) : profileStage("rgbToXYZ", target_pixels, [&] { return rgbToXYZSimd(target_image); });
+                target_image = ImageRGB();
+                //target_image_XYZ = imageVec3ToPlane3(target_image); // use this to by-pass the RGB->XYZ conversion and calculate in RGB space. The final results might often be similar.
+                outputs.write("7b_target_xyz", [&] { return imagePlane3ToVec3Simd(target_image_XYZ); });
+            });
+            const auto source_XYZ_node = edit_graph.add([&] {
+                source_image_XYZ = profileStage("rgbToXYZ", source_pixels, [&] { return rgbToXYZSimd(source_image); });
+                source_image = ImageRGB();
+                //source_image_XYZ = imageVec3ToPlane3(source_image);
+                outputs.write("7c_source_xyz", [&] { return imagePlane3ToVec3Simd(source_image_XYZ); });
+            });
+
+            if (gradient_outputs) {
+                // 8.  Compute gradients of source.
+                edit_graph.add([&] {
+                    source_gradients_XYZ = profileStage("getGradientsXYZ", source_pixels, [&] { return getGradientsXYZCached(result_cache, source_image_XYZ, plane_context); });
+                    saveGradients(outputs, source_gradients_XYZ, "8a_source_gradients");
+                }, { source_XYZ_node });
+
+                // 8.  Compute gradients of target.
+                edit_graph.add([&] {
+                    target_gradients_XYZ = profileStage("getGradientsXYZ", target_pixels, [&] { return getGradientsXYZCached(result_cache, target_image_XYZ, plane_context); });
+                    saveGradients(outputs, target_gradients_XYZ, "8b_target_gradients");
+                }, { target_XYZ_node });
+            }
+
+            edit_graph.run();
+        }
+
+        // Further sources: all layers are merged into one gradient field, later layers on top.
+        std::vector<PoissonLayer> layers;
+        if (!config.layers.empty()) {
+            layers.push_back({ std::move(source_image_XYZ), source_mask, 0, 0 });
+            for (size_t i = 0; i < config.layers.size(); i++) {
+                const auto layer_source = layer_loads[i].first.get();
+                auto layer_mask = layer_loads[i].second.get();
+                if (layer_mask.width() != layer_source.width || layer_mask.height() != layer_source.height) {
+                    std::cerr << "Mask " << config.layers[i].mask << " does not match the size of its source." << std::endl;
+                    throw std::exception();
+                }
+                layers.push_back({ rgbToXYZSimd(layer_source), std::move(layer_mask), config.layers[i].offset_x, config.layers[i].offset_y });
+            }
+        }
+
+        ImageXYZ divergence_XYZ;
+        if (fused_front_end) {
+            // Steps 7 to 9: the source planes are never stored, the target planes are written in the same pass.
+            divergence_XYZ = profileStage("getMergedDivergenceRgb", target_pixels, [&] { return getMergedDivergenceRgb(source_image, target_image, source_mask, target_image_XYZ); });
+            source_image = ImageRGB();
+            target_image = ImageRGB();
+            outputs.write("7b_target_xyz", [&] { return imagePlane3ToVec3Simd(target_image_XYZ); });
+        } else if (!layers.empty()) {
+            divergence_XYZ = profileStage("getLayeredDivergenceXYZ", target_pixels, [&] { return getLayeredDivergenceXYZ(layers, target_image_XYZ); });
+        } else if (gradient_outputs) {
+            // 9.  Merge the two gradient images following the mask.
+            auto merged_gradients_XYZ = profileStage("copySourceGradientsToTargetXYZ", target_pixels,
+                [&] { return copySourceGradientsToTargetXYZ(source_gradients_XYZ, target_gradients_XYZ, source_mask, 0, 0, plane_context); });
+            saveGradients(outputs, merged_gradients_XYZ, "9_merged_gradients");
+            //merged_gradients_XYZ = target_gradients_XYZ;
+            source_gradients_XYZ = {};
+            target_gradients_XYZ = {};
+
+            // 9.  Compute the divergence.
+            divergence_XYZ = profileStage("getDivergenceXYZ", target_pixels, [&] { return getDivergenceXYZ(merged_gradients_XYZ, plane_context); });
+        } else {
+            // Steps 8 and 9 without storing any gradients, same result.
+            divergence_XYZ = profileStage("getMergedDivergenceXYZ", target_pixels, [&] { return getMergedDivergenceXYZ(source_image_XYZ, target_image_XYZ, source_mask); });
+        }
+        outputs.write("10_divergence", [&] {
+            // Normalized while the planes are interleaved, one pass (see color_pipeline.h).
+            glm::vec2 min_max { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+            forEachPlane([&](const ImageFloat& plane) {
+                const auto [plane_min, plane_max] = std::minmax_element(plane.data.begin(), plane.data.end());
+                min_max = { std::min(min_max.x, *plane_min), std::max(min_max.y, *plane_max) };
+            }, divergence_XYZ);
+            return ColorPipeline().normalize(min_max).apply(divergence_XYZ);
+        });
+        // The source is only pasted again by the quadtree solve and the chroma transfer.
+        if (!config.poisson_quadtree && config.poisson_chroma != PoissonChroma::Transfer) {
+            source_image_XYZ = {};
+        }
+
+        // 11. Solve Poisson equations per channel (XYZ)
+        ImageXYZ edit_result_XYZ;
+        if (config.gpu) {
+            edit_result_XYZ = solvePoissonXYZGpu(target_image_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method);
+        } else if (config.poisson_quadtree) {
+            // Only the offset from the pasted composite is solved, on a grid that is fine near the seams only.
+            edit_result_XYZ = profileStage("solvePoissonQuadtreeXYZ", target_pixels,
+                [&] {
+                    const auto composite = layers.empty() ? pasteMaskedXYZ(source_image_XYZ, target_image_XYZ, source_mask) : pasteLayersXYZ(layers, target_image_XYZ);
+                    return solvePoissonQuadtreeXYZ(composite, divergence_XYZ);
+                });
+        } else if (config.poisson_prepared) {
+            // The factorization of the mask is shared by later edits through the same mask.
+            edit_result_XYZ = profileStage("solvePoissonPreparedXYZ", target_pixels, [&] { return solvePoissonPreparedXYZ(target_image_XYZ, divergence_XYZ, source_mask); });
+            const auto prepared = preparedPoissonMask(source_mask, target_image_XYZ.X.width, target_image_XYZ.X.height);
+            std::cout << "Poisson solve: " << prepared->unknowns() << " unknowns, factor of " << prepared->factorNonzeros() << " nonzeros." << std::endl;
+        } else if (config.poisson_schwarz) {
+            edit_result_XYZ = profileStage("solvePoissonSchwarzXYZ", target_pixels, [&] { return solvePoissonSchwarzXYZ(target_image_XYZ, divergence_XYZ); });
+        } else if (config.poisson_chroma != PoissonChroma::Full) {
+            // Only Y is solved in full.
+            edit_result_XYZ = profileStage("solvePoissonLuminanceXYZ", target_pixels,
+                [&] {
+                    std::optional<ImageXYZ> composite;
+                    if (config.poisson_chroma == PoissonChroma::Transfer) {
+                        composite = layers.empty() ? pasteMaskedXYZ(source_image_XYZ, target_image_XYZ, source_mask) : pasteLayersXYZ(layers, target_image_XYZ);
+                    }
+                    return solvePoissonLuminanceXYZ(target_image_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method, config.poisson_chroma,
+                        composite ? &*composite : nullptr, plane_context);
+                });
+        } else if (latency_plan && latency_plan->poisson_strategy == PoissonStrategy::Multigrid) {
+            edit_result_XYZ = profileStage("solvePoissonMultigridXYZ", target_pixels, [&] { return solvePoissonMultigridXYZ(target_image_XYZ, divergence_XYZ); });
+        } else if (latency_plan) {
+            // Stopped at the deadline of the budget with the current estimate, which is not cached.
+            PoissonStats stats;
+            PoissonControl control;
+            control.stats = &stats;
+            control.deadline = run_start
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(latency_plan->budget_seconds - latency_plan->finish_seconds));
+            edit_result_XYZ = solvePoissonPlanesCheckpointed(target_image_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method, 0.0f, control,
+                config.poisson_checkpoint);
+            std::cout << "Poisson solve: " << stats.iterations << " of " << config.poisson_iters << " iterations, relative residual " << stats.relative_residual
+                      << (stats.deadline_reached ? ", stopped at the deadline." : ".") << std::endl;
+        } else if (config.poisson_checkpoint.enabled()) {
+            // Saved in segments and resumed instead of cached.
+            edit_result_XYZ = solvePoissonPlanesCheckpointed(target_image_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method, 0.0f, {},
+                config.poisson_checkpoint);
+        } else {
+            edit_result_XYZ = solvePoissonXYZCached(result_cache, target_image_XYZ, divergence_XYZ, config.poisson_iters, config.poisson_method, plane_context);
+        }
+        divergence_XYZ = {};
+        target_image_XYZ = {};
+        //auto edit_result_XYZ = solvePoissonMaskedXYZ(target_image_XYZ, divergence_XYZ, source_mask, 2000); // solve only inside the dilated mask, the rest of the target is kept.
+        outputs.write("11_edit_result_XYZ", [&] { return imagePlane3ToVec3Simd(edit_result_XYZ); });
+
+        // [Provided] 12. XYZ to RGB
+        edit_result_rgb = profileStage("xyzToRGB", target_pixels, [&] { return xyzToRGBSimd(edit_result_XYZ); });
+    }
+
+    outputs.write("12_edit_result_rgb", edit_result_rgb, OutputKind::Final);
 
 
     #pragma endregion Poisson
 
+    // Wait for the outputs, so the stats include the buffers released by the writers.
+    StageProfiler::instance().setPhase("outputs");
+    profileStage("write outputs", 0, [&] { output_queue.flush(); });
+    if (config.huge_pages) {
+        const auto page_stats = huge_page_resource.getStats();
+        std::cout << "Large buffers: " << page_stats.huge_pages << " on huge pages, " << page_stats.regular_pages << " on transparent huge pages." << std::endl;
+    }
+
+    if (config.profile || config.profile_memory) {
+        const auto pool_stats = image_pool.getStats();
+        std::cout << "Image buffers: " << pool_stats.hits << " recycled, " << pool_stats.misses << " allocated." << std::endl;
+    }
+    if (config.profile) {
+        StageProfiler::instance().printSummary(std::cout);
+        TileBalanceReport::instance().print(std::cout);
+        RingOccupancyReport::instance().print(std::cout);
+    }
+    if (config.profile_memory) {
+        StageProfiler::instance().printMemoryTimeline(std::cout);
+    }
+    if (!config.profile_json.empty() && !StageProfiler::instance().writeJson(config.profile_json)) {
+        std::cerr << "Failed to write " << config.profile_json << std::endl;
+    }
+    if (!config.trace.empty() && !StageProfiler::instance().writeChromeTrace(config.trace)) {
+        std::cerr << "Failed to write " << config.trace << std::endl;
+    }
+
+    if (latency_plan) {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+        std::cout << "Latency: " << std::fixed << std::setprecision(0) << seconds * 1e3 << " ms of " << config.latency_budget_ms << " ms." << std::defaultfloat << std::endl;
+    }
+
     std::cout << "All done!" << std::endl;
     return 0;
 }
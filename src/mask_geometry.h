@@ -0,0 +1,302 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "binary_mask.h"
+#include "content_hash.h"
+#include "execution.h"
+#include "helpers.h"
+
+/*
+ * Data derived from the geometry of a mask.
+ *
+ * Feathered blending needs the distance of every mask pixel to the outside, the blends and the
+ * edit session the bounding box, the Poisson paths the boundary pixels, where gradients cross
+ * from the mask to the outside. A MaskGeometry computes them once per mask:
+ *
+ *  - bounds() and count(), reduced over rows in one parallel pass;
+ *  - boundary(), the mask pixels with a 4-neighbour outside of the mask (pixels beyond the edges
+ *    of the mask count as outside), as a BinaryMask built with word operations 64 pixels at a
+ *    time (see maskEdgeBits()), and boundaryPixels(), its offsets in row-major order;
+ *  - distanceSquared(), the exact squared Euclidean distance to the nearest outside pixel over
+ *    bounds(), computed on first use. The transform is separable: the horizontal distances of
+ *    every row come from two linear scans, then the lower envelope of parabolas (Felzenszwalb
+ *    and Huttenlocher) over every column gives the 2D distance. Both passes are parallel over
+ *    rows / columns.
+ *
+ * maskGeometry() keeps the geometry of the last MASK_GEOMETRY_CACHE_ENTRIES masks by a
+ * ContentHash of their bits, so the three planes of an edit, the blends of a preview and
+ * repeated jobs with the same mask share one.
+ */
+
+#pragma region Mask geometry
+
+/// <summary>
+/// Number of masks whose geometry maskGeometry() keeps.
+/// </summary>
+constexpr size_t MASK_GEOMETRY_CACHE_ENTRIES = 8;
+
+/// <summary>
+/// Pixels of one word of a mask row and where they meet the outside.
+/// </summary>
+struct MaskEdgeBits {
+    uint64_t inside = 0;
+    // Pixels whose left or right neighbour differs from them.
+    uint64_t cut_x = 0;
+    // Pixels whose neighbour above or below differs from them.
+    uint64_t cut_y = 0;
+};
+
+/// <summary>
+/// The 64 pixels of word i of row y with the neighbours compared; neighbours beyond the mask
+/// count as clear.
+/// </summary>
+inline MaskEdgeBits maskEdgeBits(const BinaryMask& mask, const int i, const int y)
+{
+    const int words = mask.wordsPerRow();
+    const uint64_t* row = mask.row(y);
+    const uint64_t left = (row[i] << 1) | (i > 0 ? row[i - 1] >> 63 : 0);
+    const uint64_t right = (row[i] >> 1) | (i + 1 < words ? row[i + 1] << 63 : 0);
+    const uint64_t above = y > 0 ? mask.row(y - 1)[i] : 0;
+    const uint64_t below = y + 1 < mask.height() ? mask.row(y + 1)[i] : 0;
+    return { row[i], (row[i] ^ left) | (row[i] ^ right), (row[i] ^ above) | (row[i] ^ below) };
+}
+
+/// <summary>
+/// Squared Euclidean distance of every mask pixel in a region to the nearest pixel outside the
+/// mask, 0 outside. Pixels beyond the region count as outside, so a region covering the mask
+/// (e.g. its bounds()) gives the exact distances, see above.
+/// </summary>
+/// <param name="mask">mask</param>
+/// <param name="region">region of the mask the distances are computed for</param>
+/// <returns>squared distances at the size of the region</returns>
+inline ImageFloat maskDistanceSquared(const BinaryMask& mask, const PixelRect& region)
+{
+    const int width = region.x1 - region.x0, height = region.y1 - region.y0;
+    auto distance = ImageFloat::uninitialized(width, height);
+
+    // Horizontal distance to the nearest outside pixel of the row, squared.
+#pragma omp parallel for num_threads(kernelThreads(distance, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        float* row = distance.data.data() + size_t(y) * size_t(width);
+        int last_outside = -1;
+        for (int x = 0; x < width; x++) {
+            if (!mask(x + region.x0, y + region.y0)) {
+                last_outside = x;
+            }
+            row[x] = float(x - last_outside);
+        }
+        int next_outside = width;
+        for (int x = width - 1; x >= 0; x--) {
+            if (row[x] == 0.0f) {
+                next_outside = x;
+            }
+            const float d = std::min(row[x], float(next_outside - x));
+            row[x] = d * d;
+        }
+    }
+
+    // Lower envelope of the parabolas (y - q)^2 + f(q) per column, with f = 0 on the rows -1 and
+    // height. Columns go in blocks, gathered and scattered a row segment at a time.
+    constexpr int block = 16;
+    const int num_blocks = (width + block - 1) / block;
+#pragma omp parallel num_threads(kernelThreads(distance, KernelCost::Medium))
+    {
+        const int n = height + 2;
+        std::vector<float> columns(size_t(block) * size_t(n)), envelopes(size_t(block) * size_t(height)), z(size_t(n) + 1);
+        std::vector<int> v(n);
+#pragma omp for
+        for (int b = 0; b < num_blocks; b++) {
+            const int x0 = b * block, count = std::min(block, width - x0);
+            for (int y = 0; y < height; y++) {
+                const float* row = distance.data.data() + size_t(y) * size_t(width) + x0;
+                for (int i = 0; i < count; i++) {
+                    columns[size_t(i) * size_t(n) + size_t(y) + 1] = row[i];
+                }
+            }
+            for (int i = 0; i < count; i++) {
+                float* f = columns.data() + size_t(i) * size_t(n);
+                f[0] = f[n - 1] = 0.0f;
+                // Where the parabolas of the rows q and p intersect.
+                const auto intersection = [f](const int q, const int p) {
+                    return ((f[q] + float(q) * float(q)) - (f[p] + float(p) * float(p))) / float(2 * (q - p));
+                };
+                int k = 0;
+                v[0] = 0;
+                z[0] = -INFINITY;
+                z[1] = INFINITY;
+                for (int q = 1; q < n; q++) {
+                    // z[0] = -inf ends the search at the latest with the first parabola.
+                    float s = intersection(q, v[k]);
+                    while (s <= z[k]) {
+                        k--;
+                        s = intersection(q, v[k]);
+                    }
+                    k++;
+                    v[k] = q;
+                    z[k] = s;
+                    z[k + 1] = INFINITY;
+                }
+                float* envelope = envelopes.data() + size_t(i) * size_t(height);
+                k = 0;
+                for (int q = 1; q + 1 < n; q++) {
+                    while (z[k + 1] < float(q)) {
+                        k++;
+                    }
+                    const float d = float(q - v[k]);
+                    envelope[q - 1] = d * d + f[v[k]];
+                }
+            }
+            for (int y = 0; y < height; y++) {
+                float* row = distance.data.data() + size_t(y) * size_t(width) + x0;
+                for (int i = 0; i < count; i++) {
+                    row[i] = envelopes[size_t(i) * size_t(height) + size_t(y)];
+                }
+            }
+        }
+    }
+    return distance;
+}
+
+/// <summary>
+/// Bounding box, boundary and distance transform of a mask, see above.
+/// </summary>
+class MaskGeometry {
+public:
+    explicit MaskGeometry(const BinaryMask& mask)
+        : m_mask(mask)
+        , m_boundary(mask.width(), mask.height())
+    {
+        const int width = mask.width(), height = mask.height(), words = mask.wordsPerRow();
+        // Per row: extent of the set pixels, set and boundary pixels.
+        std::vector<PixelRect> row_bounds(size_t(height), PixelRect { width, 0, 0, 0 });
+        std::vector<size_t> row_counts(size_t(height), 0), row_boundary(size_t(height) + 1, 0);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            if (mask.rowEmpty(y)) {
+                continue;
+            }
+            uint64_t* boundary = m_boundary.row(y);
+            for (int i = 0; i < words; i++) {
+                const auto edges = maskEdgeBits(mask, i, y);
+                if (edges.inside == 0) {
+                    continue;
+                }
+                boundary[i] = edges.inside & (edges.cut_x | edges.cut_y);
+                row_bounds[y].x0 = std::min(row_bounds[y].x0, i * 64 + std::countr_zero(edges.inside));
+                row_bounds[y].x1 = std::max(row_bounds[y].x1, i * 64 + 64 - std::countl_zero(edges.inside));
+                row_counts[y] += size_t(std::popcount(edges.inside));
+                row_boundary[y + 1] += size_t(std::popcount(boundary[i]));
+            }
+        }
+
+        m_bounds = PixelRect { width, height, 0, 0 };
+        for (int y = 0; y < height; y++) {
+            m_count += row_counts[y];
+            row_boundary[y + 1] += row_boundary[y];
+            if (row_bounds[y].x0 < row_bounds[y].x1) {
+                m_bounds.x0 = std::min(m_bounds.x0, row_bounds[y].x0);
+                m_bounds.x1 = std::max(m_bounds.x1, row_bounds[y].x1);
+                m_bounds.y0 = std::min(m_bounds.y0, y);
+                m_bounds.y1 = y + 1;
+            }
+        }
+
+        // Offsets of the boundary pixels, every row written at its prefix sum.
+        m_boundary_pixels.resize(row_boundary[size_t(height)]);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_boundary_pixels.size()), KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            size_t next = row_boundary[y];
+            const uint64_t* boundary = m_boundary.row(y);
+            for (int i = 0; i < words && next < row_boundary[y + 1]; i++) {
+                for (uint64_t bits = boundary[i]; bits != 0; bits &= bits - 1) {
+                    m_boundary_pixels[next++] = y * width + i * 64 + std::countr_zero(bits);
+                }
+            }
+        }
+    }
+
+    MaskGeometry(const MaskGeometry&) = delete;
+    MaskGeometry& operator=(const MaskGeometry&) = delete;
+
+    const BinaryMask& mask() const { return m_mask; }
+
+    /// <summary>
+    /// Bounding box of the set pixels (empty rectangle for an empty mask), same as BinaryMask::bounds().
+    /// </summary>
+    const PixelRect& bounds() const { return m_bounds; }
+
+    /// <summary>
+    /// Number of set pixels.
+    /// </summary>
+    size_t count() const { return m_count; }
+
+    /// <summary>
+    /// Set pixels with a 4-neighbour that is clear or beyond the mask.
+    /// </summary>
+    const BinaryMask& boundary() const { return m_boundary; }
+
+    /// <summary>
+    /// Offsets y * width + x of the boundary pixels in row-major order.
+    /// </summary>
+    const std::vector<int>& boundaryPixels() const { return m_boundary_pixels; }
+
+    /// <summary>
+    /// maskDistanceSquared() over bounds(), at the size of the bounds; computed on the first call.
+    /// </summary>
+    const ImageFloat& distanceSquared() const
+    {
+        std::call_once(m_distance_once, [&] { m_distance = maskDistanceSquared(m_mask, m_bounds); });
+        return m_distance;
+    }
+
+private:
+    BinaryMask m_mask;
+    BinaryMask m_boundary;
+    PixelRect m_bounds;
+    size_t m_count = 0;
+    std::vector<int> m_boundary_pixels;
+    mutable std::once_flag m_distance_once;
+    mutable ImageFloat m_distance;
+};
+
+/// <summary>
+/// Geometry of a mask, shared with earlier calls for the same mask, see above. Thread-safe; two
+/// threads that miss at once both compute it.
+/// </summary>
+inline std::shared_ptr<const MaskGeometry> maskGeometry(const BinaryMask& mask)
+{
+    static std::mutex mutex;
+    // Most recently used first.
+    static std::list<std::pair<uint64_t, std::shared_ptr<const MaskGeometry>>> entries;
+
+    const uint64_t key = ContentHash()
+                             .add(mask.width())
+                             .add(mask.height())
+                             .addBytes(mask.row(0), size_t(mask.wordsPerRow()) * size_t(mask.height()) * sizeof(uint64_t))
+                             .value();
+    {
+        const std::lock_guard lock(mutex);
+        const auto entry = std::find_if(entries.begin(), entries.end(), [key](const auto& cached) { return cached.first == key; });
+        if (entry != entries.end()) {
+            entries.splice(entries.begin(), entries, entry);
+            return entry->second;
+        }
+    }
+    auto geometry = std::make_shared<const MaskGeometry>(mask);
+    const std::lock_guard lock(mutex);
+    entries.emplace_front(key, geometry);
+    if (entries.size() > MASK_GEOMETRY_CACHE_ENTRIES) {
+        entries.pop_back();
+    }
+    return geometry;
+}
+
+#pragma endregion Mask geometry
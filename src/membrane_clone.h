@@ -0,0 +1,392 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "binary_mask.h"
+#include "execution.h"
+#include "helpers.h"
+
+/*
+ * Mean-value coordinate cloning (Farbman et al., "Coordinates for instant image cloning").
+ *
+ * Seamless cloning pastes source + m, where the membrane m is harmonic inside the mask and
+ * equals target - source on its boundary. Instead of solving for m, it is interpolated from the
+ * boundary differences with mean-value coordinates: m(x) = sum_i lambda_i(x) (target - source)(p_i)
+ * over the boundary pixels p_i. The coordinates only depend on the mask, so MembraneClone
+ * computes them once and every apply() (e.g. for each position while the source is dragged)
+ * costs one pass over the boundary plus one weighted sum per evaluation point and pixel.
+ *
+ * The boundary of each 4-connected mask component is its outer contour (Moore tracing); holes are
+ * filled by the membrane like the interior. Every evaluation point samples the contour
+ * hierarchically: it starts with coarse_segments segments and halves a segment while it is
+ * longer than boundary_ratio times its distance to the point, so the points see the nearby
+ * boundary pixel by pixel and distant parts through a few vertices, O(log boundary) per point.
+ * The membrane is evaluated on a lattice of spacing step and interpolated bilinearly inside
+ * lattice cells whose corners are inside the same component; pixels of the other cells (near the
+ * boundary) are evaluated individually.
+ */
+
+#pragma region Membrane clone
+
+/// <summary>
+/// Sampling parameters of MembraneClone.
+/// </summary>
+struct MembraneCloneParams {
+    // Spacing of the evaluated lattice, 1 evaluates every pixel.
+    int step = 4;
+    // A contour segment is split while it is longer than this times its distance to the point.
+    float boundary_ratio = 0.5f;
+    // Segments of the coarsest contour sampling.
+    int coarse_segments = 16;
+};
+
+/// <summary>
+/// Mean-value membrane of a mask, see above.
+/// </summary>
+class MembraneClone {
+public:
+    /// <param name="source_mask">mask of the pasted source, at the source size</param>
+    /// <param name="params">sampling parameters</param>
+    explicit MembraneClone(const BinaryMask& source_mask, const MembraneCloneParams& params = {})
+        : m_width(source_mask.width())
+        , m_height(source_mask.height())
+        , m_params(params)
+        , m_pixel_refs(size_t(m_width) * size_t(m_height), OUTSIDE)
+    {
+        m_params.step = std::max(m_params.step, 1);
+        const auto labels = labelComponents(source_mask);
+        traceContours(labels);
+        placeEvaluationPoints(labels);
+        computeWeights();
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    size_t boundarySize() const { return m_boundary.size(); }
+    size_t evaluationPoints() const { return m_points.size(); }
+
+    /// <summary>
+    /// Clones the source into the target with the membrane of the boundary differences.
+    /// </summary>
+    /// <param name="source">source image, at the size of the mask</param>
+    /// <param name="target">target image</param>
+    /// <param name="offset_x">target column of the source pixel (0, 0)</param>
+    /// <param name="offset_y">target row of the source pixel (0, 0)</param>
+    /// <returns>the target with the cloned source</returns>
+    template <typename T>
+    Image<T> apply(const Image<T>& source, const Image<T>& target, const int offset_x = 0, const int offset_y = 0) const
+    {
+        // Boundary differences; boundary pixels outside the target take the nearest target pixel.
+        const int num_boundary = int(m_boundary.size());
+        std::vector<T> differences(m_boundary.size());
+#pragma omp parallel for num_threads(kernelThreads(num_boundary, KernelCost::Light))
+        for (int i = 0; i < num_boundary; i++) {
+            const auto [x, y] = m_boundary[i];
+            const int tx = std::clamp(x + offset_x, 0, target.width - 1);
+            const int ty = std::clamp(y + offset_y, 0, target.height - 1);
+            differences[i] = target.data[size_t(ty) * size_t(target.width) + size_t(tx)] - source.data[size_t(y) * size_t(m_width) + size_t(x)];
+        }
+
+        // Membrane at the evaluation points.
+        const int num_points = int(m_points.size());
+        std::vector<T> membrane(m_points.size());
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_vertices.size()), KernelCost::Light)) schedule(dynamic, 64)
+        for (int e = 0; e < num_points; e++) {
+            T value(0.0f);
+            for (int k = m_weight_offsets[e]; k < m_weight_offsets[size_t(e) + 1]; k++) {
+                value += m_weights[k] * differences[m_vertices[k]];
+            }
+            membrane[e] = value;
+        }
+
+        // source + membrane inside the mask: evaluated, interpolated or boundary pixels.
+        auto result = target.clone();
+        const int step = m_params.step;
+        const int lattice_width = latticeWidth();
+        const float inv_step = 1.0f / float(step);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_width) * m_height, KernelCost::Light))
+        for (int y = 0; y < m_height; y++) {
+            const int ty = y + offset_y;
+            if (ty < 0 || ty >= target.height) {
+                continue;
+            }
+            for (int x = 0; x < m_width; x++) {
+                const int tx = x + offset_x;
+                const int ref = m_pixel_refs[size_t(y) * size_t(m_width) + size_t(x)];
+                if (ref == OUTSIDE || tx < 0 || tx >= target.width) {
+                    continue;
+                }
+                T value;
+                if (ref >= 0) {
+                    value = membrane[ref];
+                } else if (ref == INTERPOLATED) {
+                    const int lx = x / step;
+                    const int ly = y / step;
+                    const int* corners = m_lattice.data() + size_t(ly) * size_t(lattice_width) + size_t(lx);
+                    const float fx = float(x - lx * step) * inv_step;
+                    const float fy = float(y - ly * step) * inv_step;
+                    const T top = membrane[corners[0]] + fx * (membrane[corners[1]] - membrane[corners[0]]);
+                    const T bottom = membrane[corners[lattice_width]] + fx * (membrane[corners[lattice_width + 1]] - membrane[corners[lattice_width]]);
+                    value = top + fy * (bottom - top);
+                } else {
+                    value = differences[BOUNDARY - ref];
+                }
+                result.data[size_t(ty) * size_t(target.width) + size_t(tx)] = source.data[size_t(y) * size_t(m_width) + size_t(x)] + value;
+            }
+        }
+        return result;
+    }
+
+private:
+    // m_pixel_refs: index of the evaluation point (>= 0), or one of these, or BOUNDARY - boundary index.
+    static constexpr int OUTSIDE = -1;
+    static constexpr int INTERPOLATED = -2;
+    static constexpr int BOUNDARY = -3;
+
+    // Contour of a component: m_boundary[begin, end).
+    struct Contour {
+        int begin = 0, end = 0;
+    };
+
+    int latticeWidth() const { return (m_width + m_params.step - 1) / m_params.step + 1; }
+    int latticeHeight() const { return (m_height + m_params.step - 1) / m_params.step + 1; }
+
+    /// <summary>
+    /// 4-connected components of the mask, numbered from 0 in raster order of their first pixel; -1 outside.
+    /// </summary>
+    std::vector<int> labelComponents(const BinaryMask& mask)
+    {
+        std::vector<int> labels(size_t(m_width) * size_t(m_height), -1);
+        std::vector<int> queue;
+        int num_components = 0;
+        for (int y = 0; y < m_height; y++) {
+            if (mask.rowEmpty(y)) {
+                continue;
+            }
+            for (int x = 0; x < m_width; x++) {
+                const size_t start = size_t(y) * size_t(m_width) + size_t(x);
+                if (!mask(x, y) || labels[start] >= 0) {
+                    continue;
+                }
+                labels[start] = num_components;
+                queue.assign(1, int(start));
+                while (!queue.empty()) {
+                    const int i = queue.back();
+                    queue.pop_back();
+                    const int px = i % m_width;
+                    const int py = i / m_width;
+                    const std::array<std::pair<int, int>, 4> neighbours { { { px - 1, py }, { px + 1, py }, { px, py - 1 }, { px, py + 1 } } };
+                    for (const auto& [nx, ny] : neighbours) {
+                        const size_t n = size_t(ny) * size_t(m_width) + size_t(nx);
+                        if (nx >= 0 && nx < m_width && ny >= 0 && ny < m_height && mask(nx, ny) && labels[n] < 0) {
+                            labels[n] = num_components;
+                            queue.push_back(int(n));
+                        }
+                    }
+                }
+                num_components++;
+            }
+        }
+        m_contours.resize(size_t(num_components));
+        return labels;
+    }
+
+    /// <summary>
+    /// Moore-neighbour tracing of the outer contour of every component, clockwise from its first pixel.
+    /// </summary>
+    void traceContours(const std::vector<int>& labels)
+    {
+        // Clockwise from west.
+        static constexpr std::array<std::pair<int, int>, 8> directions { { { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 } } };
+        const auto inside = [&](const int x, const int y, const int label) {
+            return x >= 0 && x < m_width && y >= 0 && y < m_height && labels[size_t(y) * size_t(m_width) + size_t(x)] == label;
+        };
+
+        std::vector<bool> traced(m_contours.size(), false);
+        for (int y = 0; y < m_height; y++) {
+            for (int x = 0; x < m_width; x++) {
+                const int label = labels[size_t(y) * size_t(m_width) + size_t(x)];
+                if (label < 0 || traced[label]) {
+                    continue;
+                }
+                traced[label] = true;
+                m_contours[label].begin = int(m_boundary.size());
+
+                // The first pixel in raster order has its west neighbour outside. The contour is
+                // closed when the start pixel is left the same way as the first time.
+                int cx = x, cy = y, backtrack = 0, first_move = -1;
+                while (true) {
+                    int found = -1;
+                    for (int k = 1; k <= 8; k++) {
+                        const int d = (backtrack + k) % 8;
+                        if (inside(cx + directions[d].first, cy + directions[d].second, label)) {
+                            found = d;
+                            break;
+                        }
+                    }
+                    if (cx == x && cy == y) {
+                        if (found == first_move && int(m_boundary.size()) > m_contours[label].begin) {
+                            break;
+                        }
+                        first_move = first_move < 0 ? found : first_move;
+                    }
+                    m_boundary.push_back({ cx, cy });
+                    if (found < 0) {
+                        // Single pixel component.
+                        break;
+                    }
+                    cx += directions[found].first;
+                    cy += directions[found].second;
+                    // The last outside neighbour checked, seen from the new pixel.
+                    backtrack = (found + (found % 2 == 0 ? 6 : 5)) % 8;
+                }
+                m_contours[label].end = int(m_boundary.size());
+            }
+        }
+
+        for (int i = 0; i < int(m_boundary.size()); i++) {
+            const auto [x, y] = m_boundary[i];
+            m_pixel_refs[size_t(y) * size_t(m_width) + size_t(x)] = BOUNDARY - i;
+        }
+    }
+
+    /// <summary>
+    /// Lattice points and the pixels outside complete lattice cells become evaluation points, the
+    /// other interior pixels are interpolated.
+    /// </summary>
+    void placeEvaluationPoints(const std::vector<int>& labels)
+    {
+        const int step = m_params.step;
+        const int lattice_width = latticeWidth();
+        m_lattice.assign(size_t(lattice_width) * size_t(latticeHeight()), -1);
+        const auto interior = [&](const int x, const int y) {
+            return x < m_width && y < m_height && m_pixel_refs[size_t(y) * size_t(m_width) + size_t(x)] == OUTSIDE && labels[size_t(y) * size_t(m_width) + size_t(x)] >= 0;
+        };
+        for (int y = 0; y < m_height; y += step) {
+            for (int x = 0; x < m_width; x += step) {
+                if (interior(x, y)) {
+                    m_lattice[size_t(y / step) * size_t(lattice_width) + size_t(x / step)] = addPoint(x, y, labels);
+                }
+            }
+        }
+        for (int y = 0; y < m_height; y++) {
+            for (int x = 0; x < m_width; x++) {
+                const size_t i = size_t(y) * size_t(m_width) + size_t(x);
+                if (!interior(x, y) || (x % step == 0 && y % step == 0)) {
+                    continue;
+                }
+                const int* corners = m_lattice.data() + size_t(y / step) * size_t(lattice_width) + size_t(x / step);
+                const std::array<int, 4> corner_points { corners[0], corners[1], corners[lattice_width], corners[lattice_width + 1] };
+                const bool complete = std::all_of(corner_points.begin(), corner_points.end(), [&](const int point) { return point >= 0 && m_point_labels[point] == labels[i]; });
+                m_pixel_refs[i] = complete ? INTERPOLATED : addPoint(x, y, labels);
+            }
+        }
+    }
+
+    int addPoint(const int x, const int y, const std::vector<int>& labels)
+    {
+        const size_t i = size_t(y) * size_t(m_width) + size_t(x);
+        m_points.push_back({ x, y });
+        m_point_labels.push_back(labels[i]);
+        m_pixel_refs[i] = int(m_points.size()) - 1;
+        return m_pixel_refs[i];
+    }
+
+    /// <summary>
+    /// Mean-value coordinates of every evaluation point over its hierarchically sampled contour.
+    /// </summary>
+    void computeWeights()
+    {
+        const int num_points = int(m_points.size());
+        std::vector<std::vector<std::pair<int, float>>> point_weights(m_points.size());
+#pragma omp parallel num_threads(kernelThreads(int64_t(num_points) * 64, KernelCost::Medium))
+        {
+            std::vector<int> samples;
+            std::vector<std::pair<int, int>> stack;
+            std::vector<double> tangents;
+#pragma omp for schedule(dynamic, 64)
+            for (int e = 0; e < num_points; e++) {
+                const auto [px, py] = m_points[e];
+                const auto& contour = m_contours[m_point_labels[e]];
+                const int n = contour.end - contour.begin;
+                const auto vertex = [&](const int k) { return m_boundary[size_t(contour.begin) + size_t(k % n)]; };
+                const auto distance = [&](const int k) {
+                    const auto [vx, vy] = vertex(k);
+                    return std::hypot(double(vx - px), double(vy - py));
+                };
+
+                // Contour vertices of the point, in contour order.
+                samples.clear();
+                const int coarse = std::max(1, int(std::bit_ceil(unsigned(std::max(n / std::max(m_params.coarse_segments, 1), 1)))));
+                for (int begin = n - (n - 1) % coarse - 1; begin >= 0; begin -= coarse) {
+                    stack.push_back({ begin, std::min(coarse, n - begin) });
+                }
+                while (!stack.empty()) {
+                    const auto [begin, length] = stack.back();
+                    stack.pop_back();
+                    if (length > 1 && length > m_params.boundary_ratio * distance(begin + length / 2)) {
+                        stack.push_back({ begin + length / 2, length - length / 2 });
+                        stack.push_back({ begin, length / 2 });
+                    } else {
+                        samples.push_back(begin);
+                    }
+                }
+
+                // w_i = (tan(alpha_{i-1} / 2) + tan(alpha_i / 2)) / r_i, with alpha_i the signed angle
+                // between the vertices i and i + 1 seen from the point.
+                const int m = int(samples.size());
+                tangents.resize(size_t(m));
+                for (int i = 0; i < m; i++) {
+                    const auto [ax, ay] = vertex(samples[i]);
+                    const auto [bx, by] = vertex(samples[(i + 1) % m]);
+                    const double sx = ax - px, sy = ay - py, tx = bx - px, ty = by - py;
+                    const double cross = sx * ty - sy * tx;
+                    const double dot = sx * tx + sy * ty;
+                    tangents[i] = cross == 0.0 ? 0.0 : (std::hypot(sx, sy) * std::hypot(tx, ty) - dot) / cross;
+                }
+                auto& weights = point_weights[e];
+                double sum = 0.0;
+                for (int i = 0; i < m; i++) {
+                    const double w = (tangents[(i + m - 1) % m] + tangents[i]) / distance(samples[i]);
+                    weights.push_back({ contour.begin + samples[i], float(w) });
+                    sum += w;
+                }
+                for (auto& weight : weights) {
+                    weight.second = sum != 0.0 ? float(weight.second / sum) : 1.0f / float(m);
+                }
+            }
+        }
+
+        m_weight_offsets.assign(1, 0);
+        for (const auto& weights : point_weights) {
+            for (const auto& [vertex_index, w] : weights) {
+                m_vertices.push_back(vertex_index);
+                m_weights.push_back(w);
+            }
+            m_weight_offsets.push_back(int(m_vertices.size()));
+        }
+    }
+
+    int m_width, m_height;
+    MembraneCloneParams m_params;
+    // Per source pixel: evaluation point, INTERPOLATED, OUTSIDE or BOUNDARY - boundary index.
+    std::vector<int> m_pixel_refs;
+    // Outer contour pixels of all components, and each component's range.
+    std::vector<std::pair<int, int>> m_boundary;
+    std::vector<Contour> m_contours;
+    // Evaluation points, their component and lattice point index per lattice node (-1 if none).
+    std::vector<std::pair<int, int>> m_points;
+    std::vector<int> m_point_labels;
+    std::vector<int> m_lattice;
+    // Mean-value coordinates of point e: m_weights[m_weight_offsets[e] .. m_weight_offsets[e + 1]) of m_vertices.
+    std::vector<int> m_weight_offsets;
+    std::vector<int> m_vertices;
+    std::vector<float> m_weights;
+};
+
+#pragma endregion Membrane clone
@@ -0,0 +1,179 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Memory plan of a pipeline run, built from the image sizes before any buffer is allocated.
+ *
+ * A plan lists the stages of the run in execution order, the buffers each stage produces and
+ * the buffers it reads. analyze() derives the lifetime of every buffer, from its producer to its
+ * last reader, and the bytes live during every stage when each buffer is released right after
+ * its last use (plus the scratch bytes a stage holds only while it runs); the largest of these
+ * is the predicted peak. Buffers are also assigned to slots: a buffer takes over the slot of a
+ * buffer of the same size that died before it is produced, which is what the ImageBufferPool
+ * does at runtime with its size-keyed free lists, so the slot total is the footprint with
+ * recycling. The run compares the peak with its budget before loading anything (see main.cpp).
+ */
+
+#pragma region Memory plan
+
+/// <summary>
+/// A buffer of the plan with its lifetime, see MemoryPlan::analyze().
+/// </summary>
+struct MemoryPlanBuffer {
+    std::string name;
+    size_t bytes = 0;
+    int producer = 0;
+    // Last stage reading the buffer, the producer when nothing reads it.
+    int last_use = 0;
+    // Slot shared with the earlier buffers of the same size it replaces.
+    int slot = 0;
+};
+
+/// <summary>
+/// Result of MemoryPlan::analyze().
+/// </summary>
+struct MemoryPlanSummary {
+    // Largest live bytes of a stage with every buffer released after its last use, and that stage.
+    size_t peak_bytes = 0;
+    int peak_stage = 0;
+    // Peak when no buffer is released before the end of the run.
+    size_t unreleased_bytes = 0;
+    // Sum of the slots, the footprint when freed buffers are recycled by size.
+    size_t slot_bytes = 0;
+    int slots = 0;
+    // Live bytes during each stage.
+    std::vector<size_t> stage_bytes;
+};
+
+/// <summary>
+/// Stages and buffers of a run, see above.
+/// </summary>
+class MemoryPlan {
+public:
+    /// <summary>
+    /// Appends a stage that reads the given buffers; they must have been produced before.
+    /// </summary>
+    /// <param name="name">stage name</param>
+    /// <param name="reads">buffers read by the stage</param>
+    /// <param name="scratch_bytes">temporary bytes held only while the stage runs</param>
+    void stage(const std::string& name, const std::initializer_list<std::string> reads = {}, const size_t scratch_bytes = 0)
+    {
+        const int index = int(m_stages.size());
+        m_stages.push_back({ name, scratch_bytes });
+        for (const auto& buffer : reads) {
+            const auto it = m_buffer_index.find(buffer);
+            if (it == m_buffer_index.end()) {
+                std::cerr << "Memory plan stage " << name << " reads the unknown buffer " << buffer << "." << std::endl;
+                throw std::exception();
+            }
+            m_buffers[it->second].last_use = index;
+        }
+    }
+
+    /// <summary>
+    /// Adds a buffer produced by the last stage. A buffer of the same name replaces the earlier one.
+    /// </summary>
+    void produce(const std::string& name, const size_t bytes)
+    {
+        if (m_stages.empty()) {
+            std::cerr << "Memory plan buffer " << name << " has no stage producing it." << std::endl;
+            throw std::exception();
+        }
+        const int stage = int(m_stages.size()) - 1;
+        m_buffer_index[name] = int(m_buffers.size());
+        m_buffers.push_back({ name, bytes, stage, stage, 0 });
+    }
+
+    const std::vector<MemoryPlanBuffer>& buffers() const { return m_buffers; }
+
+    /// <summary>
+    /// Lifetimes, live bytes per stage and slots, see above.
+    /// </summary>
+    MemoryPlanSummary analyze()
+    {
+        MemoryPlanSummary summary;
+        summary.stage_bytes.assign(m_stages.size(), 0);
+        std::vector<size_t> produced_until(m_stages.size(), 0);
+        for (const auto& buffer : m_buffers) {
+            for (int s = buffer.producer; s <= buffer.last_use; s++) {
+                summary.stage_bytes[s] += buffer.bytes;
+            }
+            produced_until[buffer.producer] += buffer.bytes;
+        }
+        size_t produced = 0;
+        for (int s = 0; s < int(m_stages.size()); s++) {
+            summary.stage_bytes[s] += m_stages[s].scratch_bytes;
+            produced += produced_until[s];
+            summary.unreleased_bytes = std::max(summary.unreleased_bytes, produced + m_stages[s].scratch_bytes);
+            if (summary.stage_bytes[s] > summary.peak_bytes) {
+                summary.peak_bytes = summary.stage_bytes[s];
+                summary.peak_stage = s;
+            }
+        }
+
+        // Buffers in production order take the slot of a same-sized buffer that died before.
+        std::vector<std::pair<size_t, int>> slot_owner; // (bytes, last use of the current buffer)
+        for (auto& buffer : m_buffers) {
+            int slot = -1;
+            for (int i = 0; i < int(slot_owner.size()) && slot < 0; i++) {
+                if (slot_owner[i].first == buffer.bytes && slot_owner[i].second < buffer.producer) {
+                    slot = i;
+                }
+            }
+            if (slot < 0) {
+                slot = int(slot_owner.size());
+                slot_owner.push_back({ buffer.bytes, 0 });
+                summary.slot_bytes += buffer.bytes;
+            }
+            slot_owner[slot].second = buffer.last_use;
+            buffer.slot = slot;
+        }
+        summary.slots = int(slot_owner.size());
+        return summary;
+    }
+
+    /// <summary>
+    /// Prints the stages with their live bytes and the buffers with their lifetimes.
+    /// </summary>
+    void print(std::ostream& out)
+    {
+        const auto summary = analyze();
+        const auto megabytes = [](const size_t bytes) { return double(bytes) / double(1 << 20); };
+        out << std::fixed << std::setprecision(1);
+        out << "Memory plan: peak " << megabytes(summary.peak_bytes) << " MB during " << m_stages[summary.peak_stage].name << ", "
+            << megabytes(summary.unreleased_bytes) << " MB without releasing at last use, " << megabytes(summary.slot_bytes) << " MB in " << summary.slots
+            << " recycled slots." << std::endl;
+        for (int s = 0; s < int(m_stages.size()); s++) {
+            out << "  " << std::left << std::setw(36) << m_stages[s].name << std::right << std::setw(10) << megabytes(summary.stage_bytes[s]) << " MB";
+            for (const auto& buffer : m_buffers) {
+                if (buffer.producer == s) {
+                    out << "  +" << buffer.name;
+                }
+                if (buffer.last_use == s) {
+                    out << "  -" << buffer.name;
+                }
+            }
+            out << std::endl;
+        }
+        out << std::defaultfloat;
+    }
+
+private:
+    struct Stage {
+        std::string name;
+        size_t scratch_bytes = 0;
+    };
+
+    std::vector<Stage> m_stages;
+    std::vector<MemoryPlanBuffer> m_buffers;
+    std::map<std::string, int> m_buffer_index;
+};
+
+#pragma endregion Memory plan
@@ -0,0 +1,546 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef HDR_MPI
+#include <mpi.h>
+#endif
+
+#include "hdr_stream.h"
+#include "poisson_checkpoint.h"
+#include "your_code_here.h"
+
+/*
+ * Multi-process solving and tone mapping by row bands (CMake option A1_HDR_MPI).
+ *
+ * An image is split into one band of consecutive rows per MPI rank (rowBand()), and a rank only
+ * ever holds its band plus a halo of the rows its neighborhood operators read from the ranks
+ * above and below:
+ *   - solvePoissonDistributed() keeps one halo row on each side and exchanges it before every
+ *     Jacobi iteration, or before every color of a red-black SOR sweep. The exchange is started
+ *     non-blocking, the rows that do not read the halo are updated meanwhile and the two edge rows
+ *     after it arrived. Colors follow the image row parity, so the result is bit-identical to
+ *     solvePoisson() of the whole image with the same method and iterations.
+ *   - bilateralFilterDistributed() exchanges radius rows once; the rows of the band at least
+ *     radius away from a neighbor are filtered while the halo is in flight, the edge strips after.
+ *     For the window engines (brute force, tiled, range LUT, SIMD) the result equals bilateralFilter()
+ *     of the whole image; the global engines (grid, recursive, permutohedral, upsampled, guided,
+ *     wls) see the band with its halo and differ slightly along the band edges.
+ *   - toneMapDurandDistributed() reads the band of a Radiance HDR file on every rank, runs the three
+ *     Durand passes with the distributed bilateral filter and streams the bands to rank 0, which
+ *     appends them to the output in row order, one chunk at a time.
+ * MPI is only called outside of parallel regions (MPI_THREAD_FUNNELED), the kernels of a band
+ * use the OpenMP threads of its process. Without A1_HDR_MPI an MpiSession is a single rank, every
+ * band is the whole image and the functions run without any exchange.
+ */
+
+#pragma region MPI distributed
+
+/// <summary>
+/// Rows [begin, end) of an image owned by one rank.
+/// </summary>
+struct RowBand {
+    int begin = 0;
+    int end = 0;
+
+    int rows() const { return end - begin; }
+};
+
+/// <summary>
+/// Balanced split of height rows into ranks bands, the first height % ranks bands get one row more.
+/// </summary>
+inline RowBand rowBand(const int height, const int rank, const int ranks)
+{
+    const int base = height / ranks;
+    const int extra = height % ranks;
+    const int begin = rank * base + std::min(rank, extra);
+    return { begin, begin + base + (rank < extra ? 1 : 0) };
+}
+
+inline bool mpiAvailable()
+{
+#ifdef HDR_MPI
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// <summary>
+/// MPI environment of the process: initializes MPI unless it already is, and finalizes what it initialized.
+/// </summary>
+class MpiSession {
+public:
+    MpiSession()
+    {
+#ifdef HDR_MPI
+        int initialized = 0;
+        MPI_Initialized(&initialized);
+        if (!initialized) {
+            int provided = 0;
+            MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &provided);
+            m_owned = true;
+        }
+        MPI_Comm_rank(MPI_COMM_WORLD, &m_rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &m_ranks);
+#endif
+    }
+    ~MpiSession()
+    {
+#ifdef HDR_MPI
+        if (m_owned) {
+            MPI_Finalize();
+        }
+#endif
+    }
+    MpiSession(const MpiSession&) = delete;
+    MpiSession& operator=(const MpiSession&) = delete;
+
+    int rank() const { return m_rank; }
+    int ranks() const { return m_ranks; }
+    bool isRoot() const { return m_rank == 0; }
+    // Band of this rank of an image with height rows.
+    RowBand band(const int height) const { return rowBand(height, m_rank, m_ranks); }
+    // Smallest value over all ranks (collective).
+    int minimum(const int value) const
+    {
+#ifdef HDR_MPI
+        int result = value;
+        MPI_Allreduce(&value, &result, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        return result;
+#else
+        return value;
+#endif
+    }
+
+private:
+    int m_rank = 0;
+    int m_ranks = 1;
+    bool m_owned = false;
+};
+
+/// <summary>
+/// Non-blocking exchange of rows with the ranks above (rank - 1) and below (rank + 1).
+/// The send buffers must not be written and the receive buffers not read until wait() returned.
+/// </summary>
+class RowExchange {
+public:
+    /// <summary>
+    /// Starts the exchange; an empty span skips that direction (no neighbor or nothing needed).
+    /// </summary>
+    void start(const MpiSession& session, const std::span<const float> send_up, const std::span<float> receive_up, const std::span<const float> send_down,
+        const std::span<float> receive_down)
+    {
+#ifdef HDR_MPI
+        m_count = 0;
+        const auto post_receive = [&](const std::span<float> rows, const int source, const int tag) {
+            if (!rows.empty()) {
+                MPI_Irecv(rows.data(), checkedCount(rows.size()), MPI_FLOAT, source, tag, MPI_COMM_WORLD, &m_requests[m_count++]);
+            }
+        };
+        const auto post_send = [&](const std::span<const float> rows, const int dest, const int tag) {
+            if (!rows.empty()) {
+                MPI_Isend(rows.data(), checkedCount(rows.size()), MPI_FLOAT, dest, tag, MPI_COMM_WORLD, &m_requests[m_count++]);
+            }
+        };
+        // Tag 0 travels down, tag 1 up, so the two messages between a pair of ranks never match each other.
+        post_receive(receive_up, session.rank() - 1, 0);
+        post_receive(receive_down, session.rank() + 1, 1);
+        post_send(send_up, session.rank() - 1, 1);
+        post_send(send_down, session.rank() + 1, 0);
+#else
+        if (!send_up.empty() || !receive_up.empty() || !send_down.empty() || !receive_down.empty()) {
+            std::cerr << "a1_hdr was built without MPI, a single rank has no neighbors to exchange rows with." << std::endl;
+            throw std::exception();
+        }
+        (void)session;
+#endif
+    }
+
+    void wait()
+    {
+#ifdef HDR_MPI
+        MPI_Waitall(m_count, m_requests.data(), MPI_STATUSES_IGNORE);
+        m_count = 0;
+#endif
+    }
+
+private:
+#ifdef HDR_MPI
+    static int checkedCount(const size_t count)
+    {
+        if (count > size_t(std::numeric_limits<int>::max())) {
+            std::cerr << "A halo of " << count << " floats exceeds the MPI message size." << std::endl;
+            throw std::exception();
+        }
+        return int(count);
+    }
+
+    std::array<MPI_Request, 4> m_requests {};
+    int m_count = 0;
+#endif
+};
+
+/// <summary>
+/// Jacobi update of the local rows [y0, y1) of a band from u into u_next, the update rule of solvePoisson().
+/// </summary>
+inline void sweepBandJacobi(const ImageFloat& u, ImageFloat& u_next, const ImageFloat& f, const int y0, const int y1)
+{
+    const int w = u.width;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(std::max(y1 - y0, 0)) * w, KernelCost::Light))
+    for (int y = y0; y < y1; y++) {
+        const float* row = u.data.data() + size_t(y) * size_t(w);
+        const float* up = row - w;
+        const float* down = row + w;
+        const float* div = f.data.data() + size_t(y) * size_t(w);
+        float* out = u_next.data.data() + size_t(y) * size_t(w);
+#pragma omp simd
+        for (int x = 1; x < w - 1; x++) {
+            out[x] = 0.25f * (row[x + 1] + row[x - 1] + down[x] + up[x] - div[x]);
+        }
+    }
+}
+
+/// <summary>
+/// One color of a red-black SOR sweep of the local rows [y0, y1), see smoothPoissonRedBlack().
+/// Local row y is image row y + image_y, whose parity selects the color of its pixels.
+/// </summary>
+inline void sweepBandRedBlack(ImageFloat& u, const ImageFloat& f, const int y0, const int y1, const int image_y, const int color, const float omega)
+{
+    const int w = u.width;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(std::max(y1 - y0, 0)) * w, KernelCost::Light))
+    for (int y = y0; y < y1; y++) {
+        float* row = u.data.data() + size_t(y) * size_t(w);
+        const float* div = f.data.data() + size_t(y) * size_t(w);
+        for (int x = 1 + ((y + image_y + 1 + color) & 1); x < w - 1; x += 2) {
+            const float gs = 0.25f * (row[x - 1] + row[x + 1] + row[x - w] + row[x + w] - div[x]);
+            row[x] += omega * (gs - row[x]);
+        }
+    }
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G on the band of this rank, see above. Every rank
+/// calls it with its band; the 1px border of the image is kept fixed as in solvePoisson().
+/// Blocked and mixed-precision Jacobi run as Jacobi, mixed-precision SOR as SOR.
+/// </summary>
+/// <param name="initial_band">rows of the band of the initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_band">rows of the band of div G, at least as wide as the solution</param>
+/// <param name="band">rows of the image owned by this rank, session.band(image_height)</param>
+/// <param name="image_height">height of the whole image</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="session">ranks holding the other bands</param>
+/// <returns>rows of the band of the luminance I</returns>
+ImageFloat solvePoissonDistributed(const ImageFloat& initial_band, const ImageFloat& divergence_band, const RowBand band, const int image_height,
+    const int num_iters, const PoissonMethod method, const float omega, const MpiSession& session)
+{
+    const int w = initial_band.width;
+    const int rows = band.rows();
+    if (rows < 1 || initial_band.height != rows || divergence_band.height < rows || divergence_band.width < w) {
+        std::cerr << "The band of rows " << band.begin << " to " << band.end << " does not match its solution (" << initial_band.height << " rows) or divergence." << std::endl;
+        throw std::exception();
+    }
+    const ScopedStage stage("solvePoissonDistributed", uint64_t(initial_band.data.size()) * uint64_t(std::max(num_iters, 0)));
+
+    // Local row y is image row band.begin - 1 + y; rows 0 and rows + 1 are the halo.
+    auto u = ImageFloat(w, rows + 2);
+    auto f = ImageFloat(w, rows + 2);
+    for (int y = 0; y < rows; y++) {
+        std::copy_n(initial_band.data.data() + size_t(y) * size_t(w), w, u.data.data() + size_t(y + 1) * size_t(w));
+        std::copy_n(divergence_band.data.data() + size_t(y) * size_t(divergence_band.width), w, f.data.data() + size_t(y + 1) * size_t(w));
+    }
+    const int image_y = band.begin - 1;
+    const bool above = band.begin > 0;
+    const bool below = band.end < image_height;
+    // Updated rows: the image interior. Only the first and the last row of the band read the halo.
+    const int y_first = std::max(band.begin, 1) - image_y;
+    const int y_last = std::min(band.end, image_height - 1) - image_y;
+    const int inner_first = std::max(y_first, 2);
+    const int inner_last = std::min(y_last, rows);
+    const auto update_edges = [&](const auto& update) {
+        if (y_first <= 1 && 1 < y_last) {
+            update(1, 2);
+        }
+        if (rows > 1 && y_first <= rows && rows < y_last) {
+            update(rows, rows + 1);
+        }
+    };
+
+    RowExchange exchange;
+    const auto start_exchange = [&](ImageFloat& image) {
+        const auto row = [&](const int y) { return std::span<float>(image.data.data() + size_t(y) * size_t(w), size_t(w)); };
+        exchange.start(session, above ? row(1) : std::span<float>(), above ? row(0) : std::span<float>(), below ? row(rows) : std::span<float>(),
+            below ? row(rows + 1) : std::span<float>());
+    };
+
+    if (method == PoissonMethod::RedBlackSor || method == PoissonMethod::MixedSor) {
+        const float relaxation = omega > 0.0f ? omega : computeOptimalSorOmega(w, image_height);
+        for (int iter = 0; iter < num_iters; iter++) {
+            for (int color = 0; color < 2; color++) {
+                // Rows of the other color are read, so the halo is exchanged before each color.
+                start_exchange(u);
+                sweepBandRedBlack(u, f, inner_first, inner_last, image_y, color, relaxation);
+                exchange.wait();
+                update_edges([&](const int y0, const int y1) { sweepBandRedBlack(u, f, y0, y1, image_y, color, relaxation); });
+            }
+        }
+    } else {
+        // The border is never written, so both buffers hold the Dirichlet values.
+        auto u_next = u.clone();
+        for (int iter = 0; iter < num_iters; iter++) {
+            start_exchange(u);
+            sweepBandJacobi(u, u_next, f, inner_first, inner_last);
+            exchange.wait();
+            update_edges([&](const int y0, const int y1) { sweepBandJacobi(u, u_next, f, y0, y1); });
+            std::swap(u, u_next);
+        }
+    }
+    return ImageFloat(std::as_const(u).view(0, 1, w, rows));
+}
+
+/// <summary>
+/// solvePoissonDistributed() with checkpoints (see poisson_checkpoint.h): every rank saves its band
+/// after each segment of checkpointing.every iterations to its own file, alternating between two
+/// generations "<stem>.rank<r>.<0|1><extension>", since a preempted job may have ranks one
+/// checkpoint apart. A resumed solve continues from the newest iteration all ranks hold.
+/// </summary>
+/// <param name="initial_band">rows of the band of the initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_band">rows of the band of div G, at least as wide as the solution</param>
+/// <param name="band">rows of the image owned by this rank, session.band(image_height)</param>
+/// <param name="image_height">height of the whole image</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="session">ranks holding the other bands</param>
+/// <param name="checkpointing">base path of the checkpoint files and interval</param>
+/// <returns>rows of the band of the luminance I</returns>
+ImageFloat solvePoissonDistributedCheckpointed(const ImageFloat& initial_band, const ImageFloat& divergence_band, const RowBand band, const int image_height,
+    const int num_iters, const PoissonMethod method, const float omega, const MpiSession& session, const PoissonCheckpointing& checkpointing)
+{
+    if (!checkpointing.enabled()) {
+        return solvePoissonDistributed(initial_band, divergence_band, band, image_height, num_iters, method, omega, session);
+    }
+    const auto generation_path = [&](const int generation) {
+        auto path = checkpointing.path;
+        path.replace_filename(checkpointing.path.stem().string() + ".rank" + std::to_string(session.rank()) + "." + std::to_string(generation)
+            + checkpointing.path.extension().string());
+        return path;
+    };
+    const uint64_t fingerprint = poissonCheckpointFingerprint(initial_band, divergence_band, uint32_t(method));
+    const int every = std::max(checkpointing.every, 1);
+
+    // The iteration to resume from: the newest one of this rank, agreed on as the minimum of all
+    // ranks, and 0 unless every rank has that one.
+    auto solution = initial_band.clone();
+    int done = 0;
+    if (checkpointing.resume) {
+        std::array<std::optional<PoissonCheckpointInfo>, 2> generations;
+        std::array<ImageFloat, 2> solutions { initial_band.clone(), initial_band.clone() };
+        int newest = 0;
+        for (int generation = 0; generation < 2; generation++) {
+            generations[generation] = loadPoissonCheckpoint(generation_path(generation), fingerprint, solutions[generation]);
+            if (generations[generation]) {
+                newest = std::max(newest, generations[generation]->iteration);
+            }
+        }
+        const int agreed = session.minimum(newest);
+        int found = -1;
+        for (int generation = 0; generation < 2; generation++) {
+            if (agreed > 0 && generations[generation] && generations[generation]->iteration == agreed) {
+                found = generation;
+            }
+        }
+        done = session.minimum(found >= 0 ? agreed : 0);
+        if (done > 0) {
+            solution = std::move(solutions[found]);
+            if (session.isRoot()) {
+                std::cout << "Resuming the distributed Poisson solve at iteration " << done << "." << std::endl;
+            }
+        }
+    }
+
+    PoissonCheckpointWriter writer;
+    while (done < num_iters) {
+        const int segment = std::min(every - done % every, num_iters - done);
+        solution = solvePoissonDistributed(solution, divergence_band, band, image_height, segment, method, omega, session);
+        done += segment;
+        if (done < num_iters) {
+            writer.save(generation_path((done / every) % 2), solution, PoissonCheckpointInfo { done, uint32_t(method), fingerprint, 0.0 });
+        }
+    }
+    writer.wait();
+    for (int generation = 0; generation < 2; generation++) {
+        std::error_code error;
+        std::filesystem::remove(generation_path(generation), error);
+    }
+    return solution;
+}
+
+/// <summary>
+/// Applies bilateralFilter() to the band of this rank with a halo of size / 2 rows, see above.
+/// Every band must have at least size / 2 rows when there are several ranks.
+/// </summary>
+/// <param name="H_band">rows of the band of the intensity image</param>
+/// <param name="band">rows of the image owned by this rank, session.band(image_height)</param>
+/// <param name="image_height">height of the whole image</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="engine">implementation to use</param>
+/// <param name="session">ranks holding the other bands</param>
+/// <returns>rows of the band of the filtered intensity</returns>
+ImageFloat bilateralFilterDistributed(const ImageFloat& H_band, const RowBand band, const int image_height, const int size, const float space_sigma,
+    const float range_sigma, const BilateralEngine engine, const MpiSession& session)
+{
+    const int w = H_band.width;
+    const int rows = band.rows();
+    const int radius = size / 2;
+    // Halo rows received from the neighbors, and sent to them (what their halo needs).
+    const int top = std::min(radius, band.begin);
+    const int bottom = std::min(radius, image_height - band.end);
+    const int send_top = std::min(radius, image_height - band.begin) * (band.begin > 0 ? 1 : 0);
+    const int send_bottom = std::min(radius, band.end) * (band.end < image_height ? 1 : 0);
+    if (H_band.height != rows || send_top > rows || send_bottom > rows) {
+        std::cerr << "The band of rows " << band.begin << " to " << band.end << " is shorter than the filter radius " << radius << " or its image." << std::endl;
+        throw std::exception();
+    }
+
+    // The band with its halo; the own rows are sent from it while the halo rows are received.
+    auto window = ImageFloat::uninitialized(w, top + rows + bottom);
+    std::copy(H_band.data.begin(), H_band.data.end(), window.data.begin() + ptrdiff_t(top) * w);
+    const auto rows_of = [&](const int y, const int count) { return std::span<float>(window.data.data() + size_t(y) * size_t(w), size_t(count) * size_t(w)); };
+    RowExchange exchange;
+    exchange.start(session, rows_of(top, send_top), rows_of(0, top), rows_of(top + rows - send_bottom, send_bottom), rows_of(top + rows, bottom));
+
+    auto result = ImageFloat::uninitialized(w, rows);
+    const auto copy_rows = [&](const ImageFloat& filtered, const int filtered_y, const int y0, const int y1) {
+        for (int y = y0; y < y1; y++) {
+            std::copy_n(filtered.data.data() + size_t(y - filtered_y) * size_t(w), w, result.data.data() + size_t(y) * size_t(w));
+        }
+    };
+    // Rows whose window does not reach a neighbor, filtered while the halo is in flight.
+    const int inner_first = top > 0 ? radius : 0;
+    const int inner_last = bottom > 0 ? rows - radius : rows;
+    if (inner_first < inner_last) {
+        copy_rows(bilateralFilter(H_band, size, space_sigma, range_sigma, engine), 0, inner_first, inner_last);
+    }
+    exchange.wait();
+
+    // Edge strips: the rows near a neighbor with the window rows they read.
+    if (top > 0) {
+        const int strip_rows = std::min(top + 2 * radius, window.height);
+        const auto strip = bilateralFilter(ImageFloat(window.view(0, 0, w, strip_rows)), size, space_sigma, range_sigma, engine);
+        copy_rows(strip, -top, 0, std::min(radius, rows));
+    }
+    if (bottom > 0) {
+        const int strip_begin = std::max(window.height - bottom - 2 * radius, 0);
+        const auto strip = bilateralFilter(ImageFloat(window.view(0, strip_begin, w, window.height - strip_begin)), size, space_sigma, range_sigma, engine);
+        copy_rows(strip, strip_begin - top, std::max(rows - radius, 0), rows);
+    }
+    return result;
+}
+
+/// <summary>
+/// Reads the rows of a band of a Radiance HDR file. The scanlines above it are decoded and dropped,
+/// so only the band is ever resident.
+/// </summary>
+/// <param name="filePath">Radiance .hdr file</param>
+/// <param name="session">ranks reading the other bands</param>
+/// <param name="band">output of the band of this rank</param>
+/// <param name="image_height">output of the height of the whole image</param>
+/// <returns>rows of the band</returns>
+ImageRGB readHdrBand(const std::filesystem::path& filePath, const MpiSession& session, RowBand& band, int& image_height)
+{
+    RadianceHdrReader reader(filePath);
+    image_height = reader.height();
+    band = session.band(image_height);
+    auto rows = ImageRGB::uninitialized(reader.width(), band.rows());
+    std::vector<glm::vec3> skipped(static_cast<size_t>(reader.width()));
+    for (int y = 0; y < band.end; y++) {
+        glm::vec3* scanline = y < band.begin ? skipped.data() : rows.data.data() + size_t(y - band.begin) * size_t(reader.width());
+        static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
+        if (!reader.readScanline(reinterpret_cast<float*>(scanline))) {
+            std::cerr << "Failed to decode scanline " << y << " of " << filePath << std::endl;
+            throw std::exception();
+        }
+    }
+    return rows;
+}
+
+/// <summary>
+/// Writes the bands of all ranks as one Radiance HDR file: rank 0 appends its band and then receives
+/// the others in rank order, in chunks of at most chunk_rows rows. Every rank calls it with its band.
+/// </summary>
+/// <param name="filePath">Radiance .hdr output</param>
+/// <param name="band_rows">rows of the band of this rank</param>
+/// <param name="image_height">height of the whole image</param>
+/// <param name="session">ranks holding the other bands</param>
+/// <param name="chunk_rows">rows per message, bounds the receive buffer of rank 0</param>
+void writeHdrDistributed(const std::filesystem::path& filePath, const ImageRGB& band_rows, const int image_height, const MpiSession& session, const int chunk_rows = 64)
+{
+    const int w = band_rows.width;
+#ifdef HDR_MPI
+    if (!session.isRoot()) {
+        for (int y = 0; y < band_rows.height; y += chunk_rows) {
+            const int count = std::min(chunk_rows, band_rows.height - y);
+            MPI_Send(band_rows.data.data() + size_t(y) * size_t(w), count * w * 3, MPI_FLOAT, 0, 2, MPI_COMM_WORLD);
+        }
+        return;
+    }
+#endif
+    HdrBandWriter writer(filePath, w, image_height);
+    writer.write(band_rows.view());
+    auto chunk = ImageRGB::uninitialized(w, chunk_rows);
+    for (int rank = 1; rank < session.ranks(); rank++) {
+        const RowBand band = rowBand(image_height, rank, session.ranks());
+        for (int y = 0; y < band.rows(); y += chunk_rows) {
+            const int count = std::min(chunk_rows, band.rows() - y);
+#ifdef HDR_MPI
+            MPI_Recv(chunk.data.data(), count * w * 3, MPI_FLOAT, rank, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#endif
+            writer.write(chunk.view(0, 0, w, count));
+        }
+    }
+    assert(writer.isComplete());
+}
+
+/// <summary>
+/// Durand tone mapping of a Radiance HDR file by row bands on all ranks, see above. The output is
+/// the tone-mapped RGB in [0,1], written by rank 0 as Radiance HDR. Every rank calls it.
+/// </summary>
+/// <param name="input_path">Radiance .hdr input</param>
+/// <param name="output_path">Radiance .hdr output</param>
+/// <param name="params">tone-mapping parameters, the color guide is not supported</param>
+/// <param name="session">ranks sharing the image</param>
+/// <returns>seconds from the first read to the last write of this rank</returns>
+double toneMapDurandDistributed(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const DurandParams& params, const MpiSession& session)
+{
+    if (params.color_guide) {
+        std::cerr << "The distributed tone mapping has no joint bilateral filter, disable color_guide." << std::endl;
+        throw std::exception();
+    }
+    const auto start_time = std::chrono::steady_clock::now();
+    RowBand band;
+    int image_height = 0;
+    const auto hdr_band = profileStage("load hdr band", 0, [&] { return readHdrBand(input_path, session, band, image_height); });
+    const auto log_lum_H = durandLogLuminance(hdr_band, params);
+    const auto base_image = bilateralFilterDistributed(log_lum_H, band, image_height, params.filter_size, params.space_sigma, params.range_sigma, params.engine, session);
+    auto result = durandCompose(hdr_band, log_lum_H, base_image, params);
+    applyLook(result, params.look);
+    profileStage("write hdr bands", 0, [&] { writeHdrDistributed(output_path, result, image_height, session); return 0; });
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+#pragma endregion MPI distributed
@@ -0,0 +1,168 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <framework/image.h>
+
+#include "execution.h"
+
+/*
+ * Reduced-size renditions of an output (web delivery, thumbnail sets).
+ *
+ * A rendition is the image scaled down to a given long edge, e.g. 2048, 1024, 512 and 256
+ * pixels, with the aspect ratio kept. The chain is built from the float image before
+ * quantization: the largest rendition is resampled from the image, every further one from the
+ * rendition before it, so only the first step reads the full-resolution pixels. resampleArea()
+ * averages the source pixels under each output pixel, weighted by their overlap (a box filter
+ * for any, also non-integer, ratio; a halving is the mean of 2 x 2 pixels). It is parallel over
+ * output rows and streams the source rows: the rows under an output row are accumulated into
+ * one row buffer, which is then reduced horizontally.
+ *
+ * writeRenditions() quantizes and encodes the levels concurrently (runConcurrently()), each with
+ * a share of the threads; OutputSet uses it for the final images when renditions are set.
+ */
+
+#pragma region Output renditions
+
+/// <summary>
+/// Size of the rendition of a width x height image with the given long edge (at least 1 x 1).
+/// </summary>
+inline std::pair<int, int> renditionSize(const int width, const int height, const int long_edge)
+{
+    const int long_side = std::max(width, height);
+    const int short_side = std::max(int(std::lround(double(std::min(width, height)) * long_edge / long_side)), 1);
+    return width >= height ? std::pair { long_edge, short_side } : std::pair { short_side, long_edge };
+}
+
+/// <summary>
+/// Overlap weights of the source pixels under each pixel of a resampled axis.
+/// </summary>
+struct AreaWeights {
+    // First source pixel of each output pixel.
+    std::vector<int> first;
+    // Weights of output pixel i are weights[offsets[i] .. offsets[i + 1]).
+    std::vector<int> offsets;
+    std::vector<float> weights;
+
+    AreaWeights(const int in_size, const int out_size)
+    {
+        const double ratio = double(in_size) / double(out_size);
+        offsets.push_back(0);
+        for (int i = 0; i < out_size; i++) {
+            const double begin = i * ratio;
+            const double end = std::min((i + 1) * ratio, double(in_size));
+            const int source_first = int(begin);
+            first.push_back(source_first);
+            for (int s = source_first; s < end; s++) {
+                const double overlap = std::min(end, s + 1.0) - std::max(begin, double(s));
+                weights.push_back(float(overlap / (end - begin)));
+            }
+            offsets.push_back(int(weights.size()));
+        }
+    }
+
+    int count(const int i) const { return offsets[i + 1] - offsets[i]; }
+    const float* of(const int i) const { return weights.data() + offsets[i]; }
+};
+
+/// <summary>
+/// Area-weighted resampling to a smaller size, see above.
+/// </summary>
+/// <param name="image">float or RGB image</param>
+/// <param name="width">width of the result, at most the image width</param>
+/// <param name="height">height of the result, at most the image height</param>
+/// <returns>resampled image</returns>
+template <typename T>
+Image<T> resampleArea(const Image<T>& image, const int width, const int height)
+{
+    const AreaWeights columns(image.width, width);
+    const AreaWeights rows(image.height, height);
+    auto result = Image<T>::uninitialized(width, height);
+#pragma omp parallel num_threads(kernelThreads(int64_t(image.width) * image.height, KernelCost::Light))
+    {
+        std::vector<T> row_sum(size_t(image.width));
+#pragma omp for schedule(static)
+        for (int y = 0; y < height; y++) {
+            std::fill(row_sum.begin(), row_sum.end(), T(0.0f));
+            const float* row_weights = rows.of(y);
+            for (int k = 0; k < rows.count(y); k++) {
+                const T* source = image.data.data() + size_t(rows.first[y] + k) * size_t(image.width);
+                const float weight = row_weights[k];
+                for (int x = 0; x < image.width; x++) {
+                    row_sum[x] += weight * source[x];
+                }
+            }
+            T* out = result.data.data() + size_t(y) * size_t(width);
+            for (int x = 0; x < width; x++) {
+                const T* sums = row_sum.data() + columns.first[x];
+                const float* column_weights = columns.of(x);
+                T value(0.0f);
+                for (int k = 0; k < columns.count(x); k++) {
+                    value += column_weights[k] * sums[k];
+                }
+                out[x] = value;
+            }
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// One level of a rendition chain.
+/// </summary>
+template <typename T>
+struct Rendition {
+    int long_edge;
+    Image<T> image;
+};
+
+/// <summary>
+/// Renditions of an image for the given long edges, largest first, each resampled from the one
+/// before it. Long edges not below the long edge of the image are skipped (no upscaling).
+/// </summary>
+/// <param name="image">float or RGB image</param>
+/// <param name="long_edges">long edges in pixels, in any order</param>
+template <typename T>
+std::vector<Rendition<T>> buildRenditions(const Image<T>& image, std::vector<int> long_edges)
+{
+    std::sort(long_edges.begin(), long_edges.end(), std::greater<>());
+    long_edges.erase(std::unique(long_edges.begin(), long_edges.end()), long_edges.end());
+
+    std::vector<Rendition<T>> levels;
+    for (const int long_edge : long_edges) {
+        if (long_edge >= std::max(image.width, image.height) || long_edge < 1) {
+            continue;
+        }
+        const auto [width, height] = renditionSize(image.width, image.height, long_edge);
+        const Image<T>& previous = levels.empty() ? image : levels.back().image;
+        levels.push_back({ long_edge, resampleArea(previous, width, height) });
+    }
+    return levels;
+}
+
+/// <summary>
+/// Writes the renditions of an image as "<stem>_<long edge><extension>" next to path, with the
+/// levels quantized and encoded concurrently. Arguments as Image::writeToFile().
+/// </summary>
+/// <param name="image">float or RGB image</param>
+/// <param name="path">path of the full-size output, which is not written here</param>
+/// <param name="long_edges">long edges of the renditions, see buildRenditions()</param>
+template <typename T>
+void writeRenditions(const Image<T>& image, const std::filesystem::path& path, const std::vector<int>& long_edges, const OutputTransform& transform = {})
+{
+    const auto levels = buildRenditions(image, long_edges);
+    const int count = int(levels.size());
+    runConcurrently(count, ExecutionContext::concurrent(count), [&](const int i) {
+        auto level_path = path;
+        level_path.replace_filename(path.stem().string() + "_" + std::to_string(levels[i].long_edge) + path.extension().string());
+        levels[i].image.writeToFile(level_path, 1.0f, 0.0f, 0, transform);
+    });
+}
+
+#pragma endregion Output renditions
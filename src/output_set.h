@@ -0,0 +1,200 @@
+#pragma once
+#include <filesystem>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <framework/image_write_queue.h>
+
+#include "output_renditions.h"
+#include "tile_pyramid.h"
+
+/*
+ * Selectable outputs of main.cpp.
+ *
+ * Most images written by main.cpp are diagnostics of intermediate stages (normalized copies,
+ * gradients, the divergence), only the final images are results. Outputs are written through an
+ * OutputSet under their file stem; a diagnostic is passed as a function that produces the image,
+ * which is only evaluated when the stem is selected, so unselected diagnostics cost nothing.
+ * Stages that only exist for diagnostics can ask wantsAny() to skip work altogether.
+ *
+ * A selection is a comma-separated list of "all", "final" (the final images) and stem prefixes,
+ * e.g. "final,4_base_layer,8a" adds the base layer and the three source gradients.
+ *
+ * With setRenditions() every selected final image is also written at reduced sizes (e.g.
+ * "7_tmo_rgb_1024.png", see output_renditions.h). The renditions are built by a job of the
+ * write queue from the same snapshot as the full-size image, so the caller does not wait for them.
+ * setTilePyramid() adds a deep-zoom pyramid of every selected final image the same way, as
+ * "<name>.dzi" with "<name>_files" or as the "<name>_tiles" directory (see tile_pyramid.h).
+ */
+
+#pragma region Output selection
+
+enum class OutputKind {
+    // Final result of a part, selected by "final".
+    Final,
+    // Intermediate image for inspection.
+    Diagnostic,
+};
+
+/// <summary>
+/// Writes the selected outputs of a run, see above.
+/// </summary>
+class OutputSet {
+public:
+    /// <param name="queue">queue that encodes and stores the images</param>
+    /// <param name="directory">directory of the output files</param>
+    /// <param name="selection">comma-separated "all", "final" and stem prefixes</param>
+    OutputSet(ImageWriteQueue& queue, std::filesystem::path directory, const std::string& selection = "all")
+        : m_queue(queue)
+        , m_directory(std::move(directory))
+    {
+        std::istringstream items(selection);
+        for (std::string item; std::getline(items, item, ',');) {
+            if (item == "all") {
+                m_all = true;
+            } else if (item == "final") {
+                m_final = true;
+            } else if (!item.empty()) {
+                m_prefixes.push_back(item);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Long edges of the reduced-size renditions of the final images, none when empty.
+    /// </summary>
+    void setRenditions(std::vector<int> long_edges) { m_renditions = std::move(long_edges); }
+
+    /// <summary>
+    /// Tile pyramid of the final images, none with TilePyramidLayout::None.
+    /// </summary>
+    void setTilePyramid(const TilePyramidParams& params) { m_tile_pyramid = params; }
+
+    /// <summary>
+    /// True when the output with the given file stem is selected.
+    /// </summary>
+    bool wanted(const std::string& name, const OutputKind kind = OutputKind::Diagnostic) const
+    {
+        if (m_all || (kind == OutputKind::Final && m_final)) {
+            return true;
+        }
+        for (const auto& prefix : m_prefixes) {
+            if (name.compare(0, prefix.size(), prefix) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// True when any diagnostic whose file stem starts with stem_prefix may be selected.
+    /// </summary>
+    bool wantsAny(const std::string& stem_prefix) const
+    {
+        if (m_all) {
+            return true;
+        }
+        for (const auto& prefix : m_prefixes) {
+            if (prefix.compare(0, stem_prefix.size(), stem_prefix) == 0 || stem_prefix.compare(0, prefix.size(), prefix) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// Writes make() to "<name>.png" when the output is selected; make is not called otherwise.
+    /// The transform is applied while the image is quantized, see OutputTransform.
+    /// </summary>
+    template <typename Make, typename = std::enable_if_t<std::is_invocable_v<Make&>>>
+    void write(const std::string& name, Make&& make, const OutputKind kind = OutputKind::Diagnostic, const OutputTransform& transform = {})
+    {
+        if (wanted(name, kind)) {
+            if (withDerived(kind)) {
+                writeShared(name, std::make_shared<const std::decay_t<decltype(make())>>(make()), transform);
+            } else {
+                m_queue.write(make(), m_directory / (name + ".png"), 1.0f, 0.0f, 0, transform);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Writes a snapshot of an existing image when the output is selected.
+    /// </summary>
+    template <typename T>
+    void write(const std::string& name, const Image<T>& image, const OutputKind kind = OutputKind::Diagnostic, const OutputTransform& transform = {})
+    {
+        if (wanted(name, kind)) {
+            if (withDerived(kind)) {
+                writeShared(name, std::make_shared<const Image<T>>(image.clone()), transform);
+            } else {
+                m_queue.write(image, m_directory / (name + ".png"), 1.0f, 0.0f, 0, transform);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Hands an image that the caller no longer needs to the queue when the output is selected.
+    /// </summary>
+    template <typename T>
+    void write(const std::string& name, Image<T>&& image, const OutputKind kind = OutputKind::Diagnostic, const OutputTransform& transform = {})
+    {
+        if (wanted(name, kind)) {
+            if (withDerived(kind)) {
+                writeShared(name, std::make_shared<const Image<T>>(std::move(image)), transform);
+            } else {
+                m_queue.write(std::move(image), m_directory / (name + ".png"), 1.0f, 0.0f, 0, transform);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Writes an image shared with other outputs when the output is selected.
+    /// </summary>
+    template <typename T>
+    void write(const std::string& name, std::shared_ptr<const Image<T>> image, const OutputKind kind = OutputKind::Diagnostic, const OutputTransform& transform = {})
+    {
+        if (wanted(name, kind)) {
+            if (withDerived(kind)) {
+                writeShared(name, std::move(image), transform);
+            } else {
+                m_queue.write(std::move(image), m_directory / (name + ".png"), 1.0f, 0.0f, 0, transform);
+            }
+        }
+    }
+
+private:
+    // True when the output has renditions or a tile pyramid besides the full-size image.
+    bool withDerived(const OutputKind kind) const
+    {
+        return kind == OutputKind::Final && (!m_renditions.empty() || m_tile_pyramid.layout != TilePyramidLayout::None);
+    }
+
+    // The full-size image and jobs writing its renditions and tile pyramid, all from one snapshot.
+    template <typename T>
+    void writeShared(const std::string& name, std::shared_ptr<const Image<T>> image, const OutputTransform& transform)
+    {
+        const auto path = m_directory / (name + ".png");
+        m_queue.write(image, path, 1.0f, 0.0f, 0, transform);
+        if (!m_renditions.empty()) {
+            m_queue.submit([image, path, long_edges = m_renditions, transform] { writeRenditions(*image, path, long_edges, transform); });
+        }
+        if (m_tile_pyramid.layout != TilePyramidLayout::None) {
+            const auto pyramid_path = m_directory / (m_tile_pyramid.layout == TilePyramidLayout::DeepZoom ? name + ".dzi" : name + "_tiles");
+            m_queue.submit([image, pyramid_path, params = m_tile_pyramid, transform] { writeTilePyramid(image->view(), pyramid_path, params, transform); });
+        }
+    }
+
+    ImageWriteQueue& m_queue;
+    std::filesystem::path m_directory;
+    bool m_all = false;
+    bool m_final = false;
+    std::vector<std::string> m_prefixes;
+    std::vector<int> m_renditions;
+    TilePyramidParams m_tile_pyramid;
+};
+
+#pragma endregion Output selection
@@ -0,0 +1,243 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#include "helpers.h"
+#include "stencil.h"
+
+/*
+ * Images with a ghost border.
+ *
+ * The gradients are 1px and the divergence 2px larger than the image, and the kernels producing
+ * them test every neighbor read against the edge (or split the image with forEachStencilPixel())
+ * to read zeros beyond it. A PaddedImage keeps a border of ghost pixels around its interior in
+ * one buffer, filled on demand with zeros, the clamped edge or the mirrored image, so a stencil
+ * reading up to border pixels away from the interior reads the fill without any test. The
+ * larger images of the "+1" convention become views into the same buffer that include part of
+ * the border: getGradientsPadded() writes the dx and dy of the interior into zero-bordered
+ * planes, whose interior grown by one pixel to the right and bottom is getGradients(), and
+ * getDivergencePadded() reads them unconditionally into a divergence whose view grown by one
+ * pixel is getDivergence(). Both produce the same bits as the kernels they replace for finite
+ * inputs.
+ *
+ * solvePoisson() keeps its border pixels fixed (Dirichlet), so its sweeps read neighbors of
+ * interior pixels only and need no ghost cells. The clipped windows of the bilateral filter are
+ * not a fill of the border (the weights of the missing pixels are dropped), so the filter keeps
+ * its crop logic.
+ */
+
+#pragma region Padded images
+
+/// <summary>
+/// Values of the ghost pixels of a PaddedImage.
+/// </summary>
+enum class GhostFill {
+    // Zeros, the padding of the gradient and divergence kernels.
+    Zero,
+    // The nearest edge pixel.
+    Clamp,
+    // The image reflected at the edge pixels (-1 -> 1, width -> width - 2).
+    Mirror,
+};
+
+/// <summary>
+/// Interior pixel a ghost coordinate reads for a fill, -1 for a zero.
+/// </summary>
+/// <param name="i">coordinate, may be outside [0, n)</param>
+/// <param name="n">interior size</param>
+/// <param name="fill">fill of the ghost pixels</param>
+inline int ghostSource(int i, const int n, const GhostFill fill)
+{
+    if (i >= 0 && i < n) {
+        return i;
+    }
+    switch (fill) {
+    case GhostFill::Clamp:
+        return std::clamp(i, 0, n - 1);
+    case GhostFill::Mirror:
+        if (n == 1) {
+            return 0;
+        }
+        // Reflections repeat with period 2 (n - 1), for borders wider than the image.
+        i = std::abs(i) % (2 * (n - 1));
+        return i < n ? i : 2 * (n - 1) - i;
+    default:
+        return -1;
+    }
+}
+
+/// <summary>
+/// width x height pixels with a ghost border of border pixels on every side in one buffer. Row
+/// and column coordinates are those of the interior, ghost pixels have coordinates in
+/// [-border, 0) and [width, width + border).
+/// </summary>
+template <typename T>
+class PaddedImage {
+public:
+    PaddedImage() = default;
+
+    /// <summary>
+    /// Zero-initialized interior and border.
+    /// </summary>
+    PaddedImage(const int width, const int height, const int border)
+        : m_width(width)
+        , m_height(height)
+        , m_border(border)
+        , m_buffer(width + 2 * border, height + 2 * border)
+    {
+        assert(width > 0 && height > 0 && border >= 0);
+    }
+
+    /// <summary>
+    /// Copy of an image with the border filled.
+    /// </summary>
+    static PaddedImage copyOf(const ImageView<const T> image, const int border, const GhostFill fill)
+    {
+        auto result = PaddedImage(image.width, image.height, border);
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+        for (int y = 0; y < image.height; y++) {
+            std::copy_n(image.row(y), image.width, result.row(y));
+        }
+        result.fillBorder(fill);
+        return result;
+    }
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int border() const { return m_border; }
+    int stride() const { return m_buffer.width; }
+
+    /// <summary>
+    /// Pixel 0 of row y, -border <= y < height + border; pixels [-border, width + border) of the row are valid.
+    /// </summary>
+    T* row(const int y) { return m_buffer.data.data() + size_t(y + m_border) * size_t(stride()) + size_t(m_border); }
+    const T* row(const int y) const { return m_buffer.data.data() + size_t(y + m_border) * size_t(stride()) + size_t(m_border); }
+
+    /// <summary>
+    /// The interior.
+    /// </summary>
+    ImageView<T> view() { return view(0, 0, m_width, m_height); }
+    ImageView<const T> view() const { return view(0, 0, m_width, m_height); }
+
+    /// <summary>
+    /// Rectangle in interior coordinates that may extend into the border, e.g. the interior grown
+    /// by one pixel to the right and bottom.
+    /// </summary>
+    ImageView<T> view(const int x, const int y, const int w, const int h)
+    {
+        assert(x >= -m_border && y >= -m_border && x + w <= m_width + m_border && y + h <= m_height + m_border);
+        return ImageView<T>(row(y) + x, w, h, stride());
+    }
+    ImageView<const T> view(const int x, const int y, const int w, const int h) const
+    {
+        assert(x >= -m_border && y >= -m_border && x + w <= m_width + m_border && y + h <= m_height + m_border);
+        return ImageView<const T>(row(y) + x, w, h, stride());
+    }
+
+    /// <summary>
+    /// Overwrites the ghost pixels from the interior (or with zeros).
+    /// </summary>
+    void fillBorder(const GhostFill fill)
+    {
+        if (m_border == 0) {
+            return;
+        }
+        const int b = m_border;
+        const auto ghost = [&](const int x, const int y) {
+            const int sx = ghostSource(x, m_width, fill), sy = ghostSource(y, m_height, fill);
+            row(y)[x] = sx < 0 || sy < 0 ? T {} : row(sy)[sx];
+        };
+        // Ghost pixels read interior pixels only: the left and right ghost columns of the interior rows, then the ghost rows.
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_height) * b, KernelCost::Light))
+        for (int y = 0; y < m_height; y++) {
+            for (int x = -b; x < 0; x++) {
+                ghost(x, y);
+            }
+            for (int x = m_width; x < m_width + b; x++) {
+                ghost(x, y);
+            }
+        }
+        for (int y = -b; y < m_height + b; y += y == -1 ? m_height + 1 : 1) {
+            for (int x = -b; x < m_width + b; x++) {
+                ghost(x, y);
+            }
+        }
+    }
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    int m_border = 0;
+    Image<T> m_buffer;
+};
+
+/// <summary>
+/// Gradient of a width x height image in zero-bordered planes, see getGradientsPadded().
+/// </summary>
+struct PaddedGradient {
+    PaddedImage<float> dx;
+    PaddedImage<float> dy;
+
+    /// <summary>
+    /// The planes of getGradients(): the interior grown by the zero column and row of the border.
+    /// </summary>
+    ImageView<const float> dxView() const { return dx.view(0, 0, dx.width() + 1, dx.height() + 1); }
+    ImageView<const float> dyView() const { return dy.view(0, 0, dy.width() + 1, dy.height() + 1); }
+};
+
+/// <summary>
+/// getGradients() without bounds tests: the clamped ghost pixels of the image make the
+/// differences across the right and bottom edge zero.
+/// </summary>
+/// <param name="image">input scalar image with a border of at least 1, its border is clamped here</param>
+/// <returns>dx and dy of the image pixels with a zero border of 1</returns>
+PaddedGradient getGradientsPadded(PaddedImage<float>& image)
+{
+    assert(image.border() >= 1);
+    image.fillBorder(GhostFill::Clamp);
+    auto grad = PaddedGradient { PaddedImage<float>(image.width(), image.height(), 1), PaddedImage<float>(image.width(), image.height(), 1) };
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(image.width()) * image.height(), KernelCost::Light))
+    for (int y = 0; y < image.height(); y++) {
+        const float* row = image.row(y);
+        const float* below = image.row(y + 1);
+        float* dx = grad.dx.row(y);
+        float* dy = grad.dy.row(y);
+#pragma omp simd
+        for (int x = 0; x < image.width(); x++) {
+            dx[x] = row[x + 1] - row[x];
+            dy[x] = below[x] - row[x];
+        }
+    }
+    return grad;
+}
+
+/// <summary>
+/// getDivergence() without bounds tests: the zero ghost pixels left of and above the gradients
+/// are subtracted like the missing neighbors. The last row and column of getDivergence() are
+/// zero and stay in the border.
+/// </summary>
+/// <param name="gradients">gradients from getGradientsPadded()</param>
+/// <returns>div G of the (width + 1) x (height + 1) gradients with a zero border of 1; view(0, 0,
+/// width + 2, height + 2) is getDivergence()</returns>
+PaddedImage<float> getDivergencePadded(const PaddedGradient& gradients)
+{
+    const int width = gradients.dx.width() + 1, height = gradients.dx.height() + 1;
+    auto div_G = PaddedImage<float>(width, height, 1);
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        const float* dx = gradients.dx.row(y);
+        const float* dy = gradients.dy.row(y);
+        const float* dy_above = gradients.dy.row(y - 1);
+        float* out = div_G.row(y);
+#pragma omp simd
+        for (int x = 0; x < width; x++) {
+            out[x] = (dx[x] - dx[x - 1]) + (dy[x] - dy_above[x]);
+        }
+    }
+    return div_G;
+}
+
+#pragma endregion Padded images
@@ -0,0 +1,278 @@
+#pragma once
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include <framework/radiance_hdr.h>
+
+#include "color_pipeline.h"
+#include "planar_tone_map.h"
+#include "tone_map_encode.h"
+#include "your_code_here.h"
+
+/*
+ * Tone mapping on padded pixels (RGBA, 16 bytes per pixel) from decode to encode.
+ *
+ * An ImageRGB pixel is 12 bytes, so a vector of pixels starts at any multiple of 4 bytes, every
+ * few pixels straddle a cache line and the channels are gathered with shuffles. An ImageRgbPadded
+ * pixel is a glm::vec4 on a 16-byte boundary (the buffers are 64-byte aligned), four to a cache
+ * line, each loaded with one aligned load. The spare lane carries the luminance of the pixel:
+ *
+ *  - w is always rgbToLuminancePixel() of xyz, computed where the pixel is written (padRgb(),
+ *    loadRgbPadded(), the operators below), so the luminance of the input is computed once at
+ *    decode and the next stages read it with the color instead of from a separate image,
+ *  - durandLogLuminancePadded(), rescaleRgbByLuminancePadded(), durandComposePadded() and
+ *    rgbToXYZPadded() are the interleaved operators per pixel, with the same results up to fused
+ *    multiply-add rounding,
+ *  - writeRgbPadded() quantizes row by row into the encoder (integer formats).
+ *
+ * Whether padding or planes (planar_tone_map.h) is faster depends on the machine: padding costs a
+ * third more memory traffic than either of the others and needs no shuffles, planes need neither
+ * but three streams per image. The kernel benchmark times the three layouts side by side
+ * (durandLogLuminance, rescaleRgbByLuminance, durandCompose and rgbToXYZ, /interleaved, /planar
+ * and /padded), and the "rgb_layout" setting picks the one main.cpp runs Part I on.
+ */
+
+#pragma region Padded tone mapping
+
+/// <summary>
+/// Storage of the RGB pixels of Part I, see the "rgb_layout" setting.
+/// </summary>
+enum class RgbLayout {
+    // ImageRGB, 12 bytes per pixel.
+    Interleaved,
+    // ImageRgbPlanes, see planar_tone_map.h.
+    Planar,
+    // ImageRgbPadded, see above.
+    Padded,
+};
+
+/// <summary>
+/// RGB image with a pixel of 16 bytes, RGB in xyz and its luminance in w.
+/// </summary>
+using ImageRgbPadded = Image<glm::vec4>;
+
+/// <summary>
+/// Padded pixel of an RGB value, its luminance in w.
+/// </summary>
+inline glm::vec4 padRgbPixel(const glm::vec3& val) { return glm::vec4(val, rgbToLuminancePixel(val)); }
+
+/// <summary>
+/// Copies an interleaved RGB image into padded pixels.
+/// </summary>
+ImageRgbPadded padRgb(const ImageView<const glm::vec3> rgb)
+{
+    auto result = ImageRgbPadded::uninitialized(rgb.width, rgb.height);
+    parallelFor(0, rgb.height, rgb.width, KernelCost::Light, [&](const int y) {
+        const glm::vec3* in = rgb.row(y);
+        glm::vec4* out = result.data.data() + size_t(y) * size_t(rgb.width);
+#pragma omp simd
+        for (int x = 0; x < rgb.width; x++) {
+            out[x] = padRgbPixel(in[x]);
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Copies padded pixels into an interleaved RGB image, dropping w.
+/// </summary>
+ImageRGB unpadRgb(const ImageRgbPadded& rgb)
+{
+    auto result = ImageRGB::uninitialized(rgb.width, rgb.height);
+    const int num_pixels = int(rgb.data.size());
+    const glm::vec4* in = rgb.data.data();
+    glm::vec3* out = result.data.data();
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        out[i] = glm::vec3(in[i]);
+    }
+    return result;
+}
+
+/// <summary>
+/// Decodes an image into padded pixels, Radiance files without an interleaved copy.
+/// </summary>
+ImageRgbPadded loadRgbPadded(const std::filesystem::path& filePath)
+{
+    if (filePath.extension() != ".hdr") {
+        return padRgb(ImageRGB(filePath));
+    }
+    RadianceHdrReader reader(filePath);
+    auto result = ImageRgbPadded::uninitialized(reader.width(), reader.height());
+    const int width = reader.width();
+    std::vector<glm::vec3> scanline(static_cast<size_t>(width));
+    for (int y = 0; y < reader.height(); y++) {
+        if (!reader.readScanline(reinterpret_cast<float*>(scanline.data()))) {
+            std::cerr << "Failed to decode " << filePath << " at row " << y << std::endl;
+            throw std::exception();
+        }
+        glm::vec4* out = result.data.data() + size_t(y) * size_t(width);
+#pragma omp simd
+        for (int x = 0; x < width; x++) {
+            out[x] = padRgbPixel(scanline[x]);
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// rgbToLuminance() of padded pixels, their w.
+/// </summary>
+ImageFloat rgbToLuminancePadded(const ImageRgbPadded& rgb)
+{
+    const int num_pixels = int(rgb.data.size());
+    auto luminance = ImageFloat::uninitialized(rgb.width, rgb.height);
+    const glm::vec4* in = rgb.data.data();
+    float* out = luminance.data.data();
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        out[i] = in[i].w;
+    }
+    return luminance;
+}
+
+/// <summary>
+/// durandLogLuminance() of padded pixels.
+/// </summary>
+ImageFloat durandLogLuminancePadded(const ImageRgbPadded& rgb, const DurandParams& params = {})
+{
+    const int num_pixels = int(rgb.data.size());
+    auto log_lum_H = ImageFloat::uninitialized(rgb.width, rgb.height);
+    const glm::vec4* in = rgb.data.data();
+    float* out = log_lum_H.data.data();
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            out[i] = tmoLog<decltype(tier)::value>(std::max(in[i].w, 1e-8f));
+        }
+    });
+    return log_lum_H;
+}
+
+/// <summary>
+/// rescaleRgbByLuminance() of padded pixels, the original luminance from their w.
+/// </summary>
+ImageRgbPadded rescaleRgbByLuminancePadded(const ImageRgbPadded& rgb, const ImageFloat& new_luminance, const float saturation = 0.5f,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    const int num_pixels = int(rgb.data.size());
+    auto result = ImageRgbPadded::uninitialized(rgb.width, rgb.height);
+    const glm::vec4* in = rgb.data.data();
+    glm::vec4* out = result.data.data();
+    dispatchMathPrecision(precision, [&](auto tier) {
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            out[i] = padRgbPixel(rescaleRgbByLuminancePixel<decltype(tier)::value>(glm::vec3(in[i]), in[i].w, new_luminance.data[i], saturation));
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// durandCompose() of padded pixels, graded with params.look row by row.
+/// </summary>
+/// <returns>tone-mapped padded pixels</returns>
+ImageRgbPadded durandComposePadded(const ImageRgbPadded& rgb, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params = {})
+{
+    const int width = rgb.width, height = rgb.height;
+    auto result = ImageRgbPadded::uninitialized(width, height);
+    ColorPipeline finish;
+    finish.look(params.look);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+        {
+            // Interleaved row for the finishing steps, which work on vec3 pixels.
+            std::vector<glm::vec3> row(finish.stepCount() > 0 ? width : 0);
+#pragma omp for
+            for (int y = 0; y < height; y++) {
+                const size_t offset = size_t(y) * size_t(width);
+                const glm::vec4* in = rgb.data.data() + offset;
+                const float* log_lum = log_lum_H.data.data() + offset;
+                const float* base = base_image.data.data() + offset;
+                glm::vec4* out = result.data.data() + offset;
+                if (row.empty()) {
+#pragma omp simd
+                    for (int x = 0; x < width; x++) {
+                        const float b_val = base[x];
+                        const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, log_lum[x] - b_val, params.base_scale, params.output_gain);
+                        out[x] = padRgbPixel(rescaleRgbByLuminancePixel<decltype(tier)::value>(glm::vec3(in[x]), in[x].w, tmo_luminance, params.saturation));
+                    }
+                    continue;
+                }
+#pragma omp simd
+                for (int x = 0; x < width; x++) {
+                    const float b_val = base[x];
+                    const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, log_lum[x] - b_val, params.base_scale, params.output_gain);
+                    row[x] = rescaleRgbByLuminancePixel<decltype(tier)::value>(glm::vec3(in[x]), in[x].w, tmo_luminance, params.saturation);
+                }
+                finish.applyRow(row.data(), row.data(), width);
+#pragma omp simd
+                for (int x = 0; x < width; x++) {
+                    out[x] = padRgbPixel(row[x]);
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// toneMapDurand() of padded pixels, graded with params.look.
+/// </summary>
+ImageRgbPadded toneMapDurandPadded(const ImageRgbPadded& hdr, const DurandParams& params = {})
+{
+    const auto log_lum_H = durandLogLuminancePadded(hdr, params);
+    AutoContrast auto_contrast(params, log_lum_H.width, log_lum_H.height);
+    const auto base_image = params.color_guide
+        ? durandBaseLayer(unpadRgb(hdr), log_lum_H, params, auto_contrast.stats())
+        : bilateralFilter(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+    return durandComposePadded(hdr, log_lum_H, base_image, auto_contrast.resolve());
+}
+
+/// <summary>
+/// rgbToXYZ() of padded pixels, into the planes of the Poisson edit.
+/// </summary>
+ImageXYZ rgbToXYZPadded(const ImageRgbPadded& rgb)
+{
+    const int num_pixels = int(rgb.data.size());
+    auto xyz = uninitializedPlanes(rgb.width, rgb.height);
+    const glm::vec4* in = rgb.data.data();
+    float* p0 = xyz.X.data.data();
+    float* p1 = xyz.Y.data.data();
+    float* p2 = xyz.Z.data.data();
+    const auto& m = RGB_TO_XYZ_AFFINE.m;
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        const glm::vec4 v = in[i];
+        p0[i] = m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z;
+        p1[i] = m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z;
+        p2[i] = m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z;
+    }
+    return xyz;
+}
+
+/// <summary>
+/// Writes padded pixels to a file, quantized row by row for the integer formats, through
+/// unpadRgb() for the others.
+/// </summary>
+void writeRgbPadded(const ImageRgbPadded& rgb, const std::filesystem::path& filePath)
+{
+    if (!isFusedEncodeOutput(filePath)) {
+        unpadRgb(rgb).writeToFile(filePath);
+        return;
+    }
+    const int width = rgb.width;
+    writeQuantizedRgbFile(filePath, width, rgb.height, [&](auto zero) {
+        return quantizeRgbRows<decltype(zero)>(width, rgb.height, KernelCost::Light, [&](const int y, glm::vec3* row) {
+            const glm::vec4* in = rgb.data.data() + size_t(y) * size_t(width);
+#pragma omp simd
+            for (int x = 0; x < width; x++) {
+                row[x] = glm::vec3(in[x]);
+            }
+        });
+    });
+}
+
+#pragma endregion Padded tone mapping
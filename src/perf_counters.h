@@ -0,0 +1,164 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Hardware performance counters of the process (Linux perf_event).
+ *
+ * PerfCounters counts CPU cycles, retired instructions and last-level cache misses in user space
+ * over all threads of the process: one counter per event is opened on every thread that exists
+ * when counting starts (the OpenMP pool) and inherited by threads created meanwhile, as
+ * "perf stat -p" does, and the counts are summed. Counts of multiplexed counters are scaled by
+ * their enabled / running time.
+ *
+ * The memory traffic is estimated as one 64-byte line per LLC miss (demand loads and stores that
+ * missed, the prefetched lines are not included), which is portable across CPUs where the
+ * memory-controller counters are not. With perf_event_paranoid <= 2 no privileges are needed;
+ * where perf_event_open() is unavailable (other systems, containers without the syscall)
+ * available() is false and the benchmarks report no counters.
+ */
+
+#pragma region Performance counters
+
+/// <summary>
+/// Counts of one measured region, see PerfCounters.
+/// </summary>
+struct PerfCounterValues {
+    double cycles = 0.0;
+    double instructions = 0.0;
+    double llc_misses = 0.0;
+
+    double ipc() const { return cycles > 0.0 ? instructions / cycles : 0.0; }
+    // Estimated DRAM traffic, one cache line per LLC miss.
+    double dramBytes() const { return llc_misses * 64.0; }
+};
+
+/// <summary>
+/// Cycles, instructions and LLC misses of all threads of the process, see above.
+/// </summary>
+class PerfCounters {
+public:
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+    ~PerfCounters() { close(); }
+
+    /// <summary>
+    /// Whether the counters can be opened in this process (probed once).
+    /// </summary>
+    static bool available()
+    {
+#ifdef __linux__
+        static const bool result = [] {
+            const int fd = openCounter(PERF_COUNT_HW_CPU_CYCLES, 0);
+            if (fd < 0) {
+                return false;
+            }
+            ::close(fd);
+            return true;
+        }();
+        return result;
+#else
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// Opens and starts the counters on every thread of the process.
+    /// </summary>
+    /// <returns>false when no counter could be opened</returns>
+    bool start()
+    {
+        close();
+#ifdef __linux__
+        for (const auto& entry : std::filesystem::directory_iterator("/proc/self/task")) {
+            const int tid = std::stoi(entry.path().filename().string());
+            for (size_t event = 0; event < kEvents.size(); event++) {
+                const int fd = openCounter(kEvents[event], tid);
+                if (fd >= 0) {
+                    m_fds[event].push_back(fd);
+                }
+            }
+        }
+        for (const auto& fds : m_fds) {
+            for (const int fd : fds) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        return !m_fds[0].empty();
+#else
+        return false;
+#endif
+    }
+
+    /// <summary>
+    /// Stops the counters and returns the counts since start().
+    /// </summary>
+    PerfCounterValues stop()
+    {
+        std::array<double, 3> totals {};
+#ifdef __linux__
+        for (size_t event = 0; event < kEvents.size(); event++) {
+            for (const int fd : m_fds[event]) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                // value, time enabled, time running
+                uint64_t values[3] = {};
+                if (read(fd, values, sizeof(values)) == ssize_t(sizeof(values)) && values[2] > 0) {
+                    totals[event] += double(values[0]) * double(values[1]) / double(values[2]);
+                }
+            }
+        }
+#endif
+        close();
+        return { totals[0], totals[1], totals[2] };
+    }
+
+private:
+#ifdef __linux__
+    static constexpr std::array<uint64_t, 3> kEvents { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES };
+
+    static int openCounter(const uint64_t config, const int tid)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return int(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+    }
+#endif
+
+    void close()
+    {
+#ifdef __linux__
+        for (auto& fds : m_fds) {
+            for (const int fd : fds) {
+                ::close(fd);
+            }
+            fds.clear();
+        }
+#endif
+    }
+
+    std::array<std::vector<int>, 3> m_fds;
+};
+
+#pragma endregion Performance counters
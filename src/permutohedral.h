@@ -0,0 +1,383 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "helpers.h"
+
+/*
+ * Permutohedral lattice (Adams, Baek and Davis 2010) for bilateral filters with a vector guide.
+ *
+ * Every pixel has a position in d dimensions, e.g. (x, y) / space_sigma and the RGB of a guide
+ * image / range_sigma. Positions are lifted onto the hyperplane of the (d + 1)-dimensional
+ * permutohedral lattice, whose cells are simplices with d + 1 vertices. A value is splatted to
+ * the vertices of its simplex with barycentric weights, the vertices are blurred with a
+ * [1 2 1] / 4 kernel along each of the d + 1 lattice directions (a Gaussian of sigma 1 in the
+ * input positions), and every pixel slices the blurred values back with the same weights.
+ * Only the vertices that pixels touch exist, at most (d + 1) per pixel and far fewer in
+ * practice, kept in a hash table; the cost is O(pixels * d^2) and does not depend on the sigmas.
+ *
+ * A dense grid in 5 dimensions (bilateral_grid.h in 3) would be impractical. The lattice is built
+ * once per guide, so filtering several planes with one guide (the log-luminance of a tone
+ * mapping, a soft mask) only repeats the splat, blur and slice.
+ *
+ * jointBilateralFilter() filters a plane guided by an RGB image, durandColorGuide() is the guide
+ * of the tone mapping (log of each channel, so range_sigma keeps its meaning in log units), and
+ * bilateralFilterPermutohedral() is the scalar filter with the guide (x, y, H) for comparisons
+ * against the other engines.
+ */
+
+#pragma region Permutohedral lattice
+
+/// <summary>
+/// Lattice of one set of positions, see above.
+/// </summary>
+class PermutohedralLattice {
+public:
+    /// <param name="positions">num_points * dimensions coordinates, already divided by their sigmas</param>
+    /// <param name="dimensions">number of coordinates per point</param>
+    PermutohedralLattice(const std::vector<float>& positions, const int dimensions)
+        : m_d(dimensions)
+        , m_num_points(positions.size() / size_t(std::max(dimensions, 1)))
+    {
+        assert(dimensions > 0 && positions.size() % size_t(dimensions) == 0);
+        const int d = m_d;
+        const int vertices_per_point = d + 1;
+
+        // Simplex vertices and barycentric weights of every point, in parallel.
+        std::vector<int32_t> point_keys(m_num_points * size_t(vertices_per_point) * size_t(d));
+        m_weights.resize(m_num_points * size_t(vertices_per_point));
+        std::vector<float> scale(vertices_per_point - 1);
+        const float inv_std_dev = std::sqrt(2.0f / 3.0f) * float(d + 1);
+        for (int i = 0; i < d; i++) {
+            scale[size_t(i)] = inv_std_dev / std::sqrt(float((i + 1) * (i + 2)));
+        }
+        // Vertex offsets of the canonical simplex, remainder-major.
+        std::vector<int> canonical(size_t(vertices_per_point) * size_t(vertices_per_point));
+        for (int i = 0; i <= d; i++) {
+            for (int j = 0; j <= d - i; j++) {
+                canonical[size_t(i) * size_t(vertices_per_point) + size_t(j)] = i;
+            }
+            for (int j = d - i + 1; j <= d; j++) {
+                canonical[size_t(i) * size_t(vertices_per_point) + size_t(j)] = i - (d + 1);
+            }
+        }
+#pragma omp parallel num_threads(kernelThreads(int64_t(m_num_points), KernelCost::Heavy))
+        {
+            std::vector<float> elevated(size_t(d) + 1), barycentric(size_t(d) + 2);
+            std::vector<int> greedy(size_t(d) + 1), rank(size_t(d) + 1);
+#pragma omp for
+            for (int p = 0; p < int(m_num_points); p++) {
+                const float* position = positions.data() + size_t(p) * size_t(d);
+                // Elevate onto the hyperplane x_0 + ... + x_d = 0.
+                float sum_coords = 0.0f;
+                for (int i = d; i > 0; i--) {
+                    const float coord = position[i - 1] * scale[size_t(i - 1)];
+                    elevated[size_t(i)] = sum_coords - float(i) * coord;
+                    sum_coords += coord;
+                }
+                elevated[0] = sum_coords;
+
+                // Nearest remainder-0 point, then the rank of each coordinate's fractional part.
+                int sum = 0;
+                for (int i = 0; i <= d; i++) {
+                    const float v = elevated[size_t(i)] / float(d + 1);
+                    const int up = int(std::ceil(v)) * (d + 1);
+                    const int down = int(std::floor(v)) * (d + 1);
+                    greedy[size_t(i)] = float(up) - elevated[size_t(i)] < elevated[size_t(i)] - float(down) ? up : down;
+                    sum += greedy[size_t(i)];
+                }
+                sum /= d + 1;
+                std::fill(rank.begin(), rank.end(), 0);
+                for (int i = 0; i < d; i++) {
+                    for (int j = i + 1; j <= d; j++) {
+                        if (elevated[size_t(i)] - float(greedy[size_t(i)]) < elevated[size_t(j)] - float(greedy[size_t(j)])) {
+                            rank[size_t(i)]++;
+                        } else {
+                            rank[size_t(j)]++;
+                        }
+                    }
+                }
+                if (sum > 0) {
+                    for (int i = 0; i <= d; i++) {
+                        if (rank[size_t(i)] >= d + 1 - sum) {
+                            greedy[size_t(i)] -= d + 1;
+                            rank[size_t(i)] += sum - (d + 1);
+                        } else {
+                            rank[size_t(i)] += sum;
+                        }
+                    }
+                } else if (sum < 0) {
+                    for (int i = 0; i <= d; i++) {
+                        if (rank[size_t(i)] < -sum) {
+                            greedy[size_t(i)] += d + 1;
+                            rank[size_t(i)] += (d + 1) + sum;
+                        } else {
+                            rank[size_t(i)] += sum;
+                        }
+                    }
+                }
+
+                std::fill(barycentric.begin(), barycentric.end(), 0.0f);
+                for (int i = 0; i <= d; i++) {
+                    const float delta = (elevated[size_t(i)] - float(greedy[size_t(i)])) / float(d + 1);
+                    barycentric[size_t(d - rank[size_t(i)])] += delta;
+                    barycentric[size_t(d + 1 - rank[size_t(i)])] -= delta;
+                }
+                barycentric[0] += 1.0f + barycentric[size_t(d) + 1];
+
+                for (int remainder = 0; remainder <= d; remainder++) {
+                    const size_t slot = size_t(p) * size_t(vertices_per_point) + size_t(remainder);
+                    int32_t* key = point_keys.data() + slot * size_t(d);
+                    for (int i = 0; i < d; i++) {
+                        key[i] = greedy[size_t(i)] + canonical[size_t(remainder) * size_t(vertices_per_point) + size_t(rank[size_t(i)])];
+                    }
+                    m_weights[slot] = barycentric[size_t(remainder)];
+                }
+            }
+        }
+
+        // Unique vertices. The last coordinate follows from the others (they sum to 0).
+        m_table.assign(std::bit_ceil(std::max<size_t>(m_num_points, 1024)), -1);
+        m_offsets.resize(m_num_points * size_t(vertices_per_point));
+        for (size_t slot = 0; slot < m_offsets.size(); slot++) {
+            m_offsets[slot] = insert(point_keys.data() + slot * size_t(d));
+        }
+
+        // Neighbours of every vertex along the d + 1 lattice directions, -1 where absent.
+        const int num_vertices = int(numVertices());
+        m_neighbours.assign(size_t(num_vertices) * size_t(vertices_per_point) * 2, -1);
+#pragma omp parallel num_threads(kernelThreads(int64_t(m_num_points), KernelCost::Heavy))
+        {
+            std::vector<int32_t> forward(vertices_per_point - 1), backward(vertices_per_point - 1);
+#pragma omp for
+            for (int v = 0; v < num_vertices; v++) {
+                const int32_t* key = m_keys.data() + size_t(v) * size_t(d);
+                for (int j = 0; j <= d; j++) {
+                    for (int k = 0; k < d; k++) {
+                        forward[size_t(k)] = key[k] + 1;
+                        backward[size_t(k)] = key[k] - 1;
+                    }
+                    if (j < d) {
+                        forward[size_t(j)] = key[j] - d;
+                        backward[size_t(j)] = key[j] + d;
+                    }
+                    const size_t base = (size_t(v) * size_t(vertices_per_point) + size_t(j)) * 2;
+                    m_neighbours[base] = find(forward.data());
+                    m_neighbours[base + 1] = find(backward.data());
+                }
+            }
+        }
+    }
+
+    size_t numPoints() const { return m_num_points; }
+    size_t numVertices() const { return m_keys.size() / size_t(m_d); }
+
+    /// <summary>
+    /// Normalized Gaussian filter of one value per point in the space of the positions.
+    /// Points without weight keep their value.
+    /// </summary>
+    /// <param name="values">numPoints() values</param>
+    /// <param name="result">numPoints() filtered values</param>
+    void filter(const std::span<const float> values, const std::span<float> result) const
+    {
+        assert(values.size() == m_num_points && result.size() == m_num_points);
+        const size_t vertices_per_point = size_t(m_d) + 1;
+        const int num_vertices = int(numVertices());
+
+        // Splat (weighted value, weight). Points share vertices, so this pass is sequential.
+        std::vector<glm::vec2> splat(size_t(num_vertices), glm::vec2(0.0f));
+        for (size_t p = 0; p < m_num_points; p++) {
+            for (size_t k = 0; k < vertices_per_point; k++) {
+                const size_t slot = p * vertices_per_point + k;
+                splat[size_t(m_offsets[slot])] += m_weights[slot] * glm::vec2(values[p], 1.0f);
+            }
+        }
+
+        // Blur along every lattice direction.
+        std::vector<glm::vec2> blurred(splat.size());
+        for (size_t j = 0; j < vertices_per_point; j++) {
+#pragma omp parallel for num_threads(kernelThreads(int64_t(num_vertices), KernelCost::Light))
+            for (int v = 0; v < num_vertices; v++) {
+                const size_t base = (size_t(v) * vertices_per_point + j) * 2;
+                const int32_t forward = m_neighbours[base];
+                const int32_t backward = m_neighbours[base + 1];
+                glm::vec2 sum = 0.5f * splat[size_t(v)];
+                if (forward >= 0) {
+                    sum += 0.25f * splat[size_t(forward)];
+                }
+                if (backward >= 0) {
+                    sum += 0.25f * splat[size_t(backward)];
+                }
+                blurred[size_t(v)] = sum;
+            }
+            std::swap(splat, blurred);
+        }
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(m_num_points), KernelCost::Medium))
+        for (int p = 0; p < int(m_num_points); p++) {
+            glm::vec2 sum(0.0f);
+            for (size_t k = 0; k < vertices_per_point; k++) {
+                const size_t slot = size_t(p) * vertices_per_point + k;
+                sum += m_weights[slot] * splat[size_t(m_offsets[slot])];
+            }
+            result[size_t(p)] = sum.y > 1e-20f ? sum.x / sum.y : values[size_t(p)];
+        }
+    }
+
+private:
+    size_t hash(const int32_t* key) const
+    {
+        uint64_t h = 0;
+        for (int i = 0; i < m_d; i++) {
+            h = (h + uint64_t(uint32_t(key[i]))) * 2531011ull;
+        }
+        return size_t(h ^ (h >> 29)) & (m_table.size() - 1);
+    }
+
+    bool sameKey(const int32_t vertex, const int32_t* key) const
+    {
+        return std::equal(key, key + m_d, m_keys.data() + size_t(vertex) * size_t(m_d));
+    }
+
+    int32_t find(const int32_t* key) const
+    {
+        for (size_t h = hash(key);; h = (h + 1) & (m_table.size() - 1)) {
+            if (m_table[h] < 0 || sameKey(m_table[h], key)) {
+                return m_table[h];
+            }
+        }
+    }
+
+    int32_t insert(const int32_t* key)
+    {
+        if (2 * (numVertices() + 1) > m_table.size()) {
+            // Rehash into twice the size.
+            m_table.assign(m_table.size() * 2, -1);
+            for (int32_t v = 0; v < int32_t(numVertices()); v++) {
+                size_t h = hash(m_keys.data() + size_t(v) * size_t(m_d));
+                while (m_table[h] >= 0) {
+                    h = (h + 1) & (m_table.size() - 1);
+                }
+                m_table[h] = v;
+            }
+        }
+        for (size_t h = hash(key);; h = (h + 1) & (m_table.size() - 1)) {
+            if (m_table[h] < 0) {
+                m_table[h] = int32_t(numVertices());
+                m_keys.insert(m_keys.end(), key, key + m_d);
+                return m_table[h];
+            }
+            if (sameKey(m_table[h], key)) {
+                return m_table[h];
+            }
+        }
+    }
+
+    int m_d;
+    size_t m_num_points;
+    // Per point: the d + 1 vertices of its simplex and their barycentric weights.
+    std::vector<int32_t> m_offsets;
+    std::vector<float> m_weights;
+    // Per vertex: d key coordinates, and forward / backward neighbours per direction.
+    std::vector<int32_t> m_keys;
+    std::vector<int32_t> m_neighbours;
+    // Open addressing from key hashes to vertices, -1 = empty, at most half full.
+    std::vector<int32_t> m_table;
+};
+
+/// <summary>
+/// Guide of the tone mapping for jointBilateralFilter(): the log of each RGB channel.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <returns>log RGB</returns>
+ImageRGB durandColorGuide(const ImageRGB& hdr_image)
+{
+    auto guide = ImageRGB::uninitialized(hdr_image.width, hdr_image.height);
+#pragma omp parallel for num_threads(kernelThreads(hdr_image, KernelCost::Medium))
+    for (int i = 0; i < int(hdr_image.data.size()); i++) {
+        guide.data[size_t(i)] = glm::log(glm::max(hdr_image.data[size_t(i)], glm::vec3(1e-8f)));
+    }
+    return guide;
+}
+
+/// <summary>
+/// Lattice of the positions (x, y) / space_sigma, guide / range_sigma.
+/// </summary>
+/// <param name="guide">RGB guide, e.g. durandColorGuide()</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">sigma of the gaussian kernel on the guide channels.</param>
+PermutohedralLattice colorGuideLattice(const ImageRGB& guide, const float space_sigma, const float range_sigma)
+{
+    constexpr int d = 5;
+    const float inv_space = 1.0f / std::max(space_sigma, 1e-3f);
+    const float inv_range = 1.0f / std::max(range_sigma, 1e-6f);
+    std::vector<float> positions(guide.data.size() * size_t(d));
+#pragma omp parallel for num_threads(kernelThreads(guide, KernelCost::Light))
+    for (int y = 0; y < guide.height; y++) {
+        for (int x = 0; x < guide.width; x++) {
+            const size_t i = size_t(y) * size_t(guide.width) + size_t(x);
+            float* position = positions.data() + i * size_t(d);
+            position[0] = float(x) * inv_space;
+            position[1] = float(y) * inv_space;
+            position[2] = guide.data[i].r * inv_range;
+            position[3] = guide.data[i].g * inv_range;
+            position[4] = guide.data[i].b * inv_range;
+        }
+    }
+    return PermutohedralLattice(positions, d);
+}
+
+/// <summary>
+/// Joint (cross) bilateral filter of a plane with an RGB guide of the same size, see above.
+/// </summary>
+/// <param name="H">The plane to be filtered, e.g. the log-luminance or a soft mask.</param>
+/// <param name="guide">RGB guide, e.g. durandColorGuide()</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">sigma of the gaussian kernel on the guide channels.</param>
+/// <returns>ImageFloat, the filtered plane.</returns>
+ImageFloat jointBilateralFilter(const ImageFloat& H, const ImageRGB& guide, const float space_sigma, const float range_sigma)
+{
+    assert(H.width == guide.width && H.height == guide.height);
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+    colorGuideLattice(guide, space_sigma, range_sigma).filter(H.data, result.data);
+    return result;
+}
+
+/// <summary>
+/// Approximates bilateralFilter() on the lattice of (x, y, H). The filter size is not used: the
+/// spatial Gaussian is not truncated.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilterPermutohedral(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma)
+{
+    // The filter size is always odd.
+    assert(size % 2 == 1);
+
+    constexpr int d = 3;
+    const float inv_space = 1.0f / std::max(space_sigma, 1e-3f);
+    const float inv_range = 1.0f / std::max(range_sigma, 1e-6f);
+    std::vector<float> positions(H.data.size() * size_t(d));
+#pragma omp parallel for num_threads(kernelThreads(H, KernelCost::Light))
+    for (int y = 0; y < H.height; y++) {
+        for (int x = 0; x < H.width; x++) {
+            const size_t i = size_t(y) * size_t(H.width) + size_t(x);
+            positions[i * d] = float(x) * inv_space;
+            positions[i * d + 1] = float(y) * inv_space;
+            positions[i * d + 2] = H.data[i] * inv_range;
+        }
+    }
+    auto result = ImageFloat::uninitialized(H.width, H.height);
+    PermutohedralLattice(positions, d).filter(H.data, result.data);
+    return result;
+}
+
+#pragma endregion Permutohedral lattice
@@ -0,0 +1,281 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <framework/image_allocator.h>
+
+#include "helpers.h"
+
+/*
+ * Tiled and Z-order (Morton) pixel layouts.
+ *
+ * Image<T> stores rows one after the other (getImageOffset() is y * width + x), so the vertical
+ * neighbors of a stencil are a row apart in memory: the 27 rows of a 27x27 bilateral window
+ * touch 27 cache lines and at large widths as many pages. A LayoutImage stores the pixels in
+ * square tiles, row by row within the tile (Tiled8, Tiled16) or in Z order within 32x32 tiles
+ * (Morton), with the tiles in row-major order; the image is padded to whole tiles. Nearby pixels
+ * in both directions are then nearby in memory.
+ *
+ * Kernels are written against getImageOffset() of a LayoutImage and visit the image tile by
+ * tile with forEachLayoutTile() (row by row for RowMajor), so they traverse the storage in
+ * order; the arithmetic does not depend on the layout, and the layouts give the same bits.
+ * Images are converted at the boundary of a layout kernel (LayoutImage(view), toImage()). The
+ * brute-force bilateral filter and the Jacobi solve are provided, the two stencils whose
+ * neighbors span rows, and are benchmarked in every layout ("--benchmark").
+ */
+
+#pragma region Pixel layouts
+
+/// <summary>
+/// Order of the pixels of a LayoutImage in memory.
+/// </summary>
+enum class PixelLayout {
+    RowMajor,
+    // 8x8 and 16x16 tiles, row-major inside.
+    Tiled8,
+    Tiled16,
+    // 32x32 tiles in Z order inside.
+    Morton,
+};
+
+/// <summary>
+/// Log2 of the tile side of a layout, 0 for RowMajor.
+/// </summary>
+constexpr int layoutTileShift(const PixelLayout layout)
+{
+    switch (layout) {
+    case PixelLayout::Tiled8:
+        return 3;
+    case PixelLayout::Tiled16:
+        return 4;
+    case PixelLayout::Morton:
+        return 5;
+    default:
+        return 0;
+    }
+}
+
+/// <summary>
+/// Spreads the 5 low bits of v to the even bits (abcde -> 0a0b0c0d0e).
+/// </summary>
+constexpr uint32_t spreadMortonBits(uint32_t v)
+{
+    v = (v | (v << 4)) & 0x0F0Fu;
+    v = (v | (v << 2)) & 0x3333u;
+    v = (v | (v << 1)) & 0x5555u;
+    return v;
+}
+
+/// <summary>
+/// Storage index of pixel (x, y) of a width x height image in layout L.
+/// </summary>
+template <PixelLayout L>
+struct LayoutIndex {
+    static constexpr int shift = layoutTileShift(L);
+    static constexpr int tile = 1 << shift;
+    static constexpr int mask = tile - 1;
+
+    int width = 0;
+    int height = 0;
+    // Tiles per tile row (the width for RowMajor).
+    int tiles_x = 0;
+    int tiles_y = 0;
+
+    LayoutIndex() = default;
+    LayoutIndex(const int width_, const int height_)
+        : width(width_)
+        , height(height_)
+        , tiles_x((width_ + mask) >> shift)
+        , tiles_y((height_ + mask) >> shift)
+    {
+    }
+
+    /// <summary>
+    /// Elements of the storage, the image padded to whole tiles.
+    /// </summary>
+    size_t size() const { return size_t(tiles_x) * size_t(tiles_y) << (2 * shift); }
+
+    size_t operator()(const int x, const int y) const
+    {
+        if constexpr (L == PixelLayout::RowMajor) {
+            return size_t(y) * size_t(width) + size_t(x);
+        } else {
+            const size_t tile_base = (size_t(y >> shift) * size_t(tiles_x) + size_t(x >> shift)) << (2 * shift);
+            if constexpr (L == PixelLayout::Morton) {
+                return tile_base | spreadMortonBits(uint32_t(x & mask)) | (spreadMortonBits(uint32_t(y & mask)) << 1);
+            } else {
+                return tile_base | (size_t(y & mask) << shift) | size_t(x & mask);
+            }
+        }
+    }
+};
+
+/// <summary>
+/// Image with its pixels in layout L, see above.
+/// </summary>
+template <typename T, PixelLayout L>
+class LayoutImage {
+public:
+    int width = 0;
+    int height = 0;
+    LayoutIndex<L> index;
+    std::vector<T, ImageAllocator<T>> data;
+
+    LayoutImage() = default;
+
+    /// <summary>
+    /// Zero-initialized image.
+    /// </summary>
+    LayoutImage(const int width_, const int height_)
+        : width(width_)
+        , height(height_)
+        , index(width_, height_)
+        , data(index.size())
+    {
+    }
+
+    /// <summary>
+    /// Converts a row-major image.
+    /// </summary>
+    explicit LayoutImage(const ImageView<const T> image)
+        : LayoutImage(image.width, image.height)
+    {
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            const T* row = image.row(y);
+            for (int x = 0; x < width; x++) {
+                data[index(x, y)] = row[x];
+            }
+        }
+    }
+
+    /// <summary>
+    /// Converts back to a row-major image.
+    /// </summary>
+    Image<T> toImage() const
+    {
+        auto result = Image<T>::uninitialized(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+        for (int y = 0; y < height; y++) {
+            T* row = result.data.data() + size_t(y) * size_t(width);
+            for (int x = 0; x < width; x++) {
+                row[x] = data[index(x, y)];
+            }
+        }
+        return result;
+    }
+};
+
+/// <summary>
+/// Offset of pixel (x, y) in the data of a layout image.
+/// </summary>
+template <typename T, PixelLayout L>
+size_t getImageOffset(const LayoutImage<T, L>& image, const int x, const int y)
+{
+    return image.index(x, y);
+}
+
+/// <summary>
+/// Calls tile(x0, y0, x1, y1) for the tiles of a width x height image in layout L (single rows
+/// for RowMajor), in storage order within a tile row; tile rows run in parallel.
+/// </summary>
+template <PixelLayout L, typename Tile>
+void forEachLayoutTile(const int width, const int height, const KernelCost cost, const Tile& tile)
+{
+    constexpr int side = 1 << layoutTileShift(L);
+    const int tile_rows = (height + side - 1) / side;
+#pragma omp parallel for schedule(dynamic) num_threads(kernelThreads(int64_t(width) * height, cost))
+    for (int ty = 0; ty < tile_rows; ty++) {
+        const int y0 = ty * side, y1 = std::min(y0 + side, height);
+        if constexpr (L == PixelLayout::RowMajor) {
+            tile(0, y0, width, y1);
+        } else {
+            for (int x0 = 0; x0 < width; x0 += side) {
+                tile(x0, y0, std::min(x0 + side, width), y1);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// bilateralFilterBruteForce() of an image in layout L: the same windows, clipped at the image
+/// edge and evaluated in the same order, so the result has the same bits.
+/// </summary>
+/// <param name="H">input image</param>
+/// <param name="size">odd filter size</param>
+/// <param name="space_sigma">spatial sigma</param>
+/// <param name="range_sigma">range sigma</param>
+/// <returns>filtered image in layout L</returns>
+template <PixelLayout L>
+LayoutImage<float, L> bilateralFilterLayout(const LayoutImage<float, L>& H, const int size, const float space_sigma, const float range_sigma)
+{
+    assert(size % 2 == 1);
+    const int radius = size / 2;
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
+        }
+    }
+
+    auto result = LayoutImage<float, L>(H.width, H.height);
+    forEachLayoutTile<L>(H.width, H.height, KernelCost::Heavy, [&](const int x0, const int y0, const int x1, const int y1) {
+        for (int y = y0; y < y1; y++) {
+            const int dy0 = std::max(-radius, -y), dy1 = std::min(radius, H.height - 1 - y);
+            for (int x = x0; x < x1; x++) {
+                const int dx0 = std::max(-radius, -x), dx1 = std::min(radius, H.width - 1 - x);
+                const float val = H.data[getImageOffset(H, x, y)];
+                float K = 0.0f;
+                float filteredValue = 0.0f;
+                for (int dy = dy0; dy <= dy1; dy++) {
+                    for (int dx = dx0; dx <= dx1; dx++) {
+                        const float n_val = H.data[getImageOffset(H, x + dx, y + dy)];
+                        float rangeWeight = exp(-(val - n_val) * (val - n_val) / (2.0f * range_sigma * range_sigma));
+                        float weight = spatialWeights[(dy + radius) * size + (dx + radius)] * rangeWeight;
+                        filteredValue += weight * n_val;
+                        K += weight;
+                    }
+                }
+                result.data[getImageOffset(result, x, y)] = filteredValue / K;
+            }
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Jacobi iterations of solvePoisson() on images in layout L, the border of the solution is the
+/// Dirichlet condition. The update of every pixel is the expression of solvePoisson(), so the
+/// result has the same bits.
+/// </summary>
+/// <param name="initial_solution">initial solution and border values</param>
+/// <param name="divergence_G">div G, at least as large as the solution</param>
+/// <param name="num_iters">iterations</param>
+/// <returns>solution in layout L</returns>
+template <PixelLayout L>
+LayoutImage<float, L> solvePoissonJacobiLayout(const LayoutImage<float, L>& initial_solution, const LayoutImage<float, L>& divergence_G, const int num_iters)
+{
+    auto current = initial_solution;
+    auto next = initial_solution;
+    const int width = current.width, height = current.height;
+    for (int iter = 0; iter < num_iters; iter++) {
+        forEachLayoutTile<L>(width, height, KernelCost::Light, [&](const int x0, const int y0, const int x1, const int y1) {
+            for (int y = std::max(y0, 1); y < std::min(y1, height - 1); y++) {
+                for (int x = std::max(x0, 1); x < std::min(x1, width - 1); x++) {
+                    const auto at = [&](const int px, const int py) { return current.data[getImageOffset(current, px, py)]; };
+                    next.data[getImageOffset(next, x, y)]
+                        = 0.25f * (at(x + 1, y) + at(x - 1, y) + at(x, y + 1) + at(x, y - 1) - divergence_G.data[getImageOffset(divergence_G, x, y)]);
+                }
+            }
+        });
+        std::swap(current, next);
+    }
+    return current;
+}
+
+#pragma endregion Pixel layouts
@@ -0,0 +1,250 @@
+#pragma once
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include <framework/radiance_hdr.h>
+
+#include "color_pipeline.h"
+#include "color_simd.h"
+#include "tone_map_encode.h"
+#include "your_code_here.h"
+
+/*
+ * Tone mapping on planes (structure of arrays) from decode to encode.
+ *
+ * The operators of your_code_here.h read and write interleaved ImageRGB (vec3 per pixel) while the
+ * Poisson edit works on ImageXYZ planes, and imageVec3ToPlane3() / rgbToXYZ() copy the whole image
+ * between the two. The planar variants take R, G and B as the three planes of an ImageRgbPlanes, so
+ * every loop over a row reads three unit-stride float arrays and vectorizes without shuffles:
+ *
+ *  - loadRgbPlanes() decodes Radiance files scanline by scanline straight into the planes (other
+ *    formats are decoded and split once),
+ *  - rgbToLuminancePlanar(), durandLogLuminancePlanar(), rescaleRgbByLuminancePlanar() and
+ *    durandComposePlanar() are the interleaved operators per pixel, with the same results,
+ *  - durandComposePlanar() takes an output transform, so the Poisson target comes out as XYZ
+ *    planes (RGB_TO_XYZ_AFFINE) instead of as RGB that rgbToXYZ() copies again; the look of the
+ *    parameters is applied before it; transformPlanes() does the same afterwards, in place,
+ *  - writeRgbPlanes() interleaves and quantizes row by row into the encoder (integer formats).
+ *
+ * The joint filter of color_guide needs the interleaved guide, which is built for it alone.
+ * With the "planar" setting main.cpp runs Part I this way and, when the tone-mapped image is the
+ * target of the edit, hands it to Part II as XYZ planes (composed into them, or converted in place
+ * once 7_tmo_rgb is written), so the RGB target is never stored.
+ */
+
+#pragma region Planar tone mapping
+
+/// <summary>
+/// RGB image as three planes, R in X, G in Y and B in Z.
+/// </summary>
+using ImageRgbPlanes = ImageFloatPlane3;
+
+inline ImageRgbPlanes uninitializedPlanes(const int width, const int height)
+{
+    return ImageRgbPlanes(ImageFloat::uninitialized(width, height), ImageFloat::uninitialized(width, height), ImageFloat::uninitialized(width, height));
+}
+
+/// <summary>
+/// Decodes an image into RGB planes, Radiance files without an interleaved copy.
+/// </summary>
+ImageRgbPlanes loadRgbPlanes(const std::filesystem::path& filePath)
+{
+    if (filePath.extension() != ".hdr") {
+        return imageVec3ToPlane3Simd(ImageRGB(filePath));
+    }
+    RadianceHdrReader reader(filePath);
+    auto planes = uninitializedPlanes(reader.width(), reader.height());
+    const int width = reader.width();
+    std::vector<float> scanline(size_t(width) * 3);
+    for (int y = 0; y < reader.height(); y++) {
+        if (!reader.readScanline(scanline.data())) {
+            std::cerr << "Failed to decode " << filePath << " at row " << y << std::endl;
+            throw std::exception();
+        }
+        const size_t offset = size_t(y) * size_t(width);
+        float* r = planes.X.data.data() + offset;
+        float* g = planes.Y.data.data() + offset;
+        float* b = planes.Z.data.data() + offset;
+#pragma omp simd
+        for (int x = 0; x < width; x++) {
+            r[x] = scanline[3 * x];
+            g[x] = scanline[3 * x + 1];
+            b[x] = scanline[3 * x + 2];
+        }
+    }
+    return planes;
+}
+
+/// <summary>
+/// rgbToLuminance() of RGB planes.
+/// </summary>
+ImageFloat rgbToLuminancePlanar(const ImageRgbPlanes& rgb)
+{
+    const int num_pixels = int(rgb.X.data.size());
+    auto luminance = ImageFloat::uninitialized(rgb.X.width, rgb.X.height);
+    const float* r = rgb.X.data.data();
+    const float* g = rgb.Y.data.data();
+    const float* b = rgb.Z.data.data();
+    float* out = luminance.data.data();
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        out[i] = rgbToLuminancePixel(glm::vec3(r[i], g[i], b[i]));
+    }
+    return luminance;
+}
+
+/// <summary>
+/// durandLogLuminance() of RGB planes.
+/// </summary>
+ImageFloat durandLogLuminancePlanar(const ImageRgbPlanes& rgb, const DurandParams& params = {})
+{
+    const int num_pixels = int(rgb.X.data.size());
+    auto log_lum_H = ImageFloat::uninitialized(rgb.X.width, rgb.X.height);
+    const float* r = rgb.X.data.data();
+    const float* g = rgb.Y.data.data();
+    const float* b = rgb.Z.data.data();
+    float* out = log_lum_H.data.data();
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            out[i] = tmoLog<decltype(tier)::value>(std::max(rgbToLuminancePixel(glm::vec3(r[i], g[i], b[i])), 1e-8f));
+        }
+    });
+    return log_lum_H;
+}
+
+/// <summary>
+/// rescaleRgbByLuminance() of RGB planes.
+/// </summary>
+ImageRgbPlanes rescaleRgbByLuminancePlanar(const ImageRgbPlanes& rgb, const ImageFloat& original_luminance, const ImageFloat& new_luminance,
+    const float saturation = 0.5f, const MathPrecision precision = MathPrecision::Exact)
+{
+    const int num_pixels = int(rgb.X.data.size());
+    auto result = uninitializedPlanes(rgb.X.width, rgb.X.height);
+    dispatchMathPrecision(precision, [&](auto tier) {
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            const auto val = rescaleRgbByLuminancePixel<decltype(tier)::value>(glm::vec3(rgb.X.data[i], rgb.Y.data[i], rgb.Z.data[i]), original_luminance.data[i],
+                new_luminance.data[i], saturation);
+            result.X.data[i] = val.r;
+            result.Y.data[i] = val.g;
+            result.Z.data[i] = val.b;
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// durandCompose() of RGB planes, graded with params.look and transformed by output (e.g.
+/// RGB_TO_XYZ_AFFINE for the Poisson target) row by row.
+/// </summary>
+/// <returns>tone-mapped RGB planes, or their output transform</returns>
+ImageFloatPlane3 durandComposePlanar(const ImageRgbPlanes& rgb, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params = {},
+    const ColorAffine& output = ColorAffine::identity())
+{
+    const int width = rgb.X.width, height = rgb.X.height;
+    auto result = uninitializedPlanes(width, height);
+    ColorPipeline finish;
+    finish.look(params.look).affine(output);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+        {
+            // Interleaved row for the finishing steps, which work on pixels.
+            std::vector<glm::vec3> row(finish.stepCount() > 0 ? width : 0);
+#pragma omp for
+            for (int y = 0; y < height; y++) {
+                const size_t offset = size_t(y) * size_t(width);
+                const float* r = rgb.X.data.data() + offset;
+                const float* g = rgb.Y.data.data() + offset;
+                const float* b = rgb.Z.data.data() + offset;
+                const float* log_lum = log_lum_H.data.data() + offset;
+                const float* base = base_image.data.data() + offset;
+                float* out_0 = result.X.data.data() + offset;
+                float* out_1 = result.Y.data.data() + offset;
+                float* out_2 = result.Z.data.data() + offset;
+#pragma omp simd
+                for (int x = 0; x < width; x++) {
+                    const glm::vec3 val(r[x], g[x], b[x]);
+                    const float b_val = base[x];
+                    const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, log_lum[x] - b_val, params.base_scale, params.output_gain);
+                    const auto rescaled = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+                    out_0[x] = rescaled.r;
+                    out_1[x] = rescaled.g;
+                    out_2[x] = rescaled.b;
+                }
+                if (!row.empty()) {
+                    finish.applyPlanesRow(out_0, out_1, out_2, row.data(), width);
+#pragma omp simd
+                    for (int x = 0; x < width; x++) {
+                        out_0[x] = row[x].x;
+                        out_1[x] = row[x].y;
+                        out_2[x] = row[x].z;
+                    }
+                }
+            }
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// toneMapDurand() of RGB planes, see durandComposePlanar() for the output transform.
+/// </summary>
+ImageFloatPlane3 toneMapDurandPlanar(const ImageRgbPlanes& hdr, const DurandParams& params = {}, const ColorAffine& output = ColorAffine::identity())
+{
+    const auto log_lum_H = durandLogLuminancePlanar(hdr, params);
+    AutoContrast auto_contrast(params, log_lum_H.width, log_lum_H.height);
+    const auto base_image = params.color_guide
+        ? durandBaseLayer(imagePlane3ToVec3Simd(hdr), log_lum_H, params, auto_contrast.stats())
+        : bilateralFilter(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, auto_contrast.stats());
+    return durandComposePlanar(hdr, log_lum_H, base_image, auto_contrast.resolve(), output);
+}
+
+/// <summary>
+/// Applies an affine color transform to three planes in place, e.g. RGB_TO_XYZ_AFFINE.
+/// </summary>
+void transformPlanes(ImageFloatPlane3& planes, const ColorAffine& transform)
+{
+    const int num_pixels = int(planes.X.data.size());
+    float* p0 = planes.X.data.data();
+    float* p1 = planes.Y.data.data();
+    float* p2 = planes.Z.data.data();
+    const auto& m = transform.m;
+    const auto& offset = transform.offset;
+#pragma omp parallel for simd num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        const float v0 = p0[i], v1 = p1[i], v2 = p2[i];
+        p0[i] = m[0][0] * v0 + m[0][1] * v1 + m[0][2] * v2 + offset[0];
+        p1[i] = m[1][0] * v0 + m[1][1] * v1 + m[1][2] * v2 + offset[1];
+        p2[i] = m[2][0] * v0 + m[2][1] * v1 + m[2][2] * v2 + offset[2];
+    }
+}
+
+/// <summary>
+/// Writes RGB planes to a file, interleaved and quantized row by row for the integer formats,
+/// through imagePlane3ToVec3() for the others.
+/// </summary>
+void writeRgbPlanes(const ImageRgbPlanes& rgb, const std::filesystem::path& filePath)
+{
+    if (!isFusedEncodeOutput(filePath)) {
+        imagePlane3ToVec3Simd(rgb).writeToFile(filePath);
+        return;
+    }
+    const int width = rgb.X.width;
+    writeQuantizedRgbFile(filePath, width, rgb.X.height, [&](auto zero) {
+        return quantizeRgbRows<decltype(zero)>(width, rgb.X.height, KernelCost::Light, [&](const int y, glm::vec3* row) {
+            const size_t offset = size_t(y) * size_t(width);
+            float* values = reinterpret_cast<float*>(row);
+#pragma omp simd
+            for (int x = 0; x < width; x++) {
+                values[3 * x] = rgb.X.data[offset + x];
+                values[3 * x + 1] = rgb.Y.data[offset + x];
+                values[3 * x + 2] = rgb.Z.data[offset + x];
+            }
+        });
+    });
+}
+
+#pragma endregion Planar tone mapping
@@ -0,0 +1,126 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "execution.h"
+#include "helpers.h"
+
+/*
+ * Compile-time channel access for ImagePlane3.
+ *
+ * ImagePlane3::operator[] (helpers.h) selects the plane with a runtime switch and may throw, which
+ * keeps per-channel loops from being specialized. get<I>() resolves the plane at compile time, and
+ * forEachPlane() / mapPlanes() unroll an operation over the three planes of any number of
+ * ImagePlane3 arguments (e.g. an image and its divergence) in X, Y, Z order. Their overloads
+ * with an ExecutionContext run the planes concurrently as runConcurrently() items, the context
+ * decides how many planes run at once and with how many kernel threads each.
+ */
+
+#pragma region ImagePlane3 compile-time access
+
+/// <summary>
+/// Plane I (0 = X, 1 = Y, 2 = Z) of an ImagePlane3, selected at compile time.
+/// </summary>
+template <size_t I, typename T>
+constexpr T& get(ImagePlane3<T>& planes)
+{
+    static_assert(I < 3, "ImagePlane3 has 3 planes");
+    if constexpr (I == 0) {
+        return planes.X;
+    } else if constexpr (I == 1) {
+        return planes.Y;
+    } else {
+        return planes.Z;
+    }
+}
+
+template <size_t I, typename T>
+constexpr const T& get(const ImagePlane3<T>& planes)
+{
+    static_assert(I < 3, "ImagePlane3 has 3 planes");
+    if constexpr (I == 0) {
+        return planes.X;
+    } else if constexpr (I == 1) {
+        return planes.Y;
+    } else {
+        return planes.Z;
+    }
+}
+
+/// <summary>
+/// Calls func(get<I>(planes)...) for I = 0, 1, 2.
+/// </summary>
+/// <param name="func">per-plane operation</param>
+/// <param name="planes">ImagePlane3 arguments, their plane I is passed together</param>
+template <typename Func, typename... Planes>
+    requires(!std::is_same_v<std::decay_t<Func>, ExecutionContext>)
+void forEachPlane(Func&& func, Planes&&... planes)
+{
+    func(get<0>(planes)...);
+    func(get<1>(planes)...);
+    func(get<2>(planes)...);
+}
+
+/// <summary>
+/// Applies func to the planes of the arguments and collects the three results.
+/// </summary>
+/// <param name="func">per-plane operation</param>
+/// <param name="planes">ImagePlane3 arguments, their plane I is passed together</param>
+/// <returns>ImagePlane3 { func(X...), func(Y...), func(Z...) }, evaluated in that order</returns>
+template <typename Func, typename... Planes>
+    requires(!std::is_same_v<std::decay_t<Func>, ExecutionContext>)
+auto mapPlanes(Func&& func, Planes&&... planes)
+{
+    using Result = std::decay_t<decltype(func(get<0>(planes)...))>;
+    // Braced initialization evaluates the planes in order.
+    return ImagePlane3<Result> { func(get<0>(planes)...), func(get<1>(planes)...), func(get<2>(planes)...) };
+}
+
+/// <summary>
+/// Calls func(get<I>(planes)...) for I = 0, 1, 2 with the thread split of the context.
+/// </summary>
+/// <param name="context">planes at once and kernel threads per plane</param>
+/// <param name="func">per-plane operation, called concurrently for different planes</param>
+/// <param name="planes">ImagePlane3 arguments, their plane I is passed together</param>
+template <typename Func, typename... Planes>
+void forEachPlane(const ExecutionContext& context, Func&& func, Planes&&... planes)
+{
+    runConcurrently(3, context, [&](const int i) {
+        if (i == 0) {
+            func(get<0>(planes)...);
+        } else if (i == 1) {
+            func(get<1>(planes)...);
+        } else {
+            func(get<2>(planes)...);
+        }
+    });
+}
+
+/// <summary>
+/// mapPlanes() with the thread split of the context.
+/// </summary>
+/// <param name="context">planes at once and kernel threads per plane</param>
+/// <param name="func">per-plane operation, called concurrently for different planes</param>
+/// <param name="planes">ImagePlane3 arguments, their plane I is passed together</param>
+/// <returns>ImagePlane3 { func(X...), func(Y...), func(Z...) }</returns>
+template <typename Func, typename... Planes>
+auto mapPlanes(const ExecutionContext& context, Func&& func, Planes&&... planes)
+{
+    using Result = std::decay_t<decltype(func(get<0>(planes)...))>;
+    std::array<std::optional<Result>, 3> results;
+    runConcurrently(3, context, [&](const int i) {
+        if (i == 0) {
+            results[0].emplace(func(get<0>(planes)...));
+        } else if (i == 1) {
+            results[1].emplace(func(get<1>(planes)...));
+        } else {
+            results[2].emplace(func(get<2>(planes)...));
+        }
+    });
+    return ImagePlane3<Result> { std::move(*results[0]), std::move(*results[1]), std::move(*results[2]) };
+}
+
+#pragma endregion ImagePlane3 compile-time access
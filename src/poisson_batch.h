@@ -0,0 +1,140 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "scratch_arena.h"
+#include "your_code_here.h"
+
+/*
+ * Batched solver for many small independent Poisson problems (retouching patches, tiles).
+ *
+ * solvePoisson() forks its threads for every sweep of one image: for a 64 x 64 patch a sweep is
+ * a few microseconds of work, so the fork/join barrier of each of its iterations and the
+ * allocations of every call dominate. solvePoissonBatch() instead runs the problems
+ * concurrently, one problem per thread: each thread packs its problem (solution buffers and the
+ * cropped divergence) into its ScratchArena, reused by its next problem, and sweeps it to the end
+ * without synchronizing, so the per-problem overhead is the packing and the result copy and the
+ * throughput scales with the cores as long as there are more problems than threads. The sweeps
+ * are the serial versions of the solvePoisson() kernels with the same expressions, so every
+ * result is bit-identical to solvePoisson() with the same method and iterations.
+ */
+
+#pragma region Poisson batch
+
+/// <summary>
+/// One problem of a batch, the arguments of solvePoisson(). The images must outlive the solve.
+/// </summary>
+struct PoissonProblem {
+    const ImageFloat* initial_solution = nullptr;
+    // div G, at least the size of the solution (only its top-left part is used).
+    const ImageFloat* divergence_G = nullptr;
+};
+
+/// <summary>
+/// Jacobi sweep of a packed width x height problem: u_next = (neighbors of u - f) / 4 on the interior.
+/// </summary>
+inline void sweepPackedJacobi(const float* u, float* u_next, const float* f, const int width, const int height)
+{
+    for (int y = 1; y < height - 1; y++) {
+        const float* row = u + size_t(y) * size_t(width);
+        const float* up = row - width;
+        const float* down = row + width;
+        const float* div = f + size_t(y) * size_t(width);
+        float* out = u_next + size_t(y) * size_t(width);
+#pragma omp simd
+        for (int x = 1; x < width - 1; x++) {
+            out[x] = 0.25f * (row[x + 1] + row[x - 1] + down[x] + up[x] - div[x]);
+        }
+    }
+}
+
+/// <summary>
+/// Red-black SOR sweep of a packed width x height problem, see smoothPoissonRedBlack().
+/// </summary>
+inline void sweepPackedRedBlack(float* u, const float* f, const int width, const int height, const float omega)
+{
+    for (int color = 0; color < 2; color++) {
+        for (int y = 1; y < height - 1; y++) {
+            for (int x = 1 + ((y + 1 + color) & 1); x < width - 1; x += 2) {
+                const size_t i = size_t(y) * size_t(width) + size_t(x);
+                const float gs = 0.25f * (u[i - 1] + u[i + 1] + u[i - width] + u[i + width] - f[i]);
+                u[i] += omega * (gs - u[i]);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Solves every problem like solvePoisson(initial_solution, divergence_G, num_iters, method, omega),
+/// one problem per thread, see above. Blocked Jacobi is solved as Jacobi (the results are identical), the
+/// mixed-precision methods as their fp32 scheme.
+/// </summary>
+/// <param name="problems">problems of any sizes</param>
+/// <param name="num_iters">iterations of every problem</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for each problem size</param>
+/// <returns>solution of every problem, in order</returns>
+std::vector<ImageFloat> solvePoissonBatch(const std::vector<PoissonProblem>& problems, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const float omega = 0.0f)
+{
+    const int num_problems = int(problems.size());
+    const bool sor = method == PoissonMethod::RedBlackSor || method == PoissonMethod::MixedSor;
+    int64_t total_pixels = 0;
+    for (int p = 0; p < num_problems; p++) {
+        const auto& problem = problems[p];
+        if (!problem.initial_solution || !problem.divergence_G || problem.divergence_G->width < problem.initial_solution->width
+            || problem.divergence_G->height < problem.initial_solution->height) {
+            std::cerr << "Poisson problem " << p << " has no solution or a divergence smaller than its solution." << std::endl;
+            throw std::exception();
+        }
+        total_pixels += int64_t(problem.initial_solution->data.size());
+    }
+
+    // The results are allocated up front, from the image memory resource of the caller.
+    std::vector<ImageFloat> solutions;
+    solutions.reserve(problems.size());
+    for (const auto& problem : problems) {
+        solutions.push_back(ImageFloat::uninitialized(problem.initial_solution->width, problem.initial_solution->height));
+    }
+    const ScopedStage stage("solvePoissonBatch", uint64_t(total_pixels) * uint64_t(std::max(num_iters, 0)));
+#pragma omp parallel for schedule(dynamic) num_threads(std::clamp(num_problems, 1, getThreadCount()))
+    for (int p = 0; p < num_problems; p++) {
+        const ImageFloat& initial = *problems[p].initial_solution;
+        const ImageFloat& divergence = *problems[p].divergence_G;
+        const int w = initial.width;
+        const int h = initial.height;
+        const size_t pixels = initial.data.size();
+
+        // Packed by the thread that solves the problem, into its arena, so the planes are in that
+        // thread's cache and memory node and the next problem of the thread reuses them.
+        ScratchScope scratch;
+        float* f = scratch.take<float>(pixels).data();
+        float* u = scratch.take<float>(pixels).data();
+        float* u_next = sor ? nullptr : scratch.take<float>(pixels).data();
+        for (int y = 0; y < h; y++) {
+            std::copy_n(divergence.data.data() + size_t(y) * size_t(divergence.width), w, f + size_t(y) * size_t(w));
+        }
+        std::copy(initial.data.begin(), initial.data.end(), u);
+
+        if (sor) {
+            const float relaxation = omega > 0.0f ? omega : computeOptimalSorOmega(w, h);
+            for (int iter = 0; iter < num_iters; iter++) {
+                sweepPackedRedBlack(u, f, w, h, relaxation);
+            }
+        } else {
+            // The border is never written, both buffers hold the Dirichlet values.
+            std::copy(initial.data.begin(), initial.data.end(), u_next);
+            for (int iter = 0; iter < num_iters; iter++) {
+                sweepPackedJacobi(u, u_next, f, w, h);
+                std::swap(u, u_next);
+            }
+        }
+
+        std::copy_n(u, solutions[p].data.size(), solutions[p].data.begin());
+    }
+    return solutions;
+}
+
+#pragma endregion Poisson batch
@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "helpers.h"
+#include "execution.h"
+#include "poisson_common.h"
+
+/*
+ * Temporally blocked (wavefront) Jacobi iteration.
+ *
+ * A plain Jacobi sweep streams the solution, the next solution and div G through memory once per
+ * iteration for 5 flops per pixel. Here block_iters iterations are fused into one pass over the
+ * rows: a wavefront moves down the image and, when it reaches row f, iteration level l computes
+ * its row f - l from the three rows of level l - 1 around it. Each level only keeps those three
+ * rows in a small ring buffer, so the intermediate levels never leave the cache and the full
+ * images are streamed once per block_iters iterations.
+ *
+ * For threads, the image is split into one band of rows per thread. A band [y0, y1) also
+ * computes the overlap rows [y0 - k + l, y1 + k - l) at level l (trapezoid tiling), so bands
+ * never exchange rows inside a block; after k levels exactly the band is exact and written. The
+ * image border is a Dirichlet condition and never changes. Every value is computed by the same
+ * expression from the same inputs as in solvePoisson(), so the result is bit-identical to plain
+ * sweeps for any thread count.
+ */
+
+#pragma region Poisson temporally blocked Jacobi
+
+/// <summary>
+/// Jacobi iteration of grad^2 I = div G with temporal blocking, bit-identical to solvePoisson()
+/// with PoissonMethod::Jacobi.
+/// </summary>
+/// <param name="initial_solution">initial solution and Dirichlet border</param>
+/// <param name="divergence_G">div G (may be wider than the solution, as produced by getDivergence())</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="block_iters">iterations fused into one pass over the image</param>
+/// <param name="band_rows">rows per band, values <= 0 give one band per thread</param>
+/// <param name="control">progress output and cancellation, checked between blocks; updates are not measured</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonJacobiBlocked(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters = 2000,
+    const int block_iters = currentKernelTuning().jacobi_block_iters, const int band_rows = 0, const PoissonControl& control = {})
+{
+    const int w = initial_solution.width;
+    const int h = initial_solution.height;
+    const int fw = divergence_G.width;
+    const int depth = std::max(block_iters, 1);
+    const int band = band_rows > 0 ? band_rows : std::max((h + getThreadCount() - 1) / getThreadCount(), 1);
+    const int num_bands = (h + band - 1) / band;
+
+    // Both buffers hold the Dirichlet border, only interior rows and columns are ever written.
+    auto I = initial_solution.clone();
+    auto I_next = initial_solution.clone();
+    ImageFloat* current = &I;
+    ImageFloat* next = &I_next;
+    // Shared by all threads, set between the barriers of a block.
+    bool cancelled = false;
+
+#pragma omp parallel
+    {
+        // Three rows of each intermediate level, row r of a level is in slot r % 3.
+        std::vector<float> rings(size_t(std::max(depth - 1, 1)) * 3 * size_t(w));
+
+        for (int iter = 0; iter < num_iters && !cancelled; iter += depth) {
+            const int steps = std::min(depth, num_iters - iter);
+#pragma omp master
+            for (int i = iter; i < iter + steps; i++) {
+                if (control.reports(i)) {
+                    control.report({ i, num_iters, std::numeric_limits<float>::quiet_NaN(), "blocked" });
+                }
+            }
+
+            const auto& src = *current;
+            auto& dst = *next;
+            // Row r of level l: level 0 is the current solution, level "steps" is written to dst.
+            const auto level_row = [&](const int l, const int r) -> float* {
+                return rings.data() + (size_t(l - 1) * 3 + size_t(r % 3)) * size_t(w);
+            };
+
+#pragma omp for schedule(static)
+            for (int b = 0; b < num_bands; b++) {
+                const int y0 = b * band;
+                const int y1 = std::min(y0 + band, h);
+                for (int f = std::max(y0 - steps, 0); f < std::min(y1 + steps, h) + steps; f++) {
+                    for (int l = 1; l <= steps; l++) {
+                        const int r = f - l;
+                        // Rows of level l needed by the band (and the image rows that exist).
+                        if (r < std::max(y0 - steps + l, 0) || r >= std::min(y1 + steps - l, h)) {
+                            continue;
+                        }
+                        const float* source = src.data.data() + size_t(r) * size_t(w);
+                        if (l == steps) {
+                            if (r == 0 || r == h - 1) {
+                                continue; // The border of dst is already in place.
+                            }
+                        } else if (r == 0 || r == h - 1) {
+                            std::copy_n(source, w, level_row(l, r));
+                            continue;
+                        }
+
+                        const float* up = l == 1 ? source - w : level_row(l - 1, r - 1);
+                        const float* row = l == 1 ? source : level_row(l - 1, r);
+                        const float* down = l == 1 ? source + w : level_row(l - 1, r + 1);
+                        float* out = l == steps ? dst.data.data() + size_t(r) * size_t(w) : level_row(l, r);
+                        const float* div = divergence_G.data.data() + size_t(r) * size_t(fw);
+                        out[0] = source[0];
+                        out[w - 1] = source[w - 1];
+#pragma omp simd
+                        for (int x = 1; x < w - 1; x++) {
+                            // Same update (and summation order) as solvePoisson().
+                            out[x] = 0.25f * (row[x + 1] + row[x - 1] + down[x] + up[x] - div[x]);
+                        }
+                    }
+                }
+            }
+            // Implicit barrier: every band is written before the buffers are swapped.
+
+#pragma omp single
+            {
+                std::swap(current, next);
+                cancelled = control.checkpoint();
+            }
+            // Implicit barrier: every thread sees the swapped pointers and the cancellation.
+        }
+    }
+    control.throwIfCancelled();
+
+    return std::move(*current);
+}
+
+#pragma endregion Poisson temporally blocked Jacobi
@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "helpers.h"
+#include "poisson_common.h"
+#include "plane3.h"
+
+/*
+ * Matrix-free (preconditioned) conjugate gradient solver for the Poisson problem of solvePoisson().
+ *
+ * The solution is written as I = I0 + e with e = 0 on the border, and CG solves the symmetric
+ * positive definite system A e = b with A e = 4 e - sum(neighbors of e) and b = -(div G - L I0).
+ */
+
+#pragma region Poisson conjugate gradient
+
+/// <summary>
+/// Preconditioners of the conjugate gradient solver.
+/// </summary>
+enum class PoissonPreconditioner {
+    // Plain CG.
+    None,
+    // Diagonal scaling. Parallel, but the 5-point Laplacian has a constant diagonal so it only rescales.
+    Jacobi,
+    // Zero fill-in incomplete Cholesky. About 3x fewer iterations than plain CG, but the triangular solves are serial.
+    IncompleteCholesky,
+};
+
+/// <summary>
+/// q = A p on the interior, where A is the negated 5-point Laplacian. The border of q is 0.
+/// </summary>
+/// <returns>dot product p . q</returns>
+double applyNegativeLaplacian(const ImageFloat& p, ImageFloat& q)
+{
+    const int w = p.width;
+    // One partial sum per row, see reproducibleSum().
+    return reproducibleSum<double>(std::max(p.height - 2, 0), 1, kernelThreads(p, KernelCost::Light), [&](const int64_t row, const int64_t) {
+        const int y = int(row) + 1;
+        double dot = 0.0;
+        for (int x = 1; x < w - 1; x++) {
+            const int i = y * w + x;
+            const float val = 4.0f * p.data[i] - (p.data[i - 1] + p.data[i + 1] + p.data[i - w] + p.data[i + w]);
+            q.data[i] = val;
+            dot += double(p.data[i]) * double(val);
+        }
+        return dot;
+    });
+}
+
+/// <summary>
+/// Diagonal of the zero fill-in incomplete Cholesky factor of A (interior pixels only).
+/// </summary>
+ImageFloat computeIncompleteCholeskyDiagonal(const int width, const int height)
+{
+    auto d = ImageFloat(width, height);
+    for (int y = 1; y < height - 1; y++) {
+        for (int x = 1; x < width - 1; x++) {
+            float val = 4.0f;
+            if (x > 1) {
+                val -= 1.0f / d.data[y * width + x - 1];
+            }
+            if (y > 1) {
+                val -= 1.0f / d.data[(y - 1) * width + x];
+            }
+            d.data[y * width + x] = val;
+        }
+    }
+    return d;
+}
+
+/// <summary>
+/// z = M^-1 r for the selected preconditioner.
+/// </summary>
+void applyPoissonPreconditioner(const PoissonPreconditioner preconditioner, const ImageFloat& ic_diagonal, const ImageFloat& r, ImageFloat& z)
+{
+    const int w = r.width;
+    const int h = r.height;
+    switch (preconditioner) {
+    case PoissonPreconditioner::IncompleteCholesky:
+        // Forward substitution (D + L) y = r, then backward (D + L^T) z = D y. Border entries are 0.
+        for (int y = 1; y < h - 1; y++) {
+            for (int x = 1; x < w - 1; x++) {
+                const int i = y * w + x;
+                z.data[i] = (r.data[i] + z.data[i - 1] + z.data[i - w]) / ic_diagonal.data[i];
+            }
+        }
+        for (int y = h - 2; y >= 1; y--) {
+            for (int x = w - 2; x >= 1; x--) {
+                const int i = y * w + x;
+                z.data[i] += (z.data[i + 1] + z.data[i + w]) / ic_diagonal.data[i];
+            }
+        }
+        break;
+    case PoissonPreconditioner::Jacobi:
+#pragma omp parallel for num_threads(kernelThreads(int64_t(r.data.size()), KernelCost::Light))
+        for (int i = 0; i < int(r.data.size()); i++) {
+            z.data[i] = 0.25f * r.data[i];
+        }
+        break;
+    case PoissonPreconditioner::None:
+    default:
+        z.data = r.data;
+        break;
+    }
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G with (preconditioned) conjugate gradients.
+/// Uses the same border convention as solvePoisson(): the 1px border of initial_solution is kept fixed.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="tolerance">stop when the residual drops below tolerance * initial residual</param>
+/// <param name="max_iters">upper bound on the number of CG iterations</param>
+/// <param name="preconditioner">preconditioner</param>
+/// <param name="stats">optional output of iterations used and final relative residual</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonCG(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const float tolerance = 1e-4f,
+    const int max_iters = 2000, const PoissonPreconditioner preconditioner = PoissonPreconditioner::IncompleteCholesky, PoissonStats* stats = nullptr)
+{
+    const int w = initial_solution.width;
+    const int h = initial_solution.height;
+    const auto f = cropPoissonRhs(divergence_G, w, h);
+
+    auto I = initial_solution.clone();
+
+    // r = b = -(f - L I0), the residual of the zero correction.
+    auto r = ImageFloat(w, h);
+    const double initial_norm2 = computePoissonResidual(I, f, r);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(r.data.size()), KernelCost::Light))
+    for (int i = 0; i < int(r.data.size()); i++) {
+        r.data[i] = -r.data[i];
+    }
+
+    const auto ic_diagonal = preconditioner == PoissonPreconditioner::IncompleteCholesky ? computeIncompleteCholeskyDiagonal(w, h) : ImageFloat(1, 1);
+
+    auto e = ImageFloat(w, h);
+    auto z = ImageFloat(w, h);
+    auto q = ImageFloat(w, h);
+    applyPoissonPreconditioner(preconditioner, ic_diagonal, r, z);
+    auto p = z;
+
+    const auto size = int64_t(e.data.size());
+    const int threads = kernelThreads(size, KernelCost::Light);
+    const auto dot = [&](const ImageFloat& a, const ImageFloat& b) {
+        return reproducibleSum<double>(size, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            double sum = 0.0;
+            for (int64_t i = begin; i < end; i++) {
+                sum += double(a.data[i]) * double(b.data[i]);
+            }
+            return sum;
+        });
+    };
+
+    const double threshold2 = initial_norm2 * double(tolerance) * double(tolerance);
+    double norm2 = initial_norm2;
+    double rz = dot(r, z);
+
+    int iter = 0;
+    while (iter < max_iters && norm2 > threshold2) {
+        const double pq = applyNegativeLaplacian(p, q);
+        if (pq <= 0.0) {
+            break;
+        }
+        const auto alpha = float(rz / pq);
+
+        norm2 = reproducibleSum<double>(size, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            double sum = 0.0;
+            for (int64_t i = begin; i < end; i++) {
+                e.data[i] += alpha * p.data[i];
+                r.data[i] -= alpha * q.data[i];
+                sum += double(r.data[i]) * double(r.data[i]);
+            }
+            return sum;
+        });
+        iter++;
+        if (norm2 <= threshold2) {
+            break;
+        }
+
+        applyPoissonPreconditioner(preconditioner, ic_diagonal, r, z);
+        const double rz_next = dot(r, z);
+        const auto beta = float(rz_next / rz);
+        rz = rz_next;
+#pragma omp parallel for num_threads(kernelThreads(int64_t(p.data.size()), KernelCost::Light))
+        for (int i = 0; i < int(p.data.size()); i++) {
+            p.data[i] = z.data[i] + beta * p.data[i];
+        }
+    }
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(I.data.size()), KernelCost::Light))
+    for (int i = 0; i < int(I.data.size()); i++) {
+        I.data[i] += e.data[i];
+    }
+
+    if (stats) {
+        // Report the true residual of the returned solution rather than the recursively updated one.
+        stats->iterations = iter;
+        stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(computePoissonResidual(I, f, r) / initial_norm2)) : 0.0f;
+    }
+
+    return I;
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G for each channel using preconditioned CG.
+/// </summary>
+/// <param name="targetXYZ">initial solution and border values</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="tolerance">relative residual tolerance</param>
+/// <param name="max_iters">upper bound on the number of CG iterations</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonCGXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const float tolerance = 1e-4f, const int max_iters = 2000)
+{
+    return mapPlanes([&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonCG(target, divergence, tolerance, max_iters); }, targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson conjugate gradient
@@ -0,0 +1,412 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <framework/float_image_io.h>
+#include <framework/mapped_image.h>
+
+#include "result_cache.h"
+#include "your_code_here.h"
+
+/*
+ * Checkpoints of long Poisson solves, and resuming from them.
+ *
+ * The iterative solvers keep no state besides the current solution: a Jacobi or SOR sweep, a
+ * blocked Jacobi pass and a multigrid cycle all start from the solution alone. A solve with
+ * checkpoints therefore runs in segments of `every` iterations (or cycles), and after each
+ * segment the solution is saved to an .f32 file (see float_image_io.h) with the planes stacked
+ * vertically like the result cache, and the progress in the reserved words of the header: the
+ * iterations done, the solver and a fingerprint of the problem (the initial solution, div G and
+ * the solver). Saving is non-blocking: the solution is copied and written on a background
+ * thread while the next segment runs, to a temporary name that is renamed when complete, so a
+ * process killed at any moment leaves the last complete checkpoint behind.
+ *
+ * A solve started with a checkpoint path resumes from the file when it holds the same problem
+ * and continues with the remaining iterations; the result is bit-identical to an uninterrupted
+ * solve for Jacobi, blocked Jacobi and SOR, and for the mixed-precision methods when `every` is
+ * a multiple of their 100 sweeps per refinement step. A finished solve removes its checkpoint,
+ * a solve stopped by its deadline keeps it for the next run.
+ */
+
+#pragma region Poisson checkpoints
+
+/// <summary>
+/// Checkpoint settings of a solve, see above.
+/// </summary>
+struct PoissonCheckpointing {
+    // .f32 file of the checkpoint, empty disables checkpoints and resuming.
+    std::filesystem::path path;
+    // Iterations (multigrid: cycles) between checkpoints, 0 only resumes.
+    int every = 500;
+    // Continue from a checkpoint of the same problem at path.
+    bool resume = true;
+
+    bool enabled() const { return !path.empty(); }
+};
+
+/// <summary>
+/// Progress stored with a checkpoint.
+/// </summary>
+struct PoissonCheckpointInfo {
+    // Iterations (or cycles) done.
+    int iteration = 0;
+    // PoissonMethod, or POISSON_CHECKPOINT_MULTIGRID.
+    uint32_t solver = 0;
+    uint64_t fingerprint = 0;
+    // Squared residual norm of the initial solution, the reference of relative tolerances.
+    double initial_norm2 = 0.0;
+};
+
+constexpr uint32_t POISSON_CHECKPOINT_MULTIGRID = 0x100;
+
+// Planes of a solution, in the order they are stored.
+inline std::vector<const ImageFloat*> checkpointPlanes(const ImageFloat& image) { return { &image }; }
+inline std::vector<const ImageFloat*> checkpointPlanes(const ImageXYZ& image) { return { &image.X, &image.Y, &image.Z }; }
+inline void restoreCheckpointPlanes(ImageFloat& image, std::vector<ImageFloat>& planes) { image = std::move(planes[0]); }
+inline void restoreCheckpointPlanes(ImageXYZ& image, std::vector<ImageFloat>& planes)
+{
+    image.X = std::move(planes[0]);
+    image.Y = std::move(planes[1]);
+    image.Z = std::move(planes[2]);
+}
+
+/// <summary>
+/// Fingerprint of a problem: its initial solution, right-hand side and solver.
+/// </summary>
+template <typename Solution>
+uint64_t poissonCheckpointFingerprint(const Solution& initial_solution, const Solution& divergence_G, const uint32_t solver)
+{
+    return ContentHash().add(std::string_view("poisson checkpoint")).add(solver).add(initial_solution).add(divergence_G).value();
+}
+
+/// <summary>
+/// Writes the planes and the progress to path through a temporary file, see above.
+/// </summary>
+/// <returns>false (after printing the reason) when the file could not be written</returns>
+inline bool writePoissonCheckpoint(const std::filesystem::path& path, const std::vector<ImageFloat>& planes, const PoissonCheckpointInfo& info)
+{
+    RawFloatHeader header;
+    header.width = uint32_t(planes.front().width);
+    header.height = uint32_t(planes.front().height) * uint32_t(planes.size());
+    header.channels = 1;
+    header.reserved[0] = uint32_t(planes.size());
+    header.reserved[1] = uint32_t(info.iteration);
+    header.reserved[2] = info.solver;
+    header.reserved[3] = uint32_t(info.fingerprint);
+    header.reserved[4] = uint32_t(info.fingerprint >> 32);
+    const auto norm_bits = std::bit_cast<uint64_t>(info.initial_norm2);
+    header.reserved[5] = uint32_t(norm_bits);
+    header.reserved[6] = uint32_t(norm_bits >> 32);
+
+    auto temporary_path = path;
+    temporary_path += ".tmp";
+    std::error_code error;
+    if (path.has_parent_path()) {
+        std::filesystem::create_directories(path.parent_path(), error);
+    }
+    std::FILE* file = std::fopen(temporary_path.string().c_str(), "wb");
+    bool written = file && std::fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const auto& plane : planes) {
+        written = written && std::fwrite(plane.data.data(), sizeof(float), plane.data.size(), file) == plane.data.size();
+    }
+    if (file) {
+        written = std::fclose(file) == 0 && written;
+    }
+    if (written) {
+        std::filesystem::rename(temporary_path, path, error);
+        written = !error;
+    }
+    if (!written) {
+        std::cerr << "Failed to write the Poisson checkpoint " << path << std::endl;
+        std::filesystem::remove(temporary_path, error);
+    }
+    return written;
+}
+
+/// <summary>
+/// Reads a checkpoint written by writePoissonCheckpoint().
+/// </summary>
+/// <param name="path">checkpoint file</param>
+/// <param name="planes">output of the planes</param>
+/// <returns>the progress, nothing when the file is missing or not a checkpoint</returns>
+inline std::optional<PoissonCheckpointInfo> readPoissonCheckpoint(const std::filesystem::path& path, std::vector<ImageFloat>& planes)
+{
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) {
+        return std::nullopt;
+    }
+    try {
+        const MappedFile file(path);
+        RawFloatHeader header;
+        if (file.size() < sizeof(header)) {
+            return std::nullopt;
+        }
+        std::memcpy(&header, file.data(), sizeof(header));
+        const uint32_t num_planes = header.reserved[0];
+        if (header.magic != RawFloatHeader::MAGIC || header.version != RawFloatHeader::VERSION || header.channels != 1 || num_planes == 0
+            || header.height % num_planes != 0 || file.size() < sizeof(header) + size_t(header.width) * size_t(header.height) * sizeof(float)) {
+            return std::nullopt;
+        }
+        const int width = int(header.width);
+        const int height = int(header.height / num_planes);
+        const auto pixels = ImageView<const float>(reinterpret_cast<const float*>(file.data() + sizeof(header)), width, height * int(num_planes), width);
+        planes.clear();
+        for (int i = 0; i < int(num_planes); i++) {
+            planes.emplace_back(pixels.subview(0, i * height, width, height));
+        }
+        PoissonCheckpointInfo info;
+        info.iteration = int(header.reserved[1]);
+        info.solver = header.reserved[2];
+        info.fingerprint = uint64_t(header.reserved[3]) | uint64_t(header.reserved[4]) << 32;
+        info.initial_norm2 = std::bit_cast<double>(uint64_t(header.reserved[5]) | uint64_t(header.reserved[6]) << 32);
+        return info;
+    } catch (const std::exception&) {
+        return std::nullopt;
+    }
+}
+
+/// <summary>
+/// Loads the checkpoint of a problem into solution when it matches, see above.
+/// </summary>
+/// <param name="path">checkpoint file</param>
+/// <param name="fingerprint">poissonCheckpointFingerprint() of the problem</param>
+/// <param name="solution">solution of the problem's size, replaced by the checkpoint</param>
+/// <returns>the progress of the loaded checkpoint, nothing when there is none for the problem</returns>
+template <typename Solution>
+std::optional<PoissonCheckpointInfo> loadPoissonCheckpoint(const std::filesystem::path& path, const uint64_t fingerprint, Solution& solution)
+{
+    std::vector<ImageFloat> planes;
+    auto info = readPoissonCheckpoint(path, planes);
+    if (!info) {
+        return std::nullopt;
+    }
+    const auto expected = checkpointPlanes(solution);
+    if (info->fingerprint != fingerprint || planes.size() != expected.size() || planes[0].width != expected[0]->width || planes[0].height != expected[0]->height) {
+        std::cout << "Ignoring the checkpoint " << path.string() << " of another problem." << std::endl;
+        return std::nullopt;
+    }
+    restoreCheckpointPlanes(solution, planes);
+    return info;
+}
+
+/// <summary>
+/// Writes checkpoints on a background thread, one at a time, see above.
+/// </summary>
+class PoissonCheckpointWriter {
+public:
+    PoissonCheckpointWriter() = default;
+    PoissonCheckpointWriter(const PoissonCheckpointWriter&) = delete;
+    PoissonCheckpointWriter& operator=(const PoissonCheckpointWriter&) = delete;
+    ~PoissonCheckpointWriter() { wait(); }
+
+    /// <summary>
+    /// Copies the solution and writes it to path in the background, after the previous write finished.
+    /// </summary>
+    template <typename Solution>
+    void save(const std::filesystem::path& path, const Solution& solution, const PoissonCheckpointInfo& info)
+    {
+        std::vector<ImageFloat> planes;
+        for (const ImageFloat* plane : checkpointPlanes(solution)) {
+            planes.push_back(plane->clone());
+        }
+        wait();
+        m_thread = std::thread([path, planes = std::move(planes), info] { writePoissonCheckpoint(path, planes, info); });
+    }
+
+    /// <summary>
+    /// Waits until the last checkpoint is written.
+    /// </summary>
+    void wait()
+    {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+private:
+    std::thread m_thread;
+};
+
+/// <summary>
+/// Runs solve(solution, iterations, control) in segments with checkpoints, see above. The
+/// segments report the iterations of the whole solve, the statistics cover all segments.
+/// </summary>
+/// <param name="initial_solution">initial solution</param>
+/// <param name="fingerprint">poissonCheckpointFingerprint() of the problem</param>
+/// <param name="solver">PoissonMethod of the solve</param>
+/// <param name="num_iters">iterations of the whole solve</param>
+/// <param name="control">control of the whole solve</param>
+/// <param name="checkpointing">checkpoint file and interval</param>
+/// <param name="solve">runs the given iterations from a solution with a control and returns the new solution</param>
+template <typename Solution, typename Solve>
+Solution solveWithPoissonCheckpoints(const Solution& initial_solution, const uint64_t fingerprint, const uint32_t solver, const int num_iters,
+    const PoissonControl& control, const PoissonCheckpointing& checkpointing, const Solve& solve)
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    Solution solution = initial_solution;
+    PoissonCheckpointInfo info { 0, solver, fingerprint, 0.0 };
+    if (checkpointing.resume) {
+        if (const auto loaded = loadPoissonCheckpoint(checkpointing.path, fingerprint, solution)) {
+            info.iteration = std::min(loaded->iteration, num_iters);
+            std::cout << "Resuming the Poisson solve from " << checkpointing.path.string() << " at iteration " << info.iteration << "." << std::endl;
+        }
+    }
+
+    int done = info.iteration;
+    PoissonStats stats;
+    PoissonControl segment_control = control;
+    segment_control.stats = &stats;
+    if (control.on_progress) {
+        segment_control.on_progress = [&](const PoissonProgress& progress) {
+            auto total = progress;
+            total.iteration += done;
+            total.num_iters = num_iters;
+            control.report(total);
+        };
+    }
+    PoissonCheckpointWriter writer;
+    bool stopped = false;
+    std::vector<float> update_history;
+    while (done < num_iters && !stopped) {
+        const int segment = checkpointing.every > 0 ? std::min(checkpointing.every - done % checkpointing.every, num_iters - done) : num_iters - done;
+        solution = solve(solution, segment, segment_control);
+        update_history.insert(update_history.end(), stats.update_history.begin(), stats.update_history.end());
+        // Converged or stopped at the deadline.
+        stopped = stats.iterations < segment || stats.deadline_reached;
+        done += stats.iterations;
+        if (done < num_iters && (!stopped || stats.deadline_reached)) {
+            info.iteration = done;
+            writer.save(checkpointing.path, solution, info);
+        }
+    }
+    writer.wait();
+    if (done >= num_iters || !stats.deadline_reached) {
+        std::error_code error;
+        std::filesystem::remove(checkpointing.path, error);
+    }
+
+    if (control.stats) {
+        control.stats->iterations = done;
+        control.stats->relative_residual = stats.relative_residual;
+        control.stats->update_history = std::move(update_history);
+        control.stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        control.stats->deadline_reached = stats.deadline_reached;
+    }
+    return solution;
+}
+
+/// <summary>
+/// solvePoisson() with checkpoints, see above. Without a checkpoint path it is solvePoisson().
+/// </summary>
+/// <param name="initial_solution">initial solution</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="control">convergence monitoring, early termination, deadline and progress output</param>
+/// <param name="checkpointing">checkpoint file and interval</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonCheckpointed(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters, const PoissonMethod method,
+    const float omega, const PoissonControl& control, const PoissonCheckpointing& checkpointing)
+{
+    if (!checkpointing.enabled()) {
+        return solvePoisson(initial_solution, divergence_G, num_iters, method, omega, control);
+    }
+    const auto divergence = cropPoissonRhs(divergence_G, initial_solution.width, initial_solution.height);
+    return solveWithPoissonCheckpoints(initial_solution, poissonCheckpointFingerprint(initial_solution, divergence, uint32_t(method)), uint32_t(method), num_iters,
+        control, checkpointing, [&](const ImageFloat& solution, const int iterations, const PoissonControl& segment_control) {
+            return solvePoisson(solution, divergence, iterations, method, omega, segment_control);
+        });
+}
+
+/// <summary>
+/// solvePoissonPlanes() with checkpoints of the three planes, see above.
+/// </summary>
+/// <param name="initial_solution">initial solution per channel</param>
+/// <param name="divergence_G">div G per channel</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="control">deadline and statistics of the solve</param>
+/// <param name="checkpointing">checkpoint file and interval</param>
+/// <returns>luminance I per channel</returns>
+ImageXYZ solvePoissonPlanesCheckpointed(const ImageXYZ& initial_solution, const ImageXYZ& divergence_G, const int num_iters, const PoissonMethod method,
+    const float omega, const PoissonControl& control, const PoissonCheckpointing& checkpointing)
+{
+    if (!checkpointing.enabled()) {
+        return solvePoissonPlanes(initial_solution, divergence_G, num_iters, method, omega, control);
+    }
+    const int w = initial_solution.X.width;
+    const int h = initial_solution.X.height;
+    const ImageXYZ divergence { cropPoissonRhs(divergence_G.X, w, h), cropPoissonRhs(divergence_G.Y, w, h), cropPoissonRhs(divergence_G.Z, w, h) };
+    return solveWithPoissonCheckpoints(initial_solution, poissonCheckpointFingerprint(initial_solution, divergence, uint32_t(method)), uint32_t(method), num_iters,
+        control, checkpointing, [&](const ImageXYZ& solution, const int iterations, const PoissonControl& segment_control) {
+            return solvePoissonPlanes(solution, divergence, iterations, method, omega, segment_control);
+        });
+}
+
+/// <summary>
+/// solvePoissonMultigrid() with a checkpoint every checkpointing.every cycles, see above. The
+/// tolerance stays relative to the residual of the initial solution across resumes.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="tolerance">stop when the residual drops below tolerance * initial residual</param>
+/// <param name="max_cycles">upper bound on the number of cycles</param>
+/// <param name="checkpointing">checkpoint file and interval</param>
+/// <param name="stats">optional output of cycles used and final relative residual</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonMultigridCheckpointed(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const float tolerance, const int max_cycles,
+    const PoissonCheckpointing& checkpointing, PoissonStats* stats = nullptr)
+{
+    if (!checkpointing.enabled()) {
+        return solvePoissonMultigrid(initial_solution, divergence_G, tolerance, max_cycles, MultigridCycle::V, stats);
+    }
+    const auto divergence = cropPoissonRhs(divergence_G, initial_solution.width, initial_solution.height);
+    const uint64_t fingerprint = poissonCheckpointFingerprint(initial_solution, divergence, POISSON_CHECKPOINT_MULTIGRID);
+    auto solution = initial_solution.clone();
+    PoissonCheckpointInfo info { 0, POISSON_CHECKPOINT_MULTIGRID, fingerprint, poissonResidualNorm2(initial_solution, divergence) };
+    if (checkpointing.resume) {
+        if (const auto loaded = loadPoissonCheckpoint(checkpointing.path, fingerprint, solution)) {
+            info.iteration = std::min(loaded->iteration, max_cycles);
+            std::cout << "Resuming the multigrid solve from " << checkpointing.path.string() << " at cycle " << info.iteration << "." << std::endl;
+        }
+    }
+
+    PoissonCheckpointWriter writer;
+    PoissonStats segment_stats;
+    double norm2 = poissonResidualNorm2(solution, divergence);
+    while (info.iteration < max_cycles && norm2 > info.initial_norm2 * double(tolerance) * double(tolerance)) {
+        const int segment = checkpointing.every > 0 ? std::min(checkpointing.every - info.iteration % checkpointing.every, max_cycles - info.iteration)
+                                                    : max_cycles - info.iteration;
+        // The same absolute threshold, relative to the residual this segment starts from.
+        const float segment_tolerance = float(double(tolerance) * std::sqrt(info.initial_norm2 / norm2));
+        solution = solvePoissonMultigrid(solution, divergence, segment_tolerance, segment, MultigridCycle::V, &segment_stats);
+        info.iteration += segment_stats.iterations;
+        norm2 = poissonResidualNorm2(solution, divergence);
+        if (segment_stats.iterations < segment || info.iteration >= max_cycles) {
+            break;
+        }
+        writer.save(checkpointing.path, solution, info);
+    }
+    writer.wait();
+    std::error_code error;
+    std::filesystem::remove(checkpointing.path, error);
+
+    if (stats) {
+        stats->iterations = info.iteration;
+        stats->relative_residual = info.initial_norm2 > 0.0 ? float(std::sqrt(norm2 / info.initial_norm2)) : 0.0f;
+    }
+    return solution;
+}
+
+#pragma endregion Poisson checkpoints
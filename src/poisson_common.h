@@ -0,0 +1,259 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+#include "helpers.h"
+#include "binary_mask.h"
+#include "job_control.h"
+#include "stencil.h"
+
+/*
+ * Pieces shared by the Poisson solvers.
+ *
+ * All solvers use the discretization of solvePoisson(): sum(neighbors) - 4 I = div G on the
+ * interior, with the 1px border of the initial solution kept fixed (Dirichlet).
+ * The divergence image is larger than the solution, only its top-left part is used.
+ */
+
+#pragma region Poisson common
+
+/// <summary>
+/// Result of an iterative Poisson solve.
+/// </summary>
+struct PoissonStats {
+    // Iterations (sweeps or cycles, depending on the solver) that were run.
+    int iterations = 0;
+    // Final residual norm relative to the initial one.
+    float relative_residual = 0.0f;
+    // Largest pixel update of every checked iteration (solvers with a PoissonControl).
+    std::vector<float> update_history;
+    // Wall time of the solve.
+    double seconds = 0.0;
+    // The solve was stopped by the deadline of its PoissonControl.
+    bool deadline_reached = false;
+    // The solve was stopped because an iteration made the residual grow (multigrid).
+    bool diverged = false;
+};
+
+/// <summary>
+/// State of an iterative solve passed to PoissonControl::on_progress.
+/// </summary>
+struct PoissonProgress {
+    // Iterations done so far and requested.
+    int iteration = 0;
+    int num_iters = 0;
+    // Largest pixel update of the last checked iteration, NaN when none was measured yet.
+    float max_update = std::numeric_limits<float>::quiet_NaN();
+    // Scheme description, e.g. "SOR, omega 1.9".
+    std::string_view method;
+};
+
+/// <summary>
+/// Prints the progress line of the solvers to std::cout.
+/// </summary>
+inline void printPoissonProgress(const PoissonProgress& progress)
+{
+    std::cout << "[" << progress.iteration << "/" << progress.num_iters << "] Solving Poisson equation";
+    if (!progress.method.empty()) {
+        std::cout << " (" << progress.method << ")";
+    }
+    if (!std::isnan(progress.max_update)) {
+        std::cout << ", max update " << progress.max_update;
+    }
+    std::cout << "..." << std::endl;
+}
+
+/// <summary>
+/// Default progress output of the solvers: the iterations go to the job of the calling thread
+/// when it takes progress (see job_control.h), otherwise the line of printPoissonProgress().
+/// </summary>
+inline void reportPoissonProgress(const PoissonProgress& progress)
+{
+    const JobControl* job = currentJobControl();
+    if (job && job->reportsProgress()) {
+        job->report({ "solvePoisson", progress.iteration, progress.num_iters });
+    } else {
+        printPoissonProgress(progress);
+    }
+}
+
+/// <summary>
+/// Most sweeps a solver runs between two checks of the job of its PoissonControl.
+/// </summary>
+constexpr int POISSON_CANCEL_SWEEPS = 16;
+
+/// <summary>
+/// Convergence monitoring of an iterative solve. The largest pixel update max |I_next - I| is
+/// computed within the sweep of every check_every-th iteration, and the solve stops early once it
+/// is <= tolerance. Progress goes to on_progress, called by one thread between iterations.
+/// The solve also stops between iterations when the job of the thread that created the control
+/// is cancelled, and then throws CancelledError.
+/// </summary>
+struct PoissonControl {
+    // Iterations between update measurements, 0 disables measuring (and early termination).
+    int check_every = 0;
+    // Stop when the measured update is <= tolerance.
+    float tolerance = 0.0f;
+    // Iterations between progress reports, 0 reports only measurements.
+    int report_every = 500;
+    // Progress output, empty for none.
+    std::function<void(const PoissonProgress&)> on_progress = reportPoissonProgress;
+    // Optional statistics of the solve.
+    PoissonStats* stats = nullptr;
+    // The solve stops after the iteration that passes the deadline and returns its current estimate.
+    // With a deadline, stats also get the relative residual of that estimate.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Cancellation token of the solve, see job_control.h.
+    const JobControl* job = currentJobControl();
+
+    bool checks(const int iteration) const { return check_every > 0 && (iteration + 1) % check_every == 0; }
+    bool hasDeadline() const { return deadline != std::chrono::steady_clock::time_point::max(); }
+    bool pastDeadline() const { return hasDeadline() && std::chrono::steady_clock::now() >= deadline; }
+    // Yields while the job is preempted, true once it is cancelled (see JobControl::checkpoint()).
+    bool checkpoint() const { return job && job->checkpoint(); }
+    // Whether the iterations stop early, at the deadline or for a cancelled job; a checkpoint.
+    bool stopRequested() const { return checkpoint() || pastDeadline(); }
+    void throwIfCancelled() const { ::throwIfCancelled(job); }
+    bool reports(const int iteration) const { return report_every > 0 && iteration % report_every == 0; }
+    void report(const PoissonProgress& progress) const
+    {
+        if (on_progress) {
+            on_progress(progress);
+        }
+    }
+};
+
+/// <summary>
+/// A source mask placed with its pixel (0, 0) at target pixel (offset_x, offset_y). The mask is
+/// stored at the source size; target pixels outside of it are not masked.
+/// </summary>
+struct PlacedMask {
+    const BinaryMask& mask;
+    int offset_x = 0;
+    int offset_y = 0;
+
+    // True when target pixel (x, y) is covered by a set mask pixel.
+    bool operator()(const int x, const int y) const
+    {
+        const int sx = x - offset_x;
+        const int sy = y - offset_y;
+        return sx >= 0 && sy >= 0 && sx < mask.width() && sy < mask.height() && mask(sx, sy);
+    }
+};
+
+/// <summary>
+/// Copies the part of the divergence that overlaps the solution into an image of the solution size.
+/// </summary>
+/// <param name="divergence_G">div G (at least width x height)</param>
+/// <param name="width">solution width</param>
+/// <param name="height">solution height</param>
+/// <returns>right-hand side of the solution size</returns>
+ImageFloat cropPoissonRhs(const ImageFloat& divergence_G, const int width, const int height)
+{
+    auto f = ImageFloat::uninitialized(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            f.data[y * width + x] = divergence_G.data[y * divergence_G.width + x];
+        }
+    }
+    return f;
+}
+
+/// <summary>
+/// Computes r = f - (sum(neighbors) - 4 u) on the interior and 0 on the border.
+/// </summary>
+/// <returns>squared L2 norm of the residual</returns>
+double computePoissonResidual(const ImageFloat& u, const ImageFloat& f, ImageFloat& r)
+{
+    const int w = u.width;
+    const auto interior = StencilInterior(w, u.height, StencilReach { 1, 1, 1, 1 });
+    // One partial sum per row, see reproducibleSum().
+    return reproducibleSum<double>(u.height, 1, kernelThreads(u, KernelCost::Light), [&](const int64_t row, const int64_t) {
+        const int y = int(row);
+        double norm2 = 0.0;
+        forEachStencilRow(
+            y, w, interior,
+            [&](const int, const int x0, const int x1) {
+                for (int x = x0; x < x1; x++) {
+                    const int i = y * w + x;
+                    const float res = f.data[i] - (u.data[i - 1] + u.data[i + 1] + u.data[i - w] + u.data[i + w] - 4.0f * u.data[i]);
+                    r.data[i] = res;
+                    norm2 += double(res) * double(res);
+                }
+            },
+            [&](const int x, const int) { r.data[y * w + x] = 0.0f; });
+        return norm2;
+    });
+}
+
+/// <summary>
+/// Squared L2 norm of the residual of u, see computePoissonResidual().
+/// </summary>
+/// <param name="u">solution</param>
+/// <param name="divergence_G">div G (at least the size of u)</param>
+double poissonResidualNorm2(const ImageFloat& u, const ImageFloat& divergence_G)
+{
+    auto r = ImageFloat::uninitialized(u.width, u.height);
+    return computePoissonResidual(u, cropPoissonRhs(divergence_G, u.width, u.height), r);
+}
+
+/// <summary>
+/// Red-black successive over-relaxation sweeps for sum(neighbors) - 4 u = f on the interior of u.
+/// omega = 1 is plain Gauss-Seidel. Border pixels are never written, and f may be larger than u
+/// (only its top-left part is read), so the divergence image can be passed without cropping.
+/// The job of the calling thread is checked between sweeps (see job_control.h).
+/// </summary>
+/// <param name="u">solution updated in place</param>
+/// <param name="f">right-hand side, at least the size of u</param>
+/// <param name="num_sweeps">number of full (red + black) sweeps</param>
+/// <param name="omega">relaxation factor in (0, 2)</param>
+/// <param name="max_update">optional output of the largest |change| of a pixel in the last sweep</param>
+void smoothPoissonRedBlack(ImageFloat& u, const ImageFloat& f, const int num_sweeps, const float omega = 1.0f, float* max_update = nullptr)
+{
+    const int w = u.width;
+    const int fw = f.width;
+    float largest = 0.0f;
+    const JobControl* const job = currentJobControl();
+    for (int sweep = 0; sweep < num_sweeps; sweep++) {
+        throwIfCancelled(job);
+        const bool measure = max_update && sweep == num_sweeps - 1;
+        for (int color = 0; color < 2; color++) {
+#pragma omp parallel for num_threads(kernelThreads(u, KernelCost::Light)) reduction(max : largest)
+            for (int y = 1; y < u.height - 1; y++) {
+                // First interior x of this row with (x + y) % 2 == color.
+                for (int x = 1 + ((y + 1 + color) & 1); x < w - 1; x += 2) {
+                    const int i = y * w + x;
+                    const float gs = 0.25f * (u.data[i - 1] + u.data[i + 1] + u.data[i - w] + u.data[i + w] - f.data[y * fw + x]);
+                    const float delta = omega * (gs - u.data[i]);
+                    u.data[i] += delta;
+                    if (measure) {
+                        largest = std::max(largest, std::abs(delta));
+                    }
+                }
+            }
+        }
+    }
+    if (max_update) {
+        *max_update = largest;
+    }
+}
+
+/// <summary>
+/// Optimal SOR relaxation factor for the 5-point Laplacian on a width x height grid with a Dirichlet border,
+/// omega = 2 / (1 + sqrt(1 - rho^2)) where rho is the spectral radius of the Jacobi iteration.
+/// </summary>
+float computeOptimalSorOmega(const int width, const int height)
+{
+    const double pi = 3.14159265358979323846;
+    const double rho = 0.5 * (std::cos(pi / double(std::max(width - 1, 2))) + std::cos(pi / double(std::max(height - 1, 2))));
+    return float(2.0 / (1.0 + std::sqrt(1.0 - rho * rho)));
+}
+
+#pragma endregion Poisson common
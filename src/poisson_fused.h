@@ -0,0 +1,538 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "helpers.h"
+#include "color_simd.h"
+#include "poisson_common.h"
+#include "plane3.h"
+
+/*
+ * Fused gradient -> merge -> divergence.
+ *
+ * getDivergence(copySourceGradientsToTarget(getGradients(source), getGradients(target), mask))
+ * materializes six gradient planes per channel to produce one divergence plane. Every merged
+ * gradient only depends on the two images and the mask around its pixel, and every divergence
+ * value on the merged gradients of its pixel and its left and upper neighbors. Here output row y
+ * computes merged dx and dy of row y into row buffers and reuses the merged dy of row y - 1 from
+ * the previous row of the same thread, so only the divergence image is allocated. The gradients
+ * are evaluated with the same expressions as the unfused chain, the result is bit-identical.
+ * Outside the rows around the mask the merged gradients are those of the target, and there the
+ * divergence is the target Laplacian, computed with one 5-point stencil per pixel: for a small
+ * mask on a large target almost all of the image is read once and no gradient row is built.
+ *
+ * Several sources (PoissonLayer) are merged into one field the same way: every target pixel is
+ * owned by the topmost layer whose mask covers it, or by the target, and the gradients between
+ * pixels of different owners are zero. One solve then composites all layers.
+ */
+
+#pragma region Poisson fused divergence
+
+/// <summary>
+/// Row y (0 <= y <= height) of getDivergence(getGradients(target)): the 5-point Laplacian, with
+/// the gradients past the last column and row taken as zero. Same expressions as the merged path.
+/// </summary>
+/// <param name="up">target row y - 1, read when y > 0</param>
+/// <param name="row">target row y, read when y < height</param>
+/// <param name="down">target row y + 1, read when y + 1 < height</param>
+/// <param name="w">target width</param>
+/// <param name="h">target height</param>
+/// <param name="y">divergence row</param>
+/// <param name="out">width + 1 values</param>
+inline void getTargetDivergenceRow(const float* up, const float* row, const float* down, const int w, const int h, const int y, float* out)
+{
+    const auto at = [&](const int px, const int py) { return (py < y ? up : py > y ? down : row)[px]; };
+    const auto gx = [&](const int px, const int py) { return py < h && px + 1 < w ? at(px + 1, py) - at(px, py) : 0.0f; };
+    const auto gy = [&](const int px, const int py) { return py + 1 < h && px < w ? at(px, py + 1) - at(px, py) : 0.0f; };
+    const auto divergence = [&](const int x) {
+        float div_x = gx(x, y);
+        if (x > 0) {
+            div_x -= gx(x - 1, y);
+        }
+        float div_y = gy(x, y);
+        if (y > 0) {
+            div_y -= gy(x, y - 1);
+        }
+        return div_x + div_y;
+    };
+    if (y == 0 || y >= h - 1 || w < 3) {
+        for (int x = 0; x < w + 1; x++) {
+            out[x] = divergence(x);
+        }
+        return;
+    }
+    out[0] = divergence(0);
+#pragma omp simd
+    for (int x = 1; x < w - 1; x++) {
+        out[x] = ((row[x + 1] - row[x]) - (row[x] - row[x - 1])) + ((down[x] - row[x]) - (row[x] - up[x]));
+    }
+    out[w - 1] = divergence(w - 1);
+    out[w] = divergence(w);
+}
+
+/// <summary>
+/// getTargetDivergenceRow() of a target image.
+/// </summary>
+/// <param name="target">target image</param>
+/// <param name="y">divergence row</param>
+/// <param name="out">width + 1 values</param>
+inline void getTargetDivergenceRow(const ImageFloat& target, const int y, float* out)
+{
+    const int w = target.width;
+    const int h = target.height;
+    const auto row = [&](const int py) { return py >= 0 && py < h ? target.data.data() + size_t(py) * size_t(w) : nullptr; };
+    getTargetDivergenceRow(row(y - 1), row(y), row(y + 1), w, h, y, out);
+}
+
+/// <summary>
+/// Divergence row y from the merged gradients of rows y - 1 and y, same expressions as getDivergence().
+/// </summary>
+/// <param name="dx">merged dx of row y, gw values</param>
+/// <param name="dy">merged dy of row y</param>
+/// <param name="dy_above">merged dy of row y - 1, not read for y = 0</param>
+/// <param name="gw">gradient width, target width + 1</param>
+/// <param name="y">divergence row</param>
+/// <param name="out">gw values</param>
+inline void getGradientDivergenceRow(const float* dx, const float* dy, const float* dy_above, const int gw, const int y, float* out)
+{
+    for (int x = 0; x < gw; x++) {
+        float div_x = dx[x];
+        if (x > 0) {
+            div_x -= dx[x - 1];
+        }
+        float div_y = dy[x];
+        if (y > 0) {
+            div_y -= dy_above[x];
+        }
+        out[x] = div_x + div_y;
+    }
+}
+
+/// <summary>
+/// copySourceGradientsToTarget() of row y < height, from the rows of the images around it.
+/// </summary>
+/// <param name="t_row">target row y</param>
+/// <param name="t_next">target row y + 1, nullptr for the last row</param>
+/// <param name="s_row">source row y - offset_y, read where the placed mask is set</param>
+/// <param name="s_next">source row y - offset_y + 1, nullptr past the last source row</param>
+/// <param name="w">target width</param>
+/// <param name="sw">source width</param>
+/// <param name="placed">source mask placed on the target</param>
+/// <param name="y">target row</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="out_dx">merged dx, w + 1 values</param>
+/// <param name="out_dy">merged dy, w + 1 values</param>
+inline void mergeGradientsRow(const float* t_row, const float* t_next, const float* s_row, const float* s_next, const int w, const int sw, const BinaryMask& placed,
+    const int y, const int offset_x, float* out_dx, float* out_dy)
+{
+    const int h = placed.height();
+    out_dx[w] = 0.0f;
+    out_dy[w] = 0.0f;
+    for (int x = 0; x < w; x++) {
+        const bool mask_val = placed(x, y);
+        float gx = 0.0f;
+        float gy = 0.0f;
+        if (mask_val) {
+            const int sx = x - offset_x;
+            if (sx + 1 < sw) {
+                gx = s_row[sx + 1] - s_row[sx];
+            }
+            if (s_next) {
+                gy = s_next[sx] - s_row[sx];
+            }
+        } else {
+            if (x + 1 < w) {
+                gx = t_row[x + 1] - t_row[x];
+            }
+            if (t_next) {
+                gy = t_next[x] - t_row[x];
+            }
+        }
+        // Gradients crossing the mask boundary are zero.
+        if ((x > 0 && placed(x - 1, y) != mask_val) || (x < w - 1 && placed(x + 1, y) != mask_val)) {
+            gx = 0.0f;
+        }
+        if ((y > 0 && placed(x, y - 1) != mask_val) || (y < h - 1 && placed(x, y + 1) != mask_val)) {
+            gy = 0.0f;
+        }
+        out_dx[x] = gx;
+        out_dy[x] = gy;
+    }
+}
+
+/// <summary>
+/// getDivergence() of merged gradients that are produced row by row: merge_row(y, dx, dy) writes
+/// the merged gradients of row y (the last one is the zero row h) into two rows of w + 1 values.
+/// Rows far from the merged region only hold target gradients, their divergence is the target
+/// Laplacian computed directly (getTargetDivergenceRow()) without any gradient row.
+/// </summary>
+/// <param name="target">target image</param>
+/// <param name="merged">pixels whose gradients may differ from the target ones (empty for none)</param>
+/// <param name="merge_row">merged gradients of one row, called concurrently for different rows</param>
+/// <returns>div G, 2px larger than the target like getDivergence()</returns>
+template <typename MergeRow>
+ImageFloat getRowMergedDivergence(const ImageFloat& target, const PixelRect& merged, const MergeRow& merge_row)
+{
+    const int width = target.width;
+    const int height = target.height;
+    // The merged gradients are (w + 1) x (h + 1), their last row and column are zero.
+    const int gw = width + 1;
+    auto div_G = ImageFloat(width + 2, height + 2);
+    // Divergence row y reads the gradients of rows y - 1 and y, which depend on the pixels of rows y - 2 .. y + 1.
+    const int merged_y0 = merged.empty() ? 0 : merged.y0 - 1;
+    const int merged_y1 = merged.empty() ? 0 : merged.y1 + 2;
+
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+    {
+        // Merged gradients of rows y - 1 and y.
+        std::vector<float> dx(static_cast<size_t>(gw)), dy(static_cast<size_t>(gw)), dy_above(static_cast<size_t>(gw));
+        int previous_y = -2;
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < height + 1; y++) {
+            float* out = div_G.data.data() + size_t(y) * size_t(div_G.width);
+            if (y < merged_y0 || y >= merged_y1) {
+                getTargetDivergenceRow(target, y, out);
+                continue;
+            }
+
+            // Rows of a thread are consecutive, dy of the previous row is reused when it is ours.
+            if (y == 0) {
+                std::fill(dy_above.begin(), dy_above.end(), 0.0f);
+            } else if (previous_y == y - 1) {
+                std::swap(dy_above, dy);
+            } else {
+                merge_row(y - 1, dx, dy_above);
+            }
+            merge_row(y, dx, dy);
+            previous_y = y;
+
+            getGradientDivergenceRow(dx.data(), dy.data(), dy_above.data(), gw, y, out);
+        }
+    }
+
+    return div_G;
+}
+
+/// <summary>
+/// Computes getDivergence(copySourceGradientsToTarget(getGradients(source), getGradients(target),
+/// source_mask, offset_x, offset_y)) without storing any gradient image.
+/// </summary>
+/// <param name="source">source image, at the size of the mask</param>
+/// <param name="target">target image</param>
+/// <param name="source_mask">source mask, set pixels take the source gradients</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>div G, 2px larger than the target like getDivergence()</returns>
+ImageFloat getMergedDivergence(const ImageFloat& source, const ImageFloat& target, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0)
+{
+    const int w = target.width;
+    const int h = target.height;
+    const int sw = source.width;
+    const int sh = source.height;
+    const auto placed = source_mask.placed(w, h, offset_x, offset_y);
+
+    // copySourceGradientsToTarget() of row y, from the gradients of the images.
+    return getRowMergedDivergence(target, placed.bounds(), [&](const int y, std::vector<float>& out_dx, std::vector<float>& out_dy) {
+        if (y >= h) {
+            std::fill(out_dx.begin(), out_dx.end(), 0.0f);
+            std::fill(out_dy.begin(), out_dy.end(), 0.0f);
+            return;
+        }
+        const float* t_row = target.data.data() + size_t(y) * size_t(w);
+        const int sy = y - offset_y;
+        const float* s_row = sy >= 0 && sy < sh ? source.data.data() + size_t(sy) * size_t(sw) : nullptr;
+        mergeGradientsRow(t_row, y + 1 < h ? t_row + w : nullptr, s_row, s_row && sy + 1 < sh ? s_row + sw : nullptr, w, sw, placed, y, offset_x, out_dx.data(), out_dy.data());
+    });
+}
+
+/// <summary>
+/// Applies getMergedDivergence() per channel.
+/// </summary>
+/// <param name="source">source image</param>
+/// <param name="target">target image</param>
+/// <param name="source_mask">source mask, at the size of the source</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>div G per channel</returns>
+ImageXYZ getMergedDivergenceXYZ(const ImageXYZ& source, const ImageXYZ& target, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0)
+{
+    return mapPlanes([&](const ImageFloat& source_plane, const ImageFloat& target_plane) { return getMergedDivergence(source_plane, target_plane, source_mask, offset_x, offset_y); }, source, target);
+}
+
+/// <summary>
+/// The last three rows of an RGB image that were asked for, converted to XYZ planes (with the
+/// kernels of rgbToXYZSimd(), bit-identical) when they are not held yet. Rows y - 1, y and y + 1
+/// are held at once.
+/// </summary>
+class XyzRowRing {
+public:
+    XyzRowRing(const ImageView<const glm::vec3> rgb, const color_simd::ColorMatrix& matrix, const SimdIsa isa)
+        : m_rgb(rgb)
+        , m_matrix(matrix)
+        , m_isa(isa)
+        , m_planes(size_t(9) * size_t(rgb.width))
+    {
+    }
+
+    // Plane c (0 = X, 1 = Y, 2 = Z) of row y, nullptr outside the image.
+    const float* row(const int y, const int c)
+    {
+        if (y < 0 || y >= m_rgb.height) {
+            return nullptr;
+        }
+        const int slot = y % 3;
+        float* planes = m_planes.data() + size_t(3 * slot) * size_t(m_rgb.width);
+        if (m_rows[slot] != y) {
+            color_simd::deinterleaveRow<true>(reinterpret_cast<const float*>(m_rgb.row(y)), planes, planes + m_rgb.width, planes + 2 * m_rgb.width, m_rgb.width, m_matrix, m_isa);
+            m_rows[slot] = y;
+        }
+        return planes + size_t(c) * size_t(m_rgb.width);
+    }
+
+private:
+    ImageView<const glm::vec3> m_rgb;
+    color_simd::ColorMatrix m_matrix;
+    SimdIsa m_isa;
+    std::vector<float> m_planes;
+    int m_rows[3] = { -1, -1, -1 };
+};
+
+/// <summary>
+/// getMergedDivergenceXYZ(rgbToXYZSimd(source), rgbToXYZSimd(target), ...) with the color
+/// conversion fused into the rows of the divergence: the source rows are converted in a ring of
+/// three rows and never stored, the target rows are converted once per thread and row (rows next
+/// to a chunk of rows twice) and stored in target_XYZ, which the solver starts from. Bit-identical
+/// to the unfused chain.
+/// </summary>
+/// <param name="source">source image in RGB, at the size of the mask</param>
+/// <param name="target">target image in RGB</param>
+/// <param name="source_mask">source mask, set pixels take the source gradients</param>
+/// <param name="target_XYZ">receives rgbToXYZSimd(target)</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>div G per channel, 2px larger than the target like getDivergence()</returns>
+ImageXYZ getMergedDivergenceRgb(const ImageView<const glm::vec3> source, const ImageView<const glm::vec3> target, const BinaryMask& source_mask, ImageXYZ& target_XYZ,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    const int w = target.width;
+    const int h = target.height;
+    const int sw = source.width;
+    const int gw = w + 1;
+    const auto placed = source_mask.placed(w, h, offset_x, offset_y);
+    const auto merged = placed.bounds();
+    // As getRowMergedDivergence(): rows y - 2 .. y + 1 of the merged region change divergence row y.
+    const int merged_y0 = merged.empty() ? 0 : merged.y0 - 1;
+    const int merged_y1 = merged.empty() ? 0 : merged.y1 + 2;
+    const auto matrix = color_simd::toColorMatrix(color_simd::rgbToXyzMatrix());
+    const auto isa = detectSimdIsa();
+
+    target_XYZ = ImageXYZ { ImageFloat::uninitialized(w, h), ImageFloat::uninitialized(w, h), ImageFloat::uninitialized(w, h) };
+    auto div_G = ImageXYZ { ImageFloat(w + 2, h + 2), ImageFloat(w + 2, h + 2), ImageFloat(w + 2, h + 2) };
+    float* const xyz_planes[3] = { target_XYZ.X.data.data(), target_XYZ.Y.data.data(), target_XYZ.Z.data.data() };
+    float* const div_planes[3] = { div_G.X.data.data(), div_G.Y.data.data(), div_G.Z.data.data() };
+
+#pragma omp parallel num_threads(kernelThreads(int64_t(w) * h * 3, KernelCost::Medium))
+    {
+        XyzRowRing target_rows(target, matrix, isa);
+        XyzRowRing source_rows(source, matrix, isa);
+        std::vector<float> dx(static_cast<size_t>(gw)), dy(static_cast<size_t>(gw)), dy_above(static_cast<size_t>(gw));
+        // Merged gradients of target row r < h, with the source rows around it from the ring.
+        const auto merge_row = [&](const int r, const int c, float* out_dx, float* out_dy) {
+            const int sy = r - offset_y;
+            const float* s_row = source_rows.row(sy, c);
+            mergeGradientsRow(target_rows.row(r, c), target_rows.row(r + 1, c), s_row, s_row ? source_rows.row(sy + 1, c) : nullptr, w, sw, placed, r, offset_x, out_dx, out_dy);
+        };
+
+#pragma omp for schedule(static)
+        for (int y = 0; y < h + 1; y++) {
+            for (int c = 0; c < 3; c++) {
+                if (y < h) {
+                    std::copy_n(target_rows.row(y, c), w, xyz_planes[c] + size_t(y) * size_t(w));
+                }
+                float* out = div_planes[c] + size_t(y) * size_t(w + 2);
+                if (y < merged_y0 || y >= merged_y1) {
+                    getTargetDivergenceRow(target_rows.row(y - 1, c), target_rows.row(y, c), target_rows.row(y + 1, c), w, h, y, out);
+                    continue;
+                }
+                if (y == 0) {
+                    std::fill(dy_above.begin(), dy_above.end(), 0.0f);
+                } else {
+                    merge_row(y - 1, c, dx.data(), dy_above.data());
+                }
+                if (y < h) {
+                    merge_row(y, c, dx.data(), dy.data());
+                } else {
+                    std::fill(dx.begin(), dx.end(), 0.0f);
+                    std::fill(dy.begin(), dy.end(), 0.0f);
+                }
+                getGradientDivergenceRow(dx.data(), dy.data(), dy_above.data(), gw, y, out);
+            }
+        }
+    }
+    return div_G;
+}
+
+/// <summary>
+/// Source placed on the target by its mask, one layer of a multi-source composite.
+/// </summary>
+struct PoissonLayer {
+    // Source image, at the size of the mask.
+    ImageXYZ source;
+    BinaryMask mask;
+    // Target column and row of the source pixel (0, 0).
+    int offset_x = 0, offset_y = 0;
+};
+
+/// <summary>
+/// Owner of every target pixel: 0 for the target, i + 1 where layer i is the last layer whose
+/// placed mask covers the pixel (later layers lie on top of earlier ones).
+/// </summary>
+/// <param name="layers">layers, bottom first (at most 65535)</param>
+/// <param name="width">target width</param>
+/// <param name="height">target height</param>
+/// <returns>width x height owners, row-major</returns>
+std::vector<uint16_t> computeLayerOwners(const std::vector<PoissonLayer>& layers, const int width, const int height)
+{
+    if (layers.size() > 0xffff) {
+        std::cerr << "Too many layers: " << layers.size() << std::endl;
+        throw std::exception();
+    }
+    std::vector<BinaryMask> placed;
+    for (const auto& layer : layers) {
+        placed.push_back(layer.mask.placed(width, height, layer.offset_x, layer.offset_y));
+    }
+    std::vector<uint16_t> owners(size_t(width) * size_t(height), 0);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height * int64_t(layers.size()), KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        uint16_t* row = owners.data() + size_t(y) * size_t(width);
+        for (size_t i = 0; i < placed.size(); i++) {
+            if (placed[i].rowEmpty(y)) {
+                continue;
+            }
+            for (int x = 0; x < width; x++) {
+                if (placed[i](x, y)) {
+                    row[x] = uint16_t(i + 1);
+                }
+            }
+        }
+    }
+    return owners;
+}
+
+/// <summary>
+/// getMergedDivergence() of several sources at once: every pixel takes the gradients of its
+/// owner (see computeLayerOwners()), and gradients between pixels of different owners are zero.
+/// With one layer this is getMergedDivergence().
+/// </summary>
+/// <param name="sources">source plane of every layer, at the size of its mask</param>
+/// <param name="layers">placement of the layers</param>
+/// <param name="target">target image</param>
+/// <param name="owners">computeLayerOwners() of the layers on the target</param>
+/// <returns>div G, 2px larger than the target like getDivergence()</returns>
+ImageFloat getLayeredDivergence(const std::vector<const ImageFloat*>& sources, const std::vector<PoissonLayer>& layers, const ImageFloat& target,
+    const std::vector<uint16_t>& owners)
+{
+    const int w = target.width;
+    const int h = target.height;
+    PixelRect covered;
+    for (const auto& layer : layers) {
+        const auto bounds = layer.mask.bounds();
+        covered = covered.united(PixelRect { bounds.x0 + layer.offset_x, bounds.y0 + layer.offset_y, bounds.x1 + layer.offset_x, bounds.y1 + layer.offset_y }.clamped(w, h));
+    }
+
+    return getRowMergedDivergence(target, covered, [&](const int y, std::vector<float>& out_dx, std::vector<float>& out_dy) {
+        std::fill(out_dx.begin(), out_dx.end(), 0.0f);
+        std::fill(out_dy.begin(), out_dy.end(), 0.0f);
+        if (y >= h) {
+            return;
+        }
+        const float* t_row = target.data.data() + size_t(y) * size_t(w);
+        const uint16_t* owner_row = owners.data() + size_t(y) * size_t(w);
+        for (int x = 0; x < w; x++) {
+            const uint16_t owner = owner_row[x];
+            float gx = 0.0f;
+            float gy = 0.0f;
+            if (owner > 0) {
+                const auto& layer = layers[owner - 1];
+                const ImageFloat& source = *sources[owner - 1];
+                const int sx = x - layer.offset_x;
+                const int sy = y - layer.offset_y;
+                const float* s_row = source.data.data() + size_t(sy) * size_t(source.width);
+                if (sx + 1 < source.width) {
+                    gx = s_row[sx + 1] - s_row[sx];
+                }
+                if (sy + 1 < source.height) {
+                    gy = s_row[sx + source.width] - s_row[sx];
+                }
+            } else {
+                if (x + 1 < w) {
+                    gx = t_row[x + 1] - t_row[x];
+                }
+                if (y + 1 < h) {
+                    gy = t_row[x + w] - t_row[x];
+                }
+            }
+            // Gradients crossing a boundary between owners are zero.
+            if ((x > 0 && owner_row[x - 1] != owner) || (x < w - 1 && owner_row[x + 1] != owner)) {
+                gx = 0.0f;
+            }
+            if ((y > 0 && owner_row[x - w] != owner) || (y < h - 1 && owner_row[x + w] != owner)) {
+                gy = 0.0f;
+            }
+            out_dx[x] = gx;
+            out_dy[x] = gy;
+        }
+    });
+}
+
+/// <summary>
+/// Applies getLayeredDivergence() per channel, with one owner map for all channels.
+/// </summary>
+/// <param name="layers">layers, bottom first</param>
+/// <param name="target">target image</param>
+/// <returns>div G per channel</returns>
+ImageXYZ getLayeredDivergenceXYZ(const std::vector<PoissonLayer>& layers, const ImageXYZ& target)
+{
+    const auto owners = computeLayerOwners(layers, target.X.width, target.X.height);
+    const auto channel = [&](const size_t c) {
+        std::vector<const ImageFloat*> sources;
+        for (const auto& layer : layers) {
+            sources.push_back(&layer.source[c]);
+        }
+        return getLayeredDivergence(sources, layers, target[c], owners);
+    };
+    return ImageXYZ { channel(0), channel(1), channel(2) };
+}
+
+/// <summary>
+/// Initial solution of a layered composite: every target pixel takes the value of its owner.
+/// </summary>
+/// <param name="layers">layers, bottom first</param>
+/// <param name="target">target image</param>
+/// <returns>composite per channel</returns>
+ImageXYZ pasteLayersXYZ(const std::vector<PoissonLayer>& layers, const ImageXYZ& target)
+{
+    const int w = target.X.width;
+    const auto owners = computeLayerOwners(layers, w, target.X.height);
+    auto composite = target;
+    for (size_t c = 0; c < 3; c++) {
+        auto& plane = composite[c];
+#pragma omp parallel for num_threads(kernelThreads(plane, KernelCost::Light))
+        for (int y = 0; y < plane.height; y++) {
+            for (int x = 0; x < w; x++) {
+                const uint16_t owner = owners[size_t(y) * size_t(w) + size_t(x)];
+                if (owner > 0) {
+                    const auto& layer = layers[owner - 1];
+                    const auto& source = layer.source[c];
+                    plane.data[size_t(y) * size_t(w) + size_t(x)] = source.data[size_t(y - layer.offset_y) * size_t(source.width) + size_t(x - layer.offset_x)];
+                }
+            }
+        }
+    }
+    return composite;
+}
+
+#pragma endregion Poisson fused divergence
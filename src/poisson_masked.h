@@ -0,0 +1,190 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "helpers.h"
+#include "mask_geometry.h"
+#include "poisson_common.h"
+#include "plane3.h"
+
+/*
+ * Poisson solve restricted to the edited region.
+ *
+ * copySourceGradientsToTarget() only changes the gradients inside the source mask and on its
+ * boundary, so the solve is restricted to the mask dilated by one pixel and every other pixel
+ * keeps its initial (target) value as a Dirichlet condition. This is the classic Perez et al.
+ * formulation: the seam is pinned to the target instead of diffusing into the whole frame.
+ * The mask may be stored at the source size and placed at an offset in the target.
+ */
+
+#pragma region Poisson masked
+
+/// <summary>
+/// Compact list of the pixels updated by the masked Poisson solve, in row-major order.
+/// </summary>
+struct PoissonActiveRegion {
+    std::vector<int> offsets;
+    // Bounding box of the active pixels, [x0, x1) x [y0, y1). Empty when x0 >= x1.
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+};
+
+/// <summary>
+/// Collects the interior pixels of a width x height target that are inside the placed mask or
+/// share an edge with a masked pixel, 64 pixels at a time: the mask dilated by its rows above and
+/// below and its words shifted by one pixel. Rows without mask pixels around them are skipped.
+/// The 1px frame border is never active.
+/// </summary>
+/// <param name="source_mask">mask at the source size</param>
+/// <param name="width">target width</param>
+/// <param name="height">target height</param>
+/// <param name="offset_x">target column of the mask pixel (0, 0)</param>
+/// <param name="offset_y">target row of the mask pixel (0, 0)</param>
+/// <returns>active pixels</returns>
+PoissonActiveRegion findPoissonActiveRegion(const BinaryMask& source_mask, const int width, const int height, const int offset_x, const int offset_y)
+{
+    const auto placed = source_mask.placed(width, height, offset_x, offset_y);
+    const int words = placed.wordsPerRow();
+    // Only the rows of the mask's bounds and one row around them can be active.
+    const auto bounds = maskGeometry(source_mask)->bounds();
+
+    auto region = PoissonActiveRegion { {}, width, height, 0, 0 };
+    for (int y = std::max(bounds.y0 + offset_y - 1, 1); y < std::min(bounds.y1 + offset_y + 1, height - 1); y++) {
+        if (placed.rowEmpty(y - 1) && placed.rowEmpty(y) && placed.rowEmpty(y + 1)) {
+            continue;
+        }
+        const uint64_t* row = placed.row(y);
+        const uint64_t* above = placed.row(y - 1);
+        const uint64_t* below = placed.row(y + 1);
+        for (int i = 0; i < words; i++) {
+            // Bit x is set when pixel x or one of its 4 neighbors is masked.
+            const uint64_t left = (row[i] << 1) | (i > 0 ? row[i - 1] >> 63 : 0);
+            const uint64_t right = (row[i] >> 1) | (i + 1 < words ? row[i + 1] << 63 : 0);
+            uint64_t active = row[i] | left | right | above[i] | below[i];
+            // Only the interior columns [1, width - 1).
+            if (i == 0) {
+                active &= ~uint64_t(1);
+            }
+            const int end = width - 1 - i * 64;
+            if (end < 64) {
+                active &= end > 0 ? (uint64_t(1) << end) - 1 : 0;
+            }
+            for (; active != 0; active &= active - 1) {
+                const int x = i * 64 + std::countr_zero(active);
+                region.offsets.push_back(y * width + x);
+                region.x0 = std::min(region.x0, x);
+                region.y0 = std::min(region.y0, y);
+                region.x1 = std::max(region.x1, x + 1);
+                region.y1 = std::max(region.y1, y + 1);
+            }
+        }
+    }
+    return region;
+}
+
+/// <summary>
+/// Collects the interior pixels that are inside the mask or share an edge with a masked pixel,
+/// for a mask of the target size.
+/// </summary>
+/// <param name="source_mask">mask of the edited pixels</param>
+/// <returns>active pixels</returns>
+PoissonActiveRegion findPoissonActiveRegion(const BinaryMask& source_mask)
+{
+    return findPoissonActiveRegion(source_mask, source_mask.width(), source_mask.height(), 0, 0);
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G only on the given active pixels.
+/// All other pixels of initial_solution are kept as Dirichlet values.
+/// </summary>
+/// <param name="initial_solution">initial solution (target image)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="region">active pixels, see findPoissonActiveRegion()</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="control">progress output and cancellation; updates are not measured</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonMasked(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const PoissonActiveRegion& region, const int num_iters = 2000,
+    const PoissonControl& control = {})
+{
+    const int w = initial_solution.width;
+    const int dw = divergence_G.width;
+    const int num_active = int(region.offsets.size());
+    const auto method_text = "masked, " + std::to_string(num_active) + " px";
+
+    // Both buffers start with the fixed pixels in place; only active pixels are ever written.
+    auto I = initial_solution.clone();
+    auto I_next = initial_solution.clone();
+    ImageFloat* current = &I;
+    ImageFloat* next = &I_next;
+    // Shared by all threads, set between the barriers of an iteration.
+    bool cancelled = false;
+
+#pragma omp parallel num_threads(kernelThreads(int64_t(num_active), KernelCost::Light))
+    {
+        for (auto iter = 0; iter < num_iters && !cancelled; iter++) {
+#pragma omp master
+            if (control.reports(iter)) {
+                control.report({ iter, num_iters, std::numeric_limits<float>::quiet_NaN(), method_text });
+            }
+
+            const auto& src = current->data;
+            auto& dst = next->data;
+
+#pragma omp for schedule(static)
+            for (int k = 0; k < num_active; k++) {
+                const int i = region.offsets[k];
+                const int x = i % w;
+                const int y = i / w;
+                dst[i] = 0.25f * (src[i + 1] + src[i - 1] + src[i + w] + src[i - w] - divergence_G.data[y * dw + x]);
+            }
+
+#pragma omp single
+            {
+                std::swap(current, next);
+                cancelled = control.checkpoint();
+            }
+        }
+    }
+    control.throwIfCancelled();
+
+    return std::move(*current);
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G inside the dilated source mask only.
+/// </summary>
+/// <param name="initial_solution">initial solution (target image)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="source_mask">mask of the pasted source, at the source size</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonMasked(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const BinaryMask& source_mask, const int num_iters = 2000,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    const auto region = findPoissonActiveRegion(source_mask, initial_solution.width, initial_solution.height, offset_x, offset_y);
+    return solvePoissonMasked(initial_solution, divergence_G, region, num_iters);
+}
+
+/// <summary>
+/// Solves the masked poisson equation for each channel, sharing one active region.
+/// </summary>
+/// <param name="targetXYZ">initial solution (target image)</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="source_mask">mask of the pasted source, at the source size</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonMaskedXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const BinaryMask& source_mask, const int num_iters = 2000,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    const auto region = findPoissonActiveRegion(source_mask, targetXYZ.X.width, targetXYZ.X.height, offset_x, offset_y);
+    return mapPlanes([&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonMasked(target, divergence, region, num_iters); }, targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson masked
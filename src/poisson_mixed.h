@@ -0,0 +1,263 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "helpers.h"
+#include "execution.h"
+#include "half_float.h"
+#include "poisson_common.h"
+
+/*
+ * Mixed-precision iterative refinement for the Poisson problem of solvePoisson().
+ *
+ * The stencil sweeps are bandwidth bound, so most of them run on 16-bit storage (half or
+ * bfloat16, see half_float.h): every outer step computes the residual r = f - lap(u) of the fp32
+ * solution, scales it into the 16-bit range, runs inner_iters sweeps of lap(e) = r on the 16-bit
+ * correction e (zero border, rows widened to fp32 for the arithmetic) and adds e to u in fp32.
+ * Jacobi and SOR are stationary iterations, so in exact arithmetic k sweeps on the correction from
+ * zero are k more sweeps of u: the result follows the fp32 solve of the same total sweeps, while
+ * the 16-bit rounding only limits how much one outer step can gain (about 1e3 for half, 1e2 for
+ * bfloat16) and is corrected by the next fp32 residual.
+ *
+ * The residual is scaled by 1 / (max |r| * inner_iters): the averaging sweeps grow the correction
+ * by at most max |f| / 4 per sweep, so it stays below 1 and far from the half overflow, while the
+ * small values of r keep their bits. The red-black sweep updates the rows of one parity at a
+ * time, so a thread writing a whole row never overlaps the rows other threads read.
+ */
+
+#pragma region Poisson mixed precision
+
+/// <summary>
+/// 16-bit storage of the correction sweeps.
+/// </summary>
+enum class PoissonStorage {
+    // IEEE half: 10-bit mantissa, the more accurate steps.
+    Half,
+    // bfloat16: 8-bit mantissa, the fp32 range.
+    Bfloat16,
+};
+
+/// <summary>
+/// Sweeps of the correction equation.
+/// </summary>
+enum class MixedPoissonSmoother {
+    Jacobi,
+    RedBlackSor,
+};
+
+/// <summary>
+/// Jacobi sweeps of sum(neighbors) - 4 e = r on 16-bit images; the border of both buffers stays as it is.
+/// </summary>
+/// <param name="e">correction, holds the result</param>
+/// <param name="e_next">second buffer of the size of e with the same border</param>
+/// <param name="r">right-hand side of the size of e</param>
+/// <param name="num_sweeps">number of sweeps</param>
+template <typename T>
+void sweepPoissonJacobi16(Image<T>& e, Image<T>& e_next, const Image<T>& r, const int num_sweeps)
+{
+    const int w = e.width;
+    const int h = e.height;
+#pragma omp parallel num_threads(kernelThreads(e, KernelCost::Light))
+    {
+        std::vector<float> up(static_cast<size_t>(w)), mid(static_cast<size_t>(w)), down(static_cast<size_t>(w));
+        std::vector<float> rhs(static_cast<size_t>(w)), out(static_cast<size_t>(w));
+        // Every thread swaps its own copies, identically.
+        Image<T>* current = &e;
+        Image<T>* next = &e_next;
+        for (int sweep = 0; sweep < num_sweeps; sweep++) {
+            const T* src = current->data.data();
+            T* dst = next->data.data();
+            // A thread sweeps contiguous rows, so each row is widened once and then moves up the window.
+            int window_y = -1;
+#pragma omp for schedule(static)
+            for (int y = 1; y < h - 1; y++) {
+                if (y == window_y + 1) {
+                    std::swap(up, mid);
+                    std::swap(mid, down);
+                } else {
+                    loadRow(src + size_t(y - 1) * size_t(w), up.data(), w);
+                    loadRow(src + size_t(y) * size_t(w), mid.data(), w);
+                }
+                loadRow(src + size_t(y + 1) * size_t(w), down.data(), w);
+                window_y = y;
+                loadRow(r.data.data() + size_t(y) * size_t(w), rhs.data(), w);
+                out[0] = mid[0];
+                out[w - 1] = mid[w - 1];
+#pragma omp simd
+                for (int x = 1; x < w - 1; x++) {
+                    out[x] = 0.25f * (mid[x + 1] + mid[x - 1] + down[x] + up[x] - rhs[x]);
+                }
+                storeRow(out.data(), dst + size_t(y) * size_t(w), w);
+            }
+            // Implicit barrier: the sweep is complete before it is read.
+            std::swap(current, next);
+        }
+    }
+    if (num_sweeps % 2 == 1) {
+        std::swap(e.data, e_next.data);
+    }
+}
+
+/// <summary>
+/// Red-black SOR sweeps of sum(neighbors) - 4 e = r on a 16-bit image, the update of smoothPoissonRedBlack().
+/// </summary>
+/// <param name="e">correction updated in place</param>
+/// <param name="r">right-hand side of the size of e</param>
+/// <param name="num_sweeps">number of full (red + black) sweeps</param>
+/// <param name="omega">relaxation factor in (0, 2)</param>
+template <typename T>
+void sweepPoissonRedBlack16(Image<T>& e, const Image<T>& r, const int num_sweeps, const float omega)
+{
+    const int w = e.width;
+    const int h = e.height;
+#pragma omp parallel num_threads(kernelThreads(e, KernelCost::Light))
+    {
+        std::vector<float> up(static_cast<size_t>(w)), mid(static_cast<size_t>(w)), down(static_cast<size_t>(w)), rhs(static_cast<size_t>(w));
+        T* u = e.data.data();
+        for (int sweep = 0; sweep < num_sweeps; sweep++) {
+            for (int color = 0; color < 2; color++) {
+                // Rows of one parity are written while the rows of the other one are only read.
+                for (int parity = 0; parity < 2; parity++) {
+                    // The row below a row is the row above the next one of the thread. No row is loaded
+                    // yet: -1 would match the first row 1 and reuse the rows of the previous pass.
+                    int window_y = -3;
+#pragma omp for schedule(static)
+                    for (int y = 1 + parity; y < h - 1; y += 2) {
+                        if (y == window_y + 2) {
+                            std::swap(up, down);
+                        } else {
+                            loadRow(u + size_t(y - 1) * size_t(w), up.data(), w);
+                        }
+                        loadRow(u + size_t(y) * size_t(w), mid.data(), w);
+                        loadRow(u + size_t(y + 1) * size_t(w), down.data(), w);
+                        window_y = y;
+                        loadRow(r.data.data() + size_t(y) * size_t(w), rhs.data(), w);
+                        // Neighbors in the row have the other color and are not changed by the update.
+                        for (int x = 1 + ((y + 1 + color) & 1); x < w - 1; x += 2) {
+                            const float gs = 0.25f * (mid[x - 1] + mid[x + 1] + up[x] + down[x] - rhs[x]);
+                            mid[x] += omega * (gs - mid[x]);
+                        }
+                        storeRow(mid.data(), u + size_t(y) * size_t(w), w);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Refinement loop of solvePoissonMixed() with the storage type T.
+/// </summary>
+template <typename T>
+ImageFloat solvePoissonMixedAs(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters, const MixedPoissonSmoother smoother,
+    const float omega, const int inner_iters, PoissonStats* stats)
+{
+    const int w = initial_solution.width;
+    const int h = initial_solution.height;
+    const int threads = kernelThreads(initial_solution, KernelCost::Light);
+    const float relaxation = omega > 0.0f ? omega : computeOptimalSorOmega(w, h);
+    const int step_iters = std::max(inner_iters, 1);
+
+    auto u = initial_solution.clone();
+    const auto f = cropPoissonRhs(divergence_G, w, h);
+    auto r = ImageFloat::uninitialized(w, h);
+    auto r16 = Image<T>::uninitialized(w, h);
+    auto e16 = Image<T>::uninitialized(w, h);
+    auto e16_next = smoother == MixedPoissonSmoother::Jacobi ? Image<T>::uninitialized(w, h) : Image<T>::uninitialized(0, 0);
+
+    double initial_norm2 = -1.0;
+    double norm2 = 0.0;
+    int iters = 0;
+    while (true) {
+        norm2 = computePoissonResidual(u, f, r);
+        if (initial_norm2 < 0.0) {
+            initial_norm2 = norm2;
+        }
+        if (iters >= num_iters) {
+            break;
+        }
+        float max_residual = 0.0f;
+#pragma omp parallel for num_threads(threads) reduction(max : max_residual)
+        for (int i = 0; i < int(r.data.size()); i++) {
+            max_residual = std::max(max_residual, std::abs(r.data[i]));
+        }
+        if (!(max_residual > 0.0f) || !std::isfinite(max_residual)) {
+            break;
+        }
+        const int sweeps = std::min(step_iters, num_iters - iters);
+        const float scale = 1.0f / (max_residual * float(sweeps));
+
+        // Scaled residual and a zero correction, in 16 bit.
+#pragma omp parallel num_threads(threads)
+        {
+            std::vector<float> row(static_cast<size_t>(w));
+#pragma omp for schedule(static)
+            for (int y = 0; y < h; y++) {
+                const float* residual = r.data.data() + size_t(y) * size_t(w);
+                for (int x = 0; x < w; x++) {
+                    row[x] = scale * residual[x];
+                }
+                storeRow(row.data(), r16.data.data() + size_t(y) * size_t(w), w);
+                std::fill(e16.data.begin() + ptrdiff_t(y) * w, e16.data.begin() + ptrdiff_t(y + 1) * w, T(0.0f));
+                if (!e16_next.data.empty()) {
+                    std::fill(e16_next.data.begin() + ptrdiff_t(y) * w, e16_next.data.begin() + ptrdiff_t(y + 1) * w, T(0.0f));
+                }
+            }
+        }
+
+        if (smoother == MixedPoissonSmoother::Jacobi) {
+            sweepPoissonJacobi16(e16, e16_next, r16, sweeps);
+        } else {
+            sweepPoissonRedBlack16(e16, r16, sweeps, relaxation);
+        }
+
+        // u += e in fp32; the border of e is zero, so the Dirichlet values are kept.
+        const float unscale = 1.0f / scale;
+#pragma omp parallel num_threads(threads)
+        {
+            std::vector<float> row(static_cast<size_t>(w));
+#pragma omp for schedule(static)
+            for (int y = 1; y < h - 1; y++) {
+                loadRow(e16.data.data() + size_t(y) * size_t(w), row.data(), w);
+                float* solution = u.data.data() + size_t(y) * size_t(w);
+                for (int x = 1; x < w - 1; x++) {
+                    solution[x] += unscale * row[x];
+                }
+            }
+        }
+        iters += sweeps;
+    }
+
+    if (stats) {
+        stats->iterations = iters;
+        stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
+    }
+    return u;
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G by mixed-precision iterative refinement, see
+/// above. Follows solvePoisson() with the same scheme and number of iterations.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="num_iters">total number of sweeps</param>
+/// <param name="smoother">sweeps of the correction equation</param>
+/// <param name="storage">16-bit type of the correction and residual</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="inner_iters">16-bit sweeps per fp32 refinement step</param>
+/// <param name="stats">optional output of sweeps run and final relative residual</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonMixed(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters = 2000,
+    const MixedPoissonSmoother smoother = MixedPoissonSmoother::Jacobi, const PoissonStorage storage = PoissonStorage::Half, const float omega = 0.0f,
+    const int inner_iters = 100, PoissonStats* stats = nullptr)
+{
+    if (storage == PoissonStorage::Bfloat16) {
+        return solvePoissonMixedAs<bfloat16>(initial_solution, divergence_G, num_iters, smoother, omega, inner_iters, stats);
+    }
+    return solvePoissonMixedAs<half>(initial_solution, divergence_G, num_iters, smoother, omega, inner_iters, stats);
+}
+
+#pragma endregion Poisson mixed precision
@@ -0,0 +1,339 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "helpers.h"
+#include "poisson_common.h"
+#include "plane3.h"
+
+/*
+ * Geometric multigrid solver for the Poisson problem solved by solvePoisson().
+ *
+ * The discretization is the same 5-point Laplacian with Dirichlet values taken from the
+ * 1px border of the initial solution. Coarse levels solve for the correction of the fine
+ * residual with a homogeneous Dirichlet border, using the restriction that is the transpose of
+ * the prolongation (4 times full weighting inside the image), bilinear prolongation and red-black
+ * Gauss-Seidel smoothing.
+ *
+ * Coarse node i of a side of n fine nodes lies on fine node min(2i, n - 1), so every level is
+ * (n / 2 + 1) nodes across and its border lies on the fine border. On an odd side that is fine
+ * node 2i everywhere; on an even side the last coarse node is the last fine node, one fine step
+ * from the node before it. As in the coarsening of stencil_solver.h, that edge conducts twice as
+ * much as a full coarse edge, and its conductance carries down to the next levels (two edges in
+ * series on an odd side, doubled again on an even one). Only the edges into the right and bottom
+ * border differ, so a level keeps their two conductances: they add to the diagonal of the last
+ * free column and row, and weight the prolongation to the fine node between the last free coarse
+ * node and the border.
+ */
+
+#pragma region Poisson multigrid
+
+/// <summary>
+/// Multigrid cycle shapes.
+/// </summary>
+enum class MultigridCycle {
+    V,
+    F,
+};
+
+/// <summary>
+/// One level of the multigrid hierarchy: unknowns and right-hand side of the same size.
+/// </summary>
+struct MultigridLevel {
+    ImageFloat u;
+    ImageFloat f;
+    ImageFloat r;
+    // Conductance of the edges from the last free column into the right border and from the last
+    // free row into the bottom border, relative to the other edges, see above.
+    float east = 1.0f;
+    float south = 1.0f;
+
+    bool uniform() const { return east == 1.0f && south == 1.0f; }
+
+    // Diagonal of the operator at free node (x, y).
+    float diagonal(const int x, const int y) const
+    {
+        return 4.0f + (x == u.width - 2 ? east - 1.0f : 0.0f) + (y == u.height - 2 ? south - 1.0f : 0.0f);
+    }
+};
+
+/// <summary>
+/// Rounding error of a residual value in float epsilons of the magnitude of its terms, |f| + 8 |u|.
+/// A cycle that makes a residual below it grow only meets the rounding, the end of the solve
+/// rather than a failure.
+/// </summary>
+constexpr double MULTIGRID_ROUNDING_EPSILONS = 16.0;
+
+/// <summary>
+/// Conductance of the last edge of a side of the next coarser level, see above.
+/// </summary>
+/// <param name="fine_nodes">nodes of the fine side</param>
+/// <param name="conductance">conductance of the last fine edge</param>
+inline float coarseBorderConductance(const int fine_nodes, const float conductance)
+{
+    // Odd: a free fine edge and the border edge in series over the doubled spacing. Even: the
+    // border edge alone, at half the coarse spacing.
+    return fine_nodes % 2 == 1 ? 2.0f * conductance / (1.0f + conductance) : 2.0f * conductance;
+}
+
+/// <summary>
+/// Weight of coarse node i in the prolongation to fine node x of a side of n fine nodes whose last
+/// edge has the given conductance, see above.
+/// </summary>
+inline float multigridWeight(const int x, const int i, const int n, const float conductance)
+{
+    const int node = std::min(2 * i, n - 1);
+    if (x == node) {
+        return 1.0f;
+    }
+    if (x % 2 == 0 || std::abs(x - node) != 1) {
+        return 0.0f;
+    }
+    // Between two coarse nodes, weighted by the conductances of its two fine edges.
+    const float left = 1.0f / (1.0f + (x + 1 == n - 1 ? conductance : 1.0f));
+    return x > node ? left : 1.0f - left;
+}
+
+/// <summary>
+/// Red-black Gauss-Seidel sweeps of a level, see smoothPoissonRedBlack().
+/// </summary>
+void smoothMultigridLevel(MultigridLevel& level, const int num_sweeps)
+{
+    if (level.uniform()) {
+        smoothPoissonRedBlack(level.u, level.f, num_sweeps);
+        return;
+    }
+    // The border of a coarse level is 0, so only the diagonal changes.
+    auto& u = level.u;
+    const int w = u.width;
+    const JobControl* const job = currentJobControl();
+    for (int sweep = 0; sweep < num_sweeps; sweep++) {
+        throwIfCancelled(job);
+        for (int color = 0; color < 2; color++) {
+#pragma omp parallel for num_threads(kernelThreads(u, KernelCost::Light))
+            for (int y = 1; y < u.height - 1; y++) {
+                for (int x = 1 + ((y + 1 + color) & 1); x < w - 1; x += 2) {
+                    const int i = y * w + x;
+                    u.data[i] = (u.data[i - 1] + u.data[i + 1] + u.data[i - w] + u.data[i + w] - level.f.data[i]) / level.diagonal(x, y);
+                }
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Residual of a level into level.r, see computePoissonResidual().
+/// </summary>
+/// <returns>squared L2 norm of the residual</returns>
+double computeMultigridResidual(MultigridLevel& level)
+{
+    if (level.uniform()) {
+        return computePoissonResidual(level.u, level.f, level.r);
+    }
+    const auto& u = level.u;
+    const int w = u.width, h = u.height;
+    return reproducibleSum<double>(h, 1, kernelThreads(u, KernelCost::Light), [&](const int64_t row, const int64_t) {
+        const int y = int(row);
+        double norm2 = 0.0;
+        for (int x = 0; x < w; x++) {
+            const int i = y * w + x;
+            if (x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+                level.r.data[i] = 0.0f;
+                continue;
+            }
+            const float res = level.f.data[i] - (u.data[i - 1] + u.data[i + 1] + u.data[i - w] + u.data[i + w] - level.diagonal(x, y) * u.data[i]);
+            level.r.data[i] = res;
+            norm2 += double(res) * double(res);
+        }
+        return norm2;
+    });
+}
+
+/// <summary>
+/// Restriction of the fine residual to the coarse right-hand side, the transpose of
+/// prolongateAndCorrect(): 4 times full weighting inside the image, see above.
+/// </summary>
+void restrictResidual(const MultigridLevel& fine, MultigridLevel& coarse)
+{
+    const int fw = fine.r.width;
+    const int fh = fine.r.height;
+    auto& coarse_f = coarse.f;
+#pragma omp parallel for num_threads(kernelThreads(coarse_f, KernelCost::Light))
+    for (int j = 0; j < coarse_f.height; j++) {
+        for (int i = 0; i < coarse_f.width; i++) {
+            if (i == 0 || j == 0 || i == coarse_f.width - 1 || j == coarse_f.height - 1) {
+                coarse_f.data[j * coarse_f.width + i] = 0.0f;
+                continue;
+            }
+            const int x0 = std::min(2 * i, fw - 1);
+            const int y0 = std::min(2 * j, fh - 1);
+            float sum = 0.0f;
+            // The fine border has no residual.
+            for (int y = std::max(y0 - 1, 1); y <= std::min(y0 + 1, fh - 2); y++) {
+                const float wy = multigridWeight(y, j, fh, fine.south);
+                for (int x = std::max(x0 - 1, 1); x <= std::min(x0 + 1, fw - 2); x++) {
+                    sum += wy * multigridWeight(x, i, fw, fine.east) * fine.r.data[y * fw + x];
+                }
+            }
+            coarse_f.data[j * coarse_f.width + i] = sum;
+        }
+    }
+}
+
+/// <summary>
+/// Bilinear prolongation of the coarse correction, added to the interior of the fine solution.
+/// </summary>
+void prolongateAndCorrect(const MultigridLevel& coarse, MultigridLevel& fine)
+{
+    const auto& coarse_u = coarse.u;
+    auto& fine_u = fine.u;
+    const int cw = coarse_u.width;
+    const int fw = fine_u.width;
+    const int fh = fine_u.height;
+#pragma omp parallel for num_threads(kernelThreads(fine_u, KernelCost::Light))
+    for (int y = 1; y < fh - 1; y++) {
+        const int j = y / 2;
+        const float top_weight = multigridWeight(y, j, fh, fine.south);
+        const float bottom_weight = j + 1 < coarse_u.height ? multigridWeight(y, j + 1, fh, fine.south) : 0.0f;
+        const int j1 = std::min(j + 1, coarse_u.height - 1);
+        for (int x = 1; x < fw - 1; x++) {
+            const int i = x / 2;
+            const int i1 = std::min(i + 1, cw - 1);
+            const float left_weight = multigridWeight(x, i, fw, fine.east);
+            const float right_weight = i + 1 < cw ? multigridWeight(x, i + 1, fw, fine.east) : 0.0f;
+            const float top = left_weight * coarse_u.data[j * cw + i] + right_weight * coarse_u.data[j * cw + i1];
+            const float bottom = left_weight * coarse_u.data[j1 * cw + i] + right_weight * coarse_u.data[j1 * cw + i1];
+            fine_u.data[y * fw + x] += top_weight * top + bottom_weight * bottom;
+        }
+    }
+}
+
+/// <summary>
+/// Recursively runs one multigrid cycle starting at the given level.
+/// </summary>
+void runMultigridCycle(std::vector<MultigridLevel>& levels, const size_t level, const MultigridCycle cycle)
+{
+    const int PRE_SMOOTH = 2;
+    const int POST_SMOOTH = 2;
+    const int COARSEST_SWEEPS = 50;
+
+    auto& current = levels[level];
+    if (level + 1 == levels.size()) {
+        smoothMultigridLevel(current, COARSEST_SWEEPS);
+        return;
+    }
+
+    smoothMultigridLevel(current, PRE_SMOOTH);
+    computeMultigridResidual(current);
+
+    auto& coarse = levels[level + 1];
+    restrictResidual(current, coarse);
+    std::fill(coarse.u.data.begin(), coarse.u.data.end(), 0.0f);
+    runMultigridCycle(levels, level + 1, cycle);
+    if (cycle == MultigridCycle::F) {
+        // F-cycle: the coarse correction is refined by one more V-cycle.
+        runMultigridCycle(levels, level + 1, MultigridCycle::V);
+    }
+    prolongateAndCorrect(coarse, current);
+
+    smoothMultigridLevel(current, POST_SMOOTH);
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G using geometric multigrid.
+/// Uses the same border convention as solvePoisson(): the 1px border of initial_solution is kept fixed.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="tolerance">stop when the residual drops below tolerance * initial residual</param>
+/// <param name="max_cycles">upper bound on the number of cycles</param>
+/// <param name="cycle">cycle shape</param>
+/// <param name="stats">optional output of cycles used, final relative residual and whether the residual grew</param>
+/// <returns>luminance I, before the cycle that made the residual grow if one did</returns>
+ImageFloat solvePoissonMultigrid(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const float tolerance = 1e-4f,
+    const int max_cycles = 50, const MultigridCycle cycle = MultigridCycle::V, PoissonStats* stats = nullptr)
+{
+    // Coarsen until the grid is only a few pixels across.
+    const int MIN_LEVEL_SIZE = 5;
+
+    std::vector<MultigridLevel> levels;
+    levels.push_back({ initial_solution.clone(), ImageFloat(initial_solution.width, initial_solution.height), ImageFloat(initial_solution.width, initial_solution.height) });
+
+    int w = initial_solution.width;
+    int h = initial_solution.height;
+    while (std::min(w, h) > MIN_LEVEL_SIZE) {
+        const float east = coarseBorderConductance(w, levels.back().east);
+        const float south = coarseBorderConductance(h, levels.back().south);
+        w = w / 2 + 1;
+        h = h / 2 + 1;
+        levels.push_back({ ImageFloat(w, h), ImageFloat(w, h), ImageFloat(w, h), east, south });
+    }
+
+    auto& finest = levels.front();
+    finest.f = cropPoissonRhs(divergence_G, finest.u.width, finest.u.height);
+
+    const double initial_norm2 = computePoissonResidual(finest.u, finest.f, finest.r);
+    const double threshold2 = initial_norm2 * double(tolerance) * double(tolerance);
+    double norm2 = initial_norm2;
+
+    // Squared norm of the residual that is only the rounding of its terms, see MULTIGRID_ROUNDING_EPSILONS.
+    const auto size = int64_t(finest.u.data.size());
+    const double rounding_norm2 = reproducibleSum<double>(size, REDUCTION_CHUNK, kernelThreads(size, KernelCost::Light), [&](const int64_t begin, const int64_t end) {
+        double sum = 0.0;
+        for (int64_t i = begin; i < end; i++) {
+            const double magnitude = std::abs(double(finest.f.data[i])) + 8.0 * std::abs(double(finest.u.data[i]));
+            sum += magnitude * magnitude;
+        }
+        return sum;
+    }) * std::pow(MULTIGRID_ROUNDING_EPSILONS * double(std::numeric_limits<float>::epsilon()), 2);
+
+    // The solution before the last cycle, kept in case the residual grows.
+    auto previous = ImageFloat::uninitialized(finest.u.width, finest.u.height);
+    bool diverged = false;
+    int cycles = 0;
+    while (cycles < max_cycles && norm2 > threshold2) {
+        std::copy(finest.u.data.begin(), finest.u.data.end(), previous.data.begin());
+        runMultigridCycle(levels, 0, cycle);
+        const double next_norm2 = computePoissonResidual(finest.u, finest.f, finest.r);
+        cycles++;
+        if (!(next_norm2 <= norm2)) {
+            // The cycle made the solution worse: stop with the one before. At the rounding of
+            // float that is the end of the progress, above it the solve failed.
+            std::swap(finest.u, previous);
+            if (norm2 > rounding_norm2) {
+                const double relative = initial_norm2 > 0.0 ? std::sqrt(norm2 / initial_norm2) : 0.0;
+                diverged = true;
+                std::cerr << "solvePoissonMultigrid: the residual grew in cycle " << cycles << " (" << initial_solution.width << " x " << initial_solution.height
+                          << "), stopped at relative residual " << relative << "." << std::endl;
+            }
+            break;
+        }
+        norm2 = next_norm2;
+    }
+
+    if (stats) {
+        stats->iterations = cycles;
+        stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
+        stats->diverged = diverged;
+    }
+
+    return std::move(finest.u);
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G for each channel using multigrid.
+/// </summary>
+/// <param name="targetXYZ">initial solution and border values</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="tolerance">relative residual tolerance</param>
+/// <param name="max_cycles">upper bound on the number of cycles</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonMultigridXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const float tolerance = 1e-4f, const int max_cycles = 50)
+{
+    return mapPlanes([&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonMultigrid(target, divergence, tolerance, max_cycles); }, targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson multigrid
@@ -0,0 +1,401 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "binary_mask.h"
+#include "content_hash.h"
+#include "helpers.h"
+#include "plane3.h"
+#include "poisson_masked.h"
+
+/*
+ * Masked Poisson solves prepared once per mask.
+ *
+ * The masked system of poisson_masked.h depends on the mask, its placement and the size of the
+ * target only: 4 u_p - sum of the active neighbours u_q = sum of the fixed neighbours t_q - div_p
+ * for every active pixel p. Jobs that paste different sources into different targets through
+ * the same mask only change the right-hand side, so PreparedPoissonMask factorizes the matrix
+ * once, A = L L^T (sparse Cholesky, in double), and every solve is a forward and a backward
+ * substitution, the exact solution of the system instead of the state after a number of sweeps.
+ *
+ *  - The unknowns are ordered by nested dissection of the bounding box of the region: a
+ *    rectangle is split at the middle line of its longer side, both halves are ordered
+ *    (recursively) before the line, down to rectangles of NESTED_DISSECTION_LEAF_PIXELS. The
+ *    fill of L then grows as n log n on the pixels of a 2D region instead of n^1.5 for a
+ *    row-major order.
+ *  - The factorization is the up-looking one of CSparse (Davis): the elimination tree, the
+ *    pattern of every row of L by a walk up the tree (ereach), the column counts, then the
+ *    numeric rows. Factors above PREPARED_POISSON_MAX_FACTOR_BYTES are refused before they are
+ *    allocated.
+ *  - solveXYZ() substitutes the three planes together, every entry of L applied to the three
+ *    right-hand sides at once.
+ *
+ * preparedPoissonMask() keeps the last PREPARED_POISSON_CACHE_ENTRIES factorizations by a
+ * ContentHash of the mask bits, the placement and the target size, for all jobs of the process.
+ */
+
+#pragma region Poisson prepared
+
+/// <summary>
+/// Number of factorizations preparedPoissonMask() keeps.
+/// </summary>
+constexpr size_t PREPARED_POISSON_CACHE_ENTRIES = 4;
+
+/// <summary>
+/// Largest factor (indices and values) a PreparedPoissonMask allocates.
+/// </summary>
+constexpr size_t PREPARED_POISSON_MAX_FACTOR_BYTES = size_t(2) << 30;
+
+/// <summary>
+/// Rectangles of at most this many pixels end the nested dissection, ordered row by row.
+/// </summary>
+constexpr int NESTED_DISSECTION_LEAF_PIXELS = 64;
+
+/// <summary>
+/// Cholesky factorization of the masked Poisson system of one mask placement, see above.
+/// </summary>
+class PreparedPoissonMask {
+public:
+    /// <param name="source_mask">mask of the pasted source, at the source size</param>
+    /// <param name="width">target width</param>
+    /// <param name="height">target height</param>
+    /// <param name="offset_x">target column of the mask pixel (0, 0)</param>
+    /// <param name="offset_y">target row of the mask pixel (0, 0)</param>
+    PreparedPoissonMask(const BinaryMask& source_mask, const int width, const int height, const int offset_x = 0, const int offset_y = 0)
+        : m_width(width)
+        , m_height(height)
+    {
+        const auto region = findPoissonActiveRegion(source_mask, width, height, offset_x, offset_y);
+        if (region.offsets.empty()) {
+            return;
+        }
+        // The box of the region and its neighbours, which the 1px frame keeps inside the target.
+        m_box_x0 = region.x0 - 1;
+        m_box_y0 = region.y0 - 1;
+        m_box_width = region.x1 - region.x0 + 2;
+        m_index.assign(size_t(m_box_width) * size_t(region.y1 - region.y0 + 2), -1);
+        for (const int offset : region.offsets) {
+            m_index[boxIndex(offset % width, offset / width)] = UNORDERED;
+        }
+        m_pixels.reserve(region.offsets.size());
+        dissect(region.x0, region.y0, region.x1, region.y1);
+        factorize();
+    }
+
+    PreparedPoissonMask(const PreparedPoissonMask&) = delete;
+    PreparedPoissonMask& operator=(const PreparedPoissonMask&) = delete;
+
+    /// <summary>
+    /// Active pixels, the unknowns of the system.
+    /// </summary>
+    size_t unknowns() const { return m_pixels.size(); }
+
+    /// <summary>
+    /// Nonzeros of the factor L.
+    /// </summary>
+    size_t factorNonzeros() const { return m_Lx.size(); }
+
+    /// <summary>
+    /// Solves grad^2 I = div G on the active pixels; all other pixels keep their initial value.
+    /// </summary>
+    /// <param name="initial_solution">initial solution (target image), the Dirichlet values</param>
+    /// <param name="divergence_G">div G</param>
+    /// <returns>luminance I</returns>
+    ImageFloat solve(const ImageFloat& initial_solution, const ImageFloat& divergence_G) const
+    {
+        auto result = initial_solution.clone();
+        substitute<1>({ &initial_solution }, { &divergence_G }, { &result });
+        return result;
+    }
+
+    /// <summary>
+    /// solve() of the three channels, substituted together.
+    /// </summary>
+    ImageXYZ solveXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G) const
+    {
+        ImageXYZ result(targetXYZ.X.clone(), targetXYZ.Y.clone(), targetXYZ.Z.clone());
+        substitute<3>({ &targetXYZ.X, &targetXYZ.Y, &targetXYZ.Z }, { &divergenceXYZ_G.X, &divergenceXYZ_G.Y, &divergenceXYZ_G.Z }, { &result.X, &result.Y, &result.Z });
+        return result;
+    }
+
+private:
+    // Marks an active pixel in m_index before the dissection orders it.
+    static constexpr int UNORDERED = -2;
+
+    size_t boxIndex(const int x, const int y) const { return size_t(y - m_box_y0) * size_t(m_box_width) + size_t(x - m_box_x0); }
+
+    void order(const int x, const int y)
+    {
+        int& index = m_index[boxIndex(x, y)];
+        if (index == UNORDERED) {
+            index = int(m_pixels.size());
+            m_pixels.push_back(y * m_width + x);
+        }
+    }
+
+    // Orders the active pixels of [x0, x1) x [y0, y1): both halves, then the line between them.
+    void dissect(const int x0, const int y0, const int x1, const int y1)
+    {
+        if (x0 >= x1 || y0 >= y1) {
+            return;
+        }
+        if ((x1 - x0) * (y1 - y0) <= NESTED_DISSECTION_LEAF_PIXELS) {
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    order(x, y);
+                }
+            }
+            return;
+        }
+        if (x1 - x0 >= y1 - y0) {
+            const int mid = (x0 + x1) / 2;
+            dissect(x0, y0, mid, y1);
+            dissect(mid + 1, y0, x1, y1);
+            for (int y = y0; y < y1; y++) {
+                order(mid, y);
+            }
+        } else {
+            const int mid = (y0 + y1) / 2;
+            dissect(x0, y0, x1, mid);
+            dissect(x0, mid + 1, x1, y1);
+            for (int x = x0; x < x1; x++) {
+                order(x, mid);
+            }
+        }
+    }
+
+    // Index of the 4 neighbours of unknown k, -1 for fixed pixels.
+    std::array<int, 4> neighbours(const int k) const
+    {
+        const int x = m_pixels[k] % m_width, y = m_pixels[k] / m_width;
+        return { m_index[boxIndex(x - 1, y)], m_index[boxIndex(x + 1, y)], m_index[boxIndex(x, y - 1)], m_index[boxIndex(x, y + 1)] };
+    }
+
+    // Pattern of row k of L in s[top, n) (the result), by walks up the elimination tree from the
+    // columns of row k of A; mark[i] == k marks the visited columns.
+    int ereach(const int k, const std::vector<int>& parent, std::vector<int>& mark, std::vector<int>& stack, std::vector<int>& s) const
+    {
+        const int n = int(m_pixels.size());
+        int top = n;
+        mark[k] = k;
+        for (int i : neighbours(k)) {
+            if (i < 0 || i > k) {
+                continue;
+            }
+            int length = 0;
+            for (; mark[i] != k; i = parent[i]) {
+                stack[length++] = i;
+                mark[i] = k;
+            }
+            while (length > 0) {
+                s[--top] = stack[--length];
+            }
+        }
+        return top;
+    }
+
+    void factorize()
+    {
+        const int n = int(m_pixels.size());
+        // Elimination tree, with path compression through the ancestors.
+        std::vector<int> parent(n, -1), ancestor(n, -1);
+        for (int k = 0; k < n; k++) {
+            for (int i : neighbours(k)) {
+                while (i >= 0 && i < k) {
+                    const int next = ancestor[i];
+                    ancestor[i] = k;
+                    if (next < 0) {
+                        parent[i] = k;
+                    }
+                    i = next;
+                }
+            }
+        }
+
+        // Column counts from the row patterns, then the column pointers.
+        std::vector<int> mark(n, -1), stack(n), s(n);
+        std::vector<size_t> counts(n, 1);
+        for (int k = 0; k < n; k++) {
+            for (int top = ereach(k, parent, mark, stack, s); top < n; top++) {
+                counts[s[top]]++;
+            }
+        }
+        m_Lp.assign(size_t(n) + 1, 0);
+        for (int k = 0; k < n; k++) {
+            m_Lp[k + 1] = m_Lp[k] + counts[k];
+        }
+        const size_t nonzeros = m_Lp[n];
+        if (nonzeros * (sizeof(int) + sizeof(double)) > PREPARED_POISSON_MAX_FACTOR_BYTES) {
+            std::cerr << "The mask has " << n << " unknowns, its factor of " << nonzeros << " nonzeros exceeds "
+                      << (PREPARED_POISSON_MAX_FACTOR_BYTES >> 20) << " MB; solve it iteratively instead." << std::endl;
+            throw std::exception();
+        }
+        m_Li.resize(nonzeros);
+        m_Lx.resize(nonzeros);
+
+        // Up-looking factorization: row k of L from the solve of the rows above, the diagonal first in every column.
+        std::vector<size_t> next(m_Lp.begin(), m_Lp.end() - 1);
+        std::vector<double> x(n, 0.0);
+        std::fill(mark.begin(), mark.end(), -1);
+        for (int k = 0; k < n; k++) {
+            int top = ereach(k, parent, mark, stack, s);
+            for (const int i : neighbours(k)) {
+                if (i >= 0 && i < k) {
+                    x[i] = -1.0;
+                }
+            }
+            double d = 4.0;
+            for (; top < n; top++) {
+                const int i = s[top];
+                const double l_ki = x[i] / m_Lx[m_Lp[i]];
+                x[i] = 0.0;
+                for (size_t p = m_Lp[i] + 1; p < next[i]; p++) {
+                    x[m_Li[p]] -= m_Lx[p] * l_ki;
+                }
+                d -= l_ki * l_ki;
+                const size_t p = next[i]++;
+                m_Li[p] = k;
+                m_Lx[p] = l_ki;
+            }
+            if (d <= 0.0) {
+                std::cerr << "The masked Poisson system is not positive definite at unknown " << k << "." << std::endl;
+                throw std::exception();
+            }
+            const size_t p = next[k]++;
+            m_Li[p] = k;
+            m_Lx[p] = std::sqrt(d);
+        }
+    }
+
+    // L L^T u = b for C planes at once, written into the active pixels of result.
+    template <size_t C>
+    void substitute(const std::array<const ImageFloat*, C>& initial, const std::array<const ImageFloat*, C>& divergence, const std::array<ImageFloat*, C>& result) const
+    {
+        for (size_t c = 0; c < C; c++) {
+            if (initial[c]->width != m_width || initial[c]->height != m_height) {
+                std::cerr << "The mask was prepared for " << m_width << " x " << m_height << " targets, not " << initial[c]->width << " x " << initial[c]->height << "."
+                          << std::endl;
+                throw std::exception();
+            }
+        }
+        const int n = int(m_pixels.size());
+        std::vector<std::array<double, C>> b(n);
+        // Right-hand side: the divergence and the Dirichlet values of the fixed neighbours.
+        for (int k = 0; k < n; k++) {
+            const int x = m_pixels[k] % m_width, y = m_pixels[k] / m_width;
+            const auto adjacent = neighbours(k);
+            const std::array<int, 4> offsets { m_pixels[k] - 1, m_pixels[k] + 1, m_pixels[k] - m_width, m_pixels[k] + m_width };
+            for (size_t c = 0; c < C; c++) {
+                double value = -double(divergence[c]->data[size_t(y) * size_t(divergence[c]->width) + size_t(x)]);
+                for (int q = 0; q < 4; q++) {
+                    if (adjacent[q] < 0) {
+                        value += double(initial[c]->data[offsets[q]]);
+                    }
+                }
+                b[k][c] = value;
+            }
+        }
+        // L y = b.
+        for (int j = 0; j < n; j++) {
+            const double diagonal = m_Lx[m_Lp[j]];
+            for (size_t c = 0; c < C; c++) {
+                b[j][c] /= diagonal;
+            }
+            for (size_t p = m_Lp[j] + 1; p < m_Lp[j + 1]; p++) {
+                auto& target = b[m_Li[p]];
+                for (size_t c = 0; c < C; c++) {
+                    target[c] -= m_Lx[p] * b[j][c];
+                }
+            }
+        }
+        // L^T u = y.
+        for (int j = n - 1; j >= 0; j--) {
+            for (size_t p = m_Lp[j] + 1; p < m_Lp[j + 1]; p++) {
+                const auto& source = b[m_Li[p]];
+                for (size_t c = 0; c < C; c++) {
+                    b[j][c] -= m_Lx[p] * source[c];
+                }
+            }
+            const double diagonal = m_Lx[m_Lp[j]];
+            for (size_t c = 0; c < C; c++) {
+                b[j][c] /= diagonal;
+                result[c]->data[m_pixels[j]] = float(b[j][c]);
+            }
+        }
+    }
+
+    int m_width, m_height;
+    // Box of the active pixels and their neighbours.
+    int m_box_x0 = 0, m_box_y0 = 0, m_box_width = 0;
+    // Unknown of every pixel of the box, -1 for the fixed ones.
+    std::vector<int> m_index;
+    // Target offset of every unknown, in elimination order.
+    std::vector<int> m_pixels;
+    // L in compressed columns, the diagonal first.
+    std::vector<size_t> m_Lp;
+    std::vector<int> m_Li;
+    std::vector<double> m_Lx;
+};
+
+/// <summary>
+/// Factorization of a mask placement, shared with earlier calls for the same mask, placement and
+/// target size, see above. Thread-safe; two threads that miss at once both factorize.
+/// </summary>
+inline std::shared_ptr<const PreparedPoissonMask> preparedPoissonMask(const BinaryMask& source_mask, const int width, const int height, const int offset_x = 0,
+    const int offset_y = 0)
+{
+    static std::mutex mutex;
+    // Most recently used first.
+    static std::list<std::pair<uint64_t, std::shared_ptr<const PreparedPoissonMask>>> entries;
+
+    const uint64_t key = ContentHash()
+                             .add(source_mask.width())
+                             .add(source_mask.height())
+                             .addBytes(source_mask.row(0), size_t(source_mask.wordsPerRow()) * size_t(source_mask.height()) * sizeof(uint64_t))
+                             .add(width)
+                             .add(height)
+                             .add(offset_x)
+                             .add(offset_y)
+                             .value();
+    {
+        const std::lock_guard lock(mutex);
+        const auto entry = std::find_if(entries.begin(), entries.end(), [key](const auto& cached) { return cached.first == key; });
+        if (entry != entries.end()) {
+            entries.splice(entries.begin(), entries, entry);
+            return entry->second;
+        }
+    }
+    auto prepared = std::make_shared<const PreparedPoissonMask>(source_mask, width, height, offset_x, offset_y);
+    const std::lock_guard lock(mutex);
+    entries.emplace_front(key, prepared);
+    if (entries.size() > PREPARED_POISSON_CACHE_ENTRIES) {
+        entries.pop_back();
+    }
+    return prepared;
+}
+
+/// <summary>
+/// Solves the masked poisson equation of the three channels with the cached factorization of the
+/// mask, see above.
+/// </summary>
+/// <param name="targetXYZ">initial solution (target image)</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="source_mask">mask of the pasted source, at the source size</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonPreparedXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const BinaryMask& source_mask, const int offset_x = 0,
+    const int offset_y = 0)
+{
+    return preparedPoissonMask(source_mask, targetXYZ.X.width, targetXYZ.X.height, offset_x, offset_y)->solveXYZ(targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson prepared
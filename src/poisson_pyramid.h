@@ -0,0 +1,180 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "poisson_common.h"
+
+/*
+ * Coarse-to-fine initial guess for the Poisson solvers (nested iteration).
+ *
+ * Iterative smoothers remove high frequencies quickly, but the source content has to diffuse
+ * from the seam across the whole edited region, which takes O(n^2) Jacobi iterations for a
+ * region n pixels wide. The correction of the initial solution, A e = f - A u0 with a zero
+ * border, is first solved on grids with 1/2^k of the resolution, where the same distance is few
+ * pixels, and each result is upsampled as the initial guess of the next finer level; the finest
+ * level then only needs a few iterations to fix the remaining fine detail. The correction is
+ * solved instead of the solution because it is smooth where u0 (the target) already has the
+ * right texture, which a coarse grid could not represent. Unlike multigrid (poisson_multigrid.h)
+ * there are no correction cycles, so any smoother can be used per level.
+ *
+ * Coarse grids keep the corner nodes of the fine grid (node i lies at fine position i * scale),
+ * and the right-hand side is the tent-filtered fine one scaled by scale_x * scale_y for the
+ * coarser grid spacing.
+ */
+
+#pragma region Poisson coarse-to-fine
+
+/// <summary>
+/// Bilinear resampling with aligned corners: node (i, j) of the result samples the input at
+/// (i * (w - 1) / (new_width - 1), j * (h - 1) / (new_height - 1)).
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="new_width">result width</param>
+/// <param name="new_height">result height</param>
+/// <returns>resampled image</returns>
+ImageFloat resampleNodesBilinear(const ImageFloat& image, const int new_width, const int new_height)
+{
+    const float scale_x = new_width > 1 ? float(image.width - 1) / float(new_width - 1) : 0.0f;
+    const float scale_y = new_height > 1 ? float(image.height - 1) / float(new_height - 1) : 0.0f;
+    auto result = ImageFloat::uninitialized(new_width, new_height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(new_width) * new_height, KernelCost::Medium))
+    for (int j = 0; j < new_height; j++) {
+        const float sy = float(j) * scale_y;
+        const int y0 = std::min(int(sy), image.height - 1);
+        const int y1 = std::min(y0 + 1, image.height - 1);
+        const float ty = sy - float(y0);
+        for (int i = 0; i < new_width; i++) {
+            const float sx = float(i) * scale_x;
+            const int x0 = std::min(int(sx), image.width - 1);
+            const int x1 = std::min(x0 + 1, image.width - 1);
+            const float tx = sx - float(x0);
+            const float top = image.data[y0 * image.width + x0] * (1.0f - tx) + image.data[y0 * image.width + x1] * tx;
+            const float bottom = image.data[y1 * image.width + x0] * (1.0f - tx) + image.data[y1 * image.width + x1] * tx;
+            result.data[j * new_width + i] = top * (1.0f - ty) + bottom * ty;
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Right-hand side of the coarse problem: the fine right-hand side averaged with a tent filter
+/// centered on each coarse node (full weighting for a ratio of 2), times the squared grid spacing
+/// ratio.
+/// </summary>
+/// <param name="fine_f">fine right-hand side (solution size)</param>
+/// <param name="coarse_width">coarse grid width</param>
+/// <param name="coarse_height">coarse grid height</param>
+/// <returns>coarse right-hand side</returns>
+ImageFloat restrictPoissonRhs(const ImageFloat& fine_f, const int coarse_width, const int coarse_height)
+{
+    const float scale_x = float(fine_f.width - 1) / float(std::max(coarse_width - 1, 1));
+    const float scale_y = float(fine_f.height - 1) / float(std::max(coarse_height - 1, 1));
+    auto coarse_f = ImageFloat::uninitialized(coarse_width, coarse_height);
+    // Fine pixels within one coarse spacing of node i, with their tent weights.
+    const auto tent = [](const int i, const float scale, const int fine_size, std::vector<float>& weights) {
+        const float center = float(i) * scale;
+        const int first = std::max(int(std::floor(center - scale)) + 1, 0);
+        const int last = std::min(int(std::ceil(center + scale)) - 1, fine_size - 1);
+        weights.clear();
+        for (int x = first; x <= last; x++) {
+            weights.push_back(std::max(1.0f - std::abs(float(x) - center) / scale, 0.0f));
+        }
+        return first;
+    };
+#pragma omp parallel num_threads(kernelThreads(int64_t(coarse_width) * coarse_height, KernelCost::Medium))
+    {
+        std::vector<float> weights_x, weights_y;
+#pragma omp for
+        for (int j = 0; j < coarse_height; j++) {
+            const int fy0 = tent(j, scale_y, fine_f.height, weights_y);
+            for (int i = 0; i < coarse_width; i++) {
+                const int fx0 = tent(i, scale_x, fine_f.width, weights_x);
+                float sum = 0.0f;
+                float weight = 0.0f;
+                for (size_t dy = 0; dy < weights_y.size(); dy++) {
+                    const float* row = fine_f.data.data() + (fy0 + int(dy)) * fine_f.width + fx0;
+                    for (size_t dx = 0; dx < weights_x.size(); dx++) {
+                        sum += weights_y[dy] * weights_x[dx] * row[dx];
+                        weight += weights_y[dy] * weights_x[dx];
+                    }
+                }
+                coarse_f.data[j * coarse_width + i] = weight > 0.0f ? scale_x * scale_y * sum / weight : 0.0f;
+            }
+        }
+    }
+    return coarse_f;
+}
+
+/// <summary>
+/// Solves grad^2 I = div G coarse to fine: the correction of initial_solution is solved at
+/// 1/2^levels of the resolution first, then at every finer level starting from the upsampled
+/// coarser correction, and the full resolution starts from initial_solution plus the correction.
+/// </summary>
+/// <param name="initial_solution">initial solution and Dirichlet border</param>
+/// <param name="divergence_G">div G (at least the solution size)</param>
+/// <param name="levels">number of coarse levels, each halves the resolution</param>
+/// <param name="coarse_iters">iterations per coarse level</param>
+/// <param name="fine_iters">iterations on the full resolution</param>
+/// <param name="solver">solver(initial, rhs, iterations) -> solution, e.g. a solvePoisson() wrapper</param>
+/// <returns>luminance I</returns>
+template <typename Solver>
+ImageFloat solvePoissonCoarseToFine(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int levels, const int coarse_iters, const int fine_iters, Solver&& solver)
+{
+    const int w = initial_solution.width;
+    const int h = initial_solution.height;
+
+    // Level sizes, stopping before a grid without interior nodes.
+    std::vector<std::pair<int, int>> sizes = { { w, h } };
+    for (int level = 0; level < levels; level++) {
+        const auto [fine_w, fine_h] = sizes.back();
+        const int coarse_w = (fine_w + 1) / 2;
+        const int coarse_h = (fine_h + 1) / 2;
+        if (coarse_w < 3 || coarse_h < 3) {
+            break;
+        }
+        sizes.push_back({ coarse_w, coarse_h });
+    }
+
+    // The coarse levels solve for the correction of the initial solution.
+    auto residual = ImageFloat::uninitialized(w, h);
+    computePoissonResidual(initial_solution, cropPoissonRhs(divergence_G, w, h), residual);
+    std::vector<ImageFloat> correction_rhs = { residual };
+    for (size_t level = 1; level < sizes.size(); level++) {
+        correction_rhs.push_back(restrictPoissonRhs(correction_rhs.back(), sizes[level].first, sizes[level].second));
+    }
+
+    // Upsampled coarse correction with a zero border, added to base.
+    const auto upsample_into = [](const ImageFloat& coarse, ImageFloat& base) {
+        const auto upsampled = resampleNodesBilinear(coarse, base.width, base.height);
+#pragma omp parallel for num_threads(kernelThreads(base, KernelCost::Light))
+        for (int y = 1; y < base.height - 1; y++) {
+            for (int x = 1; x < base.width - 1; x++) {
+                base.data[y * base.width + x] += upsampled.data[y * base.width + x];
+            }
+        }
+    };
+
+    std::optional<ImageFloat> correction;
+    for (size_t level = sizes.size() - 1; level > 0; level--) {
+        const auto [level_w, level_h] = sizes[level];
+        auto guess = ImageFloat(level_w, level_h);
+        if (correction) {
+            upsample_into(*correction, guess);
+        }
+        std::cout << "Coarse-to-fine Poisson level " << level << " (" << level_w << "x" << level_h << ", " << coarse_iters << " iterations)" << std::endl;
+        correction = solver(guess, correction_rhs[level], coarse_iters);
+    }
+
+    auto guess = initial_solution.clone();
+    if (correction) {
+        upsample_into(*correction, guess);
+    }
+    return solver(guess, divergence_G, fine_iters);
+}
+
+#pragma endregion Poisson coarse-to-fine
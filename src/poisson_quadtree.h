@@ -0,0 +1,644 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "binary_mask.h"
+#include "execution.h"
+#include "helpers.h"
+#include "poisson_common.h"
+#include "plane3.h"
+
+/*
+ * Quadtree-adaptive Poisson compositing (Agarwala, "Efficient gradient-domain compositing using
+ * quadtrees").
+ *
+ * A composite I0 (the source pasted into the target) already satisfies L I0 = div G wherever
+ * both neighbours of every pixel come from the same image, so the solution I = I0 + o only
+ * needs an offset o that is smooth everywhere except near the seams. o solves L o = r with
+ * r = div G - L I0, which is zero (up to rounding) away from the seams, and o = 0 on the 1px
+ * border like the other solvers.
+ *
+ * The offset is represented on a quadtree over the frame: cells are split down to single
+ * pixels around pixels with |r| > seam_threshold, the cells within `grading` cells of the same
+ * size of a seam are split as well (so leaf sizes grow gradually away from the seams), and no cell is
+ * larger than max_cell_size. The unknowns are the values at the corners of the leaves, every
+ * pixel interpolates the corners of its leaf bilinearly (o = S y), and the reduced system
+ * S^T A S y = S^T b of the negated Laplacian A and b = -r is solved with Jacobi preconditioned
+ * CG. Its size follows the seam length instead of the pixel count: the pixel-sized passes are
+ * the residual (twice) and the final interpolation, all streaming and parallel.
+ *
+ * Inside a leaf the energy sum (o_p - o_q)^2 of the pixel edges is a fixed 4 x 4 form of the
+ * corner values per cell size; only the edges leaving a leaf to its right and bottom are summed
+ * pixel by pixel. Corners in the middle of a larger neighbour's edge (T-junctions) are ordinary
+ * unknowns; the system is still the least-squares optimum over the interpolated offsets.
+ */
+
+#pragma region Poisson quadtree
+
+/// <summary>
+/// Parameters of the quadtree-adaptive solve.
+/// </summary>
+struct QuadtreePoissonParams {
+    // Largest leaf, in pixels (rounded down to a power of two).
+    int max_cell_size = 128;
+    // Pixels whose residual |div G - L I0| exceeds this value get single-pixel leaves.
+    float seam_threshold = 1e-4f;
+    // Rings of same-size cells around a cell with a seam that are split as well: larger values grow
+    // the leaves more slowly away from the seams (more unknowns, smaller interpolation error).
+    int grading = 2;
+    // Relative residual tolerance and iteration cap of the reduced CG solve.
+    float tolerance = 1e-6f;
+    int max_iters = 2000;
+};
+
+/// <summary>
+/// Leaf of the quadtree: pixels [x0, x0 + size) x [y0, y0 + size).
+/// </summary>
+struct QuadtreeCell {
+    int x0 = 0, y0 = 0, size = 1;
+    // Unknowns at the corners (x0, y0), (x0 + size, y0), (x0, y0 + size), (x0 + size, y0 + size); -1 on the border.
+    std::array<int, 4> nodes { -1, -1, -1, -1 };
+};
+
+/// <summary>
+/// Quadtree and reduced system of one frame, see above. Mark the seams of every channel, call
+/// build() once, then solve() each channel.
+/// </summary>
+class PoissonQuadtree {
+public:
+    PoissonQuadtree(const int width, const int height, const QuadtreePoissonParams& params = {})
+        : m_width(width)
+        , m_height(height)
+        , m_params(params)
+    {
+        // The root covers [0, 2^levels]^2, enough for the corner (width - 1, height - 1).
+        const int extent = std::max(std::max(width, height) - 1, 1);
+        m_levels = std::bit_width(unsigned(extent - 1));
+        for (int level = 0; level <= m_levels; level++) {
+            const int size = 1 << level;
+            m_seams.push_back(level == 0 ? SeamLevel {} : SeamLevel { (width + size - 1) / size, (height + size - 1) / size, {} });
+            m_seams.back().flags.resize(size_t(m_seams.back().width) * size_t(m_seams.back().height));
+        }
+    }
+
+    /// <summary>
+    /// Flags the 2 x 2 blocks with a residual above the seam threshold.
+    /// </summary>
+    /// <param name="initial_solution">composite I0, also the Dirichlet border</param>
+    /// <param name="divergence_G">div G</param>
+    void markSeams(const ImageFloat& initial_solution, const ImageFloat& divergence_G)
+    {
+        if (m_levels == 0) {
+            return;
+        }
+        auto& blocks = m_seams[1];
+        const float threshold = m_params.seam_threshold;
+#pragma omp parallel for num_threads(kernelThreads(initial_solution, KernelCost::Light)) schedule(static)
+        for (int by = 0; by < blocks.height; by++) {
+            for (int y = std::max(2 * by, 1); y < std::min(2 * by + 2, m_height - 1); y++) {
+                for (int x = 1; x < m_width - 1; x++) {
+                    if (std::abs(residual(initial_solution, divergence_G, x, y)) > threshold) {
+                        blocks.flags[size_t(by) * size_t(blocks.width) + size_t(x / 2)] = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Builds the leaves, numbers the unknowns and assembles S^T A S.
+    /// </summary>
+    void build()
+    {
+        // Coarser seam flags: a cell is flagged when one of its four children is.
+        for (int level = 2; level <= m_levels; level++) {
+            const auto& fine = m_seams[level - 1];
+            auto& coarse = m_seams[level];
+            for (int cy = 0; cy < coarse.height; cy++) {
+                for (int cx = 0; cx < coarse.width; cx++) {
+                    uint8_t flag = 0;
+                    for (int k = 0; k < 4; k++) {
+                        const int fx = 2 * cx + (k & 1);
+                        const int fy = 2 * cy + (k >> 1);
+                        if (fx < fine.width && fy < fine.height) {
+                            flag |= fine.flags[size_t(fy) * size_t(fine.width) + size_t(fx)];
+                        }
+                    }
+                    coarse.flags[size_t(cy) * size_t(coarse.width) + size_t(cx)] = flag;
+                }
+            }
+        }
+
+        // Leaves, depth first from the root; cells past the last row or column are dropped.
+        std::vector<std::array<int, 3>> stack { { m_levels, 0, 0 } };
+        while (!stack.empty()) {
+            const auto [level, cx, cy] = stack.back();
+            stack.pop_back();
+            const int size = 1 << level;
+            if (cx * size >= m_width - 1 || cy * size >= m_height - 1) {
+                continue;
+            }
+            if (!splits(level, cx, cy)) {
+                m_cells.push_back({ cx * size, cy * size, size });
+                continue;
+            }
+            for (int k = 3; k >= 0; k--) {
+                stack.push_back({ level - 1, 2 * cx + (k & 1), 2 * cy + (k >> 1) });
+            }
+        }
+
+        // Unknowns: the leaf corners off the border, sorted by (y, x).
+        for (const auto& cell : m_cells) {
+            for (int k = 0; k < 4; k++) {
+                const int x = cell.x0 + (k & 1) * cell.size;
+                const int y = cell.y0 + (k >> 1) * cell.size;
+                if (!onBorder(x, y)) {
+                    m_node_keys.push_back(key(x, y));
+                }
+            }
+        }
+        std::sort(m_node_keys.begin(), m_node_keys.end());
+        m_node_keys.erase(std::unique(m_node_keys.begin(), m_node_keys.end()), m_node_keys.end());
+        const int num_cells = int(m_cells.size());
+#pragma omp parallel for num_threads(kernelThreads(num_cells, KernelCost::Medium)) schedule(static)
+        for (int c = 0; c < num_cells; c++) {
+            auto& cell = m_cells[c];
+            for (int k = 0; k < 4; k++) {
+                cell.nodes[k] = nodeIndex(cell.x0 + (k & 1) * cell.size, cell.y0 + (k >> 1) * cell.size);
+            }
+        }
+
+        assembleSystem();
+    }
+
+    /// <summary>
+    /// Solves one channel on the tree.
+    /// </summary>
+    /// <param name="initial_solution">composite I0, also the Dirichlet border</param>
+    /// <param name="divergence_G">div G</param>
+    /// <param name="stats">optional output of CG iterations and final relative residual of the reduced system</param>
+    /// <returns>luminance I</returns>
+    ImageFloat solve(const ImageFloat& initial_solution, const ImageFloat& divergence_G, PoissonStats* stats = nullptr) const
+    {
+        std::cout << "Solving quadtree Poisson equation (" << numNodes() << " nodes, " << m_cells.size() << " cells)..." << std::endl;
+        const int num_cells = int(m_cells.size());
+        const int64_t pixels = int64_t(m_width) * m_height;
+
+        // S^T b with b = -r, summed per leaf; corners are shared, so the leaf sums are added to
+        // them afterwards in cell order, independent of the thread count.
+        std::vector<std::array<double, 4>> cell_sums(static_cast<size_t>(num_cells));
+#pragma omp parallel for num_threads(kernelThreads(pixels, KernelCost::Light)) schedule(dynamic)
+        for (int c = 0; c < num_cells; c++) {
+            const auto& cell = m_cells[c];
+            std::array<double, 4> sums {};
+            for (int y = std::max(cell.y0, 1); y < cell.y0 + cell.size; y++) {
+                const double fy = double(y - cell.y0) / cell.size;
+                for (int x = std::max(cell.x0, 1); x < cell.x0 + cell.size; x++) {
+                    const double fx = double(x - cell.x0) / cell.size;
+                    const double b = -double(residual(initial_solution, divergence_G, x, y));
+                    sums[0] += b * (1.0 - fx) * (1.0 - fy);
+                    sums[1] += b * fx * (1.0 - fy);
+                    sums[2] += b * (1.0 - fx) * fy;
+                    sums[3] += b * fx * fy;
+                }
+            }
+            cell_sums[c] = sums;
+        }
+        std::vector<double> rhs(size_t(numNodes()), 0.0);
+        for (int c = 0; c < num_cells; c++) {
+            for (int k = 0; k < 4; k++) {
+                if (m_cells[c].nodes[k] >= 0) {
+                    rhs[m_cells[c].nodes[k]] += cell_sums[c][k];
+                }
+            }
+        }
+
+        const auto y = solveReduced(rhs, stats);
+
+        // I = I0 + S y.
+        auto I = initial_solution.clone();
+        const int w = m_width;
+#pragma omp parallel for num_threads(kernelThreads(pixels, KernelCost::Light)) schedule(dynamic)
+        for (int c = 0; c < num_cells; c++) {
+            const auto& cell = m_cells[c];
+            std::array<float, 4> corner {};
+            for (int k = 0; k < 4; k++) {
+                corner[k] = cell.nodes[k] >= 0 ? float(y[cell.nodes[k]]) : 0.0f;
+            }
+            const float inv_size = 1.0f / float(cell.size);
+            for (int py = cell.y0; py < cell.y0 + cell.size; py++) {
+                const float fy = float(py - cell.y0) * inv_size;
+                const float left = corner[0] + fy * (corner[2] - corner[0]);
+                const float right = corner[1] + fy * (corner[3] - corner[1]);
+                float* row = I.data.data() + size_t(py) * size_t(w);
+                for (int px = cell.x0; px < cell.x0 + cell.size; px++) {
+                    row[px] += left + float(px - cell.x0) * inv_size * (right - left);
+                }
+            }
+        }
+        return I;
+    }
+
+    int numNodes() const { return int(m_node_keys.size()); }
+    const std::vector<QuadtreeCell>& cells() const { return m_cells; }
+
+private:
+    struct SeamLevel {
+        int width = 0, height = 0;
+        std::vector<uint8_t> flags;
+    };
+
+    // Node (index, weight) pairs of the interpolated offset of one pixel or pixel edge.
+    struct Weights {
+        std::array<int, 8> nodes;
+        std::array<double, 8> values;
+        int count = 0;
+
+        void add(const int node, const double value)
+        {
+            for (int i = 0; i < count; i++) {
+                if (nodes[i] == node) {
+                    values[i] += value;
+                    return;
+                }
+            }
+            nodes[count] = node;
+            values[count++] = value;
+        }
+    };
+
+    struct Entry {
+        int row, col;
+        double value;
+    };
+
+    static float residual(const ImageFloat& u, const ImageFloat& divergence_G, const int x, const int y)
+    {
+        const int w = u.width;
+        const size_t i = size_t(y) * size_t(w) + size_t(x);
+        const float laplacian = u.data[i - 1] + u.data[i + 1] + u.data[i - w] + u.data[i + w] - 4.0f * u.data[i];
+        return divergence_G.data[size_t(y) * size_t(divergence_G.width) + size_t(x)] - laplacian;
+    }
+
+    uint64_t key(const int x, const int y) const { return uint64_t(y) * uint64_t(m_width) + uint64_t(x); }
+    bool onBorder(const int x, const int y) const { return x == 0 || y == 0 || x >= m_width - 1 || y >= m_height - 1; }
+
+    int nodeIndex(const int x, const int y) const
+    {
+        if (onBorder(x, y)) {
+            return -1;
+        }
+        return int(std::lower_bound(m_node_keys.begin(), m_node_keys.end(), key(x, y)) - m_node_keys.begin());
+    }
+
+    /// <summary>
+    /// Whether the cell (cx, cy) of the given level is split: it is larger than the largest leaf,
+    /// crosses the last row or column (whose pixels are Dirichlet values), or a cell of its size
+    /// within grading cells of it contains a seam.
+    /// </summary>
+    bool splits(const int level, const int cx, const int cy) const
+    {
+        if (level == 0) {
+            return false;
+        }
+        const int size = 1 << level;
+        const int x0 = cx * size;
+        const int y0 = cy * size;
+        if (size > m_params.max_cell_size) {
+            return true;
+        }
+        if ((x0 < m_width - 1 && m_width - 1 < x0 + size) || (y0 < m_height - 1 && m_height - 1 < y0 + size)) {
+            return true;
+        }
+        const auto& seams = m_seams[level];
+        const int reach = m_params.grading;
+        for (int ny = std::max(cy - reach, 0); ny <= std::min(cy + reach, seams.height - 1); ny++) {
+            for (int nx = std::max(cx - reach, 0); nx <= std::min(cx + reach, seams.width - 1); nx++) {
+                if (seams.flags[size_t(ny) * size_t(seams.width) + size_t(nx)]) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /// <summary>
+    /// Leaf containing the pixel (x, y), which must be left of the last column and above the last row.
+    /// </summary>
+    QuadtreeCell locate(const int x, const int y) const
+    {
+        int level = m_levels;
+        while (splits(level, x >> level, y >> level)) {
+            level--;
+        }
+        QuadtreeCell cell { (x >> level) << level, (y >> level) << level, 1 << level };
+        for (int k = 0; k < 4; k++) {
+            cell.nodes[k] = nodeIndex(cell.x0 + (k & 1) * cell.size, cell.y0 + (k >> 1) * cell.size);
+        }
+        return cell;
+    }
+
+    static bool contains(const QuadtreeCell& cell, const int x, const int y)
+    {
+        return x >= cell.x0 && x < cell.x0 + cell.size && y >= cell.y0 && y < cell.y0 + cell.size;
+    }
+
+    /// <summary>
+    /// Adds sign * the interpolation weights of pixel (x, y) inside cell.
+    /// </summary>
+    void addPixelWeights(const QuadtreeCell& cell, const int x, const int y, const double sign, Weights& weights) const
+    {
+        const double fx = double(x - cell.x0) / cell.size;
+        const double fy = double(y - cell.y0) / cell.size;
+        const std::array<double, 4> bilinear { (1.0 - fx) * (1.0 - fy), fx * (1.0 - fy), (1.0 - fx) * fy, fx * fy };
+        for (int k = 0; k < 4; k++) {
+            if (bilinear[k] != 0.0 && cell.nodes[k] >= 0) {
+                weights.add(cell.nodes[k], sign * bilinear[k]);
+            }
+        }
+    }
+
+    /// <summary>
+    /// S^T A S in CSR form: the fixed energy form of every leaf plus the edges from each leaf to the
+    /// pixels right of and below it.
+    /// </summary>
+    void assembleSystem()
+    {
+        // Energy of the edges inside a leaf of size s: (s - 1) / s^2 * sum over the s rows (columns)
+        // of (a (1 - t) + b t)^2, with a, b the corner differences along the first and last row
+        // (column) and t = j / s.
+        std::vector<std::array<double, 16>> leaf_forms(size_t(m_levels) + 1);
+        for (int level = 0; level <= m_levels; level++) {
+            const double s = double(1 << level);
+            double alpha = 0.0, beta = 0.0, gamma = 0.0;
+            for (int j = 0; j < (1 << level); j++) {
+                const double t = j / s;
+                alpha += (1.0 - t) * (1.0 - t);
+                beta += t * (1.0 - t);
+                gamma += t * t;
+            }
+            const double scale = (s - 1.0) / (s * s);
+            // Horizontal edges: a = y1 - y0, b = y3 - y2; vertical edges: c = y2 - y0, d = y3 - y1.
+            const std::array<std::array<double, 4>, 4> diffs { { { -1, 1, 0, 0 }, { 0, 0, -1, 1 }, { -1, 0, 1, 0 }, { 0, -1, 0, 1 } } };
+            auto& form = leaf_forms[level];
+            form.fill(0.0);
+            for (int pair = 0; pair < 2; pair++) {
+                const auto& u = diffs[2 * pair];
+                const auto& v = diffs[2 * pair + 1];
+                for (int i = 0; i < 4; i++) {
+                    for (int j = 0; j < 4; j++) {
+                        form[i * 4 + j] += scale * (alpha * u[i] * u[j] + beta * (u[i] * v[j] + v[i] * u[j]) + gamma * v[i] * v[j]);
+                    }
+                }
+            }
+        }
+
+        // Entries are collected per block of 64 cells and concatenated in block order, so the
+        // duplicates of an entry are summed in the same order for any thread count.
+        const int num_cells = int(m_cells.size());
+        constexpr int cells_per_block = 64;
+        std::vector<std::vector<Entry>> block_entries(static_cast<size_t>((num_cells + cells_per_block - 1) / cells_per_block));
+#pragma omp parallel for num_threads(kernelThreads(int64_t(num_cells) * 16, KernelCost::Medium)) schedule(dynamic, 1)
+        for (int block = 0; block < int(block_entries.size()); block++) {
+            auto& entries = block_entries[block];
+            const auto add_edge = [&](const Weights& weights) {
+                for (int i = 0; i < weights.count; i++) {
+                    for (int j = 0; j < weights.count; j++) {
+                        entries.push_back({ weights.nodes[i], weights.nodes[j], weights.values[i] * weights.values[j] });
+                    }
+                }
+            };
+            for (int c = block * cells_per_block; c < std::min(num_cells, (block + 1) * cells_per_block); c++) {
+                const auto& cell = m_cells[c];
+                const auto& form = leaf_forms[std::countr_zero(unsigned(cell.size))];
+                for (int i = 0; i < 4; i++) {
+                    for (int j = 0; j < 4; j++) {
+                        if (cell.nodes[i] >= 0 && cell.nodes[j] >= 0 && form[i * 4 + j] != 0.0) {
+                            entries.push_back({ cell.nodes[i], cell.nodes[j], form[i * 4 + j] });
+                        }
+                    }
+                }
+
+                // Edges to the right and bottom neighbours; the last row and column are 0.
+                const int x1 = cell.x0 + cell.size;
+                const int y1 = cell.y0 + cell.size;
+                QuadtreeCell neighbour { -1, -1, 0 };
+                for (int y = cell.y0; y < y1; y++) {
+                    Weights weights;
+                    addPixelWeights(cell, x1 - 1, y, 1.0, weights);
+                    if (x1 < m_width - 1) {
+                        if (!contains(neighbour, x1, y)) {
+                            neighbour = locate(x1, y);
+                        }
+                        addPixelWeights(neighbour, x1, y, -1.0, weights);
+                    }
+                    add_edge(weights);
+                }
+                neighbour = { -1, -1, 0 };
+                for (int x = cell.x0; x < x1; x++) {
+                    Weights weights;
+                    addPixelWeights(cell, x, y1 - 1, 1.0, weights);
+                    if (y1 < m_height - 1) {
+                        if (!contains(neighbour, x, y1)) {
+                            neighbour = locate(x, y1);
+                        }
+                        addPixelWeights(neighbour, x, y1, -1.0, weights);
+                    }
+                    add_edge(weights);
+                }
+            }
+        }
+
+        std::vector<Entry> entries;
+        for (auto& part : block_entries) {
+            entries.insert(entries.end(), part.begin(), part.end());
+        }
+        std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.row != b.row ? a.row < b.row : a.col < b.col; });
+
+        const int n = numNodes();
+        m_row_offsets.assign(size_t(n) + 1, 0);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!m_columns.empty() && i > 0 && entries[i].row == entries[i - 1].row && entries[i].col == entries[i - 1].col) {
+                m_values.back() += entries[i].value;
+                continue;
+            }
+            m_columns.push_back(entries[i].col);
+            m_values.push_back(entries[i].value);
+            m_row_offsets[size_t(entries[i].row) + 1]++;
+        }
+        for (int i = 0; i < n; i++) {
+            m_row_offsets[size_t(i) + 1] += m_row_offsets[i];
+        }
+        m_diagonal.assign(size_t(n), 1.0);
+        for (int i = 0; i < n; i++) {
+            for (int k = m_row_offsets[i]; k < m_row_offsets[size_t(i) + 1]; k++) {
+                if (m_columns[k] == i && m_values[k] > 0.0) {
+                    m_diagonal[i] = m_values[k];
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Jacobi preconditioned CG on S^T A S y = rhs.
+    /// </summary>
+    std::vector<double> solveReduced(const std::vector<double>& rhs, PoissonStats* stats) const
+    {
+        const int n = numNodes();
+        const int threads = kernelThreads(int64_t(m_values.size()), KernelCost::Light);
+        const auto size = static_cast<size_t>(n);
+        std::vector<double> y(size, 0.0), r = rhs, z(size), p(size), q(size);
+
+        // The dot products are reproducible sums over fixed chunks of the nodes, see execution.h.
+        const glm::dvec2 initial = reproducibleSum<glm::dvec2>(n, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            glm::dvec2 sums(0.0);
+            for (int64_t i = begin; i < end; i++) {
+                z[i] = r[i] / m_diagonal[i];
+                p[i] = z[i];
+                sums += glm::dvec2(r[i] * z[i], r[i] * r[i]);
+            }
+            return sums;
+        });
+        double rz = initial.x;
+        const double initial_norm2 = initial.y;
+
+        const double threshold2 = initial_norm2 * double(m_params.tolerance) * double(m_params.tolerance);
+        double norm2 = initial_norm2;
+        int iter = 0;
+        while (iter < m_params.max_iters && norm2 > threshold2) {
+            const double pq = reproducibleSum<double>(n, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+                double dot = 0.0;
+                for (int64_t i = begin; i < end; i++) {
+                    double sum = 0.0;
+                    for (int k = m_row_offsets[i]; k < m_row_offsets[size_t(i) + 1]; k++) {
+                        sum += m_values[k] * p[m_columns[k]];
+                    }
+                    q[i] = sum;
+                    dot += p[i] * sum;
+                }
+                return dot;
+            });
+            if (pq <= 0.0) {
+                break;
+            }
+            const double alpha = rz / pq;
+
+            const glm::dvec2 next = reproducibleSum<glm::dvec2>(n, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+                glm::dvec2 sums(0.0);
+                for (int64_t i = begin; i < end; i++) {
+                    y[i] += alpha * p[i];
+                    r[i] -= alpha * q[i];
+                    z[i] = r[i] / m_diagonal[i];
+                    sums += glm::dvec2(r[i] * z[i], r[i] * r[i]);
+                }
+                return sums;
+            });
+            const double rz_next = next.x;
+            norm2 = next.y;
+            iter++;
+
+            const double beta = rz_next / rz;
+            rz = rz_next;
+#pragma omp parallel for num_threads(threads)
+            for (int i = 0; i < n; i++) {
+                p[i] = z[i] + beta * p[i];
+            }
+        }
+
+        if (stats) {
+            stats->iterations = iter;
+            stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
+        }
+        return y;
+    }
+
+    int m_width, m_height;
+    QuadtreePoissonParams m_params;
+    // The root cell has size 2^m_levels.
+    int m_levels = 0;
+    // Seam flags per level (level 0 is unused).
+    std::vector<SeamLevel> m_seams;
+    std::vector<QuadtreeCell> m_cells;
+    // Unknowns by position, see key().
+    std::vector<uint64_t> m_node_keys;
+    // S^T A S (CSR) and its diagonal.
+    std::vector<int> m_row_offsets;
+    std::vector<int> m_columns;
+    std::vector<double> m_values;
+    std::vector<double> m_diagonal;
+};
+
+/// <summary>
+/// Composite of the source pasted into the target: source values inside the placed mask, target values elsewhere.
+/// </summary>
+/// <param name="source">source image, at the size of the mask</param>
+/// <param name="target">target image</param>
+/// <param name="source_mask">mask of the pasted source</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>composite at the target size</returns>
+ImageFloat pasteMasked(const ImageFloat& source, const ImageFloat& target, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0)
+{
+    const int w = target.width;
+    const auto placed = source_mask.placed(w, target.height, offset_x, offset_y);
+    auto composite = target.clone();
+#pragma omp parallel for num_threads(kernelThreads(target, KernelCost::Light))
+    for (int y = 0; y < target.height; y++) {
+        if (placed.rowEmpty(y)) {
+            continue;
+        }
+        for (int x = 0; x < w; x++) {
+            if (placed(x, y)) {
+                composite.data[size_t(y) * size_t(w) + size_t(x)] = source.data[size_t(y - offset_y) * size_t(source.width) + size_t(x - offset_x)];
+            }
+        }
+    }
+    return composite;
+}
+
+/// <summary>
+/// Composite of pasteMasked() for each channel.
+/// </summary>
+ImageXYZ pasteMaskedXYZ(const ImageXYZ& sourceXYZ, const ImageXYZ& targetXYZ, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0)
+{
+    return mapPlanes([&](const ImageFloat& source, const ImageFloat& target) { return pasteMasked(source, target, source_mask, offset_x, offset_y); }, sourceXYZ, targetXYZ);
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G on a quadtree refined around the seams of the composite.
+/// The 1px border of the composite is kept fixed.
+/// </summary>
+/// <param name="composite">composite I0, e.g. pasteMasked()</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="params">tree and CG parameters</param>
+/// <param name="stats">optional output of the reduced CG solve</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonQuadtree(const ImageFloat& composite, const ImageFloat& divergence_G, const QuadtreePoissonParams& params = {}, PoissonStats* stats = nullptr)
+{
+    PoissonQuadtree tree(composite.width, composite.height, params);
+    tree.markSeams(composite, divergence_G);
+    tree.build();
+    return tree.solve(composite, divergence_G, stats);
+}
+
+/// <summary>
+/// Solves the quadtree Poisson equation for each channel on one tree, refined around the seams of all three channels.
+/// </summary>
+/// <param name="compositeXYZ">composite I0, e.g. pasteMaskedXYZ()</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="params">tree and CG parameters</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonQuadtreeXYZ(const ImageXYZ& compositeXYZ, const ImageXYZ& divergenceXYZ_G, const QuadtreePoissonParams& params = {})
+{
+    PoissonQuadtree tree(compositeXYZ.X.width, compositeXYZ.X.height, params);
+    forEachPlane([&](const ImageFloat& composite, const ImageFloat& divergence) { tree.markSeams(composite, divergence); }, compositeXYZ, divergenceXYZ_G);
+    tree.build();
+    return mapPlanes([&](const ImageFloat& composite, const ImageFloat& divergence) { return tree.solve(composite, divergence); }, compositeXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson quadtree
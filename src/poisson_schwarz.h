@@ -0,0 +1,174 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "helpers.h"
+#include "poisson_common.h"
+#include "poisson_multigrid.h"
+#include "poisson_pyramid.h"
+#include "plane3.h"
+#include "tile_scheduler.h"
+
+/*
+ * Overlapping Schwarz domain decomposition for the Poisson problem of solvePoisson().
+ *
+ * The image is cut into tiles (their cores, which partition it), and every tile is extended by
+ * overlap pixels on each side into a local problem: the extended region of the current solution,
+ * with its outer ring as the Dirichlet border. One exchange step solves all local problems
+ * independently from the same solution (additive), and every tile writes only its core into the
+ * next solution (restricted additive Schwarz), so the tiles need no synchronization and any tile
+ * order gives the same result. Information crosses a tile per step through the overlap, so
+ * before every step an optional coarse-grid correction removes the smooth error: the residual
+ * is restricted to a grid with one node per coarse_spacing pixels, solved by multigrid and the
+ * interpolated correction is added.
+ *
+ * A local problem is a small, cache-resident Poisson problem solved by multigrid (or SOR sweeps),
+ * the tiles are balanced by the TileScheduler. Only the two solution buffers, the right-hand side
+ * and the residual have the full size; the tiles read their region and write their core, which
+ * makes the decomposition the base for out-of-core or multi-node solving, where a tile would be
+ * read from and written to its own storage.
+ */
+
+#pragma region Poisson Schwarz
+
+/// <summary>
+/// Solver of the local problems.
+/// </summary>
+enum class SchwarzLocalSolver {
+    // local_sweeps red-black SOR sweeps with the optimal omega of the tile.
+    Sor,
+    // solvePoissonMultigrid() to local_tolerance, fewer steps but more work per step.
+    Multigrid,
+};
+
+/// <summary>
+/// Parameters of solvePoissonSchwarz().
+/// </summary>
+struct SchwarzPoissonParams {
+    // Side of the tile cores.
+    int tile_size = 256;
+    // Extension of the local problems past their cores on each side, at least 1.
+    int overlap = 16;
+    // Upper bound on the exchange steps.
+    int max_iters = 30;
+    // Stop when the residual drops below tolerance * initial residual.
+    float tolerance = 1e-4f;
+    SchwarzLocalSolver local_solver = SchwarzLocalSolver::Sor;
+    // Relative residual of the multigrid local solves.
+    float local_tolerance = 1e-3f;
+    // Sweeps of the SOR local solves.
+    int local_sweeps = 50;
+    // Pixels per node of the coarse-grid correction, 0 disables it.
+    int coarse_spacing = 32;
+};
+
+/// <summary>
+/// Adds the coarse-grid correction of the residual r to the interior of u, see above.
+/// </summary>
+inline void applySchwarzCoarseCorrection(ImageFloat& u, const ImageFloat& r, const int coarse_spacing)
+{
+    const int cw = std::max((u.width - 1) / coarse_spacing, 2) + 1;
+    const int ch = std::max((u.height - 1) / coarse_spacing, 2) + 1;
+    const auto correction = solvePoissonMultigrid(ImageFloat(cw, ch), restrictPoissonRhs(r, cw, ch), 1e-3f);
+    const auto upsampled = resampleNodesBilinear(correction, u.width, u.height);
+#pragma omp parallel for num_threads(kernelThreads(u, KernelCost::Light))
+    for (int y = 1; y < u.height - 1; y++) {
+        for (int x = 1; x < u.width - 1; x++) {
+            u.data[y * u.width + x] += upsampled.data[y * u.width + x];
+        }
+    }
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G by overlapping domain decomposition, see above.
+/// Uses the same border convention as solvePoisson(): the 1px border of initial_solution is kept fixed.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="params">tiling, local solver and stopping criterion</param>
+/// <param name="stats">optional output of exchange steps used and final relative residual</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonSchwarz(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const SchwarzPoissonParams& params = {}, PoissonStats* stats = nullptr)
+{
+    if (params.tile_size < 1 || params.overlap < 1) {
+        std::cerr << "Schwarz tiles need a size and an overlap of at least 1, got " << params.tile_size << " and " << params.overlap << "." << std::endl;
+        throw std::exception();
+    }
+    const int w = initial_solution.width;
+    const int h = initial_solution.height;
+    const int tile_size = params.tile_size;
+    const int overlap = params.overlap;
+    const int tiles_x = (w + tile_size - 1) / tile_size;
+    const int tiles_y = (h + tile_size - 1) / tile_size;
+
+    auto u = initial_solution.clone();
+    auto u_next = ImageFloat::uninitialized(w, h);
+    const auto f = cropPoissonRhs(divergence_G, w, h);
+    auto r = ImageFloat::uninitialized(w, h);
+
+    const double initial_norm2 = computePoissonResidual(u, f, r);
+    const double threshold2 = initial_norm2 * double(params.tolerance) * double(params.tolerance);
+    double norm2 = initial_norm2;
+    int iters = 0;
+    while (iters < params.max_iters && norm2 > threshold2) {
+        if (params.coarse_spacing > 0) {
+            applySchwarzCoarseCorrection(u, r, params.coarse_spacing);
+        }
+
+        // Clipped border tiles are cheaper, stealing balances them.
+        TileScheduler scheduler("solvePoissonSchwarz", tiles_x * tiles_y);
+#pragma omp parallel
+        {
+            scheduler.run([&](const int tile) {
+                const int x0 = (tile % tiles_x) * tile_size;
+                const int y0 = (tile / tiles_x) * tile_size;
+                const int x1 = std::min(x0 + tile_size, w);
+                const int y1 = std::min(y0 + tile_size, h);
+                // Local problem: the core with its overlap, clipped to the image; its ring is the Dirichlet border.
+                const int ex0 = std::max(x0 - overlap, 0);
+                const int ey0 = std::max(y0 - overlap, 0);
+                const int ex1 = std::min(x1 + overlap, w);
+                const int ey1 = std::min(y1 + overlap, h);
+
+                ImageFloat local_u(std::as_const(u).view(ex0, ey0, ex1 - ex0, ey1 - ey0));
+                const ImageFloat local_f(f.view(ex0, ey0, ex1 - ex0, ey1 - ey0));
+                if (params.local_solver == SchwarzLocalSolver::Multigrid) {
+                    local_u = solvePoissonMultigrid(local_u, local_f, params.local_tolerance);
+                } else {
+                    smoothPoissonRedBlack(local_u, local_f, params.local_sweeps, computeOptimalSorOmega(local_u.width, local_u.height));
+                }
+
+                for (int y = y0; y < y1; y++) {
+                    std::copy_n(local_u.data.data() + size_t(y - ey0) * size_t(local_u.width) + (x0 - ex0), x1 - x0, u_next.data.data() + size_t(y) * size_t(w) + x0);
+                }
+            });
+        }
+        scheduler.throwIfCancelled();
+        std::swap(u, u_next);
+        norm2 = computePoissonResidual(u, f, r);
+        iters++;
+    }
+
+    if (stats) {
+        stats->iterations = iters;
+        stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
+    }
+    return u;
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G for each channel by overlapping domain decomposition.
+/// </summary>
+/// <param name="targetXYZ">initial solution and border values</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="params">tiling, local solver and stopping criterion</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonSchwarzXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const SchwarzPoissonParams& params = {})
+{
+    return mapPlanes([&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonSchwarz(target, divergence, params); }, targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson Schwarz
@@ -0,0 +1,216 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <optional>
+#include <utility>
+
+#include "helpers.h"
+#include "poisson_common.h"
+#include "plane3.h"
+#include "stage_profiler.h"
+
+/*
+ * Incremental Poisson editing for interactive compositing.
+ *
+ * Moving the source (or changing its mask) only changes the merged gradients around the old and
+ * the new placement of the mask. The session keeps the gradients of both images, the merged
+ * gradients, the divergence and the last solution. An edit recomputes the merged gradients and
+ * the divergence only in the dirty rectangle (the union of the old and new mask bounds, grown by
+ * the 1px reach of the boundary rule and of the divergence stencil), and then warm-starts the
+ * solver from the previous solution: red-black SOR sweeps on a window around the dirty rectangle,
+ * with the previous solution as the window border. Most of the change of the solution is inside
+ * that window; refine() runs full-image sweeps (e.g. while the user is idle) to settle the rest.
+ *
+ * The merged gradients and the divergence follow copySourceGradientsToTarget() and
+ * getDivergence() exactly, with the source image and mask translated by the offset.
+ */
+
+#pragma region Poisson editing session
+
+/// <summary>
+/// Cached state of a Poisson composite of a movable source over a fixed target.
+/// </summary>
+class PoissonEditSession {
+public:
+    /// <param name="target">target image (initial solution and Dirichlet border)</param>
+    /// <param name="target_gradients">getGradientsXYZ(target)</param>
+    /// <param name="source_gradients">getGradientsXYZ(source), the source has the size of its mask</param>
+    /// <param name="source_mask">mask of the source (a float mask is thresholded at 0.5)</param>
+    /// <param name="solve_iters">SOR sweeps of the initial full solve</param>
+    PoissonEditSession(const ImageXYZ& target, ImageXYZGradient target_gradients, ImageXYZGradient source_gradients, BinaryMask source_mask, const int solve_iters = 500)
+        : m_target_gradients(std::move(target_gradients))
+        , m_source_gradients(std::move(source_gradients))
+        , m_source_mask(std::move(source_mask))
+        , m_merged(m_target_gradients)
+        , m_divergence(mapPlanes([](const ImageGradient& g) { return ImageFloat(g.dx.width + 1, g.dx.height + 1); }, m_target_gradients))
+        , m_solution(target)
+    {
+        assert(m_target_gradients.X.dx.width == target.X.width + 1 && m_target_gradients.X.dx.height == target.X.height + 1);
+        const PixelRect everything { 0, 0, width() + 2, height() + 2 };
+        updateMergedGradients(everything);
+        updateDivergence(everything);
+        refine(solve_iters);
+    }
+
+    int width() const { return m_solution.X.width; }
+    int height() const { return m_solution.X.height; }
+    int offsetX() const { return m_offset_x; }
+    int offsetY() const { return m_offset_y; }
+
+    const ImageXYZ& solution() const { return m_solution; }
+    const ImageXYZGradient& mergedGradients() const { return m_merged; }
+    const ImageXYZ& divergence() const { return m_divergence; }
+
+    /// <summary>
+    /// Places the source with its pixel (0, 0) at target pixel (offset_x, offset_y) and updates
+    /// the solution.
+    /// </summary>
+    /// <param name="local_iters">SOR sweeps on the window around the change</param>
+    /// <param name="margin">pixels of the window around the dirty rectangle</param>
+    const ImageXYZ& moveSource(const int offset_x, const int offset_y, const int local_iters = 100, const int margin = 32)
+    {
+        const PixelRect before = placedMaskBounds();
+        m_offset_x = offset_x;
+        m_offset_y = offset_y;
+        update(before.united(placedMaskBounds()), local_iters, margin);
+        return m_solution;
+    }
+
+    /// <summary>
+    /// Replaces the source mask (same size as the source) and updates the solution.
+    /// </summary>
+    const ImageXYZ& setMask(BinaryMask source_mask, const int local_iters = 100, const int margin = 32)
+    {
+        assert(source_mask.width() == m_source_mask.width() && source_mask.height() == m_source_mask.height());
+        const PixelRect before = placedMaskBounds();
+        m_source_mask = std::move(source_mask);
+        m_mask_bounds.reset();
+        update(before.united(placedMaskBounds()), local_iters, margin);
+        return m_solution;
+    }
+
+    /// <summary>
+    /// Full-image SOR sweeps from the current solution.
+    /// </summary>
+    const ImageXYZ& refine(const int num_iters)
+    {
+        const ScopedStage stage("PoissonEditSession::refine", 3 * uint64_t(width()) * uint64_t(height()) * uint64_t(std::max(num_iters, 0)));
+        const float omega = computeOptimalSorOmega(width(), height());
+        forEachPlane([&](ImageFloat& u, const ImageFloat& f) { smoothPoissonRedBlack(u, f, num_iters, omega); }, m_solution, m_divergence);
+        return m_solution;
+    }
+
+private:
+    bool insideSource(const int x, const int y) const
+    {
+        return PlacedMask { m_source_mask, m_offset_x, m_offset_y }(x, y);
+    }
+
+    // Bounds of the masked pixels in target coordinates.
+    PixelRect placedMaskBounds()
+    {
+        if (!m_mask_bounds) {
+            m_mask_bounds = m_source_mask.bounds();
+        }
+        return m_mask_bounds->grown(-m_offset_x, -m_offset_y, m_offset_x, m_offset_y);
+    }
+
+    void update(const PixelRect& changed_mask, const int local_iters, const int margin)
+    {
+        if (changed_mask.empty()) {
+            return;
+        }
+        const ScopedStage stage("PoissonEditSession::update");
+        // The boundary rule reads the mask 1px around a pixel, the divergence the gradients 1px up/left.
+        const PixelRect gradients = changed_mask.grown(1, 1, 1, 1);
+        const PixelRect divergence = gradients.grown(0, 0, 1, 1);
+        updateMergedGradients(gradients);
+        updateDivergence(divergence);
+
+        // Warm-started sweeps on the window, its outer ring stays fixed.
+        const PixelRect window = divergence.grown(margin + 1, margin + 1, margin + 1, margin + 1).clamped(width(), height());
+        if (window.x1 - window.x0 < 3 || window.y1 - window.y0 < 3) {
+            return;
+        }
+        const int ww = window.x1 - window.x0;
+        const int wh = window.y1 - window.y0;
+        const float omega = computeOptimalSorOmega(ww, wh);
+        forEachPlane([&](ImageFloat& u, const ImageFloat& f) {
+            auto u_window = ImageFloat(std::as_const(u).view(window.x0, window.y0, ww, wh));
+            const auto f_window = ImageFloat(f.view(window.x0, window.y0, ww, wh));
+            smoothPoissonRedBlack(u_window, f_window, local_iters, omega);
+            for (int y = 1; y < wh - 1; y++) {
+                std::copy_n(u_window.data.data() + y * ww + 1, ww - 2, u.data.data() + (window.y0 + y) * u.width + window.x0 + 1);
+            }
+        }, m_solution, m_divergence);
+    }
+
+    // copySourceGradientsToTarget() with the translated source, on the pixels of rect.
+    void updateMergedGradients(const PixelRect& rect)
+    {
+        // Like copySourceGradientsToTarget(), only pixels of the mask (solution) size are merged.
+        const PixelRect r = rect.clamped(width(), height());
+        const int w = width();
+        const int h = height();
+#pragma omp parallel for num_threads(kernelThreads(int64_t(r.x1 - r.x0) * (r.y1 - r.y0), KernelCost::Light))
+        for (int y = r.y0; y < r.y1; y++) {
+            for (int x = r.x0; x < r.x1; x++) {
+                const bool mask_val = insideSource(x, y);
+                const bool cut_dx = (x > 0 && insideSource(x - 1, y) != mask_val) || (x < w - 1 && insideSource(x + 1, y) != mask_val);
+                const bool cut_dy = (y > 0 && insideSource(x, y - 1) != mask_val) || (y < h - 1 && insideSource(x, y + 1) != mask_val);
+                forEachPlane([&](ImageGradient& merged, const ImageGradient& source, const ImageGradient& target) {
+                    const int offset = y * merged.dx.width + x;
+                    if (mask_val) {
+                        const int source_offset = (y - m_offset_y) * source.dx.width + (x - m_offset_x);
+                        merged.dx.data[offset] = source.dx.data[source_offset];
+                        merged.dy.data[offset] = source.dy.data[source_offset];
+                    } else {
+                        merged.dx.data[offset] = target.dx.data[offset];
+                        merged.dy.data[offset] = target.dy.data[offset];
+                    }
+                    if (cut_dx) {
+                        merged.dx.data[offset] = 0;
+                    }
+                    if (cut_dy) {
+                        merged.dy.data[offset] = 0;
+                    }
+                }, m_merged, m_source_gradients, m_target_gradients);
+            }
+        }
+    }
+
+    // getDivergence() on the pixels of rect.
+    void updateDivergence(const PixelRect& rect)
+    {
+        const PixelRect r = rect.clamped(m_merged.X.dx.width, m_merged.X.dy.height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(r.x1 - r.x0) * (r.y1 - r.y0), KernelCost::Light))
+        for (int y = r.y0; y < r.y1; y++) {
+            for (int x = r.x0; x < r.x1; x++) {
+                forEachPlane([&](ImageFloat& div_G, const ImageGradient& gradients) {
+                    float div_x = gradients.dx.data[y * gradients.dx.width + x];
+                    if (x > 0) {
+                        div_x -= gradients.dx.data[y * gradients.dx.width + x - 1];
+                    }
+                    float div_y = gradients.dy.data[y * gradients.dy.width + x];
+                    if (y > 0) {
+                        div_y -= gradients.dy.data[(y - 1) * gradients.dy.width + x];
+                    }
+                    div_G.data[y * div_G.width + x] = div_x + div_y;
+                }, m_divergence, m_merged);
+            }
+        }
+    }
+
+    ImageXYZGradient m_target_gradients;
+    ImageXYZGradient m_source_gradients;
+    BinaryMask m_source_mask;
+    ImageXYZGradient m_merged;
+    ImageXYZ m_divergence;
+    ImageXYZ m_solution;
+    int m_offset_x = 0;
+    int m_offset_y = 0;
+    // Bounds of the mask in source coordinates, computed on first use.
+    std::optional<PixelRect> m_mask_bounds;
+};
+
+#pragma endregion Poisson editing session
@@ -0,0 +1,268 @@
+#pragma once
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "helpers.h"
+#include "plane3.h"
+
+/*
+ * Direct (spectral) Poisson solver.
+ *
+ * With the Dirichlet border of solvePoisson() moved to the right-hand side, the 5-point
+ * Laplacian on the interior is diagonalized by the type-I discrete sine transform (DST-I)
+ * along both axes. The solve is a forward 2D DST, a division by the eigenvalues and an
+ * inverse 2D DST, O(N log N) and exact up to rounding.
+ *
+ * The DST-I is evaluated through a complex FFT of the odd extension. FFT lengths that are not
+ * a power of two use Bluestein's chirp-z algorithm, so any image size stays O(N log N).
+ * All transforms are computed in double precision.
+ */
+
+#pragma region Poisson spectral
+
+/// <summary>
+/// In-place iterative radix-2 FFT. data.size() must be a power of two equal to 2 * twiddles.size().
+/// </summary>
+/// <param name="data">sequence transformed in place</param>
+/// <param name="twiddles">exp(-2 pi i k / n) for k in [0, n / 2)</param>
+/// <param name="inverse">computes the unnormalized inverse transform when true</param>
+void fftRadix2(std::vector<std::complex<double>>& data, const std::vector<std::complex<double>>& twiddles, const bool inverse)
+{
+    const size_t n = data.size();
+
+    // Bit-reversal permutation.
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1) {
+        const size_t half = len / 2;
+        const size_t step = n / len;
+        for (size_t start = 0; start < n; start += len) {
+            for (size_t k = 0; k < half; k++) {
+                const auto w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+                const auto t = w * data[start + k + half];
+                data[start + k + half] = data[start + k] - t;
+                data[start + k] += t;
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Precomputed forward FFT of an arbitrary length.
+/// </summary>
+struct FftPlan {
+    // Transform length.
+    size_t n = 0;
+    // Power-of-two length of the radix-2 transforms (n itself, or the Bluestein convolution size).
+    size_t m = 0;
+    std::vector<std::complex<double>> twiddles;
+    // Bluestein only: chirp exp(-pi i k^2 / n) and the FFT of its padded conjugate.
+    std::vector<std::complex<double>> chirp;
+    std::vector<std::complex<double>> chirp_spectrum;
+
+    explicit FftPlan(const size_t length)
+        : n(length)
+    {
+        const double pi = 3.14159265358979323846;
+        const bool power_of_two = (n & (n - 1)) == 0;
+        m = 1;
+        while (m < (power_of_two ? n : 2 * n - 1)) {
+            m <<= 1;
+        }
+        twiddles.resize(m / 2);
+        for (size_t k = 0; k < m / 2; k++) {
+            twiddles[k] = std::polar(1.0, -2.0 * pi * double(k) / double(m));
+        }
+        if (power_of_two) {
+            return;
+        }
+
+        chirp.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            // k^2 mod 2n keeps the angle accurate for large k.
+            const auto k2 = (unsigned long long)(k) * k % (2 * n);
+            chirp[k] = std::polar(1.0, -pi * double(k2) / double(n));
+        }
+        chirp_spectrum.assign(m, 0.0);
+        chirp_spectrum[0] = std::conj(chirp[0]);
+        for (size_t k = 1; k < n; k++) {
+            chirp_spectrum[k] = chirp_spectrum[m - k] = std::conj(chirp[k]);
+        }
+        fftRadix2(chirp_spectrum, twiddles, false);
+    }
+
+    /// <summary>
+    /// Forward transform of data (size n) in place. scratch is resized as needed and can be reused across calls.
+    /// </summary>
+    void forward(std::vector<std::complex<double>>& data, std::vector<std::complex<double>>& scratch) const
+    {
+        if (chirp.empty()) {
+            fftRadix2(data, twiddles, false);
+            return;
+        }
+        scratch.assign(m, 0.0);
+        for (size_t k = 0; k < n; k++) {
+            scratch[k] = data[k] * chirp[k];
+        }
+        fftRadix2(scratch, twiddles, false);
+        for (size_t k = 0; k < m; k++) {
+            scratch[k] *= chirp_spectrum[k];
+        }
+        fftRadix2(scratch, twiddles, true);
+        for (size_t k = 0; k < n; k++) {
+            data[k] = chirp[k] * scratch[k] / double(m);
+        }
+    }
+};
+
+/// <summary>
+/// Unnormalized DST-I, X_k = sum_j x_j sin(pi (j + 1) (k + 1) / (n + 1)), through an FFT of length 2 (n + 1).
+/// Applying it twice scales the input by (n + 1) / 2.
+/// </summary>
+struct DstPlan {
+    size_t n;
+    FftPlan fft;
+
+    explicit DstPlan(const size_t length)
+        : n(length)
+        , fft(2 * (length + 1))
+    {
+    }
+
+    /// <summary>
+    /// Transforms values (size n) in place. buffer and scratch are per-thread work arrays.
+    /// </summary>
+    void apply(double* values, std::vector<std::complex<double>>& buffer, std::vector<std::complex<double>>& scratch) const
+    {
+        // Odd extension: 0, x_1..x_n, 0, -x_n..-x_1.
+        buffer.assign(2 * (n + 1), 0.0);
+        for (size_t j = 0; j < n; j++) {
+            buffer[j + 1] = values[j];
+            buffer[2 * (n + 1) - 1 - j] = -values[j];
+        }
+        fft.forward(buffer, scratch);
+        for (size_t k = 0; k < n; k++) {
+            values[k] = -0.5 * buffer[k + 1].imag();
+        }
+    }
+};
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G directly with a 2D discrete sine transform.
+/// Uses the same border convention as solvePoisson(): the 1px border of boundary is kept fixed.
+/// </summary>
+/// <param name="boundary">image providing the Dirichlet border (its interior is ignored)</param>
+/// <param name="divergence">div G</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonSpectral(const ImageFloat& boundary, const ImageFloat& divergence)
+{
+    const double pi = 3.14159265358979323846;
+    const int w = boundary.width;
+    const int h = boundary.height;
+    const int dw = divergence.width;
+
+    auto I = boundary.clone();
+    // Interior size.
+    const int nx = w - 2;
+    const int ny = h - 2;
+    if (nx < 1 || ny < 1) {
+        return I;
+    }
+
+    // Right-hand side with the fixed border neighbors moved over: sum(interior neighbors) - 4 u = f - sum(border neighbors).
+    std::vector<double> rhs(size_t(nx) * size_t(ny));
+#pragma omp parallel for num_threads(kernelThreads(int64_t(nx) * ny, KernelCost::Light))
+    for (int j = 0; j < ny; j++) {
+        const int y = j + 1;
+        for (int i = 0; i < nx; i++) {
+            const int x = i + 1;
+            double val = divergence.data[y * dw + x];
+            if (x == 1) {
+                val -= boundary.data[y * w];
+            }
+            if (x == w - 2) {
+                val -= boundary.data[y * w + w - 1];
+            }
+            if (y == 1) {
+                val -= boundary.data[x];
+            }
+            if (y == h - 2) {
+                val -= boundary.data[(h - 1) * w + x];
+            }
+            rhs[size_t(j) * nx + i] = val;
+        }
+    }
+
+    const auto row_dst = DstPlan(nx);
+    const auto col_dst = DstPlan(ny);
+
+    // Applies the DST along both axes of rhs.
+    const auto transform2d = [&]() {
+#pragma omp parallel num_threads(kernelThreads(int64_t(nx) * ny, KernelCost::Heavy))
+        {
+            std::vector<std::complex<double>> buffer, scratch;
+            std::vector<double> column(ny);
+#pragma omp for
+            for (int j = 0; j < ny; j++) {
+                row_dst.apply(&rhs[size_t(j) * nx], buffer, scratch);
+            }
+#pragma omp for
+            for (int i = 0; i < nx; i++) {
+                for (int j = 0; j < ny; j++) {
+                    column[j] = rhs[size_t(j) * nx + i];
+                }
+                col_dst.apply(column.data(), buffer, scratch);
+                for (int j = 0; j < ny; j++) {
+                    rhs[size_t(j) * nx + i] = column[j];
+                }
+            }
+        }
+    };
+
+    transform2d();
+
+    // Divide by the eigenvalues of the Laplacian, including the DST-I normalization of the inverse transform.
+    const double normalization = 4.0 / (double(nx + 1) * double(ny + 1));
+#pragma omp parallel for num_threads(kernelThreads(int64_t(nx) * ny, KernelCost::Light))
+    for (int l = 0; l < ny; l++) {
+        const double ly = 2.0 * std::cos(pi * double(l + 1) / double(ny + 1));
+        for (int k = 0; k < nx; k++) {
+            const double lx = 2.0 * std::cos(pi * double(k + 1) / double(nx + 1));
+            rhs[size_t(l) * nx + k] *= normalization / (lx + ly - 4.0);
+        }
+    }
+
+    transform2d();
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(nx) * ny, KernelCost::Light))
+    for (int j = 0; j < ny; j++) {
+        for (int i = 0; i < nx; i++) {
+            I.data[(j + 1) * w + i + 1] = float(rhs[size_t(j) * nx + i]);
+        }
+    }
+
+    return I;
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G for each channel using the spectral solver.
+/// </summary>
+/// <param name="targetXYZ">border values</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonSpectralXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G)
+{
+    return mapPlanes([](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonSpectral(target, divergence); }, targetXYZ, divergenceXYZ_G);
+}
+
+#pragma endregion Poisson spectral
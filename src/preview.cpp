@@ -0,0 +1,309 @@
+// glad before glfw, which would otherwise include the system GL header.
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+#include <imgui/imgui.h>
+#include <imgui/imgui_impl_glfw.h>
+#include <imgui/imgui_impl_opengl3.h>
+#include <nativefiledialog/nfd.h>
+
+#include "your_code_here.h"
+#include "run_config.h"
+#include "tone_map_preview.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <mutex>
+
+static const std::filesystem::path dataDirPath { DATA_DIR };
+
+/*
+ * Interactive tone mapping preview.
+ *
+ * The image is a ProgressiveToneMap of 1/8, 1/4, 1/2 and the full resolution. Every slider move
+ * renders the 1/8 level on the UI thread, which re-runs only the passes downstream of the moved
+ * parameter (base_scale, output_gain and saturation never re-run the bilateral filter). The
+ * finer levels are then rendered by a worker thread and replace the displayed image one after
+ * the other. A move in the meantime cancels the worker after its current level and starts it
+ * again with the new parameters.
+ *
+ * Started with the settings of a1_hdr (see "a1_hdr --help"), e.g.
+ * "a1_hdr_preview --hdr_input data/memorial2_half.hdr --engine grid".
+ */
+
+/// <summary>
+/// Preview state: the levels, the job refining them and the displayed texture.
+/// </summary>
+struct PreviewState {
+    std::filesystem::path input;
+    std::unique_ptr<ProgressiveToneMap> levels;
+    // Renders the levels after the first; true when it rendered all of them.
+    std::future<bool> refine_job;
+    std::atomic<bool> cancel_refine = false;
+    // Latest level finished by the job, taken by the UI thread.
+    std::mutex finished_mutex;
+    std::optional<ImageRGB> finished_image;
+    size_t finished_level = 0;
+    ToneMapPreviewStats finished_stats;
+    // Parameters of the running job and of the completely refined image.
+    DurandParams job_params;
+    std::optional<DurandParams> refined_params;
+    GLuint texture = 0;
+    int texture_width = 0, texture_height = 0;
+    size_t shown_level = 0;
+    ToneMapPreviewStats shown_stats;
+};
+
+bool sameDurandParams(const DurandParams& a, const DurandParams& b)
+{
+    return a.filter_size == b.filter_size && a.space_sigma == b.space_sigma && a.range_sigma == b.range_sigma && a.base_scale == b.base_scale
+        && a.output_gain == b.output_gain && a.saturation == b.saturation && a.engine == b.engine && a.color_guide == b.color_guide
+        && a.math_precision == b.math_precision && a.tone_operator == b.tone_operator
+        && a.key == b.key && a.white_point == b.white_point
+        && a.gradient_alpha == b.gradient_alpha && a.gradient_beta == b.gradient_beta && a.gradient_solver == b.gradient_solver;
+}
+
+/// <summary>
+/// Replaces the texture with an RGB image in [0,1].
+/// </summary>
+void uploadTexture(PreviewState& state, const ImageRGB& image)
+{
+    if (state.texture == 0) {
+        glGenTextures(1, &state.texture);
+    }
+    glBindTexture(GL_TEXTURE_2D, state.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.data.data());
+    state.texture_width = image.width;
+    state.texture_height = image.height;
+}
+
+/// <summary>
+/// Stops the refine job after its current level and waits for it.
+/// </summary>
+void stopRefining(PreviewState& state)
+{
+    if (state.refine_job.valid()) {
+        state.cancel_refine = true;
+        if (state.refine_job.get()) {
+            state.refined_params = state.job_params;
+        }
+    }
+    std::lock_guard lock(state.finished_mutex);
+    state.finished_image.reset();
+}
+
+/// <summary>
+/// Loads an HDR image into the levels; stops a running job first.
+/// </summary>
+void loadPreviewImage(PreviewState& state, const std::filesystem::path& input)
+{
+    stopRefining(state);
+    const ImageRGB hdr_image(input);
+    state.input = input;
+    state.levels = std::make_unique<ProgressiveToneMap>(hdr_image);
+    state.refined_params.reset();
+}
+
+/// <summary>
+/// Coarsest level after a parameter change, then the finer levels as the job finishes them.
+/// </summary>
+void updatePreview(PreviewState& state, const DurandParams& params, const bool changed)
+{
+    if (changed) {
+        stopRefining(state);
+        uploadTexture(state, state.levels->level(0).render(params));
+        state.shown_level = 0;
+        state.shown_stats = state.levels->level(0).stats();
+    }
+    {
+        std::lock_guard lock(state.finished_mutex);
+        if (state.finished_image) {
+            uploadTexture(state, *state.finished_image);
+            state.shown_level = state.finished_level;
+            state.shown_stats = state.finished_stats;
+            state.finished_image.reset();
+        }
+    }
+    if (state.refine_job.valid() && state.refine_job.wait_for(std::chrono::seconds(0)) == std::future_status::ready && state.refine_job.get()) {
+        state.refined_params = state.job_params;
+    }
+    if (!state.refine_job.valid() && !(state.refined_params && sameDurandParams(*state.refined_params, params))) {
+        state.job_params = params;
+        state.cancel_refine = false;
+        state.refine_job = std::async(std::launch::async, [&state, params] {
+            return state.levels->render(params, [&](const ImageRGB& image, const size_t level) {
+                std::lock_guard lock(state.finished_mutex);
+                state.finished_image = image;
+                state.finished_level = level;
+                state.finished_stats = state.levels->level(level).stats();
+                return !state.cancel_refine;
+            }, 1);
+        });
+    }
+}
+
+/// <summary>
+/// Parameter sliders, true when any parameter changed.
+/// </summary>
+bool drawParameterControls(DurandParams& params)
+{
+    bool changed = false;
+    if (ImGui::SliderInt("filter_size", &params.filter_size, 1, 101)) {
+        params.filter_size |= 1;
+        changed = true;
+    }
+    changed |= ImGui::SliderFloat("space_sigma", &params.space_sigma, 0.1f, 32.0f);
+    changed |= ImGui::SliderFloat("range_sigma", &params.range_sigma, 0.01f, 5.0f);
+    changed |= ImGui::SliderFloat("base_scale", &params.base_scale, 0.0f, 1.0f);
+    changed |= ImGui::SliderFloat("output_gain", &params.output_gain, 0.0f, 2.0f);
+    changed |= ImGui::SliderFloat("saturation", &params.saturation, 0.0f, 1.0f);
+
+    const char* engines[] = { "bruteforce", "grid", "tiled", "rangelut", "simd", "upsampled", "recursive", "permutohedral", "adaptive", "guided", "wls" };
+    int engine = int(params.engine);
+    if (ImGui::Combo("engine", &engine, engines, IM_ARRAYSIZE(engines))) {
+        params.engine = BilateralEngine(engine);
+        changed = true;
+    }
+    changed |= ImGui::Checkbox("color_guide", &params.color_guide);
+    const char* operators[] = { "durand", "local_laplacian", "reinhard", "filmic", "fattal" };
+    int tone_operator = int(params.tone_operator);
+    if (ImGui::Combo("operator", &tone_operator, operators, IM_ARRAYSIZE(operators))) {
+        params.tone_operator = ToneMapOperator(tone_operator);
+        changed = true;
+    }
+    const char* precisions[] = { "exact", "fast", "faster" };
+    int precision = int(params.math_precision);
+    if (ImGui::Combo("math", &precision, precisions, IM_ARRAYSIZE(precisions))) {
+        params.math_precision = MathPrecision(precision);
+        changed = true;
+    }
+    return changed;
+}
+
+/// <summary>
+/// Opens the preview window. Takes the settings of a1_hdr, see printRunUsage().
+/// </summary>
+/// <returns>0</returns>
+int main(int argc, char** argv)
+{
+    RunConfig config;
+    config.hdr_input = dataDirPath / "memorial2_half.hdr";
+    // The exact window at interactive rates.
+    config.durand.engine = BilateralEngine::Simd;
+    try {
+        parseRunArguments(config, argc, argv);
+    } catch (const std::exception&) {
+        printRunUsage(std::cerr);
+        return 1;
+    }
+    setThreadCount(config.threads);
+
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW." << std::endl;
+        return 1;
+    }
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GLFW_TRUE);
+    GLFWwindow* window = glfwCreateWindow(1600, 1000, "a1_hdr preview", nullptr, nullptr);
+    if (!window) {
+        std::cerr << "Failed to create an OpenGL 3.3 window." << std::endl;
+        glfwTerminate();
+        return 1;
+    }
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(1);
+    if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress))) {
+        std::cerr << "Failed to load the OpenGL functions." << std::endl;
+        return 1;
+    }
+
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    ImGui_ImplGlfw_InitForOpenGL(window, true);
+    ImGui_ImplOpenGL3_Init("#version 330");
+
+    PreviewState state;
+    DurandParams& params = config.durand;
+    try {
+        loadPreviewImage(state, config.hdr_input);
+    } catch (const std::exception&) {
+        return 1;
+    }
+    bool changed = true;
+
+    while (!glfwWindowShouldClose(window)) {
+        glfwPollEvents();
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui_ImplGlfw_NewFrame();
+        ImGui::NewFrame();
+
+        ImGui::SetNextWindowPos(ImVec2(0, 0), ImGuiCond_FirstUseEver);
+        ImGui::SetNextWindowSize(ImVec2(380, 0), ImGuiCond_FirstUseEver);
+        ImGui::Begin("Durand tone mapping");
+        ImGui::TextUnformatted(state.input.filename().string().c_str());
+        if (ImGui::Button("Open...")) {
+            nfdchar_t* path = nullptr;
+            if (NFD_OpenDialog("hdr,exr,png,jpg", nullptr, &path) == NFD_OKAY) {
+                try {
+                    loadPreviewImage(state, path);
+                    changed = true;
+                } catch (const std::exception&) {
+                }
+                std::free(path);
+            }
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Save PNG...")) {
+            nfdchar_t* path = nullptr;
+            if (NFD_SaveDialog("png", nullptr, &path) == NFD_OKAY) {
+                // The full resolution of the current parameters, also when its job is still running.
+                stopRefining(state);
+                auto& finest = state.levels->level(state.levels->numLevels() - 1);
+                ImageRGB(finest.render(params)).writeToFile(std::filesystem::path(path).replace_extension(".png"));
+                std::free(path);
+            }
+        }
+        changed |= drawParameterControls(params);
+        ImGui::Separator();
+        // The levels after the first belong to the job, their stats are the copies it handed out.
+        const auto& stats = state.shown_stats;
+        ImGui::Text("1/%d resolution, %d x %d", state.levels->level(state.shown_level).downsampleFactor(), state.texture_width, state.texture_height);
+        ImGui::Text("%.1f ms, passes: %zu log, %zu bilateral, %zu compose", stats.last_render_ms, stats.log_luminance_runs, stats.bilateral_runs, stats.compose_runs);
+        ImGui::End();
+
+        updatePreview(state, params, changed);
+        changed = false;
+
+        // The image fills the window behind the controls, aspect preserved.
+        const ImVec2 display = ImGui::GetIO().DisplaySize;
+        const float scale = std::min(display.x / float(state.texture_width), display.y / float(state.texture_height));
+        const ImVec2 size(float(state.texture_width) * scale, float(state.texture_height) * scale);
+        const ImVec2 corner((display.x - size.x) / 2, (display.y - size.y) / 2);
+        ImGui::GetBackgroundDrawList()->AddImage(reinterpret_cast<ImTextureID>(intptr_t(state.texture)), corner, ImVec2(corner.x + size.x, corner.y + size.y));
+
+        ImGui::Render();
+        int framebuffer_width, framebuffer_height;
+        glfwGetFramebufferSize(window, &framebuffer_width, &framebuffer_height);
+        glViewport(0, 0, framebuffer_width, framebuffer_height);
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        glfwSwapBuffers(window);
+    }
+
+    stopRefining(state);
+    glDeleteTextures(1, &state.texture);
+    ImGui_ImplOpenGL3_Shutdown();
+    ImGui_ImplGlfw_Shutdown();
+    ImGui::DestroyContext();
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 0;
+}
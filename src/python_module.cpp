@@ -0,0 +1,608 @@
+// Python bindings of the images and the tone-mapping / Poisson kernels (module a1_hdr), built
+// with -DA1_HDR_PYTHON=ON.
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "run_config.h"
+#include "your_code_here.h"
+
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+
+/*
+ * Zero-copy exchange of images with Python (NumPy).
+ *
+ * a1_hdr.ImageFloat and a1_hdr.ImageRGB own an Image<float> / Image<glm::vec3> and export its
+ * pixels through the buffer protocol: numpy.asarray(image) is a writable float32 array of shape
+ * (height, width) or (height, width, 3) over the image's own buffer, no conversion of data.
+ * Results of the kernels are moved into new image objects, so they reach Python without a copy.
+ *
+ * Kernels accept image objects and any float32 buffer of the same shape (a NumPy array, also a
+ * strided slice of one as long as each pixel is contiguous). Kernels that take image views
+ * (rgb_to_luminance, log_image) read arrays in place; the kernels that take whole images read
+ * image objects in place and copy an array once. To avoid that copy, allocate an image object and
+ * fill it through its array: numpy.asarray(a1_hdr.ImageRGB(w, h))[...] = pixels.
+ *
+ * The GIL is released while a kernel runs. A kernel that fails prints the reason to stderr, like
+ * the application, and raises RuntimeError. Tone-mapping parameters are keyword arguments with
+ * the names of the run settings (filter_size, space_sigma, range_sigma, base_scale, output_gain,
+ * saturation, engine, operator, key, white_point, gradient_alpha, gradient_beta, gradient_solver,
+ * color_guide), see printRunUsage().
+ */
+
+namespace {
+
+#pragma region Image objects
+
+template <typename T>
+struct PyImageObject {
+    PyObject_HEAD
+    Image<T>* image;
+    // Shape and strides of the exported buffer, fixed for the lifetime of the object.
+    Py_ssize_t shape[3];
+    Py_ssize_t strides[3];
+};
+
+template <typename T>
+constexpr int imageChannels() { return int(sizeof(T) / sizeof(float)); }
+
+template <typename T>
+PyTypeObject& imageType();
+
+template <typename T>
+PyObject* wrapImage(Image<T>&& image)
+{
+    auto* object = PyObject_New(PyImageObject<T>, &imageType<T>());
+    if (!object) {
+        return nullptr;
+    }
+    object->image = new Image<T>(std::move(image));
+    const Py_ssize_t channels = imageChannels<T>();
+    object->shape[0] = object->image->height;
+    object->shape[1] = object->image->width;
+    object->shape[2] = channels;
+    object->strides[0] = Py_ssize_t(sizeof(T)) * object->image->width;
+    object->strides[1] = Py_ssize_t(sizeof(T));
+    object->strides[2] = Py_ssize_t(sizeof(float));
+    return reinterpret_cast<PyObject*>(object);
+}
+
+template <typename T>
+void imageDealloc(PyObject* self)
+{
+    delete reinterpret_cast<PyImageObject<T>*>(self)->image;
+    PyObject_Free(self);
+}
+
+template <typename T>
+int imageGetBuffer(PyObject* self, Py_buffer* view, const int flags)
+{
+    auto* object = reinterpret_cast<PyImageObject<T>*>(self);
+    auto& image = *object->image;
+    view->obj = Py_NewRef(self);
+    view->buf = image.data.data();
+    view->len = Py_ssize_t(image.data.size() * sizeof(T));
+    view->itemsize = sizeof(float);
+    view->readonly = 0;
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("f") : nullptr;
+    view->ndim = imageChannels<T>() == 1 ? 2 : 3;
+    view->shape = (flags & PyBUF_ND) ? object->shape : nullptr;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? object->strides : nullptr;
+    view->suboffsets = nullptr;
+    view->internal = nullptr;
+    return 0;
+}
+
+/// <summary>
+/// Image argument of a kernel: an image object or a float32 buffer, see above.
+/// </summary>
+template <typename T>
+class ImageArgument {
+public:
+    ImageArgument() = default;
+    ImageArgument(const ImageArgument&) = delete;
+    ImageArgument& operator=(const ImageArgument&) = delete;
+    ~ImageArgument()
+    {
+        if (m_has_buffer) {
+            PyBuffer_Release(&m_buffer);
+        }
+    }
+
+    // Sets a Python exception and returns false when the object is not an image of type T.
+    bool parse(PyObject* object, const char* name)
+    {
+        if (PyObject_TypeCheck(object, &imageType<T>())) {
+            m_image = reinterpret_cast<PyImageObject<T>*>(object)->image;
+            m_view = *m_image;
+            return true;
+        }
+        if (PyObject_GetBuffer(object, &m_buffer, PyBUF_RECORDS_RO) != 0) {
+            PyErr_Format(PyExc_TypeError, "%s: expected an image or a float32 array", name);
+            return false;
+        }
+        m_has_buffer = true;
+        constexpr int channels = imageChannels<T>();
+        const int ndim = channels == 1 ? 2 : 3;
+        const bool is_float = m_buffer.itemsize == 4 && m_buffer.format && std::strcmp(m_buffer.format, "f") == 0;
+        if (!is_float || m_buffer.ndim != ndim || (channels > 1 && m_buffer.shape[2] != channels)) {
+            PyErr_Format(PyExc_ValueError, "%s: expected a float32 array of shape (height, width%s)", name, channels == 1 ? "" : ", 3");
+            return false;
+        }
+        // Pixels must be contiguous and rows a whole number of pixels apart.
+        const bool channels_contiguous = channels == 1 || m_buffer.strides[2] == Py_ssize_t(sizeof(float));
+        if (!channels_contiguous || m_buffer.strides[1] != Py_ssize_t(sizeof(T)) || m_buffer.strides[0] < m_buffer.strides[1] * m_buffer.shape[1]
+            || m_buffer.strides[0] % Py_ssize_t(sizeof(T)) != 0) {
+            PyErr_Format(PyExc_ValueError, "%s: the pixels of the array must be contiguous", name);
+            return false;
+        }
+        m_view = ImageView<const T>(static_cast<const T*>(m_buffer.buf), int(m_buffer.shape[1]), int(m_buffer.shape[0]), int(m_buffer.strides[0] / Py_ssize_t(sizeof(T))));
+        return true;
+    }
+
+    // The pixels in place.
+    ImageView<const T> view() const { return m_view; }
+
+    // The image object, or a copy of the array made on first use.
+    const Image<T>& image()
+    {
+        if (!m_image) {
+            m_copy.emplace(m_view);
+            m_image = &*m_copy;
+        }
+        return *m_image;
+    }
+
+private:
+    const Image<T>* m_image = nullptr;
+    ImageView<const T> m_view;
+    Py_buffer m_buffer {};
+    bool m_has_buffer = false;
+    std::optional<Image<T>> m_copy;
+};
+
+// Runs a kernel without the GIL; a failed kernel (std::exception) sets RuntimeError.
+template <typename Fn>
+bool runKernel(const char* name, const Fn& fn)
+{
+    bool ok = true;
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        fn();
+    } catch (const std::exception&) {
+        ok = false;
+    }
+    Py_END_ALLOW_THREADS
+    if (!ok) {
+        PyErr_Format(PyExc_RuntimeError, "%s failed, see stderr", name);
+    }
+    return ok;
+}
+
+// ImageT(width, height), ImageT(path) or ImageT(array), the latter copies the pixels.
+template <typename T>
+PyObject* imageNew(PyTypeObject*, PyObject* args, PyObject* kwargs)
+{
+    if (kwargs && PyDict_Size(kwargs) > 0) {
+        PyErr_SetString(PyExc_TypeError, "image constructors take positional arguments only");
+        return nullptr;
+    }
+    int width = 0, height = 0;
+    if (PyArg_ParseTuple(args, "ii", &width, &height)) {
+        if (width < 1 || height < 1) {
+            PyErr_SetString(PyExc_ValueError, "image size must be positive");
+            return nullptr;
+        }
+        return wrapImage(Image<T>(width, height));
+    }
+    PyErr_Clear();
+    PyObject* argument = nullptr;
+    if (!PyArg_ParseTuple(args, "O", &argument)) {
+        return nullptr;
+    }
+    if (PyUnicode_Check(argument) || PyObject_HasAttrString(argument, "__fspath__")) {
+        PyObject* path_bytes = nullptr;
+        if (!PyUnicode_FSConverter(argument, &path_bytes)) {
+            return nullptr;
+        }
+        const std::filesystem::path path(PyBytes_AsString(path_bytes));
+        Py_DECREF(path_bytes);
+        std::optional<Image<T>> image;
+        if (!runKernel("load", [&] { image.emplace(path); })) {
+            return nullptr;
+        }
+        return wrapImage(std::move(*image));
+    }
+    ImageArgument<T> source;
+    if (!source.parse(argument, "image")) {
+        return nullptr;
+    }
+    return wrapImage(Image<T>(source.view()));
+}
+
+template <typename T>
+PyObject* imageWrite(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "path", "scaling", nullptr };
+    PyObject* path_bytes = nullptr;
+    float scaling = 1.0f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|f", const_cast<char**>(keywords), PyUnicode_FSConverter, &path_bytes, &scaling)) {
+        return nullptr;
+    }
+    const std::filesystem::path path(PyBytes_AsString(path_bytes));
+    Py_DECREF(path_bytes);
+    const auto& image = *reinterpret_cast<PyImageObject<T>*>(self)->image;
+    if (!runKernel("write", [&] { image.writeToFile(path, scaling); })) {
+        return nullptr;
+    }
+    Py_RETURN_NONE;
+}
+
+template <typename T>
+PyObject* imageWidth(PyObject* self, void*) { return PyLong_FromLong(reinterpret_cast<PyImageObject<T>*>(self)->image->width); }
+template <typename T>
+PyObject* imageHeight(PyObject* self, void*) { return PyLong_FromLong(reinterpret_cast<PyImageObject<T>*>(self)->image->height); }
+
+template <typename T>
+PyTypeObject makeImageType(const char* name, const char* doc)
+{
+    static PyBufferProcs buffer_procs = { imageGetBuffer<T>, nullptr };
+    static PyMethodDef methods[] = {
+        { "write", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(imageWrite<T>)), METH_VARARGS | METH_KEYWORDS,
+            "write(path, scaling=1.0): writes the image with Image::writeToFile() (format by extension)" },
+        { nullptr, nullptr, 0, nullptr },
+    };
+    static PyGetSetDef properties[] = {
+        { "width", imageWidth<T>, nullptr, nullptr, nullptr },
+        { "height", imageHeight<T>, nullptr, nullptr, nullptr },
+        { nullptr, nullptr, nullptr, nullptr, nullptr },
+    };
+    PyTypeObject type = { PyVarObject_HEAD_INIT(nullptr, 0) };
+    type.tp_name = name;
+    type.tp_basicsize = sizeof(PyImageObject<T>);
+    type.tp_dealloc = imageDealloc<T>;
+    type.tp_as_buffer = &buffer_procs;
+    type.tp_flags = Py_TPFLAGS_DEFAULT;
+    type.tp_doc = doc;
+    type.tp_methods = methods;
+    type.tp_getset = properties;
+    type.tp_new = imageNew<T>;
+    return type;
+}
+
+template <>
+PyTypeObject& imageType<float>()
+{
+    static PyTypeObject type = makeImageType<float>("a1_hdr.ImageFloat", "Image<float>: ImageFloat(width, height), ImageFloat(path) or ImageFloat(array)");
+    return type;
+}
+
+template <>
+PyTypeObject& imageType<glm::vec3>()
+{
+    static PyTypeObject type = makeImageType<glm::vec3>("a1_hdr.ImageRGB", "Image<glm::vec3>: ImageRGB(width, height), ImageRGB(path) or ImageRGB(array)");
+    return type;
+}
+
+#pragma endregion Image objects
+
+#pragma region Kernels
+
+// Positional image arguments of a kernel; sets a Python exception on failure.
+template <typename... T>
+bool parseImages(PyObject* args, const char* name, ImageArgument<T>&... images)
+{
+    constexpr Py_ssize_t count = sizeof...(T);
+    if (PyTuple_Size(args) != count) {
+        PyErr_Format(PyExc_TypeError, "%s takes %d image arguments", name, int(count));
+        return false;
+    }
+    Py_ssize_t i = 0;
+    return (images.parse(PyTuple_GET_ITEM(args, i++), name) && ...);
+}
+
+// Tone-mapping parameters from keyword arguments named like the run settings, see above.
+bool parseDurandParams(PyObject* kwargs, DurandParams& params)
+{
+    RunConfig config;
+    if (kwargs) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(kwargs, &pos, &key, &value)) {
+            PyObject* text = PyBool_Check(value) ? PyUnicode_FromString(value == Py_True ? "1" : "0") : PyObject_Str(value);
+            if (!text) {
+                return false;
+            }
+            const std::string name = PyUnicode_AsUTF8(key);
+            const std::string setting = PyUnicode_AsUTF8(text);
+            Py_DECREF(text);
+            try {
+                applyRunSetting(config, name, setting);
+            } catch (const std::exception&) {
+                PyErr_Format(PyExc_ValueError, "invalid tone-mapping parameter %s=%s, see stderr", name.c_str(), setting.c_str());
+                return false;
+            }
+        }
+    }
+    try {
+        applyQualityPreset(config);
+    } catch (const std::exception&) {
+        PyErr_SetString(PyExc_ValueError, "invalid quality preset, see stderr");
+        return false;
+    }
+    if (!config.explicit_space_sigma) {
+        config.durand.space_sigma = config.durand.filter_size / 6.4f;
+    }
+    params = config.durand;
+    return true;
+}
+
+PyObject* pyRgbToLuminance(PyObject*, PyObject* args)
+{
+    ImageArgument<glm::vec3> rgb;
+    if (!parseImages(args, "rgb_to_luminance", rgb)) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("rgb_to_luminance", [&] { result.emplace(rgbToLuminance(rgb.view())); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyLogImage(PyObject*, PyObject* args)
+{
+    ImageArgument<float> image;
+    if (!parseImages(args, "log_image", image)) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("log_image", [&] {
+            result.emplace(ImageFloat::uninitialized(image.view().width, image.view().height));
+            logImage(image.view(), *result);
+        })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyBilateralFilter(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "image", "size", "space_sigma", "range_sigma", "engine", nullptr };
+    PyObject* object = nullptr;
+    int size = 27;
+    float space_sigma = 27 / 6.4f, range_sigma = 1.0f;
+    const char* engine = "bruteforce";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iffs", const_cast<char**>(keywords), &object, &size, &space_sigma, &range_sigma, &engine)) {
+        return nullptr;
+    }
+    ImageArgument<float> image;
+    if (!image.parse(object, "bilateral_filter")) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("bilateral_filter", [&] { result.emplace(bilateralFilter(image.image(), size, space_sigma, range_sigma, parseBilateralEngine(engine))); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyDurandLogLuminance(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    ImageArgument<glm::vec3> hdr;
+    DurandParams params;
+    if (!parseImages(args, "durand_log_luminance", hdr) || !parseDurandParams(kwargs, params)) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("durand_log_luminance", [&] { result.emplace(durandLogLuminance(hdr.image(), params)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyDurandBaseLayer(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    ImageArgument<glm::vec3> hdr;
+    ImageArgument<float> log_lum;
+    DurandParams params;
+    if (!parseImages(args, "durand_base_layer", hdr, log_lum) || !parseDurandParams(kwargs, params)) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("durand_base_layer", [&] { result.emplace(durandBaseLayer(hdr.image(), log_lum.image(), params)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyDurandCompose(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    ImageArgument<glm::vec3> hdr;
+    ImageArgument<float> log_lum, base;
+    DurandParams params;
+    if (!parseImages(args, "durand_compose", hdr, log_lum, base) || !parseDurandParams(kwargs, params)) {
+        return nullptr;
+    }
+    std::optional<ImageRGB> result;
+    if (!runKernel("durand_compose", [&] { result.emplace(durandCompose(hdr.image(), log_lum.image(), base.image(), params)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyToneMap(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    ImageArgument<glm::vec3> hdr;
+    DurandParams params;
+    if (!parseImages(args, "tone_map", hdr) || !parseDurandParams(kwargs, params)) {
+        return nullptr;
+    }
+    std::optional<ImageRGB> result;
+    if (!runKernel("tone_map", [&] { result.emplace(toneMap(hdr.image(), params)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyRescaleRgbByLuminance(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "rgb", "luminance", "new_luminance", "saturation", nullptr };
+    PyObject *rgb_object = nullptr, *luminance_object = nullptr, *new_luminance_object = nullptr;
+    float saturation = 0.5f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|f", const_cast<char**>(keywords), &rgb_object, &luminance_object, &new_luminance_object, &saturation)) {
+        return nullptr;
+    }
+    ImageArgument<glm::vec3> rgb;
+    ImageArgument<float> luminance, new_luminance;
+    if (!rgb.parse(rgb_object, "rgb") || !luminance.parse(luminance_object, "luminance") || !new_luminance.parse(new_luminance_object, "new_luminance")) {
+        return nullptr;
+    }
+    std::optional<ImageRGB> result;
+    if (!runKernel("rescale_rgb_by_luminance", [&] { result.emplace(rescaleRgbByLuminance(rgb.image(), luminance.image(), new_luminance.image(), saturation)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyApplyGamma(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "rgb", "gamma", "normalize", nullptr };
+    PyObject* object = nullptr;
+    float gamma = 1.0f / 2.2f;
+    int normalize = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|fp", const_cast<char**>(keywords), &object, &gamma, &normalize)) {
+        return nullptr;
+    }
+    ImageArgument<glm::vec3> rgb;
+    if (!rgb.parse(object, "apply_gamma")) {
+        return nullptr;
+    }
+    std::optional<ImageRGB> result;
+    if (!runKernel("apply_gamma", [&] { result.emplace(applyGamma(rgb.image(), gamma, normalize != 0)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pyGetGradients(PyObject*, PyObject* args)
+{
+    ImageArgument<float> image;
+    if (!parseImages(args, "get_gradients", image)) {
+        return nullptr;
+    }
+    std::optional<ImageGradient> gradients;
+    if (!runKernel("get_gradients", [&] { gradients.emplace(getGradients(image.image())); })) {
+        return nullptr;
+    }
+    PyObject* dx = wrapImage(std::move(gradients->dx));
+    PyObject* dy = dx ? wrapImage(std::move(gradients->dy)) : nullptr;
+    if (!dy) {
+        Py_XDECREF(dx);
+        return nullptr;
+    }
+    return Py_BuildValue("(NN)", dx, dy);
+}
+
+PyObject* pyGetDivergence(PyObject*, PyObject* args)
+{
+    ImageArgument<float> dx, dy;
+    if (!parseImages(args, "get_divergence", dx, dy)) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("get_divergence", [&] {
+            // getDivergence() takes the gradients by reference.
+            ImageGradient gradients { Image<float>(dx.view()), Image<float>(dy.view()) };
+            result.emplace(getDivergence(gradients));
+        })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pySolvePoisson(PyObject*, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "initial_solution", "divergence", "num_iters", nullptr };
+    PyObject *initial_object = nullptr, *divergence_object = nullptr;
+    int num_iters = 2000;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", const_cast<char**>(keywords), &initial_object, &divergence_object, &num_iters)) {
+        return nullptr;
+    }
+    ImageArgument<float> initial, divergence;
+    if (!initial.parse(initial_object, "initial_solution") || !divergence.parse(divergence_object, "divergence")) {
+        return nullptr;
+    }
+    std::optional<ImageFloat> result;
+    if (!runKernel("solve_poisson", [&] { result.emplace(solvePoisson(initial.image(), divergence.image(), num_iters)); })) {
+        return nullptr;
+    }
+    return wrapImage(std::move(*result));
+}
+
+PyObject* pySetThreadCount(PyObject*, PyObject* args)
+{
+    int threads = 0;
+    if (!PyArg_ParseTuple(args, "i", &threads)) {
+        return nullptr;
+    }
+    setThreadCount(threads);
+    Py_RETURN_NONE;
+}
+
+#define KERNEL_KEYWORDS(fn) reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(fn)), METH_VARARGS | METH_KEYWORDS
+
+PyMethodDef module_methods[] = {
+    { "rgb_to_luminance", pyRgbToLuminance, METH_VARARGS, "rgb_to_luminance(rgb) -> ImageFloat, reads arrays in place" },
+    { "log_image", pyLogImage, METH_VARARGS, "log_image(image) -> ImageFloat, reads arrays in place" },
+    { "bilateral_filter", KERNEL_KEYWORDS(pyBilateralFilter), "bilateral_filter(image, size=27, space_sigma=27/6.4, range_sigma=1, engine='bruteforce') -> ImageFloat" },
+    { "durand_log_luminance", KERNEL_KEYWORDS(pyDurandLogLuminance), "durand_log_luminance(hdr, **params) -> ImageFloat" },
+    { "durand_base_layer", KERNEL_KEYWORDS(pyDurandBaseLayer), "durand_base_layer(hdr, log_lum, **params) -> ImageFloat" },
+    { "durand_compose", KERNEL_KEYWORDS(pyDurandCompose), "durand_compose(hdr, log_lum, base, **params) -> ImageRGB" },
+    { "tone_map", KERNEL_KEYWORDS(pyToneMap), "tone_map(hdr, **params) -> ImageRGB, params as the run settings (filter_size=27, operator='durand', ...)" },
+    { "rescale_rgb_by_luminance", KERNEL_KEYWORDS(pyRescaleRgbByLuminance), "rescale_rgb_by_luminance(rgb, luminance, new_luminance, saturation=0.5) -> ImageRGB" },
+    { "apply_gamma", KERNEL_KEYWORDS(pyApplyGamma), "apply_gamma(rgb, gamma=1/2.2, normalize=False) -> ImageRGB" },
+    { "get_gradients", pyGetGradients, METH_VARARGS, "get_gradients(image) -> (dx, dy)" },
+    { "get_divergence", pyGetDivergence, METH_VARARGS, "get_divergence(dx, dy) -> ImageFloat" },
+    { "solve_poisson", KERNEL_KEYWORDS(pySolvePoisson), "solve_poisson(initial_solution, divergence, num_iters=2000) -> ImageFloat" },
+    { "set_thread_count", pySetThreadCount, METH_VARARGS, "set_thread_count(n): kernel threads of the calling thread, <= 0 for the default" },
+    { nullptr, nullptr, 0, nullptr },
+};
+
+#undef KERNEL_KEYWORDS
+
+PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "a1_hdr",
+    "Images and kernels of the HDR tone mapping pipeline, exchanged with NumPy without copies.",
+    -1,
+    module_methods,
+    nullptr,
+    nullptr,
+    nullptr,
+    nullptr,
+};
+
+#pragma endregion Kernels
+
+} // namespace
+
+PyMODINIT_FUNC PyInit_a1_hdr()
+{
+    if (PyType_Ready(&imageType<float>()) < 0 || PyType_Ready(&imageType<glm::vec3>()) < 0) {
+        return nullptr;
+    }
+    PyObject* module = PyModule_Create(&module_def);
+    if (!module) {
+        return nullptr;
+    }
+    if (PyModule_AddObjectRef(module, "ImageFloat", reinterpret_cast<PyObject*>(&imageType<float>())) < 0
+        || PyModule_AddObjectRef(module, "ImageRGB", reinterpret_cast<PyObject*>(&imageType<glm::vec3>())) < 0) {
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
@@ -0,0 +1,338 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <framework/float_image_io.h>
+#include <framework/image_view.h>
+#include <framework/mapped_image.h>
+
+#include "content_hash.h"
+#include "your_code_here.h"
+
+/*
+ * Content-addressed cache of expensive intermediates.
+ *
+ * A result is keyed by a 64-bit hash of everything it depends on: the name of the operation, the
+ * pixels and sizes of its input images and its parameters. Re-running the pipeline with only a
+ * later parameter changed (e.g. base_scale after the bilateral filter) finds the earlier stages
+ * under the same keys and copies them instead of computing them. Results are held in memory in
+ * least recently used order up to max_memory_bytes; with a cache directory they are also stored
+ * there as .f32 files named by the key (all planes of a result stacked vertically), so they
+ * survive the process and are shared by processes using the same directory. Files are written
+ * to a temporary name and renamed, like mapDecodedImage().
+ *
+ * The hash is not cryptographic, inputs are trusted. Results are returned as copies, a caller may
+ * modify them freely.
+ */
+
+#pragma region Result cache
+
+// Conversion of cached results to and from a list of float planes.
+inline void appendPlanes(std::vector<const ImageFloat*>& planes, const ImageFloat& image) { planes.push_back(&image); }
+inline void appendPlanes(std::vector<const ImageFloat*>& planes, const ImageGradient& gradient)
+{
+    planes.push_back(&gradient.dx);
+    planes.push_back(&gradient.dy);
+}
+template <typename T>
+void appendPlanes(std::vector<const ImageFloat*>& planes, const ImagePlane3<T>& image)
+{
+    appendPlanes(planes, image.X);
+    appendPlanes(planes, image.Y);
+    appendPlanes(planes, image.Z);
+}
+inline void restorePlanes(ImageFloat& image, const std::vector<ImageFloat>& planes, size_t& index) { image = planes[index++]; }
+inline void restorePlanes(ImageGradient& gradient, const std::vector<ImageFloat>& planes, size_t& index)
+{
+    gradient.dx = planes[index++];
+    gradient.dy = planes[index++];
+}
+template <typename T>
+void restorePlanes(ImagePlane3<T>& image, const std::vector<ImageFloat>& planes, size_t& index)
+{
+    restorePlanes(image.X, planes, index);
+    restorePlanes(image.Y, planes, index);
+    restorePlanes(image.Z, planes, index);
+}
+
+/// <summary>
+/// LRU cache of results by content key, with an optional on-disk tier, see above.
+/// Thread-safe; the result of a key may be computed twice when two threads miss at once.
+/// </summary>
+class ResultCache {
+public:
+    struct Stats {
+        size_t memory_hits = 0;
+        size_t disk_hits = 0;
+        size_t misses = 0;
+        // Bytes of results held in memory.
+        size_t memory_bytes = 0;
+    };
+
+    /// <param name="max_memory_bytes">bound of the in-memory tier</param>
+    /// <param name="disk_dir">directory of the on-disk tier, empty for none</param>
+    explicit ResultCache(const size_t max_memory_bytes = size_t(512) << 20, std::filesystem::path disk_dir = {})
+        : m_max_memory_bytes(max_memory_bytes)
+        , m_disk_dir(std::move(disk_dir))
+    {
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    /// <summary>
+    /// The result stored under key, or compute() stored under key.
+    /// </summary>
+    /// <param name="key">ContentHash of the operation, its inputs and parameters</param>
+    /// <param name="compute">() -> T, an image, a gradient or a plane triple of them</param>
+    template <typename T, typename Compute>
+    T getOrCompute(const uint64_t key, Compute&& compute)
+    {
+        if (auto planes = find(key)) {
+            T result;
+            size_t index = 0;
+            restorePlanes(result, *planes, index);
+            return result;
+        }
+        T result = compute();
+        std::vector<const ImageFloat*> planes;
+        appendPlanes(planes, result);
+        store(key, planes);
+        return result;
+    }
+
+    Stats getStats() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_stats;
+    }
+
+    /// <summary>
+    /// Drops the in-memory tier, the files of the on-disk tier are kept.
+    /// </summary>
+    void clear()
+    {
+        std::lock_guard lock(m_mutex);
+        m_entries.clear();
+        m_order.clear();
+        m_stats.memory_bytes = 0;
+    }
+
+private:
+    using Planes = std::vector<ImageFloat>;
+
+    struct Entry {
+        std::shared_ptr<const Planes> planes;
+        size_t bytes = 0;
+        std::list<uint64_t>::iterator order;
+    };
+
+    std::filesystem::path diskPath(const uint64_t key) const
+    {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << key << ".f32";
+        return m_disk_dir / name.str();
+    }
+
+    std::shared_ptr<const Planes> find(const uint64_t key)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            const auto it = m_entries.find(key);
+            if (it != m_entries.end()) {
+                m_order.splice(m_order.begin(), m_order, it->second.order);
+                m_stats.memory_hits++;
+                return it->second.planes;
+            }
+        }
+        if (!m_disk_dir.empty()) {
+            if (auto planes = loadFromDisk(key)) {
+                {
+                    std::lock_guard lock(m_mutex);
+                    m_stats.disk_hits++;
+                }
+                insert(key, planes);
+                return planes;
+            }
+        }
+        std::lock_guard lock(m_mutex);
+        m_stats.misses++;
+        return nullptr;
+    }
+
+    void store(const uint64_t key, const std::vector<const ImageFloat*>& planes)
+    {
+        auto copy = std::make_shared<Planes>();
+        copy->reserve(planes.size());
+        for (const ImageFloat* plane : planes) {
+            copy->push_back(*plane);
+        }
+        if (!m_disk_dir.empty()) {
+            storeOnDisk(key, *copy);
+        }
+        insert(key, std::move(copy));
+    }
+
+    void insert(const uint64_t key, std::shared_ptr<const Planes> planes)
+    {
+        size_t bytes = 0;
+        for (const auto& plane : *planes) {
+            bytes += plane.data.size() * sizeof(float);
+        }
+        std::lock_guard lock(m_mutex);
+        if (bytes > m_max_memory_bytes || m_entries.count(key) != 0) {
+            return;
+        }
+        m_order.push_front(key);
+        m_entries[key] = Entry { std::move(planes), bytes, m_order.begin() };
+        m_stats.memory_bytes += bytes;
+        while (m_stats.memory_bytes > m_max_memory_bytes) {
+            const auto oldest = m_entries.find(m_order.back());
+            m_stats.memory_bytes -= oldest->second.bytes;
+            m_entries.erase(oldest);
+            m_order.pop_back();
+        }
+    }
+
+    // One .f32 file per result: the planes stacked vertically (all planes have one size), the
+    // number of planes in the first reserved word of the header.
+    void storeOnDisk(const uint64_t key, const Planes& planes) const
+    {
+        RawFloatHeader header;
+        header.width = uint32_t(planes.front().width);
+        header.height = uint32_t(planes.front().height) * uint32_t(planes.size());
+        header.channels = 1;
+        header.reserved[0] = uint32_t(planes.size());
+        for (const auto& plane : planes) {
+            if (plane.width != planes.front().width || plane.height != planes.front().height) {
+                return;
+            }
+        }
+
+        const auto cache_path = diskPath(key);
+        // Unique per writer, so concurrent writers do not interleave.
+        const auto writer_id = std::hash<std::thread::id> {}(std::this_thread::get_id()) ^ size_t(std::chrono::steady_clock::now().time_since_epoch().count());
+        const auto temporary_path = m_disk_dir / (cache_path.stem().string() + ".tmp" + std::to_string(writer_id) + ".f32");
+        std::error_code error;
+        std::filesystem::create_directories(m_disk_dir, error);
+        std::FILE* file = std::fopen(temporary_path.string().c_str(), "wb");
+        bool written = file && std::fwrite(&header, sizeof(header), 1, file) == 1;
+        for (const auto& plane : planes) {
+            written = written && std::fwrite(plane.data.data(), sizeof(float), plane.data.size(), file) == plane.data.size();
+        }
+        if (file) {
+            written = std::fclose(file) == 0 && written;
+        }
+        if (!written) {
+            std::cerr << "Failed to write cached result " << temporary_path << std::endl;
+            std::filesystem::remove(temporary_path, error);
+            return;
+        }
+        std::filesystem::rename(temporary_path, cache_path, error);
+    }
+
+    std::shared_ptr<const Planes> loadFromDisk(const uint64_t key) const
+    {
+        const auto cache_path = diskPath(key);
+        if (!std::filesystem::exists(cache_path)) {
+            return nullptr;
+        }
+        try {
+            const MappedFile file(cache_path);
+            RawFloatHeader header;
+            if (file.size() < sizeof(header)) {
+                return nullptr;
+            }
+            std::memcpy(&header, file.data(), sizeof(header));
+            const uint32_t num_planes = header.reserved[0];
+            if (header.magic != RawFloatHeader::MAGIC || header.version != RawFloatHeader::VERSION || header.channels != 1 || num_planes == 0
+                || header.height % num_planes != 0 || file.size() < sizeof(header) + size_t(header.width) * size_t(header.height) * sizeof(float)) {
+                return nullptr;
+            }
+            const int width = int(header.width);
+            const int height = int(header.height / num_planes);
+            const auto pixels = ImageView<const float>(reinterpret_cast<const float*>(file.data() + sizeof(header)), width, height * int(num_planes), width);
+            auto planes = std::make_shared<Planes>();
+            for (int i = 0; i < int(num_planes); i++) {
+                planes->emplace_back(pixels.subview(0, i * height, width, height));
+            }
+            return planes;
+        } catch (const std::exception&) {
+            return nullptr;
+        }
+    }
+
+    size_t m_max_memory_bytes;
+    std::filesystem::path m_disk_dir;
+    mutable std::mutex m_mutex;
+    std::unordered_map<uint64_t, Entry> m_entries;
+    // Keys from the most to the least recently used.
+    std::list<uint64_t> m_order;
+    Stats m_stats;
+};
+
+/// <summary>
+/// bilateralFilter() served from the cache, with hashImage() of H known, e.g. from the
+/// ImageHashAccumulator of the kernel that wrote it. The statistics of the result (output_stats)
+/// come with the filter when it runs and take one pass over the cached result otherwise.
+/// </summary>
+ImageFloat bilateralFilterCached(ResultCache& cache, const ImageFloat& H, const uint64_t H_hash, const int size, const float space_sigma, const float range_sigma,
+    const BilateralEngine engine = BilateralEngine::BruteForce, ImageStatsAccumulator* output_stats = nullptr)
+{
+    const auto key = ContentHash().add(std::string_view("bilateralFilter")).add(H_hash).add(size).add(space_sigma).add(range_sigma).add(engine).value();
+    bool computed = false;
+    auto result = cache.getOrCompute<ImageFloat>(key, [&] {
+        computed = true;
+        return bilateralFilter(H, size, space_sigma, range_sigma, engine, output_stats);
+    });
+    if (output_stats && !computed) {
+        addImageRows<float>(*output_stats, result);
+    }
+    return result;
+}
+
+/// <summary>
+/// bilateralFilter() served from the cache.
+/// </summary>
+ImageFloat bilateralFilterCached(ResultCache& cache, const ImageFloat& H, const int size, const float space_sigma, const float range_sigma,
+    const BilateralEngine engine = BilateralEngine::BruteForce, ImageStatsAccumulator* output_stats = nullptr)
+{
+    return bilateralFilterCached(cache, H, hashImage<float>(H), size, space_sigma, range_sigma, engine, output_stats);
+}
+
+/// <summary>
+/// getGradientsXYZ() served from the cache.
+/// </summary>
+ImageXYZGradient getGradientsXYZCached(ResultCache& cache, const ImageXYZ& image, const ExecutionContext& context = {})
+{
+    const auto key = ContentHash().add(std::string_view("getGradientsXYZ")).add(image).value();
+    return cache.getOrCompute<ImageXYZGradient>(key, [&] { return getGradientsXYZ(image, context); });
+}
+
+/// <summary>
+/// solvePoissonXYZ() served from the cache.
+/// </summary>
+ImageXYZ solvePoissonXYZCached(ResultCache& cache, const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const ExecutionContext& context = {})
+{
+    // The thread split does not change the result, so it is not part of the key.
+    const auto key = ContentHash().add(std::string_view("solvePoissonXYZ")).add(targetXYZ).add(divergenceXYZ_G).add(num_iters).add(method).value();
+    return cache.getOrCompute<ImageXYZ>(key, [&] { return solvePoissonXYZ(targetXYZ, divergenceXYZ_G, num_iters, method, context); });
+}
+
+#pragma endregion Result cache
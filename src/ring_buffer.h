@@ -0,0 +1,463 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include "stage_profiler.h"
+
+/*
+ * Bounded lock-free queues between pipeline stages.
+ *
+ * The streaming modes hand frames or bands of rows from one thread to the next (decode -> tone
+ * map -> encode, compute -> writer). SpscRing is the fast path for one producer and one
+ * consumer: a power-of-two array of slots with a head and a tail index on separate cache lines;
+ * each side caches the other's index and reads it again only when the ring looks full or empty.
+ * MpmcRing admits any number of producers and consumers: every slot carries a sequence number
+ * (Vyukov's bounded queue), and a thread claims a slot by a CAS on the shared index. Values are
+ * moved in and out, so an Image or a band hands over its buffer without a copy.
+ *
+ * A full push or an empty pop waits with the WaitStrategy of the ring: Spin burns a core for the
+ * lowest hand-off latency, Yield gives the core to other threads between polls, and Block parks
+ * the thread on a C++20 atomic wait until the other side moves (the throughput mode, when the
+ * stages are slower than a context switch). close() ends the stream: pushes fail and pops drain
+ * the remaining values and then return nothing. The producers close the ring after their last
+ * push; a consumer that closes it to cancel the stream may drop values pushed concurrently.
+ *
+ * Every ring counts its pushes, pops and the waits of either side, and samples its occupancy on
+ * every push. A stage that often waits on a full ring is faster than its consumer, one that
+ * waits on an empty ring is starved by its producer; a mean occupancy near the capacity marks the
+ * consumer as the bottleneck. While the StageProfiler is enabled, the stats are summed per ring
+ * name in the RingOccupancyReport.
+ */
+
+#pragma region Ring buffers
+
+/// <summary>
+/// How a push into a full or a pop from an empty ring waits, see above.
+/// </summary>
+enum class WaitStrategy {
+    Spin,
+    Yield,
+    Block,
+};
+
+/// <summary>
+/// Traffic and occupancy of one or more rings.
+/// </summary>
+struct RingStats {
+    uint64_t pushes = 0;
+    uint64_t pops = 0;
+    // Pushes that found the ring full and pops that found it empty (and waited).
+    uint64_t full_waits = 0;
+    uint64_t empty_waits = 0;
+    // Sum of the occupancy after every push.
+    uint64_t occupancy_sum = 0;
+    uint64_t capacity = 0;
+
+    // Mean occupancy seen by a push, over the capacity.
+    double meanFill() const { return pushes > 0 && capacity > 0 ? double(occupancy_sum) / double(pushes) / double(capacity) : 0.0; }
+
+    void add(const RingStats& other)
+    {
+        pushes += other.pushes;
+        pops += other.pops;
+        full_waits += other.full_waits;
+        empty_waits += other.empty_waits;
+        occupancy_sum += other.occupancy_sum;
+        capacity = std::max(capacity, other.capacity);
+    }
+};
+
+/// <summary>
+/// Process-wide ring stats per ring name, filled while the StageProfiler is enabled.
+/// </summary>
+class RingOccupancyReport {
+public:
+    static RingOccupancyReport& instance()
+    {
+        static RingOccupancyReport report;
+        return report;
+    }
+
+    void record(const std::string& name, const RingStats& stats)
+    {
+        std::lock_guard lock(m_mutex);
+        m_stats[name].add(stats);
+    }
+
+    /// <summary>
+    /// Table of the rings: values passed, waits of the producers and consumers and the mean fill.
+    /// </summary>
+    void print(std::ostream& out) const
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_stats.empty()) {
+            return;
+        }
+        out << std::left << std::setw(32) << "ring" << std::right << std::setw(10) << "values" << std::setw(12) << "full waits" << std::setw(13) << "empty waits"
+            << std::setw(11) << "mean fill" << std::endl;
+        for (const auto& [name, stats] : m_stats) {
+            out << std::left << std::setw(32) << name << std::right << std::setw(10) << stats.pops << std::setw(12) << stats.full_waits << std::setw(13)
+                << stats.empty_waits << std::fixed << std::setprecision(2) << std::setw(11) << stats.meanFill() << std::defaultfloat << std::endl;
+        }
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, RingStats> m_stats;
+};
+
+/// <summary>
+/// Waiting of the rings: polls with the strategy until ready() holds. For Block, the thread
+/// parks on signal until it differs from the value read before the last test of ready().
+/// </summary>
+template <typename Ready>
+void ringWait(const WaitStrategy strategy, const std::atomic<uint32_t>& signal, const Ready& ready)
+{
+    while (true) {
+        const uint32_t seen = signal.load(std::memory_order_acquire);
+        if (ready()) {
+            return;
+        }
+        switch (strategy) {
+        case WaitStrategy::Spin:
+#if defined(__x86_64__) || defined(_M_X64)
+            _mm_pause();
+#endif
+            break;
+        case WaitStrategy::Yield:
+            std::this_thread::yield();
+            break;
+        case WaitStrategy::Block:
+            signal.wait(seen, std::memory_order_acquire);
+            break;
+        }
+    }
+}
+
+/// <summary>
+/// Counters and wake-up signals shared by the ring types.
+/// </summary>
+class RingBase {
+public:
+    RingBase(const RingBase&) = delete;
+    RingBase& operator=(const RingBase&) = delete;
+
+    size_t capacity() const { return m_mask + 1; }
+
+    /// <summary>
+    /// Ends the stream: later pushes fail, pops return the values left and then nothing.
+    /// </summary>
+    void close()
+    {
+        m_closed.store(true, std::memory_order_release);
+        signal(m_pushed);
+        signal(m_popped);
+    }
+
+    bool closed() const { return m_closed.load(std::memory_order_acquire); }
+
+    RingStats stats() const
+    {
+        RingStats result;
+        result.pushes = m_producer.count.load(std::memory_order_relaxed);
+        result.pops = m_consumer.count.load(std::memory_order_relaxed);
+        result.full_waits = m_producer.waits.load(std::memory_order_relaxed);
+        result.empty_waits = m_consumer.waits.load(std::memory_order_relaxed);
+        result.occupancy_sum = m_producer.occupancy_sum.load(std::memory_order_relaxed);
+        result.capacity = capacity();
+        return result;
+    }
+
+protected:
+    /// <param name="name">name in the RingOccupancyReport</param>
+    /// <param name="capacity">minimum number of values, rounded up to a power of two</param>
+    /// <param name="wait">wait strategy of a full push and an empty pop</param>
+    RingBase(std::string name, const size_t capacity, const WaitStrategy wait)
+        : m_name(std::move(name))
+        , m_mask(std::bit_ceil(std::max<size_t>(capacity, 1)) - 1)
+        , m_wait(wait)
+        , m_profile(StageProfiler::instance().enabled())
+    {
+    }
+
+    ~RingBase()
+    {
+        if (m_profile) {
+            RingOccupancyReport::instance().record(m_name, stats());
+        }
+    }
+
+    // Wakes the threads parked on a signal (Block only).
+    void signal(std::atomic<uint32_t>& value)
+    {
+        if (m_wait == WaitStrategy::Block) {
+            value.fetch_add(1, std::memory_order_release);
+            value.notify_all();
+        }
+    }
+
+    void countPush(const size_t occupancy)
+    {
+        m_producer.count.fetch_add(1, std::memory_order_relaxed);
+        m_producer.occupancy_sum.fetch_add(occupancy, std::memory_order_relaxed);
+    }
+
+    // One cache line per side, so the counters of the producer do not invalidate those of the consumer.
+    struct alignas(64) SideCounters {
+        std::atomic<uint64_t> count { 0 }, waits { 0 }, occupancy_sum { 0 };
+    };
+
+    std::string m_name;
+    size_t m_mask;
+    WaitStrategy m_wait;
+    bool m_profile;
+    std::atomic<bool> m_closed { false };
+    // Bumped after pushes (consumers park on it) and after pops (producers park on it).
+    alignas(64) std::atomic<uint32_t> m_pushed { 0 };
+    alignas(64) std::atomic<uint32_t> m_popped { 0 };
+    SideCounters m_producer, m_consumer;
+};
+
+/// <summary>
+/// Bounded queue for exactly one producer thread and one consumer thread, see above.
+/// </summary>
+template <typename T>
+class SpscRing : public RingBase {
+public:
+    /// <param name="name">name in the RingOccupancyReport</param>
+    /// <param name="capacity">minimum number of values, rounded up to a power of two</param>
+    /// <param name="wait">wait strategy of a full push and an empty pop</param>
+    SpscRing(std::string name, const size_t capacity, const WaitStrategy wait = WaitStrategy::Block)
+        : RingBase(std::move(name), capacity, wait)
+        , m_slots(std::make_unique<std::optional<T>[]>(m_mask + 1))
+    {
+    }
+
+    /// <summary>
+    /// Moves a value in unless the ring is full or closed.
+    /// </summary>
+    /// <returns>whether the value was taken (else it is left unchanged)</returns>
+    bool tryPush(T& value)
+    {
+        if (closed()) {
+            return false;
+        }
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cached_head > m_mask) {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if (tail - m_cached_head > m_mask) {
+                return false;
+            }
+        }
+        m_slots[tail & m_mask].emplace(std::move(value));
+        m_tail.store(tail + 1, std::memory_order_release);
+        countPush(tail + 1 - m_cached_head);
+        signal(m_pushed);
+        return true;
+    }
+
+    /// <summary>
+    /// Moves a value in, waiting while the ring is full.
+    /// </summary>
+    /// <returns>false when the ring was closed (the value is left unchanged)</returns>
+    bool push(T&& value)
+    {
+        if (tryPush(value)) {
+            return true;
+        }
+        m_producer.waits.fetch_add(1, std::memory_order_relaxed);
+        bool taken = false;
+        ringWait(m_wait, m_popped, [&] { return (taken = tryPush(value)) || closed(); });
+        return taken;
+    }
+
+    /// <summary>
+    /// Moves the oldest value out unless the ring is empty.
+    /// </summary>
+    std::optional<T> tryPop()
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cached_tail) {
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cached_tail) {
+                return std::nullopt;
+            }
+        }
+        auto& slot = m_slots[head & m_mask];
+        std::optional<T> value(std::move(slot));
+        slot.reset();
+        m_head.store(head + 1, std::memory_order_release);
+        m_consumer.count.fetch_add(1, std::memory_order_relaxed);
+        signal(m_popped);
+        return value;
+    }
+
+    /// <summary>
+    /// Moves the oldest value out, waiting while the ring is empty.
+    /// </summary>
+    /// <returns>nothing when the ring is closed and drained</returns>
+    std::optional<T> pop()
+    {
+        auto value = tryPop();
+        if (value || closedAndDrained()) {
+            return value;
+        }
+        m_consumer.waits.fetch_add(1, std::memory_order_relaxed);
+        ringWait(m_wait, m_pushed, [&] { return (value = tryPop()).has_value() || closedAndDrained(); });
+        return value;
+    }
+
+private:
+    // A value pushed before close() is visible once closed() is.
+    bool closedAndDrained() const { return closed() && m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_acquire); }
+
+    std::unique_ptr<std::optional<T>[]> m_slots;
+    // Next slot to pop, written by the consumer, and its copy of the tail.
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    size_t m_cached_tail = 0;
+    // Next slot to push, written by the producer, and its copy of the head.
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+    size_t m_cached_head = 0;
+};
+
+/// <summary>
+/// Bounded queue for any number of producer and consumer threads, see above.
+/// </summary>
+template <typename T>
+class MpmcRing : public RingBase {
+public:
+    /// <param name="name">name in the RingOccupancyReport</param>
+    /// <param name="capacity">minimum number of values, rounded up to a power of two</param>
+    /// <param name="wait">wait strategy of a full push and an empty pop</param>
+    MpmcRing(std::string name, const size_t capacity, const WaitStrategy wait = WaitStrategy::Block)
+        : RingBase(std::move(name), capacity, wait)
+        , m_slots(std::make_unique<Slot[]>(m_mask + 1))
+    {
+        for (size_t i = 0; i <= m_mask; i++) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /// <summary>
+    /// Moves a value in unless the ring is full or closed.
+    /// </summary>
+    /// <returns>whether the value was taken (else it is left unchanged)</returns>
+    bool tryPush(T& value)
+    {
+        if (closed()) {
+            return false;
+        }
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = m_slots[tail & m_mask];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lag = intptr_t(sequence) - intptr_t(tail);
+            if (lag == 0) {
+                // The slot is free for this lap: claim it.
+                if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+                    slot.value.emplace(std::move(value));
+                    slot.sequence.store(tail + 1, std::memory_order_release);
+                    countPush(std::min(tail + 1 - m_head.load(std::memory_order_relaxed), capacity()));
+                    signal(m_pushed);
+                    return true;
+                }
+            } else if (lag < 0) {
+                // The slot still holds the value of the previous lap.
+                return false;
+            } else {
+                tail = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Moves a value in, waiting while the ring is full.
+    /// </summary>
+    /// <returns>false when the ring was closed (the value is left unchanged)</returns>
+    bool push(T&& value)
+    {
+        if (tryPush(value)) {
+            return true;
+        }
+        m_producer.waits.fetch_add(1, std::memory_order_relaxed);
+        bool taken = false;
+        ringWait(m_wait, m_popped, [&] { return (taken = tryPush(value)) || closed(); });
+        return taken;
+    }
+
+    /// <summary>
+    /// Moves the oldest value out unless the ring is empty.
+    /// </summary>
+    std::optional<T> tryPop()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = m_slots[head & m_mask];
+            const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lag = intptr_t(sequence) - intptr_t(head + 1);
+            if (lag == 0) {
+                if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+                    std::optional<T> value(std::move(slot.value));
+                    slot.value.reset();
+                    // Free the slot for the push one lap ahead.
+                    slot.sequence.store(head + m_mask + 1, std::memory_order_release);
+                    m_consumer.count.fetch_add(1, std::memory_order_relaxed);
+                    signal(m_popped);
+                    return value;
+                }
+            } else if (lag < 0) {
+                // The slot was not pushed yet (or its push is in progress).
+                return std::nullopt;
+            } else {
+                head = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// <summary>
+    /// Moves the oldest value out, waiting while the ring is empty.
+    /// </summary>
+    /// <returns>nothing when the ring is closed and drained</returns>
+    std::optional<T> pop()
+    {
+        auto value = tryPop();
+        if (value || closedAndDrained()) {
+            return value;
+        }
+        m_consumer.waits.fetch_add(1, std::memory_order_relaxed);
+        ringWait(m_wait, m_pushed, [&] { return (value = tryPop()).has_value() || closedAndDrained(); });
+        return value;
+    }
+
+private:
+    struct alignas(64) Slot {
+        // i for a slot free for push i, i + 1 once push i is complete.
+        std::atomic<size_t> sequence { 0 };
+        std::optional<T> value;
+    };
+
+    // A claimed push that is still in progress keeps the tail ahead of the head.
+    bool closedAndDrained() const { return closed() && m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire); }
+
+    std::unique_ptr<Slot[]> m_slots;
+    alignas(64) std::atomic<size_t> m_head { 0 };
+    alignas(64) std::atomic<size_t> m_tail { 0 };
+};
+
+#pragma endregion Ring buffers
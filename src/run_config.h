@@ -0,0 +1,1028 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "autotune.h"
+#include "clone_sequence.h"
+#include "golden_check.h"
+#include "image_quality.h"
+#include "gpu_compute.h"
+#include "batch_distributed.h"
+#include "composite_blend.h"
+#include "exposure_merge.h"
+#include "kernel_benchmark.h"
+#include "scaling_harness.h"
+#include "tile_pyramid.h"
+#include "mpi_distributed.h"
+#include "padded_tone_map.h"
+#include "poisson_checkpoint.h"
+#include "job_scheduler.h"
+#include "tone_map_sequence.h"
+#include "tone_map_sweep.h"
+#include "your_code_here.h"
+
+/*
+ * Parameters of an a1_hdr run.
+ *
+ * Every tunable of main.cpp is a named setting of a RunConfig: the inputs, the Durand
+ * parameters, the Poisson solver, the GPU backend, threads, profiling, output selection and the
+ * result cache.
+ * Settings come from the command line as "--name value" (or "--name=value", dashes and
+ * underscores are interchangeable) and from flat JSON job files, {"name": value, ...}, loaded
+ * with "--job file.json". Settings apply in argument order, so flags after --job override the
+ * file. A tuning profile of the machine (see autotune.h) sets the thread count and the blocking
+ * of the kernels that are not given explicitly. A quality preset (fast, balanced or reference, see qualityPresetSettings()) fills in the
+ * engine, math and Poisson settings that are not given explicitly, wherever it appears. The modes --serve, --batch <inputs> <output dir>, --sequence <inputs> <output dir>,
+ * --clone_sequence <target frames> <output dir> (with the source and mask settings as files or frames),
+ * --distributed <in.hdr> <out.hdr>, --benchmark, --validate, --compare <reference> <test>, --autotune, --scaling and
+ * --generate <output dir> replace the default run; all but serve use the Durand settings. Any workload setting switches
+ * the benchmarks from the fixed synthetic scene to the generated inputs written by --generate.
+ */
+
+#pragma region Run configuration
+
+/// <summary>
+/// Input files and placement of an additional Poisson layer, see PoissonLayer.
+/// </summary>
+struct LayerInput {
+    std::filesystem::path source, mask;
+    int offset_x = 0, offset_y = 0;
+};
+
+/// <summary>
+/// Settings of one run, see above.
+/// </summary>
+struct RunConfig {
+    // "run", "serve", "batch", "sequence", "sweep", "clone_sequence", "distributed", "benchmark", "validate", "compare", "autotune", "scaling" or "generate".
+    std::string mode = "run";
+    // Input and output of batch, sequence, sweep, clone_sequence and distributed, reference and test of compare, output directory of generate.
+    std::filesystem::path mode_input, mode_output;
+
+    std::filesystem::path hdr_input;
+    // Poisson target, the tone mapped HDR input when empty.
+    std::filesystem::path target_input;
+    std::filesystem::path source_input;
+    std::filesystem::path mask_input;
+    // Further sources composited over source_input in the same solve, in order (one per "layer" setting).
+    std::vector<LayerInput> layers;
+    // LDR exposures merged into the HDR input instead of reading hdr_input (one per "bracket" setting).
+    std::vector<ExposureBracket> brackets;
+    ExposureMergeOptions bracket_merge;
+    std::filesystem::path output_dir;
+    // Output selection, see OutputSet.
+    std::string outputs = "all";
+    // Long edges of reduced-size renditions of the final outputs, see OutputSet::setRenditions().
+    std::vector<int> renditions;
+    // Deep-zoom tile pyramid of the final outputs, see OutputSet::setTilePyramid().
+    TilePyramidParams tile_pyramid;
+    // Directory of the on-disk result cache, none when empty.
+    std::filesystem::path cache_dir;
+    // Bound of the decoded inputs shared by the jobs of a process, see decodedImageCache().
+    size_t decoded_cache_bytes = size_t(512) << 20;
+    // Lanes and memory quotas of the priority classes of the service, see job_scheduler.h.
+    JobSchedulerQuotas serve_quotas;
+    // Shared-memory image the tone-mapped result is exported to for another process, none when empty (see shared_image.h).
+    std::string share_tmo;
+    // Kernel threads, values <= 0 use the default.
+    int threads = 0;
+    ThreadPlacement thread_placement = ThreadPlacement::Default;
+    // XYZ channels processed at once, the threads are split between them (1 = one after another).
+    int plane_threads = 1;
+    // Write single-channel outputs as 1-channel PNGs, see setGrayPngOutput().
+    bool gray_png = false;
+    // Write .png outputs with 16 bits per sample, see setPng16Output().
+    bool png16 = false;
+    // Back the image buffers of a run with 2 MB pages, see HugePageResource.
+    bool huge_pages = false;
+    // Keep idle intermediates losslessly compressed while later stages run, see compressed_image.h.
+    bool compress_idle = false;
+    // Part I streams rows through the Durand chain with ring buffers, see line_buffer.h.
+    bool line_buffer = false;
+    // Pixel storage of Part I from decode to the tone-mapped image: RGB planes (planar_tone_map.h) or
+    // padded pixels (padded_tone_map.h) instead of ImageRGB.
+    RgbLayout rgb_layout = RgbLayout::Interleaved;
+    // Steps 5 to 7 of the Durand layers run in one thread team, see runKernelTeam().
+    bool kernel_team = false;
+    // Part I runs toneMapDurandScheduled() with these schedules, see kernel_schedule.h.
+    bool scheduled = false;
+    ScheduleTable schedules;
+    // Print the predicted buffer lifetimes and peak before running, see memory_plan.h.
+    bool memory_plan = false;
+    // Peak bytes a run may need (0 unlimited): Part I is tone mapped in bands to fit, if possible, or the run is rejected.
+    size_t memory_budget = 0;
+    // Wall time of a run (0 none): the engine and the Poisson solve are chosen to fit, see latency_budget.h.
+    double latency_budget_ms = 0.0;
+    // Benchmark CSV ("--benchmark --bench_csv") calibrating the cost model of the budget, built-in rates when empty.
+    std::filesystem::path latency_profile;
+    // Per-CPU profile of the tuned threads, blocking and engine (see autotune.h), none when empty.
+    // A run measures and adds the profile of its CPU when the file has none, --autotune always.
+    std::filesystem::path tuning_profile;
+    // Side length of the synthetic image the autotuner times the kernels on.
+    int autotune_size = 512;
+    // Stage timings: summary table on stdout, JSON report and Chrome trace files.
+    bool profile = false;
+    std::filesystem::path profile_json;
+    // Print the memory timeline of the stages, see StageProfiler::printMemoryTimeline().
+    bool profile_memory = false;
+    std::filesystem::path trace;
+
+    // Quality preset, see qualityPresetSettings(); reference is the default of every setting.
+    std::string preset = "reference";
+    // Names and values of the settings applied so far, which the preset does not override.
+    std::map<std::string, std::string> explicit_settings;
+
+    DurandParams durand;
+    // Set by space_sigma, otherwise the sigma follows filter_size / 6.4 like main.cpp.
+    bool explicit_space_sigma = false;
+    int poisson_iters = 2000;
+    PoissonMethod poisson_method = PoissonMethod::Jacobi;
+    // Handling of the X and Z channels of the edit, see solvePoissonLuminanceXYZ().
+    PoissonChroma poisson_chroma = PoissonChroma::Full;
+    // Solve the edit on a quadtree refined around the seams of the composite (CPU only), see solvePoissonQuadtreeXYZ().
+    bool poisson_quadtree = false;
+    // Solve the edit by overlapping tiles with a coarse-grid correction (CPU only), see solvePoissonSchwarzXYZ().
+    bool poisson_schwarz = false;
+    // Solve the edit inside the mask by a sparse Cholesky factorization cached per mask (CPU only), see solvePoissonPreparedXYZ().
+    bool poisson_prepared = false;
+    // Temporal options of --sequence.
+    SequenceOptions sequence;
+    // Swept values of --sweep.
+    ToneMapSweep sweep;
+    // Warm starts and convergence of --clone_sequence, max_iters is poisson_iters.
+    CloneSequenceOptions clone_sequence;
+    // Clone with a mean-value membrane instead of solving (fast preview), see MembraneClone.
+    bool membrane_clone = false;
+    // Feathered or multiband blending instead of solving (milliseconds), see composite_blend.h.
+    CompositeMode composite = CompositeMode::Poisson;
+    // Fast composite written as 12_edit_preview before the solve starts, Poisson for none.
+    CompositeMode edit_preview = CompositeMode::Poisson;
+    // Transition width of the feathered blend in pixels.
+    float feather_radius = 16.0f;
+    // Levels of the multiband blend, 0 for PYRAMID_BLEND_LEVELS.
+    int blend_levels = 0;
+    // Checkpoints of the full XYZ solve of the edit and resuming from them, see poisson_checkpoint.h.
+    PoissonCheckpointing poisson_checkpoint;
+    // Edit 8-bit and 16-bit source and target files in their levels, see ldr_native.h.
+    bool ldr_native = false;
+    // Tone map and solve on the GPU backend (gpu_compute.h) where the outputs allow it.
+    bool gpu = false;
+    // Run --batch through the job queue of batch_distributed.h (over the MPI ranks when launched by mpirun).
+    bool batch_distributed = false;
+    // Run --batch as coroutines, decodes and writes on an I/O pool next to the tone mapping.
+    bool batch_coroutines = false;
+    // Input files read ahead of their decodes by --batch, see tone_map_batch.h.
+    int batch_read_ahead = 16;
+    DistributedBatchOptions distributed_batch;
+    KernelBenchmarkOptions benchmark;
+    GoldenCheckOptions validate;
+    QualityThresholds compare;
+    // Synthetic inputs of --generate and of the benchmarks, see synthetic_workload.h.
+    SyntheticWorkload workload;
+    std::vector<int> workload_sizes { 1024 };
+    ScalingHarnessOptions scaling;
+};
+
+/// <summary>
+/// Bilateral engine by name: bruteforce, grid, tiled, rangelut, simd, upsampled, recursive,
+/// permutohedral, adaptive, guided or wls.
+/// </summary>
+BilateralEngine parseBilateralEngine(const std::string& name)
+{
+    if (name == "bruteforce") {
+        return BilateralEngine::BruteForce;
+    } else if (name == "grid") {
+        return BilateralEngine::Grid;
+    } else if (name == "tiled") {
+        return BilateralEngine::Tiled;
+    } else if (name == "rangelut") {
+        return BilateralEngine::RangeLut;
+    } else if (name == "simd") {
+        return BilateralEngine::Simd;
+    } else if (name == "upsampled") {
+        return BilateralEngine::Upsampled;
+    } else if (name == "recursive") {
+        return BilateralEngine::Recursive;
+    } else if (name == "permutohedral") {
+        return BilateralEngine::Permutohedral;
+    } else if (name == "adaptive") {
+        return BilateralEngine::Adaptive;
+    } else if (name == "guided") {
+        return BilateralEngine::Guided;
+    } else if (name == "wls") {
+        return BilateralEngine::Wls;
+    }
+    std::cerr << "Unknown bilateral engine: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Tone mapping operator by name: durand, local_laplacian, reinhard, filmic or fattal.
+/// </summary>
+ToneMapOperator parseToneMapOperator(const std::string& name)
+{
+    if (name == "durand") {
+        return ToneMapOperator::Durand;
+    } else if (name == "local_laplacian") {
+        return ToneMapOperator::LocalLaplacian;
+    } else if (name == "reinhard") {
+        return ToneMapOperator::Reinhard;
+    } else if (name == "filmic") {
+        return ToneMapOperator::Filmic;
+    } else if (name == "fattal") {
+        return ToneMapOperator::Fattal;
+    }
+    std::cerr << "Unknown tone mapping operator: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Tile pyramid layout by name: none, dzi or xyz.
+/// </summary>
+TilePyramidLayout parseTilePyramidLayout(const std::string& name)
+{
+    if (name == "none") {
+        return TilePyramidLayout::None;
+    } else if (name == "dzi") {
+        return TilePyramidLayout::DeepZoom;
+    } else if (name == "xyz") {
+        return TilePyramidLayout::Xyz;
+    }
+    std::cerr << "Unknown tile pyramid layout: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// RGB pixel storage by name: interleaved, planar or padded.
+/// </summary>
+RgbLayout parseRgbLayout(const std::string& name)
+{
+    if (name == "interleaved") {
+        return RgbLayout::Interleaved;
+    } else if (name == "planar") {
+        return RgbLayout::Planar;
+    } else if (name == "padded") {
+        return RgbLayout::Padded;
+    }
+    std::cerr << "Unknown RGB layout: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Thread placement by name: default, close or spread.
+/// </summary>
+ThreadPlacement parseThreadPlacement(const std::string& name)
+{
+    if (name == "default") {
+        return ThreadPlacement::Default;
+    } else if (name == "close") {
+        return ThreadPlacement::Close;
+    } else if (name == "spread") {
+        return ThreadPlacement::Spread;
+    }
+    std::cerr << "Unknown thread placement: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Poisson method by name: jacobi, sor, blocked_jacobi, jacobi_half or sor_half.
+/// </summary>
+PoissonMethod parsePoissonMethod(const std::string& name)
+{
+    if (name == "jacobi") {
+        return PoissonMethod::Jacobi;
+    } else if (name == "sor") {
+        return PoissonMethod::RedBlackSor;
+    } else if (name == "blocked_jacobi") {
+        return PoissonMethod::BlockedJacobi;
+    } else if (name == "jacobi_half") {
+        return PoissonMethod::MixedJacobi;
+    } else if (name == "sor_half") {
+        return PoissonMethod::MixedSor;
+    }
+    std::cerr << "Unknown Poisson method: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Poisson chroma mode by name: full, coarse or transfer.
+/// </summary>
+PoissonChroma parsePoissonChroma(const std::string& name)
+{
+    if (name == "full") {
+        return PoissonChroma::Full;
+    } else if (name == "coarse") {
+        return PoissonChroma::Coarse;
+    } else if (name == "transfer") {
+        return PoissonChroma::Transfer;
+    }
+    std::cerr << "Unknown Poisson chroma mode: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Math precision by name: exact, fast or faster.
+/// </summary>
+MathPrecision parseMathPrecision(const std::string& name)
+{
+    if (name == "exact") {
+        return MathPrecision::Exact;
+    } else if (name == "fast") {
+        return MathPrecision::Fast;
+    } else if (name == "faster") {
+        return MathPrecision::Faster;
+    }
+    std::cerr << "Unknown math precision: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Settings of a quality preset by name, in the order they apply:
+///  - reference: brute-force bilateral, exact math, 2000 Jacobi iterations (the defaults, bitwise
+///    identical to a run without a preset),
+///  - balanced: vectorized bilateral, fast math, 500 red-black SOR iterations,
+///  - fast: bilateral grid, faster math, 200 half-precision SOR iterations.
+/// </summary>
+const std::vector<std::pair<std::string, std::string>>& qualityPresetSettings(const std::string& name)
+{
+    static const std::map<std::string, std::vector<std::pair<std::string, std::string>>> presets {
+        { "reference", { { "engine", "bruteforce" }, { "math_precision", "exact" }, { "poisson_method", "jacobi" }, { "poisson_iters", "2000" } } },
+        { "balanced", { { "engine", "simd" }, { "math_precision", "fast" }, { "poisson_method", "sor" }, { "poisson_iters", "500" } } },
+        { "fast", { { "engine", "grid" }, { "math_precision", "faster" }, { "poisson_method", "sor_half" }, { "poisson_iters", "200" } } },
+    };
+    const auto it = presets.find(name);
+    if (it == presets.end()) {
+        std::cerr << "Unknown quality preset: " << name << std::endl;
+        throw std::exception();
+    }
+    return it->second;
+}
+
+/// <summary>
+/// Value of a setting, throws (after printing the setting) when the text is not a complete T.
+/// </summary>
+template <typename T>
+T parseSettingValue(const std::string& name, const std::string& text)
+{
+    std::istringstream stream(text);
+    T value;
+    if (!(stream >> value) || !(stream >> std::ws).eof()) {
+        std::cerr << "Invalid value of " << name << ": " << text << std::endl;
+        throw std::exception();
+    }
+    return value;
+}
+
+/// <summary>
+/// Items of a comma-separated list setting.
+/// </summary>
+std::vector<std::string> splitSettingList(const std::string& text)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(text);
+    for (std::string item; std::getline(stream, item, ',');) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+/// <summary>
+/// Layer of a "source,mask[,x,y]" setting.
+/// </summary>
+LayerInput parseLayerInput(const std::string& name, const std::string& text)
+{
+    const auto items = splitSettingList(text);
+    if (items.size() != 2 && items.size() != 4) {
+        std::cerr << "Invalid layer in " << name << ": " << text << " (expected source,mask[,x,y])" << std::endl;
+        throw std::exception();
+    }
+    LayerInput layer { items[0], items[1] };
+    if (items.size() == 4) {
+        layer.offset_x = parseSettingValue<int>(name, items[2]);
+        layer.offset_y = parseSettingValue<int>(name, items[3]);
+    }
+    return layer;
+}
+
+/// <summary>
+/// Image sizes of a list setting, "2k" is 2048.
+/// </summary>
+std::vector<int> parseSizeList(const std::string& name, const std::string& text)
+{
+    std::vector<int> sizes;
+    for (auto item : splitSettingList(text)) {
+        const bool kilo = item.back() == 'k' || item.back() == 'K';
+        if (kilo) {
+            item.pop_back();
+        }
+        const int size = parseSettingValue<int>(name, item) * (kilo ? 1024 : 1);
+        if (size < 3) {
+            std::cerr << "Invalid size in " << name << ": " << text << std::endl;
+            throw std::exception();
+        }
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+/// <summary>
+/// Tolerance overrides of a list setting, "prefix=min_psnr[:max_abs]" items.
+/// </summary>
+std::vector<std::pair<std::string, GoldenTolerance>> parseToleranceList(const std::string& name, const std::string& text)
+{
+    std::vector<std::pair<std::string, GoldenTolerance>> tolerances;
+    for (const auto& item : splitSettingList(text)) {
+        const auto equals = item.find('=');
+        if (equals == std::string::npos) {
+            std::cerr << "Invalid value of " << name << ": " << item << std::endl;
+            throw std::exception();
+        }
+        const auto limits = item.substr(equals + 1);
+        const auto colon = limits.find(':');
+        GoldenTolerance tolerance;
+        tolerance.min_psnr = parseSettingValue<double>(name, limits.substr(0, colon));
+        if (colon != std::string::npos) {
+            tolerance.max_abs = parseSettingValue<double>(name, limits.substr(colon + 1));
+        }
+        tolerances.emplace_back(item.substr(0, equals), tolerance);
+    }
+    return tolerances;
+}
+
+/// <summary>
+/// Applies one named setting to a configuration.
+/// </summary>
+/// <param name="config">configuration to update</param>
+/// <param name="name">setting, with dashes or underscores</param>
+/// <param name="value">text of the value</param>
+void applyRunSetting(RunConfig& config, std::string name, const std::string& value)
+{
+    std::replace(name.begin(), name.end(), '-', '_');
+    using Setter = std::function<void(const std::string&)>;
+    const std::map<std::string, Setter> setters {
+        { "preset", [&](const std::string& v) {
+             qualityPresetSettings(v);
+             config.preset = v;
+         } },
+        { "hdr", [&](const std::string& v) { config.hdr_input = v; } },
+        { "target", [&](const std::string& v) { config.target_input = v; } },
+        { "source", [&](const std::string& v) { config.source_input = v; } },
+        { "mask", [&](const std::string& v) { config.mask_input = v; } },
+        { "layer", [&](const std::string& v) { config.layers.push_back(parseLayerInput(name, v)); } },
+        { "bracket", [&](const std::string& v) { config.brackets.push_back(parseExposureBracket(v)); } },
+        { "bracket_gamma", [&](const std::string& v) { config.bracket_merge.response_gamma = parseSettingValue<float>(name, v); } },
+        { "bracket_band_rows", [&](const std::string& v) { config.bracket_merge.band_rows = std::max(parseSettingValue<int>(name, v), 1); } },
+        { "output_dir", [&](const std::string& v) { config.output_dir = v; } },
+        { "share_tmo", [&](const std::string& v) { config.share_tmo = v; } },
+        { "outputs", [&](const std::string& v) { config.outputs = v; } },
+        { "renditions", [&](const std::string& v) { config.renditions = parseSizeList(name, v); } },
+        { "tile_pyramid", [&](const std::string& v) { config.tile_pyramid.layout = parseTilePyramidLayout(v); } },
+        { "tile_size", [&](const std::string& v) { config.tile_pyramid.tile_size = std::max(parseSettingValue<int>(name, v), 1); } },
+        { "tile_format", [&](const std::string& v) { config.tile_pyramid.format = v; } },
+        { "cache_dir", [&](const std::string& v) { config.cache_dir = v; } },
+        { "decoded_cache_mb", [&](const std::string& v) { config.decoded_cache_bytes = size_t(parseSettingValue<int>(name, v)) << 20; } },
+        { "serve_interactive_jobs", [&](const std::string& v) { config.serve_quotas.interactive.max_jobs = std::max(parseSettingValue<int>(name, v), 1); } },
+        { "serve_batch_jobs", [&](const std::string& v) { config.serve_quotas.batch.max_jobs = std::max(parseSettingValue<int>(name, v), 1); } },
+        { "serve_interactive_memory_mb", [&](const std::string& v) { config.serve_quotas.interactive.max_memory_bytes = size_t(parseSettingValue<int>(name, v)) << 20; } },
+        { "serve_batch_memory_mb", [&](const std::string& v) { config.serve_quotas.batch.max_memory_bytes = size_t(parseSettingValue<int>(name, v)) << 20; } },
+        { "threads", [&](const std::string& v) { config.threads = parseSettingValue<int>(name, v); } },
+        { "thread_placement", [&](const std::string& v) { config.thread_placement = parseThreadPlacement(v); } },
+        { "plane_threads", [&](const std::string& v) { config.plane_threads = parseSettingValue<int>(name, v); } },
+        { "gray_png", [&](const std::string& v) { config.gray_png = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "png16", [&](const std::string& v) { config.png16 = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "huge_pages", [&](const std::string& v) { config.huge_pages = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "compress_idle", [&](const std::string& v) { config.compress_idle = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "line_buffer", [&](const std::string& v) { config.line_buffer = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "planar", [&](const std::string& v) {
+             const bool planar = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0);
+             config.rgb_layout = planar ? RgbLayout::Planar : RgbLayout::Interleaved;
+         } },
+        { "rgb_layout", [&](const std::string& v) { config.rgb_layout = parseRgbLayout(v); } },
+        { "kernel_team", [&](const std::string& v) { config.kernel_team = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "schedule_target", [&](const std::string& v) { config.schedules.target = parseScheduleTarget(v); config.scheduled = true; } },
+        { "schedule", [&](const std::string& v) { config.schedules.parse(v); config.scheduled = true; } },
+        { "memory_plan", [&](const std::string& v) { config.memory_plan = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "memory_budget_mb", [&](const std::string& v) { config.memory_budget = size_t(parseSettingValue<int>(name, v)) << 20; } },
+        { "latency_budget_ms", [&](const std::string& v) { config.latency_budget_ms = parseSettingValue<double>(name, v); } },
+        { "latency_profile", [&](const std::string& v) { config.latency_profile = v; } },
+        { "tuning_profile", [&](const std::string& v) { config.tuning_profile = v; } },
+        { "autotune_size", [&](const std::string& v) { config.autotune_size = parseSettingValue<int>(name, v); } },
+        { "profile", [&](const std::string& v) { config.profile = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "profile_json", [&](const std::string& v) { config.profile_json = v; } },
+        { "profile_memory", [&](const std::string& v) { config.profile_memory = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "trace", [&](const std::string& v) { config.trace = v; } },
+        { "filter_size", [&](const std::string& v) { config.durand.filter_size = parseSettingValue<int>(name, v); } },
+        { "space_sigma", [&](const std::string& v) {
+             config.durand.space_sigma = parseSettingValue<float>(name, v);
+             config.explicit_space_sigma = true;
+         } },
+        { "range_sigma", [&](const std::string& v) { config.durand.range_sigma = parseSettingValue<float>(name, v); } },
+        { "base_scale", [&](const std::string& v) { config.durand.base_scale = parseSettingValue<float>(name, v); } },
+        { "output_gain", [&](const std::string& v) { config.durand.output_gain = parseSettingValue<float>(name, v); } },
+        { "auto_contrast", [&](const std::string& v) { config.durand.auto_contrast = parseSettingValue<int>(name, v) != 0; } },
+        { "target_contrast", [&](const std::string& v) { config.durand.target_contrast = parseSettingValue<float>(name, v); } },
+        { "saturation", [&](const std::string& v) { config.durand.saturation = parseSettingValue<float>(name, v); } },
+        { "look_lut", [&](const std::string& v) { config.durand.look = v.empty() ? nullptr : std::make_shared<const ColorLut3D>(ColorLut3D::loadCube(v)); } },
+        { "engine", [&](const std::string& v) { config.durand.engine = parseBilateralEngine(v); } },
+        { "operator", [&](const std::string& v) { config.durand.tone_operator = parseToneMapOperator(v); } },
+        { "key", [&](const std::string& v) { config.durand.key = parseSettingValue<float>(name, v); } },
+        { "white_point", [&](const std::string& v) { config.durand.white_point = parseSettingValue<float>(name, v); } },
+        { "gradient_alpha", [&](const std::string& v) { config.durand.gradient_alpha = parseSettingValue<float>(name, v); } },
+        { "gradient_beta", [&](const std::string& v) { config.durand.gradient_beta = parseSettingValue<float>(name, v); } },
+        { "gradient_solver", [&](const std::string& v) { config.durand.gradient_solver = parseStencilMethod(v); } },
+        { "color_guide", [&](const std::string& v) { config.durand.color_guide = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "math_precision", [&](const std::string& v) { config.durand.math_precision = parseMathPrecision(v); } },
+        { "poisson_iters", [&](const std::string& v) { config.poisson_iters = parseSettingValue<int>(name, v); } },
+        { "poisson_method", [&](const std::string& v) { config.poisson_method = parsePoissonMethod(v); } },
+        { "temporal_frames", [&](const std::string& v) { config.sequence.temporal_frames = parseSettingValue<int>(name, v); } },
+        { "temporal_sigma", [&](const std::string& v) { config.sequence.temporal_sigma = parseSettingValue<float>(name, v); } },
+        { "sweep_base_scale", [&](const std::string& v) { config.sweep.base_scales = parseSweepValues(name, v); } },
+        { "sweep_output_gain", [&](const std::string& v) { config.sweep.output_gains = parseSweepValues(name, v); } },
+        { "sweep_saturation", [&](const std::string& v) { config.sweep.saturations = parseSweepValues(name, v); } },
+        { "sweep_pass_mb", [&](const std::string& v) { config.sweep.pass_bytes = size_t(std::max(parseSettingValue<int>(name, v), 1)) << 20; } },
+        { "clone_tolerance", [&](const std::string& v) { config.clone_sequence.tolerance = parseSettingValue<float>(name, v); } },
+        { "clone_warm_start", [&](const std::string& v) { config.clone_sequence.warm_start = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "poisson_chroma", [&](const std::string& v) { config.poisson_chroma = parsePoissonChroma(v); } },
+        { "poisson_quadtree", [&](const std::string& v) { config.poisson_quadtree = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "poisson_schwarz", [&](const std::string& v) { config.poisson_schwarz = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "poisson_prepared", [&](const std::string& v) { config.poisson_prepared = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "poisson_checkpoint", [&](const std::string& v) { config.poisson_checkpoint.path = v; } },
+        { "poisson_checkpoint_every", [&](const std::string& v) { config.poisson_checkpoint.every = parseSettingValue<int>(name, v); } },
+        { "poisson_resume", [&](const std::string& v) { config.poisson_checkpoint.resume = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "membrane_clone", [&](const std::string& v) { config.membrane_clone = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "composite", [&](const std::string& v) { config.composite = parseCompositeMode(v); } },
+        { "edit_preview", [&](const std::string& v) { config.edit_preview = v == "none" ? CompositeMode::Poisson : parseCompositeMode(v); } },
+        { "feather_radius", [&](const std::string& v) { config.feather_radius = parseSettingValue<float>(name, v); } },
+        { "blend_levels", [&](const std::string& v) { config.blend_levels = parseSettingValue<int>(name, v); } },
+        { "ldr_native", [&](const std::string& v) { config.ldr_native = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "gpu", [&](const std::string& v) { config.gpu = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "batch_distributed", [&](const std::string& v) { config.batch_distributed = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "batch_coroutines", [&](const std::string& v) { config.batch_coroutines = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "batch_read_ahead", [&](const std::string& v) { config.batch_read_ahead = parseSettingValue<int>(name, v); } },
+        { "batch_attempts", [&](const std::string& v) { config.distributed_batch.max_attempts = parseSettingValue<int>(name, v); } },
+        { "batch_cache_mb", [&](const std::string& v) { config.distributed_batch.input_cache_bytes = size_t(parseSettingValue<int>(name, v)) << 20; } },
+        { "batch_log", [&](const std::string& v) { config.distributed_batch.log = v; } },
+        { "bench_sizes", [&](const std::string& v) { config.benchmark.sizes = parseSizeList(name, v); } },
+        { "bench_threads", [&](const std::string& v) {
+             config.benchmark.threads.clear();
+             for (const auto& item : splitSettingList(v)) {
+                 config.benchmark.threads.push_back(parseSettingValue<int>(name, item));
+             }
+         } },
+        { "bench_kernels", [&](const std::string& v) { config.benchmark.kernels = splitSettingList(v); } },
+        { "bench_iters", [&](const std::string& v) { config.benchmark.poisson_iters = parseSettingValue<int>(name, v); } },
+        { "bench_seconds", [&](const std::string& v) { config.benchmark.min_seconds = parseSettingValue<double>(name, v); } },
+        { "bench_repeats", [&](const std::string& v) { config.benchmark.max_repeats = parseSettingValue<int>(name, v); } },
+        { "bench_csv", [&](const std::string& v) { config.benchmark.csv = v; } },
+        { "bench_baseline", [&](const std::string& v) { config.benchmark.baseline = v; } },
+        { "bench_tolerance", [&](const std::string& v) { config.benchmark.tolerance = parseSettingValue<double>(name, v); } },
+        { "bench_noise_sigmas", [&](const std::string& v) { config.benchmark.noise_sigmas = parseSettingValue<double>(name, v); } },
+        { "bench_json", [&](const std::string& v) { config.benchmark.json = v; } },
+        { "bench_io", [&](const std::string& v) { config.benchmark.io = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "bench_io_dir", [&](const std::string& v) { config.benchmark.io_dir = v; } },
+        { "bench_roofline", [&](const std::string& v) { config.benchmark.roofline = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "bench_counters", [&](const std::string& v) { config.benchmark.counters = v == "true" || (v != "false" && parseSettingValue<int>(name, v) != 0); } },
+        { "bench_scaling", [&](const std::string& v) {
+             if (v != "strong" && v != "weak") {
+                 std::cerr << "Invalid bench_scaling: " << v << " (strong or weak)" << std::endl;
+                 throw std::exception();
+             }
+             config.benchmark.weak_scaling = v == "weak";
+             config.scaling.weak_scaling = v == "weak";
+         } },
+        { "scaling_sizes", [&](const std::string& v) { config.scaling.sizes = parseSizeList(name, v); } },
+        { "scaling_threads", [&](const std::string& v) {
+             config.scaling.threads.clear();
+             for (const auto& item : splitSettingList(v)) {
+                 config.scaling.threads.push_back(parseSettingValue<int>(name, item));
+             }
+         } },
+        { "scaling_placements", [&](const std::string& v) {
+             config.scaling.placements.clear();
+             for (const auto& item : splitSettingList(v)) {
+                 config.scaling.placements.push_back(parseThreadPlacement(item));
+             }
+         } },
+        { "scaling_parts", [&](const std::string& v) {
+             const auto items = splitSettingList(v);
+             config.scaling.pipeline = std::find(items.begin(), items.end(), "pipeline") != items.end();
+             config.scaling.kernels = std::find(items.begin(), items.end(), "kernels") != items.end();
+             if (items.size() != size_t(config.scaling.pipeline) + size_t(config.scaling.kernels)) {
+                 std::cerr << "Invalid scaling_parts: " << v << " (pipeline, kernels or both)" << std::endl;
+                 throw std::exception();
+             }
+         } },
+        { "scaling_repeats", [&](const std::string& v) { config.scaling.repeats = parseSettingValue<int>(name, v); } },
+        { "scaling_dir", [&](const std::string& v) { config.scaling.directory = v; } },
+        { "scaling_csv", [&](const std::string& v) { config.scaling.csv = v; } },
+        { "scaling_json", [&](const std::string& v) { config.scaling.json = v; } },
+        { "workload_sizes", [&](const std::string& v) { config.workload_sizes = parseSizeList(name, v); } },
+        { "workload_stops", [&](const std::string& v) { config.workload.dynamic_range_stops = parseSettingValue<float>(name, v); } },
+        { "workload_edges", [&](const std::string& v) { config.workload.edge_density = parseSettingValue<float>(name, v); } },
+        { "workload_mask_area", [&](const std::string& v) { config.workload.mask_area = parseSettingValue<float>(name, v); } },
+        { "workload_mask_complexity", [&](const std::string& v) { config.workload.mask_complexity = parseSettingValue<float>(name, v); } },
+        { "workload_seed", [&](const std::string& v) { config.workload.seed = uint32_t(parseSettingValue<int64_t>(name, v)); } },
+        { "workload_format", [&](const std::string& v) {
+             if (v != "pfm" && v != "exr") {
+                 std::cerr << "Invalid workload_format: " << v << " (pfm or exr)" << std::endl;
+                 throw std::exception();
+             }
+             config.workload.format = v;
+         } },
+        { "validate_inputs", [&](const std::string& v) {
+             const auto items = splitSettingList(v);
+             config.validate.inputs.assign(items.begin(), items.end());
+         } },
+        { "validate_sizes", [&](const std::string& v) { config.validate.synthetic_sizes = parseSizeList(name, v); } },
+        { "validate_iters", [&](const std::string& v) { config.validate.poisson_iters = parseSettingValue<int>(name, v); } },
+        { "validate_tolerances", [&](const std::string& v) { config.validate.tolerances = parseToleranceList(name, v); } },
+        { "compare_min_psnr", [&](const std::string& v) { config.compare.min_psnr = parseSettingValue<double>(name, v); } },
+        { "compare_min_ssim", [&](const std::string& v) { config.compare.min_ssim = parseSettingValue<double>(name, v); } },
+        { "compare_max_delta_e", [&](const std::string& v) { config.compare.max_delta_e = parseSettingValue<double>(name, v); } },
+        { "compare_delta_e", [&](const std::string& v) { config.compare.formula = parseDeltaEFormula(v); } },
+        { "compare_delta_e_threshold", [&](const std::string& v) { config.compare.delta_e_threshold = parseSettingValue<double>(name, v); } },
+    };
+    const auto it = setters.find(name);
+    if (it == setters.end()) {
+        std::cerr << "Unknown setting: " << name << std::endl;
+        throw std::exception();
+    }
+    it->second(value);
+    config.explicit_settings[name] = value;
+}
+
+/// <summary>
+/// Applies the settings of config.preset that were not given explicitly.
+/// </summary>
+void applyQualityPreset(RunConfig& config)
+{
+    for (const auto& [name, value] : qualityPresetSettings(config.preset)) {
+        if (!config.explicit_settings.contains(name)) {
+            applyRunSetting(config, name, value);
+            config.explicit_settings.erase(name);
+        }
+    }
+}
+
+/// <summary>
+/// Applies a tuning profile: its blocking of the kernels, its thread count unless threads was set,
+/// and its engine in place of a tunable engine (see isTunableBilateralEngine()) chosen by the
+/// preset. The reference preset keeps its brute-force filter.
+/// </summary>
+void applyTuningProfile(RunConfig& config, const TuningProfile& profile)
+{
+    currentKernelTuning() = profile.kernels;
+    if (!config.explicit_settings.contains("threads")) {
+        config.threads = profile.threads;
+    }
+    if (!config.explicit_settings.contains("engine") && isTunableBilateralEngine(config.durand.engine)) {
+        config.durand.engine = profile.engine;
+    }
+}
+
+/// <summary>
+/// Preset and effective values of its settings, e.g. "fast (engine grid, math_precision faster,
+/// poisson_method sor, poisson_iters 200)" with poisson_method overridden.
+/// </summary>
+std::string describeQualityPreset(const RunConfig& config)
+{
+    std::string description = config.preset + " (";
+    const auto& settings = qualityPresetSettings(config.preset);
+    for (size_t i = 0; i < settings.size(); i++) {
+        const auto& [name, value] = settings[i];
+        const auto it = config.explicit_settings.find(name);
+        description += (i ? ", " : "") + name + " " + (it != config.explicit_settings.end() ? it->second : value);
+    }
+    return description + ")";
+}
+
+/// <summary>
+/// Reads the (name, value) pairs of a flat JSON object. Values are strings, numbers or booleans;
+/// nested objects and arrays are rejected.
+/// </summary>
+std::vector<std::pair<std::string, std::string>> readJsonSettings(const std::filesystem::path& filePath)
+{
+    std::ifstream file(filePath);
+    if (!file) {
+        std::cerr << "Job file " << filePath << " does not exist!" << std::endl;
+        throw std::exception();
+    }
+    const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t pos = 0;
+    const auto fail = [&](const char* expected) {
+        std::cerr << "Job file " << filePath << ": expected " << expected << " at offset " << pos << std::endl;
+        throw std::exception();
+    };
+    const auto skip_space = [&] {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+    };
+    const auto read_string = [&] {
+        if (pos >= text.size() || text[pos] != '"') {
+            fail("a string");
+        }
+        std::string result;
+        for (pos++; pos < text.size() && text[pos] != '"'; pos++) {
+            if (text[pos] == '\\' && pos + 1 < text.size()) {
+                pos++;
+                const char escaped = text[pos];
+                result += escaped == 'n' ? '\n' : escaped == 't' ? '\t' : escaped;
+            } else {
+                result += text[pos];
+            }
+        }
+        if (pos >= text.size()) {
+            fail("the end of a string");
+        }
+        pos++;
+        return result;
+    };
+
+    std::vector<std::pair<std::string, std::string>> settings;
+    skip_space();
+    if (pos >= text.size() || text[pos++] != '{') {
+        fail("'{'");
+    }
+    skip_space();
+    if (pos < text.size() && text[pos] == '}') {
+        return settings;
+    }
+    while (true) {
+        skip_space();
+        auto name = read_string();
+        skip_space();
+        if (pos >= text.size() || text[pos++] != ':') {
+            fail("':'");
+        }
+        skip_space();
+        std::string value;
+        if (pos < text.size() && text[pos] == '"') {
+            value = read_string();
+        } else {
+            const size_t start = pos;
+            while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && !std::isspace(static_cast<unsigned char>(text[pos]))) {
+                pos++;
+            }
+            value = text.substr(start, pos - start);
+            if (value.empty() || value[0] == '{' || value[0] == '[') {
+                fail("a string, number or boolean");
+            }
+        }
+        settings.emplace_back(std::move(name), std::move(value));
+        skip_space();
+        if (pos < text.size() && text[pos] == ',') {
+            pos++;
+        } else if (pos < text.size() && text[pos] == '}') {
+            return settings;
+        } else {
+            fail("',' or '}'");
+        }
+    }
+}
+
+/// <summary>
+/// Applies the command line to a configuration with the defaults of the run, see above.
+/// </summary>
+void parseRunArguments(RunConfig& config, const int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            std::cerr << "Unexpected argument: " << arg << std::endl;
+            throw std::exception();
+        }
+        arg = arg.substr(2);
+        const auto next_value = [&] {
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value of --" << arg << std::endl;
+                throw std::exception();
+            }
+            return std::string(argv[++i]);
+        };
+
+        if (arg == "serve" || arg == "help" || arg == "benchmark" || arg == "validate" || arg == "autotune" || arg == "scaling") {
+            config.mode = arg;
+        } else if (arg == "batch" || arg == "sequence" || arg == "sweep" || arg == "clone_sequence" || arg == "distributed" || arg == "compare") {
+            config.mode = arg;
+            config.mode_input = next_value();
+            config.mode_output = next_value();
+        } else if (arg == "generate") {
+            config.mode = arg;
+            config.mode_output = next_value();
+        } else if (arg == "job") {
+            for (const auto& [name, value] : readJsonSettings(next_value())) {
+                applyRunSetting(config, name, value);
+            }
+        } else if (const auto equals = arg.find('='); equals != std::string::npos) {
+            applyRunSetting(config, arg.substr(0, equals), arg.substr(equals + 1));
+        } else {
+            applyRunSetting(config, arg, next_value());
+        }
+    }
+    applyQualityPreset(config);
+    if (config.durand.filter_size < 1 || config.durand.filter_size % 2 == 0) {
+        std::cerr << "filter_size must be a positive odd integer." << std::endl;
+        throw std::exception();
+    }
+    if (config.gpu && !gpuComputeAvailable()) {
+        std::cerr << "gpu requires a build with -DA1_HDR_GPU=ON." << std::endl;
+        throw std::exception();
+    }
+    if (config.poisson_prepared && !config.layers.empty()) {
+        std::cerr << "poisson_prepared solves the mask of one source and cannot be combined with layer." << std::endl;
+        throw std::exception();
+    }
+    if (config.mode == "autotune" && config.tuning_profile.empty()) {
+        std::cerr << "autotune requires a tuning_profile file." << std::endl;
+        throw std::exception();
+    }
+    if (config.mode == "distributed" && !mpiAvailable()) {
+        std::cerr << "distributed requires a build with -DA1_HDR_MPI=ON." << std::endl;
+        throw std::exception();
+    }
+    if (config.workload.dynamic_range_stops <= 0.0f || config.workload.edge_density < 0.0f || config.workload.mask_area < 0.0f || config.workload.mask_area > 1.0f) {
+        std::cerr << "workload_stops must be positive, workload_edges non-negative and workload_mask_area in [0, 1]." << std::endl;
+        throw std::exception();
+    }
+    if (std::any_of(config.explicit_settings.begin(), config.explicit_settings.end(), [](const auto& setting) { return setting.first.starts_with("workload_"); })) {
+        config.benchmark.workload = config.workload;
+    }
+    // The headers of the first bracket stand for the merged input in the plans.
+    if (!config.brackets.empty()) {
+        config.hdr_input = config.brackets.front().path;
+    }
+    if (!config.explicit_space_sigma) {
+        config.durand.space_sigma = config.durand.filter_size / 6.4f;
+    }
+}
+
+/// <summary>
+/// Explicit settings of a --scaling run that apply to its pipeline runs, "--name=value": all but
+/// the inputs, outputs, threads and profiling that the harness sets, and the settings of the
+/// harness, the benchmarks and the workload.
+/// </summary>
+std::vector<std::string> pipelineRunArguments(const RunConfig& config)
+{
+    static const std::set<std::string> harness_settings { "hdr", "target", "source", "mask", "layer", "bracket", "output_dir", "outputs", "threads",
+        "thread_placement", "profile", "profile_json", "profile_memory", "trace", "share_tmo" };
+    std::vector<std::string> arguments;
+    for (const auto& [name, value] : config.explicit_settings) {
+        if (!harness_settings.contains(name) && !name.starts_with("scaling_") && !name.starts_with("bench_") && !name.starts_with("workload_")
+            && !name.starts_with("validate_") && !name.starts_with("compare_")) {
+            arguments.push_back("--" + name + "=" + value);
+        }
+    }
+    return arguments;
+}
+
+/// <summary>
+/// Prints the command line syntax and the settings.
+/// </summary>
+void printRunUsage(std::ostream& out)
+{
+    out << "Usage: a1_hdr [--serve | --batch <inputs> <output dir> | --sequence <inputs> <output dir> | --sweep <in.hdr> <output dir> | --clone_sequence <target frames> <output dir> | --distributed <in.hdr> <out.hdr> | --benchmark | --validate | --compare <reference> <test> | --autotune | --scaling | --generate <output dir>] [--job file.json] [--<setting> <value>]...\n"
+           "Settings:\n"
+           "  preset                      fast, balanced or reference (default): engine, math_precision, poisson_method and poisson_iters\n"
+           "                              not set explicitly, see the log line of the run\n"
+           "  hdr, target, source, mask   input images (target defaults to the tone mapped hdr), shm:<name> reads a shared-memory image\n"
+           "  layer                       source,mask[,x,y] composited over the source in the same solve, repeatable\n"
+           "  bracket                     path,seconds of an LDR exposure (e.g. a.jpg,1/30), repeatable: the merged brackets replace hdr\n"
+           "  bracket_gamma               camera response of the brackets as a gamma (0 = sRGB, default)\n"
+           "  bracket_band_rows           scanlines per bracket decoded at once by the streaming merge (-DA1_HDR_LIBJPEG=ON)\n"
+           "  output_dir                  directory of the outputs\n"
+           "  share_tmo                   exports the tone-mapped image as the shared-memory image <name> (--target shm:<name> in another process)\n"
+           "  outputs                     output selection: all, final and stem prefixes, comma-separated\n"
+           "  renditions                  comma-separated long edges of reduced final outputs, e.g. 2k,1024,512,256\n"
+           "  tile_pyramid                none, dzi or xyz: deep-zoom tiles of the final outputs (<name>.dzi or <name>_tiles)\n"
+           "  tile_size                   pixels per side of the pyramid tiles (default 256)\n"
+           "  tile_format                 file format of the pyramid tiles: png (default), jpg or tif\n"
+           "  cache_dir                   directory of the on-disk result cache\n"
+           "  decoded_cache_mb            decoded inputs and masks reused by the jobs of a batch or service process (0 = off)\n"
+           "  serve_interactive_jobs      interactive service jobs (roi, thumbnail, priority=interactive) running at once (default 1)\n"
+           "  serve_batch_jobs            batch service jobs running at once (default 1), preempted by interactive ones\n"
+           "  serve_interactive_memory_mb live image memory above which no further interactive job starts (0 = no limit)\n"
+           "  serve_batch_memory_mb       live image memory above which no further batch job starts (0 = no limit)\n"
+           "  threads                     kernel threads (0 = default)\n"
+           "  thread_placement            default, close or spread: pinning of the kernel threads to CPUs\n"
+           "  plane_threads               XYZ channels processed at once (1-3), threads are split between them\n"
+           "  gray_png                    1 writes single-channel outputs as gray PNGs instead of RGB\n"
+           "  png16                       1 writes 16-bit PNGs (.tif / .tiff outputs are always 16-bit)\n"
+           "  huge_pages                  1 backs image buffers of 2 MB and more with huge pages\n"
+           "  compress_idle               1 keeps the input and its luminance compressed while the base layer is filtered (lossless)\n"
+           "  line_buffer                 1 tone maps with ring buffers of rows, O(width * filter_size) intermediates (brute-force filter)\n"
+           "  planar                      1 tone maps on RGB planes from decode to the XYZ target of the edit (Durand, no color guide)\n"
+           "  rgb_layout                  interleaved, planar or padded: pixel storage of the tone mapping (planar = planar 1, padded = 16-byte RGB + luminance)\n"
+           "  kernel_team                 1 runs the detail, contrast and RGB steps of the Durand layers in one parallel region (same result)\n"
+           "  schedule_target             default, xeon, graviton or laptop: tone maps with the kernel schedules tuned for the target\n"
+           "  schedule                    schedule overrides, e.g. durand:tile=128x32,parallel=tiles,vector=16,compute_at=tile,fuse=1\n"
+           "  memory_plan                 1 prints the predicted buffer lifetimes and peak memory before running\n"
+           "  memory_budget_mb            peak memory of a run; over it Part I is tone mapped in bands or the run is rejected\n"
+           "  latency_budget_ms           wall time of the run: engine and Poisson solve from the cost model, the solve stops at the deadline\n"
+           "  latency_profile             benchmark CSV (--benchmark --bench_csv) calibrating the cost model of latency_budget_ms\n"
+           "  tuning_profile              per-CPU file of tuned threads, tile sizes and engine; measured (and added) when it lacks this CPU,\n"
+           "                              always with --autotune\n"
+           "  autotune_size               side length of the synthetic image timed by the autotuner\n"
+           "  profile, profile_json, trace stage timings: 1 prints a table, JSON report path, Chrome trace path\n"
+           "  profile_memory              1 prints the memory timeline: live image bytes, their peak, allocations and RSS per stage\n"
+           "  filter_size, space_sigma, range_sigma, base_scale, output_gain, saturation\n"
+           "  auto_contrast               1 derives base_scale and output_gain per image from the base layer statistics\n"
+           "  target_contrast             base layer contrast (brightest / darkest) of auto_contrast\n"
+           "  engine                      bruteforce, grid, tiled, rangelut, simd, upsampled,\n"
+           "                              recursive, permutohedral, adaptive, guided or wls\n"
+           "  operator                    durand, local_laplacian (range_sigma, base_scale, output_gain, saturation),\n"
+           "                              reinhard or filmic (key, white_point, saturation),\n"
+           "                              fattal (gradient_alpha, gradient_beta, gradient_solver, output_gain, saturation)\n"
+           "  key, white_point            exposure and Reinhard white of the global operators\n"
+           "  gradient_alpha, gradient_beta  gradients above alpha times the average are scaled by (magnitude / alpha)^(beta - 1)\n"
+           "  gradient_solver             jacobi, sor, cg, multigrid or mgcg: reconstruction of the fattal operator\n"
+           "  color_guide                 1 filters the log-luminance guided by the log RGB (permutohedral)\n"
+           "  math_precision              exact, fast or faster: transcendentals of the per-pixel operators, see fast_math.h\n"
+           "  look_lut                    .cube 3D LUT (e.g. 33^3 or 65^3) grading the tone-mapped result, empty for none\n"
+           "  poisson_iters               Poisson iterations\n"
+           "  poisson_method              jacobi, sor, blocked_jacobi, or jacobi_half / sor_half (half-precision sweeps with fp32 refinement)\n"
+           "  temporal_frames             --sequence: frames of the space-time bilateral grid of the base layer, 1 for none\n"
+           "  temporal_sigma              --sequence: sigma of the space-time grid along time in frames (default 1)\n"
+           "  sweep_base_scale            --sweep: base_scale values, v1,v2,... or from:to:count (default: base_scale)\n"
+           "  sweep_output_gain           --sweep: output_gain values, as sweep_base_scale (default: output_gain)\n"
+           "  sweep_saturation            --sweep: saturation values, as sweep_base_scale (default: saturation)\n"
+           "  sweep_pass_mb               --sweep: images of the variants composed in one pass over the input (default 1024)\n"
+           "  clone_tolerance             --clone_sequence: residual of each frame relative to a cold start (default 1e-3)\n"
+           "  clone_warm_start            --clone_sequence: 0 starts every frame from its cut-and-paste composite\n"
+           "  poisson_chroma              full, coarse (X and Z solved at quarter size) or transfer (composite chromaticity on the solved Y)\n"
+           "  poisson_quadtree            1 solves the edit on a quadtree adapted to the seams (ignores poisson_iters and poisson_method)\n"
+           "  poisson_schwarz             1 solves the edit on overlapping tiles, exchanged until converged (ignores poisson_iters and poisson_method)\n"
+           "  poisson_prepared            1 solves the edit inside the mask exactly, by a sparse Cholesky factorization cached per mask (one source; ignores poisson_iters and poisson_method)\n"
+           "  poisson_checkpoint          .f32 file the Poisson solve of the edit is saved to every poisson_checkpoint_every iterations\n"
+           "                              (default 500) and resumed from when it holds the same problem (poisson_resume 0 starts over)\n"
+           "  membrane_clone              1 clones with mean-value coordinates instead of a Poisson solve (no XYZ outputs)\n"
+           "  composite                   poisson, feather (alpha falling off over feather_radius pixels inside the mask) or pyramid\n"
+           "                              (Laplacian-pyramid blend over blend_levels levels): the fast blends replace the solve (no XYZ outputs)\n"
+           "  edit_preview                none, feather or pyramid: writes that blend as 12_edit_preview before the Poisson solve starts\n"
+           "  feather_radius              transition width of the feathered blend in pixels (default 16, 0 for a hard edge)\n"
+           "  blend_levels                levels of the pyramid blend (default 0 for 6)\n"
+           "  ldr_native                  1 edits LDR source and target files in 8/16-bit levels with integer gradients (full RGB solve, no XYZ outputs)\n"
+           "  gpu                         1 tone maps and solves on the OpenGL compute backend\n"
+           "Batch settings:\n"
+           "  batch_distributed           1 runs --batch through the locality-aware job queue, over the ranks under mpirun\n"
+           "  batch_coroutines            1 runs --batch as coroutines, decodes and writes on their own threads\n"
+           "  batch_read_ahead            input files of --batch read concurrently ahead of their decodes (io_uring on Linux), 0 reads in the decode\n"
+           "  batch_attempts              attempts of a failing job\n"
+           "  batch_cache_mb              decoded inputs kept by each worker\n"
+           "  batch_log                   JSON-lines log of every job attempt\n"
+           "Benchmark settings:\n"
+           "  bench_sizes, bench_threads  comma-separated image sizes (512,2k,4k,8k) and thread counts\n"
+           "  bench_kernels               comma-separated kernel name prefixes (default all)\n"
+           "  bench_iters                 iterations of the iterative Poisson solvers\n"
+           "  bench_io                    1 adds the quantize, encode and decode paths of the file formats, warm and cold (page cache evicted)\n"
+           "  bench_io_dir                directory of the files of bench_io (default a1_hdr_io in the temp directory)\n"
+           "  bench_seconds, bench_repeats minimum time and maximum runs per kernel\n"
+           "  bench_csv, bench_json       CSV and JSON files of the results (with the standard deviation of the runs)\n"
+           "  bench_baseline, bench_tolerance earlier CSV or JSON to compare with, smallest flagged change (0.1 = 10%)\n"
+           "  bench_noise_sigmas          standard deviations of the combined run noise a change must exceed to be flagged (default 3)\n"
+           "  bench_roofline              1 measures the bandwidth and FLOP roofs and places every kernel under them\n"
+           "  bench_counters              1 adds IPC, LLC misses and DRAM bytes per update from the hardware counters (Linux perf_event)\n"
+           "  bench_scaling               strong (default, every size at every thread count) or weak (sizes grow with the thread count), also of --scaling\n"
+           "Scaling settings (--scaling, bench_kernels and bench_iters select and size the kernels):\n"
+           "  scaling_sizes               comma-separated image sizes (at the first thread count for weak scaling)\n"
+           "  scaling_threads             comma-separated thread counts (default 1, 2, 4, ... all)\n"
+           "  scaling_placements          comma-separated thread placements: default, close, spread\n"
+           "  scaling_parts               pipeline, kernels or both (default): runs of the whole program, kernels in isolation\n"
+           "  scaling_repeats             pipeline runs per point, the fastest is kept\n"
+           "  scaling_dir                 directory of the generated inputs and the runs\n"
+           "  scaling_csv, scaling_json   per-stage times, speedup and parallel efficiency as CSV and JSON\n"
+           "Workload settings (--generate, and the benchmark inputs when any is given):\n"
+           "  workload_sizes              comma-separated sizes of the generated inputs (--generate)\n"
+           "  workload_stops              dynamic range of the HDR image in stops\n"
+           "  workload_edges              share of the pixels on sharp region edges (0 = smooth)\n"
+           "  workload_mask_area          share of the image covered by the mask\n"
+           "  workload_mask_complexity    mask boundary from 0 (ellipse) to 1 (ragged)\n"
+           "  workload_seed               seed of the generated content\n"
+           "  workload_format             pfm (default) or exr HDR files (--generate)\n"
+           "Validation settings:\n"
+           "  validate_inputs             comma-separated HDR files (default the hdr of the run, empty for none)\n"
+           "  validate_sizes              comma-separated sizes of synthetic inputs\n"
+           "  validate_iters              iterations of the iterative Poisson solvers\n"
+           "  validate_tolerances         comma-separated prefix=min_psnr[:max_abs] overrides\n"
+           "Comparison settings (--compare of two images, or of the files of two directories):\n"
+           "  compare_min_psnr            minimum PSNR in dB (peak 1)\n"
+           "  compare_min_ssim            minimum SSIM\n"
+           "  compare_max_delta_e         maximum mean delta E\n"
+           "  compare_delta_e             ciede2000 (default) or cie76\n"
+           "  compare_delta_e_threshold   delta E of the reported share of differing pixels (default 1)"
+        << std::endl;
+}
+
+#pragma endregion Run configuration
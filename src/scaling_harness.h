@@ -0,0 +1,287 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "execution.h"
+#include "kernel_benchmark.h"
+#include "synthetic_workload.h"
+
+/*
+ * Strong and weak scaling of the whole run and of its stages.
+ *
+ * "a1_hdr --scaling" measures a matrix of image sizes, thread counts (1, 2, 4, ... up to all
+ * threads by default) and thread placements two ways:
+ *
+ *  - pipeline: the default run of main.cpp (tone mapping and Poisson edit) on a synthetic
+ *    workload (see synthetic_workload.h, the generated HDR image is the hdr and the source, its
+ *    mask the mask), started as a child process per point with --profile_json, so every run
+ *    starts cold like a job of the fleet. The wall time of the process is the "pipeline" row,
+ *    the profiled stages (see stage_profiler.h) the "stage" rows. Settings given to --scaling
+ *    (preset, engine, poisson_method, ...) are passed on to the runs;
+ *  - kernel: every kernel of the benchmarks in isolation, in this process (see
+ *    runKernelBenchmarks()).
+ *
+ * Every time is compared with the first thread count of the same size, placement and name. With
+ * strong scaling (fixed size) the speedup is t_first / t and the parallel efficiency the speedup
+ * over the thread ratio; with weak scaling (the size grows with the thread count, see
+ * scaledBenchmarkSize()) the efficiency is t_first / t and the speedup the scaled speedup, the
+ * efficiency times the thread ratio. The results go to a CSV and a JSON file.
+ *
+ * Pinned threads stay pinned, so the kernels run with the default placement first.
+ */
+
+#pragma region Scaling harness
+
+/// <summary>
+/// Settings of a scaling run, see above.
+/// </summary>
+struct ScalingHarnessOptions {
+    // Side lengths of the square inputs (at the first thread count for weak scaling).
+    std::vector<int> sizes { 1024, 2048 };
+    // Thread counts, 1, 2, 4, ... up to the default count when empty, 0 is the default count.
+    std::vector<int> threads;
+    std::vector<ThreadPlacement> placements { ThreadPlacement::Default };
+    bool weak_scaling = false;
+    // Which of the two measurements run.
+    bool pipeline = true;
+    bool kernels = true;
+    // Pipeline runs per point, the fastest is kept.
+    int repeats = 1;
+    // Generated inputs, outputs and profiles of the runs.
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / "a1_hdr_scaling";
+    // Results, none when empty.
+    std::filesystem::path csv, json;
+};
+
+/// <summary>
+/// Time of a pipeline, stage or kernel at one point of the matrix.
+/// </summary>
+struct ScalingSample {
+    // "pipeline", "stage" or "kernel".
+    std::string scope;
+    std::string name;
+    // Size at the first thread count, and the size measured.
+    int base_size = 0;
+    int size = 0;
+    int threads = 0;
+    ThreadPlacement placement = ThreadPlacement::Default;
+    double ms = 0.0;
+    double speedup = 1.0;
+    double efficiency = 1.0;
+};
+
+inline const char* threadPlacementName(const ThreadPlacement placement)
+{
+    return placement == ThreadPlacement::Close ? "close" : placement == ThreadPlacement::Spread ? "spread" : "default";
+}
+
+/// <summary>
+/// Path of the running executable, for starting the pipeline runs.
+/// </summary>
+inline std::filesystem::path currentExecutablePath(const char* argv0)
+{
+#ifdef __linux__
+    std::error_code error;
+    const auto path = std::filesystem::read_symlink("/proc/self/exe", error);
+    if (!error) {
+        return path;
+    }
+#endif
+    return std::filesystem::absolute(argv0);
+}
+
+/// <summary>
+/// Total time of every stage of a --profile_json report, see StageProfiler::writeJson().
+/// </summary>
+std::vector<std::pair<std::string, double>> readStageProfileJson(const std::filesystem::path& filePath)
+{
+    std::vector<std::pair<std::string, double>> stages;
+    std::ifstream file(filePath);
+    for (std::string line; std::getline(file, line);) {
+        const auto name = line.find("{\"name\": \"");
+        const auto total = line.find("\"total_ms\": ");
+        if (name == std::string::npos || total == std::string::npos) {
+            continue;
+        }
+        const auto name_start = name + 10;
+        stages.emplace_back(line.substr(name_start, line.find('"', name_start) - name_start), std::stod(line.substr(total + 12)));
+    }
+    return stages;
+}
+
+/// <summary>
+/// Runs the scaling matrix, see above.
+/// </summary>
+/// <param name="executable">this program, started for the pipeline runs</param>
+/// <param name="run_arguments">settings passed on to the pipeline runs, "--name=value"</param>
+/// <param name="params">Durand parameters of the kernels</param>
+/// <param name="kernel_options">kernel selection, iterations and timing of the isolated kernels</param>
+/// <param name="workload">synthetic inputs</param>
+/// <param name="options">matrix and outputs</param>
+/// <param name="out">progress and result table</param>
+/// <returns>false when a run failed or a file could not be written</returns>
+bool runScalingHarness(const std::filesystem::path& executable, const std::vector<std::string>& run_arguments, const DurandParams& params,
+    KernelBenchmarkOptions kernel_options, const SyntheticWorkload& workload, ScalingHarnessOptions options, std::ostream& out)
+{
+    if (options.threads.empty()) {
+        for (int threads = 1; threads < defaultThreadCount(); threads *= 2) {
+            options.threads.push_back(threads);
+        }
+        options.threads.push_back(defaultThreadCount());
+    }
+    for (int& threads : options.threads) {
+        threads = threads > 0 ? threads : defaultThreadCount();
+    }
+    std::stable_sort(options.placements.begin(), options.placements.end(), [](const ThreadPlacement a, const ThreadPlacement b) {
+        return a == ThreadPlacement::Default && b != ThreadPlacement::Default;
+    });
+    const auto size_at = [&](const int size, const int threads) { return scaledBenchmarkSize(size, threads, options.threads.front(), options.weak_scaling); };
+    bool passed = true;
+    std::vector<ScalingSample> samples;
+
+    if (options.pipeline) {
+        std::set<int> sizes;
+        for (const int size : options.sizes) {
+            for (const int threads : options.threads) {
+                sizes.insert(size_at(size, threads));
+            }
+        }
+        writeSyntheticWorkloads({ sizes.begin(), sizes.end() }, workload, options.directory, out);
+        const auto profile_path = options.directory / "profile.json";
+        for (const auto placement : options.placements) {
+            for (const int base_size : options.sizes) {
+                for (const int threads : options.threads) {
+                    const int size = size_at(base_size, threads);
+                    const auto name = "synthetic_" + std::to_string(size);
+                    const auto hdr = options.directory / (name + "." + workload.format);
+                    std::string command = "\"" + executable.string() + "\" --hdr \"" + hdr.string() + "\" --source \"" + hdr.string() + "\" --mask \""
+                        + (options.directory / (name + "_mask.png")).string() + "\" --output_dir \"" + (options.directory / "out").string()
+                        + "\" --outputs final --threads " + std::to_string(threads) + " --thread_placement " + threadPlacementName(placement) + " --profile_json \""
+                        + profile_path.string() + "\"";
+                    for (const auto& argument : run_arguments) {
+                        command += " \"" + argument + "\"";
+                    }
+#ifndef _WIN32
+                    command += " > /dev/null";
+#endif
+                    double best_ms = 0.0;
+                    std::vector<std::pair<std::string, double>> best_stages;
+                    for (int repeat = 0; repeat < std::max(options.repeats, 1); repeat++) {
+                        std::filesystem::remove(profile_path);
+                        const auto start = std::chrono::steady_clock::now();
+                        const int status = std::system(command.c_str());
+                        const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                        if (status != 0) {
+                            std::cerr << "Pipeline run failed (" << status << "): " << command << std::endl;
+                            return false;
+                        }
+                        if (best_ms == 0.0 || ms < best_ms) {
+                            best_ms = ms;
+                            best_stages = readStageProfileJson(profile_path);
+                        }
+                    }
+                    samples.push_back({ "pipeline", "pipeline", base_size, size, threads, placement, best_ms });
+                    for (const auto& [stage, ms] : best_stages) {
+                        samples.push_back({ "stage", stage, base_size, size, threads, placement, ms });
+                    }
+                    out << "Pipeline " << size << "x" << size << " with " << threads << " threads (" << threadPlacementName(placement) << "): " << std::fixed
+                        << std::setprecision(1) << best_ms << " ms" << std::defaultfloat << std::endl;
+                }
+            }
+        }
+    }
+
+    if (options.kernels) {
+        kernel_options.sizes = options.sizes;
+        kernel_options.threads = options.threads;
+        kernel_options.weak_scaling = options.weak_scaling;
+        kernel_options.csv.clear();
+        kernel_options.json.clear();
+        kernel_options.baseline.clear();
+        kernel_options.workload = workload;
+        const auto initial_placement = currentThreadPlacement();
+        for (const auto placement : options.placements) {
+            setThreadPlacement(placement);
+            out << "Kernels with placement " << threadPlacementName(placement) << ":" << std::endl;
+            std::vector<KernelBenchmarkResult> results;
+            runKernelBenchmarks(params, kernel_options, out, &results);
+            // The results are in input order, one size after the other.
+            for (const auto& result : results) {
+                const auto base = std::find_if(options.sizes.begin(), options.sizes.end(), [&](const int size) { return size_at(size, result.threads) == result.size; });
+                samples.push_back({ "kernel", result.kernel, base != options.sizes.end() ? *base : result.size, result.size, result.threads, placement, result.median_ms });
+            }
+        }
+        setThreadPlacement(initial_placement);
+    }
+
+    // Speedup and efficiency against the first thread count of the same series.
+    std::map<std::string, const ScalingSample*> first;
+    const auto series = [](const ScalingSample& sample) {
+        return sample.scope + " " + sample.name + " " + std::to_string(sample.base_size) + " " + threadPlacementName(sample.placement);
+    };
+    for (const auto& sample : samples) {
+        if (sample.threads == options.threads.front()) {
+            first.try_emplace(series(sample), &sample);
+        }
+    }
+    for (auto& sample : samples) {
+        const auto reference = first.find(series(sample));
+        if (reference == first.end() || sample.ms <= 0.0) {
+            continue;
+        }
+        const double thread_ratio = double(sample.threads) / double(reference->second->threads);
+        const double time_ratio = reference->second->ms / sample.ms;
+        sample.speedup = options.weak_scaling ? time_ratio * thread_ratio : time_ratio;
+        sample.efficiency = options.weak_scaling ? time_ratio : time_ratio / thread_ratio;
+    }
+
+    out << (options.weak_scaling ? "Weak" : "Strong") << " scaling:" << std::endl;
+    out << std::left << std::setw(10) << "scope" << std::setw(40) << "name" << std::right << std::setw(7) << "size" << std::setw(8) << "threads" << std::setw(10)
+        << "placement" << std::setw(12) << "ms" << std::setw(9) << "speedup" << std::setw(8) << "eff %" << std::endl;
+    for (const auto& sample : samples) {
+        out << std::left << std::setw(10) << sample.scope << std::setw(40) << sample.name << std::right << std::setw(7) << sample.size << std::setw(8) << sample.threads
+            << std::setw(10) << threadPlacementName(sample.placement) << std::fixed << std::setprecision(2) << std::setw(12) << sample.ms << std::setw(9) << sample.speedup
+            << std::setprecision(1) << std::setw(8) << 100.0 * sample.efficiency << std::defaultfloat << std::endl;
+    }
+
+    if (!options.csv.empty()) {
+        std::ofstream csv(options.csv);
+        csv << "scope,name,base_size,size,threads,placement,ms,speedup,efficiency\n";
+        for (const auto& sample : samples) {
+            csv << sample.scope << "," << sample.name << "," << sample.base_size << "," << sample.size << "," << sample.threads << "," << threadPlacementName(sample.placement)
+                << "," << sample.ms << "," << sample.speedup << "," << sample.efficiency << "\n";
+        }
+        if (!csv) {
+            std::cerr << "Failed to write " << options.csv << std::endl;
+            passed = false;
+        }
+    }
+    if (!options.json.empty()) {
+        std::ofstream json(options.json);
+        json << "{\n  \"scaling\": \"" << (options.weak_scaling ? "weak" : "strong") << "\",\n  \"samples\": [";
+        for (size_t i = 0; i < samples.size(); i++) {
+            const auto& sample = samples[i];
+            json << (i ? ",\n" : "\n") << "    {\"scope\": \"" << sample.scope << "\", \"name\": \"" << sample.name << "\", \"base_size\": " << sample.base_size
+                 << ", \"size\": " << sample.size << ", \"threads\": " << sample.threads << ", \"placement\": \"" << threadPlacementName(sample.placement)
+                 << "\", \"ms\": " << sample.ms << ", \"speedup\": " << sample.speedup << ", \"efficiency\": " << sample.efficiency << "}";
+        }
+        json << "\n  ]\n}\n";
+        if (!json) {
+            std::cerr << "Failed to write " << options.json << std::endl;
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+#pragma endregion Scaling harness
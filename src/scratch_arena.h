@@ -0,0 +1,177 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include <framework/image_allocator.h>
+
+/*
+ * Per-thread scratch memory of the kernels.
+ *
+ * Tiled kernels need short-lived buffers per tile or per parallel region: the halo of a bilateral
+ * tile, a line of the bilateral grid, the packed planes of a batched Poisson problem, the row
+ * rings of the line-buffered executor. Allocated with std::vector every time, they send each
+ * thread through the global allocator once per tile, and at high thread counts the allocator's
+ * locks and the page faults of fresh blocks become the hot spot.
+ *
+ * Every thread owns a ScratchArena (threadScratchArena()): a list of chunks, bump-allocated and
+ * rewound as a whole. A ScratchScope marks the arena on construction and rewinds it on
+ * destruction, so a kernel opens one per tile (or per stage) and takes its buffers from it:
+ *
+ *     scheduler.run([&](const int tile) {
+ *         ScratchScope scratch;
+ *         const auto halo = scratch.take<float>(halo_pixels);
+ *         ...
+ *     });
+ *
+ * Chunks are never returned while the thread lives, so after the first tiles a kernel does not
+ * allocate at all. Chunks and buffers are aligned to cache lines (IMAGE_ALIGNMENT) and chunks are
+ * only written by their thread, so no two threads share a line, and the pages are first touched by
+ * the thread that uses them (its NUMA node). Buffers are uninitialized and must be trivially
+ * destructible; scopes nest and must be closed in reverse order, on the thread that opened them.
+ */
+
+#pragma region Scratch arena
+
+/// <summary>
+/// Smallest chunk of a ScratchArena in bytes.
+/// </summary>
+constexpr size_t SCRATCH_CHUNK_BYTES = size_t(1) << 20;
+
+/// <summary>
+/// Bump allocator of one thread, see above.
+/// </summary>
+class alignas(IMAGE_ALIGNMENT) ScratchArena {
+public:
+    /// <summary>
+    /// Position of the arena, see rewind().
+    /// </summary>
+    struct Mark {
+        size_t chunk = 0;
+        size_t offset = 0;
+    };
+
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena&) = delete;
+    ScratchArena& operator=(const ScratchArena&) = delete;
+
+    ~ScratchArena()
+    {
+        for (const auto& chunk : m_chunks) {
+            ::operator delete(chunk.data, std::align_val_t(IMAGE_ALIGNMENT));
+        }
+    }
+
+    /// <summary>
+    /// Uninitialized bytes aligned to alignment (at most IMAGE_ALIGNMENT), valid until the arena
+    /// is rewound past them.
+    /// </summary>
+    void* allocate(const size_t bytes, const size_t alignment = IMAGE_ALIGNMENT)
+    {
+        if (!m_chunks.empty()) {
+            const size_t offset = (m_offset + alignment - 1) / alignment * alignment;
+            if (offset + bytes <= m_chunks[m_chunk].size) {
+                m_offset = offset + bytes;
+                return m_chunks[m_chunk].data + offset;
+            }
+        }
+        // The next chunk that is large enough, the ones skipped stay empty until the next rewind.
+        size_t next = m_chunks.empty() ? 0 : m_chunk + 1;
+        while (next < m_chunks.size() && m_chunks[next].size < bytes) {
+            next++;
+        }
+        if (next == m_chunks.size()) {
+            const size_t last = m_chunks.empty() ? 0 : m_chunks.back().size;
+            const size_t size = (std::max({ bytes, 2 * last, SCRATCH_CHUNK_BYTES }) + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+            m_chunks.push_back({ static_cast<std::byte*>(::operator new(size, std::align_val_t(IMAGE_ALIGNMENT))), size });
+            m_capacity += size;
+        }
+        m_chunk = next;
+        m_offset = bytes;
+        return m_chunks[m_chunk].data;
+    }
+
+    /// <summary>
+    /// Uninitialized array of count values, aligned to a cache line.
+    /// </summary>
+    template <typename T>
+    std::span<T> take(const size_t count)
+    {
+        static_assert(std::is_trivially_destructible_v<T> && alignof(T) <= IMAGE_ALIGNMENT, "Scratch buffers are never destroyed");
+        T* values = static_cast<T*>(allocate(count * sizeof(T)));
+        std::uninitialized_default_construct_n(values, count);
+        return { values, count };
+    }
+
+    Mark mark() const { return { m_chunk, m_offset }; }
+
+    /// <summary>
+    /// Frees everything allocated after the mark, for reuse.
+    /// </summary>
+    void rewind(const Mark& mark)
+    {
+        m_chunk = mark.chunk;
+        m_offset = mark.offset;
+    }
+
+    /// <summary>
+    /// Bytes of all chunks.
+    /// </summary>
+    size_t capacity() const { return m_capacity; }
+
+private:
+    struct Chunk {
+        std::byte* data;
+        size_t size;
+    };
+
+    std::vector<Chunk> m_chunks;
+    // Chunk allocated from and the bytes of it in use.
+    size_t m_chunk = 0;
+    size_t m_offset = 0;
+    size_t m_capacity = 0;
+};
+
+/// <summary>
+/// Scratch arena of the calling thread.
+/// </summary>
+inline ScratchArena& threadScratchArena()
+{
+    thread_local ScratchArena arena;
+    return arena;
+}
+
+/// <summary>
+/// Buffers of the calling thread's arena that are freed together when the scope ends.
+/// </summary>
+class ScratchScope {
+public:
+    ScratchScope()
+        : m_arena(threadScratchArena())
+        , m_mark(m_arena.mark())
+    {
+    }
+    ~ScratchScope() { m_arena.rewind(m_mark); }
+
+    ScratchScope(const ScratchScope&) = delete;
+    ScratchScope& operator=(const ScratchScope&) = delete;
+
+    /// <summary>
+    /// Uninitialized array of count values, see ScratchArena::take().
+    /// </summary>
+    template <typename T>
+    std::span<T> take(const size_t count)
+    {
+        return m_arena.take<T>(count);
+    }
+
+private:
+    ScratchArena& m_arena;
+    ScratchArena::Mark m_mark;
+};
+
+#pragma endregion Scratch arena
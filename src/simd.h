@@ -0,0 +1,319 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "fast_math.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define HDR_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define HDR_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+/*
+ * Portable SIMD layer of the vector kernels.
+ *
+ * Every instruction set has a namespace of thin wrappers with the same names: simd_scalar (one
+ * lane, plain floats), simd_avx2 and simd_avx512 on x86 and simd_neon on ARM. Each provides
+ *
+ *   VecF, VecI, LANES                      float and int32 vectors and their width
+ *   zero, set1, loadu, storeu              loads and stores of whole vectors
+ *   loadPartial, storePartial              the first count lanes only (masked), for row ends
+ *   gather                                 base[index] for every lane
+ *   add, sub, mul, div, min, max           lane-wise float arithmetic
+ *   fmadd, fnmadd                          a * b + c and c - a * b, fused where the ISA fuses
+ *   roundNearest, roundToInt               rounding to the nearest integer (ties to even)
+ *   set1i, addi, subi, andi, slli, srai    int32 arithmetic
+ *   castToInt, castToFloat, convertToFloat bit casts and the int32 to float conversion
+ *
+ * and, written once against them (simd_math.inl), expNonPositive() and the Fast / Faster tiers of
+ * fast_math.h as fastLog2, fastExp2, fastLog, fastExp and fastPow. These use the same operations
+ * in the same order as the scalar functions; a vector result differs from the scalar one only where
+ * the compiler fuses a multiply and an add for an FMA target (about an ulp).
+ *
+ * A kernel is written once in a .inl file against these names and compiled per instruction set
+ * by simd_instantiate.inl, into namespaces with the target of the instruction set (see
+ * bilateral_simd.h). The caller picks the namespace of detectSimdIsa() at run time.
+ */
+
+#pragma region SIMD layer
+
+/// <summary>
+/// Vector instruction sets of the kernels.
+/// </summary>
+enum class SimdIsa {
+    Scalar,
+    Neon,
+    Avx2,
+    Avx512,
+};
+
+/// <summary>
+/// Detects the widest supported instruction set of the running CPU (cached after the first call).
+/// </summary>
+inline SimdIsa detectSimdIsa()
+{
+    static const SimdIsa isa = []() {
+#if defined(HDR_SIMD_NEON)
+        return SimdIsa::Neon;
+#elif defined(HDR_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return SimdIsa::Avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return SimdIsa::Avx2;
+        }
+        return SimdIsa::Scalar;
+#elif defined(HDR_SIMD_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return SimdIsa::Scalar;
+        }
+        __cpuidex(info, 1, 0);
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool fma = (info[2] & (1 << 12)) != 0;
+        if (!osxsave) {
+            return SimdIsa::Scalar;
+        }
+        // The OS must save the YMM (and for AVX-512 the ZMM/opmask) state.
+        const auto xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        const bool avx2 = (info[1] & (1 << 5)) != 0;
+        const bool avx512f = (info[1] & (1 << 16)) != 0;
+        if (avx512f && (xcr0 & 0xe6) == 0xe6) {
+            return SimdIsa::Avx512;
+        }
+        if (avx2 && fma && (xcr0 & 0x6) == 0x6) {
+            return SimdIsa::Avx2;
+        }
+        return SimdIsa::Scalar;
+#else
+        return SimdIsa::Scalar;
+#endif
+    }();
+    return isa;
+}
+
+// Cephes expf constants of expNonPositive().
+constexpr float SIMD_EXP_MIN_ARG = -87.0f;
+constexpr float SIMD_LOG2E = 1.44269504088896341f;
+constexpr float SIMD_LN2_HI = 0.693359375f;
+constexpr float SIMD_LN2_LO = -2.12194440e-4f;
+constexpr float SIMD_EXP_P0 = 1.9875691500e-4f;
+constexpr float SIMD_EXP_P1 = 1.3981999507e-3f;
+constexpr float SIMD_EXP_P2 = 8.3334519073e-3f;
+constexpr float SIMD_EXP_P3 = 4.1665795894e-2f;
+constexpr float SIMD_EXP_P4 = 1.6666665459e-1f;
+constexpr float SIMD_EXP_P5 = 5.0000001201e-1f;
+
+namespace simd_scalar {
+using VecF = float;
+using VecI = int32_t;
+constexpr int LANES = 1;
+inline VecF zero() { return 0.0f; }
+inline VecF set1(const float v) { return v; }
+inline VecF loadu(const float* p) { return *p; }
+inline void storeu(float* p, const VecF v) { *p = v; }
+inline VecF loadPartial(const float* p, const int count) { return count > 0 ? *p : 0.0f; }
+inline void storePartial(float* p, const VecF v, const int count)
+{
+    if (count > 0) {
+        *p = v;
+    }
+}
+inline VecF gather(const float* base, const VecI index) { return base[index]; }
+inline VecF add(const VecF a, const VecF b) { return a + b; }
+inline VecF sub(const VecF a, const VecF b) { return a - b; }
+inline VecF mul(const VecF a, const VecF b) { return a * b; }
+inline VecF div(const VecF a, const VecF b) { return a / b; }
+inline VecF min(const VecF a, const VecF b) { return std::min(a, b); }
+inline VecF max(const VecF a, const VecF b) { return std::max(a, b); }
+inline VecF fmadd(const VecF a, const VecF b, const VecF c) { return a * b + c; }
+inline VecF fnmadd(const VecF a, const VecF b, const VecF c) { return c - a * b; }
+inline VecF roundNearest(const VecF x) { return std::nearbyint(x); }
+inline VecI roundToInt(const VecF x) { return VecI(std::nearbyint(x)); }
+inline VecI set1i(const int32_t v) { return v; }
+inline VecI addi(const VecI a, const VecI b) { return a + b; }
+inline VecI subi(const VecI a, const VecI b) { return a - b; }
+inline VecI andi(const VecI a, const VecI b) { return a & b; }
+template <int N>
+inline VecI slli(const VecI a) { return VecI(uint32_t(a) << N); }
+template <int N>
+inline VecI srai(const VecI a) { return a >> N; }
+inline VecI castToInt(const VecF x)
+{
+    VecI bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+inline VecF castToFloat(const VecI bits)
+{
+    VecF x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+inline VecF convertToFloat(const VecI a) { return VecF(a); }
+#include "simd_math.inl"
+}
+
+#if defined(HDR_SIMD_X86)
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace simd_avx2 {
+using VecF = __m256;
+using VecI = __m256i;
+constexpr int LANES = 8;
+inline VecF zero() { return _mm256_setzero_ps(); }
+inline VecF set1(const float v) { return _mm256_set1_ps(v); }
+inline VecF loadu(const float* p) { return _mm256_loadu_ps(p); }
+inline void storeu(float* p, const VecF v) { _mm256_storeu_ps(p, v); }
+inline __m256i laneMask(const int count) { return _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)); }
+inline VecF loadPartial(const float* p, const int count) { return _mm256_maskload_ps(p, laneMask(count)); }
+inline void storePartial(float* p, const VecF v, const int count) { _mm256_maskstore_ps(p, laneMask(count), v); }
+inline VecF gather(const float* base, const VecI index) { return _mm256_i32gather_ps(base, index, 4); }
+inline VecF add(const VecF a, const VecF b) { return _mm256_add_ps(a, b); }
+inline VecF sub(const VecF a, const VecF b) { return _mm256_sub_ps(a, b); }
+inline VecF mul(const VecF a, const VecF b) { return _mm256_mul_ps(a, b); }
+inline VecF div(const VecF a, const VecF b) { return _mm256_div_ps(a, b); }
+inline VecF min(const VecF a, const VecF b) { return _mm256_min_ps(a, b); }
+inline VecF max(const VecF a, const VecF b) { return _mm256_max_ps(a, b); }
+inline VecF fmadd(const VecF a, const VecF b, const VecF c) { return _mm256_fmadd_ps(a, b, c); }
+inline VecF fnmadd(const VecF a, const VecF b, const VecF c) { return _mm256_fnmadd_ps(a, b, c); }
+inline VecF roundNearest(const VecF x) { return _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+inline VecI roundToInt(const VecF x) { return _mm256_cvtps_epi32(x); }
+inline VecI set1i(const int32_t v) { return _mm256_set1_epi32(v); }
+inline VecI addi(const VecI a, const VecI b) { return _mm256_add_epi32(a, b); }
+inline VecI subi(const VecI a, const VecI b) { return _mm256_sub_epi32(a, b); }
+inline VecI andi(const VecI a, const VecI b) { return _mm256_and_si256(a, b); }
+template <int N>
+inline VecI slli(const VecI a) { return _mm256_slli_epi32(a, N); }
+template <int N>
+inline VecI srai(const VecI a) { return _mm256_srai_epi32(a, N); }
+inline VecI castToInt(const VecF x) { return _mm256_castps_si256(x); }
+inline VecF castToFloat(const VecI bits) { return _mm256_castsi256_ps(bits); }
+inline VecF convertToFloat(const VecI a) { return _mm256_cvtepi32_ps(a); }
+#include "simd_math.inl"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace simd_avx512 {
+using VecF = __m512;
+using VecI = __m512i;
+constexpr int LANES = 16;
+inline VecF zero() { return _mm512_setzero_ps(); }
+inline VecF set1(const float v) { return _mm512_set1_ps(v); }
+inline VecF loadu(const float* p) { return _mm512_loadu_ps(p); }
+inline void storeu(float* p, const VecF v) { _mm512_storeu_ps(p, v); }
+inline __mmask16 laneMask(const int count) { return __mmask16((1u << count) - 1u); }
+inline VecF loadPartial(const float* p, const int count) { return _mm512_maskz_loadu_ps(laneMask(count), p); }
+inline void storePartial(float* p, const VecF v, const int count) { _mm512_mask_storeu_ps(p, laneMask(count), v); }
+inline VecF gather(const float* base, const VecI index) { return _mm512_i32gather_ps(index, base, 4); }
+inline VecF add(const VecF a, const VecF b) { return _mm512_add_ps(a, b); }
+inline VecF sub(const VecF a, const VecF b) { return _mm512_sub_ps(a, b); }
+inline VecF mul(const VecF a, const VecF b) { return _mm512_mul_ps(a, b); }
+inline VecF div(const VecF a, const VecF b) { return _mm512_div_ps(a, b); }
+inline VecF min(const VecF a, const VecF b) { return _mm512_min_ps(a, b); }
+inline VecF max(const VecF a, const VecF b) { return _mm512_max_ps(a, b); }
+inline VecF fmadd(const VecF a, const VecF b, const VecF c) { return _mm512_fmadd_ps(a, b, c); }
+inline VecF fnmadd(const VecF a, const VecF b, const VecF c) { return _mm512_fnmadd_ps(a, b, c); }
+inline VecF roundNearest(const VecF x) { return _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+inline VecI roundToInt(const VecF x) { return _mm512_cvtps_epi32(x); }
+inline VecI set1i(const int32_t v) { return _mm512_set1_epi32(v); }
+inline VecI addi(const VecI a, const VecI b) { return _mm512_add_epi32(a, b); }
+inline VecI subi(const VecI a, const VecI b) { return _mm512_sub_epi32(a, b); }
+inline VecI andi(const VecI a, const VecI b) { return _mm512_and_si512(a, b); }
+template <int N>
+inline VecI slli(const VecI a) { return _mm512_slli_epi32(a, N); }
+template <int N>
+inline VecI srai(const VecI a) { return _mm512_srai_epi32(a, N); }
+inline VecI castToInt(const VecF x) { return _mm512_castps_si512(x); }
+inline VecF castToFloat(const VecI bits) { return _mm512_castsi512_ps(bits); }
+inline VecF convertToFloat(const VecI a) { return _mm512_cvtepi32_ps(a); }
+#include "simd_math.inl"
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif // HDR_SIMD_X86
+
+#if defined(HDR_SIMD_NEON)
+namespace simd_neon {
+using VecF = float32x4_t;
+using VecI = int32x4_t;
+constexpr int LANES = 4;
+inline VecF zero() { return vdupq_n_f32(0.0f); }
+inline VecF set1(const float v) { return vdupq_n_f32(v); }
+inline VecF loadu(const float* p) { return vld1q_f32(p); }
+inline void storeu(float* p, const VecF v) { vst1q_f32(p, v); }
+inline VecF loadPartial(const float* p, const int count)
+{
+    float lanes[LANES] = {};
+    std::copy_n(p, count, lanes);
+    return vld1q_f32(lanes);
+}
+inline void storePartial(float* p, const VecF v, const int count)
+{
+    float lanes[LANES];
+    vst1q_f32(lanes, v);
+    std::copy_n(lanes, count, p);
+}
+inline VecF gather(const float* base, const VecI index)
+{
+    int32_t indices[LANES];
+    vst1q_s32(indices, index);
+    const float lanes[LANES] = { base[indices[0]], base[indices[1]], base[indices[2]], base[indices[3]] };
+    return vld1q_f32(lanes);
+}
+inline VecF add(const VecF a, const VecF b) { return vaddq_f32(a, b); }
+inline VecF sub(const VecF a, const VecF b) { return vsubq_f32(a, b); }
+inline VecF mul(const VecF a, const VecF b) { return vmulq_f32(a, b); }
+inline VecF div(const VecF a, const VecF b) { return vdivq_f32(a, b); }
+inline VecF min(const VecF a, const VecF b) { return vminq_f32(a, b); }
+inline VecF max(const VecF a, const VecF b) { return vmaxq_f32(a, b); }
+inline VecF fmadd(const VecF a, const VecF b, const VecF c) { return vfmaq_f32(c, a, b); }
+inline VecF fnmadd(const VecF a, const VecF b, const VecF c) { return vfmsq_f32(c, a, b); }
+inline VecF roundNearest(const VecF x) { return vrndnq_f32(x); }
+inline VecI roundToInt(const VecF x) { return vcvtnq_s32_f32(x); }
+inline VecI set1i(const int32_t v) { return vdupq_n_s32(v); }
+inline VecI addi(const VecI a, const VecI b) { return vaddq_s32(a, b); }
+inline VecI subi(const VecI a, const VecI b) { return vsubq_s32(a, b); }
+inline VecI andi(const VecI a, const VecI b) { return vandq_s32(a, b); }
+template <int N>
+inline VecI slli(const VecI a) { return vshlq_n_s32(a, N); }
+template <int N>
+inline VecI srai(const VecI a) { return vshrq_n_s32(a, N); }
+inline VecI castToInt(const VecF x) { return vreinterpretq_s32_f32(x); }
+inline VecF castToFloat(const VecI bits) { return vreinterpretq_f32_s32(bits); }
+inline VecF convertToFloat(const VecI a) { return vcvtq_f32_s32(a); }
+#include "simd_math.inl"
+}
+#endif // HDR_SIMD_NEON
+
+#pragma endregion SIMD layer
@@ -0,0 +1,65 @@
+// Compiles a kernel file once per instruction set of simd.h.
+//
+// Define before including this file:
+//   HDR_SIMD_KERNEL            the kernel file, e.g. "bilateral_simd_kernel.inl"
+//   HDR_SIMD_KERNEL_NAMESPACE  the prefix of its namespaces, e.g. bilateral
+// The kernel is compiled into <prefix>_scalar, and into <prefix>_avx2 and <prefix>_avx512 on x86 or
+// <prefix>_neon on ARM with the target of the instruction set, each with the wrappers of its
+// instruction set in scope. Both macros are undefined at the end, so the next kernel file can be
+// instantiated the same way; there is no include guard on purpose.
+
+#define HDR_SIMD_NAMESPACE_(prefix, isa) prefix##_##isa
+#define HDR_SIMD_NAMESPACE(prefix, isa) HDR_SIMD_NAMESPACE_(prefix, isa)
+
+namespace HDR_SIMD_NAMESPACE(HDR_SIMD_KERNEL_NAMESPACE, scalar) {
+using namespace simd_scalar;
+#include HDR_SIMD_KERNEL
+}
+
+#if defined(HDR_SIMD_X86)
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+namespace HDR_SIMD_NAMESPACE(HDR_SIMD_KERNEL_NAMESPACE, avx2) {
+using namespace simd_avx2;
+#include HDR_SIMD_KERNEL
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#endif
+namespace HDR_SIMD_NAMESPACE(HDR_SIMD_KERNEL_NAMESPACE, avx512) {
+using namespace simd_avx512;
+#include HDR_SIMD_KERNEL
+}
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif // HDR_SIMD_X86
+
+#if defined(HDR_SIMD_NEON)
+namespace HDR_SIMD_NAMESPACE(HDR_SIMD_KERNEL_NAMESPACE, neon) {
+using namespace simd_neon;
+#include HDR_SIMD_KERNEL
+}
+#endif // HDR_SIMD_NEON
+
+#undef HDR_SIMD_NAMESPACE
+#undef HDR_SIMD_NAMESPACE_
+#undef HDR_SIMD_KERNEL_NAMESPACE
+#undef HDR_SIMD_KERNEL
@@ -0,0 +1,86 @@
+// Transcendental functions of the SIMD layer, shared by all instruction sets.
+//
+// This file is included once per ISA by simd.h, inside the namespace of its wrappers. The Fast and
+// Faster tiers repeat the operations of fast_math.h in the same order, with separate multiplies and
+// adds (which the compiler may still fuse for FMA targets); Exact has no vector form.
+
+/// <summary>
+/// exp(x) for x <= 0, Cephes polynomial with a relative error below 2e-7.
+/// </summary>
+inline VecF expNonPositive(VecF x)
+{
+    x = max(x, set1(SIMD_EXP_MIN_ARG));
+    const VecF n = roundNearest(mul(x, set1(SIMD_LOG2E)));
+    VecF r = fnmadd(n, set1(SIMD_LN2_HI), x);
+    r = fnmadd(n, set1(SIMD_LN2_LO), r);
+    VecF p = set1(SIMD_EXP_P0);
+    p = fmadd(p, r, set1(SIMD_EXP_P1));
+    p = fmadd(p, r, set1(SIMD_EXP_P2));
+    p = fmadd(p, r, set1(SIMD_EXP_P3));
+    p = fmadd(p, r, set1(SIMD_EXP_P4));
+    p = fmadd(p, r, set1(SIMD_EXP_P5));
+    const VecF y = add(fmadd(p, mul(r, r), r), set1(1.0f));
+    return mul(y, castToFloat(slli<23>(addi(roundToInt(n), set1i(127)))));
+}
+
+/// <summary>
+/// fast_math::log2() of every lane (x > 0).
+/// </summary>
+template <MathPrecision P>
+inline VecF fastLog2(const VecF x)
+{
+    static_assert(P != MathPrecision::Exact, "the exact tier is the standard library's");
+    const VecI offset = set1i(0x3F3504F3);
+    const VecI shifted = subi(castToInt(x), offset);
+    const VecF exponent = convertToFloat(srai<23>(shifted));
+    const VecF m = castToFloat(addi(andi(shifted, set1i(0x007FFFFF)), offset));
+
+    const VecF one = set1(1.0f);
+    const VecF t = div(sub(m, one), add(m, one));
+    const VecF t2 = mul(t, t);
+    VecF series;
+    if constexpr (P == MathPrecision::Faster) {
+        series = add(one, mul(t2, add(set1(1.0f / 3.0f), mul(t2, set1(1.0f / 5.0f)))));
+    } else {
+        series = add(one, mul(t2, add(set1(1.0f / 3.0f), mul(t2, add(set1(1.0f / 5.0f), mul(t2, add(set1(1.0f / 7.0f), mul(t2, set1(1.0f / 9.0f)))))))));
+    }
+    return add(exponent, mul(mul(set1(2.88539008f), t), series));
+}
+
+/// <summary>
+/// fast_math::exp2() of every lane.
+/// </summary>
+template <MathPrecision P>
+inline VecF fastExp2(VecF x)
+{
+    static_assert(P != MathPrecision::Exact, "the exact tier is the standard library's");
+    x = min(max(x, set1(-126.0f)), set1(127.999f));
+    const VecF n = roundNearest(x);
+    const VecF f = mul(sub(x, n), set1(0.69314718f));
+    const auto term = [&](const float c, const VecF next) { return add(set1(c), mul(f, next)); };
+    VecF p;
+    if constexpr (P == MathPrecision::Faster) {
+        p = term(1.0f, term(1.0f, term(1.0f / 2.0f, term(1.0f / 6.0f, set1(1.0f / 24.0f)))));
+    } else {
+        p = term(1.0f, term(1.0f, term(1.0f / 2.0f, term(1.0f / 6.0f, term(1.0f / 24.0f, term(1.0f / 120.0f, set1(1.0f / 720.0f)))))));
+    }
+    return mul(p, castToFloat(slli<23>(addi(roundToInt(n), set1i(127)))));
+}
+
+/// <summary>
+/// tmoLog() of every lane (x > 0).
+/// </summary>
+template <MathPrecision P>
+inline VecF fastLog(const VecF x) { return mul(fastLog2<P>(x), set1(0.69314718f)); }
+
+/// <summary>
+/// tmoExp() of every lane.
+/// </summary>
+template <MathPrecision P>
+inline VecF fastExp(const VecF x) { return fastExp2<P>(mul(x, set1(1.44269504f))); }
+
+/// <summary>
+/// tmoPow() of every lane (x > 0).
+/// </summary>
+template <MathPrecision P>
+inline VecF fastPow(const VecF x, const VecF y) { return fastExp2<P>(mul(y, fastLog2<P>(x))); }
@@ -0,0 +1,212 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/*
+ * Live latency metrics of a long-running process, in the OpenMetrics (Prometheus) text format.
+ *
+ * A LatencyHistogram is an HDR-style histogram with log-linear buckets: two per octave of
+ * microseconds (bounds 16, 24, 32, 48, 64, ... us, so any latency is within 50% of its bucket
+ * bound) from 16 us to about 71 minutes. An observation is two relaxed atomic additions, so
+ * histograms are filled from any thread without locks, and the bucket bounds never change, so
+ * rates and quantiles (histogram_quantile()) of successive scrapes can be combined.
+ *
+ * StageMetrics keeps one histogram per stage name and is fed by the ScopedStage timers of the
+ * stage profiler: once enable() was called, every ScopedStage (bilateralFilter, solvePoisson, the
+ * loads and writes of the service, ...) adds its wall time to the histogram of its name, whether
+ * or not the profiler records events. Disabled, it costs ScopedStage one more relaxed load.
+ *
+ * writeOpenMetricsHistogram() and friends write families of the text format; the image service
+ * answers its "metrics" job with them, see image_service.h.
+ */
+
+#pragma region Stage metrics
+
+/// <summary>
+/// Latency histogram with fixed log-linear buckets, see above.
+/// </summary>
+class LatencyHistogram {
+public:
+    // Bucket bounds 2^k and 1.5 * 2^k microseconds for k = 4 .. 31, then 2^32.
+    static constexpr int FIRST_OCTAVE = 4;
+    static constexpr int BUCKETS = 2 * (32 - FIRST_OCTAVE) + 1;
+
+    /// <summary>
+    /// Upper bound of a bucket in microseconds.
+    /// </summary>
+    static uint64_t bucketBoundUs(const int bucket)
+    {
+        const int octave = FIRST_OCTAVE + bucket / 2;
+        return bucket % 2 == 0 ? uint64_t(1) << octave : (uint64_t(3) << octave) / 2;
+    }
+
+    /// <summary>
+    /// Bucket of a latency: the first bucket whose bound is not below it, BUCKETS when beyond all.
+    /// </summary>
+    static int bucketOf(const uint64_t microseconds)
+    {
+        if (microseconds <= bucketBoundUs(0)) {
+            return 0;
+        }
+        // us in (2^k, 2^(k+1)]: the bound 1.5 * 2^k or 2^(k+1) by the bit below the leading one of us - 1.
+        const uint64_t v = microseconds - 1;
+        const int octave = std::bit_width(v) - 1;
+        const int bucket = 2 * (octave - FIRST_OCTAVE) + 1 + int((v >> (octave - 1)) & 1);
+        return bucket < BUCKETS ? bucket : BUCKETS;
+    }
+
+    void observe(const std::chrono::nanoseconds duration)
+    {
+        const uint64_t nanoseconds = uint64_t(std::max<int64_t>(duration.count(), 0));
+        m_counts[size_t(bucketOf(nanoseconds / 1000))].fetch_add(1, std::memory_order_relaxed);
+        m_sum_ns.fetch_add(nanoseconds, std::memory_order_relaxed);
+    }
+
+    // Observations of a bucket, the last one (BUCKETS) counts those beyond all bounds.
+    uint64_t bucketCount(const int bucket) const { return m_counts[size_t(bucket)].load(std::memory_order_relaxed); }
+    double sumSeconds() const { return double(m_sum_ns.load(std::memory_order_relaxed)) * 1e-9; }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS + 1> m_counts {};
+    std::atomic<uint64_t> m_sum_ns = 0;
+};
+
+/// <summary>
+/// Process-wide latency histograms per stage name, fed by ScopedStage, see above.
+/// </summary>
+class StageMetrics {
+public:
+    static StageMetrics& instance()
+    {
+        static StageMetrics metrics;
+        return metrics;
+    }
+
+    void enable() { m_enabled.store(true, std::memory_order_relaxed); }
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    void observe(const std::string_view stage, const std::chrono::nanoseconds duration)
+    {
+        {
+            std::shared_lock lock(m_mutex);
+            const auto it = m_stages.find(stage);
+            if (it != m_stages.end()) {
+                it->second->observe(duration);
+                return;
+            }
+        }
+        std::unique_lock lock(m_mutex);
+        auto& histogram = m_stages[std::string(stage)];
+        if (!histogram) {
+            histogram = std::make_unique<LatencyHistogram>();
+        }
+        histogram->observe(duration);
+    }
+
+    /// <summary>
+    /// Calls fn(name, histogram) for every stage observed so far, in order of the names.
+    /// </summary>
+    void forEach(const std::function<void(const std::string&, const LatencyHistogram&)>& fn) const
+    {
+        std::shared_lock lock(m_mutex);
+        for (const auto& [name, histogram] : m_stages) {
+            fn(name, *histogram);
+        }
+    }
+
+private:
+    std::atomic<bool> m_enabled = false;
+    mutable std::shared_mutex m_mutex;
+    // Histograms are never removed, so a pointer stays valid without the lock.
+    std::map<std::string, std::unique_ptr<LatencyHistogram>, std::less<>> m_stages;
+};
+
+/// <summary>
+/// Label value with the characters the text format escapes.
+/// </summary>
+inline std::string openMetricsLabel(const std::string_view value)
+{
+    std::string escaped;
+    for (const char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+/// <summary>
+/// Number as written in samples, 12 significant digits (bucket bounds in seconds are exact).
+/// </summary>
+inline std::string openMetricsNumber(const double value)
+{
+    std::ostringstream text;
+    text.precision(12);
+    text << value;
+    return text.str();
+}
+
+/// <summary>
+/// Writes the TYPE, UNIT and HELP lines of a metric family (for counters the name without _total).
+/// </summary>
+/// <param name="type">counter, gauge or histogram</param>
+/// <param name="unit">unit suffix of the name, e.g. "seconds" or "bytes", empty for none</param>
+inline void writeOpenMetricsFamily(std::ostream& out, const std::string& name, const char* type, const char* unit, const char* help)
+{
+    out << "# TYPE " << name << " " << type << "\n";
+    if (*unit) {
+        out << "# UNIT " << name << " " << unit << "\n";
+    }
+    out << "# HELP " << name << " " << help << "\n";
+}
+
+/// <summary>
+/// Writes one sample of a gauge, or of a counter with its name ending in _total.
+/// </summary>
+/// <param name="labels">label pairs, e.g. command="tonemap", empty for none</param>
+inline void writeOpenMetricsSample(std::ostream& out, const std::string& name, const std::string& labels, const double value)
+{
+    out << name << (labels.empty() ? "" : "{" + labels + "}") << " " << openMetricsNumber(value) << "\n";
+}
+
+/// <summary>
+/// Writes the buckets, count and sum of one histogram of a family. Empty buckets past the last
+/// observation are written too, the bounds of every scrape are the same.
+/// </summary>
+inline void writeOpenMetricsHistogram(std::ostream& out, const std::string& name, const std::string& labels, const LatencyHistogram& histogram)
+{
+    const std::string prefix = labels.empty() ? "" : labels + ",";
+    // Counts are read bucket by bucket while observations go on; the count is their sum, so the
+    // cumulative buckets stay consistent with it.
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < LatencyHistogram::BUCKETS; bucket++) {
+        cumulative += histogram.bucketCount(bucket);
+        out << name << "_bucket{" << prefix << "le=\"" << openMetricsNumber(double(LatencyHistogram::bucketBoundUs(bucket)) * 1e-6) << "\"} " << cumulative << "\n";
+    }
+    cumulative += histogram.bucketCount(LatencyHistogram::BUCKETS);
+    out << name << "_bucket{" << prefix << "le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << " " << cumulative << "\n";
+    out << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << " " << openMetricsNumber(histogram.sumSeconds()) << "\n";
+}
+
+#pragma endregion Stage metrics
@@ -0,0 +1,497 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "stage_metrics.h"
+
+/*
+ * Per-stage instrumentation.
+ *
+ * A ScopedStage measures the wall time of a stage from its construction to its destruction,
+ * together with the pixels it processed and the image bytes allocated meanwhile (counted by an
+ * ImageAllocationCounter between the images and their memory resource). Recording is off until
+ * StageProfiler::enable(), a disabled ScopedStage costs one relaxed atomic load. The recorded
+ * events give a summary table per stage name (calls, time, MPix/s, allocated MB), a JSON report
+ * with the peak resident set size of the process and a Chrome trace ("traceEvents" JSON, opened
+ * by chrome://tracing and ui.perfetto.dev). Settings of the run given to setRunInfo() (e.g. the
+ * quality preset) head the table and are written with both files. Allocation counts of stages running concurrently
+ * (e.g. the branches of a TaskGraph) include each other's allocations.
+ *
+ * The counter also tracks the live image bytes (allocated and not yet freed), their peak and
+ * the number of allocations, so every event carries a memory sample: the live bytes at its end,
+ * their peak while it ran (a watermark per stage in flight), its allocations and the resident
+ * set size of the process at its end. The run is split into phases (setPhase(), e.g. tone
+ * mapping and Poisson editing), and printMemoryTimeline() lists the events in order of their
+ * start with a peak per phase; the JSON report has the same timeline and the Chrome trace shows
+ * the live bytes and the resident set size as counter tracks.
+ *
+ * Independently of the recording, a ScopedStage feeds the live latency histograms of
+ * StageMetrics once they are enabled (service mode), see stage_metrics.h.
+ */
+
+#pragma region Stage profiler
+
+/// <summary>
+/// Memory resource that forwards to an upstream resource and counts the bytes requested.
+/// </summary>
+class ImageAllocationCounter : public std::pmr::memory_resource {
+public:
+    explicit ImageAllocationCounter(std::pmr::memory_resource* upstream)
+        : m_upstream(upstream)
+    {
+    }
+
+    // Bytes and allocations requested since construction.
+    uint64_t allocatedBytes() const { return m_allocated.load(std::memory_order_relaxed); }
+    uint64_t allocationCount() const { return m_allocations.load(std::memory_order_relaxed); }
+    // Bytes allocated and not freed yet, and their largest value since construction.
+    uint64_t liveBytes() const { return m_live.load(std::memory_order_relaxed); }
+    uint64_t peakLiveBytes() const { return m_peak_live.load(std::memory_order_relaxed); }
+
+    /// <summary>
+    /// Starts a watermark, the largest live bytes from now on until closeWatermark().
+    /// </summary>
+    /// <returns>slot of the watermark, -1 when all slots are in use</returns>
+    int openWatermark()
+    {
+        uint64_t open = m_open_watermarks.load(std::memory_order_relaxed);
+        while (open != ~uint64_t(0)) {
+            const int slot = std::countr_one(open);
+            m_watermarks[size_t(slot)].store(liveBytes(), std::memory_order_relaxed);
+            if (m_open_watermarks.compare_exchange_weak(open, open | (uint64_t(1) << slot), std::memory_order_acq_rel)) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    /// <summary>
+    /// Ends a watermark of openWatermark() and returns its peak (the current live bytes for slot -1).
+    /// </summary>
+    uint64_t closeWatermark(const int slot)
+    {
+        if (slot < 0) {
+            return liveBytes();
+        }
+        const uint64_t peak = std::max(m_watermarks[size_t(slot)].load(std::memory_order_relaxed), liveBytes());
+        m_open_watermarks.fetch_and(~(uint64_t(1) << slot), std::memory_order_acq_rel);
+        return peak;
+    }
+
+private:
+    static void raise(std::atomic<uint64_t>& peak, const uint64_t value)
+    {
+        uint64_t current = peak.load(std::memory_order_relaxed);
+        while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void* do_allocate(const size_t bytes, const size_t alignment) override
+    {
+        m_allocated.fetch_add(bytes, std::memory_order_relaxed);
+        m_allocations.fetch_add(1, std::memory_order_relaxed);
+        void* p = m_upstream->allocate(bytes, alignment);
+        const uint64_t live = m_live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        raise(m_peak_live, live);
+        for (uint64_t open = m_open_watermarks.load(std::memory_order_acquire); open != 0; open &= open - 1) {
+            raise(m_watermarks[size_t(std::countr_zero(open))], live);
+        }
+        return p;
+    }
+    void do_deallocate(void* p, const size_t bytes, const size_t alignment) override
+    {
+        m_live.fetch_sub(bytes, std::memory_order_relaxed);
+        m_upstream->deallocate(p, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::pmr::memory_resource* m_upstream;
+    std::atomic<uint64_t> m_allocated = 0;
+    std::atomic<uint64_t> m_allocations = 0;
+    std::atomic<uint64_t> m_live = 0;
+    std::atomic<uint64_t> m_peak_live = 0;
+    // One bit per watermark in use.
+    std::atomic<uint64_t> m_open_watermarks = 0;
+    std::array<std::atomic<uint64_t>, 64> m_watermarks {};
+};
+
+/// <summary>
+/// Peak resident set size of the process in bytes (0 if unknown).
+/// </summary>
+inline uint64_t peakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? uint64_t(counters.PeakWorkingSetSize) : 0;
+#else
+    rusage usage {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss);
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+/// <summary>
+/// Current resident set size of the process in bytes (0 if unknown).
+/// </summary>
+inline uint64_t currentResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    return GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? uint64_t(counters.WorkingSetSize) : 0;
+#elif defined(__linux__)
+    // Program size and resident pages.
+    std::ifstream statm("/proc/self/statm");
+    uint64_t size_pages = 0, resident_pages = 0;
+    return statm >> size_pages >> resident_pages ? resident_pages * uint64_t(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+/// <summary>
+/// Process-wide record of stage events, see above.
+/// </summary>
+class StageProfiler {
+public:
+    struct Event {
+        std::string name;
+        // Microseconds since the profiler was enabled.
+        double start_us = 0.0;
+        double duration_us = 0.0;
+        uint64_t pixels = 0;
+        uint64_t allocated_bytes = 0;
+        size_t thread = 0;
+        // Memory sample, see above.
+        uint64_t allocations = 0;
+        uint64_t live_bytes = 0;
+        uint64_t peak_live_bytes = 0;
+        uint64_t rss_bytes = 0;
+        std::string phase;
+    };
+
+    static StageProfiler& instance()
+    {
+        static StageProfiler profiler;
+        return profiler;
+    }
+
+    /// <summary>
+    /// Starts recording; allocations are counted when a counter is given.
+    /// </summary>
+    void enable(ImageAllocationCounter* allocation_counter = nullptr)
+    {
+        std::lock_guard lock(m_mutex);
+        m_allocation_counter = allocation_counter;
+        m_origin = std::chrono::steady_clock::now();
+        m_enabled.store(true, std::memory_order_relaxed);
+    }
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    double nowUs() const { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_origin).count(); }
+    uint64_t allocatedBytes() const { return m_allocation_counter ? m_allocation_counter->allocatedBytes() : 0; }
+    uint64_t allocationCount() const { return m_allocation_counter ? m_allocation_counter->allocationCount() : 0; }
+    uint64_t liveBytes() const { return m_allocation_counter ? m_allocation_counter->liveBytes() : 0; }
+    int openWatermark() { return m_allocation_counter ? m_allocation_counter->openWatermark() : -1; }
+    uint64_t closeWatermark(const int slot) { return m_allocation_counter ? m_allocation_counter->closeWatermark(slot) : 0; }
+
+    /// <summary>
+    /// Names the phase of the run the following stages belong to, e.g. "tone mapping".
+    /// </summary>
+    void setPhase(const std::string& phase)
+    {
+        std::lock_guard lock(m_mutex);
+        m_phase = phase;
+    }
+
+    std::string phase() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_phase;
+    }
+
+    void record(Event event)
+    {
+        std::lock_guard lock(m_mutex);
+        m_events.push_back(std::move(event));
+    }
+
+    std::vector<Event> events() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_events;
+    }
+
+    /// <summary>
+    /// Labels the run with a setting, reported with the stages.
+    /// </summary>
+    void setRunInfo(const std::string& key, const std::string& value)
+    {
+        std::lock_guard lock(m_mutex);
+        m_run_info[key] = value;
+    }
+
+    std::map<std::string, std::string> runInfo() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_run_info;
+    }
+
+    /// <summary>
+    /// Table of the stages in order of their first event: calls, total and mean time, MPix/s and allocated MB.
+    /// </summary>
+    void printSummary(std::ostream& out) const
+    {
+        for (const auto& [key, value] : runInfo()) {
+            out << key << ": " << value << std::endl;
+        }
+        out << std::left << std::setw(32) << "stage" << std::right << std::setw(7) << "calls" << std::setw(12) << "total ms" << std::setw(12) << "mean ms"
+            << std::setw(10) << "MPix/s" << std::setw(12) << "alloc MB" << std::endl;
+        for (const auto& stage : summarize()) {
+            out << std::left << std::setw(32) << stage.name << std::right << std::setw(7) << stage.calls << std::fixed << std::setprecision(2)
+                << std::setw(12) << stage.total_us / 1000.0 << std::setw(12) << stage.total_us / 1000.0 / double(stage.calls) << std::setw(10)
+                << stage.megapixelsPerSecond() << std::setw(12) << double(stage.allocated_bytes) / double(1 << 20) << std::defaultfloat << std::endl;
+        }
+        out << "Peak RSS: " << double(peakResidentBytes()) / double(1 << 20) << " MB" << std::endl;
+    }
+
+    /// <summary>
+    /// Memory timeline: the events in order of their start with their phase, live image MB at
+    /// the end and at the peak while they ran, allocations and resident MB at the end, then the
+    /// peaks of every phase.
+    /// </summary>
+    void printMemoryTimeline(std::ostream& out) const
+    {
+        const auto timeline = memoryTimeline();
+        const auto mb = [](const uint64_t bytes) { return double(bytes) / double(1 << 20); };
+        out << std::right << std::setw(10) << "start ms" << "  " << std::left << std::setw(16) << "phase" << std::setw(32) << "stage" << std::right << std::setw(10)
+            << "live MB" << std::setw(10) << "peak MB" << std::setw(8) << "allocs" << std::setw(10) << "alloc MB" << std::setw(10) << "RSS MB" << std::endl;
+        std::vector<std::pair<std::string, std::pair<uint64_t, uint64_t>>> phases;
+        for (const auto& event : timeline) {
+            out << std::right << std::fixed << std::setprecision(1) << std::setw(10) << event.start_us / 1000.0 << "  " << std::left << std::setw(16) << event.phase
+                << std::setw(32) << event.name << std::right << std::setw(10) << mb(event.live_bytes) << std::setw(10) << mb(event.peak_live_bytes) << std::setw(8)
+                << event.allocations << std::setw(10) << mb(event.allocated_bytes) << std::setw(10) << mb(event.rss_bytes) << std::defaultfloat << std::endl;
+            auto phase = std::find_if(phases.begin(), phases.end(), [&](const auto& entry) { return entry.first == event.phase; });
+            if (phase == phases.end()) {
+                phase = phases.insert(phases.end(), { event.phase, { 0, 0 } });
+            }
+            phase->second.first = std::max(phase->second.first, event.peak_live_bytes);
+            phase->second.second = std::max(phase->second.second, event.rss_bytes);
+        }
+        for (const auto& [phase, peaks] : phases) {
+            out << "Peak of " << (phase.empty() ? "the run" : phase) << ": " << std::fixed << std::setprecision(1) << mb(peaks.first) << " MB of images live, "
+                << mb(peaks.second) << " MB resident" << std::defaultfloat << std::endl;
+        }
+    }
+
+    /// <summary>
+    /// Writes the summary as JSON: {"run": {...}, "peak_rss_bytes": ..., "stages": [{"name", "calls", ...}]}.
+    /// </summary>
+    bool writeJson(const std::filesystem::path& filePath) const
+    {
+        std::ofstream out(filePath);
+        out << "{\n  \"run\": ";
+        writeRunInfo(out);
+        out << ",\n  \"peak_rss_bytes\": " << peakResidentBytes() << ",\n  \"stages\": [";
+        const auto stages = summarize();
+        for (size_t i = 0; i < stages.size(); i++) {
+            const auto& stage = stages[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << stage.name << "\", \"calls\": " << stage.calls << ", \"total_ms\": " << stage.total_us / 1000.0
+                << ", \"pixels\": " << stage.pixels << ", \"mpix_per_s\": " << stage.megapixelsPerSecond() << ", \"allocated_bytes\": " << stage.allocated_bytes
+                << "}";
+        }
+        out << "\n  ],\n  \"memory_timeline\": [";
+        const auto timeline = memoryTimeline();
+        for (size_t i = 0; i < timeline.size(); i++) {
+            const auto& event = timeline[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << event.name << "\", \"phase\": \"" << event.phase << "\", \"start_ms\": " << event.start_us / 1000.0
+                << ", \"duration_ms\": " << event.duration_us / 1000.0 << ", \"live_bytes\": " << event.live_bytes << ", \"peak_live_bytes\": " << event.peak_live_bytes
+                << ", \"allocations\": " << event.allocations << ", \"allocated_bytes\": " << event.allocated_bytes << ", \"rss_bytes\": " << event.rss_bytes << "}";
+        }
+        out << "\n  ]\n}\n";
+        return bool(out);
+    }
+
+    /// <summary>
+    /// Writes every event as a complete ("X") event of a Chrome trace, the live image bytes and the
+/// resident set size at the end of every event as counter ("C") tracks, the run info as its "otherData".
+    /// </summary>
+    bool writeChromeTrace(const std::filesystem::path& filePath) const
+    {
+        std::ofstream out(filePath);
+        out << "{\"traceEvents\": [";
+        const auto all_events = events();
+        for (size_t i = 0; i < all_events.size(); i++) {
+            const auto& event = all_events[i];
+            out << (i ? ",\n" : "\n") << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << event.thread << ", \"ts\": " << std::fixed
+                << std::setprecision(1) << event.start_us << ", \"dur\": " << event.duration_us << std::defaultfloat << ", \"args\": {\"pixels\": " << event.pixels
+                << ", \"allocated_bytes\": " << event.allocated_bytes << ", \"allocations\": " << event.allocations << "}}";
+            out << ",\n{\"name\": \"memory\", \"ph\": \"C\", \"pid\": 0, \"ts\": " << std::fixed << std::setprecision(1) << event.start_us + event.duration_us
+                << std::defaultfloat << ", \"args\": {\"live_images_mb\": " << double(event.live_bytes) / double(1 << 20) << ", \"resident_mb\": "
+                << double(event.rss_bytes) / double(1 << 20) << "}}";
+        }
+        out << "\n], \"otherData\": ";
+        writeRunInfo(out);
+        out << "}\n";
+        return bool(out);
+    }
+
+private:
+    struct StageSummary {
+        std::string name;
+        size_t calls = 0;
+        double total_us = 0.0;
+        uint64_t pixels = 0;
+        uint64_t allocated_bytes = 0;
+
+        double megapixelsPerSecond() const { return total_us > 0.0 ? double(pixels) / total_us : 0.0; }
+    };
+
+    void writeRunInfo(std::ostream& out) const
+    {
+        out << "{";
+        bool first = true;
+        for (const auto& [key, value] : runInfo()) {
+            out << (first ? "" : ", ") << "\"" << key << "\": \"" << value << "\"";
+            first = false;
+        }
+        out << "}";
+    }
+
+    std::vector<Event> memoryTimeline() const
+    {
+        auto timeline = events();
+        std::stable_sort(timeline.begin(), timeline.end(), [](const Event& a, const Event& b) { return a.start_us < b.start_us; });
+        return timeline;
+    }
+
+    std::vector<StageSummary> summarize() const
+    {
+        std::vector<StageSummary> stages;
+        std::map<std::string, size_t> index;
+        for (const auto& event : events()) {
+            const auto [it, inserted] = index.try_emplace(event.name, stages.size());
+            if (inserted) {
+                stages.push_back({ event.name });
+            }
+            auto& stage = stages[it->second];
+            stage.calls++;
+            stage.total_us += event.duration_us;
+            stage.pixels += event.pixels;
+            stage.allocated_bytes += event.allocated_bytes;
+        }
+        return stages;
+    }
+
+    std::atomic<bool> m_enabled = false;
+    std::chrono::steady_clock::time_point m_origin = std::chrono::steady_clock::now();
+    ImageAllocationCounter* m_allocation_counter = nullptr;
+    std::string m_phase;
+    mutable std::mutex m_mutex;
+    std::vector<Event> m_events;
+    std::map<std::string, std::string> m_run_info;
+};
+
+/// <summary>
+/// Records the enclosing scope as a stage event when the profiler is enabled.
+/// </summary>
+class ScopedStage {
+public:
+    /// <param name="name">stage name, events of one name are summed in the summary</param>
+    /// <param name="pixels">pixels processed by the stage, for MPix/s</param>
+    explicit ScopedStage(const char* name, const uint64_t pixels = 0)
+        : m_active(StageProfiler::instance().enabled())
+        , m_metrics(StageMetrics::instance().enabled())
+    {
+        if (m_metrics) {
+            m_name = name;
+            m_metrics_start = std::chrono::steady_clock::now();
+        }
+        if (m_active) {
+            auto& profiler = StageProfiler::instance();
+            m_name = name;
+            m_pixels = pixels;
+            m_phase = profiler.phase();
+            m_watermark = profiler.openWatermark();
+            m_start_us = profiler.nowUs();
+            m_start_allocated = profiler.allocatedBytes();
+            m_start_allocations = profiler.allocationCount();
+        }
+    }
+    ~ScopedStage()
+    {
+        if (m_metrics) {
+            StageMetrics::instance().observe(m_name, std::chrono::steady_clock::now() - m_metrics_start);
+        }
+        if (m_active) {
+            auto& profiler = StageProfiler::instance();
+            StageProfiler::Event event { m_name, m_start_us, profiler.nowUs() - m_start_us, m_pixels, profiler.allocatedBytes() - m_start_allocated,
+                std::hash<std::thread::id> {}(std::this_thread::get_id()) % 100000 };
+            event.allocations = profiler.allocationCount() - m_start_allocations;
+            event.live_bytes = profiler.liveBytes();
+            event.peak_live_bytes = profiler.closeWatermark(m_watermark);
+            event.rss_bytes = currentResidentBytes();
+            event.phase = std::move(m_phase);
+            profiler.record(std::move(event));
+        }
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    bool m_active;
+    // Adds the wall time to the histogram of the stage, see stage_metrics.h.
+    bool m_metrics;
+    std::chrono::steady_clock::time_point m_metrics_start;
+    const char* m_name = nullptr;
+    uint64_t m_pixels = 0;
+    double m_start_us = 0.0;
+    uint64_t m_start_allocated = 0;
+    uint64_t m_start_allocations = 0;
+    int m_watermark = -1;
+    std::string m_phase;
+};
+
+/// <summary>
+/// Evaluates body() as a stage and returns its result.
+/// </summary>
+template <typename Body>
+decltype(auto) profileStage(const char* name, const uint64_t pixels, Body&& body)
+{
+    const ScopedStage stage(name, pixels);
+    return body();
+}
+
+#pragma endregion Stage profiler
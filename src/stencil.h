@@ -0,0 +1,112 @@
+#pragma once
+#include <algorithm>
+
+#include "job_control.h"
+
+/*
+ * Interior / border split of neighborhood operators.
+ *
+ * A stencil that reads up to `left` pixels to the left, `top` above, `right` to the right and
+ * `bottom` below of a pixel only needs bounds handling within that distance of the image edge.
+ * The kernels here are written as two parts: an interior span, a row segment where every read
+ * is inside the image, written as a plain loop without bounds tests so the compiler can
+ * vectorize it (usually with "#pragma omp simd"), and a border pixel function that keeps the
+ * tests of the reference code. The split only changes which code evaluates a pixel, both parts
+ * compute the same expression, so results are unchanged.
+ */
+
+#pragma region Stencil iteration
+
+/// <summary>
+/// Distance in pixels a stencil reads from its center pixel in each direction.
+/// </summary>
+struct StencilReach {
+    int left = 0;
+    int top = 0;
+    int right = 0;
+    int bottom = 0;
+};
+
+/// <summary>
+/// Pixels [x0, x1) x [y0, y1) of a width x height image whose whole stencil is inside the image.
+/// </summary>
+struct StencilInterior {
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    StencilInterior(const int width, const int height, const StencilReach& reach)
+        : x0(std::min(reach.left, width))
+        , y0(std::min(reach.top, height))
+        , x1(std::max(width - reach.right, x0))
+        , y1(std::max(height - reach.bottom, y0))
+    {
+    }
+
+    bool containsRow(const int y) const { return y >= y0 && y < y1; }
+};
+
+/// <summary>
+/// Visits row y of a width-pixel row: border_pixel(x, y) left and right of the interior, and
+/// interior_span(y, x0, x1) once for the interior segment. Rows above or below the interior are
+/// border pixels only.
+/// </summary>
+/// <param name="y">row</param>
+/// <param name="width">row width</param>
+/// <param name="interior">interior of the stencil</param>
+/// <param name="interior_span">interior_span(y, x0, x1), evaluated without bounds tests</param>
+/// <param name="border_pixel">border_pixel(x, y), evaluated with bounds tests</param>
+template <typename InteriorSpan, typename BorderPixel>
+void forEachStencilRow(const int y, const int width, const StencilInterior& interior, InteriorSpan&& interior_span, BorderPixel&& border_pixel)
+{
+    if (!interior.containsRow(y)) {
+        for (int x = 0; x < width; x++) {
+            border_pixel(x, y);
+        }
+        return;
+    }
+    for (int x = 0; x < interior.x0; x++) {
+        border_pixel(x, y);
+    }
+    if (interior.x0 < interior.x1) {
+        interior_span(y, interior.x0, interior.x1);
+    }
+    for (int x = interior.x1; x < width; x++) {
+        border_pixel(x, y);
+    }
+}
+
+/// <summary>
+/// Visits every pixel of a width x height domain, rows in parallel, see forEachStencilRow(). Every
+/// row is a checkpoint of the job of the calling thread: once it is cancelled the remaining rows
+/// are skipped and CancelledError is thrown after the loop (see job_control.h).
+/// </summary>
+/// <param name="width">domain width</param>
+/// <param name="height">domain height</param>
+/// <param name="reach">how far the stencil reads around a pixel</param>
+/// <param name="interior_span">interior_span(y, x0, x1), evaluated without bounds tests</param>
+/// <param name="border_pixel">border_pixel(x, y), evaluated with bounds tests</param>
+/// <param name="row_done">row_done(y) after every pixel of row y, on the thread that evaluated them</param>
+template <typename InteriorSpan, typename BorderPixel, typename RowDone>
+void forEachStencilPixel(const int width, const int height, const StencilReach& reach, InteriorSpan&& interior_span, BorderPixel&& border_pixel, RowDone&& row_done)
+{
+    const auto interior = StencilInterior(width, height, reach);
+    const JobControl* const job = currentJobControl();
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+    for (int y = 0; y < height; y++) {
+        if (job && job->checkpoint()) {
+            continue;
+        }
+        // The job is checked between rows, not by kernels nested in a row.
+        const JobControlScope detached(nullptr);
+        forEachStencilRow(y, width, interior, interior_span, border_pixel);
+        row_done(y);
+    }
+    throwIfCancelled(job);
+}
+
+template <typename InteriorSpan, typename BorderPixel>
+void forEachStencilPixel(const int width, const int height, const StencilReach& reach, InteriorSpan&& interior_span, BorderPixel&& border_pixel)
+{
+    forEachStencilPixel(width, height, reach, interior_span, border_pixel, [](int) {});
+}
+
+#pragma endregion Stencil iteration
@@ -0,0 +1,854 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "binary_mask.h"
+#include "execution.h"
+#include "helpers.h"
+#include "poisson_common.h"
+#include "stencil.h"
+
+/*
+ * Solver core for 5-point stencils with per-pixel coefficients.
+ *
+ * The gradient-domain and edge-preserving operators (Poisson editing, gradient-domain HDR
+ * compression, weighted-least-squares smoothing, mask refinement) all solve A u = b with
+ *
+ *   (A u)(p) = c(p) u(p) + sum over the 4-neighbours q of w(p, q) (u(p) - u(q)),
+ *
+ * a weighted graph Laplacian with conductances w >= 0 on the edges between neighbours plus a
+ * diagonal (data) term c >= 0. StencilOperator stores the conductance to the right and to the
+ * lower neighbour of every pixel and the diagonal; edges leaving the image have conductance 0,
+ * which is a Neumann border. Pixels can be fixed instead (Dirichlet): they keep the value of the
+ * initial solution and enter the equations of their neighbours as known values. The constant
+ * 5-point Laplacian of solvePoisson() is StencilOperator::laplacian() with a fixed border and
+ * b = -div G.
+ *
+ * solveStencil() runs one of the backends on an operator:
+ *  - Jacobi and red-black SOR, in the residual form u += omega (b - A u) / diag,
+ *  - conjugate gradients with the diagonal as preconditioner (A is symmetric, and positive
+ *    definite when a pixel is fixed or c > 0 somewhere),
+ *  - geometric multigrid: node (i, j) of a coarse level lies on fine node (2i, 2j), coarse
+ *    conductances are the harmonic mean of the two fine edges they span averaged over the
+ *    neighbouring rows (1 2 1), the diagonal term is full-weighted and scaled by 4 for the
+ *    doubled spacing, the correction is interpolated along the fine conductances (bilinearly
+ *    for constant ones) and the residual restricted with the transpose of that interpolation,
+ *    and the smoother is red-black Gauss-Seidel, run in reverse color order after the
+ *    correction so that the cycle is symmetric. An even side is handled as in
+ *    poisson_multigrid.h: its last coarse node lies on the last fine pixel, and the path to it
+ *    is one fine edge at half the coarse spacing. The interpolated correction is added with the
+ *    step minimizing the error energy along it, so fixed pixels between coarse nodes slow the
+ *    cycles down instead of making them diverge,
+ *  - conjugate gradients preconditioned with one V-cycle, which keeps its iteration count low
+ *    where the conductances vary by orders of magnitude (weighted least squares).
+ * All passes are parallel over rows, with the reductions of reproducibleSum(). Interior
+ * segments of a row are plain loops without bounds tests (see stencil.h), marked
+ * "#pragma omp simd" except in the red-black passes, which stride over the pixels of one color.
+ */
+
+#pragma region Stencil solver
+
+/// <summary>
+/// Border handling of a StencilOperator built from a size.
+/// </summary>
+enum class StencilBoundary {
+    // No flux across the image edge.
+    Neumann,
+    // The 1px border keeps the values of the initial solution (the convention of solvePoisson()).
+    Dirichlet,
+};
+
+/// <summary>
+/// Symmetric 5-point operator with per-pixel coefficients, see above.
+/// </summary>
+class StencilOperator {
+public:
+    StencilOperator() = default;
+
+    /// <param name="right">conductance between (x, y) and (x + 1, y), the last column is ignored</param>
+    /// <param name="down">conductance between (x, y) and (x, y + 1), the last row is ignored</param>
+    /// <param name="center">optional diagonal term c, 0 when missing</param>
+    /// <param name="boundary">Dirichlet also fixes the 1px border</param>
+    /// <param name="fixed">optional pixels with a given value, at the operator size</param>
+    StencilOperator(ImageFloat right, ImageFloat down, const ImageFloat* center = nullptr, const StencilBoundary boundary = StencilBoundary::Neumann,
+        const BinaryMask* fixed = nullptr)
+        : m_right(std::move(right))
+        , m_down(std::move(down))
+    {
+        const int w = m_right.width, h = m_right.height;
+        if (m_down.width != w || m_down.height != h || (center && (center->width != w || center->height != h))
+            || (fixed && (fixed->width() != w || fixed->height() != h))) {
+            std::cerr << "StencilOperator: the coefficient images differ in size." << std::endl;
+            throw std::exception();
+        }
+        m_diagonal = ImageFloat::uninitialized(w, h);
+        m_inverse = ImageFloat::uninitialized(w, h);
+#pragma omp parallel for num_threads(kernelThreads(m_right, KernelCost::Light))
+        for (int y = 0; y < h; y++) {
+            const size_t row = size_t(y) * size_t(w);
+            // Edges leaving the image.
+            m_right.data[row + size_t(w) - 1] = 0.0f;
+            if (y == h - 1) {
+                std::fill_n(m_down.data.begin() + ptrdiff_t(row), w, 0.0f);
+            }
+            for (int x = 0; x < w; x++) {
+                const size_t i = row + size_t(x);
+                float diagonal = center ? center->data[i] : 0.0f;
+                diagonal += m_right.data[i] + (x > 0 ? m_right.data[i - 1] : 0.0f) + m_down.data[i] + (y > 0 ? m_down.data[i - size_t(w)] : 0.0f);
+                const bool border = x == 0 || y == 0 || x == w - 1 || y == h - 1;
+                const bool is_fixed = (boundary == StencilBoundary::Dirichlet && border) || (fixed && (*fixed)(x, y));
+                m_diagonal.data[i] = diagonal;
+                // Fixed pixels, and pixels without any coupling, are never updated.
+                m_inverse.data[i] = is_fixed || diagonal <= 0.0f ? 0.0f : 1.0f / diagonal;
+            }
+        }
+    }
+
+    /// <summary>
+    /// The unweighted 5-point Laplacian (negated, A = -L) of a width x height grid plus a constant diagonal term.
+    /// </summary>
+    static StencilOperator laplacian(const int width, const int height, const StencilBoundary boundary, const float center = 0.0f)
+    {
+        ImageFloat right(width, height), down(width, height);
+        std::fill(right.data.begin(), right.data.end(), 1.0f);
+        std::fill(down.data.begin(), down.data.end(), 1.0f);
+        if (center == 0.0f) {
+            return StencilOperator(std::move(right), std::move(down), nullptr, boundary);
+        }
+        ImageFloat diagonal(width, height);
+        std::fill(diagonal.data.begin(), diagonal.data.end(), center);
+        return StencilOperator(std::move(right), std::move(down), &diagonal, boundary);
+    }
+
+    int width() const { return m_right.width; }
+    int height() const { return m_right.height; }
+    const ImageFloat& right() const { return m_right; }
+    const ImageFloat& down() const { return m_down; }
+    // Diagonal of A, c plus the conductances of the pixel.
+    const ImageFloat& diagonal() const { return m_diagonal; }
+    // 1 / diagonal on the free pixels, 0 on the fixed ones.
+    const ImageFloat& inverseDiagonal() const { return m_inverse; }
+
+    /// <summary>
+    /// (A u)(x, y) with bounds tests, for the border pixels.
+    /// </summary>
+    float applyAt(const ImageFloat& u, const int x, const int y) const
+    {
+        const int w = width();
+        const size_t i = size_t(y) * size_t(w) + size_t(x);
+        float neighbours = m_right.data[i] * (x + 1 < w ? u.data[i + 1] : 0.0f) + m_down.data[i] * (y + 1 < height() ? u.data[i + size_t(w)] : 0.0f);
+        if (x > 0) {
+            neighbours += m_right.data[i - 1] * u.data[i - 1];
+        }
+        if (y > 0) {
+            neighbours += m_down.data[i - size_t(w)] * u.data[i - size_t(w)];
+        }
+        return m_diagonal.data[i] * u.data[i] - neighbours;
+    }
+
+    /// <summary>
+    /// Visits the rows of the operator in parallel: span(y, x0, x1, border) is called for the
+    /// interior segment of a row with border = false and for every other pixel with border = true
+    /// (x1 = x0 + 1). Returns the pairwise sum of the per-row results of span.
+    /// </summary>
+    template <typename Span>
+    double reduceRows(Span&& span) const
+    {
+        const int w = width();
+        const auto interior = StencilInterior(w, height(), StencilReach { 1, 1, 1, 1 });
+        return reproducibleSum<double>(height(), 1, kernelThreads(m_right, KernelCost::Light), [&](const int64_t row, const int64_t) {
+            const int y = int(row);
+            double sum = 0.0;
+            forEachStencilRow(
+                y, w, interior, [&](const int, const int x0, const int x1) { sum += span(y, x0, x1, false); },
+                [&](const int x, const int) { sum += span(y, x, x + 1, true); });
+            return sum;
+        });
+    }
+
+    /// <summary>
+    /// r = b - A u on the free pixels, 0 on the fixed ones.
+    /// </summary>
+    /// <returns>squared L2 norm of r</returns>
+    double residual(const ImageFloat& u, const ImageFloat& b, ImageFloat& r) const
+    {
+        const int w = width();
+        return reduceRows([&](const int y, const int x0, const int x1, const bool border) {
+            const size_t row = size_t(y) * size_t(w);
+            double norm2 = 0.0;
+            if (border) {
+                const size_t i = row + size_t(x0);
+                const float res = m_inverse.data[i] != 0.0f ? b.data[i] - applyAt(u, x0, y) : 0.0f;
+                r.data[i] = res;
+                return double(res) * double(res);
+            }
+            const float *pu = u.data.data() + row, *pb = b.data.data() + row, *right = m_right.data.data() + row, *down = m_down.data.data() + row;
+            const float *up = m_down.data.data() + row - size_t(w), *diagonal = m_diagonal.data.data() + row, *inverse = m_inverse.data.data() + row;
+            float* pr = r.data.data() + row;
+#pragma omp simd reduction(+ : norm2)
+            for (int x = x0; x < x1; x++) {
+                const float au = diagonal[x] * pu[x] - (right[x] * pu[x + 1] + right[x - 1] * pu[x - 1] + down[x] * pu[x + w] + up[x] * pu[x - w]);
+                const float res = inverse[x] != 0.0f ? pb[x] - au : 0.0f;
+                pr[x] = res;
+                norm2 += double(res) * double(res);
+            }
+            return norm2;
+        });
+    }
+
+    /// <summary>
+    /// q = A p on the free pixels, 0 on the fixed ones.
+    /// </summary>
+    /// <returns>dot product p . q</returns>
+    double apply(const ImageFloat& p, ImageFloat& q) const
+    {
+        const int w = width();
+        return reduceRows([&](const int y, const int x0, const int x1, const bool border) {
+            const size_t row = size_t(y) * size_t(w);
+            if (border) {
+                const size_t i = row + size_t(x0);
+                q.data[i] = m_inverse.data[i] != 0.0f ? applyAt(p, x0, y) : 0.0f;
+                return double(p.data[i]) * double(q.data[i]);
+            }
+            const float *pp = p.data.data() + row, *right = m_right.data.data() + row, *down = m_down.data.data() + row;
+            const float *up = m_down.data.data() + row - size_t(w), *diagonal = m_diagonal.data.data() + row, *inverse = m_inverse.data.data() + row;
+            float* pq = q.data.data() + row;
+            double dot = 0.0;
+#pragma omp simd reduction(+ : dot)
+            for (int x = x0; x < x1; x++) {
+                const float ap = diagonal[x] * pp[x] - (right[x] * pp[x + 1] + right[x - 1] * pp[x - 1] + down[x] * pp[x + w] + up[x] * pp[x - w]);
+                pq[x] = inverse[x] != 0.0f ? ap : 0.0f;
+                dot += double(pp[x]) * double(pq[x]);
+            }
+            return dot;
+        });
+    }
+
+    /// <summary>
+    /// One Jacobi sweep, next = u + omega (b - A u) / diag.
+    /// </summary>
+    /// <returns>largest |change| of a pixel</returns>
+    float jacobi(const ImageFloat& u, const ImageFloat& b, ImageFloat& next, const float omega = 1.0f) const
+    {
+        const int w = width();
+        float largest = 0.0f;
+        const auto interior = StencilInterior(w, height(), StencilReach { 1, 1, 1, 1 });
+#pragma omp parallel for num_threads(kernelThreads(m_right, KernelCost::Light)) reduction(max : largest)
+        for (int y = 0; y < height(); y++) {
+            const size_t row = size_t(y) * size_t(w);
+            forEachStencilRow(
+                y, w, interior,
+                [&](const int, const int x0, const int x1) {
+                    const float *pu = u.data.data() + row, *pb = b.data.data() + row, *right = m_right.data.data() + row, *down = m_down.data.data() + row;
+                    const float *up = m_down.data.data() + row - size_t(w), *diagonal = m_diagonal.data.data() + row, *inverse = m_inverse.data.data() + row;
+                    float* out = next.data.data() + row;
+#pragma omp simd reduction(max : largest)
+                    for (int x = x0; x < x1; x++) {
+                        const float au = diagonal[x] * pu[x] - (right[x] * pu[x + 1] + right[x - 1] * pu[x - 1] + down[x] * pu[x + w] + up[x] * pu[x - w]);
+                        const float delta = omega * inverse[x] * (pb[x] - au);
+                        out[x] = pu[x] + delta;
+                        largest = std::max(largest, std::abs(delta));
+                    }
+                },
+                [&](const int x, const int) {
+                    const size_t i = row + size_t(x);
+                    const float delta = omega * m_inverse.data[i] * (b.data[i] - applyAt(u, x, y));
+                    next.data[i] = u.data[i] + delta;
+                    largest = std::max(largest, std::abs(delta));
+                });
+        }
+        return largest;
+    }
+
+    /// <summary>
+    /// Red-black SOR sweeps in place, omega = 1 is Gauss-Seidel. Reversed sweeps update black
+    /// before red, the adjoint of the forward ones.
+    /// </summary>
+    /// <returns>largest |change| of a pixel in the last sweep</returns>
+    float relax(ImageFloat& u, const ImageFloat& b, const int num_sweeps, const float omega = 1.0f, const bool reversed = false) const
+    {
+        const int w = width();
+        float largest = 0.0f;
+        const auto interior = StencilInterior(w, height(), StencilReach { 1, 1, 1, 1 });
+        for (int sweep = 0; sweep < num_sweeps; sweep++) {
+            largest = 0.0f;
+            for (int pass = 0; pass < 2; pass++) {
+                const int color = reversed ? 1 - pass : pass;
+#pragma omp parallel for num_threads(kernelThreads(m_right, KernelCost::Light)) reduction(max : largest)
+                for (int y = 0; y < height(); y++) {
+                    const size_t row = size_t(y) * size_t(w);
+                    forEachStencilRow(
+                        y, w, interior,
+                        [&](const int, const int x0, const int x1) {
+                            // Every second pixel of the segment, starting at the first of this color.
+                            float* pu = u.data.data() + row;
+                            const float *pb = b.data.data() + row, *right = m_right.data.data() + row, *down = m_down.data.data() + row;
+                            const float *up = m_down.data.data() + row - size_t(w), *diagonal = m_diagonal.data.data() + row, *inverse = m_inverse.data.data() + row;
+                            for (int x = x0 + ((x0 + y + color) & 1); x < x1; x += 2) {
+                                const float au = diagonal[x] * pu[x] - (right[x] * pu[x + 1] + right[x - 1] * pu[x - 1] + down[x] * pu[x + w] + up[x] * pu[x - w]);
+                                const float delta = omega * inverse[x] * (pb[x] - au);
+                                pu[x] += delta;
+                                largest = std::max(largest, std::abs(delta));
+                            }
+                        },
+                        [&](const int x, const int) {
+                            if (((x + y) & 1) != color) {
+                                return;
+                            }
+                            const size_t i = row + size_t(x);
+                            const float delta = omega * m_inverse.data[i] * (b.data[i] - applyAt(u, x, y));
+                            u.data[i] += delta;
+                            largest = std::max(largest, std::abs(delta));
+                        });
+                }
+            }
+        }
+        return largest;
+    }
+
+    /// <summary>
+    /// Operator of the next coarser multigrid level, (width / 2 + 1) x (height / 2 + 1), see above.
+    /// Coarse node (i, j) is fixed when fine node (2i, 2j) (clamped to the image) is.
+    /// </summary>
+    StencilOperator coarsen() const
+    {
+        const int fw = width(), fh = height();
+        const int cw = fw / 2 + 1, ch = fh / 2 + 1;
+        ImageFloat right(cw, ch), down(cw, ch), center(cw, ch);
+        BinaryMask fixed(cw, ch);
+        // Conductance of the fine path from node (x, y) two steps along (dx, dy) at the coarse spacing. On an even
+        // side the last coarse node lies one pixel beyond the image, on the last fine node: that path is one step
+        // long, half the coarse spacing, so it conducts twice as much.
+        const auto path = [&](const ImageFloat& edges, const int x, const int y, const int dx, const int dy) {
+            const float first = edges.data[size_t(y) * size_t(fw) + size_t(x)];
+            if ((dx > 0 && x + 1 >= fw - 1) || (dy > 0 && y + 1 >= fh - 1)) {
+                return 2.0f * first;
+            }
+            const float second = edges.data[size_t(y + dy) * size_t(fw) + size_t(x + dx)];
+            return first + second > 0.0f ? 2.0f * first * second / (first + second) : 0.0f;
+        };
+#pragma omp parallel for num_threads(kernelThreads(int64_t(cw) * ch, KernelCost::Medium))
+        for (int j = 0; j < ch; j++) {
+            for (int i = 0; i < cw; i++) {
+                const size_t c = size_t(j) * size_t(cw) + size_t(i);
+                const int x = std::min(2 * i, fw - 1), y = std::min(2 * j, fh - 1);
+                if (m_inverse.data[size_t(y) * size_t(fw) + size_t(x)] == 0.0f && m_diagonal.data[size_t(y) * size_t(fw) + size_t(x)] > 0.0f) {
+                    fixed.set(i, j, true);
+                }
+                float right_sum = 0.0f, right_weight = 0.0f, down_sum = 0.0f, down_weight = 0.0f, center_sum = 0.0f, center_weight = 0.0f;
+                for (int d = -1; d <= 1; d++) {
+                    const float weight = d == 0 ? 2.0f : 1.0f;
+                    if (i + 1 < cw && 2 * i < fw - 1 && y + d >= 0 && y + d < fh) {
+                        right_sum += weight * path(m_right, 2 * i, y + d, 1, 0);
+                        right_weight += weight;
+                    }
+                    if (j + 1 < ch && 2 * j < fh - 1 && x + d >= 0 && x + d < fw) {
+                        down_sum += weight * path(m_down, x + d, 2 * j, 0, 1);
+                        down_weight += weight;
+                    }
+                    for (int e = -1; e <= 1; e++) {
+                        if (x + e >= 0 && x + e < fw && y + d >= 0 && y + d < fh) {
+                            const float wgt = weight * (e == 0 ? 2.0f : 1.0f);
+                            center_sum += wgt * centerAt(x + e, y + d);
+                            center_weight += wgt;
+                        }
+                    }
+                }
+                right.data[c] = right_weight > 0.0f ? right_sum / right_weight : 0.0f;
+                down.data[c] = down_weight > 0.0f ? down_sum / down_weight : 0.0f;
+                center.data[c] = 4.0f * center_sum / center_weight;
+            }
+        }
+        return StencilOperator(std::move(right), std::move(down), &center, StencilBoundary::Neumann, &fixed);
+    }
+
+private:
+    // Diagonal term c of a pixel, the diagonal without the conductances.
+    float centerAt(const int x, const int y) const
+    {
+        const int w = width();
+        const size_t i = size_t(y) * size_t(w) + size_t(x);
+        const float conductances = m_right.data[i] + (x > 0 ? m_right.data[i - 1] : 0.0f) + m_down.data[i] + (y > 0 ? m_down.data[i - size_t(w)] : 0.0f);
+        return std::max(m_diagonal.data[i] - conductances, 0.0f);
+    }
+
+    ImageFloat m_right;
+    ImageFloat m_down;
+    ImageFloat m_diagonal;
+    ImageFloat m_inverse;
+};
+
+/// <summary>
+/// Backends of solveStencil().
+/// </summary>
+enum class StencilMethod {
+    Jacobi,
+    RedBlackSor,
+    // Preconditioned with the diagonal.
+    ConjugateGradient,
+    // V-cycles.
+    Multigrid,
+    // Conjugate gradients preconditioned with a V-cycle, for strongly varying coefficients.
+    MultigridCG,
+};
+
+/// <summary>
+/// Stencil solver backend by name: jacobi, sor, cg, multigrid or mgcg.
+/// </summary>
+inline StencilMethod parseStencilMethod(const std::string& name)
+{
+    if (name == "jacobi") {
+        return StencilMethod::Jacobi;
+    } else if (name == "sor") {
+        return StencilMethod::RedBlackSor;
+    } else if (name == "cg") {
+        return StencilMethod::ConjugateGradient;
+    } else if (name == "multigrid") {
+        return StencilMethod::Multigrid;
+    } else if (name == "mgcg") {
+        return StencilMethod::MultigridCG;
+    }
+    std::cerr << "Unknown stencil solver: " << name << std::endl;
+    throw std::exception();
+}
+
+/// <summary>
+/// Settings of solveStencil().
+/// </summary>
+struct StencilSolveOptions {
+    StencilMethod method = StencilMethod::Multigrid;
+    // Stop when the residual drops below tolerance times the initial residual.
+    float tolerance = 1e-4f;
+    // Upper bound of the sweeps (Jacobi, SOR), iterations (CG, multigrid CG) or cycles (multigrid).
+    int max_iters = 100;
+    // Relaxation of Jacobi (default 1) and SOR (default 1.9), values <= 0 for the default.
+    float omega = 0.0f;
+    // Jacobi and SOR compute the residual every this many sweeps.
+    int check_every = 10;
+};
+
+/// <summary>
+/// One level of the multigrid hierarchy of solveStencil(). The unknowns and the right-hand side
+/// of the finest level belong to the caller.
+/// </summary>
+struct StencilLevel {
+    const StencilOperator* op;
+    ImageFloat u;
+    ImageFloat f;
+    ImageFloat r;
+    // Interpolated coarse correction.
+    ImageFloat e;
+};
+
+/// <summary>
+/// Coarse operators of a multigrid hierarchy, down to a few pixels across.
+/// </summary>
+inline std::vector<StencilOperator> coarsenStencilOperator(const StencilOperator& op)
+{
+    const int MIN_LEVEL_SIZE = 5;
+    std::vector<StencilOperator> coarse_ops;
+    while (true) {
+        const auto& coarsest = coarse_ops.empty() ? op : coarse_ops.back();
+        if (std::min(coarsest.width(), coarsest.height()) <= MIN_LEVEL_SIZE) {
+            break;
+        }
+        coarse_ops.push_back(coarsest.coarsen());
+    }
+    return coarse_ops;
+}
+
+/// <summary>
+/// Levels over an operator and its coarse operators (which must outlive them).
+/// </summary>
+inline std::vector<StencilLevel> makeStencilLevels(const StencilOperator& op, const std::vector<StencilOperator>& coarse_ops)
+{
+    std::vector<StencilLevel> levels;
+    levels.push_back({ &op, {}, {}, ImageFloat::uninitialized(op.width(), op.height()), ImageFloat::uninitialized(op.width(), op.height()) });
+    for (const auto& coarse : coarse_ops) {
+        const int cw = coarse.width(), ch = coarse.height();
+        levels.push_back({ &coarse, ImageFloat(cw, ch), ImageFloat(cw, ch), ImageFloat(cw, ch), ImageFloat::uninitialized(cw, ch) });
+    }
+    return levels;
+}
+
+/// <summary>
+/// Operator-dependent interpolation from a coarse level to a fine one (node (i, j) on fine node
+/// (2i, 2j), the last node of an even side on the last fine pixel). A fine node between two
+/// coarse nodes takes them weighted by its conductances to its two fine neighbours on them, a
+/// node between four takes its four interpolated neighbours weighted by its conductances. A
+/// correction flat within a region of strong coupling then stays flat up to the weak edges around
+/// it; for constant coefficients this is bilinear interpolation.
+/// </summary>
+class StencilInterpolation {
+public:
+    StencilInterpolation(const StencilOperator& fine_op, const int coarse_width, const int coarse_height)
+        : m_op(fine_op)
+        , m_fw(fine_op.width())
+        , m_fh(fine_op.height())
+        , m_cw(coarse_width)
+        , m_ch(coarse_height)
+    {
+    }
+
+    // Coarse column of fine column x, -1 between two coarse columns.
+    int coarseColumn(const int x) const { return x % 2 == 0 ? x / 2 : (x == m_fw - 1 ? m_cw - 1 : -1); }
+    int coarseRow(const int y) const { return y % 2 == 0 ? y / 2 : (y == m_fh - 1 ? m_ch - 1 : -1); }
+
+    // Weight of the left coarse node in fine node (x, y) between two coarse columns, the right one has 1 minus it.
+    float leftWeight(const int x, const int y) const { return share(at(m_op.right(), x - 1, y), at(m_op.right(), x, y)); }
+    // Weight of the upper coarse node in fine node (x, y) between two coarse rows.
+    float upperWeight(const int x, const int y) const { return share(at(m_op.down(), x, y - 1), at(m_op.down(), x, y)); }
+
+    // Conductances of fine node (x, y) to its left, right, upper and lower neighbour, normalized.
+    std::array<float, 4> centerWeights(const int x, const int y) const
+    {
+        std::array<float, 4> weights { at(m_op.right(), x - 1, y), at(m_op.right(), x, y), at(m_op.down(), x, y - 1), at(m_op.down(), x, y) };
+        const float sum = weights[0] + weights[1] + weights[2] + weights[3];
+        for (auto& weight : weights) {
+            weight = sum > 0.0f ? weight / sum : 0.25f;
+        }
+        return weights;
+    }
+
+private:
+    static float at(const ImageFloat& edges, const int x, const int y) { return edges.data[size_t(y) * size_t(edges.width) + size_t(x)]; }
+    static float share(const float first, const float second) { return first + second > 0.0f ? first / (first + second) : 0.5f; }
+
+    const StencilOperator& m_op;
+    int m_fw, m_fh, m_cw, m_ch;
+};
+
+/// <summary>
+/// Restriction of the fine residual into the right-hand side of the coarse level, the transpose
+/// of prolongateStencilCorrection() (for constant coefficients 4 times full weighting), 0 on the
+/// fixed coarse nodes.
+/// </summary>
+inline void restrictStencilResidual(const ImageFloat& fine_r, const StencilOperator& fine_op, const StencilOperator& coarse_op, ImageFloat& coarse_f)
+{
+    const int fw = fine_r.width, fh = fine_r.height, cw = coarse_f.width;
+    const StencilInterpolation interpolation(fine_op, cw, coarse_f.height);
+    const auto& fine_inverse = fine_op.inverseDiagonal();
+    const auto& inverse = coarse_op.inverseDiagonal();
+#pragma omp parallel for num_threads(kernelThreads(coarse_f, KernelCost::Medium))
+    for (int j = 0; j < coarse_f.height; j++) {
+        for (int i = 0; i < cw; i++) {
+            const size_t c = size_t(j) * size_t(cw) + size_t(i);
+            if (inverse.data[c] == 0.0f) {
+                coarse_f.data[c] = 0.0f;
+                continue;
+            }
+            const int x0 = std::min(2 * i, fw - 1), y0 = std::min(2 * j, fh - 1);
+            // Weight of this coarse node in the interpolation of every fine node around it.
+            const auto horizontal = [&](const int x, const int y) {
+                const float left = interpolation.leftWeight(x, y);
+                return x > x0 ? left : 1.0f - left;
+            };
+            const auto vertical = [&](const int x, const int y) {
+                const float upper = interpolation.upperWeight(x, y);
+                return y > y0 ? upper : 1.0f - upper;
+            };
+            float sum = 0.0f;
+            for (int y = std::max(y0 - 1, 0); y <= std::min(y0 + 1, fh - 1); y++) {
+                const int row = interpolation.coarseRow(y);
+                if (row >= 0 && row != j) {
+                    continue;
+                }
+                for (int x = std::max(x0 - 1, 0); x <= std::min(x0 + 1, fw - 1); x++) {
+                    const int column = interpolation.coarseColumn(x);
+                    const size_t f = size_t(y) * size_t(fw) + size_t(x);
+                    if ((column >= 0 && column != i) || fine_inverse.data[f] == 0.0f) {
+                        continue;
+                    }
+                    float weight = 1.0f;
+                    if (column < 0 && row < 0) {
+                        // Through the two interpolated neighbours next to this coarse node.
+                        const auto center = interpolation.centerWeights(x, y);
+                        weight = center[x > x0 ? 0 : 1] * vertical(x0, y) + center[y > y0 ? 2 : 3] * horizontal(x, y0);
+                    } else if (column < 0) {
+                        weight = horizontal(x, y);
+                    } else if (row < 0) {
+                        weight = vertical(x, y);
+                    }
+                    sum += weight * fine_r.data[f];
+                }
+            }
+            coarse_f.data[c] = sum;
+        }
+    }
+}
+
+/// <summary>
+/// Interpolation of the coarse correction to the free pixels of the fine level (see
+/// StencilInterpolation), 0 on the fixed ones.
+/// </summary>
+inline void prolongateStencilCorrection(const ImageFloat& coarse_u, const StencilOperator& fine_op, ImageFloat& fine_e)
+{
+    const int cw = coarse_u.width, fw = fine_e.width;
+    const StencilInterpolation interpolation(fine_op, cw, coarse_u.height);
+    const auto& inverse = fine_op.inverseDiagonal();
+    const auto coarse = [&](const int i, const int j) { return coarse_u.data[size_t(j) * size_t(cw) + size_t(i)]; };
+    // Fine nodes on a coarse row or column.
+    const auto edge = [&](const int x, const int y) {
+        const int i = interpolation.coarseColumn(x), j = interpolation.coarseRow(y);
+        if (i >= 0 && j >= 0) {
+            return coarse(i, j);
+        }
+        if (j >= 0) {
+            const float left = interpolation.leftWeight(x, y);
+            return left * coarse((x - 1) / 2, j) + (1.0f - left) * coarse((x + 1) / 2, j);
+        }
+        const float upper = interpolation.upperWeight(x, y);
+        return upper * coarse(i, (y - 1) / 2) + (1.0f - upper) * coarse(i, (y + 1) / 2);
+    };
+#pragma omp parallel for num_threads(kernelThreads(fine_e, KernelCost::Medium))
+    for (int y = 0; y < fine_e.height; y++) {
+        const bool coarse_row = interpolation.coarseRow(y) >= 0;
+        for (int x = 0; x < fw; x++) {
+            const size_t i = size_t(y) * size_t(fw) + size_t(x);
+            if (inverse.data[i] == 0.0f) {
+                fine_e.data[i] = 0.0f;
+            } else if (coarse_row || interpolation.coarseColumn(x) >= 0) {
+                fine_e.data[i] = edge(x, y);
+            } else {
+                const auto center = interpolation.centerWeights(x, y);
+                fine_e.data[i] = center[0] * edge(x - 1, y) + center[1] * edge(x + 1, y) + center[2] * edge(x, y - 1) + center[3] * edge(x, y + 1);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Dot product of two images of the same size, see reproducibleSum().
+/// </summary>
+inline double stencilDot(const ImageFloat& a, const ImageFloat& b)
+{
+    const auto size = int64_t(a.data.size());
+    return reproducibleSum<double>(size, REDUCTION_CHUNK, kernelThreads(size, KernelCost::Light), [&](const int64_t begin, const int64_t end) {
+        double sum = 0.0;
+#pragma omp simd reduction(+ : sum)
+        for (int64_t i = begin; i < end; i++) {
+            sum += double(a.data[i]) * double(b.data[i]);
+        }
+        return sum;
+    });
+}
+
+/// <summary>
+/// One V-cycle for A u = f at the given level, u updated in place.
+/// </summary>
+inline void runStencilVCycle(std::vector<StencilLevel>& levels, const size_t level, ImageFloat& u, const ImageFloat& f)
+{
+    const int PRE_SMOOTH = 2;
+    const int POST_SMOOTH = 2;
+    const int COARSEST_SWEEPS = 50;
+
+    auto& current = levels[level];
+    // Post-smoothing and the second half of the coarsest sweeps run in reverse, which keeps the
+    // cycle symmetric as a preconditioner.
+    if (level + 1 == levels.size()) {
+        current.op->relax(u, f, COARSEST_SWEEPS / 2);
+        current.op->relax(u, f, COARSEST_SWEEPS / 2, 1.0f, true);
+        return;
+    }
+    current.op->relax(u, f, PRE_SMOOTH);
+    current.op->residual(u, f, current.r);
+
+    auto& coarse = levels[level + 1];
+    restrictStencilResidual(current.r, *current.op, *coarse.op, coarse.f);
+    std::fill(coarse.u.data.begin(), coarse.u.data.end(), 0.0f);
+    runStencilVCycle(levels, level + 1, coarse.u, coarse.f);
+
+    // The correction e is added with the step that minimizes the energy of the error along it,
+    // (e . r) / (e . A e). Where the coarse operator misplaces a fixed boundary (between two
+    // coarse nodes, or an even side) the plain step overshoots; with this one no cycle diverges.
+    prolongateStencilCorrection(coarse.u, *current.op, current.e);
+    const double er = stencilDot(current.e, current.r);
+    const double eae = current.op->apply(current.e, current.r);
+    const float step = eae > 0.0 ? float(er / eae) : 0.0f;
+    const int64_t size = int64_t(u.data.size());
+#pragma omp parallel for simd num_threads(kernelThreads(size, KernelCost::Light))
+    for (int64_t i = 0; i < size; i++) {
+        u.data[i] += step * current.e.data[i];
+    }
+
+    current.op->relax(u, f, POST_SMOOTH, 1.0f, true);
+}
+
+/// <summary>
+/// Conjugate gradients preconditioned with the diagonal, or with a V-cycle when levels are
+/// given (flexible CG: the step of the cycles depends on the residual, so beta is Polak-Ribiere).
+/// u holds the initial solution and is updated.
+/// </summary>
+/// <returns>iterations run</returns>
+inline int solveStencilCG(const StencilOperator& op, const ImageFloat& b, ImageFloat& u, const double threshold2, const int max_iters, double& norm2,
+    std::vector<StencilLevel>* levels = nullptr)
+{
+    const int w = op.width(), h = op.height();
+    const auto size = int64_t(w) * h;
+    const int threads = kernelThreads(size, KernelCost::Light);
+    const auto& inverse = op.inverseDiagonal();
+    auto r = ImageFloat::uninitialized(w, h), z = ImageFloat::uninitialized(w, h), q = ImageFloat::uninitialized(w, h);
+    norm2 = op.residual(u, b, r);
+    // z = M^-1 r, returns r . z.
+    const auto precondition = [&] {
+        if (levels) {
+            std::fill(z.data.begin(), z.data.end(), 0.0f);
+            runStencilVCycle(*levels, 0, z, r);
+            return stencilDot(r, z);
+        }
+        return reproducibleSum<double>(size, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            double rz = 0.0;
+#pragma omp simd reduction(+ : rz)
+            for (int64_t i = begin; i < end; i++) {
+                z.data[i] = inverse.data[i] * r.data[i];
+                rz += double(r.data[i]) * double(z.data[i]);
+            }
+            return rz;
+        });
+    };
+    double rz = precondition();
+    auto p = z.clone();
+    int iter = 0;
+    while (iter < max_iters && norm2 > threshold2) {
+        const double pq = op.apply(p, q);
+        if (pq <= 0.0 || rz <= 0.0) {
+            break;
+        }
+        const auto alpha = float(rz / pq);
+        norm2 = reproducibleSum<double>(size, REDUCTION_CHUNK, threads, [&](const int64_t begin, const int64_t end) {
+            double sum = 0.0;
+#pragma omp simd reduction(+ : sum)
+            for (int64_t i = begin; i < end; i++) {
+                u.data[i] += alpha * p.data[i];
+                r.data[i] -= alpha * q.data[i];
+                sum += double(r.data[i]) * double(r.data[i]);
+            }
+            return sum;
+        });
+        iter++;
+        if (norm2 <= threshold2) {
+            break;
+        }
+        const double rz_next = precondition();
+        // Polak-Ribiere: z_next . (r_next - r) with r = r_next + alpha q; equal to rz_next for a fixed preconditioner.
+        const double beta = levels ? (rz_next + double(alpha) * stencilDot(q, z)) / rz : rz_next / rz;
+        rz = rz_next;
+        const auto beta_f = float(std::max(beta, 0.0));
+#pragma omp parallel for simd num_threads(threads)
+        for (int64_t i = 0; i < size; i++) {
+            p.data[i] = z.data[i] + beta_f * p.data[i];
+        }
+    }
+    // The true residual of the result rather than the recursively updated one.
+    norm2 = op.residual(u, b, r);
+    return iter;
+}
+
+/// <summary>
+/// Solves A u = b on the free pixels of the operator, see above.
+/// </summary>
+/// <param name="op">operator</param>
+/// <param name="b">right-hand side at the operator size</param>
+/// <param name="initial_solution">start of the iteration, and the values of the fixed pixels</param>
+/// <param name="options">backend, tolerance and iteration limit</param>
+/// <param name="stats">optional output of the iterations used and the final relative residual</param>
+/// <returns>u</returns>
+inline ImageFloat solveStencil(const StencilOperator& op, const ImageFloat& b, const ImageFloat& initial_solution, const StencilSolveOptions& options = {},
+    PoissonStats* stats = nullptr)
+{
+    const int w = op.width(), h = op.height();
+    if (b.width != w || b.height != h || initial_solution.width != w || initial_solution.height != h) {
+        std::cerr << "solveStencil: the right-hand side or the initial solution does not match the operator size." << std::endl;
+        throw std::exception();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    auto u = initial_solution.clone();
+    auto r = ImageFloat::uninitialized(w, h);
+    const double initial_norm2 = op.residual(u, b, r);
+    const double threshold2 = initial_norm2 * double(options.tolerance) * double(options.tolerance);
+    double norm2 = initial_norm2;
+    const int check_every = std::max(options.check_every, 1);
+
+    int iter = 0;
+    switch (options.method) {
+    case StencilMethod::Jacobi: {
+        const float omega = options.omega > 0.0f ? options.omega : 1.0f;
+        auto next = u.clone();
+        while (iter < options.max_iters && norm2 > threshold2) {
+            op.jacobi(u, b, next, omega);
+            std::swap(u, next);
+            iter++;
+            if (iter % check_every == 0 || iter == options.max_iters) {
+                norm2 = op.residual(u, b, r);
+            }
+        }
+        break;
+    }
+    case StencilMethod::RedBlackSor: {
+        const float omega = options.omega > 0.0f ? options.omega : 1.9f;
+        while (iter < options.max_iters && norm2 > threshold2) {
+            const int sweeps = std::min(check_every, options.max_iters - iter);
+            op.relax(u, b, sweeps, omega);
+            iter += sweeps;
+            norm2 = op.residual(u, b, r);
+        }
+        break;
+    }
+    case StencilMethod::ConjugateGradient:
+        iter = solveStencilCG(op, b, u, threshold2, options.max_iters, norm2);
+        break;
+    case StencilMethod::MultigridCG: {
+        const auto coarse_ops = coarsenStencilOperator(op);
+        auto levels = makeStencilLevels(op, coarse_ops);
+        iter = solveStencilCG(op, b, u, threshold2, options.max_iters, norm2, &levels);
+        break;
+    }
+    case StencilMethod::Multigrid:
+    default: {
+        const auto coarse_ops = coarsenStencilOperator(op);
+        auto levels = makeStencilLevels(op, coarse_ops);
+        while (iter < options.max_iters && norm2 > threshold2) {
+            runStencilVCycle(levels, 0, u, b);
+            norm2 = op.residual(u, b, r);
+            iter++;
+        }
+        break;
+    }
+    }
+
+    if (stats) {
+        stats->iterations = iter;
+        stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
+        stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return u;
+}
+
+/// <summary>
+/// Solves poisson equation in form grad^2 I = div G (the problem of solvePoisson(), 1px border
+/// of initial_solution fixed) with the stencil solver core.
+/// </summary>
+/// <param name="initial_solution">initial solution (also provides the Dirichlet border)</param>
+/// <param name="divergence_G">div G (at least the size of the solution)</param>
+/// <param name="options">backend, tolerance and iteration limit</param>
+/// <param name="stats">optional output of the iterations used and the final relative residual</param>
+/// <returns>luminance I</returns>
+inline ImageFloat solvePoissonStencil(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const StencilSolveOptions& options = {},
+    PoissonStats* stats = nullptr)
+{
+    const int w = initial_solution.width, h = initial_solution.height;
+    auto b = cropPoissonRhs(divergence_G, w, h);
+#pragma omp parallel for simd num_threads(kernelThreads(b, KernelCost::Light))
+    for (int64_t i = 0; i < int64_t(b.data.size()); i++) {
+        b.data[i] = -b.data[i];
+    }
+    return solveStencil(StencilOperator::laplacian(w, h, StencilBoundary::Dirichlet), b, initial_solution, options, stats);
+}
+
+#pragma endregion Stencil solver
@@ -0,0 +1,162 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+#include "execution.h"
+#include "scratch_arena.h"
+#include "simd.h"
+
+/*
+ * Non-temporal output of write-once full-frame kernels.
+ *
+ * A per-pixel pass over a large frame (the detail layer, the contrast reduction, the XYZ
+ * conversion, the normalization) writes an output that the next stage reads much later, if at
+ * all before it leaves the cache. An ordinary store first reads the destination line into the
+ * cache (read for ownership), so every output byte costs a read and a write of memory, and the
+ * lines evict the inputs and the working sets of other threads. Non-temporal stores write whole
+ * lines through the write-combining buffers instead, without reading or caching them.
+ *
+ * StreamingRow gives a kernel a row to write: the destination row itself for small outputs, or,
+ * when useStreamingStores() chooses the streaming mode, a row of scratch memory (see
+ * scratch_arena.h) that commit() then streams to the destination and fences. The pixel code is the
+ * same in both modes, so the results are bit-identical; the extra copy runs from L1. The kernels
+ * also prefetch the input rows of the next iteration (prefetchRow()) while streaming.
+ *
+ * The mode is chosen per kernel: outputs of at least KernelTuning::streaming_store_bytes are
+ * streamed (by default half the last-level cache, where an output no longer fits next to its
+ * inputs), when the images come from a memory resource that recycles buffers (the ImageBufferPool
+ * of a run, a batch or the service). Fresh pages of operator new are zeroed by the OS through the
+ * cache on their first write, and streaming into them is slower than ordinary stores. Stages of a
+ * runKernelTeam() never stream, since the next stage reads the rows back from the cache of the
+ * thread that wrote them. Without x86 non-temporal stores the rows are copied.
+ */
+
+#pragma region Streaming stores
+
+/// <summary>
+/// Bytes prefetched per prefetch instruction, one cache line.
+/// </summary>
+constexpr size_t PREFETCH_LINE_BYTES = 64;
+
+/// <summary>
+/// Whether a kernel writing output_bytes streams its rows, see above.
+/// </summary>
+inline bool useStreamingStores(const int64_t output_bytes)
+{
+    const int64_t threshold = currentKernelTuning().streaming_store_bytes;
+    // Fresh pages from operator new are zeroed by the OS through the cache first, see above.
+    return threshold > 0 && output_bytes >= threshold && !KernelTeam::current() && currentImageMemoryResource() != std::pmr::new_delete_resource();
+}
+
+/// <summary>
+/// RAII override of KernelTuning::streaming_store_bytes (process-wide), e.g. to time both modes.
+/// </summary>
+class StreamingStoreScope {
+public:
+    explicit StreamingStoreScope(const int64_t min_bytes)
+        : m_previous(currentKernelTuning().streaming_store_bytes)
+    {
+        currentKernelTuning().streaming_store_bytes = min_bytes;
+    }
+    ~StreamingStoreScope() { currentKernelTuning().streaming_store_bytes = m_previous; }
+
+    StreamingStoreScope(const StreamingStoreScope&) = delete;
+    StreamingStoreScope& operator=(const StreamingStoreScope&) = delete;
+
+private:
+    int64_t m_previous;
+};
+
+/// <summary>
+/// Copies count floats to dst with non-temporal stores, without fencing them.
+/// </summary>
+inline void streamFloats(float* dst, const float* src, const size_t count)
+{
+#if defined(HDR_SIMD_X86)
+    size_t i = 0;
+    for (; i < count && (reinterpret_cast<uintptr_t>(dst + i) & 15) != 0; i++) {
+        dst[i] = src[i];
+    }
+    for (; i + 4 <= count; i += 4) {
+        _mm_stream_ps(dst + i, _mm_loadu_ps(src + i));
+    }
+    for (; i < count; i++) {
+        dst[i] = src[i];
+    }
+#else
+    std::copy_n(src, count, dst);
+#endif
+}
+
+/// <summary>
+/// Orders the non-temporal stores of the calling thread before its later stores, so the threads
+/// that read the output after the kernel's barrier see them.
+/// </summary>
+inline void streamFence()
+{
+#if defined(HDR_SIMD_X86)
+    _mm_sfence();
+#endif
+}
+
+/// <summary>
+/// Prefetches bytes starting at address into the cache, for a row read soon.
+/// </summary>
+inline void prefetchRow(const void* address, const size_t bytes)
+{
+    const char* begin = static_cast<const char*>(address);
+    for (size_t offset = 0; offset < bytes; offset += PREFETCH_LINE_BYTES) {
+#if defined(HDR_SIMD_X86)
+        _mm_prefetch(begin + offset, _MM_HINT_T0);
+#elif defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(begin + offset, 0, 3);
+#endif
+    }
+}
+
+/// <summary>
+/// Output row of a kernel in the mode of useStreamingStores(), see above. T is a float or a vector of floats.
+/// </summary>
+template <typename T>
+class StreamingRow {
+public:
+    /// <param name="destination">row of the output image</param>
+    /// <param name="width">values of the row</param>
+    /// <param name="streaming">whether the row is streamed, from useStreamingStores()</param>
+    StreamingRow(T* destination, const int width, const bool streaming)
+        : m_destination(destination)
+        , m_width(size_t(width))
+        , m_row(streaming ? m_scratch.take<T>(m_width).data() : destination)
+    {
+    }
+
+    StreamingRow(const StreamingRow&) = delete;
+    StreamingRow& operator=(const StreamingRow&) = delete;
+
+    /// <summary>
+    /// Row the kernel writes.
+    /// </summary>
+    T* data() const { return m_row; }
+
+    /// <summary>
+    /// Streams a scratch row to the destination once the kernel has written it.
+    /// </summary>
+    void commit() const
+    {
+        static_assert(sizeof(T) % sizeof(float) == 0, "rows are streamed as floats");
+        if (m_row != m_destination) {
+            streamFloats(reinterpret_cast<float*>(m_destination), reinterpret_cast<const float*>(m_row), m_width * (sizeof(T) / sizeof(float)));
+            streamFence();
+        }
+    }
+
+private:
+    ScratchScope m_scratch;
+    T* m_destination;
+    size_t m_width;
+    T* m_row;
+};
+
+#pragma endregion Streaming stores
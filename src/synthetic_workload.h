@@ -0,0 +1,190 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <iostream>
+#include <numbers>
+#include <string>
+#include <vector>
+
+#include "binary_mask.h"
+#include "helpers.h"
+
+/*
+ * Synthetic HDR workloads of controlled size, dynamic range, edge density and mask shape.
+ *
+ * The kernels' cost depends on more than the pixel count: the bilateral grid and the range
+ * weights on the dynamic range, the tiled filters and the Poisson solvers converging on how
+ * many sharp edges there are, the masked passes on the mask's area and on how many rows and
+ * words its boundary crosses. makeSyntheticHdr() composes a smooth light field (a gradient and
+ * a bright spot) with piecewise-constant regions, the cells of a jittered-grid Voronoi diagram
+ * whose size sets the edge density, plus per-pixel texture, and maps the result to
+ * 2^-(stops/2) .. 2^(stops/2). makeSyntheticMask() is a centered star-shaped region with the
+ * requested area whose radius is modulated by more and stronger harmonics as the boundary
+ * complexity grows: a disk at 0, a ragged outline crossing every row many times at 1.
+ *
+ * Everything is a pure function of the pixel position and the seed, computed per row in
+ * parallel, so any size up to 16K x 16K is generated in a few seconds and the same parameters
+ * always give the same images. The benchmarks feed them in memory (see KernelBenchmarkOptions)
+ * and "--generate <dir>" writes them as the project's input files.
+ */
+
+#pragma region Synthetic workloads
+
+/// <summary>
+/// Parameters of a synthetic input, see above. The size is given separately.
+/// </summary>
+struct SyntheticWorkload {
+    // Luminance range of the HDR image in stops, values within 2^(-stops / 2) .. 2^(stops / 2).
+    float dynamic_range_stops = 20.0f;
+    // About this share of the pixels lie on an edge of more than a stop between two regions, 0 is smooth.
+    float edge_density = 0.02f;
+    // Share of the image covered by the mask, clipped where the shape leaves the image.
+    float mask_area = 0.25f;
+    // Boundary of the mask from 0 (ellipse) to 1 (ragged outline).
+    float mask_complexity = 0.0f;
+    uint32_t seed = 1;
+    // Float format of the written HDR images, "pfm" or "exr".
+    std::string format = "pfm";
+};
+
+/// <summary>
+/// Uniform value in [0, 1) of a position, a stream and a seed.
+/// </summary>
+inline float workloadHash(const int x, const int y, const uint32_t stream, const uint32_t seed)
+{
+    uint32_t hash = uint32_t(x) * 0x9E3779B1u ^ uint32_t(y) * 0x85EBCA77u ^ (stream + seed * 0x27D4EB2Fu) * 0xC2B2AE3Du;
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    hash *= 0x297A2D39u;
+    hash ^= hash >> 15;
+    return float(hash >> 8) * (1.0f / 16777216.0f);
+}
+
+/// <summary>
+/// Synthetic HDR image, see above.
+/// </summary>
+/// <param name="width">width of the image</param>
+/// <param name="height">height of the image</param>
+/// <param name="workload">dynamic range, edge density and seed</param>
+ImageRGB makeSyntheticHdr(const int width, const int height, const SyntheticWorkload& workload)
+{
+    // A jittered grid of one site per cell x cell square has about 2.5 / cell of its pixels next
+    // to a region boundary (boundary length 2 / cell per pixel, crossing 4 / pi pixels per unit);
+    // about 1.7 / cell differ from their right or lower neighbour by more than a stop.
+    const bool edges = workload.edge_density > 0.0f;
+    const float cell = edges ? std::max(1.7f / std::min(workload.edge_density, 1.0f), 2.0f) : 1.0f;
+    const float scale = float(std::max(width, height));
+    const float spot_x = 0.25f + 0.5f * workloadHash(0, 0, 1, workload.seed), spot_y = 0.25f + 0.5f * workloadHash(0, 0, 2, workload.seed);
+    const float phase = 2.0f * std::numbers::pi_v<float> * workloadHash(0, 0, 3, workload.seed);
+
+    auto image = ImageRGB::uninitialized(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Heavy))
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const float u = float(x) / scale, v = float(y) / scale;
+            const float dx = u - spot_x, dy = v - spot_y;
+            // Smooth light in [0, 1].
+            float level = 0.278f + 0.278f * std::sin(5.0f * u + phase) * std::cos(3.0f * v) + 0.444f * std::exp(-30.0f * (dx * dx + dy * dy));
+            glm::vec3 tint(1.0f, 0.8f + 0.2f * u, 0.7f + 0.3f * v);
+            if (edges) {
+                // Nearest site of the jittered grid among the 3 x 3 cells around the pixel.
+                const int cx = int(float(x) / cell), cy = int(float(y) / cell);
+                float best = INFINITY;
+                int site_x = 0, site_y = 0;
+                for (int j = cy - 1; j <= cy + 1; j++) {
+                    for (int i = cx - 1; i <= cx + 1; i++) {
+                        const float sx = (float(i) + workloadHash(i, j, 4, workload.seed)) * cell - float(x);
+                        const float sy = (float(j) + workloadHash(i, j, 5, workload.seed)) * cell - float(y);
+                        const float distance = sx * sx + sy * sy;
+                        if (distance < best) {
+                            best = distance;
+                            site_x = i;
+                            site_y = j;
+                        }
+                    }
+                }
+                level = 0.5f * level + 0.5f * workloadHash(site_x, site_y, 6, workload.seed);
+                tint *= glm::vec3(0.6f + 0.4f * workloadHash(site_x, site_y, 7, workload.seed), 0.6f + 0.4f * workloadHash(site_x, site_y, 8, workload.seed), 1.0f);
+            }
+            // Texture of a tenth of a stop.
+            const float texture = 0.1f * (workloadHash(x, y, 9, workload.seed) - 0.5f);
+            image.data[size_t(y) * size_t(width) + x] = std::exp2(workload.dynamic_range_stops * (std::clamp(level, 0.0f, 1.0f) - 0.5f) + texture) * tint;
+        }
+    }
+    return image;
+}
+
+/// <summary>
+/// Synthetic mask, see above: a region around the center whose radius in image-normalized
+/// coordinates is r0 * (1 + a * f(angle)), f a normalized sum of harmonics with random phases.
+/// </summary>
+/// <param name="width">width of the mask</param>
+/// <param name="height">height of the mask</param>
+/// <param name="workload">area, boundary complexity and seed</param>
+BinaryMask makeSyntheticMask(const int width, const int height, const SyntheticWorkload& workload)
+{
+    const float complexity = std::clamp(workload.mask_complexity, 0.0f, 1.0f);
+    const int harmonics = 1 + int(std::lround(63.0f * complexity));
+    const float amplitude = 0.6f * complexity;
+    // The radius per angle, tabulated: harmonic k has weight 1 / sqrt(k), the sum is scaled to [-1, 1].
+    constexpr int table_size = 1 << 14;
+    std::vector<float> radius(table_size, 0.0f);
+    float weight_sum = 0.0f, square_sum = 0.0f;
+    for (int k = 1; k <= harmonics; k++) {
+        const float weight = 1.0f / std::sqrt(float(k));
+        const float phase = 2.0f * std::numbers::pi_v<float> * workloadHash(k, 0, 10, workload.seed);
+        for (int i = 0; i < table_size; i++) {
+            radius[i] += weight * std::sin(float(k) * 2.0f * std::numbers::pi_v<float> * float(i) / float(table_size) + phase);
+        }
+        weight_sum += weight;
+        square_sum += 0.5f * weight * weight;
+    }
+    // Area of the shape in the [-1, 1]^2 square is pi r0^2 (1 + a^2 mean(f^2)), the whole square is 4.
+    const float mean_square = square_sum / (weight_sum * weight_sum);
+    const float r0 = std::sqrt(4.0f * std::clamp(workload.mask_area, 0.0f, 1.0f) / (std::numbers::pi_v<float> * (1.0f + amplitude * amplitude * mean_square)));
+    for (float& value : radius) {
+        value = r0 * (1.0f + amplitude * value / weight_sum);
+    }
+
+    BinaryMask mask(width, height);
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Medium))
+    for (int y = 0; y < height; y++) {
+        const float ny = (2.0f * float(y) + 1.0f) / float(height) - 1.0f;
+        for (int x = 0; x < width; x++) {
+            const float nx = (2.0f * float(x) + 1.0f) / float(width) - 1.0f;
+            const float angle = std::atan2(ny, nx) * (0.5f / std::numbers::pi_v<float>) + 0.5f;
+            const float r = radius[std::min(int(angle * float(table_size)), table_size - 1)];
+            if (nx * nx + ny * ny < r * r) {
+                mask.set(x, y, true);
+            }
+        }
+    }
+    return mask;
+}
+
+/// <summary>
+/// Writes synthetic_SIZE.pfm (or .exr) and synthetic_SIZE_mask.png of every size to a directory.
+/// </summary>
+/// <param name="sizes">side lengths of the square inputs</param>
+/// <param name="workload">parameters of the inputs</param>
+/// <param name="directory">output directory, created when missing</param>
+/// <param name="out">one line per written input</param>
+void writeSyntheticWorkloads(const std::vector<int>& sizes, const SyntheticWorkload& workload, const std::filesystem::path& directory, std::ostream& out)
+{
+    std::filesystem::create_directories(directory);
+    for (const int size : sizes) {
+        const auto name = "synthetic_" + std::to_string(size);
+        const auto hdr_path = directory / (name + "." + workload.format);
+        const auto mask_path = directory / (name + "_mask.png");
+        makeSyntheticHdr(size, size, workload).writeToFile(hdr_path);
+        const auto mask = makeSyntheticMask(size, size, workload);
+        mask.toImage().writeToFile(mask_path);
+        out << "Wrote " << hdr_path.string() << " and " << mask_path.string() << " (" << workload.dynamic_range_stops << " stops, edge density "
+            << workload.edge_density << ", mask area " << workload.mask_area << ", complexity " << workload.mask_complexity << ")" << std::endl;
+    }
+}
+
+#pragma endregion Synthetic workloads
@@ -0,0 +1,82 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include "execution.h"
+
+/*
+ * Task graph of pipeline stages.
+ *
+ * A stage is a node with the stages it depends on. run() executes the graph in waves: a wave is
+ * every node whose dependencies were all completed by the earlier waves, so independent branches
+ * (e.g. the source and the target gradients, or loading frame N + 1 while frame N is solved)
+ * run at the same time. The stages themselves are the OpenMP kernels of this project, so the
+ * threads are split between the nodes of a wave and each node runs its kernels in a nested
+ * parallel region with its share of the threads (see runConcurrently()); a wave of a single
+ * node gets all threads without nesting. As every kernel is independent of the thread count, so is the result.
+ *
+ * oneTBB's flow_graph would schedule nodes as soon as their inputs are ready, but would put a
+ * second thread pool next to the OpenMP one that runs the kernels; the waves keep one runtime.
+ */
+
+#pragma region Task graph
+
+/// <summary>
+/// Dependency graph of stages, see run().
+/// </summary>
+class TaskGraph {
+public:
+    using Node = int;
+
+    /// <summary>
+    /// Adds a stage that runs after the given (already added) stages.
+    /// </summary>
+    /// <param name="body">work of the stage</param>
+    /// <param name="dependencies">stages whose results the body reads</param>
+    /// <returns>the new node</returns>
+    Node add(std::function<void()> body, std::initializer_list<Node> dependencies = {})
+    {
+        int level = 0;
+        for (const Node dependency : dependencies) {
+            level = std::max(level, m_levels[dependency] + 1);
+        }
+        m_bodies.push_back(std::move(body));
+        m_levels.push_back(level);
+        return Node(m_bodies.size() - 1);
+    }
+
+    size_t size() const { return m_bodies.size(); }
+
+    /// <summary>
+    /// Runs every stage once, wave by wave, and clears the graph. The first exception thrown by
+    /// a stage is rethrown after its wave has finished.
+    /// </summary>
+    void run()
+    {
+        const int num_levels = m_levels.empty() ? 0 : *std::max_element(m_levels.begin(), m_levels.end()) + 1;
+        std::vector<std::vector<Node>> waves(static_cast<size_t>(num_levels));
+        for (size_t i = 0; i < m_levels.size(); i++) {
+            waves[static_cast<size_t>(m_levels[i])].push_back(Node(i));
+        }
+        for (const auto& wave : waves) {
+            runWave(wave);
+        }
+        m_bodies.clear();
+        m_levels.clear();
+    }
+
+private:
+    void runWave(const std::vector<Node>& wave)
+    {
+        // One item per node, the threads split evenly between them.
+        runConcurrently(int(wave.size()), ExecutionContext::concurrent(int(wave.size())), [&](const int i) { m_bodies[wave[i]](); });
+    }
+
+    std::vector<std::function<void()>> m_bodies;
+    // Wave of each node: 1 + the latest wave of its dependencies.
+    std::vector<int> m_levels;
+};
+
+#pragma endregion Task graph
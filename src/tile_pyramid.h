@@ -0,0 +1,274 @@
+#pragma once
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <framework/image.h>
+#include <framework/image_view.h>
+
+#include "execution.h"
+#include "tiled_image_store.h"
+
+/*
+ * Deep-zoom tile pyramids of an output, for viewers that load only the tiles on screen
+ * (OpenSeadragon and similar for Deep Zoom, slippy-map viewers for XYZ).
+ *
+ * Every level halves the one above it (ceil sizes, 2 x 2 box reduction; the last odd row or
+ * column is the mean of the pixels that exist) down to a single pixel (Deep Zoom) or a single
+ * tile (XYZ), and every level is cut into tile_size x tile_size tiles:
+ *
+ *  - DeepZoom writes "<name>.dzi" (the XML descriptor) and "<name>_files/<level>/<col>_<row>.<format>",
+ *    level 0 being 1 x 1 pixel and the last level the full image; tiles repeat `overlap` pixels of
+ *    their neighbours on every inner edge,
+ *  - Xyz writes "<name>/<z>/<x>/<y>.<format>", z 0 being the level that fits one tile; tiles have
+ *    no overlap and the ones on the right and bottom edges are not padded.
+ *
+ * TilePyramidWriter consumes the full-resolution image as strips of rows from top to bottom and
+ * keeps per level only the rows that the next tile row and the next reduction still need, so a
+ * pyramid of an image that does not fit in memory (a TiledImage) needs about two tile rows per
+ * level. The tiles completed by a strip are copied out and encoded concurrently
+ * (runConcurrently()), also those of the smaller levels that the strip completed.
+ *
+ * OutputSet writes the pyramids of the final images with setTilePyramid() ("tile_pyramid" setting).
+ */
+
+#pragma region Tile pyramid
+
+enum class TilePyramidLayout {
+    // No pyramid.
+    None,
+    // Microsoft Deep Zoom (.dzi descriptor and <name>_files directory).
+    DeepZoom,
+    // <z>/<x>/<y> tile directories.
+    Xyz,
+};
+
+struct TilePyramidParams {
+    TilePyramidLayout layout = TilePyramidLayout::None;
+    int tile_size = 256;
+    // Pixels of the neighbouring tiles repeated on inner tile edges (Deep Zoom only).
+    int overlap = 1;
+    // Extension of the tiles without the dot, any format of Image::writeToFile().
+    std::string format = "png";
+};
+
+/// <summary>
+/// Writes the tile pyramid of an image given as strips of rows, see above.
+/// </summary>
+template <typename T>
+class TilePyramidWriter {
+public:
+    /// <param name="path">descriptor (Deep Zoom) or tile directory (XYZ) of the pyramid, see above</param>
+    /// <param name="width">width of the full-resolution image</param>
+    /// <param name="height">height of the full-resolution image</param>
+    /// <param name="transform">output transform of the tiles, see Image::writeToFile()</param>
+    TilePyramidWriter(std::filesystem::path path, const int width, const int height, const TilePyramidParams& params = {}, const OutputTransform& transform = {})
+        : m_path(std::move(path))
+        , m_params(params)
+        , m_transform(transform)
+    {
+        if (width < 1 || height < 1 || params.tile_size < 1 || params.overlap < 0 || params.layout == TilePyramidLayout::None) {
+            std::cerr << "Invalid tile pyramid of a " << width << " x " << height << " image" << std::endl;
+            throw std::exception();
+        }
+        if (m_params.layout == TilePyramidLayout::Xyz) {
+            m_params.overlap = 0;
+        }
+        // Levels from the full image down to 1 x 1 pixel (Deep Zoom) or one tile (XYZ).
+        for (int w = width, h = height;; w = (w + 1) / 2, h = (h + 1) / 2) {
+            Level level;
+            level.width = w;
+            level.height = h;
+            m_levels.push_back(std::move(level));
+            if ((w == 1 && h == 1) || (m_params.layout == TilePyramidLayout::Xyz && w <= m_params.tile_size && h <= m_params.tile_size)) {
+                break;
+            }
+        }
+        const int count = int(m_levels.size());
+        const auto root = m_params.layout == TilePyramidLayout::DeepZoom ? m_path.parent_path() / (m_path.stem().string() + "_files") : m_path;
+        for (int i = 0; i < count; i++) {
+            Level& level = m_levels[i];
+            level.directory = root / std::to_string(count - 1 - i);
+            std::filesystem::create_directories(level.directory);
+            if (m_params.layout == TilePyramidLayout::Xyz) {
+                for (int col = 0; col < tileCount(level.width); col++) {
+                    std::filesystem::create_directories(level.directory / std::to_string(col));
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Number of levels, the full image included.
+    /// </summary>
+    int levelCount() const { return int(m_levels.size()); }
+
+    /// <summary>
+    /// Adds the next rows of the full-resolution image and writes the tiles they complete.
+    /// </summary>
+    void append(const ImageView<const T> rows)
+    {
+        if (rows.width != m_levels[0].width || m_levels[0].received + rows.height > m_levels[0].height) {
+            std::cerr << "Rows do not fit the tile pyramid" << std::endl;
+            throw std::exception();
+        }
+        appendToLevel(0, rows);
+        runConcurrently(int(m_pending.size()), ExecutionContext::concurrent(int(m_pending.size())),
+            [&](const int i) { m_pending[i].image.writeToFile(m_pending[i].path, 1.0f, 0.0f, 0, m_transform); });
+        m_pending.clear();
+    }
+
+    /// <summary>
+    /// Writes the descriptor once all rows are appended.
+    /// </summary>
+    void finish()
+    {
+        if (m_levels[0].received != m_levels[0].height) {
+            std::cerr << "Tile pyramid finished after " << m_levels[0].received << " of " << m_levels[0].height << " rows" << std::endl;
+            throw std::exception();
+        }
+        if (m_params.layout == TilePyramidLayout::DeepZoom) {
+            std::ofstream descriptor(m_path);
+            descriptor << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                       << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"" << m_params.format << "\" Overlap=\"" << m_params.overlap
+                       << "\" TileSize=\"" << m_params.tile_size << "\">\n"
+                       << "  <Size Width=\"" << m_levels[0].width << "\" Height=\"" << m_levels[0].height << "\"/>\n"
+                       << "</Image>\n";
+            if (!descriptor) {
+                std::cerr << "Failed to write " << m_path << std::endl;
+                throw std::exception();
+            }
+        }
+    }
+
+private:
+    struct Level {
+        int width = 0, height = 0;
+        std::filesystem::path directory;
+        // Rows [first_row, first_row + rows.size() / width) of the level.
+        std::vector<T> rows;
+        int first_row = 0;
+        // Rows received so far, rows reduced into the next level and the next tile row to write.
+        int received = 0;
+        int reduced = 0;
+        int next_tile_row = 0;
+
+        const T* row(const int y) const { return rows.data() + size_t(y - first_row) * size_t(width); }
+    };
+
+    struct PendingTile {
+        std::filesystem::path path;
+        Image<T> image;
+    };
+
+    int tileCount(const int size) const { return (size + m_params.tile_size - 1) / m_params.tile_size; }
+
+    void appendToLevel(const int index, const ImageView<const T> rows)
+    {
+        Level& level = m_levels[index];
+        for (int y = 0; y < rows.height; y++) {
+            level.rows.insert(level.rows.end(), rows.row(y), rows.row(y) + rows.width);
+        }
+        level.received += rows.height;
+
+        if (index + 1 < levelCount()) {
+            // Pairs of rows into the next level; the last odd row once the level is complete.
+            const int end = level.received == level.height ? level.height : level.received & ~1;
+            const int count = (end - level.reduced + 1) / 2;
+            if (count > 0) {
+                const int next_width = m_levels[index + 1].width;
+                auto reduced = Image<T>::uninitialized(next_width, count);
+                parallelFor(0, count, int64_t(level.width) * 2, KernelCost::Light, [&](const int r) {
+                    const int y0 = level.reduced + 2 * r;
+                    const T* top = level.row(y0);
+                    const T* bottom = level.row(std::min(y0 + 1, level.height - 1));
+                    T* out = reduced.data.data() + size_t(r) * size_t(next_width);
+                    for (int x = 0; x < next_width; x++) {
+                        const int x0 = 2 * x, x1 = std::min(2 * x + 1, level.width - 1);
+                        out[x] = 0.25f * (top[x0] + top[x1] + bottom[x0] + bottom[x1]);
+                    }
+                });
+                level.reduced = std::min(level.reduced + 2 * count, level.height);
+                appendToLevel(index + 1, reduced.view());
+            }
+        }
+
+        // Tile rows whose pixels, overlap included, have all arrived.
+        const int tile_size = m_params.tile_size, overlap = m_params.overlap;
+        while (level.next_tile_row < tileCount(level.height) && level.received >= std::min((level.next_tile_row + 1) * tile_size + overlap, level.height)) {
+            const int row = level.next_tile_row++;
+            const int y0 = std::max(row * tile_size - overlap, 0);
+            const int y1 = std::min((row + 1) * tile_size + overlap, level.height);
+            for (int col = 0; col < tileCount(level.width); col++) {
+                const int x0 = std::max(col * tile_size - overlap, 0);
+                const int x1 = std::min((col + 1) * tile_size + overlap, level.width);
+                auto tile = Image<T>::uninitialized(x1 - x0, y1 - y0);
+                for (int y = y0; y < y1; y++) {
+                    std::copy(level.row(y) + x0, level.row(y) + x1, tile.data.data() + size_t(y - y0) * size_t(tile.width));
+                }
+                m_pending.push_back({ tilePath(level, col, row), std::move(tile) });
+            }
+        }
+
+        // Drop the rows that neither the next tile row nor the next reduction reads.
+        const int keep = std::min(std::max(level.next_tile_row * tile_size - overlap, 0), index + 1 < levelCount() ? level.reduced : level.height);
+        if (keep > level.first_row) {
+            level.rows.erase(level.rows.begin(), level.rows.begin() + ptrdiff_t(keep - level.first_row) * level.width);
+            level.first_row = keep;
+        }
+    }
+
+    std::filesystem::path tilePath(const Level& level, const int col, const int row) const
+    {
+        if (m_params.layout == TilePyramidLayout::Xyz) {
+            return level.directory / std::to_string(col) / (std::to_string(row) + "." + m_params.format);
+        }
+        return level.directory / (std::to_string(col) + "_" + std::to_string(row) + "." + m_params.format);
+    }
+
+    std::filesystem::path m_path;
+    TilePyramidParams m_params;
+    OutputTransform m_transform;
+    // Full image first.
+    std::vector<Level> m_levels;
+    std::vector<PendingTile> m_pending;
+};
+
+/// <summary>
+/// Writes the tile pyramid of an image in memory, see TilePyramidWriter.
+/// </summary>
+template <typename T>
+void writeTilePyramid(const ImageView<const T> image, const std::filesystem::path& path, const TilePyramidParams& params, const OutputTransform& transform = {})
+{
+    TilePyramidWriter<T> writer(path, image.width, image.height, params, transform);
+    for (int y = 0; y < image.height; y += params.tile_size) {
+        writer.append(image.subview(0, y, image.width, std::min(params.tile_size, image.height - y)));
+    }
+    writer.finish();
+}
+
+/// <summary>
+/// Writes the tile pyramid of an out-of-core image strip by strip, prefetching the next strip
+/// while the current one is reduced and encoded.
+/// </summary>
+template <typename T>
+void writeTilePyramid(TiledImage<T>& image, const std::filesystem::path& path, const TilePyramidParams& params, const OutputTransform& transform = {})
+{
+    TilePyramidWriter<T> writer(path, image.width(), image.height(), params, transform);
+    const int strip = std::max(image.tileSize(), params.tile_size);
+    for (int y = 0; y < image.height(); y += strip) {
+        const PixelRect rect { 0, y, image.width(), std::min(y + strip, image.height()) };
+        const auto rows = image.read(rect);
+        if (rect.y1 < image.height()) {
+            image.prefetch({ 0, rect.y1, image.width(), std::min(rect.y1 + strip, image.height()) });
+        }
+        writer.append(rows.view());
+    }
+    writer.finish();
+}
+
+#pragma endregion Tile pyramid
@@ -0,0 +1,312 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "execution.h"
+#include "stage_profiler.h"
+
+/*
+ * Work-stealing scheduler for tiles of uneven cost.
+ *
+ * A static "omp for" splits the tiles evenly by count, so when a few tiles cost far more than
+ * the rest (windows around a mask, dense bilateral tiles, a region of interest) most threads go
+ * idle while one finishes. schedule(dynamic) balances, but hands out tiles from one shared
+ * counter in global order, so a thread's tiles are scattered over the whole image.
+ *
+ * TileScheduler gives every thread a contiguous range of the tiles, the same bands the static
+ * schedule would give it (and so the pages it first touched, see imageRowsFirstTouch()). A
+ * thread takes grain tiles at a time from the front of its range; when its range is empty it
+ * steals the back half of the remaining range of another thread, so large imbalances move in a
+ * few steals and tiles stay in runs. The ranges are single atomic words updated with CAS, no
+ * locks. The scheduler is created before the parallel region and every thread of the region
+ * calls run(), so per-thread scratch buffers stay in the region as before:
+ *
+ *     TileScheduler scheduler("bilateralFilterTiled", num_tiles);
+ *     #pragma omp parallel
+ *     {
+ *         std::vector<float> scratch(...);
+ *         scheduler.run([&](const int tile) { ... });
+ *     }
+ *
+ * Every tile runs exactly once on some thread; kernels that write each output pixel from one
+ * tile give the same result for any schedule. While the StageProfiler is enabled, the tiles,
+ * steals and busy times per thread are summed per scheduler name in the TileBalanceReport.
+ *
+ * The scheduler runs for the job of the thread that creates it (see job_control.h): tiles done
+ * are reported to the job, every tile starts with a checkpoint (a preempted job sleeps there),
+ * and once the job is cancelled no further tile is started. The remaining tiles are skipped, so
+ * the caller calls throwIfCancelled() after the region.
+ */
+
+#pragma region Tile scheduler
+
+/// <summary>
+/// Load balance of one or more scheduler runs.
+/// </summary>
+struct TileBalanceStats {
+    uint64_t runs = 0;
+    uint64_t tiles = 0;
+    uint64_t steals = 0;
+    // Sums over the runs of the busiest thread's and of the mean busy time.
+    double max_busy_ms = 0.0;
+    double mean_busy_ms = 0.0;
+
+    // Busiest thread over the mean, 1 is a perfect balance.
+    double imbalance() const { return mean_busy_ms > 0.0 ? max_busy_ms / mean_busy_ms : 1.0; }
+
+    void add(const TileBalanceStats& other)
+    {
+        runs += other.runs;
+        tiles += other.tiles;
+        steals += other.steals;
+        max_busy_ms += other.max_busy_ms;
+        mean_busy_ms += other.mean_busy_ms;
+    }
+};
+
+/// <summary>
+/// Process-wide load balance per scheduler name, filled while the StageProfiler is enabled.
+/// </summary>
+class TileBalanceReport {
+public:
+    static TileBalanceReport& instance()
+    {
+        static TileBalanceReport report;
+        return report;
+    }
+
+    void record(const std::string& name, const TileBalanceStats& stats)
+    {
+        std::lock_guard lock(m_mutex);
+        m_stats[name].add(stats);
+    }
+
+    /// <summary>
+    /// Table of the schedulers: runs, tiles, steals and the imbalance of the busy times.
+    /// </summary>
+    void print(std::ostream& out) const
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_stats.empty()) {
+            return;
+        }
+        out << std::left << std::setw(32) << "tile scheduler" << std::right << std::setw(7) << "runs" << std::setw(10) << "tiles" << std::setw(10) << "steals"
+            << std::setw(12) << "max/mean" << std::endl;
+        for (const auto& [name, stats] : m_stats) {
+            out << std::left << std::setw(32) << name << std::right << std::setw(7) << stats.runs << std::setw(10) << stats.tiles << std::setw(10) << stats.steals
+                << std::fixed << std::setprecision(2) << std::setw(12) << stats.imbalance() << std::defaultfloat << std::endl;
+        }
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, TileBalanceStats> m_stats;
+};
+
+/// <summary>
+/// Work-stealing distribution of num_tiles tasks over the threads of one parallel region, see above.
+/// </summary>
+class TileScheduler {
+public:
+    /// <param name="name">name in the TileBalanceReport</param>
+    /// <param name="num_tiles">number of tasks, run as 0 .. num_tiles - 1</param>
+    /// <param name="grain">tiles a thread takes from its own range at a time</param>
+    /// <param name="num_threads">size of the team that will call run()</param>
+    TileScheduler(const char* name, const int num_tiles, const int grain = 1, const int num_threads = getThreadCount())
+        : m_name(name)
+        , m_num_tiles(std::max(num_tiles, 0))
+        , m_grain(std::max(grain, 1))
+        , m_slots(size_t(std::max(num_threads, 1)))
+        , m_profile(StageProfiler::instance().enabled())
+        , m_job(currentJobControl())
+        , m_progress(m_name, m_num_tiles, m_job)
+    {
+        const auto threads = int64_t(m_slots.size());
+        for (int64_t t = 0; t < threads; t++) {
+            m_slots[size_t(t)].range.store(pack(uint32_t(t * m_num_tiles / threads), uint32_t((t + 1) * m_num_tiles / threads)), std::memory_order_relaxed);
+        }
+    }
+
+    ~TileScheduler()
+    {
+        if (m_profile) {
+            TileBalanceReport::instance().record(m_name, stats());
+        }
+    }
+
+    TileScheduler(const TileScheduler&) = delete;
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+    /// <summary>
+    /// Runs tiles on the calling thread until no thread has any left or the job is cancelled.
+    /// Called by every thread of the parallel region; threads beyond num_threads have no range of
+    /// their own and only steal.
+    /// </summary>
+    /// <param name="tile_fn">called as tile_fn(tile)</param>
+    template <typename TileFn>
+    void run(const TileFn& tile_fn)
+    {
+        // Kernels nested in a tile run without the job, it is checked between the tiles and an
+        // exception must not leave the parallel region.
+        const JobControlScope detached(nullptr);
+        const int num_slots = int(m_slots.size());
+        const int thread = threadIndex();
+        Slot* own = thread < num_slots ? &m_slots[size_t(thread)] : nullptr;
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t tiles = 0, steals = 0;
+        const auto run_range = [&](const uint32_t begin, const uint32_t end) {
+            for (uint32_t tile = begin; tile < end && !checkpoint(); tile++) {
+                tile_fn(int(tile));
+                tiles++;
+                m_progress.add();
+            }
+        };
+
+        while (!cancelled()) {
+            uint32_t begin, end;
+            while (own && !cancelled() && takeFront(own->range, begin, end)) {
+                run_range(begin, end);
+            }
+            // Own range is empty: take the back half of another range.
+            bool stolen = false;
+            for (int k = 1; k <= num_slots && !stolen; k++) {
+                const int victim_index = (thread + k) % num_slots;
+                if (own && victim_index == thread) {
+                    continue;
+                }
+                auto& victim = m_slots[size_t(victim_index)].range;
+                uint64_t value = victim.load(std::memory_order_acquire);
+                while (true) {
+                    const auto [victim_begin, victim_end] = unpack(value);
+                    if (victim_begin >= victim_end) {
+                        break;
+                    }
+                    const uint32_t split = victim_end - (victim_end - victim_begin + 1) / 2;
+                    if (victim.compare_exchange_weak(value, pack(victim_begin, split), std::memory_order_acq_rel)) {
+                        if (own) {
+                            // Only thieves write a non-empty range, and the own range is empty.
+                            own->range.store(pack(split, victim_end), std::memory_order_release);
+                        } else {
+                            run_range(split, victim_end);
+                        }
+                        stolen = true;
+                        steals++;
+                        break;
+                    }
+                }
+            }
+            if (!stolen) {
+                break;
+            }
+        }
+
+        if (own) {
+            own->tiles.fetch_add(tiles, std::memory_order_relaxed);
+            own->steals.fetch_add(steals, std::memory_order_relaxed);
+            own->busy_us.fetch_add(uint64_t(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+            own->ran.store(true, std::memory_order_relaxed);
+        } else {
+            m_unowned.tiles.fetch_add(tiles, std::memory_order_relaxed);
+            m_unowned.steals.fetch_add(steals, std::memory_order_relaxed);
+        }
+    }
+
+    /// <summary>
+    /// True once the job of the scheduler is cancelled.
+    /// </summary>
+    bool cancelled() const { return m_job && m_job->cancelled(); }
+
+    /// <summary>
+    /// Checkpoint of the job before a tile, see JobControl::checkpoint().
+    /// </summary>
+    bool checkpoint() const { return m_job && m_job->checkpoint(); }
+
+    /// <summary>
+    /// Throws CancelledError when tiles were skipped for a cancelled job; called after the region.
+    /// </summary>
+    void throwIfCancelled() const { ::throwIfCancelled(m_job); }
+
+    /// <summary>
+    /// Load balance of the finished run.
+    /// </summary>
+    TileBalanceStats stats() const
+    {
+        TileBalanceStats result;
+        result.runs = 1;
+        double total_ms = 0.0;
+        int threads = 0;
+        for (const auto& slot : m_slots) {
+            const double busy_ms = double(slot.busy_us.load()) / 1000.0;
+            result.tiles += slot.tiles.load();
+            result.steals += slot.steals.load();
+            result.max_busy_ms = std::max(result.max_busy_ms, busy_ms);
+            total_ms += busy_ms;
+            threads += slot.ran.load() ? 1 : 0;
+        }
+        result.tiles += m_unowned.tiles.load();
+        result.steals += m_unowned.steals.load();
+        result.mean_busy_ms = total_ms / double(std::max(threads, 1));
+        return result;
+    }
+
+private:
+    // One cache line per thread, so a steal does not invalidate the ranges of other threads.
+    struct alignas(64) Slot {
+        // [begin, end) of the remaining tiles, begin in the high word.
+        std::atomic<uint64_t> range { 0 };
+        std::atomic<uint64_t> tiles { 0 }, steals { 0 }, busy_us { 0 };
+        // Whether a thread of the region ran on this range.
+        std::atomic<bool> ran { false };
+    };
+
+    static uint64_t pack(const uint32_t begin, const uint32_t end) { return (uint64_t(begin) << 32) | end; }
+    static std::pair<uint32_t, uint32_t> unpack(const uint64_t value) { return { uint32_t(value >> 32), uint32_t(value) }; }
+
+    static int threadIndex()
+    {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    // Takes up to grain tiles from the front of a range.
+    bool takeFront(std::atomic<uint64_t>& range, uint32_t& begin, uint32_t& end) const
+    {
+        uint64_t value = range.load(std::memory_order_acquire);
+        while (true) {
+            const auto [range_begin, range_end] = unpack(value);
+            if (range_begin >= range_end) {
+                return false;
+            }
+            const uint32_t taken_end = std::min(range_end, range_begin + uint32_t(m_grain));
+            if (range.compare_exchange_weak(value, pack(taken_end, range_end), std::memory_order_acq_rel)) {
+                begin = range_begin;
+                end = taken_end;
+                return true;
+            }
+        }
+    }
+
+    std::string m_name;
+    int m_num_tiles;
+    int m_grain;
+    std::vector<Slot> m_slots;
+    // Counts of threads beyond num_threads.
+    Slot m_unowned;
+    bool m_profile;
+    const JobControl* m_job;
+    JobProgressCounter m_progress;
+};
+
+#pragma endregion Tile scheduler
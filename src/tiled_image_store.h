@@ -0,0 +1,492 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <framework/float_image_io.h>
+#include <framework/image.h>
+#include <framework/image_view.h>
+
+#include "binary_mask.h"
+#include "tile_scheduler.h"
+#include "your_code_here.h"
+
+/*
+ * Out-of-core images: a TiledImage lives in a .f32 file (see float_image_io.h) and only a bounded
+ * set of square tiles is resident in memory.
+ *
+ * Tiles are loaded on first use (one read per tile row, the file stays a plain row-major .f32
+ * image that MappedImage and FloatImageReader open as well) and kept in a least recently used
+ * cache of memory_budget bytes. A tile is used through a Pin, which exposes it as an ImageView
+ * and keeps it resident; unpinned tiles are evicted least recently used first, written back when
+ * they were modified. The budget is exceeded only when more tiles are pinned at once than fit.
+ * prefetch() is a hint: a background thread loads the tiles of a region ahead of their use.
+ * Loads, write-backs and the cache bookkeeping are serialized by the store, the kernels run on
+ * pinned tiles concurrently.
+ *
+ * Region access (read() and write()) gathers and scatters across tiles, so a kernel with a halo
+ * reads its tile grown by the halo, runs unchanged on the in-memory window and writes back the
+ * core: transformTiles() does this for every tile under the TileScheduler, and with a halo of
+ * at least the reach of the kernel the result equals the kernel on the whole image (see
+ * bilateralFilterOutOfCore()).
+ */
+
+#pragma region Tiled image store
+
+/// <summary>
+/// Tile size and cache limit of a TiledImage.
+/// </summary>
+struct TiledImageParams {
+    int tile_size = 256;
+    // Bytes of resident tiles.
+    size_t memory_budget = size_t(256) << 20;
+};
+
+/// <summary>
+/// Cache counters of a TiledImage.
+/// </summary>
+struct TiledImageStats {
+    uint64_t hits = 0;
+    uint64_t loads = 0;
+    uint64_t evictions = 0;
+    uint64_t write_backs = 0;
+};
+
+/// <summary>
+/// Use of a pinned tile.
+/// </summary>
+enum class TileAccess {
+    Read,
+    // Modified in place, written back when evicted.
+    Write,
+    // Fully overwritten, the file contents are not loaded.
+    Overwrite,
+};
+
+/// <summary>
+/// Image of pixel type T (float or glm::vec3) stored in a .f32 file with a cache of resident tiles, see above.
+/// </summary>
+template <typename T>
+class TiledImage {
+    struct Tile {
+        std::unique_ptr<T[]> pixels;
+        int pins = 0;
+        bool dirty = false;
+        std::list<int>::iterator lru;
+    };
+
+public:
+    /// <summary>
+    /// Pinned tile, resident until the pin is destroyed.
+    /// </summary>
+    class Pin {
+    public:
+        Pin(TiledImage* image, const int tile, ImageView<T> view)
+            : m_image(image)
+            , m_tile(tile)
+            , view(view)
+        {
+        }
+        ~Pin()
+        {
+            if (m_image) {
+                m_image->unpin(m_tile);
+            }
+        }
+        Pin(Pin&& other) noexcept
+            : m_image(std::exchange(other.m_image, nullptr))
+            , m_tile(other.m_tile)
+            , view(other.view)
+        {
+        }
+        Pin(const Pin&) = delete;
+        Pin& operator=(const Pin&) = delete;
+        Pin& operator=(Pin&&) = delete;
+
+    private:
+        TiledImage* m_image;
+        int m_tile;
+
+    public:
+        // The tile pixels, stride tileRect(tile) width.
+        ImageView<T> view;
+    };
+
+    /// <summary>
+    /// Creates a new file of width x height pixels (zero, sparse where the file system allows).
+    /// </summary>
+    TiledImage(const std::filesystem::path& filePath, const int width, const int height, const TiledImageParams& params = {})
+        : m_width(width)
+        , m_height(height)
+        , m_params(params)
+    {
+        validateParams();
+        RawFloatHeader header;
+        header.width = uint32_t(width);
+        header.height = uint32_t(height);
+        header.channels = uint32_t(CHANNELS);
+        if (!filePath.parent_path().empty()) {
+            std::filesystem::create_directories(filePath.parent_path());
+        }
+        m_file = std::fopen(filePath.string().c_str(), "w+b");
+        if (!m_file || std::fwrite(&header, sizeof(header), 1, m_file) != 1 || std::fflush(m_file) != 0) {
+            std::cerr << "Failed to create tiled image " << filePath << std::endl;
+            throw std::exception();
+        }
+        std::filesystem::resize_file(filePath, sizeof(header) + size_t(width) * size_t(height) * sizeof(T));
+        initTiles();
+    }
+
+    /// <summary>
+    /// Opens an existing .f32 file of pixel type T for reading and writing.
+    /// </summary>
+    explicit TiledImage(const std::filesystem::path& filePath, const TiledImageParams& params = {})
+        : m_params(params)
+    {
+        validateParams();
+        RawFloatHeader header;
+        m_file = std::fopen(filePath.string().c_str(), "r+b");
+        if (!m_file || std::fread(&header, sizeof(header), 1, m_file) != 1 || header.magic != RawFloatHeader::MAGIC || header.version != RawFloatHeader::VERSION
+            || header.channels != uint32_t(CHANNELS)) {
+            std::cerr << "Image " << filePath << " is not a raw float image of " << CHANNELS << " channels" << std::endl;
+            throw std::exception();
+        }
+        m_width = int(header.width);
+        m_height = int(header.height);
+        initTiles();
+    }
+
+    ~TiledImage()
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_prefetch_wake.notify_all();
+        if (m_prefetcher.joinable()) {
+            m_prefetcher.join();
+        }
+        flush();
+        if (m_file) {
+            std::fclose(m_file);
+        }
+    }
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int tileSize() const { return m_params.tile_size; }
+    int tilesX() const { return m_tiles_x; }
+    int tileCount() const { return int(m_tiles.size()); }
+    PixelRect bounds() const { return { 0, 0, m_width, m_height }; }
+
+    /// <summary>
+    /// Pixels of a tile, clipped to the image.
+    /// </summary>
+    PixelRect tileRect(const int tile) const
+    {
+        const int x0 = (tile % m_tiles_x) * m_params.tile_size;
+        const int y0 = (tile / m_tiles_x) * m_params.tile_size;
+        return { x0, y0, std::min(x0 + m_params.tile_size, m_width), std::min(y0 + m_params.tile_size, m_height) };
+    }
+
+    TiledImageStats stats() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_stats;
+    }
+
+    /// <summary>
+    /// Pins a tile, loading it unless it is resident or overwritten.
+    /// </summary>
+    Pin pin(const int tile, const TileAccess access = TileAccess::Read)
+    {
+        std::lock_guard lock(m_mutex);
+        Tile& entry = acquire(tile, access);
+        entry.pins++;
+        entry.dirty |= access != TileAccess::Read;
+        const auto rect = tileRect(tile);
+        return Pin(this, tile, ImageView<T>(entry.pixels.get(), rect.x1 - rect.x0, rect.y1 - rect.y0, rect.x1 - rect.x0));
+    }
+
+    /// <summary>
+    /// Copies a region, which must lie inside the image.
+    /// </summary>
+    Image<T> read(const PixelRect& rect)
+    {
+        auto result = Image<T>::uninitialized(rect.x1 - rect.x0, rect.y1 - rect.y0);
+        forEachTileIn(rect, [&](const int tile, const PixelRect& part) {
+            const auto pinned = pin(tile);
+            const auto origin = tileRect(tile);
+            for (int y = part.y0; y < part.y1; y++) {
+                std::copy_n(pinned.view.row(y - origin.y0) + (part.x0 - origin.x0), part.x1 - part.x0,
+                    result.data.data() + size_t(y - rect.y0) * size_t(result.width) + (part.x0 - rect.x0));
+            }
+        });
+        return result;
+    }
+
+    /// <summary>
+    /// Writes pixels with their top-left corner at (x, y); they must lie inside the image.
+    /// </summary>
+    void write(const int x, const int y, const ImageView<const T> pixels)
+    {
+        const PixelRect rect { x, y, x + pixels.width, y + pixels.height };
+        forEachTileIn(rect, [&](const int tile, const PixelRect& part) {
+            const auto origin = tileRect(tile);
+            const bool whole = part.x0 == origin.x0 && part.y0 == origin.y0 && part.x1 == origin.x1 && part.y1 == origin.y1;
+            const auto pinned = pin(tile, whole ? TileAccess::Overwrite : TileAccess::Write);
+            for (int row = part.y0; row < part.y1; row++) {
+                std::copy_n(pixels.row(row - y) + (part.x0 - x), part.x1 - part.x0, pinned.view.row(row - origin.y0) + (part.x0 - origin.x0));
+            }
+        });
+    }
+
+    /// <summary>
+    /// Hint that the tiles of a region are used soon, they are loaded in the background.
+    /// </summary>
+    void prefetch(const PixelRect& rect)
+    {
+        {
+            std::lock_guard lock(m_mutex);
+            if (!m_prefetcher.joinable()) {
+                m_prefetcher = std::thread([this] { prefetchLoop(); });
+            }
+            forEachTileIn(rect, [&](const int tile, const PixelRect&) { m_prefetch_queue.push_back(tile); });
+        }
+        m_prefetch_wake.notify_one();
+    }
+
+    /// <summary>
+    /// Writes all modified resident tiles back to the file.
+    /// </summary>
+    void flush()
+    {
+        std::lock_guard lock(m_mutex);
+        for (int tile = 0; tile < int(m_tiles.size()); tile++) {
+            if (m_tiles[tile] && m_tiles[tile]->dirty) {
+                transferTile(tile, *m_tiles[tile], true);
+                m_tiles[tile]->dirty = false;
+            }
+        }
+        std::fflush(m_file);
+    }
+
+private:
+    static constexpr int CHANNELS = int(sizeof(T) / sizeof(float));
+
+    void validateParams() const
+    {
+        if (m_params.tile_size < 1) {
+            std::cerr << "Tiles need a size of at least 1, got " << m_params.tile_size << "." << std::endl;
+            throw std::exception();
+        }
+    }
+
+    void initTiles()
+    {
+        m_tiles_x = (m_width + m_params.tile_size - 1) / m_params.tile_size;
+        const int tiles_y = (m_height + m_params.tile_size - 1) / m_params.tile_size;
+        m_tiles.resize(size_t(m_tiles_x) * size_t(tiles_y));
+    }
+
+    size_t tileBytes(const int tile) const
+    {
+        const auto rect = tileRect(tile);
+        return size_t(rect.x1 - rect.x0) * size_t(rect.y1 - rect.y0) * sizeof(T);
+    }
+
+    template <typename Func>
+    void forEachTileIn(const PixelRect& rect, Func&& func) const
+    {
+        const auto clipped = rect.clamped(m_width, m_height);
+        if (clipped.empty()) {
+            return;
+        }
+        const int size = m_params.tile_size;
+        for (int ty = clipped.y0 / size; ty <= (clipped.y1 - 1) / size; ty++) {
+            for (int tx = clipped.x0 / size; tx <= (clipped.x1 - 1) / size; tx++) {
+                const int tile = ty * m_tiles_x + tx;
+                const auto origin = tileRect(tile);
+                func(tile, PixelRect { std::max(origin.x0, clipped.x0), std::max(origin.y0, clipped.y0), std::min(origin.x1, clipped.x1), std::min(origin.y1, clipped.y1) });
+            }
+        }
+    }
+
+    /// <summary>
+    /// Reads (or with write, writes) the rows of a tile from the file; the caller holds the lock.
+    /// </summary>
+    void transferTile(const int tile, Tile& entry, const bool write)
+    {
+        const auto rect = tileRect(tile);
+        const int w = rect.x1 - rect.x0;
+        for (int y = rect.y0; y < rect.y1; y++) {
+            const auto offset = int64_t(sizeof(RawFloatHeader)) + (int64_t(y) * m_width + rect.x0) * int64_t(sizeof(T));
+            T* row = entry.pixels.get() + size_t(y - rect.y0) * size_t(w);
+#ifdef _WIN32
+            const bool positioned = _fseeki64(m_file, offset, SEEK_SET) == 0;
+#else
+            const bool positioned = fseeko(m_file, off_t(offset), SEEK_SET) == 0;
+#endif
+            const bool transferred = positioned && (write ? std::fwrite(row, sizeof(T), size_t(w), m_file) : std::fread(row, sizeof(T), size_t(w), m_file)) == size_t(w);
+            if (!transferred) {
+                std::cerr << "Failed to " << (write ? "write" : "read") << " row " << y << " of tile " << tile << " of a tiled image" << std::endl;
+                throw std::exception();
+            }
+        }
+        (write ? m_stats.write_backs : m_stats.loads)++;
+    }
+
+    /// <summary>
+    /// Makes a tile resident and most recently used; the caller holds the lock.
+    /// </summary>
+    Tile& acquire(const int tile, const TileAccess access)
+    {
+        if (m_tiles[tile]) {
+            Tile& entry = *m_tiles[tile];
+            m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+            m_stats.hits++;
+            return entry;
+        }
+
+        // Evict least recently used unpinned tiles until the new one fits (or nothing is left to evict).
+        const size_t bytes = tileBytes(tile);
+        for (auto it = m_lru.end(); m_resident_bytes + bytes > m_params.memory_budget && it != m_lru.begin();) {
+            const int victim = *--it;
+            Tile& candidate = *m_tiles[victim];
+            if (candidate.pins > 0) {
+                continue;
+            }
+            if (candidate.dirty) {
+                transferTile(victim, candidate, true);
+            }
+            m_resident_bytes -= tileBytes(victim);
+            it = m_lru.erase(it);
+            m_tiles[victim].reset();
+            m_stats.evictions++;
+        }
+
+        m_tiles[tile] = std::make_unique<Tile>();
+        Tile& entry = *m_tiles[tile];
+        entry.pixels = std::make_unique_for_overwrite<T[]>(bytes / sizeof(T));
+        m_lru.push_front(tile);
+        entry.lru = m_lru.begin();
+        m_resident_bytes += bytes;
+        if (access != TileAccess::Overwrite) {
+            transferTile(tile, entry, false);
+        }
+        return entry;
+    }
+
+    void unpin(const int tile)
+    {
+        std::lock_guard lock(m_mutex);
+        m_tiles[tile]->pins--;
+    }
+
+    void prefetchLoop()
+    {
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_prefetch_wake.wait(lock, [&] { return m_stop || !m_prefetch_queue.empty(); });
+            if (m_stop) {
+                return;
+            }
+            const int tile = m_prefetch_queue.front();
+            m_prefetch_queue.pop_front();
+            try {
+                if (!m_tiles[tile]) {
+                    acquire(tile, TileAccess::Read);
+                }
+            } catch (const std::exception&) {
+                // Only a hint, the access itself reports the error.
+            }
+        }
+    }
+
+    int m_width = 0;
+    int m_height = 0;
+    TiledImageParams m_params;
+    int m_tiles_x = 0;
+    std::FILE* m_file = nullptr;
+
+    // Guards the tiles, the cache order, the file and the counters.
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<Tile>> m_tiles;
+    // Resident tiles, most recently used first.
+    std::list<int> m_lru;
+    size_t m_resident_bytes = 0;
+    TiledImageStats m_stats;
+
+    std::thread m_prefetcher;
+    std::condition_variable m_prefetch_wake;
+    std::deque<int> m_prefetch_queue;
+    bool m_stop = false;
+};
+
+/// <summary>
+/// Runs a tile kernel over a tiled image: func(window, core) receives the tile grown by halo
+/// pixels on each side (clipped to the image) and the tile in window coordinates, and returns
+/// the output pixels of the tile. The tiles run concurrently, with the next ones prefetched.
+/// </summary>
+/// <param name="input">image read by the kernel</param>
+/// <param name="output">image of the same size receiving the results</param>
+/// <param name="halo">reach of the kernel</param>
+/// <param name="func">tile kernel, Image&lt;U&gt;(const Image&lt;T&gt;&amp;, const PixelRect&amp;)</param>
+template <typename T, typename U, typename TileFunc>
+void transformTiles(TiledImage<T>& input, TiledImage<U>& output, const int halo, TileFunc&& func)
+{
+    if (input.width() != output.width() || input.height() != output.height()) {
+        std::cerr << "Tiled images of different sizes: " << input.width() << "x" << input.height() << " and " << output.width() << "x" << output.height() << std::endl;
+        throw std::exception();
+    }
+    const ScopedStage stage("transformTiles", uint64_t(input.width()) * uint64_t(input.height()));
+    const int lookahead = getThreadCount();
+    TileScheduler scheduler("transformTiles", input.tileCount());
+#pragma omp parallel num_threads(getThreadCount())
+    {
+        scheduler.run([&](const int tile) {
+            if (tile + lookahead < input.tileCount()) {
+                input.prefetch(input.tileRect(tile + lookahead).grown(halo, halo, halo, halo));
+            }
+            const auto core = input.tileRect(tile);
+            const auto window = core.grown(halo, halo, halo, halo).clamped(input.width(), input.height());
+            const Image<U> result = func(input.read(window), PixelRect { core.x0 - window.x0, core.y0 - window.y0, core.x1 - window.x0, core.y1 - window.y0 });
+            output.write(core.x0, core.y0, result.view());
+        });
+    }
+    scheduler.throwIfCancelled();
+}
+
+/// <summary>
+/// bilateralFilter() of an out-of-core intensity image, tile by tile with a halo of size / 2.
+/// Equal to bilateralFilter() of the whole image for the window engines (brute force, tiled,
+/// range LUT, SIMD); the global engines see each tile with its halo.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="result">output of the filtered intensity, the size of H</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="engine">implementation to use</param>
+void bilateralFilterOutOfCore(TiledImage<float>& H, TiledImage<float>& result, const int size, const float space_sigma, const float range_sigma,
+    const BilateralEngine engine = BilateralEngine::BruteForce)
+{
+    transformTiles(H, result, size / 2, [&](const ImageFloat& window, const PixelRect& core) {
+        const auto filtered = bilateralFilter(window, size, space_sigma, range_sigma, engine);
+        return ImageFloat(filtered.view(core.x0, core.y0, core.x1 - core.x0, core.y1 - core.y0));
+    });
+}
+
+#pragma endregion Tiled image store
@@ -0,0 +1,334 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <framework/image.h>
+
+#include "batch_file_reader.h"
+#include "compressed_image.h"
+#include "coro_stages.h"
+#include "decoded_image_cache.h"
+#include "tone_map_encode.h"
+#include "your_code_here.h"
+
+/*
+ * Batch tone mapping of many HDR files in one process.
+ *
+ * Every job is toneMap() of one input with one parameter set, written with toneMapToFile() so the
+ * float result is not allocated (toneMapCompressedIdle() with compress_idle, which takes less
+ * memory per job and admits more of them). Jobs are split
+ * by size: images with at least large_image_pixels pixels are processed one at a time with all
+ * threads in their kernels (intra-image parallelism), the others are spread over concurrent
+ * workers that each run their kernels with an equal share of the threads (inter-image
+ * parallelism). A worker reserves the estimated peak memory of its job from memory_budget before
+ * loading it and waits while the reservation does not fit, so the number of images in flight
+ * is bounded by memory as well as by the worker count. Sizes come from the file headers (see
+ * probeImage()) and the concurrent jobs start largest first. The results do not depend on the
+ * schedule, every kernel is independent of its thread count. An input of several jobs (one plate
+ * tone mapped with several parameter sets) is decoded once through the DecodedImageCache. The
+ * other inputs are read into memory ahead of their jobs, read_ahead files at a time and in the
+ * order the jobs start, by a BatchFileReader (io_uring on Linux), and decoded from the buffers, so
+ * a worker does not wait for the round trips of its file (float formats are read by their decoder).
+ *
+ * runToneMapBatchCoroutines() runs the same jobs as coroutines (see coro_stages.h): decodes and
+ * writes on a pool of io_threads, tone mapping on the compute workers, and up to
+ * max_concurrent_images jobs in flight, so a job waiting for its decode or write does not hold a
+ * compute worker. The memory budget is not used there; the jobs in flight bound the memory.
+ */
+
+#pragma region Tone mapping batch
+
+/// <summary>
+/// One input file tone mapped with one parameter set.
+/// </summary>
+struct ToneMapJob {
+    std::filesystem::path input;
+    std::filesystem::path output;
+    DurandParams params;
+};
+
+/// <summary>
+/// Scheduling limits of runToneMapBatch().
+/// </summary>
+struct ToneMapBatchOptions {
+    // Concurrent images, values <= 0 use one per thread.
+    int max_concurrent_images = 0;
+    // Bytes of images in flight, 0 for no limit.
+    size_t memory_budget = 0;
+    // Images with at least this many pixels run alone with all threads.
+    size_t large_image_pixels = size_t(8) << 20;
+    // Decode and write threads of runToneMapBatchCoroutines().
+    int io_threads = 2;
+    // Inputs wait for their base layer compressed, see toneMapCompressedIdle().
+    bool compress_idle = false;
+    // Input files of runToneMapBatch() read ahead of their decodes, 0 to read them in Image(path).
+    int read_ahead = 16;
+};
+
+/// <summary>
+/// Outcome of runToneMapBatch().
+/// </summary>
+struct ToneMapBatchStats {
+    int succeeded = 0;
+    int failed = 0;
+    double seconds = 0.0;
+};
+
+/// <summary>
+/// Pixel count of an image file from its header (see probeImage()), 0 when it cannot be read.
+/// </summary>
+size_t readImagePixelCount(const std::filesystem::path& filePath)
+{
+    try {
+        return probeImage(filePath).pixelCount();
+    } catch (const std::exception&) {
+        return 0;
+    }
+}
+
+/// <summary>
+/// Estimated peak bytes of toneMapDurand() on an image of the given size: the input and output
+/// RGB images, the log-luminance and the base layer. A compressed input (see
+/// toneMapCompressedIdle()) is assumed to take half its raw size.
+/// </summary>
+size_t estimateToneMapBytes(const size_t num_pixels, const bool compress_idle = false)
+{
+    const size_t input_bytes = compress_idle ? sizeof(glm::vec3) / 2 : sizeof(glm::vec3);
+    return num_pixels * (input_bytes + sizeof(glm::vec3) + 2 * sizeof(float));
+}
+
+/// <summary>
+/// Jobs for every HDR file (.hdr, .pfm, .exr) of a directory, or every path listed in a text
+/// file (one per line), times every parameter set. Outputs are named
+/// "<stem><suffix>.png" in output_dir, suffix being the name of the parameter set.
+/// </summary>
+/// <param name="inputs">directory or list file</param>
+/// <param name="output_dir">output directory</param>
+/// <param name="param_sets">(suffix, parameters) pairs</param>
+/// <returns>jobs sorted by input path</returns>
+std::vector<ToneMapJob> collectToneMapJobs(const std::filesystem::path& inputs, const std::filesystem::path& output_dir,
+    const std::vector<std::pair<std::string, DurandParams>>& param_sets = { { "", DurandParams {} } })
+{
+    std::vector<std::filesystem::path> files;
+    if (std::filesystem::is_directory(inputs)) {
+        for (const auto& entry : std::filesystem::directory_iterator(inputs)) {
+            const auto extension = entry.path().extension();
+            if (entry.is_regular_file() && (extension == ".hdr" || extension == ".pfm" || extension == ".exr")) {
+                files.push_back(entry.path());
+            }
+        }
+    } else {
+        std::ifstream list(inputs);
+        for (std::string line; std::getline(list, line);) {
+            if (!line.empty()) {
+                files.emplace_back(line);
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    std::vector<ToneMapJob> jobs;
+    for (const auto& file : files) {
+        for (const auto& [suffix, params] : param_sets) {
+            jobs.push_back({ file, output_dir / (file.stem().string() + suffix + ".png"), params });
+        }
+    }
+    return jobs;
+}
+
+/// <summary>
+/// Tone maps all jobs, see the scheduling policy above. Failing jobs are reported and skipped.
+/// </summary>
+/// <param name="jobs">jobs to run</param>
+/// <param name="options">concurrency and memory limits</param>
+/// <returns>counts and wall time</returns>
+ToneMapBatchStats runToneMapBatch(const std::vector<ToneMapJob>& jobs, const ToneMapBatchOptions& options = {})
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    std::atomic<int> succeeded = 0;
+    std::atomic<int> failed = 0;
+
+    std::map<std::filesystem::path, int> input_jobs;
+    for (const auto& job : jobs) {
+        input_jobs[job.input]++;
+    }
+    // Footprints from the file headers, once per input.
+    std::map<std::filesystem::path, size_t> input_bytes;
+    for (const auto& job : jobs) {
+        if (!input_bytes.contains(job.input)) {
+            input_bytes[job.input] = estimateToneMapBytes(readImagePixelCount(job.input), options.compress_idle);
+        }
+    }
+
+    // Large images first, one at a time, each with all threads; then the small ones, largest
+    // first so the small ones fill the budget left next to them and the batch does not end on a
+    // large image.
+    std::vector<const ToneMapJob*> large;
+    std::vector<std::pair<const ToneMapJob*, size_t>> small;
+    for (const auto& job : jobs) {
+        const size_t bytes = input_bytes[job.input];
+        if (bytes >= estimateToneMapBytes(options.large_image_pixels, options.compress_idle)) {
+            large.push_back(&job);
+        } else {
+            small.push_back({ &job, bytes });
+        }
+    }
+    std::stable_sort(small.begin(), small.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+    // Inputs of one job that stb_image.h decodes, read ahead in the order the jobs start.
+    std::map<const ToneMapJob*, size_t> read_index;
+    std::vector<std::filesystem::path> read_paths;
+    if (options.read_ahead > 0) {
+        const auto add_read = [&](const ToneMapJob* job) {
+            if (input_jobs.at(job->input) == 1 && !isFloatImageFile(job->input)) {
+                read_index[job] = read_paths.size();
+                read_paths.push_back(job->input);
+            }
+        };
+        std::for_each(large.begin(), large.end(), add_read);
+        for (const auto& [job, bytes] : small) {
+            add_read(job);
+        }
+    }
+    // A window of at least one file per worker, so a worker never waits for a read behind the
+    // inputs of workers waiting for memory.
+    const int total_threads = getThreadCount();
+    const int workers = std::max(std::min({ options.max_concurrent_images > 0 ? options.max_concurrent_images : total_threads, total_threads, int(small.size()) }), 1);
+    std::optional<BatchFileReader> reader;
+    if (!read_paths.empty()) {
+        reader.emplace(std::move(read_paths), std::max(options.read_ahead, workers), options.io_threads);
+    }
+
+    const auto load_input = [&](const ToneMapJob& job) {
+        const auto index = read_index.find(&job);
+        if (index == read_index.end()) {
+            return ImageRGB(job.input);
+        }
+        const auto bytes = reader->take(index->second);
+        return ImageRGB::fromMemory(bytes);
+    };
+    const auto run_job = [&](const ToneMapJob& job) {
+        try {
+            if (input_jobs.at(job.input) > 1) {
+                const auto hdr_image = decodedImageCache().load<ImageRGB>(job.input);
+                if (options.compress_idle) {
+                    toneMapCompressedIdle(hdr_image->clone(), job.params).writeToFile(job.output);
+                } else {
+                    toneMapToFile(*hdr_image, job.params, job.output);
+                }
+            } else if (options.compress_idle) {
+                toneMapCompressedIdle(load_input(job), job.params).writeToFile(job.output);
+            } else {
+                toneMapToFile(load_input(job), job.params, job.output);
+            }
+            succeeded++;
+        } catch (const std::exception&) {
+            std::cerr << "Tone mapping " << job.input << " failed." << std::endl;
+            failed++;
+        }
+    };
+
+    for (const ToneMapJob* job : large) {
+        run_job(*job);
+    }
+
+    // Small images on concurrent workers sharing the threads.
+    const int threads_per_worker = std::max(total_threads / workers, 1);
+    std::mutex memory_mutex;
+    std::condition_variable memory_released;
+    size_t bytes_in_flight = 0;
+    std::atomic<size_t> next_job = 0;
+    std::pmr::memory_resource* const resource = currentImageMemoryResource();
+
+#ifdef _OPENMP
+    const int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(std::max(max_levels, 2));
+#endif
+#pragma omp parallel num_threads(workers)
+    {
+        ImageMemoryScope memory_scope(resource);
+        setThreadCount(threads_per_worker);
+        for (size_t i = next_job++; i < small.size(); i = next_job++) {
+            const auto [job, bytes] = small[i];
+            {
+                // An image always fits when nothing else is in flight.
+                std::unique_lock lock(memory_mutex);
+                memory_released.wait(lock, [&] { return options.memory_budget == 0 || bytes_in_flight == 0 || bytes_in_flight + bytes <= options.memory_budget; });
+                bytes_in_flight += bytes;
+            }
+            run_job(*job);
+            {
+                std::lock_guard lock(memory_mutex);
+                bytes_in_flight -= bytes;
+            }
+            memory_released.notify_all();
+        }
+    }
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_levels);
+#endif
+
+    return { succeeded.load(), failed.load(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() };
+}
+
+/// <summary>
+/// One job of runToneMapBatchCoroutines(): decode on io, tone map on compute, write on io.
+/// </summary>
+Task<void> toneMapJobAsync(const ToneMapJob& job, StageExecutor& io, StageExecutor& compute, std::atomic<int>& succeeded, std::atomic<int>& failed)
+{
+    try {
+        auto hdr_image = co_await loadImageAsync<ImageRGB>(io, job.input);
+        co_await writeAsync(io, co_await toneMapAsync(compute, std::move(hdr_image), job.params), job.output);
+        succeeded++;
+    } catch (const std::exception&) {
+        std::cerr << "Tone mapping " << job.input << " failed." << std::endl;
+        failed++;
+    }
+}
+
+/// <summary>
+/// Tone maps all jobs as interleaved coroutines, see above. Failing jobs are reported and skipped.
+/// </summary>
+/// <param name="jobs">jobs to run</param>
+/// <param name="options">compute workers (max_concurrent_images, values <= 0 for one per thread), I/O threads</param>
+/// <returns>counts and wall time</returns>
+ToneMapBatchStats runToneMapBatchCoroutines(const std::vector<ToneMapJob>& jobs, const ToneMapBatchOptions& options = {})
+{
+    const auto start_time = std::chrono::steady_clock::now();
+    std::atomic<int> succeeded = 0;
+    std::atomic<int> failed = 0;
+
+    const int total_threads = getThreadCount();
+    const int workers = std::max(std::min({ options.max_concurrent_images > 0 ? options.max_concurrent_images : total_threads, total_threads, int(jobs.size()) }), 1);
+#ifdef _OPENMP
+    const int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(std::max(max_levels, 2));
+#endif
+    {
+        ThreadPoolExecutor io("batch io", options.io_threads, 1);
+        ThreadPoolExecutor compute("batch compute", workers);
+        // One job decoding and one writing next to each tone mapping.
+        TaskGroup group(3 * workers);
+        for (const auto& job : jobs) {
+            group.spawn(toneMapJobAsync(job, io, compute, succeeded, failed));
+        }
+        group.wait();
+    }
+#ifdef _OPENMP
+    omp_set_max_active_levels(max_levels);
+#endif
+
+    return { succeeded.load(), failed.load(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count() };
+}
+
+#pragma endregion Tone mapping batch
@@ -0,0 +1,221 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <utility>
+
+#include "dirty_region.h"
+#include "your_code_here.h"
+
+/*
+ * Local edits of a tone-mapped image.
+ *
+ * A colorist brightens a face or darkens a window and looks at the result after every stroke.
+ * ToneMapEditSession keeps the HDR image, its log-luminance, base layer and the tone-mapped
+ * result, and runs the Durand passes as a DirtyRegionGraph (see dirty_region.h):
+ *
+ *   hdr --pointwise--> log-luminance --window(radius)--> base layer
+ *   hdr, log-luminance, base layer --pointwise--> result (look included)
+ *
+ * so an edit of a rectangle recomputes the log-luminance of its tiles, the base layer within the
+ * filter radius of them (each run of tiles filtered from a window grown by another radius, like
+ * ToneMapSequence) and the result over the same tiles. With an engine that evaluates the exact
+ * window (BruteForce, Tiled, Simd) the result equals toneMap() of the edited image. Settings
+ * without a local footprint update more: auto_contrast derives the contrast from the whole base
+ * layer (global footprint of the compose pass), color_guide and the other engines filter the whole
+ * frame, and the other operators tone map it again.
+ *
+ * Above EDIT_FULL_FRACTION of the tiles a pass runs over the whole frame instead. A cancelled
+ * update leaves its tiles marked, so the next edit completes it.
+ */
+
+#pragma region Tone-mapping edit session
+
+/// <summary>
+/// Fraction of dirty tiles above which a pass of ToneMapEditSession runs over the whole frame.
+/// </summary>
+constexpr float EDIT_FULL_FRACTION = 0.5f;
+
+/// <summary>
+/// Tiles of a ToneMapEditSession and the ones the last edit recomputed.
+/// </summary>
+struct ToneMapEditStats {
+    int tiles = 0;
+    int edits = 0;
+    int input_tiles = 0;
+    int base_tiles = 0;
+    int result_tiles = 0;
+    double last_edit_ms = 0.0;
+};
+
+/// <summary>
+/// Tone mapping of one image under local edits, see above.
+/// </summary>
+class ToneMapEditSession {
+public:
+    /// <param name="hdr_image">linear HDR RGB image, the edits change it</param>
+    /// <param name="params">tone-mapping parameters</param>
+    /// <param name="tile_size">edge length of the dirty tiles</param>
+    ToneMapEditSession(ImageRGB hdr_image, const DurandParams& params, const int tile_size = DIRTY_TILE_SIZE)
+        : m_image(std::move(hdr_image))
+        , m_params(params)
+        , m_graph(m_image.width, m_image.height, tile_size)
+    {
+        m_source = m_graph.addSource("editInput");
+        if (params.tone_operator != ToneMapOperator::Durand) {
+            m_result_buffer = m_graph.addStage("toneMap", { { m_source, StageFootprint::global() } }, [this](const DirtyTiles&) { m_result = toneMap(m_image, m_params); });
+        } else {
+            m_log_buffer = m_graph.addStage("durandLogLuminance", { { m_source, StageFootprint::pointwise() } }, [this](const DirtyTiles& tiles) { updateLogLuminance(tiles); });
+            const int radius = params.filter_size / 2;
+            m_base_buffer = m_graph.addStage("bilateralFilter",
+                { { m_source, params.color_guide ? StageFootprint::global() : StageFootprint::pointwise() },
+                    { m_log_buffer, isWindowed(params) ? StageFootprint::window(radius) : StageFootprint::global() } },
+                [this](const DirtyTiles& tiles) { updateBaseLayer(tiles); });
+            m_result_buffer = m_graph.addStage("durandCompose",
+                { { m_source, StageFootprint::pointwise() }, { m_log_buffer, StageFootprint::pointwise() },
+                    { m_base_buffer, params.auto_contrast ? StageFootprint::global() : StageFootprint::pointwise() } },
+                [this](const DirtyTiles& tiles) { updateResult(tiles); });
+        }
+        m_graph.invalidateAll(m_source);
+        update();
+    }
+
+    /// <summary>
+    /// True when the base layer of an edit is filtered from the window around it only.
+    /// </summary>
+    static bool isWindowed(const DurandParams& params)
+    {
+        return !params.color_guide && (params.engine == BilateralEngine::BruteForce || params.engine == BilateralEngine::Tiled || params.engine == BilateralEngine::Simd);
+    }
+
+    const ImageRGB& image() const { return m_image; }
+    const ImageRGB& result() const { return m_result; }
+    const DurandParams& params() const { return m_params; }
+    const ToneMapEditStats& stats() const { return m_stats; }
+
+    /// <summary>
+    /// Changes the pixels of a rectangle of the image and updates the result.
+    /// </summary>
+    /// <param name="rect">rectangle the edit may change, clipped to the image</param>
+    /// <param name="body">called with the view of the clipped rectangle</param>
+    /// <returns>the updated result</returns>
+    const ImageRGB& edit(const PixelRect& rect, const std::function<void(ImageView<glm::vec3>)>& body)
+    {
+        const PixelRect clipped = rect.clamped(m_image.width, m_image.height);
+        if (!clipped.empty()) {
+            body(m_image.view(clipped.x0, clipped.y0, clipped.x1 - clipped.x0, clipped.y1 - clipped.y0));
+            m_graph.invalidate(m_source, clipped);
+        }
+        m_stats.edits++;
+        update();
+        return m_result;
+    }
+
+    /// <summary>
+    /// Scales the exposure of a rectangle by 2^stops.
+    /// </summary>
+    const ImageRGB& adjustExposure(const PixelRect& rect, const float stops)
+    {
+        const float gain = std::exp2(stops);
+        return edit(rect, [gain](const ImageView<glm::vec3> pixels) {
+#pragma omp parallel for num_threads(kernelThreads(int64_t(pixels.width) * pixels.height, KernelCost::Light))
+            for (int y = 0; y < pixels.height; y++) {
+                glm::vec3* row = pixels.row(y);
+                for (int x = 0; x < pixels.width; x++) {
+                    row[x] *= gain;
+                }
+            }
+        });
+    }
+
+private:
+    void update()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        m_graph.update();
+        m_stats.tiles = m_graph.numTiles();
+        m_stats.input_tiles = m_graph.lastDirtyTiles(m_source);
+        m_stats.base_tiles = m_params.tone_operator == ToneMapOperator::Durand ? m_graph.lastDirtyTiles(m_base_buffer) : 0;
+        m_stats.result_tiles = m_graph.lastDirtyTiles(m_result_buffer);
+        m_stats.last_edit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static bool wholeFrame(const DirtyTiles& tiles) { return float(tiles.count()) > EDIT_FULL_FRACTION * float(tiles.numTiles()); }
+
+    // Copies an image into a rectangle of another at (x0, y0).
+    template <typename T>
+    static void paste(const Image<T>& source, Image<T>& target, const int x0, const int y0)
+    {
+        for (int y = 0; y < source.height; y++) {
+            const T* row = source.data.data() + size_t(y) * size_t(source.width);
+            std::copy_n(row, source.width, target.data.data() + size_t(y0 + y) * size_t(target.width) + size_t(x0));
+        }
+    }
+
+    template <typename T>
+    static Image<T> crop(const Image<T>& image, const PixelRect& rect)
+    {
+        return Image<T>(image.view(rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0));
+    }
+
+    void updateLogLuminance(const DirtyTiles& tiles)
+    {
+        if (wholeFrame(tiles)) {
+            m_log_lum = durandLogLuminance(m_image, m_params);
+            return;
+        }
+        for (const auto& run : tiles.runs()) {
+            paste(durandLogLuminance(crop(m_image, run), m_params), m_log_lum, run.x0, run.y0);
+        }
+    }
+
+    void updateBaseLayer(const DirtyTiles& tiles)
+    {
+        if (!isWindowed(m_params) || wholeFrame(tiles)) {
+            m_base = durandBaseLayer(m_image, m_log_lum, m_params);
+            return;
+        }
+        // Every run is filtered from a window grown by the radius, so it equals the whole-frame filter.
+        const int radius = m_params.filter_size / 2;
+        for (const auto& run : tiles.runs()) {
+            const PixelRect window = run.grown(radius, radius, radius, radius).clamped(m_image.width, m_image.height);
+            const auto window_base = bilateralFilter(crop(m_log_lum, window), m_params.filter_size, m_params.space_sigma, m_params.range_sigma, m_params.engine);
+            paste(crop(window_base, PixelRect { run.x0 - window.x0, run.y0 - window.y0, run.x1 - window.x0, run.y1 - window.y0 }), m_base, run.x0, run.y0);
+        }
+    }
+
+    void updateResult(const DirtyTiles& tiles)
+    {
+        AutoContrast auto_contrast(m_params, m_image.width, m_image.height);
+        if (auto_contrast.stats()) {
+            addImageRows<float>(*auto_contrast.stats(), m_base);
+        }
+        const auto params = auto_contrast.resolve();
+        if (wholeFrame(tiles)) {
+            m_result = durandCompose(m_image, m_log_lum, m_base, params);
+            applyLook(m_result, params.look);
+            return;
+        }
+        for (const auto& run : tiles.runs()) {
+            auto result = durandCompose(crop(m_image, run), crop(m_log_lum, run), crop(m_base, run), params);
+            applyLook(result, params.look);
+            paste(result, m_result, run.x0, run.y0);
+        }
+    }
+
+    ImageRGB m_image;
+    DurandParams m_params;
+    DirtyRegionGraph m_graph;
+    DirtyRegionGraph::Buffer m_source = 0;
+    DirtyRegionGraph::Buffer m_log_buffer = 0;
+    DirtyRegionGraph::Buffer m_base_buffer = 0;
+    DirtyRegionGraph::Buffer m_result_buffer = 0;
+    // Intermediates of the Durand passes, kept between edits.
+    ImageFloat m_log_lum;
+    ImageFloat m_base;
+    ImageRGB m_result;
+    ToneMapEditStats m_stats;
+};
+
+#pragma endregion Tone-mapping edit session
@@ -0,0 +1,161 @@
+#pragma once
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include <framework/image.h>
+#include <framework/png_writer.h>
+#include <framework/tiff_writer.h>
+
+#include "your_code_here.h"
+
+/*
+ * Fused last pass and quantization of the Durand operator.
+ *
+ * durandCompose() materializes the tone-mapped RGB as floats, which writeToFile() reads again
+ * only to quantize them. durandComposeQuantized() rescales one row at a time into a row buffer
+ * that stays in the cache and quantizes it right away into the integer pixels handed to the
+ * encoder, so the float image is never allocated (12 bytes per pixel less at the peak, one pass
+ * over it less). The row goes through floatsToUint8() / floatsToUint16() like Image::quantizePixels(),
+ * so the file is the same as durandCompose(...).writeToFile(path). The look of the parameters
+ * (color_lut.h) grades the row buffer before it is quantized.
+ *
+ * Only integer outputs without dithering or output transform take this path; float and
+ * shared-memory outputs keep the floats anyway and fall back to writeToFile().
+ */
+
+#pragma region Fused encode
+
+/// <summary>
+/// Whether durandComposeToFile() can quantize while composing for this output path.
+/// </summary>
+inline bool isFusedEncodeOutput(const std::filesystem::path& filePath)
+{
+    return !isSharedImagePath(filePath) && !isFloatImageFile(filePath);
+}
+
+/// <summary>
+/// Interleaved 8- or 16-bit RGB of rows produced by fill_row(y, row) into a row buffer, quantized
+/// as Image::quantizePixels() does.
+/// </summary>
+/// <returns>width * height * 3 values</returns>
+template <typename Out, typename FillRow>
+std::vector<Out> quantizeRgbRows(const int width, const int height, const KernelCost cost, const FillRow& fill_row)
+{
+    static_assert(std::is_same_v<Out, uint8_t> || std::is_same_v<Out, uint16_t>);
+    std::vector<Out> pixels(size_t(width) * size_t(height) * 3);
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height, cost))
+    {
+        std::vector<glm::vec3> row(width);
+#pragma omp for
+        for (int y = 0; y < height; y++) {
+            fill_row(y, row.data());
+            const float* src = reinterpret_cast<const float*>(row.data());
+            Out* dst = pixels.data() + size_t(y) * size_t(width) * 3;
+            if constexpr (std::is_same_v<Out, uint8_t>) {
+                floatsToUint8(src, dst, size_t(width) * 3);
+            } else {
+                floatsToUint16(src, dst, size_t(width) * 3);
+            }
+        }
+    }
+    return pixels;
+}
+
+/// <summary>
+/// Encodes quantized RGB to an integer output file (isFusedEncodeOutput()) by extension.
+/// quantize(Out {}) returns the width * height * 3 values of type Out (uint8_t or uint16_t).
+/// </summary>
+template <typename Quantize>
+void writeQuantizedRgbFile(const std::filesystem::path& filePath, const int width, const int height, const Quantize& quantize)
+{
+    if (!std::filesystem::is_directory(filePath.parent_path())) {
+        std::filesystem::create_directories(filePath.parent_path());
+    }
+    const auto encoding = outputEncoding(filePath);
+    bool written = true;
+    if (encoding == ImageEncoding::Png16 || encoding == ImageEncoding::Tiff16) {
+        const auto pixels = quantize(uint16_t {});
+        written = encoding == ImageEncoding::Png16 ? writePng(filePath, width, height, 3, pixels.data()) : writeTiff(filePath, width, height, 3, pixels.data());
+    } else {
+        const auto pixels = quantize(uint8_t {});
+        const auto filePathStr = filePath.string();
+        written = encoding == ImageEncoding::Png ? writePng(filePath, width, height, 3, pixels.data()) : stbi_write_jpg(filePathStr.c_str(), width, height, 3, pixels.data(), 95) != 0;
+    }
+    if (!written) {
+        std::cerr << "Failed to write image " << filePath << std::endl;
+    }
+}
+
+/// <summary>
+/// Pass 3 of toneMapDurand() quantized to interleaved 8- or 16-bit RGB, see above.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="log_lum_H">durandLogLuminance() of the image</param>
+/// <param name="base_image">base layer, the bilateral filter of log_lum_H</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>width * height * 3 values, the quantizePixels() of durandCompose()</returns>
+template <typename Out>
+std::vector<Out> durandComposeQuantized(const ImageRGB& hdr_image, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params = {})
+{
+    const int width = hdr_image.width;
+    std::vector<Out> pixels;
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+        pixels = quantizeRgbRows<Out>(width, hdr_image.height, KernelCost::Medium, [&](const int y, glm::vec3* row) {
+            const size_t first = size_t(y) * size_t(width);
+            for (int x = 0; x < width; x++) {
+                const auto val = hdr_image.data[first + x];
+                const float b_val = base_image.data[first + x];
+                const float d_val = log_lum_H.data[first + x] - b_val;
+                const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, d_val, params.base_scale, params.output_gain);
+                row[x] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+            }
+            if (params.look) {
+                params.look->applyRow(row, row, width);
+            }
+        });
+    });
+    return pixels;
+}
+
+/// <summary>
+/// Writes pass 3 of toneMapDurand() to a file without the float result where the output format
+/// allows it (see isFusedEncodeOutput()), otherwise durandCompose(...).writeToFile(filePath).
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="log_lum_H">durandLogLuminance() of the image</param>
+/// <param name="base_image">base layer, the bilateral filter of log_lum_H</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <param name="filePath">output file, encoded by extension as Image::writeToFile()</param>
+void durandComposeToFile(const ImageRGB& hdr_image, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params, const std::filesystem::path& filePath)
+{
+    if (!isFusedEncodeOutput(filePath)) {
+        auto result = durandCompose(hdr_image, log_lum_H, base_image, params);
+        applyLook(result, params.look);
+        result.writeToFile(filePath);
+        return;
+    }
+    writeQuantizedRgbFile(filePath, hdr_image.width, hdr_image.height,
+        [&](auto zero) { return durandComposeQuantized<decltype(zero)>(hdr_image, log_lum_H, base_image, params); });
+}
+
+/// <summary>
+/// toneMap(hdr_image, params).writeToFile(filePath), with the last pass of the Durand operator
+/// fused with the quantization (see durandComposeToFile()).
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <param name="filePath">output file</param>
+void toneMapToFile(const ImageRGB& hdr_image, const DurandParams& params, const std::filesystem::path& filePath)
+{
+    if (params.tone_operator != ToneMapOperator::Durand) {
+        toneMap(hdr_image, params).writeToFile(filePath);
+        return;
+    }
+    const auto log_lum_H = durandLogLuminance(hdr_image, params);
+    AutoContrast auto_contrast(params, hdr_image.width, hdr_image.height);
+    const auto base_image = durandBaseLayer(hdr_image, log_lum_H, params, auto_contrast.stats());
+    durandComposeToFile(hdr_image, log_lum_H, base_image, auto_contrast.resolve(), filePath);
+}
+
+#pragma endregion Fused encode
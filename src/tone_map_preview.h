@@ -0,0 +1,512 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "your_code_here.h"
+
+/*
+ * Incremental tone mapping for interactive previews.
+ *
+ * toneMapDurand() is three passes: durandLogLuminance(), the bilateral filter and durandCompose().
+ * ToneMapPreview keeps the log-luminance and the base layer of its image together with the
+ * parameters they were computed from, and re-runs a pass only when one of its inputs changed:
+ * base_scale, output_gain and saturation re-run durandCompose() only, the filter parameters
+ * also the bilateral filter, the math precision all three. A render equals toneMapDurand(), or
+ * toneMap() in one pass for the other operators.
+ *
+ * For progressive previews a ToneMapPreview works on a downsampled copy of the image
+ * (downsampleHdr(), box filter). Its filter_size and space_sigma are scaled down by the same
+ * factor, so the preview shows the local contrast of the full-resolution result.
+ *
+ * ProgressiveToneMap renders a pyramid of such previews coarsest first (by default 1/8, 1/4, 1/2
+ * and the full resolution) and hands out every level as it is done, so the first image arrives
+ * after a fraction of the full-resolution time. Each level of the pyramid is downsampled from the
+ * next finer one, and each level keeps its passes between renders. The base layer of a finer
+ * level is not derived from a coarser one: the full-resolution level stays equal to
+ * toneMapDurand().
+ *
+ * RoiToneMap renders a rectangle of the full-resolution result for zoomed inspection. The
+ * output is cut into tiles of tile_size pixels that are kept between renders (least recently
+ * used ones evicted), so panning only computes the tiles that came into view, and the cost of a
+ * render depends on the viewport, not on the image. Missing tiles of a tile row are computed
+ * together from the HDR region around them: with a windowed engine (BruteForce, Tiled, Simd,
+ * RangeLut) a halo of filter_size / 2 pixels is all the bilateral filter reads, the range table
+ * of RangeLut is built over the log-luminance span of the whole frame, and the global operators
+ * use the luminance statistics of the whole frame. Both statistics are computed once and kept,
+ * so a region equals the same region of toneMap() of the whole image. The other engines, the
+ * color guide and the local Laplacian operator are not windowed: their first render tone maps
+ * the whole frame, and the tiles are cut from that.
+ */
+
+#pragma region Tone map preview
+
+/// <summary>
+/// Box-filtered copy of an image at 1 / factor of its size (at least 1 x 1).
+/// </summary>
+/// <param name="image">linear HDR RGB image</param>
+/// <param name="factor">downsampling factor, values <= 1 copy the image</param>
+/// <returns>downsampled image</returns>
+ImageRGB downsampleHdr(const ImageRGB& image, const int factor)
+{
+    if (factor <= 1) {
+        return image;
+    }
+    const int w = std::max(image.width / factor, 1);
+    const int h = std::max(image.height / factor, 1);
+    auto result = ImageRGB::uninitialized(w, h);
+#pragma omp parallel for
+    for (int y = 0; y < h; y++) {
+        const int y1 = std::min((y + 1) * factor, image.height);
+        for (int x = 0; x < w; x++) {
+            const int x1 = std::min((x + 1) * factor, image.width);
+            glm::vec3 sum(0.0f);
+            for (int sy = y * factor; sy < y1; sy++) {
+                for (int sx = x * factor; sx < x1; sx++) {
+                    sum += image.data[size_t(sy) * size_t(image.width) + size_t(sx)];
+                }
+            }
+            result.data[size_t(y) * size_t(w) + size_t(x)] = sum / float((y1 - y * factor) * (x1 - x * factor));
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Downsampled copies of an image for the given factors (at least 1), each box-filtered from the
+/// finest level whose factor divides it.
+/// </summary>
+/// <param name="image">linear HDR RGB image</param>
+/// <param name="factors">downsampling factors in any order</param>
+/// <returns>the images in the order of the factors</returns>
+std::vector<ImageRGB> buildHdrPyramid(const ImageRGB& image, const std::vector<int>& factors)
+{
+    std::vector<size_t> order(factors.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](const size_t a, const size_t b) { return factors[a] < factors[b]; });
+
+    std::vector<ImageRGB> levels(factors.size());
+    for (size_t k = 0; k < order.size(); k++) {
+        const int factor = std::max(factors[order[k]], 1);
+        // Finest level built so far that this one can be reduced from.
+        size_t parent = order.size();
+        for (size_t j = k; j-- > 0;) {
+            if (factor % std::max(factors[order[j]], 1) == 0) {
+                parent = j;
+                break;
+            }
+        }
+        if (parent == order.size()) {
+            levels[order[k]] = downsampleHdr(image, factor);
+        } else {
+            levels[order[k]] = downsampleHdr(levels[order[parent]], factor / std::max(factors[order[parent]], 1));
+        }
+    }
+    return levels;
+}
+
+/// <summary>
+/// Parameters at 1 / factor of the resolution: filter_size and space_sigma divided by the factor.
+/// </summary>
+DurandParams scaleDurandParams(const DurandParams& params, const int factor)
+{
+    auto scaled = params;
+    if (factor > 1) {
+        scaled.filter_size = std::max(params.filter_size / factor, 1) | 1;
+        scaled.space_sigma = std::max(params.space_sigma / float(factor), 0.1f);
+    }
+    return scaled;
+}
+
+/// <summary>
+/// Number of times each pass ran, and the time of the last render.
+/// </summary>
+struct ToneMapPreviewStats {
+    size_t log_luminance_runs = 0;
+    size_t bilateral_runs = 0;
+    size_t compose_runs = 0;
+    double last_render_ms = 0.0;
+};
+
+/// <summary>
+/// Tone mapping of one image that re-runs only the passes whose inputs changed, see above.
+/// </summary>
+class ToneMapPreview {
+public:
+    /// <param name="hdr_image">linear HDR RGB image</param>
+    /// <param name="downsample_factor">renders at 1 / downsample_factor of the image size</param>
+    explicit ToneMapPreview(const ImageRGB& hdr_image, const int downsample_factor = 1)
+        : m_image(downsampleHdr(hdr_image, downsample_factor))
+        , m_factor(std::max(downsample_factor, 1))
+    {
+    }
+
+    /// <summary>
+    /// Preview of an image that already is downsampled by downsample_factor.
+    /// </summary>
+    static ToneMapPreview ofDownsampled(ImageRGB downsampled_image, const int downsample_factor)
+    {
+        return ToneMapPreview(std::move(downsampled_image), std::max(downsample_factor, 1), 0);
+    }
+
+    const ImageRGB& image() const { return m_image; }
+    int downsampleFactor() const { return m_factor; }
+    const ToneMapPreviewStats& stats() const { return m_stats; }
+
+    /// <summary>
+    /// Parameters at the scale of the downsampled image, see scaleDurandParams().
+    /// </summary>
+    DurandParams scaledParams(const DurandParams& params) const { return scaleDurandParams(params, m_factor); }
+
+    /// <summary>
+    /// Tone-mapped image, valid until the next render.
+    /// </summary>
+    /// <param name="full_params">tone-mapping parameters at the full resolution</param>
+    const ImageRGB& render(const DurandParams& full_params)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto params = scaledParams(full_params);
+        if (params.tone_operator != ToneMapOperator::Durand) {
+            // One pass, the other operators have no intermediate layers worth keeping.
+            if (!m_result_params || !sameSinglePass(*m_result_params, params)) {
+                m_result = toneMap(m_image, params);
+                m_result_params = params;
+                m_stats.compose_runs++;
+            }
+            m_stats.last_render_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return m_result;
+        }
+        if (!m_log_params || m_log_params->math_precision != params.math_precision) {
+            m_log_lum = durandLogLuminance(m_image, params);
+            m_log_params = params;
+            m_base_params.reset();
+            m_stats.log_luminance_runs++;
+        }
+        if (!m_base_params || !sameBaseLayer(*m_base_params, params)) {
+            m_base = durandBaseLayer(m_image, m_log_lum, params);
+            m_base_params = params;
+            m_result_params.reset();
+            m_stats.bilateral_runs++;
+        }
+        if (!m_result_params || !sameComposition(*m_result_params, params)) {
+            m_result = durandCompose(m_image, m_log_lum, m_base, params);
+            applyLook(m_result, params.look);
+            m_result_params = params;
+            m_stats.compose_runs++;
+        }
+        m_stats.last_render_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return m_result;
+    }
+
+private:
+    ToneMapPreview(ImageRGB&& downsampled_image, const int downsample_factor, int)
+        : m_image(std::move(downsampled_image))
+        , m_factor(downsample_factor)
+    {
+    }
+
+    static bool sameBaseLayer(const DurandParams& a, const DurandParams& b)
+    {
+        return a.filter_size == b.filter_size && a.space_sigma == b.space_sigma && a.range_sigma == b.range_sigma && a.engine == b.engine
+            && a.color_guide == b.color_guide;
+    }
+    static bool sameComposition(const DurandParams& a, const DurandParams& b)
+    {
+        return a.base_scale == b.base_scale && a.output_gain == b.output_gain && a.saturation == b.saturation && a.math_precision == b.math_precision
+            && a.tone_operator == b.tone_operator && a.look == b.look;
+    }
+    static bool sameSinglePass(const DurandParams& a, const DurandParams& b)
+    {
+        return sameComposition(a, b) && a.range_sigma == b.range_sigma && a.key == b.key && a.white_point == b.white_point
+            && a.gradient_alpha == b.gradient_alpha && a.gradient_beta == b.gradient_beta && a.gradient_solver == b.gradient_solver;
+    }
+
+    ImageRGB m_image;
+    int m_factor;
+    // Parameters of the cached passes, empty when a pass has to run.
+    std::optional<DurandParams> m_log_params, m_base_params, m_result_params;
+    ImageFloat m_log_lum, m_base;
+    ImageRGB m_result;
+    ToneMapPreviewStats m_stats;
+};
+
+/// <summary>
+/// Coarse-to-fine renders of one image, see above.
+/// </summary>
+class ProgressiveToneMap {
+public:
+    /// <param name="hdr_image">linear HDR RGB image</param>
+    /// <param name="factors">downsampling factors of the levels, rendered from the largest to the smallest</param>
+    explicit ProgressiveToneMap(const ImageRGB& hdr_image, std::vector<int> factors = { 8, 4, 2, 1 })
+    {
+        std::sort(factors.begin(), factors.end(), std::greater<int>());
+        auto images = buildHdrPyramid(hdr_image, factors);
+        for (size_t i = 0; i < factors.size(); i++) {
+            m_levels.push_back(ToneMapPreview::ofDownsampled(std::move(images[i]), factors[i]));
+        }
+    }
+
+    size_t numLevels() const { return m_levels.size(); }
+    // Levels from the coarsest to the finest.
+    ToneMapPreview& level(const size_t index) { return m_levels[index]; }
+    const ToneMapPreview& level(const size_t index) const { return m_levels[index]; }
+
+    /// <summary>
+    /// Renders the levels from first_level on, coarsest first. on_level(result, level) is called
+    /// after each; returning false stops before the next level.
+    /// </summary>
+    /// <param name="params">tone-mapping parameters at the full resolution</param>
+    /// <param name="on_level">receives each result (valid during the call) and its level index</param>
+    /// <param name="first_level">index of the first level to render</param>
+    /// <returns>true when all levels were rendered</returns>
+    bool render(const DurandParams& params, const std::function<bool(const ImageRGB&, size_t)>& on_level, const size_t first_level = 0)
+    {
+        for (size_t i = first_level; i < m_levels.size(); i++) {
+            if (!on_level(m_levels[i].render(params), i) && i + 1 < m_levels.size()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<ToneMapPreview> m_levels;
+};
+
+/// <summary>
+/// Rectangle of an image in pixels.
+/// </summary>
+struct RoiRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+/// <summary>
+/// Tiles computed and taken from the cache, whole-frame renders and the time of the last render.
+/// </summary>
+struct RoiToneMapStats {
+    size_t tiles_computed = 0;
+    size_t tiles_reused = 0;
+    size_t full_frame_renders = 0;
+    double last_render_ms = 0.0;
+};
+
+/// <summary>
+/// Tone mapping of rectangles of one image with a tile cache, see above.
+/// </summary>
+class RoiToneMap {
+public:
+    /// <param name="hdr_image">linear HDR RGB image</param>
+    /// <param name="tile_size">edge length of the cached tiles</param>
+    /// <param name="max_cached_tiles">tiles kept between renders</param>
+    explicit RoiToneMap(std::shared_ptr<const ImageRGB> hdr_image, const int tile_size = 128, const size_t max_cached_tiles = 1024)
+        : m_image(std::move(hdr_image))
+        , m_tile_size(std::max(tile_size, 8))
+        , m_max_cached_tiles(std::max<size_t>(max_cached_tiles, 1))
+    {
+    }
+
+    const ImageRGB& image() const { return *m_image; }
+    const RoiToneMapStats& stats() const { return m_stats; }
+
+    /// <summary>
+    /// True when a region is computed from its surroundings only, false when the whole frame is tone mapped.
+    /// </summary>
+    static bool isWindowed(const DurandParams& params)
+    {
+        if (params.tone_operator == ToneMapOperator::Reinhard || params.tone_operator == ToneMapOperator::Filmic) {
+            return true;
+        }
+        return params.tone_operator == ToneMapOperator::Durand && !params.color_guide
+            && (params.engine == BilateralEngine::BruteForce || params.engine == BilateralEngine::Tiled || params.engine == BilateralEngine::Simd
+                || params.engine == BilateralEngine::RangeLut);
+    }
+
+    /// <summary>
+    /// Tone-mapped pixels of a rectangle, clipped to the image.
+    /// </summary>
+    /// <param name="roi">rectangle in pixels of the image</param>
+    /// <param name="params">tone-mapping parameters</param>
+    ImageRGB render(const RoiRect& roi, const DurandParams& params)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const int x0 = std::max(roi.x, 0);
+        const int y0 = std::max(roi.y, 0);
+        const int x1 = std::min(roi.x + roi.width, m_image->width);
+        const int y1 = std::min(roi.y + roi.height, m_image->height);
+        if (x1 <= x0 || y1 <= y0) {
+            std::cerr << "Region " << roi.x << "," << roi.y << " " << roi.width << "x" << roi.height << " is outside of the " << m_image->width << "x"
+                      << m_image->height << " image." << std::endl;
+            throw std::exception();
+        }
+        if (!m_params || !sameParams(*m_params, params)) {
+            m_tiles.clear();
+            m_full_frame.reset();
+            m_params = params;
+        }
+
+        // Missing tiles, computed in runs along each tile row.
+        const int tx0 = x0 / m_tile_size, tx1 = (x1 - 1) / m_tile_size;
+        const int ty0 = y0 / m_tile_size, ty1 = (y1 - 1) / m_tile_size;
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1;) {
+                if (m_tiles.contains({ tx, ty })) {
+                    m_stats.tiles_reused++;
+                    tx++;
+                    continue;
+                }
+                int run_end = tx + 1;
+                while (run_end <= tx1 && !m_tiles.contains({ run_end, ty })) {
+                    run_end++;
+                }
+                computeTiles(tx, run_end, ty, params);
+                tx = run_end;
+            }
+        }
+
+        auto result = ImageRGB::uninitialized(x1 - x0, y1 - y0);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                auto& tile = m_tiles.at({ tx, ty });
+                tile.last_use = ++m_use_counter;
+                const int cx0 = std::max(tx * m_tile_size, x0), cx1 = std::min((tx + 1) * m_tile_size, x1);
+                const int cy0 = std::max(ty * m_tile_size, y0), cy1 = std::min((ty + 1) * m_tile_size, y1);
+                for (int y = cy0; y < cy1; y++) {
+                    const auto* src = tile.image.data.data() + size_t(y - ty * m_tile_size) * size_t(tile.image.width) + size_t(cx0 - tx * m_tile_size);
+                    std::copy_n(src, cx1 - cx0, result.data.data() + size_t(y - y0) * size_t(result.width) + size_t(cx0 - x0));
+                }
+            }
+        }
+        evictTiles();
+        m_stats.last_render_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+private:
+    struct Tile {
+        ImageRGB image;
+        uint64_t last_use = 0;
+    };
+
+    static bool sameParams(const DurandParams& a, const DurandParams& b)
+    {
+        return a.filter_size == b.filter_size && a.space_sigma == b.space_sigma && a.range_sigma == b.range_sigma && a.base_scale == b.base_scale
+            && a.output_gain == b.output_gain && a.saturation == b.saturation && a.engine == b.engine && a.color_guide == b.color_guide
+            && a.math_precision == b.math_precision && a.tone_operator == b.tone_operator && a.key == b.key && a.white_point == b.white_point
+            && a.gradient_alpha == b.gradient_alpha && a.gradient_beta == b.gradient_beta && a.gradient_solver == b.gradient_solver && a.look == b.look;
+    }
+
+    /// <summary>
+    /// Computes the tiles [tx_begin, tx_end) of tile row ty from one region of the image.
+    /// </summary>
+    void computeTiles(const int tx_begin, const int tx_end, const int ty, const DurandParams& params)
+    {
+        const int x0 = tx_begin * m_tile_size, x1 = std::min(tx_end * m_tile_size, m_image->width);
+        const int y0 = ty * m_tile_size, y1 = std::min(y0 + m_tile_size, m_image->height);
+        const auto region = computeRegion({ x0, y0, x1 - x0, y1 - y0 }, params);
+        for (int tx = tx_begin; tx < tx_end; tx++) {
+            const int tile_x = tx * m_tile_size - x0;
+            m_tiles[{ tx, ty }] = { ImageRGB(region.view(tile_x, 0, std::min(m_tile_size, region.width - tile_x), region.height)), ++m_use_counter };
+            m_stats.tiles_computed++;
+        }
+    }
+
+    /// <summary>
+    /// Tone-mapped region, equal to the same region of toneMap() of the whole image.
+    /// </summary>
+    ImageRGB computeRegion(const RoiRect& region, const DurandParams& params)
+    {
+        if (!isWindowed(params)) {
+            if (!m_full_frame) {
+                m_full_frame = toneMap(*m_image, params);
+                m_stats.full_frame_renders++;
+            }
+            return ImageRGB(m_full_frame->view(region.x, region.y, region.width, region.height));
+        }
+        if (params.tone_operator != ToneMapOperator::Durand) {
+            if (!m_luminance_stats) {
+                m_luminance_stats = getLuminanceStats(*m_image);
+            }
+            auto result = toneMapGlobal(ImageRGB(m_image->view(region.x, region.y, region.width, region.height)), params, *m_luminance_stats);
+            applyLook(result, params.look);
+            return result;
+        }
+
+        // The region with the halo the filter window reads.
+        const int radius = params.filter_size / 2;
+        const int wx0 = std::max(region.x - radius, 0), wx1 = std::min(region.x + region.width + radius, m_image->width);
+        const int wy0 = std::max(region.y - radius, 0), wy1 = std::min(region.y + region.height + radius, m_image->height);
+        const ImageRGB window(m_image->view(wx0, wy0, wx1 - wx0, wy1 - wy0));
+        const auto log_lum_H = durandLogLuminance(window, params);
+        const auto base_image = params.engine == BilateralEngine::RangeLut
+            ? bilateralFilterRangeLutSpan(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, logLuminanceSpan(params.math_precision))
+            : bilateralFilter(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine);
+        const auto result = durandCompose(window, log_lum_H, base_image, params);
+        auto graded = ImageRGB(result.view(region.x - wx0, region.y - wy0, region.width, region.height));
+        applyLook(graded, params.look);
+        return graded;
+    }
+
+    /// <summary>
+    /// Maximum minus minimum of durandLogLuminance() of the whole image, computed once per precision.
+    /// </summary>
+    float logLuminanceSpan(const MathPrecision precision)
+    {
+        const auto cached = m_log_spans.find(precision);
+        if (cached != m_log_spans.end()) {
+            return cached->second;
+        }
+        float min_val = std::numeric_limits<float>::max();
+        float max_val = std::numeric_limits<float>::lowest();
+        const auto num_pixels = int(m_image->data.size());
+        dispatchMathPrecision(precision, [&](auto tier) {
+#pragma omp parallel for reduction(min : min_val) reduction(max : max_val) num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+            for (int i = 0; i < num_pixels; i++) {
+                // The expression of durandLogLuminance().
+                const float value = tmoLog<decltype(tier)::value>(std::max(rgbToLuminancePixel(m_image->data[i]), 1e-8f));
+                min_val = std::min(min_val, value);
+                max_val = std::max(max_val, value);
+            }
+        });
+        return m_log_spans[precision] = max_val - min_val;
+    }
+
+    void evictTiles()
+    {
+        while (m_tiles.size() > m_max_cached_tiles) {
+            auto oldest = m_tiles.begin();
+            for (auto it = m_tiles.begin(); it != m_tiles.end(); ++it) {
+                if (it->second.last_use < oldest->second.last_use) {
+                    oldest = it;
+                }
+            }
+            m_tiles.erase(oldest);
+        }
+    }
+
+    std::shared_ptr<const ImageRGB> m_image;
+    int m_tile_size;
+    size_t m_max_cached_tiles;
+    // Parameters of the cached tiles and the whole-frame result.
+    std::optional<DurandParams> m_params;
+    std::map<std::pair<int, int>, Tile> m_tiles;
+    uint64_t m_use_counter = 0;
+    std::optional<ImageRGB> m_full_frame;
+    // Whole-frame statistics, independent of the parameters.
+    std::optional<LuminanceStats> m_luminance_stats;
+    std::map<MathPrecision, float> m_log_spans;
+    RoiToneMapStats m_stats;
+};
+
+#pragma endregion Tone map preview
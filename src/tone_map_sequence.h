@@ -0,0 +1,279 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <chrono>
+#include <filesystem>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <framework/image_pool.h>
+#include <framework/image_write_queue.h>
+
+#include "bilateral_spacetime.h"
+#include "color_pipeline.h"
+#include "ring_buffer.h"
+#include "your_code_here.h"
+
+/*
+ * Tone mapping of frame sequences.
+ *
+ * Consecutive video frames are mostly the same. ToneMapSequence keeps the log-luminance that the
+ * current base layer was filtered from (the reference) and compares every new frame against it
+ * in tiles: a tile whose log-luminance moved by more than base_update_threshold is copied into
+ * the reference, and only the base pixels within the filter radius of such tiles are filtered
+ * again, from a window of the reference grown by another radius. Every other base pixel already
+ * is the filter of the reference, so the base layer always equals the full filter of the
+ * reference, and the reference differs from the frame by at most the threshold per pixel. With
+ * the default threshold 0 and an engine that evaluates the exact window (BruteForce, Tiled,
+ * Simd), the output equals toneMapDurand() of each frame; Grid and RangeLut adapt to the value
+ * range of the filtered window and always filter whole frames.
+ *
+ * With temporal_frames above 1 the base layer is filtered over time as well, by a
+ * SpaceTimeBilateralGrid (see bilateral_spacetime.h) over the frame and the temporal_frames - 1
+ * frames before it, whatever the engine. Frames then no longer equal toneMapDurand() of each
+ * frame, but their base layers do not flicker, and a frame costs about one grid filter.
+ *
+ * Independent per-frame normalization makes the brightness pump from frame to frame. With
+ * normalize set, the min/max of getRGBImageMinMax() is smoothed exponentially over time before
+ * the frame is normalized with it. Normalization and the look run as one ColorPipeline pass.
+ *
+ * toneMapSequenceFiles() pipelines the stream: a decoder thread runs up to decode_ahead frames
+ * ahead through an SpscRing while the current one is tone mapped with all threads (with
+ * --profile the ring reports whether decoding or tone mapping is the bottleneck), outputs are encoded by an
+ * ImageWriteQueue, and all frames are allocated from one ImageBufferPool, so from the second
+ * frame on every buffer of the chain is recycled.
+ */
+
+#pragma region Tone mapping sequences
+
+/// <summary>
+/// Temporal options of ToneMapSequence.
+/// </summary>
+struct SequenceOptions {
+    // Tiles whose log-luminance changed by at most this much keep their base layer; negative
+    // values filter every frame completely.
+    float base_update_threshold = 0.0f;
+    // Side of the change-detection tiles in pixels.
+    int tile_size = 32;
+    // Above this fraction of changed tiles the whole base layer is filtered again.
+    float max_dirty_fraction = 0.5f;
+    // Normalize each output to [0,1] with the smoothed min/max.
+    bool normalize = false;
+    // Weight of the previous smoothed min/max, 0 uses the min/max of each frame.
+    float min_max_smoothing = 0.9f;
+    // Frames toneMapSequenceFiles() decodes ahead of the tone mapping.
+    int decode_ahead = 2;
+    // Frames of the space-time grid window of the base layer, 1 filters every frame on its own.
+    int temporal_frames = 1;
+    // Sigma of the space-time grid along time in frames.
+    float temporal_sigma = 1.0f;
+};
+
+/// <summary>
+/// Durand tone mapping of consecutive frames of one resolution, see above.
+/// </summary>
+class ToneMapSequence {
+public:
+    ToneMapSequence(const DurandParams& params = {}, const SequenceOptions& options = {})
+        : m_params(params)
+        , m_options(options)
+    {
+    }
+
+    /// <summary>
+    /// Tone maps the next frame. A frame of a different resolution restarts the sequence.
+    /// </summary>
+    /// <param name="hdr_frame">linear HDR RGB frame</param>
+    /// <returns>tone-mapped RGB in [0,1]</returns>
+    ImageRGB process(const ImageRGB& hdr_frame)
+    {
+        const auto log_lum_H = durandLogLuminance(hdr_frame, m_params);
+        updateBase(log_lum_H);
+        auto result = durandCompose(hdr_frame, log_lum_H, m_base, m_params);
+
+        ColorPipeline finish;
+        if (m_options.normalize) {
+            const glm::vec2 frame_min_max = getRGBImageMinMax(result);
+            m_min_max = m_min_max ? glm::mix(frame_min_max, *m_min_max, m_options.min_max_smoothing) : frame_min_max;
+            finish.normalize(*m_min_max);
+        }
+        finish.look(m_params.look);
+        if (finish.stepCount() > 0) {
+            finish.apply(result, result);
+        }
+        return result;
+    }
+
+    // Tiles of the last frame that changed beyond the threshold (all of them on a restart).
+    int dirtyTiles() const { return m_dirty_tiles; }
+    int numTiles() const { return m_tiles_x * m_tiles_y; }
+
+private:
+    bool incremental() const
+    {
+        return m_options.base_update_threshold >= 0.0f && !temporal()
+            && (m_params.engine == BilateralEngine::BruteForce || m_params.engine == BilateralEngine::Tiled || m_params.engine == BilateralEngine::Simd);
+    }
+
+    bool temporal() const { return m_options.temporal_frames > 1; }
+
+    ImageFloat filter(const ImageFloat& H)
+    {
+        if (temporal()) {
+            return m_grid.filter(H);
+        }
+        return bilateralFilter(H, m_params.filter_size, m_params.space_sigma, m_params.range_sigma, m_params.engine);
+    }
+
+    void updateBase(const ImageFloat& log_lum_H)
+    {
+        const int w = log_lum_H.width;
+        const int h = log_lum_H.height;
+        const int tile = std::max(m_options.tile_size, 1);
+        const int tiles_x = (w + tile - 1) / tile;
+        const int tiles_y = (h + tile - 1) / tile;
+
+        const bool restart = m_reference.width != w || m_reference.height != h;
+        if (restart) {
+            m_min_max.reset();
+        }
+        if (restart || !incremental()) {
+            m_reference = log_lum_H;
+            m_base = filter(m_reference);
+            m_tiles_x = tiles_x;
+            m_tiles_y = tiles_y;
+            m_dirty_tiles = numTiles();
+            return;
+        }
+
+        // Tiles that moved away from the reference, copied into it.
+        const float threshold = m_options.base_update_threshold;
+        std::vector<char> dirty(static_cast<size_t>(tiles_x) * static_cast<size_t>(tiles_y), 0);
+#pragma omp parallel for schedule(dynamic)
+        for (int t = 0; t < tiles_x * tiles_y; t++) {
+            const PixelRect rect = PixelRect { (t % tiles_x) * tile, (t / tiles_x) * tile, (t % tiles_x + 1) * tile, (t / tiles_x + 1) * tile }.clamped(w, h);
+            bool changed = false;
+            for (int y = rect.y0; y < rect.y1 && !changed; y++) {
+                const float* current = log_lum_H.data.data() + size_t(y) * size_t(w);
+                const float* reference = m_reference.data.data() + size_t(y) * size_t(w);
+                for (int x = rect.x0; x < rect.x1; x++) {
+                    changed |= std::abs(current[x] - reference[x]) > threshold;
+                }
+            }
+            if (changed) {
+                dirty[t] = 1;
+                for (int y = rect.y0; y < rect.y1; y++) {
+                    const size_t offset = size_t(y) * size_t(w);
+                    std::copy(log_lum_H.data.begin() + (offset + rect.x0), log_lum_H.data.begin() + (offset + rect.x1), m_reference.data.begin() + (offset + rect.x0));
+                }
+            }
+        }
+        m_dirty_tiles = int(std::count(dirty.begin(), dirty.end(), 1));
+
+        if (m_dirty_tiles > m_options.max_dirty_fraction * float(numTiles())) {
+            m_base = filter(m_reference);
+            return;
+        }
+
+        // Base pixels within the radius of a run of changed tiles of a tile row, filtered from a
+        // window grown by another radius.
+        const int radius = m_params.filter_size / 2;
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                if (!dirty[size_t(ty) * size_t(tiles_x) + size_t(tx)]) {
+                    continue;
+                }
+                const int run_start = tx;
+                while (tx + 1 < tiles_x && dirty[size_t(ty) * size_t(tiles_x) + size_t(tx + 1)]) {
+                    tx++;
+                }
+                const PixelRect run { run_start * tile, ty * tile, (tx + 1) * tile, (ty + 1) * tile };
+                const PixelRect update = run.grown(radius, radius, radius, radius).clamped(w, h);
+                const PixelRect window = update.grown(radius, radius, radius, radius).clamped(w, h);
+                const auto window_base = filter(ImageFloat(m_reference.view(window.x0, window.y0, window.x1 - window.x0, window.y1 - window.y0)));
+#pragma omp parallel for
+                for (int y = update.y0; y < update.y1; y++) {
+                    const float* src = window_base.data.data() + size_t(y - window.y0) * size_t(window_base.width) + (update.x0 - window.x0);
+                    std::copy(src, src + (update.x1 - update.x0), m_base.data.data() + size_t(y) * size_t(w) + update.x0);
+                }
+            }
+        }
+    }
+
+    DurandParams m_params;
+    SequenceOptions m_options;
+    // Log-luminance the base layer was filtered from, and the base layer.
+    ImageFloat m_reference;
+    ImageFloat m_base;
+    int m_tiles_x = 0;
+    int m_tiles_y = 0;
+    int m_dirty_tiles = 0;
+    std::optional<glm::vec2> m_min_max;
+    // Window of the temporal base layer, restarted by a frame of another resolution.
+    SpaceTimeBilateralGrid m_grid { m_params.space_sigma, m_params.range_sigma, m_options.temporal_frames, m_options.temporal_sigma };
+};
+
+/// <summary>
+/// Tone maps a sequence of frame files in order with ToneMapSequence, decoding frame i + 1 and
+/// encoding frame i - 1 while frame i is processed.
+/// </summary>
+/// <param name="inputs">frame files, all of one resolution</param>
+/// <param name="outputs">output file of each frame</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <param name="options">temporal options</param>
+/// <returns>frames per second</returns>
+double toneMapSequenceFiles(const std::vector<std::filesystem::path>& inputs, const std::vector<std::filesystem::path>& outputs,
+    const DurandParams& params = {}, const SequenceOptions& options = {})
+{
+    assert(inputs.size() == outputs.size());
+    const auto start_time = std::chrono::steady_clock::now();
+    ImageBufferPool frame_pool;
+    ImageMemoryScope memory_scope(&frame_pool);
+    // Declared after the pool, which must outlive the queued frames.
+    ImageWriteQueue output_queue;
+    ToneMapSequence sequence(params, options);
+
+    // The decoder stops at the end of the inputs, on an error, or when the ring is closed below.
+    SpscRing<ImageRGB> decoded("sequence decode", size_t(std::max(options.decode_ahead, 1)));
+    std::exception_ptr decode_error;
+    std::thread decoder([&] {
+        ImageMemoryScope decode_scope(&frame_pool);
+        try {
+            for (const auto& path : inputs) {
+                if (!decoded.push(ImageRGB(path))) {
+                    break;
+                }
+            }
+        } catch (...) {
+            decode_error = std::current_exception();
+        }
+        decoded.close();
+    });
+
+    try {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            auto frame = decoded.pop();
+            if (!frame) {
+                break;
+            }
+            output_queue.write(sequence.process(*frame), outputs[i]);
+        }
+    } catch (...) {
+        decoded.close();
+        decoder.join();
+        throw;
+    }
+    decoder.join();
+    if (decode_error) {
+        std::rethrow_exception(decode_error);
+    }
+    output_queue.flush();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    return seconds > 0.0 ? double(inputs.size()) / seconds : 0.0;
+}
+
+#pragma endregion Tone mapping sequences
@@ -0,0 +1,280 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <span>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <framework/image_write_queue.h>
+
+#include "color_lut.h"
+#include "fast_math_simd.h"
+#include "your_code_here.h"
+
+/*
+ * Parameter sweeps of the Durand operator for look development.
+ *
+ * A sweep renders one image for every combination of base_scale, output_gain and saturation.
+ * None of them changes the log-luminance or the base layer, so the bilateral filter, by far the
+ * most expensive stage, runs once per sweep (prepareDurandSweep()). Per pixel, the contrast
+ * reduction and the RGB rescale of one variant are
+ *
+ *   out_c = clamp(exp(base_scale * b + d) * output_gain * (c / L)^saturation)
+ *         = clamp(output_gain * exp(saturation * ln(c / L) + base_scale * b + d)),
+ *
+ * so the pixel terms b, d and ln(c / L) are computed once for all variants, and a variant costs
+ * three exponentials. composeDurandSweep() makes one pass over the image per group of variants:
+ * per row the logarithms are taken once, then every variant of the group runs over the row from
+ * L1, its exponentials vectorized for the running CPU by the row kernels of fast_math_simd.h with
+ * the Fast and Faster tiers (the exact tier is the standard library's, per pixel). A row is
+ * vectorized across its pixels rather than a pixel across the variants, so the stores of a
+ * variant stay contiguous whatever the number of variants.
+ *
+ * With the exact tier the results are within a few float ulp of durandCompose() with the same
+ * parameters (exp of the sum instead of the product of exp and pow); auto_contrast is ignored,
+ * the swept values are the parameters. The look of the parameters grades every variant.
+ * toneMapSweepFile() groups the variants so their images fit a memory budget and hands every
+ * finished image to an ImageWriteQueue, which encodes it while the next group is composed.
+ */
+
+#pragma region Parameter sweeps
+
+/// <summary>
+/// Parameters of one variant of a sweep.
+/// </summary>
+struct ToneMapVariant {
+    float base_scale;
+    float output_gain;
+    float saturation;
+};
+
+/// <summary>
+/// Values of the swept parameters, the value of the DurandParams for an empty list.
+/// </summary>
+struct ToneMapSweep {
+    std::vector<float> base_scales;
+    std::vector<float> output_gains;
+    std::vector<float> saturations;
+    // Bytes of the variant images composed in one pass, at least one image.
+    size_t pass_bytes = size_t(1) << 30;
+
+    bool empty() const { return base_scales.empty() && output_gains.empty() && saturations.empty(); }
+
+    /// <summary>
+    /// All combinations of the values, saturation varying fastest.
+    /// </summary>
+    std::vector<ToneMapVariant> variants(const DurandParams& params) const
+    {
+        const auto values = [](const std::vector<float>& list, const float fallback) { return list.empty() ? std::vector<float> { fallback } : list; };
+        std::vector<ToneMapVariant> result;
+        for (const float base_scale : values(base_scales, params.base_scale)) {
+            for (const float output_gain : values(output_gains, params.output_gain)) {
+                for (const float saturation : values(saturations, params.saturation)) {
+                    result.push_back({ base_scale, output_gain, saturation });
+                }
+            }
+        }
+        return result;
+    }
+};
+
+/// <summary>
+/// Values of a sweep setting: a comma-separated list, or "from:to:count" evenly spaced values.
+/// </summary>
+std::vector<float> parseSweepValues(const std::string& name, const std::string& text)
+{
+    const auto fail = [&] {
+        std::cerr << "Invalid value of " << name << ": " << text << " (expected v1,v2,... or from:to:count)" << std::endl;
+        throw std::exception();
+    };
+    std::vector<float> values;
+    try {
+        if (const auto colon = text.find(':'); colon != std::string::npos) {
+            const auto second = text.find(':', colon + 1);
+            if (second == std::string::npos) {
+                fail();
+            }
+            const float from = std::stof(text.substr(0, colon));
+            const float to = std::stof(text.substr(colon + 1, second - colon - 1));
+            const int count = std::stoi(text.substr(second + 1));
+            if (count < 1) {
+                fail();
+            }
+            for (int i = 0; i < count; i++) {
+                values.push_back(count == 1 ? from : from + (to - from) * float(i) / float(count - 1));
+            }
+            return values;
+        }
+        std::istringstream stream(text);
+        for (std::string item; std::getline(stream, item, ',');) {
+            if (!item.empty()) {
+                values.push_back(std::stof(item));
+            }
+        }
+    } catch (const std::invalid_argument&) {
+        fail();
+    } catch (const std::out_of_range&) {
+        fail();
+    }
+    if (values.empty()) {
+        fail();
+    }
+    return values;
+}
+
+/// <summary>
+/// The layers of an image shared by all variants of a sweep.
+/// </summary>
+struct DurandSweepLayers {
+    ImageFloat log_lum_H;
+    ImageFloat base_image;
+    ImageFloat detail_image;
+};
+
+/// <summary>
+/// Log-luminance, base and detail layer of an image, once for a whole sweep.
+/// </summary>
+DurandSweepLayers prepareDurandSweep(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    DurandSweepLayers layers;
+    layers.log_lum_H = durandLogLuminance(hdr_image, params);
+    layers.base_image = durandBaseLayer(hdr_image, layers.log_lum_H, params);
+    layers.detail_image = getDetailImage(layers.log_lum_H, layers.base_image);
+    return layers;
+}
+
+/// <summary>
+/// Composes every variant of a group in one pass over the image, see above.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="base_image">base layer of the image, see prepareDurandSweep()</param>
+/// <param name="detail_image">detail layer of the image</param>
+/// <param name="variants">parameters of the images</param>
+/// <param name="precision">math tier of the exponentials and logarithms</param>
+/// <returns>tone-mapped RGB in [0,1] of every variant, ungraded</returns>
+std::vector<ImageRGB> composeDurandSweep(const ImageRGB& hdr_image, const ImageFloat& base_image, const ImageFloat& detail_image,
+    const std::span<const ToneMapVariant> variants, const MathPrecision precision = MathPrecision::Exact)
+{
+    const int width = hdr_image.width, height = hdr_image.height;
+    const int count = int(variants.size());
+    std::vector<ImageRGB> results;
+    for (int v = 0; v < count; v++) {
+        results.push_back(ImageRGB::uninitialized(width, height));
+    }
+    // Parameters of the variants, the gain as a term of the exponent.
+    std::vector<float> base_scales(count), log_gains(count), saturations(count);
+    for (int v = 0; v < count; v++) {
+        base_scales[v] = variants[v].base_scale;
+        log_gains[v] = std::log(std::max(variants[v].output_gain, 1e-30f));
+        saturations[v] = variants[v].saturation;
+    }
+    // Ratio of a black channel: a normal float, which the fast logarithms need, tiny after the power.
+    const float MIN_RATIO = 1e-30f;
+    const float EPSILON = 1e-7f;
+    const SimdIsa isa = detectSimdIsa();
+    dispatchMathPrecision(precision, [&](auto tier) {
+        constexpr MathPrecision P = decltype(tier)::value;
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height * std::max(count, 1), KernelCost::Medium))
+        {
+            // ln(c / L) of the channels of a row, the terms every variant reads.
+            std::vector<float> log_r(width), log_g(width), log_b(width);
+            // Exponent without the channel term and the channels of a variant (Fast and Faster tiers).
+            const bool vector_rows = P != MathPrecision::Exact;
+            std::vector<float> shared(vector_rows ? width : 0), channel_r(shared.size()), channel_g(shared.size()), channel_b(shared.size());
+#pragma omp for
+            for (int y = 0; y < height; y++) {
+                const size_t offset = size_t(y) * size_t(width);
+                const glm::vec3* in = hdr_image.data.data() + offset;
+                const float* base = base_image.data.data() + offset;
+                const float* detail = detail_image.data.data() + offset;
+#pragma omp simd
+                for (int x = 0; x < width; x++) {
+                    // The luminance of rescaleRgbByLuminancePixel().
+                    const float luminance = std::max(rgbToLuminancePixel(in[x]), EPSILON);
+                    log_r[x] = tmoLog<P>(std::max(in[x].r / luminance, MIN_RATIO));
+                    log_g[x] = tmoLog<P>(std::max(in[x].g / luminance, MIN_RATIO));
+                    log_b[x] = tmoLog<P>(std::max(in[x].b / luminance, MIN_RATIO));
+                }
+                for (int v = 0; v < count; v++) {
+                    const float base_scale = base_scales[v], log_gain = log_gains[v], saturation = saturations[v];
+                    float* out = reinterpret_cast<float*>(results[v].data.data() + offset);
+                    if constexpr (P == MathPrecision::Exact) {
+#pragma omp simd
+                        for (int x = 0; x < width; x++) {
+                            const float shared = base_scale * base[x] + detail[x] + log_gain;
+                            out[3 * x] = std::clamp(tmoExp<P>(saturation * log_r[x] + shared), 0.0f, 1.0f);
+                            out[3 * x + 1] = std::clamp(tmoExp<P>(saturation * log_g[x] + shared), 0.0f, 1.0f);
+                            out[3 * x + 2] = std::clamp(tmoExp<P>(saturation * log_b[x] + shared), 0.0f, 1.0f);
+                        }
+                    } else {
+                        // The exponentials in vectors of the running CPU, then interleaved.
+                        const auto exp_row = clampedExpRowKernel<P>(isa);
+#pragma omp simd
+                        for (int x = 0; x < width; x++) {
+                            shared[x] = base_scale * base[x] + detail[x] + log_gain;
+                        }
+                        exp_row(log_r.data(), shared.data(), saturation, channel_r.data(), width);
+                        exp_row(log_g.data(), shared.data(), saturation, channel_g.data(), width);
+                        exp_row(log_b.data(), shared.data(), saturation, channel_b.data(), width);
+#pragma omp simd
+                        for (int x = 0; x < width; x++) {
+                            out[3 * x] = channel_r[x];
+                            out[3 * x + 1] = channel_g[x];
+                            out[3 * x + 2] = channel_b[x];
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return results;
+}
+
+/// <summary>
+/// Output file of a variant, "<stem>_b<base_scale>_g<output_gain>_s<saturation><extension>".
+/// </summary>
+std::filesystem::path sweepOutputPath(const std::filesystem::path& output_dir, const std::string& stem, const ToneMapVariant& variant, const std::string& extension = ".png")
+{
+    std::ostringstream name;
+    name << stem << "_b" << variant.base_scale << "_g" << variant.output_gain << "_s" << variant.saturation << extension;
+    return output_dir / name.str();
+}
+
+/// <summary>
+/// Renders every variant of a sweep of one HDR file into output_dir, the layers computed once
+/// and the images encoded by the queue, see above.
+/// </summary>
+/// <param name="input">HDR file</param>
+/// <param name="output_dir">directory of the images, created when missing</param>
+/// <param name="params">tone-mapping parameters: filter, math_precision and look</param>
+/// <param name="sweep">swept values</param>
+/// <param name="output_queue">encodes the images in the background</param>
+/// <returns>rendered variants</returns>
+size_t toneMapSweepFile(const std::filesystem::path& input, const std::filesystem::path& output_dir, const DurandParams& params, const ToneMapSweep& sweep,
+    ImageWriteQueue& output_queue)
+{
+    std::filesystem::create_directories(output_dir);
+    const ImageRGB hdr_image(input);
+    const auto layers = prepareDurandSweep(hdr_image, params);
+    const auto variants = sweep.variants(params);
+    const size_t image_bytes = std::max(hdr_image.data.size() * sizeof(glm::vec3), size_t(1));
+    const size_t group = std::max(sweep.pass_bytes / image_bytes, size_t(1));
+    const std::string stem = input.stem().string();
+    for (size_t begin = 0; begin < variants.size(); begin += group) {
+        const auto span = std::span(variants).subspan(begin, std::min(group, variants.size() - begin));
+        auto images = composeDurandSweep(hdr_image, layers.base_image, layers.detail_image, span, params.math_precision);
+        for (size_t i = 0; i < images.size(); i++) {
+            if (params.look) {
+                applyLook(images[i], params.look);
+            }
+            output_queue.write(std::move(images[i]), sweepOutputPath(output_dir, stem, span[i]));
+        }
+    }
+    output_queue.flush();
+    return variants.size();
+}
+
+#pragma endregion Parameter sweeps
@@ -0,0 +1,85 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+
+#include "execution.h"
+#include "helpers.h"
+#include "stencil_solver.h"
+
+/*
+ * Weighted-least-squares smoothing (Farbman, Fattal, Lischinski and Szeliski 2008) as an
+ * edge-preserving base-layer operator.
+ *
+ * The output u is the minimizer of
+ *
+ *   sum (u - H)^2 + sum over neighbouring pixels p, q of w(p, q) (u(p) - u(q))^2,
+ *   w(p, q) = lambda / (1 + (|H(p) - H(q)| / range_sigma)^alpha / eps),
+ *
+ * so u stays close to H and is smooth where H is, while a large difference of H costs little to
+ * keep. These are the weights lambda / (|dH|^alpha + eps) of the paper, scaled so that lambda is
+ * the coupling of flat areas, where the smoothing reaches about sqrt(lambda) pixels, and a
+ * difference of range_sigma cuts the coupling by 1 + 1 / eps. The filter maps onto the bilateral
+ * parameters as lambda = space_sigma^2; the filter size is not used.
+ *
+ * The minimizer solves (I + L_w) u = H, a stencil operator with the conductances w and a unit
+ * diagonal term, solved from u = H with the stencil solver core. With the multigrid-preconditioned
+ * CG default the iterations grow slowly with space_sigma (6 at the default 4.2, 17 at 40 on a
+ * 1 Mpix frame, against 50 and 370 for diagonal-preconditioned CG), so wide smoothing costs a few
+ * times the narrow one instead of the square of the radius. Unlike the bilateral filter the
+ * result has no halo or gradient reversal at strong edges.
+ */
+
+#pragma region WLS filter
+
+/// <summary>
+/// Exponent alpha of the edge-stopping weights (1.2 to 2 in the paper).
+/// </summary>
+constexpr float WLS_ALPHA = 1.2f;
+
+/// <summary>
+/// Edge contrast eps of the weights: a difference of range_sigma couples 1 + 1 / eps times less
+/// than a flat area. Smaller values preserve edges more strongly, and stiffen the system.
+/// </summary>
+constexpr float WLS_EPSILON = 0.1f;
+
+/// <summary>
+/// Applies weighted-least-squares smoothing to an intensity image, see above.
+/// </summary>
+/// <param name="H">The intensity image to be filtered (e.g. log-luminance).</param>
+/// <param name="lambda">coupling of flat areas, the squared reach of the smoothing</param>
+/// <param name="range_sigma">unit of the differences in the edge-stopping weights</param>
+/// <param name="method">solver backend</param>
+/// <param name="tolerance">relative residual the solve stops at</param>
+/// <param name="stats">optional output of the solver iterations and final relative residual</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+inline ImageFloat wlsFilter(const ImageFloat& H, const float lambda, const float range_sigma, const StencilMethod method = StencilMethod::MultigridCG,
+    const float tolerance = 1e-4f, PoissonStats* stats = nullptr)
+{
+    const int w = H.width, h = H.height;
+    auto right = ImageFloat::uninitialized(w, h), down = ImageFloat::uninitialized(w, h);
+    const float inv_range = 1.0f / range_sigma;
+    const auto weight = [&](const float difference) { return lambda / (1.0f + std::pow(std::abs(difference) * inv_range, WLS_ALPHA) / WLS_EPSILON); };
+#pragma omp parallel for num_threads(kernelThreads(H, KernelCost::Medium))
+    for (int y = 0; y < h; y++) {
+        const float* row = H.data.data() + size_t(y) * size_t(w);
+        // The last row and column leave the image, StencilOperator ignores them.
+        const float* below = y + 1 < h ? row + w : row;
+        float* right_row = right.data.data() + size_t(y) * size_t(w);
+        float* down_row = down.data.data() + size_t(y) * size_t(w);
+        for (int x = 0; x < w; x++) {
+            right_row[x] = weight(row[std::min(x + 1, w - 1)] - row[x]);
+            down_row[x] = weight(below[x] - row[x]);
+        }
+    }
+    ImageFloat center(w, h);
+    std::fill(center.data.begin(), center.data.end(), 1.0f);
+    const StencilOperator op(std::move(right), std::move(down), &center);
+
+    StencilSolveOptions options;
+    options.method = method;
+    options.tolerance = tolerance;
+    options.max_iters = method == StencilMethod::Multigrid || method == StencilMethod::MultigridCG ? 100 : 10000;
+    return solveStencil(op, H, H, options, stats);
+}
+
+#pragma endregion WLS filter
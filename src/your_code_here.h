@@ -2,12 +2,64 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <numeric>
+#include <optional>
 #include <span>
+#include <sstream>
+#include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "helpers.h"
+#include "binary_mask.h"
+#include "mask_geometry.h"
+#include "execution.h"
+#include "color_lut.h"
+#include "content_hash.h"
+#include "stencil.h"
+#include "kernel_schedule.h"
+#include "bilateral_grid.h"
+#include "bilateral_tiled.h"
+#include "bilateral_adaptive.h"
+#include "bilateral_simd.h"
+#include "bilateral_upsampled.h"
+#include "bilateral_recursive.h"
+#include "guided_filter.h"
+#include "wls_filter.h"
+#include "permutohedral.h"
+#include "local_laplacian.h"
+#include "gradient_compression.h"
+#include "global_tmo.h"
+#include "image_stats.h"
+#include "image_expr.h"
+#include "integral_image.h"
+#include "poisson_multigrid.h"
+#include "poisson_cg.h"
+#include "poisson_masked.h"
+#include "poisson_quadtree.h"
+#include "poisson_prepared.h"
+#include "membrane_clone.h"
+#include "poisson_spectral.h"
+#include "poisson_blocked.h"
+#include "poisson_mixed.h"
+#include "poisson_pyramid.h"
+#include "poisson_schwarz.h"
+#include "poisson_session.h"
+#include "poisson_fused.h"
+#include "stencil_solver.h"
+#include "fast_math.h"
+#include "fast_math_simd.h"
+#include "curve_lut.h"
+#include "hdr_stream.h"
+#include "half_float.h"
+#include "color_simd.h"
+#include "plane3.h"
+#include "task_graph.h"
+#include "stage_profiler.h"
 
 /*
  * Utility functions.
@@ -30,87 +82,168 @@ int getImageOffset(const Image<T>& image, int x, int y)
 
 #pragma region HDR TMO
 
-glm::vec2 getRGBImageMinMax(const ImageRGB& image) {
+glm::vec2 getRGBImageMinMax(const ImageView<const glm::vec3> image) {
 
-    auto min_val = 100.0f;
-    auto max_val = -1.0f;
+    auto min_val = std::numeric_limits<float>::max();
+    auto max_val = std::numeric_limits<float>::lowest();
 
     // Write a code that will return minimum value (min of all color channels and pixels) and maximum value as a glm::vec2(min,max).
     
     // Note: Parallelize the code using OpenMP directives for full points.
-    
-   #pragma omp parallel for
+
+    // Every thread reduces its own partial min/max, which OpenMP combines at the end.
+    // Rows are split across threads and each row is vectorized.
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light)) reduction(min : min_val) reduction(max : max_val)
     for (int y = 0; y < image.height; y++) {
+        const auto* row = image.row(y);
+#pragma omp simd reduction(min : min_val) reduction(max : max_val)
         for (int x = 0; x < image.width; x++) {
-            int pos = getImageOffset(image, x, y);  
-            auto val = image.data[pos];
-
+            const auto val = row[x];
 
             float max_rgb = std::max(std::max(val.r, val.g), val.b);
             float min_rgb = std::min(std::min(val.r, val.g), val.b);
 
-            if (min_rgb < min_val) {
-                min_val = min_rgb;
-            }
-            if (max_rgb > max_val) {
-                max_val = max_rgb;
-            }
+            min_val = std::min(min_val, min_rgb);
+            max_val = std::max(max_val, max_rgb);
         }
-
     }
 
     // Return min and max value as x and y components of a vector.
     return glm::vec2(min_val, max_val);
 }
 
-ImageRGB normalizeRGBImage(const ImageRGB& image)
+/// <summary>
+/// Maps a single pixel from [min, max] to [0, 1].
+/// </summary>
+/// <param name="val">RGB</param>
+/// <param name="min_max">min and max over all channels and pixels as (x, y)</param>
+/// <returns>normalized RGB</returns>
+glm::vec3 normalizeRgbPixel(const glm::vec3& val, const glm::vec2& min_max)
 {
-    // Create an empty image of the same size as input.
-    auto result = ImageRGB(image.width, image.height);
-
-    // Find min and max values.
-    glm::vec2 min_max = getRGBImageMinMax(image);
+    return (val - min_max.x) / (min_max.y - min_max.x);
+}
 
-    // Fill the result with normalized image values (ie, fit the image to [0,1] range).    
-    
+/// <summary>
+/// Fits the image to the [0,1] range using a precomputed min/max (see getRGBImageMinMax()).
+/// </summary>
+ImageRGB normalizeRGBImage(const ImageRGB& image, const glm::vec2& min_max)
+{
+    // Create an empty image of the same size as input.
+    auto result = ImageRGB::uninitialized(image.width, image.height);
+    // A large output is streamed, see streaming_store.h.
+    const bool streaming = useStreamingStores(int64_t(image.data.size() * sizeof(glm::vec3)));
 
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
     for (int y = 0; y < image.height; y++) {
+        if (streaming && y + 1 < image.height) {
+            prefetchRow(image.data.data() + size_t(y + 1) * size_t(image.width), size_t(image.width) * sizeof(glm::vec3));
+        }
+        const StreamingRow<glm::vec3> out(result.data.data() + size_t(y) * size_t(image.width), image.width, streaming);
         for (int x = 0; x < image.width; x++) {
             int pos = getImageOffset(image, x, y);
             auto val = image.data[pos];
 
-            glm::vec3 I_norm = (val - min_max.x) / (min_max.y - min_max.x);
-
-            result.data[y * image.width + x] = I_norm;
+            out.data()[x] = normalizeRgbPixel(val, min_max);
         }
+        out.commit();
     }
 
     return result;
 }
 
-ImageRGB applyGamma(const ImageRGB& image, const float gamma)
+ImageRGB normalizeRGBImage(const ImageRGB& image)
 {
-    // Create an empty image of the same size as input.
-    auto result = ImageRGB(image.width, image.height);
-    auto Inorm = normalizeRGBImage(image);
-    // Fill the result with gamma mapped pixel values (result = image^gamma).    
+    // Find min and max values.
+    glm::vec2 min_max = getRGBImageMinMax(image);
 
-    for (int y = 0; y < image.height; y++) {
-        for (int x = 0; x < image.width; x++) {
-            int pos = getImageOffset(image, x, y);
-            auto val = image.data[pos];
-            //auto val = Inorm.data[pos];
+    // Fill the result with normalized image values (ie, fit the image to [0,1] range).    
+    return normalizeRGBImage(image, min_max);
+}
+
+/// <summary>
+/// Gamma curve of a single pixel (result = val^gamma) at the given math precision.
+/// </summary>
+template <MathPrecision P = MathPrecision::Exact>
+glm::vec3 applyGammaPixel(const glm::vec3& val, const float gamma)
+{
+    float R = tmoPow<P>(val.r, gamma);
+    float G = tmoPow<P>(val.g, gamma);
+    float B = tmoPow<P>(val.b, gamma);
+
+    return glm::vec3(R, G, B);
+}
 
-            float R = pow(val.r, gamma);
-            float G = pow(val.g, gamma);
-            float B = pow(val.b, gamma);
+/// <summary>
+/// Applies the gamma curve (result = image^gamma) into a caller-provided buffer of the same size.
+/// When min_max is given, the input is normalized with it first (one fused pass).
+/// result may be the image itself (in place).
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="gamma">exponent</param>
+/// <param name="result">output buffer</param>
+/// <param name="min_max">optional min/max to normalize the input to [0,1] before the gamma curve</param>
+/// <param name="precision">accuracy of pow()</param>
+/// <param name="quantization">8-bit inputs are mapped through a 256-entry table instead of pow()</param>
+void applyGamma(const ImageView<const glm::vec3> image, const float gamma, const ImageView<glm::vec3> result, const std::optional<glm::vec2> min_max = std::nullopt,
+    const MathPrecision precision = MathPrecision::Exact, const PixelQuantization quantization = PixelQuantization::Auto)
+{
+    assert(result.width == image.width && result.height == image.height);
+
+    const bool quantized = quantization == PixelQuantization::Uint8 || (quantization == PixelQuantization::Auto && isQuantizedImage(image));
+
+    dispatchMathPrecision(precision, [&](auto tier) {
+        if (quantized) {
+            // Same per-channel curve as below, evaluated once per input level.
+            const auto lut = QuantizedCurveLut(UINT8_LEVELS, [&](const float v) {
+                auto val = glm::vec3(v);
+                if (min_max) {
+                    val = normalizeRgbPixel(val, *min_max);
+                }
+                return applyGammaPixel<decltype(tier)::value>(val, gamma).r;
+            });
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+            for (int y = 0; y < image.height; y++) {
+                for (int x = 0; x < image.width; x++) {
+                    result(x, y) = lut(image(x, y));
+                }
+            }
+            return;
+        }
 
-            glm::vec3 rgb(R, G, B);
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Medium))
+        for (int y = 0; y < image.height; y++) {
+            for (int x = 0; x < image.width; x++) {
+                auto val = image(x, y);
+                if (min_max) {
+                    val = normalizeRgbPixel(val, *min_max);
+                }
 
-            result.data[y * image.width + x] = rgb;
+                result(x, y) = applyGammaPixel<decltype(tier)::value>(val, gamma);
+            }
         }
+    });
+}
+
+/// <summary>
+/// Applies the gamma curve (result = image^gamma), optionally fused with normalizeRGBImage().
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="gamma">exponent</param>
+/// <param name="normalize">normalize the input to [0,1] first</param>
+/// <param name="min_max">min/max used for normalization; computed from the image when not given</param>
+/// <param name="precision">accuracy of pow()</param>
+/// <param name="quantization">8-bit inputs are mapped through a table instead of pow()</param>
+/// <returns>gamma mapped image</returns>
+ImageRGB applyGamma(const ImageRGB& image, const float gamma, const bool normalize = false, std::optional<glm::vec2> min_max = std::nullopt,
+    const MathPrecision precision = MathPrecision::Exact, const PixelQuantization quantization = PixelQuantization::Auto)
+{
+    // Create an empty image of the same size as input.
+    auto result = ImageRGB::uninitialized(image.width, image.height);
+    if (normalize && !min_max) {
+        min_max = getRGBImageMinMax(image);
     }
-    
+    // Fill the result with gamma mapped pixel values (result = image^gamma).    
+    applyGamma(image, gamma, result, normalize ? min_max : std::nullopt, precision, quantization);
 
     return result;
 }
@@ -120,27 +253,47 @@ ImageRGB applyGamma(const ImageRGB& image, const float gamma)
 */
 
 /// <summary>
-/// Compute luminance from a linear RGB image.
+/// Luminance of a single linear RGB pixel.
 /// </summary>
-/// <param name="rgb">A linear RGB image</param>
-/// <returns>log-luminance</returns>
-ImageFloat rgbToLuminance(const ImageRGB& rgb)
+/// <param name="val">linear RGB</param>
+/// <returns>luminance</returns>
+float rgbToLuminancePixel(const glm::vec3& val)
 {
     // RGB to luminance weights defined in ITU R-REC-BT.601 in the R,G,B order.
     const auto WEIGHTS_RGB_TO_LUM = glm::vec3(0.299f, 0.587f, 0.114f);
-    // An empty luminance image.
-    auto luminance = ImageFloat(rgb.width, rgb.height);
-    // Fill the image by logarithmic luminace.
     // Luminance is a linear combination of the red, green and blue channels using the weights above.
+    return WEIGHTS_RGB_TO_LUM[0] * val.r + WEIGHTS_RGB_TO_LUM[1] * val.g + WEIGHTS_RGB_TO_LUM[2] * val.b;
+}
 
-    for (int y = 0; y < rgb.height; y++) {
+/// <summary>
+/// Compute luminance from a linear RGB image into a caller-provided buffer of the same size.
+/// </summary>
+/// <param name="rgb">A linear RGB image (or a region of one)</param>
+/// <param name="luminance">output buffer</param>
+void rgbToLuminance(const ImageView<const glm::vec3> rgb, const ImageView<float> luminance)
+{
+    assert(luminance.width == rgb.width && luminance.height == rgb.height);
+
+    parallelFor(0, rgb.height, rgb.width, KernelCost::Light, [&](const int y) {
         for (int x = 0; x < rgb.width; x++) {
-            int pos = getImageOffset(rgb, x, y);
-            auto val = rgb.data[pos];
+            auto val = rgb(x, y);
 
-            luminance.data[y * rgb.width + x] = WEIGHTS_RGB_TO_LUM[0] * val.r + WEIGHTS_RGB_TO_LUM[1] * val.g + WEIGHTS_RGB_TO_LUM[2] * val.b;
+            luminance(x, y) = rgbToLuminancePixel(val);
         }
-    }
+    });
+}
+
+/// <summary>
+/// Compute luminance from a linear RGB image.
+/// </summary>
+/// <param name="rgb">A linear RGB image (or a region of one)</param>
+/// <returns>log-luminance</returns>
+ImageFloat rgbToLuminance(const ImageView<const glm::vec3> rgb)
+{
+    // An empty luminance image.
+    auto luminance = ImageFloat::uninitialized(rgb.width, rgb.height);
+    // Fill the image by logarithmic luminace.
+    rgbToLuminance(rgb, luminance);
     return luminance;
 }
 
@@ -154,8 +307,9 @@ ImageFloat rgbToLuminance(const ImageRGB& rgb)
 /// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
 /// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
 /// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="output_stats">receives the statistics of the result row by row when given, see ImageStatsAccumulator</param>
 /// <returns>ImageFloat, the filtered intensity.</returns>
-ImageFloat bilateralFilter(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma)
+ImageFloat bilateralFilterBruteForce(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma, ImageStatsAccumulator* output_stats = nullptr)
 {
     // The filter size is always odd.
     assert(size % 2 == 1);
@@ -163,63 +317,221 @@ ImageFloat bilateralFilter(const ImageFloat& H, const int size, const float spac
     // Kernel radius.
     int radius = size / 2;
 
-    // Precompute spatial Gaussian weights.
-    std::vector<std::vector<float>> spatialWeights(size, std::vector<float>(size));
+    // Precompute spatial Gaussian weights into a flat, contiguous size x size table.
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
     for (int i = -radius; i <= radius; i++) {
         for (int j = -radius; j <= radius; j++) {
             // Using squared Euclidean dist --> i * i + j * j
-            spatialWeights[i + radius][j + radius] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
         }
     }
 
     // Empty output image.
-    auto result = ImageFloat(H.width, H.height);
+    auto result = ImageFloat::uninitialized(H.width, H.height);
 
-    for (int y = 0; y < H.height; y++) {
-        for (int x = 0; x < H.width; x++) {
-            float K = 0.0f;
-            float filteredValue = 0.0f;
+    // Filters pixel (x, y) over the window rows [y + dy0, y + dy1] and columns [x + dx0, x + dx1].
+    const auto filter_pixel = [&](const int x, const int y, const int dy0, const int dy1, const int dx0, const int dx1) {
+        float K = 0.0f;
+        float filteredValue = 0.0f;
 
-            int pos = getImageOffset(H, x, y);
-            float val = H.data[pos];
+        int pos = getImageOffset(H, x, y);
+        float val = H.data[pos];
 
-            // Iterate through the kernel.
-            for (int dy = -radius; dy <= radius; dy++) {
-                for (int dx = -radius; dx <= radius; dx++) {
-                    int nx = x + dx;
-                    int ny = y + dy;
+        // Iterate through the kernel.
+        for (int dy = dy0; dy <= dy1; dy++) {
+            for (int dx = dx0; dx <= dx1; dx++) {
+                int n_pos = getImageOffset(H, x + dx, y + dy);
+                auto n_val = H.data[n_pos];
 
-                    // Skip out-of-bounds pixels.
-                    if (nx < 0 || ny < 0 || nx >= H.width || ny >= H.height) {
-                        continue;
-                    }
+                // Compute range weight (intensity difference).
+                float rangeWeight = exp(-(val - n_val) * (val - n_val) / (2.0f * range_sigma * range_sigma));
+
+                // Compute combined weight --> f(x-y)g(I(x)-I(y))
+                float weight = spatialWeights[(dy + radius) * size + (dx + radius)] * rangeWeight;
 
-                    int n_pos = getImageOffset(H, nx, ny);
-                    auto n_val = H.data[n_pos];
+                // Accumulate the weighted value and total weight --> *I(y)
+                filteredValue += weight * n_val;
+                // Normalization factor
+                K += weight;
+            }
+        }
 
-                    // Compute range weight (intensity difference).
-                    float rangeWeight = exp(-(val - n_val) * (val - n_val) / (2.0f * range_sigma * range_sigma));
+        // Normalize the result.
+        result.data[y * H.width + x] = filteredValue / K;
+    };
 
-                    // Compute combined weight --> f(x-y)g(I(x)-I(y))
-                    float weight = spatialWeights[dy + radius][dx + radius] * rangeWeight;
+    // Interior: the whole window is inside the image.
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        for (int x = x0; x < x1; x++) {
+            filter_pixel(x, y, -radius, radius, -radius, radius);
+        }
+    };
 
-                    // Accumulate the weighted value and total weight --> *I(y)
-                    filteredValue += weight * n_val;
-                    // Normalization factor
-                    K += weight;
-                }
-            }
+    // Border: out-of-bounds pixels are skipped by cropping the window to the image.
+    const auto border = [&](const int x, const int y) {
+        filter_pixel(x, y, std::max(-radius, -y), std::min(radius, H.height - 1 - y), std::max(-radius, -x), std::min(radius, H.width - 1 - x));
+    };
 
-            // Normalize the result.
-            result.data[y * H.width + x] = filteredValue / K;
+    // Rows are still in cache when they are added to the statistics.
+    JobProgressCounter progress("bilateralFilterBruteForce", H.height);
+    const auto row_done = [&](const int y) {
+        if (output_stats) {
+            output_stats->addRows(std::as_const(result).view(0, y, H.width, 1), y);
         }
-    }
+        progress.add();
+    };
+
+    forEachStencilPixel(H.width, H.height, StencilReach { radius, radius, radius, radius }, interior, border, row_done);
 
     // Return filtered intensity.
     return result;
 }
 
 
+/// <summary>
+/// Implementations of the edge-preserving filter used for the base layer.
+/// </summary>
+enum class BilateralEngine {
+    // Exact evaluation of the full size x size window (reference).
+    BruteForce,
+    // Bilateral grid approximation, runtime independent of the filter size (brute force when
+    // range_sigma is below 1/250 of the intensity span, see BILATERAL_GRID_MAX_DEPTH).
+    Grid,
+    // Exact, cache-blocked evaluation in tiles with halo regions.
+    Tiled,
+    // Tiled evaluation with the range Gaussian read from a lookup table.
+    RangeLut,
+    // Vector kernel (AVX2 / AVX-512 / NEON) selected for the running CPU.
+    Simd,
+    // Piecewise-linear filter at a lower resolution, sliced at the full-resolution intensity.
+    Upsampled,
+    // Recursive filtering along rows and columns, runtime independent of the filter size.
+    Recursive,
+    // Permutohedral lattice of (x, y, intensity), runtime independent of the filter size.
+    Permutohedral,
+    // Tiled evaluation on edge tiles and a separable Gaussian on flat tiles, within
+    // BILATERAL_FLAT_TOLERANCE * range_sigma of the exact result.
+    Adaptive,
+    // Guided filter (not a bilateral filter), radius size / 2 and eps range_sigma^2.
+    Guided,
+    // Weighted-least-squares smoothing (not a bilateral filter), lambda space_sigma^2 and edges in
+    // units of range_sigma, runtime independent of the filter size.
+    Wls,
+};
+
+/// <summary>
+/// Applies the bilateral filter on the given intensity image using the selected engine.
+/// See bilateralFilterBruteForce() for the reference semantics.
+/// </summary>
+/// <param name="H">The intensity image to be filtered.</param>
+/// <param name="size">The kernel size, which is always odd (size == 2 * radius + 1).</param>
+/// <param name="space_sigma">spatial sigma value of a gaussian kernel.</param>
+/// <param name="range_sigma">intensity sigma value of a gaussian kernel.</param>
+/// <param name="engine">implementation to use</param>
+/// <param name="output_stats">receives the statistics of the result when given: from the tiles or rows of
+/// the window engines (brute force, tiled, range LUT, SIMD, adaptive) as they are written, from one
+/// more pass over the result for the others</param>
+/// <returns>ImageFloat, the filtered intensity.</returns>
+ImageFloat bilateralFilter(const ImageFloat& H, const int size, const float space_sigma, const float range_sigma, const BilateralEngine engine = BilateralEngine::BruteForce,
+    ImageStatsAccumulator* output_stats = nullptr)
+{
+    const ScopedStage stage("bilateralFilter", H.data.size());
+    ImageFloat result;
+    switch (engine) {
+    case BilateralEngine::Grid:
+        if (!bilateralGridResolvesRange(H, range_sigma)) {
+            // A range_sigma too small for the grid depth, the exact filter instead of a wider range kernel.
+            return bilateralFilterBruteForce(H, size, space_sigma, range_sigma, output_stats);
+        }
+        result = bilateralFilterGrid(H, size, space_sigma, range_sigma);
+        break;
+    case BilateralEngine::Tiled:
+        return bilateralFilterTiled(H, size, space_sigma, range_sigma, currentKernelTuning().bilateral_tile, output_stats);
+    case BilateralEngine::RangeLut:
+        return bilateralFilterRangeLut(H, size, space_sigma, range_sigma, BILATERAL_RANGE_LUT_SIZE, output_stats);
+    case BilateralEngine::Simd:
+        return bilateralFilterSimd(H, size, space_sigma, range_sigma, detectSimdIsa(), output_stats);
+    case BilateralEngine::Upsampled:
+        result = bilateralFilterUpsampled(H, size, space_sigma, range_sigma);
+        break;
+    case BilateralEngine::Recursive:
+        result = bilateralFilterRecursive(H, size, space_sigma, range_sigma);
+        break;
+    case BilateralEngine::Permutohedral:
+        result = bilateralFilterPermutohedral(H, size, space_sigma, range_sigma);
+        break;
+    case BilateralEngine::Adaptive:
+        return bilateralFilterAdaptive(H, size, space_sigma, range_sigma, BILATERAL_FLAT_TOLERANCE, currentKernelTuning().bilateral_tile, nullptr, output_stats);
+    case BilateralEngine::Guided:
+        result = guidedFilter(H, size, range_sigma);
+        break;
+    case BilateralEngine::Wls:
+        result = wlsFilter(H, space_sigma * space_sigma, range_sigma);
+        break;
+    case BilateralEngine::BruteForce:
+    default:
+        return bilateralFilterBruteForce(H, size, space_sigma, range_sigma, output_stats);
+    }
+    if (output_stats) {
+        addImageRows<float>(*output_stats, result);
+    }
+    return result;
+}
+
+/// <summary>
+/// Durand contrast reduction of a single pixel, see applyDurandToneMappingOperator().
+/// </summary>
+/// <param name="b_val">base layer value in ln space</param>
+/// <param name="d_val">detail layer value in ln space</param>
+/// <param name="base_scale">scaling factor for the base layer</param>
+/// <param name="output_gain">scaling factor for the linear output</param>
+/// <returns>linear luminance</returns>
+template <MathPrecision P = MathPrecision::Exact>
+float applyDurandToneMappingPixel(const float b_val, const float d_val, const float base_scale, const float output_gain)
+{
+    float f_val = b_val * base_scale;
+    f_val += d_val;
+    f_val = tmoExp<P>(f_val);
+    f_val *= output_gain;
+    return f_val;
+}
+
+/// <summary>
+/// applyDurandToneMappingOperator() into a caller-provided buffer of the same size.
+/// result may be one of the layers (in place).
+/// </summary>
+/// <param name="base_layer">base layer in ln space</param>
+/// <param name="detail_layer">detail layer in ln space</param>
+/// <param name="base_scale">scaling factor for the base layer</param>
+/// <param name="output_gain">scaling factor for the linear output</param>
+/// <param name="result">output buffer</param>
+/// <param name="precision">accuracy of exp()</param>
+void applyDurandToneMappingOperator(const ImageView<const float> base_layer, const ImageView<const float> detail_layer, const float base_scale, const float output_gain, const ImageView<float> result,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    assert(result.width == base_layer.width && result.height == base_layer.height);
+    assert(detail_layer.width == base_layer.width && detail_layer.height == base_layer.height);
+
+    // A large output is streamed, see streaming_store.h.
+    const bool streaming = useStreamingStores(int64_t(result.width) * result.height * int64_t(sizeof(float)));
+    dispatchMathPrecision(precision, [&](auto tier) {
+        parallelFor(0, base_layer.height, base_layer.width, KernelCost::Medium, [&](const int y) {
+            if (streaming && y + 1 < base_layer.height) {
+                prefetchRow(base_layer.row(y + 1), size_t(base_layer.width) * sizeof(float));
+                prefetchRow(detail_layer.row(y + 1), size_t(base_layer.width) * sizeof(float));
+            }
+            const StreamingRow<float> out(result.row(y), result.width, streaming);
+            for (int x = 0; x < base_layer.width; x++) {
+                auto b_val = base_layer(x, y);
+                auto d_val = detail_layer(x, y);
+
+                out.data()[x] = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, d_val, base_scale, output_gain);
+            }
+            out.commit();
+        });
+    });
+}
+
 /// <summary>
 /// Reduces contrast of an intensity image decomposed in log space (nautral log => ln) and converts it back to the linear space.
 /// Follow instructions from the slides for a correct operation order.
@@ -228,204 +540,797 @@ ImageFloat bilateralFilter(const ImageFloat& H, const int size, const float spac
 /// <param name="detail_layer">detail layer in ln space</param>
 /// <param name="base_scale">scaling factor for the base layer</param>
 /// <param name="output_gain">scaling factor for the linear output</param>
+/// <param name="precision">accuracy of exp()</param>
 /// <returns></returns>
-ImageFloat applyDurandToneMappingOperator(const ImageFloat& base_layer, const ImageFloat& detail_layer, const float base_scale, const float output_gain)
+ImageFloat applyDurandToneMappingOperator(const ImageFloat& base_layer, const ImageFloat& detail_layer, const float base_scale, const float output_gain,
+    const MathPrecision precision = MathPrecision::Exact)
 {
     // Empty output image.
-    auto result = ImageFloat(base_layer.width, base_layer.height);
+    auto result = ImageFloat::uninitialized(base_layer.width, base_layer.height);
+    applyDurandToneMappingOperator(base_layer, detail_layer, base_scale, output_gain, result, precision);
+    // Return final result as SDR.
+    return result;
+}
+
+/// <summary>
+/// Contrast reduction parameters of applyDurandToneMappingOperator().
+/// </summary>
+struct DurandContrast {
+    float base_scale = 0.15f;
+    float output_gain = 0.5f;
+};
 
-    for (int y = 0; y < base_layer.height; y++) {
-        for (int x = 0; x < base_layer.width; x++) {
-            int pos = getImageOffset(base_layer, x, y);
-            auto b_val = base_layer.data[pos];
-            auto d_val = detail_layer.data[pos];
+/// <summary>
+/// Fractions of the base layer below the low and above the high end of its range in
+/// autoDurandContrast(), so a few outliers do not decide the contrast.
+/// </summary>
+constexpr double AUTO_CONTRAST_LOW_PERCENTILE = 0.005;
+constexpr double AUTO_CONTRAST_HIGH_PERCENTILE = 0.995;
 
+/// <summary>
+/// Contrast reduction derived from the statistics of the base layer (Durand and Dorsey): the
+/// range of the base (between the percentiles above) is compressed to target_contrast, never
+/// expanded, and its top is mapped to 1.
+/// </summary>
+/// <param name="base_stats">min/max and value histogram (histogram_of_values) of the base layer, see baseLayerStatsRequest()</param>
+/// <param name="target_contrast">ratio of the brightest to the darkest base luminance in the output</param>
+inline DurandContrast autoDurandContrast(const ImageStats& base_stats, const float target_contrast)
+{
+    const float low = std::max(base_stats.percentile(AUTO_CONTRAST_LOW_PERCENTILE), base_stats.min.r);
+    const float high = std::min(base_stats.percentile(AUTO_CONTRAST_HIGH_PERCENTILE), base_stats.max.r);
+    DurandContrast contrast;
+    contrast.base_scale = std::min(std::log(std::max(target_contrast, 1.0f)) / std::max(high - low, 1e-3f), 1.0f);
+    contrast.output_gain = std::exp(-contrast.base_scale * high);
+    return contrast;
+}
 
-            float f_val = b_val * base_scale;
-            f_val += d_val;
-            f_val = exp(f_val);
-            f_val *= output_gain;
+/// <summary>
+/// applyDurandToneMappingOperator() with the parameters derived from the statistics of the base
+/// layer, see autoDurandContrast().
+/// </summary>
+/// <param name="base_layer">base layer in ln space</param>
+/// <param name="detail_layer">detail layer in ln space</param>
+/// <param name="base_stats">statistics of the base layer, e.g. from bilateralFilter()</param>
+/// <param name="target_contrast">ratio of the brightest to the darkest base luminance in the output</param>
+/// <param name="precision">accuracy of exp()</param>
+ImageFloat applyDurandToneMappingOperator(const ImageFloat& base_layer, const ImageFloat& detail_layer, const ImageStats& base_stats, const float target_contrast,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    const auto contrast = autoDurandContrast(base_stats, target_contrast);
+    return applyDurandToneMappingOperator(base_layer, detail_layer, contrast.base_scale, contrast.output_gain, precision);
+}
 
-            result.data[y * base_layer.width + x] = f_val;
+/// <summary>
+/// applyDurandToneMappingOperator() for base and detail layers kept in 16-bit storage (half or
+/// bfloat16). Rows are widened to fp32 before the pixel operator, the output stays fp32.
+/// </summary>
+template <typename S>
+void applyDurandToneMappingOperator(const ImageView<const S> base_layer, const ImageView<const S> detail_layer, const float base_scale, const float output_gain, const ImageView<float> result,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    assert(result.width == base_layer.width && result.height == base_layer.height);
+    assert(detail_layer.width == base_layer.width && detail_layer.height == base_layer.height);
+
+    dispatchMathPrecision(precision, [&](auto tier) {
+#pragma omp parallel num_threads(kernelThreads(base_layer, KernelCost::Medium))
+        {
+            std::vector<float> b_row(static_cast<size_t>(base_layer.width)), d_row(static_cast<size_t>(base_layer.width));
+#pragma omp for
+            for (int y = 0; y < base_layer.height; y++) {
+                loadRow(base_layer.row(y), b_row.data(), base_layer.width);
+                loadRow(detail_layer.row(y), d_row.data(), base_layer.width);
+                float* out = result.row(y);
+                for (int x = 0; x < base_layer.width; x++) {
+                    out[x] = applyDurandToneMappingPixel<decltype(tier)::value>(b_row[x], d_row[x], base_scale, output_gain);
+                }
+            }
         }
-    }
-    // Return final result as SDR.
-    return result;
+    });
 }
 
 /// <summary>
-/// Rescale RGB by luminances ratio and clamp the output to range [0,1].
-/// All values are in "linear space" (ie., not in log space).
+/// Rescales a single RGB pixel by the luminance ratio, see rescaleRgbByLuminance().
 /// </summary>
-/// <param name="original_rgb">Original RGB image</param>
-/// <param name="original_luminance">original luminance</param>
-/// <param name="new_luminance">new (target) luminance</param>
+/// <param name="val">original RGB</param>
+/// <param name="original_luminance_val">original luminance</param>
+/// <param name="new_luminance_val">new (target) luminance</param>
 /// <param name="saturation">saturation correction coefficient</param>
-/// <returns>new RGB image</returns>
-ImageRGB rescaleRgbByLuminance(const ImageRGB& original_rgb, const ImageFloat& original_luminance, const ImageFloat& new_luminance, const float saturation = 0.5f)
+/// <returns>new RGB clamped to [0,1]</returns>
+template <MathPrecision P = MathPrecision::Exact>
+glm::vec3 rescaleRgbByLuminancePixel(const glm::vec3& val, const float original_luminance_val, const float new_luminance_val, const float saturation)
 {
     // EPSILON for thresholding the divisior.
     const float EPSILON = 1e-7f;
-    // An empty RGB image for the result.
-    auto result = ImageRGB(original_rgb.width, original_rgb.height);
 
-    for (int y = 0; y < original_rgb.height; y++) {
-        for (int x = 0; x < original_rgb.width; x++) {
-            
-            int pos = getImageOffset(original_rgb, x, y);
-            auto val = original_rgb.data[pos];
+    float normalized_r = val.r / std::max(original_luminance_val, EPSILON);
+    float normalized_g = val.g / std::max(original_luminance_val, EPSILON);
+    float normalized_b = val.b / std::max(original_luminance_val, EPSILON);
 
+    float adjusted_r = tmoPow<P>(normalized_r, saturation) * new_luminance_val;
+    float adjusted_g = tmoPow<P>(normalized_g, saturation) * new_luminance_val;
+    float adjusted_b = tmoPow<P>(normalized_b, saturation) * new_luminance_val;
 
-            float original_luminance_val = original_luminance.data[y * original_luminance.width + x];
-            float new_luminance_val = new_luminance.data[y * new_luminance.width + x];
+    adjusted_r = std::clamp(adjusted_r, 0.0f, 1.0f);
+    adjusted_g = std::clamp(adjusted_g, 0.0f, 1.0f);
+    adjusted_b = std::clamp(adjusted_b, 0.0f, 1.0f);
 
+    return { adjusted_r, adjusted_g, adjusted_b };
+}
 
-            float normalized_r = val.r / std::max(original_luminance_val, EPSILON);
-            float normalized_g = val.g / std::max(original_luminance_val, EPSILON);
-            float normalized_b = val.b / std::max(original_luminance_val, EPSILON);
+/// <summary>
+/// rescaleRgbByLuminance() into a caller-provided buffer of the same size.
+/// result may be original_rgb itself (in place).
+/// </summary>
+/// <param name="original_rgb">Original RGB image</param>
+/// <param name="original_luminance">original luminance</param>
+/// <param name="new_luminance">new (target) luminance</param>
+/// <param name="saturation">saturation correction coefficient</param>
+/// <param name="result">output buffer</param>
+/// <param name="precision">accuracy of pow()</param>
+void rescaleRgbByLuminance(const ImageView<const glm::vec3> original_rgb, const ImageView<const float> original_luminance, const ImageView<const float> new_luminance, const float saturation, const ImageView<glm::vec3> result,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    assert(result.width == original_rgb.width && result.height == original_rgb.height);
 
-            float adjusted_r = std::pow(normalized_r, saturation) * new_luminance_val;
-            float adjusted_g = std::pow(normalized_g, saturation) * new_luminance_val;
-            float adjusted_b = std::pow(normalized_b, saturation) * new_luminance_val;
+    dispatchMathPrecision(precision, [&](auto tier) {
+        parallelFor(0, original_rgb.height, original_rgb.width, KernelCost::Medium, [&](const int y) {
+            for (int x = 0; x < original_rgb.width; x++) {
+                auto val = original_rgb(x, y);
 
+                float original_luminance_val = original_luminance(x, y);
+                float new_luminance_val = new_luminance(x, y);
 
-            adjusted_r = std::clamp(adjusted_r, 0.0f, 1.0f);
-            adjusted_g = std::clamp(adjusted_g, 0.0f, 1.0f);
-            adjusted_b = std::clamp(adjusted_b, 0.0f, 1.0f);
+                result(x, y) = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, original_luminance_val, new_luminance_val, saturation);
+            }
+        });
+    });
+}
 
-            result.data[y * result.width + x] = { adjusted_r, adjusted_g, adjusted_b }; 
+/// <summary>
+/// Rescale RGB by luminances ratio and clamp the output to range [0,1].
+/// All values are in "linear space" (ie., not in log space).
+/// </summary>
+/// <param name="original_rgb">Original RGB image</param>
+/// <param name="original_luminance">original luminance</param>
+/// <param name="new_luminance">new (target) luminance</param>
+/// <param name="saturation">saturation correction coefficient</param>
+/// <param name="precision">accuracy of pow()</param>
+/// <returns>new RGB image</returns>
+ImageRGB rescaleRgbByLuminance(const ImageRGB& original_rgb, const ImageFloat& original_luminance, const ImageFloat& new_luminance, const float saturation = 0.5f,
+    const MathPrecision precision = MathPrecision::Exact)
+{
+    // An empty RGB image for the result.
+    auto result = ImageRGB::uninitialized(original_rgb.width, original_rgb.height);
+    rescaleRgbByLuminance(original_rgb, original_luminance, new_luminance, saturation, result, precision);
+    return result;
+}
 
+/// <summary>
+/// Natural log of an image into a caller-provided buffer of the same size, see logImage().
+/// result may be the image itself (in place). The approximate tiers run the row kernel of the
+/// detected instruction set, see fast_math_simd.h.
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="result">output buffer</param>
+/// <param name="precision">accuracy of log()</param>
+void logImage(const ImageView<const float> image, const ImageView<float> result, const MathPrecision precision = MathPrecision::Exact)
+{
+    assert(result.width == image.width && result.height == image.height);
+    dispatchMathPrecision(precision, [&](auto tier) {
+        if constexpr (decltype(tier)::value == MathPrecision::Exact) {
+            parallelFor(0, image.height, image.width, KernelCost::Medium, [&](const int y) {
+                for (int x = 0; x < image.width; x++) {
+                    result(x, y) = tmoLog<MathPrecision::Exact>(std::max(image(x, y), 1e-8f));
+                }
+            });
+        } else {
+            const auto kernel = logRowKernel<decltype(tier)::value>(detectSimdIsa());
+            parallelFor(0, image.height, image.width, KernelCost::Light, [&](const int y) { kernel(image.row(y), result.row(y), image.width); });
         }
-    }
+    });
+}
 
+/// <summary>
+/// Natural log of an image at the given math precision, see logImage().
+/// </summary>
+/// <param name="image">input image</param>
+/// <param name="precision">accuracy of log()</param>
+/// <returns>ln(image)</returns>
+ImageFloat logImage(const ImageFloat& image, const MathPrecision precision)
+{
+    auto result = ImageFloat::uninitialized(image.width, image.height);
+    logImage(image, result, precision);
     return result;
 }
 
-
-
-#pragma endregion HDR TMO
-
-
-#pragma region Poisson editing
-
-
 /// <summary>
-/// Compute dX and dY gradients of an image. 
-/// The output is expected to be 1px bigger than the input to contain all "over-the-boundary" gradients.
-/// The input image is considered to be padded by zeros.
+/// Detail layer H - base into a caller-provided buffer of the same size, see getDetailImage().
+/// result may be H or base (in place).
 /// </summary>
-/// <param name="image">input scalar image</param>
-/// <returns>grad image</returns>
-ImageGradient getGradients(const ImageFloat& image)
+/// <param name="H">log intensity</param>
+/// <param name="base">base layer</param>
+/// <param name="result">output buffer</param>
+void getDetailImage(const ImageView<const float> H, const ImageView<const float> base, const ImageView<float> result)
 {
-    // An empty gradient pair (dx, dy).
-    auto grad = ImageGradient({ image.width + 1, image.height + 1 }, { image.width + 1, image.height + 1 });
-
-    for (int y = 0; y < image.height; ++y) {
-        for (int x = 0; x < image.width; ++x) {
-            // Get the offset 
-            int currentxy = getImageOffset(image, x, y);
-
-            // Compute dx
-            float dx = 0.0f; // Initialize
-            if (x + 1 < image.width) { // Boundary handling
-                int nextx = getImageOffset(image, x + 1, y);
-                dx = image.data[nextx] - image.data[currentxy];
-            }
+    evaluateInto(H - base, result);
+}
 
-            // Compute dy 
-            float dy = 0.0f; // Initialize
-            if (y + 1 < image.height) { // Boundary handling
-                int nexty = getImageOffset(image, x, y + 1);
-                dy = image.data[nexty] - image.data[currentxy];
+/// <summary>
+/// getDetailImage() with the base and detail layers in 16-bit storage; the difference is taken in
+/// fp32 and rounded once. result may be base (in place).
+/// </summary>
+template <typename S>
+void getDetailImage(const ImageView<const float> H, const ImageView<const S> base, const ImageView<S> result)
+{
+    assert(result.width == H.width && result.height == H.height);
+#pragma omp parallel num_threads(kernelThreads(H, KernelCost::Light))
+    {
+        std::vector<float> row(static_cast<size_t>(H.width));
+#pragma omp for
+        for (int y = 0; y < H.height; y++) {
+            loadRow(base.row(y), row.data(), H.width);
+            const float* h_row = H.row(y);
+            for (int x = 0; x < H.width; x++) {
+                row[x] = h_row[x] - row[x];
             }
-
-            // Store the gradients in the respective gradient images
-            int gradOffset = getImageOffset(grad.dx, x, y);
-            grad.dx.data[gradOffset] = dx;
-            grad.dy.data[gradOffset] = dy;
+            storeRow(row.data(), result.row(y), H.width);
         }
     }
-
-    // Step 7: Return the gradient structure
-    return grad;
 }
 
 /// <summary>
-/// Merges two gradient images:
-/// - Use source gradients where source_mask > 0.5
-/// - Use target gradients where source_mask <= 0.5
-/// - Set gradients to 0 for gradients crossing the mask boundary (see slides).
-/// Warning: dX and dY gradients often do not cross the boundary at the same time.
-/// Refer to the slides for details.
+/// Tone mapping operators of the pipeline.
 /// </summary>
-/// <param name="source"></param>
-/// <param name="target"></param>
-/// <param name="source_mask"></param>
-/// <returns></returns>
-ImageGradient copySourceGradientsToTarget(const ImageGradient& source, const ImageGradient& target, const ImageFloat& source_mask)
-{   
-    // An empty gradient pair (dx, dy).
-    ImageGradient result = ImageGradient({ target.dx.width, target.dx.height }, { target.dx.width, target.dx.height });
+enum class ToneMapOperator {
+    // Bilateral base/detail decomposition, toneMapDurand().
+    Durand,
+    // Fast local Laplacian filter of the log-luminance, toneMapLocalLaplacian().
+    LocalLaplacian,
+    // Global curves in one pass after a luminance reduction, toneMapGlobal().
+    Reinhard,
+    Filmic,
+    // Attenuated log-luminance gradients and a Poisson reconstruction, toneMapFattal().
+    Fattal,
+};
 
-    for (int y = 0; y < source_mask.height; ++y) {
-        for (int x = 0; x < source_mask.width; ++x) {
+/// <summary>
+/// Parameters of the Durand tone-mapping pipeline (defaults match main.cpp).
+/// </summary>
+struct DurandParams {
+    // Bilateral kernel size, always odd.
+    int filter_size = 27;
+    float space_sigma = 27 / 6.4f;
+    float range_sigma = 1.0f;
+    // Contrast reduction.
+    float base_scale = 0.15f;
+    float output_gain = 0.5f;
+    // Derive base_scale and output_gain from the base layer instead, see autoDurandContrast()
+    // and AutoContrast.
+    bool auto_contrast = false;
+    float target_contrast = 5.0f;
+    // Saturation correction of rescaleRgbByLuminance().
+    float saturation = 0.5f;
+    BilateralEngine engine = BilateralEngine::BruteForce;
+    // Joint filter of the log-luminance guided by the log RGB (jointBilateralFilter()), so that
+    // chroma edges are kept as well; the engine is not used then.
+    bool color_guide = false;
+    // Accuracy of log/exp/pow in the per-pixel passes ("fast math" option).
+    MathPrecision math_precision = MathPrecision::Exact;
+    // Operator of toneMap(). LocalLaplacian uses range_sigma, base_scale, output_gain and
+    // saturation, the filter settings are ignored.
+    ToneMapOperator tone_operator = ToneMapOperator::Durand;
+    // Exposure of the global operators: key / log-average luminance.
+    float key = 0.18f;
+    // Exposed luminance that Reinhard maps to 1, the exposed maximum when <= 0.
+    float white_point = 0.0f;
+    // Gradient-domain compression (see gradient_compression.h): gradients above gradient_alpha
+    // times the average magnitude are scaled by (magnitude / alpha)^(gradient_beta - 1). Also
+    // uses output_gain and saturation.
+    float gradient_alpha = 0.1f;
+    float gradient_beta = 0.85f;
+    // Backend of the reconstruction.
+    StencilMethod gradient_solver = StencilMethod::Multigrid;
+    // Look applied to the display result (see color_lut.h), none when null.
+    std::shared_ptr<const ColorLut3D> look;
+};
 
-            int pos = getImageOffset(source_mask, x, y);
-            auto mask_val = source_mask.data[pos];
+/// <summary>
+/// Statistics of a base layer for autoDurandContrast(): min/max and a histogram of the ln values,
+/// 64 bins per unit over a range far wider than any real scene.
+/// </summary>
+inline ImageStatsRequest baseLayerStatsRequest()
+{
+    ImageStatsRequest request;
+    request.stats = StatMinMax | StatHistogram;
+    request.histogram_bins = 3072;
+    request.histogram_min = -24.0f;
+    request.histogram_max = 24.0f;
+    request.histogram_of_values = true;
+    return request;
+}
 
-            int gradOffset = getImageOffset(result.dx, x, y);
-            
-            // Use either target or source gradients depending on mask value
-            if (mask_val > 0.5) {
+/// <summary>
+/// params.auto_contrast of one image: collects the statistics of the base layer while it is
+/// filtered (pass stats() to durandBaseLayer()) and then fills in the contrast reduction.
+/// </summary>
+class AutoContrast {
+public:
+    AutoContrast(const DurandParams& params, const int width, const int height)
+        : m_params(params)
+    {
+        if (params.auto_contrast) {
+            m_stats.emplace(width, height, baseLayerStatsRequest());
+        }
+    }
 
-                result.dx.data[gradOffset] = source.dx.data[gradOffset];
-                result.dy.data[gradOffset] = source.dy.data[gradOffset];
+    /// <summary>
+    /// Accumulator of the base layer statistics, null without auto_contrast.
+    /// </summary>
+    ImageStatsAccumulator* stats() { return m_stats ? &*m_stats : nullptr; }
 
-            } else {
-                result.dx.data[gradOffset] = target.dx.data[gradOffset];
-                result.dy.data[gradOffset] = target.dy.data[gradOffset];
-            }
+    /// <summary>
+    /// The parameters with base_scale and output_gain derived from the base layer, unchanged
+    /// without auto_contrast. Call once, after the base layer was filtered.
+    /// </summary>
+    DurandParams resolve()
+    {
+        DurandParams params = m_params;
+        if (m_stats) {
+            const auto contrast = autoDurandContrast(m_stats->finish(), params.target_contrast);
+            params.base_scale = contrast.base_scale;
+            params.output_gain = contrast.output_gain;
+        }
+        return params;
+    }
 
+private:
+    DurandParams m_params;
+    std::optional<ImageStatsAccumulator> m_stats;
+};
 
-            if (x > 0) {
-                int left_pos = getImageOffset(source_mask, x-1, y);
-                float left_mask = source_mask.data[left_pos];
-                // Check if only one of the pixels belong to the source area - boundary handling
-                if ((mask_val > 0.5) != (left_mask > 0.5)) {
-                    result.dx.data[gradOffset] = 0;                 
-                }
+/// <summary>
+/// Pass 1 of toneMapDurand(): log-luminance of an HDR image.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters (math_precision)</param>
+/// <param name="output_hash">receives the rows of the result as they are written when given, e.g. for the key of bilateralFilterCached()</param>
+/// <returns>log-luminance image</returns>
+ImageFloat durandLogLuminance(const ImageRGB& hdr_image, const DurandParams& params = {}, ImageHashAccumulator* output_hash = nullptr)
+{
+    const int width = hdr_image.width;
+    auto log_lum_H = ImageFloat::uninitialized(hdr_image.width, hdr_image.height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for num_threads(kernelThreads(hdr_image, KernelCost::Medium))
+        for (int y = 0; y < hdr_image.height; y++) {
+            const glm::vec3* in = hdr_image.data.data() + size_t(y) * size_t(width);
+            float* out = log_lum_H.data.data() + size_t(y) * size_t(width);
+            for (int x = 0; x < width; x++) {
+                out[x] = tmoLog<decltype(tier)::value>(std::max(rgbToLuminancePixel(in[x]), 1e-8f));
             }
-
-            if (x < source_mask.width-1) {
-                int right_pos = getImageOffset(source_mask, x + 1, y);
-                float right_mask = source_mask.data[right_pos];
-                // Boundary handling
-                if ((mask_val > 0.5) != (right_mask > 0.5)) {
-                    result.dx.data[gradOffset] = 0;
-                }
+            if (output_hash) {
+                output_hash->addRow(y, out);
             }
+        }
+    });
+    return log_lum_H;
+}
 
-            if (y > 0) {
-                int down_pos = getImageOffset(source_mask, x, y-1);
-                float down_mask = source_mask.data[down_pos];
-                // Boundary handling
-                if ((mask_val > 0.5) != (down_mask > 0.5)) {
-                    result.dy.data[gradOffset] = 0;
-                }
-            }
+/// <summary>
+/// Pass 2 of toneMapDurand(): base layer, the bilateral filter of the log-luminance, or with
+/// params.color_guide the joint filter guided by the log RGB of the image.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="log_lum_H">durandLogLuminance() of the image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <param name="base_stats">receives the statistics of the base layer when given, see AutoContrast</param>
+/// <returns>base layer</returns>
+ImageFloat durandBaseLayer(const ImageRGB& hdr_image, const ImageFloat& log_lum_H, const DurandParams& params = {}, ImageStatsAccumulator* base_stats = nullptr)
+{
+    if (params.color_guide) {
+        const ScopedStage stage("jointBilateralFilter", log_lum_H.data.size());
+        auto base = jointBilateralFilter(log_lum_H, durandColorGuide(hdr_image), params.space_sigma, params.range_sigma);
+        if (base_stats) {
+            addImageRows<float>(*base_stats, base);
+        }
+        return base;
+    }
+    return bilateralFilter(log_lum_H, params.filter_size, params.space_sigma, params.range_sigma, params.engine, base_stats);
+}
 
-            if (y < source_mask.height - 1) {
-                int up_pos = getImageOffset(source_mask, x, y+1);
-                float up_mask = source_mask.data[up_pos];
-                // Boundary handling
-                if ((mask_val > 0.5) != (up_mask > 0.5)) {
-                    result.dy.data[gradOffset] = 0;
-                }
-            }
+/// <summary>
+/// Pass 3 of toneMapDurand(): detail, contrast reduction and RGB rescale in registers.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="log_lum_H">durandLogLuminance() of the image</param>
+/// <param name="base_image">base layer, the bilateral filter of log_lum_H</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB durandCompose(const ImageRGB& hdr_image, const ImageFloat& log_lum_H, const ImageFloat& base_image, const DurandParams& params = {})
+{
+    const auto num_pixels = int(hdr_image.data.size());
+    auto result = ImageRGB::uninitialized(hdr_image.width, hdr_image.height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            const auto val = hdr_image.data[i];
+            const float b_val = base_image.data[i];
+            const float d_val = log_lum_H.data[i] - b_val;
+            const float tmo_luminance = applyDurandToneMappingPixel<decltype(tier)::value>(b_val, d_val, params.base_scale, params.output_gain);
+            result.data[i] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Fused Durand tone mapping: luminance -> log -> base/detail -> contrast reduction -> RGB rescale.
+/// Produces the same result as calling the individual stages as in main.cpp, but only materializes
+/// the log-luminance (needed by the bilateral neighborhood) and the base layer.
+/// Luminance, detail and the new luminance are recomputed per pixel in the final pass.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapDurand(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    const auto log_lum_H = durandLogLuminance(hdr_image, params);
+    AutoContrast auto_contrast(params, hdr_image.width, hdr_image.height);
+    const auto base_image = durandBaseLayer(hdr_image, log_lum_H, params, auto_contrast.stats());
+    return durandCompose(hdr_image, log_lum_H, base_image, auto_contrast.resolve());
+}
+
+/// <summary>
+/// toneMapDurand() described as kernels and run with a separate schedule (see kernel_schedule.h):
+/// the log-luminance is the pointwise producer, the bilateral filter the stencil over it and the
+/// contrast reduction with the RGB rescale the consumer. The window is evaluated in the order of
+/// bilateralFilterBruteForce(), so every schedule gives the result of the brute-force engine.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters (the engine is not used)</param>
+/// <param name="schedule">loop structure, by default the "durand" schedule of the run</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapDurandScheduled(const ImageRGB& hdr_image, const DurandParams& params = {}, const KernelSchedule& schedule = currentSchedules().get("durand", KernelKind::Stencil))
+{
+    assert(params.filter_size % 2 == 1);
+    const int size = params.filter_size;
+    const int radius = size / 2;
+    const int width = hdr_image.width;
+    const float space_sigma = params.space_sigma;
+    const float range_sigma = params.range_sigma;
+
+    // Same spatial table as bilateralFilterBruteForce().
+    std::vector<float> spatialWeights(size_t(size) * size_t(size));
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            spatialWeights[(i + radius) * size + (j + radius)] = exp(-(i * i + j * j) / (2.0f * space_sigma * space_sigma));
         }
     }
 
+    auto result = ImageRGB::uninitialized(width, hdr_image.height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+        constexpr auto precision = decltype(tier)::value;
+        const auto hdr = [&](const int x, const int y) { return hdr_image.data[size_t(y) * size_t(width) + size_t(x)]; };
+
+        const PointwiseKernel log_luminance { [&](const int x, const int y) { return tmoLog<precision>(std::max(rgbToLuminancePixel(hdr(x, y)), 1e-8f)); } };
+
+        const StencilKernel base_layer { radius, [&](const StencilWindow<float>& H, const int x, const int y) {
+                                            const int dy0 = std::max(-radius, -y);
+                                            const int dy1 = std::min(radius, H.height - 1 - y);
+                                            const int dx0 = std::max(-radius, -x);
+                                            const int dx1 = std::min(radius, H.width - 1 - x);
+                                            const float val = H.row(y)[x];
+                                            float K = 0.0f;
+                                            float filteredValue = 0.0f;
+                                            for (int dy = dy0; dy <= dy1; dy++) {
+                                                const float* row = H.row(y + dy) + x;
+                                                const float* weights = &spatialWeights[(dy + radius) * size + radius];
+                                                for (int dx = dx0; dx <= dx1; dx++) {
+                                                    const float n_val = row[dx];
+                                                    float rangeWeight = exp(-(val - n_val) * (val - n_val) / (2.0f * range_sigma * range_sigma));
+                                                    float weight = weights[dx] * rangeWeight;
+                                                    filteredValue += weight * n_val;
+                                                    K += weight;
+                                                }
+                                            }
+                                            return filteredValue / K;
+                                        } };
+
+        const PointwiseKernel compose { [&](const int x, const int y, const StencilWindow<float>& H, const float b_val) {
+            const auto val = hdr(x, y);
+            const float d_val = H.row(y)[x] - b_val;
+            const float tmo_luminance = applyDurandToneMappingPixel<precision>(b_val, d_val, params.base_scale, params.output_gain);
+            return rescaleRgbByLuminancePixel<precision>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+        } };
+
+        realizeStencilChain<float, float>("toneMapDurandScheduled", log_luminance, base_layer, compose, result.view(), schedule);
+    });
+    return result;
+}
+
+/// <summary>
+/// Local Laplacian tone mapping: the log-luminance is filtered by localLaplacianFilter() with
+/// details up to range_sigma kept, and edges and the residual scaled by base_scale, then it is
+/// converted back like durandCompose() (exp, output_gain, RGB rescale).
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapLocalLaplacian(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    const auto log_lum_H = durandLogLuminance(hdr_image, params);
+    const auto tmo_log_lum = [&] {
+        const ScopedStage stage("localLaplacianFilter", log_lum_H.data.size());
+        return localLaplacianFilter(log_lum_H, params.range_sigma, 1.0f, params.base_scale, params.base_scale);
+    }();
+    const auto num_pixels = int(hdr_image.data.size());
+    auto result = ImageRGB::uninitialized(hdr_image.width, hdr_image.height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            const auto val = hdr_image.data[i];
+            const float tmo_luminance = tmoExp<decltype(tier)::value>(tmo_log_lum.data[i]) * params.output_gain;
+            result.data[i] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Log-average and maximum luminance of an image in one parallel pass, see computeImageStats().
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <returns>luminance statistics</returns>
+LuminanceStats getLuminanceStats(const ImageView<const glm::vec3> hdr_image)
+{
+    ImageStatsRequest request;
+    request.stats = StatLogMean;
+    const auto stats = computeImageStats<glm::vec3>(hdr_image, request);
+    return { float(stats.log_mean), std::max(stats.max_luminance, 1e-6f) };
+}
+
+/// <summary>
+/// Global tone mapping (params.tone_operator Reinhard or Filmic) with given luminance statistics,
+/// e.g. of the whole frame for a region of it: luminance, curve and RGB rescale fused in one pass
+/// over the pixels.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters (key, white_point, saturation, math_precision)</param>
+/// <param name="stats">luminance statistics the exposure and white point are derived from</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapGlobal(const ImageRGB& hdr_image, const DurandParams& params, const LuminanceStats& stats)
+{
+    const float exposure = params.key / stats.log_average;
+    const float white = params.white_point > 0.0f ? params.white_point : stats.max * exposure;
+    const bool filmic = params.tone_operator == ToneMapOperator::Filmic;
+    const auto num_pixels = int(hdr_image.data.size());
+    auto result = ImageRGB::uninitialized(hdr_image.width, hdr_image.height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            const auto val = hdr_image.data[i];
+            const float lum = rgbToLuminancePixel(val);
+            const float exposed = lum * exposure;
+            const float tmo_luminance = filmic ? acesFilmicCurve(exposed) : reinhardCurve(exposed, white);
+            result.data[i] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, lum, tmo_luminance, params.saturation);
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Global tone mapping (params.tone_operator Reinhard or Filmic): the luminance statistics, then
+/// luminance, curve and RGB rescale fused in one pass over the pixels.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters (key, white_point, saturation, math_precision)</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapGlobal(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    return toneMapGlobal(hdr_image, params, getLuminanceStats(hdr_image));
+}
+
+/// <summary>
+/// The banded tone mappers below filter one band at a time, so auto_contrast would give every
+/// band its own contrast.
+/// </summary>
+inline void rejectBandedAutoContrast(const DurandParams& params)
+{
+    if (params.auto_contrast) {
+        std::cerr << "auto_contrast needs the whole image and cannot be used when tone mapping in bands." << std::endl;
+        throw std::exception();
+    }
+}
+
+/// <summary>
+/// toneMapDurand() of a Radiance HDR file that is streamed in bands of band_rows scanlines, for
+/// images too large to load. Each band is read with a halo of filter_size / 2 rows; with an engine
+/// that evaluates the exact window (BruteForce, Tiled, Simd) the output equals toneMapDurand() of
+/// the whole image. Grid and RangeLut adapt to the value range of each band and differ slightly.
+/// params.auto_contrast needs the base layer of the whole image and is rejected.
+/// </summary>
+/// <param name="input_path">Radiance .hdr input</param>
+/// <param name="output_path">Radiance .hdr output with the tone-mapped RGB in [0,1]</param>
+/// <param name="band_rows">rows per band, the memory footprint is O(width * (band_rows + filter_size))</param>
+/// <param name="params">tone-mapping parameters</param>
+void toneMapDurandStreamed(const std::filesystem::path& input_path, const std::filesystem::path& output_path, const int band_rows, const DurandParams& params = {})
+{
+    rejectBandedAutoContrast(params);
+    processHdrInBands(input_path, output_path, band_rows, params.filter_size / 2, [&](const ImageRGB& window, const int halo_top, const int num_rows) {
+        const auto window_result = toneMapDurand(window, params);
+        return ImageRGB(window_result.view(0, halo_top, window_result.width, num_rows));
+    });
+}
+
+/// <summary>
+/// toneMapDurandStreamed() into memory: only the result is held in full, the HDR image and the
+/// intermediate layers exist for one band at a time.
+/// </summary>
+/// <param name="input_path">Radiance .hdr input</param>
+/// <param name="band_rows">rows per band</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapDurandInBands(const std::filesystem::path& input_path, const int band_rows, const DurandParams& params = {})
+{
+    rejectBandedAutoContrast(params);
+    HdrBandReader reader(input_path, band_rows, params.filter_size / 2);
+    auto result = ImageRGB::uninitialized(reader.width(), reader.height());
+    while (reader.next()) {
+        const auto window_result = toneMapDurand(reader.window(), params);
+        const int num_rows = reader.bandEnd() - reader.bandBegin();
+        std::copy_n(window_result.data.begin() + ptrdiff_t(reader.haloTop()) * window_result.width, ptrdiff_t(num_rows) * window_result.width,
+            result.data.begin() + ptrdiff_t(reader.bandBegin()) * result.width);
+    }
+    return result;
+}
+
+
+#pragma endregion HDR TMO
+
+
+#pragma region Poisson editing
+
+
+/// <summary>
+/// Compute dX and dY gradients of an image. 
+/// The output is expected to be 1px bigger than the input to contain all "over-the-boundary" gradients.
+/// The input image is considered to be padded by zeros.
+/// </summary>
+/// <param name="image">input scalar image</param>
+/// <returns>grad image</returns>
+ImageGradient getGradients(const ImageFloat& image)
+{
+    // An empty gradient pair (dx, dy).
+    auto grad = ImageGradient({ image.width + 1, image.height + 1 }, { image.width + 1, image.height + 1 });
+
+    // Interior: the right and lower neighbors exist.
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        const float* row = image.data.data() + getImageOffset(image, 0, y);
+        const float* below = row + image.width;
+        float* dx = grad.dx.data.data() + getImageOffset(grad.dx, 0, y);
+        float* dy = grad.dy.data.data() + getImageOffset(grad.dy, 0, y);
+#pragma omp simd
+        for (int x = x0; x < x1; ++x) {
+            dx[x] = row[x + 1] - row[x];
+            dy[x] = below[x] - row[x];
+        }
+    };
+
+    // Last row and column.
+    const auto border = [&](const int x, const int y) {
+        // Get the offset 
+        int currentxy = getImageOffset(image, x, y);
+
+        // Compute dx
+        float dx = 0.0f; // Initialize
+        if (x + 1 < image.width) { // Boundary handling
+            int nextx = getImageOffset(image, x + 1, y);
+            dx = image.data[nextx] - image.data[currentxy];
+        }
+
+        // Compute dy 
+        float dy = 0.0f; // Initialize
+        if (y + 1 < image.height) { // Boundary handling
+            int nexty = getImageOffset(image, x, y + 1);
+            dy = image.data[nexty] - image.data[currentxy];
+        }
+
+        // Store the gradients in the respective gradient images
+        int gradOffset = getImageOffset(grad.dx, x, y);
+        grad.dx.data[gradOffset] = dx;
+        grad.dy.data[gradOffset] = dy;
+    };
+
+    forEachStencilPixel(image.width, image.height, StencilReach { 0, 0, 1, 1 }, interior, border);
+
+    // Step 7: Return the gradient structure
+    return grad;
+}
+
+/// <summary>
+/// Merges two gradient images:
+/// - Use source gradients where source_mask is set (float masks are thresholded at > 0.5)
+/// - Use target gradients elsewhere
+/// - Set gradients to 0 for gradients crossing the mask boundary (see slides).
+/// Warning: dX and dY gradients often do not cross the boundary at the same time.
+/// Refer to the slides for details.
+/// </summary>
+/// <param name="source">source gradients, at the size of the source (and mask)</param>
+/// <param name="target">target gradients</param>
+/// <param name="source_mask">source mask, at the size of the source</param>
+/// <param name="offset_x">target column of the source pixel (0, 0)</param>
+/// <param name="offset_y">target row of the source pixel (0, 0)</param>
+/// <returns>merged gradients, at the size of the target</returns>
+ImageGradient copySourceGradientsToTarget(const ImageGradient& source, const ImageGradient& target, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0)
+{   
+    // An empty gradient pair (dx, dy).
+    ImageGradient result = ImageGradient({ target.dx.width, target.dx.height }, { target.dx.width, target.dx.height });
+
+    // The target image is 1px smaller than its gradients.
+    const int width = target.dx.width - 1;
+    const int height = target.dx.height - 1;
+    // The mask placed in the target frame, out of frame pixels are clear.
+    const auto inside = source_mask.placed(width, height, offset_x, offset_y);
+
+    // Interior: all four neighbors exist.
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        const int gradRow = getImageOffset(result.dx, 0, y);
+        // Rows without mask pixels around them keep the target gradients.
+        if (inside.rowEmpty(y - 1) && inside.rowEmpty(y) && inside.rowEmpty(y + 1)) {
+            std::copy(target.dx.data.begin() + gradRow + x0, target.dx.data.begin() + gradRow + x1, result.dx.data.begin() + gradRow + x0);
+            std::copy(target.dy.data.begin() + gradRow + x0, target.dy.data.begin() + gradRow + x1, result.dy.data.begin() + gradRow + x0);
+            return;
+        }
+        // Boundary handling a word of the mask at a time: the bits of the pixels whose gradients
+        // cross the mask boundary (see maskEdgeBits()).
+        for (int x = x0; x < x1;) {
+            const auto edges = maskEdgeBits(inside, x >> 6, y);
+            for (const int word_end = std::min(x1, (x | 63) + 1); x < word_end; ++x) {
+                const int bit = x & 63;
+                const bool mask_val = (edges.inside >> bit) & 1;
+                const int gradOffset = gradRow + x;
+                // Only pixels under the mask read the source, so its offset is always inside it.
+                const float dx = mask_val ? source.dx.data[getImageOffset(source.dx, x - offset_x, y - offset_y)] : target.dx.data[gradOffset];
+                const float dy = mask_val ? source.dy.data[getImageOffset(source.dy, x - offset_x, y - offset_y)] : target.dy.data[gradOffset];
+                result.dx.data[gradOffset] = (edges.cut_x >> bit) & 1 ? 0.0f : dx;
+                result.dy.data[gradOffset] = (edges.cut_y >> bit) & 1 ? 0.0f : dy;
+            }
+        }
+    };
+
+    // Pixels on the image border, where some neighbors are missing.
+    const auto border = [&](const int x, const int y) {
+        const bool mask_val = inside(x, y);
+
+        int gradOffset = getImageOffset(result.dx, x, y);
+
+        // Use either target or source gradients depending on mask value
+        if (mask_val) {
+            int sourceOffset = getImageOffset(source.dx, x - offset_x, y - offset_y);
+            result.dx.data[gradOffset] = source.dx.data[sourceOffset];
+            result.dy.data[gradOffset] = source.dy.data[sourceOffset];
+
+        } else {
+            result.dx.data[gradOffset] = target.dx.data[gradOffset];
+            result.dy.data[gradOffset] = target.dy.data[gradOffset];
+        }
+
+        // Check if only one of the pixels belong to the source area - boundary handling
+        if (x > 0 && inside(x - 1, y) != mask_val) {
+            result.dx.data[gradOffset] = 0;
+        }
+        if (x < width - 1 && inside(x + 1, y) != mask_val) {
+            result.dx.data[gradOffset] = 0;
+        }
+        if (y > 0 && inside(x, y - 1) != mask_val) {
+            result.dy.data[gradOffset] = 0;
+        }
+        if (y < height - 1 && inside(x, y + 1) != mask_val) {
+            result.dy.data[gradOffset] = 0;
+        }
+    };
+
+    forEachStencilPixel(width, height, StencilReach { 1, 1, 1, 1 }, interior, border);
+
     return result;
 }
 
@@ -439,88 +1344,775 @@ ImageGradient copySourceGradientsToTarget(const ImageGradient& source, const Ima
 /// </summary>
 /// <param name="gradients">gradients</param>
 /// <returns>div G</returns>
-ImageFloat getDivergence(ImageGradient& gradients)
+ImageFloat getDivergence(const ImageGradient& gradients)
 {
     // An empty divergence field 
     auto div_G = ImageFloat(gradients.dx.width + 1, gradients.dx.height + 1);
 
-    for (int y = 0; y < gradients.dy.height; ++y) {
-        for (int x = 0; x < gradients.dx.width; ++x) {
-            // Calculate Gx/x
-            float div_x = gradients.dx.data[getImageOffset(gradients.dx, x, y)];
-            if (x > 0) {
-                div_x -= gradients.dx.data[getImageOffset(gradients.dx, x - 1, y)];
+    // Interior: the left and upper neighbors exist.
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        const float* dx = gradients.dx.data.data() + getImageOffset(gradients.dx, 0, y);
+        const float* dy = gradients.dy.data.data() + getImageOffset(gradients.dy, 0, y);
+        const float* dy_above = dy - gradients.dy.width;
+        float* out = div_G.data.data() + getImageOffset(div_G, 0, y);
+#pragma omp simd
+        for (int x = x0; x < x1; ++x) {
+            out[x] = (dx[x] - dx[x - 1]) + (dy[x] - dy_above[x]);
+        }
+    };
+
+    // First row and column.
+    const auto border = [&](const int x, const int y) {
+        // Calculate Gx/x
+        float div_x = gradients.dx.data[getImageOffset(gradients.dx, x, y)];
+        if (x > 0) {
+            div_x -= gradients.dx.data[getImageOffset(gradients.dx, x - 1, y)];
+        }
+
+        // Calculate Gy/y
+        float div_y = gradients.dy.data[getImageOffset(gradients.dy, x, y)];
+        if (y > 0) {
+            div_y -= gradients.dy.data[getImageOffset(gradients.dy, x, y - 1)];
+        }
+
+        // Sum partial derivatives for divergence.
+        div_G.data[getImageOffset(div_G, x, y)] = div_x + div_y;
+    };
+
+    forEachStencilPixel(gradients.dx.width, gradients.dy.height, StencilReach { 1, 1, 0, 0 }, interior, border);
+
+    return div_G;
+}
+
+/// <summary>
+/// getGradients() with the gradients in the given layout, the same values for both.
+/// </summary>
+/// <param name="image">input scalar image</param>
+/// <returns>grad image, 1px bigger than the input</returns>
+template <GradientLayout Layout>
+ImageGradientOf<Layout> getGradients(const ImageFloat& image)
+{
+    if constexpr (Layout == GradientLayout::Planar) {
+        return getGradients(image);
+    } else {
+        auto grad = ImageGradientInterleaved { Image<glm::vec2>(image.width + 1, image.height + 1) };
+
+        const auto interior = [&](const int y, const int x0, const int x1) {
+            const float* row = image.data.data() + getImageOffset(image, 0, y);
+            const float* below = row + image.width;
+            glm::vec2* dxy = grad.dxy.data.data() + getImageOffset(grad.dxy, 0, y);
+#pragma omp simd
+            for (int x = x0; x < x1; ++x) {
+                dxy[x] = glm::vec2(row[x + 1] - row[x], below[x] - row[x]);
             }
+        };
+        const auto border = [&](const int x, const int y) {
+            const float value = image.data[getImageOffset(image, x, y)];
+            const float dx = x + 1 < image.width ? image.data[getImageOffset(image, x + 1, y)] - value : 0.0f;
+            const float dy = y + 1 < image.height ? image.data[getImageOffset(image, x, y + 1)] - value : 0.0f;
+            grad.dxy.data[getImageOffset(grad.dxy, x, y)] = glm::vec2(dx, dy);
+        };
+        forEachStencilPixel(image.width, image.height, StencilReach { 0, 0, 1, 1 }, interior, border);
+        return grad;
+    }
+}
 
-            // Calculate Gy/y
-            float div_y = gradients.dy.data[getImageOffset(gradients.dy, x, y)];
-            if (y > 0) {
-                div_y -= gradients.dy.data[getImageOffset(gradients.dy, x, y - 1)];
+/// <summary>
+/// copySourceGradientsToTarget() of interleaved gradients: the merged dx and dy of a pixel are
+/// read and written together.
+/// </summary>
+ImageGradientInterleaved copySourceGradientsToTarget(const ImageGradientInterleaved& source, const ImageGradientInterleaved& target, const BinaryMask& source_mask,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    auto result = ImageGradientInterleaved { Image<glm::vec2>(target.dxy.width, target.dxy.height) };
+    const int width = target.dxy.width - 1;
+    const int height = target.dxy.height - 1;
+    const auto inside = source_mask.placed(width, height, offset_x, offset_y);
+
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        const int gradRow = getImageOffset(result.dxy, 0, y);
+        if (inside.rowEmpty(y - 1) && inside.rowEmpty(y) && inside.rowEmpty(y + 1)) {
+            std::copy(target.dxy.data.begin() + gradRow + x0, target.dxy.data.begin() + gradRow + x1, result.dxy.data.begin() + gradRow + x0);
+            return;
+        }
+        for (int x = x0; x < x1;) {
+            const auto edges = maskEdgeBits(inside, x >> 6, y);
+            for (const int word_end = std::min(x1, (x | 63) + 1); x < word_end; ++x) {
+                const int bit = x & 63;
+                const bool mask_val = (edges.inside >> bit) & 1;
+                const glm::vec2 dxy = mask_val ? source.dxy.data[getImageOffset(source.dxy, x - offset_x, y - offset_y)] : target.dxy.data[gradRow + x];
+                result.dxy.data[gradRow + x] = glm::vec2((edges.cut_x >> bit) & 1 ? 0.0f : dxy.x, (edges.cut_y >> bit) & 1 ? 0.0f : dxy.y);
             }
+        }
+    };
+    const auto border = [&](const int x, const int y) {
+        const bool mask_val = inside(x, y);
+        glm::vec2 dxy = mask_val ? source.dxy.data[getImageOffset(source.dxy, x - offset_x, y - offset_y)] : target.dxy.data[getImageOffset(target.dxy, x, y)];
+        if ((x > 0 && inside(x - 1, y) != mask_val) || (x < width - 1 && inside(x + 1, y) != mask_val)) {
+            dxy.x = 0.0f;
+        }
+        if ((y > 0 && inside(x, y - 1) != mask_val) || (y < height - 1 && inside(x, y + 1) != mask_val)) {
+            dxy.y = 0.0f;
+        }
+        result.dxy.data[getImageOffset(result.dxy, x, y)] = dxy;
+    };
+    forEachStencilPixel(width, height, StencilReach { 1, 1, 1, 1 }, interior, border);
+    return result;
+}
 
-            // Sum partial derivatives for divergence.
-            div_G.data[getImageOffset(div_G, x, y)] = div_x + div_y;
+/// <summary>
+/// getDivergence() of interleaved gradients, the same sums in the same order.
+/// </summary>
+/// <param name="gradients">gradients</param>
+/// <returns>div G</returns>
+ImageFloat getDivergence(const ImageGradientInterleaved& gradients)
+{
+    auto div_G = ImageFloat(gradients.dxy.width + 1, gradients.dxy.height + 1);
+
+    const auto interior = [&](const int y, const int x0, const int x1) {
+        const glm::vec2* dxy = gradients.dxy.data.data() + getImageOffset(gradients.dxy, 0, y);
+        const glm::vec2* dxy_above = dxy - gradients.dxy.width;
+        float* out = div_G.data.data() + getImageOffset(div_G, 0, y);
+#pragma omp simd
+        for (int x = x0; x < x1; ++x) {
+            out[x] = (dxy[x].x - dxy[x - 1].x) + (dxy[x].y - dxy_above[x].y);
+        }
+    };
+    const auto border = [&](const int x, const int y) {
+        const glm::vec2 dxy = gradients.dxy.data[getImageOffset(gradients.dxy, x, y)];
+        float div_x = dxy.x;
+        if (x > 0) {
+            div_x -= gradients.dxy.data[getImageOffset(gradients.dxy, x - 1, y)].x;
+        }
+        float div_y = dxy.y;
+        if (y > 0) {
+            div_y -= gradients.dxy.data[getImageOffset(gradients.dxy, x, y - 1)].y;
+        }
+        div_G.data[getImageOffset(div_G, x, y)] = div_x + div_y;
+    };
+    forEachStencilPixel(gradients.dxy.width, gradients.dxy.height, StencilReach { 1, 1, 0, 0 }, interior, border);
+
+    return div_G;
+}
+
+/// <summary>
+/// getGradients() of P pixels with dx and dy stored as S. The differences are computed in Acc
+/// and converted once: fp32 differences of fp32 pixels are rounded to S, integer differences of
+/// integer pixels are exact (8-bit pixels differ by 9 bits, which int16_t stores).
+/// </summary>
+/// <param name="image">input scalar image</param>
+/// <returns>grad image, 1px bigger than the input</returns>
+template <typename S, typename Acc, typename P>
+ImageGradientStorage<S> getGradientsWith(const ImageView<const P> image)
+{
+    // Zero-initialized, the last row and column are the over-the-boundary gradients.
+    auto grad = ImageGradientStorage<S> { Image<S>(image.width + 1, image.height + 1), Image<S>(image.width + 1, image.height + 1) };
+
+#pragma omp parallel num_threads(kernelThreads(image, KernelCost::Light))
+    {
+        std::vector<Acc> dx(static_cast<size_t>(image.width)), dy(static_cast<size_t>(image.width));
+#pragma omp for
+        for (int y = 0; y < image.height; ++y) {
+            const P* current = image.row(y);
+            for (int x = 0; x + 1 < image.width; ++x) {
+                dx[x] = Acc(current[x + 1]) - Acc(current[x]);
+            }
+            dx[image.width - 1] = Acc {};
+            if (y + 1 < image.height) {
+                const P* next = image.row(y + 1);
+                for (int x = 0; x < image.width; ++x) {
+                    dy[x] = Acc(next[x]) - Acc(current[x]);
+                }
+            } else {
+                std::fill(dy.begin(), dy.end(), Acc {});
+            }
+            storeRow(dx.data(), grad.dx.view().row(y), image.width);
+            storeRow(dy.data(), grad.dy.view().row(y), image.width);
         }
     }
+    return grad;
+}
+
+/// <summary>
+/// getGradients() with dx and dy stored as S (half or bfloat16 to halve the gradient traffic).
+/// The differences are computed in fp32 from the fp32 input and rounded once.
+/// </summary>
+/// <param name="image">input scalar image</param>
+/// <returns>grad image, 1px bigger than the input</returns>
+template <typename S>
+ImageGradientStorage<S> getGradientsAs(const ImageView<const float> image)
+{
+    return getGradientsWith<S, float>(image);
+}
 
+/// <summary>
+/// getGradients() of an 8-bit plane in the units of its levels, exact in int16_t storage.
+/// </summary>
+template <typename S>
+ImageGradientStorage<S> getGradientsAs(const ImageView<const uint8_t> image)
+{
+    return getGradientsWith<S, int>(image);
+}
+
+/// <summary>
+/// getGradients() of a 16-bit plane in the units of its levels, exact in int32_t storage.
+/// </summary>
+template <typename S>
+ImageGradientStorage<S> getGradientsAs(const ImageView<const uint16_t> image)
+{
+    return getGradientsWith<S, int>(image);
+}
+
+/// <summary>
+/// copySourceGradientsToTarget() for gradients in S storage (same placement offset). Gradients
+/// are selected, never recomputed, so the stored values are copied as they are.
+/// </summary>
+template <typename S>
+ImageGradientStorage<S> copySourceGradientsToTarget(const ImageGradientStorage<S>& source, const ImageGradientStorage<S>& target, const BinaryMask& source_mask,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    auto result = ImageGradientStorage<S> { Image<S>(target.dx.width, target.dx.height), Image<S>(target.dx.width, target.dx.height) };
+    const int width = target.dx.width - 1;
+    const int height = target.dx.height - 1;
+    const PlacedMask inside { source_mask, offset_x, offset_y };
+
+#pragma omp parallel for num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const bool mask_val = inside(x, y);
+            const int gradOffset = getImageOffset(result.dx, x, y);
+            if (mask_val) {
+                const int sourceOffset = getImageOffset(source.dx, x - offset_x, y - offset_y);
+                result.dx.data[gradOffset] = source.dx.data[sourceOffset];
+                result.dy.data[gradOffset] = source.dy.data[sourceOffset];
+            } else {
+                result.dx.data[gradOffset] = target.dx.data[gradOffset];
+                result.dy.data[gradOffset] = target.dy.data[gradOffset];
+            }
+
+            // Gradients crossing the mask boundary are zero.
+            if ((x > 0 && inside(x - 1, y) != mask_val) || (x < width - 1 && inside(x + 1, y) != mask_val)) {
+                result.dx.data[gradOffset] = S {};
+            }
+            if ((y > 0 && inside(x, y - 1) != mask_val) || (y < height - 1 && inside(x, y + 1) != mask_val)) {
+                result.dy.data[gradOffset] = S {};
+            }
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// getDivergence() of gradients in S storage. Rows are widened to fp32 and the divergence is
+/// accumulated and returned in fp32, as solvePoisson() expects.
+/// </summary>
+/// <param name="gradients">gradients</param>
+/// <returns>div G</returns>
+template <typename S>
+ImageFloat getDivergence(const ImageGradientStorage<S>& gradients)
+{
+    const int width = gradients.dx.width, height = gradients.dx.height;
+    auto div_G = ImageFloat(width + 1, height + 1);
+
+#pragma omp parallel num_threads(kernelThreads(int64_t(width) * height, KernelCost::Light))
+    {
+        std::vector<float> dx(static_cast<size_t>(width)), dy(static_cast<size_t>(width)), dy_above(static_cast<size_t>(width));
+#pragma omp for
+        for (int y = 0; y < height; ++y) {
+            loadRow(gradients.dx.view().row(y), dx.data(), width);
+            loadRow(gradients.dy.view().row(y), dy.data(), width);
+            if (y > 0) {
+                loadRow(gradients.dy.view().row(y - 1), dy_above.data(), width);
+            } else {
+                std::fill(dy_above.begin(), dy_above.end(), 0.0f);
+            }
+            float* out = div_G.view().row(y);
+            for (int x = 0; x < width; ++x) {
+                const float div_x = x > 0 ? dx[x] - dx[x - 1] : dx[x];
+                out[x] = div_x + (dy[x] - dy_above[x]);
+            }
+        }
+    }
     return div_G;
 }
 
 
+/// <summary>
+/// Iteration schemes of solvePoisson().
+/// </summary>
+enum class PoissonMethod {
+    // Double-buffered Jacobi iteration.
+    Jacobi,
+    // In-place red-black successive over-relaxation, a single solution buffer.
+    RedBlackSor,
+    // Jacobi with temporal blocking (see poisson_blocked.h), bit-identical to Jacobi.
+    BlockedJacobi,
+    // Jacobi and SOR sweeps in half storage with fp32 refinement steps (see poisson_mixed.h).
+    MixedJacobi,
+    MixedSor,
+};
+
 /// <summary>
 /// Solves poisson equation in form grad^2 I = div G.
 /// </summary>
 /// <param name="initial_solution">initial solution</param>
 /// <param name="divergence_G">div G</param>
 /// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="control">convergence monitoring, early termination, deadline, cancellation and progress output</param>
 /// <returns>luminance I</returns>
-ImageFloat solvePoisson(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters = 2000)
+ImageFloat solvePoisson(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const float omega = 0.0f, const PoissonControl& control = {})
 {
+    // Pixel updates, so MPix/s is the update rate.
+    const ScopedStage stage("solvePoisson", uint64_t(initial_solution.data.size()) * uint64_t(std::max(num_iters, 0)));
+    const auto start_time = std::chrono::steady_clock::now();
+    auto progress = PoissonProgress { 0, num_iters };
+    // Last reported iteration, a measurement is not reported again by the periodic report.
+    int reported = -1;
+    const auto report_at = [&](const int iterations) {
+        if (reported != iterations) {
+            reported = iterations;
+            progress.iteration = iterations;
+            control.report(progress);
+        }
+    };
+    if (control.stats) {
+        control.stats->update_history.clear();
+    }
+    // Records a measured update, true when the solve has converged.
+    const auto record = [&](const int iterations, const float max_update) {
+        progress.max_update = max_update;
+        if (control.stats) {
+            control.stats->update_history.push_back(max_update);
+        }
+        report_at(iterations);
+        return max_update <= control.tolerance;
+    };
+    // Set when the deadline stopped the iterations.
+    bool deadline_reached = false;
+    const auto finish = [&](const int iterations, const ImageFloat& I) {
+        control.throwIfCancelled();
+        if (control.stats) {
+            control.stats->iterations = iterations;
+            control.stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            control.stats->deadline_reached = deadline_reached;
+            if (control.hasDeadline()) {
+                const double initial_norm2 = poissonResidualNorm2(initial_solution, divergence_G);
+                control.stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(poissonResidualNorm2(I, divergence_G) / initial_norm2)) : 0.0f;
+            }
+        }
+    };
+
+    if (method == PoissonMethod::BlockedJacobi) {
+        // Iterations are fused into blocks, updates are not measured and the deadline is not checked.
+        auto I = solvePoissonJacobiBlocked(initial_solution, divergence_G, num_iters, currentKernelTuning().jacobi_block_iters, 0, control);
+        finish(num_iters, I);
+        return I;
+    }
+    if (method == PoissonMethod::MixedJacobi || method == PoissonMethod::MixedSor) {
+        // Updates are not measured, the refinement steps compute the residual instead. No deadline.
+        const auto smoother = method == PoissonMethod::MixedSor ? MixedPoissonSmoother::RedBlackSor : MixedPoissonSmoother::Jacobi;
+        auto I = solvePoissonMixed(initial_solution, divergence_G, num_iters, smoother, PoissonStorage::Half, omega);
+        finish(num_iters, I);
+        return I;
+    }
+    if (method == PoissonMethod::RedBlackSor) {
+        auto I = initial_solution.clone();
+        const float relaxation = omega > 0.0f ? omega : computeOptimalSorOmega(I.width, I.height);
+        std::ostringstream method_name;
+        method_name << "SOR, omega " << relaxation;
+        const auto method_text = method_name.str();
+        progress.method = method_text;
+        // Sweep in chunks that end on the next report or measurement.
+        int iter = 0;
+        while (iter < num_iters) {
+            if (control.reports(iter)) {
+                report_at(iter);
+            }
+            int chunk = num_iters - iter;
+            if (control.report_every > 0) {
+                chunk = std::min(chunk, control.report_every - iter % control.report_every);
+            }
+            if (control.check_every > 0) {
+                chunk = std::min(chunk, control.check_every - iter % control.check_every);
+            }
+            const bool check = control.checks(iter + chunk - 1);
+            float max_update = 0.0f;
+            if (control.hasDeadline()) {
+                chunk = 1;
+            } else if (control.job) {
+                chunk = std::min(chunk, POISSON_CANCEL_SWEEPS);
+            }
+            smoothPoissonRedBlack(I, divergence_G, chunk, relaxation, check ? &max_update : nullptr);
+            iter += chunk;
+            if (check && record(iter, max_update)) {
+                break;
+            }
+            if (control.stopRequested()) {
+                deadline_reached = iter < num_iters;
+                break;
+            }
+        }
+        finish(iter, I);
+        return I;
+    }
+
     // Initial solution guess.
-    auto I = ImageFloat(initial_solution);
+    auto I = initial_solution.clone();
 
     // Another solution for the alteranting updates.
-    auto I_next = ImageFloat(I.width, I.height);
-
-    // Parallelization
-    #pragma omp parallel for
-    // Iterative solver.
-    for (auto iter = 0; iter < num_iters; iter++)
+    // The border is never updated, so both buffers start with the Dirichlet values in place.
+    auto I_next = initial_solution.clone();
+
+    // The buffers are swapped through pointers shared by all threads.
+    ImageFloat* current = &I;
+    ImageFloat* next = &I_next;
+    const auto interior = StencilInterior(I.width, I.height, StencilReach { 1, 1, 1, 1 });
+
+    // Shared by all threads, written only between the barriers of an iteration.
+    float max_update = 0.0f;
+    bool converged = false;
+    int iterations = num_iters;
+
+    // One parallel region for the whole solve. Every iteration is a row-partitioned sweep
+    // followed by a barrier, so the result does not depend on the number of threads.
+#pragma omp parallel num_threads(kernelThreads(initial_solution, KernelCost::Light))
     {
-        if (iter % 500 == 0) {
-            // Print progress info every 500 iteartions.
-            std::cout << "[" << iter << "/" << num_iters << "] Solving Poisson equation..." << std::endl;
+        // Iterative solver.
+        for (auto iter = 0; iter < num_iters && !converged; iter++) {
+#pragma omp master
+            if (control.reports(iter)) {
+                // Print progress info every 500 iteartions.
+                report_at(iter);
+            }
+
+            const auto& src = *current;
+            auto& dst = *next;
+            const bool check = control.checks(iter);
+
+            // The border is the Dirichlet condition and is never written.
+            const auto keep_border = [](const int, const int) {};
+
+            if (check) {
+#pragma omp for schedule(static) reduction(max : max_update)
+                for (int y = 1; y < src.height - 1; ++y) {
+                    forEachStencilRow(y, src.width, interior, [&](const int row_y, const int x0, const int x1) {
+                        const float* row = src.data.data() + getImageOffset(src, 0, row_y);
+                        const float* up = row - src.width;
+                        const float* down = row + src.width;
+                        const float* div = divergence_G.data.data() + getImageOffset(divergence_G, 0, row_y);
+                        float* out = dst.data.data() + getImageOffset(dst, 0, row_y);
+                        float largest = 0.0f;
+#pragma omp simd reduction(max : largest)
+                        for (int x = x0; x < x1; ++x) {
+                            // Apply the update rule
+                            out[x] = 0.25f * (row[x + 1] + row[x - 1] + down[x] + up[x] - div[x]);
+                            largest = std::max(largest, std::abs(out[x] - row[x]));
+                        }
+                        max_update = std::max(max_update, largest);
+                    }, keep_border);
+                }
+            } else {
+                // Interior: all four neighbors exist.
+                const auto update = [&](const int y, const int x0, const int x1) {
+                    const float* row = src.data.data() + getImageOffset(src, 0, y);
+                    const float* up = row - src.width;
+                    const float* down = row + src.width;
+                    const float* div = divergence_G.data.data() + getImageOffset(divergence_G, 0, y);
+                    float* out = dst.data.data() + getImageOffset(dst, 0, y);
+#pragma omp simd
+                    for (int x = x0; x < x1; ++x) {
+                        // Apply the update rule
+                        out[x] = 0.25f * (row[x + 1] + row[x - 1] + down[x] + up[x] - div[x]);
+                    }
+                };
+
+#pragma omp for schedule(static)
+                for (int y = 1; y < src.height - 1; ++y) {
+                    forEachStencilRow(y, src.width, interior, update, keep_border);
+                }
+            }
+            // Implicit barrier: the sweep is complete before the buffers are swapped.
+
+            // Swap the current and next solution so that the next iteration
+            // uses the new solution as input and the previous solution as output.
+#pragma omp single
+            {
+                std::swap(current, next);
+                if (check) {
+                    if (record(iter + 1, max_update)) {
+                        converged = true;
+                        iterations = iter + 1;
+                    }
+                    max_update = 0.0f;
+                }
+                if (!converged && iter + 1 < num_iters && control.stopRequested()) {
+                    converged = true;
+                    deadline_reached = true;
+                    iterations = iter + 1;
+                }
+            }
+            // Implicit barrier: every thread sees the swapped pointers and the convergence flag.
         }
+    }
+    finish(iterations, *current);
 
+    // After the last "swap", current points to the latest solution.
+    return std::move(*current);
+}
 
-        for (int y = 0; y < I.height; ++y) {
-            for (int x = 0; x < I.width; ++x) {
+/// <summary>
+/// solvePoisson() warm-started coarse to fine (see poisson_pyramid.h): the correction of the
+/// initial solution is solved at 1/4 and 1/2 of the resolution first, each result upsampled as the
+/// next initial guess, so the full resolution needs a fraction of the iterations of a cold start.
+/// </summary>
+/// <param name="initial_solution">initial solution</param>
+/// <param name="divergence_G">div G</param>
+/// <param name="num_iters">iterations on the full resolution</param>
+/// <param name="method">iteration scheme of every level</param>
+/// <param name="levels">number of coarse levels</param>
+/// <param name="coarse_iters">iterations per coarse level</param>
+/// <returns>luminance I</returns>
+ImageFloat solvePoissonPyramid(const ImageFloat& initial_solution, const ImageFloat& divergence_G, const int num_iters = 200,
+    const PoissonMethod method = PoissonMethod::Jacobi, const int levels = 2, const int coarse_iters = 500)
+{
+    return solvePoissonCoarseToFine(initial_solution, divergence_G, levels, coarse_iters, num_iters,
+        [&](const ImageFloat& guess, const ImageFloat& rhs, const int iters) { return solvePoisson(guess, rhs, iters, method); });
+}
 
-            // Boundary handling
-            if (x == 0 || y == 0 || x == I.width - 1 || y == I.height - 1) {
-                I_next.data[getImageOffset(I, x, y)] = I.data[getImageOffset(I, x, y)];
-                continue;
+/// <summary>
+/// Solves the three XYZ systems grad^2 I = div G together. Every row sweep updates the X, Y and Z
+/// rows, so the three channels share one traversal of the grid, one boundary test and one barrier
+/// per iteration instead of three solves in sequence. The per-channel arithmetic is that of
+/// solvePoisson(), the results are identical.
+/// </summary>
+/// <param name="initial_solution">initial solution per channel</param>
+/// <param name="divergence_G">div G per channel</param>
+/// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="omega">SOR relaxation factor, values <= 0 select the optimal one for the image size</param>
+/// <param name="control">deadline, cancellation, statistics and progress output of the Jacobi and SOR sweeps</param>
+/// <returns>luminance I per channel</returns>
+ImageXYZ solvePoissonPlanes(const ImageXYZ& initial_solution, const ImageXYZ& divergence_G, const int num_iters = 2000,
+    const PoissonMethod method = PoissonMethod::Jacobi, const float omega = 0.0f, const PoissonControl& control = {})
+{
+    // Pixel updates of all three planes.
+    const ScopedStage stage("solvePoissonPlanes", 3 * uint64_t(initial_solution.X.data.size()) * uint64_t(std::max(num_iters, 0)));
+    const int w = initial_solution.X.width;
+    const int h = initial_solution.X.height;
+    const int fw = divergence_G.X.width;
+    forEachPlane([&](const ImageFloat& solution, const ImageFloat& divergence) {
+        assert(solution.width == w && solution.height == h && divergence.width == fw);
+    }, initial_solution, divergence_G);
+    const auto start_time = std::chrono::steady_clock::now();
+    // Iterations run, fewer than num_iters when the deadline stopped them.
+    int iterations = num_iters;
+    bool deadline_reached = false;
+    const auto finish = [&](const ImageXYZ& I) {
+        control.throwIfCancelled();
+        if (control.stats) {
+            control.stats->iterations = iterations;
+            control.stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            control.stats->deadline_reached = deadline_reached;
+            if (control.hasDeadline()) {
+                double initial_norm2 = 0.0, norm2 = 0.0;
+                forEachPlane([&](const ImageFloat& initial, const ImageFloat& solution, const ImageFloat& divergence) {
+                    initial_norm2 += poissonResidualNorm2(initial, divergence);
+                    norm2 += poissonResidualNorm2(solution, divergence);
+                }, initial_solution, I, divergence_G);
+                control.stats->relative_residual = initial_norm2 > 0.0 ? float(std::sqrt(norm2 / initial_norm2)) : 0.0f;
             }
+        }
+    };
 
-            // Apply the update rule
-            float new_value = 0.25f * (I.data[getImageOffset(I, x + 1, y)] + I.data[getImageOffset(I, x - 1, y)] + I.data[getImageOffset(I, x, y + 1)] + I.data[getImageOffset(I, x, y - 1)] - divergence_G.data[getImageOffset(divergence_G, x, y)]);
-
-            I_next.data[getImageOffset(I, x, y)] = new_value;
+    if (method == PoissonMethod::BlockedJacobi || method == PoissonMethod::MixedJacobi || method == PoissonMethod::MixedSor) {
+        // The blocked and mixed solvers keep one plane in cache at a time.
+        return mapPlanes([&](const ImageFloat& solution, const ImageFloat& divergence) { return solvePoisson(solution, divergence, num_iters, method, omega); }, initial_solution, divergence_G);
+    }
+    if (method == PoissonMethod::RedBlackSor) {
+        auto I = initial_solution;
+        const float relaxation = omega > 0.0f ? omega : computeOptimalSorOmega(w, h);
+        std::ostringstream method_name;
+        method_name << "XYZ, SOR, omega " << relaxation;
+        const auto method_text = method_name.str();
+#pragma omp parallel num_threads(kernelThreads(int64_t(w) * h, KernelCost::Light))
+        {
+            for (auto iter = 0; iter < num_iters && !deadline_reached; iter++) {
+#pragma omp master
+                if (control.reports(iter)) {
+                    control.report({ iter, num_iters, std::numeric_limits<float>::quiet_NaN(), method_text });
+                }
+                for (int color = 0; color < 2; color++) {
+#pragma omp for schedule(static)
+                    for (int y = 1; y < h - 1; y++) {
+                        forEachPlane([&](ImageFloat& u_plane, const ImageFloat& f_plane) {
+                            float* u = u_plane.data.data() + size_t(y) * size_t(w);
+                            const float* f = f_plane.data.data() + size_t(y) * size_t(fw);
+                            // Same update as smoothPoissonRedBlack().
+                            for (int x = 1 + ((y + 1 + color) & 1); x < w - 1; x += 2) {
+                                const float gs = 0.25f * (u[x - 1] + u[x + 1] + u[x - w] + u[x + w] - f[x]);
+                                u[x] += relaxation * (gs - u[x]);
+                            }
+                        }, I, divergence_G);
+                    }
+                    // Implicit barrier: a color is complete before the other one reads it.
+                }
+#pragma omp single
+                if (iter + 1 < num_iters && control.stopRequested()) {
+                    deadline_reached = true;
+                    iterations = iter + 1;
+                }
+                // Implicit barrier: every thread sees the deadline flag.
             }
         }
+        finish(I);
+        return I;
+    }
+
+    // Double-buffered Jacobi on all planes, the border keeps the Dirichlet values in both buffers.
+    auto I = initial_solution;
+    auto I_next = initial_solution;
+    ImageXYZ* current = &I;
+    ImageXYZ* next = &I_next;
+
+#pragma omp parallel num_threads(kernelThreads(initial_solution.X, KernelCost::Light))
+    {
+        for (auto iter = 0; iter < num_iters && !deadline_reached; iter++) {
+#pragma omp master
+            if (control.reports(iter)) {
+                control.report({ iter, num_iters, std::numeric_limits<float>::quiet_NaN(), "XYZ" });
+            }
+
+#pragma omp for schedule(static)
+            for (int y = 1; y < h - 1; ++y) {
+                forEachPlane([&](const ImageFloat& src_plane, ImageFloat& dst_plane, const ImageFloat& f_plane) {
+                    const float* src = src_plane.data.data() + size_t(y) * size_t(w);
+                    float* dst = dst_plane.data.data() + size_t(y) * size_t(w);
+                    const float* f = f_plane.data.data() + size_t(y) * size_t(fw);
+                    // Same update (and summation order) as solvePoisson().
+                    for (int x = 1; x < w - 1; ++x) {
+                        dst[x] = 0.25f * (src[x + 1] + src[x - 1] + src[x + w] + src[x - w] - f[x]);
+                    }
+                }, std::as_const(*current), *next, divergence_G);
+            }
 
-        // Swap the current and next solution so that the next iteration
-        // uses the new solution as input and the previous solution as output.
-        std::swap(I, I_next);
+#pragma omp single
+            {
+                std::swap(current, next);
+                if (iter + 1 < num_iters && control.stopRequested()) {
+                    deadline_reached = true;
+                    iterations = iter + 1;
+                }
+            }
+            // Implicit barrier: every thread sees the swapped pointers and the deadline flag.
+        }
     }
+    finish(*current);
 
-    // After the last "swap", I is the latest solution.
-    return I;
+    return std::move(*current);
 }
 
 
 #pragma endregion Poisson editing
 
+
+#pragma region Gradient-domain TMO
+
+
+/// <summary>
+/// Gradient-domain HDR compression (see gradient_compression.h): the log-luminance gradients are
+/// attenuated, the log-luminance is reconstructed from them with a Neumann border, shifted so
+/// that its maximum maps to output_gain, and the color is rescaled like toneMapLocalLaplacian().
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters (gradient_alpha, gradient_beta, gradient_solver, output_gain, saturation, math_precision)</param>
+/// <param name="stats">optional output of the solver iterations and final relative residual</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMapFattal(const ImageRGB& hdr_image, const DurandParams& params = {}, PoissonStats* stats = nullptr)
+{
+    const int width = hdr_image.width, height = hdr_image.height;
+    const auto log_lum_H = durandLogLuminance(hdr_image, params);
+    auto gradients = getGradients(log_lum_H);
+    {
+        const ScopedStage stage("gradientAttenuation", log_lum_H.data.size());
+        attenuateGradients(gradients, gradientAttenuation(log_lum_H, params.gradient_alpha, params.gradient_beta));
+    }
+    // A u = -div G; no difference crosses the image edge, which is the Neumann border.
+    auto rhs = cropPoissonRhs(getDivergence(gradients), width, height);
+#pragma omp parallel for simd num_threads(kernelThreads(rhs, KernelCost::Light))
+    for (int64_t i = 0; i < int64_t(rhs.data.size()); i++) {
+        rhs.data[i] = -rhs.data[i];
+    }
+    const auto tmo_log_lum = [&] {
+        const ScopedStage stage("solveStencil", log_lum_H.data.size());
+        StencilSolveOptions options;
+        options.method = params.gradient_solver;
+        options.tolerance = 1e-4f;
+        const bool multigrid = params.gradient_solver == StencilMethod::Multigrid || params.gradient_solver == StencilMethod::MultigridCG;
+        options.max_iters = multigrid ? 50 : 5000;
+        // The solution is defined up to a constant: one fixed pixel makes the operator definite on
+        // every multigrid level. From 0 rather than the input, whose large-scale contrast is the
+        // error to remove yet has a small residual, so the relative tolerance would stop too early.
+        BinaryMask anchor(width, height);
+        anchor.set(0, 0, true);
+        const auto laplacian = StencilOperator::laplacian(width, height, StencilBoundary::Neumann);
+        const StencilOperator op(laplacian.right(), laplacian.down(), nullptr, StencilBoundary::Neumann, &anchor);
+        return solveStencil(op, rhs, ImageFloat(width, height), options, stats);
+    }();
+
+    const auto num_pixels = int(hdr_image.data.size());
+    float max_log_lum = -std::numeric_limits<float>::infinity();
+#pragma omp parallel for reduction(max : max_log_lum) num_threads(kernelThreads(num_pixels, KernelCost::Light))
+    for (int i = 0; i < num_pixels; i++) {
+        max_log_lum = std::max(max_log_lum, tmo_log_lum.data[i]);
+    }
+    auto result = ImageRGB::uninitialized(width, height);
+    dispatchMathPrecision(params.math_precision, [&](auto tier) {
+#pragma omp parallel for num_threads(kernelThreads(num_pixels, KernelCost::Medium))
+        for (int i = 0; i < num_pixels; i++) {
+            const auto val = hdr_image.data[i];
+            const float tmo_luminance = tmoExp<decltype(tier)::value>(tmo_log_lum.data[i] - max_log_lum) * params.output_gain;
+            result.data[i] = rescaleRgbByLuminancePixel<decltype(tier)::value>(val, rgbToLuminancePixel(val), tmo_luminance, params.saturation);
+        }
+    });
+    return result;
+}
+
+/// <summary>
+/// Tone maps an image with the operator selected by params.tone_operator and grades it with
+/// params.look.
+/// </summary>
+/// <param name="hdr_image">linear HDR RGB image</param>
+/// <param name="params">tone-mapping parameters</param>
+/// <returns>tone-mapped RGB in [0,1]</returns>
+ImageRGB toneMap(const ImageRGB& hdr_image, const DurandParams& params = {})
+{
+    ImageRGB result;
+    switch (params.tone_operator) {
+    case ToneMapOperator::LocalLaplacian:
+        result = toneMapLocalLaplacian(hdr_image, params);
+        break;
+    case ToneMapOperator::Reinhard:
+    case ToneMapOperator::Filmic:
+        result = toneMapGlobal(hdr_image, params);
+        break;
+    case ToneMapOperator::Fattal:
+        result = toneMapFattal(hdr_image, params);
+        break;
+    case ToneMapOperator::Durand:
+    default:
+        result = toneMapDurand(hdr_image, params);
+        break;
+    }
+    applyLook(result, params.look);
+    return result;
+}
+
+
+#pragma endregion Gradient-domain TMO
+
 // Below are pre-implemented parts of the code.
 
 #pragma region Functions applying per-channel operation to all planes of an XYZ image
@@ -529,28 +2121,22 @@ ImageFloat solvePoisson(const ImageFloat& initial_solution, const ImageFloat& di
 /// A helper function computing X and Y gradients of an XYZ image by calling getGradient() to each channel.
 /// </summary>
 /// <param name="image">XYZ image.</param>
+/// <param name="context">thread split between the channels and their kernels</param>
 /// <returns>Grad per channel.</returns>
-ImageXYZGradient getGradientsXYZ(const ImageXYZ& image)
+ImageXYZGradient getGradientsXYZ(const ImageXYZ& image, const ExecutionContext& context = {})
 {
-    return {
-        getGradients(image.X),
-        getGradients(image.Y),
-        getGradients(image.Z),
-    };
+    return mapPlanes(context, [](const ImageFloat& plane) { return getGradients(plane); }, image);
 }
 
 /// <summary>
 /// A helper function computing divergence of an XYZ gradient image by calling getDivergence() to each channel.
 /// </summary>
 /// <param name="grad_xyz">gradients of XYZ</param>
+/// <param name="context">thread split between the channels and their kernels</param>
 /// <returns>div G</returns>
-ImageXYZ getDivergenceXYZ(ImageXYZGradient& grad_xyz)
+ImageXYZ getDivergenceXYZ(ImageXYZGradient& grad_xyz, const ExecutionContext& context = {})
 {
-    return {
-        getDivergence(grad_xyz.X),
-        getDivergence(grad_xyz.Y),
-        getDivergence(grad_xyz.Z),
-    };
+    return mapPlanes(context, [](auto& gradients) { return getDivergence(gradients); }, grad_xyz);
 }
 
 /// <summary>
@@ -559,14 +2145,42 @@ ImageXYZ getDivergenceXYZ(ImageXYZGradient& grad_xyz)
 /// <param name="source">source</param>
 /// <param name="target">target</param>
 /// <param name="source_mask">target</param>
+/// <param name="context">thread split between the channels and their kernels</param>
 /// <returns>gradient</returns>
-ImageXYZGradient copySourceGradientsToTargetXYZ(const ImageXYZGradient& source, const ImageXYZGradient& target, const ImageFloat& source_mask)
+ImageXYZGradient copySourceGradientsToTargetXYZ(const ImageXYZGradient& source, const ImageXYZGradient& target, const BinaryMask& source_mask, const int offset_x = 0, const int offset_y = 0,
+    const ExecutionContext& context = {})
 {
-    return {
-        copySourceGradientsToTarget(source.X, target.X, source_mask),
-        copySourceGradientsToTarget(source.Y, target.Y, source_mask),
-        copySourceGradientsToTarget(source.Z, target.Z, source_mask),
-    };
+    return mapPlanes(context, [&](const auto& source_plane, const auto& target_plane) { return copySourceGradientsToTarget(source_plane, target_plane, source_mask, offset_x, offset_y); }, source, target);
+}
+
+/// <summary>
+/// getGradientsXYZ() with the gradients stored as S.
+/// </summary>
+/// <param name="image">XYZ image.</param>
+/// <returns>Grad per channel.</returns>
+template <typename S>
+ImagePlane3<ImageGradientStorage<S>> getGradientsXYZAs(const ImageXYZ& image)
+{
+    return mapPlanes([](const ImageFloat& plane) { return getGradientsAs<S>(plane); }, image);
+}
+
+/// <summary>
+/// getDivergenceXYZ() of gradients stored as S, the divergence is fp32.
+/// </summary>
+template <typename S>
+ImageXYZ getDivergenceXYZ(const ImagePlane3<ImageGradientStorage<S>>& grad_xyz)
+{
+    return mapPlanes([](auto& gradients) { return getDivergence(gradients); }, grad_xyz);
+}
+
+/// <summary>
+/// copySourceGradientsToTargetXYZ() for gradients stored as S.
+/// </summary>
+template <typename S>
+ImagePlane3<ImageGradientStorage<S>> copySourceGradientsToTargetXYZ(const ImagePlane3<ImageGradientStorage<S>>& source, const ImagePlane3<ImageGradientStorage<S>>& target, const BinaryMask& source_mask,
+    const int offset_x = 0, const int offset_y = 0)
+{
+    return mapPlanes([&](const auto& source_plane, const auto& target_plane) { return copySourceGradientsToTarget(source_plane, target_plane, source_mask, offset_x, offset_y); }, source, target);
 }
 
 /// <summary>
@@ -574,21 +2188,166 @@ ImageXYZGradient copySourceGradientsToTargetXYZ(const ImageXYZGradient& source,
 /// </summary>
 /// <param name="divergence_G">div G</param>
 /// <param name="num_iters">number of iterations</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="context">thread split between the channels and their kernels</param>
 /// <returns>luminance I</returns>
-ImageXYZ solvePoissonXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 2000)
+ImageXYZ solvePoissonXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 2000, const PoissonMethod method = PoissonMethod::Jacobi,
+    const ExecutionContext& context = {})
 {
-    return {
-        solvePoisson(targetXYZ.X, divergenceXYZ_G.X, num_iters),
-        solvePoisson(targetXYZ.Y, divergenceXYZ_G.Y, num_iters),
-        solvePoisson(targetXYZ.Z, divergenceXYZ_G.Z, num_iters),
-    };
+    if (context.concurrent_items > 1) {
+        // One solve per channel, the channels at once.
+        return mapPlanes(context, [&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoisson(target, divergence, num_iters, method); }, targetXYZ, divergenceXYZ_G);
+    }
+    // All channels in one solve, see solvePoissonPlanes().
+    return solvePoissonPlanes(targetXYZ, divergenceXYZ_G, num_iters, method);
 }
 
 
+/// <summary>
+/// solvePoissonPyramid() for each channel.
+/// </summary>
+/// <param name="targetXYZ">initial solution</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="num_iters">iterations on the full resolution</param>
+/// <param name="method">iteration scheme of every level</param>
+/// <param name="context">thread split between the channels and their kernels</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonPyramidXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 200, const PoissonMethod method = PoissonMethod::Jacobi,
+    const ExecutionContext& context = {})
+{
+    return mapPlanes(context, [&](const ImageFloat& target, const ImageFloat& divergence) { return solvePoissonPyramid(target, divergence, num_iters, method); }, targetXYZ, divergenceXYZ_G);
+}
+
+/// <summary>
+/// Handling of the X and Z channels by solvePoissonLuminanceXYZ().
+/// </summary>
+enum class PoissonChroma {
+    // Full solves, as solvePoissonXYZ().
+    Full,
+    // Solved at quarter size (half width and height) for num_iters / 2 iterations, then num_iters / 8 full-size iterations.
+    Coarse,
+    // No solve: the chromaticity (X / Y, Z / Y) of the composite applied to the solved Y.
+    Transfer,
+};
+
+/// <summary>
+/// X and Z of the given luminance with the chromaticity of the composite. Where the composite is
+/// black the D65 white point is used. The border keeps the values of the target.
+/// </summary>
+/// <param name="compositeXYZ">composite of the edit, e.g. pasteMaskedXYZ()</param>
+/// <param name="targetXYZ">target, provides the Dirichlet border</param>
+/// <param name="Y">solved luminance</param>
+/// <returns>XYZ result with the given Y</returns>
+ImageXYZ transferChromaXYZ(const ImageXYZ& compositeXYZ, const ImageXYZ& targetXYZ, ImageFloat Y)
+{
+    const int w = Y.width;
+    const int h = Y.height;
+    ImageXYZ result { ImageFloat::uninitialized(w, h), std::move(Y), ImageFloat::uninitialized(w, h) };
+#pragma omp parallel for num_threads(kernelThreads(result.Y, KernelCost::Light))
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const size_t i = size_t(y) * size_t(w) + size_t(x);
+            if (x == 0 || y == 0 || x == w - 1 || y == h - 1) {
+                result.X.data[i] = targetXYZ.X.data[i];
+                result.Z.data[i] = targetXYZ.Z.data[i];
+                continue;
+            }
+            const float composite_Y = compositeXYZ.Y.data[i];
+            const bool lit = composite_Y > 1e-8f;
+            result.X.data[i] = result.Y.data[i] * (lit ? compositeXYZ.X.data[i] / composite_Y : 0.95047f);
+            result.Z.data[i] = result.Y.data[i] * (lit ? compositeXYZ.Z.data[i] / composite_Y : 1.08883f);
+        }
+    }
+    return result;
+}
+
+/// <summary>
+/// Solves the Y system fully and X and Z as selected by chroma: most of the visible structure is
+/// in Y, and the chroma offsets of an edit are smooth, so a coarse solve (about a quarter of the
+/// work per channel) or no solve at all is often enough. The golden checks report the deviation
+/// from the full solve.
+/// </summary>
+/// <param name="targetXYZ">initial solution</param>
+/// <param name="divergenceXYZ_G">div G</param>
+/// <param name="num_iters">iterations of the Y solve</param>
+/// <param name="method">iteration scheme</param>
+/// <param name="chroma">handling of X and Z</param>
+/// <param name="compositeXYZ">composite of the edit, required by PoissonChroma::Transfer</param>
+/// <param name="context">thread split between the channels and their kernels</param>
+/// <returns>luminance I</returns>
+ImageXYZ solvePoissonLuminanceXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXYZ_G, const int num_iters = 2000, const PoissonMethod method = PoissonMethod::Jacobi,
+    const PoissonChroma chroma = PoissonChroma::Coarse, const ImageXYZ* compositeXYZ = nullptr, const ExecutionContext& context = {})
+{
+    if (chroma == PoissonChroma::Full) {
+        return solvePoissonXYZ(targetXYZ, divergenceXYZ_G, num_iters, method, context);
+    }
+    if (chroma == PoissonChroma::Transfer) {
+        if (!compositeXYZ) {
+            std::cerr << "The chroma transfer needs the composite of the edit." << std::endl;
+            throw std::exception();
+        }
+        return transferChromaXYZ(*compositeXYZ, targetXYZ, solvePoisson(targetXYZ.Y, divergenceXYZ_G.Y, num_iters, method));
+    }
+    // Y in full, X and Z coarse-to-fine with one coarse level.
+    const auto solve_chroma = [&](const ImageFloat& target, const ImageFloat& divergence) {
+        return solvePoissonCoarseToFine(target, divergence, 1, num_iters / 2, num_iters / 8,
+            [&](const ImageFloat& guess, const ImageFloat& rhs, const int iters) { return solvePoisson(guess, rhs, iters, method); });
+    };
+    ImageXYZ result;
+    runConcurrently(3, context, [&](const int plane) {
+        if (plane == 0) {
+            result.X = solve_chroma(targetXYZ.X, divergenceXYZ_G.X);
+        } else if (plane == 1) {
+            result.Y = solvePoisson(targetXYZ.Y, divergenceXYZ_G.Y, num_iters, method);
+        } else {
+            result.Z = solve_chroma(targetXYZ.Z, divergenceXYZ_G.Z);
+        }
+    });
+    return result;
+}
+
 #pragma endregion
 
 #pragma region Convenience functions
 
+/// <summary>
+/// Maps every channel of every pixel from [min, max] to [0, 1] into a caller-provided buffer of
+/// the same size, see normalizeRgbPixel(). result may be the image itself (in place).
+/// </summary>
+/// <param name="image">float or RGB image</param>
+/// <param name="min_max">min and max over all channels and pixels as (x, y)</param>
+/// <param name="result">output buffer</param>
+template <typename T>
+void normalizeImage(const ImageView<const T> image, const glm::vec2 min_max, const ImageView<T> result)
+{
+    assert(result.width == image.width && result.height == image.height);
+    // Division instead of a reciprocal, so the result equals normalizeRGBImage().
+    const float range = min_max.y - min_max.x;
+#pragma omp parallel for num_threads(kernelThreads(image, KernelCost::Light))
+    for (int y = 0; y < image.height; y++) {
+        const T* in = image.row(y);
+        T* out = result.row(y);
+#pragma omp simd
+        for (int x = 0; x < image.width; x++) {
+            out[x] = (in[x] - min_max.x) / range;
+        }
+    }
+}
+
+/// <summary>
+/// Fits a float or RGB image to the [0,1] range: one computeImageStats() reduction for the
+/// min/max, then one streaming pass.
+/// </summary>
+/// <param name="image">float or RGB image</param>
+/// <returns>normalized image</returns>
+template <typename T>
+Image<T> normalizeImage(const Image<T>& image)
+{
+    auto result = Image<T>::uninitialized(image.width, image.height);
+    normalizeImage<T>(image, computeImageStats<T>(image).minMax(), result);
+    return result;
+}
+
 /// <summary>
 /// Normalizes single channel image to 0..1 range.
 /// </summary>
@@ -596,7 +2355,7 @@ ImageXYZ solvePoissonXYZ(const ImageXYZ& targetXYZ, const ImageXYZ& divergenceXY
 /// <returns></returns>
 ImageFloat normalizeFloatImage(const ImageFloat& image)
 {
-    return imageRgbToFloat(normalizeRGBImage(imageFloatToRgb(image)));
+    return normalizeImage(image);
 }
 
 